@@ -18,6 +18,7 @@ NTL_CLIENT
 #include <cassert>
 #include <list>
 #include <sstream>
+#include <algorithm>
 
 #if (__cplusplus>199711L)
 #include <memory>
@@ -26,13 +27,22 @@ NTL_CLIENT
 #endif
 
 #include <NTL/vector.h>
+#include <NTL/BasicThreadPool.h>
 #include "NumbTh.h"
 #include "permutations.h"
-
+#include "taskScheduler.h"
+
+// Route one sub-network at recursion depth d, the one whose nodes are
+// delta_j..delta_j+sz-1: sets its edges at levels d and 2k-2-d, and returns
+// in upper[0..sz0-1] and lower[0..sz1-1] the permutations of its internal
+// networks (nothing is returned for d==k-1, where the recursion stops).
+// Sub-networks at the same depth touch disjoint entries of level, ilevel,
+// upper and lower, so they can be routed concurrently.
 static void 
-recursiveGeneralBenesInit(long n, long k, long d, long delta_j,
-                          const Permut& perm, const Permut& iperm,
-                          Vec< Vec<short> >& level, Vec< Vec<short> >& ilevel)
+routeGeneralBenes(long n, long k, long d, long delta_j,
+                  const Permut& perm, const Permut& iperm,
+                  Vec< Vec<short> >& level, Vec< Vec<short> >& ilevel,
+                  long* upper, long* lower)
 {
   long sz = perm.length();
 
@@ -238,20 +248,30 @@ recursiveGeneralBenesInit(long n, long k, long d, long delta_j,
     }
   }
 
-  // done constructing the external edges and internal permutations...
-  // time to recurse
+  // done constructing the external edges and internal permutations,
+  // the internal networks are routed at the next depth
+  for (long j = 0; j < sz0; j++) upper[j] = inner_perm[0][0][j];
+  for (long j = 0; j < sz1; j++) lower[j] = inner_perm[1][0][j];
+}
 
-  // recurse on upper internal network:
-  recursiveGeneralBenesInit(n, k, d+1, delta_j, 
-                            inner_perm[0][0], inner_perm[0][1], level, ilevel);
 
-  // recurse on lower intrernal network
-  recursiveGeneralBenesInit(n, k, d+1, delta_j + sz0, 
-                            inner_perm[1][0], inner_perm[1][1], level, ilevel);  
+GeneralBenesNetwork::GeneralBenesNetwork(const Permut& perm)
+{
+  build(perm, nullptr);
 }
 
+GeneralBenesNetwork::GeneralBenesNetwork(const Permut& perm,
+                                         const GeneralBenesNetwork& old)
+{
+  build(perm, (old.n == perm.length())? &old : nullptr);
+}
 
-GeneralBenesNetwork::GeneralBenesNetwork(const Permut& perm)
+// The sub-networks are routed one depth at a time, all those at the same
+// depth in parallel. Given an old network of the same size, the routes of
+// the sub-networks whose permutations did not change are kept from it,
+// together with all the sub-networks below them.
+void GeneralBenesNetwork::build(const Permut& perm,
+                                const GeneralBenesNetwork* old)
 {
   n = perm.length();
 
@@ -261,42 +281,84 @@ GeneralBenesNetwork::GeneralBenesNetwork(const Permut& perm)
   // compute recursion depth k = least integer k s/t 2^k >= n
   k = GeneralBenesNetwork::depth(n);
 
-  // construct the inverse perm, which is convenient in the recursive function.
-  // As a byproduct, verify that perm is indeed a permutation on {0,...,n-1}.
-
-  Permut iperm;
-  iperm.SetLength(n);
-
-  for (long j = 0; j < n; j++)
-    iperm[j] = -1;
-
+  // verify that perm is indeed a permutation on {0,...,n-1}
+  {Vec<bool> seen;
+  seen.SetLength(n);
+  for (long j = 0; j < n; j++) seen[j] = false;
   for (long j = 0; j < n; j++) {
     long j1 = perm[j];
-    assert(j1 >= 0 && j1 < n);
-    iperm[j1] = j;
+    assert(j1 >= 0 && j1 < n && !seen[j1]);
+    seen[j1] = true;
+  }}
+
+  // allocate space for the levels graph and the sub-permutations,
+  // starting from those of the old network if there is one
+  if (old != nullptr) {
+    level = old->level;
+    subPerms = old->subPerms;
   }
-
-
-  for (long j = 0; j < n; j++)
-    assert(iperm[j] != -1);
-
-  // allocate space for the levels graph
-
-  level.SetLength(2*k-1);
-  for (long i = 0; i < 2*k-1; i++)
-    level[i].SetLength(n);
+  else {
+    level.SetLength(2*k-1);
+    for (long i = 0; i < 2*k-1; i++)
+      level[i].SetLength(n);
+    subPerms.SetLength(k);
+    for (long d = 0; d < k; d++)
+      subPerms[d].SetLength(n);
+  }
+  subPerms[0] = perm;
 
   // allocate space for the reverse levels graph...
-  // makes the recursive construction more convenient
+  // makes the construction more convenient
 
   Vec< Vec<short> > ilevel;
   ilevel.SetLength(2*k-1);
   for (long i = 0; i < 2*k-1; i++)
     ilevel[i].SetLength(n);
 
-  // recursively construct the levels graph
-
-  recursiveGeneralBenesInit(n, k, 0, 0, perm, iperm, level, ilevel);
+  // The sub-networks (offset, size) to route at the current depth
+  vector< pair<long,long> > nets(1, make_pair(0L, n));
+  numRouted = 0;
+  for (long d = 0; d < k && !nets.empty(); d++) {
+    if (old != nullptr) { // drop the sub-networks that did not change
+      vector< pair<long,long> > changed;
+      for (auto& net: nets) {
+        const long* p0 = subPerms[d].elts() + net.first;
+        const long* p1 = old->subPerms[d].elts() + net.first;
+        if (!std::equal(p0, p0+net.second, p1)) changed.push_back(net);
+      }
+      nets.swap(changed);
+    }
+    long nNets = nets.size();
+    numRouted += nNets;
+
+    Vec<long>* inner = (d+1 < k)? &subPerms[d+1] : nullptr;
+    FHE_EXEC_RANGE(nNets, first, last)
+      Permut p, ip;
+      long dummy[2];
+      for (long t = first; t < last; t++) {
+        long delta_j = nets[t].first, sz = nets[t].second;
+        p.SetLength(sz);
+        ip.SetLength(sz);
+        for (long j = 0; j < sz; j++) {
+          p[j] = subPerms[d][delta_j+j];
+          ip[p[j]] = j;
+        }
+        long sz0 = (inner != nullptr)? shamt(n, k, d) : 0;
+        long* upper = (inner != nullptr)? inner->elts()+delta_j : dummy;
+        routeGeneralBenes(n, k, d, delta_j, p, ip, level, ilevel,
+                          upper, upper+sz0);
+      }
+    FHE_EXEC_RANGE_END
+
+    if (inner == nullptr) break; // the last depth
+    vector< pair<long,long> > next;
+    long sz0 = shamt(n, k, d);
+    for (auto& net: nets) {
+      next.push_back(make_pair(net.first, sz0));
+      next.push_back(make_pair(net.first+sz0, net.second-sz0));
+    }
+    nets.swap(next);
+  }
 }
 
 
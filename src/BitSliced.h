@@ -0,0 +1,173 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _BITSLICED_H_
+#define _BITSLICED_H_
+/**
+ * @file BitSliced.h
+ * @brief Owning containers for integers in bit-sliced representation.
+ *
+ * The wrappers in CtPtrs.h point into vectors that are owned by the
+ * caller, and every intermediate number of a circuit is a fresh vector of
+ * fresh ciphertexts. A BitSliced owns one pool of ciphertexts for all the
+ * bits of a number. Shrinking it keeps the ciphertexts in the pool, and
+ * growing it again reuses them (and their allocated DoubleCRT parts) before
+ * constructing new ones. Since it is a CtPtrs, all the routines of
+ * binaryArith, binaryCompare and tableLookup accept it as is. The class is
+ * final, so calls through a BitSliced& are not dispatched virtually, and
+ * bit(i) gives direct access to the ciphertexts.
+ **/
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <cassert>
+#include "CtPtrs.h"
+
+//! @brief An integer in bit-sliced representation that owns its bits.
+//! Pointers to the bits stay valid as long as the size of the number does
+//! not grow beyond its capacity.
+class BitSliced final : public CtPtrs {
+  std::vector<Ctxt> pool; // pool[0..sz-1] are the bits, the rest are spare
+  long sz;
+  std::unique_ptr<Ctxt> zero; // an empty ciphertext for new bits, if known
+
+public:
+  //! An empty number, with room for capacity bits like the template ct
+  explicit BitSliced(const Ctxt& ct, long capacity=0): sz(0)
+  { reserve(capacity, ct); }
+
+  //! A number with nBits bits, all initialized to empty ciphertexts
+  BitSliced(const Ctxt& ct, long nBits, long capacity): sz(0)
+  { reserve(std::max(nBits, capacity), ct); sz = nBits; }
+
+  //! A copy of the number v
+  explicit BitSliced(const CtPtrs& v): sz(0)
+  {
+    const Ctxt* pt = v.ptr2nonNull();
+    if (pt==nullptr && lsize(v)>0)
+      throw std::logic_error("BitSliced: no ciphertext to copy");
+    if (pt!=nullptr) reserve(lsize(v), *pt);
+    for (long i=0; i<lsize(v); i++) if (v.isSet(i)) pool[i] = *v[i];
+    sz = lsize(v);
+  }
+
+  Ctxt* operator[](long i) const override
+  { return const_cast<Ctxt*>(&pool[i]); }
+  long size() const override { return sz; }
+
+  //! Direct access to the bits, no virtual call
+  Ctxt& bit(long i) { return pool[i]; }
+  const Ctxt& bit(long i) const { return pool[i]; }
+
+  //! How many bits the pool holds already
+  long capacity() const { return long(pool.size()); }
+
+  //! Make sure that the pool has at least n ciphertexts, the new ones
+  //! are empty ciphertexts like ct (or like the ones already in the pool)
+  void reserve(long n, const Ctxt* ct=nullptr)
+  {
+    if (ct!=nullptr && !zero) zero.reset(new Ctxt(ZeroCtxtLike, *ct));
+    if (n <= capacity()) return;
+    if (!zero) throw std::logic_error("BitSliced: no template ciphertext");
+    pool.reserve(n);
+    while (capacity() < n) pool.push_back(*zero);
+  }
+  void reserve(long n, const Ctxt& ct) { reserve(n, &ct); }
+
+  //! Change the number of bits in place. The new bits are copies of
+  //! some ciphertext from another (or empty if another is null), and the
+  //! bits that are cut off stay in the pool for later.
+  void resize(long newSize, const CtPtrs* another=nullptr) override
+  {
+    assert(newSize>=0);
+    if (newSize <= sz) { sz = newSize; return; }
+    const Ctxt* pt = (another!=nullptr)? another->ptr2nonNull() : nullptr;
+    if (newSize > capacity()) {
+      if (pt!=nullptr) {
+        Ctxt val = *pt; // pt may point into the pool
+        reserve(newSize, &val);
+        for (long i=sz; i<newSize; i++) pool[i] = val;
+        sz = newSize;
+        return;
+      }
+      reserve(newSize);
+    }
+    for (long i=sz; i<newSize; i++) {
+      if (pt!=nullptr) pool[i] = *pt;
+      else             pool[i].clear();
+    }
+    sz = newSize;
+  }
+
+  //! Make the number equal to v, reusing the ciphertexts in the pool
+  BitSliced& operator=(const CtPtrs& v)
+  {
+    if (&v == this) return *this;
+    const Ctxt* pt = v.ptr2nonNull();
+    if (pt!=nullptr) reserve(lsize(v), pt);
+    else if (lsize(v)>0) reserve(lsize(v));
+    for (long i=0; i<lsize(v); i++) {
+      if (v.isSet(i)) pool[i] = *v[i];
+      else            pool[i].clear();
+    }
+    sz = lsize(v);
+    return *this;
+  }
+  BitSliced& operator=(const BitSliced& v)
+  { return (*this) = static_cast<const CtPtrs&>(v); }
+  BitSliced(const BitSliced& v): BitSliced(static_cast<const CtPtrs&>(v))
+  { if (v.zero && !zero) zero.reset(new Ctxt(*v.zero)); }
+  BitSliced(BitSliced&& v) = default;
+
+  //! The bits [from, from+n) as a CtPtrs, without copying them
+  CtPtrs_slice slice(long from, long n=-1) const
+  { return CtPtrs_slice(*this, from, n); }
+
+  long numNonNull(long first=0, long last=LONG_MAX) const override
+  {
+    if (first<0) first = 0;
+    if (last>sz) last = sz;
+    return std::max(last - first, 0L);
+  }
+  const Ctxt* ptr2nonNull() const override
+  { return (sz>0)? &pool[0] : nullptr; }
+};
+
+//! @brief A matrix of integers, each one a BitSliced that owns its bits.
+//! The rows live in their own allocations, so resizing the matrix does not
+//! invalidate the rows that are already there.
+class BitSlicedMat final : public CtPtrMat {
+  std::vector< std::unique_ptr<BitSliced> > rows;
+  Ctxt like; // an empty template for the rows that are added by resize
+
+public:
+  //! nRows empty numbers, each with room for capacity bits like ct
+  BitSlicedMat(const Ctxt& ct, long nRows=0, long capacity=0)
+    : like(ZeroCtxtLike, ct)
+  {
+    for (long i=0; i<nRows; i++)
+      rows.emplace_back(new BitSliced(ct, capacity));
+  }
+
+  BitSliced& operator[](long i) override { return *rows[i]; }
+  const BitSliced& operator[](long i) const override { return *rows[i]; }
+  long size() const override { return long(rows.size()); }
+
+  //! New rows are empty numbers, rows that are cut off are freed
+  void resize(long newSize) override
+  {
+    if (newSize < size()) rows.resize(newSize);
+    while (size() < newSize)
+      rows.emplace_back(new BitSliced(like));
+  }
+};
+
+#endif // ifndef _BITSLICED_H_
@@ -12,6 +12,8 @@
 /* CModulus.cpp - supports forward and backward length-m FFT transformations
  *
  * This is a wrapper around the bluesteinFFT routines, for one modulus q.
+ * When m is a power of two we use instead a native negacyclic NTT, see
+ * NativeNTTFwd/NativeNTTInv below.
  *
  * On initialization, it initizlies NTL's zz_pContext for this q
  * and computes a 2m-th root of unity r mod q and also r^{-1} mod q.
@@ -24,11 +26,453 @@
  * (vec_long), that store only the evaluation in primitive m-th
  * roots of unity.
  */
+#include <algorithm>
 #include "CModulus.h"
 #include "timing.h"
+#include "memoryUsage.h"
+
+// The native NTT needs 64x64->128-bit multiplication for the Shoup
+// products. It is not used with the OpenCL FFT, or if FHE_NO_NATIVE_NTT
+// is defined.
+#if (defined(__SIZEOF_INT128__) && !defined(FHE_OPENCL) && !defined(FHE_NO_NATIVE_NTT))
+#define FHE_NATIVE_NTT
+#endif
 
 NTL_CLIENT
 
+#ifdef FHE_NATIVE_NTT
+//==================================================================
+// A native negacyclic NTT of length n=2^logn (n = phi(m) for m = 2n),
+// computing y[j] = x(psi^{2j+1}) mod q for j=0..n-1. We use Cooley-Tukey
+// butterflies for the forward and Gentleman-Sande for the inverse
+// transform, both with Harvey's lazy reduction: values are kept in [0,4q)
+// resp. [0,2q) inside the transform and only fully reduced at the end.
+// This requires 4q < 2^64, which holds for all single-precision primes.
+
+typedef unsigned __int128 fhe_u128;
+
+// floor(w*2^64/q), for w<q
+static inline
+unsigned long ShoupFactor(unsigned long w, unsigned long q)
+{
+  return (unsigned long) ((fhe_u128(w) << 64) / q);
+}
+
+// x*w mod q, in the range [0,2q), for any 64-bit x
+static inline
+unsigned long LazyMulModShoup(unsigned long x, unsigned long w,
+                              unsigned long wShoup, unsigned long q)
+{
+  unsigned long qh = (unsigned long) ((fhe_u128(x) * wShoup) >> 64);
+  return x*w - qh*q;
+}
+
+static inline
+long BitReverse(long i, long logn)
+{
+  long r = 0;
+  for (long b = 0; b < logn; b++, i >>= 1) r = (r << 1) | (i & 1);
+  return r;
+}
+
+// in-place bit-reversal permutation of a[0..n-1]
+static void BitReversePermute(unsigned long *a, long n)
+{
+  for (long i = 1, j = 0; i < n; i++) {
+    long bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) std::swap(a[i], a[j]);
+  }
+}
+
+// Forward transform: input in natural order in [0,4q),
+// output in bit-reversed order, fully reduced
+static void NativeNTTFwd(unsigned long *a, long n, unsigned long q,
+                         const unsigned long *w, const unsigned long *wShoup)
+{
+  const unsigned long twoq = 2*q;
+  for (long m = 1, t = n/2; m < n; m *= 2, t /= 2) {
+    for (long i = 0; i < m; i++) {
+      const unsigned long W = w[m+i], Wshoup = wShoup[m+i];
+      unsigned long *x = a + 2*i*t;
+      unsigned long *y = x + t;
+      for (long j = 0; j < t; j++) {
+        unsigned long X = x[j];
+        if (X >= twoq) X -= twoq;
+        unsigned long T = LazyMulModShoup(y[j], W, Wshoup, q);
+        x[j] = X + T;
+        y[j] = X - T + twoq;
+      }
+    }
+  }
+  for (long j = 0; j < n; j++) {
+    unsigned long X = a[j];
+    if (X >= twoq) X -= twoq;
+    if (X >= q) X -= q;
+    a[j] = X;
+  }
+}
+
+// Inverse transform: input in bit-reversed order in [0,2q),
+// output in natural order, scaled by nInv and fully reduced
+static void NativeNTTInv(unsigned long *a, long n, unsigned long q,
+                         const unsigned long *w, const unsigned long *wShoup,
+                         unsigned long nInv, unsigned long nInvShoup)
+{
+  const unsigned long twoq = 2*q;
+  for (long m = n/2, t = 1; m >= 1; m /= 2, t *= 2) {
+    for (long i = 0; i < m; i++) {
+      const unsigned long W = w[m+i], Wshoup = wShoup[m+i];
+      unsigned long *x = a + 2*i*t;
+      unsigned long *y = x + t;
+      for (long j = 0; j < t; j++) {
+        unsigned long X = x[j], Y = y[j];
+        unsigned long S = X + Y;
+        if (S >= twoq) S -= twoq;
+        x[j] = S;
+        y[j] = LazyMulModShoup(X - Y + twoq, W, Wshoup, q);
+      }
+    }
+  }
+  for (long j = 0; j < n; j++) {
+    unsigned long X = LazyMulModShoup(a[j], nInv, nInvShoup, q);
+    if (X >= q) X -= q;
+    a[j] = X;
+  }
+}
+
+// The same as NativeNTTFwd, applied to NB rows at once, possibly modulo
+// different primes. The rows are processed in lock-step, so the loop
+// overhead is shared and the NB independent butterflies can overlap.
+template<long NB>
+static void NativeNTTFwdBatch(unsigned long * const *a, long n,
+                              const unsigned long *q,
+                              const unsigned long * const *w,
+                              const unsigned long * const *wShoup)
+{
+  unsigned long twoq[NB];
+  for (long b = 0; b < NB; b++) twoq[b] = 2*q[b];
+
+  for (long m = 1, t = n/2; m < n; m *= 2, t /= 2) {
+    for (long i = 0; i < m; i++) {
+      unsigned long W[NB], Wshoup[NB];
+      for (long b = 0; b < NB; b++) {
+        W[b] = w[b][m+i];
+        Wshoup[b] = wShoup[b][m+i];
+      }
+      const long first = 2*i*t, last = first + t;
+      for (long j = first; j < last; j++) {
+        for (long b = 0; b < NB; b++) {
+          unsigned long *x = a[b];
+          unsigned long X = x[j];
+          if (X >= twoq[b]) X -= twoq[b];
+          unsigned long T = LazyMulModShoup(x[j+t], W[b], Wshoup[b], q[b]);
+          x[j] = X + T;
+          x[j+t] = X - T + twoq[b];
+        }
+      }
+    }
+  }
+  for (long b = 0; b < NB; b++) {
+    unsigned long *x = a[b];
+    for (long j = 0; j < n; j++) {
+      unsigned long X = x[j];
+      if (X >= twoq[b]) X -= twoq[b];
+      if (X >= q[b]) X -= q[b];
+      x[j] = X;
+    }
+  }
+}
+
+// Fixed-size kernels for the power-of-two m of the production parameters,
+// m = 2^15, 2^16, 2^17. They compute what NativeNTTFwd/NativeNTTInv compute,
+// to the bit, but the stages are templates on logn, so that the distance
+// and the number of the butterflies of each stage are compile-time
+// constants and the short inner loops are unrolled. The stages are also
+// cache blocked: those with a distance of at least 2^FHE_NTT_BLOCK_LOG run
+// one pass over the row each, and all the others run a block of
+// 2^FHE_NTT_BLOCK_LOG entries at a time, while it is in the L1 cache. The
+// twiddles are the tables of the Cmodulus (they depend on q).
+#ifndef FHE_NTT_BLOCK_LOG
+#define FHE_NTT_BLOCK_LOG (11) // 16KB blocks
+#endif
+
+// Stage S of the forward transform of length 2^LOGN: the 2^S groups of
+// butterflies at distance T, with the twiddles w[M..2M)
+template<long LOGN, long S>
+struct NTTFwdStage {
+  static const long M = 1L << S, T = 1L << (LOGN-S-1);
+
+  // the groups [first,last), those in a[2*first*T .. 2*last*T)
+  static void groups(unsigned long *a, long first, long last, unsigned long q,
+                     const unsigned long *w, const unsigned long *wShoup)
+  {
+    const unsigned long twoq = 2*q;
+    for (long i = first; i < last; i++) {
+      const unsigned long W = w[M+i], Wshoup = wShoup[M+i];
+      unsigned long *x = a + 2*i*T;
+      unsigned long *y = x + T;
+      for (long j = 0; j < T; j++) {
+        unsigned long X = x[j];
+        if (X >= twoq) X -= twoq;
+        unsigned long U = LazyMulModShoup(y[j], W, Wshoup, q);
+        x[j] = X + U;
+        y[j] = X - U + twoq;
+      }
+    }
+  }
+};
+
+// The forward stages LO..HI-1 on a[base .. base+len), which is made of
+// whole groups of each of them
+template<long LOGN, long LO, long HI>
+struct NTTFwdStages {
+  static void run(unsigned long *a, long base, long len, unsigned long q,
+                  const unsigned long *w, const unsigned long *wShoup)
+  {
+    typedef NTTFwdStage<LOGN,LO> Stage;
+    Stage::groups(a, base/(2*Stage::T), (base+len)/(2*Stage::T),
+                  q, w, wShoup);
+    NTTFwdStages<LOGN,LO+1,HI>::run(a, base, len, q, w, wShoup);
+  }
+};
+
+template<long LOGN, long HI>
+struct NTTFwdStages<LOGN,HI,HI> {
+  static void run(unsigned long *, long, long, unsigned long,
+                  const unsigned long *, const unsigned long *) {}
+};
+
+// Stage S of the inverse transform, as above
+template<long LOGN, long S>
+struct NTTInvStage {
+  static const long M = 1L << S, T = 1L << (LOGN-S-1);
+
+  static void groups(unsigned long *a, long first, long last, unsigned long q,
+                     const unsigned long *w, const unsigned long *wShoup)
+  {
+    const unsigned long twoq = 2*q;
+    for (long i = first; i < last; i++) {
+      const unsigned long W = w[M+i], Wshoup = wShoup[M+i];
+      unsigned long *x = a + 2*i*T;
+      unsigned long *y = x + T;
+      for (long j = 0; j < T; j++) {
+        unsigned long X = x[j], Y = y[j];
+        unsigned long U = X + Y;
+        if (U >= twoq) U -= twoq;
+        x[j] = U;
+        y[j] = LazyMulModShoup(X - Y + twoq, W, Wshoup, q);
+      }
+    }
+  }
+};
+
+// The inverse stages HI-1 down to LO on a[base .. base+len)
+template<long LOGN, long HI, long LO>
+struct NTTInvStages {
+  static void run(unsigned long *a, long base, long len, unsigned long q,
+                  const unsigned long *w, const unsigned long *wShoup)
+  {
+    typedef NTTInvStage<LOGN,HI-1> Stage;
+    Stage::groups(a, base/(2*Stage::T), (base+len)/(2*Stage::T),
+                  q, w, wShoup);
+    NTTInvStages<LOGN,HI-1,LO>::run(a, base, len, q, w, wShoup);
+  }
+};
+
+template<long LOGN, long LO>
+struct NTTInvStages<LOGN,LO,LO> {
+  static void run(unsigned long *, long, long, unsigned long,
+                  const unsigned long *, const unsigned long *) {}
+};
+
+// NativeNTTFwd for n = 2^LOGN. Each block is fully reduced as soon as its
+// last stage is done.
+template<long LOGN>
+static void NativeNTTFwdFixed(unsigned long *a, unsigned long q,
+                              const unsigned long *w,
+                              const unsigned long *wShoup)
+{
+  const long N = 1L << LOGN;
+  const long LOGB = (LOGN < FHE_NTT_BLOCK_LOG)? LOGN : FHE_NTT_BLOCK_LOG;
+  const long B = 1L << LOGB;
+  const unsigned long twoq = 2*q;
+
+  NTTFwdStages<LOGN,0,LOGN-LOGB>::run(a, 0, N, q, w, wShoup);
+  for (long base = 0; base < N; base += B) {
+    NTTFwdStages<LOGN,LOGN-LOGB,LOGN>::run(a, base, B, q, w, wShoup);
+    unsigned long *x = a + base;
+    for (long j = 0; j < B; j++) {
+      unsigned long X = x[j];
+      if (X >= twoq) X -= twoq;
+      if (X >= q) X -= q;
+      x[j] = X;
+    }
+  }
+}
+
+// NativeNTTInv for n = 2^LOGN
+template<long LOGN>
+static void NativeNTTInvFixed(unsigned long *a, unsigned long q,
+                              const unsigned long *w,
+                              const unsigned long *wShoup,
+                              unsigned long nInv, unsigned long nInvShoup)
+{
+  const long N = 1L << LOGN;
+  const long LOGB = (LOGN < FHE_NTT_BLOCK_LOG)? LOGN : FHE_NTT_BLOCK_LOG;
+  const long B = 1L << LOGB;
+
+  for (long base = 0; base < N; base += B)
+    NTTInvStages<LOGN,LOGN,LOGN-LOGB>::run(a, base, B, q, w, wShoup);
+  NTTInvStages<LOGN,LOGN-LOGB,0>::run(a, 0, N, q, w, wShoup);
+  for (long j = 0; j < N; j++) {
+    unsigned long X = LazyMulModShoup(a[j], nInv, nInvShoup, q);
+    if (X >= q) X -= q;
+    a[j] = X;
+  }
+}
+
+// Is there a fixed-size kernel for length n? (-DFHE_NO_FIXED_NTT to
+// always use the generic ones)
+static inline bool HasFixedNTT(long n)
+{
+#ifdef FHE_NO_FIXED_NTT
+  return false;
+#else
+  return n == (1L << 14) || n == (1L << 15) || n == (1L << 16);
+#endif
+}
+
+// NativeNTTFwd, through the fixed-size kernel for n if there is one
+static void NativeNTTFwdAny(unsigned long *a, long n, unsigned long q,
+                            const unsigned long *w,
+                            const unsigned long *wShoup)
+{
+  if (HasFixedNTT(n)) switch (n) {
+    case 1L << 14: NativeNTTFwdFixed<14>(a, q, w, wShoup); return;
+    case 1L << 15: NativeNTTFwdFixed<15>(a, q, w, wShoup); return;
+    case 1L << 16: NativeNTTFwdFixed<16>(a, q, w, wShoup); return;
+    }
+  NativeNTTFwd(a, n, q, w, wShoup);
+}
+
+// NativeNTTInv, through the fixed-size kernel for n if there is one
+static void NativeNTTInvAny(unsigned long *a, long n, unsigned long q,
+                            const unsigned long *w,
+                            const unsigned long *wShoup,
+                            unsigned long nInv, unsigned long nInvShoup)
+{
+  if (HasFixedNTT(n)) switch (n) {
+    case 1L << 14:
+      NativeNTTInvFixed<14>(a, q, w, wShoup, nInv, nInvShoup); return;
+    case 1L << 15:
+      NativeNTTInvFixed<15>(a, q, w, wShoup, nInv, nInvShoup); return;
+    case 1L << 16:
+      NativeNTTInvFixed<16>(a, q, w, wShoup, nInv, nInvShoup); return;
+    }
+  NativeNTTInv(a, n, q, w, wShoup, nInv, nInvShoup);
+}
+
+// Reduce x modulo (X^n+1, q[b]) into the rows y[b], for b=0..nb-1,
+// reading each coefficient of x only once.
+static void ReduceToRows(long * const *y, long nb, long n,
+                         const unsigned long *q, const zzX& x)
+{
+  long qmin = q[0];
+  for (long b = 1; b < nb; b++) qmin = std::min(qmin, long(q[b]));
+
+  long len = x.length();
+  if (len > n) { // need to fold the high coefficients using X^n = -1
+    for (long b = 0; b < nb; b++)
+      for (long j = 0; j < n; j++) y[b][j] = 0;
+    for (long i = 0; i < len; i++) {
+      long c = ((i/n) & 1)? -x[i] : x[i];
+      long j = i & (n-1);
+      for (long b = 0; b < nb; b++) {
+        long cb = c % long(q[b]);
+        if (cb < 0) cb += q[b];
+        y[b][j] = AddMod(y[b][j], cb, long(q[b]));
+      }
+    }
+    return;
+  }
+
+  for (long i = 0; i < len; i++) {
+    long c = x[i];
+    if (c >= 0 && c < qmin) { // the common case: small coefficients
+      for (long b = 0; b < nb; b++) y[b][i] = c;
+    }
+    else if (c < 0 && c > -qmin) {
+      for (long b = 0; b < nb; b++) y[b][i] = c + long(q[b]);
+    }
+    else {
+      for (long b = 0; b < nb; b++) {
+        long cb = c % long(q[b]);
+        if (cb < 0) cb += q[b];
+        y[b][i] = cb;
+      }
+    }
+  }
+  for (long b = 0; b < nb; b++)
+    for (long j = len; j < n; j++) y[b][j] = 0;
+}
+
+static void ReduceToRows(long * const *y, long nb, long n,
+                         const unsigned long *q, const ZZX& x)
+{
+  for (long b = 0; b < nb; b++)
+    for (long j = 0; j < n; j++) y[b][j] = 0;
+
+  long len = x.rep.length();
+  for (long i = 0; i < len; i++) {
+    const ZZ& c = x.rep[i];
+    long j = i & (n-1);
+    bool negate = (i/n) & 1; // X^n = -1
+    for (long b = 0; b < nb; b++) {
+      long cb = rem(c, long(q[b]));
+      if (negate) y[b][j] = SubMod(y[b][j], cb, long(q[b]));
+      else        y[b][j] = AddMod(y[b][j], cb, long(q[b]));
+    }
+  }
+}
+
+// Batched reduction and NTT for nb <= FHE_NTT_BATCH native moduli
+template<class T>
+static void NativeBatchFFT(long **y, const Cmodulus * const *mods, long nb,
+                           const T& x)
+{
+  long n = mods[0]->getPhiM();
+  unsigned long q[FHE_NTT_BATCH];
+  unsigned long *a[FHE_NTT_BATCH];
+  const unsigned long *w[FHE_NTT_BATCH];
+  const unsigned long *wShoup[FHE_NTT_BATCH];
+  for (long b = 0; b < nb; b++) {
+    q[b] = mods[b]->getQ();
+    a[b] = reinterpret_cast<unsigned long*>(y[b]);
+    w[b] = mods[b]->getNTTPsi();
+    wShoup[b] = mods[b]->getNTTPsiShoup();
+  }
+
+  ReduceToRows(y, nb, n, q, x);
+
+  if (HasFixedNTT(n)) { // the rows are too long to gain from the lock-step
+    for (long b = 0; b < nb; b++) {
+      NativeNTTFwdAny(a[b], n, q[b], w[b], wShoup[b]);
+      BitReversePermute(a[b], n);
+    }
+    return;
+  }
+  switch (nb) {
+  case 4: NativeNTTFwdBatch<4>(a, n, q, w, wShoup); break;
+  case 3: NativeNTTFwdBatch<3>(a, n, q, w, wShoup); break;
+  case 2: NativeNTTFwdBatch<2>(a, n, q, w, wShoup); break;
+  default: NativeNTTFwdBatch<1>(a, n, q, w, wShoup);
+  }
+  for (long b = 0; b < nb; b++) BitReversePermute(a[b], n);
+}
+#endif // FHE_NATIVE_NTT
+
 // It is assumed that m,q,context, and root are already set. If root is set
 // to zero, it will be computed by the compRoots() method. Then rInv is
 // computed as the inverse of root.
@@ -44,7 +488,33 @@ zz_pContext BuildContext(long p, long maxroot) {
 
 // Constructor: it is assumed that zms is already set with m>1
 // If q == 0, then the current context is used
-Cmodulus::Cmodulus(const PAlgebra &zms, long qq, long rt)
+Cmodulus::BluesteinTables::BluesteinTables(const PAlgebra& zms, long root)
+  : phimx(zms.getM(), conv<zz_pX>(zms.getPhimX()))
+{
+  BluesteinInit(zms.getM(), conv<zz_p>(root), powers, powers_aux, Rb);
+}
+
+// A thread that already works modulo q (as in the loops over the rows of
+// one prime) keeps its modulus, without saving and restoring the NTL
+// context, which updates the reference count that all the threads share.
+class Cmodulus::Scope {
+  zz_pBak bak;
+public:
+  explicit Scope(const Cmodulus& cm) {
+    if (zz_pInfo != cm.info) { bak.save(); cm.context.restore(); }
+  }
+};
+
+const Cmodulus::BluesteinTables& Cmodulus::getBluestein() const
+{
+  if (!bluestein.built()) {
+    Scope scope(*this); // the tables are relative to q
+    make_lazy(bluestein, *zMStar, root);
+  }
+  return *bluestein;
+}
+
+Cmodulus::Cmodulus(const PAlgebra &zms, long qq, long rt, bool lazy)
 {
   assert(zms.getM()>1);
   bool explicitModulus = true;
@@ -80,6 +550,7 @@ Cmodulus::Cmodulus(const PAlgebra &zms, long qq, long rt)
     state.restore();
 
     context.restore();
+    info = zz_pInfo;
 
     powers.set_ptr(new zz_pX);
     ipowers.set_ptr(new zz_pX);
@@ -115,6 +586,9 @@ Cmodulus::Cmodulus(const PAlgebra &zms, long qq, long rt)
       w = MulMod(w, w1, q);
     }
 
+#ifdef FHE_NATIVE_NTT
+    initNativeNTT(k-1);
+#endif
   
     return;
   }
@@ -127,6 +601,7 @@ Cmodulus::Cmodulus(const PAlgebra &zms, long qq, long rt)
   }
   else
     context.save();
+  info = zz_pInfo;
 
   if (root==0) { // Find a 2m-th root of unity modulo q, if not given
     zz_p rtp;
@@ -147,20 +622,48 @@ Cmodulus::Cmodulus(const PAlgebra &zms, long qq, long rt)
   }
   rInv = InvMod(root,q); // set rInv = root^{-1} mod q
 
-  // Allocate memory (relative to current modulus that was defined above).
-  // These objects will be initialized when anyone calls FFT/iFFT.
-
-  zz_pX phimx_poly;
-  conv(phimx_poly, zms.getPhimX());
+  // The tables are relative to the current modulus that was defined above
+  if (!lazy) getBluestein();
+}
 
-  powers.set_ptr(new zz_pX);
-  Rb.set_ptr(new fftRep);
-  ipowers.set_ptr(new zz_pX);
-  iRb.set_ptr(new fftRep);
-  phimx.set_ptr(new zz_pXModulus1(zms.getM(), phimx_poly));
+// The native NTT uses the same root psi=w0 as the NTL-based code above,
+// so both produce exactly the same evaluations.
+void Cmodulus::initNativeNTT(long logn)
+{
+#ifdef FHE_NATIVE_NTT
+  long n = 1L << logn;
+  assert(n == lsize(powers->rep) && n == lsize(ipowers->rep));
+
+  nttPsi.SetLength(n);
+  nttPsiShoup.SetLength(n);
+  nttIPsi.SetLength(n);
+  nttIPsiShoup.SetLength(n);
+  for (long i = 0; i < n; i++) {
+    long e = BitReverse(i, logn); // psi^e for e<n is just powers[e]
+    nttPsi[i] = rep(powers->rep[e]);
+    nttPsiShoup[i] = ShoupFactor(nttPsi[i], q);
+    nttIPsi[i] = rep(ipowers->rep[e]);
+    nttIPsiShoup[i] = ShoupFactor(nttIPsi[i], q);
+  }
+  nttNInv = InvMod(n % q, q);
+  nttNInvShoup = ShoupFactor(nttNInv, q);
+#endif
+}
 
-  BluesteinInit(mm, conv<zz_p>(root), *powers, powers_aux, *Rb);
-  BluesteinInit(mm, conv<zz_p>(rInv), *ipowers, ipowers_aux, *iRb);
+long Cmodulus::memoryUsage() const
+{
+  long n = sizeof(*this) + memBytes(powers_aux) + memBytes(ipowers_aux)
+    + memBytes(nttPsi) + memBytes(nttPsiShoup)
+    + memBytes(nttIPsi) + memBytes(nttIPsiShoup);
+  if (!powers.null()) n += sizeof(zz_pX) + memBytes(*powers);
+  if (!ipowers.null()) n += sizeof(zz_pX) + memBytes(*ipowers);
+  if (bluestein.built()) {
+    const BluesteinTables& b = *bluestein;
+    n += sizeof(BluesteinTables) + memBytes(b.powers)
+      + memBytes(b.powers_aux) + memBytes(b.Rb) + memBytes(b.phimx.f)
+      + memBytes(b.phimx.R0) + memBytes(b.phimx.R1) + memBytes(b.phimx.fm.f);
+  }
+  return n;
 }
 
 Cmodulus& Cmodulus::operator=(const Cmodulus &other)
@@ -173,8 +676,8 @@ Cmodulus& Cmodulus::operator=(const Cmodulus &other)
   m_inv   = other.m_inv;
 
   context = other.context;
-  zz_pBak bak; bak.save(); // backup the current modulus
-  context.restore();       // Set NTL's current modulus to q
+  info    = other.info;    // the same tables
+  Scope scope(*this);      // Set NTL's current modulus to q
 
   // NOTE: newer versions of NTL allow fftRep's and zz_pXModulus's to be copied
   // "out of context" (versions after 7.0.*). However, those copies
@@ -190,12 +693,17 @@ Cmodulus& Cmodulus::operator=(const Cmodulus &other)
   powers_aux = other.powers_aux;
   ipowers_aux = other.ipowers_aux;
 
+  nttPsi = other.nttPsi;
+  nttPsiShoup = other.nttPsiShoup;
+  nttIPsi = other.nttIPsi;
+  nttIPsiShoup = other.nttIPsiShoup;
+  nttNInv = other.nttNInv;
+  nttNInvShoup = other.nttNInvShoup;
+
   // copy data, not pointers in these fields
   powers = other.powers;
-  Rb = other.Rb;
   ipowers = other.ipowers;
-  iRb = other.iRb;
-  phimx = other.phimx;
+  bluestein = other.bluestein; // a copy of the tables, if built
 
 #ifdef FHE_OPENCL
   altFFTInfo = other.altFFTInfo;
@@ -347,7 +855,7 @@ void BitReverseCopy(long * NTL_RESTRICT B, const long * NTL_RESTRICT A, long k)
 
 
 
-void Cmodulus::FFT_aux(vec_long &y, zz_pX& tmp) const
+void Cmodulus::FFT_aux(long *y, zz_pX& tmp) const
 {
 
   if (zMStar->getPow2()) {
@@ -361,8 +869,7 @@ void Cmodulus::FFT_aux(vec_long &y, zz_pX& tmp) const
     const zz_p *powers_p = (*powers).rep.elts();
     const mulmod_precon_t *powers_aux_p = powers_aux.elts();
 
-    y.SetLength(phim);
-    long *yp = y.elts();
+    long *yp = y;
 
     zz_p *tmp_p = tmp.rep.elts();
 
@@ -403,23 +910,38 @@ void Cmodulus::FFT_aux(vec_long &y, zz_pX& tmp) const
   zz_p rt;
   conv(rt, root);  // convert root to zp format
 
-  BluesteinFFT(tmp, getM(), rt, *powers, powers_aux, *Rb); // call the FFT routine
+  const BluesteinTables& bt = getBluestein();
+  BluesteinFFT(tmp, getM(), rt, bt.powers, bt.powers_aux, bt.Rb); // call the FFT routine
 
   // copy the result to the output vector y, keeping only the
   // entries corresponding to primitive roots of unity
-  y.SetLength(zMStar->getPhiM());
-  long i,j;
-  long m = getM();
-  for (i=j=0; i<m; i++)
-    if (zMStar->inZmStar(i)) y[j++] = rep(coeff(tmp,i));
+  long phim = getPhiM();
+  for (long j = 0; j < phim; j++)
+    y[j] = rep(coeff(tmp, zMStar->repInZmstar_unchecked(j)));
 }
 
 
-void Cmodulus::FFT(vec_long &y, const ZZX& x) const
+void Cmodulus::FFT(long *y, const ZZX& x) const
 {
   FHE_TIMER_START;
-  zz_pBak bak; bak.save();
-  context.restore();
+
+#ifdef FHE_NATIVE_NTT
+  if (usesNativeNTT()) { // reduce mod (X^n+1, q) directly into y
+    long n = nttPsi.length();
+    for (long i = 0; i < n; i++) y[i] = 0;
+    for (long i = 0; i < x.rep.length(); i++) {
+      long c = rem(x.rep[i], q);
+      long j = i & (n-1);
+      if ((i/n) & 1) y[j] = SubMod(y[j], c, q); // X^n = -1
+      else           y[j] = AddMod(y[j], c, q);
+    }
+    unsigned long *yp = reinterpret_cast<unsigned long*>(y);
+    NativeNTTFwdAny(yp, n, q, nttPsi.elts(), nttPsiShoup.elts());
+    BitReversePermute(yp, n);
+    return;
+  }
+#endif
+  Scope scope(*this);
 
   zz_pX& tmp = Cmodulus::getScratch_zz_pX();
   { FHE_NTIMER_START(FFT_remainder);
@@ -429,11 +951,28 @@ void Cmodulus::FFT(vec_long &y, const ZZX& x) const
   FFT_aux(y, tmp);
 };
 
-void Cmodulus::FFT(vec_long &y, const zzX& x) const
+void Cmodulus::FFT(long *y, const zzX& x) const
 {
   FHE_TIMER_START;
-  zz_pBak bak; bak.save();
-  context.restore();
+
+#ifdef FHE_NATIVE_NTT
+  if (usesNativeNTT()) { // reduce mod (X^n+1, q) directly into y
+    long n = nttPsi.length();
+    for (long i = 0; i < n; i++) y[i] = 0;
+    for (long i = 0; i < x.length(); i++) {
+      long c = x[i] % q;
+      if (c < 0) c += q;
+      long j = i & (n-1);
+      if ((i/n) & 1) y[j] = SubMod(y[j], c, q); // X^n = -1
+      else           y[j] = AddMod(y[j], c, q);
+    }
+    unsigned long *yp = reinterpret_cast<unsigned long*>(y);
+    NativeNTTFwdAny(yp, n, q, nttPsi.elts(), nttPsiShoup.elts());
+    BitReversePermute(yp, n);
+    return;
+  }
+#endif
+  Scope scope(*this);
 
   zz_pX& tmp = Cmodulus::getScratch_zz_pX();
   { FHE_NTIMER_START(FFT_remainder);
@@ -445,11 +984,55 @@ void Cmodulus::FFT(vec_long &y, const zzX& x) const
 
 
 
-void Cmodulus::iFFT(zz_pX &x, const vec_long& y)const
+template<class T>
+static void batchFFT_aux(long **y, const Cmodulus * const *mods, long nb,
+                         const T& x)
 {
   FHE_TIMER_START;
-  zz_pBak bak; bak.save();
-  context.restore();
+#ifdef FHE_NATIVE_NTT
+  if (nb > 0 && mods[0]->usesNativeNTT()) {
+    for (long first = 0; first < nb; first += FHE_NTT_BATCH) {
+      long cnt = std::min(nb - first, long(FHE_NTT_BATCH));
+      NativeBatchFFT(y + first, mods + first, cnt, x);
+    }
+    return;
+  }
+#endif
+  for (long t = 0; t < nb; t++) mods[t]->FFT(y[t], x);
+}
+
+void Cmodulus::batchFFT(long **y, const Cmodulus * const *mods, long nb,
+                        const zzX& x)
+{ batchFFT_aux(y, mods, nb, x); }
+
+void Cmodulus::batchFFT(long **y, const Cmodulus * const *mods, long nb,
+                        const ZZX& x)
+{ batchFFT_aux(y, mods, nb, x); }
+
+
+void Cmodulus::iFFT(zz_pX &x, const long *y)const
+{
+  FHE_TIMER_START;
+#ifdef FHE_NATIVE_NTT
+  if (usesNativeNTT()) {
+    long n = nttPsi.length();
+    vec_long& tmp = Cmodulus::getScratch_vec_long();
+    tmp.SetLength(n);
+    unsigned long *tmp_p = reinterpret_cast<unsigned long*>(tmp.elts());
+
+    for (long i = 0; i < n; i++) tmp_p[i] = y[i];
+    BitReversePermute(tmp_p, n);
+    NativeNTTInvAny(tmp_p, n, q, nttIPsi.elts(), nttIPsiShoup.elts(),
+                    nttNInv, nttNInvShoup);
+
+    x.rep.SetLength(n);
+    zz_p *xp = x.rep.elts();
+    for (long i = 0; i < n; i++) xp[i].LoopHole() = tmp_p[i];
+    x.normalize();
+    return;
+  }
+#endif
+  Scope scope(*this);
 
   if (zMStar->getPow2()) {
     // special case when m is a power of 2
@@ -461,7 +1044,7 @@ void Cmodulus::iFFT(zz_pX &x, const vec_long& y)const
     const zz_p *ipowers_p = (*ipowers).rep.elts();
     const mulmod_precon_t *ipowers_aux_p = ipowers_aux.elts();
 
-    const long *yp = y.elts();
+    const long *yp = y;
 
     vec_long& tmp = Cmodulus::getScratch_vec_long();
     tmp.SetLength(phim);
@@ -500,20 +1083,25 @@ void Cmodulus::iFFT(zz_pX &x, const vec_long& y)const
 
   zz_p rt;
   long m = getM();
+  long phim = getPhiM();
 
-  // convert input to zpx format, initializing only the coeffs i s.t. (i,m)=1
+  // convert input to zpx format, initializing only the coeffs i s.t. (i,m)=1.
+  // The transform with root^{-1} is the one with root of the input at -i,
+  // and -i is the (phim-1-j)'th element of Zm* when i is the j'th.
   x.rep.SetLength(m);
-  long i,j;
-  for (i=j=0; i<m; i++)
-    if (zMStar->inZmStar(i)) x.rep[i].LoopHole() = y[j++]; // DIRT: y[j] already reduced
+  zz_p *xp = x.rep.elts();
+  for (long i = 0; i < m; i++) clear(xp[i]);
+  for (long j = 0; j < phim; j++) // DIRT: y[j] already reduced
+    xp[zMStar->repInZmstar_unchecked(phim-1-j)].LoopHole() = y[j];
   x.normalize();
-  conv(rt, rInv);  // convert rInv to zp format
+  conv(rt, root);  // convert root to zp format
 
-  BluesteinFFT(x, m, rt, *ipowers, ipowers_aux, *iRb); // call the FFT routine
+  const BluesteinTables& bt = getBluestein();
+  BluesteinFFT(x, m, rt, bt.powers, bt.powers_aux, bt.Rb); // call the FFT routine
 
   // reduce the result mod (Phi_m(X),q) and copy to the output polynomial x
   { FHE_NTIMER_START(iFFT_division);
-    rem(x, x, *phimx); // out %= (Phi_m(X),q)
+    rem(x, x, bt.phimx); // out %= (Phi_m(X),q)
   }
 
   // normalize
@@ -523,6 +1111,30 @@ void Cmodulus::iFFT(zz_pX &x, const vec_long& y)const
 }
 
 
+void Cmodulus::iFFT(long *x, const long *y) const
+{
+  long phim = getPhiM();
+#ifdef FHE_NATIVE_NTT
+  if (usesNativeNTT()) { // straight into x, no zz_p at all
+    FHE_TIMER_START;
+    unsigned long *xp = reinterpret_cast<unsigned long*>(x);
+    for (long i = 0; i < phim; i++) xp[i] = y[i];
+    BitReversePermute(xp, phim);
+    NativeNTTInvAny(xp, phim, q, nttIPsi.elts(), nttIPsiShoup.elts(),
+                    nttNInv, nttNInvShoup);
+    return;
+  }
+#endif
+  Scope scope(*this);
+  zz_pX& tmp = Cmodulus::getScratch_zz_pX();
+  iFFT(tmp, y);
+  long d = deg(tmp); // copy the coefficients, pad by zeros
+  const zz_p *tp = tmp.rep.elts();
+  for (long h = 0; h <= d; h++) x[h] = rep(tp[h]);
+  for (long h = d+1; h < phim; h++) x[h] = 0;
+}
+
+
 zz_pX& Cmodulus::getScratch_zz_pX() 
 {
    NTL_THREAD_LOCAL static zz_pX scratch;
@@ -16,12 +16,18 @@
  * @brief Supports forward and backward length-m FFT transformations
  *
  * This is a wrapper around the bluesteinFFT routines, for one modulus q.
+ * When m is a power of two, it uses instead a native negacyclic NTT with
+ * lazy reduction and precomputed Shoup twiddle factors (Harvey's butterflies).
  **/
+#include <NTL/Lazy.h>
 #include "NumbTh.h"
 #include "PAlgebra.h"
 #include "bluestein.h"
 #include "cloned_ptr.h"
 
+//! The number of primes whose NTTs are interleaved in Cmodulus::batchFFT
+#define FHE_NTT_BATCH (4)
+
 /**
 * @class Cmodulus
 * @brief Provides FFT and iFFT routines modulo a single-precision prime
@@ -29,8 +35,9 @@
 * On initialization, it initizlies NTL's zz_pContext for this q
 * and computes a 2m-th root of unity r mod q and also r^{-1} mod q.
 * Thereafter this class provides FFT and iFFT routines that converts between
-* time & frequency domains. Some tables are computed the first time that
-* each directions is called, which are then used in subsequent computations.
+* time & frequency domains. For m that is not a power of two, the Bluestein
+* tables can be left for the first FFT/iFFT to compute (see the lazy flag
+* of the constructor), which is then used in subsequent computations.
 * 
 * The "time domain" polynomials are represented as ZZX, which are reduced
 * modulo Phi_m(X). The "frequency domain" are just vectors of integers
@@ -42,6 +49,10 @@ class Cmodulus {
   NTL::mulmod_t      qinv;    // PrepMulMod(q);
 
   NTL::zz_pContext   context; // NTL's tables for this modulus
+  const NTL::zz_pInfoT* info;  // the same tables, as NTL installs them
+
+  // Makes q the current NTL modulus for its lifetime, if it is not already
+  class Scope;
 
   const PAlgebra* zMStar;  // points to the Zm* structure, m is FFT size
 
@@ -50,15 +61,40 @@ class Cmodulus {
   long        root;    // 2m-th root of unity modulo q
   long        rInv;    // root^{-1} mod q
 
+  // The powers of psi (resp. psi^{-1}), when m is a power of two
   copied_ptr<NTL::zz_pX>    powers;  // tables for forward FFT
   NTL::Vec<NTL::mulmod_precon_t> powers_aux;
-  copied_ptr<NTL::fftRep>   Rb;
 
   copied_ptr<NTL::zz_pX>    ipowers; // tables for backward FFT
   NTL::Vec<NTL::mulmod_precon_t> ipowers_aux;
-  copied_ptr<NTL::fftRep>   iRb;
 
-  copied_ptr<zz_pXModulus1> phimx; // PhimX modulo q, for faster division w/ remainder
+  // When m is not a power of two: the Bluestein tables of root, and PhimX
+  // modulo q, for faster division w/ remainder. iFFT uses the same tables
+  // on its input in reverse order (see bluestein.h).
+  struct BluesteinTables {
+    NTL::zz_pX powers;
+    NTL::Vec<NTL::mulmod_precon_t> powers_aux;
+    NTL::fftRep Rb;
+    zz_pXModulus1 phimx;
+
+    //! Must be called with the modulus q installed
+    BluesteinTables(const PAlgebra& zms, long root);
+  };
+  NTL::Lazy<BluesteinTables> bluestein; // built on first use, if lazy
+
+  // Returns the Bluestein tables, building them if needed
+  const BluesteinTables& getBluestein() const;
+
+  // Tables for the native negacyclic NTT, used when m is a power of two.
+  // nttPsi[i] = psi^{bitrev(i)} and nttIPsi[i] = psi^{-bitrev(i)}, where
+  // psi is a primitive m-th root of unity mod q, with the corresponding
+  // Shoup factors floor(w*2^64/q). Empty when the native NTT is not used.
+  NTL::Vec<unsigned long> nttPsi, nttPsiShoup;
+  NTL::Vec<unsigned long> nttIPsi, nttIPsiShoup;
+  unsigned long nttNInv, nttNInvShoup; // phi(m)^{-1} mod q and its Shoup factor
+
+  // Build the tables above from the powers of psi in *powers, *ipowers
+  void initNativeNTT(long logn);
 
 
   // Allocate memory and compute roots
@@ -75,17 +111,23 @@ class Cmodulus {
   // Destructor and constructors
 
   // Default constructor
-  Cmodulus() {}
+  Cmodulus() : info(NULL), nttNInv(0), nttNInvShoup(0) {}
 
   Cmodulus(const Cmodulus &other) { *this = other; }
 
   // Specify m and q, and optionally also the root
   // if q == 0, then the current context is used
-  Cmodulus(const PAlgebra &zms, long qq, long rt);
+  // If lazy, the Bluestein tables (for m that is not a power of two) are
+  // only built by the first FFT/iFFT that needs them
+  Cmodulus(const PAlgebra &zms, long qq, long rt, bool lazy=false);
 
   // Copy operator
   Cmodulus& operator=(const Cmodulus &other);
 
+  //! The bytes of the FFT tables, the lazy ones if they are built, and of
+  //! this object (see memoryUsage.h)
+  long memoryUsage() const;
+
   // utility methods
 
   const PAlgebra &getZMStar() const { return *zMStar; }
@@ -94,24 +136,58 @@ class Cmodulus {
   long getQ() const          { return q; }
   NTL::mulmod_t getQInv() const          { return qinv; }
   long getRoot() const       { return root; }
-  const zz_pXModulus1& getPhimX() const  { return *phimx; }
+  const zz_pXModulus1& getPhimX() const  { return getBluestein().phimx; }
+
+  //! @brief Are FFT/iFFT using the native NTT (rather than NTL's FFT)?
+  bool usesNativeNTT() const { return nttPsi.length() > 0; }
+
+  //! @brief The forward NTT twiddles psi^{bitrev(i)} and their Shoup
+  //! factors (only meaningful if usesNativeNTT())
+  const unsigned long* getNTTPsi() const { return nttPsi.elts(); }
+  const unsigned long* getNTTPsiShoup() const { return nttPsiShoup.elts(); }
 
   //! @brief Restore NTL's current modulus
   void restoreModulus() const {context.restore();}
 
   // FFT routines
 
-  // sets zp context internally
-  void FFT(NTL::vec_long &y, const NTL::ZZX& x) const;  // y = FFT(x)
-  void FFT(NTL::vec_long &y, const zzX& x) const;  // y = FFT(x)
-
-  // auxilliary routine used by above two routines
-  void FFT_aux(NTL::vec_long &y, NTL::zz_pX& tmp) const;  
-
-
-
-  // expects zp context to be set externally
-  void iFFT(NTL::zz_pX &x, const NTL::vec_long& y) const; // x = FFT^{-1}(y)
+  // These set the zp context internally when they need it, and leave NTL's
+  // current modulus as it was. Threads may call them concurrently.
+  // The raw-pointer versions write/read exactly phi(m) entries, they are
+  // used by DoubleCRT to work directly on the rows of its slab.
+  void FFT(long *y, const NTL::ZZX& x) const;  // y = FFT(x)
+  void FFT(long *y, const zzX& x) const;  // y = FFT(x)
+
+  void FFT(NTL::vec_long &y, const NTL::ZZX& x) const // y = FFT(x)
+  { y.SetLength(getPhiM()); FFT(y.elts(), x); }
+  void FFT(NTL::vec_long &y, const zzX& x) const  // y = FFT(x)
+  { y.SetLength(getPhiM()); FFT(y.elts(), x); }
+
+  //! @brief Batched FFT of one polynomial modulo several primes:
+  //! y[t] = FFT(x) modulo mods[t]->getQ(), for t=0..nb-1.
+  //! With the native NTT, the input coefficients are read only once and
+  //! reduced into all the residues together, and the butterflies of up to
+  //! FHE_NTT_BATCH primes are interleaved. Otherwise this just calls
+  //! mods[t]->FFT(y[t],x) for each t.
+  static void batchFFT(long **y, const Cmodulus * const *mods, long nb,
+                       const zzX& x);
+  static void batchFFT(long **y, const Cmodulus * const *mods, long nb,
+                       const NTL::ZZX& x);
+
+  // auxilliary routine used by above routines
+  void FFT_aux(long *y, NTL::zz_pX& tmp) const;  
+
+
+
+  // x = FFT^{-1}(y), a zz_pX modulo q (so the caller should have q as
+  // the current modulus to use x)
+  void iFFT(NTL::zz_pX &x, const long *y) const; // x = FFT^{-1}(y)
+  void iFFT(NTL::zz_pX &x, const NTL::vec_long& y) const // x = FFT^{-1}(y)
+  { iFFT(x, y.elts()); }
+
+  //! @brief x = FFT^{-1}(y), the phi(m) coefficients in [0,q). Neither
+  //! the input nor the output involves NTL's current modulus.
+  void iFFT(long *x, const long *y) const;
 
   // returns thread-local scratch space
   // DIRT: this zz_pX is used for several zz_p moduli,
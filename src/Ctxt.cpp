@@ -9,10 +9,22 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. See accompanying LICENSE file.
  */
+#include <cstring>
+#include <list>
+#include <algorithm>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
 #include <NTL/BasicThreadPool.h>
 
 #include "binio.h"
 #include "timing.h"
+#include "telemetry.h"
+#include "costModel.h"
+#include "circuit.h"
+#include "ctxtTrace.h"
+#include "metrics.h"
+#include "memoryUsage.h"
 #include "FHEContext.h"
 #include "Ctxt.h"
 #include "FHE.h"
@@ -20,6 +32,8 @@
 
 #include "debugging.h"
 #include "norms.h"
+#include "taskScheduler.h"
+#include "encodedPtxt.h"
 
 NTL_CLIENT
 
@@ -80,6 +94,8 @@ void Ctxt::DummyEncrypt(const ZZX& ptxt, double size)
   }
 
   primeSet = context.ctxtPrimes;
+  circuitNode = -1; // a new input
+  traceId = -1;
 
   // A single part, with the plaintext as data and handle pointing to 1
 
@@ -119,13 +135,14 @@ keySwitchNoise(const CtxtPart& p, const FHEPubKey& pubKey, const KeySwitch& ks)
 
   xdouble ks_bound = ks.noiseBound;
 
+  const vector<IndexSet>& digits = ks.getDigits(context);
   long nDigits = 0;
   xdouble addedNoise = to_xdouble(0.0);
   double sizeLeft = context.logOfProduct(p.getIndexSet());
-  for (size_t i=0; i<context.digits.size() && sizeLeft>0.0; i++) {    
+  for (size_t i=0; i<digits.size() && sizeLeft>0.0; i++) {    
     nDigits++;
 
-    double digitSize = context.logOfProduct(context.digits[i]);
+    double digitSize = context.logOfProduct(digits[i]);
     if (sizeLeft<digitSize) digitSize=sizeLeft;// need only part of this digit
 
     // Added noise due to this digit is keySwMatrixNoise * |Di|, 
@@ -162,45 +179,157 @@ std::pair<long, NTL::xdouble> Ctxt::computeKSNoise(long partIdx, const KeySwitch
   return keySwitchNoise(parts.at(partIdx), pubKey, ks);
 }
 
-// Multiply vector of digits by key-switching matrix and add to *this.
-// It is assumed that W has at least as many b[i]'s as there are digits.
-// The vector of digits is modified in place.
-void Ctxt::keySwitchDigits(const KeySwitch& W, vector<DoubleCRT>& digits)
-{  // An object to hold the pseudorandom ai's, note that it must be defined
-  // with the maximum number of levels, else the PRG will go out of synch.
-  // FIXME: This is a bug waiting to happen.
-
-  DoubleCRT ai(context, context.ctxtPrimes | context.specialPrimes);
-
-  // Subsequent ai's use the evolving RNG state
-  RandomState state; // backup the NTL PRG seed
-  NTL::SetSeed(W.prgSeed);
-
-  // Add the columns in, one by one
-  DoubleCRT tmpDCRT(context, IndexSet::emptySet());
-  for (size_t i=0; i<digits.size(); i++) {
-    FHE_NTIMER_START(KS_loop);
-    ai.randomize();
-    tmpDCRT = digits[i];
-  
-    // The operations below all use the IndexSet of tmpDCRT
-  
-    // add digit*a[i] with a handle pointing to base of W.toKeyID
-    {FHE_NTIMER_START(KS_loop_1);
-     tmpDCRT.Mul(ai,  /*matchIndexSet=*/false);
-    }
-    {FHE_NTIMER_START(KS_loop_2);
-     this->addPart(tmpDCRT, SKHandle(1,1,W.toKeyID), /*matchPrimeSet=*/true);
-    }
-    // add digit*b[i] with a handle pointing to one
-    {FHE_NTIMER_START(KS_loop_3);
-     digits[i].Mul(W.b[i], /*matchIndexSet=*/false);
+/********************************************************************/
+// The LRU cache of expanded key-switching rows
+
+namespace {
+struct KSCacheEntry {
+  unsigned long context; // FHEcontext::getId()
+  ZZ seed;
+  shared_ptr<const vector<DoubleCRT>> rows; // a_0,...,a_{n-1}
+  long bytes;
+};
+
+struct KSCache {
+  std::mutex mtx;
+  std::list<KSCacheEntry> entries; // most recently used first
+  long budget = 0;
+  long size = 0;
+
+  void evict() { // drop the least recently used entries, mtx must be held
+    while (size > budget && !entries.empty()) {
+      size -= entries.back().bytes;
+      entries.pop_back();
     }
-    {FHE_NTIMER_START(KS_loop_4);
-     this->addPart(digits[i], SKHandle(), /*matchPrimeSet=*/true);
+  }
+};
+
+KSCache& ksCache()
+{
+  // never destroyed, since ~FHEcontext of a static context may use it
+  static KSCache* cache = new KSCache;
+  return *cache;
+}
+} // anonymous namespace
+
+void setKeySwitchCacheBudget(long bytes)
+{
+  KSCache& cache = ksCache();
+  std::lock_guard<std::mutex> lock(cache.mtx);
+  cache.budget = std::max(0L, bytes);
+  cache.evict();
+}
+
+long getKeySwitchCacheBudget()
+{
+  KSCache& cache = ksCache();
+  std::lock_guard<std::mutex> lock(cache.mtx);
+  return cache.budget;
+}
+
+long getKeySwitchCacheSize()
+{
+  KSCache& cache = ksCache();
+  std::lock_guard<std::mutex> lock(cache.mtx);
+  return cache.size;
+}
+
+void clearKeySwitchCache()
+{
+  KSCache& cache = ksCache();
+  std::lock_guard<std::mutex> lock(cache.mtx);
+  cache.entries.clear();
+  cache.size = 0;
+}
+
+void clearKeySwitchCache(const FHEcontext& context)
+{
+  KSCache& cache = ksCache();
+  std::lock_guard<std::mutex> lock(cache.mtx);
+  for (auto it = cache.entries.begin(); it != cache.entries.end(); )
+    if (it->context == context.getId()) {
+      cache.size -= it->bytes;
+      it = cache.entries.erase(it);
     }
+    else ++it;
+}
+
+// Returns at least n of the pseudorandom a_i's of W, from the cache if
+// possible, else generating them (and caching them if the budget allows).
+static shared_ptr<const vector<DoubleCRT>>
+keySwitchRandomRows(const FHEcontext& context, const KeySwitch& W, long n)
+{
+  KSCache& cache = ksCache();
+  {std::lock_guard<std::mutex> lock(cache.mtx);
+   for (auto it = cache.entries.begin(); it != cache.entries.end(); ++it)
+     if (it->context == context.getId() && it->seed == W.prgSeed
+         && long(it->rows->size()) >= n) {
+       cache.entries.splice(cache.entries.begin(), cache.entries, it);
+       return it->rows;
+     }
+  }
+
+  // Objects to hold the pseudorandom ai's, note that they must be defined
+  // over the same primes as the b's of W (all the levels, unless W is
+  // trimmed), else the PRG will go out of synch.
+  IndexSet allPrimes = W.b.empty()? (context.ctxtPrimes | context.specialPrimes)
+                                  : W.b[0].getIndexSet();
+  auto rows = make_shared<vector<DoubleCRT>>(n, DoubleCRT(context, allPrimes));
+
+  // The ai's are generated sequentially, using the evolving RNG state
+  {FHE_NTIMER_START(KS_prg);
+   RandomState state; // backup the NTL PRG seed
+   NTL::SetSeed(W.prgSeed);
+   for (auto& a: *rows) a.randomize();
+  } // restore random state upon destruction of the RandomState, see NumbTh.h
+
+  long stride = RowSlab(context.zMStar.getPhiM()).getStride();
+  long bytes = n * allPrimes.card() * stride * sizeof(long);
+  std::lock_guard<std::mutex> lock(cache.mtx);
+  if (bytes <= cache.budget) {
+    // drop older (possibly shorter) entries for the same matrix
+    for (auto it = cache.entries.begin(); it != cache.entries.end(); )
+      if (it->context == context.getId() && it->seed == W.prgSeed) {
+        cache.size -= it->bytes;
+        it = cache.entries.erase(it);
+      }
+      else ++it;
+    cache.entries.push_front(KSCacheEntry{context.getId(), W.prgSeed, rows, bytes});
+    cache.size += bytes;
+    cache.evict();
+  }
+  return rows;
+}
+
+// Multiply vector of digits by key-switching matrix and add to *this.
+// It is assumed that W has at least as many b[i]'s as there are digits.
+void Ctxt::keySwitchDigits(const KeySwitch& W,
+                           const vector<DoubleCRT>& digits)
+{
+  if (digits.size()==0) return;
+  countKeySwitch(); // for the recryption profiles, see telemetry.h
+  addMetric(METRIC_KEY_SWITCHES);
+  MetricTimer latency(METRIC_KEY_SWITCH_SECONDS);
+  if (CostCounter *cost = getCostCounter())
+    cost->countKeySwitch(digits.size(), digits[0].getIndexSet().card());
+
+  // The pseudorandom ai's, regenerated from W.prgSeed or cached
+  shared_ptr<const vector<DoubleCRT>> ai
+    = keySwitchRandomRows(context, W, digits.size());
+
+  // Compute sum_i digit[i]*b[i] and sum_i digit[i]*a[i], in parallel over
+  // the primes, relative to the IndexSet of the digits
+  DoubleCRT sumB(context, IndexSet::emptySet());
+  DoubleCRT sumA(context, IndexSet::emptySet());
+  {FHE_NTIMER_START(KS_loop);
+   DoubleCRT::dualInnerProduct(sumB, sumA, digits, W.b, *ai);
   }
-} // restore random state upon destruction of the RandomState, see NumbTh.h
+
+  // add sum digit*a[i] with a handle pointing to base of W.toKeyID
+  this->addPart(std::move(sumA), SKHandle(1,1,W.toKeyID), /*matchPrimeSet=*/true);
+  // add sum digit*b[i] with a handle pointing to one
+  this->addPart(std::move(sumB), SKHandle(), /*matchPrimeSet=*/true);
+}
 
 
 
@@ -247,6 +376,10 @@ Ctxt::Ctxt(const FHEPubKey& newPubKey, long newPtxtSpace):
   primeSet=context.ctxtPrimes;
   intFactor = 1;
   ratFactor = 1.0;
+  lazyRelin = false;
+  circuitNode = -1;
+  traceId = -1;
+  addMetric(METRIC_CTXTS_CREATED);
 }
 
 // Constructor
@@ -261,6 +394,10 @@ Ctxt::Ctxt(ZeroCtxtLike_type, const Ctxt& ctxt):
   primeSet=context.ctxtPrimes;
   intFactor = 1;
   ratFactor = 1.0;
+  lazyRelin = false;
+  circuitNode = -1;
+  traceId = -1;
+  addMetric(METRIC_CTXTS_CREATED);
 }
 
 
@@ -278,9 +415,41 @@ Ctxt& Ctxt::privateAssign(const Ctxt& other)
   noiseBound  = other.noiseBound;
   intFactor = other.intFactor;
   ratFactor = other.ratFactor;
+  prgSeed = other.prgSeed;
+  lazyRelin = other.lazyRelin;
+  circuitNode = other.circuitNode;
+  traceId = other.traceId;
   return *this;
 }
 
+Ctxt& Ctxt::privateAssign(Ctxt&& other)
+{
+  FHE_TIMER_START;
+  if (this == &other) return *this; // both point to the same object
+
+  parts = std::move(other.parts);
+  other.parts.clear();
+  primeSet = std::move(other.primeSet);
+  ptxtSpace = other.ptxtSpace;
+  noiseBound  = other.noiseBound;
+  intFactor = other.intFactor;
+  ratFactor = other.ratFactor;
+  swap(prgSeed, other.prgSeed);
+  lazyRelin = other.lazyRelin;
+  circuitNode = other.circuitNode;
+  traceId = other.traceId;
+  return *this;
+}
+
+long Ctxt::memoryUsage() const
+{
+  long n = sizeof(Ctxt) + primeSet.memoryUsage() - sizeof(IndexSet)
+    + memBytes(prgSeed) + (parts.capacity()-parts.size())*sizeof(CtxtPart);
+  for (const CtxtPart& part: parts)
+    n += part.memoryUsage() + sizeof(CtxtPart) - sizeof(DoubleCRT);
+  return n;
+}
+
 // explicitly multiply intFactor by e, which should be
 // in the interval [0, ptxtSpace)
 void Ctxt::mulIntFactor(long e)
@@ -346,6 +515,8 @@ void Ctxt::bringToSet(const IndexSet& s)
 void Ctxt::modDownToSet(const IndexSet &s)
 {
   FHE_TIMER_START;
+  CtxtOpProbe probe(CTXT_OP_MODDOWN, *this, __func__);
+  CtxtTraceProbe trace(TRACE_MODDOWN, *this);
   IndexSet intersection = primeSet & s;
   if (empty(intersection)) {
     cerr << "modDownToSet called from "<<primeSet<<" to "<<s<<endl;
@@ -409,6 +580,89 @@ void Ctxt::modDownToSet(const IndexSet &s)
   FHE_TIMER_STOP;
 }
 
+xdouble Ctxt::targetRatFactor() const
+{
+  const FHEcontext& context = getContext();
+  xdouble target = (context.ckksScale.targetBits > 0)?
+    power2_xdouble(context.ckksScale.targetBits)
+    : to_xdouble(context.alMod.getCx().encodeScalingFactor());
+  xdouble minFactor = modSwitchAddedNoiseBound()*context.alMod.getPPowR();
+  return (target < minFactor)? minFactor : target;
+}
+
+void Ctxt::rescale()
+{
+  FHE_TIMER_START;
+  assert(isCKKS());
+  if (isEmpty()) return;
+
+  // Dropping primes of total log d leaves a factor of ratFactor/e^d, so
+  // look for a set of size between logQ-excess and a few bits above it
+  double excess = log(ratFactor) - log(targetRatFactor());
+  if (excess < log(2.0)) return;
+  double lo = logOfPrimeSet() - excess;
+  IndexSet s = context.modSizes.getSet4Size(lo, lo + 5*log(2.0),
+                                            primeSet, /*reverse=*/true);
+  if (empty(s) || s == primeSet || context.logOfProduct(s) < lo) return;
+  bringToSet(s);
+}
+
+void Ctxt::rescaleToSet(const IndexSet& s, const xdouble& factor)
+{
+  assert(isCKKS());
+  modUpToSet(s); // a no-op if s <= primeSet
+  IndexSet setDiff = primeSet / s;
+  if (empty(setDiff)) return;
+
+  // The factor after dropping setDiff would be ratFactor/prod(setDiff). A
+  // multiplier k>1 is exact, so this only ever scales up.
+  xdouble k = factor*xexp(context.logOfProduct(setDiff))/ratFactor;
+  if (k >= 1.5) {
+    ZZ kk = conv<ZZ>(floor(k + 0.5));
+    multByConstant(kk);
+    ratFactor *= conv<xdouble>(kk);
+  }
+  modDownToSet(s);
+}
+
+long Ctxt::levelsLeft() const
+{
+  assert(isCKKS());
+  double bitsPerLevel = context.ckksScale.autoRescale?
+    log(targetRatFactor()) : log(getNoiseBound());
+  bitsPerLevel = std::max(bitsPerLevel, log(2.0));
+  double spare = capacity() - log(context.alMod.getPPowR());
+  return (spare > 0)? long(spare/bitsPerLevel) : 0;
+}
+
+long ckksBitsForLevels(const FHEcontext& context, long levels)
+{
+  assert(levels >= 0);
+  long bitsPerLevel = (context.ckksScale.targetBits > 0)?
+    context.ckksScale.targetBits
+    : NTL::NumBits(context.alMod.getCx().encodeScalingFactor()) - 1;
+
+  // A fresh ciphertext has a noise bound of about its factor, and after the
+  // last level r bits must be left above the noise; 5 bits of slack cover
+  // the granularity of the prime sets that rescale can choose from
+  return (levels+1)*bitsPerLevel + context.alMod.getR() + 5;
+}
+
+// Under context.ckksScale.autoRescale, the level at which two operands
+// meet: the lower of their prime sets if it is contained in the other
+// one, otherwise the cheapest set of (at most) the smaller size
+static IndexSet ckksCommonSet(const Ctxt& c1, const Ctxt& c2)
+{
+  const FHEcontext& context = c1.getContext();
+  const IndexSet& s1 = c1.getPrimeSet();
+  const IndexSet& s2 = c2.getPrimeSet();
+  if (s1 <= s2) return s1;
+  if (s2 <= s1) return s2;
+  double hi = std::min(c1.logOfPrimeSet(), c2.logOfPrimeSet());
+  return context.modSizes.getSet4Size(hi - 5*log(2.0), hi, s1, s2,
+                                      /*reverse=*/false);
+}
+
 void Ctxt::blindCtxt(const ZZX& poly)
 {
   Ctxt tmp(pubKey);
@@ -499,17 +753,44 @@ void Ctxt::dropSmallAndSpecialPrimes()
   }
 }
 
+void Ctxt::trimPrimes(long marginBits)
+{
+  if (isEmpty() || isCKKS() || noiseBound <= 0.0) return;
+  if (!primeSet.disjointFrom(context.specialPrimes)) return;
+
+  // After dropping to log(q') = low, the noise is 2^marginBits times the
+  // mod-switching added noise. A set up to 3 bits above that is as good,
+  // and may be cheaper to reach.
+  double low = capacity() + log(modSwitchAddedNoiseBound())
+               + marginBits*log(2.0);
+  if (low >= logOfPrimeSet()) return;
+  IndexSet target = primeSet &
+    context.modSizes.getSet4Size(low, low + 3*log(2.0), primeSet,
+                                 /*reverse=*/true);
+  if (target != primeSet && context.logOfProduct(target) >= low)
+    modDownToSet(target);
+}
+
+// The PrimeTrimMode hook of the operations
+static void eagerTrim(Ctxt& ctxt)
+{
+  const PrimeTrimMode& mode = ctxt.getContext().primeTrim;
+  if (mode.eager) ctxt.trimPrimes(mode.marginBits);
+}
+
 
 // key-switch to (1,s_i), s_i is the base key with index keyID. If
 // keyID<0 then re-linearize to any key for which a switching matrix exists
 void Ctxt::reLinearize(long keyID)
 {
   FHE_TIMER_START;
+  CtxtOpProbe probe(CTXT_OP_RELINEARIZE, *this, __func__);
   // Special case: if *this is empty or already re-linearized then do nothing
   if (this->isEmpty() || this->inCanonicalForm(keyID)) return;
   // this->reduce();
 
   dropSmallAndSpecialPrimes();
+  eagerTrim(*this); // fewer primes to key-switch
 
   long g = ptxtSpace;
   Ctxt tmp(pubKey, ptxtSpace); // an empty ciphertext, same plaintext space
@@ -538,7 +819,9 @@ void Ctxt::reLinearize(long keyID)
       assert (g>1);
       tmp.ptxtSpace = g;
     }    
-    tmp.keySwitchPart(part, W); // switch this part & update noiseBound
+    // switch this part & update noiseBound, with a trimmed variant of W
+    // if there is one for the primes of this part
+    tmp.keySwitchPart(part, pubKey.getTrimmedKSWmatrix(W, part.getIndexSet()));
   }
   *this = tmp;
 }
@@ -588,7 +871,7 @@ void Ctxt::keySwitchPart(const CtxtPart& p, const KeySwitch& W)
   // during homormophic evaluation, so it should be thoroughly optimized.
 
   vector<DoubleCRT> polyDigits;
-  p.breakIntoDigits(polyDigits, nDigits);
+  p.breakIntoDigits(polyDigits, nDigits, W.getDigits(context));
 
   // Finally we multiply the vector of digits by the key-switching matrix
   keySwitchDigits(W, polyDigits);
@@ -650,9 +933,31 @@ void Ctxt::addPart(const DoubleCRT& part, const SKHandle& handle,
   }
 }
 
+void Ctxt::addPart(DoubleCRT&& part, const SKHandle& handle, 
+		   bool matchPrimeSet, bool negative)
+{
+  assert (&part.getContext() == &context);
+
+  if (parts.size()>0 && part.getIndexSet() <= primeSet) {
+    IndexSet s = primeSet / part.getIndexSet();
+    if (!empty(s)) part.addPrimesAndScale(s); // mod-UP in place
+  }
+
+  if (parts.size()==0 ||
+      (part.getIndexSet()==primeSet && getPartIndexByHandle(handle)<0)) {
+    // a new part, take over the residues of part
+    if (parts.size()==0) primeSet = part.getIndexSet();
+    parts.push_back(CtxtPart(std::move(part),handle));
+    if (negative) parts.back().Negate();
+  }
+  else // add it to an existing part, or match the prime-sets first
+    addPart(part, handle, matchPrimeSet, negative);
+}
+
 // Add a constant polynomial
 void Ctxt::addConstant(const DoubleCRT& dcrt, double size)
 {
+  CircuitProbe circuit(CIRCUIT_CONSTANT, *this);
   if (getContext().alMod.getTag()==PA_cx_tag) {
     addConstantCKKS(dcrt, to_xdouble(size));
     return;
@@ -690,9 +995,17 @@ void Ctxt::addConstant(const DoubleCRT& dcrt, double size)
   addPart(tmp, SKHandle(0,1,0));
 }
 
+void Ctxt::addConstant(const EncodedPlaintext& ptxt)
+{
+  if (&ptxt.getContext() != &context)
+    Error("Ctxt::addConstant: incompatible contexts");
+  addConstant(*ptxt.getDCRT(primeSet), ptxt.getSize());
+}
+
 // Add a constant polynomial
 void Ctxt::addConstant(const ZZ& c)
 {
+  CircuitProbe circuit(CIRCUIT_CONSTANT, *this);
   if (isCKKS()) {
     addConstantCKKS(c);
     return;
@@ -714,6 +1027,7 @@ void addSomePrimes(Ctxt& c);
 
 void Ctxt::addConstantCKKS(const DoubleCRT& dcrt, xdouble size, xdouble factor)
 {
+  CircuitProbe circuit(CIRCUIT_CONSTANT, *this);
   if (factor<1.0)
     conv(factor, getContext().alMod.getCx().encodeScalingFactor());
 
@@ -772,6 +1086,7 @@ void Ctxt::addConstantCKKS(const ZZ& c)
 // Add the rational constant num.first / num.second
 void Ctxt::addConstantCKKS(std::pair<long,long> num)
 {
+  CircuitProbe circuit(CIRCUIT_CONSTANT, *this);
 #if 1
   // Check if you need to scale up to get target accuracy of 2^{-r}
   xdouble xb = to_xdouble(num.second);        // denominator
@@ -828,6 +1143,7 @@ void addSomePrimes(Ctxt& c)
 
 void Ctxt::negate()
 {
+  CircuitProbe circuit(CIRCUIT_CONSTANT, *this);
   for (size_t i=0; i<parts.size(); i++) parts[i].Negate();
 }
 
@@ -894,9 +1210,30 @@ NoiseNorm(xdouble noise1, xdouble noise2, long e1, long e2, long p)
 }
 
 // Add/subtract another ciphertxt (depending on the negative flag)
-void Ctxt::addCtxt(const Ctxt& other, bool negative)
+void Ctxt::addCtxt(Ctxt&& other, bool negative)
+{
+  assert (&context==&other.context && &pubKey==&other.pubKey);
+
+  if (this == &other) { // other is also *this, nothing to cannibalize
+    addCtxt(other, negative, nullptr);
+    return;
+  }
+  if (this->isEmpty()) { // just take over other
+    *this = std::move(other);
+    if (negative) negate();
+    return;
+  }
+  addCtxt(other, negative, &other);
+}
+
+void Ctxt::addCtxt(const Ctxt& other_arg, bool negative, Ctxt* spare)
 {
   FHE_TIMER_START;
+  const Ctxt* operand = &other_arg;
+  CircuitProbe circuit(CIRCUIT_ADD, *this, &operand);
+  if (operand != &other_arg) spare = nullptr; // a refreshed copy, keep it
+  CtxtTraceProbe trace(TRACE_ADD, *this, operand, negative);
+  const Ctxt& other = *operand;
 
   // Sanity check: same context and public key
   assert (&context==&other.context && &pubKey==&other.pubKey);
@@ -914,7 +1251,9 @@ void Ctxt::addCtxt(const Ctxt& other, bool negative)
   else // BGV
     this->reducePtxtSpace(other.getPtxtSpace());
 
-  Ctxt tmp(pubKey, other.ptxtSpace); // a temporary empty ciphertext
+  Ctxt localTmp(pubKey, other.ptxtSpace); // a temporary empty ciphertext
+  // When other is spare we modify it directly: tmp=other is then a no-op
+  Ctxt& tmp = (spare != nullptr)? *spare : localTmp;
   const Ctxt* other_pt = &other;
 
 
@@ -925,6 +1264,21 @@ void Ctxt::addCtxt(const Ctxt& other, bool negative)
     other_pt = &tmp;
   }
 
+  // Under automatic scale management, meet at the lower level instead,
+  // with the factor of the operand that is already there
+  if (isCKKS() && context.ckksScale.autoRescale
+      && primeSet != other_pt->primeSet) {
+    IndexSet common = ckksCommonSet(*this, *other_pt);
+    if (!empty(common)) {
+      xdouble factor = (primeSet == common)? ratFactor : other_pt->ratFactor;
+      rescaleToSet(common, factor);
+      if (other_pt->primeSet != common) {
+        if (other_pt != &tmp) { tmp = other; other_pt = &tmp; }
+        tmp.rescaleToSet(common, factor);
+      }
+    }
+  }
+
   // Match the prime-sets, mod-UP the arguments if needed
   IndexSet s = other_pt->primeSet / primeSet; // set-minus
   if (!empty(s)) modUpToSet(s);
@@ -1008,11 +1362,14 @@ void Ctxt::addCtxt(const Ctxt& other, bool negative)
       if (negative) parts[j] -= part;
       else          parts[j] += part;
     } else {    // no mathing part found, just append this part
-      parts.push_back(part);
+      if (spare != nullptr) parts.push_back(std::move(spare->parts[i]));
+      else                  parts.push_back(part);
       if (negative) parts.back().Negate(); // not thread safe??
     }
   }
   noiseBound += other_pt->noiseBound;
+  if (spare != nullptr) spare->clear(); // some of its parts were moved out
+  eagerTrim(*this);
 }
 
 //long fhe_disable_intFactor = 0;
@@ -1153,9 +1510,14 @@ IndexSet Ctxt::naturalPrimeSet() const
 
 
 // This is essentially operator*=, but with an extra parameter
-void Ctxt::multLowLvl(const Ctxt& other_orig, bool destructive)
+void Ctxt::multLowLvl(const Ctxt& other_arg, bool destructive)
 {
   FHE_TIMER_START;
+  const Ctxt* operand = &other_arg;
+  CircuitProbe circuit(CIRCUIT_MULTIPLY, *this, &operand);
+  if (operand != &other_arg) destructive = false; // a refreshed copy
+  CtxtTraceProbe trace(TRACE_MULTIPLY, *this, operand);
+  const Ctxt& other_orig = *operand;
 
   // Special case: if *this is empty then do nothing
   if (this->isEmpty()) 
@@ -1178,8 +1540,10 @@ void Ctxt::multLowLvl(const Ctxt& other_orig, bool destructive)
 
   Ctxt* other_pt = nullptr;
   unique_ptr<Ctxt> ct; // scratch space if needed
+  bool managed = isCKKS() && context.ckksScale.autoRescale;
   if (this == &other_orig) { // squaring
-    bringToSet(naturalPrimeSet()); // drop to the "natural" primeSet
+    if (!managed)
+      bringToSet(naturalPrimeSet()); // drop to the "natural" primeSet
     other_pt = this;
   }
   else { // real multiplication
@@ -1199,22 +1563,31 @@ void Ctxt::multLowLvl(const Ctxt& other_orig, bool destructive)
       ptxtSpace = other_pt->ptxtSpace = g;
     }
 
-    // Compute commonPrimeSet, which defines the modulus q of the product
-
-    // To do this, we first compute an interval [lo, hi] in which
-    // log(q) should lie in order to properly manage noise growth
-    double lo, hi;
-    computeIntervalForMul(lo, hi, *this, *other_pt);
-
-    // We then compute commonPrimeSet in a way that minimizes
-    // the computational cost of dropping to it
-    IndexSet commonPrimeSet = 
-      context.modSizes.getSet4Size(lo, hi,
-                                   primeSet, other_pt->primeSet, isCKKS());
-
-    // drop the prime sets of *this and other
-    bringToSet(commonPrimeSet);
-    other_pt->bringToSet(commonPrimeSet);
+    if (managed) { // the noise is kept in check by rescaling afterwards
+      IndexSet common = ckksCommonSet(*this, *other_pt);
+      if (!empty(common)) {
+        rescaleToSet(common, ratFactor);
+        other_pt->rescaleToSet(common, other_pt->ratFactor);
+      }
+    }
+    else {
+      // Compute commonPrimeSet, which defines the modulus q of the product
+
+      // To do this, we first compute an interval [lo, hi] in which
+      // log(q) should lie in order to properly manage noise growth
+      double lo, hi;
+      computeIntervalForMul(lo, hi, *this, *other_pt);
+
+      // We then compute commonPrimeSet in a way that minimizes
+      // the computational cost of dropping to it
+      IndexSet commonPrimeSet = 
+        context.modSizes.getSet4Size(lo, hi,
+                                     primeSet, other_pt->primeSet, isCKKS());
+
+      // drop the prime sets of *this and other
+      bringToSet(commonPrimeSet);
+      other_pt->bringToSet(commonPrimeSet);
+    }
   }
 
   // Perform the actual tensor product
@@ -1228,15 +1601,33 @@ void Ctxt::multLowLvl(const Ctxt& other_orig, bool destructive)
 
   tmpCtxt.tensorProduct(*this, *other_pt);
   *this = tmpCtxt;
+  if (managed) rescale(); // back to the target factor
+  eagerTrim(*this);
 }
 
 
 // Higher-level multiply routines that include also modulus-switching
 // and re-linearization
 
-void Ctxt::multiplyBy(const Ctxt& other)
+// Returns c itself, unless c has a pending lazy re-linearization. In that
+// case returns a re-linearized copy of c, kept in scratch.
+static const Ctxt& settledCopy(const Ctxt& c, unique_ptr<Ctxt>& scratch)
+{
+  long keyID = c.getKeyID();
+  if (!c.isLazyRelin() || c.inCanonicalForm(keyID)) return c;
+  scratch.reset(new Ctxt(c));
+  scratch->reLinearize(keyID);
+  return *scratch;
+}
+
+void Ctxt::multiplyBy(const Ctxt& other_arg)
 {
   FHE_TIMER_START;
+  const Ctxt* operand = &other_arg;
+  CircuitProbe circuit(CIRCUIT_MULTIPLY, *this, &operand);
+  const Ctxt& other = *operand;
+  CtxtOpProbe probe(CTXT_OP_MULTIPLY, *this, __func__, &other);
+  CtxtTraceProbe trace(TRACE_MULTIPLY, *this, &other);
   // Special case: if *this is empty then do nothing
   if (this->isEmpty()) return;
 
@@ -1245,31 +1636,40 @@ void Ctxt::multiplyBy(const Ctxt& other)
     return;
   }
 
-  *this *= other;  // perform the multiplication
+  // Settle any pending re-linearization of the inputs
+  if (lazyRelin) reLinearize(getKeyID());
+  unique_ptr<Ctxt> tmp;
+  *this *= settledCopy(other, tmp);  // perform the multiplication
   decryptAndPrint(cout<<"*** multiplyBy, after tensorProduct ",
                   *this, *dbgKey, *dbgEa);
-  reLinearize();   // re-linearize
+  if (!lazyRelin) reLinearize();   // re-linearize
 #ifdef DEBUG_PRINTOUT
       checkNoise(*this, *dbgKey, "reLinearize " + to_string(size_t(this)));
 #endif
 }
 
-void Ctxt::multiplyBy2(const Ctxt& other1, const Ctxt& other2)
+void Ctxt::multiplyBy2(const Ctxt& other1_orig, const Ctxt& other2_orig)
 {
   FHE_TIMER_START;
   // Special case: if *this is empty then do nothing
   if (this->isEmpty()) return;
 
-  if (other1.isEmpty()) {
-    *this = other1;
+  if (other1_orig.isEmpty()) {
+    *this = other1_orig;
     return;
   }
 
-  if (other2.isEmpty()) {
-    *this = other2;
+  if (other2_orig.isEmpty()) {
+    *this = other2_orig;
     return;
   }
 
+  // Settle any pending re-linearization of the inputs
+  if (lazyRelin) reLinearize(getKeyID());
+  unique_ptr<Ctxt> scratch1, scratch2;
+  const Ctxt& other1 = settledCopy(other1_orig, scratch1);
+  const Ctxt& other2 = settledCopy(other2_orig, scratch2);
+
   long cap = capacity();
   long cap1 = other1.capacity();
   long cap2 = other2.capacity();
@@ -1280,7 +1680,7 @@ void Ctxt::multiplyBy2(const Ctxt& other1, const Ctxt& other2)
     else                    tmp *= other2;
 
     *this *= tmp;
-    reLinearize(); // re-linearize after all the multiplications
+    if (!lazyRelin) reLinearize(); // re-linearize after all the multiplications
     return;
   }
 
@@ -1303,12 +1703,14 @@ void Ctxt::multiplyBy2(const Ctxt& other1, const Ctxt& other2)
     *this *= *first;
     *this *= *second;
   }
-  reLinearize(); // re-linearize after all the multiplications
+  if (!lazyRelin) reLinearize(); // re-linearize after all the multiplications
 }
 
 // Multiply-by-constant
 void Ctxt::multByConstant(const ZZ& c)
 {
+  CircuitProbe circuit(CIRCUIT_CONSTANT, *this);
+  CtxtTraceProbe trace(TRACE_MULT_CONSTANT, *this);
   // Special case: if *this is empty then do nothing
   if (this->isEmpty()) return;
   FHE_TIMER_START;
@@ -1327,12 +1729,15 @@ void Ctxt::multByConstant(const ZZ& c)
 
   // multiply all the parts by this constant
   for (long i: range(parts.size())) parts[i] *= c_copy;
+  eagerTrim(*this);
 }
 
 // Multiply-by-constant, it is assumed that the size of this
 // constant fits in a double float
 void Ctxt::multByConstant(const DoubleCRT& dcrt, double size)
 {
+  CircuitProbe circuit(CIRCUIT_CONSTANT, *this);
+  CtxtTraceProbe trace(TRACE_MULT_CONSTANT, *this);
   FHE_TIMER_START;
   if (isCKKS()) {
     multByConstantCKKS(dcrt, to_xdouble(size));
@@ -1353,11 +1758,43 @@ void Ctxt::multByConstant(const DoubleCRT& dcrt, double size)
     parts[i].Mul(dcrt,/*matchIndexSets=*/false);
 
   noiseBound *= size;
+  eagerTrim(*this);
+}
+
+void Ctxt::mulAddConstant(const Ctxt& other, const DoubleCRT& dcrt,
+                          double size)
+{
+  FHE_TIMER_START;
+  if (other.isEmpty()) return;
+
+  // The circuit hook and the tracer see the two steps
+  bool fused = !isEmpty() && !isCKKS() && &context == &other.context
+    && getCircuitHook() == NULL && getCtxtTracer() == NULL
+    && primeSet == other.primeSet && primeSet <= dcrt.getIndexSet()
+    && ptxtSpace == other.ptxtSpace && intFactor == other.intFactor
+    && parts.size() == other.parts.size();
+  for (long i: range(parts.size()))
+    if (fused && parts[i].skHandle != other.parts[i].skHandle) fused = false;
+  if (!fused) {
+    Ctxt tmp(other);
+    tmp.multByConstant(dcrt, size);
+    *this += tmp;
+    return;
+  }
+
+  if (size < 0.0)
+    size = context.noiseBoundForUniform(double(ptxtSpace)/2.0,
+                                        context.zMStar.getPhiM());
+  for (long i: range(parts.size()))
+    parts[i].addMul(other.parts[i], dcrt);
+  noiseBound += other.noiseBound * size;
+  eagerTrim(*this);
 }
 
 void Ctxt::multByConstant(const ZZX& poly, double size)
 {
   FHE_TIMER_START;
+  CtxtTraceProbe trace(TRACE_MULT_CONSTANT, *this);
   if (this->isEmpty()) return;
   DoubleCRT dcrt(poly,context,primeSet);
   multByConstant(dcrt,size);
@@ -1366,13 +1803,39 @@ void Ctxt::multByConstant(const ZZX& poly, double size)
 void Ctxt::multByConstant(const zzX& poly, double size)
 {
   FHE_TIMER_START;
+  CtxtTraceProbe trace(TRACE_MULT_CONSTANT, *this);
   if (this->isEmpty()) return;
   DoubleCRT dcrt(poly,context,primeSet);
   multByConstant(dcrt,size);
 }
 
+// The form may have more primes than the ciphertext, which
+// DoubleCRT::Mul ignores
+void Ctxt::multByConstant(const EncodedPlaintext& ptxt)
+{
+  if (&ptxt.getContext() != &context)
+    Error("Ctxt::multByConstant: incompatible contexts");
+  if (this->isEmpty()) return;
+  multByConstant(*ptxt.getDCRT(primeSet), ptxt.getSize());
+}
+
+void Ctxt::xorConstant(const EncodedPlaintext& ptxt)
+{
+  if (&ptxt.getContext() != &context)
+    Error("Ctxt::xorConstant: incompatible contexts");
+  xorConstant(*ptxt.getDCRT(primeSet), ptxt.getSize());
+}
+
+void Ctxt::nxorConstant(const EncodedPlaintext& ptxt)
+{
+  if (&ptxt.getContext() != &context)
+    Error("Ctxt::nxorConstant: incompatible contexts");
+  nxorConstant(*ptxt.getDCRT(primeSet), ptxt.getSize());
+}
+
 void Ctxt::multByConstantCKKS(const DoubleCRT& dcrt, xdouble size, ZZ factor)
 {
+  CircuitProbe circuit(CIRCUIT_CONSTANT, *this);
   // Special case: if *this is empty then do nothing
   if (this->isEmpty()) return;
 
@@ -1394,12 +1857,14 @@ void Ctxt::multByConstantCKKS(const DoubleCRT& dcrt, xdouble size, ZZ factor)
 
 void Ctxt::multByConstantCKKS(std::pair<long,long> num)
 {
+  CircuitProbe circuit(CIRCUIT_CONSTANT, *this);
   multByConstant(to_ZZ(num.first)); // multiply by numerator
   ratFactor *= num.second;    // increase the scaling factor  
 }
 
 void Ctxt::multByConstantCKKS(double x)
 {
+  CircuitProbe circuit(CIRCUIT_CONSTANT, *this);
   xdouble target = ratFactor/x;
   if (target < getContext().alMod.getCx().encodeScalingFactor())
     multByConstantCKKS(rationalApprox(x)); // "actual multiplication"
@@ -1417,6 +1882,7 @@ void Ctxt::multByConstantCKKS(double x)
 // FIXME: is this still needed/used?
 void Ctxt::divideBy2()
 {
+  CircuitProbe circuit(CIRCUIT_CONSTANT, *this);
   // Special case: if *this is empty then do nothing
   if (this->isEmpty()) return;
   assert (ptxtSpace % 2 == 0 && ptxtSpace>2);
@@ -1440,6 +1906,7 @@ void Ctxt::divideBy2()
 // As a side-effect, the plaintext space is reduced from p^r to p^{r-1}.
 void Ctxt::divideByP()
 {
+  CircuitProbe circuit(CIRCUIT_CONSTANT, *this);
   // Special case: if *this is empty then do nothing
   if (this->isEmpty()) return;
 
@@ -1460,6 +1927,7 @@ void Ctxt::divideByP()
 
 void Ctxt::automorph(long k) // Apply automorphism F(X)->F(X^k) (gcd(k,m)=1)
 {
+  CircuitProbe circuit(CIRCUIT_AUTOMORPH, *this);
   FHE_TIMER_START;
   // Special case: if *this is empty then do nothing
   if (this->isEmpty()) return;
@@ -1468,6 +1936,9 @@ void Ctxt::automorph(long k) // Apply automorphism F(X)->F(X^k) (gcd(k,m)=1)
   assert (context.zMStar.inZmStar(k));
   long m = context.zMStar.getM();
 
+  // A pending lazy re-linearization must be done before the automorphism
+  if (lazyRelin) reLinearize(getKeyID());
+
   // Apply this automorphism to all the parts
   for (long i: range(parts.size())) { 
     parts[i].automorph(k);
@@ -1480,6 +1951,7 @@ void Ctxt::automorph(long k) // Apply automorphism F(X)->F(X^k) (gcd(k,m)=1)
 }
 void Ctxt::complexConj() //  Complex conjugate, same as automorph(m-1)
 {
+  CircuitProbe circuit(CIRCUIT_AUTOMORPH, *this);
   FHE_TIMER_START;
   // Special case: if *this is empty then do nothing
   if (this->isEmpty()) return;
@@ -1500,7 +1972,10 @@ void Ctxt::complexConj() //  Complex conjugate, same as automorph(m-1)
 // result of every step.
 void Ctxt::smartAutomorph(long k) 
 {
+  CircuitProbe circuit(CIRCUIT_AUTOMORPH, *this);
   FHE_TIMER_START;
+  CtxtOpProbe probe(CTXT_OP_AUTOMORPH, *this, __func__);
+  CtxtTraceProbe trace(TRACE_AUTOMORPH, *this, NULL, k);
 
   // A hack: record this automorphism rather than actually performing it
   if (isSetAutomorphVals()) { // defined in NumbTh.h
@@ -1548,6 +2023,7 @@ void Ctxt::smartAutomorph(long k)
 // applies the Frobenius automorphism p^j
 void Ctxt::frobeniusAutomorph(long j) 
 {
+  CircuitProbe circuit(CIRCUIT_AUTOMORPH, *this);
   FHE_TIMER_START;
   // Special case: if *this is empty then do nothing
   if (this->isEmpty() || j==0) return;
@@ -1567,6 +2043,149 @@ void Ctxt::frobeniusAutomorph(long j)
 }
 
 
+/********************************************************************/
+// Hoisted automorphisms: break the ciphertext into digits once, then
+// apply many automorphisms to the digits
+
+BasicAutomorphPrecon::BasicAutomorphPrecon(const Ctxt& _ctxt)
+  : ctxt(_ctxt), noise(1.0)
+{
+  FHE_TIMER_START;
+  if (ctxt.parts.size() >= 1) assert(ctxt.parts[0].skHandle.isOne());
+  if (ctxt.parts.size() <= 1) return; // nothing to do
+
+  ctxt.cleanUp();
+  const FHEcontext& context = ctxt.getContext();
+  const FHEPubKey& pubKey = ctxt.getPubKey();
+  long keyID = ctxt.getKeyID();
+
+  // The call to cleanUp() should ensure that this assertions passes.
+  assert(ctxt.inCanonicalForm(keyID));
+
+  // Compute the number of digits that we need and the esitmated
+  // added noise from switching this ciphertext.
+  long nDigits;
+  std::tie(nDigits, noise)
+    = ctxt.computeKSNoise(1, pubKey.keySWlist().at(0));
+
+  double logProd = context.logOfProduct(context.specialPrimes);
+  noise += ctxt.getNoiseBound() * xexp(logProd);
+
+  // Break the ciphertext part into digits, if needed, and scale up these
+  // digits using the special primes.
+
+  ctxt.parts[1].breakIntoDigits(polyDigits, nDigits);
+}
+
+shared_ptr<Ctxt> BasicAutomorphPrecon::automorph(long k) const
+{
+  FHE_TIMER_START;
+
+  // A hack: record this automorphism rather than actually performing it
+  if (isSetAutomorphVals()) { // defined in NumbTh.h
+    recordAutomorphVal(k);
+    return make_shared<Ctxt>(ctxt);
+  }
+
+  const FHEcontext& context = ctxt.getContext();
+  long m = context.zMStar.getM();
+  k = mcMod(k, m);
+  if (k==1 || ctxt.isEmpty()) return make_shared<Ctxt>(ctxt);// nothing to do
+  assert (context.zMStar.inZmStar(k));
+
+  const FHEPubKey& pubKey = ctxt.getPubKey();
+  shared_ptr<Ctxt> result = make_shared<Ctxt>(ZeroCtxtLike, ctxt); // empty ctxt
+  result->noiseBound = noise; // noise estimate
+  result->intFactor = ctxt.intFactor;
+  result->ratFactor = ctxt.ratFactor;
+
+  if (ctxt.parts.size()==1) { // only constant part, no need to key-switch
+    CtxtPart tmpPart = ctxt.parts[0];
+    tmpPart.automorph(k);
+    tmpPart.addPrimesAndScale(context.specialPrimes);
+    result->addPart(tmpPart, /*matchPrimeSet=*/true);
+    return result;
+  }
+
+  // Ensure that we have a key-switching matrices for this automorphism
+  long keyID = ctxt.getKeyID();
+  if (!pubKey.isReachable(k,keyID)) {
+    throw std::logic_error("no key-switching matrices for k="+std::to_string(k)
+                           + ", keyID="+std::to_string(keyID));
+  }
+
+  // Get the first key-switching matrix for this automorphism
+  const KeySwitch& W = pubKey.getTrimmedKSWmatrix(
+    pubKey.getNextKSWmatrix(k,keyID), ctxt.getPrimeSet(), /*ownDigits=*/false);
+  long amt = W.fromKey.getPowerOfX();
+
+  // Start by rotating the constant part, no need to key-switch it
+  CtxtPart tmpPart = ctxt.parts[0];
+  tmpPart.automorph(amt);
+  tmpPart.addPrimesAndScale(context.specialPrimes);
+  result->addPart(tmpPart, /*matchPrimeSet=*/true);
+
+  // Then rotate the digits and key-switch them
+  vector<DoubleCRT> tmpDigits = polyDigits;
+  for (auto&& tmp: tmpDigits) // rotate each of the digits
+    tmp.automorph(amt);
+
+  result->keySwitchDigits(W, tmpDigits); // key-switch the digits
+
+  if ((amt-k)%m != 0) { // amt != k (mod m), more automorphisms to do
+    k = MulMod(k, InvMod(amt,m), m); // k *= amt^{-1} mod m
+    result->smartAutomorph(k);       // call usual smartAutomorph
+  }
+  return result;
+}
+
+shared_ptr<Ctxt> BasicAutomorphPrecon::frobeniusAutomorph(long j) const
+{
+  if (ctxt.isCKKS()) { // no key-switching to share, just conjugate
+    shared_ptr<Ctxt> result = make_shared<Ctxt>(ctxt);
+    result->frobeniusAutomorph(j);
+    return result;
+  }
+  const PAlgebra& zMStar = ctxt.getContext().zMStar;
+  long m = zMStar.getM();
+  j = mcMod(j, zMStar.getOrdP());
+  return automorph(PowerMod(zMStar.getP() % m, j, m));
+}
+
+shared_ptr<Ctxt> BasicAutomorphPrecon::complexConj() const
+{
+  long m = ctxt.getContext().zMStar.getM();
+  if (ctxt.parts.size() > 1
+      && !ctxt.getPubKey().isReachable(m-1, ctxt.getKeyID())) {
+    shared_ptr<Ctxt> result = make_shared<Ctxt>(ctxt);
+    result->complexConj();
+    return result;
+  }
+  return automorph(m-1);
+}
+
+void BasicAutomorphPrecon::automorph(vector<shared_ptr<Ctxt>>& out,
+                                     const vector<long>& vals) const
+{
+  long n = vals.size();
+  out.resize(n);
+  FHE_EXEC_RANGE(n, first, last)
+    for (long i: range(first, last))
+      out[i] = automorph(vals[i]);
+  FHE_EXEC_RANGE_END
+}
+
+void BasicAutomorphPrecon::frobeniusAutomorphs(vector<shared_ptr<Ctxt>>& out,
+                                               long d) const
+{
+  out.resize(d);
+  FHE_EXEC_RANGE(d, first, last)
+    for (long j: range(first, last))
+      out[j] = frobeniusAutomorph(j);
+  FHE_EXEC_RANGE_END
+}
+
+
 /********************************************************************/
 // Utility methods
 
@@ -1611,6 +2230,13 @@ xdouble Ctxt::modSwitchAddedNoiseBound() const
 
 void Ctxt::write(ostream& str) const
 {
+  if (lazyRelin && !inCanonicalForm(getKeyID())) { // write re-linearized
+    Ctxt tmp(*this);
+    tmp.reLinearize(getKeyID());
+    tmp.write(str);
+    return;
+  }
+  MetricBytesProbe bytes(str);
   writeEyeCatcher(str, BINIO_EYE_CTXT_BEGIN);
   
   /*  Writing out in binary:
@@ -1630,19 +2256,223 @@ void Ctxt::write(ostream& str) const
   writeEyeCatcher(str, BINIO_EYE_CTXT_END);
 }
 
+// Does parts[1] of this ciphertext still come from prgSeed?
+bool Ctxt::seededPartValid() const
+{
+  if (IsZero(prgSeed) || parts.size()!=2 || !parts[0].skHandle.isOne())
+    return false;
+  if (parts[1].getIndexSet() != primeSet) return false;
+
+  DoubleCRT c1(context, primeSet);
+  { RandomState state; // do not disturb the NTL PRG
+    c1.randomize(&prgSeed);
+  }
+  return c1 == parts[1];
+}
+
+void Ctxt::writeCompact(ostream& str) const
+{
+  if (lazyRelin && !inCanonicalForm(getKeyID())) { // write re-linearized
+    Ctxt tmp(*this);
+    tmp.reLinearize(getKeyID());
+    tmp.writeCompact(str);
+    return;
+  }
+  MetricBytesProbe bytes(str);
+  writeEyeCatcher(str, BINIO_EYE_CTXT_COMPACT_BEGIN);
+
+  /*  Writing out in binary:
+    1.  long ptxtSpace, long intFactor, xdouble ratFactor, xdouble noiseBound
+    2.  IndexSet primeSet;
+    3.  long seeded
+    4a. if seeded: ZZ prgSeed, parts[1].skHandle, packed parts[0]
+    4b. otherwise: number of parts, then packed part + skHandle for each
+  */
+
+  write_raw_int(str, ptxtSpace);
+  write_raw_int(str, intFactor);
+  write_raw_xdouble(str, ratFactor);
+  write_raw_xdouble(str, noiseBound);
+  primeSet.write(str);
+
+  bool seeded = seededPartValid();
+  write_raw_int(str, seeded, BINIO_32BIT);
+  if (seeded) {
+    write_raw_ZZ(str, prgSeed);
+    parts[1].skHandle.write(str);
+    parts[0].writePacked(str);
+  }
+  else {
+    write_raw_int(str, parts.size());
+    for (const CtxtPart& part: parts) {
+      part.writePacked(str);
+      part.skHandle.write(str);
+    }
+  }
+  writeEyeCatcher(str, BINIO_EYE_CTXT_COMPACT_END);
+}
+
+IndexSet Ctxt::egressPrimeSet(double marginBits) const
+{
+  if (isCKKS() || isEmpty() || noiseBound <= 0.0) return primeSet;
+
+  // The candidates (not the special primes), largest first
+  vector<long> cands;
+  for (long i: primeSet / context.specialPrimes) cands.push_back(i);
+  stable_sort(cands.begin(), cands.end(), [&](long a, long b) {
+    return context.ithPrime(a) > context.ithPrime(b);
+  });
+
+  // After switching to a set of size logS the noise is about
+  // noiseBound*e^(logS-logQ) + added, and it must stay below
+  // e^logS/2 with marginBits to spare
+  double logQ = logOfPrimeSet();
+  double logNoise = log(noiseBound);
+  double logAdded = log(modSwitchAddedNoiseBound());
+  double margin = (marginBits + 1) * log(2.0);
+
+  IndexSet s;
+  double logS = 0;
+  for (long i: cands) {
+    s.insert(i);
+    if (s == primeSet) break; // nothing to drop
+    logS += log(double(context.ithPrime(i)));
+    double scaled = logNoise + logS - logQ;
+    double hi = max(scaled, logAdded);
+    double logNew = hi + log1p(exp(min(scaled, logAdded) - hi));
+    if (logS - logNew >= margin) return s;
+  }
+  return primeSet;
+}
+
+void Ctxt::prepareEgress(double marginBits)
+{
+  if (lazyRelin && !inCanonicalForm(getKeyID())) reLinearize(getKeyID());
+  IndexSet s = egressPrimeSet(marginBits);
+  if (s != primeSet) modDownToSet(s);
+}
+
+void Ctxt::writeEgress(ostream& str, double marginBits) const
+{
+  Ctxt tmp(*this);
+  tmp.prepareEgress(marginBits);
+  tmp.writeCompact(str);
+}
+
+void Ctxt::writeWire(WireMessage& msg) const
+{
+  if (lazyRelin && !inCanonicalForm(getKeyID()))
+    throw std::logic_error("Ctxt::writeWire: re-linearize the ciphertext first");
+
+  /*  The metadata:
+    1.  the native marker and phi(m)
+    2.  long ptxtSpace, long intFactor, xdouble ratFactor, xdouble noiseBound
+    3.  IndexSet primeSet
+    4.  number of parts, then skHandle and IndexSet for each
+      and the body has the rows of each part
+  */
+  ostringstream meta;
+  writeWireRows(meta, context.zMStar.getPhiM());
+  write_raw_int(meta, ptxtSpace);
+  write_raw_int(meta, intFactor);
+  write_raw_xdouble(meta, ratFactor);
+  write_raw_xdouble(meta, noiseBound);
+  primeSet.write(meta);
+  write_raw_int(meta, parts.size());
+  for (const CtxtPart& part: parts) {
+    part.skHandle.write(meta);
+    part.getIndexSet().write(meta);
+  }
+
+  msg.setHeader(meta.str());
+  for (const CtxtPart& part: parts) part.wireSegments(msg.body);
+  msg.finish();
+  addMetric(METRIC_BYTES_SERIALIZED,
+            long(msg.header.size()) + msg.bodySize());
+}
+
+void Ctxt::readWire(const string& header, vector<WireBuffer>& body)
+{
+  long bodySize;
+  istringstream meta(wireMetadata(header, bodySize));
+  readWireRows(meta, context.zMStar.getPhiM());
+  ptxtSpace = read_raw_int(meta);
+  intFactor = read_raw_int(meta);
+  ratFactor = read_raw_xdouble(meta);
+  noiseBound = read_raw_xdouble(meta);
+  primeSet.read(meta);
+  clear(prgSeed);
+  lazyRelin = false;
+
+  long nParts = read_raw_int(meta);
+  if (!meta || nParts < 0 || nParts > bodySize)
+    throw std::runtime_error("Ctxt::readWire: corrupt header");
+  parts.resize(nParts, CtxtPart(context, IndexSet::emptySet()));
+  body.clear();
+  for (CtxtPart& part: parts) {
+    part.skHandle.read(meta);
+    IndexSet s;
+    s.read(meta);
+    part.wireBuffers(body, s);
+  }
+
+  long len = 0;
+  for (const WireBuffer& buf: body) len += buf.len;
+  if (!meta || len != bodySize)
+    throw std::runtime_error("Ctxt::readWire: corrupt header");
+}
+
 void Ctxt::read(istream& str)
 {
-  assert(readEyeCatcher(str, BINIO_EYE_CTXT_BEGIN)==0);
+  bool compact = false;
+  char eye[BINIO_EYE_SIZE];
+  str.read(eye, BINIO_EYE_SIZE);
+  if (memcmp(eye, BINIO_EYE_CTXT_BEGIN, BINIO_EYE_SIZE)==0)
+    compact = false;
+  else if (memcmp(eye, BINIO_EYE_CTXT_COMPACT_BEGIN, BINIO_EYE_SIZE)==0)
+    compact = true;
+  else
+    Error("Ctxt::read: bad eye-catcher");
   
   ptxtSpace = read_raw_int(str);
   intFactor = read_raw_int(str);
   ratFactor = read_raw_xdouble(str);
   noiseBound = read_raw_xdouble(str);
   primeSet.read(str);
-  CtxtPart blankCtxtPart(context, IndexSet::emptySet());
-  read_raw_vector(str, parts, blankCtxtPart);
+  clear(prgSeed);
 
-  assert(readEyeCatcher(str, BINIO_EYE_CTXT_END)==0);
+  if (!compact) {
+    CtxtPart blankCtxtPart(context, IndexSet::emptySet());
+    read_raw_vector(str, parts, blankCtxtPart);
+    assert(readEyeCatcher(str, BINIO_EYE_CTXT_END)==0);
+    return;
+  }
+
+  bool seeded = read_raw_int(str, BINIO_32BIT);
+  CtxtPart blankCtxtPart(context, IndexSet::emptySet());
+  if (seeded) {
+    parts.assign(2, blankCtxtPart);
+    read_raw_ZZ(str, prgSeed);
+    parts[1].skHandle.read(str);
+    parts[0].readPacked(str);
+    parts[0].skHandle.setOne();
+
+    // regenerate the random part from the seed
+    DoubleCRT c1(context, primeSet);
+    { RandomState state; // do not disturb the NTL PRG
+      c1.randomize(&prgSeed);
+    }
+    (DoubleCRT&) parts[1] = c1;
+  }
+  else {
+    long nParts = read_raw_int(str);
+    parts.assign(nParts, blankCtxtPart);
+    for (CtxtPart& part: parts) {
+      part.readPacked(str);
+      part.skHandle.read(str);
+    }
+  }
+  assert(readEyeCatcher(str, BINIO_EYE_CTXT_COMPACT_END)==0);
 }
 
 void CtxtPart::write(ostream& str)
@@ -1686,6 +2516,11 @@ istream& operator>>(istream& str, CtxtPart& p)
 
 ostream& operator<<(ostream& str, const Ctxt& ctxt)
 {
+  if (ctxt.lazyRelin && !ctxt.inCanonicalForm(ctxt.getKeyID())) {
+    Ctxt tmp(ctxt); // print a re-linearized copy
+    tmp.reLinearize(ctxt.getKeyID());
+    return str << tmp;
+  }
   str << "["<<ctxt.ptxtSpace<<" "<<ctxt.noiseBound<<" "<<ctxt.primeSet
       << ctxt.intFactor << " " << ctxt.ratFactor << " "
       << ctxt.parts.size() << endl;
@@ -1711,7 +2546,21 @@ istream& operator>>(istream& str, Ctxt& ctxt)
 }
 
 
-// The recursive incremental-product function that does the actual work
+// The two halves of a split are independent. With a scheduler they are
+// forked as tasks, and the loops over the primes inside them still run in
+// parallel. NTL's pool would run those loops serially inside the halves,
+// so without a scheduler the halves run one after the other.
+template<class Fn0, class Fn1>
+static void forkHalves(const Fn0& f0, const Fn1& f1)
+{
+  if (getTaskScheduler()) parallelInvoke(f0, f1);
+  else { f0(); f1(); }
+}
+
+// The recursive incremental-product function that does the actual work.
+// This is the prefix scheme of Sklansky (the minimum-depth member of the
+// Ladner-Fischer family), other members save products at the cost of
+// more levels, which are the scarcer resource here.
 static void recursiveIncrementalProduct(Ctxt array[], long n)
 {
   if (n <= 1) return; // nothing to do
@@ -1723,15 +2572,15 @@ static void recursiveIncrementalProduct(Ctxt array[], long n)
   long n1 = 1UL << (ell-1);     // n/2 <= n1 = 2^l < n
 
   // Call the recursive procedure separately on the first and second parts
-  recursiveIncrementalProduct(array, n1);
-  recursiveIncrementalProduct(&array[n1], n-n1);
+  forkHalves([&]{ recursiveIncrementalProduct(array, n1); },
+             [&]{ recursiveIncrementalProduct(&array[n1], n-n1); });
 
   // Multiply the last product in the 1st part into every product in the 2nd
   if (n-n1 > 1) {
-    NTL_EXEC_RANGE(n-n1, first, last)
+    FHE_EXEC_RANGE(n-n1, first, last)
     for (long i=n1+first; i<n1+last; i++)
       array[i].multiplyBy(array[n1-1]);
-    NTL_EXEC_RANGE_END
+    FHE_EXEC_RANGE_END
   }
   else
     for (long i=n1; i<n; i++) array[i].multiplyBy(array[n1-1]);
@@ -1762,8 +2611,8 @@ static void recursiveTotalProduct(Ctxt& out, const Ctxt array[], long n)
 
   // Call the recursive procedure separately on the first and second parts
   Ctxt out2(ZeroCtxtLike, out);
-  recursiveTotalProduct(out, array, n1);
-  recursiveTotalProduct(out2, &array[n1], n-n1);
+  forkHalves([&]{ recursiveTotalProduct(out, array, n1); },
+             [&]{ recursiveTotalProduct(out2, &array[n1], n-n1); });
 
   // Multiply the beginning of the two halves
   out.multiplyBy(out2);
@@ -1792,7 +2641,7 @@ void innerProduct(Ctxt& result, const CtPtrs& v1, const CtPtrs& v2)
   for (long i=1; i<n; i++) {
     Ctxt tmp = *v1[i];
     tmp *= *v2[i];
-    result += tmp;
+    result += std::move(tmp);
   }
   result.reLinearize();
 }
@@ -1816,7 +2665,81 @@ void innerProduct(Ctxt& result,
   for (long i=1; i<n; i++) {
     Ctxt tmp = v1[i];
     tmp.multByConstant(v2[i]);
-    result += tmp;
+    result += std::move(tmp);
+  }
+}
+
+void innerProducts(vector<Ctxt>& out, const vector<Ctxt>& v,
+                   const vector< vector<DoubleCRT> >& rows)
+{
+  FHE_TIMER_START;
+  assert(!v.empty());
+  const Ctxt& c0 = v[0];
+  long nRows = rows.size();
+  out.assign(nRows, Ctxt(ZeroCtxtLike, c0));
+
+  // Can the rows be accumulated part by part?
+  bool same = !c0.isEmpty() && nRows > 0
+              && c0.inCanonicalForm(c0.getKeyID());
+  for (const Ctxt& c: v) {
+    if (!same) break;
+    same = c.primeSet == c0.primeSet && c.ptxtSpace == c0.ptxtSpace
+           && c.inCanonicalForm(c0.getKeyID())
+           && c.intFactor == c0.intFactor && c.ratFactor == c0.ratFactor;
+  }
+  for (const vector<DoubleCRT>& row: rows) {
+    if (!same) break;
+    same = row.size() == rows[0].size();
+    for (long j: range(min(v.size(), row.size())))
+      if (!(c0.primeSet <= row[j].getIndexSet())) same = false;
+  }
+
+  if (!same) {
+    FHE_EXEC_INDEX(nRows, i)
+      innerProduct(out[i], v, rows[i]);
+    FHE_EXEC_INDEX_END
+    return;
+  }
+  long n = min(v.size(), rows[0].size());
+  if (n == 0) return; // all the rows are empty, so are their products
+
+  // The noise of multByConstant with a constant of the default size
+  const FHEcontext& context = c0.getContext();
+  long phim = context.zMStar.getPhiM();
+  xdouble size, factor(1.0);
+  if (c0.isCKKS()) {
+    factor = context.alMod.getCx().encodeScalingFactor();
+    size = context.noiseBoundForUniform(factor, phim);
+  }
+  else
+    size = context.noiseBoundForUniform(double(c0.getPtxtSpace())/2.0, phim);
+  xdouble noise(0.0);
+  for (long j: range(n)) noise += v[j].getNoiseBound();
+
+  for (Ctxt& res: out) {
+    res.primeSet = c0.primeSet;
+    res.intFactor = c0.intFactor;
+    res.ratFactor = c0.ratFactor * factor;
+    res.noiseBound = noise * size;
+    for (const CtxtPart& part: c0.parts)
+      res.parts.push_back(CtxtPart(context, IndexSet::emptySet(),
+                                   part.skHandle));
+  }
+
+  // For every part, rows i and i+1 share one pass over that part of v
+  DoubleCRT spare(context, IndexSet::emptySet()); // the row after the last
+  vector<const DoubleCRT*> x(n), y0(n), y1(n);
+  for (long k: range(c0.parts.size())) {
+    for (long j: range(n)) x[j] = &v[j].parts[k];
+    for (long i = 0; i < nRows; i += 2) {
+      long i1 = (i+1 < nRows)? i+1 : i;
+      for (long j: range(n)) {
+        y0[j] = &rows[i][j];
+        y1[j] = &rows[i1][j];
+      }
+      DoubleCRT& out1 = (i1 > i)? out[i1].parts[k] : spare;
+      DoubleCRT::dualInnerProduct(out[i].parts[k], out1, x, y0, y1);
+    }
   }
 }
 
@@ -1832,7 +2755,7 @@ void innerProduct(Ctxt& result,
   for (long i=1; i<n; i++) {
     Ctxt tmp = v1[i];
     tmp.multByConstant(v2[i]);
-    result += tmp;
+    result += std::move(tmp);
   }
 }
 
@@ -1865,7 +2788,9 @@ double Ctxt::rawModSwitch(vector<ZZX>& zzParts, long toModulus) const
 
   mulmod_precon_t precon = PrepMulModPrecon(ratioModP, p2r);
 
-  // Scale and round all the integers in all the parts
+  // Scale and round all the integers in all the parts. The rounded
+  // coefficients are smaller than toModulus, so they are kept as longs
+  // and the rounding runs over blocks of coefficients in parallel.
   zzParts.resize(parts.size());
   const PowerfulDCRT& p2d_conv = *context.rcData.p2dConv;
   for (size_t i=0; i<parts.size(); i++) {
@@ -1873,7 +2798,9 @@ double Ctxt::rawModSwitch(vector<ZZX>& zzParts, long toModulus) const
     Vec<ZZ> powerful;
     p2d_conv.dcrtToPowerful(powerful, parts[i]); // conver to powerful rep
 
-    for (long j=0; j<powerful.length(); j++) {
+    zzX scaled(INIT_SIZE, powerful.length());
+    FHE_EXEC_RANGE(powerful.length(), first, last)
+    for (long j=first; j<last; j++) {
       const ZZ& coef = powerful[j];
       long c_mod_p = MulModPrecon(rem(coef,p2r), ratioModP, p2r, precon);
       xdouble xcoef = ratio*conv<xdouble>(coef); // the scaled coefficient
@@ -1889,11 +2816,10 @@ double Ctxt::rawModSwitch(vector<ZZX>& zzParts, long toModulus) const
 	rounded += delta;
 	if (delta > toModulus-delta) rounded -= p2r;
       }
-      // SetCoeff(zzParts[i],j,rounded);
-      conv(powerful[j], rounded);  // store back in the powerful vector
+      scaled[j] = rounded;
     }
-    //  if (deg(zzParts[i])<20) cerr << "]\n   scaled poly="<<zzParts[i]<<endl;
-    p2d_conv.powerfulToZZX(zzParts[i],powerful); // conver to ZZX
+    FHE_EXEC_RANGE_END
+    p2d_conv.powerfulToZZX(zzParts[i],scaled); // conver to ZZX
   }
 
   // Return an estimate for the noise
@@ -55,11 +55,14 @@
  * to another ciphertext wrt (1,s).
  **/
 #include <cfloat> // DBL_MAX
+#include <memory>
 #include "DoubleCRT.h"
 
 class KeySwitch;
 class FHEPubKey;
 class FHESecKey;
+class WireMessage;
+class EncodedPlaintext;
 
 /**
  * @class SKHandle
@@ -214,6 +217,15 @@ public:
   CtxtPart(const DoubleCRT& other, const SKHandle& otherHandle): 
     DoubleCRT(other), skHandle(otherHandle) {}
 
+  //! @brief Take over the residues of other rather than copy them
+  CtxtPart(DoubleCRT&& other, const SKHandle& otherHandle): 
+    DoubleCRT(std::move(other)), skHandle(otherHandle) {}
+
+  CtxtPart(const CtxtPart&) = default;
+  CtxtPart(CtxtPart&&) = default;
+  CtxtPart& operator=(const CtxtPart&) = default;
+  CtxtPart& operator=(CtxtPart&&) = default;
+
   void read(std::istream& str); 
   void write(std::ostream& str);
 
@@ -253,6 +265,15 @@ class Ctxt {
   friend class FHEPubKey;
   friend class FHESecKey;
   friend class BasicAutomorphPrecon;
+  friend class CtxtDataset;
+  friend class CtxtDatasetWriter;
+  friend class CtxtBatch;
+  friend class EncryptedZeroPool;
+  friend void innerProducts(std::vector<Ctxt>& out,
+                            const std::vector<Ctxt>& v,
+                            const std::vector< std::vector<DoubleCRT> >& rows);
+  friend void ringSwitch(Ctxt& out, const Ctxt& in, long keyID,
+                         long toKeyID);
 
   const FHEcontext& context; // points to the parameters of this FHE instance
   const FHEPubKey& pubKey;   // points to the public encryption key;
@@ -265,6 +286,21 @@ class Ctxt {
   long intFactor;    // an integer factor to multiply by on decryption (for BGV)
   NTL::xdouble ratFactor; // rational factor to divide on decryption (for CKKS)
 
+  bool lazyRelin; // defer re-linearization until the ciphertext is consumed
+
+  // The node of the recorded circuit that this ciphertext holds, -1 if none
+  // (see circuit.h). Only bookkeeping, so it can be set on a const Ctxt.
+  mutable long circuitNode;
+
+  // The tag of the ctxtTrace.h value that this ciphertext holds, -1 if
+  // none. Also bookkeeping.
+  mutable long traceId;
+
+  // For a fresh symmetric encryption, parts[1] is derived from this seed.
+  // It is zero if there is no such seed. It is only a hint for writeCompact,
+  // which checks that parts[1] still matches the seed before using it.
+  NTL::ZZ prgSeed;
+
   // Create a tensor product of c1,c2. It is assumed that *this,c1,c2
   // are defined relative to the same set of primes and plaintext space,
   // and that *this DOES NOT point to the same object as c1,c2
@@ -287,6 +323,10 @@ class Ctxt {
   { addPart(part, handle, matchPrimeSet, true); }
   void addPart(const DoubleCRT& part, const SKHandle& handle, 
 	       bool matchPrimeSet=false, bool negative=false);
+  // Same as above, but part may be modified. If it becomes a new part
+  // of *this its residues are moved rather than copied.
+  void addPart(DoubleCRT&& part, const SKHandle& handle, 
+	       bool matchPrimeSet=false, bool negative=false);
 
   // Takes as arguments a ciphertext-part p relative to s' and a key-switching
   // matrix W = W[s'->s], use W to switch p relative to (1,s), and add the
@@ -294,7 +334,8 @@ class Ctxt {
   void keySwitchPart(const CtxtPart& p, const KeySwitch& W);
 
   // interenal procedure used in key-swtching
-  void keySwitchDigits(const KeySwitch& W, std::vector<DoubleCRT>& digits);
+  void keySwitchDigits(const KeySwitch& W,
+                       const std::vector<DoubleCRT>& digits);
 
   long getPartIndexByHandle(const SKHandle& hanle) const {
     for (size_t i=0; i<parts.size(); i++) 
@@ -310,10 +351,19 @@ class Ctxt {
   // public key, this is needed when we copy the pubEncrKey member between
   // different public keys.
   Ctxt& privateAssign(const Ctxt& other);
+  Ctxt& privateAssign(Ctxt&& other);
+
+  // The body of addCtxt. If spare is not null then it points to other,
+  // which the caller no longer needs, and it is modified and cannibalized
+  // instead of making a temporary copy of it.
+  void addCtxt(const Ctxt& other, bool negative, Ctxt* spare);
 
   // explicitly multiply intFactor by e, which should be
   // in the interval [0, ptxtSpace)
   void mulIntFactor(long e);
+
+  // Used by writeCompact: does parts[1] still come from prgSeed?
+  bool seededPartValid() const;
  
 public:
   //__attribute__((deprecated))
@@ -329,11 +379,19 @@ public:
   //! on the L-infty norm of the canonical embedding
   void DummyEncrypt(const NTL::ZZX& ptxt, double size=-1.0);
 
+  Ctxt(const Ctxt& other) = default;
+  Ctxt(Ctxt&& other) = default; // leaves other empty
+
   Ctxt& operator=(const Ctxt& other) {  // public assignment operator
     assert(&context == &other.context);
     assert (&pubKey == &other.pubKey);
     return privateAssign(other);
   }
+  Ctxt& operator=(Ctxt&& other) {  // move the parts rather than copy them
+    assert(&context == &other.context);
+    assert (&pubKey == &other.pubKey);
+    return privateAssign(std::move(other));
+  }
 
   bool operator==(const Ctxt& other) const { return equalsTo(other); }
   bool operator!=(const Ctxt& other) const { return !equalsTo(other); }
@@ -350,10 +408,20 @@ public:
  // Add/subtract aonther ciphertext
   Ctxt& operator+=(const Ctxt& other) { addCtxt(other); return *this; }
   Ctxt& operator-=(const Ctxt& other) { addCtxt(other,true); return *this; }
-  void addCtxt(const Ctxt& other, bool negative=false);
+  void addCtxt(const Ctxt& other, bool negative=false)
+  { addCtxt(other, negative, nullptr); }
+
+  //! The rvalue versions reuse the storage of other, which is left in
+  //! an unspecified (but valid) state
+  Ctxt& operator+=(Ctxt&& other)
+  { addCtxt(std::move(other)); return *this; }
+  Ctxt& operator-=(Ctxt&& other)
+  { addCtxt(std::move(other),true); return *this; }
+  void addCtxt(Ctxt&& other, bool negative=false);
 
   void multLowLvl(const Ctxt& other, bool destructive=false); // Multiply by aonther ciphertext
   Ctxt& operator*=(const Ctxt& other){  multLowLvl(other); return *this; }
+  Ctxt& operator*=(Ctxt&& other){  multLowLvl(other, true); return *this; }
   void automorph(long k); // Apply automorphism F(X) -> F(X^k) (gcd(k,m)=1)
   Ctxt& operator>>=(long k) { automorph(k); return *this; }
   void complexConj();     // Complex conjugate, same as automorph(m-1)
@@ -386,6 +454,10 @@ public:
   // poly mod ptxtSpace.
 
   void addConstant(const NTL::ZZ& c);
+  //! @brief Add an encoded constant, through its DoubleCRT form over the
+  //! primes of this ciphertext, and with its precomputed size (see
+  //! encodedPtxt.h)
+  void addConstant(const EncodedPlaintext& ptxt);
   //! add a rational number in the form a/b, a,b are long
   void addConstantCKKS(std::pair</*numerator=*/long,/*denominator=*/long>);
   void addConstantCKKS(double x) {
@@ -404,7 +476,16 @@ public:
   void multByConstant(const DoubleCRT& dcrt, double size=-1.0);
   void multByConstant(const NTL::ZZX& poly, double size=-1.0);
   void multByConstant(const zzX& poly, double size=-1.0);
+
+  //! @brief this += other*dcrt. When the two ciphertexts have the same
+  //! primes, parts and factors (e.g., in a sum of many such terms), the
+  //! products are added to the parts of this in one pass, without a copy
+  //! of other. BGV only; otherwise it is a multByConstant of a copy.
+  void mulAddConstant(const Ctxt& other, const DoubleCRT& dcrt,
+                      double size=-1.0);
   void multByConstant(const NTL::ZZ& c);
+  //! @brief Multiply by an encoded constant, as addConstant above
+  void multByConstant(const EncodedPlaintext& ptxt);
 
   //! multiply by a rational number in the form a/b, a,b are long
   void multByConstantCKKS(std::pair</*numerator=*/long,/*denominator=*/long>);
@@ -443,6 +524,9 @@ public:
   void nxorConstant(const NTL::ZZX& poly, double size=-1.0)
   { nxorConstant(DoubleCRT(poly,context,primeSet),size); }
 
+  void xorConstant(const EncodedPlaintext& ptxt);
+  void nxorConstant(const EncodedPlaintext& ptxt);
+
   
   //! Divide a cipehrtext by p, for plaintext space p^r, r>1. It is assumed
   //! that the ciphertext encrypts a polynomial which is zero mod p. If this
@@ -498,6 +582,28 @@ public:
   void cleanUp();
          // relinearize, then reduce, then drop special primes 
 
+  //! @brief Lazy re-linearization mode. When set, multiplyBy, multiplyBy2,
+  //! square and cube leave the product relative to (1,s,s^2), so a sum of
+  //! products costs a single key-switching (and the mod-down that follows
+  //! it) instead of one per term. The pending re-linearization is done when
+  //! the ciphertext is consumed: multiplied, automorphed or written out.
+  //! The mode is a property of this object, it is kept across assignments
+  //! to it and is not serialized.
+  void setLazyRelin(bool lazy=true) { lazyRelin = lazy; }
+  bool isLazyRelin() const { return lazyRelin; }
+
+  //! The node of a recorded circuit that this ciphertext holds, -1 if it
+  //! was not seen by a CircuitHook (see circuit.h). Kept across copies and
+  //! assignments, reset on encryption.
+  long getCircuitNode() const { return circuitNode; }
+  void setCircuitNode(long node) const { circuitNode = node; }
+
+  //! A tag of the CtxtTrace value that this ciphertext holds, -1 if it was
+  //! not seen by a CtxtTracer (see ctxtTrace.h, CtxtTracer::lookup gives
+  //! the value). Kept like the circuit node.
+  long getTraceId() const { return traceId; }
+  void setTraceId(long id) const { traceId = id; }
+
   // void reduce() const;
 
   //! @brief Add a high-noise encryption of the given constant
@@ -520,6 +626,30 @@ public:
   //! via modUpToSet and modDownToSet
   void bringToSet(const IndexSet& s); 
 
+  //! @name CKKS scale management (see CKKSScaleMode)
+  ///@{
+
+  //! @brief The factor that rescale() brings a CKKS ciphertext back to:
+  //! 2^targetBits (or encodeScalingFactor), but no less than what keeps
+  //! getPPowR() above the mod-switching added noise
+  NTL::xdouble targetRatFactor() const;
+
+  //! @brief Drop as many primes as the factor allows, at the smallest
+  //! cost, leaving a factor of at least targetRatFactor()
+  void rescale();
+
+  //! @brief Mod-switch to the set s (modding up first if needed),
+  //! multiplying by an integer beforehand so that the factor ends close
+  //! to the given one when the dropped primes allow it
+  void rescaleToSet(const IndexSet& s, const NTL::xdouble& factor);
+
+  //! @brief The number of multiplications that this CKKS ciphertext can
+  //! still afford, leaving r bits of precision. Under autoRescale each
+  //! one costs log(targetRatFactor()); otherwise the estimate assumes
+  //! that it costs log(noiseBound).
+  long levelsLeft() const;
+  ///@}
+
   // Finding the "natural" state of a cipehrtext
   double naturalSize() const; //! "natural size" is size before suqaring
   IndexSet naturalPrimeSet() const; //! the corresponding primeSet
@@ -529,6 +659,13 @@ public:
   //! modulus-switching added noise term.
   void dropSmallAndSpecialPrimes();
 
+  //! @brief Drop the primes that the noise of a BGV ciphertext does not
+  //! need, as long as it is at least 2^marginBits times the mod-switching
+  //! added noise afterwards. Nothing is done for CKKS, or while the special
+  //! primes are in the prime set. Under context.primeTrim.eager the
+  //! operations call it with context.primeTrim.marginBits.
+  void trimPrimes(long marginBits);
+
   //! @brief returns the "capacity" of a ciphertext,
   //! which is the log of the ratio of the modulus to the
   //! noise bound
@@ -582,6 +719,10 @@ public:
   //! @brief Is this an empty cipehrtext without any parts
   bool isEmpty() const { return (parts.size()==0); }
 
+  //! @brief The bytes of this ciphertext, its own size included (see
+  //! memoryUsage.h)
+  long memoryUsage() const;
+
   //! @brief A canonical ciphertext has (at most) handles pointing to (1,s)
   bool inCanonicalForm(long keyID=0) const {
     if (parts.size()>2) return false;
@@ -631,7 +772,46 @@ public:
   
   //Raw IO
   void write(std::ostream& str) const;
-  void read(std::istream& str);
+  void read(std::istream& str); // reads both the full and compact formats
+
+  //! @brief A compact binary format: the residues are packed at the
+  //! bit-width of their primes, and for a fresh symmetric encryption the
+  //! random part is replaced by the seed it was generated from (roughly
+  //! halving the size). Read it back with read().
+  void writeCompact(std::ostream& str) const;
+
+  //! @name Egress: writing results for the client to decrypt
+  ///@{
+
+  //! @brief The smallest subset of the ciphertext primes of primeSet that
+  //! this ciphertext can be mod-switched down to and still decrypt, with
+  //! marginBits bits to spare. The primes are taken largest first, so a
+  //! BGV ciphertext with little noise ends up with a single prime. The
+  //! noise after the switch is estimated from the current noise bound and
+  //! modSwitchAddedNoiseBound(). A CKKS ciphertext keeps its primeSet, as
+  //! its precision depends on the size of its plaintext, which is not known.
+  IndexSet egressPrimeSet(double marginBits=4.0) const;
+
+  //! @brief Mod-switch down to egressPrimeSet(marginBits), in place
+  void prepareEgress(double marginBits=4.0);
+
+  //! @brief Write a copy mod-switched down to egressPrimeSet(marginBits),
+  //! in the compact format (read it back with read())
+  void writeEgress(std::ostream& str, double marginBits=4.0) const;
+  ///@}
+
+  //! @brief A scatter-gather message (see WireMessage in binio.h), whose
+  //! body points at the residues of this ciphertext so they are sent
+  //! without a copy. The ciphertext must stay alive and unchanged until the
+  //! message is sent. Raises logic_error on a ciphertext that still needs
+  //! re-linearization.
+  void writeWire(WireMessage& msg) const;
+
+  //! @brief Set this ciphertext up from the header of a message, and give
+  //! the buffers that the body is to be received into (the parts keep their
+  //! storage if their primes do not change). The residues are valid once
+  //! the whole body is there.
+  void readWire(const std::string& header, std::vector<WireBuffer>& body);
 
   // scale up c1, c2 so they have the same ratFactor
   static void equalizeRationalFactors(Ctxt& c1, Ctxt &c2,
@@ -639,6 +819,74 @@ public:
 };
 
 
+//! @brief The bits of ctxtPrimes (the L of buildModChain) needed for a
+//! fresh CKKS ciphertext to afford the given number of multiplications
+//! under context.ckksScale.autoRescale
+long ckksBitsForLevels(const FHEcontext& context, long levels);
+
+
+/**
+ * @class BasicAutomorphPrecon
+ * @brief Pre-computation to speed many automorphism on the same ciphertext.
+ *
+ * The expensive part of homomorphic automorphism is braking the ciphertext
+ * parts into digits. The usual setting is we first rotate the ciphertext
+ * parts, then break them into digits. But when we apply many automorphisms
+ * it is faster to break the original ciphertext into digits, then rotate
+ * the digits (as opposed to first rotate, then break).
+ * An BasicAutomorphPrecon object breaks the original ciphertext and keeps
+ * the digits, then when you call automorph is only needs to apply the
+ * native automorphism and key switching to the digits, which is fast(er).
+ *
+ * Usage example, computing many rotations along dimension dim:
+ * \code
+ *   BasicAutomorphPrecon precon(ctxt); // decompose once
+ *   for (long i: range(n))
+ *     rot[i] = precon.automorph(zMStar.genToPow(dim, i));
+ * \endcode
+ * For a "good" dimension (or a single-dimension hypercube), the automorphism
+ * zMStar.genToPow(dim,i) is exactly ea.rotate1D(ctxt,dim,i).
+ *
+ * The object is read-only after construction, so the automorph methods can
+ * be called concurrently from several threads.
+ **/
+class BasicAutomorphPrecon {
+  Ctxt ctxt;
+  NTL::xdouble noise;
+  std::vector<DoubleCRT> polyDigits;
+
+public:
+  explicit BasicAutomorphPrecon(const Ctxt& _ctxt);
+
+  //! @brief The ciphertext that was decomposed (after cleanUp)
+  const Ctxt& getCtxt() const { return ctxt; }
+
+  //! @brief Returns the original ciphertext after the automorphism X->X^k
+  std::shared_ptr<Ctxt> automorph(long k) const;
+
+  //! @brief Returns the original ciphertext after the Frobenius map p^j.
+  //! For CKKS this is a complex conjugation for odd j, as in
+  //! Ctxt::frobeniusAutomorph
+  std::shared_ptr<Ctxt> frobeniusAutomorph(long j) const;
+
+  //! @brief Returns the complex conjugate of the original ciphertext, i.e.
+  //! the automorphism X->X^{m-1} key-switched from the digits. Unlike
+  //! Ctxt::complexConj, the result needs no re-linearization later. If the
+  //! key has no matrices for X^{m-1} it is only conjugated, as there.
+  std::shared_ptr<Ctxt> complexConj() const;
+
+  //! @brief out[j] is the original ciphertext after the Frobenius map p^j,
+  //! for all 0<=j<d. The work is split between the NTL threads.
+  void frobeniusAutomorphs(std::vector<std::shared_ptr<Ctxt>>& out,
+                           long d) const;
+
+  //! @brief Apply all the automorphisms X->X^{vals[i]}, out[i] is the
+  //! result of the i'th one. The work is split between the NTL threads.
+  void automorph(std::vector<std::shared_ptr<Ctxt>>& out,
+                 const std::vector<long>& vals) const;
+};
+
+
 // set out=prod_{i=0}^{n-1} v[j], takes depth log n and n-1 products
 // out could point to v[0], but having it pointing to any other v[i]
 // will make the result unpredictable.
@@ -665,6 +913,16 @@ inline Ctxt innerProduct(const std::vector<Ctxt>& v1,
   innerProduct(ret, v1, v2); return ret; 
 }
 
+//! @brief out[i] = innerProduct(v, rows[i]) for all the rows, i.e., the
+//! plaintext matrix rows times the vector of ciphertexts v (which must not
+//! be empty). When the ciphertexts of v have the same primes, parts and
+//! factors and the rows have the same length, the parts of v are streamed
+//! once through the multiply-accumulate kernel of key-switching, two rows
+//! at a time, with no copies of the ciphertexts. Otherwise the rows are
+//! computed one by one, in parallel.
+void innerProducts(std::vector<Ctxt>& out, const std::vector<Ctxt>& v,
+                   const std::vector< std::vector<DoubleCRT> >& rows);
+
 void innerProduct(Ctxt& result, const std::vector<Ctxt>& v1,
                                 const std::vector<NTL::ZZX>& v2);
 inline Ctxt innerProduct(const std::vector<Ctxt>& v1,
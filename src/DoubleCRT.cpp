@@ -18,6 +18,9 @@
  * in use. The list of primes is defined by the data member modChain, which is
  * a vector of Cmodulus objects. 
  */
+#include <cmath>
+#include <cstring>
+#include <algorithm>
 #include <NTL/ZZVec.h>
 #include <NTL/BasicThreadPool.h>
 
@@ -26,19 +29,50 @@
 #include "sample.h"
 #include "DoubleCRT.h"
 #include "FHEContext.h"
+#include "costModel.h"
+#include "metrics.h"
+#include "taskScheduler.h"
+#include "rowArith.h"
 
 NTL_CLIENT
 
 // A threaded implementation of DoubleCRT operations
+//
+// Every kernel counts its rows for the installed CostCounter (see
+// costModel.h) before it checks for a dry run. Where a dry run skips the
+// calls that would have counted them, they are counted on their behalf.
 
-static
-long MakeIndexVector(const IndexSet& s, Vec<long>& v)
+static void countRows(CostKernel k, const IndexSet& s)
 {
-  long sz = s.card();
-  v.SetLength(sz);
-  for (long i = s.first(), j = 0; i <= s.last(); i = s.next(i), j++)
-    v[j] = i;
-  return sz;
+  countCostRows(k, card(s));
+  if (isDryRun()) return; // nothing is converted
+  if (k == COST_FFT)       addMetric(METRIC_FFT_ROWS, card(s));
+  else if (k == COST_IFFT) addMetric(METRIC_IFFT_ROWS, card(s));
+}
+
+// The forward NTT of poly into the rows of s. Each thread transforms its
+// primes FHE_NTT_BATCH at a time, so that the input is reduced once for
+// the whole batch.
+template<class Poly>
+static void batchFFTRows(RowSlab& map, const IndexSet& s,
+                         const FHEcontext& context, const Poly& poly)
+{
+  shared_ptr<const Vec<long>> ivecp = context.getIndexVector(s);
+  const Vec<long>& ivec = *ivecp;
+  long icard = ivec.length();
+  FHE_EXEC_RANGE(icard, first, last)
+    long *rows[FHE_NTT_BATCH];
+    const Cmodulus *mods[FHE_NTT_BATCH];
+    for (long j = first; j < last; j += FHE_NTT_BATCH) {
+      long cnt = std::min(last - j, long(FHE_NTT_BATCH));
+      for (long b: range(cnt)) {
+        long i = ivec[j+b];
+        rows[b] = map[i];
+        mods[b] = &context.ithModulus(i);
+      }
+      Cmodulus::batchFFT(rows, mods, cnt, poly);
+    }
+  FHE_EXEC_RANGE_END
 }
 
 // representing an integer polynomial as DoubleCRT. If the number of moduli
@@ -52,36 +86,19 @@ void DoubleCRT::FFT(const ZZX& poly, const IndexSet& s)
   FHE_TIMER_START;
 
   if (empty(s)) return;
+  countRows(COST_FFT, s);
 
-  static thread_local Vec<long> tls_ivec;
-  Vec<long>& ivec = tls_ivec;
-
-  long icard = MakeIndexVector(s, ivec);
-  NTL_EXEC_RANGE(icard, first, last)
-      for (long j = first; j < last; j++) {
-        long i = ivec[j];
-        context.ithModulus(i).FFT(map[i], poly); 
-      }
-  NTL_EXEC_RANGE_END
+  batchFFTRows(map, s, context, poly);
 }
 
-// FIXME: "code bloat": this just replicates the above with ZZX -> zzX
 void DoubleCRT::FFT(const zzX& poly, const IndexSet& s)
 {
   FHE_TIMER_START;
 
   if (empty(s)) return;
+  countRows(COST_FFT, s);
 
-  static thread_local Vec<long> tls_ivec;
-  Vec<long>& ivec = tls_ivec;
-
-  long icard = MakeIndexVector(s, ivec);
-  NTL_EXEC_RANGE(icard, first, last)
-      for (long j = first; j < last; j++) {
-        long i = ivec[j];
-        context.ithModulus(i).FFT(map[i], poly); 
-      }
-  NTL_EXEC_RANGE_END
+  batchFFTRows(map, s, context, poly);
 }
 
 
@@ -96,12 +113,12 @@ void DoubleCRT::verify()
 
   long phim = context.zMStar.getPhiM();
 
+  if (map.getRowLength() != phim)
+    Error("DoubleCRT object has bad row length");
+
   // check that the content of i'th row is in [0,pi) for all i
   for (long i: s) {
-    vec_long& row = map[i];
-
-    if (row.length() != phim) 
-      Error("DoubleCRT object has bad row length");
+    long *row = map[i];
 
     long pi = context.ithPrime(i); // the i'th modulus
     for (long j: range(phim))
@@ -118,6 +135,7 @@ template<class Fun>
 DoubleCRT& DoubleCRT::Op(const DoubleCRT &other, Fun fun,
 			 bool matchIndexSets)
 {
+  countRows(COST_ROW_OP, map.getIndexSet());
   if (isDryRun()) return *this;
 
   if (&context != &other.context)
@@ -132,7 +150,7 @@ DoubleCRT& DoubleCRT::Op(const DoubleCRT &other, Fun fun,
 
   // If you need to mod-up the other, do it on a temporary scratch copy
   DoubleCRT tmp(context, IndexSet()); 
-  const IndexMap<vec_long>* other_map = &other.map;
+  const RowSlab* other_map = &other.map;
   if (!(map.getIndexSet() <= other.map.getIndexSet())){ // Even more expensive
     FHE_NTIMER_START(addPrimes_2); 
     tmp = other;
@@ -144,14 +162,10 @@ DoubleCRT& DoubleCRT::Op(const DoubleCRT &other, Fun fun,
   const IndexSet& s = map.getIndexSet();
   long phim = context.zMStar.getPhiM();
 
-  // add/sub/mul the data, element by element, modulo the respective primes
+  // add/sub/mul the data, row by row, modulo the respective primes
   for (long i: s) {
-    long pi = context.ithPrime(i);
-    vec_long& row = map[i];
-    const vec_long& other_row = (*other_map)[i];
-
-    for (long j: range(phim))
-      row[j] = fun.apply(row[j], other_row[j], pi);
+    const Cmodulus& mod = context.ithModulus(i);
+    fun.apply(map[i], (*other_map)[i], phim, mod.getQ(), mod.getQInv());
   }
   return *this;
 }
@@ -166,6 +180,7 @@ DoubleCRT& DoubleCRT::do_mul(const DoubleCRT &other,
 {
   FHE_TIMER_START;
 
+  countRows(COST_ROW_OP, map.getIndexSet());
   if (isDryRun()) return *this;
 
   if (&context != &other.context)
@@ -180,7 +195,7 @@ DoubleCRT& DoubleCRT::do_mul(const DoubleCRT &other,
 
   // If you need to mod-up the other, do it on a temporary scratch copy
   DoubleCRT tmp(context, IndexSet()); 
-  const IndexMap<vec_long>* other_map = &other.map;
+  const RowSlab* other_map = &other.map;
   if (!(map.getIndexSet() <= other.map.getIndexSet())){ // Even more expensive
     FHE_NTIMER_START(addPrimes_4);
     tmp = other;
@@ -192,15 +207,29 @@ DoubleCRT& DoubleCRT::do_mul(const DoubleCRT &other,
   const IndexSet& s = map.getIndexSet();
   long phim = context.zMStar.getPhiM();
 
-  // add/sub/mul the data, element by element, modulo the respective primes
+  // multiply the data, row by row, modulo the respective primes
   for (long i: s) {
-    long pi = context.ithPrime(i);
-    mulmod_t pi_inv = context.ithModulus(i).getQInv(); 
-    vec_long& row = map[i];
-    const vec_long& other_row = (*other_map)[i];
+    const Cmodulus& mod = context.ithModulus(i);
+    mulModRow(map[i], (*other_map)[i], phim, mod.getQ(), mod.getQInv());
+  }
+  return *this;
+}
 
-    for (long j: range(phim))
-      row[j] = MulMod(row[j], other_row[j], pi, pi_inv);
+DoubleCRT& DoubleCRT::addMul(const DoubleCRT& a, const DoubleCRT& b)
+{
+  FHE_TIMER_START;
+  const IndexSet& s = map.getIndexSet();
+  countRows(COST_ROW_OP, s);
+  if (isDryRun()) return *this;
+
+  if (&context != &a.context || &context != &b.context)
+    Error("DoubleCRT::addMul: incompatible objects");
+  assert(s <= a.getIndexSet() && s <= b.getIndexSet());
+
+  long phim = context.zMStar.getPhiM();
+  for (long i: s) {
+    const Cmodulus& mod = context.ithModulus(i);
+    mulAddModRow(map[i], a.map[i], b.map[i], phim, mod.getQ(), mod.getQInv());
   }
   return *this;
 }
@@ -222,6 +251,7 @@ DoubleCRT& DoubleCRT::Op<DoubleCRT::SubFun>(const DoubleCRT &other, SubFun fun,
 template<class Fun>
 DoubleCRT& DoubleCRT::Op(const ZZ &num, Fun fun)
 {
+  countRows(COST_ROW_OP, map.getIndexSet());
   if (isDryRun()) return *this;
 
   const IndexSet& s = map.getIndexSet();
@@ -230,9 +260,7 @@ DoubleCRT& DoubleCRT::Op(const ZZ &num, Fun fun)
   for (long i: s) {
     long pi = context.ithPrime(i);
     long n = rem(num, pi);  // n = num % pi
-    vec_long& row = map[i];
-    for (long j: range(phim))
-      row[j] = fun.apply(row[j], n, pi);
+    fun.apply(map[i], n, phim, pi);
   }
   return *this;
 }
@@ -248,6 +276,7 @@ DoubleCRT& DoubleCRT::Op<DoubleCRT::SubFun>(const ZZ &num, SubFun fun);
 
 DoubleCRT& DoubleCRT::Negate(const DoubleCRT& other)
 {
+  countRows(COST_ROW_OP, other.map.getIndexSet());
   if (isDryRun()) return *this;
 
   if (&context != &other.context) 
@@ -260,8 +289,8 @@ DoubleCRT& DoubleCRT::Negate(const DoubleCRT& other)
   long phim = context.zMStar.getPhiM();
   for (long i: s) { 
     long pi = context.ithPrime(i);
-    vec_long& row = map[i];
-    const vec_long& other_row = other.map[i];
+    long *row = map[i];
+    const long *other_row = other.map[i];
     for (long j: range(phim))
       row[j] = NegateMod(other_row[j], pi);
   }
@@ -271,7 +300,11 @@ DoubleCRT& DoubleCRT::Negate(const DoubleCRT& other)
 template<class Fun>
 DoubleCRT& DoubleCRT::Op(const ZZX &poly, Fun fun)
 {
-  if (isDryRun()) return *this;
+  if (isDryRun()) { // the conversion of poly and the operation
+    countRows(COST_FFT, map.getIndexSet());
+    countRows(COST_ROW_OP, map.getIndexSet());
+    return *this;
+  }
 
   const IndexSet& s = map.getIndexSet();
   DoubleCRT other(poly, context, s); // other defined wrt same primes as *this
@@ -290,6 +323,13 @@ DoubleCRT& DoubleCRT::Op<DoubleCRT::SubFun>(const ZZX &poly, SubFun fun);
 
 // break *this into n digits,according to the primeSets in context.digits
 void DoubleCRT::breakIntoDigits(vector<DoubleCRT>& digits, long n) const
+{
+  breakIntoDigits(digits, n, context.digits);
+}
+
+// same, according to the primeSets in dgtSets
+void DoubleCRT::breakIntoDigits(vector<DoubleCRT>& digits, long n,
+                                const vector<IndexSet>& dgtSets) const
 {
   FHE_TIMER_START;
   IndexSet allPrimes = getIndexSet() | context.specialPrimes;
@@ -298,33 +338,250 @@ void DoubleCRT::breakIntoDigits(vector<DoubleCRT>& digits, long n) const
   // the calling routine should ensure that the index set
   // contains only ctxt primes
 
-  assert(n <= (long)context.digits.size());
+  assert(n <= (long)dgtSets.size());
 
   digits.resize(n, DoubleCRT(context, IndexSet::emptySet()));
-  if (isDryRun()) return;
+  if (isDryRun()) { // the digits get all the primes, as they would below
+    for (long i: range(n)) {
+      digits[i].map.clear();
+      digits[i].map.insert(allPrimes);
+      IndexSet inDigit = getIndexSet() & dgtSets[i];
+      countRows(COST_IFFT, inDigit);
+      if (!empty(inDigit)) countRows(COST_FFT, allPrimes / inDigit);
+      for (long j: range(i+1, n)) // the Sub and /= of digits[j]
+        countCostRows(COST_ROW_OP, 2*card(getIndexSet() & dgtSets[j]));
+    }
+    return;
+  }
+
+  // The digits are found in coefficient form, with each prime of *this
+  // inverse-transformed once: digit i is the balanced lift of the residues
+  // (mod its primes) of ((x - d_0)/P_0 - d_1)/P_1 ... - d_{i-1})/P_{i-1},
+  // and the base extension of d_i to the other primes gives both its rows
+  // there and what the later digits subtract. The forward transforms of
+  // all the digits then run in one parallel loop, into rows that are kept
+  // if digits[i] already has all the primes.
+  const IndexSet& s = getIndexSet();
+  long phim = context.zMStar.getPhiM();
+  countRows(COST_IFFT, s);
+
+  static thread_local Vec< Vec<long> > tls_remtab;
+  static thread_local Vec< Vec< Vec<long> > > tls_drem, tls_ext;
+  Vec< Vec<long> >& remtab = tls_remtab;
+  Vec< Vec< Vec<long> > >& drem = tls_drem; // [i][h][j], j in inDigit[i]
+  Vec< Vec< Vec<long> > >& ext = tls_ext;   // [i][k][h], k in outDigit[i]
+  coeffsModPrimes(remtab, context, map, s);
+
+  vector<IndexSet> inDigit(n), outDigit(n);
+  vector< shared_ptr<const BaseConvTables> > tables(n);
+  drem.SetLength(n);
+  ext.SetLength(n);
+  for (long i: range(n)) {
+    inDigit[i] = s & dgtSets[i];
+    outDigit[i] = allPrimes / inDigit[i];
+    if (empty(inDigit[i])) continue;
+    tables[i] = context.getBaseConvTables(inDigit[i], outDigit[i]);
+
+    // the columns of remtab of the primes of digit i
+    vector<long> cols;
+    long pos = 0;
+    for (long q: s) {
+      if (inDigit[i].contains(q)) cols.push_back(pos);
+      pos++;
+    }
+    drem[i].SetLength(phim);
+    FHE_EXEC_RANGE(phim, first, last)
+        for (long h: range(first, last)) {
+          drem[i][h].SetLength(cols.size());
+          for (long j: range(lsize(cols))) drem[i][h][j] = remtab[h][cols[j]];
+        }
+    FHE_EXEC_RANGE_END
+  }
 
-  for (long i: range(digits.size())) { 
-    digits[i]=*this;
-    IndexSet notInDigit = digits[i].getIndexSet()/context.digits[i];
-    digits[i].removePrimes(notInDigit); // reduce modulo the digit primes
+  // pinv[i][q] = prod(dgtSets[i])^{-1} mod q, for the primes of *this
+  vector< vector<long> > pinv(n, vector<long>(context.numPrimes(), 0));
+  for (long i: range(n)) {
+    ZZ pi = context.productOfPrimes(dgtSets[i]);
+    for (long q: s) pinv[i][q] = InvMod(rem(pi, context.ithPrime(q)),
+                                        context.ithPrime(q));
   }
-  
-  for (long i: range(digits.size())) { 
-    FHE_NTIMER_START(addPrimes_5);
-    IndexSet notInDigit = allPrimes / digits[i].getIndexSet();
-    digits[i].addPrimes(notInDigit); // add back all the primes
-
-    ZZ pi = context.productOfPrimes(context.digits[i]);
-    for (long j: range(i+1, digits.size())) {
-      digits[j].Sub(digits[i], /*matchIndexSets=*/false);
-      digits[j] /= pi;
+
+  // outPos[i][q] = the position of the prime q in outDigit[i]
+  vector< vector<long> > outPos(n, vector<long>(context.numPrimes(), -1));
+  for (long i: range(n)) {
+    long k = 0;
+    for (long q: outDigit[i]) outPos[i][q] = k++;
+  }
+
+  for (long i: range(n)) {
+    if (!empty(inDigit[i])) {
+      countRows(COST_FFT, outDigit[i]);
+      baseExtend(ext[i], nullptr, drem[i], *tables[i], phim);
+    }
+    if (i+1 == n) break;
+
+    // the later digits subtract d_i and divide by P_i, in coefficient form
+    struct Fix { long j, jj, k, q; long f; mulmod_precon_t precon; };
+    vector<Fix> fixes;
+    for (long j: range(i+1, n)) {
+      countCostRows(COST_ROW_OP, 2*card(inDigit[j]));
+      long jj = 0;
+      for (long q: inDigit[j]) {
+        long qq = context.ithPrime(q), f = pinv[i][q];
+        long k = empty(inDigit[i])? -1 : outPos[i][q];
+        fixes.push_back(Fix{j, jj++, k, qq, f, PrepMulModPrecon(f, qq)});
+      }
     }
+    FHE_EXEC_RANGE(phim, first, last)
+        for (long h: range(first, last))
+          for (const Fix& x: fixes) {
+            long& c = drem[x.j][h][x.jj];
+            if (x.k >= 0) c = SubMod(c, ext[i][x.k][h], x.q);
+            c = MulModPrecon(c, x.f, x.q, x.precon);
+          }
+    FHE_EXEC_RANGE_END
   }
+
+  // the rows of every digit at the primes it was extended to, all at once
+  vector< std::pair<long,long> > work; // (digit, prime)
+  for (long i: range(n)) {
+    if (&digits[i].context != &context)
+      Error("DoubleCRT::breakIntoDigits: digits of another context");
+    if (digits[i].map.getIndexSet() != allPrimes) {
+      digits[i].map.clear();
+      digits[i].map.insert(allPrimes);
+    }
+    for (long q: outDigit[i]) work.push_back(std::make_pair(i, q));
+  }
+  FHE_EXEC_RANGE(lsize(work), first, last)
+      for (long w: range(first, last)) {
+        long i = work[w].first, q = work[w].second;
+        long *row = digits[i].map[q];
+        if (empty(inDigit[i])) // a digit without primes is zero
+          std::memset(row, 0, phim*sizeof(long));
+        else
+          context.ithModulus(q).FFT(row, ext[i][outPos[i][q]]);
+      }
+  FHE_EXEC_RANGE_END
+
+  // and at their own primes, from the rows of *this in evaluation form
+  shared_ptr<const Vec<long>> ivecp = context.getIndexVector(s);
+  const Vec<long>& ivec = *ivecp;
+  long icard = ivec.length();
+  FHE_EXEC_RANGE(icard, first, last)
+      for (long t: range(first, last)) {
+        long q = ivec[t];
+        long qq = context.ithPrime(q);
+        long j = 0;
+        while (j < n && !inDigit[j].contains(q)) j++; // the digit of q
+        if (j == n) continue; // in none of the n digits
+        long *row = digits[j].map[q];
+        std::memcpy(row, map[q], phim*sizeof(long));
+        for (long i: range(j)) {
+          subModRow(row, digits[i].map[q], phim, qq);
+          mulModRowConst(row, pinv[i][q], phim, qq);
+        }
+      }
+  FHE_EXEC_RANGE_END
   FHE_TIMER_STOP;
 }
 
+void DoubleCRT::dualInnerProduct(DoubleCRT& out0, DoubleCRT& out1,
+                                 const vector<DoubleCRT>& x,
+                                 const vector<DoubleCRT>& y0,
+                                 const vector<DoubleCRT>& y1)
+{
+  long n = x.size();
+  assert(n > 0 && long(y0.size()) >= n && long(y1.size()) >= n);
+  vector<const DoubleCRT*> px(n), py0(n), py1(n);
+  for (long k: range(n)) {
+    px[k] = &x[k];
+    py0[k] = &y0[k];
+    py1[k] = &y1[k];
+  }
+  dualInnerProduct(out0, out1, px, py0, py1);
+}
+
+// The smallest column-block that dualInnerProduct hands to one task
+static const long ksMinBlock = 512;
+
+void DoubleCRT::dualInnerProduct(DoubleCRT& out0, DoubleCRT& out1,
+                                 const vector<const DoubleCRT*>& x,
+                                 const vector<const DoubleCRT*>& y0,
+                                 const vector<const DoubleCRT*>& y1)
+{
+  FHE_TIMER_START;
+  long n = x.size();
+  assert(n > 0 && long(y0.size()) >= n && long(y1.size()) >= n);
+
+  const FHEcontext& context = x[0]->context;
+  const IndexSet& s = x[0]->getIndexSet();
+  assert(&out0.context == &context && &out1.context == &context);
+  out0.map.clear(); out0.map.insert(s); // the new rows are set to zero
+  out1.map.clear(); out1.map.insert(s);
+  countCostRows(COST_INNER_PRODUCT, n*card(s));
+  if (isDryRun() || empty(s)) return;
+
+  for (long k: range(n))
+    assert(x[k]->getIndexSet() == s && s <= y0[k]->getIndexSet()
+           && s <= y1[k]->getIndexSet());
+
+  shared_ptr<const Vec<long>> ivecp = context.getIndexVector(s);
+  const Vec<long>& ivec = *ivecp;
+  long icard = ivec.length();
+  long phim = context.zMStar.getPhiM();
+
+  // Split the rows into column-blocks when there are fewer primes than
+  // threads. Blocks are multiples of 8 entries, to keep them aligned.
+  long nBlocks = std::max(1L, std::min(divc(fheAvailableThreads(), icard),
+                                       phim / ksMinBlock));
+  long blockSize = divc(divc(phim, nBlocks), 8) * 8;
+
+  FHE_EXEC_RANGE(icard*nBlocks, first, last)
+    // The rows of the n terms at this prime and column-block
+    static thread_local vector<const long*> tls_x, tls_y0, tls_y1;
+    tls_x.resize(n); tls_y0.resize(n); tls_y1.resize(n);
+
+    for (long t: range(first, last)) {
+      long i = ivec[t / nBlocks];
+      long lo = (t % nBlocks) * blockSize;
+      long len = std::min(blockSize, phim - lo);
+      if (len <= 0) continue;
+
+      for (long k: range(n)) {
+        tls_x[k] = x[k]->map[i] + lo;
+        tls_y0[k] = y0[k]->map[i] + lo;
+        tls_y1[k] = y1[k]->map[i] + lo;
+      }
+      // The sums are reduced lazily (see mulAccRows), and the second one
+      // finds the x rows of the block still in cache
+      const Cmodulus& mod = context.ithModulus(i);
+      long q = mod.getQ();
+      mulmod_t qinv = mod.getQInv();
+      mulAccRows(out0.map[i] + lo, tls_x.data(), tls_y0.data(), n, len,
+                 q, qinv);
+      mulAccRows(out1.map[i] + lo, tls_x.data(), tls_y1.data(), n, len,
+                 q, qinv);
+    }
+  FHE_EXEC_RANGE_END
+}
+
+// The word-size base-conversion kernels, defined next to toPoly
+static long coeffsModPrimes(Vec< Vec<long> >& remtab,
+                            const FHEcontext& context, const RowSlab& map,
+                            const IndexSet& s);
+static void baseExtend(Vec< Vec<long> >& out, Vec<long>* sgn,
+                       const Vec< Vec<long> >& remtab,
+                       const BaseConvTables& B, long phim);
+static void coeffsToRows(RowSlab& map, const FHEcontext& context,
+                         const IndexSet& s, const Vec< Vec<long> >& coeffs,
+                         const Vec<long>* scale);
+
 // expand index set by s1.
 // it is assumed that s1 is disjoint from the current index set.
+// The new rows are those of the balanced lift of the current ones, found
+// by the fast base extension rather than by toPoly: the coefficients never
+// leave single precision.
 void DoubleCRT::addPrimes(const IndexSet& s1)
 {
   FHE_TIMER_START;
@@ -337,17 +594,23 @@ void DoubleCRT::addPrimes(const IndexSet& s1)
     SetZero();
     return;
   }
-  ZZX poly;
-  toPoly(poly); // recover in coefficient representation
+  IndexSet s = getIndexSet();
+  countRows(COST_IFFT, s);
+  if (isDryRun()) {
+    map.insert(s1);
+    countRows(COST_FFT, s1);
+    return;
+  }
 
-  map.insert(s1);  // add new rows to the map
-  if (isDryRun()) return;
+  static thread_local Vec< Vec<long> > tls_remtab, tls_coeffs;
+  long phim = context.zMStar.getPhiM();
+  coeffsModPrimes(tls_remtab, context, map, s);
+  shared_ptr<const BaseConvTables> B = context.getBaseConvTables(s, s1);
+  baseExtend(tls_coeffs, nullptr, tls_remtab, *B, phim);
 
-  // fill in new rows
-  if (deg(poly)<=0) // special case for a constant polynomial
-    *this = coeff(poly,0); // no FFT is needed
-  else
-    FFT(poly, s1);
+  map.insert(s1);  // add new rows to the map, then fill them in
+  countRows(COST_FFT, s1);
+  coeffsToRows(map, context, s1, tls_coeffs, nullptr);
 }
 
 // Expand index set by s1, and multiply by \prod{q \in s1}. s1 is assumed to
@@ -374,20 +637,17 @@ double DoubleCRT::addPrimesAndScale(const IndexSet& s1)
   // scale existing rows
   long phim = context.zMStar.getPhiM();
   const IndexSet& iSet = map.getIndexSet();
+  countRows(COST_ROW_OP, iSet);
   for (long i: iSet) { 
     long qi = context.ithPrime(i);
     long f = rem(factor, qi);     // f = factor % qi
-    vec_long& row = map[i];
-    // scale row by a factor of f modulo qi
-    mulmod_precon_t bninv = PrepMulModPrecon(f, qi);
-    for (long j: range(phim))
-      row[j] = MulModPrecon(row[j], f, qi, bninv);
+    mulModRowConst(map[i], f, phim, qi); // scale row by f modulo qi
   }
 
   // insert new rows and fill them with zeros
   map.insert(s1);  // add new rows to the map
   for (long i: s1) { 
-    vec_long& row = map[i];
+    long *row = map[i];
     for (long j: range(phim)) row[j] = 0;
   }
 
@@ -396,19 +656,17 @@ double DoubleCRT::addPrimesAndScale(const IndexSet& s1)
 
 
 // *****************************************************
-DoubleCRTHelper::DoubleCRTHelper(const FHEcontext& context)
-{ 
-  val = context.zMStar.getPhiM(); 
-}
-
 DoubleCRT::DoubleCRT(const ZZX& poly, const FHEcontext &_context, const IndexSet& s)
-: context(_context), map(new DoubleCRTHelper(_context))
+: context(_context), map(_context.zMStar.getPhiM())
 {
   FHE_TIMER_START;
   assert(s.last() < context.numPrimes());
 
   map.insert(s);
-  if (isDryRun()) return;
+  if (isDryRun()) {
+    countRows(COST_FFT, s);
+    return;
+  }
 
   // convert the integer polynomial to FFT representation modulo the primes
   if (deg(poly)<=0) // special case for a constant polynomial
@@ -420,7 +678,7 @@ DoubleCRT::DoubleCRT(const ZZX& poly, const FHEcontext &_context, const IndexSet
 // FIXME-IndexSet
 #if 0
 DoubleCRT::DoubleCRT(const ZZX& poly, const FHEcontext &_context)
-: context(_context), map(new DoubleCRTHelper(_context))
+: context(_context), map(_context.zMStar.getPhiM())
 {
   FHE_TIMER_START;
   IndexSet s = IndexSet(0, context.numPrimes()-1);
@@ -437,7 +695,7 @@ DoubleCRT::DoubleCRT(const ZZX& poly, const FHEcontext &_context)
 }
 
 DoubleCRT::DoubleCRT(const ZZX& poly)
-: context(*activeContext), map(new DoubleCRTHelper(*activeContext))
+: context(*activeContext), map(*activeContext.zMStar.getPhiM())
 {
   FHE_TIMER_START;
   IndexSet s = IndexSet(0, context.numPrimes()-1);
@@ -459,13 +717,16 @@ DoubleCRT::DoubleCRT(const ZZX& poly)
 // FIXME: "code bloat": this just replicates the above with ZZX -> zzX
 
 DoubleCRT::DoubleCRT(const zzX& poly, const FHEcontext &_context, const IndexSet& s)
-: context(_context), map(new DoubleCRTHelper(_context))
+: context(_context), map(_context.zMStar.getPhiM())
 {
   FHE_TIMER_START;
   assert(s.last() < context.numPrimes());
 
   map.insert(s);
-  if (isDryRun()) return;
+  if (isDryRun()) {
+    countRows(COST_FFT, s);
+    return;
+  }
 
   // convert the integer polynomial to FFT representation modulo the primes
   if (lsize(poly)<=1) // special case for a constant polynomial
@@ -477,7 +738,7 @@ DoubleCRT::DoubleCRT(const zzX& poly, const FHEcontext &_context, const IndexSet
 // FIXME-IndexSet
 #if 0
 DoubleCRT::DoubleCRT(const zzX& poly, const FHEcontext &_context)
-: context(_context), map(new DoubleCRTHelper(_context))
+: context(_context), map(_context.zMStar.getPhiM())
 {
   FHE_TIMER_START;
   IndexSet s = IndexSet(0, context.numPrimes()-1);
@@ -495,7 +756,7 @@ DoubleCRT::DoubleCRT(const zzX& poly, const FHEcontext &_context)
 }
 
 DoubleCRT::DoubleCRT(const zzX& poly)
-: context(*activeContext), map(new DoubleCRTHelper(*activeContext))
+: context(*activeContext), map(*activeContext.zMStar.getPhiM())
 {
   FHE_TIMER_START;
   IndexSet s = IndexSet(0, context.numPrimes()-1);
@@ -514,19 +775,11 @@ DoubleCRT::DoubleCRT(const zzX& poly)
 #endif
 
 DoubleCRT::DoubleCRT(const FHEcontext &_context, const IndexSet& s)
-: context(_context), map(new DoubleCRTHelper(_context))
+: context(_context), map(_context.zMStar.getPhiM())
 {
   assert(s.last() < context.numPrimes());
 
-  map.insert(s);
-  if (isDryRun()) return;
-
-  long phim = context.zMStar.getPhiM();
-
-  for (long i: s) { 
-    vec_long& row = map[i];
-    for (long j: range(phim)) row[j] = 0;
-  }
+  map.insert(s); // the new rows are initialized to zero
 }
 
 // *****************************************************
@@ -534,7 +787,7 @@ DoubleCRT::DoubleCRT(const FHEcontext &_context, const IndexSet& s)
 // FIXME-IndexSet
 #if 0
 DoubleCRT::DoubleCRT(const FHEcontext &_context)
-: context(_context), map(new DoubleCRTHelper(_context))
+: context(_context), map(_context.zMStar.getPhiM())
 {
   IndexSet s = IndexSet(0, context.numPrimes()-1);
   // FIXME: maybe the default index set should be determined by context?
@@ -545,7 +798,7 @@ DoubleCRT::DoubleCRT(const FHEcontext &_context)
   long phim = context.zMStar.getPhiM();
 
   for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    vec_long& row = map[i];
+    long *row = map[i];
     for (long j = 0; j < phim; j++) row[j] = 0;
   }
 }
@@ -566,8 +819,8 @@ DoubleCRT& DoubleCRT::operator=(const DoubleCRT& other)
       const IndexSet& s = map.getIndexSet();
       long phim = context.zMStar.getPhiM();
       for (long i: s) {
-         vec_long& row = map[i];
-         const vec_long& other_row = other.map[i];
+         long *row = map[i];
+         const long *other_row = other.map[i];
          for (long j: range(phim))
             row[j] = other_row[j];
       }
@@ -576,9 +829,24 @@ DoubleCRT& DoubleCRT::operator=(const DoubleCRT& other)
 }
 
 
+DoubleCRT& DoubleCRT::operator=(DoubleCRT&& other)
+{
+   if (this == &other) return *this;
+
+   if (&context != &other.context) 
+      Error("DoubleCRT move assignment: incompatible contexts");
+
+   map = std::move(other.map);
+   return *this;
+}
+
+
 DoubleCRT& DoubleCRT::operator=(const ZZX& poly)
 {
-  if (isDryRun()) return *this;
+  if (isDryRun()) {
+    countRows(COST_FFT, map.getIndexSet());
+    return *this;
+  }
 
   const IndexSet& s = map.getIndexSet();
   if (deg(poly)<=0) // special case for a constant polynomial
@@ -590,7 +858,10 @@ DoubleCRT& DoubleCRT::operator=(const ZZX& poly)
 
 DoubleCRT& DoubleCRT::operator=(const zzX& poly)
 {
-  if (isDryRun()) return *this;
+  if (isDryRun()) {
+    countRows(COST_FFT, map.getIndexSet());
+    return *this;
+  }
 
   const IndexSet& s = map.getIndexSet();
   // convert the integer polynomial to FFT representation modulo the primes
@@ -609,7 +880,7 @@ DoubleCRT& DoubleCRT::operator=(const ZZ& num)
   long phim = context.zMStar.getPhiM();
 
   for (long i: s) {
-    vec_long& row = map[i];
+    long *row = map[i];
     long pi = context.ithPrime(i);
     long n = rem(num, pi);
 
@@ -636,194 +907,254 @@ long DoubleCRT::getOneRow(zz_pX& row, long idx) const
 // If idx is not in the current primesSet then do nothing and return 0;
 long DoubleCRT::getOneRow(Vec<long>& row, long idx, bool positive) const
 {
-  zz_pBak bak; bak.save();   // backup NTL's current modulus
-
-  zz_pX& tmp = Cmodulus::getScratch_zz_pX();
-  long q = getOneRow(tmp,idx);
-  if (q==0) return 0;        // no such index
+  if (!map.getIndexSet().contains(idx)) // idx not in the primeset
+    return 0;
 
-  conv(row, tmp.rep);        // copy the row to Vec<long> format
+  long phim = context.zMStar.getPhiM();
+  long q = context.ithPrime(idx);
+  row.SetLength(phim);
+  context.ithModulus(idx).iFFT(row.elts(), map[idx]); // in [0,q)
 
   // By default, integers are in [0,q).
   // If we need the symmetric interval then make it so.
-  if (!positive) {
-    long phim = context.zMStar.getPhiM();
+  if (!positive)
     for (long j: range(phim)) if (row[j] > q/2) row[j] -= q;
-  }
   return q;
 }
 
-// A parallelizable implementation of toPoly
-void DoubleCRT::toPoly(ZZX& poly, const IndexSet& s,
-		       bool positive) const
+// The coefficients of the rows of map in s, each one modulo its own prime:
+// remtab[h][j] = the h'th coefficient modulo the j'th prime of s. The
+// inverse FFTs run in parallel over the primes. Returns card(s).
+static long coeffsModPrimes(Vec< Vec<long> >& remtab,
+                            const FHEcontext& context, const RowSlab& map,
+                            const IndexSet& s)
 {
-  FHE_TIMER_START;
-  if (isDryRun()) return;
-
-  IndexSet s1 = map.getIndexSet() & s;
-  if (empty(s1)) { // nothing to do
-    clear(poly);
-    return;
-  }
+  FHE_NTIMER_START(toPoly_FFT);
 
   // To avoid allocating these with every call, they are defined static
   // but thread_local, so concurrent calls to toPoly by multiple threads
   // will have different copies. (tls_ = "Thread-Local Storage")
-  static thread_local Vec<long> tls_ivec;
-  static thread_local Vec<long> tls_pvec;
-  static thread_local Vec< Vec<long> > tls_remtab;
-  static thread_local Vec<zz_pX> tls_tmpvec;
+  static thread_local Vec< Vec<long> > tls_tmpvec;
 
-  // For readability, call them by names without the tls_
-  Vec<long>& ivec = tls_ivec;      // the indexes of the active primes
-  Vec<long>& pvec = tls_pvec;
-  Vec< Vec<long> >& remtab = tls_remtab;// remtab[*][i] = coeffs of tmpvec[i]
-  Vec<zz_pX>& tmpvec = tls_tmpvec; // tmpvec[i] = current poly in i'th thread
+  // For readability, call it by a name without the tls_
+  Vec< Vec<long> >& tmpvec = tls_tmpvec; // tmpvec[i] = current row in
+                                   // the i'th thread
 
-  // initialize the ivec vector, ivec[j] = index of j'th active prime
+  // ivec[j] = index of j'th active prime, kept by the context
   long phim = context.zMStar.getPhiM();
-  long icard = MakeIndexVector(s1, ivec); // icard = how many active primes
+  shared_ptr<const Vec<long>> ivecp = context.getIndexVector(s);
+  const Vec<long>& ivec = *ivecp;
+  long icard = ivec.length(); // icard = how many active primes
 
   // Which primes are handled by what thread
-  PartitionInfo pinfo(icard);      // allocate threads to handle icard primes
+  // allocate threads to handle icard primes
+  PartitionInfo pinfo(icard, fheAvailableThreads());
   long cnt = pinfo.NumIntervals(); // how many threads are allocated
 
   // allocate space for all the coefficients modulo all the primes
   remtab.SetLength(phim);
   for (long h: range(phim)) remtab[h].SetLength(icard);
 
-  // allocate space for the polynomials modulo all the primes
+  // allocate space for the rows modulo all the primes
   tmpvec.SetLength(cnt);
-  for (long i: range(cnt)) tmpvec[i].SetMaxLength(phim);
+  for (long i: range(cnt)) tmpvec[i].SetLength(phim);
 
-  // Run the inverse FFT modulo the different primes in parallel
-  {
-  FHE_NTIMER_START(toPoly_FFT);  
-  NTL_EXEC_INDEX(cnt, index)
+  // Run the inverse FFT modulo the different primes in parallel, with
+  // the moduli given explicitly (NTL's current modulus is not involved)
+  FHE_EXEC_INDEX(cnt, index)
       long first, last;
       pinfo.interval(first, last, index);
 
-      zz_pX& tmp = tmpvec[index];
-  
+      long *tmp = tmpvec[index].elts();
       for (long j: range(first, last)) {
         long i = ivec[j];
         context.ithModulus(i).iFFT(tmp, map[i]); // inverse FFT
-  
-        long d = deg(tmp); // copy the coefficents, pad by zeros if needed
-        for (long h = 0; h <= d; h++) remtab[h][j] = rep(tmp.rep[h]);
-        for (long h = d+1; h < phim; h++) remtab[h][j] = 0;
+        for (long h = 0; h < phim; h++) remtab[h][j] = tmp[h];
       }
-  NTL_EXEC_INDEX_END
-  } // release space of local variables
+  FHE_EXEC_INDEX_END
+  return icard;
+}
 
-  // Run the integer CRT in parallel for the different coefficients
-  {
-  FHE_NTIMER_START(toPoly_CRT);
-  PartitionInfo pinfo1(phim);
-  long cnt1 = pinfo1.NumIntervals();
+// The integer CRT of one coefficient, given its residues remvec. tmp
+// should have room for T.sz+4 limbs.
+static inline void crtCoefficient(ZZ& tmp, const long *remvec,
+                                  const CrtTables& T, bool positive)
+{
+  long icard = T.qvec.length();
+  const long *qvecp = T.qvec.elts();
+  const double *qrecipvecp = T.qrecipvec.elts();
+  const long *tvecp = T.tvec.elts();
+  const mulmod_precon_t *tqinvvecp = T.tqinvvec.elts();
+  const ZZ *prod1vecp = T.prod1vec.elts();
+
+  clear(tmp);
+  double quotient = 0;
+  for (long j: range(icard)) { // Add one prime at a time
+    long q = qvecp[j];
+    long r = MulModPrecon(remvec[j], tvecp[j], q, tqinvvecp[j]);
+    MulAddTo(tmp, prod1vecp[j], r);
+    quotient += r*qrecipvecp[j];
+  }
+  // reduce modulo prod
+  MulSubFrom(tmp, T.prod, long(quotient));
+  while (tmp < 0) add(tmp, tmp, T.prod);
+  while (tmp >= T.prod) sub(tmp, tmp, T.prod);
+  // if !positive, reduce to the interval [-prod/2, prod/2]
+  if (!positive && tmp >= T.prodHalf) 
+    tmp -= T.prod;
+}
 
-  // static thread-local variables to avoid re-allocation
-  static thread_local ZZ tls_prod;
-  static thread_local ZZ tls_prod_half;
-  static thread_local Vec<long> tls_qvec;
-  static thread_local Vec<double> tls_qrecipvec;
-  static thread_local Vec<long> tls_tvec;
-  static thread_local Vec<mulmod_precon_t> tls_tqinvvec;
+// The fast base extension. For each coefficient h of the residues remtab
+// over the primes of B.crt, x_h is its balanced lift, in
+// [-(prod-1)/2, (prod-1)/2]. out[k][h] = x_h mod t_k, in [0,t_k), for
+// each target t_k of B. If sgn is not NULL then sgn[h] = sign(x_h) too.
+// x_h = sum_j r_j*(prod/q_j) - v*prod, as in toPolyMod, so only single
+// precision is used, except for the coefficients whose v (or sign) the
+// floating-point sum leaves unsure.
+static void baseExtend(Vec< Vec<long> >& out, Vec<long>* sgn,
+                       const Vec< Vec<long> >& remtab,
+                       const BaseConvTables& B, long phim)
+{
+  FHE_NTIMER_START(baseExtend);
+  const CrtTables& T = *B.crt;
+  long icard = T.qvec.length();
+  long tcard = B.tvec.length();
+  out.SetLength(tcard);
+  for (long k: range(tcard)) out[k].SetLength(phim);
+  if (sgn) sgn->SetLength(phim);
+
+  double eps = (icard+1) * std::ldexp(1.0, -40);
+
+  FHE_EXEC_RANGE(phim, first, last)
+      const long *qvecp = T.qvec.elts();
+      const double *qrecipvecp = T.qrecipvec.elts();
+      const long *tvecp = T.tvec.elts();
+      const mulmod_precon_t *tqinvvecp = T.tqinvvec.elts();
+      Vec<long> rvec(INIT_SIZE, icard);
+      long *r = rvec.elts();
+      ZZ tmp;
 
-  static thread_local ZZVec tls_prod1vec;
-  static thread_local ZZVec tls_resvec;
+      for (long h: range(first, last)) {
+        const long *remvec = remtab[h].elts();
+        double quotient = 0;
+        for (long j: range(icard)) {
+          r[j] = MulModPrecon(remvec[j], tvecp[j], qvecp[j], tqinvvecp[j]);
+          quotient += r[j]*qrecipvecp[j];
+        }
+        if (quotient == 0) { // all the residues are zero
+          for (long k: range(tcard)) out[k][h] = 0;
+          if (sgn) (*sgn)[h] = 0;
+          continue;
+        }
+        double v = std::floor(quotient + 0.5);
+        double frac = quotient - v; // ~ x_h/prod
+        if (std::fabs(std::fabs(frac) - 0.5) < eps
+            || (sgn && std::fabs(frac) < eps)) { // the exact CRT
+          tmp.SetSize(T.sz+4);
+          crtCoefficient(tmp, remvec, T, /*positive=*/false);
+          for (long k: range(tcard)) out[k][h] = rem(tmp, B.tvec[k]);
+          if (sgn) (*sgn)[h] = sign(tmp);
+          continue;
+        }
+        long lv = long(v);
+        for (long k: range(tcard)) {
+          long t = B.tvec[k];
+          const long *pmod = B.prod1mod[k].elts();
+          const mulmod_precon_t *pprecon = B.prod1precon[k].elts();
+          long acc = 0;
+          for (long j: range(icard)) {
+            long a = (r[j] < t)? r[j] : r[j] % t;
+            acc = AddMod(acc, MulModPrecon(a, pmod[j], t, pprecon[j]), t);
+          }
+          out[k][h] = SubMod(acc, MulMod(lv % t, B.prodmod[k], t,
+                                         B.tinvvec[k]), t);
+        }
+        if (sgn) (*sgn)[h] = (frac < 0)? -1 : 1;
+      }
+  FHE_EXEC_RANGE_END
+}
 
-  ZZ& prod = tls_prod;                   // product of all the primes
-  ZZ& prod_half = tls_prod_half;         // = (prod+1)/2
-  ZZVec& prod1vec = tls_prod1vec;        // prod1vec[i] = prod / qi
-  Vec<long>& qvec = tls_qvec;            // vector of the primes themselves
-  Vec<double>& qrecipvec = tls_qrecipvec;// keeps 1/qi for each prime qi
-  Vec<long>& tvec = tls_tvec;            // tvec[i] = (prod / qi)^{-1} mod qi
-  Vec<mulmod_precon_t>& tqinvvec = tls_tqinvvec; // tvec with extra tables
-  ZZVec& resvec = tls_resvec;
+// Back to evaluation form: for the k'th prime q of s the row of q in map
+// becomes FFT(coeffs[k]), or (row - FFT(coeffs[k])) * scale[k] mod q when
+// scale is not NULL. The primes are split between the threads.
+static void coeffsToRows(RowSlab& map, const FHEcontext& context,
+                         const IndexSet& s, const Vec< Vec<long> >& coeffs,
+                         const Vec<long>* scale)
+{
+  FHE_NTIMER_START(coeffsToRows);
+  shared_ptr<const Vec<long>> ivecp = context.getIndexVector(s);
+  const Vec<long>& ivec = *ivecp;
+  long icard = ivec.length();
+  long phim = context.zMStar.getPhiM();
 
-  qvec.SetLength(icard);
-  qrecipvec.SetLength(icard);
-  tvec.SetLength(icard);
-  tqinvvec.SetLength(icard);
-
-  // store the primes and reciprocals, and compute their product
-  prod = 1;
-  for (long j: range(icard)) {
-    long i = ivec[j];
-    long q = context.ithModulus(i).getQ(); // the prime
-    qvec[j] = q;
-    qrecipvec[j] = 1/double(q);
-    mul(prod, prod, q);
-  }
-  long sz = prod.size(); // size of the product
+  FHE_EXEC_RANGE(icard, first, last)
+      Vec<long> tmp(INIT_SIZE, phim);
+      for (long k: range(first, last)) {
+        long i = ivec[k];
+        const Cmodulus& mod = context.ithModulus(i);
+        if (!scale) {
+          mod.FFT(map[i], coeffs[k]);
+          continue;
+        }
+        long q = mod.getQ();
+        mod.FFT(tmp.elts(), coeffs[k]);
+        subModRow(map[i], tmp.elts(), phim, q);
+        mulModRowConst(map[i], (*scale)[k], phim, q);
+      }
+  FHE_EXEC_RANGE_END
+}
 
-  // reallocate space only if needed
-  if (prod1vec.length() != icard || prod1vec.BaseSize() != sz+1) {
-    prod1vec.kill();
-    prod1vec.SetSize(icard, sz+1); // icard integers of size<=sz+1 each
-  }
+// A parallelizable implementation of toPoly
+void DoubleCRT::toPoly(ZZX& poly, const IndexSet& s,
+		       bool positive) const
+{
+  FHE_TIMER_START;
+  countRows(COST_IFFT, map.getIndexSet() & s);
+  if (isDryRun()) return;
 
-  // compute (prod / qi)^{-1} mod qi
-  for (long j: range(icard)) { 
-    long q = qvec[j];
-    div(prod1vec[j], prod, q);
-    long t = rem(prod1vec[j], q);
-    t = InvMod(t, q);
-    tvec[j] = t;
-    tqinvvec[j] = PrepMulModPrecon(t, q);
+  IndexSet s1 = map.getIndexSet() & s;
+  if (empty(s1)) { // nothing to do
+    clear(poly);
+    return;
   }
 
+  // remtab[*][i] = coeffs modulo the i'th prime
+  static thread_local Vec< Vec<long> > tls_remtab;
+  Vec< Vec<long> >& remtab = tls_remtab;
+  long phim = context.zMStar.getPhiM();
+  coeffsModPrimes(remtab, context, map, s1);
+
+  // Run the integer CRT in parallel for the different coefficients
+  {
+  FHE_NTIMER_START(toPoly_CRT);
+  PartitionInfo pinfo1(phim, fheAvailableThreads());
+  long cnt1 = pinfo1.NumIntervals();
+
+  // The products of the primes and the inverses are kept by the context
+  shared_ptr<const CrtTables> tables = context.getCrtTables(s1);
+  const CrtTables& T = *tables;
+  long sz = T.sz; // size of the product
+
+  static thread_local ZZVec tls_resvec;
+  ZZVec& resvec = tls_resvec;
   if (resvec.length() != phim || resvec.BaseSize() != sz+1) {
     resvec.kill();
     resvec.SetSize(phim, sz+1);
   }
 
-  if (!positive) { // prod_half = (prod+1)/2
-    add(prod_half, prod, 1);
-    div(prod_half, prod_half, 2);
-  }
-  
   // Compute the actual CRT reconstruction
-  NTL_EXEC_INDEX(cnt1, index)
-  NTL_IMPORT(icard)
+  FHE_EXEC_INDEX(cnt1, index)
       long first, last;
       pinfo1.interval(first, last, index);
 
-      long *qvecp = qvec.elts();
-      double *qrecipvecp = qrecipvec.elts();
-      long *tvecp = tvec.elts();
-      mulmod_precon_t *tqinvvecp = tqinvvec.elts();
-      ZZ *prod1vecp = prod1vec.elts();
-
       ZZ tmp;
       tmp.SetSize(sz+4);
 
       for (long h: range(first, last)) { // CRT the h'th coefficient
-        clear(tmp);
-        double quotient = 0;
-        long *remvec = remtab[h].elts();
-        
-        for (long j: range(icard)) { // Add one prime at a time
-          long q = qvecp[j];
-          long t = tvecp[j];
-          mulmod_precon_t tqinv = tqinvvecp[j];
-          long r = remvec[j];
-          double qrecip = qrecipvecp[j];
-          r = MulModPrecon(r, t, q, tqinv);
-          MulAddTo(tmp, prod1vecp[j], r);
-          quotient += r*qrecip;
-        }
-        // reduce modulo prod
-        MulSubFrom(tmp, prod, long(quotient));
-        while (tmp < 0) add(tmp, tmp, prod);
-        while (tmp >= prod) sub(tmp, tmp, prod);
-        // if !positive, reduce to the interval [-prod/2, prod/2]
-        if (!positive && tmp >= prod_half) 
-          tmp -= prod;
+        crtCoefficient(tmp, remtab[h].elts(), T, positive);
         resvec[h] = tmp;
       }
-  NTL_EXEC_INDEX_END
+  FHE_EXEC_INDEX_END
 
   poly.SetLength(phim);
   for (long j: range(phim)) poly[j] = resvec[j];
@@ -835,6 +1166,81 @@ void DoubleCRT::toPoly(ZZX& poly, const IndexSet& s,
   }
 }
 
+// The same integer CRT, but only the result mod Q is kept, so every
+// coefficient is computed with single-precision arithmetic: with
+// r_j = rem_j * t_j mod q_j the coefficient is x = sum_j r_j*(prod/q_j)
+// minus v*prod, where v is the integer part (or the rounding, for the
+// balanced lift) of sum_j r_j/q_j, so x mod Q only needs (prod/q_j) mod Q
+// and prod mod Q. That sum is computed in floating point, and the few
+// coefficients for which it is too close to a rounding boundary to be
+// sure of v go through the big-integer CRT instead.
+void DoubleCRT::toPolyMod(zzX& poly, long Q, const IndexSet& s,
+                          bool positive) const
+{
+  FHE_TIMER_START;
+  assert(Q > 1 && Q < NTL_SP_BOUND);
+  countRows(COST_IFFT, map.getIndexSet() & s);
+  if (isDryRun()) return;
+
+  IndexSet s1 = map.getIndexSet() & s;
+  long phim = context.zMStar.getPhiM();
+  if (empty(s1)) { // nothing to do
+    poly.SetLength(0);
+    return;
+  }
+
+  static thread_local Vec< Vec<long> > tls_remtab;
+  Vec< Vec<long> >& remtab = tls_remtab;
+  long icard = coeffsModPrimes(remtab, context, map, s1);
+
+  FHE_NTIMER_START(toPolyMod_CRT);
+  shared_ptr<const CrtTables> tables = context.getCrtTables(s1);
+  const CrtTables& T = *tables;
+
+  Vec<long> prod1modQ(INIT_SIZE, icard); // (prod/q_j) mod Q
+  for (long j: range(icard)) prod1modQ[j] = rem(T.prod1vec[j], Q);
+  long prodModQ = rem(T.prod, Q);
+  mulmod_t Qinv = PrepMulMod(Q);
+
+  // a bound on the rounding error of the floating-point sum
+  double eps = (icard+1) * std::ldexp(1.0, -40);
+
+  poly.SetLength(phim);
+  long *out = poly.elts();
+  FHE_EXEC_RANGE(phim, first, last)
+      const long *qvecp = T.qvec.elts();
+      const double *qrecipvecp = T.qrecipvec.elts();
+      const long *tvecp = T.tvec.elts();
+      const mulmod_precon_t *tqinvvecp = T.tqinvvec.elts();
+      const long *pmodQ = prod1modQ.elts();
+      ZZ tmp;
+
+      for (long h: range(first, last)) {
+        const long *remvec = remtab[h].elts();
+        long acc = 0;
+        double quotient = 0;
+        for (long j: range(icard)) {
+          long q = qvecp[j];
+          long r = MulModPrecon(remvec[j], tvecp[j], q, tqinvvecp[j]);
+          acc = AddMod(acc, MulMod(r % Q, pmodQ[j], Q, Qinv), Q);
+          quotient += r*qrecipvecp[j];
+        }
+        double frac = quotient - std::floor(quotient);
+        bool unsure = positive? (frac < eps || frac > 1-eps)
+                              : (std::fabs(frac - 0.5) < eps);
+        if (unsure) { // the exact CRT of this coefficient
+          tmp.SetSize(T.sz+4);
+          crtCoefficient(tmp, remvec, T, positive);
+          out[h] = rem(tmp, Q);
+          continue;
+        }
+        long v = positive? long(quotient) : long(std::floor(quotient + 0.5));
+        out[h] = SubMod(acc, MulMod(v % Q, prodModQ, Q, Qinv), Q);
+      }
+  FHE_EXEC_RANGE_END
+  poly.normalize();
+}
+
 
 
 
@@ -847,6 +1253,7 @@ void DoubleCRT::toPoly(ZZX& p, bool positive) const
 // Division by constant
 DoubleCRT& DoubleCRT::operator/=(const ZZ &num)
 {
+  countRows(COST_ROW_OP, map.getIndexSet());
   if (isDryRun()) return *this;
 
   const IndexSet& s = map.getIndexSet();
@@ -855,10 +1262,7 @@ DoubleCRT& DoubleCRT::operator/=(const ZZ &num)
   for (long i: s) { 
     long pi = context.ithPrime(i);
     long n = InvMod(rem(num, pi),pi);  // n = num^{-1} mod pi
-    vec_long& row = map[i];
-    mulmod_precon_t precon = PrepMulModPrecon(n, pi);
-    for (long j: range(phim))
-      row[j] = MulModPrecon(row[j], n, pi, precon);
+    mulModRowConst(map[i], n, phim, pi);
   }
   return *this;
 }
@@ -866,6 +1270,7 @@ DoubleCRT& DoubleCRT::operator/=(const ZZ &num)
 // Small-exponent polynomial exponentiation
 void DoubleCRT::Exp(long e)
 {
+  countRows(COST_ROW_OP, map.getIndexSet());
   if (isDryRun()) return;
 
   const IndexSet& s = map.getIndexSet();
@@ -873,108 +1278,106 @@ void DoubleCRT::Exp(long e)
   
   for (long i: s) { 
     long pi = context.ithPrime(i);
-    vec_long& row = map[i];
+    long *row = map[i];
     for (long j: range(phim))
       row[j] = PowerMod(row[j], e, pi);
   }
 }
 
-// Apply the automorphism F(X) --> F(X^k)  (with gcd(k,m)=1)
-#if 1
-void DoubleCRT::automorph(long k)
+// Permute the rows of map in s by the same table, new[j] = old[perm[j]].
+// The primes are split between the threads, and each thread gathers from
+// a copy of the row in its own scratch, kept from one call to the next.
+static void permuteRows(RowSlab& map, const FHEcontext& context,
+                        const IndexSet& s, const long* perm, long phim)
 {
-  if (isDryRun()) return;
-
-  const PAlgebra& zMStar = context.zMStar;
-  if (!zMStar.inZmStar(k))
-    Error("DoubleCRT::automorph: k not in Zm*");
-
-  long m = zMStar.getM();
-  long phim = zMStar.getPhiM();
-  vector<long> tmp(m);  // temporary array of size m
-  mulmod_precon_t precon = PrepMulModPrecon(k, m);
-
-  const IndexSet& s = map.getIndexSet();
-
-  // go over the rows, permute them one at a time
-  for (long i: s) { 
-    vec_long& row = map[i];
-
-    // Compute new[j] = old[j*k mod m]
-
-    // for (long j=1; j<m; j++) { // 1st pass: copy to temporary array
-    //   long idx = zMStar.indexInZmstar_unchecked(j);
-    //   if (idx>=0) tmp[j] = row[idx];
-    // }
-    // for (long j=1; j<m; j++) { // 2nd pass: copy back from temporary array
-    //   long idx = zMStar.indexInZmstar_unchecked(j);
-    //   if (idx>=0) row[idx] = tmp[MulModPrecon(j,k,m,precon)];
-    //                                        // new[j] = old[j*k mod m]
-    // }
-
-    // slightly faster...
-
-    for (long j: range(phim)) {// 1st pass: copy to temporary array
-       tmp[zMStar.repInZmstar_unchecked(j)] = row[j];
-    }
-    for (long j: range(phim)) {// 2nd pass: copy back from temp array
-       row[j] = tmp[MulModPrecon(zMStar.repInZmstar_unchecked(j),k,m,precon)];
-    }
-  }
+  shared_ptr<const Vec<long>> ivecp = context.getIndexVector(s);
+  const Vec<long>& ivec = *ivecp;
+  long icard = ivec.length();
+  FHE_EXEC_RANGE(icard, first, last)
+      static thread_local vector<long> tls_tmp;
+      vector<long>& tmp = tls_tmp; // this worker's copy
+      tmp.resize(phim);
+      long *t = tmp.data();
+      for (long k: range(first, last)) {
+        long *row = map[ivec[k]];
+        std::memcpy(t, row, phim*sizeof(long));
+        for (long j: range(phim)) row[j] = t[perm[j]];
+      }
+  FHE_EXEC_RANGE_END
 }
 
-#else
-// VJS: I tried this as an alternative...it is slower :-(
+// Apply the automorphism F(X) --> F(X^k)  (with gcd(k,m)=1), through the
+// permutation table kept by the context
 void DoubleCRT::automorph(long k)
 {
+  countRows(COST_AUTOMORPH, map.getIndexSet());
   if (isDryRun()) return;
+
   const PAlgebra& zMStar = context.zMStar;
   if (!zMStar.inZmStar(k))
     Error("DoubleCRT::automorph: k not in Zm*");
-  long m = zMStar.getM();
-  long phim = zMStar.getPhiM();
-  vector<long> tmp(phim);  // temporary array of size m
-
-  k = InvMod(k, m);
-  mulmod_precon_t precon = PrepMulModPrecon(k, m);
-  const IndexSet& s = map.getIndexSet();
 
-  // go over the rows, permute them one at a time
-  // new[j*k mod m] = old[j]
-  for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    vec_long& row = map[i];
-
-    for (long j = 0; j < phim; j++) tmp[j] = row[j];
-
-    for (long j = 0; j < phim; j++) {
-       long rep = zMStar.repInZmstar_unchecked(j);
-       rep = MulModPrecon(rep, k, m, precon);
-       long idx = zMStar.indexInZmstar_unchecked(rep);
-       row[idx] = tmp[j];
-    }
-  }
+  shared_ptr<const vector<long>> perm = context.getAutomorphPerm(k);
+  permuteRows(map, context, map.getIndexSet(), perm->data(),
+              zMStar.getPhiM());
 }
-#endif
 
 // Compute the complex conjugate, this is the same as automorph(m-1)
 void DoubleCRT::complexConj()
 {
+  countRows(COST_AUTOMORPH, map.getIndexSet());
   if (isDryRun()) return;
 
-  const PAlgebra& zMStar = context.zMStar;
-  long phim = zMStar.getPhiM();
-
   const IndexSet& s = map.getIndexSet();
-
-  // go over the rows, permute them one at a time
-  for (long i: s) { 
-    vec_long& row = map[i];
-    for (long j: range(phim/2)) {// swap i <-> phi(m)-i-1
-      std::swap(row[j], row[phim-j-1]);
-    }
-  }
+  long phim = context.zMStar.getPhiM();
+  shared_ptr<const Vec<long>> ivecp = context.getIndexVector(s);
+  const Vec<long>& ivec = *ivecp;
+  long icard = ivec.length();
+
+  // reverse the rows, index j <-> phi(m)-j-1
+  FHE_EXEC_RANGE(icard, first, last)
+      for (long k: range(first, last)) {
+        long *row = map[ivec[k]];
+        std::reverse(row, row+phim);
+      }
+  FHE_EXEC_RANGE_END
 }
 
+// Prime by prime: the coefficients of the row of other, every d'th of them
+// and back to evaluations modulo the same prime for the smaller m
+void DoubleCRT::ringProject(const DoubleCRT& other, long d)
+{
+  FHE_TIMER_START;
+  const IndexSet& s = other.map.getIndexSet();
+  long phim = context.zMStar.getPhiM();
+  long otherPhim = other.context.zMStar.getPhiM();
+  if (d < 1 || other.context.zMStar.getM() != d*context.zMStar.getM()
+      || otherPhim != d*phim)
+    Error("DoubleCRT::ringProject: the rings do not match");
+  for (long i: s)
+    if (context.ithPrime(i) != other.context.ithPrime(i))
+      Error("DoubleCRT::ringProject: the primes do not match");
+
+  map.remove(map.getIndexSet() / s);
+  map.insert(s / map.getIndexSet());
+  countRows(COST_IFFT, s);
+  countRows(COST_FFT, s);
+  if (isDryRun()) return;
+
+  shared_ptr<const Vec<long>> ivecp = context.getIndexVector(s);
+  const Vec<long>& ivec = *ivecp;
+  long icard = ivec.length();
+  FHE_EXEC_RANGE(icard, first, last)
+      Vec<long> coeffs(INIT_SIZE, otherPhim);
+      zzX sub(INIT_SIZE, phim);
+      for (long k: range(first, last)) {
+        long i = ivec[k];
+        other.context.ithModulus(i).iFFT(coeffs.elts(), other.map[i]);
+        for (long j: range(phim)) sub[j] = coeffs[j*d];
+        context.ithModulus(i).FFT(map[i], sub);
+      }
+  FHE_EXEC_RANGE_END
+}
 
 // fills each row i with random integers mod pi
 void DoubleCRT::randomize(const ZZ* seed) 
@@ -1002,7 +1405,7 @@ void DoubleCRT::randomize(const ZZ* seed)
     long nb = (k+7)/8;
     unsigned long mask = (1UL << k) - 1UL;
 
-    vec_long& row = map[i];
+    long *row = map[i];
     long j = 0;
     
     for (;;) {
@@ -1133,8 +1536,14 @@ xdouble DoubleCRT::sampleUniform(const ZZ& B)
   return retval;
 }
 
+// The residues of delta = (*this mod diffProd), the balanced lift of the
+// rows to drop, are found at the primes that remain by the fast base
+// extension, together with delta mod ptxtSpace, so that delta is made
+// divisible by ptxtSpace, subtracted and divided by diffProd without ever
+// leaving single precision.
 void DoubleCRT::scaleDownToSet(const IndexSet& s, long ptxtSpace)
 {
+  FHE_TIMER_START;
   IndexSet diff = getIndexSet() / s;
   if (empty(diff)) return;     // nothing to do
 
@@ -1144,44 +1553,57 @@ void DoubleCRT::scaleDownToSet(const IndexSet& s, long ptxtSpace)
     removePrimes(diff);// remove the primes from consideration
     return;
   }
-
-  ZZX delta;
-  ZZ diffProd = context.productOfPrimes(diff); // mod-down by this factor
-  toPoly(delta, diff); // convert to coeff-representation modulo diffProd
+  IndexSet rest = getIndexSet() / diff;
+  countRows(COST_IFFT, diff);
+  countRows(COST_FFT, rest);
+  countRows(COST_ROW_OP, rest);
+
+  // delta[k] = delta mod the k'th prime of rest, and mod ptxtSpace last
+  static thread_local Vec< Vec<long> > tls_remtab, tls_delta;
+  static thread_local Vec<long> tls_sgn;
+  Vec< Vec<long> >& delta = tls_delta;
+  long phim = context.zMStar.getPhiM();
+  coeffsModPrimes(tls_remtab, context, map, diff);
+  shared_ptr<const BaseConvTables> B =
+    context.getBaseConvTables(diff, rest, ptxtSpace);
+  baseExtend(delta, (ptxtSpace == 2)? &tls_sgn : nullptr, tls_remtab, *B,
+             phim);
+  long rcard = card(rest);
 
   if (ptxtSpace > 1) { // make delta divisible by ptxtSpace
-    long delta_len = delta.rep.length();
-    if (ptxtSpace == 2) { // simpler handling for plaintext space mod 2
-      for (long i: range(delta_len)) { 
-        if (IsOdd(delta.rep[i])) { // add or subtract diffProd to make it even
-          if (sign(delta.rep[i]) < 0) delta.rep[i] += diffProd;
-          else                        delta.rep[i] -= diffProd;
+    // Subtract from each coefficient delta[i] the integer diffProd*c[i],
+    // which does not change delta modulo diffProd. For ptxtSpace == 2, c[i]
+    // is the sign of an odd delta[i] (so it moves towards zero); otherwise
+    // c[i] = delta[i]*diffProd^{-1} mod ptxtSpace, in the symmetric interval
+    const Vec<long>& dmodp = delta[rcard];
+    const Vec<long>& sgn = tls_sgn; // the workers have their own tls_sgn
+    long p_over_2 = ptxtSpace/2;
+    long prodInv = B->prodinv[rcard];
+    mulmod_precon_t precon = PrepMulModPrecon(prodInv, ptxtSpace);
+    FHE_EXEC_RANGE(phim, first, last)
+        for (long h: range(first, last)) {
+          long c;
+          if (ptxtSpace == 2) c = (dmodp[h] != 0)? sgn[h] : 0;
+          else {
+            c = MulModPrecon(dmodp[h], prodInv, ptxtSpace, precon);
+            if (c > p_over_2) c -= ptxtSpace;
+          }
+          if (c == 0) continue;
+          for (long k: range(rcard)) {
+            long q = B->tvec[k];
+            long cq = c % q;
+            if (cq < 0) cq += q;
+            delta[k][h] = SubMod(delta[k][h],
+                                 MulMod(cq, B->prodmod[k], q, B->tinvvec[k]),
+                                 q);
+          }
         }
-      }
-    }
-    // The general case of plaintext space modulo some p > 2, we
-    // need to subtract from each coefficient delta[i] the integer
-    //          diffProd * (delta[i] * diffProd^{-1} mod ptxtSpace).
-    // This does not change delta modulo diffProd, but makes it
-    // divisible by ptxtSpace.
-    else {
-      long p_over_2 = ptxtSpace/2;
-      long prodInv = InvMod(rem(diffProd,ptxtSpace), ptxtSpace);
-      mulmod_precon_t precon = PrepMulModPrecon(prodInv, ptxtSpace); // optimization
-      for (long i: range(delta_len)) { 
-        long delta_i_modP = rem(delta.rep[i],ptxtSpace);
-        if (delta_i_modP != 0) { // if not already 0 mod ptxtSpace
-          delta_i_modP = MulModPrecon(delta_i_modP, prodInv, ptxtSpace, precon);
-          if (delta_i_modP > p_over_2) delta_i_modP -= ptxtSpace;
-          delta.rep[i] -= diffProd * delta_i_modP;
-        }
-      }
-    }
-    delta.normalize(); // normalize after working directly on the coeffs
+    FHE_EXEC_RANGE_END
   }
   removePrimes(diff);// remove the primes from consideration
-  *this -= delta;    // convert delta to DoubleCRT, then subtract
-  *this /= diffProd; // *this is divisible by diffProd, so this operation actually scales it down
+
+  // *this = (*this - delta)/diffProd, one prime at a time
+  coeffsToRows(map, context, rest, delta, &B->prodinv);
 }
 
 ostream& operator<< (ostream &str, const DoubleCRT &d)
@@ -1189,9 +1611,17 @@ ostream& operator<< (ostream &str, const DoubleCRT &d)
   const IndexSet& set = d.map.getIndexSet();
 
   // check that the content of i'th row is in [0,pi) for all i
+  long phim = d.map.getRowLength();
   str << "[" << set << endl;
-  for (long i: set) 
-    str << " " << d.map[i] << "\n";
+  for (long i: set) { // same format as the vec_long rows used to have
+    const long *row = d.map[i];
+    str << " [";
+    for (long j: range(phim)) {
+      if (j > 0) str << " ";
+      str << row[j];
+    }
+    str << "]\n";
+  }
   str << "]";
   return str;
 }
@@ -1211,13 +1641,17 @@ istream& operator>> (istream &str, DoubleCRT &d)
   d.map.clear();
   d.map.insert(set); // fix the index set for the data
 
+  vec_long tmp;
   for (long i: set) { 
-    str >> d.map[i]; // read the actual data
+    str >> tmp; // read the actual data
 
     // verify that the data is valid
-    assert (d.map[i].length() == phim);
-    for (long j: range(phim))
-      assert(d.map[i][j]>=0 && d.map[i][j]<context.ithPrime(i));
+    assert (tmp.length() == phim);
+    long *row = d.map[i];
+    for (long j: range(phim)) {
+      assert(tmp[j]>=0 && tmp[j]<context.ithPrime(i));
+      row[j] = tmp[j];
+    }
   }
 
   // Advance str beyond closing ']'
@@ -1232,9 +1666,9 @@ void DoubleCRT::write(ostream& str) const
 //  cerr << "[DCRT::write] set: " << set << endl;
   set.write(str);
   
-  for(long i: set) { 
-    write_ntl_vec_long(str, map[i]);
- //   cerr << "[DCRT::write] map[i]: " << map[i] << endl;
+  for(long i: set) { // each row packed at the bit-width of its prime
+    long nBits = NumBits(context.ithPrime(i)-1);
+    write_residue_row(str, map[i], map.getRowLength(), nBits);
   }
 }
 
@@ -1246,9 +1680,49 @@ void DoubleCRT::read(istream& str)
   map.insert(set); // fix the index set for the data
 //  cerr << "[DCRT::read] set: " << set << endl;
  
-  for(long i: set) { 
-    read_ntl_vec_long(str, map[i]);    
- //   cerr << "[DCRT::read] map[i]: " << map[i] << endl;
+  for(long i: set) { // packed rows, or the 64-bit rows of older files
+    read_residue_row(str, map[i], map.getRowLength());
+  }
+}
+
+void DoubleCRT::wireSegments(vector<WireSegment>& body) const
+{
+  long len = map.getRowLength() * sizeof(long);
+  for (long i: map.getIndexSet())
+    appendWireSegment(body, map[i], len);
+}
+
+void DoubleCRT::wireBuffers(vector<WireBuffer>& body, const IndexSet& s)
+{
+  if (map.getIndexSet() != s || map.isView()) {
+    map.clear();
+    map.insert(s);
+  }
+  long len = map.getRowLength() * sizeof(long);
+  for (long i: s)
+    appendWireBuffer(body, map[i], len);
+}
+
+void DoubleCRT::writePacked(ostream& str) const
+{
+  const IndexSet& set = map.getIndexSet();
+  set.write(str);
+
+  for(long i: set) {
+    long nBits = NumBits(context.ithPrime(i)-1);
+    write_packed_long_array(str, map[i], map.getRowLength(), nBits);
+  }
+}
+
+void DoubleCRT::readPacked(istream& str)
+{
+  IndexSet set;
+  set.read(str); // read in the indexSet
+  map.clear();
+  map.insert(set); // fix the index set for the data
+
+  for(long i: set) {
+    read_packed_long_array(str, map[i], map.getRowLength());
   }
 }
 
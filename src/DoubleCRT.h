@@ -17,37 +17,13 @@
  **/
 #include "zzX.h"
 #include "NumbTh.h"
-#include "IndexMap.h"
+#include "RowSlab.h"
+#include "rowArith.h"
 #include "timing.h"
 
 class FHEcontext;
-
-/**
-* @class DoubleCRTHelper
-* @brief A helper class to enforce consistency within an DoubleCRTHelper object
-*
-* See Section 2.6.2 of the design document (IndexMap)
-*/
-class DoubleCRTHelper : public IndexMapInit<NTL::vec_long> {
-private: 
-  long val;
-
-public:
-  DoubleCRTHelper(const FHEcontext& context);
-
-  /** @brief the init method ensures that all rows have the same size */
-  virtual void init(NTL::vec_long& v) { 
-    v.FixLength(val); 
-  }
-
-  /** @brief clone allocates a new object and copies the content */
-  virtual IndexMapInit<NTL::vec_long> * clone() const { 
-    return new DoubleCRTHelper(*this); 
-  }
-private:
-  DoubleCRTHelper(); // disable default constructor
-};
-
+struct WireSegment; // A scatter-gather message, see binio.h
+struct WireBuffer;
 
 /**
  * @class DoubleCRT
@@ -59,10 +35,11 @@ private:
  * The polynomial thus represented is defined modulo the product of all the
  * primes in use.
  *
- * The list of primes is defined by the data member indexMap.
- * indexMap.getIndexSet() defines the set of indices of primes
+ * The list of primes is defined by the data member map.
+ * map.getIndexSet() defines the set of indices of primes
  * associated with this DoubleCRT object: they index the
- * primes stored in the associated FHEContext.
+ * primes stored in the associated FHEContext. All the rows are kept in a
+ * single cache-aligned RowSlab, each row starting on an aligned address.
  *
  * Arithmetic operations are computed modulo the product of the primes in use
  * and also modulo Phi_m(X). Arithmetic operations can only be applied to
@@ -71,8 +48,8 @@ private:
  **/
 class DoubleCRT {
   const FHEcontext& context; // the context
-  IndexMap<NTL::vec_long> map; // the data itself: if the i'th prime is in use then
-                          // map[i] is the std::vector of evaluations wrt this prime
+  RowSlab map; // the data itself: if the i'th prime is in use then
+               // map[i] points to the evaluations wrt this prime
 
   //! a "sanity check" method, verifies consistency of the map with
   //! current moduli chain, an error is raised if they are not consistent
@@ -84,19 +61,31 @@ class DoubleCRT {
   // determined by the union of the two index sets; otherwise, the index set
   // of *this.
 
+  // The functors operate on a whole row at a time, using the
+  // (possibly vectorized) kernels from rowArith.h
+
   class AddFun {
   public:
-    long apply(long a, long b, long n) { return NTL::AddMod(a, b, n); }
+    void apply(long *x, const long *y, long n, long q, NTL::mulmod_t qinv)
+    { addModRow(x, y, n, q); }
+    void apply(long *x, long c, long n, long q)
+    { addModRowConst(x, c, n, q); }
   };
 
   class SubFun {
   public:
-    long apply(long a, long b, long n) { return NTL::SubMod(a, b, n); }
+    void apply(long *x, const long *y, long n, long q, NTL::mulmod_t qinv)
+    { subModRow(x, y, n, q); }
+    void apply(long *x, long c, long n, long q)
+    { subModRowConst(x, c, n, q); }
   };
 
   class MulFun {
   public:
-    long apply(long a, long b, long n) { return NTL::MulMod(a, b, n); }
+    void apply(long *x, const long *y, long n, long q, NTL::mulmod_t qinv)
+    { mulModRow(x, y, n, q, qinv); }
+    void apply(long *x, long c, long n, long q)
+    { mulModRowConst(x, c, n, q); }
   };
 
 
@@ -169,7 +158,14 @@ public:
   // or
   //    DoubleCRT dCRT(context, indexSet); dCRT = poly;
 
+  DoubleCRT(const DoubleCRT& other) = default;
+
+  //! @brief Moving takes over the residues of other, leaving it with an
+  //! empty index set
+  DoubleCRT(DoubleCRT&& other) = default;
+
   DoubleCRT& operator=(const DoubleCRT& other);
+  DoubleCRT& operator=(DoubleCRT&& other);
 
   // Copy only the primes in s \intersect other.getIndexSet()
   //  void partialCopy(const DoubleCRT& other, const IndexSet& s);
@@ -192,12 +188,14 @@ public:
   void toPoly(NTL::ZZX& p, const IndexSet& s, bool positive=false) const;
   void toPoly(NTL::ZZX& p, bool positive=false) const;
 
-  // The variant toPolyMod has another argument, which is a modulus Q, and it
-  // computes toPoly() mod Q. This is offerred as a separate function in the
-  // hope that one day we will figure out a more efficient method of computing
-  // this. Right now it is not implemented
-  // 
-  // void toPolyMod(ZZX& p, const ZZ &Q, const IndexSet& s) const;
+  //! @brief toPoly() mod a single-precision Q, with coefficients in
+  //! [0,Q). Each coefficient is reconstructed mod Q directly with
+  //! single-precision arithmetic, without the big integers of toPoly. This
+  //! is what decryption needs (Q = the plaintext space).
+  void toPolyMod(zzX& p, long Q, const IndexSet& s,
+                 bool positive=false) const;
+  void toPolyMod(zzX& p, long Q, bool positive=false) const
+  { toPolyMod(p, Q, map.getIndexSet(), positive); }
 
 
   bool operator==(const DoubleCRT& other) const {
@@ -224,9 +222,30 @@ public:
   //! @brief Break into n digits,according to the primeSets in context.digits.
   //! See Section 3.1.6 of the design document (re-linearization)
   void breakIntoDigits(std::vector<DoubleCRT>& dgts, long n) const;
+  //! Same, according to the given primeSets (e.g., the own digits of a
+  //! key-switching matrix)
+  void breakIntoDigits(std::vector<DoubleCRT>& dgts, long n,
+                       const std::vector<IndexSet>& dgtSets) const;
+
+  //! @brief The inner products of key-switching: out0 = sum_i x[i]*y0[i]
+  //! and out1 = sum_i x[i]*y1[i], relative to the index set s of x[0].
+  //! All the x[i]'s must be defined relative to s, and all the y's relative
+  //! to supersets of s. The rows are split into (prime x column-block) tasks
+  //! on NTL's thread pool, each one owning its piece of out0,out1.
+  static void dualInnerProduct(DoubleCRT& out0, DoubleCRT& out1,
+                               const std::vector<DoubleCRT>& x,
+                               const std::vector<DoubleCRT>& y0,
+                               const std::vector<DoubleCRT>& y1);
+  //! @brief The same, with terms that live elsewhere (e.g., in ciphertexts)
+  static void dualInnerProduct(DoubleCRT& out0, DoubleCRT& out1,
+                               const std::vector<const DoubleCRT*>& x,
+                               const std::vector<const DoubleCRT*>& y0,
+                               const std::vector<const DoubleCRT*>& y1);
 
   //! @brief Expand the index set by s1.
   //! It is assumed that s1 is disjoint from the current index set.
+  //! The new rows are those of the balanced lift, computed by a
+  //! word-size base extension (no ZZX).
   void addPrimes(const IndexSet& s1);
 
   //! @brief Expand index set by s1, and multiply by Prod_{q in s1}.
@@ -325,6 +344,10 @@ public:
     do_mul(other, matchIndexSets); 
   }
 
+  //! @brief *this += a*b with one pass over the rows, at the primes of
+  //! *this (which a and b must both have)
+  DoubleCRT& addMul(const DoubleCRT& a, const DoubleCRT& b);
+
   // Division by constant
   DoubleCRT& operator/=(const NTL::ZZ &num);
   DoubleCRT& operator/=(long num) { return (*this /= NTL::to_ZZ(num)); }
@@ -338,14 +361,39 @@ public:
 
   //! Compute the complex conjugate, the same as automorph(m-1)
   void complexConj();
+
+  //! @brief For ring switching (see ringSwitch.h): *this = sum_j a_{dj}X^j
+  //! for other = sum_i a_i X^i over a context for m = d*m', at the primes
+  //! of other. This is over the context for m', which must have the same
+  //! primes at these indexes.
+  void ringProject(const DoubleCRT& other, long d);
   ///@}
 
   // Utilities
 
   const FHEcontext& getContext() const { return context; }
-  const IndexMap<NTL::vec_long>& getMap() const { return map; }
+  const RowSlab& getMap() const { return map; }
+
+  //! @brief Make this a read-only view of rows stored elsewhere, see
+  //! RowSlab::attachView. The rows must be RowSlab(phi(m)).getStride()
+  //! longs apart. The first modification copies them out of the view.
+  void attachView(const IndexSet& s, const long* data,
+                  std::shared_ptr<const void> keep)
+  { map.attachView(s, data, std::move(keep)); }
   const IndexSet& getIndexSet() const { return map.getIndexSet(); }
 
+  //! @brief The bytes of this object, its own size included
+  long memoryUsage() const
+  { return sizeof(DoubleCRT) - sizeof(RowSlab) + map.memoryUsage(); }
+
+  //! @brief Append the residue rows to body, for a scatter-gather message
+  //! (see WireMessage in binio.h). They point into this object.
+  void wireSegments(std::vector<WireSegment>& body) const;
+
+  //! @brief Set the index set to s (keeping the rows if it is already s),
+  //! and append the rows to body, to receive the residues into
+  void wireBuffers(std::vector<WireBuffer>& body, const IndexSet& s);
+
   // Choose random DoubleCRT's, either at random or with small/Gaussian
   // coefficients. 
 
@@ -378,7 +426,7 @@ public:
 
 
 
-  // used to implement modulus switching
+  // used to implement modulus switching, in word-size arithmetic
   void scaleDownToSet(const IndexSet& s, long ptxtSpace);
 
 
@@ -389,10 +437,15 @@ public:
 
   void reduce() const {} // place-holder for consistenct with AltCRT
 
-  // Raw I/O
+  // Raw I/O, every row packed at the bit-width of its prime (read also
+  // takes the full 64-bit rows that older versions wrote)
   void read(std::istream& str);
   void write(std::ostream& str) const;
 
+  // Raw I/O with every row packed at the bit-width of its prime
+  void readPacked(std::istream& str);
+  void writePacked(std::ostream& str) const;
+
   // I/O: ONLY the matrix is outputted/recovered, not the moduli chain!! An
   // error is raised on input if this is not consistent with the current chain
 
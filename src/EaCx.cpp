@@ -12,28 +12,29 @@
 /* EaCx.cpp - Encoding/decoding and data-movement for encrypted complex data
  */
 #include <algorithm>
+#include <NTL/BasicThreadPool.h>
 #include "zzX.h"
 #include "EncryptedArray.h"
 
 #include "timing.h"
 #include "cloned_ptr.h"
 #include "norms.h"
+#include "taskScheduler.h"
 
 NTL_CLIENT
 
 static constexpr cx_double the_imaginary_i = cx_double(0.0, 1.0);
 
-void EncryptedArrayCx::decrypt(const Ctxt& ctxt,
-                               const FHESecKey& sKey, vector<cx_double>& ptxt) const
+// Decrypt ctxt into zpp, with the factor to divide by after decoding
+static void decryptScaled(zzX& zpp, double& factor,
+                          const Ctxt& ctxt, const FHESecKey& sKey)
 {
-  assert(&getContext() == &ctxt.getContext());
   NTL::ZZX pp;
   sKey.Decrypt(pp, ctxt);
 
   // convert to zzX, if the pp is too big, scale it down
   long nBits = NTL::MaxBits(pp) - NTL_SP_NBITS;
-  zzX zpp(INIT_SIZE, deg(pp)+1);
-  double factor;
+  zpp.SetLength(deg(pp)+1);
   if (nBits<=0) { // convert to zzX, double
     for (long i=0; i<lsize(zpp); i++)
       conv(zpp[i], pp[i]);
@@ -43,11 +44,70 @@ void EncryptedArrayCx::decrypt(const Ctxt& ctxt,
       conv(zpp[i], pp[i]>>nBits);
     factor = to_double(ctxt.getRatFactor()/power2_xdouble(nBits));
   }
+}
+
+void EncryptedArrayCx::decrypt(const Ctxt& ctxt,
+                               const FHESecKey& sKey, vector<cx_double>& ptxt) const
+{
+  assert(&getContext() == &ctxt.getContext());
+  zzX zpp;
+  double factor;
+  decryptScaled(zpp, factor, ctxt, sKey);
   canonicalEmbedding(ptxt, zpp, getPAlgebra()); // decode without scaling
   for (cx_double& cx : ptxt)  // divide by the factor
     cx /= factor;
 }
 
+void EncryptedArrayCx::decrypt(const vector<Ctxt>& ctxts,
+                               const FHESecKey& sKey,
+                               vector< vector<cx_double> >& arrays) const
+{
+  FHE_TIMER_START;
+  long n = lsize(ctxts);
+  vector<zzX> zpps(n);
+  vector<double> factors(n);
+  FHE_EXEC_RANGE(n, first, last)
+  for (long i=first; i<last; i++) {
+    assert(&getContext() == &ctxts[i].getContext());
+    decryptScaled(zpps[i], factors[i], ctxts[i], sKey);
+  }
+  FHE_EXEC_RANGE_END
+
+  canonicalEmbedding(arrays, zpps, getPAlgebra()); // decode without scaling
+  for (long i=0; i<n; i++)
+    for (cx_double& cx : arrays[i]) cx /= factors[i];
+}
+
+// A power-of-two bound on the entries of v, the size estimate that is
+// given to the encryption routine (as in encryptOneNum)
+static long ptxtSizeBound(const vector<cx_double>& v)
+{
+  double mx = 0.0;
+  for (const cx_double& x: v) mx = std::max(mx, std::abs(x));
+  long rounded = ceil(mx);
+  return (rounded <= 1)? 1 : (1L << NTL::NumBits(rounded-1));
+}
+
+void EncryptedArrayCx::encrypt(vector<Ctxt>& ctxts, const FHEPubKey& key,
+                               const vector< vector<cx_double> >& arrays) const
+{
+  FHE_TIMER_START;
+  long n = lsize(arrays);
+  if (lsize(ctxts) < n)
+    throw std::logic_error("EncryptedArrayCx::encrypt: "
+                           "fewer ciphertexts than arrays");
+  vector<zzX> ptxts;
+  encode(ptxts, arrays);
+
+  // The random choices of each thread come from its own NTL stream
+  FHE_EXEC_RANGE(n, first, last)
+  for (long i=first; i<last; i++) {
+    assert(&getContext() == &ctxts[i].getContext());
+    key.Encrypt(ctxts[i], ptxts[i], ptxtSizeBound(arrays[i]));
+  }
+  FHE_EXEC_RANGE_END
+}
+
 // rotate ciphertext in dimension 0 by amt
 void EncryptedArrayCx::rotate1D(Ctxt& ctxt, long i, long amt, bool dc) const
 {
@@ -90,6 +150,14 @@ void EncryptedArrayCx::encode(zzX& ptxt, const vector<cx_double>& array,
   embedInSlots(ptxt, array, getPAlgebra(), factor);
 }
 
+void EncryptedArrayCx::encode(vector<zzX>& ptxts,
+                              const vector< vector<cx_double> >& arrays,
+                              long precision) const
+{
+  embedInSlots(ptxts, arrays, getPAlgebra(),
+               alMod.encodeScalingFactor(precision));
+}
+
 void EncryptedArrayCx::encode(zzX& ptxt, double num, long precision) const
 {
   // This factor ensures that encode/decode introduce less than
@@ -114,6 +182,14 @@ void EncryptedArrayCx::decode(vector<cx_double>& array, const zzX& ptxt) const
   for (auto& x: array) x /= factor;
 }
 
+void EncryptedArrayCx::decode(vector< vector<cx_double> >& arrays,
+                              const vector<zzX>& ptxts) const
+{
+  canonicalEmbedding(arrays, ptxts, getPAlgebra());
+  double factor = alMod.encodeScalingFactor();
+  for (auto& array: arrays) for (auto& x: array) x /= factor;
+}
+
 // return an array of random complex numbers in the unit circle
 void EncryptedArrayCx::random(vector<cx_double>& array) const
 {
@@ -136,29 +212,233 @@ void EncryptedArrayCx::extractRealPart(Ctxt& c) const
   c.multByConstantCKKS(0.5); // divide by two
 }
 
-// Note: If called with dcrt==nullptr, it will perform FFT's when
-// encoding i as a DoubleCRT object. If called with dcrt!=nullptr,
+// Note: If called with dcrt==nullptr, i is taken from the cache of
+// constants (encoded with FFT's the first time). If called with dcrt!=nullptr,
 // it assumes that dcrt points to an object that encodes i. If the
 // primeSet of the given DoubleCRT is missing some of the moduli in
 // c.getPrimeSet(), many extra FFTs/iFFTs will be called.
 void EncryptedArrayCx::extractImPart(Ctxt& c, DoubleCRT* iDcrtPtr) const
 {
-  DoubleCRT tmpDcrt(getContext(), IndexSet::emptySet());
   {Ctxt tmp = c;
   c.complexConj(); // the complex conjugate of c
   c -= tmp;        // conj(c) - c = -2*i*imaginary(c)
   }
-  if (iDcrtPtr==nullptr) { // Need to encode i in a DoubleCRt object
-    tmpDcrt.addPrimes(c.getPrimeSet());
-    tmpDcrt.FFT(getiEncoded(), c.getPrimeSet());
-    // FFT is a low-level DoubleCRT procedure to initialize an
-    // existing object with a given PrimeSet and a given polynomial
-    iDcrtPtr = &tmpDcrt;
+  CKKSConstCache::Entry iDcrt;
+  if (iDcrtPtr==nullptr) { // Need i as a DoubleCRT object at these primes
+    iDcrt = getiDcrt(c.getPrimeSet());
+    iDcrtPtr = iDcrt.get();
   }
   c.multByConstantCKKS(*iDcrtPtr); // multiply by i
   c.multByConstantCKKS(0.5);       // divide by two
 }
 
+CKKSConstCache::Entry EncryptedArrayCx::getiDcrt(const IndexSet& s) const
+{
+  // the same encoding as iEncoded, with precision 0
+  return constCache->get(*this, vector<cx_double>(size(), the_imaginary_i), s);
+}
+
+void EncryptedArrayCx::extractParts(const Ctxt& c, Ctxt* re, Ctxt* im,
+                                    vector<shared_ptr<Ctxt>>* rots,
+                                    const vector<long>& amts) const
+{
+  FHE_TIMER_START;
+  assert(&getContext() == &c.getContext());
+  BasicAutomorphPrecon precon(c); // decompose once
+  const Ctxt& orig = precon.getCtxt();
+
+  if (rots != nullptr) {
+    assert(nativeDimension(0));
+    const PAlgebra& palg = getPAlgebra();
+    vector<long> vals(amts.size());
+    for (long i: range(lsize(amts)))
+      vals[i] = palg.genToPow(0, amts[i] % sizeOfDimension(0));
+    precon.automorph(*rots, vals);
+  }
+  if (re == nullptr && im == nullptr) return;
+
+  shared_ptr<Ctxt> conj = precon.complexConj();
+  conj->modDownToSet(orig.getPrimeSet()); // drop the special primes
+  if (re != nullptr) {
+    *re = orig;
+    *re += *conj;              // c + conj(c) = 2*real(c)
+    re->multByConstantCKKS(0.5);
+  }
+  if (im != nullptr) {
+    *im = *conj;
+    *im -= orig;               // conj(c) - c = -2*i*imaginary(c)
+    im->multByConstantCKKS(*getiDcrt(im->getPrimeSet()));
+    im->multByConstantCKKS(0.5);
+  }
+}
+
+void EncryptedArrayCx::multByConstant(Ctxt& c, const vector<cx_double>& v,
+                                      long precision) const
+{
+  if (c.isEmpty()) return;
+  CKKSConstCache::Entry dcrt
+    = constCache->get(*this, v, c.getPrimeSet(), precision);
+  c.multByConstantCKKS(*dcrt, /*size=*/NTL::xdouble(-1.0),
+                       /*factor=*/to_ZZ(alMod.encodeScalingFactor(precision)));
+}
+
+void EncryptedArrayCx::addConstant(Ctxt& c, const vector<cx_double>& v,
+                                   long precision) const
+{
+  CKKSConstCache::Entry dcrt
+    = constCache->get(*this, v, c.getPrimeSet(), precision);
+  c.addConstantCKKS(*dcrt, /*size=*/NTL::xdouble(-1.0),
+                    /*factor=*/to_xdouble(alMod.encodeScalingFactor(precision)));
+}
+
+/********************************************************************/
+/****************** The cache of encoded constants ******************/
+
+bool CKKSConstCache::Key::operator<(const Key& other) const
+{
+  if (hash != other.hash) return hash < other.hash;
+  if (precision != other.precision) return precision < other.precision;
+  return primes < other.primes;
+}
+
+// FNV-1a over the bits of the entries, mixed with the precision and primes
+CKKSConstCache::Key
+CKKSConstCache::makeKey(const vector<cx_double>& v, const IndexSet& s,
+                        long precision)
+{
+  Key key;
+  unsigned long long h = 14695981039346656037ULL;
+  for (const cx_double& x: v) {
+    double parts[2] = {x.real(), x.imag()};
+    const unsigned char* bytes = (const unsigned char*) parts;
+    for (size_t j=0; j<sizeof(parts); j++) {
+      h ^= bytes[j];
+      h *= 1099511628211ULL;
+    }
+  }
+  key.hash = (unsigned long) h;
+  key.precision = precision;
+  for (long i: s) key.primes.push_back(i);
+  return key;
+}
+
+CKKSConstCache::Index::iterator
+CKKSConstCache::find(const Key& key, const vector<cx_double>& v)
+{
+  Index::iterator it = index.find(key);
+  if (it != index.end() && it->second->values != v)
+    return index.end(); // a hash collision
+  return it;
+}
+
+void CKKSConstCache::evict()
+{
+  while (long(lru.size()) > maxEntries) {
+    index.erase(lru.back().key);
+    lru.pop_back();
+  }
+}
+
+CKKSConstCache::Entry
+CKKSConstCache::lookup(const EncryptedArrayCx& ea, const vector<cx_double>& v,
+                       const IndexSet& s, long precision, bool pin)
+{
+  Key key = makeKey(v, s, precision);
+  {std::lock_guard<std::mutex> lock(mtx);
+  Index::iterator it = find(key, v);
+  if (it != index.end()) {
+    NodeList::iterator node = it->second;
+    nHits++;
+    if (pin) {
+      if (node->pins++ == 0) pinned.splice(pinned.begin(), lru, node);
+    }
+    else if (node->pins == 0) lru.splice(lru.begin(), lru, node);
+    return node->dcrt;
+  }
+  nMisses++;
+  }
+
+  // Encode v outside the lock, this is the expensive part
+  FHE_TIMER_START;
+  zzX poly;
+  ea.encode(poly, v, precision);
+  Entry dcrt = std::make_shared<DoubleCRT>(poly, ea.getContext(), s);
+  FHE_TIMER_STOP;
+
+  std::lock_guard<std::mutex> lock(mtx);
+  Index::iterator it = find(key, v);
+  if (it != index.end()) { // someone else inserted it meanwhile
+    NodeList::iterator node = it->second;
+    if (pin && node->pins++ == 0) pinned.splice(pinned.begin(), lru, node);
+    return node->dcrt;
+  }
+  if (index.count(key) > 0) return dcrt; // a hash collision, do not cache
+  if (!pin && maxEntries <= 0) return dcrt;
+
+  NodeList& dest = pin? pinned : lru;
+  dest.push_front(Node{key, v, dcrt, pin? 1L : 0L});
+  index[key] = dest.begin();
+  evict();
+  return dcrt;
+}
+
+bool CKKSConstCache::unpin(const vector<cx_double>& v, const IndexSet& s,
+                           long precision)
+{
+  Key key = makeKey(v, s, precision);
+  std::lock_guard<std::mutex> lock(mtx);
+  Index::iterator it = find(key, v);
+  if (it == index.end() || it->second->pins == 0) return false;
+  NodeList::iterator node = it->second;
+  if (--node->pins == 0) {
+    lru.splice(lru.begin(), pinned, node);
+    evict();
+  }
+  return true;
+}
+
+void CKKSConstCache::clear(bool keepPinned)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  for (const Node& node: lru) index.erase(node.key);
+  lru.clear();
+  if (!keepPinned) {
+    index.clear();
+    pinned.clear();
+  }
+}
+
+void CKKSConstCache::setMaxEntries(long n)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  maxEntries = n;
+  evict();
+}
+
+long CKKSConstCache::size() const
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  return long(lru.size() + pinned.size());
+}
+
+long CKKSConstCache::numPinned() const
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  return long(pinned.size());
+}
+
+long CKKSConstCache::hits() const
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  return nHits;
+}
+
+long CKKSConstCache::misses() const
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  return nMisses;
+}
+
 void EncryptedArrayCx::buildLinPolyCoeffs(vector<zzX>& C,
               const cx_double& oneImage, const cx_double& iImage) const
 {
@@ -12,10 +12,14 @@
 /* EncryptedArray.cpp - Data-movement operations on arrays of slots
  */
 #include <algorithm>
+#include <stdexcept>
+#include <NTL/BasicThreadPool.h>
 #include "zzX.h"
 #include "EncryptedArray.h"
 #include "timing.h"
 #include "cloned_ptr.h"
+#include "binio.h"
+#include "taskScheduler.h"
 
 NTL_CLIENT
 
@@ -44,11 +48,233 @@ EncryptedArrayBase* buildEncryptedArray(const FHEcontext& context,
 template<class type>
 EncryptedArrayDerived<type>::EncryptedArrayDerived(
    const FHEcontext& _context, const RX& _G, const PAlgebraMod& alMod)
-  : context(_context), tab(alMod.getDerived(type()))
+  : context(_context), tab(alMod.getDerived(type())),
+    rotPlans(std::make_shared<RotationPlanCache>()),
+    masks(std::make_shared<MaskCache>())
 {
   tab.mapToSlots(mappingData, _G); // Compute the base-G representation maps
 }
 
+/********************************************************************/
+/***************** The cache of DoubleCRT masks *********************/
+
+bool MaskCache::Key::operator<(const Key& other) const
+{
+  if (op != other.op) return op < other.op;
+  if (dim != other.dim) return dim < other.dim;
+  if (amt != other.amt) return amt < other.amt;
+  return primes < other.primes;
+}
+
+void MaskCache::evict()
+{
+  while (long(lru.size()) > maxEntries) {
+    index.erase(lru.back().first);
+    lru.pop_back();
+  }
+}
+
+MaskCache::Entry MaskCache::get(const FHEcontext& context, long op, long dim,
+                                long amt, const IndexSet& s,
+                                const std::function<void(zzX&)>& build)
+{
+  Key key;
+  key.op = op;
+  key.dim = dim;
+  key.amt = amt;
+  for (long i: s) key.primes.push_back(i);
+  {std::lock_guard<std::mutex> lock(mtx);
+  auto it = index.find(key);
+  if (it != index.end()) {
+    nHits++;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+  }
+  nMisses++;
+  }
+
+  // Encode and convert outside the lock, this is the expensive part
+  zzX poly;
+  build(poly);
+  Entry dcrt = std::make_shared<DoubleCRT>(poly, context, s);
+
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = index.find(key);
+  if (it != index.end()) return it->second->second; // another thread won
+  if (maxEntries > 0) {
+    lru.emplace_front(key, dcrt);
+    index[key] = lru.begin();
+    evict();
+  }
+  return dcrt;
+}
+
+void MaskCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  lru.clear();
+  index.clear();
+}
+
+void MaskCache::setMaxEntries(long n)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  maxEntries = max(0L, n);
+  evict();
+}
+
+long MaskCache::size() const
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  return lru.size();
+}
+
+long MaskCache::hits() const
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  return nHits;
+}
+
+long MaskCache::misses() const
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  return nMisses;
+}
+
+/********************************************************************/
+/******************* The plans of hoisted rotations *****************/
+
+void RotationPlanCache::evict()
+{
+  while (long(lru.size()) > maxEntries) {
+    index.erase(lru.back().first);
+    lru.pop_back();
+  }
+}
+
+RotationPlanCache::Entry RotationPlanCache::find(long i, long amt)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = index.find(Key(i, amt));
+  if (it == index.end()) return Entry();
+  lru.splice(lru.begin(), lru, it->second);
+  return it->second->second;
+}
+
+RotationPlanCache::Entry
+RotationPlanCache::insert(long i, long amt, const Entry& plan)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = index.find(Key(i, amt));
+  if (it != index.end()) return it->second->second; // another thread won
+  if (maxEntries <= 0) return plan;
+  lru.emplace_front(Key(i, amt), plan);
+  index[Key(i, amt)] = lru.begin();
+  evict();
+  return plan;
+}
+
+void RotationPlanCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  lru.clear();
+  index.clear();
+}
+
+void RotationPlanCache::setMaxEntries(long n)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  maxEntries = max(0L, n);
+  evict();
+}
+
+long RotationPlanCache::size() const
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  return lru.size();
+}
+
+// The slot t of the rotated array comes from the slot s = t-amt, moving
+// the coordinates by e[d] = t_d - s_d. Along a native dimension e[d] can
+// be taken mod the order, along a bad one the automorphism must not wrap
+// around, so the slots are grouped by their exponent vectors e.
+template<class type>
+void EncryptedArrayDerived<type>::rotationPatterns(vector<long>& vals,
+       vector< vector<long> >* sel, long i, long amt) const
+{
+  const PAlgebra& al = getPAlgebra();
+  long n = size(), m = al.getM();
+  long first = (i < 0)? 0 : i;            // the dimensions that move
+  long last = (i < 0)? dimension() : i+1;
+
+  vals.clear();
+  if (sel) sel->clear();
+  vector<long> e(dimension(), 0);
+  map<vector<long>, long> index; // exponent vector -> its position in vals
+  for (long t = 0; t < n; t++) {
+    long s = (i < 0)? mcMod(t-amt, n) : addCoord(i, t, -amt);
+    for (long d = first; d < last; d++) {
+      e[d] = coordinate(d, t) - coordinate(d, s);
+      if (nativeDimension(d)) e[d] = mcMod(e[d], sizeOfDimension(d));
+    }
+    auto res = index.emplace(e, lsize(vals));
+    if (res.second) { // a new pattern
+      long val = 1;
+      for (long d = first; d < last; d++)
+        val = MulMod(val, al.genToPow(d, e[d]), m);
+      vals.push_back(val);
+      if (sel) sel->push_back(vector<long>(n, 0));
+    }
+    if (sel) (*sel)[res.first->second][t] = 1;
+  }
+}
+
+template<class type>
+RotationPlanCache::Entry
+EncryptedArrayDerived<type>::rotationPlan(long i, long amt) const
+{
+  RotationPlanCache::Entry plan = rotPlans->find(i, amt);
+  if (plan) return plan;
+
+  FHE_TIMER_START;
+  auto newPlan = std::make_shared<RotationPlanCache::Plan>();
+  vector< vector<long> > sel;
+  rotationPatterns(newPlan->vals, &sel, i, amt);
+  IndexSet allPrimes = context.fullPrimes();
+  for (const vector<long>& slots: sel) {
+    zzX mask;
+    encode(mask, slots);
+    newPlan->masks.push_back(DoubleCRT(mask, context, allPrimes));
+  }
+  FHE_TIMER_STOP;
+  return rotPlans->insert(i, amt, newPlan);
+}
+
+// Returns true if there are matrices for X->X^k for all k in vals
+static bool haveDirectKeys(const Ctxt& ctxt, const vector<long>& vals)
+{
+  if (isSetAutomorphVals()) return false; // recording, take the unhoisted path
+  const FHEPubKey& pubKey = ctxt.getPubKey();
+  long keyID = ctxt.getKeyID();
+  for (long k: vals)
+    if (k != 1 && !pubKey.haveKeySWmatrix(1, k, keyID, keyID)) return false;
+  return true;
+}
+
+// ctxt = sum_j plan.masks[j] * ctxt^{(plan.vals[j])}
+static void applyRotationPlan(Ctxt& ctxt, const RotationPlanCache::Plan& plan)
+{
+  vector< shared_ptr<Ctxt> > rots;
+  BasicAutomorphPrecon(ctxt).automorph(rots, plan.vals);
+  long n = lsize(rots);
+  FHE_EXEC_RANGE(n, first, last)
+  for (long j = first; j < last; j++)
+    rots[j]->multByConstant(plan.masks[j]);
+  FHE_EXEC_RANGE_END
+  ctxt = *rots[0];
+  for (long j = 1; j < n; j++) ctxt += *rots[j];
+}
+
 // rotate ciphertext in dimension i by amt
 template<class type>
 void EncryptedArrayDerived<type>::rotate1D(Ctxt& ctxt, long i, long amt, bool dc) const
@@ -77,6 +303,14 @@ void EncryptedArrayDerived<type>::rotate1D(Ctxt& ctxt, long i, long amt, bool dc
   if (amt < 0) amt += ord;  // Make sure amt is in the range [1,ord-1]
   assert(maskTable[i].size() > 0);
 
+  // With matrices for both rho_i^{amt} and rho_i^{amt-ord}, apply them to
+  // one decomposition of ctxt
+  if (haveDirectKeys(ctxt, {zMStar.genToPow(i, amt),
+                            zMStar.genToPow(i, amt-ord)})) {
+    applyRotationPlan(ctxt, *rotationPlan(i, amt));
+    return;
+  }
+
   //cerr << "*** rotate1D " << i << " " << amt << "\n";
 
 #if 0
@@ -108,14 +342,16 @@ void EncryptedArrayDerived<type>::rotate1D(Ctxt& ctxt, long i, long amt, bool dc
   // for \rho_i^{-ord}
 
   const RX& mask = maskTable[i][amt];
-  DoubleCRT m1(convert<zzX>(mask), context, 
-               ctxt.getPrimeSet() | T.getPrimeSet());
+  MaskCache::Entry m1 =
+    masks->get(context, MaskCache::ROTATE1D, i, amt,
+               ctxt.getPrimeSet() | T.getPrimeSet(),
+               [&](zzX& poly) { poly = convert<zzX>(mask); });
   // m1 will be used to multiply both ctxt and T
   
   // Compute ctxt = ctxt*m1 + T - T*m1
-  ctxt.multByConstant(m1);
+  ctxt.multByConstant(*m1);
   ctxt += T;
-  T.multByConstant(m1);
+  T.multByConstant(*m1);
   ctxt -= T;
 
 #endif
@@ -157,8 +393,10 @@ void EncryptedArrayDerived<type>::shift1D(Ctxt& ctxt, long i, long k) const
     mask = 1 - mask;
     val = al.genToPow(i, amt);
   }
-  DoubleCRT m1(convert<zzX,RX>(mask), context, ctxt.getPrimeSet());
-  ctxt.multByConstant(m1);   // zero out slots where mask=0
+  MaskCache::Entry m1 =
+    masks->get(context, MaskCache::SHIFT1D, i, k, ctxt.getPrimeSet(),
+               [&](zzX& poly) { poly = convert<zzX,RX>(mask); });
+  ctxt.multByConstant(*m1);  // zero out slots where mask=0
   ctxt.smartAutomorph(val);  // shift left by val
   FHE_TIMER_STOP;
 }
@@ -166,7 +404,8 @@ void EncryptedArrayDerived<type>::shift1D(Ctxt& ctxt, long i, long k) const
 
 // NOTE: masking depth: if there are N dimensions, and if for i = 1..N
 // we define c_i = 1 if dimension i is bad and 0 o/w, then the masking
-// depth is N - 1 + \sum_{i=1} c_i.  
+// depth is N - 1 + \sum_{i=1} c_i. A hoisted rotation (see
+// RotationPlanCache) has masking depth one.
 
 template<class type>
 void EncryptedArrayDerived<type>::rotate(Ctxt& ctxt, long amt) const
@@ -192,6 +431,15 @@ void EncryptedArrayDerived<type>::rotate(Ctxt& ctxt, long amt) const
   if (amt == 0) { return; }
   if (amt < 0) amt += al.getNSlots();
 
+  // If there are matrices for all the automorphisms of the plan, apply them
+  // to one decomposition of ctxt and mask only once
+  vector<long> vals;
+  getRotationVals(vals, -1, amt);
+  if (haveDirectKeys(ctxt, vals)) {
+    applyRotationPlan(ctxt, *rotationPlan(-1, amt));
+    return;
+  }
+
   // rotate the ciphertext, one dimension at a time
   long i = al.numOfGens()-1;
   long v = al.coordinate(i, amt);
@@ -235,15 +483,17 @@ void EncryptedArrayDerived<type>::rotate(Ctxt& ctxt, long amt) const
   // assumption that we have the key switch matrix 
   // for \rho_i^{-ord}
 
-  DoubleCRT m1(convert<zzX>(maskTable[i][v]), context, 
-               ctxt.getPrimeSet() | tmp.getPrimeSet());
+  MaskCache::Entry m1 =
+    masks->get(context, MaskCache::ROTATE, i, amt,
+               ctxt.getPrimeSet() | tmp.getPrimeSet(),
+               [&](zzX& poly) { poly = convert<zzX>(maskTable[i][v]); });
   // m1 will be used to multiply both ctxt and tmp
   
   // Compute ctxt = ctxt*m1, tmp = tmp*(1-m1)
-  ctxt.multByConstant(m1);
+  ctxt.multByConstant(*m1);
 
   Ctxt tmp1(tmp);
-  tmp1.multByConstant(m1);
+  tmp1.multByConstant(*m1);
   tmp -= tmp1;
 
 #endif
@@ -265,10 +515,12 @@ void EncryptedArrayDerived<type>::rotate(Ctxt& ctxt, long amt) const
   for (i--; i >= 0; i--) {
     v = al.coordinate(i, amt);
 
-    DoubleCRT m1(convert<zzX,RX>(mask), context, ctxt.getPrimeSet());
+    MaskCache::Entry m1 =
+      masks->get(context, MaskCache::ROTATE, i, amt, ctxt.getPrimeSet(),
+                 [&](zzX& poly) { poly = convert<zzX,RX>(mask); });
     tmp = ctxt;
-    tmp.multByConstant(m1); // only the slots in which mask=1
-    ctxt -= tmp;            // only the slots in which mask=0
+    tmp.multByConstant(*m1); // only the slots in which mask=1
+    ctxt -= tmp;             // only the slots in which mask=0
 
     rotate1D(tmp, i, v); 
     rotate1D(ctxt, i, v+1);
@@ -325,10 +577,12 @@ void EncryptedArrayDerived<type>::shift(Ctxt& ctxt, long k) const
   for (i--; i >= 0; i--) {
     v = al.coordinate(i, amt);
 
-    DoubleCRT m1(convert<zzX,RX>(mask), context, ctxt.getPrimeSet());
+    MaskCache::Entry m1 =
+      masks->get(context, MaskCache::SHIFT, i, amt, ctxt.getPrimeSet(),
+                 [&](zzX& poly) { poly = convert<zzX,RX>(mask); });
     tmp = ctxt;
-    tmp.multByConstant(m1); // only the slots in which mask=1
-    ctxt -= tmp;            // only the slots in which mask=0
+    tmp.multByConstant(*m1); // only the slots in which mask=1
+    ctxt -= tmp;             // only the slots in which mask=0
     if (i>0) {
       rotate1D(ctxt, i, v+1);
       rotate1D(tmp, i, v); 
@@ -435,6 +689,84 @@ void EncryptedArrayDerived<type>::decode(PlaintextArray& array, const NTL::Vec<l
   decode(array.getData<type>(), ptxt);
 }
 
+template<class type>
+void EncryptedArrayDerived<type>::encode(vector<zzX>& ptxts,
+                               const vector< vector<long> >& arrays) const
+{
+  FHE_TIMER_START;
+  long n = lsize(arrays);
+  ptxts.resize(n);
+  FHE_EXEC_RANGE(n, first, last)
+  RBak bak; bak.save(); tab.restoreContext();
+  vector<RX> array1;
+  for (long i=first; i<last; i++) {
+    convert(array1, arrays[i]);
+    encode(ptxts[i], array1);
+  }
+  FHE_EXEC_RANGE_END
+}
+
+template<class type>
+void EncryptedArrayDerived<type>::decode(vector< vector<long> >& arrays,
+                               const vector<zzX>& ptxts) const
+{
+  FHE_TIMER_START;
+  long n = lsize(ptxts);
+  arrays.resize(n);
+  FHE_EXEC_RANGE(n, first, last)
+  RBak bak; bak.save(); tab.restoreContext();
+  vector<RX> array1;
+  for (long i=first; i<last; i++) {
+    decode(array1, ptxts[i]);
+    convert(arrays[i], array1);
+  }
+  FHE_EXEC_RANGE_END
+}
+
+template<class type>
+void EncryptedArrayDerived<type>::encrypt(vector<Ctxt>& ctxts,
+                               const FHEPubKey& key,
+                               const vector< vector<long> >& arrays) const
+{
+  FHE_TIMER_START;
+  long n = lsize(arrays);
+  if (lsize(ctxts) < n)
+    throw std::logic_error("EncryptedArrayDerived::encrypt: "
+                           "fewer ciphertexts than arrays");
+  vector<zzX> ptxts;
+  encode(ptxts, arrays);
+  for (long i=0; i<n; i++) assert(&context == &ctxts[i].getContext());
+  key.batchEncrypt(ctxts, ptxts);
+}
+
+template<class type>
+void EncryptedArrayDerived<type>::decrypt(const vector<Ctxt>& ctxts,
+                               const FHESecKey& sKey,
+                               vector< vector<long> >& arrays) const
+{
+  FHE_TIMER_START;
+  long n = lsize(ctxts);
+  arrays.resize(n);
+  FHE_EXEC_RANGE(n, first, last)
+  RBak bak; bak.save(); tab.restoreContext();
+  ZZX pp;
+  zzX vp;
+  vector<RX> array1;
+  for (long i=first; i<last; i++) {
+    assert(&context == &ctxts[i].getContext());
+    if (sKey.DecryptSinglePrime(vp, ctxts[i])) decode(array1, vp);
+    else {
+      sKey.Decrypt(pp, ctxts[i]);
+      decode(array1, pp);
+    }
+    convert(arrays[i], array1);
+    long ptxtSpace = ctxts[i].getPtxtSpace();
+    if (ptxtSpace < getP2R())
+      for (long& x: arrays[i]) x %= ptxtSpace;
+  }
+  FHE_EXEC_RANGE_END
+}
+
 
 // this routine generates a "random" normal element and initializes a
 // matrix mapping from polynomial to normal basis and its inverse. It
@@ -505,25 +837,35 @@ void EncryptedArrayDerived<type>::initNormalBasisMatrix() const
 
 // Other functions...
 
-void runningSums(const EncryptedArray& ea, Ctxt& ctxt)
-{
-  long n = ea.size();
+// Summing along the dimensions of the hypercube. Along a native dimension
+// all the rotations are automorphisms of the same input, so when the
+// key-switching matrices for them exist they can share one decomposition
+// (see BasicAutomorphPrecon). The cost estimates below count a digit
+// decomposition and a key-switching inner product as one unit each, and
+// assume that the hoisted inner products are split between the threads.
 
-  long shamt = 1;
-  while (shamt < n) {
-    Ctxt tmp = ctxt;
-    ea.shift(tmp, shamt);
-    ctxt += tmp; // ctxt = ctxt + (ctxt >> shamt)
-    shamt = 2*shamt;
-  }
+// out = sum_i ctxt^{(vals[i])}, using one decomposition of ctxt
+static void hoistedSum(Ctxt& out, const Ctxt& ctxt, const vector<long>& vals)
+{
+  vector< shared_ptr<Ctxt> > rots;
+  BasicAutomorphPrecon(ctxt).automorph(rots, vals);
+  out = *rots[0];
+  for (long i = 1; i < lsize(rots); i++) out += *rots[i];
 }
 
-void totalSums(const EncryptedArray& ea, Ctxt& ctxt)
+// The number of rotations in the rotate-and-add ladder for n slots
+static long ladderSteps(long n)
 {
-  long n = ea.size();
-
-  if (n == 1) return;
+  long steps = 0;
+  for (long i = NumBits(n)-2; i >= 0; i--) steps += 1 + bit(n, i);
+  return steps;
+}
 
+// Sum along dimension d with the rotate-and-add ladder, using about
+// 2*log(n) sequential rotations
+static void ladderSum1D(const EncryptedArray& ea, Ctxt& ctxt, long d)
+{
+  long n = ea.sizeOfDimension(d);
   Ctxt orig = ctxt;
 
   long k = NumBits(n);
@@ -531,13 +873,13 @@ void totalSums(const EncryptedArray& ea, Ctxt& ctxt)
 
   for (long i = k-2; i >= 0; i--) {
     Ctxt tmp1 = ctxt;
-    ea.rotate(tmp1, e);
+    ea.rotate1D(tmp1, d, e);
     ctxt += tmp1; // ctxt = ctxt + (ctxt >>> e)
     e = 2*e;
 
     if (bit(n, i)) {
       Ctxt tmp2 = orig;
-      ea.rotate(tmp2, e);
+      ea.rotate1D(tmp2, d, e);
       ctxt += tmp2; // ctxt = ctxt + (orig >>> e)
                     // NOTE: we could have also computed
                     // ctxt =  (ctxt >>> e) + orig, however,
@@ -547,6 +889,115 @@ void totalSums(const EncryptedArray& ea, Ctxt& ctxt)
   }
 }
 
+// Sum along the native dimension d, choosing between the ladder, all the
+// n-1 rotations hoisted together, and baby-step/giant-step: with b baby
+// steps and q=floor(n/b), sum_{j<n} rot_j = sum_{i<q} rot_{ib}(S_b)
+// + rot_{qb}(S_{n-qb}) where S_t = sum_{j<t} rot_j, all the baby steps
+// (and then all the giant steps) hoisted together.
+static void totalSums1D(const EncryptedArray& ea, Ctxt& ctxt, long d)
+{
+  long n = ea.sizeOfDimension(d);
+  if (n == 1) return;
+  if (!ea.nativeDimension(d)) { // rotations need masking, no hoisting
+    ladderSum1D(ea, ctxt, d);
+    return;
+  }
+  const PAlgebra& zMStar = ea.getPAlgebra();
+  double nThreads = fheAvailableThreads();
+
+  double bestCost = 2.0*ladderSteps(n);
+  long best = 0; // 0: ladder, 1: all hoisted, b>1: b baby steps
+
+  vector<long> all(n);
+  for (long j = 0; j < n; j++) all[j] = zMStar.genToPow(d, j);
+  double cost = 1.0 + (n-1)/nThreads;
+  if (cost < bestCost && haveDirectKeys(ctxt, all)) {
+    bestCost = cost;
+    best = 1;
+  }
+
+  long b = SqrRoot(n-1) + 1; // ceil(sqrt(n)) for n>1
+  long q = n / b, rem = n - q*b;
+  vector<long> baby(all.begin(), all.begin()+b), giant(q);
+  for (long i = 0; i < q; i++) giant[i] = zMStar.genToPow(d, i*b);
+  if (rem > 0) giant.push_back(zMStar.genToPow(d, q*b));
+  cost = 2.0 + (b-1 + lsize(giant)-1)/nThreads + (rem > 0);
+  if (b > 1 && cost < bestCost
+      && haveDirectKeys(ctxt, baby) && haveDirectKeys(ctxt, giant)) {
+    bestCost = cost;
+    best = b;
+  }
+
+  if (best == 0) ladderSum1D(ea, ctxt, d);
+  else if (best == 1) hoistedSum(ctxt, ctxt, all);
+  else { // baby-step/giant-step
+    vector< shared_ptr<Ctxt> > rots;
+    BasicAutomorphPrecon(ctxt).automorph(rots, baby);
+    Ctxt Sb = *rots[0], tail(ZeroCtxtLike, ctxt);
+    for (long j = 1; j < b; j++) {
+      if (j == rem) tail = Sb; // keep S_rem
+      Sb += *rots[j];
+    }
+    if (rem > 0) giant.pop_back();
+    hoistedSum(ctxt, Sb, giant);
+    if (rem > 0) {
+      tail.smartAutomorph(zMStar.genToPow(d, q*b));
+      ctxt += tail;
+    }
+  }
+}
+
+void runningSums(const EncryptedArray& ea, Ctxt& ctxt)
+{
+  long n = ea.size();
+
+  // For a single native dimension, shift(ctxt,j) is the rotation by j
+  // masked to the slots i>=j, and all the rotations are hoisted together
+  if (ea.dimension() == 1 && ea.nativeDimension(0) && n > 2
+      && !ctxt.isCKKS()
+      && 1.0 + (n-1)/double(fheAvailableThreads()) < 2.0*(NumBits(n-1))) {
+    const PAlgebra& zMStar = ea.getPAlgebra();
+    vector<long> vals(n);
+    for (long j = 0; j < n; j++) vals[j] = zMStar.genToPow(0, j);
+    if (haveDirectKeys(ctxt, vals)) {
+      vector<zzX> masks(n); // encoded serially, encoding is not thread-safe
+      vector<long> mask(n);
+      for (long j = 1; j < n; j++) {
+        for (long i = 0; i < n; i++) mask[i] = (i >= j);
+        ea.encode(masks[j], mask);
+      }
+      vector< shared_ptr<Ctxt> > rots;
+      BasicAutomorphPrecon(ctxt).automorph(rots, vals);
+      FHE_EXEC_RANGE(n-1, first, last)
+        for (long j = first+1; j < last+1; j++)
+          rots[j]->multByConstant(masks[j]);
+      FHE_EXEC_RANGE_END
+      ctxt = *rots[0];
+      for (long j = 1; j < n; j++) ctxt += *rots[j];
+      return;
+    }
+  }
+
+  long shamt = 1;
+  while (shamt < n) {
+    Ctxt tmp = ctxt;
+    ea.shift(tmp, shamt);
+    ctxt += tmp; // ctxt = ctxt + (ctxt >> shamt)
+    shamt = 2*shamt;
+  }
+}
+
+// The total sum is the composition of the sums along each dimension, each
+// sum with its own strategy
+void totalSums(const EncryptedArray& ea, Ctxt& ctxt)
+{
+  FHE_TIMER_START;
+  if (ea.size() == 1) return;
+
+  for (long d = 0; d < ea.dimension(); d++)
+    totalSums1D(ea, ctxt, d);
+}
+
 
 
 
@@ -605,34 +1056,29 @@ EncryptedArrayDerived<type>::buildLinPolyCoeffs(vector<RX>& C,
 }
 
 
-// Apply the same linear transformation to all the slots.
-// C[0...d-1] is the output of ea.buildLinPolyCoeffs
-void applyLinPoly1(const EncryptedArray& ea, Ctxt& ctxt, const vector<ZZX>& C)
+// Encoding the coefficients of linear polynomials in slots
+
+// encodedC[j] encodes C[j] in all the slots
+static void encodeLinPoly1(vector<ZZX>& encodedC, const EncryptedArray& ea,
+                           const vector<ZZX>& C)
 {
-  assert(&ea.getContext() == &ctxt.getContext());
   long d = ea.getDegree();
   assert(d == lsize(C));
 
   long nslots = ea.size();
 
-  vector<ZZX> encodedC(d);
+  encodedC.resize(d);
   for (long j = 0; j < d; j++) {
     vector<ZZX> v(nslots); // all the slots of v equal C[j]
     for (long i = 0; i < nslots; i++) v[i] = C[j];
     ea.encode(encodedC[j], v);
   }
-
-  applyLinPolyLL(ctxt, encodedC, ea.getDegree());
 }
 
-
-// Apply different transformations to different slots. Each row in
-// the matrix Cvec[0...nslots-1][0...d-1] is a length-d vector which
-// is the output of ea.buildLinPolyCoeffs
-void applyLinPolyMany(const EncryptedArray& ea, Ctxt& ctxt, 
-                      const vector< vector<ZZX> >& Cvec)
+// encodedC[j] encodes the j'th column of Cvec
+static void encodeLinPolyMany(vector<ZZX>& encodedC, const EncryptedArray& ea,
+                              const vector< vector<ZZX> >& Cvec)
 {
-  assert(&ea.getContext() == &ctxt.getContext());
   long d = ea.getDegree();
   long nslots = ea.size();
 
@@ -640,18 +1086,40 @@ void applyLinPolyMany(const EncryptedArray& ea, Ctxt& ctxt,
   for (long i = 0; i < nslots; i++)
     assert(d == lsize(Cvec[i]));
 
-  vector<ZZX> encodedC(d);
+  encodedC.resize(d);
   for (long j = 0; j < d; j++) { // encodedC[j] encodes j'th column in Cvec
     vector<ZZX> v(nslots);       // copy j'th column to v
     for (long i = 0; i < nslots; i++) v[i] = Cvec[i][j];
     ea.encode(encodedC[j], v);   // then encode it
   }
+}
 
+// Apply the same linear transformation to all the slots.
+// C[0...d-1] is the output of ea.buildLinPolyCoeffs
+void applyLinPoly1(const EncryptedArray& ea, Ctxt& ctxt, const vector<ZZX>& C)
+{
+  assert(&ea.getContext() == &ctxt.getContext());
+  vector<ZZX> encodedC;
+  encodeLinPoly1(encodedC, ea, C);
+  applyLinPolyLL(ctxt, encodedC, ea.getDegree());
+}
+
+
+// Apply different transformations to different slots. Each row in
+// the matrix Cvec[0...nslots-1][0...d-1] is a length-d vector which
+// is the output of ea.buildLinPolyCoeffs
+void applyLinPolyMany(const EncryptedArray& ea, Ctxt& ctxt, 
+                      const vector< vector<ZZX> >& Cvec)
+{
+  assert(&ea.getContext() == &ctxt.getContext());
+  vector<ZZX> encodedC;
+  encodeLinPolyMany(encodedC, ea, Cvec);
   applyLinPolyLL(ctxt, encodedC, ea.getDegree());
 }
 
 // A low-level variant: encodedCoeffs has all the linPoly coeffs encoded
-// in slots; different transformations can be encoded in different slots
+// in slots; different transformations can be encoded in different slots.
+// The d Frobenius images share one digit decomposition.
 template<class P>
 void applyLinPolyLL(Ctxt& ctxt, const vector<P>& encodedC, long d)
 {
@@ -659,26 +1127,99 @@ void applyLinPolyLL(Ctxt& ctxt, const vector<P>& encodedC, long d)
 
   ctxt.cleanUp();  // not sure, but this may be a good idea
 
-  Ctxt tmp(ctxt);
+  vector< shared_ptr<Ctxt> > frob;
+  BasicAutomorphPrecon(ctxt).frobeniusAutomorphs(frob, d);
 
-  ctxt.multByConstant(encodedC[0]);
-  for (long j = 1; j < d; j++) {
-    Ctxt tmp1(tmp);
-    tmp1.frobeniusAutomorph(j);
-    tmp1.multByConstant(encodedC[j]);
-    ctxt += tmp1;
-  }
+  FHE_EXEC_RANGE(d, first, last)
+    for (long j = first; j < last; j++)
+      frob[j]->multByConstant(encodedC[j]);
+  FHE_EXEC_RANGE_END
+
+  ctxt = *frob[0];
+  for (long j = 1; j < d; j++)
+    ctxt += *frob[j];
 }
 template void applyLinPolyLL(Ctxt& ctxt, const vector<zzX>& encodedC, long d);
 template void applyLinPolyLL(Ctxt& ctxt, const vector<ZZX>& encodedC, long d);
 template void applyLinPolyLL(Ctxt& ctxt, const vector<DoubleCRT>& encodedC, long d);
 
+LinPolyExecutor::LinPolyExecutor(const EncryptedArray& ea,
+                                 const vector<ZZX>& C)
+{
+  vector<ZZX> encoded;
+  encodeLinPoly1(encoded, ea, C);
+  *this = LinPolyExecutor(ea.getContext(), encoded);
+}
+
+LinPolyExecutor::LinPolyExecutor(const EncryptedArray& ea,
+                                 const vector< vector<ZZX> >& Cvec)
+{
+  vector<ZZX> encoded;
+  encodeLinPolyMany(encoded, ea, Cvec);
+  *this = LinPolyExecutor(ea.getContext(), encoded);
+}
+
+LinPolyExecutor::LinPolyExecutor(const FHEcontext& context,
+                                 const vector<zzX>& encoded)
+{
+  for (const zzX& c: encoded)
+    encodedC.emplace_back(c, context, context.fullPrimes());
+}
+
+LinPolyExecutor::LinPolyExecutor(const FHEcontext& context,
+                                 const vector<ZZX>& encoded)
+{
+  for (const ZZX& c: encoded)
+    encodedC.emplace_back(c, context, context.fullPrimes());
+}
+
+void LinPolyExecutor::apply(Ctxt& ctxt) const
+{
+  FHE_TIMER_START;
+  applyLinPolyLL(ctxt, encodedC, degree());
+}
+
+void LinPolyExecutor::apply(vector<Ctxt>& ctxts) const
+{
+  FHE_TIMER_START;
+  long n = lsize(ctxts);
+  if (n < fheAvailableThreads()) { // parallelize within each ciphertext
+    for (Ctxt& c: ctxts) apply(c);
+    return;
+  }
+  FHE_EXEC_RANGE(n, first, last) // inner loops: serial, or tasks
+    for (long i = first; i < last; i++) apply(ctxts[i]);
+  FHE_EXEC_RANGE_END
+}
+
 /****************** End linear transformation code ******************/
 /********************************************************************/
 
 
 // PlaintextArray
 
+// The slot-wise operations on a PlaintextArray run in parallel when the
+// slots hold at least this many coefficients between them
+#ifndef FHE_PA_PARALLEL_THRESH
+#define FHE_PA_PARALLEL_THRESH (4096)
+#endif
+
+// f(first,last) over the slots [0,n), split between the threads if there
+// are enough of them, each thread under the NTL modulus of the slots. The
+// caller has installed that modulus for the serial case.
+template<class type, class Fct>
+static void execSlots(const EncryptedArrayDerived<type>& ea, long n,
+                      const Fct& f)
+{
+  if (n*ea.getDegree() < FHE_PA_PARALLEL_THRESH || fheAvailableThreads()==1) {
+    f(0, n);
+    return;
+  }
+  FHE_EXEC_RANGE(n, first, last)
+    typename type::RBak bak; bak.save(); ea.getTab().restoreContext();
+    f(first, last);
+  FHE_EXEC_RANGE_END
+}
 
 template<class type>
 class rotate_pa_impl {
@@ -689,12 +1230,12 @@ public:
   {
     PA_BOILER
 
-    vector<RX> tmp(n); 
-
-    for (long i = 0; i < n; i++)
-      tmp[((i+k)%n + n)%n] = data[i];
+    if (n == 0) return;
+    k = mcMod(k, n);
+    if (k == 0) return;
 
-    data = tmp;
+    // slot i moves to i+k: the last k slots come first, swapped in place
+    std::rotate(data.begin(), data.begin() + (n-k), data.end());
   }
 };
 
@@ -903,6 +1444,69 @@ bool equals(const EncryptedArray& ea, const PlaintextArray& pa, const vector<ZZX
 
 //=============================================================================
 
+template<class type>
+class write_pa_impl {
+public:
+  PA_INJECT(type)
+
+  static void apply(const EncryptedArrayDerived<type>& ea, ostream& str,
+    const PlaintextArray& pa)
+  {
+    CPA_BOILER
+
+    vector<long> coeffs(n*d);
+    for (long i = 0; i < n; i++)
+      for (long j = 0; j < d; j++)
+        coeffs[i*d + j] = conv<long>(coeff(data[i], j));
+
+    write_raw_int(str, n);
+    write_raw_int(str, d);
+    write_packed_long_array(str, coeffs.data(), n*d,
+                            max(NumBits(tab.getPPowR()-1), 1L));
+  }
+};
+
+template<class type>
+class read_pa_impl {
+public:
+  PA_INJECT(type)
+
+  static void apply(const EncryptedArrayDerived<type>& ea, istream& str,
+    PlaintextArray& pa)
+  {
+    PA_BOILER
+
+    if (read_raw_int(str) != n || read_raw_int(str) != d)
+      throw std::runtime_error("readPlaintextArray: wrong number of slots "
+                               "or degree");
+    vector<long> coeffs(n*d);
+    read_packed_long_array(str, coeffs.data(), n*d);
+    if (!str)
+      throw std::runtime_error("readPlaintextArray: stream too short");
+
+    for (long i = 0; i < n; i++) {
+      clear(data[i]);
+      for (long j = 0; j < d; j++)
+        SetCoeff(data[i], j, coeffs[i*d + j]);
+    }
+  }
+};
+
+
+void writePlaintextArray(ostream& str, const EncryptedArray& ea,
+                         const PlaintextArray& pa)
+{
+  ea.dispatch<write_pa_impl>(str, pa);
+}
+
+void readPlaintextArray(istream& str, const EncryptedArray& ea,
+                        PlaintextArray& pa)
+{
+  ea.dispatch<read_pa_impl>(str, pa);
+}
+
+//=============================================================================
+
 template<class type>
 class add_pa_impl {
 public:
@@ -915,8 +1519,10 @@ public:
 
     const vector<RX>& odata = other.getData<type>(); 
 
-    for (long i = 0; i < n; i++)
-      data[i] += odata[i];
+    execSlots(ea, n, [&](long first, long last) {
+      for (long i = first; i < last; i++)
+        data[i] += odata[i];
+    });
   }
 }; 
 
@@ -940,8 +1546,10 @@ public:
 
     const vector<RX>& odata = other.getData<type>(); 
 
-    for (long i = 0; i < n; i++)
-      data[i] -= odata[i];
+    execSlots(ea, n, [&](long first, long last) {
+      for (long i = first; i < last; i++)
+        data[i] -= odata[i];
+    });
   }
 }; 
 
@@ -965,8 +1573,20 @@ public:
 
     const vector<RX>& odata = other.getData<type>(); 
 
-    for (long i = 0; i < n; i++)
-      data[i] = (data[i] * odata[i]) % G;
+    if (d == 1) { // the slots are constants, no reduction mod G
+      execSlots(ea, n, [&](long first, long last) {
+        for (long i = first; i < last; i++)
+          mul(data[i], data[i], ConstTerm(odata[i]));
+      });
+      return;
+    }
+
+    // precomputed once for all the slots, and only read by the threads
+    RXModulus Gmod(G);
+    execSlots(ea, n, [&](long first, long last) {
+      for (long i = first; i < last; i++)
+        MulMod(data[i], data[i], odata[i], Gmod);
+    });
   }
 }; 
 
@@ -987,8 +1607,10 @@ public:
   {
     PA_BOILER
 
-    for (long i = 0; i < n; i++)
-      NTL::negate(data[i], data[i]);
+    execSlots(ea, n, [&](long first, long last) {
+      for (long i = first; i < last; i++)
+        NTL::negate(data[i], data[i]);
+    });
   }
 }; 
 
@@ -1012,10 +1634,15 @@ public:
     long p = ea.getPAlgebra().getP();
 
     j = mcMod(j, d);
-    RX H = PowerMod(RX(1, 1), power_ZZ(p, j), G);
+    if (j == 0) return; // also the case for d=1
 
-    for (long i = 0; i < n; i++)
-      data[i] = CompMod(data[i], H, G);
+    RXModulus Gmod(G);
+    RX H = PowerMod(RX(1, 1), power_ZZ(p, j), Gmod);
+
+    execSlots(ea, n, [&](long first, long last) {
+      for (long i = first; i < last; i++)
+        CompMod(data[i], data[i], H, Gmod);
+    });
   }
 
   static void apply(const EncryptedArrayDerived<type>& ea, PlaintextArray& pa,
@@ -1025,13 +1652,28 @@ public:
 
     assert(vec.length() == n);
 
+    if (d == 1) return; // the Frobenius map is the identity on Z_{p^r}
+
     long p = ea.getPAlgebra().getP();
 
+    // X^{p^j} mod G for each of the d possible j's that vec uses, all
+    // computed before the slots are split between the threads
+    RXModulus Gmod(G);
+    vector<RX> H(d);
+    vector<bool> haveH(d, false);
     for (long i = 0; i < n; i++) {
       long j = mcMod(vec[i], d);
-      RX H = PowerMod(RX(1, 1), power_ZZ(p, j), G);
-      data[i] = CompMod(data[i], H, G);
+      if (j == 0 || haveH[j]) continue;
+      PowerMod(H[j], RX(1, 1), power_ZZ(p, j), Gmod);
+      haveH[j] = true;
     }
+
+    execSlots(ea, n, [&](long first, long last) {
+      for (long i = first; i < last; i++) {
+        long j = mcMod(vec[i], d);
+        if (j != 0) CompMod(data[i], data[i], H[j], Gmod);
+      }
+    });
   }
 };
 
@@ -1077,12 +1719,42 @@ public:
 
     assert(pi.length() == n);
 
-    vector<RX> tmp;
-    tmp.resize(n);
-    for (long i = 0; i < n; i++)
-      tmp[i] = data[pi[i]];
+    // A permutation is applied in place, one cycle at a time by swapping
+    // the slots. A map that repeats slots needs the copies.
+    vector<bool> seen(n, false);
+    bool isPerm = true;
+    for (long i = 0; i < n && isPerm; i++) {
+      long j = pi[i];
+      assert(j >= 0 && j < n);
+      if (seen[j]) isPerm = false;
+      seen[j] = true;
+    }
+
+    if (!isPerm) {
+      vector<RX> tmp(n);
+      for (long i = 0; i < n; i++)
+        tmp[i] = data[pi[i]];
+      data.swap(tmp);
+      return;
+    }
 
-    data = tmp;
+    // slot i takes slot pi[i]: along a cycle s, pi[s], pi[pi[s]], ... each
+    // slot takes the next one, and the last one takes the old slot s
+    std::fill(seen.begin(), seen.end(), false);
+    RX first;
+    for (long s = 0; s < n; s++) {
+      if (seen[s]) continue;
+      seen[s] = true;
+      if (pi[s] == s) continue;
+      swap(first, data[s]);
+      long j = s;
+      while (pi[j] != s) {
+        swap(data[j], data[pi[j]]);
+        j = pi[j];
+        seen[j] = true;
+      }
+      swap(data[j], first);
+    }
   }
 };
 
@@ -1096,6 +1768,59 @@ void applyPerm(const EncryptedArray& ea, PlaintextArray& pa, const Vec<long>& pi
 
 //=============================================================================
 
+template<class type>
+class rotate1D_pa_impl {
+public:
+  PA_INJECT(type)
+
+  // slot j moves to addCoord(i, j, k), which is where it is taken from
+  static void apply(const EncryptedArrayDerived<type>& ea, PlaintextArray& pa,
+    long i, long k)
+  {
+    long n = ea.size();
+    assert(i >= 0 && i < ea.dimension());
+    Vec<long> pi;
+    pi.SetLength(n);
+    for (long j = 0; j < n; j++)
+      pi[ea.addCoord(i, j, k)] = j;
+    applyPerm_pa_impl<type>::apply(ea, pa, pi);
+  }
+};
+
+template<class type>
+class shift1D_pa_impl {
+public:
+  PA_INJECT(type)
+
+  static void apply(const EncryptedArrayDerived<type>& ea, PlaintextArray& pa,
+    long i, long k)
+  {
+    PA_BOILER
+
+    assert(i >= 0 && i < ea.dimension());
+    long ord = ea.sizeOfDimension(i);
+    for (long j = 0; j < n; j++) {
+      long c = ea.coordinate(i, j) + k;
+      if (c < 0 || c >= ord) clear(data[j]); // shifted off the end
+    }
+
+    rotate1D_pa_impl<type>::apply(ea, pa, i, k);
+  }
+};
+
+
+void rotate1D(const EncryptedArray& ea, PlaintextArray& pa, long i, long k)
+{
+  ea.dispatch<rotate1D_pa_impl>(pa, i, k);
+}
+
+void shift1D(const EncryptedArray& ea, PlaintextArray& pa, long i, long k)
+{
+  ea.dispatch<shift1D_pa_impl>(pa, i, k);
+}
+
+//=============================================================================
+
 template<class type>
 class print_pa_impl {
 public:
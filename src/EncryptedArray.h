@@ -16,8 +16,13 @@
  * @brief Data-movement operations on encrypted arrays of slots
  */
 #include <exception>
+#include <functional>
 #include <cmath>
 #include <complex>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <NTL/Lazy.h>
 #include <NTL/pair.h>
 #include <NTL/SmartPtr.h>
@@ -53,6 +58,76 @@ typedef std::complex<double> cx_double;
 class PlaintextArray; // forward reference
 class EncryptedArray; // forward reference
 
+/**
+ * @class MaskCache
+ * @brief The DoubleCRT images of the masks and constants of data movement.
+ *
+ * Operations such as shift, shift1D, non-native rotate1D, replicate and
+ * incrementalZeroTest multiply by masks that only depend on the operation,
+ * a dimension and an amount. Converting the encoded mask to DoubleCRT takes
+ * an FFT for every prime, so the converted masks are kept here, keyed by
+ * (op, dim, amt) and the prime set. They are built on first use, and
+ * evicted in least-recently-used order once there are more than maxEntries
+ * of them. All the methods are thread-safe.
+ **/
+class MaskCache {
+public:
+  typedef std::shared_ptr<const DoubleCRT> Entry;
+
+  //! The operations that use the cache, the op of the key
+  enum { SHIFT, SHIFT1D, ROTATE, ROTATE1D, REPLICATE, SELECT_RANGE,
+         ZERO_TEST, USER_MASK };
+
+private:
+  struct Key {
+    long op, dim, amt;
+    std::vector<long> primes;
+    bool operator<(const Key& other) const;
+  };
+  typedef std::list< std::pair<Key, Entry> > NodeList;
+  NodeList lru; // most recently used first
+  std::map<Key, NodeList::iterator> index;
+  long maxEntries;
+  long nHits, nMisses;
+  mutable std::mutex mtx;
+
+  void evict(); // Must be called with mtx locked
+
+public:
+  explicit MaskCache(long maxEntries=256)
+    : maxEntries(maxEntries), nHits(0), nMisses(0) {}
+  MaskCache(const MaskCache&) = delete;
+  MaskCache& operator=(const MaskCache&) = delete;
+
+  //! The mask of (op,dim,amt) at the primes s. On a miss, build(mask) is
+  //! called (without holding the lock) to encode it, then it is converted
+  //! and cached.
+  Entry get(const FHEcontext& context, long op, long dim, long amt,
+            const IndexSet& s, const std::function<void(zzX&)>& build);
+
+  void clear();
+
+  //! The bound on the number of entries (0 disables caching)
+  void setMaxEntries(long n);
+
+  long size() const;
+  long hits() const;
+  long misses() const;
+};
+
+//! @brief The mask of (op,dim,amt) at the primes s, from cache if it is not
+//! NULL, else built and converted on the spot
+inline MaskCache::Entry
+cachedMask(MaskCache* cache, const FHEcontext& context, long op, long dim,
+           long amt, const IndexSet& s,
+           const std::function<void(zzX&)>& build)
+{
+  if (cache) return cache->get(context, op, dim, amt, s, build);
+  zzX mask;
+  build(mask);
+  return std::make_shared<DoubleCRT>(mask, context, s);
+}
+
 /**
  * @class EncryptedArrayBase
  * @brief virtual class for data-movement operations on arrays of slots
@@ -96,6 +171,9 @@ public:
 
   virtual PA_tag getTag() const = 0;
 
+  //! The cache of converted masks, NULL if this class has none
+  virtual MaskCache* getMaskCache() const { return NULL; }
+
   virtual const FHEcontext& getContext() const = 0;
   virtual const PAlgebra& getPAlgebra() const = 0;
   virtual const long getDegree() const = 0;
@@ -148,6 +226,20 @@ public:
   void encode(zzX& ptxt, const std::vector< NTL::ZZX >& array) const
   { NTL::ZZX tmp; encode(tmp, array); convert(ptxt, tmp); }
 
+  //! @brief Encode into a constant that builds its own DoubleCRT forms,
+  //! for use with ciphertexts at any level (see encodedPtxt.h). ptxt must
+  //! be over the context of this array.
+  template<class ARRAY>
+  void encode(EncodedPlaintext& ptxt, const ARRAY& array) const
+  {
+    if (&ptxt.getContext() != &getContext())
+      throw std::logic_error("EncryptedArrayBase::encode: "
+                             "incompatible contexts");
+    zzX poly;
+    encode(poly, array);
+    ptxt.set(poly);
+  }
+
   // These methods are only defined for some of the derived calsses
   virtual void decode(std::vector< long  >& array, const NTL::ZZX& ptxt) const
   {throw std::logic_error("EncryptedArrayBase::decode for undefined type");}
@@ -268,6 +360,58 @@ public:
   }
 };
 
+/**
+ * @class RotationPlanCache
+ * @brief The plans of the hoisted rotations of an EncryptedArrayDerived.
+ *
+ * When there are key-switching matrices for all its automorphisms, a
+ * rotation by amt (along one dimension or of the whole array) is computed
+ * as sum_j masks[j]*ctxt^{(vals[j])}, where masks[j] selects the slots that
+ * the automorphism X->X^{vals[j]} moves to the right place. The
+ * automorphisms are hoisted over one decomposition of ctxt, and there is a
+ * single masking step whatever the number of bad dimensions. A plan keeps
+ * its masks as DoubleCRTs over all the primes, so it fits ciphertexts at
+ * any level. Plans are evicted in least-recently-used order once there are
+ * more than maxEntries of them. All the methods are thread-safe.
+ **/
+class RotationPlanCache {
+public:
+  struct Plan {
+    std::vector<long> vals;       //!< the automorphisms X->X^{vals[j]}
+    std::vector<DoubleCRT> masks; //!< masks[j] for vals[j], all the primes
+  };
+  typedef std::shared_ptr<const Plan> Entry;
+
+private:
+  typedef std::pair<long,long> Key; // (dimension or -1, amount)
+  typedef std::list< std::pair<Key, Entry> > NodeList;
+  NodeList lru; // most recently used first
+  std::map<Key, NodeList::iterator> index;
+  long maxEntries;
+  mutable std::mutex mtx;
+
+  void evict(); // Must be called with mtx locked
+
+public:
+  explicit RotationPlanCache(long maxEntries=16) : maxEntries(maxEntries) {}
+  RotationPlanCache(const RotationPlanCache&) = delete;
+  RotationPlanCache& operator=(const RotationPlanCache&) = delete;
+
+  //! The plan of the rotation by amt along dimension i (i=-1 for the
+  //! whole array), or NULL if it is not cached
+  Entry find(long i, long amt);
+
+  //! Cache the plan, returns the one that is now cached for (i,amt)
+  Entry insert(long i, long amt, const Entry& plan);
+
+  void clear();
+
+  //! The bound on the number of plans (0 disables caching them)
+  void setMaxEntries(long n);
+
+  long size() const;
+};
+
 /**
  * @class EncryptedArrayDerived
  * @brief Derived concrete implementation of EncryptedArrayBase
@@ -293,6 +437,16 @@ private:
   NTL::Lazy< NTL::Pair< NTL::Mat<R>, NTL::Mat<R> > > normalBasisMatrices;
   // a is the matrix, b is its inverse
 
+  std::shared_ptr<RotationPlanCache> rotPlans; // shared with the copies
+  std::shared_ptr<MaskCache> masks;            // also shared
+
+  // The automorphisms of the hoisted rotation by amt along dimension i (or
+  // of the whole array for i=-1) and, if sel!=NULL, the slots of each one
+  void rotationPatterns(std::vector<long>& vals,
+                        std::vector< std::vector<long> >* sel,
+                        long i, long amt) const;
+  RotationPlanCache::Entry rotationPlan(long i, long amt) const;
+
 public:
   explicit
   EncryptedArrayDerived(const FHEcontext& _context, const RX& _G,
@@ -306,6 +460,8 @@ public:
     mappingData = other.mappingData;
     linPolyMatrix = other.linPolyMatrix;
     normalBasisMatrices = other.normalBasisMatrices;
+    rotPlans = other.rotPlans;
+    masks = other.masks;
   }
 
   EncryptedArrayDerived& operator=(const EncryptedArrayDerived& other) // assignment
@@ -318,6 +474,8 @@ public:
     mappingData = other.mappingData;
     linPolyMatrix = other.linPolyMatrix;
     normalBasisMatrices = other.normalBasisMatrices;
+    rotPlans = other.rotPlans;
+    masks = other.masks;
     return *this;
   }
 
@@ -367,6 +525,18 @@ public:
     { EncryptedArrayBase::rotate1D(out, in, i, offset); }
   virtual void shift1D(Ctxt& ctxt, long i, long k) const override;
 
+  //! @brief The automorphisms that the hoisted rotation by amt along
+  //! dimension i (or of the whole array, for i=-1) uses. With key-switching
+  //! matrices for all of them, rotate1D and rotate are hoisted and mask
+  //! once (see RotationPlanCache).
+  void getRotationVals(std::vector<long>& vals, long i, long amt) const
+  { rotationPatterns(vals, NULL, i, amt); }
+
+  //! The plans of the hoisted rotations, shared with the copies
+  RotationPlanCache& getRotationPlans() const { return *rotPlans; }
+
+  virtual MaskCache* getMaskCache() const override { return masks.get(); }
+
   virtual void encode(NTL::ZZX& ptxt, const std::vector< long >& array) const override
     { genericEncode(ptxt, array);  }
 
@@ -421,6 +591,25 @@ public:
     // FIXME: Redudc mod the ciphertext plaintext space as above
     }
 
+  //! @name Batch encoding and encryption
+  //! Each vector is handled as a whole by one thread of the NTL thread
+  //! pool, with the p^r context restored in every thread.
+  ///@{
+  using EncryptedArrayBase::encrypt;
+
+  void encode(std::vector<zzX>& ptxts,
+              const std::vector< std::vector<long> >& arrays) const;
+  void decode(std::vector< std::vector<long> >& arrays,
+              const std::vector<zzX>& ptxts) const;
+
+  //! Encrypt arrays[i] into ctxts[i]. The ciphertexts must already exist
+  //! (e.g., std::vector<Ctxt>(n, Ctxt(key))), at least one per array.
+  void encrypt(std::vector<Ctxt>& ctxts, const FHEPubKey& key,
+               const std::vector< std::vector<long> >& arrays) const;
+  void decrypt(const std::vector<Ctxt>& ctxts, const FHESecKey& sKey,
+               std::vector< std::vector<long> >& arrays) const;
+  ///@}
+
   virtual void buildLinPolyCoeffs(std::vector<NTL::ZZX>& C, const std::vector<NTL::ZZX>& L) const override;
 
   /* the following are specialized methods, used to work over extension fields...they assume 
@@ -498,10 +687,110 @@ private:
                       T& array) const
   {
     assert(&context == &ctxt.getContext());
+    zzX vp; // try the single-precision path first
+    if (sKey.DecryptSinglePrime(vp, ctxt)) {
+      decodeVec(array, vp);
+      return;
+    }
     NTL::ZZX pp;
     sKey.Decrypt(pp, ctxt);
     decode(array, pp);
   }
+
+  template<class T>
+  void decodeVec(T& array, const zzX& ptxt) const
+  {
+    RBak bak; bak.save(); tab.restoreContext();
+
+    std::vector< RX > array1;
+    decode(array1, ptxt);
+    convert(array, array1);
+  }
+  void decodeVec(PlaintextArray& array, const zzX& ptxt) const
+  { decode(array, ptxt); }
+};
+
+class EncryptedArrayCx;
+
+/**
+ * @class CKKSConstCache
+ * @brief A cache of CKKS constants that are already encoded as DoubleCRT.
+ *
+ * Encoding a vector of slots takes an FFT over Z_m^*, and converting the
+ * result to DoubleCRT takes another FFT for every prime. The cache keeps
+ * the DoubleCRT images of vectors that are used again and again, keyed by
+ * a hash of the content of the vector, the precision and the prime set.
+ * Pinned entries (e.g., the weights of a model) stay until they are
+ * unpinned. The others are evicted in least-recently-used order once there
+ * are more than maxEntries of them. All the methods are thread-safe.
+ **/
+class CKKSConstCache {
+public:
+  typedef std::shared_ptr<const DoubleCRT> Entry;
+
+private:
+  struct Key {
+    unsigned long hash;
+    long precision;
+    std::vector<long> primes;
+    bool operator<(const Key& other) const;
+  };
+  struct Node {
+    Key key;
+    std::vector<cx_double> values; // to tell hash collisions apart
+    Entry dcrt;
+    long pins;
+  };
+  typedef std::list<Node> NodeList;
+
+  NodeList lru;    // the unpinned entries, most recently used first
+  NodeList pinned; // the pinned entries, never evicted
+  typedef std::map<Key, NodeList::iterator> Index;
+  Index index;
+  long maxEntries;
+  long nHits, nMisses;
+  mutable std::mutex mtx;
+
+  static Key makeKey(const std::vector<cx_double>& v, const IndexSet& s,
+                     long precision);
+  // The index entry of v, or index.end(). Must be called with mtx locked.
+  Index::iterator find(const Key& key, const std::vector<cx_double>& v);
+  void evict(); // Must be called with mtx locked
+  Entry lookup(const EncryptedArrayCx& ea, const std::vector<cx_double>& v,
+               const IndexSet& s, long precision, bool pin);
+
+public:
+  explicit CKKSConstCache(long maxEntries=64)
+    : maxEntries(maxEntries), nHits(0), nMisses(0) {}
+  CKKSConstCache(const CKKSConstCache&) = delete;
+  CKKSConstCache& operator=(const CKKSConstCache&) = delete;
+
+  //! The encoding of v at the primes s, encoded (and cached) if needed.
+  Entry get(const EncryptedArrayCx& ea, const std::vector<cx_double>& v,
+            const IndexSet& s, long precision=0)
+  { return lookup(ea, v, s, precision, /*pin=*/false); }
+
+  //! Same as get, and the entry is not evicted until it is unpinned as
+  //! many times as it was pinned.
+  Entry pin(const EncryptedArrayCx& ea, const std::vector<cx_double>& v,
+            const IndexSet& s, long precision=0)
+  { return lookup(ea, v, s, precision, /*pin=*/true); }
+
+  //! Returns false if v is not pinned at these primes and precision.
+  bool unpin(const std::vector<cx_double>& v, const IndexSet& s,
+             long precision=0);
+
+  //! Drop all the entries, or only the unpinned ones. Entries that are
+  //! still held by a caller stay valid.
+  void clear(bool keepPinned=false);
+
+  //! The bound on the number of unpinned entries (0 disables caching them)
+  void setMaxEntries(long n);
+
+  long size() const;      //!< number of entries, including pinned ones
+  long numPinned() const;
+  long hits() const;
+  long misses() const;
 };
 
 //! A different derived class to be used for the approximate-numbers scheme
@@ -509,14 +798,17 @@ class EncryptedArrayCx : public EncryptedArrayBase {
   const FHEcontext& context;
   const PAlgebraModCx& alMod;
   zzX iEncoded; // an encoded plaintext with i in all the slots
+  std::shared_ptr<CKKSConstCache> constCache; // shared with the clones
 
 public:
   void encodei(zzX& ptxt, long precision) const; // encode i in all slots
 
   explicit EncryptedArrayCx(const FHEcontext& _context)
-    : context(_context), alMod(context.alMod.getCx()) {encodei(iEncoded,0);}
+    : context(_context), alMod(context.alMod.getCx()),
+      constCache(std::make_shared<CKKSConstCache>()) {encodei(iEncoded,0);}
   EncryptedArrayCx(const FHEcontext& _context, const PAlgebraModCx& _alMod)
-    : context(_context), alMod(_alMod) {encodei(iEncoded,0);}
+    : context(_context), alMod(_alMod),
+      constCache(std::make_shared<CKKSConstCache>()) {encodei(iEncoded,0);}
 
   // convertion between std::vectors of complex, real, and integers
   static void convert(std::vector<cx_double>& out,
@@ -620,13 +912,64 @@ public:
                const FHESecKey& sKey, std::vector<double>& ptxt) const override
   { std::vector<cx_double> v; decrypt(ctxt,sKey,v); convert(ptxt,v); }
 
+  //! @name Batch encoding and encryption
+  //! Each vector is handled as a whole by one thread of the NTL thread
+  //! pool, and the FFT tables are fetched once for the batch.
+  ///@{
+  using EncryptedArrayBase::encrypt;
+
+  void encode(std::vector<zzX>& ptxts,
+              const std::vector< std::vector<cx_double> >& arrays,
+              long precision=0) const;
+  void decode(std::vector< std::vector<cx_double> >& arrays,
+              const std::vector<zzX>& ptxts) const;
+
+  //! Encrypt arrays[i] into ctxts[i]. The ciphertexts must already exist
+  //! (e.g., std::vector<Ctxt>(n, Ctxt(key))), at least one per array.
+  void encrypt(std::vector<Ctxt>& ctxts, const FHEPubKey& key,
+               const std::vector< std::vector<cx_double> >& arrays) const;
+  void decrypt(const std::vector<Ctxt>& ctxts, const FHESecKey& sKey,
+               std::vector< std::vector<cx_double> >& arrays) const;
+  ///@}
+
+  //! @name Constants from the cache
+  ///@{
+  //! The cache of encoded constants of this array
+  CKKSConstCache& getConstCache() const { return *constCache; }
+
+  //! Multiply c by (resp. add to c) the constant with v in its slots. The
+  //! DoubleCRT encoding of v at the primes of c is taken from the cache.
+  void multByConstant(Ctxt& c, const std::vector<cx_double>& v,
+                      long precision=0) const;
+  void addConstant(Ctxt& c, const std::vector<cx_double>& v,
+                   long precision=0) const;
+  void multByConstant(Ctxt& c, const std::vector<double>& v,
+                      long precision=0) const
+  { std::vector<cx_double> v1; convert(v1, v); multByConstant(c, v1, precision); }
+  void addConstant(Ctxt& c, const std::vector<double>& v,
+                   long precision=0) const
+  { std::vector<cx_double> v1; convert(v1, v); addConstant(c, v1, precision); }
+  ///@}
+
   void extractRealPart(Ctxt& c) const;
 
-  //! Note: If called with dcrt==nullptr, extractImPart will perform FFT's
-  //! when encoding i as a DoubleCRT object. If called with dcrt!=nullptr,
+  //! Note: If called with dcrt==nullptr, extractImPart takes i from the
+  //! cache of constants, see getiDcrt. If called with dcrt!=nullptr,
   //! it assumes that dcrt points to an object that encodes i.
   void extractImPart(Ctxt& c, DoubleCRT* dcrt=nullptr) const;
 
+  //! The encoding of i in all the slots at the primes s, from the cache
+  CKKSConstCache::Entry getiDcrt(const IndexSet& s) const;
+
+  //! @brief The real part, imaginary part and rotations of c, all from one
+  //! decomposition of c (see BasicAutomorphPrecon). re or im may be null
+  //! to skip them, and (*rots)[i] is c rotated by amts[i]. The conjugate
+  //! is key-switched once for both parts, so unlike extractRealPart and
+  //! extractImPart the results need no re-linearization.
+  void extractParts(const Ctxt& c, Ctxt* re, Ctxt* im,
+                    std::vector<std::shared_ptr<Ctxt>>* rots=nullptr,
+                    const std::vector<long>& amts=std::vector<long>()) const;
+
   //! @name Linearized polynomials for EncryptedArrayCx
   ///@{
   //! buildLinPolyCoeffs returns in C two encoded constants such that the
@@ -756,6 +1099,7 @@ public:
 
 
   const FHEcontext& getContext() const { return rep->getContext(); }
+  MaskCache* getMaskCache() const { return rep->getMaskCache(); }
   const PAlgebraMod& getAlMod() const { return alMod; }
   const PAlgebra& getPAlgebra() const { return rep->getPAlgebra(); }
   const long getDegree() const { return rep->getDegree(); }
@@ -883,6 +1227,10 @@ std::ostream& operator<<(std::ostream& s, const PlaintextArray& pa)
 
 void rotate(const EncryptedArray& ea, PlaintextArray& pa, long k);
 void shift(const EncryptedArray& ea, PlaintextArray& pa, long k);
+//! @brief Rotate / shift (with zero fill) k positions along dimension i, as
+//! EncryptedArray::rotate1D and shift1D do to a ciphertext
+void rotate1D(const EncryptedArray& ea, PlaintextArray& pa, long i, long k);
+void shift1D(const EncryptedArray& ea, PlaintextArray& pa, long i, long k);
 
 void encode(const EncryptedArray& ea, PlaintextArray& pa, const std::vector<long>& array);
 void encode(const EncryptedArray& ea, PlaintextArray& pa, const std::vector<NTL::ZZX>& array);
@@ -911,6 +1259,15 @@ void applyPerm(const EncryptedArray& ea, PlaintextArray& pa, const NTL::Vec<long
 
 void power(const EncryptedArray& ea, PlaintextArray& pa, long e);
 
+//! @brief Binary IO of a PlaintextArray: the coefficients of the slots,
+//! packed to the bit width of p^r. The read function raises
+//! std::runtime_error if pa was written with another number of slots or
+//! another degree.
+void writePlaintextArray(std::ostream& str, const EncryptedArray& ea,
+                         const PlaintextArray& pa);
+void readPlaintextArray(std::istream& str, const EncryptedArray& ea,
+                        PlaintextArray& pa);
+
 
 
 
@@ -922,12 +1279,18 @@ void power(const EncryptedArray& ea, PlaintextArray& pa, long e);
 //! @brief A ctxt that encrypts \f$(x_1, ..., x_n)\f$ is replaced by an
 //! encryption of \f$(y_1, ..., y_n)\f$, where \f$y_i = sum_{j\le i} x_j\f$.
 void runningSums(const EncryptedArray& ea, Ctxt& ctxt);
-// The implementation uses O(log n) shift operations.
+// The implementation uses O(log n) shift operations, or for a single native
+// dimension with all the key-switching matrices, n-1 hoisted rotations when
+// the threads make that cheaper.
 
 
 //! @brief A ctxt that encrypts \f$(x_1, ..., x_n)\f$ is replaced by an
 //! encryption of \f$(y, ..., y)\$, where \f$y = sum_{j=1}^n x_j.\f$
 void totalSums(const EncryptedArray& ea, Ctxt& ctxt);
+// The sum is taken one dimension at a time. Each native dimension uses the
+// cheapest of the rotate-and-add ladder (O(log n) rotations), all the
+// rotations hoisted together, or hoisted baby-step/giant-step, among those
+// that the available key-switching matrices allow.
 
 
 //! @brief Map all non-zero slots to 1, leaving zero slots as zero.
@@ -936,7 +1299,20 @@ void mapTo01(const EncryptedArray& ea, Ctxt& ctxt);
 // Implemented in eqtesting.cpp. We compute
 //             x^{p^d-1} = x^{(1+p+...+p^{d-1})*(p-1)}
 // by setting y=x^{p-1} and then outputting y * y^p * ... * y^{p^{d-1}},
-// with exponentiation to powers of p done via Frobenius.
+// with exponentiation to powers of p done via Frobenius, all the d
+// Frobenius images sharing one digit decomposition.
+
+//! @brief mapTo01 on all the ciphertexts. With enough of them to keep all
+//! the threads busy, the work is split by ciphertext.
+void mapTo01(const EncryptedArray& ea, std::vector<Ctxt>& ctxts);
+
+//! @brief (only for p=2) Raise ctxt to the power 2^d-1, with O(log d)
+//! automorphisms and multiplications.
+void fastPower(Ctxt& ctxt, long d);
+
+//! @brief fastPower on all the ciphertexts, split between the threads as
+//! in mapTo01
+void fastPower(std::vector<Ctxt>& ctxts, long d);
 
 
 //! @brief (only for p=2, r=1), test if prefixes of bits in slots are all zero.
@@ -947,6 +1323,15 @@ void incrementalZeroTest(Ctxt* res[], const EncryptedArray& ea,
 			 const Ctxt& ctxt, long n);
 // Complexity: O(d + n log d) smart automorphisms
 //             O(n d) 
+// The d automorphisms share one digit decomposition, and the n tests are
+// split between the threads.
+
+//! @brief incrementalZeroTest on all the ciphertexts: res[k][i] is the
+//! i'th result for ctxts[k] (res is resized here). The encoded coefficients
+//! of the tests are shared by all the ciphertexts at the same level.
+void incrementalZeroTest(std::vector< std::vector<Ctxt> >& res,
+                         const EncryptedArray& ea,
+                         const std::vector<Ctxt>& ctxts, long n);
 
 /*************** End linear transformation functions ****************/
 /********************************************************************/
@@ -983,6 +1368,43 @@ void applyLinPolyMany(const EncryptedArray& ea, Ctxt& ctxt,
 //!        different transformations can be encoded in different slots
 template<class P>  // P can be ZZX or DoubleCRT
 void applyLinPolyLL(Ctxt& ctxt, const std::vector<P>& encodedC, long d);
+
+//! @class LinPolyExecutor
+//! @brief A linear polynomial, ready to be applied to many ciphertexts.
+//!
+//! The coefficients are encoded once as DoubleCRT objects (over all the
+//! primes, so they fit ciphertexts at any level). Each application
+//! computes the d Frobenius images of the ciphertext from a single digit
+//! decomposition (see BasicAutomorphPrecon), and multiplies them by the
+//! coefficients in parallel.
+class LinPolyExecutor {
+  std::vector<DoubleCRT> encodedC; // encodedC[j] multiplies the j'th Frobenius
+
+public:
+  //! The same transformation in all the slots, C is the output of
+  //! ea.buildLinPolyCoeffs
+  LinPolyExecutor(const EncryptedArray& ea, const std::vector<NTL::ZZX>& C);
+
+  //! Different transformations in different slots, as in applyLinPolyMany
+  LinPolyExecutor(const EncryptedArray& ea,
+                  const std::vector< std::vector<NTL::ZZX> >& Cvec);
+
+  //! From coefficients that are already encoded in slots, as in
+  //! applyLinPolyLL
+  LinPolyExecutor(const FHEcontext& context, const std::vector<zzX>& encoded);
+  LinPolyExecutor(const FHEcontext& context,
+                  const std::vector<NTL::ZZX>& encoded);
+
+  long degree() const { return encodedC.size(); }
+  const std::vector<DoubleCRT>& getEncodedCoeffs() const { return encodedC; }
+
+  //! Apply the transformation to ctxt
+  void apply(Ctxt& ctxt) const;
+
+  //! Apply the transformation to all the ciphertexts. With enough of them
+  //! to keep all the threads busy, the work is split by ciphertext.
+  void apply(std::vector<Ctxt>& ctxts) const;
+};
 ///@}
 
 #endif /* ifdef _EncryptedArray_H_ */
@@ -10,6 +10,10 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 #include "EvalMap.h"
+#include <algorithm>
+#include <sstream>
+#include "binio.h"
+#include "memoryUsage.h"
 
 // needed to get NTL's TraceMap functions...needed for ThinEvalMap
 #include <NTL/lzz_pXFactoring.h>
@@ -17,6 +21,18 @@
 
 NTL_CLIENT
 
+// The cache file for the transformation along dimension dim
+static string
+cacheFileName(const string& dir, const char* kind, const Vec<long>& mvec,
+              bool invert, long dim)
+{
+  ostringstream name;
+  name << dir << "/" << kind << (invert? "-inv" : "-fwd");
+  for (long i: range(mvec.length())) name << (i? "x" : "-") << mvec[i];
+  name << "-" << dim << ".bin";
+  return name.str();
+}
+
 // Forward declerations
 static BlockMatMul1D*
 buildStep1Matrix(const EncryptedArray& ea, shared_ptr<CubeSignature> sig,
@@ -26,6 +42,10 @@ static MatMul1D*
 buildStep2Matrix(const EncryptedArray& ea, shared_ptr<CubeSignature> sig,
                  const Vec<long>& reps, long dim, long cofactor,
                  bool invert);
+static MatMulFull*
+buildCollapsedMatrix(const EncryptedArray& ea, shared_ptr<CubeSignature> sig,
+                     const Vec< Vec<long> >& reps, const Vec<long>& mvec,
+                     bool invert);
 static void
 init_representatives(Vec<long>& representatives, long dim, 
                      const Vec<long>& mvec, const PAlgebra& zMStar);
@@ -38,7 +58,9 @@ EvalMap::EvalMap(const EncryptedArray& _ea,
                  const Vec<long>& mvec, 
                  bool _invert,
                  bool build_cache,
-                 bool normal_basis)
+                 bool normal_basis,
+                 const string& cacheDir,
+                 bool collapse)
 
   : ea(_ea), invert(_invert)
 {
@@ -122,25 +144,78 @@ EvalMap::EvalMap(const EncryptedArray& _ea,
   unique_ptr<BlockMatMul1D> mat1_data;
   mat1_data.reset(buildStep1Matrix(ea, sig_sequence[dim],
        	          local_reps[dim], dim, m/mvec[dim], invert, normal_basis));
-  mat1.reset(new BlockMatMul1DExec(*mat1_data, minimal));
-
-  matvec.SetLength(nfactors-1);
-  for (dim=nfactors-2; dim>=0; --dim) {
+  const char* kind = normal_basis? "EvalMap" : "EvalMapNoNB";
+  if (cacheDir.empty())
+    mat1.reset(new BlockMatMul1DExec(*mat1_data, minimal));
+  else
+    mat1.reset(new BlockMatMul1DExec(*mat1_data, minimal,
+                 cacheFileName(cacheDir, kind, mvec, invert, dim), build_cache));
+
+  if (collapse && nfactors > 2) {
+    // One transformation for all the factors but the last, the constants
+    // are not cached in files
+    unique_ptr<MatMulFull> full_data;
+    full_data.reset(buildCollapsedMatrix(ea, sig_sequence[0], local_reps,
+                                         mvec, invert));
+    collapsed.reset(new MatMulFullExec(*full_data, minimal));
+  }
+  else matvec.SetLength(nfactors-1);
+  for (dim=matvec.length()-1; dim>=0; --dim) {
     unique_ptr<MatMul1D> mat_data;
 
     mat_data.reset(buildStep2Matrix(ea, sig_sequence[dim], local_reps[dim],
 				       dim, m/mvec[dim], invert));
-    matvec[dim].reset(new MatMul1DExec(*mat_data, minimal));
+    if (cacheDir.empty())
+      matvec[dim].reset(new MatMul1DExec(*mat_data, minimal));
+    else
+      matvec[dim].reset(new MatMul1DExec(*mat_data, minimal,
+                 cacheFileName(cacheDir, kind, mvec, invert, dim), build_cache));
   }
 
   if (build_cache) upgrade();
 }
 
+EvalMap::EvalMap(const EncryptedArray& _ea, istream& str)
+  : ea(_ea)
+{
+  invert = read_raw_int(str);
+  nfactors = read_raw_int(str);
+  mat1.reset(new BlockMatMul1DExec(ea, str));
+  matvec.SetLength(read_raw_int(str));
+  for (long i = 0; i < matvec.length(); i++)
+    matvec[i].reset(new MatMul1DExec(ea, str));
+  if (read_raw_int(str))
+    collapsed.reset(new MatMulFullExec(ea, str));
+}
+
+void EvalMap::write(ostream& str) const
+{
+  write_raw_int(str, invert);
+  write_raw_int(str, nfactors);
+  mat1->write(str);
+  write_raw_int(str, matvec.length());
+  for (long i = 0; i < matvec.length(); i++)
+    matvec[i]->write(str);
+  write_raw_int(str, collapsed != nullptr);
+  if (collapsed) collapsed->write(str);
+}
+
 void EvalMap::upgrade()
 {
   mat1->upgrade();
   for (long i = 0; i < matvec.length(); i++)
     matvec[i]->upgrade();
+  if (collapsed) collapsed->upgrade();
+}
+
+long EvalMap::memoryUsage() const
+{
+  long n = sizeof(*this) + matvec.MaxLength()*sizeof(matvec[0]);
+  if (mat1) n += mat1->memoryUsage();
+  for (long i = 0; i < matvec.length(); i++)
+    if (matvec[i]) n += matvec[i]->memoryUsage();
+  if (collapsed) n += collapsed->memoryUsage();
+  return n;
 }
 
 // Applying the evaluation (or its inverse) map to a ciphertext
@@ -151,8 +226,10 @@ void EvalMap::apply(Ctxt& ctxt) const
 
     for (long i = matvec.length()-1; i >= 0; i--)
       matvec[i]->mul(ctxt);
+    if (collapsed) collapsed->mul(ctxt);
   }
   else {         // inverse transformation
+    if (collapsed) collapsed->mul(ctxt);
     for (long i = 0; i < matvec.length(); i++)
       matvec[i]->mul(ctxt);
 
@@ -160,6 +237,46 @@ void EvalMap::apply(Ctxt& ctxt) const
   }
 }
 
+// The levels and key-switchings of the transformations along all the
+// factors but the last one, separate or collapsed. A separate 1D
+// transformation along a dimension of size D takes one level (two if the
+// dimension is bad) and about D key-switchings. The collapsed one is a
+// full transformation: it rotates along every dimension of the hypercube
+// but the one it handles last (the largest), one subtree of rotations for
+// each rotation amount, and takes one level for the constants and one for
+// each bad dimension that it rotates in (not counting the largest one).
+void EvalMap::estimateCost(long& levels, long& keySwitches,
+                           const EncryptedArray& ea,
+                           const Vec<long>& mvec, bool collapse)
+{
+  long nfactors = mvec.length();
+  long ndims = ea.dimension();
+  levels = keySwitches = 0;
+  if (!collapse || nfactors <= 2) {
+    for (long dim = 0; dim < nfactors-1 && dim < ndims; dim++) {
+      levels += ea.nativeDimension(dim)? 1 : 2;
+      keySwitches += ea.sizeOfDimension(dim);
+    }
+    return;
+  }
+
+  vector<long> dims(ndims);
+  for (long i: range(ndims)) dims[i] = i;
+  sort(dims.begin(), dims.end(), [&](long i, long j) {
+    return ea.sizeOfDimension(i) < ea.sizeOfDimension(j);
+  });
+  long nodes = 1; // how many subtrees reach this dimension
+  levels = 1;
+  for (long k = 0; k < ndims-1; k++) {
+    long dim = dims[k];
+    keySwitches += nodes*ea.sizeOfDimension(dim);
+    nodes *= ea.sizeOfDimension(dim);
+    if (!ea.nativeDimension(dim)) levels++;
+  }
+  if (ndims > 0) // the leaf transformations, along the largest dimension
+    keySwitches += nodes*ea.sizeOfDimension(dims[ndims-1]);
+}
+
 
 static void
 init_representatives(Vec<long>& representatives, long dim, 
@@ -261,6 +378,68 @@ buildStep2Matrix(const EncryptedArray& ea, shared_ptr<CubeSignature> sig,
   }
 }
 
+// The product of the Step2 transformations along the factors 0..n-2 of
+// mvec, as one matrix over all the slots. Along the last factor (and any
+// dimension beyond it) it is the identity.
+template<class type> class CollapsedStep2Matrix : public MatMulFull_derived<type>
+{
+  PA_INJECT(type)
+
+  const EncryptedArray& base_ea;
+  vector< unique_ptr< Step2Matrix<type> > > factors;
+
+public:
+  CollapsedStep2Matrix(const EncryptedArray& _ea,
+                       shared_ptr<CubeSignature> sig,
+                       const Vec< Vec<long> >& reps, const Vec<long>& mvec,
+                       bool invert)
+    : base_ea(_ea)
+  {
+    long m = computeProd(mvec);
+    for (long dim = 0; dim < mvec.length()-1; dim++)
+      factors.emplace_back(new Step2Matrix<type>(_ea, sig, reps[dim], dim,
+                                                 m/mvec[dim], invert));
+  }
+
+  bool get(RX& out, long i, long j) const override {
+    const PAlgebra& zMStar = base_ea.getPAlgebra();
+    long ngens = zMStar.numOfGens();
+    long n = factors.size();
+    for (long dim = n; dim < ngens; dim++)
+      if (zMStar.coordinate(dim, i) != zMStar.coordinate(dim, j))
+        return true;
+
+    const RX& G = base_ea.getDerived(type()).getG();
+    RX entry;
+    set(out);
+    for (long dim = 0; dim < n; dim++) {
+      long ci = (dim < ngens)? zMStar.coordinate(dim, i) : 0;
+      long cj = (dim < ngens)? zMStar.coordinate(dim, j) : 0;
+      factors[dim]->get(entry, ci, cj, 0);
+      MulMod(out, out, entry, G);
+    }
+    return IsZero(out);
+  }
+
+  const EncryptedArray& getEA() const override { return base_ea; }
+};
+
+static MatMulFull*
+buildCollapsedMatrix(const EncryptedArray& ea, shared_ptr<CubeSignature> sig,
+                     const Vec< Vec<long> >& reps, const Vec<long>& mvec,
+                     bool invert)
+{
+  switch (ea.getTag()) {
+  case PA_GF2_tag:
+    return new CollapsedStep2Matrix<PA_GF2>(ea, sig, reps, mvec, invert);
+
+  case PA_zz_p_tag:
+    return new CollapsedStep2Matrix<PA_zz_p>(ea, sig, reps, mvec, invert);
+
+  default: return 0;
+  }
+}
+
 template<class type> class Step1Matrix : public BlockMatMul1D_derived<type> 
 {
   PA_INJECT(type)
@@ -442,7 +621,8 @@ ThinEvalMap::ThinEvalMap(const EncryptedArray& _ea,
                  bool minimal,
                  const Vec<long>& mvec, 
                  bool _invert,
-                 bool build_cache)
+                 bool build_cache,
+                 const string& cacheDir)
 
   : ea(_ea), invert(_invert)
 {
@@ -524,19 +704,29 @@ ThinEvalMap::ThinEvalMap(const EncryptedArray& _ea,
 
   matvec.SetLength(nfactors);
 
+  // build the transformation for dimension dim, from the cache if any
+  auto build = [&](const MatMul1D& mat, long dim) {
+    if (cacheDir.empty())
+      matvec[dim].reset(new MatMul1DExec(mat, minimal));
+    else
+      matvec[dim].reset(new MatMul1DExec(mat, minimal,
+            cacheFileName(cacheDir, "ThinEvalMap", mvec, invert, dim),
+            build_cache));
+  };
+
   if (invert) {
      long dim = nfactors - 1;
      unique_ptr<MatMul1D> mat1_data;
      mat1_data.reset(buildThinStep1Matrix(ea, sig_sequence[dim],
 		     local_reps[dim], dim, m/mvec[dim]));
-     matvec[dim].reset(new MatMul1DExec(*mat1_data, minimal));
+     build(*mat1_data, dim);
   }
   else {
      long dim = nfactors - 1;
      unique_ptr<MatMul1D> mat1_data;
      mat1_data.reset(buildThinStep2Matrix(ea, sig_sequence[dim],
 		     local_reps[dim], dim, m/mvec[dim], invert, /*inflate=*/true));
-     matvec[dim].reset(new MatMul1DExec(*mat1_data, minimal));
+     build(*mat1_data, dim);
   }
 
   for (long dim=nfactors-2; dim>=0; --dim) {
@@ -544,18 +734,49 @@ ThinEvalMap::ThinEvalMap(const EncryptedArray& _ea,
 
     mat_data.reset(buildThinStep2Matrix(ea, sig_sequence[dim], local_reps[dim],
 				       dim, m/mvec[dim], invert));
-    matvec[dim].reset(new MatMul1DExec(*mat_data, minimal));
+    build(*mat_data, dim);
   }
 
   if (build_cache) upgrade();
 }
 
+ThinEvalMap::ThinEvalMap(const EncryptedArray& _ea, istream& str)
+  : ea(_ea)
+{
+  invert = read_raw_int(str);
+  nfactors = read_raw_int(str);
+  matvec.SetLength(read_raw_int(str));
+  for (long i = 0; i < matvec.length(); i++)
+    matvec[i].reset(new MatMul1DExec(ea, str));
+}
+
+void ThinEvalMap::write(ostream& str) const
+{
+  write_raw_int(str, invert);
+  write_raw_int(str, nfactors);
+  write_raw_int(str, matvec.length());
+  for (long i = 0; i < matvec.length(); i++) {
+    // all the transformations are 1D, see the constructor
+    const MatMul1DExec* mat = dynamic_cast<const MatMul1DExec*>(matvec[i].get());
+    assert(mat != nullptr);
+    mat->write(str);
+  }
+}
+
 void ThinEvalMap::upgrade()
 {
   for (long i = 0; i < matvec.length(); i++)
     matvec[i]->upgrade();
 }
 
+long ThinEvalMap::memoryUsage() const
+{
+  long n = sizeof(*this) + matvec.MaxLength()*sizeof(matvec[0]);
+  for (long i = 0; i < matvec.length(); i++)
+    if (matvec[i]) n += matvec[i]->memoryUsage();
+  return n;
+}
+
 // Applying the evaluation (or its inverse) map to a ciphertext
 void ThinEvalMap::apply(Ctxt& ctxt) const
 {
@@ -48,6 +48,12 @@
 //! to directly use the output of the program in  params.cpp: that
 //! program computes values for mvec (to be used here), and gens
 //! and ords (to be used in initialize the FHEcontext).
+//!
+//! If cacheDir is not empty, the encoded constants of every transformation
+//! are kept in files in that directory (see the persistent caches in
+//! matmul.h), so that later runs with the same parameters load them
+//! instead of computing them again. A cacheDir of the form "shm:DIR"
+//! keeps them in shared memory, where concurrent processes map one copy.
 
 class EvalMap {
 private:
@@ -56,6 +62,7 @@ private:
   long nfactors; // how many factors of m
   std::unique_ptr<BlockMatMul1DExec>       mat1;   // one block matrix
   NTL::Vec<std::unique_ptr<MatMul1DExec>>  matvec; // regular matrices
+  std::unique_ptr<MatMulFullExec> collapsed; // all of matvec in one
 
 public:
   EvalMap(const EncryptedArray& _ea, 
@@ -63,14 +70,36 @@ public:
           const NTL::Vec<long>& mvec, 
           bool _invert,
           bool build_cache,
-          bool normal_basis = true);
+          bool normal_basis = true,
+          const std::string& cacheDir = "",
+          bool collapse = false);
 
   // the normal_basis parameter indicates that we want the
   // normal basis transformation when invert == true.
   // On by default, off for testing
+  //
+  // With collapse set (and more than two factors), the regular matrices
+  // of all the factors but the last are multiplied into one matrix over
+  // all the slots, applied with one full transformation. That saves
+  // levels (one, plus one per bad dimension, instead of one per factor)
+  // for more key-switchings. The collapsed constants are not kept in
+  // cacheDir.
+
+  //! The levels and key-switchings of the regular matrices, separate or
+  //! collapsed, estimated as in the comment of the implementation
+  static void estimateCost(long& levels, long& keySwitches,
+                           const EncryptedArray& ea,
+                           const NTL::Vec<long>& mvec, bool collapse);
+
+  // Read a transformation that was written by write(str) with the same ea
+  EvalMap(const EncryptedArray& _ea, std::istream& str);
+  void write(std::ostream& str) const;
 
   void upgrade();
   void apply(Ctxt& ctxt) const;
+
+  //! The bytes of the encoded constants of all the matrices
+  long memoryUsage() const;
 };
 
 
@@ -94,10 +123,17 @@ public:
           bool minimal, 
           const NTL::Vec<long>& mvec, 
           bool _invert,
-          bool build_cache);
+          bool build_cache,
+          const std::string& cacheDir = "");
+
+  ThinEvalMap(const EncryptedArray& _ea, std::istream& str);
+  void write(std::ostream& str) const;
 
   void upgrade();
   void apply(Ctxt& ctxt) const;
+
+  //! The bytes of the encoded constants of all the matrices
+  long memoryUsage() const;
 };
 
 #endif
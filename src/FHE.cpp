@@ -12,9 +12,23 @@
 #include "FHE.h"
 
 #include <queue> // used in the breadth-first search in setKeySwitchMap
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <memory>
+#include <set>
+#include <tuple>
+#include <algorithm>
+#include <mutex>
+#include <NTL/BasicThreadPool.h>
 #include "timing.h"
 #include "binio.h"
 #include "sample.h"
+#include "memoryUsage.h"
+#include "taskScheduler.h"
 
 NTL_CLIENT
 
@@ -77,7 +91,7 @@ bool KeySwitch::operator==(const KeySwitch& other) const
   if (b.size() != other.b.size()) return false;
   for (size_t i=0; i<b.size(); i++) if (b[i] != other.b[i]) return false;
 
-  return true;
+  return (digits == other.digits);
 }
 
 
@@ -189,13 +203,28 @@ const KeySwitch& KeySwitch::dummy()
   return dummy;
 }
 
+long KeySwitch::memoryUsage() const
+{
+  long n = sizeof(*this) + memBytes(prgSeed)
+    + (b.capacity()-b.size())*sizeof(DoubleCRT)
+    + (digits.capacity()-digits.size())*sizeof(IndexSet);
+  for (const DoubleCRT& bi: b) n += bi.memoryUsage();
+  for (const IndexSet& d: digits) n += d.memoryUsage();
+  return n;
+}
+
 ostream& operator<<(ostream& str, const KeySwitch& matrix)
 {
   str << "["<<matrix.fromKey  <<" "<<matrix.toKeyID
       << " "<<matrix.ptxtSpace<<" "<<matrix.b.size() << endl;
   for (long i=0; i<(long)matrix.b.size(); i++)
     str << matrix.b[i] << endl;
-  str << matrix.prgSeed << " " << matrix.noiseBound << "]";
+  str << matrix.prgSeed << " " << matrix.noiseBound;
+  if (!matrix.digits.empty()) { // only for matrices with their own digits
+    str << " " << matrix.digits.size();
+    for (const IndexSet& d: matrix.digits) str << " " << d;
+  }
+  str << "]";
   return str;
 }
 
@@ -214,6 +243,14 @@ void KeySwitch::readMatrix(istream& str, const FHEcontext& context)
     str >> b[i];
   str >> prgSeed;
   str >> noiseBound;
+  digits.clear();
+  str >> std::ws;
+  if (str.peek() != ']') { // the matrix has its own digits
+    long nd;
+    str >> nd;
+    digits.resize(nd);
+    for (IndexSet& d: digits) str >> d;
+  }
   seekPastChar(str,']');
 }
 
@@ -229,6 +266,7 @@ void KeySwitch::write(ostream& str) const
     4. vector<DoubleCRT> b;
     5. ZZ prgSeed;
     6. xdouble noiseBound;
+    7. vector<IndexSet> digits;
 */
 
   fromKey.write(str);
@@ -239,6 +277,7 @@ void KeySwitch::write(ostream& str) const
   
   write_raw_ZZ(str, prgSeed);
   write_raw_xdouble(str, noiseBound);
+  write_raw_vector(str, digits);
 
   writeEyeCatcher(str, BINIO_EYE_SKM_END);
 }
@@ -254,12 +293,67 @@ void KeySwitch::read(istream& str, const FHEcontext& context)
   read_raw_vector(str, b, blankDCRT);
   read_raw_ZZ(str, prgSeed);
   noiseBound = read_raw_xdouble(str); 
+  IndexSet blankSet;
+  read_raw_vector(str, digits, blankSet);
 
   assert(readEyeCatcher(str, BINIO_EYE_SKM_END)==0);
 }
 
 
 
+void KeySwitch::writeWire(WireMessage& msg) const
+{
+  // The metadata: the fields of write(), with the IndexSet of each b[j]
+  // in place of its residues
+  if (b.empty())
+    throw std::logic_error("KeySwitch::writeWire: a matrix with no columns");
+  const FHEcontext& context = b[0].getContext();
+  ostringstream meta;
+  writeWireRows(meta, context.zMStar.getPhiM());
+  fromKey.write(meta);
+  write_raw_int(meta, toKeyID);
+  write_raw_int(meta, ptxtSpace);
+  write_raw_int(meta, b.size());
+  for (const DoubleCRT& bj: b) bj.getIndexSet().write(meta);
+  write_raw_ZZ(meta, prgSeed);
+  write_raw_xdouble(meta, noiseBound);
+  write_raw_vector(meta, digits);
+
+  msg.setHeader(meta.str());
+  for (const DoubleCRT& bj: b) bj.wireSegments(msg.body);
+  msg.finish();
+}
+
+void KeySwitch::readWire(const string& header, vector<WireBuffer>& body,
+                         const FHEcontext& context)
+{
+  long bodySize;
+  istringstream meta(wireMetadata(header, bodySize));
+  readWireRows(meta, context.zMStar.getPhiM());
+  fromKey.read(meta);
+  toKeyID = read_raw_int(meta);
+  ptxtSpace = read_raw_int(meta);
+  long nDigits = read_raw_int(meta);
+  if (!meta || nDigits < 0 || nDigits > bodySize)
+    throw std::runtime_error("KeySwitch::readWire: corrupt header");
+  b.resize(nDigits, DoubleCRT(context, IndexSet::emptySet()));
+  body.clear();
+  for (DoubleCRT& bj: b) {
+    IndexSet s;
+    s.read(meta);
+    bj.wireBuffers(body, s);
+  }
+  read_raw_ZZ(meta, prgSeed);
+  noiseBound = read_raw_xdouble(meta);
+  IndexSet blankSet;
+  read_raw_vector(meta, digits, blankSet);
+
+  long len = 0;
+  for (const WireBuffer& buf: body) len += buf.len;
+  if (!meta || len != bodySize)
+    throw std::runtime_error("KeySwitch::readWire: corrupt header");
+}
+
 /******************** FHEPubKey implementation **********************/
 /********************************************************************/
 // Computes the keySwitchMap pointers, using breadth-first search (BFS)
@@ -278,7 +372,8 @@ void FHEPubKey::setKeySwitchMap(long keyId)
   for (long i=0; i<(long)keySwitching.size(); i++) {
     const KeySwitch& mat = keySwitching.at(i);
     if (mat.toKeyID == keyId && mat.fromKey.getPowerOfS()==1
-                             && mat.fromKey.getSecretKeyID()== keyId)
+                             && mat.fromKey.getSecretKeyID()== keyId
+                             && isFullKSWmatrix(mat))
       edges.push_back(keySwitchingEdge(mat.fromKey.getPowerOfX(), i));
   }
   if (keyId>=(long)keySwitchMap.size()) // allocate more space if needed
@@ -326,7 +421,8 @@ const KeySwitch& FHEPubKey::getKeySWmatrix(const SKHandle& from,
 
   // Otherwise resort to linear search
   for (size_t i=0; i<keySwitching.size(); i++) {
-    if (keySwitching[i].toKeyID==toIdx && keySwitching[i].fromKey==from)
+    if (keySwitching[i].toKeyID==toIdx && keySwitching[i].fromKey==from
+        && isFullKSWmatrix(keySwitching[i]))
       return keySwitching[i];
   }
   return KeySwitch::dummy(); // return this if nothing is found
@@ -346,11 +442,62 @@ const KeySwitch& FHEPubKey::getAnyKeySWmatrix(const SKHandle& from) const
 
   // Otherwise resort to linear search
   for (size_t i=0; i<keySwitching.size(); i++) {
-    if (keySwitching[i].fromKey==from) return keySwitching[i];
+    if (keySwitching[i].fromKey==from && isFullKSWmatrix(keySwitching[i]))
+      return keySwitching[i];
   }
   return KeySwitch::dummy(); // return this if nothing is found
 }
 
+// The number of digits of a part over primes, as keySwitchNoise counts them
+static long ksDigitsFor(const FHEcontext& context,
+                        const vector<IndexSet>& digits, const IndexSet& primes)
+{
+  double sizeLeft = context.logOfProduct(primes);
+  long n = 0;
+  while (n < lsize(digits) && sizeLeft > 0.0)
+    sizeLeft -= context.logOfProduct(digits[n++]);
+  return n;
+}
+
+const KeySwitch& FHEPubKey::getTrimmedKSWmatrix(const KeySwitch& W,
+                                                const IndexSet& primes,
+                                                bool ownDigits) const
+{
+  if (W.b.empty()) return W;
+
+  // The cost of key-switching is about the number of columns that are
+  // used times the number of primes of the b's
+  auto cost = [&](const KeySwitch& V) {
+    return ksDigitsFor(context, V.getDigits(context), primes)
+      * V.b[0].getIndexSet().card();
+  };
+  const KeySwitch* best = &W;
+  long bestCost = cost(W);
+  for (const KeySwitch& V: keySwitching) {
+    if (V.b.empty() || V.toKeyID != W.toKeyID || V.fromKey != W.fromKey
+        || !(primes <= V.b[0].getIndexSet())
+        || (!ownDigits && !V.digits.empty()))
+      continue;
+    long c = cost(V);
+    if (c < bestCost) {
+      best = &V;
+      bestCost = c;
+    }
+  }
+  return *best;
+}
+
+bool FHEPubKey::haveTrimmedKSWmatrix(const SKHandle& from, long toID,
+                                     const IndexSet& primes,
+                                     const vector<IndexSet>& digits) const
+{
+  for (const KeySwitch& V: keySwitching)
+    if (!V.b.empty() && V.toKeyID == toID && V.fromKey == from
+        && V.b[0].getIndexSet() == primes && V.digits == digits)
+      return true;
+  return false;
+}
+
 
 // Encrypts plaintext, result returned in the ciphertext argument. When
 // called with highNoise=true, returns a ciphertext with noise level
@@ -382,6 +529,8 @@ long FHEPubKey::Encrypt(Ctxt &ctxt, const ZZX& ptxt, long ptxtSpace,
 
   // generate a random encryption of zero from the public encryption key
   ctxt = pubEncrKey; // already an encryption of zero, just not a random one
+  clear(ctxt.prgSeed); // parts[1] will not be a function of a seed
+  ctxt.circuitNode = -1; // a new input of any recorded circuit
                      // ctxt with two parts, each with all the ctxtPrimes
   ctxt.noiseBound = 0;
 
@@ -488,6 +637,8 @@ void FHEPubKey::CKKSencrypt(Ctxt &ctxt, const ZZX& ptxt, double ptxtSize) const
 
   // generate a random encryption of zero from the public encryption key
   ctxt = pubEncrKey; // already an encryption of zero, just not a random one
+  clear(ctxt.prgSeed); // parts[1] will not be a function of a seed
+  ctxt.circuitNode = -1; // a new input of any recorded circuit
 
   // choose a random small scalar r and a small random error vector
   // (e0,e1), then set ctxt = r*pk + (e0,e1) + (ef*ptxt,0), where
@@ -541,6 +692,23 @@ void FHEPubKey::CKKSencrypt(Ctxt &ctxt, const ZZX& ptxt, double ptxtSize) const
   ctxt.ptxtSpace = 1;
 }
 
+MemoryReport FHEPubKey::memoryReport() const
+{
+  MemoryReport r("public key", sizeof(FHEPubKey) - 2*sizeof(Ctxt));
+  r.add("pubEncrKey", pubEncrKey.memoryUsage());
+  MemoryReport ks("keySwitching (" + std::to_string(keySwitching.size())
+                  + " matrices)", (keySwitching.capacity()
+                  - keySwitching.size())*sizeof(KeySwitch));
+  for (const KeySwitch& m: keySwitching) ks.bytes += m.memoryUsage();
+  r.add(ks);
+  r.add("keySwitchMap", memBytes(keySwitchMap));
+  r.add("skBounds", memBytes(skBounds) + memBytes(KS_strategy));
+  r.add("recryptEkey", recryptEkey.memoryUsage());
+  return r;
+}
+
+long FHEPubKey::memoryUsage() const { return memoryReport().bytes; }
+
 bool FHEPubKey::operator==(const FHEPubKey& other) const
 {
   if (this == &other) return true;
@@ -740,10 +908,426 @@ void readPubKeyBinary(istream& str, FHEPubKey& pk)
   assert(readEyeCatcher(str, BINIO_EYE_PK_END)==0);
 }
 
+/******************** Memory-mapped key files ***********************/
+
+/*  The layout of a mapped key file:
+    1. A fixed-size prefix: eye-catcher, version, an endianness marker
+       (written natively), phi(m), the row stride, the size of the
+       metadata, and the offset of the data area
+    2. Metadata in the usual binary format: everything in the public key
+       except the residues of the b's, which are replaced by their index
+       set and their offset in the data area
+    3. Zero padding up to a page boundary
+    4. The data area: the rows of every b, native longs, stride apart
+*/
+
+static const long keyFileVersion = 2;
+static const long keyFilePage = BINIO_PAGE_SIZE;
+static const long keyFileMarker = 0x0102030405060708L;
+static const long keyFilePrefixSize = BINIO_EYE_SIZE + 4 + 5*8;
+
+void writePubKeyMapped(const string& fname, const FHEPubKey& pk)
+{
+  const FHEcontext& context = pk.getContext();
+  long phim = context.zMStar.getPhiM();
+  long stride = RowSlab(phim).getStride();
+
+  // The metadata, with the offset of every b[j] in the data area
+  ostringstream meta;
+  writeContextBaseBinary(meta, context);
+  pk.pubEncrKey.write(meta);
+  write_raw_vector(meta, pk.skBounds);
+
+  long offset = 0;
+  write_raw_int(meta, pk.keySwitching.size());
+  for (const KeySwitch& W: pk.keySwitching) {
+    W.fromKey.write(meta);
+    write_raw_int(meta, W.toKeyID);
+    write_raw_int(meta, W.ptxtSpace);
+    write_raw_ZZ(meta, W.prgSeed);
+    write_raw_xdouble(meta, W.noiseBound);
+    write_raw_vector(meta, W.digits);
+    write_raw_int(meta, W.b.size());
+    for (const DoubleCRT& bj: W.b) {
+      bj.getIndexSet().write(meta);
+      write_raw_int(meta, offset);
+      offset += bj.getIndexSet().card() * stride * sizeof(long);
+    }
+  }
+
+  write_raw_int(meta, pk.keySwitchMap.size());
+  for(auto v: pk.keySwitchMap)
+    write_raw_vector(meta, v);
+  write_ntl_vec_long(meta, pk.KS_strategy);
+  write_raw_int(meta, pk.recryptKeyID);
+  pk.recryptEkey.write(meta);
+  writeEyeCatcher(meta, BINIO_EYE_KEYFILE_END);
+
+  string metaStr = meta.str();
+  long metaSize = metaStr.size();
+  long dataStart = divc(keyFilePrefixSize + metaSize, keyFilePage)*keyFilePage;
+
+  // Write to a temporary file and rename it, so that the workers that map
+  // fname never see a partially written key
+  string path = resolveBinaryPath(fname, /*forWriting=*/true);
+  string tmpName = tempBinaryPath(path);
+  ofstream str(tmpName, ios::binary);
+  if (!str)
+    throw std::runtime_error("writePubKeyMapped: cannot open "+tmpName);
+
+  writeEyeCatcher(str, BINIO_EYE_KEYFILE_BEGIN);
+  write_raw_int(str, keyFileVersion, BINIO_32BIT);
+  str.write(reinterpret_cast<const char*>(&keyFileMarker), sizeof(long));
+  write_raw_int(str, phim);
+  write_raw_int(str, stride);
+  write_raw_int(str, metaSize);
+  write_raw_int(str, dataStart);
+  str.write(metaStr.data(), metaSize);
+
+  string pad(dataStart - keyFilePrefixSize - metaSize, '\0');
+  str.write(pad.data(), pad.size());
+
+  vector<long> zeros(stride-phim, 0);
+  for (const KeySwitch& W: pk.keySwitching)
+    for (const DoubleCRT& bj: W.b)
+      for (long i: bj.getIndexSet()) {
+        str.write(reinterpret_cast<const char*>(bj.getMap()[i]),
+                  phim*sizeof(long));
+        str.write(reinterpret_cast<const char*>(zeros.data()),
+                  zeros.size()*sizeof(long));
+      }
+  str.close(); // flushes the buffer
+  if (!str) {
+    std::remove(tmpName.c_str());
+    throw std::runtime_error("writePubKeyMapped: error writing "+tmpName);
+  }
+  if (std::rename(tmpName.c_str(), path.c_str()) != 0) {
+    std::remove(tmpName.c_str());
+    throw std::runtime_error("writePubKeyMapped: cannot rename "+tmpName);
+  }
+}
+
+void readPubKeyMapped(const string& fname, FHEPubKey& pk)
+{
+  const FHEcontext& context = pk.getContext();
+  long phim = context.zMStar.getPhiM();
+  long stride = RowSlab(phim).getStride();
+
+  long len;
+  shared_ptr<const void> mapping = mapBinaryFile(fname, len);
+  const char *base = static_cast<const char*>(mapping.get());
+
+  if (len < keyFilePrefixSize)
+    throw std::runtime_error("readPubKeyMapped: file too short");
+  istringstream prefix(string(base, keyFilePrefixSize));
+  if (readEyeCatcher(prefix, BINIO_EYE_KEYFILE_BEGIN) != 0
+      || read_raw_int(prefix, BINIO_32BIT) != keyFileVersion)
+    throw std::runtime_error("readPubKeyMapped: not a mapped key file");
+  long marker;
+  prefix.read(reinterpret_cast<char*>(&marker), sizeof(long));
+  if (marker != keyFileMarker)
+    throw std::runtime_error("readPubKeyMapped: wrong endianness");
+  if (read_raw_int(prefix) != phim || read_raw_int(prefix) != stride)
+    throw std::runtime_error("readPubKeyMapped: wrong context");
+  long metaSize = read_raw_int(prefix);
+  long dataStart = read_raw_int(prefix);
+  if (metaSize < 0 || dataStart < keyFilePrefixSize + metaSize
+      || dataStart > len || dataStart % keyFilePage != 0)
+    throw std::runtime_error("readPubKeyMapped: corrupt file");
+
+  istringstream str(string(base + keyFilePrefixSize, metaSize));
+  unsigned long m, p, r;
+  vector<long> gens, ords;
+  readContextBaseBinary(str, m, p, r, gens, ords);
+  assert(comparePAlgebra(pk.getContext().zMStar, m, p, r, gens, ords));
+
+  pk.pubEncrKey.read(str);
+  read_raw_vector(str, pk.skBounds);
+
+  // The key-switching matrices, with the b's pointing into the mapping
+  IndexSet allPrimes(0, context.numPrimes()-1);
+  const long* data = reinterpret_cast<const long*>(base + dataStart);
+  long dataLen = (len - dataStart) / sizeof(long);
+
+  long nMatrices = read_raw_int(str);
+  pk.keySwitching.clear();
+  pk.keySwitching.resize(nMatrices);
+  for (KeySwitch& W: pk.keySwitching) {
+    W.fromKey.read(str);
+    W.toKeyID = read_raw_int(str);
+    W.ptxtSpace = read_raw_int(str);
+    read_raw_ZZ(str, W.prgSeed);
+    W.noiseBound = read_raw_xdouble(str);
+    IndexSet blankSet;
+    read_raw_vector(str, W.digits, blankSet);
+    long nDigits = read_raw_int(str);
+    W.b.assign(nDigits, DoubleCRT(context, IndexSet::emptySet()));
+    for (DoubleCRT& bj: W.b) {
+      IndexSet s;
+      s.read(str);
+      long offset = read_raw_int(str) / sizeof(long);
+      if (!(s <= allPrimes) || offset < 0
+          || offset + s.card()*stride > dataLen)
+        throw std::runtime_error("readPubKeyMapped: corrupt file");
+      bj.attachView(s, data + offset, mapping);
+    }
+  }
+
+  long sz = read_raw_int(str);
+  pk.keySwitchMap.clear();
+  pk.keySwitchMap.resize(sz);
+  for(auto& v: pk.keySwitchMap)
+    read_raw_vector(str, v);
+
+  read_ntl_vec_long(str, pk.KS_strategy);
+
+  pk.recryptKeyID = read_raw_int(str);
+  pk.recryptEkey.read(str);
+
+  if (readEyeCatcher(str, BINIO_EYE_KEYFILE_END) != 0)
+    throw std::runtime_error("readPubKeyMapped: corrupt file");
+}
+
+/******************** Indexed key files ***********************/
+
+/*  The layout of an indexed key file:
+    1. A prefix: eye-catcher, version, whether there are secret keys, the
+       size of the metadata and the number n of key-switching matrices
+    2. A table of n (offset, size) pairs, the offsets from the start of
+       the data area
+    3. Metadata in the usual binary format: everything in the key except
+       the key-switching matrices
+    4. The data area: the matrices, each one written with KeySwitch::write
+*/
+
+static const long keyIndexVersion = 1;
+
+static long keyIndexPrefixSize(long nMatrices)
+{ return BINIO_EYE_SIZE + 4 + 3*8 + 16*nMatrices; }
+
+void writeKeyIndexed(const string& fname, const FHEPubKey& pk,
+                     const vector<DoubleCRT>* sKeys)
+{
+  ostringstream meta;
+  writeContextBaseBinary(meta, pk.getContext());
+  pk.pubEncrKey.write(meta);
+  write_raw_vector(meta, pk.skBounds);
+  write_raw_int(meta, pk.keySwitchMap.size());
+  for(auto v: pk.keySwitchMap)
+    write_raw_vector(meta, v);
+  write_ntl_vec_long(meta, pk.KS_strategy);
+  write_raw_int(meta, pk.recryptKeyID);
+  pk.recryptEkey.write(meta);
+  if (sKeys) write_raw_vector<DoubleCRT>(meta, *sKeys);
+  writeEyeCatcher(meta, BINIO_EYE_KEYINDEX_END);
+  string metaStr = meta.str();
+
+  ofstream str(resolveBinaryPath(fname, /*forWriting=*/true), ios::binary);
+  if (!str)
+    throw std::runtime_error("writeKeyIndexed: cannot open "+fname);
+
+  long n = pk.keySwitching.size();
+  writeEyeCatcher(str, BINIO_EYE_KEYINDEX_BEGIN);
+  write_raw_int(str, keyIndexVersion, BINIO_32BIT);
+  write_raw_int(str, sKeys != NULL);
+  write_raw_int(str, metaStr.size());
+  write_raw_int(str, n);
+  streampos table = str.tellp();
+  for (long i=0; i<2*n; i++) write_raw_int(str, 0); // filled in below
+  str.write(metaStr.data(), metaStr.size());
+
+  // The matrices, then go back to fill in the table
+  streampos dataStart = str.tellp();
+  vector<long> offsets(n+1);
+  offsets[0] = 0;
+  for (long i: range(n)) {
+    pk.keySwitching[i].write(str);
+    offsets[i+1] = long(str.tellp() - dataStart);
+  }
+  str.seekp(table);
+  for (long i: range(n)) {
+    write_raw_int(str, offsets[i]);
+    write_raw_int(str, offsets[i+1]-offsets[i]);
+  }
+  if (!str)
+    throw std::runtime_error("writeKeyIndexed: error writing "+fname);
+}
+
+void readKeyIndexed(const string& fname, FHEPubKey& pk,
+                    vector<DoubleCRT>* sKeys, const KeyLoadProgress& progress)
+{
+  const FHEcontext& context = pk.getContext();
+  string path = resolveBinaryPath(fname);
+  ifstream str(path, ios::binary);
+  if (!str)
+    throw std::runtime_error("readKeyIndexed: cannot open "+fname);
+  str.seekg(0, ios::end);
+  long len = str.tellg();
+  str.seekg(0);
+
+  if (len < keyIndexPrefixSize(0)
+      || readEyeCatcher(str, BINIO_EYE_KEYINDEX_BEGIN) != 0
+      || read_raw_int(str, BINIO_32BIT) != keyIndexVersion)
+    throw std::runtime_error("readKeyIndexed: not an indexed key file");
+  bool haveSecret = read_raw_int(str);
+  long metaSize = read_raw_int(str);
+  long n = read_raw_int(str);
+  if (sKeys && !haveSecret)
+    throw std::runtime_error("readKeyIndexed: no secret key in "+fname);
+  if (metaSize < 0 || n < 0 || n > len/16
+      || keyIndexPrefixSize(n) + metaSize > len)
+    throw std::runtime_error("readKeyIndexed: corrupt file");
+
+  long dataStart = keyIndexPrefixSize(n) + metaSize;
+  vector<long> offsets(n), sizes(n);
+  for (long i: range(n)) {
+    offsets[i] = read_raw_int(str);
+    sizes[i] = read_raw_int(str);
+    if (offsets[i] < 0 || sizes[i] <= 0
+        || offsets[i] + sizes[i] > len - dataStart)
+      throw std::runtime_error("readKeyIndexed: corrupt file");
+  }
+
+  // The metadata, parsed on this thread
+  string metaStr(metaSize, '\0');
+  str.read(&metaStr[0], metaSize);
+  if (!str)
+    throw std::runtime_error("readKeyIndexed: file too short");
+  istringstream meta(metaStr);
+  unsigned long m, p, r;
+  vector<long> gens, ords;
+  readContextBaseBinary(meta, m, p, r, gens, ords);
+  assert(comparePAlgebra(context.zMStar, m, p, r, gens, ords));
+
+  pk.pubEncrKey.read(meta);
+  read_raw_vector(meta, pk.skBounds);
+  long sz = read_raw_int(meta);
+  pk.keySwitchMap.clear();
+  pk.keySwitchMap.resize(sz);
+  for(auto& v: pk.keySwitchMap)
+    read_raw_vector(meta, v);
+  read_ntl_vec_long(meta, pk.KS_strategy);
+  pk.recryptKeyID = read_raw_int(meta);
+  pk.recryptEkey.read(meta);
+  if (haveSecret) {
+    DoubleCRT blankDCRT(context, IndexSet::emptySet());
+    vector<DoubleCRT> dummy;
+    read_raw_vector<DoubleCRT>(meta, sKeys? *sKeys : dummy, blankDCRT);
+  }
+  if (readEyeCatcher(meta, BINIO_EYE_KEYINDEX_END) != 0)
+    throw std::runtime_error("readKeyIndexed: corrupt file");
+
+  // The matrices, over contiguous ranges with about the same number of
+  // bytes, one stream for each range
+  pk.keySwitching.clear();
+  pk.keySwitching.resize(n);
+  if (n == 0) return;
+  long nRanges = min(n, fheAvailableThreads());
+  vector<long> bounds(nRanges+1, n);
+  long total = 0;
+  for (long s: sizes) total += s;
+  for (long t=0, i=0, acc=0; t<nRanges; t++) {
+    while (i < n && acc < t*double(total)/nRanges) acc += sizes[i++];
+    bounds[t] = i;
+  }
+
+  mutex mx;
+  long done = 0;
+  FHE_EXEC_INDEX(nRanges, t)
+    long first = bounds[t], last = bounds[t+1];
+    if (first < last) {
+      ifstream in(path, ios::binary);
+      in.seekg(dataStart + offsets[first]);
+      for (long i=first; i<last; i++) {
+        if (!in || long(in.tellg()) != dataStart + offsets[i])
+          throw std::runtime_error("readKeyIndexed: corrupt file");
+        pk.keySwitching[i].read(in, context);
+        if (!in || long(in.tellg()) != dataStart + offsets[i] + sizes[i])
+          throw std::runtime_error("readKeyIndexed: corrupt file");
+        if (progress) {
+          lock_guard<mutex> lock(mx);
+          progress(++done, n);
+        }
+      }
+    }
+  FHE_EXEC_INDEX_END
+}
+
+void writePubKeyIndexed(const string& fname, const FHEPubKey& pk)
+{ writeKeyIndexed(fname, pk, NULL); }
+
+void readPubKeyIndexed(const string& fname, FHEPubKey& pk,
+                       const KeyLoadProgress& progress)
+{ readKeyIndexed(fname, pk, NULL, progress); }
+
+void writeSecKeyIndexed(const string& fname, const FHESecKey& sk)
+{ writeKeyIndexed(fname, sk, &sk.sKeys); }
+
+void readSecKeyIndexed(const string& fname, FHESecKey& sk,
+                       const KeyLoadProgress& progress)
+{ readKeyIndexed(fname, sk, &sk.sKeys, progress); }
+
+
+long packKeySwitching(FHEPubKey& pk)
+{
+  const FHEcontext& context = pk.getContext();
+  long phim = context.zMStar.getPhiM();
+  long stride = RowSlab(phim).getStride();
+
+  // Group the matrices by automorphism, then by power of s
+  vector<long> order(pk.keySwitching.size());
+  for (long i: range(order.size())) order[i] = i;
+  auto key = [&](long i) {
+    const SKHandle& h = pk.keySwitching[i].fromKey;
+    return make_tuple(pk.keySwitching[i].toKeyID, h.getSecretKeyID(),
+                      h.getPowerOfX(), h.getPowerOfS());
+  };
+  stable_sort(order.begin(), order.end(),
+              [&](long a, long b) { return key(a) < key(b); });
+
+  long total = 0;
+  for (const KeySwitch& W: pk.keySwitching)
+    for (const DoubleCRT& bj: W.b) total += bj.getIndexSet().card() * stride;
+  if (total == 0) return 0;
+
+  long align = FHE_SLAB_ALIGN / sizeof(long);
+  shared_ptr<long> buffer(new long[total + align], default_delete<long[]>());
+  long *data = buffer.get();
+  data += (align - (reinterpret_cast<uintptr_t>(data)/sizeof(long)) % align)
+          % align;
+
+  // Filled serially, so that all the pages are first touched here
+  long offset = 0;
+  for (long i: order)
+    for (DoubleCRT& bj: pk.keySwitching[i].b) {
+      const IndexSet& s = bj.getIndexSet();
+      long *start = data + offset;
+      for (long j: s) {
+        std::copy(bj.getMap()[j], bj.getMap()[j] + phim, data + offset);
+        std::fill(data + offset + phim, data + offset + stride, 0L);
+        offset += stride;
+      }
+      bj.attachView(IndexSet(s), start, buffer);
+    }
+  return total * sizeof(long);
+}
 
 /******************** FHESecKey implementation **********************/
 /********************************************************************/
 
+MemoryReport FHESecKey::memoryReport() const
+{
+  MemoryReport r = FHEPubKey::memoryReport();
+  r.name = "secret key";
+  r.bytes += sizeof(FHESecKey) - sizeof(FHEPubKey);
+  MemoryReport sk("sKeys", (sKeys.capacity()-sKeys.size())*sizeof(DoubleCRT));
+  for (const DoubleCRT& s: sKeys) sk.bytes += s.memoryUsage();
+  r.add(sk);
+  return r;
+}
+
+long FHESecKey::memoryUsage() const { return memoryReport().bytes; }
+
 bool FHESecKey::operator==(const FHESecKey& other) const
 {
   if (this == &other) return true;
@@ -798,38 +1382,89 @@ long FHESecKey::ImportSecKey(const DoubleCRT& sKey, double bound,
 
 // Generate a key-switching matrix and store it in the public key.
 // The argument p denotes the plaintext space
-void FHESecKey::GenKeySWmatrix(long fromSPower, long fromXPower,
-			       long fromIdx, long toIdx, long p)
+// The plaintext space of new key-switching matrices, p<2 means default
+long FHESecKey::keySWptxtSpace(long p) const
 {
-  FHE_TIMER_START;
+  if (isCKKS()) return 1;
 
-  // sanity checks
-  if (fromSPower<=0 || fromXPower<=0) return;  
-  if (fromSPower==1 && fromXPower==1 && fromIdx==toIdx) return;
+  // BGV
+  if (p<2) {
+    if (context.isBootstrappable()) { 
+      // use larger bootstrapping plaintext space
+      p = context.rcData.alMod->getPPowR();
+    }
+    else {
+      p = pubEncrKey.ptxtSpace; // default plaintext space from public key
+    }
+  }
+  // FIXME: We use context.isBootstrappable() rather than
+  //   this->isBootstrappable(). So we get the larger bootstrapping
+  //   plaintext space even if *this is not currently bootstrapppable,
+  //   in case the calling application will make it bootstrappable later.
 
-  // See if this key-switching matrix already exists in our list
-  if (haveKeySWmatrix(fromSPower, fromXPower, fromIdx, toIdx))
-    return; // nothing to do here
+  assert(p>=2);
+  return p;
+}
+
+// Is there such a matrix, either in the key or already streamed out
+// Was this matrix generated already? If primes is not null, the variant
+// over primes (which includes the special primes) and with these digits
+// is looked for.
+bool FHESecKey::generatedKeySWmatrix(const SKHandle& from, long toID,
+                                     const IndexSet* primes,
+                                     const vector<IndexSet>& digits) const
+{
+  IndexSet full = context.ctxtPrimes | context.specialPrimes;
+  const IndexSet& s = (primes == NULL)? full : *primes;
+  if (primes == NULL? haveKeySWmatrix(from, toID)
+                    : haveTrimmedKSWmatrix(from, toID, s, digits))
+    return true;
+  for (long i = 0; i < lsize(streamedKS); i++)
+    if (streamedKS[i].fromKey == from && streamedKS[i].toKeyID == toID
+        && (primes == NULL? (full <= streamedPrimes[i]
+                             && streamedKS[i].digits.empty())
+                          : (streamedPrimes[i] == s
+                             && streamedKS[i].digits == digits)))
+      return true;
+  return false;
+}
 
-  DoubleCRT fromKey = sKeys.at(fromIdx); // copy object, not a reference
-  const DoubleCRT& toKey = sKeys.at(toIdx);   // this can be a reference
+// Fill in the b's of ksMatrix, whose fromKey, toKeyID, ptxtSpace and
+// prgSeed are already set. If noiseSeed is not null, the noise is drawn
+// from a stream seeded with it, otherwise from the current stream. If
+// primes is not null, the matrix is only defined modulo these ciphertext
+// primes (and the special primes), with the columns of its digits that
+// are needed for ciphertexts over them.
+void FHESecKey::buildKeySWmatrix(KeySwitch& ksMatrix, const ZZ* noiseSeed,
+                                 const IndexSet* primes) const
+{
+  FHE_TIMER_START;
+  const SKHandle& from = ksMatrix.fromKey;
+  DoubleCRT fromKey = sKeys.at(from.getSecretKeyID()); // copy object
+  const DoubleCRT& toKey = sKeys.at(ksMatrix.toKeyID); // a reference
 
+  long fromXPower = from.getPowerOfX(), fromSPower = from.getPowerOfS();
   if (fromXPower>1) fromKey.automorph(fromXPower); // compute s(X^t)
   if (fromSPower>1) fromKey.Exp(fromSPower);       // compute s^r(X^t)
   // SHAI: The above lines compute the automorphism and exponentiation mod q,
   //   turns out this is really what we want (even through usually we think
   //   of the secret key as being mod p^r)
 
-  KeySwitch ksMatrix(fromSPower,fromXPower,fromIdx,toIdx);
-  RandomBits(ksMatrix.prgSeed, 256); // a random 256-bit seed
-
-  long n = context.digits.size();
+  const vector<IndexSet>& digits = ksMatrix.getDigits(context);
+  long n = digits.size();
+  IndexSet allPrimes = context.ctxtPrimes | context.specialPrimes;
+  if (primes != NULL) {
+    // as many digits as keySwitchNoise uses for a part over these primes
+    n = ksDigitsFor(context, digits, *primes);
+    allPrimes = *primes | context.specialPrimes;
+    fromKey.removePrimes(fromKey.getIndexSet() / allPrimes);
+  }
 
   // size-n vector
-  ksMatrix.b.resize(n, DoubleCRT(context, context.ctxtPrimes | context.specialPrimes)); 
+  ksMatrix.b.resize(n, DoubleCRT(context, allPrimes)); 
 
   vector<DoubleCRT> a; 
-  a.resize(n, DoubleCRT(context, context.ctxtPrimes | context.specialPrimes));
+  a.resize(n, DoubleCRT(context, allPrimes));
 
   { RandomState state;
     SetSeed(ksMatrix.prgSeed);
@@ -837,57 +1472,208 @@ void FHESecKey::GenKeySWmatrix(long fromSPower, long fromXPower,
       a[i].randomize();
   } // restore state upon destruction of state
 
-  // Record the plaintext space for this key-switching matrix
-  if (isCKKS()) p = 1;
-  else {        // BGV
-    if (p<2) {
-      if (context.isBootstrappable()) { 
-        // use larger bootstrapping plaintext space
-        p = context.rcData.alMod->getPPowR();
-      }
-      else {
-        p = pubEncrKey.ptxtSpace; // default plaintext space from public key
-      }
-    }
-    // FIXME: We use context.isBootstrappable() rather than
-    //   this->isBootstrappable(). So we get the larger bootstrapping
-    //   plaintext space even if *this is not currently bootstrapppable,
-    //   in case the calling application will make it bootstrappable later.
-
-    assert(p>=2);
-  }
-  ksMatrix.ptxtSpace = p;
-
   // generate the RLWE instances with pseudorandom ai's
-
-  for (long i = 0; i < n; i++) {
-    ksMatrix.noiseBound = RLWE1(ksMatrix.b[i], a[i], toKey, p);
+  { std::unique_ptr<RandomState> state;
+    if (noiseSeed != NULL) {
+      state.reset(new RandomState); // restored upon destruction
+      SetSeed(*noiseSeed);
+    }
+    for (long i = 0; i < n; i++) {
+      ksMatrix.noiseBound = RLWE1(ksMatrix.b[i], a[i], toKey,
+                                  ksMatrix.ptxtSpace);
+    }
   }
   // Add in the multiples of the fromKey secret key
   fromKey *= context.productOfPrimes(context.specialPrimes);
   for (long i = 0; i < n; i++) {
     ksMatrix.b[i] += fromKey;
-    fromKey *= context.productOfPrimes(context.digits[i]);
+    fromKey *= context.productOfPrimes(digits[i]);
   }
+}
 
-  // Push the new matrix onto our list
-  keySwitching.push_back(ksMatrix);
+long FHEPubKey::readKeySWmatrices(istream& str)
+{
+  long count = 0;
+  while (str.peek() != EOF) {
+    KeySwitch W;
+    W.read(str, context);
+    bool dup = isFullKSWmatrix(W)?
+      haveKeySWmatrix(W.fromKey, W.toKeyID) :
+      haveTrimmedKSWmatrix(W.fromKey, W.toKeyID, W.b[0].getIndexSet(),
+                           W.digits);
+    if (!dup) keySwitching.push_back(W);
+    count++;
+  }
+  return count;
 }
 
-// Decryption
-void FHESecKey::Decrypt(ZZX& plaintxt, const Ctxt &ciphertxt) const
+vector<long> FHEPubKey::selectKeySWmatrices(const std::set<long>& automVals,
+                                            long keyID, bool relin) const
 {
-  ZZX f;
-  Decrypt(plaintxt, ciphertxt, f);
+  long m = context.zMStar.getM();
+  vector< pair<SKHandle,long> > chosen; // (from, to) of the full matrices
+  for (long k: automVals) {
+    if (!isReachable(k, keyID)) continue;
+    while (k != 1) { // the route that smartAutomorph takes
+      const KeySwitch& W = getNextKSWmatrix(k, keyID);
+      chosen.push_back(make_pair(W.fromKey, W.toKeyID));
+      long amt = W.fromKey.getPowerOfX();
+      k = MulMod(k, InvMod(amt,m), m);
+    }
+  }
+
+  vector<long> which;
+  for (long i: range(keySwitching.size())) {
+    const KeySwitch& W = keySwitching[i];
+    bool take = relin && W.toKeyID == keyID
+      && W.fromKey.getSecretKeyID() == keyID
+      && W.fromKey.getPowerOfX() == 1 && W.fromKey.getPowerOfS() > 1;
+    for (auto& c: chosen)
+      take = take || (W.fromKey == c.first && W.toKeyID == c.second);
+    if (take) which.push_back(i);
+  }
+  return which;
 }
 
-void FHESecKey::Decrypt(ZZX& plaintxt, const Ctxt &ciphertxt,
-			ZZX& f) const // plaintext before modular reduction
+vector<long> FHEPubKey::keySWmatricesTo(long keyID) const
+{
+  vector<long> which;
+  for (long i: range(keySwitching.size()))
+    if (keySwitching[i].toKeyID == keyID) which.push_back(i);
+  return which;
+}
+
+void FHEPubKey::writeKeySWmatrices(ostream& str,
+                                   const vector<long>& which) const
+{
+  for (long i: which) keySwitching.at(i).write(str);
+  if (!str)
+    throw std::runtime_error("writeKeySWmatrices: error writing the matrices");
+}
+
+FHEPubKey::FHEPubKey(const FHEPubKey& other, const vector<long>& which):
+  context(other.context), pubEncrKey(*this), skBounds(other.skBounds),
+  KS_strategy(other.KS_strategy), recryptKeyID(other.recryptKeyID),
+  recryptEkey(*this)
+{
+  pubEncrKey.privateAssign(other.pubEncrKey);
+  recryptEkey.privateAssign(other.recryptEkey);
+  for (long i: which) keySwitching.push_back(other.keySwitching.at(i));
+
+  // route the automorphisms through these matrices only
+  for (long i: range(other.keySwitchMap.size()))
+    setKeySwitchMap(i);
+}
+
+void writePubKeySubset(ostream& str, const FHEPubKey& pk,
+                       const vector<long>& which)
+{
+  writePubKeyBinary(str, FHEPubKey(pk, which));
+}
+
+// Push the new matrix onto our list, or write it out
+void FHESecKey::storeKeySWmatrix(KeySwitch& ksMatrix)
+{
+  if (ksStream == nullptr) {
+    keySwitching.push_back(ksMatrix);
+    return;
+  }
+  ksMatrix.write(*ksStream);
+  if (!*ksStream)
+    throw std::runtime_error("FHESecKey: error writing a key-switching matrix");
+  streamedPrimes.push_back(ksMatrix.b.empty()? IndexSet()
+                                             : ksMatrix.b[0].getIndexSet());
+  ksMatrix.b.clear(); // keep only the header
+  streamedKS.push_back(ksMatrix);
+}
+
+void FHESecKey::GenKeySWmatrix(long fromSPower, long fromXPower,
+			       long fromIdx, long toIdx, long p)
 {
   FHE_TIMER_START;
-  assert(getContext()==ciphertxt.getContext());
+
+  // sanity checks
+  if (fromSPower<=0 || fromXPower<=0) return;  
+  if (fromSPower==1 && fromXPower==1 && fromIdx==toIdx) return;
+
+  // See if this key-switching matrix already exists in our list
+  if (generatedKeySWmatrix(SKHandle(fromSPower, fromXPower, fromIdx), toIdx))
+    return; // nothing to do here
+
+  // Record the plaintext space for this key-switching matrix
+  KeySwitch ksMatrix(fromSPower,fromXPower,fromIdx,toIdx,keySWptxtSpace(p));
+  RandomBits(ksMatrix.prgSeed, 256); // a random 256-bit seed
+  buildKeySWmatrix(ksMatrix);
+  storeKeySWmatrix(ksMatrix);
+}
+
+void FHESecKey::genKeySWmatrices(const vector<long>& fromXPowers,
+                                 long fromIdx, long toIdx, long p,
+                                 const IndexSet* primes, long nDgts)
+{
+  FHE_TIMER_START;
+  p = keySWptxtSpace(p);
+
+  // The ciphertext primes of trimmed variants, the primes of their b's,
+  // and their own digits if any
+  IndexSet trimmed, withSpecial;
+  vector<IndexSet> digits;
+  if (primes != NULL) {
+    trimmed = *primes / context.specialPrimes;
+    if (trimmed.card() == 0) return;
+    if (nDgts > 0) {
+      digits = splitIntoDigits(trimmed, nDgts);
+      double maxDigitLog = 0.0;
+      for (const IndexSet& d: digits)
+        maxDigitLog = std::max(maxDigitLog, context.logOfProduct(d));
+      if (maxDigitLog > ksDigitBudget(context, lsize(digits), p))
+        throw std::logic_error("GenTrimmedKeySWmatrices: "+std::to_string(nDgts)
+                               +" digits are too large for the special primes");
+    }
+    if (context.ctxtPrimes <= trimmed && digits.empty())
+      primes = NULL; // not trimmed at all
+    else withSpecial = trimmed | context.specialPrimes;
+  }
+
+  // The new matrices, without repetitions, each with the seeds for its
+  // ai's and its noise
+  vector<KeySwitch> todo;
+  vector<ZZ> noiseSeeds;
+  std::set<long> seen;
+  for (long t: fromXPowers) {
+    if (t<=0 || (t==1 && fromIdx==toIdx)) continue;
+    if (!seen.insert(t).second) continue;
+    SKHandle from(1, t, fromIdx);
+    if (generatedKeySWmatrix(from, toIdx, primes? &withSpecial : NULL,
+                             digits))
+      continue;
+
+    todo.push_back(KeySwitch(from, fromIdx, toIdx, p));
+    todo.back().digits = digits;
+    RandomBits(todo.back().prgSeed, 256);
+    noiseSeeds.push_back(RandomBits_ZZ(256));
+  }
+
+  // Generate one matrix per thread at a time, so that when streaming
+  // there are at most that many in memory
+  long nTodo = lsize(todo);
+  long chunk = std::max(fheAvailableThreads(), 1L);
+  for (long start = 0; start < nTodo; start += chunk) {
+    long cnt = std::min(chunk, nTodo-start);
+    FHE_EXEC_INDEX(cnt, index)
+      buildKeySWmatrix(todo[start+index], &noiseSeeds[start+index],
+                       primes? &trimmed : NULL);
+    FHE_EXEC_INDEX_END
+    for (long i = start; i < start+cnt; i++)
+      storeKeySWmatrix(todo[i]);
+  }
+}
+
+// Add to ptxt (a zero over the primes of ciphertxt) the inner product of
+// the parts of ciphertxt with the secret key
+void FHESecKey::decryptToDCRT(DoubleCRT& ptxt, const Ctxt &ciphertxt) const
+{
   const IndexSet& ptxtPrimes = ciphertxt.primeSet;
-  DoubleCRT ptxt(context, ptxtPrimes); // Set to zero
 
   // for each ciphertext part, fetch the right key, multiply and add
   for (size_t i=0; i<ciphertxt.parts.size(); i++) {
@@ -924,6 +1710,42 @@ void FHESecKey::Decrypt(ZZX& plaintxt, const Ctxt &ciphertxt,
     key *= part;
     ptxt += key;
   }
+}
+
+// Decryption
+void FHESecKey::Decrypt(ZZX& plaintxt, const Ctxt &ciphertxt) const
+{
+  if (isCKKS()) { // CKKS needs the whole integers
+    ZZX f;
+    Decrypt(plaintxt, ciphertxt, f);
+    return;
+  }
+  FHE_TIMER_START;
+  assert(getContext()==ciphertxt.getContext());
+  DoubleCRT ptxt(context, ciphertxt.primeSet); // Set to zero
+  decryptToDCRT(ptxt, ciphertxt);
+
+  // Only the result mod p is needed, so the CRT is done mod p directly.
+  // Then multiply by (Q*intFactor)^{-1} mod p, as below.
+  long p = ciphertxt.ptxtSpace;
+  zzX coeffs;
+  ptxt.toPolyMod(coeffs, p);
+  long factor = rem(context.productOfPrimes(ciphertxt.primeSet), p);
+  factor = MulMod(factor, mcMod(ciphertxt.intFactor, p), p);
+  factor = InvMod(factor, p);
+  plaintxt.SetLength(coeffs.length());
+  for (long h: range(coeffs.length()))
+    conv(plaintxt[h], MulMod(coeffs[h], factor, p));
+  plaintxt.normalize();
+}
+
+void FHESecKey::Decrypt(ZZX& plaintxt, const Ctxt &ciphertxt,
+			ZZX& f) const // plaintext before modular reduction
+{
+  FHE_TIMER_START;
+  assert(getContext()==ciphertxt.getContext());
+  DoubleCRT ptxt(context, ciphertxt.primeSet); // Set to zero
+  decryptToDCRT(ptxt, ciphertxt);
   // convert to coefficient representation & reduce modulo the plaintext space
   ptxt.toPoly(plaintxt);
   f = plaintxt; // f used only for debugging
@@ -948,6 +1770,58 @@ void FHESecKey::Decrypt(ZZX& plaintxt, const Ctxt &ciphertxt,
   PolyRed(plaintxt, ciphertxt.ptxtSpace, true/*reduce to [0,p-1]*/);
 }
 
+bool FHESecKey::DecryptSinglePrime(zzX& plaintxt,
+                                   const Ctxt &ciphertxt) const
+{
+  FHE_TIMER_START;
+  assert(getContext()==ciphertxt.getContext());
+  if (isCKKS() || empty(ciphertxt.primeSet)) return false;
+
+  long j = ciphertxt.primeSet.first(); // the largest prime
+  for (long i: ciphertxt.primeSet)
+    if (context.ithPrime(i) > context.ithPrime(j)) j = i;
+  long q = context.ithPrime(j);
+  if (ciphertxt.noiseBound*4 >= to_xdouble(q)) return false;
+
+  // The inner product with the secret key, modulo q only
+  IndexSet single(j);
+  DoubleCRT ptxt(context, single);
+  for (const CtxtPart& part: ciphertxt.parts) {
+    if (part.skHandle.isOne()) {
+      ptxt.Add(part, /*matchIndexSets=*/false);
+      continue;
+    }
+    DoubleCRT key(context, single);
+    key.Add(sKeys.at(part.skHandle.getSecretKeyID()), false);
+    long xPower = part.skHandle.getPowerOfX();
+    long sPower = part.skHandle.getPowerOfS();
+    if (xPower>1) key.automorph(xPower); // s(X^t)
+    if (sPower>1) key.Exp(sPower);       // s^r(X^t)
+    key.Mul(part, /*matchIndexSets=*/false);
+    ptxt += key;
+  }
+
+  long phim = context.zMStar.getPhiM();
+  plaintxt.SetLength(phim);
+  context.ithModulus(j).iFFT(plaintxt.elts(), ptxt.getMap()[j]);
+
+  // f = the centered residues, then f * Q^{-1} * intFactor^{-1} mod p
+  long p = ciphertxt.ptxtSpace;
+  long factor = 1;
+  for (long i: ciphertxt.primeSet)
+    factor = MulMod(factor, context.ithPrime(i) % p, p);
+  factor = MulMod(InvMod(factor, p), InvMod(mcMod(ciphertxt.intFactor, p), p), p);
+
+  for (long h = 0; h < phim; h++) {
+    long c = plaintxt[h];
+    if (c > q/2) c -= q;
+    c %= p;
+    if (c < 0) c += p;
+    plaintxt[h] = MulMod(c, factor, p);
+  }
+  return true;
+}
+
 // Encryption using the secret key, this is useful, e.g., to put an
 // encryption of the secret key into the public key.
 long FHESecKey::skEncrypt(Ctxt &ctxt, const ZZX& ptxt,
@@ -977,14 +1851,23 @@ long FHESecKey::skEncrypt(Ctxt &ctxt, const ZZX& ptxt,
 
   // Set Ctxt bookeeping parameters
   ctxt.intFactor = 1; // FIXME: is this necessary?
+  ctxt.circuitNode = -1;
 
   // make parts[0],parts[1] point to (1,s)
   ctxt.parts[0].skHandle.setOne();
   ctxt.parts[1].skHandle.setBase(skIdx);
 
   const DoubleCRT& sKey = sKeys.at(skIdx);   // get key
+
+  // Choose parts[1] from a fresh seed, so that Ctxt::writeCompact can
+  // replace it by the seed. The NTL PRG is restored before sampling the
+  // noise below, so the seed reveals nothing about it.
+  RandomBits(ctxt.prgSeed, 256); // a random 256-bit seed
+  { RandomState state;
+    ctxt.parts[1].randomize(&ctxt.prgSeed);
+  }
   // Sample a new RLWE instance
-  ctxt.noiseBound = RLWE(ctxt.parts[0], ctxt.parts[1], sKey, ptxtSpace);
+  ctxt.noiseBound = RLWE1(ctxt.parts[0], ctxt.parts[1], sKey, ptxtSpace);
 
   if (isCKKS()) {
     long f = getContext().alMod.getCx().encodeScalingFactor();
@@ -1008,6 +1891,32 @@ long FHESecKey::skEncrypt(Ctxt &ctxt, const ZZX& ptxt,
 }
 
 
+void FHEPubKey::batchEncrypt(vector<Ctxt>& ctxts, const vector<zzX>& ptxts,
+                             long ptxtSpace, ostream* compactOut) const
+{
+  FHE_TIMER_START;
+  long n = lsize(ptxts);
+  if (lsize(ctxts) < n) ctxts.resize(n, Ctxt(*this));
+
+  vector<ZZ> seeds(n);
+  for (ZZ& seed: seeds) RandomBits(seed, 256);
+
+  FHE_EXEC_RANGE(n, first, last)
+  for (long i = first; i < last; i++) {
+    assert(&ctxts[i].getPubKey() == this);
+    RandomState state; // restored upon destruction
+    SetSeed(seeds[i]);
+    Encrypt(ctxts[i], ptxts[i], ptxtSpace); // virtual, symmetric for FHESecKey
+  }
+  FHE_EXEC_RANGE_END
+
+  if (compactOut != NULL) {
+    for (long i = 0; i < n; i++) ctxts[i].writeCompact(*compactOut);
+    if (!*compactOut)
+      throw std::runtime_error("batchEncrypt: error writing the ciphertexts");
+  }
+}
+
 // Generate bootstrapping data if needed, returns index of key
 long FHESecKey::genRecryptData()
 {
@@ -17,9 +17,17 @@
    @brief Public/secret keys for the BGV cryptosystem
 */
 #include <climits>
+#include <map>
+#include <functional>
 #include "DoubleCRT.h"
 #include "FHEContext.h"
 #include "Ctxt.h"
+#include "encodedPtxt.h"
+#include "CtPtrs.h"
+
+//! Called with the number of key-switching matrices loaded so far and
+//! their total, see readPubKeyIndexed
+typedef std::function<void(long done, long total)> KeyLoadProgress;
 
 /**
  * @class KeySwitch
@@ -76,6 +84,12 @@
  * moduli chain. However, if p is much smaller than B then is is enough to
  * use W mod Qi with Qi a smaller modulus, Q>p*sigma*q0. Also note that if
  * p<Br then we will be using only first r columns of the matrix W.
+ *
+ * A matrix may have its own decomposition of the ciphertext primes into
+ * digits (see FHESecKey::GenTrimmedKeySWmatrices), then B0,B1,... are the
+ * products of its own digits. Fewer digits mean fewer columns and faster
+ * key-switching, but each digit must still be small enough for the
+ * special primes.
  ********************************************************************/
 class KeySwitch { 
 public:
@@ -87,6 +101,8 @@ public:
   NTL::ZZ prgSeed;         // a seed to generate the random ai's in the bottom row
   NTL::xdouble noiseBound;  // high probability bound on noise magnitude
                             // in each column
+  std::vector<IndexSet> digits; // the digits of the columns, if empty
+                                // then they are context.digits
 
   explicit
   KeySwitch(long sPow=0, long xPow=0, long fromID=0, long toID=0, long p=0):
@@ -100,6 +116,13 @@ public:
 
   unsigned long NumCols() const { return b.size(); }
 
+  //! The bytes of this matrix, its own size included
+  long memoryUsage() const;
+
+  //! The decomposition into digits that this matrix uses
+  const std::vector<IndexSet>& getDigits(const FHEcontext& context) const
+  { return digits.empty()? context.digits : digits; }
+
   //! @brief returns a dummy static matrix with toKeyId == -1
   static const KeySwitch& dummy();
   bool isDummy() const { return (toKeyID==-1); }
@@ -114,11 +137,38 @@ public:
   void read(std::istream& str, const FHEcontext& context);
   void write(std::ostream& str) const;
 
+  //! @brief Scatter-gather IO, as Ctxt::writeWire and Ctxt::readWire. The
+  //! body of the message is the rows of the b's.
+  void writeWire(WireMessage& msg) const;
+  void readWire(const std::string& header, std::vector<WireBuffer>& body,
+                const FHEcontext& context);
+
 };
 std::ostream& operator<<(std::ostream& str, const KeySwitch& matrix);
 // We DO NOT have std::istream& operator>>(std::istream& str, KeySwitch& matrix);
 // instead must use the readMatrix method above, where you can specify context
 
+/**
+ * @name Cache of the expanded a_i's of key-switching matrices
+ * @brief Every key-switching operation with a matrix W regenerates its
+ * bottom row a_0, a_1, ... from W.prgSeed. With a nonzero memory budget,
+ * the expanded rows of the most recently used matrices are kept in an LRU
+ * cache (keyed by the context and the seed), trading memory for PRG time.
+ * The entries of a context are dropped when it is destroyed. The default
+ * budget is zero, i.e., always regenerate. The cache is thread-safe.
+ **/
+///@{
+//! @brief Set the budget in bytes, evicting entries if needed
+void setKeySwitchCacheBudget(long bytes);
+long getKeySwitchCacheBudget();
+//! @brief The number of bytes currently used by the cache
+long getKeySwitchCacheSize();
+//! @brief Empty the cache
+void clearKeySwitchCache();
+//! @brief Drop the entries of one context (called by ~FHEcontext)
+void clearKeySwitchCache(const FHEcontext& context);
+///@}
+
 
 #define FHE_KSS_UNKNOWN (0)
 // unknown KS strategy
@@ -138,6 +188,8 @@ std::ostream& operator<<(std::ostream& str, const KeySwitch& matrix);
  * @class FHEPubKey
  * @brief The public key
  ********************************************************************/
+struct RecryptRecord; // in telemetry.h
+
 class FHEPubKey { // The public key
   const FHEcontext& context; // The context
 
@@ -166,6 +218,14 @@ private:
   long recryptKeyID; // index of the bootstrapping key
   Ctxt recryptEkey;  // the key itself, encrypted under key #0
 
+  // Stages of recryption that are shared by reCrypt and thinReCrypt
+  static bool recryptTrivial(Ctxt& ctxt);
+  void bootKeySwitch(Ctxt& ctxt, bool thin, RecryptRecord* prof=NULL) const;
+
+  // A copy of other with only the matrices with the given indexes, and the
+  // keySwitchMap computed for them (see writePubKeySubset)
+  FHEPubKey(const FHEPubKey& other, const std::vector<long>& which);
+
 public:
   FHEPubKey(): // this constructor thorws run-time error if activeContext=NULL
     context(*activeContext), pubEncrKey(*this),
@@ -223,6 +283,32 @@ public:
   bool haveAnyKeySWmatrix(const SKHandle& from) const
   { return getAnyKeySWmatrix(from).toKeyID >= 0; }
 
+  //! @brief The variant of W (same keys) whose b's include all of primes
+  //! and that is the cheapest to use for a part over primes (the fewest
+  //! columns times primes), W itself if there is no cheaper one. Variants
+  //! that are trimmed to the lower levels or have their own digits (see
+  //! FHESecKey::GenTrimmedKeySWmatrices) are only ever found this way, the
+  //! other lookups return the matrices over the whole chain. With
+  //! ownDigits=false only variants with the digits of the context are
+  //! considered (for parts that are already broken into these digits).
+  const KeySwitch& getTrimmedKSWmatrix(const KeySwitch& W,
+                                       const IndexSet& primes,
+                                       bool ownDigits=true) const;
+
+  //! @brief Is there a variant of this matrix over exactly these primes
+  //! (including the special primes), with these digits (empty: those of
+  //! the context)?
+  bool haveTrimmedKSWmatrix(const SKHandle& from, long toID,
+                            const IndexSet& primes,
+                            const std::vector<IndexSet>& digits
+                              = std::vector<IndexSet>()) const;
+
+  //! Is W defined over all of the ciphertext and special primes, with the
+  //! digits of the context?
+  bool isFullKSWmatrix(const KeySwitch& W) const
+  { return W.digits.empty() && (W.b.empty() ||
+      (context.ctxtPrimes | context.specialPrimes) <= W.b[0].getIndexSet()); }
+
   //!@brief Get the next matrix to use for multi-hop automorphism
   //! See Section 3.2.2 in the design document
   const KeySwitch& getNextKSWmatrix(long fromXPower, long fromID=0) const
@@ -240,6 +326,29 @@ public:
   //! See Section 3.2.2 in the design document (KeySwitchMap)
   void setKeySwitchMap(long keyId=0);  // Computes the keySwitchMap pointers
 
+  //! @brief Add the matrices that a secret key streamed out (see
+  //! FHESecKey::streamKeySWmatrices), reading str to its end. Returns the
+  //! number of matrices read. Call setKeySwitchMap afterwards.
+  long readKeySWmatrices(std::istream& str);
+
+  //! @brief The indexes in keySWlist() of the matrices that the
+  //! automorphisms X -> X^k for k in automVals use with keyID, following
+  //! the routes of setKeySwitchMap (so the automorphisms recorded from a
+  //! computation can be given as they are), and with relin also those that
+  //! re-linearize keyID. The trimmed variants of these matrices are
+  //! included, the automorphisms that this key cannot do are ignored.
+  std::vector<long> selectKeySWmatrices(const std::set<long>& automVals,
+                                        long keyID=0, bool relin=true) const;
+
+  //! The indexes of all the matrices that switch to keyID
+  std::vector<long> keySWmatricesTo(long keyID) const;
+
+  //! @brief Write the matrices with the given indexes in the format that
+  //! readKeySWmatrices reads. A worker can read several of these, one after
+  //! the other, into the same key.
+  void writeKeySWmatrices(std::ostream& str,
+                          const std::vector<long>& which) const;
+
   //! @brief get KS strategy for dimension dim  
   //! dim == -1 is Frobenius
   long getKSStrategy(long dim) const {
@@ -293,20 +402,68 @@ public:
   virtual long Encrypt(Ctxt &ciphertxt, const zzX& plaintxt, long ptxtSpace=0) const
   { return Encrypt(ciphertxt, plaintxt, ptxtSpace, /*highNoise=*/false); }
 
+  /**
+   * @brief Encrypt many plaintexts on all the threads, ctxts[i] encrypts
+   * ptxts[i] (ctxts is extended with ciphertexts under this key if it is
+   * too short). The seeds of all the ciphertexts are drawn in one pass
+   * before any of them is sampled, so the results do not depend on the
+   * number of threads. A secret key encrypts symmetrically (see
+   * FHESecKey::Encrypt). If compactOut is not null, the ciphertexts are
+   * also written to it in order with Ctxt::writeCompact, which replaces
+   * the random part of symmetric ciphertexts by their seed.
+   **/
+  void batchEncrypt(std::vector<Ctxt>& ctxts, const std::vector<zzX>& ptxts,
+                    long ptxtSpace=0, std::ostream* compactOut=NULL) const;
+
   bool isCKKS() const
   { return (getContext().alMod.getTag()==PA_cx_tag); }
   // NOTE: Is taking the alMod from the context the right thing to do?
 
   bool isBootstrappable() const { return (recryptKeyID>=0); }
+
+  //! @brief The bytes of the key, by its members (see memoryUsage.h)
+  MemoryReport memoryReport() const;
+  long memoryUsage() const;
   void reCrypt(Ctxt &ctxt); // bootstrap a ciphertext to reduce noise
   void thinReCrypt(Ctxt &ctxt);  // bootstrap a "thin" ciphertext, where
                                  // slots are assumed to contain constants
 
+  //! Bootstrap all the ciphertexts in cts (unset entries are skipped).
+  //! The batch goes through the recryption one stage at a time, and when
+  //! it has at least as many ciphertexts as there are threads they are
+  //! spread over the threads. This gives more throughput than recrypting
+  //! them one by one, where many of the inner loops are too short to use
+  //! all the threads.
+  void reCrypt(const CtPtrs& cts);
+  void thinReCrypt(const CtPtrs& cts);
+
+  //! Bootstrap "thin" ciphertexts that only use their first usedSlots
+  //! slots (in the linear order of the EncryptedArray). Up to
+  //! nslots/usedSlots of them are masked, rotated into disjoint ranges of
+  //! one ciphertext and recrypted together, then rotated back. Only the
+  //! first usedSlots slots of the results are meaningful, the others hold
+  //! whatever the packing left there. The masks and rotations take some
+  //! capacity before the recryption, and the rotations back take a little
+  //! of what it restored. Falls back to thinReCrypt(cts) when there is
+  //! nothing to pack.
+  void thinReCryptPacked(const CtPtrs& cts, long usedSlots);
+
   friend class FHESecKey;
   friend std::ostream& operator << (std::ostream& str, const FHEPubKey& pk);
   friend std::istream& operator >> (std::istream& str, FHEPubKey& pk);
   friend void writePubKeyBinary(std::ostream& str, const FHEPubKey& pk);
   friend void readPubKeyBinary(std::istream& str, FHEPubKey& pk);
+  friend void writePubKeyMapped(const std::string& fname, const FHEPubKey& pk);
+  friend void readPubKeyMapped(const std::string& fname, FHEPubKey& pk);
+  friend void writePubKeySubset(std::ostream& str, const FHEPubKey& pk,
+                                const std::vector<long>& which);
+  friend void writeKeyIndexed(const std::string& fname, const FHEPubKey& pk,
+                              const std::vector<DoubleCRT>* sKeys);
+  friend void readKeyIndexed(const std::string& fname, FHEPubKey& pk,
+                             std::vector<DoubleCRT>* sKeys,
+                             const KeyLoadProgress& progress);
+
+  friend long packKeySwitching(FHEPubKey& pk);
 
   // defines plaintext space for the bootstrapping encrypted secret key
   static long ePlusR(long p);
@@ -323,6 +480,24 @@ public:
 ******************************************************************/
 class FHESecKey: public FHEPubKey { // The secret key
   FHESecKey(){} // disable default constructor
+
+  std::ostream* ksStream = nullptr;  // see streamKeySWmatrices
+  std::vector<KeySwitch> streamedKS; // the matrices written to it (no b's)
+  std::vector<IndexSet> streamedPrimes; // and the primes of their b's
+
+  long keySWptxtSpace(long p) const;
+  bool generatedKeySWmatrix(const SKHandle& from, long toID,
+                            const IndexSet* primes=NULL,
+                            const std::vector<IndexSet>& digits
+                              = std::vector<IndexSet>()) const;
+  void buildKeySWmatrix(KeySwitch& ksMatrix, const NTL::ZZ* noiseSeed=NULL,
+                        const IndexSet* primes=NULL) const;
+  void storeKeySWmatrix(KeySwitch& ksMatrix);
+  void decryptToDCRT(DoubleCRT& ptxt, const Ctxt &ciphertxt) const;
+  void genKeySWmatrices(const std::vector<long>& fromXPowers,
+                        long fromIdx, long toIdx, long p,
+                        const IndexSet* primes, long nDgts=0);
+
 public:
   std::vector<DoubleCRT> sKeys; // The secret key(s) themselves
 
@@ -338,6 +513,10 @@ public:
   void clear() // clear all secret-key data
   { FHEPubKey::clear(); sKeys.clear(); }
 
+  //! @brief As for FHEPubKey, with the secret keys
+  MemoryReport memoryReport() const;
+  long memoryUsage() const;
+
   //! We allow the calling application to choose a secret-key polynomial by
   //! itself, then insert it into the FHESecKey object, getting the index of
   //! that secret key in the sKeys list. If this is the first secret-key for
@@ -373,6 +552,43 @@ public:
   void GenKeySWmatrix(long fromSPower, long fromXPower, long fromKeyIdx=0,
 		      long toKeyIdx=0, long ptxtSpace=0);
 
+  //! @brief Generate the matrices s(X^t) -> s(X) for all the t's in
+  //! fromXPowers (those that do not exist yet), as GenKeySWmatrix(1,t,...)
+  //! would, in parallel over the NTL thread pool. The seeds of every matrix,
+  //! for its ai's and for its noise, are drawn from the current stream
+  //! before any of them is built, so the matrices do not depend on the
+  //! number of threads.
+  void GenKeySWmatrices(const std::vector<long>& fromXPowers,
+                        long fromKeyIdx=0, long toKeyIdx=0, long ptxtSpace=0)
+  { genKeySWmatrices(fromXPowers, fromKeyIdx, toKeyIdx, ptxtSpace, NULL); }
+
+  //! @brief Same as GenKeySWmatrices, but for variants of the matrices
+  //! that are only defined over the given primes (and the special primes),
+  //! with only the columns that ciphertexts over these primes use. A
+  //! ciphertext whose primes are all in the set (e.g., one at the lower
+  //! levels, with primes the bottom of ctxtPrimes) is key-switched with
+  //! the variant, in time and memory that scale with its own level. The
+  //! variants are in addition to the matrices over the whole chain, which
+  //! must also be generated.
+  //!
+  //! With nDgts>0 the variants split these primes into nDgts digits of
+  //! their own (see splitIntoDigits), instead of using those of the
+  //! context. Raises std::logic_error if the digits are then too large for
+  //! the special primes (see the budgetDgts argument of addSpecialPrimes).
+  void GenTrimmedKeySWmatrices(const std::vector<long>& fromXPowers,
+                               const IndexSet& primes, long fromKeyIdx=0,
+                               long toKeyIdx=0, long ptxtSpace=0,
+                               long nDgts=0)
+  { genKeySWmatrices(fromXPowers, fromKeyIdx, toKeyIdx, ptxtSpace, &primes,
+                     nDgts); }
+
+  //! @brief While str is not null, new key-switching matrices are written
+  //! to it (with KeySwitch::write) as soon as they are generated, instead
+  //! of being kept in this key. GenKeySWmatrices then holds at most one
+  //! matrix per thread in memory. A public key that is read later gets
+  //! them with readKeySWmatrices.
+  void streamKeySWmatrices(std::ostream* str) { ksStream = str; }
+
   // Decryption
   void Decrypt(NTL::ZZX& plaintxt, const Ctxt &ciphertxt) const;
 
@@ -380,6 +596,15 @@ public:
   //! before reduction modulo the ptxtSpace
   void Decrypt(NTL::ZZX& plaintxt, const Ctxt &ciphertxt, NTL::ZZX& f) const;
 
+  //! @brief Decrypt a BGV ciphertext modulo only the largest prime of its
+  //! chain, which recovers the plaintext when the noise is below half of
+  //! that prime (with some margin). The coefficients are returned in
+  //! [0,ptxtSpace), and everything is done with single-precision
+  //! arithmetic, no big-integer CRT. Returns false without decrypting if
+  //! the noise is too large or the ciphertext is CKKS, use Decrypt then.
+  bool DecryptSinglePrime(zzX& plaintxt,
+                          const Ctxt &ciphertxt) const;
+
   //! @brief Symmetric encryption using the secret key.
   long skEncrypt(Ctxt &ctxt, const NTL::ZZX& ptxt, long ptxtSpace, long skIdx) const;
   long skEncrypt(Ctxt &ctxt, const zzX& ptxt, long ptxtSpace, long skIdx) const {
@@ -462,6 +687,40 @@ void addMatrices4Network(FHESecKey& sKey, const PermNetwork& net, long keyID=0);
 void addTheseMatrices(FHESecKey& sKey,
 		      const std::set<long>& automVals, long keyID=0);
 
+/**
+ * @name Key-switching matrices planned from a recorded trace
+ * @brief Record the automorphisms that a computation uses (run it with
+ * setAutomorphVals, e.g. in dry-run mode), then choose at most maxMatrices
+ * matrices with which every one of them can be done. Missing automorphisms
+ * are composed from the chosen ones, as FHEPubKey::setKeySwitchMap routes
+ * them, and the choice keeps the number of key-switchings small, weighted
+ * by how often each automorphism is used. The plan may be larger than
+ * maxMatrices if fewer matrices cannot reach all of the trace.
+ **/
+///@{
+std::set<long> planKeySWmatrices(const FHEcontext& context,
+                                 const std::map<long,double>& weights,
+                                 long maxMatrices);
+std::set<long> planKeySWmatrices(const FHEcontext& context,
+                                 const std::set<long>& trace,
+                                 long maxMatrices);
+
+//! The weighted number of key-switchings with the matrices of plan, or -1
+//! if some automorphism cannot be reached
+double keySWplanCost(const FHEcontext& context, const std::set<long>& plan,
+                     const std::map<long,double>& weights);
+
+//! Plan the matrices for the trace and add them to sKey
+void addPlannedMatrices(FHESecKey& sKey, const std::set<long>& trace,
+                        long maxMatrices, long keyID=0);
+///@}
+
+//! Add variants, trimmed to the given primes (and with nDgts digits of
+//! their own if nDgts>0), of all the automorphism matrices that sKey
+//! already has (see FHESecKey::GenTrimmedKeySWmatrices)
+void addTrimmedMatrices(FHESecKey& sKey, const IndexSet& primes, long keyID=0,
+                        long nDgts=0);
+
 //! Choose random c0,c1 such that c0+s*c1 = p*e for a short e
 //! Returns a high-probabiliy bound on the L-infty norm
 //! of the canonical embedding
@@ -471,4 +730,71 @@ double RLWE(DoubleCRT& c0, DoubleCRT& c1, const DoubleCRT &s, long p,
 //! Same as RLWE, but assumes that c1 is already chosen by the caller
 double RLWE1(DoubleCRT& c0, const DoubleCRT& c1, const DoubleCRT &s, long p);
 
+/**
+ * @brief Memory-mapped key files.
+ *
+ * writePubKeyMapped writes a public key in a format where the residues of
+ * the key-switching matrices are laid out exactly as in memory (native
+ * endianness, aligned rows). readPubKeyMapped maps such a file (with mmap
+ * where available) and makes the KeySwitch::b's read-only views into the
+ * mapping, so nothing is copied and pages are loaded on first use. The
+ * mapping lives for as long as any of these DoubleCRT's (or copies) exist.
+ * The files are not portable across machines with different endianness.
+ *
+ * For key servers and worker pools on one machine, fname can be a
+ * shared-memory name "shm:NAME" (see resolveBinaryPath in binio.h). One
+ * process writes the key there and every worker that reads it maps the
+ * same physical pages, so the key-switching matrices are held in memory
+ * only once no matter how many workers use them.
+ **/
+void writePubKeyMapped(const std::string& fname, const FHEPubKey& pk);
+void readPubKeyMapped(const std::string& fname, FHEPubKey& pk);
+
+/**
+ * @brief Copy the residues of all the key-switching matrices of pk into a
+ * single aligned buffer, and make the KeySwitch::b's read-only views into
+ * it (as readPubKeyMapped does).
+ *
+ * The matrices are laid out grouped by the automorphism that they serve
+ * (then by power of s), and within a matrix one column after the other, so
+ * the key switches of a linear transform (the EvalMap of a recryption, a
+ * matmul exec) stream through a few long runs of memory instead of one heap
+ * block per column. The buffer is allocated and filled by the calling
+ * thread, so with the usual first-touch policy its pages come from the
+ * memory of the NUMA node that this thread runs on: call it from a thread
+ * on the node that will do the key switching. Returns the size of the
+ * buffer in bytes.
+ **/
+long packKeySwitching(FHEPubKey& pk);
+
+//! @brief Write pk as writePubKeyBinary does, but with only the matrices
+//! with the given indexes (see FHEPubKey::selectKeySWmatrices), and with
+//! the keySwitchMap computed for them. Read it with readPubKeyBinary.
+void writePubKeySubset(std::ostream& str, const FHEPubKey& pk,
+                       const std::vector<long>& which);
+
+/**
+ * @brief Indexed key files.
+ *
+ * An indexed key file starts with a table of the offset and size of every
+ * key-switching matrix, followed by the rest of the key and then by the
+ * matrices themselves (each one as in KeySwitch::write). The read functions
+ * parse the rest of the key and then read the matrices in parallel on the
+ * NTL thread pool, each thread with its own stream over a contiguous range
+ * of the file. If progress is set, it is called (from one thread at a
+ * time) after each matrix is loaded. Unlike mapped key files these are
+ * portable, and the key does not depend on the file once it is read.
+ *
+ * A public key can be read from a secret-key file, the secret keys are
+ * then skipped. Errors in the file raise std::runtime_error.
+ **/
+///@{
+void writePubKeyIndexed(const std::string& fname, const FHEPubKey& pk);
+void readPubKeyIndexed(const std::string& fname, FHEPubKey& pk,
+                       const KeyLoadProgress& progress=nullptr);
+void writeSecKeyIndexed(const std::string& fname, const FHESecKey& sk);
+void readSecKeyIndexed(const std::string& fname, FHESecKey& sk,
+                       const KeyLoadProgress& progress=nullptr);
+///@}
+
 #endif // ifndef _FHE_H_
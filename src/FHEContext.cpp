@@ -10,11 +10,17 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 #include <cstring>
+#include <cstdio>
 #include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <atomic>
 #include "FHEContext.h"
 #include "EvalMap.h"
 #include "powerful.h"
 #include "binio.h"
+#include "memoryUsage.h"
 #include "sample.h"
 
 NTL_CLIENT
@@ -163,6 +169,159 @@ void FHEcontext::productOfPrimes(ZZ& p, const IndexSet& s) const
     p *= ithPrime(i);
 }
 
+shared_ptr<const Vec<long>> FHEcontext::getIndexVector(const IndexSet& s) const
+{
+  std::lock_guard<std::mutex> lock(indexMutex);
+  auto it = indexVectors.find(s);
+  if (it != indexVectors.end()) return it->second;
+
+  shared_ptr< Vec<long> > v = make_shared< Vec<long> >();
+  v->SetLength(s.card());
+  long j = 0;
+  for (long i: s) (*v)[j++] = i;
+  if (long(indexVectors.size()) >= FHE_CRT_CACHE_SIZE) indexVectors.clear();
+  indexVectors[s] = v;
+  return v;
+}
+
+shared_ptr<const CrtTables> FHEcontext::getCrtTables(const IndexSet& s) const
+{
+  {
+    std::lock_guard<std::mutex> lock(crtMutex);
+    auto it = crtTables.find(s);
+    if (it != crtTables.end()) return it->second;
+  }
+
+  // build them without holding the lock, primes are never modified
+  shared_ptr<const Vec<long>> key = getIndexVector(s);
+  shared_ptr<CrtTables> t = make_shared<CrtTables>();
+  long icard = key->length();
+  t->qvec.SetLength(icard);
+  t->qrecipvec.SetLength(icard);
+  t->tvec.SetLength(icard);
+  t->tqinvvec.SetLength(icard);
+  productOfPrimes(t->prod, s);
+  t->sz = t->prod.size();
+  t->prod1vec.SetSize(icard, t->sz+1);
+  for (long j: range(icard)) {
+    long q = ithPrime((*key)[j]);
+    t->qvec[j] = q;
+    t->qrecipvec[j] = 1/double(q);
+    div(t->prod1vec[j], t->prod, q);
+    long inv = InvMod(rem(t->prod1vec[j], q), q);
+    t->tvec[j] = inv;
+    t->tqinvvec[j] = PrepMulModPrecon(inv, q);
+  }
+  add(t->prodHalf, t->prod, 1);
+  div(t->prodHalf, t->prodHalf, 2);
+
+  std::lock_guard<std::mutex> lock(crtMutex);
+  if (long(crtTables.size()) >= FHE_CRT_CACHE_SIZE) crtTables.clear();
+  auto res = crtTables.insert(make_pair(s, shared_ptr<const CrtTables>(t)));
+  return res.first->second; // another thread may have been first
+}
+
+shared_ptr<const BaseConvTables>
+FHEcontext::getBaseConvTables(const IndexSet& from, const IndexSet& to,
+                              long extra) const
+{
+  assert(disjoint(from, to));
+  vector<long> key;   // from, -1, to, -1, extra
+  for (long i: from) key.push_back(i);
+  key.push_back(-1);
+  for (long i: to) key.push_back(i);
+  key.push_back(-1);
+  key.push_back(extra);
+  {
+    std::lock_guard<std::mutex> lock(crtMutex);
+    auto it = convTables.find(key);
+    if (it != convTables.end()) return it->second;
+  }
+
+  shared_ptr<BaseConvTables> b = make_shared<BaseConvTables>();
+  b->crt = getCrtTables(from);
+  const CrtTables& T = *b->crt;
+  long icard = T.qvec.length();
+  long tcard = card(to) + (extra > 1);
+  b->tvec.SetLength(tcard);
+  long n = 0;
+  for (long i: to) b->tvec[n++] = ithPrime(i);
+  if (extra > 1) b->tvec[n] = extra;
+
+  b->tinvvec.SetLength(tcard);
+  b->prod1mod.SetLength(tcard);
+  b->prod1precon.SetLength(tcard);
+  b->prodmod.SetLength(tcard);
+  b->prodinv.SetLength(tcard);
+  for (long k: range(tcard)) {
+    long t = b->tvec[k];
+    assert(t > 1 && t < NTL_SP_BOUND);
+    b->tinvvec[k] = PrepMulMod(t);
+    b->prod1mod[k].SetLength(icard);
+    b->prod1precon[k].SetLength(icard);
+    for (long j: range(icard)) {
+      long c = rem(T.prod1vec[j], t);
+      b->prod1mod[k][j] = c;
+      b->prod1precon[k][j] = PrepMulModPrecon(c, t);
+    }
+    b->prodmod[k] = rem(T.prod, t);
+    b->prodinv[k] = InvMod(b->prodmod[k], t);
+  }
+
+  std::lock_guard<std::mutex> lock(crtMutex);
+  if (long(convTables.size()) >= FHE_CRT_CACHE_SIZE) convTables.clear();
+  auto res = convTables.insert(make_pair(key,
+                                   shared_ptr<const BaseConvTables>(b)));
+  return res.first->second;
+}
+
+shared_ptr<const vector<long>> FHEcontext::getAutomorphPerm(long k) const
+{
+  long m = zMStar.getM();
+  k %= m;
+  if (k < 0) k += m;
+  {
+    std::lock_guard<std::mutex> lock(autoMutex);
+    for (auto it = autoPerms.begin(); it != autoPerms.end(); ++it)
+      if (it->first == k) {
+        autoPerms.splice(autoPerms.begin(), autoPerms, it); // now most recent
+        return it->second;
+      }
+  }
+
+  // new[j] = old[j'], j' being the index of rep(j)*k mod m in Zm*
+  long phim = zMStar.getPhiM();
+  shared_ptr<vector<long>> perm = make_shared<vector<long>>(phim);
+  mulmod_precon_t precon = PrepMulModPrecon(k, m);
+  for (long j: range(phim))
+    (*perm)[j] = zMStar.indexInZmstar_unchecked(
+                   MulModPrecon(zMStar.repInZmstar_unchecked(j), k, m, precon));
+
+  std::lock_guard<std::mutex> lock(autoMutex);
+  for (auto& entry: autoPerms) // another thread may have been first
+    if (entry.first == k) return entry.second;
+  autoPerms.push_front(make_pair(k, shared_ptr<const vector<long>>(perm)));
+  if (long(autoPerms.size()) > FHE_AUTOMORPH_CACHE_SIZE) autoPerms.pop_back();
+  return autoPerms.front().second;
+}
+
+long BaseConvTables::memoryUsage() const
+{
+  // the CRT tables are counted with the other CRT tables
+  return sizeof(BaseConvTables) + memBytes(tvec) + memBytes(tinvvec)
+    + memBytes(prod1mod) + memBytes(prod1precon) + memBytes(prodmod)
+    + memBytes(prodinv);
+}
+
+long CrtTables::memoryUsage() const
+{
+  return sizeof(CrtTables) + memBytes(prod) + memBytes(prodHalf)
+    + memBytes(qvec) + memBytes(qrecipvec) + memBytes(tvec)
+    + tqinvvec.MaxLength()*long(sizeof(mulmod_precon_t))
+    + prod1vec.length()*(prod1vec.BaseSize()+2)*long(sizeof(long))
+    + prod1vec.length()*long(sizeof(ZZ));
+}
+
 bool FHEcontext::operator==(const FHEcontext& other) const
 {
   if (zMStar != other.zMStar) return false;
@@ -191,6 +350,48 @@ bool FHEcontext::operator==(const FHEcontext& other) const
   return true;
 }
 
+MemoryReport FHEcontext::memoryReport() const
+{
+  MemoryReport r("context", sizeof(*this) - sizeof(PAlgebra)
+                 - sizeof(PAlgebraMod) - sizeof(ThinRecryptData));
+  MemoryReport mods("moduli", moduli.capacity()*sizeof(Cmodulus)
+                    - moduli.size()*sizeof(Cmodulus));
+  for (const Cmodulus& mod: moduli) mods.bytes += mod.memoryUsage();
+  r.add(mods);
+  r.add("zMStar", zMStar.memoryUsage());
+  r.add("alMod", alMod.memoryUsage());
+  long sets = smallPrimes.memoryUsage() + ctxtPrimes.memoryUsage()
+    + specialPrimes.memoryUsage() - 3*sizeof(IndexSet);
+  for (const IndexSet& d: digits) sets += d.memoryUsage();
+  r.add("prime sets", sets + (digits.capacity()-digits.size())*sizeof(IndexSet));
+  r.add(rcData.memoryReport());
+  long crt = 0;
+  {
+    std::lock_guard<std::mutex> lock(crtMutex);
+    for (auto& entry: crtTables)
+      crt += entry.second->memoryUsage() + entry.first.memoryUsage();
+    for (auto& entry: convTables)
+      crt += entry.second->memoryUsage() + memBytes(entry.first);
+  }
+  {
+    std::lock_guard<std::mutex> lock(indexMutex);
+    for (auto& entry: indexVectors)
+      crt += entry.first.memoryUsage() + memBytes(*entry.second);
+  }
+  r.add("CRT tables", crt);
+  long perms = 0;
+  {
+    std::lock_guard<std::mutex> lock(autoMutex);
+    for (auto& entry: autoPerms)
+      perms += sizeof(entry) + sizeof(vector<long>)
+        + entry.second->capacity()*long(sizeof(long));
+  }
+  r.add("automorphism tables", perms);
+  return r;
+}
+
+long FHEcontext::memoryUsage() const { return memoryReport().bytes; }
+
 
 void writeContextBaseBinary(ostream& str, const FHEcontext& context)
 {
@@ -246,7 +447,8 @@ std::unique_ptr<FHEcontext> buildContextFromBinary(istream& str)
   return std::unique_ptr<FHEcontext>(new FHEcontext(m,p,r,gens,ords));
 }
 
-void writeContextBinary(ostream& str, const FHEcontext& context)
+void writeContextBinary(ostream& str, const FHEcontext& context,
+                        bool withRecryptData)
 {
   
   writeEyeCatcher(str, BINIO_EYE_CONTEXT_BEGIN);
@@ -290,6 +492,11 @@ void writeContextBinary(ostream& str, const FHEcontext& context)
 
   write_raw_int(str, context.rcData.skHwt);
 
+  // the recryption data itself, if requested
+  bool full = withRecryptData && context.isBootstrappable();
+  write_raw_int(str, full);
+  if (full) context.rcData.write(str);
+
   writeEyeCatcher(str, BINIO_EYE_CONTEXT_END);
 }
 
@@ -326,11 +533,11 @@ void readContextBinary(istream& str, FHEcontext& context)
 
   long nPrimes = read_raw_int(str);
 
-  for (long p,i=0; i<nPrimes; i++) {
-    p = read_raw_int(str);
-
-    context.moduli.push_back(Cmodulus(context.zMStar,p,0));
+  vector<long> qs(nPrimes);
+  for (long i=0; i<nPrimes; i++) qs[i] = read_raw_int(str);
+  context.addModuli(qs); // the tables of the primes are built in parallel
 
+  for (long i=0; i<nPrimes; i++) {
     if (smallPrimes.contains(i))
       context.smallPrimes.insert(i);   // small prime
     else if (specialPrimes.contains(i))
@@ -357,7 +564,11 @@ void readContextBinary(istream& str, FHEcontext& context)
 
   long t = read_raw_int(str);
 
-  if (mv.length()>0) {
+  bool full = read_raw_int(str);
+  if (full) {
+    context.rcData.read(str, context);
+  }
+  else if (mv.length()>0) {
     context.makeBootstrappable(mv, t);
   }
 
@@ -367,6 +578,82 @@ void readContextBinary(istream& str, FHEcontext& context)
 
 }
 
+// The snapshot file starts with a fixed-size prefix: eye-catcher, version,
+// endianness marker, payload size and payload hash. The payload is the
+// context base, the factorization of Phi_m(X) and the rest of the context.
+static const long snapshotVersion = 2;
+static const long snapshotMarker = 0x0102030405060708L;
+static const long snapshotPrefixSize = BINIO_EYE_SIZE + 4 + 3*8;
+
+void writeContextSnapshot(const string& fname, const FHEcontext& context,
+                          bool withRecryptData)
+{
+  ostringstream payload;
+  writeContextBaseBinary(payload, context);
+  writeEyeCatcher(payload, BINIO_EYE_ALMOD_BEGIN);
+  context.alMod.writeFactors(payload);
+  writeEyeCatcher(payload, BINIO_EYE_ALMOD_END);
+  writeContextBinary(payload, context, withRecryptData);
+  string data = payload.str();
+
+  // Write to a temporary file and rename it, so that the workers that map
+  // fname never see a partially written snapshot
+  string path = resolveBinaryPath(fname, /*forWriting=*/true);
+  string tmpName = tempBinaryPath(path);
+  ofstream str(tmpName, ios::binary);
+  if (!str)
+    throw std::runtime_error("writeContextSnapshot: cannot open "+tmpName);
+  writeEyeCatcher(str, BINIO_EYE_SNAPSHOT_BEGIN);
+  write_raw_int(str, snapshotVersion, BINIO_32BIT);
+  str.write(reinterpret_cast<const char*>(&snapshotMarker), sizeof(long));
+  write_raw_int(str, data.size());
+  write_raw_int(str, hashBytes(data.data(), data.size()));
+  str.write(data.data(), data.size());
+  str.close(); // flushes the buffer
+  if (!str) {
+    std::remove(tmpName.c_str());
+    throw std::runtime_error("writeContextSnapshot: error writing "+tmpName);
+  }
+  if (std::rename(tmpName.c_str(), path.c_str()) != 0) {
+    std::remove(tmpName.c_str());
+    throw std::runtime_error("writeContextSnapshot: cannot rename "+tmpName);
+  }
+}
+
+std::unique_ptr<FHEcontext> buildContextFromSnapshot(const string& fname)
+{
+  long len;
+  shared_ptr<const void> mapping = mapBinaryFile(fname, len);
+  const char *base = static_cast<const char*>(mapping.get());
+
+  if (len < snapshotPrefixSize)
+    throw std::runtime_error("buildContextFromSnapshot: file too short");
+  istringstream prefix(string(base, snapshotPrefixSize));
+  if (readEyeCatcher(prefix, BINIO_EYE_SNAPSHOT_BEGIN) != 0
+      || read_raw_int(prefix, BINIO_32BIT) != snapshotVersion)
+    throw std::runtime_error("buildContextFromSnapshot: not a snapshot");
+  long marker;
+  prefix.read(reinterpret_cast<char*>(&marker), sizeof(long));
+  if (marker != snapshotMarker)
+    throw std::runtime_error("buildContextFromSnapshot: wrong endianness");
+  long size = read_raw_int(prefix);
+  unsigned long hash = read_raw_int(prefix);
+  if (size != len - snapshotPrefixSize
+      || hash != hashBytes(base + snapshotPrefixSize, size))
+    throw std::runtime_error("buildContextFromSnapshot: corrupt file");
+
+  istringstream str(string(base + snapshotPrefixSize, size));
+  unsigned long m, p, r;
+  vector<long> gens, ords;
+  readContextBaseBinary(str, m, p, r, gens, ords);
+  assert(readEyeCatcher(str, BINIO_EYE_ALMOD_BEGIN)==0);
+  std::unique_ptr<FHEcontext>
+    context(new FHEcontext(m, p, r, gens, ords, str));
+  assert(readEyeCatcher(str, BINIO_EYE_ALMOD_END)==0);
+  readContextBinary(str, *context);
+  return context;
+}
+
 void writeContextBase(ostream& str, const FHEcontext& context)
 {
   str << "[" << context.zMStar.getM()
@@ -468,12 +755,11 @@ istream& operator>> (istream &str, FHEcontext& context)
 
   long nPrimes;
   str >> nPrimes;
-  for (long i=0; i<nPrimes; i++) {
-    long p;
-    str >> p; 
-
-    context.moduli.push_back(Cmodulus(context.zMStar,p,0));
+  vector<long> qs(nPrimes);
+  for (long i=0; i<nPrimes; i++) str >> qs[i];
+  context.addModuli(qs); // the tables of the primes are built in parallel
 
+  for (long i=0; i<nPrimes; i++) {
     if (smallPrimes.contains(i))
       context.smallPrimes.insert(i);   // small prime
     else if (specialPrimes.contains(i))
@@ -505,11 +791,15 @@ istream& operator>> (istream &str, FHEcontext& context)
 }
 
 #include "EncryptedArray.h"
+#include "FHE.h"
 FHEcontext::~FHEcontext()
 {
+  clearKeySwitchCache(*this); // the cached rows are defined over *this
   delete ea;
 }
 
+static std::atomic<unsigned long> nextContextId(1);
+
 // Constructors must ensure that alMod points to zMStar, and
 // rcEA (if set) points to rcAlmod which points to zMStar
 FHEcontext::FHEcontext(unsigned long m, unsigned long p, unsigned long r,
@@ -519,4 +809,17 @@ FHEcontext::FHEcontext(unsigned long m, unsigned long p, unsigned long r,
 {
   stdev=3.2;  
   scale=10;
+  lazyModuli=false;
+  id = nextContextId++;
+}
+
+FHEcontext::FHEcontext(unsigned long m, unsigned long p, unsigned long r,
+   const vector<long>& gens, const vector<long>& ords, istream& factorsStr):
+  zMStar(m, p, gens, ords), alMod(zMStar, r, &factorsStr),
+  ea(new EncryptedArray(*this, alMod))
+{
+  stdev=3.2;  
+  scale=10;
+  lazyModuli=false;
+  id = nextContextId++;
 }
@@ -22,6 +22,59 @@
 #include "primeChain.h"
 
 #include <NTL/Lazy.h>
+#include <NTL/ZZVec.h>
+#include <map>
+#include <list>
+#include <mutex>
+#include <memory>
+
+//! The most prime sets whose CRT tables FHEcontext::getCrtTables keeps
+#ifndef FHE_CRT_CACHE_SIZE
+#define FHE_CRT_CACHE_SIZE (64)
+#endif
+
+//! The most automorphisms whose tables FHEcontext::getAutomorphPerm keeps
+#ifndef FHE_AUTOMORPH_CACHE_SIZE
+#define FHE_AUTOMORPH_CACHE_SIZE (32)
+#endif
+
+/**
+ * @brief The tables of the integer CRT over a set of primes, as used by
+ * DoubleCRT::toPoly. They depend only on the primes, so the context keeps
+ * them (see FHEcontext::getCrtTables) rather than each call rebuilding them.
+ **/
+struct CrtTables {
+  NTL::ZZ prod;                             // the product of the primes
+  NTL::ZZ prodHalf;                         // (prod+1)/2
+  long sz;                                  // prod.size()
+  NTL::Vec<long> qvec;                      // the primes themselves
+  NTL::Vec<double> qrecipvec;               // 1/qi for each prime qi
+  NTL::Vec<long> tvec;                      // (prod/qi)^{-1} mod qi
+  NTL::Vec<NTL::mulmod_precon_t> tqinvvec;  // tvec with extra tables
+  NTL::ZZVec prod1vec;                      // prod/qi
+
+  long memoryUsage() const;
+};
+
+/**
+ * @brief The tables of the fast base extension from the primes of one set
+ * to a list of other single-precision moduli t_k (see
+ * FHEcontext::getBaseConvTables). With them DoubleCRT::addPrimes and
+ * DoubleCRT::scaleDownToSet find the residues mod t_k of the balanced
+ * lift of a coefficient from its residues mod the q_j, in word-size
+ * arithmetic only.
+ **/
+struct BaseConvTables {
+  std::shared_ptr<const CrtTables> crt;     // the CRT over the q_j
+  NTL::Vec<long> tvec;                      // the target moduli t_k
+  NTL::Vec<NTL::mulmod_t> tinvvec;          // for MulMod modulo t_k
+  NTL::Vec< NTL::Vec<long> > prod1mod;      // [k][j] = (prod/q_j) mod t_k
+  NTL::Vec< NTL::Vec<NTL::mulmod_precon_t> > prod1precon; // and their tables
+  NTL::Vec<long> prodmod;                   // prod mod t_k
+  NTL::Vec<long> prodinv;                   // prod^{-1} mod t_k
+
+  long memoryUsage() const;
+};
 
 /**
  * @brief Returns smallest parameter m satisfying various constraints:
@@ -39,6 +92,46 @@ long FindM(long k, long nBits, long c, long p, long d, long s, long chosen_m, bo
 
 
 class EncryptedArray;
+
+/**
+ * @class CKKSScaleMode
+ * @brief Automatic scale/level management of CKKS ciphertexts.
+ *
+ * When autoRescale is set, every multiplication of CKKS ciphertexts is
+ * followed by a rescale that drops primes until the factor is back near
+ * the target (see Ctxt::rescale), and operands at different levels are
+ * brought down to the lower of the two levels, rather than the default
+ * of pre-multiplication drops and adding primes before an addition. Each
+ * multiplication then consumes about log2(target) bits of the modulus, so
+ * the levels left are predictable (see Ctxt::levelsLeft).
+ **/
+struct CKKSScaleMode {
+  bool autoRescale;
+  long targetBits; //!< log2 of the target factor (0: encodeScalingFactor)
+  CKKSScaleMode(): autoRescale(false), targetBits(0) {}
+};
+
+/**
+ * @class PrimeTrimMode
+ * @brief Eager modulus switching of BGV ciphertexts.
+ *
+ * By default a ciphertext keeps its primes until an operation needs fewer:
+ * a multiplication drops to the natural prime set of its operands, and
+ * bootstrapping drops the small primes. When eager is set, the primes that
+ * the noise does not need are dropped (see Ctxt::trimPrimes) after every
+ * addition, multiplication and multiplication by a constant, and before
+ * every key-switching, so the operations that follow run on fewer
+ * residues. The noise is left at least 2^marginBits times the noise that
+ * mod-switching adds, which is room for the key-switching noise of a
+ * rotation or a few additions. A drop costs log2(1+2^{-marginBits}) bits
+ * of capacity, 0.17 bits at the default margin.
+ **/
+struct PrimeTrimMode {
+  bool eager;
+  long marginBits;
+  PrimeTrimMode(): eager(false), marginBits(3) {}
+};
+
 /**
  * @class FHEcontext
  * @brief Maintaining the parameters
@@ -48,6 +141,30 @@ class FHEcontext {
   // This is private since the implementation assumes that the list of
   // primes only grows and no prime is ever modified or removed.
 
+  // Construct the Cmodulus objects of the primes qs (in parallel) and
+  // append them to moduli, returns the indexes of the new primes
+  IndexSet addModuli(const std::vector<long>& qs);
+
+  // The CRT tables of getCrtTables, by their prime sets
+  mutable std::mutex crtMutex;
+  mutable std::map< IndexSet, std::shared_ptr<const CrtTables>,
+                    IndexSetLess > crtTables;
+  // The tables of getBaseConvTables, by the source and target indexes
+  mutable std::map< std::vector<long>,
+                    std::shared_ptr<const BaseConvTables> > convTables;
+
+  // The vectors of getIndexVector, by their sets
+  mutable std::mutex indexMutex;
+  mutable std::map< IndexSet, std::shared_ptr<const NTL::Vec<long>>,
+                    IndexSetLess > indexVectors;
+
+  // The tables of getAutomorphPerm by k mod m, most recently used first
+  mutable std::mutex autoMutex;
+  mutable std::list< std::pair<long, std::shared_ptr<const std::vector<long>>> >
+    autoPerms;
+
+  unsigned long id; // see getId
+
 public:
   // FHEContext is meant for convenience, not encapsulation: Most data
   // members are public and can be initialized by the application program.
@@ -219,16 +336,42 @@ public:
   //! Bootstrapping-related data in the context
   ThinRecryptData rcData; // includes both thin and think
 
+  //! How the scaling factors of CKKS ciphertexts are managed (not
+  //! serialized with the context)
+  CKKSScaleMode ckksScale;
+
+  //! When the primes of BGV ciphertexts are dropped (not serialized)
+  PrimeTrimMode primeTrim;
+
+  //! If set, the Bluestein tables of each prime that is added to the chain
+  //! are only built when that prime is first used (not serialized either)
+  bool lazyModuli;
+
+  //! A number that identifies this context for the process-wide caches
+  //! (e.g. clearKeySwitchCache): no two contexts of the process ever get
+  //! the same id, even if one is allocated at the address of another.
+  unsigned long getId() const { return id; }
+
   /******************************************************************/
   ~FHEcontext(); // destructor
   FHEcontext(unsigned long m, unsigned long p, unsigned long r,
              const std::vector<long>& gens = std::vector<long>(), 
              const std::vector<long>& ords = std::vector<long>() );  // constructor
 
+  //! Same as above, except that the factorization of Phi_m(X) mod p^r is
+  //! read from factorsStr (see PAlgebraMod::writeFactors) and not computed
+  FHEcontext(unsigned long m, unsigned long p, unsigned long r,
+             const std::vector<long>& gens, const std::vector<long>& ords,
+             std::istream& factorsStr);
+
+  //! If cacheDir is not empty, the constants of the linear transformations
+  //! are saved in (and later loaded from) files in that directory
   void makeBootstrappable(const NTL::Vec<long>& mvec, long skWht=0,
-			  bool build_cache=false, bool alsoThick=true)
+			  bool build_cache=false, bool alsoThick=true,
+			  const std::string& cacheDir="")
   {
-    rcData.init(*this, mvec, alsoThick, skWht, build_cache);
+    rcData.init(*this, mvec, alsoThick, skWht, build_cache, /*minimal=*/false,
+                cacheDir);
   }
 
   bool isBootstrappable() const 
@@ -258,6 +401,12 @@ public:
   bool operator==(const FHEcontext& other) const;
   bool operator!=(const FHEcontext& other) const { return !(*this==other); }
 
+  //! @brief The bytes of the context by its members: the tables of each
+  //! prime, the plaintext algebra and the recryption data (see
+  //! memoryUsage.h). The EncryptedArray's are not included.
+  MemoryReport memoryReport() const;
+  long memoryUsage() const;
+
   //! @brief The ith small prime in the modulus chain
   long ithPrime(unsigned long i) const 
   { return (i<moduli.size())? moduli[i].getQ() :0; }
@@ -292,6 +441,26 @@ public:
   }
   ///@}
 
+  //! @brief The elements of s in increasing order, e.g. to split the
+  //! primes of s between threads. Kept as getCrtTables keeps its tables.
+  std::shared_ptr<const NTL::Vec<long>> getIndexVector(const IndexSet& s) const;
+
+  //! @brief The CRT tables of the primes in s, built on first use. When
+  //! more than FHE_CRT_CACHE_SIZE sets were used, all of them are dropped.
+  std::shared_ptr<const CrtTables> getCrtTables(const IndexSet& s) const;
+
+  //! @brief The base-extension tables from the primes in from to those in
+  //! to (which must be disjoint from it), followed by the modulus extra
+  //! when extra > 1. Kept as getCrtTables keeps its tables.
+  std::shared_ptr<const BaseConvTables>
+  getBaseConvTables(const IndexSet& from, const IndexSet& to,
+                    long extra=0) const;
+
+  //! @brief The permutation of the automorphism X -> X^k (k in Zm*) on the
+  //! phi(m) entries of a DoubleCRT row: new[j] = old[perm[j]]. The
+  //! FHE_AUTOMORPH_CACHE_SIZE most recently used ones are kept.
+  std::shared_ptr<const std::vector<long>> getAutomorphPerm(long k) const;
+
   // FIXME: run-time error when ithPrime(i) returns 0
   //! @brief Returns the natural logarithm of the ith prime
   double logOfPrime(unsigned long i) const { return log(ithPrime(i)); }
@@ -319,6 +488,12 @@ public:
   void AddCtxtPrime(long q);
   void AddSpecialPrime(long q);
 
+  //! @brief Add several primes to the chain at once, building their
+  //! tables on the threads of the NTL thread pool
+  void AddSmallPrimes(const std::vector<long>& qs);
+  void AddCtxtPrimes(const std::vector<long>& qs);
+  void AddSpecialPrimes(const std::vector<long>& qs);
+
   
   ///@{
   /**
@@ -370,7 +545,8 @@ public:
   friend std::istream& operator>> (std::istream &str, FHEcontext& context);
   ///@}
 
-  friend void writeContextBinary(std::ostream& str, const FHEcontext& context);
+  friend void writeContextBinary(std::ostream& str, const FHEcontext& context,
+                                 bool withRecryptData);
   friend void readContextBinary(std::istream& str, FHEcontext& context);
 
 };
@@ -385,7 +561,11 @@ std::unique_ptr<FHEcontext> buildContextFromAscii(std::istream& str);
 
 //! @brief write [m p r gens ords] data
 void writeContextBaseBinary(std::ostream& str, const FHEcontext& context);
-void writeContextBinary(std::ostream& str, const FHEcontext& context);
+//! @brief If withRecryptData is set, also write the precomputed recryption
+//! data (linear maps etc.) of a bootstrappable context, so that
+//! readContextBinary restores it rather than calling makeBootstrappable
+void writeContextBinary(std::ostream& str, const FHEcontext& context,
+                        bool withRecryptData=false);
 
 //! @brief read [m p r gens ords] data, needed to construct context
 void readContextBaseBinary(std::istream& s, unsigned long& m,
@@ -394,15 +574,43 @@ void readContextBaseBinary(std::istream& s, unsigned long& m,
 std::unique_ptr<FHEcontext> buildContextFromBinary(std::istream& str);
 void readContextBinary(std::istream& str, FHEcontext& context);
 
+/**
+ * @brief Write a full snapshot of the context to the file fname.
+ *
+ * Besides everything that writeContextBaseBinary and writeContextBinary
+ * write, the snapshot holds the factorization of Phi_m(X) mod p^r and the
+ * CRT coefficients, which dominate the construction time of the context
+ * for large m. The file starts with a hash of its contents.
+ **/
+void writeContextSnapshot(const std::string& fname, const FHEcontext& context,
+                          bool withRecryptData=false);
+
+//! @brief Build the context from a snapshot, the file is mapped into memory
+//! (or read in one go) and its hash is checked first. Raises
+//! std::runtime_error if fname is not a valid snapshot.
+std::unique_ptr<FHEcontext> buildContextFromSnapshot(const std::string& fname);
+
 
 // Build modulus chain with nBits worth of ctxt primes, 
 // using nDgts digits in key-switching.
 // willBeBootstrappable flag is a hack, used to get around some
 // circularity when making the context boostrappable.
 // resolution ... FIXME
+// If 0<budgetDgts<nDgts, the special primes are large enough for
+// matrices that split the ciphertext primes into only budgetDgts digits
+// (see FHESecKey::GenTrimmedKeySWmatrices).
 
 void buildModChain(FHEcontext& context, long nBits, long nDgts=3,
-                      bool willBeBootstrappable=false, long resolution=3);
+                   bool willBeBootstrappable=false, long resolution=3,
+                   long budgetDgts=0);
+
+//! Split primes into nDgts digits of about the same number of primes
+//! each (fewer if there are not enough primes), as the digits of a context
+std::vector<IndexSet> splitIntoDigits(const IndexSet& primes, long nDgts);
+
+//! The log of the largest digit that the special primes of the context
+//! can absorb, when key-switching with nDgts digits relative to ptxtSpace
+double ksDigitBudget(const FHEcontext& context, long nDgts, long ptxtSpace);
 
 ///@}
 extern FHEcontext* activeContext; // Should point to the "current" context
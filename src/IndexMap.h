@@ -62,6 +62,13 @@ public:
   //! operator new, and the pointer is "exclusively owned" by the map object.
   explicit IndexMap(IndexMapInit<T> *_init) : init(_init) { }
 
+  //! @brief Copying clones the elements and the initialization object,
+  //! moving takes them over and leaves the other map empty.
+  IndexMap(const IndexMap&) = default;
+  IndexMap(IndexMap&&) = default;
+  IndexMap& operator=(const IndexMap&) = default;
+  IndexMap& operator=(IndexMap&&) = default;
+
   //! @brief Get the underlying index set
   const IndexSet& getIndexSet() const { return indexSet; }
 
@@ -10,6 +10,7 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <algorithm>
 #include "IndexSet.h"
 #include "binio.h"
 
@@ -19,19 +20,42 @@ const IndexSet& IndexSet::emptySet()
    return empty;
 }
 
+static inline long popCount(unsigned long x) { return __builtin_popcountl(x); }
+static inline long lowBit(unsigned long x) { return __builtin_ctzl(x); }
+static inline long highBit(unsigned long x)
+{ return NTL_BITS_PER_LONG-1 - __builtin_clzl(x); }
+
+void IndexSet::recompute()
+{
+  long n = numWords();
+  _card = 0;
+  _first = 0; _last = -1;
+  for (long w = 0; w < n; w++) {
+    word x = getWord(w);
+    if (x == 0) continue;
+    if (_card == 0) _first = w*WORD_BITS + lowBit(x);
+    _last = w*WORD_BITS + highBit(x);
+    _card += popCount(x);
+  }
+}
+
 // constructs an interval, low to high
 void IndexSet::intervalConstructor(long low, long high) {
   assert(low >= 0);
 
+  clearWords();
   if (high < low) {
     _first = 0; _last = -1; _card = 0;
   }
   else {
-    rep.resize(high+1);
-    for (long i = 0; i < low; i++)
-      rep[i] = false;
-    for (long i = low; i <= high; i++)
-      rep[i] = true;
+    long wlo = low / WORD_BITS, whi = high / WORD_BITS;
+    wordRef(whi); // allocate them all at once
+    for (long w = wlo; w <= whi; w++) {
+      word x = ~word(0);
+      if (w == wlo) x &= ~word(0) << (low % WORD_BITS);
+      if (w == whi) x &= ~word(0) >> (WORD_BITS-1 - high % WORD_BITS);
+      wordRef(w) = x;
+    }
 
     _first = low; _last = high; _card = high-low+1;
   }
@@ -42,8 +66,10 @@ long IndexSet::next(long j) const {
   if (j >= _last) return j + 1;
   if (j < _first) return _first;
   j++;
-  while (rep[j] == false) j++;
-  return j;
+  long w = j / WORD_BITS;
+  word x = getWord(w) & (~word(0) << (j % WORD_BITS));
+  while (x == 0) x = getWord(++w); // there is one by _last
+  return w*WORD_BITS + lowBit(x);
 }
 
 long IndexSet::prev(long j) const {
@@ -51,19 +77,24 @@ long IndexSet::prev(long j) const {
   if (j > _last) return _last;
   if (j <= _first) return j-1;
   j--;
-  while (rep[j] == false) j--;
-  return j;
+  long w = j / WORD_BITS;
+  word x = getWord(w) & (~word(0) >> (WORD_BITS-1 - j % WORD_BITS));
+  while (x == 0) x = getWord(--w); // there is one by _first
+  return w*WORD_BITS + highBit(x);
 }
 
 bool IndexSet::contains(long j) const {
   if (j < _first || j > _last) return false;
-  return rep[j];
+  return (getWord(j / WORD_BITS) >> (j % WORD_BITS)) & 1;
 }
 
 
 bool IndexSet::contains(const IndexSet& s) const {
-  for (long i = s.first(); i <= s.last(); i = s.next(i))
-    if (!contains(i)) return false;
+  if (s.card() == 0) return true;
+  if (s.card() > card() || s.first() < first() || s.last() > last())
+    return false;
+  for (long w = s.first()/WORD_BITS; w <= s.last()/WORD_BITS; w++)
+    if (s.getWord(w) & ~getWord(w)) return false;
   return true;
 }
 
@@ -73,8 +104,10 @@ bool IndexSet::disjointFrom(const IndexSet& s) const
   if (card() == 0 || s.card() == 0
       || last() < s.first() || s.last() < first()) return true;
 
-  for (long i = s.first(); i <= s.last(); i = s.next(i))
-    if (contains(i)) return false;
+  long lo = std::max(first(), s.first()) / WORD_BITS;
+  long hi = std::min(last(), s.last()) / WORD_BITS;
+  for (long w = lo; w <= hi; w++)
+    if (getWord(w) & s.getWord(w)) return false;
   return true;
 }
 
@@ -84,24 +117,30 @@ bool IndexSet::operator==(const IndexSet& s) const {
   if (_first != s._first) return false;
   if (_last != s._last) return false;
 
-  return equal(rep.begin()+_first, rep.begin()+_last+1, 
-               s.rep.begin()+_first); 
-  // NOTE: maybe vector<bool> optimizes this???
+  for (long w = _first/WORD_BITS; w <= _last/WORD_BITS; w++)
+    if (getWord(w) != s.getWord(w)) return false;
+  return true;
+}
+
+bool IndexSet::lexLess(const IndexSet& s) const {
+  long n = std::max(numWords(), s.numWords());
+  for (long w = 0; w < n; w++) {
+    word x = getWord(w), y = s.getWord(w);
+    if (x != y) return x < y;
+  }
+  return false;
 }
 
 void IndexSet::clear() {
-  rep.resize(0);
+  clearWords();
   _first = 0; _last = -1; _card = 0;
 }
 
 void IndexSet::insert(long j) {
   assert(j >= 0);
 
-  long oldSize = rep.size();
-  if (j >= oldSize) {
-    rep.resize(j+1);
-    for (long i = oldSize; i <= j; i++) rep[i] = false;
-  }
+  word& x = wordRef(j / WORD_BITS);
+  word bit = word(1) << (j % WORD_BITS);
 
   if (_card == 0) {
     _first = _last = j;
@@ -110,17 +149,16 @@ void IndexSet::insert(long j) {
   else {
     if (j > _last) _last = j;
     if (j < _first) _first = j;
-    if (rep[j] == false) _card++;
+    if (!(x & bit)) _card++;
   }
 
-  rep[j] = true;
+  x |= bit;
 }
 
 void IndexSet::remove(long j) {
   assert(j >= 0);
 
-  if (j >= (long) rep.size()) return;
-  if (rep[j] == false) return;
+  if (!contains(j)) return;
 
   long newFirst = _first, newLast = _last;
 
@@ -136,7 +174,7 @@ void IndexSet::remove(long j) {
   _first = newFirst;
   _last = newLast;
   _card--;
-  rep[j] = false;
+  wordRef(j / WORD_BITS) &= ~(word(1) << (j % WORD_BITS));
 }
 
 void IndexSet::insert(const IndexSet& s) {
@@ -147,19 +185,24 @@ void IndexSet::insert(const IndexSet& s) {
     return;
   }
 
-  for (long i = s.last(); i >= s.first(); i = s.prev(i)) insert(i);
-  // NOTE: traversal done from high to low so as to trigger at 
-  // at most one resize
-
+  long lo = s.first()/WORD_BITS, hi = s.last()/WORD_BITS;
+  wordRef(hi);
+  for (long w = lo; w <= hi; w++) wordRef(w) |= s.getWord(w);
+  _first = std::min(_first, s.first());
+  _last = std::max(_last, s.last());
+  _card = 0;
+  for (long w = _first/WORD_BITS; w <= _last/WORD_BITS; w++)
+    _card += popCount(getWord(w));
 }
 
 void IndexSet::remove(const IndexSet& s) {
   if (this == &s) { clear(); return; }
-  if (s.card() == 0) return;
-  if (card() == 0) return;
+  if (disjointFrom(s)) return;
 
-  for (long i = s.first(); i <= s.last(); i = s.next(i)) remove(i);
-  // NOTE: traversal order should not matter here
+  long lo = std::max(first(), s.first()) / WORD_BITS;
+  long hi = std::min(last(), s.last()) / WORD_BITS;
+  for (long w = lo; w <= hi; w++) wordRef(w) &= ~s.getWord(w);
+  recompute();
 }
 
 
@@ -168,9 +211,9 @@ void IndexSet::retain(const IndexSet& s) {
   if (s.card() == 0) { clear(); return; }
   if (card() == 0) return;
 
-  for (long i = first(); i <= last(); i = next(i)) {
-    if (!s.contains(i)) remove(i);
-  }
+  for (long w = first()/WORD_BITS; w <= last()/WORD_BITS; w++)
+    wordRef(w) &= s.getWord(w);
+  recompute();
 }
 
 // union
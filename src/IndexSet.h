@@ -18,6 +18,12 @@
 
 #include "NumbTh.h"
 
+//! The number of words of an IndexSet that are kept inline, so that sets
+//! of indexes below NTL_BITS_PER_LONG*FHE_INDEXSET_WORDS never allocate
+#ifndef FHE_INDEXSET_WORDS
+#define FHE_INDEXSET_WORDS (2)
+#endif
+
 //! @brief A dynamic set of non-negative integers.
 //!
 //! You can iterate through a set as follows:
@@ -25,21 +31,45 @@
 //!    for (long i = s.first(); i <= s.last(); i = s.next(i)) ...
 //!    for (long i = s.last(); i >= s.first(); i = s.prev(i)) ...
 //! \endcode
+//!
+//! The set is a bit vector packed into words, the first FHE_INDEXSET_WORDS
+//! of them inside the object. The prime sets of a context are typically
+//! of fewer than 128 primes, so copying them takes no allocation, and the
+//! set algebra, the comparisons and the cardinality take a few word
+//! operations.
 class IndexSet {
+  typedef unsigned long word;
+  enum { WORD_BITS = NTL_BITS_PER_LONG, NSMALL = FHE_INDEXSET_WORDS };
 
-  std::vector<bool> rep;
-  // NOTE: modern versions of C++ are supposed
-  // to implement this efficiently as a "specialized template class".
-  // Older versions of C++ define the equivalent class bit_std::vector.
+  word small[NSMALL];      // the words of the indexes below NSMALL*WORD_BITS
+  std::vector<word> more;  // the words after those, may end with zeros
 
   long _first, _last, _card;
 
   // Invariant: if _card == 0, then _first = 0, _last = -1;
   // otherwise, _first (resp. _last) is the lowest (resp. highest)
   // index in the set.
-  // In any case, the std::vector rep always defines the characterstic
+  // In any case, the words always define the characterstic
   // function of the set.
 
+  long numWords() const { return NSMALL + long(more.size()); }
+  word getWord(long w) const {
+    if (w < NSMALL) return small[w];
+    w -= NSMALL;
+    return (w < long(more.size()))? more[w] : 0;
+  }
+  word& wordRef(long w) { // the word w, allocated if needed
+    if (w < NSMALL) return small[w];
+    w -= NSMALL;
+    if (w >= long(more.size())) more.resize(w+1, 0);
+    return more[w];
+  }
+  void clearWords() {
+    for (long w = 0; w < NSMALL; w++) small[w] = 0;
+    more.clear();
+  }
+  void recompute(); // _first, _last and _card from the words
+
   // private helper function
   void intervalConstructor(long low, long high);
 
@@ -49,6 +79,7 @@ public:
 
   // @brief No-argument constructor, creates empty set
   IndexSet() {
+    clearWords();
     _first = 0;  _last = -1; _card = 0;
   }
 
@@ -64,10 +95,33 @@ public:
   }
 
   // copy constructor: use the built-in copy constructor
+  IndexSet(const IndexSet&) = default;
+
+  // move constructor: leaves other as the empty set
+  IndexSet(IndexSet&& other) noexcept
+    : more(std::move(other.more)),
+      _first(other._first), _last(other._last), _card(other._card)
+  {
+    for (long w = 0; w < NSMALL; w++) small[w] = other.small[w];
+    other.clearWords();
+    other._first = 0; other._last = -1; other._card = 0;
+  }
 
   /*** asignment ***/
 
   // assignment: use the built-in assignment operator
+  IndexSet& operator=(const IndexSet&) = default;
+
+  IndexSet& operator=(IndexSet&& other) noexcept {
+    if (this != &other) {
+      for (long w = 0; w < NSMALL; w++) small[w] = other.small[w];
+      more = std::move(other.more);
+      _first = other._first; _last = other._last; _card = other._card;
+      other.clearWords();
+      other._first = 0; other._last = -1; other._card = 0;
+    }
+    return *this;
+  }
 
   //! @brief Returns the first element, 0 if the set is empty
   long first() const { return _first; }
@@ -84,6 +138,10 @@ public:
   //! @brief The cardinality of the set
   long card() const { return _card; }
 
+  //! @brief The bytes of this set, its own size included
+  long memoryUsage() const
+  { return sizeof(IndexSet) + more.capacity()*sizeof(word); }
+
   //! @brief Returns true iff the set contains j
   bool contains(long j) const;
 
@@ -101,6 +159,9 @@ public:
     return !(*this == s);
   }
 
+  //! @brief A total order on sets (not inclusion), for keys of maps
+  bool lexLess(const IndexSet& s) const;
+
   /*** update methods ***/
 
   //! @brief Set to the empty set
@@ -158,8 +219,7 @@ public:
 
 };
 
-// some high-level convenience methods...not very efficient...
-// not sure if we really need these
+// some high-level convenience methods
 
 //! @brief union
 IndexSet operator|(const IndexSet& s, const IndexSet& t);
@@ -194,6 +254,12 @@ bool operator>=(const IndexSet& s1, const IndexSet& s2);
 //! @brief Is s2 strict subset of s1
 bool operator>(const IndexSet& s1, const IndexSet& s2);
 
+//! @brief Orders sets by IndexSet::lexLess, e.g. for std::map
+struct IndexSetLess {
+  bool operator()(const IndexSet& s1, const IndexSet& s2) const
+  { return s1.lexLess(s2); }
+};
+
 //! @brief Functional disjoint
 inline bool disjoint(const IndexSet& s1, const IndexSet& s2)
 { return s1.disjointFrom(s2); }
@@ -14,6 +14,9 @@
  * Copyright IBM Corporation 2012 All rights reserved.
  */
 #include <unordered_set>
+#include <map>
+#include <queue>
+#include <functional>
 #include "NTL/ZZ.h"
 #include "permutations.h"
 NTL_CLIENT
@@ -34,10 +37,12 @@ void addAllMatrices(FHESecKey& sKey, long keyID)
   long m = context.zMStar.getM();
 
   // key-switching matrices for the automorphisms
+  std::vector<long> vals;
   for (long i = 0; i < m; i++) {
     if (!context.zMStar.inZmStar(i)) continue;
-    sKey.GenKeySWmatrix(1, i, keyID, keyID);
+    vals.push_back(i);
   }
+  sKey.GenKeySWmatrices(vals, keyID, keyID);
   sKey.setKeySwitchMap(); // re-compute the key-switching map
 }
 
@@ -100,10 +105,10 @@ static void add1Dmats4dim(FHESecKey& sKey, long i, long keyID)
 */
 }
 #else
-// adds all matrices for dim i.
+// adds all matrices for dim i (to the list vals of automorphisms).
 // i == -1 => Frobenius (NOTE: in matmul1D, i ==#gens means something else,
 //   so it is best to avoid that).
-static void add1Dmats4dim(FHESecKey& sKey, long i, long keyID)
+static void add1Dmats4dim(FHESecKey& sKey, long i, std::vector<long>& vals)
 {
   const PAlgebra& zMStar = sKey.getContext().zMStar;
   long ord;
@@ -120,10 +125,10 @@ static void add1Dmats4dim(FHESecKey& sKey, long i, long keyID)
   }
 
   for (long j = 1; j < ord; j++) 
-    sKey.GenKeySWmatrix(1, zMStar.genToPow(i, j), keyID, keyID);
+    vals.push_back(zMStar.genToPow(i, j));
 
   if (!native)
-    sKey.GenKeySWmatrix(1, zMStar.genToPow(i, -ord), keyID, keyID);
+    vals.push_back(zMStar.genToPow(i, -ord));
 
   sKey.setKSStrategy(i, FHE_KSS_FULL);
 }
@@ -253,7 +258,8 @@ MAUTO
 
 #else
 // same as above, but uses BS/GS strategy
-static void addSome1Dmats4dim(FHESecKey& sKey, long i, long bound, long keyID)
+static void addSome1Dmats4dim(FHESecKey& sKey, long i, long bound,
+                              std::vector<long>& vals)
 {
   const PAlgebra& zMStar = sKey.getContext().zMStar;
   long ord;
@@ -273,14 +279,14 @@ static void addSome1Dmats4dim(FHESecKey& sKey, long i, long bound, long keyID)
 
   // baby steps
   for (long j = 1; j < g; j++)
-    sKey.GenKeySWmatrix(1, zMStar.genToPow(i, j), keyID, keyID);
+    vals.push_back(zMStar.genToPow(i, j));
 
   // giant steps
   for (long j = g; j < ord; j += g)
-    sKey.GenKeySWmatrix(1, zMStar.genToPow(i, j), keyID, keyID);
+    vals.push_back(zMStar.genToPow(i, j));
 
   if (!native)
-    sKey.GenKeySWmatrix(1, zMStar.genToPow(i, -ord), keyID, keyID);
+    vals.push_back(zMStar.genToPow(i, -ord));
 
   sKey.setKSStrategy(i, FHE_KSS_BSGS);
 
@@ -303,13 +309,15 @@ void addSome1DMatrices(FHESecKey& sKey, long bound, long keyID)
   const FHEcontext &context = sKey.getContext();
 
   // key-switching matrices for the automorphisms
+  std::vector<long> vals;
   for (long i: range(context.zMStar.numOfGens())) {
           // For generators of small order, add all the powers
     if (bound >= context.zMStar.OrderOf(i))
-      add1Dmats4dim(sKey, i, keyID);
+      add1Dmats4dim(sKey, i, vals);
     else  // For generators of large order, add only some of the powers
-      addSome1Dmats4dim(sKey, i, bound, keyID);
+      addSome1Dmats4dim(sKey, i, bound, vals);
   }
+  sKey.GenKeySWmatrices(vals, keyID, keyID); // all dimensions together
   sKey.setKeySwitchMap(); // re-compute the key-switching map
 }
 
@@ -317,15 +325,18 @@ void addSome1DMatrices(FHESecKey& sKey, long bound, long keyID)
 void addSomeFrbMatrices(FHESecKey& sKey, long bound, long keyID)
 {
   const FHEcontext &context = sKey.getContext();
+  std::vector<long> vals;
   if (bound >= LONG(context.zMStar.getOrdP()))
-    add1Dmats4dim(sKey, -1, keyID);
+    add1Dmats4dim(sKey, -1, vals);
   else  // For generators of large order, add only some of the powers
-    addSome1Dmats4dim(sKey, -1, bound, keyID);
+    addSome1Dmats4dim(sKey, -1, bound, vals);
 
+  sKey.GenKeySWmatrices(vals, keyID, keyID);
   sKey.setKeySwitchMap(); // re-compute the key-switching map
 }
 
-static void addMinimal1Dmats4dim(FHESecKey& sKey, long i, long keyID)
+static void addMinimal1Dmats4dim(FHESecKey& sKey, long i,
+                                 std::vector<long>& vals)
 {
   const PAlgebra& zMStar = sKey.getContext().zMStar;
   long ord;
@@ -341,14 +352,14 @@ static void addMinimal1Dmats4dim(FHESecKey& sKey, long i, long keyID)
     native = true;
   }
 
-  sKey.GenKeySWmatrix(1, zMStar.genToPow(i, 1), keyID, keyID);
+  vals.push_back(zMStar.genToPow(i, 1));
 
   if (!native)
-    sKey.GenKeySWmatrix(1, zMStar.genToPow(i, -ord), keyID, keyID);
+    vals.push_back(zMStar.genToPow(i, -ord));
 
   if (ord > FHE_KEYSWITCH_MIN_THRESH) {
     long g = KSGiantStepSize(ord);
-    sKey.GenKeySWmatrix(1, zMStar.genToPow(i, g), keyID, keyID);
+    vals.push_back(zMStar.genToPow(i, g));
   }
 
   sKey.setKSStrategy(i, FHE_KSS_MIN);
@@ -360,16 +371,20 @@ void addMinimal1DMatrices(FHESecKey& sKey, long keyID)
   const FHEcontext &context = sKey.getContext();
 
   // key-switching matrices for the automorphisms
+  std::vector<long> vals;
   for (long i: range(context.zMStar.numOfGens())) {
-    addMinimal1Dmats4dim(sKey, i, keyID);
+    addMinimal1Dmats4dim(sKey, i, vals);
   }
+  sKey.GenKeySWmatrices(vals, keyID, keyID);
   sKey.setKeySwitchMap(); // re-compute the key-switching map
 }
 
 // Generate all Frobenius matrices of the form s(X^{p^i})->s(X)
 void addMinimalFrbMatrices(FHESecKey& sKey, long keyID)
 {
-  addMinimal1Dmats4dim(sKey, -1, keyID);
+  std::vector<long> vals;
+  addMinimal1Dmats4dim(sKey, -1, vals);
+  sKey.GenKeySWmatrices(vals, keyID, keyID);
   sKey.setKeySwitchMap(); // re-compute the key-switching map
 }
 
@@ -379,6 +394,7 @@ void addMatrices4Network(FHESecKey& sKey, const PermNetwork& net, long keyID)
   const FHEcontext &context = sKey.getContext();
   long m = context.zMStar.getM();
 
+  std::vector<long> vals;
   for (long i=0; i<net.depth(); i++) {
     long e = net.getLayer(i).getE();
     long gIdx = net.getLayer(i).getGenIdx();
@@ -387,20 +403,140 @@ void addMatrices4Network(FHESecKey& sKey, const PermNetwork& net, long keyID)
     const Vec<long>&shamts = net.getLayer(i).getShifts();
     for (long j=0; j<shamts.length(); j++) {
       if (shamts[j]==0) continue;
-      long val = PowerMod(g2e, shamts[j], m);
-      sKey.GenKeySWmatrix(1, val, keyID, keyID);
+      vals.push_back(PowerMod(g2e, shamts[j], m));
     }
   }
+  sKey.GenKeySWmatrices(vals, keyID, keyID);
   sKey.setKeySwitchMap(); // re-compute the key-switching map
 }
 
 void addTheseMatrices(FHESecKey& sKey,
 		      const std::set<long>& automVals, long keyID)
 {
-  std::set<long>::iterator it;
-  for (it=automVals.begin(); it!=automVals.end(); ++it) {
-    long k = *it;
-    sKey.GenKeySWmatrix(1, k, keyID, keyID);
-  }
+  std::vector<long> vals(automVals.begin(), automVals.end());
+  sKey.GenKeySWmatrices(vals, keyID, keyID);
   sKey.setKeySwitchMap(); // re-compute the key-switching map
 }
+
+/********************************************************************/
+/******************** Planning from a recorded trace ****************/
+
+// The weighted number of key-switchings for the automorphisms in weights,
+// with shortest paths over the matrices in S (as setKeySwitchMap finds
+// them). Returns -1 if some of them cannot be reached.
+static double planCost(const std::vector<long>& S,
+                       const std::map<long,double>& weights, long m)
+{
+  std::vector<long> dist(m, -1);
+  dist[1] = 0;
+  long left = 0;
+  for (auto& w: weights) if (w.first != 1) left++;
+
+  std::vector<long> queue(1, 1);
+  for (long head = 0; head < lsize(queue) && left > 0; head++) {
+    long u = queue[head];
+    for (long e: S) {
+      long v = MulMod(u, e, m);
+      if (dist[v] >= 0) continue;
+      dist[v] = dist[u]+1;
+      queue.push_back(v);
+      if (weights.count(v) && --left == 0) break; // found all of them
+    }
+  }
+  if (left > 0) return -1;
+
+  double cost = 0;
+  for (auto& w: weights) cost += w.second * dist[w.first];
+  return cost;
+}
+
+double keySWplanCost(const FHEcontext& context, const std::set<long>& plan,
+                     const std::map<long,double>& weights)
+{
+  std::vector<long> S(plan.begin(), plan.end());
+  return planCost(S, weights, context.zMStar.getM());
+}
+
+std::set<long> planKeySWmatrices(const FHEcontext& context,
+                                 const std::map<long,double>& weights,
+                                 long maxMatrices)
+{
+  const PAlgebra& zMStar = context.zMStar;
+  long m = zMStar.getM();
+
+  // The candidates are the automorphisms of the trace, and the
+  // power-of-two steps in every dimension (including Frobenius) from
+  // which the others can be composed
+  std::set<long> cands;
+  for (auto& w: weights)
+    if (w.first != 1) cands.insert(mcMod(w.first, m));
+  for (long i = -1; i < long(zMStar.numOfGens()); i++) {
+    long ord = (i == -1)? zMStar.getOrdP() : zMStar.OrderOf(i);
+    for (long j = 1; j < ord; j *= 2)
+      cands.insert(zMStar.genToPow(i, j));
+    if (i != -1 && !zMStar.SameOrd(i))
+      cands.insert(zMStar.genToPow(i, -ord));
+  }
+  cands.erase(1);
+
+  // Drop matrices greedily, each time the one whose removal costs the
+  // least, as long as everything stays reachable. The increases only get
+  // larger as matrices are removed (mostly), so they are re-evaluated
+  // lazily: a candidate whose recomputed increase is still the smallest
+  // one is removed.
+  std::vector<long> S(cands.begin(), cands.end());
+  double cost = planCost(S, weights, m);
+  assert(cost >= 0);
+
+  auto without = [&S](long e) {
+    std::vector<long> T;
+    for (long x: S) if (x != e) T.push_back(x);
+    return T;
+  };
+  typedef std::pair<double,long> Entry; // (increase, automorphism)
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > heap;
+  for (long e: S) heap.push(Entry(0.0, e)); // optimistic start
+
+  while (lsize(S) > maxMatrices && !heap.empty()) {
+    long e = heap.top().second;
+    heap.pop();
+    double c = planCost(without(e), weights, m);
+    if (c < 0) continue; // needed for reachability, keep it
+    double inc = c - cost;
+    if (!heap.empty() && inc > heap.top().first) {
+      heap.push(Entry(inc, e)); // stale, try the next one first
+      continue;
+    }
+    S = without(e);
+    cost = c;
+  }
+  return std::set<long>(S.begin(), S.end());
+}
+
+std::set<long> planKeySWmatrices(const FHEcontext& context,
+                                 const std::set<long>& trace,
+                                 long maxMatrices)
+{
+  std::map<long,double> weights;
+  for (long k: trace) weights[k] = 1.0;
+  return planKeySWmatrices(context, weights, maxMatrices);
+}
+
+void addPlannedMatrices(FHESecKey& sKey, const std::set<long>& trace,
+                        long maxMatrices, long keyID)
+{
+  std::set<long> plan =
+    planKeySWmatrices(sKey.getContext(), trace, maxMatrices);
+  addTheseMatrices(sKey, plan, keyID); // also sets the key-switching map
+}
+
+void addTrimmedMatrices(FHESecKey& sKey, const IndexSet& primes, long keyID,
+                        long nDgts)
+{
+  std::vector<long> vals;
+  for (const KeySwitch& W: sKey.keySWlist())
+    if (W.toKeyID == keyID && W.fromKey.getSecretKeyID() == keyID
+        && W.fromKey.getPowerOfS() == 1 && sKey.isFullKSWmatrix(W))
+      vals.push_back(W.fromKey.getPowerOfX());
+  sKey.GenTrimmedKeySWmatrices(vals, primes, keyID, keyID, 0, nDgts);
+}
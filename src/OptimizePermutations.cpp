@@ -17,6 +17,11 @@
 #include <cassert>
 #include <list>
 #include <sstream>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
 using namespace std;
 #if (__cplusplus>199711L)
 #include <memory>
@@ -328,6 +333,10 @@ BenesMemoEntry optimalBenesAux(long i, long budget, long nlev,
 }
 
 
+// The process-wide store of solutions (defined below)
+static bool lookupBenes(const string& key, BenesMemoEntry& ent);
+static void rememberBenes(const string& key, const BenesMemoEntry& ent);
+
 // Computes an optimal level-collapsing strategy for a Benes network
 //   n = the size of the network
 //   budget = an upper bound on the number of levels in the collapsed network
@@ -341,6 +350,15 @@ BenesMemoEntry optimalBenesAux(long i, long budget, long nlev,
 void optimalBenes(long n, long budget, bool good, 
                      long& cost, LongNodePtr& solution)
 {
+  stringstream key;
+  key << n << " " << budget << " " << good;
+  BenesMemoEntry t;
+  if (lookupBenes(key.str(), t)) { // solved before
+    cost = t.cost;
+    solution = t.solution;
+    return;
+  }
+
   long k = GeneralBenesNetwork::depth(n); // k = ceiling(log_2 n)
   long nlev = 2*k - 1;  // before collapsing, we have 2k-1 levels
 
@@ -351,12 +369,12 @@ void optimalBenes(long n, long budget, bool good,
   // Compute the cost for all (n choose 2) possible ways to collapse levels.
 
   BenesMemoTable memoTab;
-  BenesMemoEntry t = optimalBenesAux(0, budget, nlev, costTab, memoTab);
+  t = optimalBenesAux(0, budget, nlev, costTab, memoTab);
   // Compute the optimal collapsing of layers in a width-n Benes network
+  rememberBenes(key.str(), t);
 
   cost = t.cost;
   solution = t.solution;
-  
 }
 
 /********************************************************************/
@@ -569,6 +587,212 @@ typedef unordered_map< UpperMemoKey, UpperMemoEntry,
                             ClassHash<UpperMemoKey> > UpperMemoTable;
 //! \endcond
 
+/********************************************************************/
+/*** A store of solutions, shared by all the builds in the process ***/
+/********************************************************************/
+
+// The solutions of optimalBenes are keyed by "n budget good" and those of
+// buildOptimalTrees by "depthBound nGens order_1 good_1 ... order_k good_k"
+// (the generator indexes do not change the solution). When the store has
+// a file, each new solution is appended to it as a line of integers,
+//   "B <n budget good> cost <list>" or "T <trees key> cost <gens>"
+// where <list> is a length followed by the counts, <gens> is a length
+// followed by that many <split>s, and <split> is "1 order mid good <list>
+// <list>" for a leaf or "0 order mid good <split> <split>" otherwise.
+//! \cond FALSE (make doxygen ignore these classes)
+namespace {
+struct PermPlanStore {
+  std::mutex mtx;
+  unordered_map<string, BenesMemoEntry> benes;
+  unordered_map<string, UpperMemoEntry> trees;
+  string filename; // new solutions are appended here, if not empty
+};
+
+PermPlanStore& permPlanStore()
+{
+  static PermPlanStore store;
+  return store;
+}
+} // anonymous namespace
+//! \endcond
+
+static void writeList(ostream& s, LongNodePtr p)
+{
+  s << " " << length(p);
+  for (; p != NULL; p = p->next) s << " " << p->count;
+}
+
+static LongNodePtr readList(istream& s)
+{
+  long len = -1;
+  s >> len;
+  if (!s || len < 0) { s.setstate(ios::failbit); return LongNodePtr(); }
+  vector<long> counts(len);
+  for (long& c: counts) s >> c;
+  LongNodePtr p;
+  for (long i=len-1; i>=0; i--) p = LongNodePtr(new LongNode(counts[i], p));
+  return p;
+}
+
+static void writeSplit(ostream& s, SplitNodePtr p)
+{
+  s << " " << p->isLeaf() << " " << p->order << " " << p->mid
+    << " " << p->good;
+  if (p->isLeaf()) {
+    writeList(s, p->solution1);
+    writeList(s, p->solution2);
+  } else {
+    writeSplit(s, p->left);
+    writeSplit(s, p->right);
+  }
+}
+
+static SplitNodePtr readSplit(istream& s)
+{
+  long leaf=0, order=0, mid=0, good=0;
+  s >> leaf >> order >> mid >> good;
+  if (!s) return SplitNodePtr();
+  if (leaf) {
+    LongNodePtr sol1 = readList(s);
+    LongNodePtr sol2 = readList(s);
+    return SplitNodePtr(new SplitNode(order, mid, good, sol1, sol2));
+  }
+  SplitNodePtr left = readSplit(s);
+  SplitNodePtr right = readSplit(s);
+  if (!s) return SplitNodePtr();
+  return SplitNodePtr(new SplitNode(order, mid, good, left, right));
+}
+
+static void writeGens(ostream& s, GenNodePtr p)
+{
+  s << " " << length(p);
+  for (; p != NULL; p = p->next) writeSplit(s, p->solution);
+}
+
+static GenNodePtr readGens(istream& s)
+{
+  long len = -1;
+  s >> len;
+  if (!s || len < 0) { s.setstate(ios::failbit); return GenNodePtr(); }
+  vector<SplitNodePtr> sols(len);
+  for (SplitNodePtr& sol: sols) sol = readSplit(s);
+  GenNodePtr p;
+  for (long i=len-1; i>=0; i--) p = GenNodePtr(new GenNode(sols[i], p));
+  return p;
+}
+
+// Append one record to the store file, mtx must be held
+static void appendRecord(const PermPlanStore& store, const string& rec)
+{
+  if (store.filename.empty()) return;
+  ofstream f(store.filename, ios::app);
+  f << rec << "\n";
+  f.flush();
+  if (!f)
+    throw std::runtime_error("permutation plan store: error writing "
+                             + store.filename);
+}
+
+static bool lookupBenes(const string& key, BenesMemoEntry& ent)
+{
+  PermPlanStore& store = permPlanStore();
+  std::lock_guard<std::mutex> lock(store.mtx);
+  auto it = store.benes.find(key);
+  if (it == store.benes.end()) return false;
+  ent = it->second;
+  return true;
+}
+
+static void rememberBenes(const string& key, const BenesMemoEntry& ent)
+{
+  PermPlanStore& store = permPlanStore();
+  std::lock_guard<std::mutex> lock(store.mtx);
+  if (!store.benes.emplace(key, ent).second) return; // already known
+  stringstream rec;
+  rec << "B " << key << " " << ent.cost;
+  writeList(rec, ent.solution);
+  appendRecord(store, rec.str());
+}
+
+static bool lookupTrees(const string& key, UpperMemoEntry& ent)
+{
+  PermPlanStore& store = permPlanStore();
+  std::lock_guard<std::mutex> lock(store.mtx);
+  auto it = store.trees.find(key);
+  if (it == store.trees.end()) return false;
+  ent = it->second;
+  return true;
+}
+
+static void rememberTrees(const string& key, const UpperMemoEntry& ent)
+{
+  PermPlanStore& store = permPlanStore();
+  std::lock_guard<std::mutex> lock(store.mtx);
+  if (!store.trees.emplace(key, ent).second) return;
+  stringstream rec;
+  rec << "T " << key << " " << ent.cost;
+  writeGens(rec, ent.solution);
+  appendRecord(store, rec.str());
+}
+
+void setPermPlanStore(const string& filename)
+{
+  PermPlanStore& store = permPlanStore();
+  std::lock_guard<std::mutex> lock(store.mtx);
+  store.filename = filename;
+  if (filename.empty()) return;
+
+  ifstream f(filename);
+  if (!f) { // a new store, make sure that we can write it
+    ofstream out(filename, ios::app);
+    if (!out)
+      throw std::runtime_error("setPermPlanStore: cannot open " + filename);
+    return;
+  }
+  // Load the records, skipping those that are malformed (e.g., a line that
+  // was cut short when another process was writing it)
+  string line;
+  while (getline(f, line)) {
+    istringstream s(line);
+    string tag;
+    s >> tag;
+    stringstream key;
+    if (tag == "B") {
+      long n=0, budget=0, good=0;
+      BenesMemoEntry ent;
+      s >> n >> budget >> good >> ent.cost;
+      ent.solution = readList(s);
+      if (!s) continue;
+      key << n << " " << budget << " " << good;
+      store.benes.emplace(key.str(), ent);
+    }
+    else if (tag == "T") {
+      long depthBound=0, nGens=-1;
+      s >> depthBound >> nGens;
+      if (!s || nGens < 0) continue;
+      key << depthBound << " " << nGens;
+      for (long i=0; i<nGens; i++) {
+        long order=0, good=0;
+        s >> order >> good;
+        key << " " << order << " " << good;
+      }
+      UpperMemoEntry ent;
+      s >> ent.cost;
+      ent.solution = readGens(s);
+      if (!s) continue;
+      store.trees.emplace(key.str(), ent);
+    }
+  }
+}
+
+void clearPermPlanCache()
+{
+  PermPlanStore& store = permPlanStore();
+  std::lock_guard<std::mutex> lock(store.mtx);
+  store.benes.clear();
+  store.trees.clear();
+}
+
 // Optimize a single tree: try all possible ways of splitting the order into
 // order1*order2 (and also the solution of not splitting at all). For every
 // possible split, try all budget allocations and allocations of good and mid.
@@ -891,12 +1115,18 @@ long GeneratorTrees::buildOptimalTrees(const Vec<GenDescriptor>& gens,
       trees[i].collapseToRoot();
   }
 
-  UpperMemoTable upperMemoTable;
-  LowerMemoTable lowerMemoTable;
-
-  // Compute a solution in { t.cost, t.solution }
-  UpperMemoEntry t = 
-    optimalUpperAux(gens, 0, depthBound, 1, upperMemoTable, lowerMemoTable);
+  // Compute a solution in { t.cost, t.solution }, unless it is in the store
+  stringstream key;
+  key << depthBound << " " << gens.length();
+  for (long i=0; i<gens.length(); i++)
+    key << " " << gens[i].order << " " << gens[i].good;
+  UpperMemoEntry t;
+  if (!lookupTrees(key.str(), t)) {
+    UpperMemoTable upperMemoTable;
+    LowerMemoTable lowerMemoTable;
+    t = optimalUpperAux(gens, 0, depthBound, 1, upperMemoTable, lowerMemoTable);
+    rememberTrees(key.str(), t);
+  }
 
   // Copy the solution into the trees
   GenNodePtr midPtr;
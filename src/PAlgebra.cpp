@@ -15,6 +15,9 @@
 #include "PAlgebra.h"
 #include "hypercube.h"
 #include "timing.h"
+#include "binio.h"
+#include "memoryUsage.h"
+#include "taskScheduler.h"
 
 #include <NTL/ZZXFactoring.h>
 #include <NTL/GF2EXFactoring.h>
@@ -69,6 +72,12 @@ bool PAlgebra::operator==(const PAlgebra& other) const
   return true;
 }
 
+long PAlgebra::memoryUsage() const
+{
+  return sizeof(*this) + memBytes(gens) + memBytes(native) + memBytes(PhimX)
+    + memBytes(T) + memBytes(Tidx) + memBytes(zmsIdx) + memBytes(zmsRep);
+}
+
 
 long PAlgebra::exponentiate(const vector<long>& exps,
 				bool onlySameOrd) const
@@ -260,7 +269,8 @@ long PAlgebra::genToPow(long i, long j) const
 
 ************************************************************************/
 
-PAlgebraModBase *buildPAlgebraMod(const PAlgebra& zMStar, long r)
+PAlgebraModBase *buildPAlgebraMod(const PAlgebra& zMStar, long r,
+                                  istream* factorsStr)
 {
   long p = zMStar.getP();
 
@@ -269,9 +279,9 @@ PAlgebraModBase *buildPAlgebraMod(const PAlgebra& zMStar, long r)
 
   assert(p>=2 && r > 0);
   if (p == 2 && r == 1) 
-    return new PAlgebraModDerived<PA_GF2>(zMStar, r);
+    return new PAlgebraModDerived<PA_GF2>(zMStar, r, factorsStr);
   else
-    return new  PAlgebraModDerived<PA_zz_p>(zMStar, r);
+    return new  PAlgebraModDerived<PA_zz_p>(zMStar, r, factorsStr);
 }
 
 
@@ -294,16 +304,12 @@ zz_pEX FrobeniusMap(const zz_pEXModulus& F)
 
 
 template<class type> 
-PAlgebraModDerived<type>::PAlgebraModDerived(const PAlgebra& _zMStar, long _r) 
+PAlgebraModDerived<type>::PAlgebraModDerived(const PAlgebra& _zMStar, long _r,
+                                             istream* factorsStr)
   : zMStar(_zMStar), r(_r)
 
 {
   long p = zMStar.getP();
-  long m = zMStar.getM();
-
-  // For dry-run, use a tiny m value for the PAlgebra tables
-  if (isDryRun()) m = (p==3)? 4 : 3;
-
   assert(r > 0);
 
   ZZ BigPPowR = power_ZZ(p, r);
@@ -313,6 +319,31 @@ PAlgebraModDerived<type>::PAlgebraModDerived(const PAlgebra& _zMStar, long _r)
   long nSlots = zMStar.getNSlots();
 
   RBak bak; bak.save();
+  if (factorsStr != nullptr) readFactors(*factorsStr);
+  else                       factorPhimX();
+  // Either way, the current modulus is now p^r
+
+  // set factorsOverZZ
+  resize(factorsOverZZ,nSlots);
+  for (long i = 0; i < nSlots; i++)
+    conv(factorsOverZZ[i], factors[i]);
+
+  genCrtTable();
+  genMaskTable();
+}
+
+// Sets factors, crtCoeffs, PhimXMod and pPowRContext
+template<class type>
+void PAlgebraModDerived<type>::factorPhimX()
+{
+  long p = zMStar.getP();
+  long m = zMStar.getM();
+
+  // For dry-run, use a tiny m value for the PAlgebra tables
+  if (isDryRun()) m = (p==3)? 4 : 3;
+
+  long nSlots = zMStar.getNSlots();
+
   SetModulus(p);
 
   // Compute the factors Ft of Phi_m(X) mod p, for all t \in T
@@ -333,14 +364,21 @@ PAlgebraModDerived<type>::PAlgebraModDerived(const PAlgebra& _zMStar, long _r)
   // We make the lexicographically smallest factor have index 0.
   // The remaining factors are ordered according to their representives.
 
+  // The factors (and the CRT tables below) are computed one slot per
+  // thread, each thread installing the current modulus for itself
+  RContext ctx; ctx.save();
+
   RXModulus F1(localFactors[0]); 
-  for (long i=1; i<nSlots; i++) {
+  FHE_EXEC_RANGE(nSlots-1, first, last)
+  RBak bak1; bak1.save(); ctx.restore();
+  for (long i=first+1; i<last+1; i++) {
     long t =zMStar.ith_rep(i); // Ft is minimal poly of x^{1/t} mod F1
     long tInv = InvMod(t, m);  // tInv = t^{-1} mod m
     RX X2tInv = PowerXMod(tInv,F1);     // X2tInv = X^{1/t} mod F1
     NTL::IrredPolyMod(localFactors[i], X2tInv, F1);
           // IrredPolyMod(X,P,Q) returns in X the minimal polynomial of P mod Q
   }
+  FHE_EXEC_RANGE_END
   /* Debugging sanity-check #1: we should have Ft= GCD(F1(X^t),Phi_m(X))
   for (i=1; i<nSlots; i++) {
     long t = T[i];
@@ -359,11 +397,14 @@ PAlgebraModDerived<type>::PAlgebraModDerived(const PAlgebra& _zMStar, long _r)
 
     // Compute the CRT coefficients for the Ft's
     resize(crtCoeffs,nSlots);
-    for (long i=0; i<nSlots; i++) {
+    FHE_EXEC_RANGE(nSlots, first, last)
+    RBak bak1; bak1.save(); ctx.restore();
+    for (long i=first; i<last; i++) {
       RX te = phimxmod / factors[i]; // \prod_{j\ne i} Fj
       te %= factors[i];              // \prod_{j\ne i} Fj mod Fi
       InvMod(crtCoeffs[i], te, factors[i]); // \prod_{j\ne i} Fj^{-1} mod Fi
     }
+    FHE_EXEC_RANGE_END
   }
   else {
     PAlgebraLift(zMStar.getPhimX(), localFactors, factors, crtCoeffs, r);
@@ -372,14 +413,89 @@ PAlgebraModDerived<type>::PAlgebraModDerived(const PAlgebra& _zMStar, long _r)
     build(PhimXMod, phimxmod1);
     pPowRContext.save();
   }
+}
 
-  // set factorsOverZZ
-  resize(factorsOverZZ,nSlots);
-  for (long i = 0; i < nSlots; i++)
-    conv(factorsOverZZ[i], factors[i]);
+// The factors are written as the list of their lengths, followed by all
+// their coefficients (in [0,p^r)) in one packed array. Same for crtCoeffs.
+template<class RX>
+static void writePolys(ostream& str, const Vec<RX>& polys, long nBits)
+{
+  vector<long> lens(polys.length());
+  long total = 0;
+  for (long i=0; i<polys.length(); i++) total += (lens[i] = deg(polys[i])+1);
+  write_raw_vector(str, lens);
+
+  vector<long> coeffs(total);
+  long k = 0;
+  for (long i=0; i<polys.length(); i++)
+    for (long j=0; j<lens[i]; j++) coeffs[k++] = rep(coeff(polys[i], j));
+  write_raw_int(str, total);
+  write_packed_long_array(str, coeffs.data(), total, nBits);
+}
 
-  genCrtTable();
-  genMaskTable();
+// Assumes that the current modulus is the one the polys were written with
+template<class RX>
+static void readPolys(istream& str, Vec<RX>& polys)
+{
+  vector<long> lens;
+  read_raw_vector(str, lens);
+  long total = read_raw_int(str);
+  vector<long> coeffs(total);
+  read_packed_long_array(str, coeffs.data(), total);
+
+  polys.SetLength(lsize(lens));
+  long k = 0;
+  for (long i=0; i<lsize(lens); i++) {
+    assert(lens[i] >= 0 && k+lens[i] <= total);
+    polys[i].SetMaxLength(lens[i]);
+    clear(polys[i]);
+    for (long j=0; j<lens[i]; j++) SetCoeff(polys[i], j, coeffs[k++]);
+  }
+}
+
+// The nodes of a CRT tree and their polynomials
+template<class RX>
+static long memBytesTree(const shared_ptr< TNode<RX> >& node)
+{
+  if (!node) return 0;
+  return sizeof(TNode<RX>) + memBytes(node->data)
+    + memBytesTree(node->left) + memBytesTree(node->right);
+}
+
+template<class type>
+long PAlgebraModDerived<type>::memoryUsage() const
+{
+  return sizeof(*this) + memBytes(factors) + memBytes(factorsOverZZ)
+    + memBytes(crtCoeffs) + memBytes(maskTable) + memBytes(crtTable)
+    + memBytesTree(crtTree);
+}
+
+template<class type>
+void PAlgebraModDerived<type>::writeFactors(ostream& str) const
+{
+  long nBits = NumBits(pPowR-1);
+  write_raw_int(str, r);
+  writePolys(str, factors, nBits);
+  writePolys(str, crtCoeffs, nBits);
+}
+
+template<class type>
+void PAlgebraModDerived<type>::readFactors(istream& str)
+{
+  long rr = read_raw_int(str);
+  assert(rr == r);
+
+  SetModulus(pPowR);
+  pPowRContext.save();
+  readPolys(str, factors);
+  readPolys(str, crtCoeffs);
+
+  long nSlots = zMStar.getNSlots();
+  assert(factors.length() == nSlots && crtCoeffs.length() == nSlots);
+
+  RX phimxmod;
+  conv(phimxmod, zMStar.getPhimX());
+  build(PhimXMod, phimxmod);
 }
 
 // Assumes current zz_p modulus is p^r
@@ -484,8 +600,7 @@ void PAlgebraModDerived<type>::CRT_decompose(vector<RX>& crt, const RX& H) const
     return;
   }
   resize(crt,nSlots);
-  for (long i=0; i<nSlots; i++)
-    rem(crt[i], H, factors[i]); // crt[i] = H % factors[i]
+  remTree(crt, H, crtTree, 0, nSlots); // crt[i] = H % factors[i]
 }
 
 template<class type>
@@ -872,8 +987,8 @@ void PAlgebraModDerived<type>::genMaskTable()
   // This is only called by the constructor, which has already
   // set the zz_p context
 
-  RX tmp1;
-  
+  // The terms PhimX/Fk * crtCoeffs[k] are the entries of crtTable, which
+  // genCrtTable has already computed
   resize(maskTable,zMStar.numOfGens());
   for (long i = 0; i < (long)zMStar.numOfGens(); i++) {
     long ord = zMStar.OrderOf(i);
@@ -884,11 +999,8 @@ void PAlgebraModDerived<type>::genMaskTable()
       // Note: maskTable[i][0] = constant 1, maskTable[i][ord] = constant 0
       maskTable[i][j] = maskTable[i][j+1];
       for (long k = 0; k < (long)zMStar.getNSlots(); k++) {
-         if (zMStar.coordinate(i, k) == j) {
-           div(tmp1, PhimXMod, factors[k]);
-           mul(tmp1, tmp1, crtCoeffs[k]);
-           add(maskTable[i][j], maskTable[i][j], tmp1);
-         }
+         if (zMStar.coordinate(i, k) == j)
+           add(maskTable[i][j], maskTable[i][j], crtTable[k]);
       }
     }
     maskTable[i][0] = 1;
@@ -906,11 +1018,15 @@ void PAlgebraModDerived<type>::genCrtTable()
 
   long nslots = zMStar.getNSlots();
   resize(crtTable,nslots);
-  for (long i = 0; i < nslots; i++) {
+  RContext ctx; ctx.save();
+  FHE_EXEC_RANGE(nslots, first, last)
+  RBak bak; bak.save(); ctx.restore();
+  for (long i = first; i < last; i++) {
     RX allBut_i = PhimXMod / factors[i]; // = \prod_{j \ne i }Fj
     allBut_i *= crtCoeffs[i]; // = 1 mod Fi and = 0 mod Fj for j \ne i
     crtTable[i] = allBut_i;
   }
+  FHE_EXEC_RANGE_END
 
   buildTree(crtTree, 0, nslots);
 }
@@ -953,6 +1069,22 @@ void PAlgebraModDerived<type>::evalTree(RX& res,
   }
 }
 
+template<class type> 
+void PAlgebraModDerived<type>::remTree(vector<RX>& crt, const RX& H,
+              shared_ptr< TNode<RX> > tree,
+              long offset, long extent) const
+{
+  RX rH;
+  rem(rH, H, tree->data); // divisions by the large products use the FFT
+  if (extent == 1)
+    crt[offset] = rH;
+  else {
+    long half = extent/2;
+    remTree(crt, rH, tree->left, offset, half);
+    remTree(crt, rH, tree->right, offset+half, extent-half);
+  }
+}
+
 // Explicit instantiation
 
 template class PAlgebraModDerived<PA_GF2>;
@@ -44,6 +44,7 @@
  */
 #include <exception>
 #include <utility>
+#include <iostream>
 #include "NumbTh.h"
 #include "zzX.h"
 #include "cloned_ptr.h"
@@ -97,6 +98,9 @@ class PAlgebra {
   bool operator!=(const PAlgebra& other) const {return !(*this==other);}
   // comparison
 
+  //! The bytes of the tables, and of this object (see memoryUsage.h)
+  long memoryUsage() const;
+
   /* I/O methods */
 
   //! Prints the structure in a readable form
@@ -366,6 +370,13 @@ public:
 
   virtual zzX getMask_zzX(long i, long j) const = 0;
 
+  //! Write the factors of Phi_m(X) mod p^r and the CRT coefficients, so
+  //! that they can be restored without factoring (see buildPAlgebraMod)
+  virtual void writeFactors(std::ostream& str) const = 0;
+
+  //! The bytes of the factors, masks and CRT tables, and of this object
+  virtual long memoryUsage() const = 0;
+
 };
 
 #ifndef DOXYGEN_IGNORE
@@ -472,10 +483,15 @@ private:
 
   void genMaskTable();
   void genCrtTable();
+  void factorPhimX();                 // factor and lift Phi_m(X) mod p^r
+  void readFactors(std::istream& str); // or read them, as in writeFactors
 
 public:
 
-  PAlgebraModDerived(const PAlgebra& zMStar, long r);
+  //! If factorsStr is not null, the factors and CRT coefficients are read
+  //! from it (as written by writeFactors) instead of being computed
+  PAlgebraModDerived(const PAlgebra& zMStar, long r,
+                     std::istream* factorsStr=nullptr);
 
   PAlgebraModDerived(const PAlgebraModDerived& other) // copy constructor
   : zMStar(other.zMStar), r(other.r), pPowR(other.pPowR), 
@@ -484,6 +500,8 @@ public:
     RBak bak; bak.save(); restoreContext();
     PhimXMod = other.PhimXMod;
     factors = other.factors;
+    factorsOverZZ = other.factorsOverZZ;
+    crtCoeffs = other.crtCoeffs;
     maskTable = other.maskTable;
     crtTable = other.crtTable;
     crtTree = other.crtTree;
@@ -501,6 +519,8 @@ public:
     RBak bak; bak.save(); restoreContext();
     PhimXMod = other.PhimXMod;
     factors = other.factors;
+    factorsOverZZ = other.factorsOverZZ;
+    crtCoeffs = other.crtCoeffs;
     maskTable = other.maskTable;
     crtTable = other.crtTable;
     crtTree = other.crtTree;
@@ -570,6 +590,10 @@ public:
     return convert<zzX>(maskTable.at(i).at(j));
   }
 
+  void writeFactors(std::ostream& str) const override;
+
+  long memoryUsage() const override;
+
 
   ///@{
   //! @name Embedding in the plaintext slots and decoding back
@@ -579,6 +603,8 @@ public:
   //! In addition, when r > 1, G must be the monomial X (RX(1, 1))
 
   //! @brief Returns a std::vector crt[] such that crt[i] = H mod Ft (with t = T[i])
+  //! The remainders are computed down the product tree of the factors, for
+  //! O(M(phi(m)) log nSlots) operations instead of nSlots*phi(m).
   void CRT_decompose(std::vector<RX>& crt, const RX& H) const;
 
   //! @brief Returns H in R[X]/Phi_m(X) s.t. for every i<nSlots and t=T[i],
@@ -647,6 +673,12 @@ private:
   std::shared_ptr< TNode<RX> > tree,
   const std::vector<RX>& crt1,
   long offset, long extent) const;
+
+  //! The reverse of evalTree: crt[offset+i] = H mod factors[offset+i],
+  //! reducing H modulo the products at the nodes on the way down
+  void remTree(std::vector<RX>& crt, const RX& H,
+  std::shared_ptr< TNode<RX> > tree,
+  long offset, long extent) const;
 };
 
 //! A different derived class to be used for the approximate-numbers scheme
@@ -676,6 +708,11 @@ public:
   zzX getMask_zzX(long i, long j) const override
   { throw std::logic_error("PAlgebraModCx::getMask_zzX undefined"); }
 
+  // There is nothing to factor for the complex plaintext space
+  void writeFactors(std::ostream& str) const override {}
+
+  long memoryUsage() const override { return sizeof(*this); }
+
   // The scaling factor to use when encoding/decoding plaintext elements
   long encodeScalingFactor(long precision=0) const {
     assert(precision>=0 && precision<NTL_SP_BOUND);
@@ -690,8 +727,10 @@ public:
 };
 
 
-//! Builds a table, of type PA_GF2 if p == 2 and r == 1, and PA_zz_p otherwise
-PAlgebraModBase *buildPAlgebraMod(const PAlgebra& zMStar, long r);
+//! Builds a table, of type PA_GF2 if p == 2 and r == 1, and PA_zz_p otherwise.
+//! If factorsStr is not null, the factorization of Phi_m(X) is read from it.
+PAlgebraModBase *buildPAlgebraMod(const PAlgebra& zMStar, long r,
+                                  std::istream* factorsStr=nullptr);
 
 // A simple wrapper for a pointer to an object of type PAlgebraModBase.
 //
@@ -711,10 +750,11 @@ public:
   // assignment operator, and destructor will work correctly.
 
   explicit
-  PAlgebraMod(const PAlgebra& zMStar, long r) 
-  : rep( buildPAlgebraMod(zMStar, r) )
+  PAlgebraMod(const PAlgebra& zMStar, long r,
+              std::istream* factorsStr=nullptr)
+  : rep( buildPAlgebraMod(zMStar, r, factorsStr) )
   { }
-  // constructor
+  // constructor, see buildPAlgebraMod
 
   //! Downcast operator
   //! example: const PAlgebraModDerived<PA_GF2>& rep = alMod.getDerived(PA_GF2());
@@ -753,6 +793,11 @@ public:
 
   zzX getMask_zzX(long i, long j) const { return rep->getMask_zzX(i, j); }
 
+  //! Write the factorization of Phi_m(X) mod p^r, for a context snapshot
+  void writeFactors(std::ostream& str) const { rep->writeFactors(str); }
+
+  long memoryUsage() const { return sizeof(*this) + rep->memoryUsage(); }
+
 };
 
 //! returns true if the palg parameters match the rest, false otherwise
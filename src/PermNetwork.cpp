@@ -10,11 +10,13 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 #include <NTL/ZZ.h>
+#include <NTL/BasicThreadPool.h>
 NTL_CLIENT
 #include "FHEContext.h"
 #include "Ctxt.h"
 #include "permutations.h"
 #include "EncryptedArray.h"
+#include "taskScheduler.h"
 
 ostream& operator<< (ostream &s, const PermNetwork &net)
 {
@@ -31,7 +33,7 @@ ostream& operator<< (ostream &s, const PermNetwork &net)
 void PermNetwork::setLayers4Leaf(long lyrIdx, const ColPerm& p,
 				 const Vec<long>& benesLvls, long gIdx,
 				 const SubDimension& leafData, 
-				 const Permut& map2cube)
+				 const Permut& map2cube, BenesNetworks* nets)
 {
 #ifdef DEBUG_PRINTOUT
   std::cerr << "Layer "<<lyrIdx<<", column-permutation="<< p << endl;
@@ -45,7 +47,7 @@ void PermNetwork::setLayers4Leaf(long lyrIdx, const ColPerm& p,
     isID[0] = !p.getShiftAmounts(shifts[0]);
   }
   else  // The general case of a multi-layer Benes network
-    p.getBenesShiftAmounts(shifts,isID,benesLvls);
+    p.getBenesShiftAmounts(shifts,isID,benesLvls,nets);
 
   // Copy the shift amounts to the right place in the bigger network,
   // renaming the slots from a linear array to the hyper cube
@@ -72,9 +74,24 @@ void PermNetwork::setLayers4Leaf(long lyrIdx, const ColPerm& p,
 
 // Build a full permutation network
 void PermNetwork::buildNetwork(const Permut& pi, const GeneratorTrees& trees)
+{
+  routes.clear();
+  build(pi, trees, false);
+}
+
+// Build it again for a new permutation, updating the Benes networks of
+// the columns that were kept by the previous call
+void PermNetwork::updateNetwork(const Permut& pi, const GeneratorTrees& trees)
+{
+  build(pi, trees, true);
+}
+
+void PermNetwork::build(const Permut& pi, const GeneratorTrees& trees,
+                        bool keepRoutes)
 {
   if (trees.numTrees()==0) { // the identity permutation, nothing to do
     layers.SetLength(0);
+    routes.clear();
     return;
   }
 
@@ -104,6 +121,10 @@ void PermNetwork::buildNetwork(const Permut& pi, const GeneratorTrees& trees)
   //  }
 
   layers.SetLength(trees.numLayers()); // allocate space
+  if (keepRoutes && routes.size() != perms.size()) { // a different shape
+    routes.clear();
+    routes.resize(perms.size());
+  }
 
   // Go over the different permutations and build the corresponding layers
   long dimIdx =0;
@@ -124,7 +145,8 @@ void PermNetwork::buildNetwork(const Permut& pi, const GeneratorTrees& trees)
 		     /*Benes levels   =*/leafData.frstBenes,
 		     /*generator index=*/T.getAuxKey(),
 		     /*(size,good,e)  =*/leafData,
-		     /*hypercube renaming permutation=*/trees.mapToCube());
+		     /*hypercube renaming permutation=*/trees.mapToCube(),
+		     /*column networks=*/keepRoutes? &routes[dimIdx] : nullptr);
       frntLyr += leafData.frstBenes.length(); // how many layers were used
       dimIdx++;
 
@@ -136,7 +158,8 @@ void PermNetwork::buildNetwork(const Permut& pi, const GeneratorTrees& trees)
 		       /*Benes levels   =*/leafData.scndBenes,
 		       /*generator index=*/T.getAuxKey(),
 		       /*(size,good,e)  =*/leafData,
-		       /*hypercube renaming permutation=*/trees.mapToCube());
+		       /*hypercube renaming permutation=*/trees.mapToCube(),
+		       /*column networks=*/keepRoutes? &routes[dimIdx2] : nullptr);
       }
     }
   }
@@ -204,10 +227,15 @@ makeMask(vector<long>& mask, Vec<long>& haystack, long needle)
   return std::make_pair(fstNonZeroIdx,found);
 }
 
-// Apply a permutation network to a ciphertext
+// Apply a permutation network to a ciphertext.
+// The rotations of each layer are all applied to the same input, so they
+// share one digit decomposition (see BasicAutomorphPrecon). Rather than
+// masking and then rotating, we rotate c and multiply by the rotated mask,
+// using rho(mask*c) = rho(mask)*rho(c) for an automorphism rho.
 void PermNetwork::applyToCtxt(Ctxt& c, const EncryptedArray& ea) const
 {
   const PAlgebra& al = ea.getPAlgebra();
+  const FHEcontext& context = c.getContext();
 
   // Apply the layers, one at a time
   for (long i=0; i<layers.length(); i++) {
@@ -217,33 +245,48 @@ void PermNetwork::applyToCtxt(Ctxt& c, const EncryptedArray& ea) const
     // This layer is shifted via powers of g^e mod m
     long g2e = PowerMod(al.ZmStarGen(lyr.genIdx), lyr.e, al.getM());
 
+    // Collect the automorphisms and encoded masks of this layer. The
+    // encoding uses the current NTL modulus, so it is done serially.
     Vec<long> unused = lyr.shifts; // copy to a new vector
     vector<long> mask(lyr.shifts.length());  // buffer to hold masks
-    Ctxt sum(c.getPubKey(), c.getPtxtSpace()); // an empty ciphertext
-
+    vector<long> vals;
+    vector<ZZX> maskPolys;
     long shamt = 0;
-    bool frst = true;
     while (true) {
       pair<long,bool> ret=makeMask(mask, unused, shamt); // compute mask
       if (ret.second) { // non-empty mask
-	Ctxt tmp = c;
-	ZZX maskPoly;
-	ea.encode(maskPoly, mask);    // encode mask as polynomial
-	tmp.multByConstant(maskPoly); // multiply by mask
-	if (shamt!=0) // rotate if the shift amount is nonzero
-	  tmp.smartAutomorph(PowerMod(g2e, shamt, al.getM()));
-	if (frst) {
-	  sum = tmp;
-	  frst = false;
-	}
-	else
-	  sum += tmp;
+        vals.push_back(PowerMod(g2e, shamt, al.getM()));
+        maskPolys.emplace_back();
+        ea.encode(maskPolys.back(), mask); // encode mask as polynomial
       }
       if (ret.first >= 0)
 	shamt = unused[ret.first]; // next shift amount to use
 
       else break; // unused is all-zero, done with this layer
     }
+    if (vals.empty()) continue; // should not happen
+
+    // Rotate the unmasked c by all the shift amounts, in parallel
+    vector<shared_ptr<Ctxt>> rotated;
+    {
+      BasicAutomorphPrecon precon(c);
+      precon.automorph(rotated, vals);
+    }
+
+    // Multiply each rotation by its rotated mask, also in parallel
+    long n = vals.size();
+    FHE_EXEC_RANGE(n, first, last)
+      for (long j: range(first, last)) {
+        Ctxt& tmp = *rotated[j];
+        DoubleCRT dcrt(maskPolys[j], context, tmp.getPrimeSet());
+        if (vals[j] != 1) dcrt.automorph(vals[j]);
+        tmp.multByConstant(dcrt);
+      }
+    FHE_EXEC_RANGE_END
+
+    Ctxt& sum = *rotated[0];
+    for (long j=1; j<n; j++)
+      sum += *rotated[j];
     c = sum; // update the cipehrtext c before the next layer
   }
 }
@@ -53,6 +53,7 @@ template<typename T> void setLengthZero(PtrMatrix<T>& v){v.resize(0);}
 //struct PtrMatrix_vector; // std::vector<std::vector<T>>
 //struct PtrMatrix_ptVec;    // NTL::Vec<NTL::Vec<T>*>
 //struct PtrMatrix_ptvector; // std::vector<std::vector<T>*>
+//struct PtrMatrix_PtPtrVector; // std::vector<PtrVector<T>*>
 
 #include <initializer_list>
 template<typename T>
@@ -181,4 +182,16 @@ struct PtrMatrix_ptvector : PtrMatrix<T> {
   { return rows[i]; }
   long size() const override { return lsize(rows); }    // How many rows
 };
+//! @brief An implementation of PtrMatrix using vector< PtrVector<T>* >
+template<typename T>
+struct PtrMatrix_PtPtrVector : PtrMatrix<T> {
+  std::vector< PtrVector<T>* >& rows;
+  PtrMatrix_PtPtrVector(std::vector< PtrVector<T>* >& mat): rows(mat) {}
+  PtrVector<T>& operator[](long i) override             // returns a row
+  { return *rows[i]; }
+  const PtrVector<T>& operator[](long i) const override // returns a row
+  { return *rows[i]; }
+  long size() const override { return lsize(rows); }    // How many rows
+};
+
 #endif // _PTRMATRIX_H
@@ -122,6 +122,19 @@ void vecCopy(PtrVector<T>& v1, const V& v2, long sizeLimit=0)
     for (int i=0; i<n; i++) *(v1[i]) = v2[i];
   }
 }
+// Move the entries of a temporary std::vector rather than copy them
+template<typename T>
+void vecCopy(PtrVector<T>& v1, std::vector<T>&& v2, long sizeLimit=0)
+{
+  int n = lsize(v2);
+  if (sizeLimit>0 && sizeLimit<n) n = sizeLimit;
+  if (n==0)
+    setLengthZero(v1);
+  else {
+    resize(v1, n, v2[0]);
+    for (int i=0; i<n; i++) *(v1[i]) = std::move(v2[i]);
+  }
+}
 template<typename T> // V is either Vec<T> or vector<T>
 void vecCopy(PtrVector<T>& v1, const PtrVector<T>& v2, long sizeLimit=0)
 {
@@ -0,0 +1,318 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* RowSlab.cpp - fixed-length rows of longs in one cache-aligned buffer
+ *
+ * The rows are kept in increasing order of their index, the i'th row
+ * starting at slab + pos[i]*stride. Inserting or removing rows moves the
+ * surviving rows to their new slots, reallocating only when the buffer
+ * is too small to hold the new index set.
+ */
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include "RowSlab.h"
+#include "costModel.h"
+#include "memoryUsage.h"
+#include "numa.h"
+
+NTL_CLIENT
+
+// The number of longs in one alignment unit
+static const long slabUnit = FHE_SLAB_ALIGN / sizeof(long);
+
+//======================== SlabBuffer ========================
+
+namespace {
+// The freed buffers of one thread, returned to the allocator at thread exit
+const long slabPoolMaxBufs = 64; // keeps the best-fit scan short
+
+thread_local bool slabPoolAlive = false; // false after the thread's pool died
+
+struct PooledBuffer {
+  long *p;
+  long len;
+  bool counted; // in the pooled bytes of memoryUsage.h
+};
+
+struct SlabPool {
+  std::vector<PooledBuffer> bufs;
+  long bytes = 0;
+  SlabPool() { slabPoolAlive = true; }
+  ~SlabPool() {
+    slabPoolAlive = false;
+    for (auto& b: bufs) {
+      if (b.counted)
+        countSlabBytes(b.len*sizeof(long), SLAB_POOLED, SLAB_UNCOUNTED);
+      delete[] b.p;
+    }
+  }
+};
+thread_local SlabPool slabPool;
+} // anonymous namespace
+
+SlabBuffer::SlabBuffer(long n, long nRows)
+  : p(NULL), len(0), rows(0), counted(false)
+{
+  if (n <= 0) return;
+  if (nRows > 0 && takeLiveRows(nRows)) rows = nRows;
+  counted = isSlabMemoryCounting();
+
+  // Take the smallest pooled buffer that fits, if it is not too wasteful
+  std::vector<PooledBuffer>& bufs = slabPool.bufs;
+  long best = -1;
+  for (long i: range(bufs.size()))
+    if (bufs[i].len >= n && bufs[i].len <= 2*n
+        && (best < 0 || bufs[i].len < bufs[best].len))
+      best = i;
+  if (best >= 0) {
+    p = bufs[best].p;
+    len = bufs[best].len;
+    slabPool.bytes -= len*sizeof(long);
+    if (counted || bufs[best].counted)
+      countSlabBytes(len*sizeof(long),
+                     bufs[best].counted? SLAB_POOLED : SLAB_UNCOUNTED,
+                     counted? SLAB_LIVE : SLAB_UNCOUNTED);
+    bufs[best] = bufs.back();
+    bufs.pop_back();
+    return;
+  }
+  p = new long[n];
+  len = n;
+  if (counted) countSlabBytes(len*sizeof(long), SLAB_UNCOUNTED, SLAB_LIVE);
+}
+
+void SlabBuffer::release() noexcept
+{
+  if (rows > 0) {
+    releaseLiveRows(rows);
+    rows = 0;
+  }
+  if (p == NULL) return;
+  long nBytes = len*sizeof(long);
+  SlabState from = counted? SLAB_LIVE : SLAB_UNCOUNTED;
+  counted = false;
+  // a buffer freed by a static object after thread exit just goes away
+  if (slabPoolAlive && slabPool.bufs.size() < slabPoolMaxBufs
+      && slabPool.bytes + nBytes <= FHE_SLAB_POOL_BYTES) {
+    try {
+      bool pooledCounted = isSlabMemoryCounting();
+      slabPool.bufs.push_back(PooledBuffer{p, len, pooledCounted});
+      slabPool.bytes += nBytes;
+      if (from == SLAB_LIVE || pooledCounted)
+        countSlabBytes(nBytes, from,
+                       pooledCounted? SLAB_POOLED : SLAB_UNCOUNTED);
+      p = NULL; len = 0;
+      return;
+    }
+    catch (...) {} // could not grow the pool, free the buffer
+  }
+  if (from == SLAB_LIVE) countSlabBytes(nBytes, from, SLAB_UNCOUNTED);
+  delete[] p;
+  p = NULL; len = 0;
+}
+
+//======================== RowSlab ========================
+
+RowSlab::RowSlab(long _rowLen)
+  : rowLen(_rowLen), capacity(0), slab(NULL)
+{
+  assert(rowLen >= 0);
+  stride = ((rowLen + slabUnit - 1) / slabUnit) * slabUnit;
+}
+
+RowSlab::RowSlab(const RowSlab& other)
+  : rowLen(other.rowLen), stride(other.stride), capacity(0), slab(NULL)
+{
+  *this = other;
+}
+
+RowSlab::RowSlab(RowSlab&& other) noexcept
+  : rowLen(other.rowLen), stride(other.stride), capacity(other.capacity),
+    indexSet(std::move(other.indexSet)), pos(std::move(other.pos)),
+    raw(std::move(other.raw)), slab(other.slab),
+    backing(std::move(other.backing))
+{
+  other.capacity = 0;
+  other.slab = NULL;
+  other.pos.clear();
+}
+
+RowSlab& RowSlab::operator=(RowSlab&& other) noexcept
+{
+  if (this == &other) return *this;
+
+  rowLen = other.rowLen;
+  stride = other.stride;
+  capacity = other.capacity;
+  indexSet = std::move(other.indexSet);
+  pos = std::move(other.pos);
+  raw = std::move(other.raw); // our old buffer goes back to the pool
+  slab = other.slab;
+  backing = std::move(other.backing);
+
+  other.capacity = 0;
+  other.slab = NULL;
+  other.pos.clear();
+  return *this;
+}
+
+void RowSlab::allocate(long n)
+{
+  // over-allocate by one alignment unit, then round the pointer up
+  raw = SlabBuffer(n*stride + slabUnit, n);
+  uintptr_t addr = reinterpret_cast<uintptr_t>(raw.get());
+  uintptr_t pad = (FHE_SLAB_ALIGN - addr % FHE_SLAB_ALIGN) % FHE_SLAB_ALIGN;
+  slab = raw.get() + pad/sizeof(long);
+  // a recycled buffer may hold more than n rows
+  capacity = (stride > 0)? (raw.size() - slabUnit)/stride : n;
+  if (isNumaPlacingRows()) numaPlaceRows(slab, stride, n, /*move=*/false);
+}
+
+long RowSlab::computePositions(const IndexSet& s, vector<long>& p) const
+{
+  p.assign(s.last()+1, -1);
+  long n = 0;
+  for (long i: s) p[i] = n++;
+  return n;
+}
+
+void RowSlab::detach()
+{
+  long n = indexSet.card();
+  const long *src = slab;
+  std::shared_ptr<const void> keep; // hold the view until we copied it
+  keep.swap(backing);
+
+  allocate(n);
+  if (n > 0)
+    std::memcpy(slab, src, n*stride*sizeof(long));
+}
+
+void RowSlab::attachView(const IndexSet& s, const long* data,
+                         shared_ptr<const void> keep)
+{
+  assert(reinterpret_cast<uintptr_t>(data) % FHE_SLAB_ALIGN == 0);
+  raw = SlabBuffer();
+  indexSet = s;
+  capacity = computePositions(s, pos);
+  slab = const_cast<long*>(data); // never written while backing is set
+  backing = std::move(keep);
+}
+
+RowSlab& RowSlab::operator=(const RowSlab& other)
+{
+  if (this == &other) return *this;
+
+  if (other.backing) { // share the view rather than copy it
+    rowLen = other.rowLen;
+    stride = other.stride;
+    raw = SlabBuffer();
+    capacity = other.capacity;
+    slab = other.slab;
+    backing = other.backing;
+    indexSet = other.indexSet;
+    pos = other.pos;
+    return *this;
+  }
+  if (backing) { // our memory is not ours to overwrite
+    backing.reset();
+    capacity = 0;
+  }
+
+  long n = other.indexSet.card();
+  if (rowLen != other.rowLen) { // the buffer cannot be reused
+    rowLen = other.rowLen;
+    stride = other.stride;
+    capacity = 0;
+  }
+  if (n > capacity) allocate(n);
+
+  // both slabs have the same layout, so copy everything in one go
+  if (n > 0)
+    std::memcpy(slab, other.slab, n*stride*sizeof(long));
+
+  indexSet = other.indexSet;
+  pos = other.pos;
+  return *this;
+}
+
+void RowSlab::insert(const IndexSet& s)
+{
+  IndexSet added = s / indexSet;
+  if (empty(added)) return;
+  if (backing) detach();
+
+  IndexSet newSet = indexSet | added;
+  vector<long> newPos;
+  long n = computePositions(newSet, newPos);
+
+  if (n > capacity) { // copy the existing rows to a fresh buffer
+    SlabBuffer oldRaw(std::move(raw));
+    long *oldSlab = slab;
+    allocate(n);
+    for (long i: indexSet)
+      std::memcpy(slab + newPos[i]*stride, oldSlab + pos[i]*stride,
+                  rowLen*sizeof(long));
+  }
+  else {
+    // Move rows up in place, starting from the last one. Since
+    // newPos[i] >= pos[i], a row is never overwritten before it is moved.
+    for (long i = indexSet.last(); i >= indexSet.first(); i = indexSet.prev(i))
+      if (newPos[i] != pos[i])
+        std::memcpy(slab + newPos[i]*stride, slab + pos[i]*stride,
+                    rowLen*sizeof(long));
+  }
+
+  for (long i: added)
+    std::memset(slab + newPos[i]*stride, 0, rowLen*sizeof(long));
+
+  indexSet = newSet;
+  pos.swap(newPos);
+}
+
+void RowSlab::remove(const IndexSet& s)
+{
+  IndexSet newSet = indexSet / s;
+  if (newSet == indexSet) return;
+  if (backing) detach();
+
+  vector<long> newPos;
+  computePositions(newSet, newPos);
+
+  // Move rows down in place, starting from the first one
+  for (long i: newSet)
+    if (newPos[i] != pos[i])
+      std::memcpy(slab + newPos[i]*stride, slab + pos[i]*stride,
+                  rowLen*sizeof(long));
+
+  indexSet = newSet;
+  pos.swap(newPos);
+}
+
+long RowSlab::memoryUsage() const
+{
+  long n = sizeof(RowSlab) + indexSet.memoryUsage() - sizeof(IndexSet)
+           + pos.capacity()*sizeof(long);
+  if (!backing) n += raw.size()*sizeof(long);
+  return n;
+}
+
+bool RowSlab::operator==(const RowSlab& other) const
+{
+  if (indexSet != other.indexSet) return false;
+  if (rowLen != other.rowLen) return false;
+
+  for (long i: indexSet)
+    if (!std::equal((*this)[i], (*this)[i]+rowLen, other[i]))
+      return false;
+  return true;
+}
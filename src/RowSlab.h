@@ -0,0 +1,186 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _RowSlab_H_
+#define _RowSlab_H_
+/**
+ * @file RowSlab.h
+ * @brief Fixed-length rows of longs, indexed by an IndexSet, all kept
+ * in a single cache-aligned allocation.
+ **/
+#include <memory>
+#include "IndexSet.h"
+
+//! Alignment (in bytes) of the slab and of every row in it
+#define FHE_SLAB_ALIGN (64)
+
+//! Upper bound (in bytes) on the freed buffers that each thread keeps for
+//! reuse, see SlabBuffer. Define it as 0 to always go to the allocator.
+#ifndef FHE_SLAB_POOL_BYTES
+#define FHE_SLAB_POOL_BYTES (64L << 20)
+#endif
+
+/**
+ * @class SlabBuffer
+ * @brief An owned array of longs, recycled through a per-thread pool.
+ *
+ * Ciphertext operations create and destroy many temporary DoubleCRT's of
+ * the same few sizes. When a SlabBuffer is destroyed its memory goes to a
+ * small pool of the current thread (up to FHE_SLAB_POOL_BYTES), and a new
+ * SlabBuffer takes a large-enough buffer from that pool if there is one,
+ * so the hot loops rarely reach malloc or fault in fresh pages.
+ *
+ * A buffer can also hold rows of a RowSlab, which are counted as live
+ * rows by an installed CostCounter (see costModel.h). Its bytes are
+ * counted by the counters of memoryUsage.h when those are on.
+ **/
+class SlabBuffer {
+  long *p;
+  long len;
+  long rows;    // the live rows that were counted for this buffer
+  bool counted; // in the live bytes of memoryUsage.h
+public:
+  SlabBuffer() : p(NULL), len(0), rows(0), counted(false) {}
+  //! @brief At least n longs, uninitialized, that hold nRows rows
+  explicit SlabBuffer(long n, long nRows=0);
+  ~SlabBuffer() { release(); }
+
+  SlabBuffer(SlabBuffer&& other) noexcept
+    : p(other.p), len(other.len), rows(other.rows), counted(other.counted)
+  { other.p = NULL; other.len = 0; other.rows = 0; other.counted = false; }
+  SlabBuffer& operator=(SlabBuffer&& other) noexcept {
+    if (this != &other) {
+      release();
+      p = other.p; len = other.len; rows = other.rows;
+      counted = other.counted;
+      other.p = NULL; other.len = 0; other.rows = 0; other.counted = false;
+    }
+    return *this;
+  }
+  SlabBuffer(const SlabBuffer&) = delete;
+  SlabBuffer& operator=(const SlabBuffer&) = delete;
+
+  long* get() const { return p; }
+  long size() const { return len; }
+
+  //! @brief Give the memory back to the pool of the current thread
+  void release() noexcept;
+};
+
+/**
+ * @class RowSlab
+ * @brief A map from a dynamic IndexSet to rows of rowLen longs each.
+ *
+ * This plays the same role as IndexMap<vec_long>, but all the rows live in
+ * one FHE_SLAB_ALIGN-aligned buffer, in increasing order of their index.
+ * The distance between consecutive rows (the stride) is rowLen rounded up
+ * to a multiple of FHE_SLAB_ALIGN bytes, so every row starts on an aligned
+ * address. Rows are accessed through raw pointers, obtained in constant time
+ * from the index of the row.
+ *
+ * Removing rows compacts the slab in place and keeps the buffer, so that a
+ * subsequent insertion of the same number of rows (e.g., dropping and
+ * re-adding the special primes) does not go back to the allocator.
+ *
+ * A slab can also be a read-only view of memory that it does not own (e.g.,
+ * a memory-mapped key file), kept alive by a shared handle. Copying a view
+ * gives another view of the same memory, and the first non-const access or
+ * modification of a view copies the rows into a private buffer.
+ **/
+class RowSlab {
+  long rowLen;     // number of entries in each row
+  long stride;     // distance (in longs) between consecutive rows
+  long capacity;   // number of rows that fit in the current buffer
+
+  IndexSet indexSet;      // the indexes of the rows that are present
+  std::vector<long> pos;  // pos[i] = slot of row i in the slab, -1 if absent
+
+  SlabBuffer raw;              // the allocation itself, possibly unaligned
+  long *slab;                  // the aligned start of the buffer
+
+  std::shared_ptr<const void> backing; // keeps alive the memory of a view
+
+  // Allocate a fresh (uninitialized) buffer for n rows
+  void allocate(long n);
+
+  // Copy the rows of a view into a private buffer
+  void detach();
+
+  // Recompute pos[] from indexSet, returns the number of rows
+  long computePositions(const IndexSet& s, std::vector<long>& p) const;
+
+public:
+
+  //! @brief An empty slab whose rows (when added) have rowLen entries
+  explicit RowSlab(long _rowLen=0);
+
+  RowSlab(const RowSlab& other);
+  RowSlab& operator=(const RowSlab& other);
+
+  //! @brief Moving takes over the buffer (or the view) of other,
+  //! leaving it empty with no buffer.
+  RowSlab(RowSlab&& other) noexcept;
+  RowSlab& operator=(RowSlab&& other) noexcept;
+
+  //! @brief Get the underlying index set
+  const IndexSet& getIndexSet() const { return indexSet; }
+
+  //! @brief Number of entries in each row
+  long getRowLength() const { return rowLen; }
+
+  //! @brief Distance (in longs) between the starts of consecutive rows
+  long getStride() const { return stride; }
+
+  //! @brief Access functions: will raise an error
+  //! if j does not belong to the current index set
+  long* operator[] (long j) {
+    assert(indexSet.contains(j));
+    if (backing) detach();
+    return slab + pos[j]*stride;
+  }
+  const long* operator[] (long j) const {
+    assert(indexSet.contains(j));
+    return slab + pos[j]*stride;
+  }
+
+  //! @brief Insert indexes to the IndexSet. New rows are set to zero.
+  void insert(long j) { insert(IndexSet(j)); }
+  void insert(const IndexSet& s);
+
+  //! @brief Delete indexes from IndexSet. The buffer is not released.
+  void remove(long j) { remove(IndexSet(j)); }
+  void remove(const IndexSet& s);
+
+  void clear() {
+    indexSet.clear();
+    pos.clear();
+    if (backing) { backing.reset(); capacity = 0; slab = NULL; }
+  }
+
+  //! @brief Make this a view of the rows in s, stored in increasing order
+  //! of their index, getStride() longs apart, starting at data (which must
+  //! be FHE_SLAB_ALIGN-aligned). The memory is never written through the
+  //! view, and keep is held for as long as any view of it exists.
+  void attachView(const IndexSet& s, const long* data,
+                  std::shared_ptr<const void> keep);
+
+  //! @brief Is this a view of memory that it does not own?
+  bool isView() const { return bool(backing); }
+
+  //! @brief The bytes of this slab, its own size included. The rows of a
+  //! view are not counted, the memory that they live in is shared.
+  long memoryUsage() const;
+
+  bool operator==(const RowSlab& other) const;
+  bool operator!=(const RowSlab& other) const { return !(*this == other); }
+};
+
+#endif // ifndef _RowSlab_H_
@@ -0,0 +1,493 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_Bench.cpp - microbenchmarks of the core kernels
+ *
+ * Every case is timed over a grid of parameter sets, modulus-chain sizes
+ * and thread counts. For each point we run one warm-up call, pick a number
+ * of iterations that takes at least minTime seconds, and then time reps
+ * such batches, reporting the mean, median, min, max and relative standard
+ * deviation of the time per call. With json=1 the results are printed as
+ * one JSON object, to be compared across commits.
+ *
+ * Only the call itself is timed: any per-call preparation (e.g., copying
+ * the input ciphertext that the call modifies) is excluded.
+ */
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <sstream>
+#include <NTL/ZZ.h>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "matmul.h"
+#include "polyEval.h"
+#include "intraSlot.h"
+#include "binaryArith.h"
+#include "tableLookup.h"
+#include "randomMatrices.h"
+#include "rowArith.h"
+
+// The parameter sets, all of them bootstrappable
+static long mValues[][14] = {
+// { p, phi(m),  m,    d, m1,  m2, m3,   g1,    g2,    g3,ord1,ord2,ord3, c_m}
+  {  2,    48,   105, 12,  3,  35,  0,    71,    76,    0,  2,  2,   0, 100},
+  {  2,   600,  1023, 10, 11,  93,  0,   838,   584,    0, 10,  6,   0, 100},
+  {  2,  2304,  4641, 24,  7,   3,221,  3979,  3095, 3760,  6,  2,  -8, 300},
+  {  2, 15004, 15709, 22, 23, 683,  0,  4099, 13663,    0, 22, 31,   0, 100},
+  {  2, 27000, 32767, 15, 31,   7,151, 11628, 28087, 25824, 30,  6, -10, 200}
+};
+static const long nParams = sizeof(mValues)/sizeof(mValues[0]);
+
+// Everything that the cases need, for one parameter set
+struct BenchEnv {
+  std::unique_ptr<FHEcontext> context;
+  std::unique_ptr<FHESecKey> secKey;
+  const EncryptedArray *ea;
+  std::vector<zzX> unpackSlotEncoding;
+  bool bootstrappable;
+  long L;
+
+  const FHEPubKey& pubKey() const { return *secKey; }
+
+  // An encryption of random slots in Z_{p^r} (so also a "thin" ciphertext)
+  void encryptRandom(Ctxt& c) const {
+    long p2r = context->alMod.getPPowR();
+    std::vector<long> v(ea->size());
+    for (long& x: v) x = RandomBnd(p2r);
+    ea->encrypt(c, pubKey(), v);
+  }
+
+  // Encryptions of the bits of a random nBits-bit number in every slot
+  void encryptBits(std::vector<Ctxt>& bits, long nBits) const {
+    bits.assign(nBits, Ctxt(pubKey()));
+    for (long i: range(nBits)) {
+      std::vector<long> v(ea->size());
+      for (long& x: v) x = RandomBits_long(1);
+      ea->encrypt(bits[i], pubKey(), v);
+    }
+  }
+};
+
+static void buildEnv(BenchEnv& env, long idx, long L, bool bootstrappable)
+{
+  long *vals = mValues[idx];
+  long p = vals[0], m = vals[2];
+  Vec<long> mvec;
+  for (long i=4; i<7; i++) if (vals[i]>1) append(mvec, vals[i]);
+  std::vector<long> gens, ords;
+  for (long i=7; i<10; i++) if (vals[i]>1) gens.push_back(vals[i]);
+  for (long i=10; i<13; i++) if (abs(vals[i])>1) ords.push_back(vals[i]);
+
+  env.L = L;
+  env.bootstrappable = bootstrappable;
+  env.context.reset(new FHEcontext(m, p, /*r=*/1, gens, ords));
+  env.context->zMStar.set_cM(vals[13]/100.0);
+  buildModChain(*env.context, L, /*c=*/3, bootstrappable);
+  if (bootstrappable)
+    env.context->makeBootstrappable(mvec, /*t=*/0, /*build_cache=*/false,
+                                    /*alsoThick=*/true);
+  env.ea = env.context->ea;
+  buildUnpackSlotEncoding(env.unpackSlotEncoding, *env.ea);
+
+  env.secKey.reset(new FHESecKey(*env.context));
+  env.secKey->GenSecKey(64);
+  addSome1DMatrices(*env.secKey);
+  addFrbMatrices(*env.secKey);
+  if (bootstrappable) env.secKey->genRecryptData();
+}
+
+// Runs and times the calls of one case
+class Sampler {
+  long reps;
+  double minTime;
+public:
+  long iters;
+  std::vector<double> samples; // seconds per call, one for each rep
+
+  Sampler(long _reps, double _minTime) :
+    reps(_reps), minTime(_minTime), iters(0) {}
+
+  template<class Body, class Prep>
+  void measure(const Body& body, const Prep& prep)
+  {
+    auto timeIt = [&]() {
+      prep();
+      auto start = std::chrono::steady_clock::now();
+      body();
+      std::chrono::duration<double> d = std::chrono::steady_clock::now()-start;
+      return d.count();
+    };
+
+    double t = timeIt(); // warm-up, also calibrates the number of iterations
+    iters = std::max(1L, long(ceil(minTime / std::max(t, 1e-9))));
+    iters = std::min(iters, 1000000L);
+
+    samples.clear();
+    for (long r=0; r<reps; r++) {
+      double total = 0;
+      for (long i=0; i<iters; i++) total += timeIt();
+      samples.push_back(total/iters);
+    }
+  }
+
+  template<class Body>
+  void measure(const Body& body) { measure(body, [](){}); }
+};
+
+//======================== the cases ========================
+
+static const Cmodulus& firstCtxtModulus(const FHEcontext& context)
+{
+  return context.ithModulus(context.ctxtPrimes.first());
+}
+
+static void benchFFT(BenchEnv& env, Sampler& s)
+{
+  const Cmodulus& cm = firstCtxtModulus(*env.context);
+  zzX x;
+  x.SetLength(env.context->zMStar.getPhiM());
+  for (long& c: x) c = RandomBnd(3) - 1;
+  vec_long y;
+  s.measure([&]() { cm.FFT(y, x); });
+}
+
+static void benchIFFT(BenchEnv& env, Sampler& s)
+{
+  const Cmodulus& cm = firstCtxtModulus(*env.context);
+  zzX x;
+  x.SetLength(env.context->zMStar.getPhiM());
+  for (long& c: x) c = RandomBnd(3) - 1;
+  vec_long y;
+  cm.FFT(y, x);
+  cm.restoreModulus();
+  zz_pX out;
+  s.measure([&]() { cm.iFFT(out, y); });
+}
+
+static void benchDCRTadd(BenchEnv& env, Sampler& s)
+{
+  DoubleCRT a(*env.context, env.context->ctxtPrimes), b(a);
+  a.randomize(); b.randomize();
+  s.measure([&]() { a += b; });
+}
+
+static void benchDCRTmul(BenchEnv& env, Sampler& s)
+{
+  DoubleCRT a(*env.context, env.context->ctxtPrimes), b(a);
+  a.randomize(); b.randomize();
+  s.measure([&]() { a *= b; });
+}
+
+// One term of a sum of products, as in MulAdd
+static void benchDCRTaddMul(BenchEnv& env, Sampler& s)
+{
+  DoubleCRT a(*env.context, env.context->ctxtPrimes), b(a), c(a);
+  a.randomize(); b.randomize(); c.randomize();
+  s.measure([&]() { a.addMul(b, c); });
+}
+
+// The inner product of a key-switching: 3 digits times their key parts, on
+// the rows of one prime
+static void benchMulAccRows(BenchEnv& env, Sampler& s)
+{
+  const Cmodulus& cm = firstCtxtModulus(*env.context);
+  long q = cm.getQ(), n = env.context->zMStar.getPhiM(), nTerms = 3;
+  std::vector<std::vector<long>> ys(nTerms), zs(nTerms);
+  std::vector<const long*> yp, zp;
+  for (long t: range(nTerms)) {
+    ys[t].resize(n);
+    zs[t].resize(n);
+    for (long j: range(n)) { ys[t][j] = RandomBnd(q); zs[t][j] = RandomBnd(q); }
+    yp.push_back(ys[t].data());
+    zp.push_back(zs[t].data());
+  }
+  std::vector<long> x(n);
+  s.measure([&]() {
+    mulAccRows(x.data(), yp.data(), zp.data(), nTerms, n, q, cm.getQInv());
+  });
+}
+
+static void benchDCRTautomorph(BenchEnv& env, Sampler& s)
+{
+  DoubleCRT a(*env.context, env.context->ctxtPrimes);
+  a.randomize();
+  long k = env.context->zMStar.ZmStarGen(0);
+  s.measure([&]() { a.automorph(k); });
+}
+
+static void benchDigits(BenchEnv& env, Sampler& s)
+{
+  DoubleCRT a(*env.context, env.context->ctxtPrimes);
+  a.randomize();
+  std::vector<DoubleCRT> digits;
+  long n = env.context->digits.size();
+  s.measure([&]() { a.breakIntoDigits(digits, n); });
+}
+
+// One key-switching (keySwitchPart), of the output of an automorphism
+static void benchKeySwitch(BenchEnv& env, Sampler& s)
+{
+  Ctxt c(env.pubKey()), t(env.pubKey());
+  env.encryptRandom(c);
+  long k = 0; // some automorphism that we have a key-switching matrix for
+  for (const KeySwitch& W: env.pubKey().keySWlist())
+    if (W.fromKey.getPowerOfS()==1 && W.fromKey.getPowerOfX()!=1) {
+      k = W.fromKey.getPowerOfX();
+      break;
+    }
+  assert(k != 0);
+  s.measure([&]() { t.reLinearize(); },
+            [&]() { t = c; t.automorph(k); });
+}
+
+static void benchMatMul(BenchEnv& env, Sampler& s)
+{
+  std::unique_ptr<MatMul1D> mat(buildRandomMatrix(*env.ea, 0));
+  MatMul1DExec exec(*mat);
+  Ctxt c(env.pubKey()), t(env.pubKey());
+  env.encryptRandom(c);
+  s.measure([&]() { exec.mul(t); }, [&]() { t = c; });
+}
+
+static void benchPolyEval(BenchEnv& env, Sampler& s)
+{
+  long p2r = env.context->alMod.getPPowR();
+  ZZX poly;
+  for (long i=0; i<=15; i++) SetCoeff(poly, i, RandomBnd(p2r));
+  Ctxt c(env.pubKey()), out(env.pubKey());
+  env.encryptRandom(c);
+  s.measure([&]() { polyEval(out, poly, c); });
+}
+
+static void benchReCrypt(BenchEnv& env, Sampler& s)
+{
+  Ctxt c(env.pubKey()), t(env.pubKey());
+  env.encryptRandom(c);
+  s.measure([&]() { env.pubKey().reCrypt(t); }, [&]() { t = c; });
+}
+
+static void benchThinReCrypt(BenchEnv& env, Sampler& s)
+{
+  Ctxt c(env.pubKey()), t(env.pubKey());
+  env.encryptRandom(c);
+  s.measure([&]() { env.pubKey().thinReCrypt(t); }, [&]() { t = c; });
+}
+
+static long benchBits = 8;
+
+static void benchAddNumbers(BenchEnv& env, Sampler& s)
+{
+  std::vector<Ctxt> a, b, sum;
+  env.encryptBits(a, benchBits);
+  env.encryptBits(b, benchBits);
+  s.measure([&]() {
+      CtPtrs_vectorCt sumWrapper(sum);
+      addTwoNumbers(sumWrapper, CtPtrs_vectorCt(a), CtPtrs_vectorCt(b),
+                    /*sizeLimit=*/0, &env.unpackSlotEncoding);
+    });
+}
+
+static void benchTableLookup(BenchEnv& env, Sampler& s)
+{
+  long inSize = std::min(benchBits, 7L);
+  std::vector<zzX> table;
+  buildLookupTable(table, [](double x){ return 1/(x+1.0); },
+                   inSize, /*scale_in=*/0, /*sign_in=*/0,
+                   inSize, /*scale_out=*/1-inSize, /*sign_out=*/0, *env.ea);
+  std::vector<Ctxt> idx;
+  env.encryptBits(idx, inSize);
+  Ctxt out(env.pubKey());
+  s.measure([&]() {
+      tableLookup(out, table, CtPtrs_vectorCt(idx), &env.unpackSlotEncoding);
+    });
+}
+
+struct BenchCase {
+  const char *name;
+  bool needsBootstrapping;
+  void (*run)(BenchEnv&, Sampler&);
+};
+
+static const BenchCase benchCases[] = {
+  { "FFT",            false, benchFFT },
+  { "iFFT",           false, benchIFFT },
+  { "DoubleCRT_add",  false, benchDCRTadd },
+  { "DoubleCRT_mul",  false, benchDCRTmul },
+  { "DoubleCRT_addMul", false, benchDCRTaddMul },
+  { "mulAccRows",     false, benchMulAccRows },
+  { "DoubleCRT_automorph", false, benchDCRTautomorph },
+  { "breakIntoDigits", false, benchDigits },
+  { "keySwitchPart",  false, benchKeySwitch },
+  { "MatMul1DExec",   false, benchMatMul },
+  { "polyEval",       false, benchPolyEval },
+  { "reCrypt",        true,  benchReCrypt },
+  { "thinReCrypt",    true,  benchThinReCrypt },
+  { "addTwoNumbers",  false, benchAddNumbers },
+  { "tableLookup",    false, benchTableLookup }
+};
+
+//======================== statistics and output ========================
+
+struct BenchStats {
+  double mean, median, min, max, stddev;
+
+  explicit BenchStats(std::vector<double> v) {
+    assert(!v.empty());
+    std::sort(v.begin(), v.end());
+    long n = v.size();
+    min = v[0];
+    max = v[n-1];
+    median = (n%2)? v[n/2] : (v[n/2-1]+v[n/2])/2;
+    mean = 0;
+    for (double x: v) mean += x;
+    mean /= n;
+    stddev = 0;
+    for (double x: v) stddev += (x-mean)*(x-mean);
+    stddev = (n>1)? sqrt(stddev/(n-1)) : 0;
+  }
+  double relStddev() const { return (mean>0)? stddev/mean : 0; }
+};
+
+struct BenchResult {
+  const char *name;
+  long m, phim, L, nPrimes, threads, iters;
+  std::vector<double> samples;
+};
+
+static void printJSON(ostream& str, const std::vector<BenchResult>& results,
+                      long reps, double minTime)
+{
+  str << "{\"reps\": " << reps << ", \"minTime\": " << minTime
+      << ", \"unit\": \"seconds per call\",\n \"results\": [";
+  for (long i: range(results.size())) {
+    const BenchResult& r = results[i];
+    BenchStats st(r.samples);
+    str << (i? ",\n" : "\n") << "  {\"case\": \"" << r.name << "\""
+        << ", \"m\": " << r.m << ", \"phim\": " << r.phim
+        << ", \"L\": " << r.L << ", \"nPrimes\": " << r.nPrimes
+        << ", \"threads\": " << r.threads << ", \"iters\": " << r.iters
+        << ", \"mean\": " << st.mean << ", \"median\": " << st.median
+        << ", \"min\": " << st.min << ", \"max\": " << st.max
+        << ", \"stddev\": " << st.stddev
+        << ", \"relStddev\": " << st.relStddev()
+        << ", \"samples\": [";
+    for (long j: range(r.samples.size()))
+      str << (j? ", " : "") << r.samples[j];
+    str << "]}";
+  }
+  str << "\n]}\n";
+}
+
+static void printText(ostream& str, const BenchResult& r)
+{
+  BenchStats st(r.samples);
+  str << "  " << r.name << ", m=" << r.m << ", L=" << r.L
+      << ", nt=" << r.threads << ": " << st.median << " sec/call (mean "
+      << st.mean << ", min " << st.min << ", max " << st.max << ", +-"
+      << (100*st.relStddev()) << "%, " << r.iters << " calls/rep)\n";
+}
+
+// Is name in the comma-separated list (or is the list "all")?
+static bool selected(const std::string& list, const char *name)
+{
+  if (list == "all") return true;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    if (item == name) return true;
+  return false;
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  std::string cases = "all";
+  amap.arg("cases", cases, "comma-separated cases to run, or all");
+  Vec<long> prms;
+  amap.arg("prms", prms, "parameter sets to use", "[0]");
+  amap.note("0-tiny (m=105),...,4-huge (m=32767)");
+  Vec<long> Ls;
+  amap.arg("Ls", Ls, "modulus-chain sizes (in bits)", "[600]");
+  Vec<long> nts;
+  amap.arg("nts", nts, "thread counts", "[1]");
+  long reps = 5;
+  amap.arg("reps", reps, "number of timed batches per case");
+  double minTime = 0.05;
+  amap.arg("minTime", minTime, "minimum duration of one batch (in seconds)");
+  amap.arg("bits", benchBits, "size of the numbers in the binary cases");
+  bool json = false;
+  amap.arg("json", json, "print the results as JSON");
+  bool list = false;
+  amap.arg("list", list, "list the cases and exit");
+  long seed = 0;
+  amap.arg("seed", seed, "PRG seed");
+  amap.parse(argc, argv);
+
+  if (list) {
+    for (const BenchCase& bc: benchCases) cout << bc.name << "\n";
+    return 0;
+  }
+  if (prms.length()==0) append(prms, 0L);
+  if (Ls.length()==0)   append(Ls, 600L);
+  if (nts.length()==0)  append(nts, 1L);
+  if (reps < 1) reps = 1;
+  SetSeed(ZZ(seed));
+
+  bool anyBoot = false;
+  for (const BenchCase& bc: benchCases)
+    if (bc.needsBootstrapping && selected(cases, bc.name)) anyBoot = true;
+
+  std::vector<BenchResult> results;
+  for (long idx: prms) {
+    if (idx < 0 || idx >= nParams) {
+      cerr << "bad parameter set " << idx << ", skipping\n";
+      continue;
+    }
+    for (long L: Ls) {
+      BenchEnv env;
+      SetNumThreads(1);
+      buildEnv(env, idx, L, anyBoot);
+      if (!json)
+        cout << "m=" << mValues[idx][2] << ", L=" << L << ", "
+             << env.context->ctxtPrimes.card() << " ctxt primes:\n";
+
+      for (long nt: nts) {
+        SetNumThreads(std::max(nt, 1L));
+        for (const BenchCase& bc: benchCases) {
+          if (!selected(cases, bc.name)) continue;
+          Sampler s(reps, minTime);
+          bc.run(env, s);
+
+          BenchResult r;
+          r.name = bc.name;
+          r.m = mValues[idx][2];
+          r.phim = mValues[idx][1];
+          r.L = L;
+          r.nPrimes = env.context->ctxtPrimes.card();
+          r.threads = AvailableThreads();
+          r.iters = s.iters;
+          r.samples = s.samples;
+          if (!json) printText(cout, r);
+          results.push_back(r);
+        }
+      }
+    }
+  }
+
+  if (json) printJSON(cout, results, reps, minTime);
+  return 0;
+}
@@ -11,6 +11,7 @@
  */
 #include <cstring>
 #include <fstream>
+#include <sstream>
 #include <utility>
 #include <unistd.h>
 
@@ -20,6 +21,12 @@
 #include "FHE.h"
 #include "timing.h"
 #include "EncryptedArray.h"
+#include "ctxtArchive.h"
+#include "checkpoint.h"
+#include "ctxtDataset.h"
+#include "binio.h"
+#include "matmul.h"
+#include "randomMatrices.h"
 
 NTL_CLIENT
 
@@ -122,6 +129,11 @@ int main(int argc, char *argv[])
   const char* asciiFile1 = "misc/iotest_ascii1.txt"; 
   const char* asciiFile2 = "misc/iotest_ascii2.txt"; 
   const char* binFile1 = "misc/iotest_bin.bin"; 
+  const char* mappedFile1 = "misc/iotest_mapped.bin";
+  const char* indexedFile1 = "misc/iotest_indexed.bin";
+  const char* checkpointPrefix = "misc/iotest_checkpoint";
+  const char* datasetFile1 = "misc/iotest_dataset.bin";
+  const char* snapshotFile1 = "misc/iotest_snapshot.bin";
   const char* otherEndianFileOut = "misc/iotest_ascii3.txt";  
 
   { // 1. Write ASCII and bin files. 
@@ -252,10 +264,366 @@ int main(int argc, char *argv[])
     }
     cout << "GOOD\n";
 
+    // The compact format, with and without a seed
+    Ctxt c3(*pubKey);
+    ea.encrypt(c3, *secKey, p2); // a fresh symmetric encryption
+    for (const Ctxt* c: {&c3, &c1}) {
+      stringstream ss, full;
+      c->writeCompact(ss);
+      c->write(full);
+      Ctxt c4(*pubKey);
+      c4.read(ss);
+      // without a seed both formats have the same packed rows
+      if (!c4.equalsTo(*c)
+          || (c == &c3 && ss.str().size() >= full.str().size())) {
+        cout << "BAD compact\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
+    // DoubleCRT rows are packed, and the 64-bit rows of older files load
+    {
+      DoubleCRT dc(*context);
+      dc.randomize();
+      const IndexSet& set = dc.getIndexSet();
+      long phim = context->zMStar.getPhiM();
+      stringstream packed, old;
+      dc.write(packed);
+      set.write(old);
+      for (long i: set)
+        write_raw_long_array(old, dc.getMap()[i], phim);
+      DoubleCRT dc2(*context), dc3(*context);
+      dc2.read(packed);
+      dc3.read(old);
+      if (dc2 != dc || dc3 != dc
+          || packed.str().size() >= old.str().size()) {
+        cout << "BAD packed rows\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
+    // Egress: as few primes as decryption needs
+    {
+      stringstream ss, compact;
+      c1.writeEgress(ss);
+      c1.writeCompact(compact);
+      Ctxt c4(*pubKey);
+      c4.read(ss);
+      PlaintextArray pp4(ea);
+      ea.decrypt(c4, *secKey, pp4);
+      if (!equals(ea, p1, pp4) || ss.str().size() > compact.str().size()
+          || !(c4.getPrimeSet() <= c1.getPrimeSet())) {
+        cout << "BAD egress\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
+    // Plaintext arrays and tables of encoded constants
+    {
+      vector<zzX> table(3);
+      ea.encode(table[0], p1);
+      ea.encode(table[1], p2);
+      table[2].SetLength(4, -5); // negative coefficients too
+      stringstream ss;
+      writePlaintextArray(ss, ea, p1);
+      write_raw_vector(ss, table);
+      PlaintextArray pp4(ea);
+      vector<zzX> table2;
+      readPlaintextArray(ss, ea, pp4);
+      read_raw_vector(ss, table2);
+      if (!equals(ea, p1, pp4) || table2 != table) {
+        cout << "BAD plaintext IO\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
+    // Recryption data that was never initialized, and the minimal flag of a
+    // block transformation, come back as they were
+    {
+      stringstream ss;
+      ThinRecryptData empty;
+      empty.write(ss);
+      std::unique_ptr<BlockMatMul1D> mat(buildRandomBlockMatrix(ea, 0));
+      BlockMatMul1DExec exec(*mat, /*minimal=*/true);
+      exec.write(ss);
+      ThinRecryptData empty2;
+      empty2.read(ss, *context);
+      BlockMatMul1DExec exec2(ea, ss);
+      if (empty2.alMod != NULL || empty2.coeffToSlot != NULL
+          || !exec2.minimal || exec2.strategy != exec.strategy) {
+        cout << "BAD recryption data or block transformation IO\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
+    // Batch symmetric encryption, streamed out in the compact format
+    {
+      vector<zzX> ptxts(3);
+      for (zzX& pt: ptxts) ea.encode(pt, p2);
+      vector<Ctxt> batch;
+      stringstream ss;
+      secKey->batchEncrypt(batch, ptxts, 0, &ss);
+      for (const Ctxt& c: batch) {
+        Ctxt c4(*pubKey);
+        c4.read(ss);
+        if (!c4.equalsTo(c)) {
+          cout << "BAD batch compact\n";
+          exit(EXIT_FAILURE);
+        }
+      }
+    }
+    cout << "GOOD\n";
+
+    // A chunked archive: streamed in order, and by random access
+    {
+      vector<Ctxt> cts(7, c1);
+      cts[3] = c2;
+      cts[6] = c3;
+      stringstream ss;
+      CtxtArchiveWriter writer(ss, /*chunkSize=*/3);
+      writer.append(vector<Ctxt>(cts.begin(), cts.begin()+5));
+      writer.append(vector<Ctxt>(cts.begin()+5, cts.end()));
+      writer.close();
+
+      CtxtArchiveReader reader(ss, *pubKey);
+      Ctxt c4(*pubKey);
+      reader.readAt(c4, 6);
+      bool ok = reader.size() == 7 && c4.equalsTo(c3);
+      vector<Ctxt> first, rest;
+      ok = ok && reader.next(first) == 3; // the first chunk alone
+      reader.readAll(rest);
+      first.insert(first.end(), rest.begin(), rest.end());
+      ok = ok && first.size() == cts.size();
+      for (long i=0; ok && i<lsize(cts); i++)
+        if (!first[i].equalsTo(cts[i])) ok = false;
+      if (!ok) {
+        cout << "BAD archive\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
+    // Checkpoints written in the background, then resumed from the latest
+    {
+      CtxtCheckpoint ckpt(checkpointPrefix, /*keep=*/2);
+      long n0 = ckpt.save(vector<Ctxt>(3, c1), "step 1");
+      ckpt.save(vector<Ctxt>(2, c2), "step 2");
+      long n2 = ckpt.save({c3, c1}, "step 3");
+      ckpt.wait();
+
+      CtxtCheckpoint other(checkpointPrefix);
+      vector<Ctxt> cts;
+      string state;
+      bool ok = other.latest() == n2 && other.resume(cts, state, *pubKey)
+        && state == "step 3" && cts.size() == 2
+        && cts[0].equalsTo(c3) && cts[1].equalsTo(c1)
+        && !ifstream(ckpt.fileName(n0)); // only the last two are kept
+      if (!ok) {
+        cout << "BAD checkpoint\n";
+        exit(EXIT_FAILURE);
+      }
+      if (cleanup) {
+        cleanupFiles(ckpt.fileName(n2-1).c_str(), ckpt.fileName(n2).c_str());
+        cleanupFiles((string(checkpointPrefix)+".latest").c_str());
+      }
+    }
+    cout << "GOOD\n";
+
+    // A mapped dataset, scanned with a cursor
+    {
+      writeCtxtDataset(datasetFile1, {c1, c2, c3});
+      CtxtDataset ds(datasetFile1, *pubKey);
+      CtxtDatasetCursor cursor(ds, /*first=*/0, /*last=*/-1, /*ahead=*/1);
+      const Ctxt* expected[] = {&c1, &c2, &c3};
+      Ctxt c4(*pubKey), sum(*pubKey);
+      long n = 0;
+      bool ok = ds.size() == 3;
+      while (ok && cursor.next(c4)) {
+        ok = c4.equalsTo(*expected[n++]);
+        sum += c4; // copies the parts out of the mapping
+      }
+      Ctxt direct(c1);
+      direct += c2;
+      direct += c3;
+      ok = ok && n == 3 && sum.equalsTo(direct) && ds[1].equalsTo(c2);
+      if (!ok) {
+        cout << "BAD dataset\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
+    // Scatter-gather messages, gathered and scattered through a buffer
+    {
+      auto gather = [](const WireMessage& msg) {
+        vector<WireSegment> segs;
+        msg.segments(segs);
+        string wire;
+        for (const WireSegment& seg: segs)
+          wire.append(static_cast<const char*>(seg.data), seg.len);
+        return wire;
+      };
+      auto scatter = [](const string& wire, long headerSize,
+                        const vector<WireBuffer>& body) {
+        long pos = headerSize;
+        for (const WireBuffer& buf: body) {
+          memcpy(buf.data, wire.data()+pos, buf.len);
+          pos += buf.len;
+        }
+        return pos == long(wire.size());
+      };
+      auto headerOf = [](const string& wire) {
+        long metaSize, bodySize;
+        readWirePrefix(wire.data(), metaSize, bodySize);
+        return wire.substr(0, BINIO_WIRE_PREFIX_SIZE + metaSize);
+      };
+
+      WireMessage msg;
+      c1.writeWire(msg);
+      string wire = gather(msg);
+      string header = headerOf(wire);
+      Ctxt c4(*pubKey);
+      vector<WireBuffer> body;
+      c4.readWire(header, body);
+      bool ok = scatter(wire, header.size(), body) && c4.equalsTo(c1);
+
+      const KeySwitch& W = pubKey->keySWlist().at(0);
+      W.writeWire(msg);
+      wire = gather(msg);
+      header = headerOf(wire);
+      KeySwitch W2;
+      W2.readWire(header, body, *context);
+      ok = ok && scatter(wire, header.size(), body) && W2 == W;
+      if (!ok) {
+        cout << "BAD wire\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
+    // The memory-mapped key file
+    writePubKeyMapped(mappedFile1, *pubKey);
+    {
+      FHEPubKey mappedKey(*context);
+      readPubKeyMapped(mappedFile1, mappedKey);
+      if (mappedKey != *pubKey) {
+        cout << "BAD mapped key\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
+    // The key-switching matrices packed in one buffer
+    {
+      FHEPubKey packedKey(*pubKey);
+      if (packKeySwitching(packedKey) <= 0 || packedKey != *pubKey) {
+        cout << "BAD packed key\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
+    // The indexed key files, read in parallel
+    {
+      FHEPubKey indexedPub(*context);
+      FHESecKey indexedSec(*context);
+      long calls = 0, last = 0;
+      writePubKeyIndexed(indexedFile1, *pubKey);
+      readPubKeyIndexed(indexedFile1, indexedPub,
+                        [&](long done, long total) { calls++; last = total; });
+      writeSecKeyIndexed(indexedFile1, *secKey);
+      readSecKeyIndexed(indexedFile1, indexedSec);
+      long n = pubKey->keySWlist().size();
+      if (indexedPub != *pubKey || indexedSec != *secKey
+          || calls != n || last != n) {
+        cout << "BAD indexed key\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
+    // The full snapshot, with the factorization of Phi_m(X)
+    writeContextSnapshot(snapshotFile1, *context);
+    {
+      std::unique_ptr<FHEcontext> snap = buildContextFromSnapshot(snapshotFile1);
+      if (*snap != *context || snap->alMod.getFactorsOverZZ()
+                               != context->alMod.getFactorsOverZZ()) {
+        cout << "BAD snapshot\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
+    // Stream a few more key-switching matrices out and read them back in
+    {
+      std::set<long> autos;
+      long m = context->zMStar.getM();
+      for (long t=2; t<m && autos.size()<2; t++)
+        if (context->zMStar.inZmStar(t) && !secKey->haveKeySWmatrix(1,t))
+          autos.insert(t);
+
+      FHEPubKey pkCopy(*pubKey);
+      stringstream ksStr;
+      secKey->streamKeySWmatrices(&ksStr);
+      addTheseMatrices(*secKey, autos);
+      secKey->streamKeySWmatrices(nullptr);
+
+      long n = pkCopy.readKeySWmatrices(ksStr);
+      pkCopy.setKeySwitchMap();
+      bool ok = (n == long(autos.size()));
+      for (long t: autos)
+        ok = ok && pkCopy.haveKeySWmatrix(1,t) && !secKey->haveKeySWmatrix(1,t);
+      if (!ok) {
+        cout << "BAD streamed matrices\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
+    // Export the re-linearization matrices as a key of their own, then add
+    // the matrices of two automorphisms to it
+    {
+      vector<long> autos;
+      for (const KeySwitch& W: secKey->keySWlist())
+        if (W.fromKey.getPowerOfS() == 1 && W.fromKey.getPowerOfX() != 1
+            && W.toKeyID == 0 && autos.size() < 2)
+          autos.push_back(W.fromKey.getPowerOfX());
+      assert(autos.size() == 2);
+
+      stringstream base, more;
+      vector<long> relin = secKey->selectKeySWmatrices({}, 0, true);
+      vector<long> first = secKey->selectKeySWmatrices({autos[0]}, 0, false);
+      vector<long> second = secKey->selectKeySWmatrices({autos[1]}, 0, false);
+      writePubKeySubset(base, *secKey, relin);
+      secKey->writeKeySWmatrices(more, first);
+      secKey->writeKeySWmatrices(more, second);
+
+      FHEPubKey worker(*context);
+      readPubKeyBinary(base, worker);
+      bool ok = !relin.empty() && worker.haveKeySWmatrix(2,1)
+        && !worker.isReachable(autos[0]) && !worker.isReachable(autos[1]);
+      long n = worker.readKeySWmatrices(more);
+      worker.setKeySwitchMap();
+      ok = ok && n == long(first.size() + second.size())
+        && worker.isReachable(autos[0]) && worker.isReachable(autos[1])
+        && worker.keySWlist().size() < secKey->keySWlist().size();
+      if (!ok) {
+        cout << "BAD key subset\n";
+        exit(EXIT_FAILURE);
+      }
+    }
+    cout << "GOOD\n";
+
     if(cleanup) {
       if (!noPrint)
         cout << "Clean up. Deleting created files." << endl;
-      cleanupFiles(asciiFile1, asciiFile2, binFile1);     
+      cleanupFiles(asciiFile1, asciiFile2, binFile1, mappedFile1,
+                   indexedFile1, datasetFile1, snapshotFile1);
     }
   }
   { // 5. Read in binary from opposite little endian and print ASCII and compare
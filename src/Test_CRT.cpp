@@ -0,0 +1,397 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_CRT.cpp - DoubleCRT::toPolyMod gives toPoly mod Q, also for the
+ * coefficients next to the rounding boundaries, and decryption through it
+ * gives what the big-integer decryption gives. addPrimes and
+ * scaleDownToSet give what they gave through toPoly, and automorph
+ * through the tables of the context gives F(X^k), and breakIntoDigits
+ * gives the digits it gave through removePrimes and addPrimes. The
+ * inverse FFTs with explicit moduli give what the zz_pX ones give, leave
+ * NTL's current modulus alone, and run on many threads at once. The
+ * transforms for m = 2^15, 2^16, 2^17 multiply as zz_pX does.
+ */
+#include <thread>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+
+static bool sameMod(const FHEcontext& context, const DoubleCRT& d,
+                    const IndexSet& s, long Q, bool positive)
+{
+  ZZX big;
+  zzX small;
+  d.toPoly(big, s, positive);
+  d.toPolyMod(small, Q, s, positive);
+  long phim = context.zMStar.getPhiM();
+  for (long h: range(phim)) {
+    long expected = rem(coeff(big, h), Q);
+    long got = (h < small.length())? small[h] : 0;
+    if (got != expected) return false;
+  }
+  return true;
+}
+
+// addPrimes and scaleDownToSet through ZZX, as they used to be
+static void addPrimesRef(DoubleCRT& d, const IndexSet& s1)
+{
+  ZZX poly;
+  d.toPoly(poly);
+  d = DoubleCRT(poly, d.getContext(), d.getIndexSet() | s1);
+}
+
+static void scaleDownRef(DoubleCRT& d, const IndexSet& s, long ptxtSpace)
+{
+  IndexSet diff = d.getIndexSet() / s;
+  ZZ diffProd = d.getContext().productOfPrimes(diff);
+  ZZX delta;
+  d.toPoly(delta, diff);
+  if (ptxtSpace == 2) {
+    for (long i: range(delta.rep.length()))
+      if (IsOdd(delta.rep[i])) {
+        if (sign(delta.rep[i]) < 0) delta.rep[i] += diffProd;
+        else                        delta.rep[i] -= diffProd;
+      }
+  }
+  else if (ptxtSpace > 2) {
+    long prodInv = InvMod(rem(diffProd, ptxtSpace), ptxtSpace);
+    for (long i: range(delta.rep.length())) {
+      long c = MulMod(rem(delta.rep[i], ptxtSpace), prodInv, ptxtSpace);
+      if (c > ptxtSpace/2) c -= ptxtSpace;
+      delta.rep[i] -= diffProd * c;
+    }
+  }
+  delta.normalize();
+  d.removePrimes(diff);
+  d -= delta;
+  d /= diffProd;
+}
+
+static bool sameAddPrimes(const DoubleCRT& d, const IndexSet& s1)
+{
+  DoubleCRT fast = d, slow = d;
+  fast.addPrimes(s1);
+  addPrimesRef(slow, s1);
+  return fast == slow;
+}
+
+static bool sameScaleDown(const DoubleCRT& d, const IndexSet& s,
+                          long ptxtSpace)
+{
+  DoubleCRT fast = d, slow = d;
+  fast.scaleDownToSet(s, ptxtSpace);
+  scaleDownRef(slow, s, ptxtSpace);
+  return fast == slow;
+}
+
+// coefficients at and next to the boundaries of the lifts mod P: 0, P-1,
+// (P-1)/2 and (P+1)/2 (and their neighbors)
+static ZZX edgePoly(const ZZ& P, long phim)
+{
+  ZZ half = (P-1)/2;
+  ZZ vals[] = {conv<ZZ>(0), conv<ZZ>(1), P-1, P-2,
+               half-1, half, half+1, half+2};
+  ZZX edge;
+  for (long h: range(phim)) SetCoeff(edge, h, vals[h % 8]);
+  return edge;
+}
+
+// F(X^k) mod Phi_m(X), in coefficient form
+static ZZX automorphRef(const ZZX& f, long k, const PAlgebra& zMStar)
+{
+  long m = zMStar.getM();
+  ZZX g;
+  for (long i: range(deg(f)+1))
+    SetCoeff(g, MulMod(i, k, m), coeff(f, i));
+  rem(g, g, zMStar.getPhimX());
+  return g;
+}
+
+// the digits of d by removePrimes, addPrimes, Sub and /=, as they used to be
+static void digitsRef(vector<DoubleCRT>& digits, const DoubleCRT& d,
+                      long n, const vector<IndexSet>& dgtSets)
+{
+  const FHEcontext& context = d.getContext();
+  IndexSet allPrimes = d.getIndexSet() | context.specialPrimes;
+  digits.assign(n, d);
+  for (long i: range(n)) {
+    digits[i].removePrimes(d.getIndexSet() / dgtSets[i]);
+    digits[i].addPrimes(allPrimes / digits[i].getIndexSet());
+    ZZ pi = context.productOfPrimes(dgtSets[i]);
+    for (long j: range(i+1, n)) {
+      digits[j].Sub(digits[i], false);
+      digits[j] /= pi;
+    }
+  }
+}
+
+static bool sameDigits(const DoubleCRT& d, vector<DoubleCRT>& fast)
+{
+  const FHEcontext& context = d.getContext();
+  long n = context.digits.size();
+  vector<DoubleCRT> slow;
+  d.breakIntoDigits(fast, n, context.digits);
+  digitsRef(slow, d, n, context.digits);
+  for (long i: range(n))
+    if (fast[i] != slow[i]) return false;
+  return true;
+}
+
+// iFFT into longs against iFFT into a zz_pX, at every prime of d
+static bool sameRows(const DoubleCRT& d)
+{
+  const FHEcontext& context = d.getContext();
+  long phim = context.zMStar.getPhiM();
+  Vec<long> row;
+  row.SetLength(phim);
+  for (long i: d.getIndexSet()) {
+    const Cmodulus& mod = context.ithModulus(i);
+    zz_pBak bak; bak.save();
+    mod.restoreModulus();
+    zz_pX x;
+    mod.iFFT(x, d.getMap()[i]);
+    mod.iFFT(row.elts(), d.getMap()[i]);
+    for (long h: range(phim))
+      if (row[h] != rep(coeff(x, h))) return false;
+  }
+  return true;
+}
+
+// a product through the FFT of one prime for m=2^logm, against the
+// product in zz_pX modulo X^{m/2}+1 (the power-of-two m of the
+// production parameters have kernels of their own)
+static bool sameProduct(long logm)
+{
+  long m = 1L << logm, n = m/2;
+  PAlgebra zMStar(m, 3);
+  long q = ((NTL_SP_BOUND-1)/m)*m + 1;
+  while (!ProbPrime(q)) q -= m;
+  Cmodulus mod(zMStar, q, 0);
+
+  zzX a, b;
+  a.SetLength(n);
+  b.SetLength(n);
+  for (long h: range(n)) {
+    a[h] = RandomBnd(q);
+    b[h] = RandomBnd(q);
+  }
+  Vec<long> ya, yb, c;
+  mod.FFT(ya, a);
+  mod.FFT(yb, b);
+  for (long j: range(n)) ya[j] = MulMod(ya[j], yb[j], q);
+  c.SetLength(n);
+  mod.iFFT(c.elts(), ya.elts());
+
+  zz_pPush push(q);
+  zz_pX A, B, C;
+  for (long h: range(n)) {
+    SetCoeff(A, h, a[h]);
+    SetCoeff(B, h, b[h]);
+  }
+  mul(C, A, B);
+  for (long h: range(n))
+    if (c[h] != rep(coeff(C, h) - coeff(C, h+n))) return false;
+  return true;
+}
+
+// for m that is not a power of two: FFT(a) of one prime against a(w^t)
+// for t in Zm*, with w=root^2 a primitive m'th root, and iFFT back to a
+static bool sameEvaluations(const Cmodulus& mod)
+{
+  const PAlgebra& zMStar = mod.getZMStar();
+  long m = zMStar.getM(), phim = zMStar.getPhiM(), q = mod.getQ();
+  zzX a;
+  a.SetLength(phim);
+  for (long h: range(phim)) a[h] = RandomBnd(q);
+  Vec<long> y, b;
+  mod.FFT(y, a);
+  b.SetLength(phim);
+  mod.iFFT(b.elts(), y.elts());
+  for (long h: range(phim)) if (b[h] != a[h]) return false;
+
+  long w = MulMod(mod.getRoot(), mod.getRoot(), q);
+  for (long j: range(phim)) {
+    long x = PowerMod(w, zMStar.repInZmstar_unchecked(j), q), v = 0;
+    for (long h = phim-1; h >= 0; h--) v = AddMod(MulMod(v, x, q), a[h], q);
+    if (v != y[j]) return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long r=1;
+  amap.arg("r", r, "lifting");
+  long L=8;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long nt=1;
+  amap.arg("nt", nt, "# threads");
+  amap.parse(argc, argv);
+
+  if (nt > 1) SetNumThreads(nt);
+
+  FHEcontext context(m, p, r);
+  buildModChain(context, L, /*c=*/2);
+  long phim = context.zMStar.getPhiM();
+  bool ok = true;
+
+  // random elements, at a few prime sets and moduli
+  IndexSet all = context.ctxtPrimes | context.specialPrimes;
+  std::vector<IndexSet> sets = {all, context.ctxtPrimes,
+                                IndexSet(context.ctxtPrimes.first())};
+  std::vector<long> mods = {2, 3, power_long(p, r), 257, (1L<<40) + 15};
+  for (const IndexSet& s: sets) {
+    DoubleCRT d(context, s);
+    d.randomize();
+    for (long Q: mods)
+      for (long positive: range(2))
+        if (!sameMod(context, d, s, Q, positive)) ok = false;
+  }
+
+  // coefficients next to the boundaries of the lifts
+  DoubleCRT d(edgePoly(context.productOfPrimes(all), phim), context, all);
+  for (long Q: mods)
+    for (long positive: range(2))
+      if (!sameMod(context, d, all, Q, positive)) ok = false;
+
+  // the base extensions, of random elements and of the boundaries
+  const IndexSet& ctxt = context.ctxtPrimes;
+  const IndexSet& special = context.specialPrimes;
+  IndexSet top(ctxt.last());
+  std::vector<long> spaces = {1, 2, power_long(p, r), 257};
+  for (long trial: range(2)) {
+    DoubleCRT e(context, ctxt);
+    if (trial == 0) e.randomize();
+    else e = DoubleCRT(edgePoly(context.productOfPrimes(ctxt), phim),
+                       context, ctxt);
+    if (!sameAddPrimes(e, special)) ok = false;
+
+    DoubleCRT f(context, all);
+    if (trial == 0) f.randomize();
+    else f = DoubleCRT(edgePoly(context.productOfPrimes(special), phim),
+                       context, all);
+    for (long t: spaces) {
+      if (!sameScaleDown(f, ctxt, t)) ok = false;
+      if (!sameScaleDown(f, all / top, t)) ok = false;
+    }
+  }
+
+  // the digits, at the top level and below it, into the same vector
+  vector<DoubleCRT> digits;
+  for (long trial: range(2)) {
+    DoubleCRT e(context, ctxt);
+    e.randomize();
+    if (!sameDigits(e, digits)) ok = false;
+    DoubleCRT low(context, ctxt / top);
+    low.randomize();
+    if (!sameDigits(low, digits)) ok = false;
+  }
+
+  if (!context.zMStar.getPow2())
+    for (long i: all)
+      if (!sameEvaluations(context.ithModulus(i))) ok = false;
+
+  // the tables are kept by the context
+  if (context.getCrtTables(all) != context.getCrtTables(all)) ok = false;
+  shared_ptr<const Vec<long>> iv = context.getIndexVector(all);
+  if (iv != context.getIndexVector(all) || iv->length() != all.card())
+    ok = false;
+  else {
+    long j = 0;
+    for (long i: all) if ((*iv)[j++] != i) ok = false;
+  }
+
+  // sets beyond the inline words of IndexSet
+  IndexSet wide(3, 300), odd;
+  for (long i = 1; i < 400; i += 2) odd.insert(i);
+  IndexSet both = wide & odd;
+  if (both.card() != 149 || both.first() != 3 || both.last() != 299
+      || !(both <= wide) || (wide / odd).contains(201)
+      || !(odd / wide).contains(301) || both.next(299) != 300) ok = false;
+  odd.remove(odd);
+  if (!empty(odd) || wide.disjointFrom(IndexSet(300, 500))) ok = false;
+
+  // automorphisms through the tables, and the oldest tables are dropped
+  std::vector<long> ks;
+  for (long k: range(2, m))
+    if (context.zMStar.inZmStar(k)) ks.push_back(k);
+  auto first = context.getAutomorphPerm(ks[0]);
+  ZZX small;
+  for (long h: range(phim)) SetCoeff(small, h, RandomBits_ZZ(20) - (1L<<19));
+  for (long k: ks) {
+    DoubleCRT fast(small, context, all);
+    fast.automorph(k);
+    if (fast != DoubleCRT(automorphRef(small, k, context.zMStar),
+                          context, all)) ok = false;
+  }
+  if (lsize(ks) > FHE_AUTOMORPH_CACHE_SIZE
+      && context.getAutomorphPerm(ks[0]) == first) ok = false;
+  if (context.getAutomorphPerm(m-1) != context.getAutomorphPerm(-1))
+    ok = false;
+  DoubleCRT conj(context, all);
+  conj.randomize();
+  DoubleCRT conj1 = conj;
+  conj.complexConj();
+  conj1.automorph(m-1);
+  if (conj != conj1) ok = false;
+
+  // the explicit moduli: the same rows, the current modulus is kept, and
+  // toPoly on several threads at once gives what it gives on one
+  DoubleCRT rows(context, all);
+  rows.randomize();
+  if (!sameRows(rows)) ok = false;
+  {
+    zz_pPush push(17);
+    ZZX poly1;
+    Vec<long> row1;
+    rows.toPoly(poly1);
+    rows.getOneRow(row1, ctxt.first());
+    DoubleCRT again(poly1, context, all);
+    if (zz_p::modulus() != 17 || again != rows) ok = false;
+  }
+  ZZX serial;
+  rows.toPoly(serial);
+  std::vector<ZZX> polys(4);
+  std::vector<std::thread> threads;
+  for (long t: range(4))
+    threads.emplace_back([&rows, &polys, t]{ rows.toPoly(polys[t]); });
+  for (auto& th: threads) th.join();
+  for (const ZZX& q: polys)
+    if (q != serial) ok = false;
+
+  // the fixed-size NTTs
+  for (long logm: range(15, 18))
+    if (!sameProduct(logm)) ok = false;
+
+  // decryption by the two routes
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+  EncryptedArray ea(context, context.alMod);
+  ZZX poly, fast, slow, f;
+  for (long h: range(phim)) SetCoeff(poly, h, RandomBnd(power_long(p, r)));
+  Ctxt c(secretKey);
+  secretKey.Encrypt(c, poly);
+  c.multiplyBy(c);
+  secretKey.Decrypt(fast, c);
+  secretKey.Decrypt(slow, c, f);
+  if (fast != slow) ok = false;
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
@@ -0,0 +1,158 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_Convolution.cpp - 1D convolutions along every dimension, with both
+ * boundaries, per-slot taps and kernels longer than the dimension, against
+ * the same convolutions in the clear (p=-1 for CKKS)
+ */
+#include <cmath>
+#include <stdexcept>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "convolution.h"
+
+// The slot that output slot s reads at offset off along dim, -1 if it is
+// beyond an end
+static long source(const EncryptedArray& ea, long s, long dim, long off,
+                   bool zero)
+{
+  std::pair<long,long> kj = ea.getPAlgebra().breakIndexByDim(s, dim);
+  long D = ea.sizeOfDimension(dim), j = kj.second + off;
+  if (zero && (j < 0 || j >= D)) return -1;
+  kj.second = mcMod(j, D);
+  return ea.getPAlgebra().assembleIndexByDim(kj, dim);
+}
+
+// taps[t][s] (or taps[t][0] for all the slots) applied to v in the clear
+template<class T>
+static vector<T> convRef(const EncryptedArray& ea, const vector<T>& v,
+                         long dim, const vector< vector<T> >& taps,
+                         long origin, bool zero)
+{
+  vector<T> w(ea.size(), T(0));
+  for (long s: range(ea.size()))
+    for (long t: range(lsize(taps))) {
+      long src = source(ea, s, dim, t-origin, zero);
+      if (src >= 0) w[s] += taps[t][(lsize(taps[t]) == 1)? 0 : s] * v[src];
+    }
+  return w;
+}
+
+static bool checkBGV(const FHESecKey& sk, const EncryptedArray& ea, long dim)
+{
+  long p2r = ea.getAlMod().getPPowR(), n = ea.size();
+  long D = ea.sizeOfDimension(dim);
+  bool ok = true;
+
+  // (taps, origin, zero boundary?, per-slot taps?)
+  struct Case { long T, origin; bool zero, perSlot; };
+  vector<Case> cases = { {3, 1, true, false}, {3, 1, false, false},
+                         {2, 0, true, true}, {D+2, (D+2)/2, false, false},
+                         {D+2, 0, true, false} };
+  for (const Case& c: cases) {
+    vector< vector<long> > taps(c.T);
+    for (auto& tap: taps) {
+      tap.resize(c.perSlot? n : 1);
+      for (long& x: tap) x = RandomBnd(p2r);
+    }
+    vector<long> v(n);
+    for (long& x: v) x = RandomBnd(p2r);
+    ConvBoundary b = c.zero? CONV_ZERO : CONV_CYCLIC;
+
+    vector<long> expected = convRef(ea, v, dim, taps, c.origin, c.zero);
+    for (long& x: expected) x = mcMod(x, p2r);
+
+    Convolution1D conv(ea, dim, taps, c.origin, b);
+    conv.upgrade(); // the encoded taps serve both ciphertexts
+    for (long trial: range(2)) {
+      Ctxt ctxt(sk);
+      ea.encrypt(ctxt, sk, v);
+      if (c.perSlot || trial == 0) conv.apply(ctxt);
+      else { // the one-shot version with the same scalar taps
+        vector<long> scalar(c.T);
+        for (long t: range(c.T)) scalar[t] = taps[t][0];
+        convolve1D(ea, ctxt, dim, scalar, c.origin, b);
+      }
+      vector<long> res;
+      ea.decrypt(ctxt, sk, res);
+      if (res != expected) ok = false;
+    }
+  }
+  return ok;
+}
+
+static bool checkCKKS(const FHESecKey& sk, const EncryptedArray& ea,
+                      long dim)
+{
+  const EncryptedArrayCx& eaCx = ea.getCx();
+  long n = ea.size();
+  bool ok = true;
+  for (long zero: range(2)) {
+    vector< vector<double> > taps = { {0.25}, {0.5}, {0.25} };
+    vector<double> v(n), flat = {0.25, 0.5, 0.25};
+    for (long s: range(n)) v[s] = std::sin(double(s));
+    vector<double> expected = convRef(ea, v, dim, taps, 1, zero);
+
+    Ctxt ctxt(sk);
+    eaCx.encrypt(ctxt, sk, v);
+    convolve1D(ea, ctxt, dim, flat, 1, zero? CONV_ZERO : CONV_CYCLIC);
+    vector<double> res;
+    eaCx.decrypt(ctxt, sk, res);
+    for (long s: range(n))
+      if (std::fabs(res[s] - expected[s]) > 0.01) ok = false;
+  }
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base (-1 for CKKS)");
+  long r=1;
+  amap.arg("r", r, "lifting (bits of precision for CKKS)");
+  long L=6;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  amap.parse(argc, argv);
+
+  FHEcontext context(m, p, r);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+  const EncryptedArray& ea = *context.ea;
+  bool ok = true;
+
+  for (long dim: range(ea.dimension())) {
+    bool good = (p == -1)? checkCKKS(secretKey, ea, dim)
+                         : checkBGV(secretKey, ea, dim);
+    if (!good) {
+      cout << "dimension " << dim << " (size " << ea.sizeOfDimension(dim)
+           << (ea.nativeDimension(dim)? ", native" : ", not native")
+           << ") failed\n";
+      ok = false;
+    }
+  }
+
+  try { // there is no such dimension
+    Convolution1D bad(ea, ea.dimension(), vector<long>(1, 1), 0);
+    ok = false;
+  }
+  catch (std::logic_error&) {}
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
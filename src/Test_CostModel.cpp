@@ -0,0 +1,146 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_CostModel.cpp - count the kernels of a small circuit, for real and
+ * in a dry run, and predict its time from benchmark results
+ */
+#include <sstream>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "costModel.h"
+
+// A product, a sum and an automorphism of c0 and c1, into out
+static void compute(Ctxt& out, const Ctxt& c0, const Ctxt& c1, long k)
+{
+  out = c0;
+  out.multiplyBy(c1);
+  out += c0;
+  out.smartAutomorph(k);
+}
+
+static CostCounts countCircuit(const Ctxt& c0, const Ctxt& c1, long k)
+{
+  CostCounter counter;
+  setCostCounter(&counter);
+  {
+    Ctxt out(c0.getPubKey());
+    compute(out, c0, c1, k);
+  }
+  setCostCounter(NULL);
+  return counter.getCounts();
+}
+
+// Results in the format of Test_Bench json=1, for two parameter sets
+static const char benchJSON[] =
+  "{\"reps\": 5, \"minTime\": 0.05, \"unit\": \"seconds per call\",\n"
+  " \"results\": [\n"
+  "  {\"case\": \"FFT\", \"m\": 105, \"phim\": 48, \"L\": 600, \"nPrimes\": 12, \"threads\": 1, \"iters\": 10, \"mean\": 1e-06, \"median\": 1e-06, \"min\": 1e-06, \"max\": 1e-06, \"stddev\": 0, \"relStddev\": 0, \"samples\": [1e-06]},\n"
+  "  {\"case\": \"FFT\", \"m\": 1023, \"phim\": 600, \"L\": 600, \"nPrimes\": 12, \"threads\": 1, \"iters\": 10, \"mean\": 2e-05, \"median\": 2e-05, \"min\": 2e-05, \"max\": 2e-05, \"stddev\": 0, \"relStddev\": 0, \"samples\": [2e-05]},\n"
+  "  {\"case\": \"iFFT\", \"m\": 1023, \"phim\": 600, \"L\": 600, \"nPrimes\": 12, \"threads\": 1, \"iters\": 10, \"mean\": 3e-05, \"median\": 3e-05, \"min\": 3e-05, \"max\": 3e-05, \"stddev\": 0, \"relStddev\": 0, \"samples\": [3e-05]},\n"
+  "  {\"case\": \"DoubleCRT_add\", \"m\": 1023, \"phim\": 600, \"L\": 600, \"nPrimes\": 12, \"threads\": 1, \"iters\": 10, \"mean\": 1.2e-05, \"median\": 1.2e-05, \"min\": 1.2e-05, \"max\": 1.2e-05, \"stddev\": 0, \"relStddev\": 0, \"samples\": [1.2e-05]},\n"
+  "  {\"case\": \"DoubleCRT_mul\", \"m\": 1023, \"phim\": 600, \"L\": 600, \"nPrimes\": 12, \"threads\": 1, \"iters\": 10, \"mean\": 3.6e-05, \"median\": 3.6e-05, \"min\": 3.6e-05, \"max\": 3.6e-05, \"stddev\": 0, \"relStddev\": 0, \"samples\": [3.6e-05]},\n"
+  "  {\"case\": \"DoubleCRT_automorph\", \"m\": 1023, \"phim\": 600, \"L\": 600, \"nPrimes\": 12, \"threads\": 1, \"iters\": 10, \"mean\": 6e-05, \"median\": 6e-05, \"min\": 6e-05, \"max\": 6e-05, \"stddev\": 0, \"relStddev\": 0, \"samples\": [6e-05]}\n"
+  "]}\n";
+
+static bool near(double x, double y) { return fabs(x-y) <= 1e-9*fabs(y); }
+
+static bool testTimings(const CostCounts& counts, bool verbose)
+{
+  bool ok = true;
+  KernelTimings t;
+  std::istringstream str(benchJSON);
+  if (!t.readBenchJSON(str, /*phim=*/500)) return false;
+  if (t.phim != 600 || !near(t.perRow[COST_FFT], 2e-05)
+      || !near(t.perRow[COST_IFFT], 3e-05)
+      || !near(t.perRow[COST_ROW_OP], 2e-06)       // (1e-6 + 3e-6)/2
+      || !near(t.perRow[COST_AUTOMORPH], 5e-06)
+      || !near(t.perRow[COST_INNER_PRODUCT], 8e-06))
+    ok = false;
+
+  double sec = t.predictSeconds(counts);
+  double larger = t.predictSeconds(counts, 2*t.phim);
+  if (verbose)
+    cout << "predicted: " << sec << " sec at phim=" << t.phim
+         << ", " << larger << " sec at phim=" << 2*t.phim << endl;
+  if (!(sec > 0) || !(larger > 2*sec)) ok = false;
+
+  // there are no automorphism results for phim=48
+  std::istringstream str2(benchJSON);
+  KernelTimings t2;
+  if (t2.readBenchJSON(str2, /*phim=*/48)) ok = false;
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long L=4;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long nt=1;
+  amap.arg("nt", nt, "# threads");
+  bool verbose=false;
+  amap.arg("verbose", verbose, "print more information");
+  amap.parse(argc, argv);
+
+  if (nt > 1) SetNumThreads(nt);
+
+  FHEcontext context(m, p, /*r=*/1);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+  EncryptedArray ea(context, context.alMod);
+  long k = context.zMStar.ZmStarGen(0);
+
+  PlaintextArray v0(ea), v1(ea);
+  random(ea, v0);
+  random(ea, v1);
+  Ctxt c0(secretKey), c1(secretKey);
+  ea.encrypt(c0, secretKey, v0);
+  ea.encrypt(c1, secretKey, v1);
+
+  bool ok = true;
+  CostCounts real = countCircuit(c0, c1, k);
+
+  setDryRun(true);
+  CostCounts dry = countCircuit(c0, c1, k);
+  setDryRun(false);
+
+  if (verbose) {
+    cout << "real run:\n";
+    real.print(cout);
+    cout << "dry run:\n";
+    dry.print(cout);
+  }
+
+  // one re-linearization and one automorphism, the same in both runs
+  if (real.totalKeySwitches() < 2 || real.keySwitches != dry.keySwitches)
+    ok = false;
+  for (long i: range(COST_KERNEL_COUNT)) {
+    long r = real.rows[i], d = dry.rows[i];
+    if (r <= 0 || d <= 0 || d > 2*r || r > 2*d) ok = false;
+  }
+  if (real.peakRows <= 0 || dry.peakRows <= 0) ok = false;
+  if (!(real.peakBytes(context.zMStar.getPhiM()) > 0)) ok = false;
+  if (real.recrypts != 0 || real.thinRecrypts != 0) ok = false;
+
+  if (!testTimings(real, verbose)) ok = false;
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
@@ -0,0 +1,120 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_CtxtBatch.cpp - the batch operations compute what the same
+ * operations on each Ctxt compute
+ */
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "ctxtBatch.h"
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long L=6;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long N=8;
+  amap.arg("N", N, "# of ciphertexts in the batch");
+  long nt=1;
+  amap.arg("nt", nt, "# threads");
+  amap.parse(argc, argv);
+
+  if (nt > 1) SetNumThreads(nt);
+
+  FHEcontext context(m, p, /*r=*/1);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+  EncryptedArray ea(context, context.alMod);
+  long k = context.zMStar.genToPow(0, 1);
+  secretKey.GenKeySWmatrix(1, k, 0, 0);
+
+  vector<PlaintextArray> va(N, PlaintextArray(ea)), vb(N, PlaintextArray(ea));
+  vector<Ctxt> ca(N, Ctxt(secretKey)), cb(N, Ctxt(secretKey));
+  for (long n: range(N)) {
+    random(ea, va[n]);
+    random(ea, vb[n]);
+    ea.encrypt(ca[n], secretKey, va[n]);
+    ea.encrypt(cb[n], secretKey, vb[n]);
+  }
+  PlaintextArray vw(ea);
+  random(ea, vw);
+  ZZX w;
+  ea.encode(w, vw);
+
+  // ((a + b) * w - b)^k * a on a batch and on each ciphertext
+  CtxtBatch a(secretKey, ca), b(secretKey, cb);
+  CtxtBatch r = a;
+  r += b;
+  r.multByConstant(w);
+  r -= b;
+  r.automorph(k);
+  r.reLinearize();
+  r.multiplyBy(a);
+
+  bool ok = (r.size() == N);
+  vector<Ctxt> out;
+  r.unpack(out);
+  for (long n: range(N)) {
+    Ctxt c = ca[n];
+    c += cb[n];
+    c.multByConstant(w);
+    c -= cb[n];
+    c.automorph(k);
+    c.reLinearize();
+    c.multLowLvl(ca[n]);
+    c.reLinearize();
+
+    PlaintextArray got(ea), direct(ea);
+    ea.decrypt(c, secretKey, direct);
+    ea.decrypt(out[n], secretKey, got);
+    if (!equals(ea, got, direct) || !out[n].inCanonicalForm())
+      ok = false;
+  }
+
+  // the residues of a batch sum are those of the Ctxt sums
+  CtxtBatch s = a;
+  s += b;
+  for (long n: range(N)) {
+    Ctxt c = ca[n], d(secretKey);
+    c += cb[n];
+    s.get(d, n);
+    if (!c.equalsTo(d)) ok = false;
+  }
+  if (s.memoryUsage() <= 0) ok = false;
+
+  // operands that do not match are rejected
+  try {
+    CtxtBatch shorter(secretKey, vector<Ctxt>(ca.begin(), ca.begin()+N-1));
+    shorter += a;
+    ok = false;
+  }
+  catch (std::logic_error&) {}
+  try {
+    vector<Ctxt> mixed = ca;
+    const IndexSet& s0 = mixed[0].getPrimeSet();
+    mixed[0].modDownToSet(s0 / IndexSet(s0.last())); // one prime less
+    CtxtBatch bad(secretKey, mixed);
+    ok = false;
+  }
+  catch (std::logic_error&) {}
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
@@ -0,0 +1,150 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_CtxtExpr.cpp - lazy expressions compute what the eager Ctxt
+ * operations compute, with and without the optimizations
+ */
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "ctxtExpr.h"
+
+static bool sameDecryption(const EncryptedArray& ea, const FHESecKey& sk,
+                           const Ctxt& c0, const Ctxt& c1)
+{
+  PlaintextArray p0(ea), p1(ea);
+  ea.decrypt(c0, sk, p0);
+  ea.decrypt(c1, sk, p1);
+  return equals(ea, p0, p1);
+}
+
+// out0 = w1*x^{k1} + w2*x^{k2} - x*y + x^{k1}*y,  out1 = x^{k1} + y,
+// built with the repeated subexpressions that the optimizer merges
+static void build(std::vector<CtxtExpr>& outs, CtxtGraph& g,
+                  const Ctxt& x0, const Ctxt& y0,
+                  const ZZX& w1, const ZZX& w2, long k1, long k2)
+{
+  CtxtExpr x = g.input(x0), y = g.input(y0);
+  ExprConstant c1 = g.constant(w1), c2 = g.constant(w2);
+  CtxtExpr out0 = c1*automorph(x, k1) + c2*automorph(x, k2);
+  out0 -= x*y;
+  out0 += automorph(x, k1)*y;
+  CtxtExpr out1 = automorph(x, k1) + y;
+  CtxtExpr unused = x*x*x;
+  outs = {out0, out1};
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long L=6;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long nt=1;
+  amap.arg("nt", nt, "# threads");
+  bool verbose=false;
+  amap.arg("verbose", verbose, "print the statistics");
+  amap.parse(argc, argv);
+
+  if (nt > 1) SetNumThreads(nt);
+
+  FHEcontext context(m, p, /*r=*/1);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+  EncryptedArray ea(context, context.alMod);
+  const PAlgebra& zMStar = context.zMStar;
+
+  // direct matrices for both automorphisms, so that they can be hoisted
+  long k1 = zMStar.genToPow(0, 1), k2 = zMStar.genToPow(0, 2);
+  secretKey.GenKeySWmatrix(1, k1, 0, 0);
+  secretKey.GenKeySWmatrix(1, k2, 0, 0);
+
+  PlaintextArray vx(ea), vy(ea), vw1(ea), vw2(ea);
+  random(ea, vx);
+  random(ea, vy);
+  random(ea, vw1);
+  random(ea, vw2);
+  Ctxt x(secretKey), y(secretKey);
+  ea.encrypt(x, secretKey, vx);
+  ea.encrypt(y, secretKey, vy);
+  ZZX w1, w2;
+  ea.encode(w1, vw1);
+  ea.encode(w2, vw2);
+
+  // the eager computation
+  Ctxt r1 = x, r2 = x, xy = x, r1y(secretKey);
+  r1.smartAutomorph(k1);
+  r2.smartAutomorph(k2);
+  xy.multiplyBy(y);
+  r1y = r1;
+  r1y.multiplyBy(y);
+  Ctxt out1 = r1;
+  out1 += y;
+  r1.multByConstant(w1);
+  r2.multByConstant(w2);
+  Ctxt out0 = r1;
+  out0 += r2;
+  out0 -= xy;
+  out0 += r1y;
+
+  bool ok = true;
+  ExprOptions none;
+  none.cse = none.hoist = none.fuse = none.lazyRelin = none.parallel = false;
+  for (long pass: range(2)) {
+    CtxtGraph g(secretKey, pass? none : ExprOptions(), &ea);
+    std::vector<CtxtExpr> exprs;
+    build(exprs, g, x, y, w1, w2, k1, k2);
+    std::vector<Ctxt> outs;
+    g.evaluate(outs, exprs);
+    const ExprStats& s = g.getStats();
+    if (verbose) cout << (pass? "unoptimized " : "optimized ") << s << endl;
+
+    if (outs.size() != 2
+        || !sameDecryption(ea, secretKey, outs[0], out0)
+        || !sameDecryption(ea, secretKey, outs[1], out1)
+        || !outs[0].inCanonicalForm())
+      ok = false;
+    if (s.evaluated >= g.size() - 2) ok = false; // x*x*x is not computed
+    if (pass == 0
+        && (s.cseHits < 2 || s.hoistGroups != 1 || s.hoisted != 2
+            || s.fused < 3 || s.relinsSaved != 1))
+      ok = false;
+    if (pass == 1
+        && (s.cseHits != 0 || s.hoistGroups != 0 || s.fused != 0
+            || s.relinsSaved != 0))
+      ok = false;
+
+    // a second evaluation of the same graph gives the same results
+    if (pass == 0) {
+      Ctxt again(secretKey);
+      g.evaluate(again, exprs[1]);
+      if (!sameDecryption(ea, secretKey, again, out1)) ok = false;
+    }
+  }
+
+  // operands of different graphs are rejected
+  try {
+    CtxtGraph g1(secretKey), g2(secretKey);
+    CtxtExpr e = g1.input(x) + g2.input(y);
+    ok = false;
+  }
+  catch (std::logic_error&) {}
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
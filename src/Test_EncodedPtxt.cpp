@@ -0,0 +1,126 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_EncodedPtxt.cpp - a constant that is encoded once multiplies and
+ * adds at every level, builds a DoubleCRT form only when no form covers
+ * the ciphertext, and serves many threads at once.
+ */
+#include <thread>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long r=1;
+  amap.arg("r", r, "lifting");
+  long L=6;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  amap.parse(argc, argv);
+
+  FHEcontext context(m, p, r);
+  buildModChain(context, L, /*c=*/2);
+  EncryptedArray ea(context, context.alMod);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  const FHEPubKey& publicKey = secretKey;
+  bool ok = true;
+
+  PlaintextArray u(ea), v(ea), res(ea);
+  random(ea, u);
+  random(ea, v);
+  EncodedPlaintext w(context);
+  ea.encode(w, v);
+  if (w.getSize() <= 0 || w.numForms() != 0) ok = false;
+
+  // the product and the sum at the top level
+  Ctxt c(publicKey);
+  ea.encrypt(c, publicKey, u);
+  Ctxt prod(c), sum(c);
+  prod.multByConstant(w);
+  sum.addConstant(w);
+  PlaintextArray expected(u);
+  mul(ea, expected, v);
+  ea.decrypt(prod, secretKey, res);
+  if (!equals(ea, res, expected)) ok = false;
+  expected = u;
+  add(ea, expected, v);
+  ea.decrypt(sum, secretKey, res);
+  if (!equals(ea, res, expected)) ok = false;
+  if (p == 2) { // xor is addition mod 2
+    Ctxt x(c);
+    x.xorConstant(w);
+    ea.decrypt(x, secretKey, res);
+    if (!equals(ea, res, expected)) ok = false;
+  }
+
+  // lower down, through the same form
+  IndexSet low = c.getPrimeSet() / IndexSet(c.getPrimeSet().last());
+  Ctxt d(c);
+  d.modDownToSet(low);
+  d.multByConstant(w);
+  d.addConstant(w);
+  expected = u;
+  mul(ea, expected, v);
+  add(ea, expected, v);
+  ea.decrypt(d, secretKey, res);
+  if (!equals(ea, res, expected)) ok = false;
+  if (w.numBuilt() != 1 || w.numForms() != 1) ok = false;
+
+  // used low first, then the fresh ciphertext needs a larger form, which
+  // replaces the smaller one
+  EncodedPlaintext w2(context);
+  ea.encode(w2, v);
+  Ctxt e(c);
+  e.modDownToSet(low);
+  e.multByConstant(w2);
+  Ctxt f(c);
+  f.multByConstant(w2);
+  if (w2.numBuilt() != 2 || w2.numForms() != 1) ok = false;
+  ea.decrypt(f, secretKey, res);
+  expected = u;
+  mul(ea, expected, v);
+  if (!equals(ea, res, expected)) ok = false;
+
+  // copies share the forms, and many threads use one constant
+  EncodedPlaintext w3(w);
+  if (w3.numForms() != 1 || w3.numBuilt() != 1) ok = false;
+  EncodedPlaintext w4(context);
+  ea.encode(w4, v);
+  std::vector<Ctxt> prods(4, c);
+  std::vector<std::thread> threads;
+  for (long t: range(4))
+    threads.emplace_back([&prods, &w4, t]{ prods[t].multByConstant(w4); });
+  for (auto& th: threads) th.join();
+  if (w4.numBuilt() != 1) ok = false;
+  for (const Ctxt& q: prods) {
+    ea.decrypt(q, secretKey, res);
+    if (!equals(ea, res, expected)) ok = false;
+  }
+
+  // the zero constant
+  EncodedPlaintext zero(context);
+  Ctxt z(c);
+  z.multByConstant(zero);
+  ea.decrypt(z, secretKey, res);
+  PlaintextArray zeros(ea);
+  if (!equals(ea, res, zeros)) ok = false;
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
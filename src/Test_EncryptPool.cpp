@@ -0,0 +1,103 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_EncryptPool.cpp - encryptions from a pool of zeros decrypt to their
+ * plaintexts and get the noise bound of FHEPubKey::Encrypt, the refill
+ * thread fills the pool, and a saved pool is read back once.
+ */
+#include <cstdio>
+#include <fstream>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "encryptPool.h"
+
+// encrypt a few random plaintexts from the pool, check them against ptxt
+// and against FHEPubKey::Encrypt
+static bool checkPool(EncryptedZeroPool& pool, const FHESecKey& secretKey,
+                      long count)
+{
+  const FHEPubKey& publicKey = secretKey;
+  const FHEcontext& context = secretKey.getContext();
+  long p = pool.getPtxtSpace();
+  long phim = context.zMStar.getPhiM();
+  bool ok = true;
+  while (count-- > 0) {
+    zzX ptxt;
+    ptxt.SetLength(phim);
+    for (long h: range(phim)) ptxt[h] = RandomBnd(p);
+    Ctxt c(publicKey), ref(publicKey);
+    if (pool.encrypt(c, ptxt) != p) ok = false;
+    publicKey.Encrypt(ref, ptxt, p, /*highNoise=*/false);
+    double ratio = conv<double>(c.getNoiseBound()/ref.getNoiseBound());
+    if (c.getPrimeSet() != ref.getPrimeSet() || fabs(ratio-1) > 0.01)
+      ok = false;
+
+    ZZX dec, expected;
+    convert(expected, ptxt);
+    secretKey.Decrypt(dec, c);
+    PolyRed(dec, p, /*abs=*/true);
+    if (dec != expected) ok = false;
+  }
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long r=1;
+  amap.arg("r", r, "lifting");
+  long L=6;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long size=4;
+  amap.arg("size", size, "the capacity of the pool");
+  amap.parse(argc, argv);
+
+  FHEcontext context(m, p, r);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  const FHEPubKey& publicKey = secretKey;
+  bool ok = true;
+
+  // filled on this thread, then one miss after the pool is used up
+  EncryptedZeroPool pool(publicKey, size, /*ptxtSpace=*/0, /*background=*/false);
+  pool.fill();
+  if (pool.size() != size || pool.running()) ok = false;
+  if (!checkPool(pool, secretKey, size+1)) ok = false;
+  if (pool.numMisses() != 1 || pool.size() != 0) ok = false;
+
+  // refilled in the background
+  pool.start();
+  pool.waitFull();
+  if (pool.size() != size) ok = false;
+  if (!checkPool(pool, secretKey, size)) ok = false;
+  pool.waitFull();
+  pool.stop();
+  if (pool.size() != size) ok = false;
+
+  // saved, and read back once
+  string fname = "Test_EncryptPool.zeros";
+  if (pool.save(fname) != size || pool.size() != 0) ok = false;
+  EncryptedZeroPool other(publicKey, size, /*ptxtSpace=*/0, false);
+  if (other.load(fname) != size || other.size() != size) ok = false;
+  if (ifstream(fname).good()) ok = false; // the file is gone
+  if (!checkPool(other, secretKey, size) || other.numMisses() != 0) ok = false;
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
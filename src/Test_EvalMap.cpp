@@ -22,6 +22,8 @@ NTL_CLIENT
 
 static bool dry = false; // a dry-run flag
 static bool noPrint = true;
+static bool collapse = false; // one full transformation for the 1D stages
+static long tierMB = 0; // budget of the hot tier of zzX constants
 
 void  TestIt(long p, long r, long c, long _k,
              long L, Vec<long>& mvec, 
@@ -133,7 +135,8 @@ void  TestIt(long p, long r, long c, long _k,
 
   if (!noPrint) cout << "build EvalMap\n";
   EvalMap map(ea, /*minimal=*/false, mvec, 
-    /*invert=*/false, /*build_cache=*/false, /*normal_basis=*/false); 
+    /*invert=*/false, /*build_cache=*/false, /*normal_basis=*/false,
+    /*cacheDir=*/"", collapse); 
   // compute the transformation to apply
 
   if (!noPrint) cout << "apply EvalMap\n";
@@ -160,7 +163,8 @@ void  TestIt(long p, long r, long c, long _k,
 
   if (!noPrint) cout << "build EvalMap\n";
   EvalMap imap(ea, /*minimal=*/false, mvec, 
-    /*invert=*/true, /*build_cache=*/false, /*normal_basis=*/false); 
+    /*invert=*/true, /*build_cache=*/false, /*normal_basis=*/false,
+    /*cacheDir=*/"", collapse); 
   // compute the transformation to apply
   if (!noPrint) cout << "apply EvalMap\n";
   if (useCache) imap.upgrade();
@@ -200,6 +204,8 @@ void  TestIt(long p, long r, long c, long _k,
  *             e.g., gens='[562 1871 751]'
  *  ords    use specified vector of orders
  *             e.g., ords='[4 2 -4]', negative means 'bad'
+ *  collapse collapse the regular matrices [ default=0 ]
+ *  tierMB  MB of DoubleCRT copies of the zzX constants [ default=0 ]
  */
 int main(int argc, char *argv[])
 {
@@ -248,12 +254,26 @@ int main(int argc, char *argv[])
   long useCache=0;
   amap.arg("useCache", useCache, "0: zzX cache, 2: DCRT cache");
 
+  amap.arg("collapse", collapse, "collapse the regular matrices");
+  amap.arg("tierMB", tierMB, "MB of DoubleCRT copies of the zzX constants");
+
   amap.parse(argc, argv);
 
   SetNumThreads(nthreads);
 
   SetSeed(conv<ZZ>(seed));
+  setConstMultiplierBudget(tierMB << 20);
   TestIt(p, r, c, k, L, mvec, gens, ords, useCache);
+  if (tierMB > 0) {
+    ConstMultiplierStats stats = getConstMultiplierStats();
+    if (!noPrint)
+      cout << "hot tier: " << stats.entries << " constants in "
+           << stats.bytes << " bytes, hit rate " << stats.hitRate() << endl;
+    cout << ((stats.bytes <= (tierMB << 20)
+             && (useCache || stats.hits+stats.misses > 0))?
+             "GOOD\n" : "BAD\n");
+    clearConstMultiplierTier();
+  }
 }
 
 // ./Test_EvalMap_x mvec="[73 433]" gens="[18620 12995]" ords="[72 -6]"
@@ -16,11 +16,13 @@
 #include <NTL/BasicThreadPool.h>
 #include "FHE.h"
 #include "timing.h"
+#include "telemetry.h"
 #include "EncryptedArray.h"
 #include <NTL/lzz_pXFactoring.h>
 
 #include <cassert>
 #include <cstdio>
+#include <algorithm>
 
 NTL_CLIENT
 
@@ -56,6 +58,90 @@ NTL_CLIENT
 
 static bool noPrint = true;
 
+// Encrypt a few random arrays together, then decrypt them back together
+template<class type>
+static bool checkBatch(const EncryptedArrayDerived<type>& ea,
+                       const FHESecKey& sKey, long n)
+{
+  long p2r = ea.getP2R();
+  vector< vector<long> > in(n, vector<long>(ea.size())), out;
+  for (auto& v: in) for (long& x: v) x = RandomBnd(p2r);
+
+  vector<Ctxt> ctxts(n, Ctxt(sKey));
+  ea.encrypt(ctxts, sKey, in);
+  ea.decrypt(ctxts, sKey, out);
+  return out == in;
+}
+
+// Rotations with matrices for all the automorphisms of their plans, which
+// are then hoisted and mask once
+template<class type>
+static bool checkHoistedRotations(const EncryptedArrayDerived<type>& ea,
+                                  FHESecKey& sKey)
+{
+  long n = ea.size(), p2r = ea.getP2R();
+  if (n < 2) return true;
+  long amt = 1 + RandomBnd(n-1);
+  long dim = 0; // a bad dimension if there is one
+  for (long d = 0; d < ea.dimension(); d++)
+    if (!ea.nativeDimension(d)) dim = d;
+  long amt1D = 1 + RandomBnd(max(1L, ea.sizeOfDimension(dim)-1));
+
+  vector<long> vals, vals1D;
+  ea.getRotationVals(vals, -1, amt);
+  ea.getRotationVals(vals1D, dim, amt1D);
+  vals.insert(vals.end(), vals1D.begin(), vals1D.end());
+  vals.erase(std::remove(vals.begin(), vals.end(), 1L), vals.end());
+  sKey.GenKeySWmatrices(vals);
+
+  vector<long> in(n), out, rot(n), rot1D;
+  for (long& x: in) x = RandomBnd(p2r);
+  for (long t = 0; t < n; t++) rot[(t+amt)%n] = in[t];
+  ea.rotate1D(rot1D, in, dim, amt1D);
+
+  Ctxt c(sKey), c1D(sKey);
+  ea.encrypt(c, sKey, in);
+  c1D = c;
+  ea.rotate(c, amt);
+  ea.rotate1D(c1D, dim, amt1D);
+  ea.decrypt(c, sKey, out);
+  if (out != rot) return false;
+  ea.decrypt(c1D, sKey, out);
+  return out == rot1D;
+}
+
+// A lazy product assigned to another ciphertext is still lazy there, so an
+// automorphism of the copy re-linearizes it first
+static bool checkLazyAssign(const EncryptedArray& ea, const FHESecKey& sKey)
+{
+  const PAlgebra& zMStar = ea.getContext().zMStar;
+  if (zMStar.numOfGens() == 0) return true;
+  long k = zMStar.ZmStarGen(0);
+
+  PlaintextArray p1(ea), p2(ea), eager(ea), lazy(ea);
+  random(ea, p1);
+  random(ea, p2);
+  Ctxt c1(sKey), c2(sKey);
+  ea.encrypt(c1, sKey, p1);
+  ea.encrypt(c2, sKey, p2);
+
+  Ctxt expected(c1);
+  expected.multiplyBy(c2);
+  expected.smartAutomorph(k);
+
+  Ctxt product(c1);
+  product.setLazyRelin();
+  product.multiplyBy(c2);
+  Ctxt a(sKey);
+  a = product;
+  if (!a.isLazyRelin()) return false;
+  a.smartAutomorph(k);
+
+  ea.decrypt(expected, sKey, eager);
+  ea.decrypt(a, sKey, lazy);
+  return equals(ea, eager, lazy);
+}
+
 void  TestIt(long R, long p, long r, long d, long c, long k, long w, 
                long L, long m, const Vec<long>& gens, const Vec<long>& ords)
 {
@@ -227,8 +313,133 @@ void  TestIt(long R, long p, long r, long d, long c, long k, long w,
   ea.decrypt(c2, secretKey, pp2);
   ea.decrypt(c3, secretKey, pp3);
    
+  // The single-prime decryption must agree with the usual one
+  bool singleOK = true;
+  for (const Ctxt* c: {&c0, &c1, &c2, &c3}) {
+    zzX fast;
+    ZZX slow, fastZZ;
+    if (!secretKey.DecryptSinglePrime(fast, *c)) continue;
+    secretKey.Decrypt(slow, *c);
+    convert(fastZZ, fast);
+    if (fastZZ != slow) singleOK = false;
+  }
+
+  // Rotate at the bottom half of the chain, with matrices trimmed to it
+  const IndexSet& cp = context.ctxtPrimes;
+  IndexSet low = IndexSet(cp.first(), cp.first() + (cp.card()+1)/2 - 1) & cp;
+  addTrimmedMatrices(secretKey, low);
+  PlaintextArray pl(ea), ppl(ea);
+  random(ea, pl);
+  Ctxt cl(publicKey);
+  ea.encrypt(cl, publicKey, pl);
+  cl.modDownToSet(low);
+  ea.rotate(cl, 1);
+  rotate(ea, pl, 1);
+  ea.decrypt(cl, secretKey, ppl);
+  bool trimmedOK = equals(ea, pl, ppl);
+
+  // And at the bottom quarter, with matrices that have a single digit
+  IndexSet lowest = IndexSet(cp.first(), cp.first() + (cp.card()+3)/4 - 1) & cp;
+  addTrimmedMatrices(secretKey, lowest, 0, /*nDgts=*/1);
+  ea.encrypt(cl, publicKey, pl);
+  cl.modDownToSet(lowest);
+  ea.rotate(cl, 1);
+  rotate(ea, pl, 1);
+  ea.decrypt(cl, secretKey, ppl);
+  trimmedOK = trimmedOK && equals(ea, pl, ppl);
+
+  // Shifting twice by the same amount, the second one finds its masks in
+  // the cache of ea
+  bool masksOK = true;
+  if (nslots > 1) {
+    long shamt = 1 + RandomBnd(nslots-1);
+    MaskCache* masks = ea.getMaskCache();
+    for (long pass = 0; pass < 2; pass++) {
+      long misses = masks? masks->misses() : 0;
+      PlaintextArray ps(ea), pdec(ea);
+      random(ea, ps);
+      Ctxt cs(publicKey);
+      ea.encrypt(cs, publicKey, ps);
+      ea.shift(cs, shamt);
+      shift(ea, ps, shamt);
+      ea.decrypt(cs, secretKey, pdec);
+      if (!equals(ea, ps, pdec)) masksOK = false;
+      if (pass == 1 && masks && masks->misses() != misses) masksOK = false;
+    }
+  }
+
+  // Total and running sums, whichever strategy they choose
+  PlaintextArray ps(ea), pTot(ea), pRun(ea), pdec(ea);
+  random(ea, ps);
+  pTot = ps;
+  pRun = ps;
+  for (long amt = 1; amt < nslots; amt++) {
+    PlaintextArray t = ps;
+    rotate(ea, t, amt);
+    add(ea, pTot, t);
+    t = ps;
+    shift(ea, t, amt);
+    add(ea, pRun, t);
+  }
+  Ctxt cs(publicKey);
+  ea.encrypt(cs, publicKey, ps);
+  Ctxt cr = cs;
+  totalSums(ea, cs);
+  runningSums(ea, cr);
+  ea.decrypt(cs, secretKey, pdec);
+  bool sumsOK = equals(ea, pTot, pdec);
+  ea.decrypt(cr, secretKey, pdec);
+  sumsOK = sumsOK && equals(ea, pRun, pdec);
+
+  // A linear map that clears the constant coefficient of every slot,
+  // applied by one executor to a batch of ciphertexts
+  long deg = ea.getDegree();
+  std::vector<ZZX> L(deg), C;
+  for (long j = 1; j < deg; j++) SetCoeff(L[j], j);
+  ea.buildLinPolyCoeffs(C, L);
+  LinPolyExecutor linPoly(ea, C);
+  std::vector<Ctxt> linBatch(2, Ctxt(publicKey));
+  ea.encrypt(linBatch[0], publicKey, ps);
+  ea.encrypt(linBatch[1], publicKey, pTot);
+  linPoly.apply(linBatch);
+  bool linPolyOK = true;
+  for (long i = 0; i < 2; i++) {
+    std::vector<ZZX> slots;
+    decode(ea, slots, (i == 0)? ps : pTot);
+    for (ZZX& x: slots) SetCoeff(x, 0, 0);
+    PlaintextArray pexp(ea);
+    encode(ea, pexp, slots);
+    ea.decrypt(linBatch[i], secretKey, pdec);
+    if (!equals(ea, pexp, pdec)) linPolyOK = false;
+  }
+
+  // Plan the matrices for all the rotations, with few of them
+  std::set<long> trace;
+  setAutomorphVals(&trace);
+  for (long amt = 1; amt < nslots; amt++) {
+    Ctxt tmp(c0);
+    ea.rotate(tmp, amt);
+  }
+  setAutomorphVals(NULL);
+  long maxMatrices = 2*context.zMStar.numOfGens();
+  std::set<long> plan = planKeySWmatrices(context, trace, maxMatrices);
+  std::map<long,double> weights;
+  for (long k: trace) weights[k] = 1.0;
+  bool planOK = keySWplanCost(context, plan, weights) >= 0
+    && lsize(plan) <= maxMatrices; // one generator and its inverse suffice
+
+  bool batchOK = (ea.getTag() == PA_GF2_tag)?
+    checkBatch(ea.getDerived(PA_GF2()), secretKey, 3) :
+    checkBatch(ea.getDerived(PA_zz_p()), secretKey, 3);
+  bool hoistedOK = (ea.getTag() == PA_GF2_tag)?
+    checkHoistedRotations(ea.getDerived(PA_GF2()), secretKey) :
+    checkHoistedRotations(ea.getDerived(PA_zz_p()), secretKey);
+  bool lazyOK = checkLazyAssign(ea, secretKey);
+
   if (equals(ea, pp0, p0) && equals(ea, pp1, p1)
-      && equals(ea, pp2, p2) && equals(ea, pp3, p3))
+      && equals(ea, pp2, p2) && equals(ea, pp3, p3) && batchOK && planOK
+      && trimmedOK && singleOK && sumsOK && linPolyOK && hoistedOK
+      && masksOK && lazyOK)
        std::cout << "GOOD\n";
   else std::cout << "BAD\n";
 
@@ -320,12 +531,19 @@ int main(int argc, char **argv)
   long nt=1;
   amap.arg("nt", nt, "num threads");
 
+  long ksCache=0;
+  amap.arg("ksCache", ksCache, "key-switching cache budget (in MB)");
+
+  bool budget=false;
+  amap.arg("budget", budget, "print a report of the noise budget used");
+
   amap.arg("noPrint", noPrint, "suppress printouts");
 
   amap.parse(argc, argv);
 
   SetSeed(ZZ(seed));
   SetNumThreads(nt);
+  setKeySwitchCacheBudget(ksCache << 20);
   
 
   long w = 64; // Hamming weight of secret key
@@ -335,8 +553,16 @@ int main(int argc, char **argv)
   long m = FindM(k, L, c, p, d, s, chosen_m, !noPrint);
 
   setDryRun(dry);
+  CtxtBudgetReport report;
+  if (budget) setCtxtTelemetry(&report);
   for (long repeat_cnt = 0; repeat_cnt < repeat; repeat_cnt++) {
     TestIt(R, p, r, d, c, k, w, L, m, gens, ords);
+    if (getKeySwitchCacheSize() != 0)
+      cout << "BAD: the key-switching cache outlived its context\n";
+  }
+  if (budget) {
+    setCtxtTelemetry(NULL);
+    report.print(std::cout);
   }
 }
 
@@ -0,0 +1,108 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_KeyStore.cpp - the keys of a few tenants over one context: each
+ * one rotates the ciphertexts of its tenant, the keys are loaded once
+ * while they stay in the budget, and the least recently used are dropped.
+ */
+#include <cstdio>
+#include <memory>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "keyStore.h"
+
+// rotate an encryption of v under the tenant's key, decrypt with sk
+static bool rotates(const FHEPubKey& pk, const FHESecKey& sk,
+                    const EncryptedArray& ea)
+{
+  PlaintextArray v(ea), w(ea);
+  random(ea, v);
+  Ctxt c(pk);
+  ea.encrypt(c, pk, v);
+  ea.rotate(c, 1);
+  rotate(ea, v, 1);
+  ea.decrypt(c, sk, w);
+  return equals(ea, v, w);
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long L=4;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long n=3;
+  amap.arg("n", n, "# of tenants");
+  amap.parse(argc, argv);
+
+  FHEcontext context(m, /*p=*/2, /*r=*/1);
+  buildModChain(context, L, /*c=*/2);
+  EncryptedArray ea(context, context.alMod);
+  bool ok = true;
+
+  // the tenants, all but the last with a mapped key file, the last with
+  // an indexed one (which is read in full)
+  vector< unique_ptr<FHESecKey> > secKeys;
+  vector<string> ids, files;
+  for (long i: range(n)) {
+    secKeys.emplace_back(new FHESecKey(context));
+    secKeys[i]->GenSecKey();
+    addSome1DMatrices(*secKeys[i]);
+    ids.push_back("tenant" + to_string(i));
+    files.push_back("Test_KeyStore." + to_string(i) + ".key");
+    if (i < n-1) writePubKeyMapped(files[i], *secKeys[i]);
+    else         writePubKeyIndexed(files[i], *secKeys[i]);
+  }
+
+  // room for two keys, once the size of one is known
+  TenantKeyStore store(context, 0);
+  for (long i: range(n-1)) store.addTenant(ids[i], files[i]);
+  const string lastFile = files[n-1];
+  store.addTenant(ids[n-1], TenantKeyStore::Loader([&](FHEPubKey& pk) {
+      readPubKeyIndexed(lastFile, pk);
+  }));
+  if (store.numLoaded() != 0) ok = false;
+
+  shared_ptr<const FHEPubKey> k0 = store.get(ids[0]);
+  long charge = store.usage();
+  store.setBudget(2*charge + charge/2);
+  if (!rotates(*k0, *secKeys[0], ea)) ok = false;
+  if (store.get(ids[0]) != k0) ok = false;  // a hit
+  shared_ptr<const FHEPubKey> k1 = store.get(ids[1]);
+  if (!rotates(*k1, *secKeys[1], ea)) ok = false;
+  store.get(ids[0]);                         // 1 is now the oldest
+  shared_ptr<const FHEPubKey> k2 = store.get(ids[n-1]);
+  if (!rotates(*k2, *secKeys[n-1], ea)) ok = false;
+  if (store.isLoaded(ids[1]) || !store.isLoaded(ids[0])) ok = false;
+
+  // a dropped key still works for those that hold it
+  if (!rotates(*k1, *secKeys[1], ea)) ok = false;
+  TenantKeyStore::Stats st = store.stats();
+  if (st.hits != 2 || st.loads != 3 || st.evictions != 1) ok = false;
+  if (store.usage() > store.getBudget() || store.numLoaded() != 2) ok = false;
+
+  // nothing fits
+  store.setBudget(0);
+  if (store.numLoaded() != 0 || store.usage() != 0) ok = false;
+  try {
+    store.get("nobody");
+    ok = false;
+  }
+  catch (std::logic_error&) {}
+
+  for (const string& f: files) remove(f.c_str());
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
@@ -0,0 +1,114 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_Memory.cpp - the memory reports of a context, keys and ciphertexts,
+ * and the counters of the DoubleCRT row buffers
+ */
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "memoryUsage.h"
+
+// Every total covers its parts
+static bool consistent(const MemoryReport& r)
+{
+  long sum = 0;
+  for (const MemoryReport& part: r.parts) {
+    if (part.bytes < 0 || !consistent(part)) return false;
+    sum += part.bytes;
+  }
+  return r.bytes >= sum;
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long L=4;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long nCtxts=4;
+  amap.arg("nCtxts", nCtxts, "# of ciphertexts to allocate");
+  bool verbose=false;
+  amap.arg("verbose", verbose, "print the reports");
+  amap.parse(argc, argv);
+
+  bool ok = true;
+  FHEcontext context(m, p, /*r=*/1);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  EncryptedArray ea(context, context.alMod);
+  long phim = context.zMStar.getPhiM();
+
+  // a ciphertext holds at least two parts of phi(m) numbers per prime
+  Ctxt c(secretKey);
+  PlaintextArray v(ea);
+  random(ea, v);
+  ea.encrypt(c, secretKey, v);
+  long rowBytes = 2 * c.getPrimeSet().card() * phim * sizeof(long);
+  if (c.memoryUsage() < rowBytes || c.memoryUsage() > 2*rowBytes + 4096)
+    ok = false;
+  if (Ctxt(secretKey).memoryUsage() >= c.memoryUsage()) ok = false;
+
+  // the reports add up, and grow with the key-switching matrices
+  MemoryReport before = secretKey.memoryReport();
+  addSome1DMatrices(secretKey);
+  MemoryReport after = secretKey.memoryReport();
+  MemoryReport ctx = context.memoryReport();
+  if (verbose) {
+    cout << ctx << before << after;
+    cout << "ciphertext: " << c.memoryUsage() << " bytes\n";
+  }
+  if (!consistent(before) || !consistent(after) || !consistent(ctx))
+    ok = false;
+  if (after.bytes <= before.bytes
+      || after.bytes != secretKey.memoryUsage()
+      || ctx.bytes != context.memoryUsage() || ctx.parts.empty())
+    ok = false;
+  long nMatrices = 0;
+  for (const MemoryReport& part: after.parts)
+    if (part.name.compare(0, 12, "keySwitching") == 0)
+      nMatrices += (part.bytes >= rowBytes);
+  if (nMatrices != 1) ok = false;
+
+  // the counters see the new ciphertexts, and not the ones before them
+  setSlabMemoryCounting(true);
+  SlabMemoryStats s0 = getSlabMemoryStats();
+  long held = 0;
+  {
+    vector<Ctxt> cts(nCtxts, c);
+    for (const Ctxt& ct: cts) held += ct.memoryUsage();
+    SlabMemoryStats s1 = getSlabMemoryStats();
+    if (s1.liveBytes - s0.liveBytes < nCtxts*rowBytes
+        || s1.liveBytes - s0.liveBytes > held
+        || s1.buffers - s0.buffers != 2*nCtxts
+        || s1.peakBytes < s1.liveBytes + s1.pooledBytes)
+      ok = false;
+    if (verbose)
+      cout << "live " << s1.liveBytes << ", pooled " << s1.pooledBytes
+           << ", peak " << s1.peakBytes << ", buffers " << s1.buffers
+           << endl;
+  }
+  SlabMemoryStats s2 = getSlabMemoryStats();
+  if (s2.liveBytes != s0.liveBytes || s2.buffers != s0.buffers) ok = false;
+  resetSlabMemoryPeak();
+  s2 = getSlabMemoryStats();
+  if (s2.peakBytes != s2.liveBytes + s2.pooledBytes) ok = false;
+  setSlabMemoryCounting(false);
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
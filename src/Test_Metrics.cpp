@@ -0,0 +1,142 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_Metrics.cpp - the counters and histograms of metrics.h follow the
+ * operations that are made, nothing is counted while they are off, and the
+ * gauges and the exported text are what was registered.
+ */
+#include <sstream>
+#include <atomic>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "taskScheduler.h"
+#include "metrics.h"
+
+static bool contains(const string& s, const string& what)
+{
+  return s.find(what) != string::npos;
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long r=1;
+  amap.arg("r", r, "lifting");
+  long L=4;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long nt=1;
+  amap.arg("nt", nt, "# of threads");
+  amap.parse(argc, argv);
+  if (nt > 1) SetNumThreads(nt);
+
+  FHEcontext context(m, p, r);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+  const EncryptedArray& ea = *context.ea;
+  bool ok = true;
+
+  PlaintextArray v(ea);
+  random(ea, v);
+  Ctxt c1(secretKey), c2(secretKey);
+  ea.encrypt(c1, secretKey, v);
+  ea.encrypt(c2, secretKey, v);
+
+  // off: nothing is counted
+  resetMetrics();
+  c1.multiplyBy(c2);
+  MetricsSnapshot snap = readMetrics();
+  for (long c = 0; c < METRIC_COUNTER_COUNT; c++)
+    if (snap.counter[c] != 0) ok = false;
+
+  setMetricsOn(true);
+  Ctxt c3(secretKey);
+  ea.encrypt(c3, secretKey, v);
+  c1.multiplyBy(c3);
+  ea.rotate(c1, 1);
+  ostringstream out;
+  c1.write(out);
+  snap = readMetrics();
+  const MetricHistogramSnapshot& ks = snap.histogram[METRIC_KEY_SWITCH_SECONDS];
+  if (snap.counter[METRIC_CTXTS_CREATED] < 1
+      || snap.counter[METRIC_KEY_SWITCHES] < 2
+      || ks.count != snap.counter[METRIC_KEY_SWITCHES]
+      || snap.counter[METRIC_FFT_ROWS] <= 0
+      || snap.counter[METRIC_BYTES_SERIALIZED] != long(out.str().size()))
+    ok = false;
+
+  // the buckets add up, and the quantiles are within the bounds
+  long inBuckets = 0;
+  for (long b = 0; b < MetricHistogramSnapshot::NBUCKETS; b++)
+    inBuckets += ks.buckets[b];
+  if (inBuckets != ks.count || ks.sum <= 0
+      || ks.quantile(0.5) > ks.quantile(1.0)
+      || ks.quantile(1.0) < ks.sum / ks.count)
+    ok = false;
+  if (MetricHistogramSnapshot::bound(0) != 1e-6
+      || MetricHistogramSnapshot::bound(10) != 1024e-6)
+    ok = false;
+
+  // the tasks of a scheduler, from several threads
+  setTaskScheduler(4);
+  std::atomic<long> sum(0);
+  parallelIndex(64, [&sum](long i) { sum += i; });
+  snap = readMetrics();
+  if (sum != 63*32 || snap.counter[METRIC_TASKS_RUN] < 1) ok = false;
+  setTaskScheduler(0);
+
+  // the gauges, and the exported text
+  long mine = addMetricGauge("test_answer", "kind=\"test\"",
+                             []{ return 42.0; });
+  long caches = addCacheGauges(ea, "context=\"test\"");
+  snap = readMetrics();
+  bool found = false;
+  for (const MetricsSnapshot::Gauge& g: snap.gauges)
+    if (g.name == "test_answer" && g.value == 42.0) found = true;
+  if (!found) ok = false;
+
+  ostringstream prom, json;
+  writeMetricsPrometheus(prom, snap);
+  writeMetricsJSON(json, snap);
+  if (!contains(prom.str(), "# TYPE helib_key_switches_total counter\n")
+      || !contains(prom.str(), "helib_key_switch_seconds_bucket{le=\"+Inf\"} "
+                               + std::to_string(ks.count) + "\n")
+      || !contains(prom.str(), "test_answer{kind=\"test\"} 42\n")
+      || !contains(prom.str(), "context=\"test\"")
+      || !contains(json.str(), "\"helib_bytes_serialized_total\": "))
+    ok = false;
+
+  removeMetricGauges(mine);
+  removeMetricGauges(caches);
+  snap = readMetrics();
+  for (const MetricsSnapshot::Gauge& g: snap.gauges)
+    if (g.labels == "kind=\"test\"" || g.labels == "context=\"test\"")
+      ok = false;
+
+  // stopped: the totals stay as they were
+  setMetricsOn(false);
+  long before = readMetrics().counter[METRIC_KEY_SWITCHES];
+  c1.multiplyBy(c2);
+  if (readMetrics().counter[METRIC_KEY_SWITCHES] != before) ok = false;
+  resetMetrics();
+  if (readMetrics().counter[METRIC_KEY_SWITCHES] != 0) ok = false;
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
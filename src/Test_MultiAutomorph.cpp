@@ -0,0 +1,161 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_MultiAutomorph.cpp - the trees of buildAutGraph take one matrix per
+ * step and reach every target in the fewest steps, and multiAutomorph
+ * gives the same ciphertexts as one smartAutomorph for each target.
+ */
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "multiAutomorph.h"
+
+// Collects the automorphisms it is given, and prunes below depth maxDepth
+class Collector : public AutomorphHandler {
+  const AutGraph& tree;
+  std::mutex mtx;
+
+public:
+  std::set<long> handled;
+  long maxDepth;
+
+  Collector(const AutGraph& _tree, long _maxDepth)
+    : tree(_tree), maxDepth(_maxDepth) {}
+
+  bool handle(const Ctxt& ctxt, long k) override
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    handled.insert(k);
+    // the depth of k in the tree
+    long d = 0;
+    for (long i: range(tree.size()))
+      if (tree[i].k == k)
+        for (long j = i; tree[j].parent >= 0; j = tree[j].parent) d++;
+    return d < maxDepth;
+  }
+};
+
+static bool checkTree(const FHESecKey& sk, const EncryptedArray& ea,
+                      const Ctxt& ctxt, const vector<long>& targets)
+{
+  const FHEPubKey& pk = sk;
+  long m = ea.getPAlgebra().getM();
+  bool ok = true;
+  AutGraph tree = buildAutGraph(pk, targets);
+
+  std::set<long> want, got;
+  for (long k: targets) if (mcMod(k, m) != 1) want.insert(mcMod(k, m));
+  for (long i: range(1, tree.size())) {
+    const AutGraph::Node& node = tree[i];
+    if (!pk.haveKeySWmatrix(1, node.step, 0, 0)) ok = false;
+    if (node.parent >= i) ok = false; // parents first
+    if (node.wanted) got.insert(node.k);
+  }
+  if (got != want) ok = false;
+
+  vector< shared_ptr<Ctxt> > out;
+  multiAutomorph(out, ctxt, tree);
+  PlaintextArray res(ea), expected(ea);
+  for (long i: range(tree.size())) {
+    if (!tree[i].wanted) {
+      if (out[i]) ok = false;
+      continue;
+    }
+    Ctxt direct(ctxt);
+    direct.smartAutomorph(tree[i].k);
+    ea.decrypt(direct, sk, expected);
+    ea.decrypt(*out[i], sk, res);
+    if (!equals(ea, res, expected)) ok = false;
+  }
+
+  // the handler sees every wanted node, and pruning below the first level
+  // leaves out what is below a wanted node
+  Collector all(tree, tree.depth());
+  multiAutomorph(ctxt, tree, all);
+  if (all.handled != want) ok = false;
+  Collector top(tree, 1);
+  multiAutomorph(ctxt, tree, top);
+  std::set<long> reached;
+  for (long i: range(1, tree.size())) {
+    if (!tree[i].wanted) continue;
+    bool below = false;
+    for (long j = tree[i].parent; j > 0; j = tree[j].parent)
+      if (tree[j].wanted) below = true;
+    if (!below) reached.insert(tree[i].k);
+  }
+  if (top.handled != reached) ok = false;
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long r=1;
+  amap.arg("r", r, "lifting");
+  long L=4;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long nt=1;
+  amap.arg("nt", nt, "# of threads");
+  amap.parse(argc, argv);
+  if (nt > 1) SetNumThreads(nt);
+
+  FHEcontext context(m, p, r);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+  addSomeFrbMatrices(secretKey);
+  const EncryptedArray& ea = *context.ea;
+  const PAlgebra& zMStar = context.zMStar;
+  bool ok = true;
+
+  PlaintextArray v(ea);
+  random(ea, v);
+  Ctxt ctxt(secretKey);
+  ea.encrypt(ctxt, secretKey, v);
+
+  for (long dim: range(-1, ea.dimension()))
+    if (!checkTree(secretKey, ea, ctxt, dimAutomorphs(zMStar, dim))) {
+      cout << "dimension " << dim << " failed\n";
+      ok = false;
+    }
+  if (!checkTree(secretKey, ea, ctxt, slotAutomorphs(zMStar))) {
+    cout << "the slot automorphisms failed\n";
+    ok = false;
+  }
+
+  // with addSome1DMatrices, no rotation of a native dimension is more than
+  // two key-switchings away (a baby step and a giant step)
+  for (long dim: range(ea.dimension()))
+    if (zMStar.SameOrd(dim) &&
+        buildAutGraph(secretKey, dimAutomorphs(zMStar, dim)).depth() > 2)
+      ok = false;
+
+  try { // a key without matrices reaches nothing
+    FHESecKey bare(context);
+    bare.GenSecKey();
+    buildAutGraph(bare, slotAutomorphs(zMStar));
+    if (ea.size() > 1) ok = false;
+  }
+  catch (std::logic_error&) {}
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
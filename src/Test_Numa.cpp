@@ -0,0 +1,149 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_Numa.cpp - the NUMA policy changes where things are, not what is
+ * computed. On a machine with one node the test splits its CPUs in two
+ * fake nodes, both backed by the real node.
+ */
+#include <set>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "numa.h"
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long L=4;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long nt=1;
+  amap.arg("nt", nt, "# threads");
+  bool verbose=false;
+  amap.arg("verbose", verbose, "print the topology and the statistics");
+  amap.parse(argc, argv);
+
+  if (nt > 1) SetNumThreads(nt);
+  bool ok = true;
+
+  // the topology lists every CPU once
+  const NumaTopology& real = getNumaTopology();
+  std::set<long> seen;
+  long nCpus = 0;
+  for (long i: range(real.nodes())) {
+    if (verbose) cout << "node " << real.nodeIds[i] << ": "
+                      << real.cpus[i].size() << " cpus\n";
+    for (long c: real.cpus[i]) { seen.insert(c); nCpus++; }
+  }
+  if (real.nodes() < 1 || nCpus == 0 || long(seen.size()) != nCpus) ok = false;
+
+  if (real.nodes() == 1) {
+    NumaTopology fake;
+    std::vector<long> cpus = real.cpus[0];
+    long half = (cpus.size()+1)/2;
+    fake.nodeIds.assign(2, real.nodeIds[0]);
+    fake.cpus.push_back(std::vector<long>(cpus.begin(), cpus.begin()+half));
+    fake.cpus.push_back(std::vector<long>(cpus.begin()+half, cpus.end()));
+    if (fake.cpus[1].empty()) fake.cpus[1] = fake.cpus[0];
+    setNumaTopology(fake);
+  }
+  long nNodes = getNumaTopology().nodes();
+
+  // rows go to the nodes in order, and every node gets some
+  long nRows = 4*AvailableThreads();
+  long prev = 0;
+  std::set<long> used;
+  for (long j: range(nRows)) {
+    long node = numaNodeOfRow(j, nRows);
+    if (node < prev || node >= nNodes) ok = false;
+    prev = node;
+    used.insert(node);
+  }
+  if (AvailableThreads() >= nNodes && long(used.size()) != nNodes) ok = false;
+
+  // placing a large buffer, if the system lets us
+  resetNumaStats();
+  std::vector<long> buf(2*FHE_NUMA_MIN_BYTES/sizeof(long), 1);
+  bool supported = numaPlace(buf.data(), buf.size()*sizeof(long), 0, true);
+  numaPlaceRows(buf.data(), buf.size()/nRows, nRows, true);
+  NumaStats st = getNumaStats();
+  if (supported && (st.calls < 2 || st.placedBytes <= 0 || st.failures != 0))
+    ok = false;
+  if (buf[0] != 1 || buf.back() != 1) ok = false;
+
+  FHEcontext context(m, p, /*r=*/1);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+  EncryptedArray ea(context, context.alMod);
+
+  PlaintextArray v1(ea), v2(ea);
+  random(ea, v1);
+  random(ea, v2);
+  Ctxt c1(secretKey), c2(secretKey);
+  ea.encrypt(c1, secretKey, v1);
+  ea.encrypt(c2, secretKey, v2);
+
+  // the same computation with and without the policy
+  NumaPolicy policies[2];
+  policies[1].pinThreads = policies[1].placeRows = true;
+  policies[1].keys = NUMA_KEYS_INTERLEAVE;
+  PlaintextArray results[2] = {PlaintextArray(ea), PlaintextArray(ea)};
+  for (long i: range(2)) {
+    resetNumaStats();
+    bool applied = setNumaPolicy(policies[i]);
+    if (i == 0 && !applied) ok = false;
+    numaPlaceKeys(secretKey);
+    Ctxt c = c1;
+    c.multiplyBy(c2);
+    ea.rotate(c, 1);
+    c += c1;
+    ea.decrypt(c, secretKey, results[i]);
+    if (verbose) {
+      NumaStats s = getNumaStats();
+      cout << "policy " << i << (applied? "" : " (not all applied)")
+           << ": " << s.calls << " calls, " << s.placedBytes
+           << " bytes, " << s.failures << " failures\n";
+    }
+    if (i == 1 && supported && getNumaStats().calls == 0) ok = false;
+  }
+  PlaintextArray expected = v1;
+  mul(ea, expected, v2);
+  rotate(ea, expected, 1);
+  add(ea, expected, v1);
+  if (!equals(ea, results[0], expected) || !equals(ea, results[1], expected))
+    ok = false;
+
+  // a node that does not exist makes the calls fail, and nothing else
+  NumaTopology bad = getNumaTopology();
+  bad.nodeIds.back() = 1000;
+  setNumaTopology(bad);
+  resetNumaStats();
+  if (numaPlace(buf.data(), buf.size()*sizeof(long), nNodes-1, false))
+    ok = false;
+  if (supported && getNumaStats().failures != 1) ok = false;
+  Ctxt c = c1;
+  c += c2;
+  PlaintextArray sum = v1, dec(ea);
+  add(ea, sum, v2);
+  ea.decrypt(c, secretKey, dec);
+  if (!equals(ea, dec, sum)) ok = false;
+  setNumaPolicy(NumaPolicy());
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
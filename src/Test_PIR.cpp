@@ -0,0 +1,107 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+/* Test_PIR.cpp - Retrieving random entries of a random database through
+ * PIRServer, with a database that is written and read back in between
+ */
+#include <sstream>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "pirServer.h"
+#include "timing.h"
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+
+  long m=2047;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long L=6;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long nEntries=60;
+  amap.arg("nEntries", nEntries, "# of entries in the database");
+  long entryBytes=32;
+  amap.arg("entryBytes", entryBytes, "# of bytes per entry");
+  long queries=1;
+  amap.arg("queries", queries, "# of queries in a batch");
+  long nt=1;
+  amap.arg("nt", nt, "# threads");
+  bool noPrint=false;
+  amap.arg("noPrint", noPrint, "suppress printouts");
+  amap.parse(argc, argv);
+
+  if (nt > 1) SetNumThreads(nt);
+  setTimersOn();
+
+  FHEcontext context(m, p, /*r=*/1);
+  buildModChain(context, L, /*c=*/3);
+  if (!noPrint) {
+    context.zMStar.printout();
+    cout << endl;
+  }
+
+  FHESecKey secretKey(context);
+  const FHEPubKey& publicKey = secretKey;
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+  EncryptedArray ea(context, context.alMod);
+
+  vector< vector<uint8_t> > db(nEntries, vector<uint8_t>(entryBytes));
+  for (auto& entry: db)
+    for (auto& byte: entry) byte = RandomBits_long(8);
+
+  bool error = false;
+  {
+  PIRServer encoded(ea, db);
+  stringstream str;
+  encoded.write(str);
+  PIRServer server(ea, str);
+  if (server.size() != nEntries || server.groups() != encoded.groups()
+      || server.chunks() != encoded.chunks())
+    error = true;
+  if (!noPrint)
+    cout << "** " << nEntries << " entries of " << entryBytes << " bytes, "
+         << server.groups() << " groups, " << server.chunks()
+         << " chunks, " << str.str().size() << " bytes encoded\n";
+
+  vector<long> idx(queries);
+  vector<PIRQuery> qs(queries, PIRQuery(publicKey));
+  for (long i=0; i<queries; i++) {
+    idx[i] = RandomBnd(nEntries);
+    encryptPIRQuery(qs[i], ea, idx[i], server.groups(), publicKey);
+  }
+
+  vector< vector<Ctxt> > answers;
+  if (queries == 1) {
+    answers.resize(1);
+    server.answer(answers[0], qs[0]);
+  }
+  else server.answer(answers, qs);
+
+  for (long i=0; i<queries; i++) {
+    vector<uint8_t> entry;
+    decryptPIRAnswer(entry, answers[i], idx[i], entryBytes, ea, secretKey);
+    if (entry != db[idx[i]]) {
+      if (!noPrint) cout << "  entry " << idx[i] << " is wrong\n";
+      error = true;
+    }
+  }
+  }
+  cout << (error? "BAD" : "GOOD") << endl;
+
+  if (!noPrint) printAllTimers();
+  return error? -1 : 0;
+}
@@ -12,6 +12,7 @@
 
 /* Test_Permutations.cpp - Applying plaintext permutation to encrypted vector
  */
+#include <cstdio>
 #include <NTL/ZZ.h>
 NTL_CLIENT
 
@@ -55,6 +56,27 @@ void testCube(Vec<GenDescriptor>& vec, long widthBound)
   trees.getCubeDims(dims);
   CubeSignature sig(dims);
 
+  // The same trees again, from a stored solution
+  {
+    const char* storeFile = "permPlanStore.tmp";
+    std::remove(storeFile);
+    clearPermPlanCache();
+    setPermPlanStore(storeFile);
+    GeneratorTrees trees2;
+    trees2.buildOptimalTrees(vec, widthBound); // solve and store
+    clearPermPlanCache();
+    setPermPlanStore(storeFile);               // reload the file
+    GeneratorTrees trees3;
+    long cost3 = trees3.buildOptimalTrees(vec, widthBound);
+    setPermPlanStore("");
+    std::remove(storeFile);
+    Vec<long> dims3;
+    trees3.getCubeDims(dims3);
+    if (cost3==cost && dims3==dims && trees3.numLayers()==trees.numLayers())
+      cout << "GOOD\n";
+    else cout << "BAD (stored trees)\n";
+  }
+
   for (long cnt=0; cnt<3; cnt++) {
     Permut pi;
     randomPerm(pi, trees.getSize());
@@ -76,9 +98,45 @@ void testCube(Vec<GenDescriptor>& vec, long widthBound)
 	     << cube3.getData()<<endl<<endl;
       }
     }
+
+    // Update the network after swapping two entries of pi
+    PermNetwork net2;
+    net2.updateNetwork(pi, trees);
+    long i1 = RandomBnd(pi.length()), i2 = RandomBnd(pi.length());
+    std::swap(pi[i1], pi[i2]);
+    net2.updateNetwork(pi, trees);
+    HyperCube<long> cube4 = cube1;
+    applyPermToVec(cube2.getData(), cube1.getData(), pi);
+    net2.applyToCube(cube4);
+    if (cube2==cube4) cout << "GOOD\n";
+    else cout << "BAD (updated network)\n";
   }
 }
 
+// A Benes network that is updated for a slightly different permutation
+// must be the one built from scratch, without routing all of it again
+void testBenesUpdate(long n)
+{
+  if (n < 2) return;
+  Permut pi;
+  randomPerm(pi, n);
+  GeneralBenesNetwork net(pi);
+  Permut pi2 = pi;
+  long i = RandomBnd(n-1);
+  std::swap(pi2[i], pi2[i+1]);
+
+  GeneralBenesNetwork fresh(pi2), updated(pi2, net), same(pi, net);
+  bool ok = updated.testNetwork(pi2) && same.testNetwork(pi)
+    && same.getNumRouted() == 0
+    && updated.getNumRouted() <= fresh.getNumRouted();
+  for (long l=0; ok && l<fresh.getNumLevels(); l++)
+    if (fresh.getLevel(l) != updated.getLevel(l)) ok = false;
+  if (!noPrint)
+    cout << "@testBenesUpdate(n="<<n<<"): routed "<<updated.getNumRouted()
+         << " of "<<fresh.getNumRouted()<<" sub-networks\n";
+  cout << (ok? "GOOD\n" : "BAD (updated Benes network)\n");
+}
+
 void testCtxt(long m, long p, long widthBound, long L, long r)
 {
   if (!noPrint)
@@ -250,6 +308,8 @@ int main(int argc, char *argv[])
       cout << ", depth="<<depth<<"\n";
     }
     testCube(vec, depth);
+    testBenesUpdate(ord1);
+    testBenesUpdate(1000);
   }
   else {
     setTimersOn();
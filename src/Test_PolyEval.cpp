@@ -13,6 +13,7 @@
  * Test_PolyEval.cpp - Homomorphic Polynomial Evaluation
  */
 #include <NTL/ZZ.h>
+#include <NTL/BasicThreadPool.h>
 NTL_CLIENT
 #include "polyEval.h"
 #include "EncryptedArray.h"
@@ -114,6 +115,26 @@ void testIt(long d, long k, long p, long r, long m, long L,
       exit(0);
     }
   }
+
+  // Evaluate a few polynomials of smaller degrees along with poly, sharing
+  // the powers of inCtxt
+  std::vector<ZZX> polys(1, poly);
+  for (long dd=d/2; dd>=0; dd = (dd>1)? dd/2 : -1) {
+    ZZX pp;
+    for (long i=dd; i>=0; i--) SetCoeff(pp, i, RandomBnd(p2r));
+    polys.push_back(pp);
+  }
+  std::vector<Ctxt> outCtxts;
+  polyEval(outCtxts, polys, inCtxt, k);
+  for (long j=0; j<lsize(polys); j++) {
+    ea.decrypt(outCtxts[j], secretKey, y);
+    for (long i=0; i<ea.size(); i++)
+      if (polyEvalMod(polys[j], x[i], p2r) != y[i]) {
+        std::cout << "BAD\n";
+        if (!noPrint) cout<<"  shared-powers poly "<<j<<" MISMATCH\n";
+        exit(0);
+      }
+  }
   std::cout << "GOOD\n" << std::flush;
 }
 
@@ -129,6 +150,7 @@ void usage(char *prog)
   std::cout << "    d=undefined means trying a few powers d=1,...,4,25,...,34"<<endl;
   std::cout << "  k is the baby-step parameter [default=undefined]" << endl;
   std::cout << "    if k is undefined it is computed from d" << endl;
+  std::cout << "  nt is the number of threads [default=1]" << endl;
   std::cout << "  noPrint suppresses printouts [default=0]" << endl;
   exit(0);
 }
@@ -142,6 +164,7 @@ int main(int argc, char *argv[])
   argmap["d"] = "-1";
   argmap["k"] = "0";
   argmap["dry"] = "0";
+  argmap["nt"] = "1";
   argmap["noPrint"] = "1";
 
   // get parameters from the command line
@@ -153,6 +176,7 @@ int main(int argc, char *argv[])
   long d = atoi(argmap["d"]);
   long k = atoi(argmap["k"]);
   bool dry = atoi(argmap["dry"]);
+  long nt = atoi(argmap["nt"]);
   noPrint = atoi(argmap["noPrint"]);
 
   long max_d = (d<=0)? 35 : d;
@@ -160,6 +184,7 @@ int main(int argc, char *argv[])
   if (m<2)
     m = FindM(/*secprm=*/80, L, /*c=*/3, p, 1, 0, m, !noPrint);
   setDryRun(dry);
+  if (nt>1) SetNumThreads(nt);
 
   // Test both monic and non-monic polynomials of this degree
   if (d>=0) {
@@ -29,6 +29,12 @@ void testSimpleConversion(const Vec<long>& mvec)
   pConv.polyToPowerful(cube, poly);
   pConv.powerfulToPoly(poly2, cube);
   cout << ((poly == poly2)? "GOOD" : "BAD") << endl;
+
+  // A polynomial of degree up to m-1 comes back reduced mod Phi_m(X)
+  random(poly, ind.m);
+  pConv.polyToPowerful(cube, poly);
+  pConv.powerfulToPoly(poly2, cube);
+  cout << ((poly % conv<zz_pX>(ind.phimX) == poly2)? "GOOD" : "BAD") << endl;
 }
 
 void testHighLvlConversion(const FHEcontext& context, const Vec<long>& mvec)
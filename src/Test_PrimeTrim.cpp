@@ -0,0 +1,113 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_PrimeTrim.cpp - Ctxt::trimPrimes keeps the margin it is given, and
+ * a computation under eager trimming decrypts as without it, on no more
+ * primes.
+ */
+#include <NTL/ZZX.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+
+// A few additions, a rotation, constants and two multiplications
+static void circuit(const EncryptedArray& ea, Ctxt& x, const Ctxt& y,
+                    const ZZX& c)
+{
+  x += y;
+  ea.rotate(x, 1);
+  x.multByConstant(c);
+  x.multiplyBy(y);
+  x -= y;
+  x.addConstant(c);
+  x.multiplyBy(x);
+}
+
+static void circuit(const EncryptedArray& ea, PlaintextArray& x,
+                    const PlaintextArray& y, const PlaintextArray& c)
+{
+  add(ea, x, y);
+  rotate(ea, x, 1);
+  mul(ea, x, c);
+  mul(ea, x, y);
+  sub(ea, x, y);
+  add(ea, x, c);
+  mul(ea, x, x);
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long r=1;
+  amap.arg("r", r, "lifting");
+  long L=8;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long margin=3;
+  amap.arg("margin", margin, "bits above the mod-switching noise");
+  amap.parse(argc, argv);
+
+  FHEcontext context(m, p, r);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+  const FHEPubKey& publicKey = secretKey;
+  const EncryptedArray& ea = *context.ea;
+  bool ok = true;
+
+  PlaintextArray u(ea), v(ea), c(ea), res(ea);
+  random(ea, u);
+  random(ea, v);
+  random(ea, c);
+  ZZX cPoly;
+  ea.encode(cPoly, c);
+  Ctxt x(publicKey), y(publicKey);
+  ea.encrypt(x, publicKey, u);
+  ea.encrypt(y, publicKey, v);
+
+  // a fresh ciphertext has far more primes than its noise needs
+  Ctxt t(x);
+  t.trimPrimes(margin);
+  ea.decrypt(t, secretKey, res);
+  if (!equals(ea, res, u)) ok = false;
+  if (t.getPrimeSet().card() >= x.getPrimeSet().card()) ok = false;
+  if (log(t.getNoiseBound()) < log(t.modSwitchAddedNoiseBound())
+                               + (margin-0.01)*log(2.0)) ok = false;
+  Ctxt again(t);
+  again.trimPrimes(margin); // nothing left to drop
+  if (again.getPrimeSet() != t.getPrimeSet()) ok = false;
+
+  PlaintextArray expected(u);
+  circuit(ea, expected, v, c);
+
+  Ctxt lazy(x);
+  circuit(ea, lazy, y, cPoly);
+  context.primeTrim.eager = true;
+  context.primeTrim.marginBits = margin;
+  Ctxt eager(x);
+  circuit(ea, eager, y, cPoly);
+  context.primeTrim.eager = false;
+
+  ea.decrypt(lazy, secretKey, res);
+  if (!equals(ea, res, expected)) ok = false;
+  ea.decrypt(eager, secretKey, res);
+  if (!equals(ea, res, expected)) ok = false;
+  if (eager.getPrimeSet().card() > lazy.getPrimeSet().card()) ok = false;
+  if (eager.capacity() <= 0) ok = false;
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
@@ -0,0 +1,460 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_Regress.cpp - a performance regression harness over fixed presets
+ *
+ *   Test_Regress_x out=a.json                 time all the presets
+ *   Test_Regress_x out=b.json base=a.json     ... and compare with a.json
+ *   Test_Regress_x new=b.json base=a.json     only compare two result files
+ *
+ * Every preset is a fixed parameter set (small, medium, bootstrappable and
+ * CKKS) with a fixed seed, so two builds time the same keys on the same
+ * inputs. The process is pinned to the CPUs cpu,...,cpu+nt-1 before the
+ * thread pool is started (on Linux), every operation is called warmup times
+ * before it is timed, and then batches of calls that take at least minTime
+ * seconds are timed until the 95% confidence interval of the median time
+ * per call is within tol of the median (between minReps and maxReps
+ * batches).
+ *
+ * An operation regresses if its median is more than threshold slower than
+ * in the base file and the two confidence intervals do not overlap, i.e.,
+ * a slowdown that is within the noise of either run is reported but does
+ * not fail. The program returns -1 if any operation regresses.
+ */
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <NTL/ZZ.h>
+#include <NTL/version.h>
+#include <NTL/BasicThreadPool.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+
+// The parameter sets. The table is part of the file format: changing a
+// preset makes its results incomparable with older files.
+struct RegressPreset {
+  const char *name;
+  long m, p, r, L, c;
+  long mvec[3], gens[3], ords[3];
+  double cM;
+  bool bootstrappable;
+};
+
+static const RegressPreset regressPresets[] = {
+// name, m, p, r, L(bits), c, mvec, gens, ords, c_m, bootstrappable
+  {"small",  1023,  2,  1, 300, 2, {0},        {0},              {0},
+   1.0, false},
+  {"medium", 4641,  2,  1, 600, 3, {7,3,221},  {3979,3095,3760}, {6,2,-8},
+   3.0, false},
+  {"boot",   1023,  2,  1, 600, 3, {11,93},    {838,584},        {10,6},
+   1.0, true},
+  {"ckks",   2048, -1, 20, 300, 2, {0},        {0},              {0},
+   1.0, false}
+};
+
+// Everything that the operations need, for one preset
+struct RegressEnv {
+  const RegressPreset *preset;
+  std::unique_ptr<FHEcontext> context;
+  std::unique_ptr<FHESecKey> secKey;
+
+  bool isCKKS() const { return preset->p < 0; }
+  const FHEPubKey& pubKey() const { return *secKey; }
+  const EncryptedArray& ea() const { return *context->ea; }
+
+  void encryptRandom(Ctxt& c) const {
+    if (isCKKS()) {
+      std::vector<double> v;
+      ea().getCx().random(v);
+      ea().getCx().encrypt(c, pubKey(), v);
+    }
+    else {
+      std::vector<long> v;
+      ea().random(v);
+      ea().encrypt(c, pubKey(), v);
+    }
+  }
+};
+
+static void buildEnv(RegressEnv& env, const RegressPreset& pr, long seed)
+{
+  SetSeed(ZZ(seed)); // the same keys and inputs whatever else is run
+  std::vector<long> gens, ords;
+  Vec<long> mvec;
+  for (long i: range(3)) {
+    if (pr.mvec[i] > 1) append(mvec, pr.mvec[i]);
+    if (pr.gens[i] > 1) gens.push_back(pr.gens[i]);
+    if (abs(pr.ords[i]) > 1) ords.push_back(pr.ords[i]);
+  }
+
+  env.preset = &pr;
+  env.context.reset(new FHEcontext(pr.m, pr.p, pr.r, gens, ords));
+  env.context->zMStar.set_cM(pr.cM);
+  buildModChain(*env.context, pr.L, pr.c, pr.bootstrappable);
+  if (pr.bootstrappable)
+    env.context->makeBootstrappable(mvec, /*t=*/0, /*build_cache=*/false);
+
+  env.secKey.reset(new FHESecKey(*env.context));
+  env.secKey->GenSecKey(pr.bootstrappable? 64 : 0);
+  addSome1DMatrices(*env.secKey);
+  if (pr.bootstrappable) env.secKey->genRecryptData();
+}
+
+//======================== statistics ========================
+
+// The median of the samples and a distribution-free 95% confidence
+// interval for it, from the order statistics around n/2
+struct MedianCI {
+  double median, lo, hi;
+
+  explicit MedianCI(std::vector<double> v) {
+    assert(!v.empty());
+    std::sort(v.begin(), v.end());
+    long n = v.size();
+    median = (n%2)? v[n/2] : (v[n/2-1]+v[n/2])/2;
+    double w = 1.96*sqrt(double(n))/2;
+    long i = std::max(0L, long(floor(n/2.0 - w)));
+    long j = std::min(n-1, long(ceil(n/2.0 + w)) - 1);
+    lo = std::min(v[i], median);
+    hi = std::max(v[j], median);
+  }
+  double relWidth() const { return (median>0)? (hi-lo)/(2*median) : 0; }
+};
+
+struct RegressResult {
+  std::string preset, op;
+  long m, phim, nPrimes, threads, iters;
+  bool converged;
+  double median, lo, hi;
+  std::vector<double> samples; // seconds per call, one for each batch
+
+  bool sameCase(const RegressResult& o) const
+  { return preset == o.preset && op == o.op; }
+};
+
+// Runs and times the calls of one operation
+class Repeater {
+public:
+  long warmup, minReps, maxReps;
+  double minTime, tol;
+
+  template<class Body, class Prep>
+  void measure(RegressResult& res, const Body& body, const Prep& prep) const
+  {
+    auto timeIt = [&]() {
+      prep();
+      auto start = std::chrono::steady_clock::now();
+      body();
+      std::chrono::duration<double> d = std::chrono::steady_clock::now()-start;
+      return d.count();
+    };
+
+    double t = timeIt(); // the first warm-up call, also calibrates the batch
+    for (long i=1; i<warmup; i++) t = std::min(t, timeIt());
+    res.iters = std::max(1L, long(ceil(minTime / std::max(t, 1e-9))));
+    res.iters = std::min(res.iters, 1000000L);
+
+    res.samples.clear();
+    res.converged = false;
+    while (long(res.samples.size()) < std::max(minReps, 1L)
+           || (!res.converged && long(res.samples.size()) < maxReps)) {
+      double total = 0;
+      for (long i=0; i<res.iters; i++) total += timeIt();
+      res.samples.push_back(total/res.iters);
+      res.converged = (MedianCI(res.samples).relWidth() <= tol);
+    }
+    MedianCI ci(res.samples);
+    res.median = ci.median;
+    res.lo = ci.lo;
+    res.hi = ci.hi;
+  }
+};
+
+//======================== the workload ========================
+
+// Is name in the comma-separated list (or is the list "all")?
+static bool selected(const std::string& list, const char *name)
+{
+  if (list == "all") return true;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    if (item == name) return true;
+  return false;
+}
+
+static void runPreset(std::vector<RegressResult>& results,
+                      const RegressEnv& env, const Repeater& rep,
+                      const std::string& ops)
+{
+  const FHEcontext& context = *env.context;
+  RegressResult proto;
+  proto.preset = env.preset->name;
+  proto.m = context.zMStar.getM();
+  proto.phim = context.zMStar.getPhiM();
+  proto.nPrimes = context.ctxtPrimes.card();
+  proto.threads = AvailableThreads();
+
+  Ctxt c1(env.pubKey()), c2(env.pubKey()), t(env.pubKey());
+  env.encryptRandom(c1);
+  env.encryptRandom(c2);
+  ZZX poly;
+  for (long i: range(proto.phim)) SetCoeff(poly, i, RandomBnd(2));
+
+  auto run = [&](const char *op, std::function<void()> body,
+                 std::function<void()> prep) {
+    if (!selected(ops, op)) return;
+    RegressResult res = proto;
+    res.op = op;
+    rep.measure(res, body, prep);
+    cout << "  " << res.preset << "/" << res.op << ": " << res.median
+         << " sec/call [" << res.lo << ", " << res.hi << "], "
+         << res.samples.size() << " x " << res.iters << " calls"
+         << (res.converged? "" : ", not converged") << endl;
+    results.push_back(res);
+  };
+  auto reset = [&]() { t = c1; };
+  auto nothing = []() {};
+
+  run("encrypt", [&]() { env.encryptRandom(t); }, nothing);
+  if (env.isCKKS()) {
+    std::vector<double> v;
+    run("decrypt", [&]() { env.ea().getCx().decrypt(c1, *env.secKey, v); },
+        nothing);
+  }
+  else {
+    std::vector<long> v;
+    run("decrypt", [&]() { env.ea().decrypt(c1, *env.secKey, v); }, nothing);
+  }
+  run("add", [&]() { t += c2; }, reset);
+  run("multByConstant", [&]() { t.multByConstant(poly); }, reset);
+  run("multiply", [&]() { t.multiplyBy(c2); }, reset);
+  run("rotate", [&]() { env.ea().rotate(t, 1); }, reset);
+  if (env.preset->bootstrappable)
+    run("reCrypt", [&]() { env.pubKey().reCrypt(t); }, reset);
+}
+
+//======================== the result files ========================
+
+static void writeJSON(ostream& str, const std::vector<RegressResult>& results,
+                      const Repeater& rep, long seed, bool pinned)
+{
+  str << "{\"harness\": \"Test_Regress\", \"version\": 1"
+      << ", \"ntl\": \"" << NTL_VERSION << "\", \"seed\": " << seed
+      << ", \"pinned\": " << (pinned? "true" : "false")
+      << ", \"warmup\": " << rep.warmup << ", \"minTime\": " << rep.minTime
+      << ", \"tol\": " << rep.tol << ", \"unit\": \"seconds per call\",\n"
+      << " \"results\": [";
+  // one result per line, which is all that readJSON relies on
+  for (long i: range(results.size())) {
+    const RegressResult& r = results[i];
+    str << (i? ",\n" : "\n") << "  {\"preset\": \"" << r.preset << "\""
+        << ", \"op\": \"" << r.op << "\", \"m\": " << r.m
+        << ", \"phim\": " << r.phim << ", \"nPrimes\": " << r.nPrimes
+        << ", \"threads\": " << r.threads << ", \"iters\": " << r.iters
+        << ", \"converged\": " << (r.converged? "true" : "false")
+        << ", \"median\": " << r.median << ", \"lo\": " << r.lo
+        << ", \"hi\": " << r.hi << ", \"samples\": [";
+    for (long j: range(r.samples.size()))
+      str << (j? ", " : "") << r.samples[j];
+    str << "]}";
+  }
+  str << "\n]}\n";
+}
+
+// The value of "key" in a line that writeJSON wrote, or "" if none
+static std::string jsonField(const std::string& line, const char *key)
+{
+  std::string pat = std::string("\"") + key + "\": ";
+  size_t pos = line.find(pat);
+  if (pos == std::string::npos) return "";
+  pos += pat.size();
+  if (line[pos] == '"') {
+    size_t end = line.find('"', pos+1);
+    return line.substr(pos+1, end-pos-1);
+  }
+  size_t end = line.find_first_of(",}", pos);
+  return line.substr(pos, end-pos);
+}
+
+static void readJSON(std::vector<RegressResult>& results,
+                     const std::string& fileName)
+{
+  ifstream f(fileName);
+  if (!f) throw std::runtime_error("cannot open " + fileName);
+  results.clear();
+  std::string line;
+  while (std::getline(f, line)) {
+    if (jsonField(line, "preset").empty()) continue;
+    RegressResult r;
+    r.preset = jsonField(line, "preset");
+    r.op = jsonField(line, "op");
+    r.m = atol(jsonField(line, "m").c_str());
+    r.phim = atol(jsonField(line, "phim").c_str());
+    r.nPrimes = atol(jsonField(line, "nPrimes").c_str());
+    r.threads = atol(jsonField(line, "threads").c_str());
+    r.iters = atol(jsonField(line, "iters").c_str());
+    r.converged = (jsonField(line, "converged") == "true");
+    r.median = atof(jsonField(line, "median").c_str());
+    r.lo = atof(jsonField(line, "lo").c_str());
+    r.hi = atof(jsonField(line, "hi").c_str());
+    if (r.op.empty() || r.median <= 0)
+      throw std::runtime_error("bad result in " + fileName + ": " + line);
+    results.push_back(r);
+  }
+  if (results.empty())
+    throw std::runtime_error("no results in " + fileName);
+}
+
+// Compare every result with the same case in the base, returns false if
+// any of them regressed
+static bool compareResults(ostream& str, const std::vector<RegressResult>& base,
+                           const std::vector<RegressResult>& cur,
+                           double threshold)
+{
+  long nRegressed = 0, nCompared = 0;
+  for (const RegressResult& r: cur) {
+    str << "  " << r.preset << "/" << r.op << ": ";
+    auto it = std::find_if(base.begin(), base.end(),
+                           [&](const RegressResult& b){ return b.sameCase(r); });
+    if (it == base.end()) {
+      str << "not in the base\n";
+      continue;
+    }
+    const RegressResult& b = *it;
+    if (b.m != r.m || b.nPrimes != r.nPrimes || b.threads != r.threads) {
+      str << "different parameters or threads, skipped\n";
+      continue;
+    }
+    nCompared++;
+    double ratio = r.median / b.median;
+    bool slower = (ratio > 1+threshold);
+    bool significant = (r.lo > b.hi || r.hi < b.lo);
+    str << b.median << " -> " << r.median << " sec/call ("
+        << (ratio >= 1? "+" : "") << 100*(ratio-1) << "%)";
+    if (slower && significant) {
+      str << "  REGRESSION";
+      nRegressed++;
+    }
+    else if (slower) str << "  slower, within the noise";
+    else if (ratio < 1-threshold && significant) str << "  faster";
+    str << "\n";
+  }
+  for (const RegressResult& b: base) {
+    bool found = false;
+    for (const RegressResult& r: cur) found = found || r.sameCase(b);
+    if (!found) str << "  " << b.preset << "/" << b.op << ": not run\n";
+  }
+  str << nCompared << " compared, " << nRegressed << " regressed (threshold "
+      << 100*threshold << "%)\n";
+  return nRegressed == 0;
+}
+
+// Restrict this thread, and so the threads that it starts later, to the
+// CPUs first,...,first+n-1. Returns false if that is not supported or fails.
+static bool pinToCPUs(long first, long n)
+{
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (long i: range(n)) CPU_SET(first+i, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  std::string presets = "all";
+  amap.arg("presets", presets, "comma-separated presets to run, or all");
+  amap.note("small, medium, boot, ckks");
+  std::string ops = "all";
+  amap.arg("ops", ops, "comma-separated operations to time, or all");
+  long nt = 1;
+  amap.arg("nt", nt, "# threads");
+  bool pin = true;
+  amap.arg("pin", pin, "pin the threads to the CPUs cpu,...,cpu+nt-1");
+  long cpu = 0;
+  amap.arg("cpu", cpu, "the first CPU to pin to");
+  Repeater rep;
+  rep.warmup = 2;
+  amap.arg("warmup", rep.warmup, "untimed calls before timing an operation");
+  rep.minReps = 5;
+  amap.arg("minReps", rep.minReps, "minimum number of timed batches");
+  rep.maxReps = 30;
+  amap.arg("maxReps", rep.maxReps, "maximum number of timed batches");
+  rep.minTime = 0.1;
+  amap.arg("minTime", rep.minTime, "minimum duration of a batch (seconds)");
+  rep.tol = 0.02;
+  amap.arg("tol", rep.tol, "target half-width of the confidence interval");
+  long seed = 0;
+  amap.arg("seed", seed, "PRG seed");
+  std::string out;
+  amap.arg("out", out, "write the results to this JSON file", NULL);
+  std::string baseFile;
+  amap.arg("base", baseFile, "compare the results with this JSON file", NULL);
+  std::string newFile;
+  amap.arg("new", newFile, "compare this JSON file instead of running", NULL);
+  double threshold = 0.05;
+  amap.arg("threshold", threshold, "relative slowdown that fails");
+  amap.parse(argc, argv);
+
+  std::vector<RegressResult> results;
+  try {
+    if (!newFile.empty()) readJSON(results, newFile);
+    else {
+      bool pinned = pin && pinToCPUs(cpu, std::max(nt, 1L));
+      if (pin && !pinned) cerr << "cannot pin the threads, running unpinned\n";
+      SetNumThreads(std::max(nt, 1L));
+
+      for (const RegressPreset& pr: regressPresets) {
+        if (!selected(presets, pr.name)) continue;
+        RegressEnv env;
+        buildEnv(env, pr, seed);
+        cout << pr.name << ": m=" << pr.m << ", "
+             << env.context->ctxtPrimes.card() << " ctxt primes, nt="
+             << AvailableThreads() << endl;
+        runPreset(results, env, rep, ops);
+      }
+      if (!out.empty()) {
+        ofstream f(out);
+        if (!f) throw std::runtime_error("cannot open " + out);
+        writeJSON(f, results, rep, seed, pinned);
+      }
+    }
+
+    if (!baseFile.empty()) {
+      std::vector<RegressResult> base;
+      readJSON(base, baseFile);
+      bool pass = compareResults(cout, base, results, threshold);
+      cout << (pass? "PASS" : "FAIL") << endl;
+      return pass? 0 : -1;
+    }
+  }
+  catch (std::exception& e) {
+    cerr << e.what() << endl;
+    return -1;
+  }
+  return 0;
+}
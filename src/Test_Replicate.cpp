@@ -17,6 +17,7 @@
 
 #include <cassert>
 #include <NTL/lzz_pXFactoring.h>
+#include <NTL/BasicThreadPool.h>
 NTL_CLIENT
 
 #include "FHE.h"
@@ -88,6 +89,14 @@ public:
 };
 
 
+// Keeps the replicated ciphertexts by index, safe to call from many threads
+// since every call writes a different entry
+class ReplicateCollector : public ReplicateHandler {
+public:
+  std::vector<Ctxt>& v;
+  explicit ReplicateCollector(std::vector<Ctxt>& _v): v(_v) {}
+  virtual void handle(const Ctxt& ctxt, long idx) { v.at(idx) = ctxt; }
+};
 
 void  TestIt(long m, long p, long r, long d, long L, long bnd, long B)
 {
@@ -175,6 +184,23 @@ void  TestIt(long m, long p, long r, long d, long L, long bnd, long B)
     cout << "  total time=" << handler->t_total << " ("
          << ((B>0)? B : ea.size()) << " vectors)\n";
   delete handler;
+
+  if (!noPrint) cout << "** Testing replicateAllParallel()... " << std::flush;
+  std::vector<Ctxt> v(ea.size(), Ctxt(publicKey));
+  ReplicateCollector collector(v);
+  {
+    FHE_NTIMER_START(replicateAllParallel);
+    replicateAllParallel(ea, xc0, &collector, /*maxLive=*/0, bnd);
+  }
+  error = false;
+  for (long i=0; i<ea.size(); i++) {
+    PlaintextArray pa1 = xp0;
+    replicate(ea, pa1, i);
+    PlaintextArray pa2(ea);
+    ea.decrypt(v[i], secretKey, pa2);
+    if (!equals(ea, pa1, pa2)) error = true;
+  }
+  std::cout << (error? "BAD" : "GOOD") << endl;
 }
 
 int main(int argc, char *argv[]) 
@@ -206,10 +232,14 @@ int main(int argc, char *argv[])
   long B = 0;
   amap.arg("B", B, "bound for # of replications", "all");
 
+  long nthreads = 1;
+  amap.arg("nthreads", nthreads, "number of threads");
+
   amap.arg("noPrint", noPrint, "suppress printouts");
 
   amap.parse(argc, argv);
   setDryRun(dry);
+  if (nthreads > 1) SetNumThreads(nthreads);
 
   TestIt(m, p, r, d, L, bnd, B);
   cout << endl;
@@ -0,0 +1,136 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_RingSwitch.cpp - a computation on plaintexts of the subring, done
+ * in the ring of m, decrypts to the same slots after ringSwitch to m', any
+ * other plaintext to its projection, and the switched ciphertext is
+ * smaller.
+ */
+#include <sstream>
+#include <stdexcept>
+#include <NTL/ZZX.h>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "ringSwitch.h"
+
+// The coefficients in [0,p)
+static void reduceMod(ZZX& a, long p)
+{
+  for (long i = 0; i <= deg(a); i++) a.rep[i] %= p;
+  a.normalize();
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=637;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long m2=91;
+  amap.arg("m2", m2, "the smaller cyclotomic, m2 | m");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long r=1;
+  amap.arg("r", r, "lifting");
+  long L=4;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long nt=1;
+  amap.arg("nt", nt, "# of threads");
+  amap.parse(argc, argv);
+  if (nt > 1) SetNumThreads(nt);
+
+  FHEcontext big(m, p, r), small(m2, p, r);
+  buildModChain(big, L, /*c=*/2);
+  buildRingSwitchChain(small, big);
+  long d = ringSwitchDegree(big, small);
+  bool ok = (d == m/m2);
+
+  FHESecKey bigKey(big), smallKey(small);
+  bigKey.GenSecKey();
+  smallKey.GenSecKey();
+  long keyID = addRingSwitchKey(bigKey, smallKey);
+  const EncryptedArray& ea = *small.ea;
+  long ptxtSpace = big.alMod.getPPowR();
+
+  // v*v + w, with v and w as plaintexts of the subring of m
+  PlaintextArray v(ea), w(ea);
+  random(ea, v);
+  random(ea, w);
+  ZZX pv, pw, bv, bw;
+  ea.encode(pv, v);
+  ea.encode(pw, w);
+  ringEmbed(bv, pv, d);
+  ringEmbed(bw, pw, d);
+  Ctxt cv(bigKey), cw(bigKey);
+  bigKey.Encrypt(cv, bv, ptxtSpace);
+  bigKey.Encrypt(cw, bw, ptxtSpace);
+  cv.multiplyBy(cv);
+  cv += cw;
+
+  Ctxt res(smallKey);
+  ringSwitch(res, cv, keyID);
+  PlaintextArray got(ea), expected(v);
+  mul(ea, expected, v);
+  add(ea, expected, w);
+  ea.decrypt(res, smallKey, got);
+  if (!equals(ea, got, expected)) {
+    cout << "the slots differ after ringSwitch\n";
+    ok = false;
+  }
+
+  // and a computation in the small ring goes on from there
+  Ctxt cw2(smallKey);
+  ea.encrypt(cw2, smallKey, w);
+  res.multiplyBy(cw2);
+  mul(ea, expected, w);
+  ea.decrypt(res, smallKey, got);
+  if (!equals(ea, got, expected)) ok = false;
+
+  // any plaintext of m goes to its projection
+  ZZX a, proj, dec;
+  for (long i: range(big.zMStar.getPhiM()))
+    SetCoeff(a, i, RandomBnd(ptxtSpace));
+  Ctxt ca(bigKey);
+  bigKey.Encrypt(ca, a, ptxtSpace);
+  Ctxt ra(smallKey);
+  ringSwitch(ra, ca, keyID);
+  smallKey.Decrypt(dec, ra);
+  ringProject(proj, a, d);
+  reduceMod(dec, ptxtSpace);
+  reduceMod(proj, ptxtSpace);
+  if (dec != proj) {
+    cout << "the projection differs\n";
+    ok = false;
+  }
+
+  // about 1/d of the size on the wire
+  ostringstream before, after;
+  ca.write(before);
+  ra.write(after);
+  if (long(after.str().size()) * (d/2) > long(before.str().size()))
+    ok = false;
+
+  // contexts that do not fit
+  FHEcontext other(m2, p, r);
+  if (ringSwitchDegree(big, other) != 0) ok = false;
+  FHEPubKey otherKey(other);
+  Ctxt bad(otherKey);
+  try {
+    ringSwitch(bad, cv, keyID);
+    ok = false;
+  }
+  catch (std::logic_error&) {}
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
@@ -0,0 +1,152 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_Shadow.cpp - the in-place and parallel PlaintextArray operations
+ * against the slots moved by hand, and a computation on ShadowCtxt's that
+ * agrees with its shadow, unless the ciphertext is not what it claims.
+ */
+#include <memory>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "shadow.h"
+#include "randomMatrices.h"
+
+static vector<ZZX> slots(const EncryptedArray& ea, const PlaintextArray& pa)
+{
+  vector<ZZX> v;
+  decode(ea, v, pa);
+  return v;
+}
+
+// The data movement of PlaintextArray against the same moves on vectors
+static bool checkMoves(const EncryptedArray& ea)
+{
+  long n = ea.size();
+  bool ok = true;
+  PlaintextArray pa(ea);
+  random(ea, pa);
+  vector<ZZX> v = slots(ea, pa), w(n);
+
+  for (long k: {1L, -3L, n+2}) {
+    PlaintextArray q(pa);
+    rotate(ea, q, k);
+    for (long i: range(n)) w[mcMod(i+k, n)] = v[i];
+    if (slots(ea, q) != w) ok = false;
+  }
+
+  for (long i: range(ea.dimension()))
+    for (long k: {1L, -1L, 2L}) {
+      PlaintextArray q(pa);
+      rotate1D(ea, q, i, k);
+      ea.rotate1D(w, v, i, k);
+      if (slots(ea, q) != w) ok = false;
+
+      q = pa;
+      shift1D(ea, q, i, k);
+      vector<ZZX> masked(v);
+      for (long j: range(n)) {
+        long c = ea.coordinate(i, j) + k;
+        if (c < 0 || c >= ea.sizeOfDimension(i)) clear(masked[j]);
+      }
+      ea.rotate1D(w, masked, i, k);
+      if (slots(ea, q) != w) ok = false;
+    }
+
+  // a permutation, swapped in place, and a map that repeats slots
+  Vec<long> pi;
+  pi.SetLength(n);
+  for (long i: range(n)) pi[i] = i;
+  for (long i: range(n-1)) swap(pi[i], pi[i + RandomBnd(n-i)]);
+  for (long round: range(2)) {
+    PlaintextArray q(pa);
+    applyPerm(ea, q, pi);
+    for (long i: range(n)) w[i] = v[pi[i]];
+    if (slots(ea, q) != w) ok = false;
+    pi[0] = pi[n-1];
+  }
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long r=1;
+  amap.arg("r", r, "lifting");
+  long L=6;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long nt=1;
+  amap.arg("nt", nt, "# of threads");
+  amap.parse(argc, argv);
+  if (nt > 1) SetNumThreads(nt);
+
+  FHEcontext context(m, p, r);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+  addFrbMatrices(secretKey);
+  const FHEPubKey& publicKey = secretKey;
+  const EncryptedArray& ea = *context.ea;
+  bool ok = checkMoves(ea);
+
+  PlaintextArray u(ea), v(ea), c(ea);
+  random(ea, u);
+  random(ea, v);
+  random(ea, c);
+
+  setShadowMode(true);
+  ShadowCtxt x(ea, publicKey, u), y(ea, publicKey, v);
+  if (!x.hasShadow()) ok = false;
+  x += y;
+  x.multByConstant(c);
+  x.addConstant(3);
+  x.rotate(1);
+  x.shift1D(0, 1);
+  x.frobeniusAutomorph(1);
+  x *= y;
+  x.negate();
+  std::unique_ptr<MatMul1D> mat(buildRandomMatrix(ea, 0));
+  x.mul(*mat);
+  x.rotate1D(ea.dimension()-1, -1);
+  x.multByConstant(2);
+  if (!x.check(secretKey)) ok = false;
+
+  // a ciphertext of another plaintext fails the check
+  Ctxt other(publicKey);
+  ea.encrypt(other, publicKey, v);
+  ShadowCtxt liar(ea, other, u);
+  if (!equals(ea, u, v) && liar.check(secretKey)) ok = false;
+
+  // without shadows, and an operand without one drops the shadow
+  setShadowMode(false);
+  ShadowCtxt z(ea, publicKey, u);
+  if (z.hasShadow() || !z.check(secretKey)) ok = false;
+  y += z;
+  if (y.hasShadow()) ok = false;
+
+  try { // CKKS slots have no PlaintextArray
+    FHEcontext contextCx(64, -1, 20);
+    buildModChain(contextCx, 50, /*c=*/2);
+    ShadowCtxt bad(*contextCx.ea, publicKey, u);
+    ok = false;
+  }
+  catch (std::logic_error&) {}
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
@@ -0,0 +1,159 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_TaskScheduler.cpp - nested loops, task graphs and exceptions on the
+ * scheduler, and two computations (and the product trees) on it give what
+ * they give serially
+ */
+#include <atomic>
+#include <stdexcept>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "taskScheduler.h"
+
+// ((c*c) rotated by k) * c, with its own loops over the primes
+static void compute(Ctxt& c, const EncryptedArray& ea, long k)
+{
+  Ctxt d = c;
+  c.multiplyBy(c);
+  ea.rotate(c, k);
+  c.multiplyBy(d);
+}
+
+static bool checkLoops()
+{
+  bool ok = true;
+
+  // a short outer loop of long inner loops
+  std::atomic<long> sum(0);
+  parallelFor(3, [&](long first, long last) {
+    for (long i: range(first, last))
+      parallelFor(1000, [&](long lo, long hi) {
+        for (long j: range(lo, hi)) sum += i*j;
+      });
+  });
+  if (sum != 3*499500) ok = false;
+
+  // a diamond: 0 before 1 and 2, which are before 3
+  std::atomic<long> step(0);
+  long at[4];
+  TaskGraph g;
+  long a = g.add([&]{ at[0] = step++; });
+  long b = g.add([&]{ at[1] = step++; }, {a});
+  long c = g.add([&]{ at[2] = step++; }, {a});
+  g.add([&]{ at[3] = step++; }, {b, c});
+  g.run();
+  if (at[0] != 0 || at[3] != 3) ok = false;
+
+  // exceptions get to the join, the dependents of a failed task are skipped
+  try {
+    parallelIndex(5, [](long i) {
+      if (i == 3) throw std::runtime_error("task 3");
+    });
+    ok = false;
+  }
+  catch (std::runtime_error&) {}
+  std::atomic<long> ran(0);
+  TaskGraph h;
+  long x = h.add([]{ throw std::runtime_error("x"); });
+  h.add([&]{ ran++; }, {x});
+  h.add([&]{ ran++; });
+  try {
+    h.run();
+    ok = false;
+  }
+  catch (std::runtime_error&) {}
+  if (ran != 1) ok = false;
+  try {
+    h.add([]{}, {17}); // no such task
+    ok = false;
+  }
+  catch (std::logic_error&) {}
+
+  // the tasks see the state of the thread that started them, no others do
+  std::atomic<long> seen(0), leaked(0);
+  parallelInvoke([&]{
+    InheritedTaskState inherited(2);
+    parallelIndex(8, [&](long) {
+      if (getInheritedTaskState() == 2) seen++;
+    });
+  }, [&]{
+    parallelIndex(8, [&](long) {
+      if (getInheritedTaskState() != 0) leaked++;
+    });
+  });
+  if (seen != 8 || leaked != 0 || getInheritedTaskState() != 0) ok = false;
+
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long L=6;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long nt=4;
+  amap.arg("nt", nt, "# threads of the scheduler");
+  amap.parse(argc, argv);
+
+  FHEcontext context(m, /*p=*/2, /*r=*/1);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+  EncryptedArray ea(context, context.alMod);
+
+  PlaintextArray v0(ea), v1(ea);
+  random(ea, v0);
+  random(ea, v1);
+  Ctxt c0(secretKey), c1(secretKey);
+  ea.encrypt(c0, secretKey, v0);
+  ea.encrypt(c1, secretKey, v1);
+
+  // serially, no scheduler
+  Ctxt s0 = c0, s1 = c1;
+  compute(s0, ea, 1);
+  compute(s1, ea, 2);
+  std::vector<Ctxt> factors;
+  for (long i: range(5)) factors.push_back((i%2)? c1 : c0);
+  Ctxt sTotal(c0);
+  totalProduct(sTotal, factors);
+  std::vector<Ctxt> sPrefix(factors);
+  incrementalProduct(sPrefix);
+
+  setTaskScheduler(nt);
+  bool ok = (fheAvailableThreads() == nt) && checkLoops();
+
+  // two computations at once, both with their per-prime loops
+  Ctxt t0 = c0, t1 = c1;
+  parallelInvoke([&]{ compute(t0, ea, 1); }, [&]{ compute(t1, ea, 2); });
+  if (!t0.equalsTo(s0) || !t1.equalsTo(s1)) ok = false;
+
+  // the products of a tree, with its halves as tasks
+  Ctxt tTotal(c0);
+  totalProduct(tTotal, factors);
+  std::vector<Ctxt> tPrefix(factors);
+  incrementalProduct(tPrefix);
+  if (!tTotal.equalsTo(sTotal)) ok = false;
+  for (long i: range(5))
+    if (!tPrefix[i].equalsTo(sPrefix[i])) ok = false;
+
+  setTaskScheduler(0);
+  if (getTaskScheduler() != nullptr || !checkLoops()) ok = false;
+
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
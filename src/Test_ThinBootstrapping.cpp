@@ -9,6 +9,7 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. See accompanying LICENSE file.
  */
+#include <sstream>
 #include <NTL/BasicThreadPool.h>
 #include "FHE.h"
 #include "EncryptedArray.h"
@@ -145,9 +146,29 @@ void TestIt(long idx, long p, long r, long L, long c, long skHwt, int build_cach
 	 << ", e'="   << context.rcData.ePrime
 	 << ", a="<< context.rcData.a
 	 << ", t="    << context.rcData.skHwt
+	 << ", digit-extraction depth="
+	 << RecryptData::digitExtractionDepth(context.rcData.digitAlg, p, r,
+                               context.rcData.e - context.rcData.ePrime)
 	 << "\n  ";
     context.zMStar.printout();
   }
+
+  { // the recryption data must survive a round trip through the binary format
+    stringstream s1, s2;
+    writeContextBaseBinary(s1, context);
+    writeContextBinary(s1, context, /*withRecryptData=*/true);
+    string written = s1.str();
+
+    std::unique_ptr<FHEcontext> context2 = buildContextFromBinary(s1);
+    readContextBinary(s1, *context2);
+    writeContextBaseBinary(s2, *context2);
+    writeContextBinary(s2, *context2, /*withRecryptData=*/true);
+    if (!context2->isBootstrappable() || s2.str() != written) {
+      cout << "BAD (binary I/O of the recryption data)\n";
+      exit(0);
+    }
+  }
+
   setDryRun(dry); // Now we can set the dry-run flag if desired
 
 
@@ -211,7 +232,36 @@ void TestIt(long idx, long p, long r, long L, long c, long skHwt, int build_cach
   vector<ZZX> val2;
   ea.decrypt(c2, secretKey, val2);
 
-  if (val1 == val2) 
+  // also recrypt a few copies together, as a batch
+  bool batchOK = true;
+  std::vector<Ctxt> batch(3, c1);
+  publicKey.thinReCrypt(CtPtrs_vectorCt(batch));
+  for (const Ctxt& c: batch) {
+    vector<ZZX> val3;
+    ea.decrypt(c, secretKey, val3);
+    if (val3 != val1) batchOK = false;
+  }
+
+  // and a few sparsely used ones, packed into one recryption
+  bool packedOK = true;
+  long used = max(nslots/3, 1L);
+  std::vector<Ctxt> sparse(3, Ctxt(publicKey));
+  std::vector< vector<ZZX> > sparseVals(3);
+  for (long i: range(3)) {
+    sparseVals[i].assign(nslots, ZZX::zero());
+    for (long j: range(used))
+      sparseVals[i][j] = conv<ZZX>(conv<ZZ>(rep(random_zz_p())));
+    ea.encrypt(sparse[i], publicKey, sparseVals[i]);
+  }
+  publicKey.thinReCryptPacked(CtPtrs_vectorCt(sparse), used);
+  for (long i: range(3)) {
+    vector<ZZX> val4;
+    ea.decrypt(sparse[i], secretKey, val4);
+    for (long j: range(used))
+      if (val4[j] != sparseVals[i][j]) packedOK = false;
+  }
+
+  if (val1 == val2 && batchOK && packedOK)
     cout << "GOOD\n";
   else
     cout << "BAD\n";
@@ -0,0 +1,205 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_Trace.cpp - trace a small circuit and replay it, or replay a trace
+ * file on dummy inputs:
+ *
+ *   Test_Trace_x                      record, replay and compare
+ *   Test_Trace_x out=t.bin            also write the recorded trace
+ *   Test_Trace_x trace=t.bin m=.. L=..  time a replay of t.bin
+ */
+#include <fstream>
+#include <sstream>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "ctxtTrace.h"
+
+// The circuit that is traced, without constants so that a replay on the
+// same inputs computes the same values
+static void compute(Ctxt& out0, Ctxt& out1,
+                    const Ctxt& c0, const Ctxt& c1, const Ctxt& c2, long k)
+{
+  out0 = c0;
+  out0.multiplyBy(c1);
+  out0.addCtxt(c2, /*negative=*/true);
+  out1 = out0;
+  out1.smartAutomorph(k);
+  out1 += c0;
+  IndexSet low = out0.getPrimeSet();
+  low.remove(low.last());
+  out0.modDownToSet(low);
+}
+
+static bool sameDecryption(const EncryptedArray& ea, const FHESecKey& sk,
+                           const Ctxt& c0, const Ctxt& c1)
+{
+  PlaintextArray p0(ea), p1(ea);
+  ea.decrypt(c0, sk, p0);
+  ea.decrypt(c1, sk, p1);
+  return equals(ea, p0, p1);
+}
+
+static bool sameCounts(const TraceReplayStats& stats, const CtxtTrace& trace)
+{
+  for (long op: range(TRACE_OP_COUNT))
+    if (stats.count[op] != trace.countOps(CtxtTraceOp(op))) return false;
+  return true;
+}
+
+static bool testTrace(FHESecKey& secretKey, const EncryptedArray& ea,
+                      const string& outFile, bool verbose)
+{
+  bool ok = true;
+  long k = secretKey.getContext().zMStar.ZmStarGen(0);
+  PlaintextArray v0(ea), v1(ea), v2(ea);
+  random(ea, v0);
+  random(ea, v1);
+  random(ea, v2);
+  vector<Ctxt> inputs(3, Ctxt(secretKey));
+  ea.encrypt(inputs[0], secretKey, v0);
+  ea.encrypt(inputs[1], secretKey, v1);
+  ea.encrypt(inputs[2], secretKey, v2);
+
+  CtxtTracer tracer;
+  Ctxt out0(secretKey), out1(secretKey);
+  for (const Ctxt& c: inputs) tracer.idOf(c); // number the inputs in order
+  setCtxtTracer(&tracer);
+  compute(out0, out1, inputs[0], inputs[1], inputs[2], k);
+  setCtxtTracer(NULL);
+  const CtxtTrace& trace = tracer.getTrace();
+  if (verbose) cout << trace << endl;
+
+  // only the outermost operations are recorded
+  if (trace.countOps(TRACE_INPUT) != 3 || trace.countOps(TRACE_ADD) != 2
+      || trace.countOps(TRACE_MULTIPLY) != 1
+      || trace.countOps(TRACE_AUTOMORPH) != 1
+      || trace.countOps(TRACE_MODDOWN) != 1 || trace.size() != 8)
+    ok = false;
+  if (tracer.lookup(out0) != trace.size()-1
+      || trace.records.back().primesAfter != out0.getPrimeSet().card())
+    ok = false;
+
+  // binary round trip
+  std::stringstream str;
+  trace.write(str);
+  CtxtTrace copy;
+  copy.read(str);
+  if (copy.size() != trace.size()) ok = false;
+  for (long i: range(min(copy.size(), trace.size()))) {
+    const CtxtTraceRecord& a = copy.records[i];
+    const CtxtTraceRecord& b = trace.records[i];
+    if (a.op != b.op || a.id != b.id || a.input != b.input
+        || a.other != b.other || a.arg != b.arg
+        || a.primesAfter != b.primesAfter || a.logNoise != b.logNoise)
+      ok = false;
+  }
+  if (!outFile.empty()) {
+    ofstream f(outFile, ios::binary);
+    trace.write(f);
+  }
+
+  // a trace with a broken eye-catcher is rejected
+  string bad = str.str();
+  bad[0] ^= 0x55;
+  try {
+    std::istringstream badStr(bad);
+    CtxtTrace t;
+    t.read(badStr);
+    ok = false;
+  }
+  catch (std::runtime_error&) {}
+
+  // the replay on the same inputs computes the same outputs
+  TraceReplayStats stats;
+  vector<Ctxt> outputs;
+  replayTrace(stats, copy, secretKey, &inputs, &outputs);
+  if (verbose) stats.print(cout, copy);
+  if (!sameCounts(stats, copy) || outputs.size() != 2
+      || !sameDecryption(ea, secretKey, outputs[0], out1)
+      || !sameDecryption(ea, secretKey, outputs[1], out0)
+      || outputs[1].getPrimeSet() != out0.getPrimeSet())
+    ok = false;
+
+  // a dummy replay of a trace with constants, the old values are inputs
+  tracer.clear();
+  setCtxtTracer(&tracer);
+  {
+    Ctxt c = inputs[0];
+    c.multByConstant(ZZ(3));
+    c.multiplyBy(inputs[1]);
+  }
+  setCtxtTracer(NULL);
+  TraceReplayStats dummy;
+  replayTrace(dummy, tracer.getTrace(), secretKey);
+  if (!sameCounts(dummy, tracer.getTrace())
+      || tracer.getTrace().countOps(TRACE_INPUT) != 2
+      || tracer.getTrace().countOps(TRACE_MULT_CONSTANT) != 1)
+    ok = false;
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long L=6;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long nt=1;
+  amap.arg("nt", nt, "# threads");
+  string traceFile;
+  amap.arg("trace", traceFile, "replay this trace file", NULL);
+  string outFile;
+  amap.arg("out", outFile, "write the recorded trace to this file", NULL);
+  bool verbose=false;
+  amap.arg("verbose", verbose, "print more information");
+  amap.parse(argc, argv);
+
+  if (nt > 1) SetNumThreads(nt);
+
+  CtxtTrace trace;
+  if (!traceFile.empty()) {
+    ifstream f(traceFile, ios::binary);
+    if (!f) {
+      cerr << "cannot open " << traceFile << endl;
+      return -1;
+    }
+    trace.read(f);
+    if (trace.countOps(TRACE_RECRYPT) > 0) {
+      cerr << "the trace has recryptions, they are not replayed here\n";
+      return -1;
+    }
+    cout << traceFile << ": " << trace << endl;
+  }
+
+  FHEcontext context(m, p, /*r=*/1);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  secretKey.GenSecKey();
+  addSome1DMatrices(secretKey);
+
+  if (!traceFile.empty()) {
+    TraceReplayStats stats;
+    replayTrace(stats, trace, secretKey);
+    stats.print(cout, trace);
+    return 0;
+  }
+
+  EncryptedArray ea(context, context.alMod);
+  bool ok = testTrace(secretKey, ea, outFile, verbose);
+  cout << (ok? "GOOD" : "BAD") << endl;
+  return ok? 0 : -1;
+}
@@ -0,0 +1,72 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_Tuner.cpp - rank parameter sets for a circuit profile
+ *
+ * Enumerates the candidates for the given profile, benchmarks them on this
+ * machine and prints them from the highest predicted throughput down. With
+ * enumOnly=1 the candidates are only listed, without building them.
+ */
+#include <NTL/ZZ.h>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "paramTuner.h"
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  CircuitProfile prof;
+  amap.arg("p", prof.p, "plaintext base");
+  amap.arg("r", prof.r, "lifting");
+  amap.arg("depth", prof.depth, "levels (between recryptions)");
+  amap.arg("mults", prof.multsPerLevel, "multiplications per level");
+  amap.arg("rots", prof.rotationsPerLevel, "rotations per level");
+  amap.arg("boot", prof.bootstrap, "the circuit needs bootstrapping");
+  amap.arg("sec", prof.security, "target security level");
+  amap.arg("slots", prof.minSlots, "least number of slots");
+  amap.arg("maxM", prof.maxM, "largest m to consider");
+  long cands = 12;
+  amap.arg("cands", cands, "how many candidates to benchmark");
+  double minTime = 0.1;
+  amap.arg("minTime", minTime, "time each kernel for at least this long");
+  long nthreads = 1;
+  amap.arg("nthreads", nthreads, "number of threads");
+  bool enumOnly = false;
+  amap.arg("enumOnly", enumOnly, "only list the candidates");
+  long seed = 0;
+  amap.arg("seed", seed, "PRG seed");
+  bool verbose = false;
+  amap.arg("verbose", verbose, "print the candidates as they are measured");
+  amap.parse(argc, argv);
+
+  SetSeed(ZZ(seed));
+  if (nthreads > 1) SetNumThreads(nthreads);
+
+  std::vector<TunerCandidate> ranked;
+  if (enumOnly) {
+    enumerateCandidates(ranked, prof, cands);
+    for (const TunerCandidate& cand: ranked) cout << cand << endl;
+    return 0;
+  }
+
+  tuneParams(ranked, prof, cands, minTime, verbose);
+  for (const TunerCandidate& cand: ranked) cout << cand << endl;
+
+  // The best candidate must run the circuit, and the ranking be sorted
+  bool good = !ranked.empty() && ranked[0].feasible;
+  for (long i=1; good && i<lsize(ranked); i++)
+    if (ranked[i].feasible && ranked[i].throughput > ranked[i-1].throughput)
+      good = false;
+  cout << (good? "GOOD\n" : "BAD\n");
+  return 0;
+}
@@ -17,6 +17,8 @@
 #include "EncryptedArray.h"
 #include "FHE.h"
 #include "debugging.h"
+#include "chebyshev.h"
+#include "matmul.h"
 
 NTL_CLIENT
 
@@ -57,6 +59,25 @@ void testComplexArith(const FHEPubKey& publicKey,
 void testRotsNShifts(const FHEPubKey& publicKey, 
                      const FHESecKey& secretKey, 
                      const EncryptedArrayCx& ea, double epsilon);
+void testHoistedParts(const FHEPubKey& publicKey, 
+                      const FHESecKey& secretKey, 
+                      const EncryptedArrayCx& ea, double epsilon);
+void testConstCache(const FHEPubKey& publicKey, 
+                    const FHESecKey& secretKey, 
+                    const EncryptedArrayCx& ea, double epsilon);
+void testChebyshev(const FHEPubKey& publicKey, 
+                   const FHESecKey& secretKey, 
+                   const EncryptedArrayCx& ea, double epsilon);
+void testMatMul(const FHEPubKey& publicKey, 
+                const FHESecKey& secretKey, 
+                const EncryptedArrayCx& ea, double epsilon);
+void testBatch(const FHEPubKey& publicKey,
+               const FHESecKey& secretKey,
+               const EncryptedArrayCx& ea, double epsilon);
+void testScaleManagement(FHEcontext& context,
+                         const FHEPubKey& publicKey,
+                         const FHESecKey& secretKey,
+                         const EncryptedArrayCx& ea, double epsilon);
 
 
 int main(int argc, char *argv[]) 
@@ -90,6 +111,7 @@ int main(int argc, char *argv[])
     FHESecKey secretKey(context);
     secretKey.GenSecKey(); // A +-1/0 secret key
     addSome1DMatrices(secretKey); // compute key-switching matrices
+    addSomeFrbMatrices(secretKey); // and the conjugation
 
     const FHEPubKey publicKey = secretKey;
     const EncryptedArrayCx& ea = context.ea->getCx();
@@ -105,6 +127,12 @@ int main(int argc, char *argv[])
     testBasicArith(publicKey, secretKey, ea, epsilon);
     testComplexArith(publicKey, secretKey, ea, epsilon);
     testRotsNShifts(publicKey, secretKey, ea, epsilon);
+    testHoistedParts(publicKey, secretKey, ea, epsilon);
+    testConstCache(publicKey, secretKey, ea, epsilon);
+    testChebyshev(publicKey, secretKey, ea, epsilon);
+    testMatMul(publicKey, secretKey, ea, epsilon);
+    testBatch(publicKey, secretKey, ea, epsilon);
+    testScaleManagement(context, publicKey, secretKey, ea, epsilon);
 
   } 
   catch (exception& e) {
@@ -279,3 +307,274 @@ void testRotsNShifts(const FHEPubKey& publicKey,
     cout << "GOOD\n":
     cout << "BAD\n";
 }
+
+
+void testHoistedParts(const FHEPubKey& publicKey,
+                      const FHESecKey& secretKey,
+                      const EncryptedArrayCx& ea, double epsilon)
+{
+  if (verbose) cout << "Test hoisted Real, Im parts and rotations: ";
+
+  Ctxt c(publicKey);
+  vector<cx_double> vd, vd_dec;
+  ea.random(vd);
+  ea.encrypt(c, publicKey, vd);
+
+  vector<long> amts = {1, -1, long(ea.size())/2};
+  Ctxt re(publicKey), im(publicKey);
+  vector< shared_ptr<Ctxt> > rots;
+  ea.extractParts(c, &re, &im, &rots, amts);
+
+  bool ok = re.inCanonicalForm() && im.inCanonicalForm();
+  vector<cx_double> expected(vd);
+  for (auto& x: expected) x = std::real(x);
+  ea.decrypt(re, secretKey, vd_dec);
+  if (!cx_equals(expected, vd_dec, epsilon)) ok = false;
+  for (long i: range(lsize(vd))) expected[i] = std::imag(vd[i]);
+  ea.decrypt(im, secretKey, vd_dec);
+  if (!cx_equals(expected, vd_dec, epsilon)) ok = false;
+
+  for (long i: range(lsize(amts))) {
+    long n = ea.size(), k = mcMod(amts[i], n);
+    for (long j: range(n)) expected[(j+k) % n] = vd[j];
+    ea.decrypt(*rots[i], secretKey, vd_dec);
+    if (!cx_equals(expected, vd_dec, epsilon)) ok = false;
+  }
+
+  // the imaginary part alone, with i at these primes from the cache
+  Ctxt im2(publicKey);
+  ea.extractParts(c, nullptr, &im2);
+  ea.decrypt(im2, secretKey, vd_dec);
+  ea.decrypt(im, secretKey, expected);
+  if (!cx_equals(expected, vd_dec, epsilon)) ok = false;
+
+  cout << (ok? "GOOD\n" : "BAD\n");
+}
+
+void testConstCache(const FHEPubKey& publicKey,
+                    const FHESecKey& secretKey,
+                    const EncryptedArrayCx& ea, double epsilon)
+{
+  if (verbose)  cout << "Test Constant Cache ";
+  CKKSConstCache& cache = ea.getConstCache();
+  cache.clear();
+  long misses = cache.misses();
+
+  vector<cx_double> vd, vd1, w, b;
+  ea.random(vd1);
+  ea.random(w);
+  ea.random(b);
+  Ctxt c1(publicKey);
+  ea.encrypt(c1, publicKey, vd1);
+
+  // w is pinned like a model weight, b only goes through the LRU
+  cache.pin(ea, w, c1.getPrimeSet());
+  cache.setMaxEntries(0); // nothing unpinned is kept
+  for (long t=0; t<3; t++) {
+    Ctxt c2 = c1;
+    ea.multByConstant(c2, w);
+    ea.addConstant(c2, b);
+    ea.decrypt(c2, secretKey, vd);
+    vector<cx_double> vd2(vd1);
+    for (long i=0; i<lsize(vd2); i++) vd2[i] = vd2[i]*w[i] + b[i];
+    if (!cx_equals(vd, vd2, epsilon)) {
+      cout << "BAD\n";
+      return;
+    }
+  }
+  bool good = (cache.numPinned()==1 && cache.size()==1);
+  cache.setMaxEntries(64);
+  Ctxt c3 = c1;
+  ea.addConstant(c3, b); // now b is kept
+  good = good && (cache.size()==2) && cache.unpin(w, c1.getPrimeSet())
+    && (cache.numPinned()==0);
+  if (verbose)
+    cout << "(" << cache.misses()-misses << " misses, "
+         << cache.hits() << " hits): ";
+  cache.clear();
+
+  good? cout << "GOOD\n": cout << "BAD\n";
+}
+
+
+void testChebyshev(const FHEPubKey& publicKey,
+                   const FHESecKey& secretKey,
+                   const EncryptedArrayCx& ea, double epsilon)
+{
+  if (verbose)  cout << "Test Chebyshev ";
+  auto sigmoid = [](double x) { return 1.0/(1.0+std::exp(-x)); };
+  const double a = -4.0, b = 4.0;
+
+  // The fit itself, on cleartext
+  ChebyshevSeries s31(sigmoid, a, b, 31);
+  for (long i=0; i<=100; i++) {
+    double x = a + (b-a)*i/100;
+    if (std::abs(s31(x) - sigmoid(x)) > 1e-6) {
+      cout << "BAD\n";
+      if (verbose) cout << "sigmoid("<<x<<")="<<sigmoid(x)
+                        << ", series gives "<<s31(x)<<endl;
+      return;
+    }
+  }
+
+  vector<double> vd1(ea.size());
+  for (auto& x: vd1) x = a + (b-a)*(NTL::RandomLen_long(16)/double(1L<<16));
+  Ctxt c1(publicKey), c2(publicKey);
+  ea.encrypt(c1, publicKey, vd1);
+
+  // as high a degree as the levels allow, compared to the same series
+  long d = evalApprox(c2, sigmoid, a, b, c1);
+  ChebyshevSeries series(sigmoid, a, b, d);
+  vector<double> vd, vd2(vd1);
+  for (auto& x: vd2) x = series(x);
+  ea.decrypt(c2, secretKey, vd);
+  double diff = 0.0;
+  for (long i=0; i<lsize(vd); i++) diff = max(diff, std::abs(vd[i]-vd2[i]));
+  if (verbose)
+    cout << "(degree "<<d<<", max |res-vec|_{infty}="<< diff << "): ";
+
+  (diff < epsilon)? cout << "GOOD\n": cout << "BAD\n";
+}
+
+
+// A random complex matrix, with a few zero entries
+class RandomMatrixCx : public MatMulFullCx {
+  const EncryptedArray& ea;
+  vector<vector<cx_double>> data;
+
+public:
+  explicit RandomMatrixCx(const EncryptedArray& _ea): ea(_ea)
+  {
+    const EncryptedArrayCx& eaCx = ea.getCx();
+    data.resize(ea.size());
+    for (auto& row: data) {
+      eaCx.random(row);
+      row[NTL::RandomBnd(lsize(row))] = 0.0;
+    }
+  }
+
+  bool get(cx_double& out, long i, long j) const override
+  {
+    out = data[i][j];
+    return (out == cx_double(0.0));
+  }
+  const EncryptedArray& getEA() const override { return ea; }
+};
+
+void testMatMul(const FHEPubKey& publicKey,
+                const FHESecKey& secretKey,
+                const EncryptedArrayCx& ea, double epsilon)
+{
+  if (verbose)  cout << "Test Matrix-Vector Multiplication ";
+  const EncryptedArray& eaBase = *(publicKey.getContext().ea);
+  RandomMatrixCx mat(eaBase);
+
+  vector<cx_double> vd1, vd;
+  ea.random(vd1);
+  Ctxt c1(publicKey);
+  ea.encrypt(c1, publicKey, vd1);
+
+  // the row vector vd1 times the matrix
+  vector<cx_double> vd2(ea.size(), cx_double(0.0));
+  for (long i=0; i<ea.size(); i++) for (long j=0; j<ea.size(); j++) {
+    cx_double x;
+    if (!mat.get(x, i, j)) vd2[j] += vd1[i]*x;
+  }
+
+  double diff = 0.0;
+  for (long bsgs: {-1, 1}) { // without and with baby-step/giant-step
+    fhe_test_force_bsgs = bsgs;
+    MatMulFullExec mat_exec(mat);
+    Ctxt c2 = c1;
+    mat_exec.mul(c2);
+    ea.decrypt(c2, secretKey, vd);
+    diff = max(diff, calcMaxDiff(vd, vd2));
+  }
+  fhe_test_force_bsgs = 0;
+  if (verbose)
+    cout << "(max |res-vec|_{infty}="<< diff << "): ";
+
+  (diff < epsilon)? cout << "GOOD\n": cout << "BAD\n";
+}
+
+void testBatch(const FHEPubKey& publicKey,
+               const FHESecKey& secretKey,
+               const EncryptedArrayCx& ea, double epsilon)
+{
+  if (verbose)  cout << "Test Batch Encryption ";
+  const long n = 5;
+  vector< vector<cx_double> > vds(n), res;
+  for (auto& v: vds) ea.random(v);
+  vds[n-1][0] = 3.0; // a larger entry, for a larger size estimate
+
+  // The batch encoding is the same as one at a time
+  vector<zzX> ptxts;
+  ea.encode(ptxts, vds);
+  bool ok = (lsize(ptxts) == n);
+  for (long i=0; i<n && ok; i++) {
+    zzX pp;
+    ea.encode(pp, vds[i]);
+    ok = (pp == ptxts[i]);
+  }
+  ea.decode(res, ptxts);
+  double diff = 0.0;
+  for (long i=0; i<n && ok; i++) diff = max(diff, calcMaxDiff(res[i], vds[i]));
+
+  vector<Ctxt> cts(n, Ctxt(publicKey));
+  ea.encrypt(cts, publicKey, vds);
+  ea.decrypt(cts, secretKey, res);
+  for (long i=0; i<n && ok; i++) diff = max(diff, calcMaxDiff(res[i], vds[i]));
+  if (verbose)
+    cout << "(max |res-vec|_{infty}="<< diff << "): ";
+
+  (ok && diff < epsilon)? cout << "GOOD\n": cout << "BAD\n";
+}
+
+void testScaleManagement(FHEcontext& context,
+                         const FHEPubKey& publicKey,
+                         const FHESecKey& secretKey,
+                         const EncryptedArrayCx& ea, double epsilon)
+{
+  if (verbose)  cout << "Test Automatic Rescaling ";
+  context.ckksScale.autoRescale = true;
+
+  vector<double> vd1(ea.size()), vd;
+  for (auto& x: vd1) x = NTL::RandomLen_long(16)/double(1L<<16); // in [0,1]
+  Ctxt c1(publicKey), c2(publicKey);
+  ea.encrypt(c1, publicKey, vd1);
+  long levels = c1.levelsLeft();
+
+  // x^2 + x: the sum meets at the level of x^2, the factor stays near the
+  // target after the multiplication
+  c2 = c1;
+  c2.square();
+  bool ok = (c2.getRatFactor() >= c2.targetRatFactor()/2
+             && c2.getRatFactor() < c2.targetRatFactor()*64
+             && c2.levelsLeft() >= levels-2);
+  IndexSet lower = c2.getPrimeSet();
+  c2 += c1;
+  ok = ok && (c2.getPrimeSet() == lower);
+  vector<double> vd2(vd1);
+  for (auto& x: vd2) x = x*x + x;
+  ea.decrypt(c2, secretKey, vd);
+  double diff = 0.0;
+  for (long i=0; i<lsize(vd); i++) diff = max(diff, std::abs(vd[i]-vd2[i]));
+
+  // x^(2^k), with as many squarings as levelsLeft() promised
+  c2 = c1;
+  vd2 = vd1;
+  for (long k=0; k<levels && ok; k++) {
+    c2.square();
+    for (auto& x: vd2) x *= x;
+    ok = c2.isCorrect();
+  }
+  if (ok) {
+    ea.decrypt(c2, secretKey, vd);
+    for (long i=0; i<lsize(vd); i++) diff = max(diff, std::abs(vd[i]-vd2[i]));
+  }
+  context.ckksScale.autoRescale = false;
+  if (verbose)
+    cout << "("<<levels<<" levels, max |res-vec|_{infty}="<< diff << "): ";
+
+  (ok && diff < epsilon)? cout << "GOOD\n": cout << "BAD\n";
+}
@@ -32,6 +32,7 @@ NTL_CLIENT
 
 static std::vector<zzX> unpackSlotEncoding; // a global variable
 static bool verbose=false;
+static long multStrategy=MULT_3FOR2;
 
 static long mValues[][15] = { 
 // { p, phi(m),   m,   d, m1, m2, m3,    g1,   g2,   g3, ord1,ord2,ord3, B,c}
@@ -50,6 +51,9 @@ void testProduct(FHESecKey& secKey, long bitSize1, long bitSize2,
                  long outSize, bool bootstrap = false);
 void testAdd(FHESecKey& secKey, long bitSize1, long bitSize2,
              long outSize, bool bootstrap = false);
+void testConstants(FHESecKey& secKey, long bitSize1, long bitSize2,
+                   long outSize, bool bootstrap = false);
+void testRecryptPolicy(FHESecKey& secKey, long bitSize1, long bitSize2);
 
 int main(int argc, char *argv[])
 {
@@ -72,9 +76,11 @@ int main(int argc, char *argv[])
   long nthreads=1;
   amap.arg("nthreads", nthreads, "number of threads");
   amap.arg("verbose", verbose, "print more information");
+  amap.arg("mult", multStrategy,
+           "multiplication strategy (0-3for2, 1-Dadda, 2-Karatsuba)");
 
   long tests2avoid = 1;
-  amap.arg("tests2avoid", tests2avoid, "bitmap of tests to disable (1-15for4, 2-add, 4-multiply");
+  amap.arg("tests2avoid", tests2avoid, "bitmap of tests to disable (1-15for4, 2-add, 4-multiply, 8-constants");
 
   amap.parse(argc, argv);
   assert(prm >= 0 && prm < 5);
@@ -118,6 +124,7 @@ int main(int argc, char *argv[])
     double three4twoLvls = log(nBits/2) / log(1.5);
     double add2NumsLvls = log(nBits) / log(2.0);
     L = (5 + ceil(three4twoLvls + add2NumsLvls))*30;
+    if (multStrategy==MULT_KARATSUBA) L *= 2; // the adders of every split
   }
   
   if (verbose) {
@@ -167,6 +174,15 @@ int main(int argc, char *argv[])
       testProduct(secKey, bitSize, bitSize2, outSize, bootstrap);
     cout << "GOOD\n";
   }
+  if (bootstrap) {
+    testRecryptPolicy(secKey, bitSize, bitSize2);
+    cout << "GOOD\n";
+  }
+  if (!(tests2avoid & 8)) {
+    for (long i=0; i<nTests; i++)
+      testConstants(secKey, bitSize, bitSize2, outSize, bootstrap);
+    cout << "GOOD\n";
+  }
   if (verbose) printAllTimers(cout);
   return 0;
 }
@@ -258,7 +274,7 @@ void testProduct(FHESecKey& secKey, long bitSize, long bitSize2,
   vector<long> slots;
   {CtPtrs_VecCt eep(eProduct);  // A wrappers around the output vector
   multTwoNumbers(eep,CtPtrs_VecCt(enca),CtPtrs_VecCt(encb),/*negative=*/false,
-                 outSize, &unpackSlotEncoding);
+                 outSize, &unpackSlotEncoding, MultStrategy(multStrategy));
   decryptBinaryNums(slots, eep, secKey, ea);
   } // get rid of the wrapper
   if (verbose)
@@ -392,3 +408,89 @@ void testAdd(FHESecKey& secKey, long bitSize1, long bitSize2,
   cout << endl;
 #endif
 }
+
+// Add and multiply an encrypted number by a random plaintext constant
+void testConstants(FHESecKey& secKey, long bitSize1, long bitSize2,
+                   long outSize, bool bootstrap)
+{
+  const FHEcontext& context = secKey.getContext();
+  const EncryptedArray& ea = *(context.ea);
+  long mask = (outSize? ((1L<<outSize)-1) : -1);
+
+  long pa = RandomBits_long(bitSize1);
+  unsigned long c = RandomBits_long(bitSize2);
+  if (RandomBnd(2)) c |= 3; // make sure that we see some runs of ones
+
+  NTL::Vec<Ctxt> eSum, eProd, enca;
+  resize(enca, bitSize1, Ctxt(secKey));
+  for (long i=0; i<bitSize1; i++) {
+    secKey.Encrypt(enca[i], ZZX((pa>>i)&1));
+    if (bootstrap) { // put them at a lower level
+      enca[i].bringToSet(context.getCtxtPrimes(5));
+    }
+  }
+
+  vector<long> sSlots, pSlots;
+  {CtPtrs_VecCt wSum(eSum), wProd(eProd); // wrappers around the outputs
+  addConstant(wSum, CtPtrs_VecCt(enca), c, outSize, &unpackSlotEncoding);
+  multByConstant(wProd, CtPtrs_VecCt(enca), c, outSize, &unpackSlotEncoding);
+  decryptBinaryNums(sSlots, wSum, secKey, ea);
+  decryptBinaryNums(pSlots, wProd, secKey, ea);
+  } // get rid of the wrappers
+
+  long pSum = (pa+long(c)) & mask;
+  long pProd = (pa*long(c)) & mask;
+  if (sSlots[0] != pSum || pSlots[0] != pProd) {
+    cout << "BAD\n";
+    if (verbose)
+      cout << "constant error: pa="<<pa<<", c="<<c
+           << ", but sum="<<sSlots[0]<<" (should be "<<pSum<<")"
+           << ", product="<<pSlots[0]<<" (should be "<<pProd<<")\n";
+    exit(0);
+  }
+  else if (verbose)
+    cout << "constants succeeded: "<<pa<<"+"<<c<<"="<<sSlots[0]
+         << ", "<<pa<<"*"<<c<<"="<<pSlots[0]<<endl;
+}
+
+// Check that the policy recrypts only the bits that need it
+void testRecryptPolicy(FHESecKey& secKey, long bitSize1, long bitSize2)
+{
+  const FHEcontext& context = secKey.getContext();
+  const EncryptedArray& ea = *(context.ea);
+  long pa = RandomBits_long(bitSize1);
+  long pb = RandomBits_long(bitSize2);
+
+  NTL::Vec<Ctxt> enca, encb;
+  resize(enca, bitSize1, Ctxt(secKey));
+  resize(encb, bitSize2, Ctxt(secKey));
+  for (long i=0; i<bitSize1; i++) // fresh bits
+    secKey.Encrypt(enca[i], ZZX((pa>>i)&1));
+  for (long i=0; i<bitSize2; i++) { // bits at a low level
+    secKey.Encrypt(encb[i], ZZX((pb>>i)&1));
+    encb[i].bringToSet(context.getCtxtPrimes(5));
+  }
+  long aCapacity = findMinBitCapacity(CtPtrs_VecCt(enca));
+
+  RecryptPolicy policy(&unpackSlotEncoding);
+  CtPtrs_VecCt wa(enca), wb(encb);
+  long depth = 3;
+  long nRecrypted = policy.ensureCapacity({&wa, &wb}, depth);
+
+  vector<long> aSlots, bSlots;
+  decryptBinaryNums(aSlots, wa, secKey, ea);
+  decryptBinaryNums(bSlots, wb, secKey, ea);
+  if (nRecrypted != bitSize2 || findMinBitCapacity(wa) != aCapacity
+      || findMinBitCapacity(wb) < policy.capacityFor(encb[0], depth)
+      || aSlots[0] != pa || bSlots[0] != pb) {
+    cout << "BAD\n";
+    if (verbose)
+      cout << "recrypt policy error: recrypted "<<nRecrypted<<" of "
+           << bitSize2<<" low bits, decrypted "<<aSlots[0]<<","<<bSlots[0]
+           << " (should be "<<pa<<","<<pb<<")\n";
+    exit(0);
+  }
+  else if (verbose)
+    cout << "recrypt policy succeeded, recrypted only the "
+         << nRecrypted << " low bits\n";
+}
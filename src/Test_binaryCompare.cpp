@@ -44,6 +44,7 @@ static long mValues[][15] = {
 };
 
 void testCompare(FHESecKey& secKey, long bitSize, bool bootstrap=false);
+void testCompareMany(FHESecKey& secKey, long bitSize, long nPairs);
 
 int main(int argc, char *argv[])
 {
@@ -54,6 +55,8 @@ int main(int argc, char *argv[])
   amap.arg("bitSize", bitSize, "bitSize of input integers (<=32)");
   long nTests = 3;
   amap.arg("nTests", nTests, "number of tests to run");
+  long nPairs = 4;
+  amap.arg("nPairs", nPairs, "number of pairs in the batch comparison");
   bool bootstrap = false;
   amap.arg("bootstrap", bootstrap, "test comparison with bootstrapping");
   long seed=0;
@@ -131,6 +134,8 @@ int main(int argc, char *argv[])
 
   for (long i=0; i<nTests; i++)
     testCompare(secKey, bitSize, bootstrap);
+  if (nPairs>0)
+    testCompareMany(secKey, bitSize, nPairs);
   cout << "GOOD\n";
 
   if (verbose) printAllTimers(cout);
@@ -210,6 +215,53 @@ void testCompare(FHESecKey& secKey, long bitSize, bool bootstrap)
 #endif
 }
 
+void testCompareMany(FHESecKey& secKey, long bitSize, long nPairs)
+{
+  const FHEcontext& context = secKey.getContext();
+  const EncryptedArray& ea = *(context.ea);
+
+  // Choose random pairs of integers, of different sizes
+  vector<long> pa(nPairs), pb(nPairs);
+  NTL::Vec< NTL::Vec<Ctxt> > enca(INIT_SIZE, nPairs), encb(INIT_SIZE, nPairs);
+  NTL::Vec< NTL::Vec<Ctxt> > eMax, eMin;
+  NTL::Vec<Ctxt> mu, ni;
+  Ctxt zero(secKey);
+  for (long k=0; k<nPairs; k++) {
+    long aSize = bitSize, bSize = bitSize + (k%2);
+    pa[k] = RandomBits_long(aSize);
+    pb[k] = (k==0)? pa[k] : RandomBits_long(bSize); // one equal pair
+    resize(enca[k], aSize, zero);
+    resize(encb[k], bSize, zero);
+    for (long i=0; i<aSize; i++)
+      secKey.Encrypt(enca[k][i], ZZX((pa[k]>>i)&1));
+    for (long i=0; i<bSize; i++)
+      secKey.Encrypt(encb[k][i], ZZX((pb[k]>>i)&1));
+  }
+
+  {CtPtrMat_VecCt wMax(eMax), wMin(eMin), wa(enca), wb(encb);
+  CtPtrs_VecCt wMu(mu), wNi(ni);
+  compareManyNumbers(wMax, wMin, wMu, wNi, wa, wb, &unpackSlotEncoding);
+  } // get rid of the wrappers
+
+  for (long k=0; k<nPairs; k++) {
+    vector<long> slotsMin, slotsMax, slotsMu, slotsNi;
+    decryptBinaryNums(slotsMax, CtPtrs_VecCt(eMax[k]), secKey, ea);
+    decryptBinaryNums(slotsMin, CtPtrs_VecCt(eMin[k]), secKey, ea);
+    ea.decrypt(mu[k], secKey, slotsMu);
+    ea.decrypt(ni[k], secKey, slotsNi);
+    if (slotsMax[0]!=std::max(pa[k],pb[k]) || slotsMin[0]!=std::min(pa[k],pb[k])
+        || slotsMu[0]!=(pa[k]>pb[k]) || slotsNi[0]!=(pa[k]<pb[k])) {
+      cout << "BAD\n";
+      if (verbose)
+        cout << "Batch comparison error: a="<<pa[k]<<", b="<<pb[k]
+             << ", but min="<<slotsMin[0]<<", max="<<slotsMax[0]
+             << ", mu="<<slotsMu[0]<<", ni="<<slotsNi[0]<<endl;
+      exit(0);
+    }
+  }
+  if (verbose)
+    cout << "Batch comparison of "<<nPairs<<" pairs succeeded\n";
+}
 
 #if 0
 e2=a2+b2+1
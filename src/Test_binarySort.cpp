@@ -0,0 +1,290 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "EncryptedArray.h"
+#include "FHE.h"
+
+#include "intraSlot.h"
+#include "binaryArith.h"
+#include "binarySort.h"
+
+static std::vector<zzX> unpackSlotEncoding; // a global variable
+static bool verbose=false;
+
+static long mValues[][15] = {
+// { p, phi(m),   m,   d, m1, m2, m3,    g1,   g2,   g3, ord1,ord2,ord3, B,c}
+  {  2,    48,   105, 12,  3, 35,  0,    71,    76,    0,   2,  2,   0, 25, 2},
+  {  2 ,  600,  1023, 10, 11, 93,  0,   838,   584,    0,  10,  6,   0, 25, 2},
+  {  2,  2304,  4641, 24,  7,  3,221,  3979,  3095, 3760,   6,  2,  -8, 25, 3},
+  {  2, 15004, 15709, 22, 23,683,  0,  4099, 13663,    0,  22, 31,   0, 25, 3},
+  {  2, 27000, 32767, 15, 31,  7, 151, 11628, 28087,25824, 30,  6, -10, 28, 4}
+};
+
+bool testNetworks(long maxN);
+void testSort(FHESecKey& secKey, long bitSize, long nNums, SortNetwork net);
+void testTopK(FHESecKey& secKey, long bitSize, long nNums, long k);
+void testMaxInSlots(FHESecKey& secKey, long bitSize);
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long prm=0;
+  amap.arg("prm", prm, "parameter size (0-tiny,...,4-huge)");
+  long bitSize = 3;
+  amap.arg("bitSize", bitSize, "bitSize of input integers (<=16)");
+  long nNums = 5;
+  amap.arg("nNums", nNums, "how many numbers to sort");
+  long k = 2;
+  amap.arg("k", k, "how many of the largest numbers to select");
+  long net = SORT_ODD_EVEN_MERGE;
+  amap.arg("net", net, "sorting network (0-bitonic, 1-odd/even merge)");
+  bool bootstrap = false;
+  amap.arg("bootstrap", bootstrap, "test sorting with bootstrapping");
+  long seed=0;
+  amap.arg("seed", seed, "PRG seed");
+  long nthreads=1;
+  amap.arg("nthreads", nthreads, "number of threads");
+  amap.arg("verbose", verbose, "print more information");
+
+  amap.parse(argc, argv);
+  assert(prm >= 0 && prm < 5);
+  if (seed) NTL::SetSeed(ZZ(seed));
+  if (nthreads>1) NTL::SetNumThreads(nthreads);
+
+  if (bitSize<=0) bitSize=3;
+  else if (bitSize>16) bitSize=16;
+
+  // Check the networks on all the 0/1 inputs, which is enough to show
+  // that they sort everything
+  if (!testNetworks(12)) {
+    cout << "BAD\n";
+    exit(0);
+  }
+
+  long* vals = mValues[prm];
+  long p = vals[0];
+  long m = vals[2];
+
+  NTL::Vec<long> mvec;
+  append(mvec, vals[4]);
+  if (vals[5]>1) append(mvec, vals[5]);
+  if (vals[6]>1) append(mvec, vals[6]);
+
+  std::vector<long> gens;
+  gens.push_back(vals[7]);
+  if (vals[8]>1) gens.push_back(vals[8]);
+  if (vals[9]>1) gens.push_back(vals[9]);
+
+  std::vector<long> ords;
+  ords.push_back(vals[10]);
+  if (abs(vals[11])>1) ords.push_back(vals[11]);
+  if (abs(vals[12])>1) ords.push_back(vals[12]);
+
+  long c = vals[14];
+
+  // Compute the number of levels: enough for the deepest network we use
+  std::vector< std::vector<std::pair<long,long>> > stages;
+  sortingNetworkStages(stages, nNums, SortNetwork(net));
+  long nStages = lsize(stages);
+  long kk = 1; while (kk<k) kk *= 2;
+  sortingNetworkStages(stages, kk, SORT_ODD_EVEN_MERGE);
+  long NumK = 0; while ((1L<<NumK) < kk) NumK++;
+  long nStagesTopK = lsize(stages) + NTL::NumBits(nNums)*(1+NumK);
+  nStages = std::max(nStages, nStagesTopK);
+  long nRounds = 0; // of maxInSlots, each with a comparison and a selection
+  for (long i=10; i<13; i++)
+    if (abs(vals[i])>1) nRounds += NTL::NumBits(abs(vals[i])-1);
+  nStages = std::max(nStages, 2*nRounds);
+  long L;
+  if (bootstrap) L = 900; // that should be enough
+  else           L = 30*(3+ nStages*(NTL::NumBits(bitSize+1)+2));
+
+  if (verbose) {
+    cout <<"input bitSize="<<bitSize<<", "<<nNums<<" numbers, k="<<k<<endl;
+    if (nthreads>1) cout << "  using "<<NTL::AvailableThreads()<<" threads\n";
+    cout << "computing key-independent tables..." << std::flush;
+  }
+  FHEcontext context(m, p, /*r=*/1, gens, ords);
+  buildModChain(context, L, c,/*willBeBootstrappable=*/bootstrap);
+  if (bootstrap) {
+    context.makeBootstrappable(mvec, /*t=*/0);
+  }
+  buildUnpackSlotEncoding(unpackSlotEncoding, *context.ea);
+  if (verbose) {
+    cout << " done.\n";
+    context.zMStar.printout();
+    cout << " L="<<L<<endl;
+    cout << "\ncomputing key-dependent tables..." << std::flush;
+  }
+  FHESecKey secKey(context);
+  secKey.GenSecKey();
+  addSome1DMatrices(secKey); // compute key-switching matrices
+  addFrbMatrices(secKey);
+  if (bootstrap) secKey.genRecryptData();
+  if (verbose) cout << " done\n";
+
+  activeContext = &context; // make things a little easier sometimes
+
+  testSort(secKey, bitSize, nNums, SortNetwork(net));
+  testTopK(secKey, bitSize, nNums, k);
+  testMaxInSlots(secKey, bitSize);
+  cout << "GOOD\n";
+
+  if (verbose) printAllTimers(cout);
+  return 0;
+}
+
+// Run the networks for all n<=maxN on all the 0/1 inputs of size n
+bool testNetworks(long maxN)
+{
+  for (long net=SORT_BITONIC; net<=SORT_ODD_EVEN_MERGE; net++)
+  for (long n=1; n<=maxN; n++) {
+    std::vector< std::vector<std::pair<long,long>> > stages;
+    sortingNetworkStages(stages, n, SortNetwork(net));
+    for (auto& stage: stages) { // each index at most once per stage
+      std::vector<bool> seen(n, false);
+      for (auto& pr: stage) {
+        if (pr.first>=pr.second || pr.second>=n
+            || seen[pr.first] || seen[pr.second]) {
+          if (verbose) cout << "bad stage for n="<<n<<endl;
+          return false;
+        }
+        seen[pr.first] = seen[pr.second] = true;
+      }
+    }
+    for (long x=0; x<(1L<<n); x++) {
+      std::vector<long> v(n);
+      for (long i=0; i<n; i++) v[i] = (x>>i)&1;
+      for (auto& stage: stages) for (auto& pr: stage)
+        if (v[pr.first] > v[pr.second]) std::swap(v[pr.first], v[pr.second]);
+      if (!std::is_sorted(v.begin(), v.end())) {
+        if (verbose)
+          cout << "network "<<net<<" does not sort "<<x<<" (n="<<n<<")\n";
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Encrypt random numbers, some of them shorter than bitSize
+static void encryptNumbers(NTL::Vec< NTL::Vec<Ctxt> >& enc,
+                           std::vector<long>& vals,
+                           FHESecKey& secKey, long bitSize, long nNums)
+{
+  const FHEcontext& context = secKey.getContext();
+  Ctxt zero(secKey);
+  enc.SetLength(nNums);
+  vals.resize(nNums);
+  for (long i=0; i<nNums; i++) {
+    long size = (i%3==2)? std::max(1L, bitSize-1) : bitSize;
+    vals[i] = RandomBits_long(size);
+    resize(enc[i], size, zero);
+    for (long j=0; j<size; j++) {
+      secKey.Encrypt(enc[i][j], ZZX((vals[i]>>j)&1));
+      if (context.isBootstrappable()) // put them at a lower level
+        enc[i][j].bringToSet(context.getCtxtPrimes(5));
+    }
+  }
+}
+
+void testSort(FHESecKey& secKey, long bitSize, long nNums, SortNetwork net)
+{
+  const EncryptedArray& ea = *(secKey.getContext().ea);
+  NTL::Vec< NTL::Vec<Ctxt> > enc;
+  std::vector<long> vals;
+  encryptNumbers(enc, vals, secKey, bitSize, nNums);
+
+  {CtPtrMat_VecCt wNums(enc); // A wrapper around the numbers
+  sortNumbers(wNums, net, &unpackSlotEncoding);
+  } // get rid of the wrapper
+
+  std::sort(vals.begin(), vals.end());
+  for (long i=0; i<nNums; i++) {
+    vector<long> slots;
+    decryptBinaryNums(slots, CtPtrs_VecCt(enc[i]), secKey, ea);
+    if (slots[0] != vals[i]) {
+      cout << "BAD\n";
+      if (verbose)
+        cout << "Sort error: position "<<i<<" has "<<slots[0]
+             <<", should be "<<vals[i]<<endl;
+      exit(0);
+    }
+  }
+  if (verbose) cout << "Sorting "<<nNums<<" numbers succeeded\n";
+}
+
+void testTopK(FHESecKey& secKey, long bitSize, long nNums, long k)
+{
+  const EncryptedArray& ea = *(secKey.getContext().ea);
+  NTL::Vec< NTL::Vec<Ctxt> > enc, top;
+  std::vector<long> vals;
+  encryptNumbers(enc, vals, secKey, bitSize, nNums);
+
+  {CtPtrMat_VecCt wNums(enc), wTop(top); // wrappers
+  topKNumbers(wTop, wNums, k, &unpackSlotEncoding);
+  } // get rid of the wrappers
+
+  std::sort(vals.begin(), vals.end(), std::greater<long>());
+  for (long i=0; i<std::min(k,nNums); i++) {
+    vector<long> slots;
+    decryptBinaryNums(slots, CtPtrs_VecCt(top[i]), secKey, ea);
+    if (slots[0] != vals[i]) {
+      cout << "BAD\n";
+      if (verbose)
+        cout << "Top-k error: number "<<i<<" is "<<slots[0]
+             <<", should be "<<vals[i]<<endl;
+      exit(0);
+    }
+  }
+  if (verbose) cout << "Top-"<<k<<" of "<<nNums<<" numbers succeeded\n";
+}
+
+void testMaxInSlots(FHESecKey& secKey, long bitSize)
+{
+  const EncryptedArray& ea = *(secKey.getContext().ea);
+  long n = ea.size();
+  std::vector<long> vals(n);
+  for (long j=0; j<n; j++) vals[j] = RandomBits_long(bitSize);
+
+  NTL::Vec<Ctxt> enc, mx, idx;
+  Ctxt zero(secKey);
+  resize(enc, bitSize, zero);
+  for (long i=0; i<bitSize; i++) {
+    std::vector<long> bits(n);
+    for (long j=0; j<n; j++) bits[j] = (vals[j]>>i) & 1;
+    ea.encrypt(enc[i], secKey, bits);
+  }
+  {CtPtrs_VecCt wNum(enc), wMax(mx), wIdx(idx); // wrappers
+  maxInSlots(wMax, wIdx, wNum, &unpackSlotEncoding);
+  } // get rid of the wrappers
+
+  long best = *std::max_element(vals.begin(), vals.end());
+  vector<long> slots, where;
+  decryptBinaryNums(slots, CtPtrs_VecCt(mx), secKey, ea);
+  decryptBinaryNums(where, CtPtrs_VecCt(idx), secKey, ea);
+  for (long j=0; j<n; j++)
+    if (slots[j] != best || where[j] < 0 || where[j] >= n
+        || vals[where[j]] != best) {
+      cout << "BAD\n";
+      if (verbose)
+        cout << "Max error: slot "<<j<<" has "<<slots[j]<<" at "<<where[j]
+             <<", should be "<<best<<endl;
+      exit(0);
+    }
+  if (verbose) cout << "Max of "<<n<<" slots succeeded\n";
+}
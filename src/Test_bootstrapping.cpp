@@ -25,6 +25,9 @@ NTL_CLIENT
 #include "EvalMap.h"
 #include "powerful.h"
 #include "matmul.h"
+#include "telemetry.h"
+#include "circuit.h"
+#include "recryptExecutor.h"
 
 static bool noPrint = false;
 static bool dry = false; // a dry-run flag
@@ -211,6 +214,8 @@ void TestIt(long idx, long p, long r, long L, long c, long skHwt, int build_cach
 
   c1.multiplyBy(c_const1);
 
+  RecryptReport report; // profile the recryptions, one record for each
+  setRecryptProfiler(&report);
   for (long num=0; num<INNER_REP; num++) { // multiple tests with same key
     publicKey.reCrypt(c1);
     secretKey.Decrypt(poly2,c1);
@@ -238,6 +243,78 @@ void TestIt(long idx, long p, long r, long L, long c, long skHwt, int build_cach
       exit(0);
     }
   }
+  setRecryptProfiler(NULL);
+  if (!isDryRun()) {
+    RecryptRecord tot = report.totals(/*thin=*/false);
+    bool profOK = (report.size()==INNER_REP && tot.keySwitches>0);
+    for (long st=0; st<RECRYPT_STAGE_COUNT; st++)
+      if (tot.stage[st].seconds < 0) profOK = false;
+    cout << (profOK? "GOOD" : "BAD") << " recryption profile\n";
+    if (!noPrint) report.print(cout);
+
+    // Record a circuit that runs out of capacity, then replay it with the
+    // recryptions placed automatically. x and y need refreshing together.
+    double bootCap = c1.bitCapacity(), minCap = bootCap/2;
+    CircuitRecorder rec;
+    Ctxt x(c_const1), y(c1);
+    long steps = 0;
+    setCircuitHook(&rec);
+    while (y.bitCapacity() > minCap/2 && steps < 32) {
+      x.multiplyBy(x);
+      y.multiplyBy(x);
+      steps++;
+    }
+    setCircuitHook(NULL);
+    RecryptPlan plan;
+    planRecryptions(plan, rec.getCircuit(), bootCap, minCap);
+
+    CircuitReplayer replay(rec.getCircuit(), plan, publicKey);
+    Ctxt x2(c_const1), y2(c1);
+    setCircuitHook(&replay);
+    for (long i=0; i<steps; i++) {
+      x2.multiplyBy(x2);
+      y2.multiplyBy(x2);
+    }
+    setCircuitHook(NULL);
+    secretKey.Decrypt(poly2, y2);
+    bool placeOK = plan.feasible && plan.recryptions()>0 && replay.complete()
+      && replay.batchesDone()==lsize(plan.batches) && poly2==ptxt_poly
+      && y2.bitCapacity() > y.bitCapacity();
+    cout << (placeOK? "GOOD" : "BAD") << " recryption placement\n";
+    if (!noPrint) cout << rec.getCircuit() << "\n" << plan << endl;
+
+    // Recrypt in the background, while this thread goes on with its work
+    bool asyncOK = true;
+    {
+      RecryptExecutor exec(publicKey, /*nWorkers=*/1);
+      auto batch = exec.submit(vector<Ctxt>(2, y), /*priority=*/0,
+                               /*thin=*/false, /*chunk=*/1);
+      long cancelId = -1;
+      auto dropped = exec.submit(y, /*priority=*/0, /*thin=*/false,
+                                 nullptr, &cancelId);
+      auto urgent = exec.submit(y, /*priority=*/1);
+      bool cancelled = exec.cancel(cancelId);
+
+      Ctxt z(c_const1); // unrelated work, overlapped with the recryptions
+      z.multiplyBy(c_const1);
+
+      vector<Ctxt> res = batch.get();
+      res.push_back(urgent.get());
+      for (const Ctxt& r: res) {
+        secretKey.Decrypt(poly2, r);
+        if (poly2 != ptxt_poly || r.bitCapacity() <= y.bitCapacity())
+          asyncOK = false;
+      }
+      if (cancelled) {
+        try { dropped.get(); asyncOK = false; }
+        catch (const RecryptCancelled&) {}
+      }
+      else dropped.get();
+      secretKey.Decrypt(poly2, z);
+      if (poly2 != ZZX(1)) asyncOK = false;
+    }
+    cout << (asyncOK? "GOOD" : "BAD") << " asynchronous recryption\n";
+  }
   }
   if (!noPrint) printAllTimers();
   resetAllTimers();
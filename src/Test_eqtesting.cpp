@@ -0,0 +1,109 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+/* Test_eqtesting.cpp - mapTo01 and incrementalZeroTest on a batch of
+ * ciphertexts, against the plaintext results
+ */
+#include <NTL/BasicThreadPool.h>
+NTL_CLIENT
+
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "timing.h"
+
+// Random slots, with some of them (or some of their low coefficients) zero
+static void randomSlots(vector<ZZX>& v, long nslots, long d, long p)
+{
+  v.assign(nslots, ZZX());
+  for (long s=0; s<nslots; s++) {
+    long low = RandomBnd(d+1); // the coefficients below low are zero
+    if (RandomBnd(4) == 0) continue;
+    for (long j=low; j<d; j++) SetCoeff(v[s], j, RandomBnd(p));
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long m=91;
+  amap.arg("m", m, "defines the cyclotomic polynomial Phi_m(X)");
+  long p=2;
+  amap.arg("p", p, "plaintext base");
+  long L=10;
+  amap.arg("L", L, "# of levels in the modulus chain");
+  long nCtxts=4;
+  amap.arg("nCtxts", nCtxts, "# of ciphertexts in the batch");
+  long n=0;
+  amap.arg("n", n, "# of incremental zero tests (0 for all)", "d");
+  long nt=1;
+  amap.arg("nt", nt, "# threads");
+  bool noPrint=false;
+  amap.arg("noPrint", noPrint, "suppress printouts");
+  amap.parse(argc, argv);
+
+  if (nt > 1) SetNumThreads(nt);
+  setTimersOn();
+
+  FHEcontext context(m, p, /*r=*/1);
+  buildModChain(context, L, /*c=*/2);
+  FHESecKey secretKey(context);
+  const FHEPubKey& publicKey = secretKey;
+  secretKey.GenSecKey();
+  addFrbMatrices(secretKey);
+  EncryptedArray ea(context, context.alMod);
+  long nslots = ea.size();
+  long d = ea.getDegree();
+  if (n <= 0 || n > d) n = d;
+
+  vector< vector<ZZX> > v(nCtxts);
+  vector<Ctxt> ctxts(nCtxts, Ctxt(publicKey));
+  for (long k=0; k<nCtxts; k++) {
+    randomSlots(v[k], nslots, d, p);
+    ea.encrypt(ctxts[k], publicKey, v[k]);
+  }
+
+  bool error = false;
+  vector<ZZX> w;
+
+  vector<Ctxt> mapped(ctxts);
+  mapTo01(ea, mapped);
+  for (long k=0; k<nCtxts; k++) {
+    ea.decrypt(mapped[k], secretKey, w);
+    for (long s=0; s<nslots; s++)
+      if (w[s] != ZZX(IsZero(v[k][s])? 0 : 1)) error = true;
+  }
+  if (!noPrint) cout << "mapTo01: " << (error? "BAD" : "GOOD") << endl;
+
+  if (p == 2) {
+    bool zeroError = false;
+    vector< vector<Ctxt> > res;
+    incrementalZeroTest(res, ea, ctxts, n);
+    if (lsize(res) != nCtxts) zeroError = true;
+    for (long k=0; k<nCtxts && !zeroError; k++)
+      for (long i=0; i<n; i++) {
+        ea.decrypt(res[k][i], secretKey, w);
+        for (long s=0; s<nslots; s++) {
+          bool zero = true;
+          for (long j=0; j<=i; j++)
+            if (!IsZero(coeff(v[k][s], j))) zero = false;
+          if (w[s] != ZZX(zero? 0 : 1)) zeroError = true;
+        }
+      }
+    if (!noPrint)
+      cout << "incrementalZeroTest: " << (zeroError? "BAD" : "GOOD") << endl;
+    error = error || zeroError;
+  }
+
+  cout << (error? "BAD" : "GOOD") << endl;
+  if (!noPrint) printAllTimers();
+  return error? -1 : 0;
+}
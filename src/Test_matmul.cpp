@@ -15,6 +15,7 @@
  */
 #include "matmul.h"
 #include <NTL/BasicThreadPool.h>
+#include <cstdio>
 
 #if (defined(__unix__) || defined(__unix) || defined(unix))
 #include <sys/time.h>
@@ -74,6 +75,122 @@ bool DoTest(const Matrix& mat, const EncryptedArray& ea,
   return equals(ea, v, v1);        // check that we've got the right answer
 }
 
+// Build the constants of a 1D matrix through the cache file twice (the
+// second time they are loaded from it), then once more without build_cache
+// (a file of another shape, which is rebuilt), and check all the products
+template<class Matrix>
+bool DoCacheTest(const Matrix& mat, const EncryptedArray& ea,
+                 const FHESecKey& secretKey, bool minimal)
+{
+  const std::string cacheFile = "Test_matmul_cache.bin";
+  std::remove(cacheFile.c_str());
+
+  PlaintextArray v(ea);
+  random(ea, v);
+  Ctxt ctxt(secretKey);
+  ea.encrypt(ctxt, secretKey, v);
+  Ctxt ctxt2 = ctxt;
+  Ctxt ctxt3 = ctxt;
+
+  {typename Matrix::ExecType mat_exec(mat, minimal, cacheFile, true);
+  mat_exec.mul(ctxt);}
+  {typename Matrix::ExecType mat_exec(mat, minimal, cacheFile, true);
+  mat_exec.mul(ctxt2);}
+  {typename Matrix::ExecType mat_exec(mat, minimal, cacheFile, false);
+  mat_exec.mul(ctxt3);}
+  std::remove(cacheFile.c_str());
+
+  mul(v, mat);
+  PlaintextArray v1(ea), v2(ea), v3(ea);
+  ea.decrypt(ctxt, secretKey, v1);
+  ea.decrypt(ctxt2, secretKey, v2);
+  ea.decrypt(ctxt3, secretKey, v3);
+  return equals(ea, v, v1) && equals(ea, v, v2) && equals(ea, v, v3);
+}
+
+// Split a full matrix into shards, send them (and the input) through
+// streams as to the workers, and check the sum of the partial results
+template<class Matrix>
+bool DoShardTest(const Matrix& mat, const EncryptedArray& ea,
+                 const FHESecKey& secretKey, bool minimal, long nShards)
+{
+  typedef typename Matrix::ExecType Exec;
+  Exec mat_exec(mat, minimal);
+  std::vector< MatMulShard<Exec> > shards;
+  partitionMatMul(shards, mat_exec, nShards);
+
+  PlaintextArray v(ea);
+  random(ea, v);
+  Ctxt ctxt(secretKey);
+  ea.encrypt(ctxt, secretKey, v);
+
+  std::vector<Ctxt> partials;
+  for (const MatMulShard<Exec>& shard: shards) {
+    std::stringstream ss;
+    shard.write(ss);
+    ctxt.write(ss);
+    MatMulShard<Exec> received(ea, ss);
+    Ctxt in(secretKey);
+    in.read(ss);
+    partials.push_back(Ctxt(secretKey));
+    received.mul(partials.back(), in);
+  }
+  mergeMatMulShards(ctxt, partials);
+
+  mul(v, mat);
+  PlaintextArray v1(ea);
+  ea.decrypt(ctxt, secretKey, v1);
+  return equals(ea, v, v1);
+}
+
+// Multiply a random vector of rows entries, encrypted in ceil(rows/n)
+// ciphertexts, by a random rows x cols matrix
+bool DoTiledTest(const EncryptedArray& ea, const FHESecKey& secretKey,
+                 bool minimal, long rows, long cols)
+{
+  std::unique_ptr< MatMulTiled > ptr(buildRandomTiledMatrix(ea, rows, cols));
+  TiledMatMulExec mat_exec(*ptr, minimal);
+  mat_exec.upgrade();
+
+  std::vector<PlaintextArray> v(mat_exec.nIn, PlaintextArray(ea));
+  std::vector<Ctxt> in(mat_exec.nIn, Ctxt(secretKey)), out;
+  for (long i: range(mat_exec.nIn)) {
+    random(ea, v[i]);
+    ea.encrypt(in[i], secretKey, v[i]);
+  }
+  mat_exec.mul(out, in);
+
+  mul(v, *ptr);
+  if (lsize(out) != lsize(v)) return false;
+  for (long j: range(lsize(out))) {
+    PlaintextArray v1(ea);
+    ea.decrypt(out[j], secretKey, v1);
+    if (!equals(ea, v[j], v1)) return false;
+  }
+  return true;
+}
+
+// Multiply two random matrices, along the dimensions 0 and 1, encrypted
+bool DoEncMatTest(const EncryptedArray& ea, const FHESecKey& secretKey,
+                  bool minimal)
+{
+  EncMatMulExec mat_exec(ea, 0, 1, minimal);
+  mat_exec.upgrade();
+
+  PlaintextArray a(ea), b(ea);
+  random(ea, a);
+  random(ea, b);
+  Ctxt ca(secretKey), cb(secretKey);
+  ea.encrypt(ca, secretKey, a);
+  ea.encrypt(cb, secretKey, b);
+  mat_exec.mul(ca, ca, cb);
+
+  mulMatrices(a, b, ea);
+  PlaintextArray a1(ea);
+  ea.decrypt(ca, secretKey, a1);
+  return equals(ea, a, a1);
+}
+
 int ks_strategy = 0;
 // 0 == default
 // 1 == full
@@ -81,7 +198,9 @@ int ks_strategy = 0;
 // 3 == minimal
 
 
-void TestIt(FHEcontext& context, long dim, bool verbose, long full, long block)
+void TestIt(FHEcontext& context, long dim, bool verbose, long full, long block,
+            long cache, long shards, long tiled, long encmat,
+            long banded)
 {
   resetAllTimers();
   if (verbose) {
@@ -165,6 +284,45 @@ void TestIt(FHEcontext& context, long dim, bool verbose, long full, long block)
         okSoFar = false;
     }
   }
+  if (banded > 0 && full == 0 && block == 0) {
+    std::unique_ptr< MatMul1D > ptr(buildRandomBandedMatrix(ea,dim,banded));
+    if (!DoTest(*ptr, ea, secretKey, minimal, verbose))
+      okSoFar = false;
+  }
+  if (cache && full == 0) {
+    if (block == 0) {
+      std::unique_ptr< MatMul1D > ptr(buildRandomMatrix(ea,dim));
+      if (!DoCacheTest(*ptr, ea, secretKey, minimal))
+        okSoFar = false;
+    }
+    else {
+      std::unique_ptr< BlockMatMul1D > ptr(buildRandomBlockMatrix(ea,dim));
+      if (!DoCacheTest(*ptr, ea, secretKey, minimal))
+        okSoFar = false;
+    }
+  }
+  if (shards > 1 && full == 1) {
+    if (block == 0) {
+      std::unique_ptr< MatMulFull > ptr(buildRandomFullMatrix(ea));
+      if (!DoShardTest(*ptr, ea, secretKey, minimal, shards))
+        okSoFar = false;
+    }
+    else {
+      std::unique_ptr< BlockMatMulFull > ptr(buildRandomFullBlockMatrix(ea));
+      if (!DoShardTest(*ptr, ea, secretKey, minimal, shards))
+        okSoFar = false;
+    }
+  }
+  if (tiled && full == 1 && block == 0) {
+    long n = ea.size();
+    if (!DoTiledTest(ea, secretKey, minimal, n + n/2 +1, 2*n -1))
+      okSoFar = false;
+  }
+  if (encmat && ea.dimension() >= 2
+      && ea.sizeOfDimension(0) == ea.sizeOfDimension(1)) {
+    if (!DoEncMatTest(ea, secretKey, minimal))
+      okSoFar = false;
+  }
   cout << (okSoFar? "GOOD\n" : "BAD\n");
 
   if (verbose) {
@@ -210,6 +368,22 @@ int main(int argc, char *argv[])
   long block = 0; 
   amap.arg("block", block, "0: normal, 1: block");
 
+  long cache = 1;
+  amap.arg("cache", cache, "1: also test the on-disk cache (1D only)");
+
+  long shards = 0;
+  amap.arg("shards", shards, "also test splitting into shards (full only)");
+
+  long tiled = 0;
+  amap.arg("tiled", tiled, "1: also test a matrix larger than nslots (full only)");
+
+  long banded = 0;
+  amap.arg("banded", banded, "also test a matrix of this bandwidth (1D only)");
+
+  long encmat = 0;
+  amap.arg("encmat", encmat, "1: also multiply two encrypted matrices");
+  amap.note("needs dimensions 0 and 1 of the same size");
+
   NTL::Vec<long> gens;
   amap.arg("gens", gens, "use specified vector of generators", NULL);
   amap.note("e.g., gens='[420 1105 1425]'");
@@ -245,5 +419,6 @@ int main(int argc, char *argv[])
   FHEcontext context(m, p, r, gens1, ords1);
   buildModChain(context, L, /*c=*/3);
 
-  TestIt(context, dim, verbose, full, block);
+  TestIt(context, dim, verbose, full, block, cache, shards, tiled, encmat,
+         banded);
 }
@@ -0,0 +1,124 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* Test_rowArith.cpp - compare all the available row kernels
+ * against plain NTL arithmetic.
+ */
+#include <iostream>
+#include <NTL/ZZ.h>
+NTL_CLIENT
+
+#include "NumbTh.h"
+#include "rowArith.h"
+
+static bool verbose=false;
+
+static void randomRow(Vec<long>& v, long n, long q)
+{
+  v.SetLength(n);
+  for (long j: range(n)) v[j] = RandomBnd(q);
+  if (n > 0) v[0] = q-1; // make sure that the extremes are covered
+  if (n > 1) v[n-1] = 0;
+}
+
+// returns true if all the kernels agree with NTL for this (n,q)
+static bool testRow(long n, long q)
+{
+  mulmod_t qinv = PrepMulMod(q);
+  long c = RandomBnd(q);
+  Vec<long> x, y, z;
+  randomRow(x, n, q);
+  randomRow(y, n, q);
+
+  z = x; addModRow(z.elts(), y.elts(), n, q);
+  for (long j: range(n)) if (z[j] != AddMod(x[j], y[j], q)) return false;
+
+  z = x; subModRow(z.elts(), y.elts(), n, q);
+  for (long j: range(n)) if (z[j] != SubMod(x[j], y[j], q)) return false;
+
+  z = x; mulModRow(z.elts(), y.elts(), n, q, qinv);
+  for (long j: range(n)) if (z[j] != MulMod(x[j], y[j], q)) return false;
+
+  z = x; addModRowConst(z.elts(), c, n, q);
+  for (long j: range(n)) if (z[j] != AddMod(x[j], c, q)) return false;
+
+  z = x; subModRowConst(z.elts(), c, n, q);
+  for (long j: range(n)) if (z[j] != SubMod(x[j], c, q)) return false;
+
+  z = x; mulModRowConst(z.elts(), c, n, q);
+  for (long j: range(n)) if (z[j] != MulMod(x[j], c, q)) return false;
+
+  Vec<long> w;
+  randomRow(w, n, q);
+  z = x; mulAddModRow(z.elts(), y.elts(), w.elts(), n, q, qinv);
+  for (long j: range(n))
+    if (z[j] != AddMod(x[j], MulMod(y[j], w[j], q), q)) return false;
+
+  // for the larger q, enough terms that the sums are reduced along the way
+  long nTerms = min(mulAccLazyTerms(q) + 3, 300L);
+  Vec< Vec<long> > ys(INIT_SIZE, nTerms), zs(INIT_SIZE, nTerms);
+  vector<const long*> yp(nTerms), zp(nTerms);
+  for (long t: range(nTerms)) {
+    randomRow(ys[t], n, q);
+    randomRow(zs[t], n, q);
+    yp[t] = ys[t].elts();
+    zp[t] = zs[t].elts();
+  }
+  z.SetLength(n);
+  mulAccRows(z.elts(), yp.data(), zp.data(), nTerms, n, q, qinv);
+  for (long j: range(n)) {
+    long sum = 0;
+    for (long t: range(nTerms))
+      sum = AddMod(sum, MulMod(ys[t][j], zs[t][j], q), q);
+    if (z[j] != sum) return false;
+  }
+
+  // the largest sums: (q-1)^2 = 1 mod q
+  for (long t: range(nTerms))
+    for (long j: range(n)) ys[t][j] = zs[t][j] = q-1;
+  mulAccRows(z.elts(), yp.data(), zp.data(), nTerms, n, q, qinv);
+  for (long j: range(n))
+    if (z[j] != nTerms % q) return false;
+
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  ArgMapping amap;
+  long nTests = 20;
+  amap.arg("nTests", nTests, "number of tests to run");
+  long seed=0;
+  amap.arg("seed", seed, "PRG seed");
+  amap.arg("verbose", verbose, "print more information");
+  amap.parse(argc, argv);
+  if (seed) SetSeed(ZZ(seed));
+
+  RowArithISA best = bestRowArithISA();
+  for (long isa = ROWARITH_SCALAR; isa <= long(best); isa++) {
+    if (!setRowArithISA(RowArithISA(isa))) continue;
+    if (verbose)
+      cout << "testing " << rowArithISAname(RowArithISA(isa)) << " kernels\n";
+
+    for (long t: range(nTests)) {
+      long n = 1 + RandomBnd(100) + (t%2)*1000; // include ragged tails
+      long q = GenPrime_long(NTL_SP_NBITS - RandomBnd(20));
+      if (!testRow(n, q)) {
+        cout << "BAD: " << rowArithISAname(RowArithISA(isa))
+             << " n=" << n << " q=" << q << endl;
+        exit(0);
+      }
+    }
+  }
+  setRowArithISA(best);
+  cout << "GOOD\n";
+  return 0;
+}
@@ -36,6 +36,10 @@ static long mValues[][15] = {
 // test function declerations
 void testLookup(const FHESecKey& sKey, long insize, long outsize);
 void testWritein(const FHESecKey& sKey, long insize, long nTests);
+void testMultiLookup(const FHESecKey& sKey, long insize, long outsize,
+                     long nTests);
+void testHistogram(const FHESecKey& sKey, long insize, long nTests);
+void testGroupBySum(const FHESecKey& sKey, long insize, long nTests);
 
 
 int main(int argc, char *argv[])
@@ -131,6 +135,15 @@ int main(int argc, char *argv[])
   testWritein(secKey, bitSize, nTests);
   cout << "GOOD\n";
 
+  testMultiLookup(secKey, bitSize, outSize, nTests);
+  cout << "GOOD\n";
+
+  testHistogram(secKey, bitSize, nTests);
+  cout << "GOOD\n";
+
+  testGroupBySum(secKey, bitSize, nTests);
+  cout << "GOOD\n";
+
   if (verbose) printAllTimers(cout);
   return 0;
 }
@@ -220,3 +233,122 @@ void testWritein(const FHESecKey& sKey, long size, long nTests)
     }
   }
 }
+
+void testMultiLookup(const FHESecKey& sKey, long insize, long outsize,
+                     long nTests)
+{
+  // Three tables for the same index, one of them shorter than the others
+  const EncryptedArray& ea = *(sKey.getContext().ea);
+  std::vector< std::vector<zzX> > T(3);
+  buildLookupTable(T[0], [](double x){ return 1/(x+1.0);},
+                   insize,  /*scale_in=*/0, /*sign_in=*/0,
+                   outsize, /*scale_out=*/1-outsize, /*sign_out=*/0, ea);
+  buildLookupTable(T[1], [](double x){ return 1/(x+2.0);},
+                   insize,  /*scale_in=*/0, /*sign_in=*/0,
+                   outsize, /*scale_out=*/1-outsize, /*sign_out=*/0, ea);
+  buildLookupTable(T[2], [](double x){ return 1/(x+3.0);},
+                   insize-1, /*scale_in=*/0, /*sign_in=*/0,
+                   outsize, /*scale_out=*/1-outsize, /*sign_out=*/0, ea);
+
+  for (long count=0; count<nTests; count++) {
+    long index = RandomBnd(1L << insize);
+    std::vector<Ctxt> ei(insize, Ctxt(sKey));
+    encryptIndex(ei, index, sKey);
+
+    std::vector<Ctxt> out;
+    {CtPtrs_vectorCt wOut(out);
+    tableLookup(wOut, T, CtPtrs_vectorCt(ei), &unpackSlotEncoding);
+    }
+    zzX zero;
+    for (long t=0; t<lsize(T); t++) {
+      ZZX poly;  sKey.Decrypt(poly, out[t]);
+      zzX poly2; convert(poly2, poly);
+      const zzX& expected = (index<lsize(T[t]))? T[t][index] : zero;
+      if (poly2 != expected) {
+        cout << "BAD\n";
+        if (verbose) cout << "testMultiLookup error: decrypted T"<<t
+                          <<"["<<index<<"]\n";
+        exit(0);
+      }
+    }
+  }
+}
+
+void testHistogram(const FHESecKey& sKey, long size, long nTests)
+{
+  long tSize = 1L << size; // table size
+
+  // encrypt a random table
+  vector<long> pT(tSize, 0);         // plaintext table
+  vector<Ctxt> T(tSize, Ctxt(sKey)); // encrypted table
+  for (long i=0; i<tSize; i++) {
+    long bit = RandomBits_long(1);
+    sKey.Encrypt(T[i], to_ZZX(bit));
+    pT[i] = bit;
+  }
+
+  // Add 1 to the entries of nTests random indexes, all in one call
+  vector< vector<Ctxt> > I(nTests, vector<Ctxt>(size, Ctxt(sKey)));
+  for (long k=0; k<nTests; k++) {
+    long index = RandomBnd(tSize);
+    encryptIndex(I[k], index, sKey);
+    pT[index]++;
+  }
+  tableWriteIn(CtPtrs_vectorCt(T), CtPtrMat_vectorCt(I), &unpackSlotEncoding);
+
+  for (long i=0; i<tSize; i++) {
+    ZZX poly;
+    sKey.Decrypt(poly, T[i]);
+    long decrypted = to_long(NTL::ConstTerm(poly));
+    long p = T[i].getPtxtSpace();
+    if ((pT[i] - decrypted) % p) { // not equal mod p
+      cout << "BAD\n";
+      if (verbose)
+        cout << "  testHistogram error: decrypted T["<<i<<"]="<<decrypted
+             <<" but should be "<<pT[i]<<" (mod "<<p<<")\n";
+      exit(0);
+    }
+  }
+}
+
+void testGroupBySum(const FHESecKey& sKey, long size, long nTests)
+{
+  size = std::min(size, 3L); // a few groups, to keep it short
+  long tSize = 1L << size;
+  const long valSize = 3;
+
+  // The groups start with random sums of valSize bits
+  vector<long> pT(tSize);
+  vector< vector<Ctxt> > T(tSize, vector<Ctxt>(valSize, Ctxt(sKey)));
+  for (long j=0; j<tSize; j++) {
+    pT[j] = RandomBnd(1L << valSize);
+    encryptIndex(T[j], pT[j], sKey);
+  }
+
+  // nTests random (group, value) pairs
+  vector< vector<Ctxt> > I(nTests, vector<Ctxt>(size, Ctxt(sKey)));
+  vector< vector<Ctxt> > V(nTests, vector<Ctxt>(valSize, Ctxt(sKey)));
+  for (long k=0; k<nTests; k++) {
+    long index = RandomBnd(tSize);
+    long value = RandomBnd(1L << valSize);
+    encryptIndex(I[k], index, sKey);
+    encryptIndex(V[k], value, sKey);
+    pT[index] += value;
+  }
+  {CtPtrMat_vectorCt wT(T);
+  tableAddIn(wT, CtPtrMat_vectorCt(I), CtPtrMat_vectorCt(V),
+             /*sizeLimit=*/0, &unpackSlotEncoding);
+  }
+
+  for (long j=0; j<tSize; j++) {
+    long decrypted = decryptIndex(T[j], sKey);
+    long mask = (1L << lsize(T[j])) - 1; // the sum is kept mod 2^size
+    if (decrypted != (pT[j] & mask)) {
+      cout << "BAD\n";
+      if (verbose)
+        cout << "  testGroupBySum error: decrypted group "<<j<<" as "
+             <<decrypted<<" but it should be "<<(pT[j] & mask)<<"\n";
+      exit(0);
+    }
+  }
+}
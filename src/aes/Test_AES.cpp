@@ -59,6 +59,9 @@ int main(int argc, char **argv)
   bool packed=true;
   amap.arg("packed", packed, "use packed bootstrapping");
 
+  bool stream=false;
+  amap.arg("stream", stream, "also test the CTR-mode transciphering pipeline");
+
   amap.parse(argc, argv);
   if (idx>5) idx = 5;
 
@@ -259,6 +262,56 @@ int main(int argc, char **argv)
     printNamedTimer(cout, "batchRecrypt");
     printNamedTimer(cout, "recryption");
   }
+
+  if (stream) { // CTR mode through the pipeline, 1.5 batches and a bit
+    cout << "AES-CTR stream "<< std::flush;
+    AESTranscipher pipe(hAES, encryptedAESkey, /*ctxtsPerBatch=*/1,
+                        /*nWorkers=*/2);
+    long nBytes = pipe.batchBytes() + pipe.batchBytes()/2 + 5;
+    Vec<uint8_t> iv(INIT_SIZE, 16), msg(INIT_SIZE, nBytes);
+    Vec<uint8_t> aesStream(INIT_SIZE, nBytes);
+    for (long i=0; i<16; i++) iv[i] = uint8_t(RandomBnd(256));
+    iv[15] = 0xff; // the counter carries into iv[14]
+    for (long i=0; i<nBytes; i++) msg[i] = uint8_t(RandomBnd(256));
+
+    for (long i=0; i<divc(nBytes,16); i++) { // C = P xor AES_k(iv+i)
+      uint8_t ctr[16], ks[16];
+      unsigned long carry = i;
+      for (long k=15; k>=0; k--) {
+        carry += iv[k];
+        ctr[k] = uint8_t(carry & 0xff);
+        carry >>= 8;
+      }
+      Cipher(ks, ctr, keySchedule, /*numRounds=*/10);
+      for (long k=0; k<16 && 16*i+k<nBytes; k++)
+        aesStream[16*i+k] = msg[16*i+k] ^ ks[k];
+    }
+
+    tm = -GetTime();
+    pipe.setCTR(iv);
+    Vec<uint8_t> part(INIT_SIZE, nBytes/3);
+    for (long i=0; i<part.length(); i++) part[i] = aesStream[i];
+    pipe.push(part);
+    part.SetLength(nBytes - nBytes/3);
+    for (long i=0; i<part.length(); i++) part[i] = aesStream[nBytes/3 +i];
+    pipe.push(part);
+    pipe.flush();
+
+    Vec<uint8_t> out;
+    vector<Ctxt> batch;
+    while (pipe.pop(batch)) {
+      Vec<ZZX> bpoly(INIT_SIZE, batch.size());
+      for (long i=0; i<bpoly.length(); i++)
+        secretKey.Decrypt(bpoly[i], batch[i]);
+      Vec<uint8_t> bytes(INIT_SIZE, min(pipe.batchBytes(),
+                                        nBytes - out.length()));
+      decode4AES(bytes, bpoly, hAES.getEA());
+      out.append(bytes);
+    }
+    tm += GetTime();
+    if (out != msg) cerr << "@ stream error\n";
+    else cout << "in "<<tm<<" seconds\n";
+  }
 #if (defined(__unix__) || defined(__unix) || defined(unix))
   struct rusage rusage;
   getrusage( RUSAGE_SELF, &rusage );
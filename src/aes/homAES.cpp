@@ -3,6 +3,8 @@
 namespace std {} using namespace std;
 namespace NTL {} using namespace NTL;
 #include <cstring>
+#include <stdexcept>
+#include <NTL/BasicThreadPool.h>
 #include "homAES.h"
 
 #ifdef DEBUG_PRINTOUT
@@ -82,15 +84,25 @@ static void decRowShift(Ctxt& c, const vector<PolyType>& decLinTran,
 
 static void invert(vector<Ctxt>& data); // Z -> Z^{-1} in GF(2^8)
 
+// Prepare a round key or the affine constant once for all the data
+// ciphertexts, at the primes of data[0] (see the comments below)
+static void roundKeyAtLevel(Ctxt& key, const Ctxt& roundKey,
+                            const vector<Ctxt>& data);
+static const PolyType& constAtLevel(PolyType& scratch, const PolyType& c,
+                                    const Ctxt& ctxt);
+static void addRoundKey(vector<Ctxt>& data, const Ctxt& roundKey,
+                        bool negative=false);
+static void addAffineConst(vector<Ctxt>& data, const PolyType& c);
+
 // Pack the ciphertexts in c in as few "fully packed" cipehrtext as possible.
 static void packCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
-		     const GF2X& XinSlots);
+		     const vector<PolyType>& packConsts);
 
 // Unpack the fully-packed ciphertext in from into the vector to. If to.size()>0
 // then do not unpack into more than to.size() ciphertexts. If 'from' does not
 // have enough ciphertexts to fill all of 'to' then pad with zeros.
 static void unackCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
-		      const Mat<GF2X>& unpackConsts);
+		      const vector< vector<PolyType> >& unpackConsts);
 
 // Implementation of the class HomAES
 
@@ -158,16 +170,27 @@ void HomAES::setPackingConstants()
   const FHEcontext& context = ea2.getContext();
   const EncryptedArrayDerived<PA_GF2>& ea = context.ea->getDerived(PA_GF2());
 
-  // Compute the packing constants, with X in all the slots
+  long e = ea.getDegree() / 8; // the extension degree
+  assert(ea.getDegree()==e*8 && e<=(long) sizeof(long));
+
+  // Compute the packing constants, with X^i in all the slots
+#ifdef USE_ZZX_POLY
+  packConsts.resize(e-1);
+#else
+  packConsts.resize(e-1, DoubleCRT(context));
+#endif
   {vector<GF2X> slots(ea.size(), GF2X(1,1)); // X in all the slots
   ZZX tmp; ea.encode(tmp, slots); // encode as ZZX
-  conv(XinSlots, tmp);}           // convert to ZZ2X
+  GF2X XinSlots, X2i;
+  conv(XinSlots, tmp);            // convert to ZZ2X
+  X2i = XinSlots;
+  for (long i=0; i<e-1; i++) {    // X^{i+1}
+    if (i>0) MulMod(X2i, X2i, XinSlots, ea.getTab().getPhimXMod());
+    packConsts[i] = conv<ZZX>(X2i);
+  }}
 
   // Compute the unpacking constants
 
-  long e = ea.getDegree() / 8; // the extension degree
-  assert(ea.getDegree()==e*8 && e<=(long) sizeof(long));
-
   GF2EBak bak; bak.save(); // save current modulus (if any)
   GF2XModulus F0(ea.getTab().getFactors()[0]);
   GF2E::init(F0);
@@ -185,11 +208,15 @@ void HomAES::setPackingConstants()
   inv(K, Kinv); // invert Kinv to get K
 
   // Encode K in slots
-  unpacking.SetDims(e,e);
+#ifdef USE_ZZX_POLY
+  unpackConsts.assign(e, vector<PolyType>(e));
+#else
+  unpackConsts.assign(e, vector<PolyType>(e, DoubleCRT(context)));
+#endif
   for (long i=0; i<e; i++) for (long j=0; j<e; j++) {
     vector<GF2X> slots(ea.size(), rep(K[i][j])); // K[i][j] in all the slots
     ZZX tmp; ea.encode(tmp, slots);
-    conv(unpacking[i][j], tmp);
+    unpackConsts[i][j] = tmp;
   }
 }
 
@@ -206,8 +233,7 @@ void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
   if (1>(long)eData.size() || 1>(long)aesKey.size()) return; // no data/key
   //  long lvlBits = eData[0].getContext().bitsPerLevel;
 
-  for (long j=0; j<(long)eData.size(); j++)
-    eData[j] += aesKey[0];  // initial key addition
+  addRoundKey(eData, aesKey[0]);  // initial key addition
 
   for (long i=1; i<(long)aesKey.size(); i++) { // apply the AES rounds
 
@@ -220,10 +246,9 @@ void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
     //    decryptAndPrint(cerr, eData[0], *dbgKey, *dbgEa);
 #endif
     if (eData[0].findBaseLevel() < 2) batchRecrypt(eData);
-    for (long j=0; j<(long)eData.size(); j++) { // GF2 affine transformation
+    for (long j=0; j<(long)eData.size(); j++) // GF2 affine transformation
       applyLinPolyLL(eData[j], encAffMat, ea2.getDegree());
-      eData[j].addConstant(affVec);
-    }
+    addAffineConst(eData, affVec);
 #ifdef DEBUG_PRINTOUT
     CheckCtxt(eData[0], "+ After affine");
     //    cerr << " + After affine ";
@@ -247,7 +272,7 @@ void HomAES::homAESenc(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
 #endif
 
     // Key addition
-    for (long j=0; j<(long)eData.size(); j++) eData[j] += aesKey[i];
+    addRoundKey(eData, aesKey[i]);
   }
 }
 
@@ -286,7 +311,7 @@ void HomAES::homAESdec(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
 
   for (long i=aesKey.size()-1; i>0; i--) { // apply the AES rounds
     // Key addition
-    for (long j=0; j<(long)eData.size(); j++) eData[j] -= aesKey[i];
+    addRoundKey(eData, aesKey[i], /*negative=*/true);
 
     // Apply RowShift/ColMix to each ciphertext
     if (eData[0].findBaseLevel() < 2) batchRecrypt(eData);
@@ -306,10 +331,9 @@ void HomAES::homAESdec(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
 
     // ByteSub
     if (eData[0].findBaseLevel() < 2) batchRecrypt(eData);
-    for (long j=0; j<(long)eData.size(); j++) { // GF2 affine transformation
-      eData[j].addConstant(affVec);
+    addAffineConst(eData, affVec);          // GF2 affine transformation
+    for (long j=0; j<(long)eData.size(); j++)
       applyLinPolyLL(eData[j], decAffMat, ea2.getDegree());
-    }
 #ifdef DEBUG_PRINTOUT
     CheckCtxt(eData[0], "+ After affine");
     //    cerr << " + After affine ";
@@ -324,8 +348,7 @@ void HomAES::homAESdec(vector<Ctxt>& eData, const vector<Ctxt>& aesKey) const
 #endif
   }
 
-  for (long j=0; j<(long)eData.size(); j++)
-    eData[j] -= aesKey[0];  // final key addition
+  addRoundKey(eData, aesKey[0], /*negative=*/true); // final key addition
 }
 
 // Perform AES decryption on AES ciphertext bytes (ECB mode). The input
@@ -356,13 +379,13 @@ void HomAES::batchRecrypt(vector<Ctxt>& data) const
   FHEPubKey& pk = (FHEPubKey&) data[0].getPubKey();
   if (!pk.isBootstrappable()) return;
 
-  if (data.size()>1 && unpacking.NumRows()==0) // lazy initialization
+  if (data.size()>1 && unpackConsts.empty()) // lazy initialization
     return; // setPackingConstants();
 
   vector<Ctxt>* pData = &data;
   vector<Ctxt> fullyPacked; // empty at first
   if (data.size()>1) {      // pack to save on recryption operations
-    packCtxt(fullyPacked, data, XinSlots);
+    packCtxt(fullyPacked, data, packConsts);
     pData = &fullyPacked;
   }
 
@@ -384,7 +407,7 @@ void HomAES::batchRecrypt(vector<Ctxt>& data) const
 
   // unpack back to the original vector, if needed
   if (fullyPacked.size()>0) {
-    unackCtxt(data, fullyPacked, unpacking);
+    unackCtxt(data, fullyPacked, unpackConsts);
   }
 
 #ifdef DEBUG_PRINTOUT
@@ -767,6 +790,63 @@ void decode4AES(Vec<uint8_t>& data, const Vec<ZZX>& encData,
   }
 }
 
+// The encrypted key schedule is kept at the level it was encrypted at,
+// while the data goes down the modulus chain. Adding them one by one would
+// mod-UP every data ciphertext to the primes of the key (Ctxt::addCtxt
+// matches the prime sets upward), so the round key is brought down to the
+// primes of the data once, and that copy is added to all of them.
+static void roundKeyAtLevel(Ctxt& key, const Ctxt& roundKey,
+                            const vector<Ctxt>& data)
+{
+  key = roundKey;
+  if (key.getPrimeSet() != data[0].getPrimeSet())
+    key.modDownToSet(data[0].getPrimeSet());
+}
+
+static void addRoundKey(vector<Ctxt>& data, const Ctxt& roundKey,
+                        bool negative)
+{
+  if (data.empty()) return;
+  Ctxt key(ZeroCtxtLike, roundKey);
+  roundKeyAtLevel(key, roundKey, data);
+  for (long j=0; j<(long)data.size(); j++)
+    data[j].addCtxt(key, negative);
+}
+
+// The constants live at all the primes, and Ctxt::addConstant trims a copy
+// to the primes of the ciphertext. Trim it once for all the ciphertexts at
+// the level of ctxt, the others (if any) still go through the slow path.
+static const PolyType& constAtLevel(PolyType& scratch, const PolyType& c,
+                                    const Ctxt& ctxt)
+{
+#ifdef USE_ZZX_POLY
+  return c; // converted to ctxt's primes by addConstant anyway
+#else
+  IndexSet delta = c.getIndexSet() / ctxt.getPrimeSet();
+  if (empty(delta)) return c;
+  scratch = c;
+  scratch.removePrimes(delta);
+  return scratch;
+#endif
+}
+
+static void addAffineConst(vector<Ctxt>& data, const PolyType& c)
+{
+  if (data.empty()) return;
+#ifdef USE_ZZX_POLY
+  PolyType scratch;
+#else
+  PolyType scratch(data[0].getContext(), IndexSet());
+#endif
+  const PolyType& atLevel = constAtLevel(scratch, c, data[0]);
+  for (long j=0; j<(long)data.size(); j++) {
+    if (data[j].getPrimeSet() == data[0].getPrimeSet())
+      data[j].addConstant(atLevel);
+    else
+      data[j].addConstant(c);
+  }
+}
+
 // the transformation X -> X^{-1} in GF(2^8)
 static void invert(vector<Ctxt>& data)
 {
@@ -785,7 +865,7 @@ static void invert(vector<Ctxt>& data)
 
 // Pack the ciphertexts in c in as few "fully packed" cipehrtext as possible.
 static void packCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
-		     const GF2X& XinSlots)
+		     const vector<PolyType>& packConsts)
 {
   FHE_TIMER_START;
   if (from.size() <= 1) { // nothing to do here
@@ -795,7 +875,6 @@ static void packCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
   // Get the context and the ea for "fully packed" polynomials
   const FHEcontext& context = from[0].getContext();
   const EncryptedArrayDerived<PA_GF2>& ea = context.ea->getDerived(PA_GF2());
-  const GF2XModulus& PhimX = ea.getTab().getPhimXMod();
   long e = ea.getDegree() / 8; // the extension degree
   long nPacked = divc(from.size(), e); // How many fully-packed ciphertexts
 
@@ -805,18 +884,9 @@ static void packCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
   // Each ctxt in 'to' is the result of packing <= e ctxts from 'from'
   for (long i=0; i<(long) to.size(); i++) {
     to[i] = from[e*i];
-    if (e*i == (long)from.size()-1) break; // check if we are done packing
-
-    Ctxt tmp = from[e*i +1];
-    tmp.multByConstant(conv<ZZX>(XinSlots));
-    to[i] += tmp;
-    if (e*i == (long)from.size()-2) break; // check if we are done packing
-
-    GF2X X2i = XinSlots; // X^i, initially i=1
-    for (long j= e*i +2; j<e*(i+1) && j<(long)from.size(); j++) {
-      MulMod(X2i, X2i, XinSlots, PhimX);  // X^i
-      tmp = from[j];
-      tmp.multByConstant(conv<ZZX>(X2i));
+    for (long j= e*i +1; j<e*(i+1) && j<(long)from.size(); j++) {
+      Ctxt tmp = from[j];
+      tmp.multByConstant(packConsts[j -e*i -1]); // X^{j-e*i}
       to[i] += tmp;
     }
   }
@@ -826,7 +896,7 @@ static void packCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
 // then do not unpack into more than to.size() ciphertexts. If 'from' does not
 // have enough ciphertexts to fill all of 'to' then pad with zeros.
 static void unackCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
-		      const Mat<GF2X>& unpackConsts)
+		      const vector< vector<PolyType> >& unpackConsts)
 {
   FHE_TIMER_START;
   // Get the context and the ea for "fully packed" polynomials
@@ -843,17 +913,193 @@ static void unackCtxt(vector<Ctxt>& to, const vector<Ctxt>& from,
 
   long nPacked = divc(nUnpacked, 8);
   for (long idx=0; idx<nPacked; idx++) {
-    vector<Ctxt> conjugates(e, from[idx]); // Compute the conjugates, Z^{2^{8j}}
+    // Compute the conjugates Z^{2^{8j}}, sharing one digit decomposition
+    vector< shared_ptr<Ctxt> > conjugates(e);
+    {BasicAutomorphPrecon precon(from[idx]);
+    conjugates[0] = make_shared<Ctxt>(from[idx]);
     for (long j=1; j<e; j++)
-      conjugates[j].frobeniusAutomorph(8*j);
+      conjugates[j] = precon.frobeniusAutomorph(8*j);}
 
     for (long i=0; i<e && (idx*e +i)<(long)to.size(); i++) {
       // Recall that to[idx*e +i] was initialize to zero
       for (long j=0; j<e; j++) {
-	Ctxt tmp = conjugates[j];
-	tmp.multByConstant(conv<ZZX>(unpackConsts[i][j]));
+	Ctxt tmp = *conjugates[j];
+	tmp.multByConstant(unpackConsts[i][j]);
 	to[idx*e +i] += tmp;
       }
     }
   }
 }
+
+
+/********************************************************************/
+/************   AESTranscipher: a stream of batches   ***************/
+/********************************************************************/
+
+AESTranscipher::AESTranscipher(const HomAES& _aes, const vector<Ctxt>& _eKey,
+                               long ctxtsPerBatch, long nWorkers,
+                               long _threadsPerWorker)
+  : aes(_aes), eKey(_eKey),
+    batchBlocks(max(ctxtsPerBatch, 1L) * (_aes.getEA().size()/16)),
+    threadsPerWorker(max(_threadsPerWorker, 1L)),
+    ctrMode(false), nextBlock(0), stopping(false)
+{
+  assert(eKey.size() > 0 && batchBlocks > 0);
+  for (long i=0; i<max(nWorkers, 1L); i++)
+    workers.emplace_back(&AESTranscipher::workerLoop, this);
+}
+
+AESTranscipher::~AESTranscipher()
+{
+  {
+    lock_guard<mutex> lock(mx);
+    stopping = true;
+  }
+  wakeup.notify_all();
+  for (thread& w: workers) w.join();
+}
+
+void AESTranscipher::workerLoop()
+{
+  SetNumThreads(threadsPerWorker); // the NTL pool of this thread
+  unique_lock<mutex> lock(mx);
+  while (true) {
+    wakeup.wait(lock, [this]() { return stopping || !jobs.empty(); });
+    if (jobs.empty()) break; // stopping, and nothing left to run
+
+    std::function<void()> job = std::move(jobs.front());
+    jobs.pop_front();
+    lock.unlock();
+    job(); // reports its own errors to its future
+    lock.lock();
+  }
+}
+
+std::future< vector<Ctxt> >
+AESTranscipher::enqueue(std::function< vector<Ctxt>() > job)
+{
+  auto task = make_shared< std::packaged_task<vector<Ctxt>()> >(job);
+  std::future< vector<Ctxt> > result = task->get_future();
+  {
+    lock_guard<mutex> lock(mx);
+    jobs.push_back([task]() { (*task)(); });
+  }
+  wakeup.notify_one();
+  return result;
+}
+
+std::future< vector<Ctxt> >
+AESTranscipher::submit(const Vec<uint8_t>& aesBytes)
+{
+  if (aesBytes.length() % 16 != 0 || aesBytes.length() > batchBytes())
+    throw logic_error("AESTranscipher::submit: the batch must be at most "
+                      + to_string(batchBytes()) + " bytes, in whole blocks");
+  auto data = make_shared< Vec<uint8_t> >(aesBytes);
+  const HomAES& hom = aes;
+  const vector<Ctxt>& key = eKey;
+  return enqueue([data, &hom, &key]() {
+    vector<Ctxt> out;
+    if (data->length() > 0) hom.homAESdec(out, key, *data);
+    return out;
+  });
+}
+
+// Set ctr to the 128-bit big-endian integer iv + n
+static void counterBlock(uint8_t* ctr, const Vec<uint8_t>& iv,
+                         unsigned long n)
+{
+  unsigned long carry = 0;
+  for (long k=15; k>=0; k--) {
+    unsigned long sum = iv[k] + (n & 0xff) + carry;
+    ctr[k] = uint8_t(sum & 0xff);
+    carry = sum >> 8;
+    n >>= 8;
+  }
+}
+
+std::future< vector<Ctxt> >
+AESTranscipher::submitCTR(const Vec<uint8_t>& aesBytes,
+                          const Vec<uint8_t>& iv, unsigned long firstBlock)
+{
+  if (iv.length() != 16)
+    throw logic_error("AESTranscipher::submitCTR: the IV must be 16 bytes");
+  if (aesBytes.length() > batchBytes())
+    throw logic_error("AESTranscipher::submitCTR: the batch must be at most "
+                      + to_string(batchBytes()) + " bytes");
+
+  // The counter blocks are public, so they are prepared here
+  long nBlocks = divc(aesBytes.length(), 16);
+  auto ctr = make_shared< Vec<uint8_t> >();
+  ctr->SetLength(nBlocks*16);
+  for (long i=0; i<nBlocks; i++)
+    counterBlock(&(*ctr)[i*16], iv, firstBlock+i);
+  auto data = make_shared< Vec<uint8_t> >(aesBytes);
+
+  const HomAES& hom = aes;
+  const vector<Ctxt>& key = eKey;
+  return enqueue([ctr, data, &hom, &key]() {
+    vector<Ctxt> out;
+    if (data->length() == 0) return out;
+    hom.homAESenc(out, key, *ctr);     // the keystream, Enc_HE(AES_k(ctr))
+
+    Vec<ZZX> encoded;                  // add the AES ciphertext to it
+    encode4AES(encoded, *data, hom.getEA());
+    for (long i=0; i<(long)out.size(); i++)
+      out[i].addConstant(encoded[i]);
+    return out;
+  });
+}
+
+void AESTranscipher::setCTR(const Vec<uint8_t>& _iv, unsigned long firstBlock)
+{
+  if (_iv.length() != 16)
+    throw logic_error("AESTranscipher::setCTR: the IV must be 16 bytes");
+  if (buffered.length() > 0) flush(); // those belong to the old mode
+  ctrMode = true;
+  iv = _iv;
+  nextBlock = firstBlock;
+}
+
+void AESTranscipher::push(const Vec<uint8_t>& aesBytes)
+{
+  long start = 0; // the first byte of aesBytes that is not queued yet
+  while (buffered.length() + aesBytes.length() - start >= batchBytes()) {
+    long take = batchBytes() - buffered.length();
+    Vec<uint8_t> batch = buffered;
+    batch.SetLength(batchBytes());
+    for (long i=0; i<take; i++)
+      batch[buffered.length()+i] = aesBytes[start+i];
+    start += take;
+    buffered.SetLength(0);
+    if (ctrMode) results.push_back(submitCTR(batch, iv, nextBlock));
+    else         results.push_back(submit(batch));
+    nextBlock += batchBlocks;
+  }
+  long keep = buffered.length();
+  buffered.SetLength(keep + aesBytes.length() - start);
+  for (long i=start; i<aesBytes.length(); i++)
+    buffered[keep + i - start] = aesBytes[i];
+}
+
+void AESTranscipher::flush()
+{
+  if (buffered.length() == 0) return;
+  if (ctrMode) {
+    results.push_back(submitCTR(buffered, iv, nextBlock));
+    nextBlock += divc(buffered.length(), 16);
+  }
+  else results.push_back(submit(buffered)); // must be in whole blocks
+  buffered.SetLength(0);
+}
+
+bool AESTranscipher::pop(vector<Ctxt>& out, bool wait)
+{
+  if (results.empty()) return false;
+  if (!wait && results.front().wait_for(std::chrono::seconds(0))
+               != std::future_status::ready)
+    return false;
+  std::future< vector<Ctxt> > next = std::move(results.front());
+  results.pop_front();
+  out = next.get();
+  return true;
+}
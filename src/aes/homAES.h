@@ -1,6 +1,13 @@
 /** homAES.h - homomorphic AES using HElib
  */
 #include <stdint.h>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <functional>
 #include <NTL/ZZX.h>
 #include <NTL/GF2X.h>
 #include "EncryptedArray.h"
@@ -24,8 +31,11 @@ class HomAES {
   
   vector<PolyType> encLinTran, decLinTran; // The rowShift/colMix constants
 
-  GF2X XinSlots; // "Fully packed" poly with X in all the slots, for packing
-  Mat<GF2X> unpacking; // constants for unpacking after recryption
+  // The packing/unpacking constants, encoded once: packConsts[i-1] has
+  // X^i in all the "fully packed" slots, unpackConsts[i][j] is the entry
+  // (i,j) of the matrix that takes the conjugates back to the bytes
+  vector<PolyType> packConsts;
+  vector< vector<PolyType> > unpackConsts;
 
   void batchRecrypt(vector<Ctxt>& data) const; // recryption during AES computation
 
@@ -64,3 +74,87 @@ void encode4AES(Vec<ZZX>& encData, const Vec<uint8_t>& data,
 		const EncryptedArrayDerived<PA_GF2>& ea2);
 void decode4AES(Vec<uint8_t>& data, const Vec<ZZX>& encData,
 		const EncryptedArrayDerived<PA_GF2>& ea2);
+
+
+/**
+ * @class AESTranscipher
+ * @brief A pipeline that turns a stream of AES-encrypted bytes into HE
+ * ciphertexts of the plaintext bytes.
+ *
+ * The bytes are cut into batches of ctxtsPerBatch ciphertexts (encoded by
+ * encode4AES), and each batch is a job for one of nWorkers threads, each
+ * with an NTL thread pool of its own, so the rounds of several batches run
+ * at the same time. Results come out in the order of the input, either
+ * from the future of each batch or from pop().
+ *
+ * In ECB mode a batch is decrypted with homAESdec. In CTR mode the
+ * keystream AES_k(counter) is computed with homAESenc on the (public)
+ * counter blocks and the AES ciphertext is added to it as a constant,
+ * which is cheaper than decryption, and the bytes need not fill whole
+ * blocks. The counter block of block i is iv+i, as a 128-bit big-endian
+ * integer. The AES key schedule eKey is shared by all the jobs and must
+ * outlive the pipeline.
+ **/
+class AESTranscipher {
+  const HomAES& aes;
+  const vector<Ctxt>& eKey;
+  long batchBlocks;      // AES blocks in a batch
+  long threadsPerWorker;
+
+  bool ctrMode;
+  Vec<uint8_t> iv;       // the counter block of block 0
+  unsigned long nextBlock; // the block number of the next pushed byte
+  Vec<uint8_t> buffered; // pushed bytes that do not fill a batch yet
+  std::deque< std::future< vector<Ctxt> > > results; // of push, in order
+
+  std::vector<std::thread> workers;
+  std::mutex mx;
+  std::condition_variable wakeup;
+  std::deque< std::function<void()> > jobs;
+  bool stopping;
+
+  void workerLoop();
+  std::future< vector<Ctxt> > enqueue(std::function< vector<Ctxt>() > job);
+
+public:
+  AESTranscipher(const HomAES& _aes, const vector<Ctxt>& _eKey,
+                 long ctxtsPerBatch=1, long nWorkers=2,
+                 long _threadsPerWorker=1);
+
+  //! Waits for the jobs that are queued
+  ~AESTranscipher();
+
+  AESTranscipher(const AESTranscipher&) = delete;
+  AESTranscipher& operator=(const AESTranscipher&) = delete;
+
+  //! The number of bytes in a batch
+  long batchBytes() const { return batchBlocks*16; }
+
+  //! @brief Queue one batch of AES-ECB ciphertext (at most batchBytes(),
+  //! in whole blocks)
+  std::future< vector<Ctxt> > submit(const Vec<uint8_t>& aesBytes);
+
+  //! @brief Queue one batch in CTR mode, aesBytes[0] being the first byte
+  //! of block number firstBlock
+  std::future< vector<Ctxt> > submitCTR(const Vec<uint8_t>& aesBytes,
+                                        const Vec<uint8_t>& iv,
+                                        unsigned long firstBlock);
+
+  //! @brief Use CTR mode for the bytes pushed after this call, with the
+  //! next pushed byte starting block number firstBlock
+  void setCTR(const Vec<uint8_t>& _iv, unsigned long firstBlock=0);
+
+  //! @brief Append bytes to the stream, queueing a batch whenever there
+  //! are enough of them
+  void push(const Vec<uint8_t>& aesBytes);
+
+  //! Queue the bytes that are left as a last (partial) batch
+  void flush();
+
+  //! @brief Take the next result of the stream. With wait=false, return
+  //! false if it is not ready yet; otherwise false only if there is none.
+  bool pop(vector<Ctxt>& out, bool wait=true);
+
+  //! The number of results of the stream that were not popped
+  long pending() const { return results.size(); }
+};
@@ -20,10 +20,13 @@
 #include <stdexcept>
 #include <cassert>
 #include <atomic>
+#include <memory>
 #include <mutex>          // std::mutex, std::unique_lock
 
 #include <NTL/BasicThreadPool.h>
 #include "binaryArith.h"
+#include "BitSliced.h"
+#include "taskScheduler.h"
 
 #define BPL_ESTIMATE (30)
 // FIXME: this should really be dynamic
@@ -52,19 +55,20 @@ public:
 
   std::atomic_long childrenLeft; // how many children were not computed yet
   DAGnode *parent1, *parent2;
+  long depth;  // longest path from a source node, -1 if not needed
 
-  std::mutex ct_mtx; // controls access to ctxt pointer (and the ctxt itself)
-  Ctxt* ct;          // points to the actual ciphertext (or NULL)
+  Ctxt* ct;    // points to the actual ciphertext (or NULL)
 
   DAGnode(NodeIdx ii, bool qq, long lvl, long chl=0,
            DAGnode* pt1=nullptr, DAGnode* pt2=nullptr):
     idx(ii), isQ(qq), level(lvl),
-    childrenLeft(chl), parent1(pt1), parent2(pt2), ct(nullptr) {}
+    childrenLeft(chl), parent1(pt1), parent2(pt2), depth(-1), ct(nullptr) {}
 
   DAGnode(DAGnode &&other): // move constructor
     idx(other.idx), isQ(other.isQ), level(other.level),
     childrenLeft(long(other.childrenLeft)),// copy value of atomic_long
-    parent1(other.parent1), parent2(other.parent2), ct(other.ct) {}
+    parent1(other.parent1), parent2(other.parent2), depth(other.depth),
+    ct(other.ct) {}
 
   std::string nodeName() const
   { return (std::string(isQ? "Q(":"P(")
@@ -98,6 +102,12 @@ public:
  * level. In addition, we try to minimize the number of nodes in the DAG that
  * actually need to be computed while adding the two numbers (subject to still
  * consuming as few levels as possible).
+ *
+ * The DAG is evaluated one depth at a time: all the nodes whose parents
+ * are ready are computed together on the thread pool, then added to the
+ * output bits that use them, and then the ciphertexts of the nodes that
+ * have no more pending children go back to the scratch space, to be reused
+ * by the next depth.
  **/
 class AddDAG {
   std::mutex scratch_mtx;  // controls access to scratch vector
@@ -108,14 +118,16 @@ class AddDAG {
 
   Ctxt* allocateCtxtLike(const Ctxt& c); // Allocate a new ciphertext if needed
   void markAsAvailable(DAGnode* node);  // Mark temporary Ctxt object as unused
-  const Ctxt& getCtxt(DAGnode* node,    // Compute a new Ctxt if neeed
-                      const CtPtrs& a, const CtPtrs& b);
-
-  // Add to c the Ctxt from the given node
-  void addCtxtFromNode(Ctxt& c, DAGnode* node,
-                       const CtPtrs& a, const CtPtrs& b) {
-    std::unique_lock<std::mutex> lck(node->ct_mtx);
-    c += getCtxt(node, a, b);
+
+  // Count one more use of node, marking its parents as needed if this
+  // is its first use. Returns the depth of the node.
+  long addUse(DAGnode* node);
+
+  // Compute node->ct (already allocated) from its parents or the inputs
+  void computeNode(DAGnode* node, const CtPtrs& a, const CtPtrs& b);
+
+  // Count down one use of node, releasing its ciphertext after the last one
+  void releaseUse(DAGnode* node) {
     if (--(node->childrenLeft) == 0) markAsAvailable(node);
   }
 
@@ -291,88 +303,113 @@ void AddDAG::apply(CtPtrs& sum,
   for (long i=0; i<lsize(sum); i++)
     sum[i]->clear();
 
-  // Allow multi-threading in this loop
-  NTL_EXEC_RANGE(sizeLimit, first, last)
-  for (long i=first; i<last; i++) { //  for (long i=0; i<sizeLimit; i++) {
-    if (i<bSize)
-      addCtxtFromNode(*(sum[i]), this->findP(i,i), a, b);
+  // The nodes that are added to each output bit: sum[i] is p[i,i]
+  // plus all the q[i-1,j]'s
+  std::vector<std::vector<DAGnode*>> outputs(sizeLimit);
+  for (long i=0; i<sizeLimit; i++) {
+    DAGnode *node = (i<bSize)? findP(i,i) : nullptr;
+    if (node!=nullptr) outputs[i].push_back(node);
     for (long j=std::min(i-1, aSize-1); j>=0; --j) {
       DAGnode *node = this->findQ(i-1,j);
-      if (node!=nullptr) addCtxtFromNode(*(sum[i]), node, a, b);
+      if (node!=nullptr) outputs[i].push_back(node);
     }
   }
-  NTL_EXEC_RANGE_END
-}
 
-//! Get the ciphertext for a node, compiuting it as needed
-const Ctxt& AddDAG::getCtxt(DAGnode* node,
-                            const CtPtrs& a, const CtPtrs& b)
-{
-  // NOTE: node->ct_mtx should be locked before calling this function
-
-  if (node->ct == nullptr) { // ciphertext not computed yet, do it now
-    if (node->parent1!=nullptr && node->parent2!=nullptr) { // internal node
-      // Obtain locks and ciphertexts for both parents. Also reduce the
-      // number of children of that parents that still need to be computed
-      std::unique_lock<std::mutex> pt1_lck(node->parent1->ct_mtx);
-      const Ctxt& c1 = getCtxt(node->parent1, a, b);
-      long n1 = --(node->parent1->childrenLeft);
-
-      std::unique_lock<std::mutex> pt2_lck(node->parent2->ct_mtx);
-      const Ctxt& c2 = getCtxt(node->parent2, a, b);
-      long n2 = --(node->parent2->childrenLeft);
-
-      if (n1==0) {              // reuse space from parent1
-        node->parent1->ct = nullptr;
-        node->ct = (Ctxt*) &c1;
-        if (c1.isEmpty() || c2.isEmpty())
-             node->ct->clear(); // ct is zero if any of the parents is
-	else node->ct->multiplyBy(c2);
-        if (n2==0)
-          markAsAvailable(node->parent2);
-      }
-      else if (n2==0) {         // reuse space from parent2
-        node->parent2->ct = nullptr;
-        node->ct = (Ctxt*) &c2;
-        if (c1.isEmpty() || c2.isEmpty())
-             node->ct->clear(); // ct is zero if any of the parents is
-	else node->ct->multiplyBy(c1);
-      }
-      else {                    // allocate new space
-        node->ct = allocateCtxtLike(c2);
-        if (c1.isEmpty() || c2.isEmpty())
-          node->ct->clear();    // ct is zero if any of the parents is
-        else {
-          *(node->ct) = c2;
-          node->ct->multiplyBy(c1);
+  // Count the uses of every node from these outputs (recomputing the counts
+  // of init, since with sizeLimit some nodes may not be needed at all),
+  // and sort the needed nodes by their depth
+  for (auto& it: p) { it.second.childrenLeft = 0; it.second.depth = -1; }
+  for (auto& it: q) { it.second.childrenLeft = 0; it.second.depth = -1; }
+  std::vector<std::vector<DAGnode*>> byDepth;
+  for (long i=0; i<sizeLimit; i++)
+    for (DAGnode* node: outputs[i]) addUse(node);
+  for (auto* nodes: {&p, &q})
+    for (auto& it: *nodes) {
+      DAGnode* node = &(it.second);
+      if (node->depth < 0) continue; // not needed
+      if (lsize(byDepth) <= node->depth) byDepth.resize(node->depth+1);
+      byDepth[node->depth].push_back(node);
+    }
+
+  for (long d=0; d<lsize(byDepth); d++) {
+    std::vector<DAGnode*>& level = byDepth[d];
+    long n = lsize(level);
+
+    // Allocate serially, the scratch vector is not safe to scan while it grows
+    const Ctxt* ct_ptr = b.ptr2nonNull();
+    assert(ct_ptr != nullptr);
+    for (DAGnode* node: level) node->ct = allocateCtxtLike(*ct_ptr);
+
+    // All the nodes of this depth are independent of each other. With
+    // fewer nodes than threads, each multiplication uses the threads itself.
+    if (n>1 && n>=fheAvailableThreads()) {
+      FHE_EXEC_RANGE(n, first, last)
+      for (long k=first; k<last; k++) computeNode(level[k], a, b);
+      FHE_EXEC_RANGE_END
+    }
+    else
+      for (DAGnode* node: level) computeNode(node, a, b);
+
+    // Add the new nodes to the output bits, then release the parents
+    for (long i=0; i<sizeLimit; i++)
+      for (DAGnode* node: outputs[i])
+        if (node->depth == d) {
+          *(sum[i]) += *(node->ct);
+          releaseUse(node);
         }
+    for (DAGnode* node: level)
+      if (node->parent1!=nullptr && node->parent2!=nullptr) {
+        releaseUse(node->parent1);
+        releaseUse(node->parent2);
       }
+  }
+}
+
+long AddDAG::addUse(DAGnode* node)
+{
+  if ((node->childrenLeft)++ == 0) { // first use, so the node is needed
+    if (node->parent1!=nullptr && node->parent2!=nullptr)
+      node->depth = 1 + std::max(addUse(node->parent1),
+                                 addUse(node->parent2));
+    else
+      node->depth = 0;
+  }
+  return node->depth;
+}
+
+//! Compute the ciphertext for a node, its parents must be ready
+void AddDAG::computeNode(DAGnode* node, const CtPtrs& a, const CtPtrs& b)
+{
+  if (node->parent1!=nullptr && node->parent2!=nullptr) { // internal node
+    const Ctxt& c1 = *(node->parent1->ct);
+    const Ctxt& c2 = *(node->parent2->ct);
+    if (c1.isEmpty() || c2.isEmpty())
+      node->ct->clear();    // ct is zero if any of the parents is
+    else {
+      *(node->ct) = c2;
+      node->ct->multiplyBy(c1);
     }
-    else { // no parents, either a[i]+b[i] or a[i]*b[i]
-      long i = node->idx.first;
-      long j = node->idx.second; // we expect i==j
-      const Ctxt* ct_ptr = b.ptr2nonNull();
-      assert(ct_ptr != nullptr);
-      node->ct = allocateCtxtLike(*ct_ptr);
-
-      if (node->isQ) { // This is b[i]*a[j]
-        if (b.isSet(i) && !(b[i]->isEmpty())
-            && a.isSet(j) && !(a[j]->isEmpty())) {
-          *(node->ct) = *(b[i]);
-          node->ct->multiplyBy(*(a[j]));
-        } // if a[j] or b[i] is empty then node->ct is a zero ciphertext
-	else node->ct->clear();
-      }
-      else {           // This is b[i]+a[i]
-        if (!b.isSet(i) || b[i]->isEmpty())
-	     node->ct->clear();
-        else *(node->ct) = *(b[i]);
-        if (a.isSet(j) && !(a[j]->isEmpty()))
-          *(node->ct) += *(a[j]);
-      }
-    } // end of no-parents case
   }
-  return *(node->ct);
+  else { // no parents, either a[i]+b[i] or a[i]*b[i]
+    long i = node->idx.first;
+    long j = node->idx.second; // we expect i==j
+
+    if (node->isQ) { // This is b[i]*a[j]
+      if (b.isSet(i) && !(b[i]->isEmpty())
+          && a.isSet(j) && !(a[j]->isEmpty())) {
+        *(node->ct) = *(b[i]);
+        node->ct->multiplyBy(*(a[j]));
+      } // if a[j] or b[i] is empty then node->ct is a zero ciphertext
+      else node->ct->clear();
+    }
+    else {           // This is b[i]+a[i]
+      if (!b.isSet(i) || b[i]->isEmpty())
+        node->ct->clear();
+      else *(node->ct) = *(b[i]);
+      if (a.isSet(j) && !(a[j]->isEmpty()))
+        *(node->ct) += *(a[j]);
+    }
+  } // end of no-parents case
 }
 
 
@@ -400,7 +437,6 @@ Ctxt* AddDAG::allocateCtxtLike(const Ctxt& c)
 // object then the object is unused.
 void AddDAG::markAsAvailable(DAGnode* node)
 {
-  // NOTE: node->ct_mtx should be locked before calling this function
   // NOTE: somewhat inefficient, use linear search for the raw pointer
   for (long i=0; i<(long)scratch.size(); i++)
     if (scratch[i].ct.get()==node->ct)
@@ -435,9 +471,71 @@ void packedRecrypt(const CtPtrs& a, const CtPtrs& b,
   packedRecrypt(ab, *unpackSlotEncoding, *(ct->getContext().ea));
 }
 
+long RecryptPolicy::capacityFor(const Ctxt& ct, long depth) const
+{
+  return (depth + margin) * ct.getContext().BPL();
+}
+
+// Recrypt the given ciphertexts in a single packedRecrypt. Returns how
+// many were recrypted, zero if we cannot bootstrap.
+long RecryptPolicy::recrypt(std::vector<Ctxt*>& cts) const
+{
+  if (cts.empty() || !canRecrypt(*cts[0])) return 0;
+  std::sort(cts.begin(), cts.end()); // the same number may appear twice
+  cts.erase(std::unique(cts.begin(), cts.end()), cts.end());
+  CtPtrs_vectorPt ptrs(cts);
+  packedRecrypt(ptrs, *unpack, *(cts[0]->getContext().ea));
+  return lsize(cts);
+}
+
+long RecryptPolicy::ensureCapacity(const std::vector<const CtPtrs*>& nums,
+                                   const std::vector<long>& depths,
+                                   long ahead) const
+{
+  FHE_TIMER_START;
+  assert(lsize(depths)==lsize(nums));
+  bool needed = false;
+  std::vector<Ctxt*> batch;
+  for (long k=0; k<lsize(nums); k++) {
+    const CtPtrs& v = *nums[k];
+    for (long i=0; i<lsize(v); i++) {
+      if (!v.isSet(i) || v[i]->isEmpty()) continue;
+      long cap = v[i]->bitCapacity();
+      if (cap < capacityFor(*v[i], depths[k])) needed = true;
+      if (cap < capacityFor(*v[i], depths[k]+ahead)) batch.push_back(v[i]);
+    }
+  }
+  if (!needed) return 0;
+  return recrypt(batch);
+}
+
+long RecryptPolicy::ensureCapacity(std::initializer_list<const CtPtrs*> nums,
+                                   long depth, long ahead) const
+{
+  std::vector<const CtPtrs*> v(nums);
+  return ensureCapacity(v, std::vector<long>(v.size(), depth), ahead);
+}
+
+long RecryptPolicy::ensureCapacity(const CtPtrMat& m, long depth,
+                                   long ahead) const
+{
+  std::vector<const CtPtrs*> v(lsize(m));
+  for (long i=0; i<lsize(m); i++) v[i] = &m[i];
+  return ensureCapacity(v, std::vector<long>(v.size(), depth), ahead);
+}
+
+long RecryptPolicy::recryptAll(std::initializer_list<const CtPtrs*> nums) const
+{
+  std::vector<Ctxt*> batch;
+  for (const CtPtrs* v: nums)
+    for (long i=0; i<lsize(*v); i++)
+      if (v->isSet(i) && !(*v)[i]->isEmpty()) batch.push_back((*v)[i]);
+  return recrypt(batch);
+}
+
 //! Add two integers in binary representation
 void addTwoNumbers(CtPtrs& sum, const CtPtrs& a, const CtPtrs& b,
-                   long sizeLimit, std::vector<zzX>* unpackSlotEncoding)
+                   long sizeLimit, const RecryptPolicy& policy)
 {
   FHE_TIMER_START;
   if (lsize(a)<1)      { vecCopy(sum,b,sizeLimit); return; }
@@ -450,11 +548,17 @@ void addTwoNumbers(CtPtrs& sum, const CtPtrs& a, const CtPtrs& b,
   addPlan.printAddDAG();
 #endif
 
-  // Ensure that we have enough levels to compute everything,
-  // bootstrap otherwise
+  // Ensure that we have enough levels to compute everything, bootstrap
+  // otherwise. Only the bits without room for the depth of the DAG are
+  // recrypted, and all of them if that turns out not to be enough.
   if (addPlan.lowLvl()< BPL_ESTIMATE) {
-    packedRecrypt(a,b,unpackSlotEncoding);
-    addPlan.init(a,b); // Re-compute the DAG
+    long depth = NTL::NumBits(std::max(lsize(a),lsize(b))) +1;
+    if (policy.ensureCapacity({&a,&b}, depth) > 0)
+      addPlan.init(a,b); // Re-compute the DAG
+    if (addPlan.lowLvl()< BPL_ESTIMATE) {
+      policy.recryptAll({&a,&b});
+      addPlan.init(a,b);
+    }
     if (addPlan.lowLvl()<BPL_ESTIMATE) { // still not enough levels
       throw std::logic_error("not enough levels for addition DAG");
     }
@@ -549,45 +653,44 @@ static long three4Two(Ctxt* lsb, Ctxt* msb, Ctxt* u, Ctxt* v, Ctxt* w)
 // Apply the 3-for-2 routine to integers (i.e., an array of bits). The
 // inputs need not be of the same size, and size of the output x is
 // equal to the largest of them, and the size of the output y is one
-// larger. This is safe even when the outputs alias some of the inputs
-static void three4Two(CtPtrs& lsb, CtPtrs& msb,
-                      const CtPtrs& u, const CtPtrs& v, const CtPtrs& w,
-                      long sizeLimit)
-{
-  FHE_TIMER_START;
-  // Arrange u,v,w by size from smallest to largest
-  const CtPtrs *p1, *p2, *p3;
-  std::tie(p1,p2,p3) = orderBySize(u,v,w); // size(p3)>=size(p2)>=size(p1)
-
-  if (p3->size() <= 0) { // empty input
-    setLengthZero(lsb);
-    setLengthZero(msb);
-    return;
-  }
-  if (p1->size()<=0) { // two or less inputs
-    std::vector<Ctxt> tmp;
-    vecCopy(tmp,*p2,sizeLimit); // just in case p2, msb share pointers
-    vecCopy(msb,*p3,sizeLimit);
-    vecCopy(lsb,tmp);
-    return;
-  }
-  if (sizeLimit==0) sizeLimit = p3->size()+1;
-
-  // Allocate space in the output vectors
-
-  const Ctxt* ctptr = p3->ptr2nonNull();
+// larger. This is safe even when the outputs alias some of the inputs.
+//
+// The work is split so that the bits of several of these can be computed
+// together: the constructor allocates temporary outputs, computeBit(i)
+// can then be called (from any thread) for all i<nBits(), and finish()
+// copies the result to the output vectors.
+class Three4TwoJob {
+  const CtPtrs *p1, *p2, *p3; // size(p3)>=size(p2)>=size(p1)
   std::vector<Ctxt> tmpMsb, tmpLsb;
+  long lsbSize, msbSize;
+  bool trivial;               // less than three inputs (or empty)
+  long sizeLimit;
 
-  long lsbSize = std::min(sizeLimit, lsize(*p3));
-  long msbSize = lsbSize;
-  if (lsize(*p2)==lsize(*p3) && lsbSize<sizeLimit)
-    msbSize++;                  // possible carry out of last position
+public:
+  Three4TwoJob(const CtPtrs& u, const CtPtrs& v, const CtPtrs& w,
+               long _sizeLimit): lsbSize(0), msbSize(0), sizeLimit(_sizeLimit)
+  {
+    // Arrange u,v,w by size from smallest to largest
+    std::tie(p1,p2,p3) = orderBySize(u,v,w);
+    trivial = (p3->size() <= 0 || p1->size() <= 0);
+    if (trivial) return;
+    if (sizeLimit==0) sizeLimit = p3->size()+1;
+
+    // Allocate space in the output vectors
+    const Ctxt* ctptr = p3->ptr2nonNull();
+    lsbSize = std::min(sizeLimit, lsize(*p3));
+    msbSize = lsbSize;
+    if (lsize(*p2)==lsize(*p3) && lsbSize<sizeLimit)
+      msbSize++;                  // possible carry out of last position
+
+    resize(tmpLsb, lsbSize, Ctxt(ZeroCtxtLike,*ctptr));
+    resize(tmpMsb, msbSize, Ctxt(ZeroCtxtLike,*ctptr));
+  }
 
-  resize(tmpLsb, lsbSize, Ctxt(ZeroCtxtLike,*ctptr));
-  resize(tmpMsb, msbSize, Ctxt(ZeroCtxtLike,*ctptr));
+  long nBits() const { return trivial? 0 : msbSize-1; }
 
-  NTL_EXEC_RANGE(msbSize-1, first, last)
-  for (long i=first; i<last; i++) {
+  void computeBit(long i)
+  {
     if (i<lsize(*p1))
       three4Two(&tmpLsb[i], &tmpMsb[i+1], (*p1)[i], (*p2)[i], (*p3)[i]);
     else if (i<lsize(*p2)) {
@@ -595,32 +698,49 @@ static void three4Two(CtPtrs& lsb, CtPtrs& msb,
     }
     else if (p3->isSet(i)) tmpLsb[i] = *((*p3)[i]);
   }
-  NTL_EXEC_RANGE_END
 
-  if (msbSize==lsbSize) { // we only computed upto lsbSize-1, do the last LSB
-    if (p1->isSet(lsbSize-1)) tmpLsb[lsbSize-1] =  *((*p1)[lsbSize-1]);
-    if (p2->isSet(lsbSize-1)) tmpLsb[lsbSize-1] += *((*p2)[lsbSize-1]);
-    if (p3->isSet(lsbSize-1)) tmpLsb[lsbSize-1] += *((*p3)[lsbSize-1]);
+  void finish(CtPtrs& lsb, CtPtrs& msb)
+  {
+    if (p3->size() <= 0) { // empty input
+      setLengthZero(lsb);
+      setLengthZero(msb);
+      return;
+    }
+    if (p1->size()<=0) { // two or less inputs
+      std::vector<Ctxt> tmp;
+      vecCopy(tmp,*p2,sizeLimit); // just in case p2, msb share pointers
+      vecCopy(msb,*p3,sizeLimit);
+      vecCopy(lsb,std::move(tmp));
+      return;
+    }
+    if (msbSize==lsbSize) { // we only computed upto lsbSize-1, do the last LSB
+      if (p1->isSet(lsbSize-1)) tmpLsb[lsbSize-1] =  *((*p1)[lsbSize-1]);
+      if (p2->isSet(lsbSize-1)) tmpLsb[lsbSize-1] += *((*p2)[lsbSize-1]);
+      if (p3->isSet(lsbSize-1)) tmpLsb[lsbSize-1] += *((*p3)[lsbSize-1]);
+    }
+    vecCopy(lsb, std::move(tmpLsb));
+    vecCopy(msb, std::move(tmpMsb));
   }
-  vecCopy(lsb, tmpLsb);
-  vecCopy(msb, tmpMsb);
-}
-
-//! @brief An implementation of PtrMatrix using vector< PtrVector<T>* >
-template<typename T>
-struct PtrMatrix_PtPtrVector : PtrMatrix<T> {
-  std::vector< PtrVector<T>* >& rows;
-  PtrMatrix_PtPtrVector(std::vector< PtrVector<T>* >& mat): rows(mat) {}
-  PtrVector<T>& operator[](long i) override             // returns a row
-  { return *rows[i]; }
-  const PtrVector<T>& operator[](long i) const override // returns a row
-  { return *rows[i]; }
-  long size() const override { return lsize(rows); }    // How many rows
 };
 
+static void three4Two(CtPtrs& lsb, CtPtrs& msb,
+                      const CtPtrs& u, const CtPtrs& v, const CtPtrs& w,
+                      long sizeLimit)
+{
+  FHE_TIMER_START;
+  Three4TwoJob job(u, v, w, sizeLimit);
+
+  FHE_EXEC_RANGE(job.nBits(), first, last)
+  for (long i=first; i<last; i++)
+    job.computeBit(i);
+  FHE_EXEC_RANGE_END
+
+  job.finish(lsb, msb);
+}
+
 // Calculates the sum of many numbers using the 3-for-2 method
 void addManyNumbers(CtPtrs& sum, CtPtrMat& numbers, long sizeLimit,
-                    std::vector<zzX>* unpackSlotEncoding)
+                    const RecryptPolicy& policy)
 {
 #ifdef DEBUG_PRINTOUT
   cout << " addManyNumbers: "<<numbers.size()
@@ -634,8 +754,10 @@ void addManyNumbers(CtPtrs& sum, CtPtrMat& numbers, long sizeLimit,
   }
   if (lsize(numbers)==1) { vecCopy(sum, numbers[0]); return; }
 
-  bool bootstrappable = ct_ptr->getPubKey().isBootstrappable();
-  const EncryptedArray& ea = *(ct_ptr->getContext().ea);
+  long maxSize = 0; // the depth of the final adder depends on the width
+  for (long i=0; i<lsize(numbers); i++)
+    maxSize = std::max(maxSize, lsize(numbers[i]));
+  if (sizeLimit>0) maxSize = std::min(maxSize, sizeLimit);
 
   long leftInQ = lsize(numbers);
   std::vector<CtPtrs*> numPtrs(leftInQ);
@@ -643,43 +765,70 @@ void addManyNumbers(CtPtrs& sum, CtPtrMat& numbers, long sizeLimit,
 
   // use 3-for-2 repeatedly until only two numbers are leff to add
   while (leftInQ>2) {
-    // If any number is too low level, then bootstrap everything
+    // If any number is too low level for this round, then bootstrap it,
+    // together with those that would run out before the final addition
     PtrMatrix_PtPtrVector<Ctxt> wrapper(numPtrs);
-    if (findMinBitCapacity(wrapper)<3*ct_ptr->getContext().BPL()) {
-      assert(bootstrappable && unpackSlotEncoding!=nullptr);
-      packedRecrypt(wrapper, *unpackSlotEncoding, ea, /*belowLvl=*/10);
-    }
+    long roundsLeft = 0;
+    for (long n=leftInQ; n>2; n -= n/3) roundsLeft++;
+    policy.ensureCapacity(wrapper, /*depth=*/2,
+                          /*ahead=*/(roundsLeft-1)*2 + NTL::NumBits(maxSize));
+    // Group numbers of similar width and capacity in the same triple, so
+    // that no triple is much wider than the others, and a noisy number does
+    // not drag down the capacity of two fresh ones. The narrowest numbers
+    // are the leftovers that are just passed on to the next round.
+    std::vector<std::pair<long,long>> keys(leftInQ); // (size, capacity)
+    for (long i=0; i<leftInQ; i++)
+      keys[i] = std::make_pair(lsize(*numPtrs[i]),
+                               findMinBitCapacity(*numPtrs[i]));
+    std::vector<long> order(leftInQ);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&keys](long i, long j) { return keys[i] > keys[j]; });
+
     // Prepare a vector for pointers to the output of this iteration
     long nTriples = leftInQ/3;
     long leftOver = leftInQ - (3*nTriples);
     std::vector<CtPtrs*> numPtrs2(2*nTriples +leftOver);
 
     if (leftOver>0) { // copy the leftover pointers
-      numPtrs2[0] = numPtrs[3*nTriples];
-      if (leftOver>1) numPtrs2[1] = numPtrs[3*nTriples +1];
+      numPtrs2[0] = numPtrs[order[3*nTriples]];
+      if (leftOver>1) numPtrs2[1] = numPtrs[order[3*nTriples +1]];
     }
-    // Allow multi-threading in this loop
-    //    NTL_EXEC_RANGE(nTriples, first, last)
-    //    for (long i=first; i<last; i++) {   // call the three-for-two procedure
-    for (long i=0; i<nTriples; i++) {   // call the three-for-two procedure
-      three4Two(*numPtrs[3*i], *numPtrs[3*i+1], // three4Two works in-place
-                *numPtrs[3*i], *numPtrs[3*i+1], *numPtrs[3*i+2], sizeLimit);
-
-      numPtrs2[leftOver +2*i]    = numPtrs[3*i]; // copy the output pointers
-      numPtrs2[leftOver +2*i +1] = numPtrs[3*i +1];
+
+    // Put the bits of all the triples in one work list, so the threads are
+    // balanced however many triples there are and whatever their widths
+    std::vector<std::unique_ptr<Three4TwoJob>> jobs(nTriples);
+    std::vector<std::pair<long,long>> work; // (triple, bit)
+    for (long i=0; i<nTriples; i++) {
+      jobs[i].reset(new Three4TwoJob(*numPtrs[order[3*i]],
+                                     *numPtrs[order[3*i+1]],
+                                     *numPtrs[order[3*i+2]], sizeLimit));
+      for (long j=0; j<jobs[i]->nBits(); j++)
+        work.push_back(std::make_pair(i,j));
+    }
+    FHE_EXEC_RANGE(lsize(work), first, last)
+    for (long k=first; k<last; k++)
+      jobs[work[k].first]->computeBit(work[k].second);
+    FHE_EXEC_RANGE_END
+
+    for (long i=0; i<nTriples; i++) {   // three4Two works in-place
+      CtPtrs* out1 = numPtrs[order[3*i]];
+      CtPtrs* out2 = numPtrs[order[3*i +1]];
+      jobs[i]->finish(*out1, *out2);
+      numPtrs2[leftOver +2*i]    = out1; // copy the output pointers
+      numPtrs2[leftOver +2*i +1] = out2;
     }
-    //    NTL_EXEC_RANGE_END
     numPtrs.swap(numPtrs2);   // swap input/output vectors
     leftInQ = lsize(numPtrs); // update the size
   }
   // final addition
-  addTwoNumbers(sum, *numPtrs[0], *numPtrs[1], sizeLimit, unpackSlotEncoding);
+  addTwoNumbers(sum, *numPtrs[0], *numPtrs[1], sizeLimit, policy);
 }
 
 
 // Multiply a positive a by a potentially negative b, we need to sign-extend b
 static void multByNegative(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
-                           long sizeLimit,std::vector<zzX>* unpackSlotEncoding)
+                           long sizeLimit,const RecryptPolicy& policy)
 {
   FHE_TIMER_START;
   long resSize = lsize(a)+lsize(b);
@@ -698,13 +847,13 @@ static void multByNegative(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
     }
   long nPairs = lsize(pairs);
 
-  NTL_EXEC_RANGE(nPairs, first, last)
+  FHE_EXEC_RANGE(nPairs, first, last)
   for (long idx=first; idx<last; idx++) {
     long i,j; std::tie(i,j) = pairs[idx];
     numbers[i][j] = *(b[j-i]);
     numbers[i][j].multiplyBy(*(a[i]));   // multiply by the bit of a
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 
   // sign extension
   for (long i=0; i<nNums; i++) for (long j=i+lsize(b); j<resSize; j++) {
@@ -720,15 +869,21 @@ static void multByNegative(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
   decryptAndSum((cout<<" multByNegative: "<<pa<<'*'<<pb<<" = "),
                 nums, true);
 #endif
-  addManyNumbers(product, nums, resSize, unpackSlotEncoding);
+  addManyNumbers(product, nums, resSize, policy);
 }
 
 // Multiply two integers (i.e. an array of bits) a, b.
 // Computes the pairwise products x_{i,j} = a_i * b_j
 // then sums the prodcuts using the 3-for-2 method.
+static void daddaMult(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
+                      long resSize, const RecryptPolicy& policy);
+static void karatsubaMult(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
+                          long resSize, const RecryptPolicy& policy);
+
 void multTwoNumbers(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
                     bool bNegative, long sizeLimit,
-                    std::vector<zzX>* unpackSlotEncoding)
+                    const RecryptPolicy& policy,
+                    MultStrategy strategy)
 {
   FHE_TIMER_START;
   long aSize = lsize(a);
@@ -757,7 +912,7 @@ void multTwoNumbers(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
     return;
   }
   if (bNegative) { // somewhat different implementation for 2s complement
-    multByNegative(product, a, b, sizeLimit, unpackSlotEncoding);
+    multByNegative(product, a, b, sizeLimit, policy);
     return;
   }
   if (bSize==1) {
@@ -766,8 +921,8 @@ void multTwoNumbers(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
       return;
     }
     vecCopy(product,a,resSize);
-    for (long i=0; i<resSize; i++)
-      a[i]->multiplyBy(*(b[0]));
+    for (long i=0; i<lsize(product); i++)
+      product[i]->multiplyBy(*(b[0]));
     return;
   }
 
@@ -778,38 +933,448 @@ void multTwoNumbers(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
   aSize = lsize(aa);
   bSize = lsize(bb);
 
-  NTL::Vec< NTL::Vec<Ctxt> > numbers(INIT_SIZE, std::min(lsize(b),resSize));
+  if (strategy==MULT_DADDA) {
+    daddaMult(product, aa, bb, resSize, policy);
+    return;
+  }
+  if (strategy==MULT_KARATSUBA) {
+    karatsubaMult(product, aa, bb, resSize, policy);
+    return;
+  }
+
+  // Bootstrapping the inputs is cheaper than bootstrapping all the partial
+  // products, so make sure they have room for the products and one round
+  policy.ensureCapacity({&a,&b}, /*depth=*/3);
+
   const Ctxt* ct_ptr = a.ptr2nonNull();
-  long nNums = lsize(numbers);
+  long nNums = std::min(lsize(b),resSize);
+  BitSlicedMat numbers(*ct_ptr, nNums, resSize);
   for (long i=0; i<nNums; i++)
-    numbers[i].SetLength(std::min((i+aSize),resSize),
-                         Ctxt( ZeroCtxtLike,*ct_ptr ) );
+    numbers[i].resize(std::min((i+aSize),resSize)); // empty bits
   std::vector<std::pair<long,long> > pairs;
   for (long i=0; i<nNums; i++) for (long j=i; j<lsize(numbers[i]); j++) {
     if (a.isSet(j-i)&& !(a[j-i]->isEmpty())&& b.isSet(i)&& !(b[i]->isEmpty()))
       pairs.push_back(std::pair<long,long>(i,j));
   }
   long nPairs = lsize(pairs);
-  NTL_EXEC_RANGE(nPairs, first, last)
+  FHE_EXEC_RANGE(nPairs, first, last)
   for (long idx=first; idx<last; idx++) {
     long i,j; std::tie(i,j) = pairs[idx];
-    numbers[i][j] = *(a[j-i]);
-    numbers[i][j].multiplyBy(*(b[i])); // multiply by the bit of b
+    Ctxt& bit = numbers[i].bit(j);
+    bit = *(a[j-i]);
+    bit.multiplyBy(*(b[i])); // multiply by the bit of b
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 
-  CtPtrMat_VecCt nums(numbers); // A wrapper aroune numbers
 #ifdef DEBUG_PRINTOUT
   long pa, pb;
   vector<long> slots;
   decryptBinaryNums(slots, a, *dbgKey, *dbgEa, false); pa=slots[0];
   decryptBinaryNums(slots, b, *dbgKey, *dbgEa, false);  pb=slots[0];
   decryptAndSum((cout<<" multTwoNumbers: "<<pa<<'*'<<pb<<" = "),
-                nums, false);
+                numbers, false);
 #endif
-  addManyNumbers(product, nums, resSize, unpackSlotEncoding);
+  addManyNumbers(product, numbers, resSize, policy);
+}
+
+// A Dadda tree: the partial-product bits a[j]*b[i] are kept in columns by
+// their weight i+j, and each stage uses full- and half-adders to bring all
+// the columns down to the next height in Dadda's sequence 2,3,4,6,9,...,
+// until two numbers are left for addTwoNumbers. All the adders of a stage
+// are independent, so they are computed together on the thread pool.
+static void daddaMult(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
+                      long resSize, const RecryptPolicy& policy)
+{
+  FHE_TIMER_START;
+  const Ctxt* ct_ptr = a.ptr2nonNull();
+  const Ctxt zeroCtxt(ZeroCtxtLike, *ct_ptr);
+
+  // As in the 3-for-2 method, recrypt the inputs rather than the products
+  policy.ensureCapacity({&a,&b}, /*depth=*/3);
+
+  // Compute the partial products, by column
+  std::vector< std::vector<Ctxt> > cols(resSize);
+  std::vector< std::tuple<long,long,long> > pairs; // (i, j, place in column)
+  for (long i=0; i<lsize(b); i++) {
+    if (!b.isSet(i) || b[i]->isEmpty()) continue;
+    for (long j=0; j<lsize(a) && i+j<resSize; j++)
+      if (a.isSet(j) && !(a[j]->isEmpty())) {
+        pairs.push_back(std::make_tuple(i, j, lsize(cols[i+j])));
+        cols[i+j].push_back(zeroCtxt);
+      }
+  }
+  FHE_EXEC_RANGE(lsize(pairs), first, last)
+  for (long idx=first; idx<last; idx++) {
+    long i, j, k; std::tie(i,j,k) = pairs[idx];
+    cols[i+j][k] = *(a[j]);
+    cols[i+j][k].multiplyBy(*(b[i])); // multiply by the bit of b
+  }
+  FHE_EXEC_RANGE_END
+
+  long maxHeight = 0;
+  for (auto& col: cols) maxHeight = std::max(maxHeight, lsize(col));
+  std::vector<long> heights(1, 2); // Dadda's sequence, up to maxHeight
+  while (heights.back() < maxHeight) heights.push_back((heights.back()*3)/2);
+  heights.pop_back();
+
+  struct Adder {
+    long col, in[3], nIn;
+    bool needCarry; // false if the carry is beyond resSize
+  };
+  for (long stage=lsize(heights)-1; stage>=0; ) {
+    long target = heights[stage];
+
+    // If any bit is too low level for this stage, then bootstrap it,
+    // together with those that would run out before the final addition
+    std::vector<Ctxt*> allBits;
+    for (auto& col: cols) for (Ctxt& c: col) allBits.push_back(&c);
+    CtPtrs_vectorPt wrapper(allBits);
+    policy.ensureCapacity({&wrapper}, /*depth=*/2,
+                          /*ahead=*/stage*2 + NTL::NumBits(resSize));
+
+    // Plan the adders of this stage. The adders of each column take its
+    // bits with the most capacity first, and the noisiest bits are left
+    // for the next stages, to keep the depth of the tree low.
+    std::vector<Adder> adders;
+    std::vector< std::vector<long> > order(resSize);
+    std::vector<long> used(resSize, 0), carries(resSize+1, 0);
+    for (long c=0; c<resSize; c++) {
+      order[c].resize(lsize(cols[c]));
+      std::iota(order[c].begin(), order[c].end(), 0);
+      std::vector<long> cap(lsize(cols[c]));
+      for (long k=0; k<lsize(cols[c]); k++) cap[k] = cols[c][k].bitCapacity();
+      std::stable_sort(order[c].begin(), order[c].end(),
+                       [&cap](long x, long y) { return cap[x] > cap[y]; });
+
+      long height = lsize(cols[c]) + carries[c];
+      while (height > target && used[c]+2 <= lsize(cols[c])) {
+        Adder ad;
+        ad.col = c;
+        ad.nIn = (height > target+1 && used[c]+3 <= lsize(cols[c]))? 3 : 2;
+        for (long t=0; t<ad.nIn; t++) ad.in[t] = order[c][used[c]++];
+        ad.needCarry = (c+1 < resSize);
+        if (ad.needCarry) carries[c+1]++;
+        height -= ad.nIn-1;
+        adders.push_back(ad);
+      }
+    }
+
+    std::vector<Ctxt> sums(lsize(adders), zeroCtxt);
+    std::vector<Ctxt> carryBits(lsize(adders), zeroCtxt);
+    FHE_EXEC_RANGE(lsize(adders), first, last)
+    for (long k=first; k<last; k++) {
+      const Adder& ad = adders[k];
+      std::vector<Ctxt>& col = cols[ad.col];
+      Ctxt* w = (ad.nIn>2)? &col[ad.in[2]] : nullptr;
+      if (ad.needCarry)
+        three4Two(&sums[k], &carryBits[k], &col[ad.in[0]], &col[ad.in[1]], w);
+      else { // only the sum bit is needed
+        sums[k] = col[ad.in[0]];
+        sums[k] += col[ad.in[1]];
+        if (w!=nullptr) sums[k] += *w;
+      }
+    }
+    FHE_EXEC_RANGE_END
+
+    // The next columns: the unused bits, the sums and the carries
+    std::vector< std::vector<Ctxt> > newCols(resSize);
+    for (long c=0; c<resSize; c++)
+      for (long k=used[c]; k<lsize(cols[c]); k++)
+        newCols[c].push_back(std::move(cols[c][order[c][k]]));
+    for (long k=0; k<lsize(adders); k++) {
+      long c = adders[k].col;
+      if (!sums[k].isEmpty()) newCols[c].push_back(std::move(sums[k]));
+      if (adders[k].needCarry && !carryBits[k].isEmpty())
+        newCols[c+1].push_back(std::move(carryBits[k]));
+    }
+    cols.swap(newCols);
+
+    maxHeight = 0;
+    for (auto& col: cols) maxHeight = std::max(maxHeight, lsize(col));
+    if (stage>0 || maxHeight<=2) stage--; // repeat the last stage if needed
+  }
+
+  // At most two bits are left in each column, add the two numbers
+  std::vector<Ctxt> row0(resSize, zeroCtxt), row1(resSize, zeroCtxt);
+  for (long c=0; c<resSize; c++) {
+    if (lsize(cols[c])>0) row0[c] = cols[c][0];
+    if (lsize(cols[c])>1) row1[c] = cols[c][1];
+  }
+  addTwoNumbers(product, CtPtrs_vectorCt(row0), CtPtrs_vectorCt(row1),
+                resSize, policy);
+}
+
+// Below this many bits, karatsubaMult uses the 3-for-2 method directly
+static const long karatsubaCutoff = 8;
+
+// Karatsuba: with a = a1*2^h + a0 and b = b1*2^h + b0, we have
+//   a*b = z0 + (P - z0 - z2)*2^h + z2*2^{2h},
+// where z0=a0*b0, z2=a1*b1 and P=(a0+a1)*(b0+b1), so only three products
+// of half the size are needed. The negations are computed mod 2^{resSize-h}
+// as -x = ~x + 1, and the five terms are added using addManyNumbers.
+// Expects lsize(a) >= lsize(b).
+static void karatsubaMult(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
+                          long resSize, const RecryptPolicy& policy)
+{
+  FHE_TIMER_START;
+  long aSize = lsize(a);
+  long bSize = lsize(b);
+  long h = (aSize+1)/2;
+  if (bSize < karatsubaCutoff || bSize <= h) { // small or unbalanced
+    multTwoNumbers(product, a, b, /*bNegative=*/false, resSize,
+                   policy, MULT_3FOR2);
+    return;
+  }
+  CtPtrs_slice a0(a, 0, h), a1(a, h);
+  CtPtrs_slice b0(b, 0, h), b1(b, h);
+  if (resSize <= h) { // only the bottom halves matter
+    multTwoNumbers(product, a0, b0, /*bNegative=*/false, resSize,
+                   policy, MULT_KARATSUBA);
+    return;
+  }
+  long wdth = resSize - h; // the width of the middle term
+
+  const Ctxt zeroCtxt(ZeroCtxtLike, *(a.ptr2nonNull()));
+  BitSliced z0(zeroCtxt, 2*h), z2(zeroCtxt, wdth), sa(zeroCtxt, h+1),
+    sb(zeroCtxt, h+1), pp(zeroCtxt, wdth);
+  multTwoNumbers(z0, a0, b0, /*bNegative=*/false, std::min(2*h, resSize),
+                 policy, MULT_KARATSUBA);
+  multTwoNumbers(z2, a1, b1, /*bNegative=*/false, wdth, // needed mod 2^wdth
+                 policy, MULT_KARATSUBA);
+  addTwoNumbers(sa, a0, a1, std::min(h+1, wdth), policy);
+  addTwoNumbers(sb, b0, b1, std::min(h+1, wdth), policy);
+  multTwoNumbers(pp, sa, sb, /*bNegative=*/false, wdth,
+                 policy, MULT_KARATSUBA);
+
+  const FHEcontext& context = zeroCtxt.getContext();
+  DoubleCRT one(context, context.allPrimes()); one += 1L;
+  Ctxt oneCtxt = zeroCtxt;
+  oneCtxt.addConstant(one, 1.0);
+
+  // The five terms, each of them resSize bits long
+  NTL::Vec< NTL::Vec<Ctxt> > numbers(INIT_SIZE, 5);
+  for (long i=0; i<5; i++) numbers[i].SetLength(resSize, zeroCtxt);
+  for (long i=0; i<lsize(z0) && i<resSize; i++)     // z0
+    numbers[0][i] = z0.bit(i);
+  for (long i=0; i<lsize(z2) && i+2*h<resSize; i++) // z2*2^{2h}
+    numbers[1][i+2*h] = z2.bit(i);
+  for (long i=0; i<lsize(pp) && i<wdth; i++)        // P*2^h
+    numbers[2][i+h] = pp.bit(i);
+  for (long i=0; i<wdth; i++) {                     // ~z0*2^h, ~z2*2^h
+    for (long t=0; t<2; t++) {
+      const BitSliced& z = t? z2 : z0;
+      Ctxt& bit = numbers[3+t][i+h];
+      if (i<lsize(z) && !(z.bit(i).isEmpty())) {
+        bit = z.bit(i);
+        bit.addConstant(one, 1.0);
+      }
+      else bit = oneCtxt;
+    }
+  }
+  // The two +1's of the negations, i.e., add 2^{h+1}
+  if (h+1 < resSize) {
+    numbers.SetLength(6);
+    numbers[5].SetLength(resSize, zeroCtxt);
+    numbers[5][h+1] = oneCtxt;
+  }
+  CtPtrMat_VecCt nums(numbers);
+  addManyNumbers(product, nums, resSize, policy);
+}
+
+/********************************************************************/
+/****************** Arithmetic with plaintext constants *************/
+
+// A bit that is either a known constant (val=0,1) or encrypted (val=-1).
+// The ciphertexts are never modified once they are set, so they can be
+// shared between bits.
+struct KnownBit {
+  long val;
+  std::shared_ptr<Ctxt> ct;
+  explicit KnownBit(long v=0): val(v) {}
+  explicit KnownBit(const Ctxt& c): val(c.isEmpty()? 0 : -1)
+  { if (val<0) ct = std::make_shared<Ctxt>(c); }
+};
+
+static KnownBit knownMul(const KnownBit& x, const KnownBit& y)
+{
+  if (x.val==0 || y.val==0) return KnownBit(0);
+  if (x.val==1) return y;
+  if (y.val==1) return x;
+  KnownBit z(*x.ct);
+  z.ct->multiplyBy(*y.ct);
+  return z;
+}
+
+static KnownBit knownAdd(const KnownBit& x, const KnownBit& y,
+                         const DoubleCRT& one)
+{
+  if (x.val>=0 && y.val>=0) return KnownBit(x.val ^ y.val);
+  if (x.val==0) return y;
+  if (y.val==0) return x;
+  if (x.val==1 || y.val==1) { // x+1 or y+1
+    KnownBit z((x.val==1)? *y.ct : *x.ct);
+    z.ct->addConstant(one, 1.0);
+    return z;
+  }
+  KnownBit z(*x.ct);
+  *z.ct += *y.ct;
+  return z;
+}
+
+static inline long bitOf(unsigned long c, long i)
+{ return (i < long(8*sizeof(c)))? long((c>>i) & 1) : 0; }
+
+static long numBitsOf(unsigned long c)
+{
+  long n = 0;
+  for (; c!=0; c >>= 1) n++;
+  return n;
+}
+
+// The carries are computed by a Sklansky parallel-prefix over the
+// generate/propagate pairs (g_i,p_i) = (a_i*c_i, a_i+c_i). Since c_i is
+// known these are (0,a_i) or (a_i,a_i+1) for free, and every product with
+// a known bit is skipped, so e.g. the carries out of the low zero bits of c
+// are known zeros. All the combinations of a prefix level run in parallel.
+void addConstant(CtPtrs& sum, const CtPtrs& a, unsigned long c,
+                 long sizeLimit, const RecryptPolicy& policy)
+{
+  FHE_TIMER_START;
+  if (c==0) { vecCopy(sum, a, sizeLimit); return; }
+  const Ctxt* ct_ptr = a.ptr2nonNull();
+  if (ct_ptr==nullptr)
+    throw std::logic_error("addConstant: no ciphertext in the input");
+
+  long resSize = std::max(lsize(a), numBitsOf(c)) +1;
+  if (sizeLimit>0 && sizeLimit<resSize) resSize = sizeLimit;
+
+  // Ensure that we have enough levels for the prefix, bootstrap otherwise
+  long bpl = ct_ptr->getContext().BPL();
+  policy.ensureCapacity({&a}, NTL::NumBits(resSize));
+  if (findMinBitCapacity(a) < (NTL::NumBits(resSize)+1)*bpl)
+    throw std::logic_error("not enough levels for addConstant");
+  const Ctxt zeroCtxt(ZeroCtxtLike, *ct_ptr);
+  const FHEcontext& context = zeroCtxt.getContext();
+  DoubleCRT one(context, context.allPrimes()); one += 1L;
+
+  std::vector<KnownBit> bits(resSize);
+  for (long i=0; i<resSize && i<lsize(a); i++)
+    if (a.isSet(i)) bits[i] = KnownBit(*a[i]);
+
+  long m = resSize-1; // the carry into bit i+1 is the prefix of [0..i]
+  std::vector<KnownBit> g(m), p(m);
+  for (long i=0; i<m; i++) {
+    if (bitOf(c,i)) {
+      g[i] = bits[i];
+      p[i] = knownAdd(bits[i], KnownBit(1), one);
+    }
+    else p[i] = bits[i];
+  }
+  for (long d=1; d<m; d*=2) {
+    std::vector<long> idx; // the upper halves of the blocks of size 2d
+    for (long i=0; i<m; i++) if (i & d) idx.push_back(i);
+    bool needP = (2*d < m); // the last level only needs the g's
+    FHE_EXEC_RANGE(lsize(idx), first, last)
+    for (long k=first; k<last; k++) {
+      long i = idx[k];
+      long j = (i & ~(2*d-1)) + d -1; // the top of the lower half
+      g[i] = knownAdd(g[i], knownMul(p[i], g[j]), one);
+      if (needP) p[i] = knownMul(p[i], p[j]);
+    }
+    FHE_EXEC_RANGE_END
+  }
+
+  std::vector<Ctxt> out(resSize, zeroCtxt);
+  for (long i=0; i<resSize; i++) {
+    KnownBit s = knownAdd(bits[i], KnownBit(bitOf(c,i)), one);
+    if (i>0) s = knownAdd(s, g[i-1], one);
+    if (s.val<0) out[i] = *s.ct;
+    else if (s.val==1) out[i].addConstant(one, 1.0);
+  }
+  vecCopy(sum, std::move(out));
 }
 
+// The product is the sum of the shifted copies of a for the nonzero
+// digits of c. With canonical signed digits, a digit -1 at position i
+// contributes -(a*2^i) = ~(a*2^i)+1 mod 2^resSize. The bits of ~(a*2^i)
+// outside the window of a are all ones, so each negative term is the
+// flipped window plus the known constant -W_i, where W_i is the mask of the
+// window. These constants are added at the end with addConstant.
+void multByConstant(CtPtrs& product, const CtPtrs& a, unsigned long c,
+                    long sizeLimit, const RecryptPolicy& policy)
+{
+  FHE_TIMER_START;
+  const Ctxt* ct_ptr = a.ptr2nonNull();
+  long aSize = lsize(a);
+  long resSize = aSize + numBitsOf(c);
+  if (sizeLimit>0 && sizeLimit<resSize) resSize = sizeLimit;
+  const long wordSize = 8*sizeof(c);
+  if (resSize < wordSize) c &= (1UL << resSize) -1;
+  if (c==0 || ct_ptr==nullptr) { setLengthZero(product); return; }
+
+  // The binary digits of c, and its non-adjacent form
+  std::vector<long> digits(resSize, 0), naf(resSize, 0);
+  long binWeight = 0, nafWeight = 0;
+  bool hasNegative = false;
+  for (long i=0, carry=0; i<resSize; i++) {
+    digits[i] = bitOf(c,i);
+    binWeight += digits[i];
+    long b = bitOf(c,i) + carry;
+    if (b==1) {
+      naf[i] = bitOf(c,i+1)? -1 : 1;
+      carry = bitOf(c,i+1);
+    }
+    else carry = b/2; // a zero digit
+    if (naf[i]!=0) nafWeight++;
+    if (naf[i]<0) hasNegative = true;
+  }
+  // The constant for the negative terms costs about as much as one more
+  // term, and it must fit in a word
+  if (nafWeight + (hasNegative? 1 : 0) < binWeight
+      && (!hasNegative || resSize <= wordSize))
+    digits.swap(naf);
+
+  const Ctxt zeroCtxt(ZeroCtxtLike, *ct_ptr);
+  const FHEcontext& context = zeroCtxt.getContext();
+  DoubleCRT one(context, context.allPrimes()); one += 1L;
+  Ctxt oneCtxt = zeroCtxt;
+  oneCtxt.addConstant(one, 1.0);
+
+  long nTerms = 0;
+  for (long i=0; i<resSize; i++) if (digits[i]!=0) nTerms++;
+  NTL::Vec< NTL::Vec<Ctxt> > numbers(INIT_SIZE, nTerms);
+  unsigned long negConst = 0; // the sum of the -W_i's mod 2^resSize
+  for (long i=0, t=0; i<resSize; i++) if (digits[i]!=0) {
+    long len = std::min(aSize, resSize-i); // the window of a in this term
+    NTL::Vec<Ctxt>& row = numbers[t++];
+    row.SetLength(i+len, zeroCtxt);
+    for (long j=0; j<len; j++) {
+      bool isSet = a.isSet(j) && !a[j]->isEmpty();
+      if (digits[i]>0) {
+        if (isSet) row[i+j] = *a[j];
+      }
+      else if (isSet) {
+        row[i+j] = *a[j];
+        row[i+j].addConstant(one, 1.0); // the flipped bit
+      }
+      else row[i+j] = oneCtxt;
+    }
+    if (digits[i]<0)
+      negConst -= ((len<wordSize)? (1UL<<len)-1 : ~0UL) << i;
+  }
+  if (resSize < wordSize) negConst &= (1UL << resSize) -1;
+
+  if (nTerms==1)
+    vecCopy(product, numbers[0]);
+  else {
+    CtPtrMat_VecCt nums(numbers);
+    addManyNumbers(product, nums, resSize, policy);
+  }
+  if (negConst!=0)
+    addConstant(product, product, negConst, resSize, policy);
+}
+
+/********************************************************************/
 /* seven4Three: adding seven input bits, getting a 3-bit counter
  *
  * input: in[6..0]
@@ -899,8 +1464,8 @@ static void fifteen4Four(const CtPtrs& out, const CtPtrs& in, long sizeLimit)
   Ctxt& d2=b7;  Ctxt& d3=b9;  Ctxt& d4=f2;
   Ctxt& e2=c1;  Ctxt& e3=c2;  Ctxt& e4=f2;
 
-  long nThreads = std::min(NTL::AvailableThreads(), 3L);
-  NTL_EXEC_INDEX(nThreads, index)     // run these three lines in parallel
+  long nThreads = std::min(fheAvailableThreads(), 3L);
+  FHE_EXEC_INDEX(nThreads, index)     // run these three lines in parallel
   switch (index) {
   case 0: three4Two(&b1,&b2,in[0],in[1],in[2]); // b2 b1 = 3for2(in[0..2])
     if (nThreads>1) break;
@@ -908,32 +1473,32 @@ static void fifteen4Four(const CtPtrs& out, const CtPtrs& in, long sizeLimit)
     if (nThreads>2) break;
   default: three4Two(&b5,&b6,in[6],in[7],in[8]);// b6 b5 = 3for2(in[6..8])
   }
-  NTL_EXEC_INDEX_END
+  FHE_EXEC_INDEX_END
 
   three4Two(c1,c2, b1, b3, b5);         // c2 c1 = 3for2(b1,b3,b5)
 
   three4Two(c3,c4, b2, b4, b6);         // c4 c3 = 3for2(b2,b4,b6)
 
-  nThreads = std::min(NTL::AvailableThreads(), 2L);
-  NTL_EXEC_INDEX(nThreads, index)       // run these two lines in parallel
+  nThreads = std::min(fheAvailableThreads(), 2L);
+  FHE_EXEC_INDEX(nThreads, index)       // run these two lines in parallel
   switch (index) {
   case 0: three4Two(&b7,&b8,in[9],in[10],in[11]);   // b8 b7 = 3for2(in[9..11])
     if (nThreads>1) break;
   default: three4Two(&b9,&b10,in[12],in[13],in[14]);// b10 b9 = 3for2(in[12..14])
   }
-  NTL_EXEC_INDEX_END
+  FHE_EXEC_INDEX_END
 
-  NTL_EXEC_INDEX(nThreads, index)       // run these two lines in parallel
+  FHE_EXEC_INDEX(nThreads, index)       // run these two lines in parallel
   switch (index) {
   case 0: three4Two(d1,d2, b7, b9, c1); // d2 d1 = 3for2(b7,b9,c1)
     if (nThreads>1) break;
   default: if (sizeLimit >= 2)
       three4Two(d3,d4, b8, b10, c2);    // d4 d3 = 3for2(b8,b10,c2)
   }
-  NTL_EXEC_INDEX_END
+  FHE_EXEC_INDEX_END
   if (sizeLimit < 2) return;
 
-  NTL_EXEC_INDEX(nThreads, index)       // run these two blocks in parallel
+  FHE_EXEC_INDEX(nThreads, index)       // run these two blocks in parallel
   switch (index) {
   case 0: three4Two(e1,e2, c3, d2, d3); // e2 e1 = 3for2(c3,d2,d3)
     if (nThreads>1) break;
@@ -943,7 +1508,7 @@ static void fifteen4Four(const CtPtrs& out, const CtPtrs& in, long sizeLimit)
       e4.multiplyBy(c4);                // e4 = c4 * d4 (e4 alias d4)
     }
   }
-  NTL_EXEC_INDEX_END
+  FHE_EXEC_INDEX_END
   if (sizeLimit < 3) return;
 
   f1 = e2;
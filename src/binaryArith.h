@@ -15,13 +15,61 @@
  * @file binaryArith.h
  * @brief Implementing integer addition, multiplication in binary representation
  **/
+#include <initializer_list>
 #include "EncryptedArray.h"
 #include "CtPtrs.h" //  defines CtPtrs, CtPtrMat
 
+/**
+ * @class RecryptPolicy
+ * @brief Decides when the binary circuits bootstrap, and what.
+ *
+ * Before each step, a circuit tells the policy which numbers the step uses
+ * and its multiplicative depth. If some ciphertexts do not have the
+ * capacity for that depth (plus a safety margin), then those ciphertexts
+ * are recrypted with a single packedRecrypt, together with the ones that
+ * would run out within the next ahead levels of the same circuit. The
+ * ciphertexts that have enough capacity are left alone.
+ *
+ * A policy without an unpackSlotEncoding (or for keys that are not
+ * bootstrappable) never recrypts.
+ **/
+class RecryptPolicy {
+  std::vector<zzX>* unpack;
+  long margin; // extra levels to keep above the predicted depth
+
+  long recrypt(std::vector<Ctxt*>& cts) const;
+
+public:
+  explicit RecryptPolicy(std::vector<zzX>* unpackSlotEncoding=nullptr,
+                         long extraLevels=1)
+    : unpack(unpackSlotEncoding), margin(extraLevels) {}
+
+  std::vector<zzX>* unpackSlotEncoding() const { return unpack; }
+  bool canRecrypt(const Ctxt& ct) const
+  { return unpack!=nullptr && ct.getPubKey().isBootstrappable(); }
+
+  //! The capacity (in bits) that ct needs for depth more levels
+  long capacityFor(const Ctxt& ct, long depth) const;
+
+  //! Make sure that the ciphertexts of nums[k] have the capacity for
+  //! depths[k] more levels. Returns the number of recrypted ciphertexts.
+  long ensureCapacity(const std::vector<const CtPtrs*>& nums,
+                      const std::vector<long>& depths, long ahead=0) const;
+  long ensureCapacity(std::initializer_list<const CtPtrs*> nums, long depth,
+                      long ahead=0) const;
+  long ensureCapacity(const CtPtrMat& m, long depth, long ahead=0) const;
+
+  //! Recrypt all the ciphertexts of nums, whatever their capacity
+  long recryptAll(std::initializer_list<const CtPtrs*> nums) const;
+};
+
 //! Add two integers (i.e. two array of bits) a, b.
-void
+void addTwoNumbers(CtPtrs& sum, const CtPtrs& a, const CtPtrs& b,
+                   long sizeLimit, const RecryptPolicy& policy);
+inline void
 addTwoNumbers(CtPtrs& sum, const CtPtrs& a, const CtPtrs& b,
-              long sizeLimit=0, std::vector<zzX>* unpackSlotEncoding=nullptr);
+              long sizeLimit=0, std::vector<zzX>* unpackSlotEncoding=nullptr)
+{ addTwoNumbers(sum, a, b, sizeLimit, RecryptPolicy(unpackSlotEncoding)); }
 
 //! Adding fifteen input bits, getting a 4-bit counter. Some of the
 //! input pointers may be null, but output pointers must point to
@@ -31,13 +79,57 @@ addTwoNumbers(CtPtrs& sum, const CtPtrs& a, const CtPtrs& b,
 long fifteenOrLess4Four(const CtPtrs& out, const CtPtrs& in, long sizeLimit=4);
 
 //! Calculate the sum of many numbers using the 3-for-2 method
-void addManyNumbers(CtPtrs& sum, CtPtrMat& numbers, long sizeLimit=0,
-                    std::vector<zzX>* unpackSlotEncoding=nullptr);
+void addManyNumbers(CtPtrs& sum, CtPtrMat& numbers, long sizeLimit,
+                    const RecryptPolicy& policy);
+inline void addManyNumbers(CtPtrs& sum, CtPtrMat& numbers, long sizeLimit=0,
+                           std::vector<zzX>* unpackSlotEncoding=nullptr)
+{ addManyNumbers(sum, numbers, sizeLimit, RecryptPolicy(unpackSlotEncoding)); }
+
+//! The ways that multTwoNumbers can compute a product
+enum MultStrategy {
+  MULT_3FOR2,     //!< all the partial products, summed with addManyNumbers
+  MULT_DADDA,     //!< a Dadda tree over the columns of partial-product bits
+  MULT_KARATSUBA  //!< Karatsuba splits, down to small 3-for-2 products
+};
 
 //! Multiply two integers (i.e. two array of bits) a, b.
+//! The strategy is only used for unsigned products (bNegative==false).
 void multTwoNumbers(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
-                    bool bNegative=false, long sizeLimit=0,
-                    std::vector<zzX>* unpackSlotEncoding=nullptr);
+                    bool bNegative, long sizeLimit,
+                    const RecryptPolicy& policy,
+                    MultStrategy strategy=MULT_3FOR2);
+inline void
+multTwoNumbers(CtPtrs& product, const CtPtrs& a, const CtPtrs& b,
+               bool bNegative=false, long sizeLimit=0,
+               std::vector<zzX>* unpackSlotEncoding=nullptr,
+               MultStrategy strategy=MULT_3FOR2)
+{
+  multTwoNumbers(product, a, b, bNegative, sizeLimit,
+                 RecryptPolicy(unpackSlotEncoding), strategy);
+}
+
+//! Add a plaintext constant c to an integer a (i.e. an array of bits),
+//! sum = a+c mod 2^sizeLimit (sizeLimit=0: as many bits as needed).
+//! The known bits of c make the carry computation cheaper than with
+//! addTwoNumbers: no multiplications where the carry is a known constant.
+//! The input a must have at least one ciphertext, sum may alias a.
+void addConstant(CtPtrs& sum, const CtPtrs& a, unsigned long c,
+                 long sizeLimit, const RecryptPolicy& policy);
+inline void addConstant(CtPtrs& sum, const CtPtrs& a, unsigned long c,
+                        long sizeLimit=0,
+                        std::vector<zzX>* unpackSlotEncoding=nullptr)
+{ addConstant(sum, a, c, sizeLimit, RecryptPolicy(unpackSlotEncoding)); }
+
+//! Multiply an integer a (i.e. an array of bits) by a plaintext constant c,
+//! product = a*c mod 2^sizeLimit (sizeLimit=0: as many bits as needed).
+//! Only the nonzero digits of c cost a partial product, and c is recoded
+//! in canonical signed digits when that leaves fewer of them.
+void multByConstant(CtPtrs& product, const CtPtrs& a, unsigned long c,
+                    long sizeLimit, const RecryptPolicy& policy);
+inline void multByConstant(CtPtrs& product, const CtPtrs& a, unsigned long c,
+                           long sizeLimit=0,
+                           std::vector<zzX>* unpackSlotEncoding=nullptr)
+{ multByConstant(product, a, c, sizeLimit, RecryptPolicy(unpackSlotEncoding)); }
 
 //! Decrypt the binary numbers that are encrypted in eNums.
 void decryptBinaryNums(std::vector<long>& pNums, const CtPtrs& eNums,
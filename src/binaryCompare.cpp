@@ -24,6 +24,7 @@
 
 #include <NTL/BasicThreadPool.h>
 #include "binaryArith.h"
+#include "taskScheduler.h"
 
 #define BPL_ESTIMATE (30)
 // FIXME: this should really be dynamic
@@ -44,137 +45,183 @@ void runningSums(CtPtrs& v)
 
 // a recursive function that computes
 //      e*[i] = prod_{j>=i} e[i]  and  g*[i] = e*[i+1] \cdot g[i]
-// This function is optimized, so that instead of all the e*[i]'s
-// it only computes e*[0] and the e*[i]'s that are used in the
-// computation of the g*[i]'d
-static void compProducts(const CtPtrs_slice& e, const CtPtrs_slice& g)
+// for every pair of slices (e[k],g[k]). This function is optimized, so
+// that instead of all the e*[i]'s it only computes e*[0] and the e*[i]'s
+// that are used in the computation of the g*[i]'d. The halves of all the
+// slices are handled together by one recursive call, so all the
+// multiplications at the same depth of the recursion run on the thread
+// pool together.
+static void compProducts(const std::vector<CtPtrs_slice>& e,
+                         const std::vector<CtPtrs_slice>& g)
 {
-  long n = lsize(e);
-  if (n <= 1) return; // nothing to do
+  // split every array in two, second part has size the largest 2^l < n,
+  // and first part is the rest
+  std::vector<CtPtrs_slice> eHalves, gHalves;
+  std::vector<long> split(lsize(e), 0);
+  std::vector<std::pair<long,long>> tasks; // (slice, index)
+  for (long k=0; k<lsize(e); k++) {
+    long n = lsize(e[k]);
+    if (n <= 1) continue; // nothing to do
 #ifdef DEBUG_PRINTOUT
-  cout << "compProducts(g["<<g.start<<".."<<(g.start+g.sz-1)<<"],e["
-       << e.start<<".."<<(e.start+e.sz-1)<<"])\n";
+    cout << "compProducts(g["<<g[k].start<<".."<<(g[k].start+g[k].sz-1)
+         <<"],e["<< e[k].start<<".."<<(e[k].start+e[k].sz-1)<<"])\n";
 #endif
+    long ell = NTL::NumBits(n-1) -1; // n/2 <= 2^l < n
+    long n1 = n - (1UL<<ell);        // n1 \in [1, n/2]
+    split[k] = n1;
 
-  // split the array in two, second part has size the largest 2^l < n,
-  // and first part is the rest
-
-  long ell = NTL::NumBits(n-1) -1; // n/2 <= 2^l < n
-  long n1 = n - (1UL<<ell);        // n1 \in [1, n/2]
+    eHalves.push_back(CtPtrs_slice(e[k],0,n1));      // first half
+    gHalves.push_back(CtPtrs_slice(g[k],0,n1));
+    eHalves.push_back(CtPtrs_slice(e[k],n1,n-n1));   // second half
+    gHalves.push_back(CtPtrs_slice(g[k],n1,n-n1));
+    for (long i=0; i<1+n1; i++) tasks.push_back(std::make_pair(k,i));
+  }
+  if (tasks.empty()) return;
 
-  // Call the recursive procedure separately on the first and second parts
-  compProducts(CtPtrs_slice(e,0,n1), CtPtrs_slice(g,0,n1));      // first half
-  compProducts(CtPtrs_slice(e,n1,n-n1), CtPtrs_slice(g,n1,n-n1));// second half
+  // Call the recursive procedure on the first and second parts of all
+  compProducts(eHalves, gHalves);
 
   // Multiply the first product in the 2nd part into every product in the 1st
-  NTL_EXEC_RANGE(1+n1, first, last)
-  for (long i=first; i<last; i++) {
-    if (i==0)               e[0]->multiplyBy(*e[n1]);
-    else if (i-1<g.size()) g[i-1]->multiplyBy(*e[n1]);
+  FHE_EXEC_RANGE(lsize(tasks), first, last)
+  for (long t=first; t<last; t++) {
+    long k = tasks[t].first, i = tasks[t].second, n1 = split[k];
+    if (i==0)                  e[k][0]->multiplyBy(*e[k][n1]);
+    else if (i-1<g[k].size()) g[k][i-1]->multiplyBy(*e[k][n1]);
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 #ifdef DEBUG_PRINTOUT
-  cout << " g["<<g.start<<".."<<(g.start+g.sz-1)<<"], "
-       << " e["<<e.start<<".."<<(e.start+e.sz-1)<<"]:\n";
-  for (long i=0; i<g.size(); i++)
-    decryptAndPrint((cout<<"   g["<<(i+g.start)<<"] ("<<((void*)g[i])<<"): "),
-                    *g[i], *dbgKey, *dbgEa, FLAG_PRINT_POLY);
-  for (long i=0; i<e.size(); i++)
-    decryptAndPrint((cout<<"   e["<<(i+e.start)<<"] ("<<((void*)e[i])<<"): "),
-                    *e[i], *dbgKey, *dbgEa, FLAG_PRINT_POLY);
-
+  for (long k=0; k<lsize(e); k++) {
+    if (lsize(e[k]) <= 1) continue;
+    cout << " g["<<g[k].start<<".."<<(g[k].start+g[k].sz-1)<<"], "
+         << " e["<<e[k].start<<".."<<(e[k].start+e[k].sz-1)<<"]:\n";
+    for (long i=0; i<g[k].size(); i++)
+      decryptAndPrint((cout<<"   g["<<(i+g[k].start)<<"] ("
+                       <<((void*)g[k][i])<<"): "),
+                      *g[k][i], *dbgKey, *dbgEa, FLAG_PRINT_POLY);
+    for (long i=0; i<e[k].size(); i++)
+      decryptAndPrint((cout<<"   e["<<(i+e[k].start)<<"] ("
+                       <<((void*)e[k][i])<<"): "),
+                      *e[k][i], *dbgKey, *dbgEa, FLAG_PRINT_POLY);
+  }
   cout << endl;
 #endif
 }
 
 // Compute aeqb[i] = (a==b upto bit i), agtb[i] = (aeqb[i+1] and ai>bi)
-// We assume that b.size()>a.size()
+// for all the pairs (a[k],b[k]). We assume that b[k].size()>=a[k].size()
 static void
-compEqGt(CtPtrs& aeqb, CtPtrs& agtb, const CtPtrs& a, const CtPtrs& b)
+compEqGt(const std::vector<CtPtrs*>& aeqb, const std::vector<CtPtrs*>& agtb,
+         const std::vector<const CtPtrs*>& a,
+         const std::vector<const CtPtrs*>& b)
 {
   FHE_TIMER_START;
-  const Ctxt zeroCtxt(ZeroCtxtLike, *(b.ptr2nonNull()));
+  const Ctxt zeroCtxt(ZeroCtxtLike, *(b[0]->ptr2nonNull()));
   const FHEcontext& context = zeroCtxt.getContext();
   DoubleCRT one(context, context.allPrimes()); one += 1L;
-  
-  resize(aeqb, lsize(b), zeroCtxt);
-  resize(agtb, lsize(a), zeroCtxt);
 
-  // First compute the local bits e[i]=(a[i]==b[i]), gt[i]=(a[i]>b[i])
-  FHE_NTIMER_START(compEqGt1);
-  long aSize = lsize(a);
-  NTL_EXEC_RANGE(aSize, first, last)
-  for (long i=first; i<last; i++) {
-    *aeqb[i] = *b[i];               // b
-    aeqb[i]->addConstant(one, 1.0); // b+1
-    *agtb[i] = *aeqb[i];            // b+1
-    *aeqb[i] += *a[i];              // a+b+1
-    agtb[i]->multiplyBy(*a[i]);     // a(b+1)
+  std::vector<std::pair<long,long>> bits; // (pair, position)
+  for (long k=0; k<lsize(a); k++) {
+    resize(*aeqb[k], lsize(*b[k]), zeroCtxt);
+    resize(*agtb[k], lsize(*a[k]), zeroCtxt);
+    for (long i=0; i<lsize(*b[k]); i++) bits.push_back(std::make_pair(k,i));
   }
-  NTL_EXEC_RANGE_END
-  FHE_NTIMER_STOP(compEqGt1);
 
-  // NOTE: Usually there isn't much gain in multi-threading the loop below,
-  //    but computing b[i] can be expensive in some implementations of CtPtrs
-  FHE_NTIMER_START(compEqGt2);
-  if (lsize(b)-aSize >1) {
-    NTL_EXEC_RANGE(lsize(b)-aSize, first, last)
-    for (long i=first; i<last; i++) {
-      *aeqb[i+aSize] = *b[i+aSize];         // b
-      aeqb[i+aSize]->addConstant(one, 1.0); // b+1
+  // First compute the local bits e[i]=(a[i]==b[i]), gt[i]=(a[i]>b[i])
+  // NOTE: computing b[i] can be expensive in some implementations of CtPtrs,
+  //    so the top bits of b (above the size of a) are done in this loop too
+  FHE_NTIMER_START(compEqGt1);
+  FHE_EXEC_RANGE(lsize(bits), first, last)
+  for (long t=first; t<last; t++) {
+    long k = bits[t].first, i = bits[t].second;
+    CtPtrs& eq = *aeqb[k];
+    CtPtrs& gt = *agtb[k];
+    *eq[i] = *(*b[k])[i];        // b
+    eq[i]->addConstant(one, 1.0); // b+1
+    if (i<lsize(*a[k])) {
+      const Ctxt& ai = *(*a[k])[i];
+      *gt[i] = *eq[i];            // b+1
+      *eq[i] += ai;               // a+b+1
+      gt[i]->multiplyBy(ai);      // a(b+1)
     }
-    NTL_EXEC_RANGE_END
   }
-  else if (lsize(b)-aSize == 1) {
-    *aeqb[aSize] = *b[aSize];         // b
-    aeqb[aSize]->addConstant(one, 1.0); // b+1
-  }
-  FHE_NTIMER_STOP(compEqGt2);
+  FHE_EXEC_RANGE_END
+  FHE_NTIMER_STOP(compEqGt1);
 
 #ifdef DEBUG_PRINTOUT
-  for (long i=0; i<lsize(b); i++)
-    decryptAndPrint((cout<<" e["<<i<<"]: "), *aeqb[i], *dbgKey, *dbgEa, FLAG_PRINT_POLY);
-  for (long i=0; i<lsize(a); i++)
-    decryptAndPrint((cout<<" ag["<<i<<"]: "), *agtb[i], *dbgKey, *dbgEa, FLAG_PRINT_POLY);
-  cout << endl;
+  for (long k=0; k<lsize(a); k++) {
+    for (long i=0; i<lsize(*b[k]); i++)
+      decryptAndPrint((cout<<" e["<<i<<"]: "), *(*aeqb[k])[i],
+                      *dbgKey, *dbgEa, FLAG_PRINT_POLY);
+    for (long i=0; i<lsize(*a[k]); i++)
+      decryptAndPrint((cout<<" ag["<<i<<"]: "), *(*agtb[k])[i],
+                      *dbgKey, *dbgEa, FLAG_PRINT_POLY);
+    cout << endl;
+  }
 #endif
 
   // Call a recursive function to compute:
   // e*_i = \prod_{j>=i} aeqb_i, g*_i = aeqb*_{i+1} \cdot agtb_i
   FHE_NTIMER_START(compEqGt3);
-  compProducts(CtPtrs_slice(aeqb,0), CtPtrs_slice(agtb,0));
-  runningSums(agtb); // now ag[i] = (a>b upto bit i)
+  std::vector<CtPtrs_slice> eSlices, gSlices;
+  for (long k=0; k<lsize(a); k++) {
+    eSlices.push_back(CtPtrs_slice(*aeqb[k],0));
+    gSlices.push_back(CtPtrs_slice(*agtb[k],0));
+  }
+  compProducts(eSlices, gSlices);
+  FHE_EXEC_RANGE(lsize(a), first, last)
+  for (long k=first; k<last; k++)
+    runningSums(*agtb[k]); // now ag[i] = (a>b upto bit i)
+  FHE_EXEC_RANGE_END
   FHE_NTIMER_STOP(compEqGt3);
 }
 
-
-// Compares two integers in binary a,b.
-// Returns max(a,b), min(a,b) and indicator bits mu=(a>b) and ni=(a<b)
-void compareTwoNumbers(CtPtrs& max, CtPtrs& min, Ctxt& mu, Ctxt& ni,
-                       const CtPtrs& aa, const CtPtrs& bb,
-                       std::vector<zzX>* unpackSlotEncoding)
+// The comparisons of compareTwoNumbers and compareManyNumbers
+static void
+compareBatch(const std::vector<CtPtrs*>& max, const std::vector<CtPtrs*>& min,
+             const std::vector<Ctxt*>& mu, const std::vector<Ctxt*>& ni,
+             const std::vector<const CtPtrs*>& aa,
+             const std::vector<const CtPtrs*>& bb,
+             const RecryptPolicy& policy)
 {
-  FHE_TIMER_START;
-  // make sure that lsize(b) >= lsize(a)
-  const CtPtrs& a = (lsize(bb)>=lsize(aa))? aa : bb;
-  const CtPtrs& b = (lsize(bb)>=lsize(aa))? bb : aa;
-  long aSize = lsize(a);
-  long bSize = lsize(b);
-  if (aSize<1) { // a is empty
-    mu.clear();
-    ni.clear();
-    ni.addConstant(ZZ(1L));
-    vecCopy(max, b);
-    setLengthZero(min);
-    return;
+  // make sure that lsize(b[k]) >= lsize(a[k]), and handle empty a[k]'s
+  std::vector<CtPtrs*> e, ag;
+  std::vector<Ctxt*> mu2, ni2;
+  std::vector<const CtPtrs*> a, b;
+  for (long k=0; k<lsize(aa); k++) {
+    const CtPtrs* ak = (lsize(*bb[k])>=lsize(*aa[k]))? aa[k] : bb[k];
+    const CtPtrs* bk = (lsize(*bb[k])>=lsize(*aa[k]))? bb[k] : aa[k];
+    if (lsize(*ak)<1) { // a is empty
+      mu[k]->clear();
+      ni[k]->clear();
+      ni[k]->addConstant(ZZ(1L));
+      vecCopy(*max[k], *bk);
+      setLengthZero(*min[k]);
+      continue;
+    }
+    // We use max, min to hold the intermediate values e, ag
+    a.push_back(ak); b.push_back(bk);
+    e.push_back(max[k]); ag.push_back(min[k]);
+    mu2.push_back(mu[k]); ni2.push_back(ni[k]);
   }
+  long n = lsize(a);
+  if (n==0) return;
 
-  // Check that we have enough levels, try to bootstrap otherwise
-  if (findMinBitCapacity({&a,&b}) < (NTL::NumBits(bSize+1)+2)*mu.getContext().BPL())
-    packedRecrypt(a,b,unpackSlotEncoding);
-  if (findMinBitCapacity({&a,&b}) < (NTL::NumBits(bSize)+1)*mu.getContext().BPL()) 
-    // the bare minimum
-    throw std::logic_error("not enough levels for comparison");
+  // Check that we have enough levels for the depth of each pair, and
+  // bootstrap the bits that need it from all the pairs in one go
+  const FHEcontext& context = mu2[0]->getContext();
+  std::vector<const CtPtrs*> nums;
+  std::vector<long> depths;
+  for (long k=0; k<n; k++) {
+    long depth = NTL::NumBits(lsize(*b[k])+1)+1;
+    nums.push_back(a[k]); depths.push_back(depth);
+    nums.push_back(b[k]); depths.push_back(depth);
+  }
+  policy.ensureCapacity(nums, depths);
+  for (long k=0; k<n; k++)
+    if (findMinBitCapacity({a[k],b[k]})
+        < (NTL::NumBits(lsize(*b[k]))+1)*context.BPL())
+      // the bare minimum
+      throw std::logic_error("not enough levels for comparison");
 
   // NOTE: this procedure minimizes the number of multiplications,
   //       but it may use one level too many. Can we optimize it?
@@ -183,32 +230,78 @@ void compareTwoNumbers(CtPtrs& max, CtPtrs& min, Ctxt& mu, Ctxt& ni,
    *   e[i] = (a==b upto position i)
    *   ag[i] = (a>b upto position i)
    */
-
-  // We use max, min to hold the intermediate values e, ag
-  CtPtrs& e = max;
-  CtPtrs& ag = min;
   compEqGt(e, ag, a, b);
 
   // We are now ready to compute the bits of the result.
 
   FHE_NTIMER_START(compResults);
-  mu = *ag[0];             // a > b
-  ni = *ag[0];
-  ni.addConstant(ZZ(1L));  // a <= b
-  ni += *e[0];             // a < b
-
-  NTL_EXEC_RANGE(aSize, first, last)
-  for (long i=first; i<last; i++) {
-    *max[i] = *a[i];
-    *max[i] -= *b[i];
-    max[i]->multiplyBy(*ag[i]);
-
-    *min[i] = *max[i];
-    *max[i] += *b[i];
-    *min[i] -= *a[i];
+  std::vector<std::pair<long,long>> bits; // (pair, position)
+  for (long k=0; k<n; k++) {
+    for (long i=0; i<lsize(*a[k]); i++) bits.push_back(std::make_pair(k,i));
+    *mu2[k] = *(*ag[k])[0];  // a > b
+    *ni2[k] = *(*ag[k])[0];
+    ni2[k]->addConstant(ZZ(1L)); // a <= b
+    *ni2[k] += *(*e[k])[0];      // a < b
+  }
+  FHE_EXEC_RANGE(lsize(bits), first, last)
+  for (long t=first; t<last; t++) {
+    long k = bits[t].first, i = bits[t].second;
+    CtPtrs& mx = *e[k];  // max
+    CtPtrs& mn = *ag[k]; // min
+    const Ctxt& ai = *(*a[k])[i];
+    const Ctxt& bi = *(*b[k])[i];
+    *mx[i] = ai;
+    *mx[i] -= bi;
+    mx[i]->multiplyBy(*(*ag[k])[i]);
+
+    *mn[i] = *mx[i];
+    *mx[i] += bi;
+    *mn[i] -= ai;
   }
-  NTL_EXEC_RANGE_END
-  for (long i=aSize; i<bSize; i++)
-    *max[i] = *b[i];
+  FHE_EXEC_RANGE_END
+  for (long k=0; k<n; k++)
+    for (long i=lsize(*a[k]); i<lsize(*b[k]); i++)
+      *(*e[k])[i] = *(*b[k])[i];
   FHE_NTIMER_STOP(compResults);
 }
+
+// Compares two integers in binary a,b.
+// Returns max(a,b), min(a,b) and indicator bits mu=(a>b) and ni=(a<b)
+void compareTwoNumbers(CtPtrs& max, CtPtrs& min, Ctxt& mu, Ctxt& ni,
+                       const CtPtrs& a, const CtPtrs& b,
+                       const RecryptPolicy& policy)
+{
+  FHE_TIMER_START;
+  compareBatch({&max}, {&min}, {&mu}, {&ni}, {&a}, {&b}, policy);
+}
+
+// Compares many pairs of integers at once
+void compareManyNumbers(CtPtrMat& max, CtPtrMat& min, CtPtrs& mu, CtPtrs& ni,
+                        const CtPtrMat& a, const CtPtrMat& b,
+                        const RecryptPolicy& policy)
+{
+  FHE_TIMER_START;
+  long n = lsize(a);
+  if (lsize(b) != n)
+    throw std::logic_error("compareManyNumbers: a, b of different sizes");
+  const Ctxt* ct_ptr = a.ptr2nonNull();
+  if (ct_ptr==nullptr) ct_ptr = b.ptr2nonNull();
+  if (n==0 || ct_ptr==nullptr) return;
+
+  const Ctxt zeroCtxt(ZeroCtxtLike, *ct_ptr);
+  if (lsize(max)<n) resize(max, n);
+  if (lsize(min)<n) resize(min, n);
+  if (lsize(mu)<n) resize(mu, n, zeroCtxt);
+  if (lsize(ni)<n) resize(ni, n, zeroCtxt);
+
+  std::vector<CtPtrs*> maxPtrs(n), minPtrs(n);
+  std::vector<Ctxt*> muPtrs(n), niPtrs(n);
+  std::vector<const CtPtrs*> aPtrs(n), bPtrs(n);
+  for (long k=0; k<n; k++) {
+    maxPtrs[k] = &max[k];  minPtrs[k] = &min[k];
+    muPtrs[k] = mu[k];     niPtrs[k] = ni[k];
+    aPtrs[k] = &a[k];      bPtrs[k] = &b[k];
+  }
+  compareBatch(maxPtrs, minPtrs, muPtrs, niPtrs, aPtrs, bPtrs,
+               policy);
+}
@@ -17,11 +17,33 @@
  **/
 #include "EncryptedArray.h"
 #include "CtPtrs.h" //  defines CtPtrs, CtPtrMat
+#include "binaryArith.h" // defines RecryptPolicy
 
 //! Compares two integers in binary a,b.
 //! Returns max(a,b), min(a,b) and indicator bits mu=(a>b) and ni=(a<b)
 void compareTwoNumbers(CtPtrs& max, CtPtrs& min, Ctxt& mu, Ctxt& ni,
                        const CtPtrs& a, const CtPtrs& b,
-                       std::vector<zzX>* unpackSlotEncoding=nullptr);
+                       const RecryptPolicy& policy);
+inline void compareTwoNumbers(CtPtrs& max, CtPtrs& min, Ctxt& mu, Ctxt& ni,
+                              const CtPtrs& a, const CtPtrs& b,
+                              std::vector<zzX>* unpackSlotEncoding=nullptr)
+{ compareTwoNumbers(max, min, mu, ni, a, b, RecryptPolicy(unpackSlotEncoding)); }
+
+//! Compares many pairs of integers a[i],b[i], setting max[i], min[i],
+//! mu[i], ni[i] as compareTwoNumbers does. The multiplications of all the
+//! pairs are scheduled on the thread pool together, and if bootstrapping
+//! is needed then the input bits that need it are bootstrapped in one go.
+//! The outputs are resized to lsize(a) if they are shorter.
+void compareManyNumbers(CtPtrMat& max, CtPtrMat& min, CtPtrs& mu, CtPtrs& ni,
+                        const CtPtrMat& a, const CtPtrMat& b,
+                        const RecryptPolicy& policy);
+inline void
+compareManyNumbers(CtPtrMat& max, CtPtrMat& min, CtPtrs& mu, CtPtrs& ni,
+                   const CtPtrMat& a, const CtPtrMat& b,
+                   std::vector<zzX>* unpackSlotEncoding=nullptr)
+{
+  compareManyNumbers(max, min, mu, ni, a, b,
+                     RecryptPolicy(unpackSlotEncoding));
+}
 
 #endif // ifdef _BINARY_COMPARE_H_
@@ -0,0 +1,265 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/**
+ * @file binarySort.cpp
+ * @brief Sorting and top-k selection of integers in binary representation.
+ */
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+
+#include "binaryCompare.h"
+#include "binarySort.h"
+#include "taskScheduler.h"
+
+NTL_CLIENT
+
+typedef std::vector<std::pair<long,long>> NetworkStage;
+
+// The smallest power of two that is at least n
+static long roundUpPowerOfTwo(long n)
+{
+  long N = 1;
+  while (N < n) N *= 2;
+  return N;
+}
+
+// Batcher's bitonic sort, in the variant where all the comparators point
+// the same way: the first step of every merge compares each item in the
+// lower half of a block with its mirror image in the upper half. We think
+// of n as padded to a power of two by +infinity's at the end, so all the
+// comparators that touch the padding are no-ops, and they are dropped.
+static void bitonicStages(std::vector<NetworkStage>& stages, long n)
+{
+  long N = roundUpPowerOfTwo(n);
+  for (long k=2; k<=N; k*=2) for (long j=k/2; j>=1; j/=2) {
+    NetworkStage stage;
+    for (long i=0; i<n; i++) {
+      long partner = (j==k/2)? (i ^ (k-1)) : (i ^ j);
+      if (partner > i && partner < n)
+        stage.push_back(std::make_pair(i, partner));
+    }
+    if (!stage.empty()) stages.push_back(stage);
+  }
+}
+
+// Batcher's odd-even merge sort, for any n
+static void oddEvenMergeStages(std::vector<NetworkStage>& stages, long n)
+{
+  for (long p=1; p<n; p*=2) for (long k=p; k>=1; k/=2) {
+    NetworkStage stage;
+    for (long j=k%p; j+k<n; j+=2*k)
+      for (long i=0; i<k && i+j+k<n; i++)
+        if ((i+j)/(2*p) == (i+j+k)/(2*p))
+          stage.push_back(std::make_pair(i+j, i+j+k));
+    if (!stage.empty()) stages.push_back(stage);
+  }
+}
+
+void sortingNetworkStages(std::vector<NetworkStage>& stages, long n,
+                          SortNetwork net)
+{
+  stages.clear();
+  if (net==SORT_BITONIC) bitonicStages(stages, n);
+  else                   oddEvenMergeStages(stages, n);
+}
+
+// Copy val into row, keeping the size of the row if val fits in it
+static void copyBack(PtrVector<Ctxt>& row, const NTL::Vec<Ctxt>& val,
+                     const Ctxt& zero)
+{
+  if (lsize(val) > lsize(row)) {
+    vecCopy(row, val);
+    return;
+  }
+  for (long i=0; i<lsize(row); i++)
+    *row[i] = (i<lsize(val))? val[i] : zero;
+}
+
+// Apply all the compare-exchanges of one stage, with a single call to
+// compareManyNumbers: for every pair (i,j), v[i] gets the min and v[j]
+// gets the max of the two
+static void compareExchange(CtPtrMat& v, const NetworkStage& stage,
+                            std::vector<zzX>* unpackSlotEncoding)
+{
+  FHE_TIMER_START;
+  long n = lsize(stage);
+  std::vector<PtrVector<Ctxt>*> aRows(n), bRows(n);
+  for (long t=0; t<n; t++) {
+    aRows[t] = &v[stage[t].first];
+    bRows[t] = &v[stage[t].second];
+  }
+  PtrMatrix_PtPtrVector<Ctxt> a(aRows), b(bRows);
+  const Ctxt* ct_ptr = a.ptr2nonNull();
+  if (ct_ptr==nullptr) ct_ptr = b.ptr2nonNull();
+  if (ct_ptr==nullptr) return; // all the numbers are zero-length
+
+  NTL::Vec< NTL::Vec<Ctxt> > mx, mn;
+  NTL::Vec<Ctxt> mu, ni;
+  {CtPtrMat_VecCt wMax(mx), wMin(mn); // wrappers around the outputs
+  CtPtrs_VecCt wMu(mu), wNi(ni);
+  compareManyNumbers(wMax, wMin, wMu, wNi, a, b, unpackSlotEncoding);
+  } // get rid of the wrappers
+
+  const Ctxt zero(ZeroCtxtLike, *ct_ptr);
+  for (long t=0; t<n; t++) {
+    copyBack(v[stage[t].first], mn[t], zero);
+    copyBack(v[stage[t].second], mx[t], zero);
+  }
+}
+
+void sortNumbers(CtPtrMat& numbers, SortNetwork net,
+                 std::vector<zzX>* unpackSlotEncoding)
+{
+  FHE_TIMER_START;
+  std::vector<NetworkStage> stages;
+  sortingNetworkStages(stages, lsize(numbers), net);
+  for (const NetworkStage& stage: stages)
+    compareExchange(numbers, stage, unpackSlotEncoding);
+}
+
+void topKNumbers(CtPtrMat& top, const CtPtrMat& numbers, long k,
+                 std::vector<zzX>* unpackSlotEncoding)
+{
+  FHE_TIMER_START;
+  long n = lsize(numbers);
+  if (k > n) k = n;
+  if (k <= 0) return;
+  if (lsize(top) < k) resize(top, k);
+
+  // Work on a copy, padded with zero-length numbers (i.e., zeros) to whole
+  // blocks of size K, each one sorted in increasing order
+  long K = roundUpPowerOfTwo(k);
+  long nBlocks = (n + K - 1)/K;
+  if (k == n) { K = n; nBlocks = 1; } // just sort everything
+  NTL::Vec< NTL::Vec<Ctxt> > work(INIT_SIZE, nBlocks*K);
+  for (long i=0; i<n; i++)
+    vecCopy(work[i], numbers[i]);
+  CtPtrMat_VecCt w(work);
+
+  // Sort all the blocks together, one stage of the network at a time
+  std::vector<NetworkStage> blockStages;
+  sortingNetworkStages(blockStages, K, SORT_ODD_EVEN_MERGE);
+  for (const NetworkStage& stage: blockStages) {
+    NetworkStage all;
+    for (long b=0; b<nBlocks; b++)
+      for (auto& pr: stage)
+        all.push_back(std::make_pair(b*K + pr.first, b*K + pr.second));
+    compareExchange(w, all, unpackSlotEncoding);
+  }
+
+  // The tournament: in every round, merge the blocks in pairs A,B. Putting
+  // the max of A[i], B[K-1-i] in B gives the top K of the two blocks in a
+  // bitonic order, which is then sorted by the half-cleaners of a bitonic
+  // merge. All the pairs of a round are handled together.
+  std::vector<long> active(nBlocks); // the starts of the remaining blocks
+  for (long b=0; b<nBlocks; b++) active[b] = b*K;
+  while (lsize(active) > 1) {
+    std::vector<long> next;
+    NetworkStage merge;
+    for (long m=0; m+1<lsize(active); m+=2) {
+      long A = active[m], B = active[m+1];
+      for (long i=0; i<K; i++)
+        merge.push_back(std::make_pair(A+i, B+K-1-i));
+      next.push_back(B);
+    }
+    compareExchange(w, merge, unpackSlotEncoding);
+
+    for (long j=K/2; j>=1; j/=2) {
+      NetworkStage cleaner;
+      for (long B: next)
+        for (long i=0; i<K; i++)
+          if ((i ^ j) > i)
+            cleaner.push_back(std::make_pair(B+i, B+(i ^ j)));
+      compareExchange(w, cleaner, unpackSlotEncoding);
+    }
+    if (lsize(active) % 2) next.push_back(active.back()); // the odd one out
+    active.swap(next);
+  }
+
+  // The top k are at the end of the last block, in increasing order
+  for (long t=0; t<k; t++)
+    vecCopy(top[t], work[active[0] + K-1-t]);
+}
+
+// Rotate the ciphertexts of a and b by amt along dimension dim. The
+// ciphertexts are rotated in parallel, and a rotation of a dimension that
+// is not native is hoisted by rotate1D itself.
+static void rotateAll(NTL::Vec<Ctxt>& a, NTL::Vec<Ctxt>& b,
+                      const EncryptedArray& ea, long dim, long amt)
+{
+  long na = a.length();
+  FHE_EXEC_RANGE(na + b.length(), first, last)
+  for (long t=first; t<last; t++)
+    ea.rotate1D((t<na)? a[t] : b[t-na], dim, amt);
+  FHE_EXEC_RANGE_END
+}
+
+void maxInSlots(CtPtrs& max, CtPtrs& argmax, const CtPtrs& a,
+                std::vector<zzX>* unpackSlotEncoding)
+{
+  FHE_TIMER_START;
+  const Ctxt* ct_ptr = a.ptr2nonNull();
+  if (ct_ptr==nullptr) { // a is zero, and so is every index
+    setLengthZero(max);
+    setLengthZero(argmax);
+    return;
+  }
+  const EncryptedArray& ea = *(ct_ptr->getContext().ea);
+  const RecryptPolicy policy(unpackSlotEncoding);
+  const Ctxt zero(ZeroCtxtLike, *ct_ptr);
+  long n = ea.size();
+
+  // The index of every slot, as a constant bit-sliced number
+  long nIdx = (n>1)? NTL::NumBits(n-1) : 0;
+  NTL::Vec<Ctxt> val, idx;
+  vecCopy(val, a);
+  idx.SetLength(nIdx, zero);
+  for (long t=0; t<nIdx; t++) {
+    std::vector<long> bits(n);
+    for (long j=0; j<n; j++) bits[j] = (j>>t) & 1;
+    ZZX poly;
+    ea.encode(poly, bits);
+    idx[t].addConstant(poly);
+  }
+
+  // After the round with stride w, every slot holds the max of the 2w
+  // slots that end at it along dim (cyclically), so ceil(log2(D)) rounds
+  // cover the whole dimension
+  CtPtrs_VecCt wVal(val), wIdx(idx);
+  for (long dim=0; dim<ea.dimension(); dim++)
+    for (long w=1; w<ea.sizeOfDimension(dim); w*=2) {
+      NTL::Vec<Ctxt> rVal(val), rIdx(idx), mx, mn;
+      rotateAll(rVal, rIdx, ea, dim, w);
+      Ctxt mu(zero), ni(zero);
+      {CtPtrs_VecCt wMax(mx), wMin(mn), wRot(rVal);
+      compareTwoNumbers(wMax, wMin, mu, ni, wVal, wRot, policy);
+      }
+
+      // idx += ni * (rIdx - idx), one level for the indexes
+      std::vector<Ctxt*> niPtr(1, &ni);
+      CtPtrs_vectorPt wNi(niPtr);
+      CtPtrs_VecCt wRIdx(rIdx);
+      policy.ensureCapacity({&wIdx, &wRIdx, &wNi}, 1);
+      FHE_EXEC_RANGE(nIdx, first, last)
+      for (long t=first; t<last; t++) {
+        rIdx[t] -= idx[t];
+        rIdx[t].multiplyBy(ni);
+        idx[t] += rIdx[t];
+      }
+      FHE_EXEC_RANGE_END
+      val.swap(mx);
+    }
+
+  vecCopy(max, val);
+  vecCopy(argmax, idx);
+}
@@ -0,0 +1,60 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _BINARY_SORT_H_
+#define _BINARY_SORT_H_
+/**
+ * @file binarySort.h
+ * @brief Sorting and top-k selection of integers in binary representation.
+ *
+ * The numbers are sorted by comparator networks. All the compare-exchange
+ * operations of one stage of a network are independent, and they are made
+ * with a single call to compareManyNumbers, which runs them together on
+ * the thread pool and bootstraps them together when they run out of levels.
+ **/
+#include <utility>
+#include "EncryptedArray.h"
+#include "CtPtrs.h" //  defines CtPtrs, CtPtrMat
+
+//! The comparator networks for sortNumbers
+enum SortNetwork {
+  SORT_BITONIC,       //!< Batcher's bitonic sort
+  SORT_ODD_EVEN_MERGE //!< Batcher's odd-even merge sort (fewer comparators)
+};
+
+//! @brief The stages of the network that sorts n items. Each stage is a
+//! list of pairs (i,j) with i<j, no index appears twice in a stage, and
+//! for each pair the smaller item goes to i and the larger one to j.
+void sortingNetworkStages(std::vector< std::vector<std::pair<long,long>> >&
+                          stages, long n, SortNetwork net=SORT_ODD_EVEN_MERGE);
+
+//! @brief Sort the rows of numbers in increasing order, in place. A row
+//! keeps its size if the number that lands in it fits, otherwise it grows
+//! (so rows of different sizes must be resizable).
+void sortNumbers(CtPtrMat& numbers, SortNetwork net=SORT_ODD_EVEN_MERGE,
+                 std::vector<zzX>* unpackSlotEncoding=nullptr);
+
+//! @brief Set top to the k largest numbers, in decreasing order (or to all
+//! of them if there are no more than k). Uses a tournament of sorted blocks
+//! of size k, merging two blocks and keeping their top k in each round.
+void topKNumbers(CtPtrMat& top, const CtPtrMat& numbers, long k,
+                 std::vector<zzX>* unpackSlotEncoding=nullptr);
+
+//! @brief The maximum over the slots of the bit-sliced number a, and the
+//! index of a slot that holds it, both in all the slots. A tournament
+//! along each dimension of the hypercube in turn: every round compares the
+//! number with itself rotated by 1,2,4,... and keeps the larger one, with
+//! its index (selected by the ni output of the comparison). With ties,
+//! different slots may end up with the indexes of different maximal slots.
+void maxInSlots(CtPtrs& max, CtPtrs& argmax, const CtPtrs& a,
+                std::vector<zzX>* unpackSlotEncoding=nullptr);
+
+#endif // ifndef _BINARY_SORT_H_
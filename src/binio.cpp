@@ -12,6 +12,19 @@
 #include "binio.h"
 #include <cassert>
 #include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <atomic>
+#if (defined(__unix__) || defined(__APPLE__))
+#define FHE_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 NTL_CLIENT
 /* Some utility functions for binary IO */
@@ -65,6 +78,16 @@ void write_ntl_vec_long(ostream& str, const vec_long& vl, long intSize)
   }
 }
 
+void write_raw_long_array(ostream& str, const long* a, long len, long intSize)
+{
+  write_raw_int(str, len, BINIO_32BIT); 
+  write_raw_int(str, intSize, BINIO_32BIT); 
+
+  for(long i=0; i<len; i++){
+    write_raw_int(str, a[i], intSize); 
+  }
+}
+
 void read_ntl_vec_long(istream& str, vec_long& vl)
 {
   long sizeOfVL = read_raw_int(str, BINIO_32BIT);
@@ -80,6 +103,135 @@ void read_ntl_vec_long(istream& str, vec_long& vl)
   }
 }
 
+void read_raw_long_array(istream& str, long* a, long len)
+{
+  long sizeOfVL = read_raw_int(str, BINIO_32BIT);
+  long intSize  = read_raw_int(str, BINIO_32BIT);
+
+  if(sizeOfVL != len)
+    Error("read_raw_long_array: stored length does not match");
+
+  for(long i=0; i<len; i++){
+    a[i] = read_raw_int(str, intSize);
+  }
+}
+
+// The packed arrays are a little-endian bit-stream, value i occupying bits
+// [i*nBits, (i+1)*nBits). They are packed and unpacked through a 64-bit
+// accumulator, a whole word at a time, so the inner loops have no per-byte
+// work and no branches that depend on the data.
+
+static inline void store64le(unsigned char* p, uint64_t w)
+{
+  for (long j=0; j<8; j++) p[j] = (unsigned char)(w >> 8*j); // one store
+}
+
+static inline uint64_t load64le(const unsigned char* p)
+{
+  uint64_t w = 0;
+  for (long j=0; j<8; j++) w |= ((uint64_t) p[j]) << 8*j; // one load
+  return w;
+}
+
+// buf has room for nBytes plus 8 bytes of spill-over
+static void packLongs(unsigned char* buf, const long* a, long len, long nBits)
+{
+  uint64_t acc = 0;
+  long filled = 0; // bits in acc
+  for (long i=0; i<len; i++) {
+    uint64_t v = a[i];
+    assert(a[i] >= 0 && (v >> nBits) == 0);
+    acc |= v << filled;
+    if (filled + nBits < 64)
+      filled += nBits;
+    else {
+      store64le(buf, acc);
+      buf += 8;
+      acc = (filled == 0)? 0 : v >> (64-filled);
+      filled += nBits - 64;
+    }
+  }
+  if (filled > 0) store64le(buf, acc);
+}
+
+// buf holds nBytes plus 8 zero bytes
+static void unpackLongs(long* a, const unsigned char* buf, long len,
+                        long nBits)
+{
+  uint64_t mask = (1UL << nBits) - 1UL;
+  uint64_t acc = 0;
+  long avail = 0; // bits left in acc
+  for (long i=0; i<len; i++) {
+    if (avail >= nBits) {
+      a[i] = acc & mask;
+      acc >>= nBits;
+      avail -= nBits;
+    }
+    else {
+      uint64_t w = load64le(buf);
+      buf += 8;
+      a[i] = (acc | (w << avail)) & mask;
+      long used = nBits - avail;
+      acc = w >> used;
+      avail = 64 - used;
+    }
+  }
+}
+
+void write_packed_long_array(ostream& str, const long* a, long len, long nBits)
+{
+  assert(nBits >= 1 && nBits <= 63);
+  write_raw_int(str, len, BINIO_32BIT);
+  write_raw_int(str, nBits, BINIO_32BIT);
+
+  long nBytes = (len*nBits + 7)/8;
+  std::vector<unsigned char> buf(nBytes + 8, 0);
+  packLongs(buf.data(), a, len, nBits);
+  str.write(reinterpret_cast<const char*>(buf.data()), nBytes);
+}
+
+// Read the data of a packed array, after its length and bit width
+static void read_packed_data(istream& str, long* a, long len, long nBits)
+{
+  if(nBits < 1 || nBits > 63)
+    Error("read_packed_long_array: bad bit width");
+
+  long nBytes = (len*nBits + 7)/8;
+  std::vector<unsigned char> buf(nBytes + 8, 0);
+  str.read(reinterpret_cast<char*>(buf.data()), nBytes);
+  unpackLongs(a, buf.data(), len, nBits);
+}
+
+void read_packed_long_array(istream& str, long* a, long len)
+{
+  long sizeOfVL = read_raw_int(str, BINIO_32BIT);
+  long nBits    = read_raw_int(str, BINIO_32BIT);
+
+  if(sizeOfVL != len)
+    Error("read_packed_long_array: stored length does not match");
+  read_packed_data(str, a, len, nBits);
+}
+
+void write_residue_row(ostream& str, const long* a, long len, long nBits)
+{
+  if (nBits == BINIO_64BIT) nBits++; // not to be read as 8-byte integers
+  write_packed_long_array(str, a, len, nBits);
+}
+
+void read_residue_row(istream& str, long* a, long len)
+{
+  long sizeOfVL = read_raw_int(str, BINIO_32BIT);
+  long width    = read_raw_int(str, BINIO_32BIT);
+
+  if(sizeOfVL != len)
+    Error("read_residue_row: stored length does not match");
+  if (width == BINIO_64BIT) // from write_raw_long_array
+    for(long i=0; i<len; i++)
+      a[i] = read_raw_int(str, BINIO_64BIT);
+  else
+    read_packed_data(str, a, len, width);
+}
+
 void write_raw_double(ostream& str, const double d)
 {
   // FIXME: this is not portable: 
@@ -178,3 +330,256 @@ template<> void write_raw_vector<double>(ostream& str, const vector<double>& v)
   for(long n: v)
     write_raw_double(str, n); 
 };
+
+template<> void write_raw_vector<vec_long>(ostream& str, const vector<vec_long>& v)
+{
+  vector<long> zz; // zigzag-mapped, so small negative values stay small
+  unsigned long all = 1;
+  for (const vec_long& x: v)
+    for (long i=0; i<x.length(); i++) {
+      unsigned long z = (static_cast<unsigned long>(x[i]) << 1) ^ (x[i] >> 63);
+      zz.push_back(z);
+      all |= z;
+    }
+  long nBits = 0;
+  while (nBits < 64 && (all >> nBits) != 0) nBits++;
+
+  write_raw_int(str, v.size());
+  for (const vec_long& x: v)
+    write_raw_int(str, x.length(), BINIO_32BIT);
+  if (nBits > 63) { // only when some value needs all 64 bits
+    write_raw_int(str, 0, BINIO_32BIT);
+    for (long z: zz) write_raw_int(str, z);
+  }
+  else {
+    write_raw_int(str, nBits, BINIO_32BIT);
+    write_packed_long_array(str, zz.data(), zz.size(), nBits);
+  }
+}
+
+template<> void read_raw_vector<vec_long>(istream& str, vector<vec_long>& v)
+{
+  long sz = read_raw_int(str);
+  v.resize(sz);
+  long total = 0;
+  for (vec_long& x: v) {
+    x.SetLength(read_raw_int(str, BINIO_32BIT));
+    total += x.length();
+  }
+
+  vector<long> zz(total);
+  if (read_raw_int(str, BINIO_32BIT) == 0)
+    for (long& z: zz) z = read_raw_int(str);
+  else
+    read_packed_long_array(str, zz.data(), total);
+
+  long k = 0;
+  for (vec_long& x: v)
+    for (long i=0; i<x.length(); i++, k++) {
+      unsigned long z = zz[k];
+      x[i] = static_cast<long>(z >> 1) ^ -static_cast<long>(z & 1);
+    }
+}
+
+unsigned long hashBytes(const void* data, long len)
+{
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  uint64_t h = 14695981039346656037ULL;
+  for (long i=0; i<len; i++) {
+    h ^= bytes[i];
+    h *= 1099511628211ULL;
+  }
+  return (unsigned long) h;
+}
+
+//======================== Scatter-gather messages ========================
+
+void WireMessage::setHeader(const string& meta)
+{
+  header.assign(BINIO_WIRE_PREFIX_SIZE, '\0');
+  header += meta;
+  body.clear();
+}
+
+void WireMessage::finish()
+{
+  ostringstream prefix;
+  writeEyeCatcher(prefix, BINIO_EYE_WIRE_BEGIN);
+  write_raw_int(prefix, header.size() - BINIO_WIRE_PREFIX_SIZE);
+  write_raw_int(prefix, bodySize());
+  header.replace(0, BINIO_WIRE_PREFIX_SIZE, prefix.str());
+}
+
+void WireMessage::segments(vector<WireSegment>& all) const
+{
+  all.clear();
+  all.push_back(WireSegment{header.data(), long(header.size())});
+  all.insert(all.end(), body.begin(), body.end());
+}
+
+long WireMessage::bodySize() const
+{
+  long len = 0;
+  for (const WireSegment& seg: body) len += seg.len;
+  return len;
+}
+
+void readWirePrefix(const char* prefix, long& metaSize, long& bodySize)
+{
+  istringstream str(string(prefix, BINIO_WIRE_PREFIX_SIZE));
+  if (readEyeCatcher(str, BINIO_EYE_WIRE_BEGIN) != 0)
+    throw std::runtime_error("readWirePrefix: not a message header");
+  metaSize = read_raw_int(str);
+  bodySize = read_raw_int(str);
+  if (metaSize < 0 || bodySize < 0)
+    throw std::runtime_error("readWirePrefix: corrupt header");
+}
+
+string wireMetadata(const string& header, long& bodySize)
+{
+  long metaSize;
+  if (long(header.size()) < BINIO_WIRE_PREFIX_SIZE)
+    throw std::runtime_error("wireMetadata: header too short");
+  readWirePrefix(header.data(), metaSize, bodySize);
+  if (long(header.size()) != BINIO_WIRE_PREFIX_SIZE + metaSize)
+    throw std::runtime_error("wireMetadata: wrong header size");
+  return header.substr(BINIO_WIRE_PREFIX_SIZE);
+}
+
+static const long wireMarker = 0x0102030405060708L;
+
+void writeWireRows(ostream& meta, long rowLen)
+{
+  meta.write(reinterpret_cast<const char*>(&wireMarker), sizeof(long));
+  write_raw_int(meta, rowLen);
+}
+
+void readWireRows(istream& meta, long rowLen)
+{
+  long marker = 0;
+  meta.read(reinterpret_cast<char*>(&marker), sizeof(long));
+  if (marker != wireMarker)
+    throw std::runtime_error("readWireRows: wrong endianness");
+  if (read_raw_int(meta) != rowLen)
+    throw std::runtime_error("readWireRows: wrong row length");
+}
+
+void appendWireSegment(vector<WireSegment>& v, const void* data, long len)
+{
+  const char* p = static_cast<const char*>(data);
+  if (!v.empty() && static_cast<const char*>(v.back().data)+v.back().len == p)
+    v.back().len += len;
+  else
+    v.push_back(WireSegment{data, len});
+}
+
+void appendWireBuffer(vector<WireBuffer>& v, void* data, long len)
+{
+  char* p = static_cast<char*>(data);
+  if (!v.empty() && static_cast<char*>(v.back().data)+v.back().len == p)
+    v.back().len += len;
+  else
+    v.push_back(WireBuffer{data, len});
+}
+
+string resolveBinaryPath(const string& name, bool forWriting)
+{
+  if (name.compare(0, 4, "shm:") != 0) return name;
+  string path = string(FHE_SHM_DIR) + "/" + name.substr(4);
+#ifdef FHE_HAVE_MMAP
+  if (forWriting) { // create the directories of NAME, one at a time
+    long start = strlen(FHE_SHM_DIR) + 1;
+    for (size_t slash = path.find('/', start); slash != string::npos;
+         slash = path.find('/', slash+1)) {
+      string dir = path.substr(0, slash);
+      if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+        throw std::runtime_error("resolveBinaryPath: cannot create "+dir);
+    }
+  }
+#endif
+  return path;
+}
+
+string tempBinaryPath(const string& path)
+{
+  static std::atomic<long> counter(0);
+  ostringstream name;
+  name << path << ".tmp";
+#ifdef FHE_HAVE_MMAP
+  name << "." << long(getpid());
+#endif
+  name << "." << counter++;
+  return name.str();
+}
+
+// Mappings of at least this many bytes are advised to use huge pages
+static const long hugePageThreshold = 1L << 21;
+
+shared_ptr<const void> mapBinaryFile(const string& name, long& len)
+{
+  string fname = resolveBinaryPath(name);
+#ifdef FHE_HAVE_MMAP
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("mapBinaryFile: cannot open "+fname);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("mapBinaryFile: cannot stat "+fname);
+  }
+  len = st.st_size;
+  if (len == 0) { // mmap rejects empty mappings
+    close(fd);
+    throw std::runtime_error("mapBinaryFile: empty file "+fname);
+  }
+  void *addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // the mapping stays valid
+  if (addr == MAP_FAILED)
+    throw std::runtime_error("mapBinaryFile: cannot map "+fname);
+#ifdef MADV_HUGEPAGE
+  if (len >= hugePageThreshold) madvise(addr, len, MADV_HUGEPAGE); // a hint
+#endif
+
+  size_t mapLen = len;
+  return shared_ptr<const void>(addr,
+           [mapLen](const void* p) { munmap(const_cast<void*>(p), mapLen); });
+#else
+  // No mmap, read the whole file into one (page-aligned) buffer instead
+  ifstream str(fname, ios::binary | ios::ate);
+  if (!str)
+    throw std::runtime_error("mapBinaryFile: cannot open "+fname);
+  len = str.tellg();
+  str.seekg(0);
+
+  long nLongs = (len + sizeof(long) - 1)/sizeof(long)
+    + BINIO_PAGE_SIZE/sizeof(long);
+  shared_ptr<long> buf(new long[nLongs], std::default_delete<long[]>());
+  uintptr_t addr = reinterpret_cast<uintptr_t>(buf.get());
+  char *start = reinterpret_cast<char*>(buf.get())
+    + (BINIO_PAGE_SIZE - addr % BINIO_PAGE_SIZE) % BINIO_PAGE_SIZE;
+  str.read(start, len);
+  if (!str)
+    throw std::runtime_error("mapBinaryFile: error reading "+fname);
+  return shared_ptr<const void>(buf, start); // aliasing constructor
+#endif
+}
+
+void adviseBinaryMapping(const void* addr, long len, bool willNeed)
+{
+#ifdef FHE_HAVE_MMAP
+  static const uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = reinterpret_cast<uintptr_t>(addr);
+  uintptr_t end = start + len;
+  if (willNeed) { // all the pages that the range touches
+    start -= start % page;
+    end = ((end + page - 1) / page) * page;
+  }
+  else {          // only those it covers
+    start = ((start + page - 1) / page) * page;
+    end -= end % page;
+  }
+  if (start < end)
+    madvise(reinterpret_cast<void*>(start), end - start,
+            willNeed? MADV_WILLNEED : MADV_DONTNEED); // only a hint
+#endif
+}
@@ -13,6 +13,8 @@
 #define  _BINIO_H_
 #include <iostream>
 #include <vector>
+#include <string>
+#include <memory>
 #include <type_traits>
 #include <NTL/xdouble.h>
 #include <NTL/vec_long.h>
@@ -29,12 +31,43 @@
 #define BINIO_EYE_CONTEXT_END       "]CN|"
 #define BINIO_EYE_CTXT_BEGIN        "|CX["
 #define BINIO_EYE_CTXT_END          "]CX|"
+#define BINIO_EYE_CTXT_COMPACT_BEGIN "|CC["
+#define BINIO_EYE_CTXT_COMPACT_END   "]CC|"
 #define BINIO_EYE_PK_BEGIN          "|PK["
 #define BINIO_EYE_PK_END            "]PK|"
 #define BINIO_EYE_SK_BEGIN          "|SK["
 #define BINIO_EYE_SK_END            "]SK|"
 #define BINIO_EYE_SKM_BEGIN         "|KM["
 #define BINIO_EYE_SKM_END           "]KM|"
+#define BINIO_EYE_KEYFILE_BEGIN     "|KF["
+#define BINIO_EYE_KEYFILE_END       "]KF|"
+#define BINIO_EYE_MMCACHE_BEGIN     "|MC["
+#define BINIO_EYE_MMCACHE_END       "]MC|"
+#define BINIO_EYE_MATMUL_BEGIN      "|MM["
+#define BINIO_EYE_MATMUL_END        "]MM|"
+#define BINIO_EYE_RECRYPT_BEGIN     "|RD["
+#define BINIO_EYE_RECRYPT_END       "]RD|"
+#define BINIO_EYE_SNAPSHOT_BEGIN    "|SN["
+#define BINIO_EYE_ALMOD_BEGIN       "|AM["
+#define BINIO_EYE_ALMOD_END         "]AM|"
+#define BINIO_EYE_ARCHIVE_BEGIN     "|CA["
+#define BINIO_EYE_ARCHIVE_END       "]CA|"
+#define BINIO_EYE_ARCHIVE_CHUNK     "|CK["
+#define BINIO_EYE_ARCHIVE_INDEX     "|CI["
+#define BINIO_EYE_WIRE_BEGIN        "|WR["
+#define BINIO_EYE_KEYINDEX_BEGIN    "|KX["
+#define BINIO_EYE_KEYINDEX_END      "]KX|"
+#define BINIO_EYE_CHECKPOINT_BEGIN  "|CP["
+#define BINIO_EYE_CHECKPOINT_END    "]CP|"
+#define BINIO_EYE_DATASET_BEGIN     "|CD["
+#define BINIO_EYE_DATASET_END       "]CD|"
+#define BINIO_EYE_PIR_BEGIN         "|PI["
+#define BINIO_EYE_PIR_END           "]PI|"
+#define BINIO_EYE_TRACE_BEGIN       "|TR["
+#define BINIO_EYE_TRACE_END         "]TR|"
+
+// Data areas in memory-mapped files start on this boundary
+#define BINIO_PAGE_SIZE 4096
 
 /* This struct (or similar) is a nice to have not used at the moment. */
 //struct BinaryHeader {
@@ -52,6 +85,24 @@ void writeEyeCatcher(std::ostream& str, const char* eye);
 void write_ntl_vec_long(std::ostream& str, const NTL::vec_long& vl, long intSize=BINIO_64BIT);
 void read_ntl_vec_long(std::istream& str, NTL::vec_long& vl);
 
+// Same format as write/read_ntl_vec_long, but for a raw array of len longs.
+// The read function raises an error if the stored length is not len.
+void write_raw_long_array(std::ostream& str, const long* a, long len, long intSize=BINIO_64BIT);
+void read_raw_long_array(std::istream& str, long* a, long len);
+
+// Write len values in [0,2^nBits) using exactly nBits bits each (rounded up
+// to a whole number of bytes for the whole array), 1 <= nBits <= 63.
+// The read function raises an error if the stored length is not len.
+void write_packed_long_array(std::ostream& str, const long* a, long len, long nBits);
+void read_packed_long_array(std::istream& str, long* a, long len);
+
+// The rows of residues in DoubleCRT::write: packed at nBits (the width of
+// the prime), except that a width of 8 is written as 9 so it is never
+// mistaken for the 8-byte ints of write_raw_long_array. The read function
+// takes rows in either format, so the files of older versions still load.
+void write_residue_row(std::ostream& str, const long* a, long len, long nBits);
+void read_residue_row(std::istream& str, long* a, long len);
+
 long read_raw_int(std::istream& str, long intSize=BINIO_64BIT);
 void write_raw_int(std::ostream& str, long num, long intSize=BINIO_64BIT);
 
@@ -100,6 +151,107 @@ template<> void read_raw_vector<long>(std::istream& str, std::vector<long>& v);
 // vector<double> has a different implementation, since double.read does not work
 template<> void read_raw_vector<double>(std::istream& str, std::vector<double>& v);
 
+// vector<vec_long> (e.g., a table of zzX's) is written compactly: all the
+// coefficients, mapped to non-negative values (0,-1,1,-2,... to 0,1,2,3,...),
+// are packed with the bit width of the largest one
+template<> void write_raw_vector<NTL::vec_long>(std::ostream& str, const std::vector<NTL::vec_long>& v);
+template<> void read_raw_vector<NTL::vec_long>(std::istream& str, std::vector<NTL::vec_long>& v);
+
+// A 64-bit FNV-1a hash of len bytes, to validate the contents of files
+unsigned long hashBytes(const void* data, long len);
+
+// The files that are mapped into memory (keys, caches, context snapshots)
+// can also be named "shm:NAME", for the POSIX shared-memory object NAME
+// (the file NAME in FHE_SHM_DIR). All the processes that map it share the
+// same physical pages. This returns the path of such a name, other names
+// are returned as they are. NAME may contain directories (e.g. a cacheDir
+// "shm:DIR"): with forWriting, those under FHE_SHM_DIR are created if they
+// do not exist yet. Only the file formats that are already mapped are
+// shared this way; KeySwitch, DoubleCRT and ConstMultiplierCache objects
+// that are built in memory stay private to their process.
+#ifndef FHE_SHM_DIR
+#define FHE_SHM_DIR "/dev/shm"
+#endif
+std::string resolveBinaryPath(const std::string& name,
+                              bool forWriting=false);
+
+// A name for a temporary file next to path, which no other process or
+// thread gets at the same time. Writers of mapped files write there, then
+// rename it to path, so that readers never map a partially written file.
+std::string tempBinaryPath(const std::string& path);
+
+// Map the whole file into memory, read-only (where mmap is not available,
+// read it into a buffer instead). The data starts on a BINIO_PAGE_SIZE
+// boundary and stays valid as long as the returned handle, or a copy of it,
+// exists. Large mappings are advised to use huge pages, which shared memory
+// honors when it is configured for them. Raises std::runtime_error if the
+// file cannot be read.
+std::shared_ptr<const void> mapBinaryFile(const std::string& fname, long& len);
+
+// Hints for the pages of [addr, addr+len) in a mapping of mapBinaryFile:
+// with willNeed, read them in the background; otherwise they may be
+// dropped from memory (only the pages entirely in the range), and are
+// read again from the file if they are used after. Does nothing where the
+// file is not mapped.
+void adviseBinaryMapping(const void* addr, long len, bool willNeed);
+
+/* Scatter-gather messages, for sending the residues of a Ctxt or a
+   KeySwitch with writev/sendmsg and receiving them with readv/recvmsg,
+   without copying them through a stream. A message is a header (a fixed
+   size prefix with the sizes, then the metadata in the format of this
+   file) followed by the body: the residue rows, as native longs.
+   WireSegment and WireBuffer have the same fields as struct iovec. */
+
+// A piece of a message to send
+struct WireSegment {
+  const void* data;
+  long len;
+};
+
+// Where a piece of a received message goes
+struct WireBuffer {
+  void* data;
+  long len;
+};
+
+// eye-catcher, size of the rest of the header, size of the body
+#define BINIO_WIRE_PREFIX_SIZE (BINIO_EYE_SIZE + 16)
+
+class WireMessage {
+public:
+  std::string header;              // owned, prefix included
+  std::vector<WireSegment> body;   // points into the serialized object
+
+  // Start the header: a blank prefix, then the metadata in meta
+  void setHeader(const std::string& meta);
+  // Fill in the sizes in the prefix, once the body is complete
+  void finish();
+
+  // The header then the body, ready for writev
+  void segments(std::vector<WireSegment>& all) const;
+  long bodySize() const;
+  long size() const { return header.size() + bodySize(); }
+};
+
+// Parse the prefix of a message (BINIO_WIRE_PREFIX_SIZE bytes), giving the
+// sizes of the rest of the header and of the body. Raises runtime_error if
+// it is not a message header.
+void readWirePrefix(const char* prefix, long& metaSize, long& bodySize);
+
+// The metadata of a whole header (prefix included), after checking the
+// prefix, and the size of the body
+std::string wireMetadata(const std::string& header, long& bodySize);
+
+// The first fields of the metadata: an endianness marker (native) and the
+// length of the rows. The read function raises runtime_error if they do
+// not match this machine and rowLen.
+void writeWireRows(std::ostream& meta, long rowLen);
+void readWireRows(std::istream& meta, long rowLen);
+
+// Append a segment, merged with the last one if they are adjacent
+void appendWireSegment(std::vector<WireSegment>& v, const void* data, long len);
+void appendWireBuffer(std::vector<WireBuffer>& v, void* data, long len);
+
 // KeySwitch::read(...) (in FHE.cpp) requires the context.
 class FHEcontext;
 template<typename T> void read_raw_vector(std::istream& str, std::vector<T>& v, const FHEcontext& context)
@@ -22,25 +22,34 @@
 
 NTL_CLIENT
 
+// The chirp root^{i^2} goes from i to i+1 by one multiplication by
+// root^{2i+1}, which goes by one multiplication by root^2, so the tables
+// take O(n) multiplications rather than an exponentiation per entry.
+// Since root^e=1, this is also root^{i^2 mod e}.
+static void chirp(Vec<zz_p>& c, long n, const zz_p& root)
+{
+  c.SetLength(n);
+  zz_p step = root, root2 = root*root;
+  c[0] = 1;
+  for (long i=1; i<n; i++) {
+    mul(c[i], c[i-1], step); // c[i] = root^{i^2}
+    mul(step, step, root2);  // step = root^{2i+1}
+  }
+}
+
 void BluesteinInit(long n, const zz_p& root, zz_pX& powers, 
                    Vec<mulmod_precon_t>& powers_aux, fftRep& Rb)
 {
   long p = zz_p::modulus();
 
-  zz_p one; one=1;
-  powers.SetMaxLength(n);
-
   long e;
   if (n % 2 == 0)
     e = 2*n;
   else
     e = n;
 
-  SetCoeff(powers,0,one);
-  for (long i=1; i<n; i++) {
-    long iSqr = MulMod(i, i, e); // i^2 mod 2n
-    SetCoeff(powers,i, power(root,iSqr)); // powers[i] = root^{i^2}
-  }
+  chirp(powers.rep, n, root); // powers[i] = root^{i^2}
+  powers.normalize();
 
   // powers_aux tracks powers
   powers_aux.SetLength(n);
@@ -54,24 +63,19 @@ void BluesteinInit(long n, const zz_p& root, zz_pX& powers,
   Rb.SetSize(k);
 
   zz_pX b(INIT_SIZE, k2);
+  Vec<zz_p> ichirp;
+  chirp(ichirp, n, inv(root)); // ichirp[i] = root^{-i^2}
 
   if (NEW_BLUE && n == e) {
-    zz_p rInv = inv(root);
-    for (long i=0; i<n; i++) {
-      long iSqr = MulMod(i, i, e); // i^2 mod 2n
-      zz_p bi = power(rInv,iSqr);
-      SetCoeff(b,i,bi);              
-    }
+    for (long i=0; i<n; i++)
+      SetCoeff(b,i,ichirp[i]);
   }
   else {
-    zz_p rInv = inv(root);
-    SetCoeff(b,n-1,one); // b[n-1] = 1
+    SetCoeff(b,n-1,ichirp[0]); // b[n-1] = 1
     for (long i=1; i<n; i++) {
-      long iSqr = MulMod(i, i, e); // i^2 mod 2n
-      zz_p bi = power(rInv,iSqr);
       // b[n-1+i] = b[n-1-i] = root^{-i^2}
-      SetCoeff(b,n-1+i, bi); 
-      SetCoeff(b,n-1-i,bi);              
+      SetCoeff(b,n-1+i, ichirp[i]); 
+      SetCoeff(b,n-1-i, ichirp[i]);              
     }
   }
 
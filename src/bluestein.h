@@ -27,6 +27,10 @@
 * but this procedure is *NOT SCALED*, so BluesteinFFT(x,n,root,...) and
 * then BluesteinFFT(x,n,root^{-1},...) will result in x = n * x_original
 *
+* The inverse can also use the tables of root itself: the DFT with root^{-2}
+* of x is the DFT with root^2 of x', where x'_i = x_{-i mod n}. This is how
+* Cmodulus gets by with one set of tables per prime.
+*
 * The values powers, powers_aux, and Rb must be precomputed by first
 * calling BluesteinInit(n, root, powers, powers_aux, Rb).
 *
@@ -0,0 +1,240 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/**
+ * @file chebyshev.cpp
+ * @brief Evaluating approximations of real functions on CKKS ciphertexts.
+ */
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include "FHEContext.h"
+#include "timing.h"
+#include "chebyshev.h"
+
+NTL_CLIENT
+
+ChebyshevSeries::ChebyshevSeries(const std::function<double(double)>& f,
+                                 double a, double b, long d)
+  : lo(a), hi(b)
+{
+  assert(d>=0 && a<b);
+  const double pi = 4*std::atan(1);
+  long N = d+1;
+  std::vector<double> fx(N);
+  for (long k=0; k<N; k++) // sample f at the Chebyshev nodes
+    fx[k] = f(0.5*(b-a)*std::cos(pi*(k+0.5)/N) + 0.5*(a+b));
+
+  coeffs.assign(N, 0.0);
+  double maxAbs = 0.0;
+  for (long j=0; j<N; j++) {
+    double s = 0.0;
+    for (long k=0; k<N; k++) s += fx[k]*std::cos(pi*j*(k+0.5)/N);
+    coeffs[j] = ((j==0)? 1.0 : 2.0)*s/N;
+    maxAbs = std::max(maxAbs, std::abs(coeffs[j]));
+  }
+  for (double& c: coeffs) if (std::abs(c) <= 1e-12*maxAbs) c = 0.0;
+}
+
+ChebyshevSeries::ChebyshevSeries(const std::vector<double>& c,
+                                 double a, double b)
+  : lo(a), hi(b), coeffs(c)
+{
+  assert(a<b);
+  if (coeffs.empty()) coeffs.push_back(0.0);
+}
+
+long ChebyshevSeries::degree() const
+{
+  long d = lsize(coeffs)-1;
+  while (d>0 && coeffs[d]==0.0) d--;
+  return d;
+}
+
+ChebyshevSeries ChebyshevSeries::truncate(long d) const
+{
+  assert(d>=0);
+  std::vector<double> c(coeffs.begin(),
+                        coeffs.begin() + std::min(d+1, lsize(coeffs)));
+  return ChebyshevSeries(c, lo, hi);
+}
+
+double ChebyshevSeries::operator()(double x) const
+{
+  double y = (2*x - lo - hi)/(hi - lo);
+  double b1 = 0.0, b2 = 0.0; // b_{j+1}, b_{j+2}
+  for (long j=degree(); j>=1; j--) {
+    double b0 = 2*y*b1 - b2 + coeffs[j];
+    b2 = b1;
+    b1 = b0;
+  }
+  return y*b1 - b2 + coeffs[0];
+}
+
+const Ctxt& ChebyshevBasis::get(long j)
+{
+  assert(j>=1);
+  auto it = T.find(j);
+  if (it != T.end()) return it->second;
+
+  // T_{2n} = 2*T_n^2 - 1 and T_{2n+1} = 2*T_{n+1}*T_n - T_1
+  Ctxt t = get((j+1)/2);
+  if (j%2 == 0) {
+    t.square();
+    t.multByConstantCKKS(2.0);
+    t.addConstantCKKS(-1.0);
+  } else {
+    t.multiplyBy(get(j/2));
+    t.multByConstantCKKS(2.0);
+    t -= get(1);
+  }
+  return T.emplace(j, t).first->second;
+}
+
+long chebyshevMaxDegree(long depth)
+{
+  assert(depth>=0 && depth<NTL_BITS_PER_LONG-1);
+  return (1L<<depth) - 1;
+}
+
+long chebyshevBabySteps(long d)
+{
+  // With k=2^l baby steps and m=D-l giant steps, there are k-1
+  // multiplications for the baby steps, m for the giant steps and 2^m-1
+  // for combining them
+  long D = std::max(NTL::NumBits(d), 1L);
+  long best = 2, bestCost = LONG_MAX;
+  for (long l=1; l<=D; l++) {
+    long m = D-l;
+    long cost = ((1L<<l) - 1) + m + ((1L<<m) - 1);
+    if (cost < bestCost) {
+      bestCost = cost;
+      best = 1L<<l;
+    }
+  }
+  return best;
+}
+
+// res = sum_j c[j]*T_j for the j's with nonzero c[j] (including T_0=1)
+static void addScaled(Ctxt& res, bool& haveRes, const Ctxt& t, double c)
+{
+  Ctxt tmp = t;
+  if (c < 0) { // negate, so the scaling only changes the factor
+    tmp.negate();
+    c = -c;
+  }
+  tmp.multByConstantCKKS(c);
+  if (haveRes) res += tmp;
+  else {
+    res = tmp;
+    haveRes = true;
+  }
+}
+
+// Evaluate sum_j c[j]*T_j. Returns false if that is just the constant
+// c[0], in which case res is not touched.
+static bool evalRecursive(Ctxt& res, const std::vector<double>& c,
+                          ChebyshevBasis& T, long k)
+{
+  long d = lsize(c)-1;
+  while (d>0 && c[d]==0.0) d--;
+  if (d == 0) return false;
+
+  if (d < k) { // a linear combination of the baby steps
+    bool haveRes = false;
+    for (long j=1; j<=d; j++)
+      if (c[j] != 0.0) addScaled(res, haveRes, T.get(j), c[j]);
+    if (c[0] != 0.0) res.addConstantCKKS(c[0]);
+    return true;
+  }
+
+  long K = k; // the largest giant step with K <= d < 2K
+  while (2*K <= d) K *= 2;
+
+  // T_{K+n} = 2*T_K*T_n - T_{K-n}, so p = q*T_K + r with
+  // q = c_K + sum_{n>=1} 2*c_{K+n}*T_n and r = sum_{j<K} c_j*T_j
+  // - sum_{n>=1} c_{K+n}*T_{K-n}
+  std::vector<double> q(d-K+1), r(c.begin(), c.begin()+K);
+  q[0] = c[K];
+  for (long n=1; n<=d-K; n++) {
+    q[n] = 2*c[K+n];
+    r[K-n] -= c[K+n];
+  }
+
+  Ctxt qt(ZeroCtxtLike, T.y());
+  if (evalRecursive(qt, q, T, k))
+    qt.multiplyBy(T.get(K));
+  else { // q is a constant
+    bool haveRes = false;
+    addScaled(qt, haveRes, T.get(K), q[0]);
+  }
+
+  Ctxt rt(ZeroCtxtLike, T.y());
+  if (evalRecursive(rt, r, T, k)) qt += rt;
+  else if (r[0] != 0.0)           qt.addConstantCKKS(r[0]);
+  res = qt;
+  return true;
+}
+
+void evalChebyshev(Ctxt& res, const ChebyshevSeries& f, ChebyshevBasis& T,
+                   long k)
+{
+  FHE_TIMER_START;
+  long d = f.degree();
+  if (k<=0) k = chebyshevBabySteps(d);
+  assert((k & (k-1)) == 0); // a power of two
+
+  std::vector<double> c(f.getCoeffs().begin(), f.getCoeffs().begin()+d+1);
+  Ctxt tmp(ZeroCtxtLike, T.y());
+  if (!evalRecursive(tmp, c, T, k)) { // f is a constant
+    tmp = T.y();
+    tmp.multByConstant(NTL::ZZ::zero());
+    tmp.addConstantCKKS(c[0]);
+  }
+  res = tmp;
+}
+
+// Map x from [a,b] to y in [-1,1]
+static void mapToUnitInterval(Ctxt& y, const Ctxt& x, double a, double b)
+{
+  y = x;
+  if (a == -1.0 && b == 1.0) return;
+  double scale = 2.0/(b - a);
+  double shift = -(a + b)/(b - a);
+  if (scale != 1.0) y.multByConstantCKKS(scale);
+  if (shift != 0.0) y.addConstantCKKS(shift);
+}
+
+void evalChebyshev(Ctxt& res, const ChebyshevSeries& f, const Ctxt& x,
+                   long k)
+{
+  Ctxt y(ZeroCtxtLike, x);
+  mapToUnitInterval(y, x, f.a(), f.b());
+  ChebyshevBasis T(y);
+  evalChebyshev(res, f, T, k);
+}
+
+long evalApprox(Ctxt& res, const std::function<double(double)>& f,
+                double a, double b, const Ctxt& x, long maxDegree)
+{
+  FHE_TIMER_START;
+  Ctxt y(ZeroCtxtLike, x);
+  mapToUnitInterval(y, x, a, b);
+
+  long depth = std::min(ckksLevelsLeft(y), long(NTL_BITS_PER_LONG-2));
+  long d = std::min(std::max(maxDegree, 1L),
+                    std::max(chebyshevMaxDegree(depth), 1L));
+  ChebyshevSeries series(f, a, b, d);
+
+  ChebyshevBasis T(y);
+  evalChebyshev(res, series, T);
+  return d;
+}
@@ -0,0 +1,112 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _CHEBYSHEV_H_
+#define _CHEBYSHEV_H_
+/**
+ * @file chebyshev.h
+ * @brief Evaluating approximations of real functions on CKKS ciphertexts.
+ *
+ * A function f over an interval [a,b] is approximated by a Chebyshev
+ * series sum_j c_j T_j(y), with y=(2x-a-b)/(b-a) in [-1,1]. On [-1,1] all
+ * the T_j are bounded by one, so unlike the monomial coefficients of the
+ * same polynomial, the c_j are small and the encrypted evaluation is
+ * numerically stable.
+ *
+ * The series is evaluated with a baby-step/giant-step scheme. The baby
+ * steps are T_1,...,T_{k-1}, the giant steps are T_k, T_{2k}, T_{4k},...
+ * and the series is split recursively as p = q*T_K + r, using the identity
+ * T_{K+n} = 2*T_K*T_n - T_{K-n}. The multiplications by the (real)
+ * coefficients do not use levels, so a series of degree d is evaluated
+ * with depth at most NumBits(d), for about 2*sqrt(d) ciphertext
+ * multiplications, where Horner's rule would need d of each.
+ **/
+#include <functional>
+#include <map>
+#include <vector>
+#include "Ctxt.h"
+
+//! @class ChebyshevSeries
+//! @brief A Chebyshev approximation of a real function over [a,b]
+class ChebyshevSeries {
+  double lo, hi;               // the interval [lo,hi]
+  std::vector<double> coeffs;  // f(x) ~ sum_j coeffs[j]*T_j(y)
+
+public:
+  //! Interpolate f at the d+1 Chebyshev nodes of [a,b]. Coefficients that
+  //! are negligible next to the largest one are set to zero (e.g., the even
+  //! ones of an odd function), so they cost nothing when evaluated.
+  ChebyshevSeries(const std::function<double(double)>& f,
+                  double a, double b, long d);
+
+  //! A series with the given coefficients over [a,b]
+  ChebyshevSeries(const std::vector<double>& c, double a, double b);
+
+  double a() const { return lo; }
+  double b() const { return hi; }
+  const std::vector<double>& getCoeffs() const { return coeffs; }
+
+  //! The degree, ignoring zero leading coefficients
+  long degree() const;
+
+  //! The series truncated to degree at most d
+  ChebyshevSeries truncate(long d) const;
+
+  //! Evaluate the series on a cleartext x (using Clenshaw's recurrence)
+  double operator()(double x) const;
+};
+
+//! @class ChebyshevBasis
+//! @brief The values T_j(y) for an encrypted y, computed as needed.
+//! T_j is computed with depth NumBits(j-1) from T_{ceil(j/2)} and
+//! T_{floor(j/2)}, and kept for later.
+class ChebyshevBasis {
+  std::map<long, Ctxt> T; // T[j] = T_j(y), std::map keeps references valid
+
+public:
+  explicit ChebyshevBasis(const Ctxt& y) { T.emplace(1, y); }
+
+  //! Returns T_j(y), must have j>=1
+  const Ctxt& get(long j);
+  const Ctxt& y() const { return T.at(1); }
+};
+
+//! @brief An estimate of the number of multiplications that the CKKS
+//! ciphertext x can still afford, same as x.levelsLeft()
+inline long ckksLevelsLeft(const Ctxt& x) { return x.levelsLeft(); }
+
+//! The largest degree that the baby-step/giant-step evaluation can fit in
+//! the given depth (that is 2^depth -1)
+long chebyshevMaxDegree(long depth);
+
+//! The baby-step size k (a power of two) with the fewest multiplications
+//! for degree d
+long chebyshevBabySteps(long d);
+
+//! @brief Evaluate the series f on the encrypted x, any x in [f.a(),f.b()].
+//! @param[out] res to hold the result (may alias x)
+//! @param[in]  k   the number of baby steps, a power of two (0: default)
+void evalChebyshev(Ctxt& res, const ChebyshevSeries& f, const Ctxt& x,
+                   long k=0);
+
+//! @brief Same as evalChebyshev with the basis of T_j(y), where y is
+//! already mapped to [-1,1]. Several series over the same interval can
+//! share one basis.
+void evalChebyshev(Ctxt& res, const ChebyshevSeries& f, ChebyshevBasis& T,
+                   long k=0);
+
+//! @brief Approximate f over [a,b] and evaluate it on x, with the highest
+//! degree (at most maxDegree) that the levels left in x allow.
+//! @return the degree that was used
+long evalApprox(Ctxt& res, const std::function<double(double)>& f,
+                double a, double b, const Ctxt& x, long maxDegree=63);
+
+#endif // ifndef _CHEBYSHEV_H_
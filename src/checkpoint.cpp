@@ -0,0 +1,160 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* checkpoint.cpp - snapshots of ciphertexts, written in the background
+ *
+ * The layout of a snapshot file:
+ *   "|CP[", version (4 bytes), the number of the snapshot, the size of the
+ *   state, its hash, the state, a ctxt archive with the ciphertexts, "]CP|"
+ * PREFIX.latest holds the number of the latest snapshot, as text.
+ */
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <NTL/BasicThreadPool.h>
+#include "checkpoint.h"
+#include "ctxtArchive.h"
+#include "FHE.h"
+#include "binio.h"
+
+NTL_CLIENT
+
+static const long checkpointVersion = 1;
+
+// Replace fname by tmp, as atomically as the file system allows
+static void replaceFile(const string& tmp, const string& fname)
+{
+  if (rename(tmp.c_str(), fname.c_str()) != 0)
+    throw std::runtime_error("CtxtCheckpoint: cannot rename "+tmp);
+}
+
+CtxtCheckpoint::CtxtCheckpoint(const string& _prefix, long _keep,
+                               bool _compact, long _nThreads)
+  : prefix(_prefix), keep(max(_keep, 1L)), compact(_compact),
+    nThreads(max(_nThreads, 1L))
+{
+  seq = latest() + 1;
+}
+
+CtxtCheckpoint::~CtxtCheckpoint()
+{
+  try { wait(); }
+  catch (...) {} // the snapshot before it is still there
+}
+
+string CtxtCheckpoint::fileName(long n) const
+{ return prefix + "." + to_string(n); }
+
+long CtxtCheckpoint::latest() const
+{
+  ifstream str(prefix + ".latest");
+  long n = -1;
+  if (!(str >> n)) return -1;
+  return n;
+}
+
+bool CtxtCheckpoint::busy() const
+{
+  return writing.valid() && writing.wait_for(std::chrono::seconds(0))
+                            != std::future_status::ready;
+}
+
+void CtxtCheckpoint::wait()
+{
+  if (writing.valid()) writing.get(); // rethrows the error of the write
+}
+
+long CtxtCheckpoint::save(vector<Ctxt> cts, string state)
+{
+  wait();
+  long n = seq++;
+  auto c = make_shared< vector<Ctxt> >(std::move(cts));
+  auto s = make_shared<string>(std::move(state));
+  writing = std::async(std::launch::async, [this, n, c, s]() {
+    if (nThreads > 1) SetNumThreads(nThreads); // the pool of this thread
+    writeSnapshot(n, *c, *s);
+  });
+  return n;
+}
+
+void CtxtCheckpoint::writeSnapshot(long n, const vector<Ctxt>& cts,
+                                   const string& state) const
+{
+  string fname = fileName(n);
+  string tmp = fname + ".tmp";
+  {
+    ofstream str(tmp, ios::binary);
+    if (!str)
+      throw std::runtime_error("CtxtCheckpoint: cannot open "+tmp);
+    writeEyeCatcher(str, BINIO_EYE_CHECKPOINT_BEGIN);
+    write_raw_int(str, checkpointVersion, BINIO_32BIT);
+    write_raw_int(str, n);
+    write_raw_int(str, state.size());
+    write_raw_int(str, hashBytes(state.data(), state.size()));
+    str.write(state.data(), state.size());
+    writeCtxtArchive(str, cts, /*chunkSize=*/16, compact);
+    writeEyeCatcher(str, BINIO_EYE_CHECKPOINT_END);
+    str.flush();
+    if (!str)
+      throw std::runtime_error("CtxtCheckpoint: error writing "+tmp);
+  }
+  replaceFile(tmp, fname);
+
+  {
+    ofstream str(prefix + ".latest.tmp");
+    str << n << "\n";
+    str.flush();
+    if (!str)
+      throw std::runtime_error("CtxtCheckpoint: error writing "+prefix
+                               +".latest.tmp");
+  }
+  replaceFile(prefix + ".latest.tmp", prefix + ".latest");
+
+  if (n >= keep) remove(fileName(n-keep).c_str()); // may be gone already
+}
+
+void CtxtCheckpoint::read(long n, vector<Ctxt>& cts, string& state,
+                          const FHEPubKey& pubKey) const
+{
+  string fname = fileName(n);
+  ifstream str(fname, ios::binary);
+  if (!str)
+    throw std::runtime_error("CtxtCheckpoint: cannot open "+fname);
+  if (readEyeCatcher(str, BINIO_EYE_CHECKPOINT_BEGIN) != 0
+      || read_raw_int(str, BINIO_32BIT) != checkpointVersion
+      || read_raw_int(str) != n)
+    throw std::runtime_error("CtxtCheckpoint: not snapshot "+fname);
+
+  long len = read_raw_int(str);
+  unsigned long hash = read_raw_int(str);
+  if (!str || len < 0)
+    throw std::runtime_error("CtxtCheckpoint: corrupt snapshot "+fname);
+  string s(len, '\0');
+  str.read(&s[0], len);
+  if (!str || hashBytes(s.data(), len) != hash)
+    throw std::runtime_error("CtxtCheckpoint: corrupt snapshot "+fname);
+
+  vector<Ctxt> v;
+  readCtxtArchive(str, v, pubKey);
+  if (readEyeCatcher(str, BINIO_EYE_CHECKPOINT_END) != 0)
+    throw std::runtime_error("CtxtCheckpoint: corrupt snapshot "+fname);
+  cts.swap(v);
+  state.swap(s);
+}
+
+bool CtxtCheckpoint::resume(vector<Ctxt>& cts, string& state,
+                            const FHEPubKey& pubKey) const
+{
+  long n = latest();
+  if (n < 0) return false;
+  read(n, cts, state, pubKey);
+  return true;
+}
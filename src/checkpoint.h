@@ -0,0 +1,94 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+/**
+ * @file checkpoint.h
+ * @brief Checkpoints of long computations, written in the background.
+ *
+ * A CtxtCheckpoint saves snapshots of a set of ciphertexts, together with
+ * a string that the caller uses to describe how far the computation got,
+ * to the files PREFIX.N (N=0,1,2,...). The ciphertexts are copied (or
+ * moved) when save() is called and written by a background thread, so
+ * the computation can go on at once. Each snapshot is written to a
+ * temporary file that is renamed when it is complete, then the file
+ * PREFIX.latest is updated to point to it, so a crash at any point leaves
+ * the latest complete snapshot readable. Only the last few snapshots are
+ * kept.
+ *
+ * The ciphertexts are stored as a ctxt archive (see ctxtArchive.h), so a
+ * damaged snapshot is detected when it is read. Errors raise
+ * std::runtime_error, those of a background write are raised by the next
+ * call to wait() or save().
+ **/
+#include <vector>
+#include <string>
+#include <future>
+#include "Ctxt.h"
+
+class FHEPubKey;
+
+//! @class CtxtCheckpoint
+//! @brief Snapshots of ciphertexts and user state, for checkpoint/resume
+class CtxtCheckpoint {
+  std::string prefix;
+  long keep;
+  bool compact;
+  long nThreads;
+  long seq;                  // the number of the next snapshot
+  std::future<void> writing; // the write in progress, if any
+
+  void writeSnapshot(long n, const std::vector<Ctxt>& cts,
+                     const std::string& state) const;
+
+public:
+  //! @param keep      how many snapshots to keep on disk (at least 1)
+  //! @param compact   write the ciphertexts with Ctxt::writeCompact
+  //! @param nThreads  the size of the NTL thread pool of the writer
+  //! Numbering starts after the latest snapshot that is already there.
+  explicit CtxtCheckpoint(const std::string& _prefix, long _keep=2,
+                          bool _compact=false, long _nThreads=1);
+
+  //! Waits for the write in progress (ignoring its errors)
+  ~CtxtCheckpoint();
+
+  CtxtCheckpoint(const CtxtCheckpoint&) = delete;
+  CtxtCheckpoint& operator=(const CtxtCheckpoint&) = delete;
+
+  //! @brief Start writing a snapshot of cts and state in the background,
+  //! after the previous one is done. Returns the number of the snapshot.
+  //! Pass the ciphertexts with std::move to avoid copying them.
+  long save(std::vector<Ctxt> cts, std::string state);
+
+  //! Wait for the write in progress, and raise its error if it failed
+  void wait();
+
+  //! Is a snapshot being written?
+  bool busy() const;
+
+  //! The number of the latest complete snapshot, -1 if there is none
+  long latest() const;
+
+  //! The file name of snapshot n
+  std::string fileName(long n) const;
+
+  //! @brief Read the latest complete snapshot. Returns false (and leaves
+  //! cts and state alone) if there is none.
+  bool resume(std::vector<Ctxt>& cts, std::string& state,
+              const FHEPubKey& pubKey) const;
+
+  //! @brief Read snapshot n
+  void read(long n, std::vector<Ctxt>& cts, std::string& state,
+            const FHEPubKey& pubKey) const;
+};
+
+#endif // ifndef _CHECKPOINT_H_
@@ -0,0 +1,349 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <atomic>
+#include <cassert>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include "circuit.h"
+#include "FHE.h"
+#include "CtPtrs.h"
+
+NTL_CLIENT
+
+static std::atomic<CircuitHook*> circuitHook(NULL);
+
+// Nesting depth of the operations seen by the hook on this thread
+static thread_local long circuitDepth = 0;
+
+// Number of CircuitPause objects alive. Recryptions run some of their
+// operations on other threads, so pausing is global.
+static std::atomic_long circuitPaused(0);
+
+void setCircuitHook(CircuitHook *hook) { circuitHook = hook; }
+CircuitHook *getCircuitHook() { return circuitHook; }
+
+const char* circuitOpName(CircuitOp op)
+{
+  switch (op) {
+  case CIRCUIT_INPUT:     return "input";
+  case CIRCUIT_ADD:       return "add";
+  case CIRCUIT_MULTIPLY:  return "multiply";
+  case CIRCUIT_CONSTANT:  return "constant";
+  case CIRCUIT_AUTOMORPH: return "automorph";
+  case CIRCUIT_RECRYPT:   return "recrypt";
+  default: return "unknown";
+  }
+}
+
+static double capacityInBits(const Ctxt& c)
+{ return c.capacity()/log(2.0); }
+
+long CtxtCircuit::countOps(CircuitOp op) const
+{
+  long count = 0;
+  for (const CircuitNode& node: nodes)
+    if (node.op == op) count++;
+  return count;
+}
+
+ostream& operator<<(ostream& str, const CtxtCircuit& circ)
+{
+  str << "[circuit of " << circ.size() << " nodes:";
+  for (long op: range(CIRCUIT_OP_COUNT))
+    str << " " << circuitOpName(CircuitOp(op)) << "="
+        << circ.countOps(CircuitOp(op));
+  return str << "]";
+}
+
+//======================== CircuitProbe ========================
+
+CircuitProbe::CircuitProbe(CircuitOp _op, Ctxt& self, const Ctxt** other)
+  : hook(getCircuitHook()), op(_op)
+{
+  if (hook == NULL) return;
+  if (circuitDepth > 0 || circuitPaused > 0 || (self.isEmpty() &&
+      (other == NULL || *other == NULL || (*other)->isEmpty()))) {
+    hook = NULL; // part of another operation, or nothing to see
+    return;
+  }
+  circuitDepth++;
+  cts.push_back(&self);
+  hook->before(op, self, other);
+}
+
+CircuitProbe::CircuitProbe(CircuitOp _op, const vector<Ctxt*>& _cts)
+  : hook(getCircuitHook()), op(_op)
+{
+  if (hook == NULL) return;
+  if (circuitDepth > 0 || circuitPaused > 0) {
+    hook = NULL;
+    return;
+  }
+  circuitDepth++;
+  for (Ctxt *c: _cts)
+    if (!c->isEmpty()) {
+      cts.push_back(c);
+      hook->before(op, *c, NULL);
+    }
+  if (op == CIRCUIT_RECRYPT) circuitPaused++; // its work uses other threads
+}
+
+CircuitProbe::~CircuitProbe()
+{
+  if (hook == NULL) return;
+  if (op == CIRCUIT_RECRYPT) circuitPaused--;
+  circuitDepth--;
+  for (Ctxt *c: cts) hook->after(op, *c);
+}
+
+CircuitPause::CircuitPause() { circuitPaused++; }
+CircuitPause::~CircuitPause() { circuitPaused--; }
+
+//======================== CircuitRecorder ========================
+
+long CircuitRecorder::nodeOf(const Ctxt& c)
+{
+  long node = c.getCircuitNode();
+  if (node < 0 || node >= circ.size()) { // not computed by this circuit
+    CircuitNode input;
+    input.capacity = capacityInBits(c);
+    node = circ.size();
+    circ.nodes.push_back(input);
+    c.setCircuitNode(node);
+  }
+  return node;
+}
+
+void CircuitRecorder::before(CircuitOp op, Ctxt& self, const Ctxt** other)
+{
+  lock_guard<mutex> lock(mx);
+  vector<long>& inputs = pending[&self];
+  inputs.clear();
+  if (!self.isEmpty()) inputs.push_back(nodeOf(self));
+  if (other && *other && !(*other)->isEmpty() && *other != &self)
+    inputs.push_back(nodeOf(**other));
+}
+
+void CircuitRecorder::after(CircuitOp op, Ctxt& self)
+{
+  lock_guard<mutex> lock(mx);
+  CircuitNode node;
+  node.op = op;
+  auto it = pending.find(&self);
+  if (it != pending.end()) {
+    node.inputs = it->second;
+    pending.erase(it);
+  }
+
+  double before = 0;
+  for (long i: range(node.inputs.size())) {
+    double cap = circ.nodes[node.inputs[i]].capacity;
+    if (i == 0 || cap < before) before = cap;
+  }
+  node.capacity = self.isEmpty()? before : capacityInBits(self);
+  if (!node.inputs.empty()) node.spent = before - node.capacity;
+
+  self.setCircuitNode(circ.size());
+  circ.nodes.push_back(node);
+}
+
+void CircuitRecorder::clear()
+{
+  lock_guard<mutex> lock(mx);
+  circ.clear();
+  pending.clear();
+}
+
+//======================== planRecryptions ========================
+
+long RecryptPlan::recryptions() const
+{
+  long count = 0;
+  for (const vector<long>& batch: batches) count += batch.size();
+  return count;
+}
+
+ostream& operator<<(ostream& str, const RecryptPlan& plan)
+{
+  str << "[" << plan.recryptions() << " recryptions in "
+      << plan.batches.size() << " batches";
+  if (!plan.feasible) str << ", infeasible";
+  for (long i: range(plan.batches.size())) {
+    str << "\n  after node " << plan.points[i] << ":";
+    for (long node: plan.batches[i]) str << " " << node;
+  }
+  return str << "]";
+}
+
+bool planRecryptions(RecryptPlan& plan, const CtxtCircuit& circ,
+                     double bootCapacity, double minCapacity)
+{
+  long n = circ.size();
+  plan.batches.clear();
+  plan.points.clear();
+  plan.capacity.assign(n, 0.0);
+  plan.feasible = true;
+
+  // need[u] is the first node that needs u refreshed, -1 if none
+  vector<long> need(n, -1);
+  auto effective = [&](long u) {
+    return (need[u] >= 0)? max(plan.capacity[u], bootCapacity)
+                         : plan.capacity[u];
+  };
+
+  for (long v: range(n)) {
+    const CircuitNode& node = circ.nodes[v];
+    if (node.op == CIRCUIT_INPUT || node.op == CIRCUIT_RECRYPT
+        || node.inputs.empty()) {
+      plan.capacity[v] = node.capacity;
+      continue;
+    }
+    auto available = [&]() {
+      double cap = effective(node.inputs[0]);
+      for (long u: node.inputs) cap = min(cap, effective(u));
+      return cap;
+    };
+
+    // Refresh the poorest inputs until v has enough left
+    while (available() - node.spent < minCapacity) {
+      long poorest = -1;
+      for (long u: node.inputs)
+        if (need[u] < 0 && plan.capacity[u] < bootCapacity
+            && (poorest < 0 || plan.capacity[u] < plan.capacity[poorest]))
+          poorest = u;
+      if (poorest < 0) { // refreshing does not help
+        plan.feasible = false;
+        break;
+      }
+      need[poorest] = v;
+    }
+    plan.capacity[v] = available() - node.spent;
+  }
+
+  // Each refreshed u can be recrypted anywhere after u and before need[u].
+  // Taking them by increasing need[u], the first one that is left closes a
+  // batch that can run just before it is needed, with all the others that
+  // are computed by then.
+  vector<long> refreshed;
+  for (long u: range(n))
+    if (need[u] >= 0) refreshed.push_back(u);
+  sort(refreshed.begin(), refreshed.end(),
+       [&](long a, long b) { return need[a] < need[b]; });
+
+  vector<bool> done(n, false);
+  for (long first: refreshed) {
+    if (done[first]) continue;
+    vector<long> batch;
+    for (long u: refreshed)
+      if (!done[u] && u < need[first]) {
+        batch.push_back(u);
+        done[u] = true;
+      }
+    sort(batch.begin(), batch.end());
+    plan.points.push_back(batch.back()); // the last one to be computed
+    plan.batches.push_back(batch);
+  }
+  return plan.feasible;
+}
+
+//======================== CircuitReplayer ========================
+
+CircuitReplayer::CircuitReplayer(const CtxtCircuit& _circ,
+                                 const RecryptPlan& _plan,
+                                 FHEPubKey& _pubKey, bool _thin)
+  : circ(_circ), plan(_plan), pubKey(_pubKey), thin(_thin),
+    next(0), recrypts(0)
+{
+  long n = circ.size();
+  batchOf.assign(n, -1);
+  waiting.resize(plan.batches.size());
+  for (long i: range(plan.batches.size())) {
+    waiting[i] = plan.batches[i].size();
+    for (long node: plan.batches[i]) {
+      assert(node >= 0 && node < n);
+      batchOf[node] = i;
+    }
+  }
+  lastUse.assign(n, -1);
+  for (long v: range(n))
+    for (long u: circ.nodes[v].inputs) lastUse[u] = max(lastUse[u], v);
+}
+
+void CircuitReplayer::check(long node, CircuitOp op) const
+{
+  if (node >= circ.size() || circ.nodes[node].op != op)
+    throw logic_error("CircuitReplayer: the circuit does not match the "
+                      "recording at node " + to_string(node));
+}
+
+// Node was just computed into c. If it closes a batch, recrypt the batch.
+void CircuitReplayer::computed(long node, const Ctxt& c)
+{
+  c.setCircuitNode(node);
+  long b = batchOf[node];
+  if (b < 0) return;
+  staged.emplace(node, c);
+  if (--waiting[b] > 0) return;
+
+  vector<Ctxt*> batch;
+  for (long u: plan.batches[b]) batch.push_back(&staged.at(u));
+  {
+    CircuitPause pause; // these are not part of the circuit
+    if (thin) pubKey.thinReCrypt(CtPtrs_vectorPt(batch));
+    else      pubKey.reCrypt(CtPtrs_vectorPt(batch));
+  }
+  recrypts++;
+  for (long u: plan.batches[b]) {
+    auto it = staged.find(u);
+    fresh.emplace(u, std::move(it->second));
+    staged.erase(it);
+  }
+}
+
+// Point the operands of an operation to the refreshed values
+void CircuitReplayer::substitute(Ctxt& self, const Ctxt** other)
+{
+  auto it = fresh.find(self.getCircuitNode());
+  if (it != fresh.end() && !self.isEmpty()) self = it->second;
+  if (other && *other && *other != &self) {
+    it = fresh.find((*other)->getCircuitNode());
+    if (it != fresh.end() && !(*other)->isEmpty()) *other = &it->second;
+  }
+}
+
+void CircuitReplayer::before(CircuitOp op, Ctxt& self, const Ctxt** other)
+{
+  lock_guard<mutex> lock(mx);
+  const Ctxt* operands[2] = { &self, other? *other : NULL };
+  for (const Ctxt* c: operands) {
+    if (c == NULL || c->isEmpty()) continue;
+    long node = c->getCircuitNode();
+    if (node >= 0 && node < next) continue;
+    check(next, CIRCUIT_INPUT); // a new input
+    computed(next++, *c);
+  }
+  substitute(self, other);
+}
+
+void CircuitReplayer::after(CircuitOp op, Ctxt& self)
+{
+  lock_guard<mutex> lock(mx);
+  long node = next++;
+  check(node, op);
+  computed(node, self);
+  auto it = fresh.find(node);
+  if (it != fresh.end()) self = it->second;
+
+  for (long u: circ.nodes[node].inputs) // free what is no longer needed
+    if (lastUse[u] == node) fresh.erase(u);
+}
@@ -0,0 +1,235 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _CIRCUIT_H_
+#define _CIRCUIT_H_
+/**
+ * @file circuit.h
+ * @brief Recording circuits of ciphertext operations and placing their
+ * recryptions automatically.
+ *
+ * A CircuitRecorder, installed with setCircuitHook(), records every
+ * outermost addCtxt, negate, multLowLvl/multiplyBy, multByConstant,
+ * addConstant, automorph/smartAutomorph/frobeniusAutomorph and reCrypt (or
+ * thinReCrypt) as a node of a CtxtCircuit, with the capacity that the
+ * operation used up. The ciphertexts remember the node they hold (see
+ * Ctxt::getCircuitNode), so copies of a value are the same node. Running
+ * the circuit once under setDryRun(true) gives these capacities without
+ * the cost of the real operations.
+ *
+ * planRecryptions() then chooses the values to refresh so that no node
+ * drops below a minimum capacity, and groups the recryptions that can run
+ * together into batches. A CircuitReplayer installed around a second
+ * (real) run of the same circuit carries out the plan: each batch is
+ * recrypted at once right after its last member is computed, and every
+ * later use of a member sees the refreshed value.
+ *
+ * Usage:
+ * \code
+ *   CircuitRecorder rec;
+ *   setCircuitHook(&rec);
+ *   ... evaluate the circuit (in dry-run mode) ...
+ *   setCircuitHook(NULL);
+ *
+ *   RecryptPlan plan;
+ *   planRecryptions(plan, rec.getCircuit(), bootCapacity, minCapacity);
+ *
+ *   CircuitReplayer replay(rec.getCircuit(), plan, publicKey);
+ *   setCircuitHook(&replay);
+ *   ... evaluate the same circuit ...
+ *   setCircuitHook(NULL);
+ * \endcode
+ *
+ * The circuit must issue its operations in the same order in both runs,
+ * so they should come from a single thread. Operations made inside other
+ * operations (e.g., the automorphisms of a recryption) are not part of it.
+ **/
+#include <vector>
+#include <map>
+#include <mutex>
+#include <iostream>
+#include "Ctxt.h"
+
+class FHEPubKey;
+
+//! The kinds of nodes in a circuit
+enum CircuitOp {
+  CIRCUIT_INPUT,     //!< a ciphertext that was not computed by the circuit
+  CIRCUIT_ADD,       //!< addCtxt
+  CIRCUIT_MULTIPLY,  //!< multLowLvl, multiplyBy
+  CIRCUIT_CONSTANT,  //!< negate, multByConstant, addConstant
+  CIRCUIT_AUTOMORPH, //!< automorph, smartAutomorph, frobeniusAutomorph
+  CIRCUIT_RECRYPT,   //!< reCrypt, thinReCrypt
+  CIRCUIT_OP_COUNT
+};
+
+//! @brief A printable name for op
+const char* circuitOpName(CircuitOp op);
+
+//! One node of a circuit, all the capacities are in bits
+struct CircuitNode {
+  CircuitOp op;
+  std::vector<long> inputs; // the nodes that the operation read
+  double capacity;          // the capacity of the result when recorded
+  double spent;             // from the smallest recorded input capacity
+
+  CircuitNode(): op(CIRCUIT_INPUT), capacity(0), spent(0) {}
+};
+
+//! @brief A DAG of ciphertext operations, in the order they were made
+//! (which is a topological order)
+class CtxtCircuit {
+public:
+  std::vector<CircuitNode> nodes;
+
+  long size() const { return nodes.size(); }
+  long countOps(CircuitOp op) const;
+  void clear() { nodes.clear(); }
+};
+
+std::ostream& operator<<(std::ostream& str, const CtxtCircuit& circ);
+
+//! @brief The hook that sees the operations of a circuit
+class CircuitHook {
+public:
+  virtual ~CircuitHook() {}
+
+  //! Called before op modifies self. If other is not NULL then *other
+  //! points to the other operand, and may be pointed to another ciphertext
+  //! that holds the same value. self may be assigned a ciphertext that
+  //! holds the same value.
+  virtual void before(CircuitOp op, Ctxt& self, const Ctxt** other) = 0;
+
+  //! Called after op modified self
+  virtual void after(CircuitOp op, Ctxt& self) = 0;
+};
+
+//! @brief Install a hook (NULL to stop). The hook is not owned, it must be
+//! alive as long as it is installed.
+void setCircuitHook(CircuitHook *hook);
+CircuitHook *getCircuitHook();
+
+//! \cond FALSE (make doxygen ignore these classes)
+// Calls the hook around an outermost operation. Used by the operations
+// themselves.
+class CircuitProbe {
+  CircuitHook *hook; // NULL if this operation is not seen
+  CircuitOp op;
+  std::vector<Ctxt*> cts;
+
+public:
+  CircuitProbe(CircuitOp _op, Ctxt& self, const Ctxt** other=NULL);
+  CircuitProbe(CircuitOp _op, const std::vector<Ctxt*>& _cts);
+  ~CircuitProbe();
+
+  CircuitProbe(const CircuitProbe&) = delete;
+  CircuitProbe& operator=(const CircuitProbe&) = delete;
+};
+
+// Hides the operations made while it is alive from the hook (on all the
+// threads), used by the replayer for the recryptions that it adds
+class CircuitPause {
+public:
+  CircuitPause();
+  ~CircuitPause();
+};
+//! \endcond
+
+/**
+ * @class CircuitRecorder
+ * @brief Records the operations it sees into a CtxtCircuit.
+ **/
+class CircuitRecorder : public CircuitHook {
+  std::mutex mx;
+  CtxtCircuit circ;
+  std::map<const Ctxt*, std::vector<long>> pending; // inputs, by self
+
+  long nodeOf(const Ctxt& c); // adds an input node if c has none
+public:
+  void before(CircuitOp op, Ctxt& self, const Ctxt** other) override;
+  void after(CircuitOp op, Ctxt& self) override;
+
+  const CtxtCircuit& getCircuit() const { return circ; }
+  void clear();
+};
+
+//! @brief Where to recrypt in a circuit
+struct RecryptPlan {
+  //! The nodes to refresh, and the ones in each batch are recrypted at
+  //! once, right after node points[i] is computed
+  std::vector< std::vector<long> > batches;
+  std::vector<long> points;
+
+  //! The capacity of each node with the plan, as predicted from the
+  //! recorded costs
+  std::vector<double> capacity;
+
+  //! false if some operation needs more than bootCapacity-minCapacity
+  bool feasible;
+
+  RecryptPlan(): feasible(true) {}
+  long recryptions() const;
+};
+
+std::ostream& operator<<(std::ostream& str, const RecryptPlan& plan);
+
+//! @brief Choose the values of circ to recrypt so that every node keeps at
+//! least minCapacity bits, assuming that a recryption leaves bootCapacity.
+//! Refreshing a value serves all of its later uses. The values are chosen
+//! greedily in circuit order: when an operation would fall short, its
+//! inputs with the least capacity are refreshed until it does not. The
+//! recryptions are then grouped into the fewest batches, each of them run
+//! at one point after its values are computed and before they are needed.
+//! @return plan.feasible
+bool planRecryptions(RecryptPlan& plan, const CtxtCircuit& circ,
+                     double bootCapacity, double minCapacity);
+
+/**
+ * @class CircuitReplayer
+ * @brief Carries out a RecryptPlan on a run of the recorded circuit.
+ *
+ * The nodes are numbered as in the recording, and the replayer throws an
+ * error if the run diverges from it. A refreshed value is kept until its
+ * last use in the circuit. With thin set, the batches are recrypted with
+ * thinReCrypt.
+ **/
+class CircuitReplayer : public CircuitHook {
+  std::mutex mx;
+  const CtxtCircuit& circ;
+  const RecryptPlan& plan;
+  FHEPubKey& pubKey;
+  bool thin;
+
+  long next;                   // the number of the next node
+  std::vector<long> batchOf;   // the batch of each node, -1 if none
+  std::vector<long> waiting;   // members of each batch not yet computed
+  std::vector<long> lastUse;   // the last node that reads each node
+  std::map<long, Ctxt> staged; // computed members of pending batches
+  std::map<long, Ctxt> fresh;  // refreshed values
+  long recrypts;               // batches done
+
+  void check(long node, CircuitOp op) const;
+  void computed(long node, const Ctxt& c);
+  void substitute(Ctxt& self, const Ctxt** other);
+public:
+  CircuitReplayer(const CtxtCircuit& _circ, const RecryptPlan& _plan,
+                  FHEPubKey& _pubKey, bool _thin=false);
+
+  void before(CircuitOp op, Ctxt& self, const Ctxt** other) override;
+  void after(CircuitOp op, Ctxt& self) override;
+
+  //! The number of batches recrypted so far
+  long batchesDone() const { return recrypts; }
+  //! Whether all the nodes of the recording were seen
+  bool complete() const { return next == circ.size(); }
+};
+
+#endif // ifndef _CIRCUIT_H_
@@ -107,6 +107,7 @@ public: \
     explicit CLONED_PTR_TYPE(X* p = 0)  : ptr(p) {} \
     ~CLONED_PTR_TYPE() {delete ptr;} \
     CLONED_PTR_TYPE(const CLONED_PTR_TYPE& r) {copy(r.ptr);} \
+    CLONED_PTR_TYPE(CLONED_PTR_TYPE&& r) noexcept : ptr(r.ptr) {r.ptr = 0;} \
  \
     CLONED_PTR_TYPE& operator=(const CLONED_PTR_TYPE& r) \
     { \
@@ -116,6 +117,14 @@ public: \
         } \
         return *this; \
     } \
+    CLONED_PTR_TYPE& operator=(CLONED_PTR_TYPE&& r) noexcept \
+    { \
+        if (this != &r) { \
+            delete ptr; \
+            ptr = r.ptr; r.ptr = 0; \
+        } \
+        return *this; \
+    } \
  \
     void set_ptr(X* p) \
     { \
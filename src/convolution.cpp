@@ -0,0 +1,236 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* convolution.cpp - a 1D convolution as a sparse 1D transformation
+ */
+#include <memory>
+#include <stdexcept>
+#include "convolution.h"
+
+NTL_CLIENT
+
+// The taps of a kernel by diagonal. The input of output j through tap t
+// is j+t-origin, so tap t is on the diagonal i = origin-t mod D (the
+// rotation by i), and a kernel longer than D puts several taps on one.
+template<class T> class ConvTaps {
+public:
+  const EncryptedArray& ea;
+  long dim, D, origin;
+  bool zero;     // CONV_ZERO
+  bool multiple; // some tap has one value per slot
+  vector< vector<T> > taps; // each of size 1 or ea.size()
+  vector<long> diags;        // the diagonals with taps, increasing
+  vector< vector<long> > onDiag; // onDiag[i] = the taps of diagonal i
+
+  ConvTaps(const EncryptedArray& _ea, long _dim,
+           const vector< vector<T> >& _taps, long _origin,
+           ConvBoundary boundary)
+    : ea(_ea), dim(_dim), origin(_origin), zero(boundary == CONV_ZERO),
+      multiple(false), taps(_taps)
+  {
+    if (dim < 0 || dim >= ea.dimension())
+      throw std::logic_error("Convolution1D: no such dimension");
+    if (taps.empty())
+      throw std::logic_error("Convolution1D: no taps");
+    for (const vector<T>& tap: taps) {
+      if (lsize(tap) == 1) continue;
+      if (lsize(tap) != ea.size())
+        throw std::logic_error("Convolution1D: a tap needs a value per slot");
+      multiple = true;
+    }
+    D = ea.sizeOfDimension(dim);
+    onDiag.resize(D);
+    for (long t: range(lsize(taps)))
+      onDiag[mcMod(origin-t, D)].push_back(t);
+    for (long i: range(D))
+      if (!onDiag[i].empty()) diags.push_back(i);
+  }
+
+  // The sum of the taps that take entry j (of block k) of diagonal i to
+  // its output, false if no tap does
+  bool entry(T& out, long i, long j, long k) const
+  {
+    long s = 0; // the output slot, if the taps depend on it
+    if (multiple)
+      s = ea.getPAlgebra().assembleIndexByDim(std::make_pair(k, j), dim);
+    bool any = false;
+    out = T(0);
+    for (long t: onDiag[i]) {
+      long src = j+t-origin;
+      if (zero && (src < 0 || src >= D)) continue; // beyond an end
+      out += taps[t][(lsize(taps[t]) == 1)? 0 : s];
+      any = true;
+    }
+    return any;
+  }
+};
+
+template<class type>
+class ConvMatrix : public MatMul1DSparse_derived<type> {
+public:
+  PA_INJECT(type)
+
+private:
+  const ConvTaps<long>& kernel;
+
+public:
+  explicit ConvMatrix(const ConvTaps<long>& _kernel) : kernel(_kernel) {}
+
+  const EncryptedArray& getEA() const override { return kernel.ea; }
+  long getDim() const override { return kernel.dim; }
+  bool multipleTransforms() const override { return kernel.multiple; }
+  vector<long> getDiagonals() const override { return kernel.diags; }
+
+  bool getDiagonalEntry(RX& out, long i, long j, long k) const override
+  {
+    long v;
+    if (!kernel.entry(v, i, j, k)) return true;
+    conv(out, v); // reduced mod p^r, the current modulus
+    return IsZero(out);
+  }
+};
+
+class ConvMatrixCx : public MatMul1DCx {
+  const ConvTaps<double>& kernel;
+
+public:
+  explicit ConvMatrixCx(const ConvTaps<double>& _kernel) : kernel(_kernel) {}
+
+  const EncryptedArray& getEA() const override { return kernel.ea; }
+  long getDim() const override { return kernel.dim; }
+  bool multipleTransforms() const override { return kernel.multiple; }
+  bool getNonzeroDiagonals(vector<long>& diags) const override
+  { diags = kernel.diags; return true; }
+
+  bool get(cx_double& out, long i, long j, long k) const override
+  {
+    double v;
+    if (!kernel.entry(v, mcMod(j-i, kernel.D), j, k) || v == 0.0)
+      return true;
+    out = v;
+    return false;
+  }
+};
+
+// The matrix of a kernel, which has to outlive it
+static unique_ptr<MatMul1D> convMatrix(const ConvTaps<long>& kernel)
+{
+  switch (kernel.ea.getTag()) {
+    case PA_GF2_tag:
+      return unique_ptr<MatMul1D>(new ConvMatrix<PA_GF2>(kernel));
+    case PA_zz_p_tag:
+      return unique_ptr<MatMul1D>(new ConvMatrix<PA_zz_p>(kernel));
+    default:
+      throw std::logic_error("Convolution1D: integer taps, CKKS slots");
+  }
+}
+
+static unique_ptr<MatMul1D> convMatrix(const ConvTaps<double>& kernel)
+{
+  if (kernel.ea.getTag() != PA_cx_tag)
+    throw std::logic_error("Convolution1D: real taps are only for CKKS");
+  return unique_ptr<MatMul1D>(new ConvMatrixCx(kernel));
+}
+
+// Build the matrix of the taps (and the kernel that it refers to) for the
+// constructor of MatMul1DExec, CKKS taking integer taps as real ones
+template<class T>
+static const MatMul1D&
+kernelMatrix(unique_ptr< ConvTaps<T> >& kernel, unique_ptr<MatMul1D>& mat,
+             const EncryptedArray& ea, long dim,
+             const vector< vector<T> >& taps, long origin,
+             ConvBoundary boundary)
+{
+  kernel.reset(new ConvTaps<T>(ea, dim, taps, origin, boundary));
+  mat = convMatrix(*kernel);
+  return *mat;
+}
+
+static const MatMul1D&
+kernelMatrix(unique_ptr< ConvTaps<double> >& kernel,
+             unique_ptr<MatMul1D>& mat, const EncryptedArray& ea, long dim,
+             const vector< vector<long> >& taps, long origin,
+             ConvBoundary boundary)
+{
+  vector< vector<double> > real(taps.size());
+  for (long t: range(lsize(taps)))
+    real[t].assign(taps[t].begin(), taps[t].end());
+  return kernelMatrix(kernel, mat, ea, dim, real, origin, boundary);
+}
+
+// Each tap as one value for all the slots
+template<class T>
+static vector< vector<T> > sameForAllSlots(const vector<T>& taps)
+{
+  vector< vector<T> > v(taps.size());
+  for (long t: range(lsize(taps))) v[t].assign(1, taps[t]);
+  return v;
+}
+
+// The kernel and its matrix only live until the constants are encoded
+struct ConvBuild {
+  unique_ptr< ConvTaps<long> > kernel;
+  unique_ptr< ConvTaps<double> > kernelCx;
+  unique_ptr<MatMul1D> mat;
+
+  const MatMul1D& get(const EncryptedArray& ea, long dim,
+                      const vector< vector<long> >& taps, long origin,
+                      ConvBoundary boundary)
+  {
+    if (ea.getTag() == PA_cx_tag)
+      return kernelMatrix(kernelCx, mat, ea, dim, taps, origin, boundary);
+    return kernelMatrix(kernel, mat, ea, dim, taps, origin, boundary);
+  }
+
+  const MatMul1D& get(const EncryptedArray& ea, long dim,
+                      const vector< vector<double> >& taps, long origin,
+                      ConvBoundary boundary)
+  { return kernelMatrix(kernelCx, mat, ea, dim, taps, origin, boundary); }
+};
+
+Convolution1D::Convolution1D(const EncryptedArray& ea, long dim,
+                             const vector<long>& taps, long origin,
+                             ConvBoundary boundary, bool minimal)
+  : exec(ConvBuild().get(ea, dim, sameForAllSlots(taps), origin, boundary),
+         minimal)
+{}
+
+Convolution1D::Convolution1D(const EncryptedArray& ea, long dim,
+                             const vector< vector<long> >& taps, long origin,
+                             ConvBoundary boundary, bool minimal)
+  : exec(ConvBuild().get(ea, dim, taps, origin, boundary), minimal)
+{}
+
+Convolution1D::Convolution1D(const EncryptedArray& ea, long dim,
+                             const vector<double>& taps, long origin,
+                             ConvBoundary boundary, bool minimal)
+  : exec(ConvBuild().get(ea, dim, sameForAllSlots(taps), origin, boundary),
+         minimal)
+{}
+
+Convolution1D::Convolution1D(const EncryptedArray& ea, long dim,
+                             const vector< vector<double> >& taps,
+                             long origin, ConvBoundary boundary, bool minimal)
+  : exec(ConvBuild().get(ea, dim, taps, origin, boundary), minimal)
+{}
+
+void convolve1D(const EncryptedArray& ea, Ctxt& ctxt, long dim,
+                const vector<long>& taps, long origin, ConvBoundary boundary)
+{
+  Convolution1D(ea, dim, taps, origin, boundary).apply(ctxt);
+}
+
+void convolve1D(const EncryptedArray& ea, Ctxt& ctxt, long dim,
+                const vector<double>& taps, long origin,
+                ConvBoundary boundary)
+{
+  Convolution1D(ea, dim, taps, origin, boundary).apply(ctxt);
+}
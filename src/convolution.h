@@ -0,0 +1,88 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _CONVOLUTION_H_
+#define _CONVOLUTION_H_
+/**
+ * @file convolution.h
+ * @brief Slot-wise 1D convolution along a dimension of the hypercube
+ *
+ * With the slots along dimension dim indexed by j=0..D-1 (in every line of
+ * the hypercube along that dimension), a kernel of T taps with its origin
+ * at tap o maps the values v to
+ *   w[j] = sum_{t<T} taps[t] * v[j+t-o],
+ * where an index j+t-o outside [0,D) is either wrapped around
+ * (CONV_CYCLIC) or contributes nothing (CONV_ZERO, as at the edges of a
+ * signal). A tap is either one value for all the slots or a vector of one
+ * value per slot, the one of the output slot.
+ *
+ * The kernel is the 1D transformation whose nonzero diagonals are those of
+ * its taps, so it runs on MatMul1DExec: the rotations of the ciphertext are
+ * hoisted over one decomposition, or split baby-step/giant-step for long
+ * kernels, and the boundary masks are folded into the encoded taps. The
+ * taps are encoded once when a Convolution1D is built (upgrade() turns
+ * them into DoubleCRT), which then serves any number of ciphertexts.
+ * The key-switching matrices of addSome1DMatrices are the ones it expects,
+ * or those of addMinimal1DMatrices with the minimal flag.
+ **/
+#include <vector>
+#include "matmul.h"
+
+//! How a convolution treats the slots beyond the ends of the dimension
+enum ConvBoundary { CONV_ZERO, CONV_CYCLIC };
+
+//! @class Convolution1D
+//! @brief A kernel with its encoded taps, see convolution.h
+class Convolution1D {
+  MatMul1DExec exec;
+
+public:
+  //! @brief A kernel of integer taps mod p^r (of real taps for CKKS)
+  Convolution1D(const EncryptedArray& ea, long dim,
+                const std::vector<long>& taps, long origin,
+                ConvBoundary boundary=CONV_ZERO, bool minimal=false);
+  //! @brief taps[t][s] is the t'th tap of slot s, for s < ea.size()
+  Convolution1D(const EncryptedArray& ea, long dim,
+                const std::vector< std::vector<long> >& taps, long origin,
+                ConvBoundary boundary=CONV_ZERO, bool minimal=false);
+
+  //! @brief Real taps, only for CKKS
+  Convolution1D(const EncryptedArray& ea, long dim,
+                const std::vector<double>& taps, long origin,
+                ConvBoundary boundary=CONV_ZERO, bool minimal=false);
+  Convolution1D(const EncryptedArray& ea, long dim,
+                const std::vector< std::vector<double> >& taps, long origin,
+                ConvBoundary boundary=CONV_ZERO, bool minimal=false);
+
+  const EncryptedArray& getEA() const { return exec.getEA(); }
+  long getDim() const { return exec.dim; }
+
+  //! @brief Replace an encryption of v by an encryption of its convolution
+  void apply(Ctxt& ctxt) const { exec.mul(ctxt); }
+
+  //! @brief Turn the encoded taps into DoubleCRT constants
+  void upgrade() { exec.upgrade(); }
+
+  long memoryUsage() const
+  { return exec.memoryUsage() - sizeof(MatMul1DExec) + sizeof(*this); }
+};
+
+//! @brief ctxt = the convolution of ctxt with taps along dimension dim.
+//! This encodes the taps on every call, a kernel that is applied to many
+//! ciphertexts is better kept as a Convolution1D.
+void convolve1D(const EncryptedArray& ea, Ctxt& ctxt, long dim,
+                const std::vector<long>& taps, long origin,
+                ConvBoundary boundary=CONV_ZERO);
+void convolve1D(const EncryptedArray& ea, Ctxt& ctxt, long dim,
+                const std::vector<double>& taps, long origin,
+                ConvBoundary boundary=CONV_ZERO);
+
+#endif // ifndef _CONVOLUTION_H_
@@ -0,0 +1,244 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* costModel.cpp - counting the kernels of a circuit, and the per-row
+ * timings that turn the counts into a running time
+ */
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <iterator>
+#include "costModel.h"
+#include "NumbTh.h"
+
+NTL_CLIENT
+
+static std::atomic<CostCounter*> installedCounter(NULL);
+
+void setCostCounter(CostCounter *counter) { installedCounter = counter; }
+CostCounter *getCostCounter() { return installedCounter; }
+
+bool takeLiveRows(long n)
+{
+  CostCounter *c = getCostCounter();
+  if (c == NULL) return false;
+  c->countLiveRows(n);
+  return true;
+}
+
+void releaseLiveRows(long n)
+{
+  if (CostCounter *c = getCostCounter()) c->countLiveRows(-n);
+}
+
+const char* costKernelName(CostKernel k)
+{
+  switch (k) {
+    case COST_FFT:           return "FFT";
+    case COST_IFFT:          return "iFFT";
+    case COST_ROW_OP:        return "rowOp";
+    case COST_AUTOMORPH:     return "automorph";
+    case COST_INNER_PRODUCT: return "innerProduct";
+    default:                 return "unknown";
+  }
+}
+
+//======================== CostCounts ========================
+
+CostCounts::CostCounts()
+  : recrypts(0), thinRecrypts(0), recryptedCtxts(0), peakRows(0)
+{
+  for (long& r: rows) r = 0;
+}
+
+long CostCounts::totalKeySwitches() const
+{
+  long n = 0;
+  for (auto& ks: keySwitches) n += ks.second;
+  return n;
+}
+
+double CostCounts::peakBytes(long phim) const
+{
+  return double(peakRows) * phim * sizeof(long);
+}
+
+void CostCounts::print(ostream& str) const
+{
+  str << "rows:";
+  for (long k: range(COST_KERNEL_COUNT))
+    str << " " << costKernelName(CostKernel(k)) << "=" << rows[k];
+  str << "\nkey switchings: " << totalKeySwitches();
+  for (auto& ks: keySwitches)
+    str << "\n  " << ks.first.first << " digits, " << ks.first.second
+        << " primes: " << ks.second;
+  str << "\nrecryptions: " << recrypts << " packed, " << thinRecrypts
+      << " thin, " << recryptedCtxts << " ciphertexts"
+      << "\npeak rows: " << peakRows << "\n";
+}
+
+//======================== CostCounter ========================
+
+CostCounter::CostCounter()
+{
+  clear();
+}
+
+void CostCounter::countKeySwitch(long digits, long primes)
+{
+  std::lock_guard<std::mutex> lock(mx);
+  keySwitches[std::make_pair(digits, primes)]++;
+}
+
+void CostCounter::countRecrypt(bool thin, long batchSize)
+{
+  (thin? thinRecrypts : recrypts)++;
+  recryptedCtxts += batchSize;
+}
+
+void CostCounter::countLiveRows(long delta)
+{
+  long now = liveRows.fetch_add(delta) + delta;
+  long peak = peakRows.load();
+  while (now > peak && !peakRows.compare_exchange_weak(peak, now)) {}
+}
+
+CostCounts CostCounter::getCounts() const
+{
+  CostCounts c;
+  for (long k: range(COST_KERNEL_COUNT)) c.rows[k] = rows[k];
+  c.recrypts = recrypts;
+  c.thinRecrypts = thinRecrypts;
+  c.recryptedCtxts = recryptedCtxts;
+  c.peakRows = peakRows;
+  std::lock_guard<std::mutex> lock(mx);
+  c.keySwitches = keySwitches;
+  return c;
+}
+
+void CostCounter::clear()
+{
+  for (auto& r: rows) r = 0;
+  recrypts = thinRecrypts = recryptedCtxts = 0;
+  liveRows = peakRows = 0;
+  std::lock_guard<std::mutex> lock(mx);
+  keySwitches.clear();
+}
+
+//======================== KernelTimings ========================
+
+KernelTimings::KernelTimings() : phim(0)
+{
+  for (double& t: perRow) t = 0;
+}
+
+namespace {
+// One result of Test_Bench
+struct BenchEntry {
+  std::string name;
+  long phim, nPrimes, threads;
+  double median;
+};
+
+// The number after "key": in obj, or -1 if there is none
+double benchField(const std::string& obj, const char *key)
+{
+  std::string k = std::string("\"") + key + "\":";
+  size_t pos = obj.find(k);
+  if (pos == std::string::npos) return -1;
+  return std::strtod(obj.c_str() + pos + k.size(), NULL);
+}
+
+// The results in the JSON object that Test_Bench prints. Each of them
+// starts with its "case" and ends with its "samples".
+void readBenchEntries(std::vector<BenchEntry>& entries, const std::string& s)
+{
+  const std::string tag = "{\"case\": \"";
+  for (size_t pos = s.find(tag); pos != std::string::npos;
+       pos = s.find(tag, pos)) {
+    pos += tag.size();
+    size_t end = s.find('"', pos);
+    if (end == std::string::npos) break;
+    size_t objEnd = s.find("\"samples\"", end);
+    std::string obj = s.substr(end, objEnd==std::string::npos?
+                                    std::string::npos : objEnd-end);
+    BenchEntry e;
+    e.name = s.substr(pos, end-pos);
+    e.phim = long(benchField(obj, "phim"));
+    e.nPrimes = long(benchField(obj, "nPrimes"));
+    e.threads = long(benchField(obj, "threads"));
+    e.median = benchField(obj, "median");
+    if (e.phim > 0 && e.nPrimes > 0 && e.median >= 0) entries.push_back(e);
+  }
+}
+}
+
+bool KernelTimings::readBenchJSON(istream& str, long _phim, long threads)
+{
+  std::string s((std::istreambuf_iterator<char>(str)),
+                std::istreambuf_iterator<char>());
+  std::vector<BenchEntry> entries;
+  readBenchEntries(entries, s);
+
+  // the parameter set to use
+  long best = 0;
+  for (const BenchEntry& e: entries) {
+    if (e.threads != threads) continue;
+    if (best == 0
+        || (_phim == 0 && e.phim > best)
+        || (_phim > 0 && std::labs(e.phim-_phim) < std::labs(best-_phim)))
+      best = e.phim;
+  }
+  if (best == 0) return false;
+
+  // the average time per row of each case, over the modulus chains
+  auto perRowOf = [&](const char *name, bool onePrime) {
+    double sum = 0;
+    long n = 0;
+    for (const BenchEntry& e: entries)
+      if (e.threads == threads && e.phim == best && e.name == name) {
+        sum += e.median / (onePrime? 1 : e.nPrimes);
+        n++;
+      }
+    return (n > 0)? sum/n : -1.0;
+  };
+  double fft = perRowOf("FFT", true);
+  double ifft = perRowOf("iFFT", true);
+  double add = perRowOf("DoubleCRT_add", false);
+  double mul = perRowOf("DoubleCRT_mul", false);
+  double aut = perRowOf("DoubleCRT_automorph", false);
+  if (fft < 0 || ifft < 0 || add < 0 || mul < 0 || aut < 0) return false;
+
+  phim = best;
+  perRow[COST_FFT] = fft;
+  perRow[COST_IFFT] = ifft;
+  perRow[COST_ROW_OP] = (add + mul)/2;
+  perRow[COST_AUTOMORPH] = aut;
+  perRow[COST_INNER_PRODUCT] = 2*(add + mul);
+  return true;
+}
+
+double KernelTimings::predictSeconds(const CostCounts& counts,
+                                     long _phim) const
+{
+  double linear = 1, fftScale = 1;
+  if (_phim > 0 && phim > 1 && _phim != phim) {
+    linear = double(_phim)/phim;
+    fftScale = linear * std::log(double(_phim))/std::log(double(phim));
+  }
+  double t = 0;
+  for (long k: range(COST_KERNEL_COUNT)) {
+    bool isFFT = (k == COST_FFT || k == COST_IFFT);
+    t += counts.rows[k] * perRow[k] * (isFFT? fftScale : linear);
+  }
+  return t;
+}
@@ -0,0 +1,169 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _COSTMODEL_H_
+#define _COSTMODEL_H_
+/**
+ * @file costModel.h
+ * @brief Counting the work of a circuit, and predicting its running time
+ *
+ * While a CostCounter is installed with setCostCounter(), the DoubleCRT
+ * kernels that dominate homomorphic evaluation (FFTs, inverse FFTs,
+ * pointwise row operations, automorphisms and the inner products of key
+ * switching) count the rows that they process, one row per prime. The
+ * counter also records every key switching by its number of digits and
+ * the size of its prime set, every recryption, and the peak number of
+ * DoubleCRT rows that were alive at once (beyond those alive when the
+ * counter was installed).
+ *
+ * The kernels are counted also under setDryRun(true), when they return
+ * without computing anything, so a dry run of a circuit gives its counts
+ * at almost no cost. A context that is built in a dry run has a tiny m
+ * but the real chain of primes, so the counts do not depend on phi(m),
+ * which is supplied separately to KernelTimings::predictSeconds and
+ * CostCounts::peakBytes to get a running time and a memory size.
+ *
+ * KernelTimings holds the time that each kernel takes per row. It can be
+ * read from the output of "Test_Bench_x json=1" (e.g., make bench).
+ *
+ * Usage:
+ * \code
+ *   KernelTimings timings;
+ *   std::ifstream f("bench.json");
+ *   timings.readBenchJSON(f);
+ *
+ *   setDryRun(true);
+ *   ... build the context, keys and inputs ...
+ *   CostCounter counter;
+ *   setCostCounter(&counter);
+ *   ... evaluate the circuit ...
+ *   setCostCounter(NULL);
+ *   setDryRun(false);
+ *
+ *   CostCounts counts = counter.getCounts();
+ *   double seconds = timings.predictSeconds(counts, phim);
+ *   double bytes = counts.peakBytes(phim);
+ * \endcode
+ **/
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <iostream>
+
+//! The kernels that are counted, all of them per row (i.e., per prime)
+enum CostKernel {
+  COST_FFT,           //!< a polynomial to the evaluation representation
+  COST_IFFT,          //!< back to the coefficient representation
+  COST_ROW_OP,        //!< add, sub, mul, negate, scale or power
+  COST_AUTOMORPH,     //!< automorph or complexConj
+  COST_INNER_PRODUCT, //!< one term of the key-switching inner product
+  COST_KERNEL_COUNT
+};
+
+//! @brief A printable name for k
+const char* costKernelName(CostKernel k);
+
+//! @brief The counts of one circuit
+struct CostCounts {
+  long rows[COST_KERNEL_COUNT];
+
+  //! The number of key switchings for each (#digits, #primes)
+  std::map<std::pair<long,long>, long> keySwitches;
+
+  long recrypts, thinRecrypts; // the calls
+  long recryptedCtxts;         // the ciphertexts in all the batches
+
+  //! The most rows that were alive at once, beyond the ones of the start
+  long peakRows;
+
+  CostCounts();
+
+  long totalKeySwitches() const;
+
+  //! The memory of peakRows rows of phim entries each
+  double peakBytes(long phim) const;
+
+  void print(std::ostream& str) const;
+};
+
+/**
+ * @class CostCounter
+ * @brief Counts the kernels while it is installed. It is updated from
+ * all the threads at once, the counts of other threads are included.
+ **/
+class CostCounter {
+  std::atomic_long rows[COST_KERNEL_COUNT];
+  std::atomic_long recrypts, thinRecrypts, recryptedCtxts;
+  std::atomic_long liveRows, peakRows;
+
+  mutable std::mutex mx; // protects keySwitches
+  std::map<std::pair<long,long>, long> keySwitches;
+
+public:
+  CostCounter();
+
+  void countRows(CostKernel k, long n)
+  { rows[k].fetch_add(n, std::memory_order_relaxed); }
+  void countKeySwitch(long digits, long primes);
+  void countRecrypt(bool thin, long batchSize);
+  void countLiveRows(long delta); // delta<0 when rows are freed
+
+  CostCounts getCounts() const;
+  void clear();
+
+  CostCounter(const CostCounter&) = delete;
+  CostCounter& operator=(const CostCounter&) = delete;
+};
+
+//! @brief Install a counter (NULL to stop counting). The counter is not
+//! owned, it must be alive as long as it is installed. Without a counter
+//! each kernel only checks for one.
+void setCostCounter(CostCounter *counter);
+CostCounter *getCostCounter();
+
+//! \cond FALSE (make doxygen ignore these functions)
+// Called by the kernels, n rows of kernel k
+inline void countCostRows(CostKernel k, long n)
+{ if (CostCounter *c = getCostCounter()) c->countRows(k, n); }
+
+// Called by SlabBuffer when it takes n rows, returns true if they were
+// counted, in which case releaseLiveRows(n) must be called when they are
+// freed
+bool takeLiveRows(long n);
+void releaseLiveRows(long n);
+//! \endcond
+
+/**
+ * @struct KernelTimings
+ * @brief The seconds per row of every kernel, measured at phi(m)=phim
+ **/
+struct KernelTimings {
+  long phim;
+  double perRow[COST_KERNEL_COUNT];
+
+  KernelTimings();
+
+  //! @brief Read the results of Test_Bench (json=1) for the given number
+  //! of threads, from the parameter set whose phi(m) is closest to phim
+  //! (the largest one if phim=0). The pointwise row operations take the
+  //! average of DoubleCRT_add and DoubleCRT_mul, and the inner product
+  //! (two products and two sums per term) is estimated from them.
+  //! Returns false if some of the kernels were not found.
+  bool readBenchJSON(std::istream& str, long phim=0, long threads=1);
+
+  //! @brief The predicted time of the counts at phi(m)=phim (0 for the
+  //! measured one). The FFTs are scaled as phim*log(phim), the others
+  //! linearly in phim.
+  double predictSeconds(const CostCounts& counts, long phim=0) const;
+};
+
+#endif // _COSTMODEL_H_
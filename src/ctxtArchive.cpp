@@ -0,0 +1,325 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* ctxtArchive.cpp - a chunked binary container for many ciphertexts
+ *
+ * The layout of an archive (all the integers are 8 bytes, as written by
+ * write_raw_int, except for the version):
+ *   header:  "|CA[", version (4 bytes), chunk size
+ *   chunk:   "|CK[", count, count offsets (in the payload), payload size,
+ *            hash of the payload, payload (the ciphertexts one after the
+ *            other)
+ *   index:   "|CI[", number of chunks, (offset, first, count) of each chunk
+ *            (offsets from the start of the archive), number of ciphertexts
+ *   trailer: offset of the index, "]CA|"
+ */
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <NTL/BasicThreadPool.h>
+#include "ctxtArchive.h"
+#include "FHE.h"
+#include "binio.h"
+#include "taskScheduler.h"
+
+NTL_CLIENT
+
+static const long archiveVersion = 1;
+static const long archiveHeaderSize = BINIO_EYE_SIZE + 4 + 8;
+static const long archiveTrailerSize = 8 + BINIO_EYE_SIZE;
+
+//======================== CtxtArchiveWriter ========================
+
+CtxtArchiveWriter::CtxtArchiveWriter(ostream& _str, long _chunkSize,
+                                     bool _compact)
+  : str(_str), chunkSize(max(_chunkSize, 1L)), compact(_compact),
+    pos(archiveHeaderSize), total(0), closed(false)
+{
+  writeEyeCatcher(str, BINIO_EYE_ARCHIVE_BEGIN);
+  write_raw_int(str, archiveVersion, BINIO_32BIT);
+  write_raw_int(str, chunkSize);
+  if (!str)
+    throw std::runtime_error("CtxtArchiveWriter: error writing the header");
+}
+
+CtxtArchiveWriter::~CtxtArchiveWriter()
+{
+  try { if (!closed) close(); }
+  catch (...) {} // an error that close() would have reported
+}
+
+void CtxtArchiveWriter::append(const vector<Ctxt>& cts)
+{
+  if (closed)
+    throw std::logic_error("CtxtArchiveWriter: append after close");
+  long n = cts.size();
+  if (n == 0) return;
+
+  // Encode the ciphertexts in parallel, then hash each chunk
+  vector<string> enc(n);
+  FHE_EXEC_RANGE(n, first, last)
+  for (long i = first; i < last; i++) {
+    ostringstream s;
+    if (compact) cts[i].writeCompact(s);
+    else         cts[i].write(s);
+    enc[i] = s.str();
+  }
+  FHE_EXEC_RANGE_END
+
+  long nChunks = divc(n, chunkSize);
+  vector<string> payload(nChunks);
+  vector<unsigned long> hash(nChunks);
+  FHE_EXEC_RANGE(nChunks, first, last)
+  for (long c = first; c < last; c++) {
+    long lo = c*chunkSize, hi = min(n, lo+chunkSize);
+    long len = 0;
+    for (long i: range(lo, hi)) len += enc[i].size();
+    payload[c].reserve(len);
+    for (long i: range(lo, hi)) payload[c] += enc[i];
+    hash[c] = hashBytes(payload[c].data(), payload[c].size());
+  }
+  FHE_EXEC_RANGE_END
+
+  // Write the chunks in order
+  for (long c: range(nChunks)) {
+    long lo = c*chunkSize, hi = min(n, lo+chunkSize);
+    index.push_back(CtxtArchiveChunk{pos, total + lo, hi - lo});
+
+    writeEyeCatcher(str, BINIO_EYE_ARCHIVE_CHUNK);
+    write_raw_int(str, hi - lo);
+    long offset = 0;
+    for (long i: range(lo, hi)) {
+      write_raw_int(str, offset);
+      offset += enc[i].size();
+    }
+    write_raw_int(str, payload[c].size());
+    write_raw_int(str, long(hash[c]));
+    str.write(payload[c].data(), payload[c].size());
+    pos += BINIO_EYE_SIZE + 8*(hi - lo + 3) + payload[c].size();
+  }
+  total += n;
+  str.flush();
+  if (!str)
+    throw std::runtime_error("CtxtArchiveWriter: error writing a chunk");
+}
+
+void CtxtArchiveWriter::close()
+{
+  if (closed) return;
+  closed = true;
+
+  long indexOffset = pos;
+  writeEyeCatcher(str, BINIO_EYE_ARCHIVE_INDEX);
+  write_raw_int(str, index.size());
+  for (const CtxtArchiveChunk& chunk: index) {
+    write_raw_int(str, chunk.offset);
+    write_raw_int(str, chunk.first);
+    write_raw_int(str, chunk.count);
+  }
+  write_raw_int(str, total);
+  write_raw_int(str, indexOffset);
+  writeEyeCatcher(str, BINIO_EYE_ARCHIVE_END);
+  str.flush();
+  if (!str)
+    throw std::runtime_error("CtxtArchiveWriter: error writing the index");
+}
+
+//======================== CtxtArchiveReader ========================
+
+namespace {
+// One chunk as it was read, before decoding
+struct RawChunk {
+  vector<long> offsets;
+  string payload;
+};
+
+// Read the rest of a chunk, after its eye-catcher
+void readRawChunk(istream& str, RawChunk& chunk)
+{
+  long count = read_raw_int(str);
+  if (!str || count <= 0)
+    throw std::runtime_error("CtxtArchiveReader: corrupt chunk");
+  chunk.offsets.resize(count);
+  for (long& off: chunk.offsets) off = read_raw_int(str);
+  long len = read_raw_int(str);
+  unsigned long hash = read_raw_int(str);
+  if (!str || len < 0)
+    throw std::runtime_error("CtxtArchiveReader: corrupt chunk");
+  for (long i: range(count))
+    if (chunk.offsets[i] < (i? chunk.offsets[i-1] : 0)
+        || chunk.offsets[i] >= len)
+      throw std::runtime_error("CtxtArchiveReader: corrupt chunk");
+
+  chunk.payload.resize(len);
+  str.read(&chunk.payload[0], len);
+  if (str.gcount() != len)
+    throw std::runtime_error("CtxtArchiveReader: truncated chunk");
+  if (hashBytes(chunk.payload.data(), len) != hash)
+    throw std::runtime_error("CtxtArchiveReader: chunk hash mismatch");
+}
+
+void decode(Ctxt& ctxt, const RawChunk& chunk, long i)
+{
+  long lo = chunk.offsets[i];
+  long hi = (i+1 < long(chunk.offsets.size()))? chunk.offsets[i+1]
+                                               : chunk.payload.size();
+  istringstream s(chunk.payload.substr(lo, hi-lo));
+  ctxt.read(s);
+}
+} // anonymous namespace
+
+CtxtArchiveReader::CtxtArchiveReader(istream& _str, const FHEPubKey& _pubKey)
+  : str(_str), pubKey(_pubKey), atEnd(false), nextIdx(0), total(-1)
+{
+  base = str.tellg(); // -1 if the stream is not seekable
+  if (readEyeCatcher(str, BINIO_EYE_ARCHIVE_BEGIN) != 0
+      || read_raw_int(str, BINIO_32BIT) != archiveVersion)
+    throw std::runtime_error("CtxtArchiveReader: not a ciphertext archive");
+  read_raw_int(str); // the chunk size, only informational
+  if (!str)
+    throw std::runtime_error("CtxtArchiveReader: truncated header");
+}
+
+long CtxtArchiveReader::next(vector<Ctxt>& cts, long maxChunks)
+{
+  vector<RawChunk> chunks;
+  while (!atEnd && lsize(chunks) < max(maxChunks, 1L)) {
+    char eye[BINIO_EYE_SIZE];
+    str.read(eye, BINIO_EYE_SIZE);
+    if (str.gcount() != BINIO_EYE_SIZE)
+      throw std::runtime_error("CtxtArchiveReader: truncated archive");
+    if (memcmp(eye, BINIO_EYE_ARCHIVE_INDEX, BINIO_EYE_SIZE) == 0)
+      atEnd = true;
+    else if (memcmp(eye, BINIO_EYE_ARCHIVE_CHUNK, BINIO_EYE_SIZE) == 0) {
+      chunks.emplace_back();
+      readRawChunk(str, chunks.back());
+    }
+    else
+      throw std::runtime_error("CtxtArchiveReader: bad eye-catcher");
+  }
+
+  // Decode all the ciphertexts of these chunks in parallel
+  vector< pair<long,long> > where; // (chunk, index in chunk)
+  for (long c: range(chunks.size()))
+    for (long i: range(chunks[c].offsets.size()))
+      where.push_back(make_pair(c, i));
+  long n = where.size();
+  cts.resize(n, Ctxt(pubKey));
+  FHE_EXEC_RANGE(n, first, last)
+  for (long t = first; t < last; t++)
+    decode(cts[t], chunks[where[t].first], where[t].second);
+  FHE_EXEC_RANGE_END
+
+  nextIdx += n;
+  return n;
+}
+
+void CtxtArchiveReader::readAll(vector<Ctxt>& cts)
+{
+  cts.clear();
+  vector<Ctxt> batch;
+  while (next(batch, fheAvailableThreads()) > 0)
+    cts.insert(cts.end(), batch.begin(), batch.end());
+}
+
+void CtxtArchiveReader::loadIndex()
+{
+  if (total >= 0) return;
+  if (base == streampos(-1))
+    throw std::runtime_error("CtxtArchiveReader: the stream is not seekable");
+
+  streampos saved = str.tellg();
+  str.clear();
+  str.seekg(0, ios::end);
+  long len = long(str.tellg() - base);
+  if (len < archiveHeaderSize + archiveTrailerSize)
+    throw std::runtime_error("CtxtArchiveReader: truncated archive");
+
+  str.seekg(base + streamoff(len - archiveTrailerSize));
+  long indexOffset = read_raw_int(str);
+  if (readEyeCatcher(str, BINIO_EYE_ARCHIVE_END) != 0
+      || indexOffset < archiveHeaderSize
+      || indexOffset > len - archiveTrailerSize)
+    throw std::runtime_error("CtxtArchiveReader: corrupt trailer");
+
+  str.seekg(base + streamoff(indexOffset));
+  if (readEyeCatcher(str, BINIO_EYE_ARCHIVE_INDEX) != 0)
+    throw std::runtime_error("CtxtArchiveReader: corrupt index");
+  long nChunks = read_raw_int(str);
+  if (!str || nChunks < 0 || 24*nChunks > len)
+    throw std::runtime_error("CtxtArchiveReader: corrupt index");
+  vector<CtxtArchiveChunk> idx(nChunks);
+  long count = 0;
+  for (CtxtArchiveChunk& chunk: idx) {
+    chunk.offset = read_raw_int(str);
+    chunk.first = read_raw_int(str);
+    chunk.count = read_raw_int(str);
+    if (chunk.first != count || chunk.count <= 0
+        || chunk.offset < archiveHeaderSize || chunk.offset >= indexOffset)
+      throw std::runtime_error("CtxtArchiveReader: corrupt index");
+    count += chunk.count;
+  }
+  if (read_raw_int(str) != count || !str)
+    throw std::runtime_error("CtxtArchiveReader: corrupt index");
+
+  index.swap(idx);
+  total = count;
+  str.clear();
+  str.seekg(saved);
+}
+
+long CtxtArchiveReader::size()
+{
+  loadIndex();
+  return total;
+}
+
+void CtxtArchiveReader::readAt(Ctxt& ctxt, long i)
+{
+  loadIndex();
+  if (i < 0 || i >= total)
+    throw std::out_of_range("CtxtArchiveReader::readAt: no ciphertext "
+                            + to_string(i));
+  auto it = upper_bound(index.begin(), index.end(), i,
+             [](long j, const CtxtArchiveChunk& c) { return j < c.first; });
+  const CtxtArchiveChunk& chunk = *(--it);
+
+  streampos saved = str.tellg();
+  str.clear();
+  str.seekg(base + streamoff(chunk.offset));
+  RawChunk raw;
+  if (readEyeCatcher(str, BINIO_EYE_ARCHIVE_CHUNK) != 0)
+    throw std::runtime_error("CtxtArchiveReader: corrupt index");
+  readRawChunk(str, raw);
+  if (lsize(raw.offsets) != chunk.count)
+    throw std::runtime_error("CtxtArchiveReader: corrupt index");
+  decode(ctxt, raw, i - chunk.first);
+  str.clear();
+  str.seekg(saved);
+}
+
+//======================== Convenience functions ========================
+
+void writeCtxtArchive(ostream& str, const vector<Ctxt>& cts,
+                      long chunkSize, bool compact)
+{
+  CtxtArchiveWriter writer(str, chunkSize, compact);
+  writer.append(cts);
+  writer.close();
+}
+
+void readCtxtArchive(istream& str, vector<Ctxt>& cts,
+                     const FHEPubKey& pubKey)
+{
+  CtxtArchiveReader reader(str, pubKey);
+  reader.readAll(cts);
+}
@@ -0,0 +1,136 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _CTXT_ARCHIVE_H_
+#define _CTXT_ARCHIVE_H_
+/**
+ * @file ctxtArchive.h
+ * @brief A chunked binary container for many ciphertexts.
+ *
+ * An archive is a header, a sequence of chunks and an index:
+ *  - each chunk holds a few ciphertexts (in the format of Ctxt::write or
+ *    Ctxt::writeCompact) with their offsets in the chunk and a hash of its
+ *    contents, so it can be checked and decoded on its own;
+ *  - the index, at the end, gives the position of every chunk, and a fixed
+ *    size trailer gives the position of the index.
+ *
+ * The chunks are encoded and decoded in parallel on the NTL thread pool.
+ * A CtxtArchiveReader can read the chunks in order from a stream that is
+ * still being written (e.g., a pipe or a socket), and returns each batch of
+ * chunks as soon as it has arrived, so the computation on the first
+ * ciphertexts can start before the rest of the archive is there. On a
+ * seekable stream it can also read any single ciphertext through the index.
+ *
+ * Errors in the data (bad eye-catchers, hashes or offsets, a truncated
+ * stream) raise std::runtime_error.
+ **/
+#include <vector>
+#include <iostream>
+#include "Ctxt.h"
+
+//! The position of one chunk in an archive
+struct CtxtArchiveChunk {
+  long offset; // from the start of the archive
+  long first;  // the index of its first ciphertext
+  long count;  // the number of ciphertexts in it
+};
+
+/**
+ * @class CtxtArchiveWriter
+ * @brief Writes an archive to a stream, which does not need to be seekable.
+ **/
+class CtxtArchiveWriter {
+  std::ostream& str;
+  long chunkSize;
+  bool compact;
+  long pos;     // bytes written so far
+  long total;   // ciphertexts written so far
+  bool closed;
+  std::vector<CtxtArchiveChunk> index;
+
+public:
+  //! @param chunkSize  the most ciphertexts in a chunk
+  //! @param compact    write them with Ctxt::writeCompact
+  CtxtArchiveWriter(std::ostream& _str, long _chunkSize=16,
+                    bool _compact=false);
+
+  //! Closes the archive if close() was not called
+  ~CtxtArchiveWriter();
+
+  CtxtArchiveWriter(const CtxtArchiveWriter&) = delete;
+  CtxtArchiveWriter& operator=(const CtxtArchiveWriter&) = delete;
+
+  //! @brief Append cts, as ceil(cts.size()/chunkSize) chunks that are
+  //! encoded in parallel, and flush the stream so a reader can go on.
+  void append(const std::vector<Ctxt>& cts);
+
+  //! @brief Write the index and the trailer. Nothing can be appended after.
+  void close();
+
+  //! The number of ciphertexts written so far
+  long size() const { return total; }
+};
+
+/**
+ * @class CtxtArchiveReader
+ * @brief Reads an archive from a stream.
+ *
+ * next() reads the chunks in order and only needs a plain stream. size()
+ * and readAt() need a seekable one, they read the index the first time
+ * they are called and leave the position of next() as it was.
+ **/
+class CtxtArchiveReader {
+  std::istream& str;
+  const FHEPubKey& pubKey;
+  std::streampos base; // the start of the archive
+  bool atEnd;          // next() has reached the index
+  long nextIdx;        // the index of the next ciphertext for next()
+  std::vector<CtxtArchiveChunk> index;
+  long total;          // -1 until the index is read
+
+  void loadIndex();
+
+public:
+  //! Reads the header at the current position of _str
+  CtxtArchiveReader(std::istream& _str, const FHEPubKey& _pubKey);
+
+  CtxtArchiveReader(const CtxtArchiveReader&) = delete;
+  CtxtArchiveReader& operator=(const CtxtArchiveReader&) = delete;
+
+  //! @brief Read the next (up to) maxChunks chunks, decoded in parallel,
+  //! into cts (which is resized to fit them). Returns the number of
+  //! ciphertexts read, 0 once the end of the chunks is reached.
+  long next(std::vector<Ctxt>& cts, long maxChunks=1);
+
+  //! @brief Read all the chunks that are left, in batches of as many
+  //! chunks as there are threads.
+  void readAll(std::vector<Ctxt>& cts);
+
+  //! The index of the ciphertext that next() reads first
+  long position() const { return nextIdx; }
+
+  //! The number of ciphertexts in the archive (needs a seekable stream)
+  long size();
+
+  //! @brief Read ciphertext i (needs a seekable stream). Its whole chunk is
+  //! read to check the hash, and only ciphertext i is decoded.
+  void readAt(Ctxt& ctxt, long i);
+};
+
+//! @brief Write cts as an archive (a writer that is closed at once)
+void writeCtxtArchive(std::ostream& str, const std::vector<Ctxt>& cts,
+                      long chunkSize=16, bool compact=false);
+
+//! @brief Read a whole archive into cts
+void readCtxtArchive(std::istream& str, std::vector<Ctxt>& cts,
+                     const FHEPubKey& pubKey);
+
+#endif // ifndef _CTXT_ARCHIVE_H_
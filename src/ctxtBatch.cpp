@@ -0,0 +1,413 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* ctxtBatch.cpp - many ciphertexts operated on in one loop per operation
+ */
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <NTL/BasicThreadPool.h>
+#include "FHE.h"
+#include "ctxtBatch.h"
+#include "rowArith.h"
+#include "costModel.h"
+#include "memoryUsage.h"
+#include "binio.h"
+#include "timing.h"
+#include "taskScheduler.h"
+
+NTL_CLIENT
+
+// Call f(i, first, n) for runs of consecutive rows of the batch: the
+// rows [first, first+n) (counted in ciphertext rows) of the block of the
+// prime i. All the perPrime*card(s) rows are split between the threads.
+template<class Fun>
+static void forAllRows(const IndexSet& s, long perPrime, Fun f)
+{
+  vector<long> primes;
+  for (long i: s) primes.push_back(i);
+  long total = primes.size() * perPrime;
+  if (total == 0) return;
+
+  FHE_EXEC_RANGE(total, first, last)
+    for (long idx = first; idx < last; ) {
+      long p = idx / perPrime, sub = idx % perPrime;
+      long n = std::min(perPrime - sub, last - idx);
+      f(primes[p], sub, n);
+      idx += n;
+    }
+  FHE_EXEC_RANGE_END
+}
+
+CtxtBatch::CtxtBatch(const FHEPubKey& _pubKey, long N):
+  context(_pubKey.getContext()), pubKey(_pubKey), count(N),
+  stride(RowSlab(_pubKey.getContext().zMStar.getPhiM()).getStride()),
+  primeSet(_pubKey.getContext().ctxtPrimes),
+  ptxtSpace(N, _pubKey.getPtxtSpace()), intFactor(N, 1),
+  noiseBound(N, to_xdouble(0.0)), ratFactor(N, to_xdouble(1.0))
+{ assert(N >= 0); }
+
+CtxtBatch::CtxtBatch(const FHEPubKey& _pubKey, const vector<Ctxt>& v):
+  CtxtBatch(_pubKey)
+{ pack(v); }
+
+CtxtBatch& CtxtBatch::operator=(const CtxtBatch& other)
+{
+  assert(&pubKey == &other.pubKey);
+  if (this == &other) return *this;
+  count = other.count;
+  primeSet = other.primeSet;
+  handles = other.handles;
+  rows = other.rows;
+  ptxtSpace = other.ptxtSpace;
+  intFactor = other.intFactor;
+  noiseBound = other.noiseBound;
+  ratFactor = other.ratFactor;
+  return *this;
+}
+
+// New (zero) rows for the parts h over the primes s
+void CtxtBatch::reshape(const IndexSet& s, const vector<SKHandle>& h)
+{
+  primeSet = s;
+  handles = h;
+  rows = RowSlab(h.size()*count*stride);
+  if (!isEmpty() && count > 0) rows.insert(s);
+}
+
+void CtxtBatch::checkMatch(const CtxtBatch& other, const char* op) const
+{
+  string where = string("CtxtBatch::") + op + ": ";
+  if (&pubKey != &other.pubKey)
+    throw std::logic_error(where + "different public keys");
+  if (count != other.count)
+    throw std::logic_error(where + "batches of different sizes");
+  if (primeSet != other.primeSet)
+    throw std::logic_error(where + "different prime sets");
+  if (handles != other.handles)
+    throw std::logic_error(where + "parts relative to different keys");
+}
+
+void CtxtBatch::pack(const vector<Ctxt>& v)
+{
+  count = v.size();
+  ptxtSpace.assign(count, pubKey.getPtxtSpace());
+  intFactor.assign(count, 1);
+  noiseBound.assign(count, to_xdouble(0.0));
+  ratFactor.assign(count, to_xdouble(1.0));
+  if (count == 0) { reshape(context.ctxtPrimes, vector<SKHandle>()); return; }
+
+  vector<SKHandle> h;
+  for (const CtxtPart& part: v[0].parts) h.push_back(part.skHandle);
+  for (long n: range(count)) {
+    const Ctxt& c = v[n];
+    bool same = (&c.pubKey == &pubKey) && c.parts.size() == h.size()
+      && c.primeSet == v[0].primeSet;
+    for (long k = 0; same && k < long(h.size()); k++)
+      same = (c.parts[k].skHandle == h[k]);
+    if (!same)
+      throw std::logic_error("CtxtBatch::pack: the ciphertexts differ in "
+                             "their key, primes or parts");
+    ptxtSpace[n] = c.ptxtSpace;
+    intFactor[n] = c.intFactor;
+    noiseBound[n] = c.noiseBound;
+    ratFactor[n] = c.ratFactor;
+  }
+  reshape(v[0].primeSet, h);
+
+  long len = context.zMStar.getPhiM() * sizeof(long);
+  forAllRows(primeSet, nParts()*count, [&](long i, long first, long n) {
+    for (long sub = first; sub < first+n; sub++) {
+      long k = sub / count, j = sub % count;
+      std::memcpy(row(i, k, j), v[j].parts[k].getMap()[i], len);
+    }
+  });
+}
+
+void CtxtBatch::get(Ctxt& out, long n) const
+{
+  assert(&out.pubKey == &pubKey && n >= 0 && n < count);
+  Ctxt c(pubKey, ptxtSpace[n]);
+  c.primeSet = primeSet;
+  c.intFactor = intFactor[n];
+  c.noiseBound = noiseBound[n];
+  c.ratFactor = ratFactor[n];
+
+  long len = context.zMStar.getPhiM() * sizeof(long);
+  for (long k: range(nParts())) {
+    c.parts.push_back(CtxtPart(context, primeSet, handles[k]));
+    vector<WireBuffer> bufs; // the rows of the new part, in order
+    c.parts.back().wireBuffers(bufs, primeSet);
+    long t = 0;
+    for (long i: primeSet) std::memcpy(bufs[t++].data, row(i, k, n), len);
+  }
+  out = std::move(c);
+}
+
+void CtxtBatch::unpack(vector<Ctxt>& out) const
+{
+  out.clear();
+  out.reserve(count);
+  for (long n: range(count)) {
+    out.push_back(Ctxt(pubKey));
+    get(out.back(), n);
+  }
+}
+
+void CtxtBatch::set(long n, const Ctxt& c)
+{
+  assert(n >= 0 && n < count);
+  if (isEmpty()) { // the first ciphertext defines the shape
+    vector<SKHandle> h;
+    for (const CtxtPart& part: c.parts) h.push_back(part.skHandle);
+    reshape(c.primeSet, h);
+  }
+  bool same = (&c.pubKey == &pubKey) && c.parts.size() == handles.size()
+    && c.primeSet == primeSet;
+  for (long k = 0; same && k < nParts(); k++)
+    same = (c.parts[k].skHandle == handles[k]);
+  if (!same)
+    throw std::logic_error("CtxtBatch::set: the ciphertext does not match "
+                           "the primes or parts of the batch");
+  ptxtSpace[n] = c.ptxtSpace;
+  intFactor[n] = c.intFactor;
+  noiseBound[n] = c.noiseBound;
+  ratFactor[n] = c.ratFactor;
+
+  long len = context.zMStar.getPhiM() * sizeof(long);
+  for (long i: primeSet)
+    for (long k: range(nParts()))
+      std::memcpy(row(i, k, n), c.parts[k].getMap()[i], len);
+}
+
+//======================== the operations ========================
+
+void CtxtBatch::addCtxt(const CtxtBatch& other, bool negative)
+{
+  FHE_TIMER_START;
+  if (other.isEmpty()) return;
+  if (isEmpty()) {
+    *this = other;
+    if (negative) negate();
+    return;
+  }
+  checkMatch(other, "addCtxt");
+
+  // The factors are not harmonized here, check them before changing anything
+  bool ckks = (context.alMod.getTag() == PA_cx_tag);
+  for (long n: range(count)) {
+    long g = ckks? 1 : GCD(ptxtSpace[n], other.ptxtSpace[n]);
+    assert(ckks || g > 1);
+    bool same = ckks?
+      closeToOne(ratFactor[n]/other.ratFactor[n], context.alMod.getPPowR()*2)
+      : (intFactor[n] % g == other.intFactor[n] % g);
+    if (!same)
+      throw std::logic_error("CtxtBatch::addCtxt: different scaling factors, "
+                             "add them as Ctxt");
+  }
+  for (long n: range(count)) { // the metadata of Ctxt::addCtxt
+    if (!ckks) {
+      ptxtSpace[n] = GCD(ptxtSpace[n], other.ptxtSpace[n]);
+      intFactor[n] %= ptxtSpace[n];
+    }
+    noiseBound[n] += other.noiseBound[n];
+  }
+
+  countCostRows(COST_ROW_OP, card(primeSet)*nParts()*count);
+  if (isDryRun()) return;
+
+  // the rows of a prime are contiguous, so each run is one kernel call
+  forAllRows(primeSet, nParts()*count, [&](long i, long first, long n) {
+    long q = context.ithPrime(i);
+    long *x = rows[i] + first*stride;
+    const long *y = other.rows[i] + first*stride;
+    if (negative) subModRow(x, y, n*stride, q);
+    else          addModRow(x, y, n*stride, q);
+  });
+}
+
+void CtxtBatch::negate()
+{
+  if (isEmpty()) return;
+  countCostRows(COST_ROW_OP, card(primeSet)*nParts()*count);
+  if (isDryRun()) return;
+
+  forAllRows(primeSet, nParts()*count, [&](long i, long first, long n) {
+    long q = context.ithPrime(i);
+    long *x = rows[i] + first*stride;
+    for (long j: range(n*stride)) if (x[j] != 0) x[j] = q - x[j];
+  });
+}
+
+void CtxtBatch::multByConstant(const DoubleCRT& dcrt, double size)
+{
+  FHE_TIMER_START;
+  if (isEmpty()) return;
+  if (!(dcrt.getIndexSet() >= primeSet))
+    throw std::logic_error("CtxtBatch::multByConstant: the constant is not "
+                           "defined over the primes of the batch");
+  long phim = context.zMStar.getPhiM();
+
+  if (context.alMod.getTag() == PA_cx_tag) { // as Ctxt::multByConstantCKKS
+    xdouble xfactor = to_xdouble(context.alMod.getCx().encodeScalingFactor());
+    xdouble xsize = (size < 0.0)?
+      context.noiseBoundForUniform(xfactor, phim) : to_xdouble(size);
+    for (long n: range(count)) {
+      noiseBound[n] *= xsize;
+      ratFactor[n] *= xfactor;
+    }
+  }
+  else
+    for (long n: range(count))
+      noiseBound[n] *= (size >= 0.0)? size :
+        context.noiseBoundForUniform(double(ptxtSpace[n])/2.0, phim);
+
+  countCostRows(COST_ROW_OP, card(primeSet)*nParts()*count);
+  if (isDryRun()) return;
+
+  const RowSlab& c = dcrt.getMap();
+  forAllRows(primeSet, nParts()*count, [&](long i, long first, long n) {
+    const Cmodulus& mod = context.ithModulus(i);
+    const long *y = c[i];
+    for (long sub = first; sub < first+n; sub++)
+      mulModRow(rows[i] + sub*stride, y, phim, mod.getQ(), mod.getQInv());
+  });
+}
+
+void CtxtBatch::multByConstant(const ZZX& poly, double size)
+{
+  if (isEmpty()) return;
+  multByConstant(DoubleCRT(poly, context, primeSet), size);
+}
+
+void CtxtBatch::automorph(long k)
+{
+  FHE_TIMER_START;
+  if (isEmpty()) return;
+  const PAlgebra& zMStar = context.zMStar;
+  if (!zMStar.inZmStar(k))
+    throw std::logic_error("CtxtBatch::automorph: k not in Zm*");
+  long m = zMStar.getM(), phim = zMStar.getPhiM();
+
+  for (SKHandle& h: handles) // as Ctxt::automorph
+    if (!h.isOne())
+      h = SKHandle(h.getPowerOfS(), MulMod(h.getPowerOfX(), k, m),
+                   h.getSecretKeyID());
+
+  countCostRows(COST_AUTOMORPH, card(primeSet)*nParts()*count);
+  if (isDryRun()) return;
+
+  // new[j] = old[perm[j]], the same permutation for every row
+  std::shared_ptr<const vector<long>> table = context.getAutomorphPerm(k);
+  const long *perm = table->data();
+
+  forAllRows(primeSet, nParts()*count, [&](long i, long first, long n) {
+    static thread_local vector<long> tls_tmp;
+    vector<long>& tmp = tls_tmp; // the scratch of this thread
+    tmp.resize(phim);
+    for (long sub = first; sub < first+n; sub++) {
+      long *x = rows[i] + sub*stride;
+      std::memcpy(tmp.data(), x, phim*sizeof(long));
+      for (long j: range(phim)) x[j] = tmp[perm[j]];
+    }
+  });
+}
+
+void CtxtBatch::multLowLvl(const CtxtBatch& other)
+{
+  FHE_TIMER_START;
+  if (isEmpty()) return;
+  if (other.isEmpty()) { *this = other; return; }
+  checkMatch(other, "multLowLvl");
+
+  // The parts of the product, and for each pair of parts where it goes
+  vector<SKHandle> h;
+  vector<long> target(nParts()*other.nParts());
+  for (long a: range(nParts()))
+    for (long b: range(other.nParts())) {
+      SKHandle hab;
+      if (!hab.mul(handles[a], other.handles[b]))
+        Error("CtxtBatch::multLowLvl: cannot multiply secret-key handles");
+      long t = std::find(h.begin(), h.end(), hab) - h.begin();
+      if (t == long(h.size())) h.push_back(hab);
+      target[a*other.nParts()+b] = t;
+    }
+
+  // the metadata, as Ctxt::multLowLvl and Ctxt::tensorProduct
+  bool ckks = (context.alMod.getTag() == PA_cx_tag);
+  for (long n: range(count)) {
+    if (!ckks) {
+      long g = GCD(ptxtSpace[n], other.ptxtSpace[n]);
+      assert(g > 1);
+      ptxtSpace[n] = g;
+    }
+    if (ptxtSpace[n] > 2) {
+      long q = rem(context.productOfPrimes(primeSet), ptxtSpace[n]);
+      intFactor[n] = MulMod(intFactor[n] % ptxtSpace[n],
+                            other.intFactor[n] % ptxtSpace[n], ptxtSpace[n]);
+      intFactor[n] = MulMod(intFactor[n], q, ptxtSpace[n]);
+    }
+    noiseBound[n] *= other.noiseBound[n];
+    ratFactor[n] *= other.ratFactor[n];
+  }
+
+  CtxtBatch prod(pubKey, count);
+  prod.reshape(primeSet, h);
+  countCostRows(COST_ROW_OP, card(primeSet)*target.size()*count*2);
+  if (!isDryRun()) {
+    long phim = context.zMStar.getPhiM();
+    forAllRows(primeSet, count, [&](long i, long first, long n) {
+      const Cmodulus& mod = context.ithModulus(i);
+      long q = mod.getQ();
+      vector<long> tmp(phim);
+      for (long j = first; j < first+n; j++)
+        for (long a: range(nParts()))
+          for (long b: range(other.nParts())) {
+            std::memcpy(tmp.data(), row(i, a, j), phim*sizeof(long));
+            mulModRow(tmp.data(), other.row(i, b, j), phim, q, mod.getQInv());
+            addModRow(prod.row(i, target[a*other.nParts()+b], j),
+                      tmp.data(), phim, q);
+          }
+    });
+  }
+  handles.swap(prod.handles);
+  rows = std::move(prod.rows);
+}
+
+void CtxtBatch::reLinearize(long keyID)
+{
+  FHE_TIMER_START;
+  bool canonical = nParts() <= 2;
+  for (const SKHandle& h: handles)
+    if (!h.isOne() && !h.isBase(keyID)) canonical = false;
+  if (isEmpty() || canonical) return;
+
+  // key-switching goes through Ctxt, one ciphertext per thread if there
+  // are enough of them, else with the threads inside each one
+  vector<Ctxt> v;
+  unpack(v);
+  if (count >= fheAvailableThreads()) {
+    FHE_EXEC_RANGE(count, first, last)
+      for (long n = first; n < last; n++) v[n].reLinearize(keyID);
+    FHE_EXEC_RANGE_END
+  }
+  else
+    for (Ctxt& c: v) c.reLinearize(keyID);
+  pack(v);
+}
+
+long CtxtBatch::memoryUsage() const
+{
+  return sizeof(CtxtBatch) - sizeof(RowSlab) + rows.memoryUsage()
+    + primeSet.memoryUsage() - sizeof(IndexSet)
+    + memBytes(handles) + memBytes(ptxtSpace) + memBytes(intFactor)
+    + memBytes(noiseBound) + memBytes(ratFactor);
+}
@@ -0,0 +1,134 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _CTXT_BATCH_H_
+#define _CTXT_BATCH_H_
+/**
+ * @file ctxtBatch.h
+ * @brief Many ciphertexts with the same primes and parts, operated on as one
+ *
+ * A CtxtBatch holds N ciphertexts that are defined relative to the same
+ * prime set and have parts relative to the same secret-key handles, in the
+ * same order (as N fresh encryptions under one key do). Their residues
+ * live in one RowSlab whose "row" for the prime q_i is the block of all
+ * the rows mod q_i: part k of ciphertext n is at offset (k*N+n)*stride.
+ * An operation on the batch checks the prime set and the handles once and
+ * then runs a single loop over all the rows of all the ciphertexts, split
+ * between the NTL threads, so that e.g. adding two batches is one call of
+ * addModRow per prime over nParts*N*stride entries.
+ *
+ * What the batch does itself:
+ *  - addCtxt / negate, multByConstant with one constant for all of them,
+ *    automorph, and the tensor product (multLowLvl).
+ * What it does one ciphertext at a time (in parallel when N is at least
+ * the number of threads):
+ *  - reLinearize, which key-switches each ciphertext through Ctxt.
+ * Nothing in between changes the prime set: the batch never mod-switches,
+ * so bring the inputs to the intended level before making the batch (the
+ * tensor product is done at the current primes, as in Ctxt::multLowLvl
+ * for ciphertexts that are already at a common set). Operands that do not
+ * match raise std::logic_error.
+ **/
+#include <vector>
+#include <NTL/xdouble.h>
+#include "Ctxt.h"
+#include "RowSlab.h"
+
+/**
+ * @class CtxtBatch
+ * @brief N ciphertexts in one contiguous layout, see ctxtBatch.h
+ **/
+class CtxtBatch {
+  const FHEcontext& context;
+  const FHEPubKey& pubKey;
+  long count;                       // N
+  long stride;                      // of one ciphertext row
+  IndexSet primeSet;
+  std::vector<SKHandle> handles;    // of the parts, common to all of them
+  RowSlab rows;                     // rows[i] = all the rows mod q_i
+
+  // the per-ciphertext metadata of Ctxt
+  std::vector<long> ptxtSpace, intFactor;
+  std::vector<NTL::xdouble> noiseBound, ratFactor;
+
+  long nParts() const { return handles.size(); }
+  // the row of part k of ciphertext n mod the i'th prime
+  long* row(long i, long k, long n) { return rows[i] + (k*count+n)*stride; }
+  const long* row(long i, long k, long n) const
+  { return rows[i] + (k*count+n)*stride; }
+
+  void reshape(const IndexSet& s, const std::vector<SKHandle>& h);
+  void checkMatch(const CtxtBatch& other, const char* op) const;
+
+public:
+  //! @brief An empty batch of N ciphertexts (with no parts)
+  CtxtBatch(const FHEPubKey& _pubKey, long N=0);
+
+  //! @brief A batch of copies of v, which must share the prime set and the
+  //! handles of their parts
+  CtxtBatch(const FHEPubKey& _pubKey, const std::vector<Ctxt>& v);
+
+  CtxtBatch(const CtxtBatch& other) = default;
+  CtxtBatch& operator=(const CtxtBatch& other);
+
+  //! @brief Replace the contents by copies of v
+  void pack(const std::vector<Ctxt>& v);
+  //! @brief Copy the ciphertexts out, out is resized to size()
+  void unpack(std::vector<Ctxt>& out) const;
+  //! @brief Copy out ciphertext n
+  void get(Ctxt& out, long n) const;
+  //! @brief Replace ciphertext n, c must match the prime set and handles
+  void set(long n, const Ctxt& c);
+
+  long size() const { return count; }
+  const FHEcontext& getContext() const { return context; }
+  const FHEPubKey& getPubKey() const { return pubKey; }
+  const IndexSet& getPrimeSet() const { return primeSet; }
+  const std::vector<SKHandle>& getHandles() const { return handles; }
+  bool isEmpty() const { return handles.empty(); }
+
+  //! @name Operations on all the ciphertexts
+  ///@{
+  //! @brief this[n] += other[n] (or -= when negative)
+  void addCtxt(const CtxtBatch& other, bool negative=false);
+  CtxtBatch& operator+=(const CtxtBatch& other)
+  { addCtxt(other); return *this; }
+  CtxtBatch& operator-=(const CtxtBatch& other)
+  { addCtxt(other, true); return *this; }
+  void negate();
+
+  //! @brief Multiply all of them by the same constant, as
+  //! Ctxt::multByConstant (and multByConstantCKKS for CKKS). dcrt must be
+  //! defined at least over getPrimeSet().
+  void multByConstant(const DoubleCRT& dcrt, double size=-1.0);
+  //! @brief The polynomial is encoded once, over getPrimeSet()
+  void multByConstant(const NTL::ZZX& poly, double size=-1.0);
+
+  //! @brief X -> X^k on all of them, without re-linearization
+  void automorph(long k);
+
+  //! @brief this[n] = this[n] (x) other[n], the tensor product at the
+  //! current prime set, without re-linearization
+  void multLowLvl(const CtxtBatch& other);
+
+  //! @brief Key-switch every ciphertext back to (1,s_keyID)
+  void reLinearize(long keyID=0);
+
+  //! @brief multLowLvl followed by reLinearize
+  void multiplyBy(const CtxtBatch& other)
+  { multLowLvl(other); reLinearize(); }
+  ///@}
+
+  //! @brief The bytes of this object, the residues included
+  long memoryUsage() const;
+};
+
+#endif // _CTXT_BATCH_H_
@@ -0,0 +1,284 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* ctxtDataset.cpp - memory-mapped files of ciphertexts
+ *
+ * The layout of a dataset file:
+ *   prefix:   "|CD[", version (4 bytes), an endianness marker (written
+ *             natively), phi(m), the row stride, zero padding up to the
+ *             first page boundary
+ *   data:     the rows of every part of every ciphertext, native longs,
+ *             stride apart
+ *   metadata: the number of ciphertexts, then for each one ptxtSpace,
+ *             intFactor, ratFactor, noiseBound, primeSet, the number of
+ *             parts, the handle and index set of every part, and the
+ *             offset and size of its rows in the data area
+ *   trailer:  offset and size of the metadata, "]CD|"
+ */
+#include <stdexcept>
+#include "ctxtDataset.h"
+#include "FHE.h"
+#include "binio.h"
+
+NTL_CLIENT
+
+static const long datasetVersion = 1;
+static const long datasetMarker = 0x0102030405060708L;
+static const long datasetPrefixSize = BINIO_EYE_SIZE + 4 + 3*8;
+static const long datasetTrailerSize = 2*8 + BINIO_EYE_SIZE;
+
+//======================== CtxtDatasetWriter ========================
+
+CtxtDatasetWriter::CtxtDatasetWriter(const string& _fname,
+                                     const FHEcontext& _context)
+  : context(_context), fname(_fname),
+    str(resolveBinaryPath(_fname, /*forWriting=*/true), ios::binary),
+    dataPos(0), count(0), closed(false)
+{
+  if (!str)
+    throw std::runtime_error("CtxtDatasetWriter: cannot open "+fname);
+  long phim = context.zMStar.getPhiM();
+  stride = RowSlab(phim).getStride();
+
+  writeEyeCatcher(str, BINIO_EYE_DATASET_BEGIN);
+  write_raw_int(str, datasetVersion, BINIO_32BIT);
+  str.write(reinterpret_cast<const char*>(&datasetMarker), sizeof(long));
+  write_raw_int(str, phim);
+  write_raw_int(str, stride);
+  string pad(BINIO_PAGE_SIZE - datasetPrefixSize, '\0');
+  str.write(pad.data(), pad.size());
+  if (!str)
+    throw std::runtime_error("CtxtDatasetWriter: error writing "+fname);
+}
+
+CtxtDatasetWriter::~CtxtDatasetWriter()
+{
+  try { if (!closed) close(); }
+  catch (...) {} // an error that close() would have reported
+}
+
+void CtxtDatasetWriter::append(const Ctxt& ctxt)
+{
+  assert(!closed && &ctxt.getContext() == &context);
+  if (ctxt.lazyRelin && !ctxt.inCanonicalForm(ctxt.getKeyID())) {
+    Ctxt tmp(ctxt);
+    tmp.reLinearize(ctxt.getKeyID());
+    append(tmp);
+    return;
+  }
+
+  long phim = context.zMStar.getPhiM();
+  write_raw_int(meta, ctxt.ptxtSpace);
+  write_raw_int(meta, ctxt.intFactor);
+  write_raw_xdouble(meta, ctxt.ratFactor);
+  write_raw_xdouble(meta, ctxt.noiseBound);
+  ctxt.primeSet.write(meta);
+  write_raw_int(meta, ctxt.parts.size());
+
+  long bytes = 0;
+  vector<long> zeros(stride-phim, 0);
+  for (const CtxtPart& part: ctxt.parts) {
+    part.skHandle.write(meta);
+    part.getIndexSet().write(meta);
+    for (long i: part.getIndexSet()) {
+      str.write(reinterpret_cast<const char*>(part.getMap()[i]),
+                phim*sizeof(long));
+      str.write(reinterpret_cast<const char*>(zeros.data()),
+                zeros.size()*sizeof(long));
+      bytes += stride*sizeof(long);
+    }
+  }
+  write_raw_int(meta, dataPos);
+  write_raw_int(meta, bytes);
+  if (!str)
+    throw std::runtime_error("CtxtDatasetWriter: error writing "+fname);
+  dataPos += bytes;
+  count++;
+}
+
+void CtxtDatasetWriter::close()
+{
+  if (closed) return;
+  closed = true;
+
+  string metaStr;
+  {
+    ostringstream all;
+    write_raw_int(all, count);
+    all << meta.str();
+    metaStr = all.str();
+  }
+  str.write(metaStr.data(), metaStr.size());
+  write_raw_int(str, BINIO_PAGE_SIZE + dataPos);
+  write_raw_int(str, metaStr.size());
+  writeEyeCatcher(str, BINIO_EYE_DATASET_END);
+  str.flush();
+  if (!str)
+    throw std::runtime_error("CtxtDatasetWriter: error writing "+fname);
+}
+
+void writeCtxtDataset(const string& fname, const vector<Ctxt>& cts)
+{
+  if (cts.empty())
+    throw std::logic_error("writeCtxtDataset: no ciphertexts");
+  CtxtDatasetWriter writer(fname, cts[0].getContext());
+  for (const Ctxt& c: cts) writer.append(c);
+  writer.close();
+}
+
+//======================== CtxtDataset ========================
+
+CtxtDataset::CtxtDataset(const string& fname, const FHEPubKey& _pubKey)
+  : pubKey(_pubKey)
+{
+  const FHEcontext& context = pubKey.getContext();
+  long phim = context.zMStar.getPhiM();
+  long stride = RowSlab(phim).getStride();
+
+  long len;
+  mapping = mapBinaryFile(fname, len);
+  const char *base = static_cast<const char*>(mapping.get());
+  if (len < BINIO_PAGE_SIZE + datasetTrailerSize)
+    throw std::runtime_error("CtxtDataset: file too short");
+
+  istringstream prefix(string(base, datasetPrefixSize));
+  if (readEyeCatcher(prefix, BINIO_EYE_DATASET_BEGIN) != 0
+      || read_raw_int(prefix, BINIO_32BIT) != datasetVersion)
+    throw std::runtime_error("CtxtDataset: not a dataset file");
+  long marker;
+  prefix.read(reinterpret_cast<char*>(&marker), sizeof(long));
+  if (marker != datasetMarker)
+    throw std::runtime_error("CtxtDataset: wrong endianness");
+  if (read_raw_int(prefix) != phim || read_raw_int(prefix) != stride)
+    throw std::runtime_error("CtxtDataset: wrong context");
+
+  istringstream trailer(string(base + len - datasetTrailerSize,
+                               datasetTrailerSize));
+  long metaOffset = read_raw_int(trailer);
+  long metaSize = read_raw_int(trailer);
+  if (readEyeCatcher(trailer, BINIO_EYE_DATASET_END) != 0
+      || metaOffset < BINIO_PAGE_SIZE || metaSize < 8
+      || metaOffset + metaSize + datasetTrailerSize != len)
+    throw std::runtime_error("CtxtDataset: corrupt file");
+  data = base + BINIO_PAGE_SIZE;
+  long dataLen = metaOffset - BINIO_PAGE_SIZE;
+
+  istringstream meta(string(base + metaOffset, metaSize));
+  IndexSet allPrimes(0, context.numPrimes()-1);
+  long n = read_raw_int(meta);
+  if (n < 0 || n > metaSize)
+    throw std::runtime_error("CtxtDataset: corrupt file");
+  entries.resize(n);
+  for (Entry& e: entries) {
+    e.ptxtSpace = read_raw_int(meta);
+    e.intFactor = read_raw_int(meta);
+    e.ratFactor = read_raw_xdouble(meta);
+    e.noiseBound = read_raw_xdouble(meta);
+    e.primeSet.read(meta);
+    long nParts = read_raw_int(meta);
+    if (!meta || nParts < 0 || nParts > metaSize)
+      throw std::runtime_error("CtxtDataset: corrupt file");
+    e.handles.resize(nParts);
+    e.sets.resize(nParts);
+    long rows = 0;
+    for (long j: range(nParts)) {
+      e.handles[j].read(meta);
+      e.sets[j].read(meta);
+      if (!(e.sets[j] <= allPrimes))
+        throw std::runtime_error("CtxtDataset: corrupt file");
+      rows += e.sets[j].card();
+    }
+    e.offset = read_raw_int(meta);
+    e.bytes = read_raw_int(meta);
+    if (!meta || e.bytes != long(rows*stride*sizeof(long))
+        || e.offset < 0 || e.offset + e.bytes > dataLen)
+      throw std::runtime_error("CtxtDataset: corrupt file");
+  }
+}
+
+void CtxtDataset::get(Ctxt& ctxt, long i) const
+{
+  if (&ctxt.getPubKey() != &pubKey)
+    throw std::logic_error("CtxtDataset::get: wrong public key");
+  const FHEcontext& context = pubKey.getContext();
+  long stride = RowSlab(context.zMStar.getPhiM()).getStride();
+  const Entry& e = entries.at(i);
+
+  ctxt.ptxtSpace = e.ptxtSpace;
+  ctxt.intFactor = e.intFactor;
+  ctxt.ratFactor = e.ratFactor;
+  ctxt.noiseBound = e.noiseBound;
+  ctxt.primeSet = e.primeSet;
+  clear(ctxt.prgSeed);
+  ctxt.lazyRelin = false;
+
+  const long* rows = reinterpret_cast<const long*>(data + e.offset);
+  ctxt.parts.assign(e.handles.size(), CtxtPart(context, IndexSet::emptySet()));
+  for (long j: range(e.handles.size())) {
+    CtxtPart& part = ctxt.parts[j];
+    part.skHandle = e.handles[j];
+    part.attachView(e.sets[j], rows, mapping);
+    rows += e.sets[j].card() * stride;
+  }
+}
+
+Ctxt CtxtDataset::operator[](long i) const
+{
+  Ctxt ctxt(pubKey);
+  get(ctxt, i);
+  return ctxt;
+}
+
+void CtxtDataset::prefetch(long first, long last) const
+{
+  first = max(first, 0L);
+  last = min(last, size());
+  if (first >= last) return;
+  long start = entries[first].offset;
+  long end = entries[last-1].offset + entries[last-1].bytes;
+  adviseBinaryMapping(data + start, end - start, /*willNeed=*/true);
+}
+
+void CtxtDataset::release(long first, long last) const
+{
+  first = max(first, 0L);
+  last = min(last, size());
+  if (first >= last) return;
+  long start = entries[first].offset;
+  long end = entries[last-1].offset + entries[last-1].bytes;
+  adviseBinaryMapping(data + start, end - start, /*willNeed=*/false);
+}
+
+//======================== CtxtDatasetCursor ========================
+
+CtxtDatasetCursor::CtxtDatasetCursor(const CtxtDataset& _ds, long first,
+                                     long _last, long _ahead,
+                                     bool _releaseBehind)
+  : ds(_ds), pos(max(first, 0L)), ahead(max(_ahead, 0L)),
+    releaseBehind(_releaseBehind)
+{
+  last = (_last < 0 || _last > ds.size())? ds.size() : _last;
+  prefetched = pos;
+}
+
+bool CtxtDatasetCursor::next(Ctxt& ctxt)
+{
+  if (pos >= last) return false;
+  long target = min(last, pos+1+ahead);
+  if (prefetched < target) {
+    ds.prefetch(max(prefetched, pos), target);
+    prefetched = target;
+  }
+  ds.get(ctxt, pos);
+  if (releaseBehind && pos >= 2) ds.release(pos-2, pos-1);
+  pos++;
+  return true;
+}
@@ -0,0 +1,139 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _CTXT_DATASET_H_
+#define _CTXT_DATASET_H_
+/**
+ * @file ctxtDataset.h
+ * @brief Memory-mapped files of ciphertexts, for data sets that do not fit
+ * in memory.
+ *
+ * A dataset file holds the residues of its ciphertexts laid out as in
+ * memory (native endianness, rows RowSlab(phi(m)).getStride() longs apart),
+ * like the mapped key files of FHE.h. A CtxtDataset maps the file and gives
+ * each ciphertext as a Ctxt whose parts are read-only views into the
+ * mapping: nothing is deserialized, and pages are read from disk on first
+ * use. Such a Ctxt can be used as any other one, the first operation that
+ * modifies a part copies it out of the mapping.
+ *
+ * A CtxtDatasetCursor goes over the ciphertexts in order, asks the system
+ * to read ahead the next few ones while the current one is used, and lets
+ * the pages of those it has passed be dropped, so a scan over a large file
+ * only keeps a window of it in memory. The files are not portable across
+ * machines with different endianness. Errors raise std::runtime_error.
+ **/
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include "Ctxt.h"
+
+class FHEPubKey;
+
+/**
+ * @class CtxtDatasetWriter
+ * @brief Writes a dataset file one ciphertext at a time.
+ **/
+class CtxtDatasetWriter {
+  const FHEcontext& context;
+  std::string fname;
+  std::ofstream str;
+  std::ostringstream meta; // the metadata of every ciphertext so far
+  long stride;
+  long dataPos;            // bytes written to the data area
+  long count;
+  bool closed;
+
+public:
+  CtxtDatasetWriter(const std::string& _fname, const FHEcontext& _context);
+
+  //! Closes the file if close() was not called
+  ~CtxtDatasetWriter();
+
+  CtxtDatasetWriter(const CtxtDatasetWriter&) = delete;
+  CtxtDatasetWriter& operator=(const CtxtDatasetWriter&) = delete;
+
+  //! Append a ciphertext (re-linearized first if it is lazy)
+  void append(const Ctxt& ctxt);
+
+  //! @brief Write the metadata. Nothing can be appended after.
+  void close();
+
+  //! The number of ciphertexts written so far
+  long size() const { return count; }
+};
+
+/**
+ * @class CtxtDataset
+ * @brief A dataset file, mapped read-only.
+ **/
+class CtxtDataset {
+  struct Entry {
+    long ptxtSpace, intFactor;
+    NTL::xdouble ratFactor, noiseBound;
+    IndexSet primeSet;
+    std::vector<SKHandle> handles;
+    std::vector<IndexSet> sets;
+    long offset, bytes; // of its rows in the data area
+  };
+
+  const FHEPubKey& pubKey;
+  std::shared_ptr<const void> mapping;
+  const char* data; // the data area
+  std::vector<Entry> entries;
+
+public:
+  CtxtDataset(const std::string& fname, const FHEPubKey& _pubKey);
+
+  //! The number of ciphertexts
+  long size() const { return entries.size(); }
+
+  //! Make ctxt (a ciphertext of the same key) a view of ciphertext i
+  void get(Ctxt& ctxt, long i) const;
+  Ctxt operator[](long i) const;
+
+  //! Start reading ciphertexts [first, last) in the background
+  void prefetch(long first, long last) const;
+
+  //! @brief Let the pages that only hold ciphertexts [first, last) be
+  //! dropped from memory. They are read again if they are used after.
+  void release(long first, long last) const;
+};
+
+/**
+ * @class CtxtDatasetCursor
+ * @brief Goes over a range of a dataset, reading ahead.
+ **/
+class CtxtDatasetCursor {
+  const CtxtDataset& ds;
+  long pos, last, ahead, prefetched;
+  bool releaseBehind;
+
+public:
+  //! @param last           the end of the range, -1 for the whole dataset
+  //! @param ahead          how many ciphertexts to read ahead
+  //! @param releaseBehind  release the ciphertexts before the previous one
+  CtxtDatasetCursor(const CtxtDataset& _ds, long first=0, long _last=-1,
+                    long _ahead=8, bool _releaseBehind=true);
+
+  //! @brief Make ctxt a view of the next ciphertext. Returns false (and
+  //! leaves ctxt alone) at the end of the range.
+  bool next(Ctxt& ctxt);
+
+  //! The index of the ciphertext that next() gives
+  long position() const { return pos; }
+};
+
+//! @brief Write cts as a dataset file
+void writeCtxtDataset(const std::string& fname, const std::vector<Ctxt>& cts);
+
+#endif // ifndef _CTXT_DATASET_H_
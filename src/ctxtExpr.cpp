@@ -0,0 +1,556 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* ctxtExpr.cpp - lazy ciphertext expressions and their optimizer
+ */
+#include <algorithm>
+#include <stdexcept>
+#include <NTL/BasicThreadPool.h>
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "timing.h"
+#include "ctxtExpr.h"
+#include "taskScheduler.h"
+
+NTL_CLIENT
+
+const char* exprOpName(ExprOp op)
+{
+  switch (op) {
+  case EXPR_INPUT:         return "input";
+  case EXPR_ADD:           return "add";
+  case EXPR_NEGATE:        return "negate";
+  case EXPR_MULTIPLY:      return "multiply";
+  case EXPR_MULT_CONSTANT: return "multByConstant";
+  case EXPR_AUTOMORPH:     return "automorph";
+  case EXPR_ROTATE:        return "rotate";
+  case EXPR_MULT_ADD:      return "multAdd";
+  default:                 return "unknown";
+  }
+}
+
+ostream& operator<<(ostream& str, const ExprStats& s)
+{
+  return str << "[nodes=" << s.nodes << " cseHits=" << s.cseHits
+             << " evaluated=" << s.evaluated << " levels=" << s.levels
+             << " hoistGroups=" << s.hoistGroups << " hoisted=" << s.hoisted
+             << " fused=" << s.fused << " relinsSaved=" << s.relinsSaved
+             << " maxLive=" << s.maxLive << "]";
+}
+
+//======================== the handles ========================
+
+// Both operands must belong to the same graph
+static CtxtGraph *graphOf(const CtxtExpr& a, const CtxtExpr& b)
+{
+  if (a.isNull() || a.getGraph() != b.getGraph())
+    throw std::logic_error("CtxtExpr: operands of different graphs");
+  return a.getGraph();
+}
+
+static CtxtGraph *graphOf(const CtxtExpr& a)
+{
+  if (a.isNull()) throw std::logic_error("CtxtExpr: null expression");
+  return a.getGraph();
+}
+
+CtxtExpr operator+(const CtxtExpr& a, const CtxtExpr& b)
+{
+  CtxtGraph *g = graphOf(a, b);
+  return CtxtExpr(g, g->add(a.getNode(), b.getNode()));
+}
+
+CtxtExpr operator-(const CtxtExpr& a, const CtxtExpr& b)
+{
+  CtxtGraph *g = graphOf(a, b);
+  return CtxtExpr(g, g->add(a.getNode(), b.getNode(), /*negative=*/true));
+}
+
+CtxtExpr operator-(const CtxtExpr& a)
+{
+  CtxtGraph *g = graphOf(a);
+  return CtxtExpr(g, g->negate(a.getNode()));
+}
+
+CtxtExpr operator*(const CtxtExpr& a, const CtxtExpr& b)
+{
+  CtxtGraph *g = graphOf(a, b);
+  return CtxtExpr(g, g->multiply(a.getNode(), b.getNode()));
+}
+
+CtxtExpr operator*(const ExprConstant& c, const CtxtExpr& a)
+{
+  CtxtGraph *g = graphOf(a);
+  return CtxtExpr(g, g->multByConstant(a.getNode(), c.idx));
+}
+
+CtxtExpr& CtxtExpr::operator+=(const CtxtExpr& other)
+{ return *this = *this + other; }
+CtxtExpr& CtxtExpr::operator-=(const CtxtExpr& other)
+{ return *this = *this - other; }
+CtxtExpr& CtxtExpr::operator*=(const CtxtExpr& other)
+{ return *this = *this * other; }
+CtxtExpr& CtxtExpr::operator*=(const ExprConstant& c)
+{ return *this = c * *this; }
+
+CtxtExpr automorph(const CtxtExpr& a, long k)
+{
+  CtxtGraph *g = graphOf(a);
+  return CtxtExpr(g, g->automorph(a.getNode(), k));
+}
+
+CtxtExpr rotate1D(const CtxtExpr& a, long i, long k)
+{
+  CtxtGraph *g = graphOf(a);
+  return CtxtExpr(g, g->rotate1D(a.getNode(), i, k));
+}
+
+CtxtExpr rotate(const CtxtExpr& a, long k)
+{
+  CtxtGraph *g = graphOf(a);
+  return CtxtExpr(g, g->rotate(a.getNode(), k));
+}
+
+//======================== building the graph ========================
+
+CtxtGraph::CtxtGraph(const FHEPubKey& _pubKey, const ExprOptions& _opts,
+                     const EncryptedArray* _ea)
+  : pubKey(_pubKey),
+    ea(_ea? *_ea : *_pubKey.getContext().ea),
+    opts(_opts)
+{}
+
+long CtxtGraph::addNode(const ExprNode& n)
+{
+  for (long a: n.args)
+    if (a < 0 || a >= size())
+      throw std::logic_error("CtxtGraph: no node "+std::to_string(a));
+
+  std::vector<long> key;
+  if (opts.cse && n.op != EXPR_INPUT) {
+    key = { long(n.op), n.amt, n.dim, n.constant, long(n.negative) };
+    key.insert(key.end(), n.args.begin(), n.args.end());
+    auto it = cseTable.find(key);
+    if (it != cseTable.end()) {
+      stats.cseHits++;
+      return it->second;
+    }
+  }
+  nodes.push_back(n);
+  inputs.push_back(NULL);
+  if (!key.empty()) cseTable[key] = size()-1;
+  stats.nodes = size();
+  return size()-1;
+}
+
+CtxtExpr CtxtGraph::input(const Ctxt& c)
+{
+  if (&c.getContext() != &pubKey.getContext())
+    throw std::logic_error("CtxtGraph::input: a ciphertext of another context");
+  for (long i: range(size())) // the same object is the same input
+    if (inputs[i] == &c) return CtxtExpr(this, i);
+  long i = addNode(ExprNode(EXPR_INPUT));
+  inputs[i] = &c;
+  return CtxtExpr(this, i);
+}
+
+ExprConstant CtxtGraph::constant(const ZZX& poly, double size)
+{
+  const FHEcontext& context = pubKey.getContext();
+  consts.push_back(make_shared<DoubleCRT>(poly, context, context.allPrimes()));
+  constSizes.push_back(size);
+  return ExprConstant(consts.size()-1);
+}
+
+ExprConstant CtxtGraph::constant(const zzX& poly, double size)
+{
+  const FHEcontext& context = pubKey.getContext();
+  consts.push_back(make_shared<DoubleCRT>(poly, context, context.allPrimes()));
+  constSizes.push_back(size);
+  return ExprConstant(consts.size()-1);
+}
+
+long CtxtGraph::add(long a, long b, bool negative)
+{
+  ExprNode n(EXPR_ADD);
+  if (opts.cse && !negative && a > b) std::swap(a, b); // a+b = b+a
+  n.args = {a, b};
+  n.negative = negative;
+  return addNode(n);
+}
+
+long CtxtGraph::negate(long a)
+{
+  if (a >= 0 && a < size() && nodes[a].op == EXPR_NEGATE)
+    return nodes[a].args[0]; // -(-a) = a
+  ExprNode n(EXPR_NEGATE);
+  n.args = {a};
+  return addNode(n);
+}
+
+long CtxtGraph::multiply(long a, long b)
+{
+  ExprNode n(EXPR_MULTIPLY);
+  if (opts.cse && a > b) std::swap(a, b);
+  n.args = {a, b};
+  return addNode(n);
+}
+
+long CtxtGraph::multByConstant(long a, long c)
+{
+  if (c < 0 || c >= long(consts.size()))
+    throw std::logic_error("CtxtGraph: no constant "+std::to_string(c));
+  ExprNode n(EXPR_MULT_CONSTANT);
+  n.args = {a};
+  n.constant = c;
+  return addNode(n);
+}
+
+long CtxtGraph::automorph(long a, long k)
+{
+  const PAlgebra& zMStar = pubKey.getContext().zMStar;
+  long m = zMStar.getM();
+  k = mcMod(k, m);
+  if (!zMStar.inZmStar(k))
+    throw std::logic_error("CtxtGraph::automorph: k is not in Z_m^*");
+  if (a >= 0 && a < size() && nodes[a].op == EXPR_AUTOMORPH) {
+    k = MulMod(k, nodes[a].amt, m); // (x^{k1})^{k2} = x^{k1*k2}
+    a = nodes[a].args[0];
+  }
+  if (k == 1) return a;
+  ExprNode n(EXPR_AUTOMORPH);
+  n.args = {a};
+  n.amt = k;
+  return addNode(n);
+}
+
+long CtxtGraph::rotate1D(long a, long i, long k)
+{
+  if (i < 0 || i >= ea.dimension())
+    throw std::logic_error("CtxtGraph::rotate1D: no dimension "
+                           +std::to_string(i));
+  long ord = ea.sizeOfDimension(i);
+  k = mcMod(k, ord);
+  if (k == 0) return a;
+  if (ea.getTag() == PA_cx_tag || ea.nativeDimension(i)) // one automorphism
+    return automorph(a, ea.getPAlgebra().genToPow(i, k));
+  ExprNode n(EXPR_ROTATE);
+  n.args = {a};
+  n.dim = i;
+  n.amt = k;
+  return addNode(n);
+}
+
+long CtxtGraph::rotate(long a, long k)
+{
+  k = mcMod(k, ea.size());
+  if (k == 0) return a;
+  if (ea.dimension() == 1) return rotate1D(a, 0, k);
+  ExprNode n(EXPR_ROTATE);
+  n.args = {a};
+  n.amt = k;
+  return addNode(n);
+}
+
+long CtxtGraph::countOps(ExprOp op) const
+{
+  long n = 0;
+  for (const ExprNode& nd: nodes) n += (nd.op == op);
+  return n;
+}
+
+//======================== the optimizer ========================
+
+namespace {
+
+// The optimized graph for one set of outputs (the nodes are numbered as in
+// the CtxtGraph, some of them turned into EXPR_MULT_ADD nodes)
+struct ExprPlan {
+  std::vector<ExprNode> nodes;
+  std::vector<bool> live;
+  std::vector<long> uses;    // by live nodes and outputs
+  std::vector<bool> isOutput;
+
+  ExprPlan(const std::vector<ExprNode>& _nodes,
+           const std::vector<CtxtExpr>& exprs)
+    : nodes(_nodes), isOutput(_nodes.size(), false)
+  {
+    for (const CtxtExpr& e: exprs) isOutput[e.getNode()] = true;
+    countUses();
+  }
+
+  // Which nodes the outputs need, and how many times
+  void countUses() {
+    long n = nodes.size();
+    live.assign(n, false);
+    uses.assign(n, 0);
+    for (long i: range(n)) if (isOutput[i]) { live[i] = true; uses[i]++; }
+    for (long i = n-1; i >= 0; i--) // the args of a node come before it
+      if (live[i])
+        for (long a: nodes[i].args) { live[a] = true; uses[a]++; }
+  }
+
+  bool absorbable(long x) const { return uses[x] == 1 && !isOutput[x]; }
+
+  // The term sign*c*x, where x may be a product that is only used here
+  void addTerm(std::vector<ExprTerm>& terms, long x, long c, bool neg,
+               bool lazyRelin, long& absorbed) const {
+    ExprTerm t(x, c, neg);
+    if (lazyRelin && absorbable(x) && nodes[x].op == EXPR_MULTIPLY) {
+      t.arg = nodes[x].args[0];
+      t.other = nodes[x].args[1];
+      absorbed++;
+    }
+    terms.push_back(t);
+  }
+
+  // Flatten the sums (and negations/constants) under x that are only used
+  // in this sum
+  void expand(std::vector<ExprTerm>& terms, long x, bool neg, bool root,
+              bool lazyRelin, long& absorbed) const {
+    const ExprNode& nd = nodes[x];
+    bool flatten = root || (absorbable(x) && (nd.op == EXPR_ADD
+                                              || nd.op == EXPR_NEGATE
+                                              || nd.op == EXPR_MULT_CONSTANT));
+    if (!flatten) {
+      addTerm(terms, x, -1, neg, lazyRelin, absorbed);
+      return;
+    }
+    if (!root) absorbed++;
+    if (nd.op == EXPR_ADD) {
+      expand(terms, nd.args[0], neg, false, lazyRelin, absorbed);
+      expand(terms, nd.args[1], neg != nd.negative, false, lazyRelin, absorbed);
+    }
+    else if (nd.op == EXPR_NEGATE)
+      expand(terms, nd.args[0], !neg, false, lazyRelin, absorbed);
+    else
+      addTerm(terms, nd.args[0], nd.constant, neg, lazyRelin, absorbed);
+  }
+
+  // Turn every sum that is not part of a larger one into a fused node
+  long fuse(bool lazyRelin) {
+    long total = 0;
+    for (long i = long(nodes.size())-1; i >= 0; i--) {
+      if (!live[i] || nodes[i].op != EXPR_ADD) continue;
+      std::vector<ExprTerm> terms;
+      long absorbed = 0;
+      expand(terms, i, false, true, lazyRelin, absorbed);
+      ExprNode& nd = nodes[i];
+      nd.op = EXPR_MULT_ADD;
+      nd.terms = terms;
+      nd.args.clear();
+      for (const ExprTerm& t: terms) {
+        nd.args.push_back(t.arg);
+        if (t.other >= 0) nd.args.push_back(t.other);
+      }
+      total += absorbed;
+      countUses(); // the absorbed nodes are no longer live
+    }
+    return total;
+  }
+};
+
+// A unit of work: one node, or the hoisted automorphisms of one value
+struct ExprUnit {
+  std::vector<long> nodes;
+  bool hoisted;
+  ExprUnit(): hoisted(false) {}
+};
+
+} // anonymous namespace
+
+//======================== the evaluation ========================
+
+// The value of node i, which is computed or an input
+#define EXPR_VALUE(i) (inputs[i]? *inputs[i] : *vals[i])
+
+void CtxtGraph::evaluate(vector<Ctxt>& out, const vector<CtxtExpr>& exprs)
+{
+  FHE_TIMER_START;
+  for (const CtxtExpr& e: exprs)
+    if (e.getGraph() != this)
+      throw std::logic_error("CtxtGraph::evaluate: not an expression of it");
+  long nodesBuilt = stats.nodes, cseHits = stats.cseHits;
+  stats.clear();
+  stats.nodes = nodesBuilt;
+  stats.cseHits = cseHits;
+
+  // Optimize
+  ExprPlan plan(nodes, exprs);
+  if (opts.fuse) stats.fused = plan.fuse(opts.lazyRelin);
+
+  long n = size();
+  std::vector<ExprUnit> units;
+  std::vector<bool> grouped(n, false);
+  if (opts.hoist) {
+    std::map<long, std::vector<long>> bySource;
+    for (long i: range(n))
+      if (plan.live[i] && plan.nodes[i].op == EXPR_AUTOMORPH)
+        bySource[plan.nodes[i].args[0]].push_back(i);
+    for (auto& src: bySource)
+      if (src.second.size() > 1) {
+        ExprUnit u;
+        u.nodes = src.second;
+        u.hoisted = true;
+        for (long i: u.nodes) grouped[i] = true;
+        units.push_back(u);
+      }
+  }
+  for (long i: range(n))
+    if (plan.live[i] && !grouped[i] && !inputs[i]) {
+      ExprUnit u;
+      u.nodes = {i};
+      units.push_back(u);
+    }
+
+  // Schedule: a unit runs one level after the last of its inputs
+  std::vector<long> level(n, 0);
+  std::vector<long> unitLevel(units.size(), 0);
+  std::sort(units.begin(), units.end(), // in the order of the nodes
+            [](const ExprUnit& a, const ExprUnit& b)
+            { return a.nodes[0] < b.nodes[0]; });
+  for (long u: range(units.size())) {
+    long l = 1;
+    for (long i: units[u].nodes)
+      for (long a: plan.nodes[i].args) l = std::max(l, level[a]+1);
+    for (long i: units[u].nodes) level[i] = l;
+    unitLevel[u] = l;
+    stats.levels = std::max(stats.levels, l);
+  }
+  std::vector< std::vector<long> > byLevel(stats.levels+1);
+  for (long u: range(units.size())) byLevel[unitLevel[u]].push_back(u);
+
+  // Run
+  std::vector< std::shared_ptr<Ctxt> > vals(n);
+  std::vector<long> products(n, 0); // of the fused nodes
+  auto runNode = [&](long i) {
+    const ExprNode& nd = plan.nodes[i];
+    std::shared_ptr<Ctxt> r;
+    if (nd.op == EXPR_MULT_ADD) {
+      Ctxt scratch(ZeroCtxtLike, EXPR_VALUE(nd.terms[0].arg));
+      for (long t: range(nd.terms.size())) {
+        const ExprTerm& term = nd.terms[t];
+        scratch = EXPR_VALUE(term.arg);
+        if (term.other >= 0) {
+          scratch.setLazyRelin(true);
+          scratch.multiplyBy(EXPR_VALUE(term.other)); // not re-linearized
+          scratch.setLazyRelin(false);
+          products[i]++;
+        }
+        if (term.constant >= 0)
+          scratch.multByConstant(*consts[term.constant],
+                                 constSizes[term.constant]);
+        if (t == 0) {
+          r = make_shared<Ctxt>(std::move(scratch));
+          if (term.negative) r->negate();
+        }
+        else r->addCtxt(std::move(scratch), term.negative);
+      }
+      if (products[i] > 0) r->reLinearize();
+    }
+    else {
+      const Ctxt& a = EXPR_VALUE(nd.args[0]);
+      r = make_shared<Ctxt>(a);
+      switch (nd.op) {
+      case EXPR_ADD:
+        r->addCtxt(EXPR_VALUE(nd.args[1]), nd.negative);
+        break;
+      case EXPR_NEGATE:
+        r->negate();
+        break;
+      case EXPR_MULTIPLY:
+        if (nd.args[1] == nd.args[0]) r->square();
+        else r->multiplyBy(EXPR_VALUE(nd.args[1]));
+        break;
+      case EXPR_MULT_CONSTANT:
+        r->multByConstant(*consts[nd.constant], constSizes[nd.constant]);
+        break;
+      case EXPR_AUTOMORPH:
+        r->smartAutomorph(nd.amt);
+        break;
+      case EXPR_ROTATE:
+        if (nd.dim < 0) ea.rotate(*r, nd.amt);
+        else ea.rotate1D(*r, nd.dim, nd.amt);
+        break;
+      default:
+        throw std::logic_error(std::string("CtxtGraph: cannot evaluate ")
+                               + exprOpName(nd.op));
+      }
+    }
+    vals[i] = r;
+  };
+  std::vector<bool> didHoist(units.size(), false);
+  auto runUnit = [&](long ui) {
+    const ExprUnit& u = units[ui];
+    if (u.hoisted) {
+      const Ctxt& src = EXPR_VALUE(plan.nodes[u.nodes[0]].args[0]);
+      long keyID = src.getKeyID();
+      std::vector<long> ks;
+      bool direct = true;
+      for (long i: u.nodes) {
+        ks.push_back(plan.nodes[i].amt);
+        direct = direct && pubKey.haveKeySWmatrix(1, ks.back(), keyID, keyID);
+      }
+      if (direct) {
+        BasicAutomorphPrecon precon(src);
+        std::vector< std::shared_ptr<Ctxt> > outs;
+        precon.automorph(outs, ks);
+        for (long j: range(u.nodes.size())) vals[u.nodes[j]] = outs[j];
+        didHoist[ui] = true;
+        return;
+      }
+    }
+    for (long i: u.nodes) runNode(i);
+  };
+
+  long nLive = 0;
+  for (long l = 1; l <= stats.levels; l++) {
+    const std::vector<long>& lvl = byLevel[l];
+    long nu = lvl.size();
+    if (opts.parallel && nu > 1 && nu >= fheAvailableThreads()) {
+      FHE_EXEC_RANGE(nu, first, last) // inner loops: serial, or tasks
+        for (long j = first; j < last; j++) runUnit(lvl[j]);
+      FHE_EXEC_RANGE_END
+    }
+    else for (long u: lvl) runUnit(u);
+
+    // free the values after their last use
+    for (long u: lvl) {
+      const ExprUnit& unit = units[u];
+      nLive += unit.nodes.size();
+      stats.evaluated += unit.nodes.size();
+      if (didHoist[u]) {
+        stats.hoistGroups++;
+        stats.hoisted += unit.nodes.size();
+      }
+      for (long i: unit.nodes) {
+        if (plan.nodes[i].op == EXPR_MULT_ADD && products[i] > 1)
+          stats.relinsSaved += products[i]-1;
+        for (long a: plan.nodes[i].args)
+          if (--plan.uses[a] == 0 && vals[a]) { vals[a].reset(); nLive--; }
+      }
+    }
+    stats.maxLive = std::max(stats.maxLive, nLive);
+  }
+
+  out.assign(exprs.size(), Ctxt(pubKey));
+  for (long j: range(exprs.size())) {
+    long i = exprs[j].getNode();
+    out[j] = EXPR_VALUE(i);
+  }
+}
+
+void CtxtGraph::evaluate(Ctxt& out, const CtxtExpr& expr)
+{
+  vector<Ctxt> v;
+  evaluate(v, vector<CtxtExpr>(1, expr));
+  out = std::move(v[0]);
+}
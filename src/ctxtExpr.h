@@ -0,0 +1,241 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _CTXT_EXPR_H_
+#define _CTXT_EXPR_H_
+/**
+ * @file ctxtExpr.h
+ * @brief Lazy ciphertext expressions, optimized as a whole before they are
+ * evaluated.
+ *
+ * A CtxtGraph builds a DAG of operations instead of performing them: the
+ * CtxtExpr handles that it returns support +, -, * and multiplication by
+ * constants, and automorph(), rotate() and rotate1D() make rotations.
+ * Nothing is computed until evaluate() is called on the outputs, which
+ * first optimizes the DAG:
+ *  - Common subexpressions are merged as the DAG is built, so a rotation
+ *    of the same value by the same amount is computed once. Automorphisms
+ *    of automorphisms are folded into one, and rotations along native
+ *    dimensions become automorphisms.
+ *  - The automorphisms of one value are grouped and, when there are
+ *    key-switching matrices for all of them, computed from a single digit
+ *    decomposition (see BasicAutomorphPrecon).
+ *  - Sums of (negated) terms, each one possibly multiplied by a constant,
+ *    are fused into one multiply-accumulate node, which adds every term
+ *    into the accumulator through one scratch ciphertext.
+ *  - The products whose only use is such a sum are left in lazy
+ *    re-linearization mode (see Ctxt::setLazyRelin), so the whole sum is
+ *    re-linearized once.
+ * The nodes are then run level by level, with the nodes of a level split
+ * between the NTL threads when there are enough of them, and every value
+ * is freed after its last use.
+ *
+ * Usage:
+ * \code
+ *   CtxtGraph g(publicKey);
+ *   CtxtExpr x = g.input(c);             // c is not copied
+ *   ExprConstant w = g.constant(poly);
+ *   CtxtExpr y = w*rotate(x, 1) + w*rotate(x, 2) - x*x;
+ *   Ctxt out(publicKey);
+ *   g.evaluate(out, y);
+ * \endcode
+ * The inputs must stay alive and unchanged until evaluate() returns. A
+ * graph is not thread-safe, and can be evaluated many times.
+ **/
+#include <vector>
+#include <map>
+#include <memory>
+#include <iostream>
+#include "Ctxt.h"
+
+class EncryptedArray;
+class CtxtGraph;
+
+//! The kinds of nodes in a CtxtGraph
+enum ExprOp {
+  EXPR_INPUT,         //!< a ciphertext given to CtxtGraph::input
+  EXPR_ADD,           //!< a + b, or a - b
+  EXPR_NEGATE,        //!< -a
+  EXPR_MULTIPLY,      //!< a * b
+  EXPR_MULT_CONSTANT, //!< c * a
+  EXPR_AUTOMORPH,     //!< a after X -> X^k
+  EXPR_ROTATE,        //!< a rotation by the EncryptedArray
+  EXPR_MULT_ADD,      //!< a fused sum of terms, made by the optimizer
+  EXPR_OP_COUNT
+};
+
+//! @brief A printable name for op
+const char* exprOpName(ExprOp op);
+
+//! @brief A constant of a CtxtGraph, for multiplications by it
+struct ExprConstant {
+  long idx;
+  ExprConstant(): idx(-1) {}
+  explicit ExprConstant(long _idx): idx(_idx) {}
+};
+
+/**
+ * @class CtxtExpr
+ * @brief A handle of a node of a CtxtGraph, it behaves like a ciphertext
+ * whose operations are recorded rather than performed.
+ **/
+class CtxtExpr {
+  CtxtGraph *graph;
+  long node;
+
+public:
+  CtxtExpr(): graph(NULL), node(-1) {}
+  CtxtExpr(CtxtGraph *_graph, long _node): graph(_graph), node(_node) {}
+
+  CtxtGraph *getGraph() const { return graph; }
+  long getNode() const { return node; }
+  bool isNull() const { return graph == NULL; }
+
+  CtxtExpr& operator+=(const CtxtExpr& other);
+  CtxtExpr& operator-=(const CtxtExpr& other);
+  CtxtExpr& operator*=(const CtxtExpr& other);
+  CtxtExpr& operator*=(const ExprConstant& c);
+};
+
+CtxtExpr operator+(const CtxtExpr& a, const CtxtExpr& b);
+CtxtExpr operator-(const CtxtExpr& a, const CtxtExpr& b);
+CtxtExpr operator-(const CtxtExpr& a);
+CtxtExpr operator*(const CtxtExpr& a, const CtxtExpr& b);
+CtxtExpr operator*(const ExprConstant& c, const CtxtExpr& a);
+inline CtxtExpr operator*(const CtxtExpr& a, const ExprConstant& c)
+{ return c*a; }
+
+//! @brief a after the automorphism X -> X^k
+CtxtExpr automorph(const CtxtExpr& a, long k);
+//! @brief a rotated by k along dimension i, as ea.rotate1D
+CtxtExpr rotate1D(const CtxtExpr& a, long i, long k);
+//! @brief a rotated by k, as ea.rotate
+CtxtExpr rotate(const CtxtExpr& a, long k);
+
+//! One term of a fused EXPR_MULT_ADD node: (+/-) c * arg (* other)
+struct ExprTerm {
+  long arg;
+  long other;    // the other factor of a product, or -1
+  long constant; // the index of the constant, or -1 for none
+  bool negative;
+
+  ExprTerm(long _arg=-1, long _constant=-1, bool _negative=false):
+    arg(_arg), other(-1), constant(_constant), negative(_negative) {}
+};
+
+//! One node of a CtxtGraph
+struct ExprNode {
+  ExprOp op;
+  std::vector<long> args;     // the nodes that the operation reads
+  long amt;                   // of an automorphism or rotation
+  long dim;                   // of a rotation, -1 for the whole array
+  long constant;              // of EXPR_MULT_CONSTANT
+  bool negative;              // EXPR_ADD subtracts args[1]
+  std::vector<ExprTerm> terms; // of EXPR_MULT_ADD
+
+  ExprNode(ExprOp _op=EXPR_INPUT):
+    op(_op), amt(0), dim(-1), constant(-1), negative(false) {}
+};
+
+//! @brief Which optimizations evaluate() applies, all of them by default
+struct ExprOptions {
+  bool cse;       //!< merge common subexpressions while building
+  bool hoist;     //!< hoist the automorphisms of one value
+  bool fuse;      //!< fuse sums into multiply-accumulate nodes
+  bool lazyRelin; //!< re-linearize the fused sums of products once
+  bool parallel;  //!< run the nodes of a level in parallel
+
+  ExprOptions():
+    cse(true), hoist(true), fuse(true), lazyRelin(true), parallel(true) {}
+};
+
+//! @brief What the last evaluate() did
+struct ExprStats {
+  long nodes;         //!< in the graph
+  long cseHits;       //!< operations that were merged into existing nodes
+  long evaluated;     //!< nodes that were computed
+  long levels;        //!< in the schedule
+  long hoistGroups;   //!< values whose automorphisms were hoisted
+  long hoisted;       //!< automorphisms in those groups
+  long fused;         //!< nodes absorbed into multiply-accumulate nodes
+  long relinsSaved;   //!< re-linearizations that were not needed
+  long maxLive;       //!< the most computed values held at once
+
+  ExprStats() { clear(); }
+  void clear() {
+    nodes = cseHits = evaluated = levels = hoistGroups = hoisted = fused =
+      relinsSaved = maxLive = 0;
+  }
+};
+
+std::ostream& operator<<(std::ostream& str, const ExprStats& stats);
+
+/**
+ * @class CtxtGraph
+ * @brief The DAG of a set of lazy ciphertext expressions.
+ **/
+class CtxtGraph {
+  const FHEPubKey& pubKey;
+  const EncryptedArray& ea;
+  ExprOptions opts;
+  std::vector<ExprNode> nodes;
+  std::vector<const Ctxt*> inputs;                // by node, NULL if none
+  std::vector< std::shared_ptr<DoubleCRT> > consts;
+  std::vector<double> constSizes;
+  std::map<std::vector<long>, long> cseTable;     // node keys to nodes
+  ExprStats stats;
+
+  long addNode(const ExprNode& n);
+
+public:
+  //! The rotations use ea, by default the one of the context
+  explicit CtxtGraph(const FHEPubKey& _pubKey,
+                     const ExprOptions& _opts=ExprOptions(),
+                     const EncryptedArray* _ea=NULL);
+
+  CtxtGraph(const CtxtGraph&) = delete;
+  CtxtGraph& operator=(const CtxtGraph&) = delete;
+
+  const FHEPubKey& getPubKey() const { return pubKey; }
+  const EncryptedArray& getEA() const { return ea; }
+  const ExprOptions& getOptions() const { return opts; }
+
+  //! @brief A new input, c is not copied
+  CtxtExpr input(const Ctxt& c);
+
+  //! @brief A constant, encoded once over all the primes. size is the
+  //! bound on its noise effect, as in Ctxt::multByConstant.
+  ExprConstant constant(const NTL::ZZX& poly, double size=-1.0);
+  ExprConstant constant(const zzX& poly, double size=-1.0);
+
+  //! @name Building the DAG (also called by the operators of CtxtExpr)
+  ///@{
+  long add(long a, long b, bool negative=false);
+  long negate(long a);
+  long multiply(long a, long b);
+  long multByConstant(long a, long c);
+  long automorph(long a, long k);
+  long rotate1D(long a, long i, long k);
+  long rotate(long a, long k);
+  ///@}
+
+  long size() const { return nodes.size(); }
+  const ExprNode& node(long i) const { return nodes[i]; }
+  long countOps(ExprOp op) const;
+
+  //! @brief Optimize the DAG for these outputs and compute them
+  void evaluate(std::vector<Ctxt>& out, const std::vector<CtxtExpr>& exprs);
+  void evaluate(Ctxt& out, const CtxtExpr& expr);
+
+  const ExprStats& getStats() const { return stats; }
+};
+
+#endif // _CTXT_EXPR_H_
@@ -0,0 +1,413 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* ctxtTrace.cpp - tracing the ciphertext operations, and replaying them
+ */
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <iomanip>
+#include <stdexcept>
+#include "ctxtTrace.h"
+#include "FHE.h"
+#include "CtPtrs.h"
+#include "binio.h"
+
+NTL_CLIENT
+
+static std::atomic<CtxtTracer*> installedTracer(NULL);
+
+// Nesting depth of the traced operations on this thread
+static thread_local long traceDepth = 0;
+
+// Number of recryptions in progress, whose operations run on other threads
+static std::atomic_long tracePaused(0);
+
+void setCtxtTracer(CtxtTracer *tracer) { installedTracer = tracer; }
+CtxtTracer *getCtxtTracer() { return installedTracer; }
+
+static double wallTime()
+{
+  return chrono::duration<double>(
+           chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double log2Noise(const Ctxt& c)
+{
+  if (c.getNoiseBound() <= 0.0) return 0;
+  return log(c.getNoiseBound())/log(2.0);
+}
+
+const char* ctxtTraceOpName(CtxtTraceOp op)
+{
+  switch (op) {
+  case TRACE_INPUT:         return "input";
+  case TRACE_ADD:           return "addCtxt";
+  case TRACE_MULTIPLY:      return "multiplyBy";
+  case TRACE_AUTOMORPH:     return "smartAutomorph";
+  case TRACE_MULT_CONSTANT: return "multByConstant";
+  case TRACE_MODDOWN:       return "modDownToSet";
+  case TRACE_RECRYPT:       return "reCrypt";
+  default: return "unknown";
+  }
+}
+
+//======================== CtxtTrace ========================
+
+long CtxtTrace::countOps(CtxtTraceOp op) const
+{
+  long count = 0;
+  for (const CtxtTraceRecord& rec: records)
+    if (rec.op == op) count++;
+  return count;
+}
+
+double CtxtTrace::seconds(CtxtTraceOp op) const
+{
+  double sec = 0;
+  for (const CtxtTraceRecord& rec: records)
+    if (rec.op == op) sec += rec.seconds;
+  return sec;
+}
+
+static const long traceVersion = 1;
+
+// The ids are written plus one, so that -1 (none) is written as zero
+void CtxtTrace::write(ostream& str) const
+{
+  writeEyeCatcher(str, BINIO_EYE_TRACE_BEGIN);
+  write_raw_int(str, traceVersion, BINIO_32BIT);
+  write_raw_int(str, size());
+  for (const CtxtTraceRecord& rec: records) {
+    write_raw_int(str, rec.op, 1);
+    write_raw_int(str, rec.input+1, BINIO_32BIT);
+    write_raw_int(str, rec.other+1, BINIO_32BIT);
+    write_raw_int(str, rec.arg);
+    write_raw_int(str, rec.batch, BINIO_32BIT);
+    write_raw_int(str, rec.primesBefore, BINIO_32BIT);
+    write_raw_int(str, rec.primesAfter, BINIO_32BIT);
+    write_raw_double(str, rec.logNoise);
+    write_raw_double(str, rec.seconds);
+  }
+  writeEyeCatcher(str, BINIO_EYE_TRACE_END);
+}
+
+void CtxtTrace::read(istream& str)
+{
+  if (readEyeCatcher(str, BINIO_EYE_TRACE_BEGIN) != 0
+      || read_raw_int(str, BINIO_32BIT) != traceVersion)
+    throw std::runtime_error("CtxtTrace: not a trace");
+  long n = read_raw_int(str);
+  if (!str || n < 0)
+    throw std::runtime_error("CtxtTrace: corrupt trace");
+
+  vector<CtxtTraceRecord> v;
+  for (long i: range(n)) {
+    CtxtTraceRecord rec;
+    long op = read_raw_int(str, 1);
+    rec.id = i;
+    rec.input = read_raw_int(str, BINIO_32BIT) - 1;
+    rec.other = read_raw_int(str, BINIO_32BIT) - 1;
+    rec.arg = read_raw_int(str);
+    rec.batch = read_raw_int(str, BINIO_32BIT);
+    rec.primesBefore = read_raw_int(str, BINIO_32BIT);
+    rec.primesAfter = read_raw_int(str, BINIO_32BIT);
+    rec.logNoise = read_raw_double(str);
+    rec.seconds = read_raw_double(str);
+    // an operation reads only the values before it
+    if (!str || op < 0 || op >= TRACE_OP_COUNT
+        || rec.input >= i || rec.other >= i
+        || (op == TRACE_INPUT && (rec.input >= 0 || rec.other >= 0)))
+      throw std::runtime_error("CtxtTrace: corrupt trace");
+    rec.op = CtxtTraceOp(op);
+    v.push_back(rec);
+  }
+  if (readEyeCatcher(str, BINIO_EYE_TRACE_END) != 0)
+    throw std::runtime_error("CtxtTrace: corrupt trace");
+  records.swap(v);
+}
+
+ostream& operator<<(ostream& str, const CtxtTrace& trace)
+{
+  str << "[trace of " << trace.size() << " records:";
+  for (long op: range(TRACE_OP_COUNT))
+    str << " " << ctxtTraceOpName(CtxtTraceOp(op)) << "="
+        << trace.countOps(CtxtTraceOp(op));
+  return str << "]";
+}
+
+//======================== CtxtTracer ========================
+
+// The tag of a ciphertext is epoch*traceEpochSize + its value, so the tags
+// of other tracers, or of this one before a clear(), are not taken for
+// values of this trace
+static const long traceEpochSize = 1L << 32;
+static std::atomic_long traceEpochs(0);
+
+CtxtTracer::CtxtTracer() : batches(0), epoch(traceEpochs++) {}
+
+long CtxtTracer::find(const Ctxt& c) const
+{
+  long tag = c.getTraceId();
+  if (tag < 0 || tag / traceEpochSize != epoch % traceEpochSize) return -1;
+  long id = tag % traceEpochSize;
+  return (id < trace.size())? id : -1;
+}
+
+long CtxtTracer::lookup(const Ctxt& c) const
+{
+  lock_guard<mutex> lock(mx);
+  return find(c);
+}
+
+long CtxtTracer::idOf(const Ctxt& c)
+{
+  lock_guard<mutex> lock(mx);
+  long id = find(c);
+  if (id < 0) { // not computed by this trace
+    CtxtTraceRecord input;
+    input.id = id = trace.size();
+    input.primesBefore = input.primesAfter = c.getPrimeSet().card();
+    input.logNoise = log2Noise(c);
+    trace.records.push_back(input);
+    c.setTraceId((epoch % traceEpochSize)*traceEpochSize + id);
+  }
+  return id;
+}
+
+void CtxtTracer::record(CtxtTraceRecord& rec, const Ctxt& self)
+{
+  lock_guard<mutex> lock(mx);
+  rec.id = trace.size();
+  trace.records.push_back(rec);
+  self.setTraceId((epoch % traceEpochSize)*traceEpochSize + rec.id);
+}
+
+long CtxtTracer::newBatch()
+{
+  lock_guard<mutex> lock(mx);
+  return batches++;
+}
+
+void CtxtTracer::clear()
+{
+  lock_guard<mutex> lock(mx);
+  trace.clear();
+  batches = 0;
+  epoch = traceEpochs++;
+}
+
+//======================== CtxtTraceProbe ========================
+
+void CtxtTraceProbe::init(CtxtTraceOp op, Ctxt& self, const Ctxt* other,
+                          long arg)
+{
+  CtxtTraceRecord rec;
+  rec.op = op;
+  rec.arg = arg;
+  rec.input = self.isEmpty()? -1 : tracer->idOf(self);
+  if (other != NULL && !other->isEmpty())
+    rec.other = tracer->idOf(*other);
+  rec.primesBefore = self.getPrimeSet().card();
+  cts.push_back(&self);
+  recs.push_back(rec);
+}
+
+CtxtTraceProbe::CtxtTraceProbe(CtxtTraceOp op, Ctxt& self,
+                               const Ctxt* other, long arg)
+  : tracer(getCtxtTracer()), t0(0)
+{
+  if (tracer == NULL) return;
+  if (traceDepth > 0 || tracePaused > 0 || (self.isEmpty() &&
+      (other == NULL || other->isEmpty()))) {
+    tracer = NULL; // part of another operation, or nothing to trace
+    return;
+  }
+  traceDepth++;
+  init(op, self, other, arg);
+  t0 = wallTime();
+}
+
+CtxtTraceProbe::CtxtTraceProbe(CtxtTraceOp op, const vector<Ctxt*>& batch,
+                               long arg)
+  : tracer(getCtxtTracer()), t0(0)
+{
+  if (tracer == NULL) return;
+  if (traceDepth > 0 || tracePaused > 0) {
+    tracer = NULL;
+    return;
+  }
+  traceDepth++;
+  long b = tracer->newBatch();
+  for (Ctxt *c: batch)
+    if (!c->isEmpty()) {
+      init(op, *c, NULL, arg);
+      recs.back().batch = b;
+    }
+  if (op == TRACE_RECRYPT) tracePaused++;
+  t0 = wallTime();
+}
+
+CtxtTraceProbe::~CtxtTraceProbe()
+{
+  if (tracer == NULL) return;
+  double sec = wallTime() - t0;
+  if (recs.size() > 0 && recs[0].op == TRACE_RECRYPT) tracePaused--;
+  traceDepth--;
+  for (long i: range(recs.size())) {
+    recs[i].seconds = sec / recs.size(); // a batch shares the time
+    recs[i].primesAfter = cts[i]->getPrimeSet().card();
+    recs[i].logNoise = log2Noise(*cts[i]);
+    tracer->record(recs[i], *cts[i]);
+  }
+}
+
+//======================== replayTrace ========================
+
+TraceReplayStats::TraceReplayStats()
+{
+  for (long op: range(TRACE_OP_COUNT)) {
+    count[op] = 0;
+    seconds[op] = 0;
+  }
+}
+
+double TraceReplayStats::totalSeconds() const
+{
+  double sec = 0;
+  for (long op: range(TRACE_OP_COUNT))
+    if (op != TRACE_INPUT) sec += seconds[op];
+  return sec;
+}
+
+void TraceReplayStats::print(ostream& str, const CtxtTrace& trace) const
+{
+  str << "operation        count   recorded   replayed (seconds)\n";
+  for (long op: range(TRACE_OP_COUNT)) {
+    if (count[op] == 0) continue;
+    str << setw(15) << left << ctxtTraceOpName(CtxtTraceOp(op)) << right
+        << setw(7) << count[op]
+        << setw(11) << trace.seconds(CtxtTraceOp(op))
+        << setw(11) << seconds[op] << "\n";
+  }
+  str << "total replayed: " << totalSeconds() << " seconds\n";
+}
+
+// The lowest n primes of s
+static IndexSet lowPrimes(const IndexSet& s, long n)
+{
+  IndexSet low;
+  for (long i = s.first(); i <= s.last() && low.card() < n; i = s.next(i))
+    low.insert(i);
+  return low;
+}
+
+void replayTrace(TraceReplayStats& stats, const CtxtTrace& trace,
+                 FHEPubKey& pubKey, const vector<Ctxt>* inputs,
+                 vector<Ctxt>* outputs)
+{
+  const FHEcontext& context = pubKey.getContext();
+  long n = trace.size();
+
+  // lastUse[v] is the last record that reads v, -1 if none
+  vector<long> lastUse(n, -1);
+  for (const CtxtTraceRecord& rec: trace.records) {
+    if (rec.input >= 0) lastUse[rec.input] = rec.id;
+    if (rec.other >= 0) lastUse[rec.other] = rec.id;
+  }
+
+  // the constant of the multByConstant's
+  ZZX constant;
+  long ptxtSpace = pubKey.getPtxtSpace();
+  for (long i: range(context.zMStar.getPhiM()))
+    SetCoeff(constant, i, RandomBnd(ptxtSpace));
+
+  vector< unique_ptr<Ctxt> > values(n);
+  auto valueOf = [&](long v) -> const Ctxt& {
+    if (v < 0 || v >= n || !values[v])
+      throw std::logic_error("replayTrace: the trace reads a lost value");
+    return *values[v];
+  };
+  long nextInput = 0;
+  if (outputs) outputs->clear();
+
+  for (long i = 0; i < n; ) {
+    const CtxtTraceRecord& rec = trace.records[i];
+    long end = i+1; // the records done together, a recryption batch
+    if (rec.op == TRACE_RECRYPT)
+      while (end < n && trace.records[end].op == TRACE_RECRYPT
+             && trace.records[end].batch == rec.batch
+             && trace.records[end].arg == rec.arg)
+        end++;
+
+    for (long j: range(i, end)) {
+      const CtxtTraceRecord& r = trace.records[j];
+      values[j].reset((r.input >= 0)? new Ctxt(valueOf(r.input))
+                                     : new Ctxt(pubKey));
+    }
+    Ctxt& c = *values[i];
+
+    double t0 = wallTime();
+    switch (rec.op) {
+    case TRACE_INPUT:
+      if (inputs) {
+        if (nextInput >= lsize(*inputs))
+          throw std::logic_error("replayTrace: too few inputs");
+        c = (*inputs)[nextInput++];
+      }
+      else {
+        pubKey.Encrypt(c, ZZX(0));
+        if (rec.primesAfter < c.getPrimeSet().card())
+          c.modDownToSet(lowPrimes(c.getPrimeSet(), rec.primesAfter));
+      }
+      break;
+    case TRACE_ADD:
+      if (rec.other >= 0) c.addCtxt(valueOf(rec.other), rec.arg != 0);
+      break;
+    case TRACE_MULTIPLY:
+      if (rec.other >= 0) c.multiplyBy(valueOf(rec.other));
+      break;
+    case TRACE_AUTOMORPH:
+      c.smartAutomorph(rec.arg);
+      break;
+    case TRACE_MULT_CONSTANT:
+      c.multByConstant(constant);
+      break;
+    case TRACE_MODDOWN:
+      c.modDownToSet(lowPrimes(c.getPrimeSet(), rec.primesAfter));
+      break;
+    case TRACE_RECRYPT: {
+      vector<Ctxt*> batch;
+      for (long j: range(i, end)) batch.push_back(values[j].get());
+      if (rec.arg) pubKey.thinReCrypt(CtPtrs_vectorPt(batch));
+      else         pubKey.reCrypt(CtPtrs_vectorPt(batch));
+      break;
+    }
+    default:
+      throw std::logic_error("replayTrace: unknown operation");
+    }
+    stats.seconds[rec.op] += wallTime() - t0;
+    stats.count[rec.op] += end - i;
+
+    // drop the values that are not read any more
+    for (long j: range(i, end)) {
+      const CtxtTraceRecord& r = trace.records[j];
+      for (long v: {r.input, r.other})
+        if (v >= 0 && lastUse[v] == j) values[v].reset();
+      if (lastUse[j] < 0) {
+        if (outputs && r.op != TRACE_INPUT) outputs->push_back(*values[j]);
+        values[j].reset();
+      }
+    }
+    i = end;
+  }
+}
@@ -0,0 +1,183 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _CTXT_TRACE_H_
+#define _CTXT_TRACE_H_
+/**
+ * @file ctxtTrace.h
+ * @brief Tracing the ciphertext operations of a workload, and replaying
+ * the trace without its data.
+ *
+ * While a CtxtTracer is installed with setCtxtTracer(), every outermost
+ * addCtxt, multiplyBy, smartAutomorph, multByConstant, modDownToSet and
+ * reCrypt (or thinReCrypt) appends a record to its CtxtTrace: the
+ * operation, the values it read and wrote, the sizes of the prime set
+ * before and after, the noise bound of the result and the duration. Every
+ * value is numbered, and the ciphertexts remember the number of the value
+ * they hold (see Ctxt::getTraceId), so copies of a value are the same
+ * value. A ciphertext that was not computed by the traced operations of
+ * this tracer is added as an input, with its prime-set size and noise.
+ *
+ * A trace holds no keys, plaintexts or ciphertexts, only the shape of the
+ * workload, so it can be written to a file (CtxtTrace::write) and given
+ * away. replayTrace() carries it out again with any public key, on dummy
+ * inputs (encryptions of zero at the recorded levels) or on real ones,
+ * and times every operation. See Test_Trace.cpp for a tool that replays a
+ * trace file.
+ *
+ * Operations made inside traced operations (e.g., the modDownToSet inside
+ * multiplyBy) are part of them, and while a recryption runs nothing else
+ * is traced, since its work runs on other threads.
+ **/
+#include <vector>
+#include <mutex>
+#include <iostream>
+#include "Ctxt.h"
+
+class FHEPubKey;
+
+//! The operations in a trace
+enum CtxtTraceOp {
+  TRACE_INPUT,         //!< a ciphertext that the trace did not compute
+  TRACE_ADD,           //!< addCtxt, arg=1 for a subtraction
+  TRACE_MULTIPLY,      //!< multiplyBy
+  TRACE_AUTOMORPH,     //!< smartAutomorph, arg=k
+  TRACE_MULT_CONSTANT, //!< multByConstant
+  TRACE_MODDOWN,       //!< modDownToSet
+  TRACE_RECRYPT,       //!< reCrypt, arg=1 for thinReCrypt
+  TRACE_OP_COUNT
+};
+
+//! @brief A printable name for op
+const char* ctxtTraceOpName(CtxtTraceOp op);
+
+//! One operation of a trace
+struct CtxtTraceRecord {
+  CtxtTraceOp op;
+  long id;         // the value that the operation computed
+  long input;      // the value that it modified, -1 if it was empty
+  long other;      // the other operand, -1 if none
+  long arg;
+  long batch;      // for TRACE_RECRYPT, the same for one call
+  long primesBefore, primesAfter; // of the modified ciphertext
+  double logNoise; // log2 of the noise bound of the result
+  double seconds;
+
+  CtxtTraceRecord() : op(TRACE_INPUT), id(-1), input(-1), other(-1),
+    arg(0), batch(0), primesBefore(0), primesAfter(0), logNoise(0),
+    seconds(0) {}
+};
+
+//! @brief The records of a trace, in the order the operations ended. The
+//! values are numbered in the order of their records.
+class CtxtTrace {
+public:
+  std::vector<CtxtTraceRecord> records;
+
+  long size() const { return records.size(); }
+  long countOps(CtxtTraceOp op) const;
+  //! The sum of the recorded durations of the operations op
+  double seconds(CtxtTraceOp op) const;
+  void clear() { records.clear(); }
+
+  //! Binary IO, read raises std::runtime_error on malformed data
+  void write(std::ostream& str) const;
+  void read(std::istream& str);
+};
+
+std::ostream& operator<<(std::ostream& str, const CtxtTrace& trace);
+
+/**
+ * @class CtxtTracer
+ * @brief Records the traced operations into a CtxtTrace. It may be used
+ * from several threads at once.
+ **/
+class CtxtTracer {
+  mutable std::mutex mx;
+  CtxtTrace trace;
+  long batches;
+  long epoch; // tags the ids of this tracer, new on every clear()
+
+  long find(const Ctxt& c) const; // the caller holds mx
+public:
+  CtxtTracer();
+
+  //! The value that c holds, adding an input record if it has none. Call
+  //! it on the inputs before tracing to number them in their order.
+  long idOf(const Ctxt& c);
+  //! The value that c holds, -1 if it holds none of this trace
+  long lookup(const Ctxt& c) const;
+  //! Append rec, as the new value of self
+  void record(CtxtTraceRecord& rec, const Ctxt& self);
+  //! A new number for the records of a recryption
+  long newBatch();
+
+  const CtxtTrace& getTrace() const { return trace; }
+  void clear();
+};
+
+//! @brief Install a tracer (NULL to stop tracing). The tracer is not
+//! owned, it must be alive as long as it is installed. Without a tracer
+//! each operation only checks for one.
+void setCtxtTracer(CtxtTracer *tracer);
+CtxtTracer *getCtxtTracer();
+
+//! \cond FALSE (make doxygen ignore these classes)
+// Records an outermost operation when it goes out of scope. Used by the
+// operations themselves.
+class CtxtTraceProbe {
+  CtxtTracer *tracer; // NULL if this operation is not traced
+  std::vector<Ctxt*> cts;
+  std::vector<CtxtTraceRecord> recs;
+  double t0;
+
+  void init(CtxtTraceOp op, Ctxt& self, const Ctxt* other, long arg);
+public:
+  CtxtTraceProbe(CtxtTraceOp op, Ctxt& self, const Ctxt* other=NULL,
+                 long arg=0);
+  CtxtTraceProbe(CtxtTraceOp op, const std::vector<Ctxt*>& batch, long arg);
+  ~CtxtTraceProbe();
+
+  CtxtTraceProbe(const CtxtTraceProbe&) = delete;
+  CtxtTraceProbe& operator=(const CtxtTraceProbe&) = delete;
+};
+//! \endcond
+
+//! The times of a replay
+struct TraceReplayStats {
+  long count[TRACE_OP_COUNT];
+  double seconds[TRACE_OP_COUNT];
+
+  TraceReplayStats();
+  double totalSeconds() const;
+  void print(std::ostream& str, const CtxtTrace& trace) const;
+};
+
+/**
+ * @brief Carry out the operations of trace with pubKey.
+ *
+ * @param inputs  the ciphertexts of the input records, in their order in
+ *                the trace; if NULL every input is an encryption of zero,
+ *                modded down to the recorded number of primes
+ * @param outputs if not NULL, receives the values that no later operation
+ *                reads, in the order they were computed
+ *
+ * The constants of multByConstant are random. The key must have the
+ * key-switching matrices of the recorded automorphisms, and recryption
+ * data if the trace has recryptions. The records of one recryption are
+ * recrypted together. The values are dropped after their last use.
+ **/
+void replayTrace(TraceReplayStats& stats, const CtxtTrace& trace,
+                 FHEPubKey& pubKey,
+                 const std::vector<Ctxt>* inputs=NULL,
+                 std::vector<Ctxt>* outputs=NULL);
+
+#endif // _CTXT_TRACE_H_
@@ -0,0 +1,157 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* encodedPtxt.cpp - a constant with DoubleCRT forms built on first use
+ */
+#include <cmath>
+#include "encodedPtxt.h"
+#include "FHEContext.h"
+#include "norms.h"
+#include "memoryUsage.h"
+
+NTL_CLIENT
+
+EncodedPlaintext::EncodedPlaintext(const FHEcontext& _context)
+  : context(_context), size(0.0), nBuilt(0)
+{}
+
+EncodedPlaintext::EncodedPlaintext(const FHEcontext& _context,
+                                   const zzX& _poly)
+  : context(_context), size(0.0), nBuilt(0)
+{ set(_poly); }
+
+EncodedPlaintext::EncodedPlaintext(const FHEcontext& _context,
+                                   const ZZX& _poly)
+  : context(_context), size(0.0), nBuilt(0)
+{ set(_poly); }
+
+EncodedPlaintext::EncodedPlaintext(const EncodedPlaintext& other)
+  : context(other.context)
+{
+  std::lock_guard<std::mutex> lock(other.mx);
+  poly = other.poly;
+  size = other.size;
+  forms = other.forms;
+  nBuilt = other.nBuilt;
+}
+
+EncodedPlaintext& EncodedPlaintext::operator=(const EncodedPlaintext& other)
+{
+  if (this == &other) return *this;
+  if (&context != &other.context)
+    Error("EncodedPlaintext assignment: incompatible contexts");
+  std::unique_lock<std::mutex> lock1(mx, std::defer_lock);
+  std::unique_lock<std::mutex> lock2(other.mx, std::defer_lock);
+  std::lock(lock1, lock2);
+  poly = other.poly;
+  size = other.size;
+  forms = other.forms;
+  nBuilt = other.nBuilt;
+  return *this;
+}
+
+// The L-infty norm of the canonical embedding, or the L1 norm of the
+// coefficients (which bounds it) if there is no FFT for the embedding
+static double embeddingSize(const zzX& f, const PAlgebra& zMStar)
+{
+  if (f.length() == 0) return 0.0;
+#if FFT_IMPL
+  return embeddingLargestCoeff(f, zMStar);
+#else
+  double s = 0.0;
+  for (long i: range(f.length())) s += std::fabs(double(f[i]));
+  return s;
+#endif
+}
+
+void EncodedPlaintext::set(const zzX& _poly)
+{
+  zzX f = _poly;
+  if (context.alMod.getTag() != PA_cx_tag) { // balanced mod p^r
+    long p2r = context.alMod.getPPowR();
+    for (long i: range(f.length())) {
+      long c = f[i] % p2r;
+      if (c < 0) c += p2r;
+      f[i] = balRem(c, p2r);
+    }
+  }
+  normalize(f);
+  double s = embeddingSize(f, context.zMStar);
+
+  std::lock_guard<std::mutex> lock(mx);
+  poly.swap(f);
+  size = s;
+  forms.clear();
+}
+
+void EncodedPlaintext::set(const ZZX& _poly)
+{
+  zzX f;
+  f.SetLength(_poly.rep.length());
+  if (context.alMod.getTag() != PA_cx_tag) {
+    long p2r = context.alMod.getPPowR();
+    for (long i: range(f.length())) f[i] = rem(_poly.rep[i], p2r);
+  }
+  else {
+    for (long i: range(f.length())) {
+      if (NumBits(_poly.rep[i]) >= NTL_BITS_PER_LONG)
+        Error("EncodedPlaintext: CKKS coefficient does not fit in a long");
+      f[i] = conv<long>(_poly.rep[i]);
+    }
+  }
+  set(f);
+}
+
+shared_ptr<const DoubleCRT> EncodedPlaintext::getDCRT(const IndexSet& s) const
+{
+  std::lock_guard<std::mutex> lock(mx);
+  for (const shared_ptr<const DoubleCRT>& f: forms)
+    if (s <= f->getIndexSet()) return f;
+
+  // build it while holding the lock, another thread that needs it would
+  // only build it again
+  shared_ptr<const DoubleCRT> form =
+    make_shared<const DoubleCRT>(poly, context, s);
+  nBuilt++;
+  long n = 0;
+  for (long i: range(lsize(forms))) // keep those that are not covered
+    if (!(forms[i]->getIndexSet() <= s)) forms[n++] = forms[i];
+  forms.resize(n);
+  forms.push_back(form);
+  return form;
+}
+
+void EncodedPlaintext::clearForms()
+{
+  std::lock_guard<std::mutex> lock(mx);
+  forms.clear();
+}
+
+long EncodedPlaintext::numForms() const
+{
+  std::lock_guard<std::mutex> lock(mx);
+  return forms.size();
+}
+
+long EncodedPlaintext::numBuilt() const
+{
+  std::lock_guard<std::mutex> lock(mx);
+  return nBuilt;
+}
+
+long EncodedPlaintext::memoryUsage() const
+{
+  std::lock_guard<std::mutex> lock(mx);
+  long n = sizeof(*this) + memBytes(poly)
+           + forms.capacity()*sizeof(forms[0]);
+  for (const shared_ptr<const DoubleCRT>& f: forms) n += f->memoryUsage();
+  return n;
+}
@@ -0,0 +1,92 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _ENCODED_PTXT_H_
+#define _ENCODED_PTXT_H_
+/**
+ * @file encodedPtxt.h
+ * @brief A plaintext constant that is encoded once, and converted to
+ * DoubleCRT at the level of the ciphertexts that it is used with
+ *
+ * Passing a ZZX or zzX constant to Ctxt::multByConstant or addConstant
+ * converts it to DoubleCRT on every call, and a constant that is kept as
+ * a DoubleCRT is only right for one prime set. An EncodedPlaintext keeps
+ * the polynomial (see EncryptedArray::encode), a bound on its size, and its
+ * DoubleCRT forms, each one built the first time that a ciphertext needs
+ * it. A form serves every ciphertext whose prime set it covers, so a
+ * constant that is first used at the top level needs no other form as the
+ * ciphertexts go down the modulus chain, and one that is first used low
+ * down gets a larger form (which replaces the smaller one) when it meets a
+ * fresher ciphertext.
+ * \code
+ *   EncodedPlaintext w(context);
+ *   ea.encode(w, weights);   // once
+ *   ...
+ *   c.multByConstant(w);     // at any level
+ * \endcode
+ * The size is the largest coefficient of the canonical embedding, which is
+ * tighter than the default bound of the ZZX versions for most constants.
+ * For BGV the coefficients are kept balanced modulo p^r, for CKKS they are
+ * used as they are (encoded with the default precision). The methods are
+ * thread-safe, so one constant can serve computations on many threads.
+ **/
+#include <vector>
+#include <memory>
+#include <mutex>
+#include "DoubleCRT.h"
+
+//! @class EncodedPlaintext
+//! @brief An encoded constant with cached DoubleCRT forms, see encodedPtxt.h
+class EncodedPlaintext {
+  const FHEcontext& context;
+  zzX poly;
+  double size; // bound on the canonical embedding of poly
+
+  // the DoubleCRT forms, none over a subset of the primes of another
+  mutable std::vector< std::shared_ptr<const DoubleCRT> > forms;
+  mutable long nBuilt;
+  mutable std::mutex mx;
+
+public:
+  //! The zero constant
+  explicit EncodedPlaintext(const FHEcontext& _context);
+  EncodedPlaintext(const FHEcontext& _context, const zzX& _poly);
+  EncodedPlaintext(const FHEcontext& _context, const NTL::ZZX& _poly);
+
+  //! The copy shares the forms that are built so far
+  EncodedPlaintext(const EncodedPlaintext& other);
+  EncodedPlaintext& operator=(const EncodedPlaintext& other);
+
+  //! @brief Replace the constant (over the same context), dropping the forms
+  void set(const zzX& _poly);
+  void set(const NTL::ZZX& _poly);
+
+  const FHEcontext& getContext() const { return context; }
+  const zzX& getPoly() const { return poly; }
+  //! A bound on the L-infty norm of the canonical embedding of the constant
+  double getSize() const { return size; }
+  bool isZero() const { return poly.length() == 0; }
+
+  //! @brief A DoubleCRT form over a superset of s, built if there is none
+  std::shared_ptr<const DoubleCRT> getDCRT(const IndexSet& s) const;
+
+  //! @brief Drop the forms (those that are still in use stay valid)
+  void clearForms();
+  long numForms() const;
+  //! How many forms were built for this constant (and for the one it was
+  //! copied from, before the copy)
+  long numBuilt() const;
+
+  //! The bytes of the polynomial and of the forms (see memoryUsage.h)
+  long memoryUsage() const;
+};
+
+#endif // ifndef _ENCODED_PTXT_H_
@@ -0,0 +1,238 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* encryptPool.cpp - encryptions of zero made ahead of time
+ *
+ * A saved pool is a ctxt archive (see ctxtArchive.h) with the zeros.
+ */
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include "encryptPool.h"
+#include "ctxtArchive.h"
+#include "FHE.h"
+
+NTL_CLIENT
+
+EncryptedZeroPool::EncryptedZeroPool(const FHEPubKey& _pubKey, long capacity,
+                                     long ptxtSpace, bool background)
+  : pubKey(_pubKey), cap(max(capacity, 1L)), misses(0), stopping(false)
+{
+  if (pubKey.isCKKS())
+    throw std::logic_error("EncryptedZeroPool: CKKS keys are not supported");
+  space = pubKey.getPtxtSpace();
+  if (ptxtSpace != space) {
+    space = GCD(ptxtSpace, space);
+    if (space <= 1) Error("Plaintext-space mismatch on encryption");
+  }
+  const FHEcontext& context = pubKey.getContext();
+  QmodP = rem(context.productOfPrimes(context.ctxtPrimes), space);
+  if (background) start();
+}
+
+EncryptedZeroPool::~EncryptedZeroPool()
+{
+  try { stop(); }
+  catch (...) {}
+}
+
+// The work of FHEPubKey::Encrypt, on the zero polynomial
+void EncryptedZeroPool::makeZero(Ctxt& zero) const
+{
+  pubKey.Encrypt(zero, zzX(), space, /*highNoise=*/false);
+}
+
+void EncryptedZeroPool::raiseError()
+{
+  if (!error) return;
+  std::exception_ptr e;
+  std::swap(e, error);
+  std::rethrow_exception(e);
+}
+
+void EncryptedZeroPool::start()
+{
+  std::lock_guard<std::mutex> lock(mx);
+  if (refiller.joinable()) return;
+  stopping = false;
+  ZZ seed = RandomBits_ZZ(256); // from the stream of this thread
+  refiller = std::thread(&EncryptedZeroPool::refillLoop, this, seed);
+}
+
+void EncryptedZeroPool::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mx);
+    stopping = true;
+  }
+  needMore.notify_all();
+  if (refiller.joinable()) refiller.join();
+  std::lock_guard<std::mutex> lock(mx);
+  raiseError();
+}
+
+void EncryptedZeroPool::refillLoop(ZZ seed)
+{
+  SetSeed(seed);
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mx);
+      needMore.wait(lock, [this]{ return stopping || lsize(zeros) < cap; });
+      if (stopping) return;
+    }
+    Ctxt zero(pubKey);
+    try { makeZero(zero); }
+    catch (...) {
+      std::lock_guard<std::mutex> lock(mx);
+      error = std::current_exception();
+      changed.notify_all();
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mx);
+    if (lsize(zeros) < cap) zeros.push_back(std::move(zero));
+    changed.notify_all();
+  }
+}
+
+void EncryptedZeroPool::fill()
+{
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> lock(mx);
+      if (lsize(zeros) >= cap) return;
+    }
+    Ctxt zero(pubKey);
+    makeZero(zero);
+    std::lock_guard<std::mutex> lock(mx);
+    if (lsize(zeros) < cap) zeros.push_back(std::move(zero));
+  }
+}
+
+void EncryptedZeroPool::waitFull()
+{
+  std::unique_lock<std::mutex> lock(mx);
+  if (!refiller.joinable() && lsize(zeros) < cap)
+    throw std::logic_error("EncryptedZeroPool::waitFull: no refill thread");
+  changed.wait(lock, [this]{ return error || lsize(zeros) >= cap; });
+  raiseError();
+}
+
+void EncryptedZeroPool::take(Ctxt& zero)
+{
+  {
+    std::lock_guard<std::mutex> lock(mx);
+    raiseError();
+    if (!zeros.empty()) {
+      zero = std::move(zeros.front());
+      zeros.pop_front();
+      needMore.notify_one();
+      return;
+    }
+    misses++;
+  }
+  makeZero(zero);
+}
+
+long EncryptedZeroPool::encrypt(Ctxt& ctxt, const zzX& ptxt)
+{
+  FHE_TIMER_START;
+  assert(&ctxt.pubKey == &pubKey);
+  take(ctxt);
+
+  // add the plaintext as FHEPubKey::Encrypt does, scaled by Q mod p
+  const FHEcontext& context = pubKey.getContext();
+  if (space == 2)
+    ctxt.parts[0] += DoubleCRT(ptxt, context, ctxt.primeSet);
+  else {
+    zzX scaled;
+    scaled.SetLength(ptxt.length());
+    for (long i: range(ptxt.length())) {
+      long c = ptxt[i] % space;
+      if (c < 0) c += space;
+      scaled[i] = MulMod(c, QmodP, space);
+    }
+    ctxt.parts[0] += DoubleCRT(scaled, context, ctxt.primeSet);
+  }
+  return space;
+}
+
+long EncryptedZeroPool::encrypt(Ctxt& ctxt, const ZZX& ptxt)
+{
+  zzX small;
+  small.SetLength(deg(ptxt)+1);
+  for (long i: range(small.length()))
+    small[i] = rem(ptxt.rep[i], space);
+  return encrypt(ctxt, small);
+}
+
+long EncryptedZeroPool::size() const
+{
+  std::lock_guard<std::mutex> lock(mx);
+  return zeros.size();
+}
+
+long EncryptedZeroPool::numMisses() const
+{
+  std::lock_guard<std::mutex> lock(mx);
+  return misses;
+}
+
+long EncryptedZeroPool::save(const string& fname)
+{
+  vector<Ctxt> out;
+  {
+    std::lock_guard<std::mutex> lock(mx);
+    for (Ctxt& z: zeros) out.push_back(std::move(z));
+    zeros.clear();
+  }
+  needMore.notify_one();
+
+  string tmp = fname + ".tmp";
+  {
+    ofstream str(tmp, ios::binary);
+    if (!str) throw std::runtime_error("EncryptedZeroPool: cannot write "+tmp);
+    writeCtxtArchive(str, out);
+    if (!str) throw std::runtime_error("EncryptedZeroPool: cannot write "+tmp);
+  }
+  if (rename(tmp.c_str(), fname.c_str()) != 0)
+    throw std::runtime_error("EncryptedZeroPool: cannot rename "+tmp);
+  return out.size();
+}
+
+long EncryptedZeroPool::load(const string& fname)
+{
+  vector<Ctxt> in;
+  {
+    ifstream str(fname, ios::binary);
+    if (!str) throw std::runtime_error("EncryptedZeroPool: cannot read "+fname);
+    readCtxtArchive(str, in, pubKey);
+  }
+  // the zeros are in memory now, they must not be read again
+  if (remove(fname.c_str()) != 0)
+    throw std::runtime_error("EncryptedZeroPool: cannot remove "+fname);
+
+  const FHEcontext& context = pubKey.getContext();
+  for (const Ctxt& z: in)
+    if (z.getPtxtSpace() != space || z.getPrimeSet() != context.ctxtPrimes)
+      throw std::runtime_error("EncryptedZeroPool: "+fname
+                               +" holds zeros of another pool");
+
+  long n = 0;
+  std::lock_guard<std::mutex> lock(mx);
+  for (Ctxt& z: in)
+    if (lsize(zeros) < cap) {
+      zeros.push_back(std::move(z));
+      n++;
+    }
+  changed.notify_all();
+  return n;
+}
@@ -0,0 +1,115 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _ENCRYPT_POOL_H_
+#define _ENCRYPT_POOL_H_
+/**
+ * @file encryptPool.h
+ * @brief Fresh encryptions of zero made ahead of time, for fast encryption
+ *
+ * Almost all the work of FHEPubKey::Encrypt (sampling r and the errors and
+ * multiplying the public key by r) does not depend on the plaintext. An
+ * EncryptedZeroPool does that work ahead of time, on a thread of its own
+ * while the application is idle, and keeps up to capacity() fresh
+ * encryptions of zero at the primes context.ctxtPrimes. encrypt() then
+ * takes one of them and only adds the plaintext to it (one FFT of the
+ * plaintext), which gives what FHEPubKey::Encrypt gives: the same
+ * distribution and the same noise bound. When the pool is empty encrypt()
+ * makes the zero itself, and the pool counts it as a miss.
+ *
+ * Every zero is used once: a zero that encrypts two plaintexts gives away
+ * their difference. The pool hands each one out exactly once, and save()
+ * moves the zeros that are left to a file (the pool is empty after it),
+ * which load() removes once they are read. Do not copy such a file.
+ *
+ * The refill thread uses a random stream of its own, seeded from the
+ * stream of the thread that calls start(). Its loops over the primes run
+ * serially, so it takes at most one core. The public key must not change
+ * while the pool is alive. Only BGV keys are supported (std::logic_error
+ * for CKKS), and the errors of the refill thread are raised by the next
+ * call to encrypt(), waitFull() or stop().
+ **/
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "Ctxt.h"
+
+class FHEPubKey;
+
+//! @class EncryptedZeroPool
+//! @brief A pool of fresh encryptions of zero, refilled in the background
+class EncryptedZeroPool {
+  const FHEPubKey& pubKey;
+  long cap;
+  long space;  // the plaintext space of the zeros
+  long QmodP;  // the product of the ctxtPrimes mod space
+  long misses;
+
+  std::deque<Ctxt> zeros;
+  mutable std::mutex mx;
+  std::condition_variable needMore, changed;
+  std::thread refiller;
+  bool stopping;
+  std::exception_ptr error;
+
+  void makeZero(Ctxt& zero) const;
+  void take(Ctxt& zero);
+  void refillLoop(NTL::ZZ seed);
+  void raiseError(); // called with mx held
+
+public:
+  //! @param capacity    the most zeros to keep (at least 1)
+  //! @param ptxtSpace   as for FHEPubKey::Encrypt
+  //! @param background  start the refill thread at once
+  EncryptedZeroPool(const FHEPubKey& _pubKey, long capacity,
+                    long ptxtSpace=0, bool background=true);
+
+  //! Stops the refill thread (ignoring its errors)
+  ~EncryptedZeroPool();
+
+  EncryptedZeroPool(const EncryptedZeroPool&) = delete;
+  EncryptedZeroPool& operator=(const EncryptedZeroPool&) = delete;
+
+  //! @brief Start the refill thread, if it is not running
+  void start();
+  //! @brief Stop the refill thread, the zeros made so far are kept
+  void stop();
+  bool running() const { return refiller.joinable(); }
+
+  //! @brief Fill the pool on this thread, up to capacity()
+  void fill();
+  //! @brief Wait until the refill thread has filled the pool
+  void waitFull();
+
+  //! @brief ctxt = an encryption of ptxt, from a zero of the pool. Returns
+  //! the plaintext space of ctxt, as FHEPubKey::Encrypt does.
+  long encrypt(Ctxt& ctxt, const zzX& ptxt);
+  long encrypt(Ctxt& ctxt, const NTL::ZZX& ptxt);
+
+  //! The number of zeros in the pool
+  long size() const;
+  long capacity() const { return cap; }
+  long getPtxtSpace() const { return space; }
+  //! How many times encrypt() found the pool empty
+  long numMisses() const;
+
+  //! @brief Move all the zeros of the pool to the file fname (written to a
+  //! temporary file first, then renamed), returns how many
+  long save(const std::string& fname);
+  //! @brief Add the zeros in the file fname to the pool (up to capacity(),
+  //! the others are dropped) and remove the file, returns how many
+  long load(const std::string& fname);
+};
+
+#endif // ifndef _ENCRYPT_POOL_H_
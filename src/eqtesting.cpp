@@ -14,13 +14,32 @@
  * @brief Useful fucntions for equality testing...
  */
 #include <NTL/lzz_pXFactoring.h>
+#include <NTL/BasicThreadPool.h>
 NTL_CLIENT
 #include "FHE.h"
 #include "timing.h"
 #include "EncryptedArray.h"
+#include "taskScheduler.h"
 
 #include <cassert>
 #include <cstdio>
+#include <mutex>
+
+// Run f(i) for all 0<=i<n. With fewer items than threads they run one
+// after the other, so that each of them can use the threads internally.
+// Otherwise the items are split between the threads, and the loops inside
+// f run serially.
+template<class F>
+static void batchExec(long n, const F& f)
+{
+  if (n < fheAvailableThreads()) {
+    for (long i = 0; i < n; i++) f(i);
+    return;
+  }
+  FHE_EXEC_RANGE(n, first, last)
+    for (long i = first; i < last; i++) f(i);
+  FHE_EXEC_RANGE_END
+}
 
 // Map all non-zero slots to 1, leaving zero slots as zero.
 // Assumes that r=1, and that all the slot contain elements from GF(p^d).
@@ -43,13 +62,22 @@ void mapTo01(const EncryptedArray& ea, Ctxt& ctxt)
 
   long d = ea.getDegree();
   if (d>1) { // compute the product of the d automorphisms
-    std::vector<Ctxt> v(d, ctxt);
-    for (long i=1; i<d; i++)
-      v[i].frobeniusAutomorph(i);
+    // the Frobenius images share one digit decomposition
+    vector< shared_ptr<Ctxt> > frob;
+    BasicAutomorphPrecon(ctxt).frobeniusAutomorphs(frob, d);
+    std::vector<Ctxt> v;
+    v.reserve(d);
+    for (long i=0; i<d; i++) v.push_back(std::move(*frob[i]));
     totalProduct(ctxt, v);
   }
 }
 
+void mapTo01(const EncryptedArray& ea, vector<Ctxt>& ctxts)
+{
+  FHE_TIMER_START;
+  batchExec(lsize(ctxts), [&](long i) { mapTo01(ea, ctxts[i]); });
+}
+
 
 // computes ctxt^{2^d-1} using a method that takes
 // O(log d) automorphisms and multiplications
@@ -77,6 +105,67 @@ void fastPower(Ctxt& ctxt, long d)
   }
 }
 
+void fastPower(vector<Ctxt>& ctxts, long d)
+{
+  FHE_TIMER_START;
+  batchExec(lsize(ctxts), [&](long i) { fastPower(ctxts[i], d); });
+}
+
+namespace {
+// The coefficients of the linearized polynomials of incrementalZeroTest.
+// C[i] are those of the mask on bits 0..i, computed at most once and only
+// if their encodings are not already in the mask cache of ea. Can be used
+// from several threads.
+class ZeroTestCoeffs {
+  const EncryptedArray& ea;
+  vector< vector<ZZX> > C;
+  vector<std::once_flag> built;
+
+public:
+  ZeroTestCoeffs(const EncryptedArray& _ea, long n)
+    : ea(_ea), C(n), built(n) {}
+
+  MaskCache::Entry get(long i, long j, const IndexSet& s) {
+    return cachedMask(ea.getMaskCache(), ea.getContext(),
+                      MaskCache::ZERO_TEST, i, j, s, [&](zzX& poly) {
+      std::call_once(built[i], [&]() {
+        // L[j] = X^j for j = 0..i, L[j] = 0 for j = i+1..d-1
+        vector<ZZX> L(ea.getDegree());
+        for (long jj = 0; jj <= i; jj++) SetCoeff(L[jj], jj);
+        ea.buildLinPolyCoeffs(C[i], L);
+      });
+      // the encoding that has C[i][j] in all slots
+      vector<ZZX> T(ea.size(), C[i][j]);
+      ea.encode(poly, T);
+    });
+  }
+};
+}
+
+static void zeroTest(Ctxt* res[], const Ctxt& ctxt, long n, long d,
+                     ZeroTestCoeffs& coeffs)
+{
+  // Conj[j] = ctxt^{2^j}, all from one digit decomposition
+  vector< shared_ptr<Ctxt> > Conj;
+  BasicAutomorphPrecon(ctxt).frobeniusAutomorphs(Conj, d);
+
+  FHE_EXEC_RANGE(n, first, last)
+    for (long i = first; i < last; i++) {
+      res[i]->clear();
+      for (long j = 0; j < d; j++) {
+        Ctxt tmp = *Conj[j];
+        tmp.multByConstant(*coeffs.get(i, j, tmp.getPrimeSet()));
+        *res[i] += tmp;
+      }
+
+      // *res[i] now has 0..i in each slot
+      // next, we raise to the power 2^d-1
+
+      fastPower(*res[i], d);
+    }
+  FHE_EXEC_RANGE_END
+}
+
 // ===> This function only works for p=2, r=1 <===
 // Test if prefixes of bits in slots are all zero: Set slot j of res[i] to 0
 // if bits 0..i of j'th slot in ctxt are all zero, else it is set to 1
@@ -87,58 +176,23 @@ void incrementalZeroTest(Ctxt* res[], const EncryptedArray& ea,
 			 const Ctxt& ctxt, long n)
 {
   FHE_TIMER_START;
-  long nslots = ea.size();
-  long d = ea.getDegree();
-
-  // compute linearized polynomial coefficients
-
-  vector< vector<ZZX> > Coeff;
-  Coeff.resize(n);
-
-  for (long i = 0; i < n; i++) {
-    // coeffients for mask on bits 0..i
-    // L[j] = X^j for j = 0..i, L[j] = 0 for j = i+1..d-1
-
-    vector<ZZX> L;
-    L.resize(d);
-
-    for (long j = 0; j <= i; j++) 
-      SetCoeff(L[j], j);
-
-    vector<ZZX> C;
-
-    ea.buildLinPolyCoeffs(C, L);
-
-    Coeff[i].resize(d);
-    for (long j = 0; j < d; j++) {
-      // Coeff[i][j] = to the encoding that has C[j] in all slots
-      // FIXME: maybe encrtpted array should have this functionality
-      //        built in
-      vector<ZZX> T;
-      T.resize(nslots);
-      for (long s = 0; s < nslots; s++) T[s] = C[j];
-      ea.encode(Coeff[i][j], T);
-    }
-  }
-
-  vector<Ctxt> Conj(d, ctxt);
-  // initialize Cong[j] to ctxt^{2^j}
-  for (long j = 0; j < d; j++) {
-    Conj[j].smartAutomorph(1L << j);
-  }
-
-  for (long i = 0; i < n; i++) {
-    res[i]->clear();
-    for (long j = 0; j < d; j++) {
-      Ctxt tmp = Conj[j];
-      tmp.multByConstant(Coeff[i][j]);
-      *res[i] += tmp;
-    }
-
-    // *res[i] now has 0..i in each slot
-    // next, we raise to the power 2^d-1
+  ZeroTestCoeffs coeffs(ea, n);
+  zeroTest(res, ctxt, n, ea.getDegree(), coeffs);
+}
 
-    fastPower(*res[i], d);
-  }
-  FHE_TIMER_STOP;
+void incrementalZeroTest(vector< vector<Ctxt> >& res, const EncryptedArray& ea,
+                         const vector<Ctxt>& ctxts, long n)
+{
+  FHE_TIMER_START;
+  long nCtxts = lsize(ctxts);
+  res.resize(nCtxts);
+  for (long k = 0; k < nCtxts; k++)
+    res[k].assign(n, Ctxt(ZeroCtxtLike, ctxts[k]));
+
+  ZeroTestCoeffs coeffs(ea, n); // shared by all the ciphertexts
+  batchExec(nCtxts, [&](long k) {
+    vector<Ctxt*> ptrs(n);
+    for (long i = 0; i < n; i++) ptrs[i] = &res[k][i];
+    zeroTest(ptrs.data(), ctxts[k], n, ea.getDegree(), coeffs);
+  });
 }
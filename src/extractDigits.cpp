@@ -11,11 +11,15 @@
  */
 /* EncryptedArray.cpp - Data-movement operations on arrays of slots
  */
+#include <map>
+#include <mutex>
 #include <NTL/ZZ.h>
 #include <NTL/ZZ_p.h>
+#include <NTL/BasicThreadPool.h>
 #include "EncryptedArray.h"
 #include "polyEval.h"
 #include "debugging.h"
+#include "taskScheduler.h"
 
 NTL_CLIENT
 
@@ -63,6 +67,16 @@ static void buildDigitPolynomial(ZZX& result, long p, long e)
 
 int fhe_watcher = 0;
 
+static const ZZX& digitPolynomial(long p, long e); // cached, defined below
+
+// "In spirit" c = c^p, using the digit polynomial x2p for p>3
+static void raiseToP(Ctxt& c, long p, const ZZX& x2p)
+{
+  if (p==2) c.square();
+  else if (p==3) c.cube();
+  else polyEval(c, x2p, c);
+}
+
 void extractDigits(vector<Ctxt>& digits, const Ctxt& c, long r)
 {
   const FHEcontext& context = c.getContext();
@@ -71,10 +85,8 @@ void extractDigits(vector<Ctxt>& digits, const Ctxt& c, long r)
 
   long p = context.zMStar.getP();
 
-  ZZX x2p;
-  if (p>3) { 
-    buildDigitPolynomial(x2p, p, r);
-  }
+  static const ZZX noPoly;
+  const ZZX& x2p = (p>3)? digitPolynomial(p, r) : noPoly;
 
   Ctxt tmp(c.getPubKey(), c.getPtxtSpace());
   digits.resize(r, tmp);      // allocate space
@@ -83,14 +95,15 @@ void extractDigits(vector<Ctxt>& digits, const Ctxt& c, long r)
   fprintf(stderr, "***\n");
 #endif
   for (long i=0; i<r; i++) {
+    // Each digits[j] is raised to the power p once per round, the digits
+    // are independent so this is done in parallel
+    FHE_EXEC_RANGE(i, first, last)
+      for (long j=first; j<last; j++)
+        raiseToP(digits[j], p, x2p); // "in spirit" digits[j] = digits[j]^p
+    FHE_EXEC_RANGE_END
+
     tmp = c;
     for (long j=0; j<i; j++) {
-
-      if (p==2) digits[j].square();
-      else if (p==3) digits[j].cube();
-      else polyEval(digits[j], x2p, digits[j]); 
-      // "in spirit" digits[j] = digits[j]^p
-
 #ifdef DEBUG_PRINTOUT
       fprintf(stderr, "%5ld", digits[j].bitCapacity());
 #endif
@@ -208,6 +221,41 @@ void compute_magic_poly(ZZX& poly1, long p, long e)
 }
 
 
+// The digit and magic polynomials depend only on (p,e), so they are built
+// once per process and then shared by all the calls (and threads).
+namespace {
+struct DigitPolyCache {
+  std::mutex mtx;
+  std::map< std::pair<long,long>, ZZX > digitPolys, magicPolys;
+};
+
+DigitPolyCache& digitPolyCache()
+{
+  static DigitPolyCache cache;
+  return cache;
+}
+} // anonymous namespace
+
+static const ZZX& cachedPoly(std::map< std::pair<long,long>, ZZX >& tab,
+                             void (*build)(ZZX&, long, long), long p, long e)
+{
+  DigitPolyCache& cache = digitPolyCache();
+  {std::lock_guard<std::mutex> lock(cache.mtx);
+   auto it = tab.find(std::make_pair(p,e));
+   if (it != tab.end()) return it->second;
+  }
+  ZZX poly;
+  build(poly, p, e); // outside the lock, this may take a while
+  std::lock_guard<std::mutex> lock(cache.mtx);
+  return tab.emplace(std::make_pair(p,e), poly).first->second;
+}
+
+static const ZZX& digitPolynomial(long p, long e)
+{ return cachedPoly(digitPolyCache().digitPolys, buildDigitPolynomial, p, e); }
+
+static const ZZX& magicPolynomial(long p, long e)
+{ return cachedPoly(digitPolyCache().magicPolys, compute_magic_poly, p, e); }
+
 // extendExtractDigits assumes that the slots of *this contains integers mod
 // p^{r+e} i.e., that only the free terms are nonzero. (If that assumptions
 // does not hold then the result will not be a valid ciphertext anymore.)
@@ -222,18 +270,13 @@ void extendExtractDigits(vector<Ctxt>& digits, const Ctxt& c, long r, long e)
   const FHEcontext& context = c.getContext();
 
   long p = context.zMStar.getP();
-  ZZX x2p;
-  if (p>3) { 
-    buildDigitPolynomial(x2p, p, r);
-  }
+  static const ZZX noPoly;
+  const ZZX& x2p = (p>3)? digitPolynomial(p, r) : noPoly;
 
-  // we should pre-compute this table
   // for i = 0..r-1, entry i is G_{e+r-i} in Chen and Han
-  Vec<ZZX> G;
-  G.SetLength(r);
-  for (long i: range(r)) {
-    compute_magic_poly(G[i], p, e+r-i);
-  }
+  vector<const ZZX*> G(r);
+  for (long i: range(r))
+    G[i] = &magicPolynomial(p, e+r-i);
 
   vector<Ctxt> digits0;
 
@@ -246,22 +289,26 @@ void extendExtractDigits(vector<Ctxt>& digits, const Ctxt& c, long r, long e)
   fprintf(stderr, "***\n");
 #endif
   for (long i: range(r)) {
+    // optimization: where digits[j] is better than digits0[j] we just use
+    // it, the others digits0[j] are raised to the power p in parallel
+    vector<bool> useDigit(i);
+    for (long j: range(i))
+      useDigit[j] = (digits[j].capacity() >= digits0[j].capacity());
+    FHE_EXEC_RANGE(i, first, last)
+      for (long j: range(first, last))
+        if (!useDigit[j]) // "in spirit" digits0[j] = digits0[j]^p
+          raiseToP(digits0[j], p, x2p);
+    FHE_EXEC_RANGE_END
+
     tmp = c;
     for (long j: range(i)) {
-      if (digits[j].capacity() >= digits0[j].capacity()) {
-         // optimization: digits[j] is better than digits0[j],
-         // so just use it
-
+      if (useDigit[j]) {
          tmp -= digits[j];
 #ifdef DEBUG_PRINTOUT
       fprintf(stderr, "%5ld*", digits[j].bitCapacity());
 #endif
       }
       else {
-	if (p==2) digits0[j].square();
-	else if (p==3) digits0[j].cube();
-	else polyEval(digits0[j], x2p, digits0[j]); // "in spirit" digits0[j] = digits0[j]^p
-
 	tmp -= digits0[j];
 #ifdef DEBUG_PRINTOUT
       fprintf(stderr, "%5ld ", digits0[j].bitCapacity());
@@ -270,7 +317,7 @@ void extendExtractDigits(vector<Ctxt>& digits, const Ctxt& c, long r, long e)
       tmp.divideByP();
     }
     digits0[i] = tmp; // needed in the next round
-    polyEval(digits[i], G[i], tmp);
+    polyEval(digits[i], *G[i], tmp);
 
 #ifdef DEBUG_PRINTOUT
     if (dbgKey) {
@@ -20,6 +20,7 @@
 #include "timing.h"
 #include "norms.h"
 #include "PAlgebra.h"
+#include "taskScheduler.h"
 NTL_CLIENT
 
 const double pi = 4 * std::atan(1);
@@ -30,30 +31,30 @@ const double pi = 4 * std::atan(1);
 void convert(zzX& to, const arma::vec& from)
 {
   to.SetLength(from.size());
-  NTL_EXEC_RANGE(to.length(), first, last)
+  FHE_EXEC_RANGE(to.length(), first, last)
   for (long i=first; i<last; i++)
     to[i] = std::round(from[i]);
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 }
 
 void convert(arma::vec& to, const zzX& from)
 {
   to.resize(from.length());
-  NTL_EXEC_RANGE(from.length(), first, last)
+  FHE_EXEC_RANGE(from.length(), first, last)
   for (long i=first; i<last; i++)
     to[i] = from[i];
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 }
 
 void convert(arma::vec& to, const ZZX& from)
 {
   to.resize(from.rep.length());
-  NTL_EXEC_RANGE(from.rep.length(), first, last)
+  FHE_EXEC_RANGE(from.rep.length(), first, last)
   for (long i=first; i<last; i++) {
     double x = conv<double>(from[i]);
     to[i] = x;
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 }
 
 #if 0
@@ -211,91 +212,254 @@ void embedInSlots(zzX& f, const std::vector<cx_double>& v,
   if (strictInverse) f /= m;  // scale down by m
   normalize(f);
 }
+
+// The batch versions run whole transforms on the different threads
+void canonicalEmbedding(std::vector< std::vector<cx_double> >& v,
+                        const std::vector<zzX>& f, const PAlgebra& palg)
+{
+  FHE_TIMER_START;
+  v.resize(f.size());
+  FHE_EXEC_RANGE(lsize(f), first, last)
+  for (long i=first; i<last; i++) canonicalEmbedding(v[i], f[i], palg);
+  FHE_EXEC_RANGE_END
+}
+
+void embedInSlots(std::vector<zzX>& f,
+                  const std::vector< std::vector<cx_double> >& v,
+                  const PAlgebra& palg, double scaling, bool strictInverse)
+{
+  FHE_TIMER_START;
+  f.resize(v.size());
+  FHE_EXEC_RANGE(lsize(v), first, last)
+  for (long i=first; i<last; i++)
+    embedInSlots(f[i], v[i], palg, scaling, strictInverse);
+  FHE_EXEC_RANGE_END
+}
 #else
 #ifdef FFT_NATIVE
-#warning "canonicalEmbedding implemented via slow DFT, expect very slow key-generation"
-// An extremely lame implementation of the canonical embedding
+// A native FFT, no need for external libraries
+#include <map>
+#include <memory>
+#include <mutex>
 
-// evaluate poly(x) using Horner's rule
-cx_double complexEvalPoly(const zzX& poly, const cx_double& x)
-{
-  if (lsize(poly)<=0) return cx_double(0.0,0.0);
-  cx_double res(double(poly[0]), 0.0);
-  for (long i=1; i<lsize(poly); i++) {
-    res *= x;
-    res += cx_double(double(poly[i]));
+/**
+ * @class CmplxFFT
+ * @brief A complex DFT of size m, for any m.
+ *
+ * Computes X[j] = sum_k x[k]*exp(-2*pi*i*j*k/m). Powers of two use an
+ * iterative radix-2 FFT, any other m uses Bluestein's trick, which turns
+ * the DFT into a convolution of power-of-two length n >= 2m-1:
+ *   X[j] = w[j] * sum_k (x[k]*w[k]) * conj(w[j-k]) with w[k]=exp(-pi*i*k^2/m).
+ * The roots and the transform of the chirp conj(w) are computed once.
+ **/
+class CmplxFFT {
+  long m;
+  long n;      // the length of the power-of-two transforms
+  std::vector<long> rev;          // the bit-reversal permutation of [0,n)
+  std::vector<cx_double> roots;   // roots[k] = exp(-2*pi*i*k/n), k<n/2
+  std::vector<cx_double> chirp;   // w[k], k<m (Bluestein only)
+  std::vector<cx_double> chirpFFT;// the FFT of conj(w), padded to n
+
+  // In-place power-of-two FFT of length n, with the sign of the roots
+  // flipped if inverse==true (no scaling)
+  void fft2(std::vector<cx_double>& a, bool inverse) const
+  {
+    for (long i=0; i<n; i++) if (i < rev[i]) std::swap(a[i], a[rev[i]]);
+    for (long len=2; len<=n; len*=2) {
+      long step = n/len;
+      for (long i=0; i<n; i+=len) for (long j=0; j<len/2; j++) {
+        cx_double w = inverse? std::conj(roots[j*step]) : roots[j*step];
+        cx_double u = a[i+j];
+        cx_double v = a[i+j+len/2] * w;
+        a[i+j] = u+v;
+        a[i+j+len/2] = u-v;
+      }
+    }
+  }
+
+public:
+  explicit CmplxFFT(long _m): m(_m)
+  {
+    bool pow2 = (m & (m-1)) == 0;
+    n = 1;
+    while (n < (pow2? m : 2*m-1)) n *= 2;
+
+    long logn = 0; while ((1L << logn) < n) logn++;
+    rev.resize(n);
+    for (long i=0; i<n; i++) {
+      rev[i] = 0;
+      for (long b=0; b<logn; b++) if (i & (1L<<b)) rev[i] |= 1L << (logn-1-b);
+    }
+    roots.resize(std::max(n/2, 1L));
+    for (long k=0; k<lsize(roots); k++)
+      roots[k] = std::polar<double>(1.0, -(2*pi*k)/n);
+    if (pow2) return;
+
+    chirp.resize(m);
+    for (long k=0; k<m; k++) { // k^2 mod 2m keeps the angles accurate
+      long k2 = (k*k) % (2*m);
+      chirp[k] = std::polar<double>(1.0, -(pi*k2)/m);
+    }
+    chirpFFT.assign(n, cx_double(0.0, 0.0));
+    chirpFFT[0] = std::conj(chirp[0]);
+    for (long k=1; k<m; k++)
+      chirpFFT[k] = chirpFFT[n-k] = std::conj(chirp[k]);
+    fft2(chirpFFT, false);
   }
-  return res;
+
+  long size() const { return m; }
+
+  //! The DFT of x (which is padded with zeros or folded mod m to size m),
+  //! or the inverse DFT without the 1/m factor if inverse==true
+  void apply(std::vector<cx_double>& out, std::vector<cx_double> x,
+             bool inverse=false) const
+  {
+    for (long k=m; k<lsize(x); k++) x[k % m] += x[k]; // since w^m=1
+    x.resize(m, cx_double(0.0, 0.0));
+    if (inverse) for (auto& c: x) c = std::conj(c);
+
+    if (chirp.empty()) { // m is a power of two
+      fft2(x, false);
+      out.swap(x);
+    }
+    else {
+      std::vector<cx_double> a(n, cx_double(0.0, 0.0));
+      for (long k=0; k<m; k++) a[k] = x[k]*chirp[k];
+      fft2(a, false);
+      for (long k=0; k<n; k++) a[k] *= chirpFFT[k];
+      fft2(a, true);
+      out.resize(m);
+      for (long j=0; j<m; j++) out[j] = chirp[j]*a[j]/double(n);
+    }
+    if (inverse) for (auto& c: out) c = std::conj(c);
+  }
+};
+
+// The tables for each m are computed once and shared by all the threads
+static std::shared_ptr<const CmplxFFT> getCmplxFFT(long m)
+{
+  static std::map<long, std::shared_ptr<const CmplxFFT>> cache;
+  static std::mutex mx;
+  std::lock_guard<std::mutex> lock(mx);
+  std::shared_ptr<const CmplxFFT>& ptr = cache[m];
+  if (!ptr) ptr.reset(new CmplxFFT(m));
+  return ptr;
 }
 
-void canonicalEmbedding(std::vector<cx_double>& v, const zzX& f, const PAlgebra& palg)
+// Pick the entries of the full DFT that correspond to the first half of
+// Zm*, in the same order as the armadillo version
+static void pickHalfZmStar(std::vector<cx_double>& v,
+                           const std::vector<cx_double>& avv,
+                           const PAlgebra& palg)
 {
-  FHE_TIMER_START;
   long m = palg.getM();
   long phimBy2 = divc(palg.getPhiM(),2);
-  vector<long> zmstar(phimBy2); // the first half of Zm*
-
+  v.resize(phimBy2);
   if (palg.getNSlots()==phimBy2) // order roots by the palg order
     for (long i=0; i<phimBy2; i++)
-      zmstar[phimBy2-i-1] = palg.ith_rep(i);
+      v[phimBy2-i-1] = avv[palg.ith_rep(i)];
   else                           // order roots sequentially
     for (long i=1, idx=0; i<=m/2; i++)
-      if (palg.inZmStar(i)) zmstar[idx++] = i;
+      if (palg.inZmStar(i)) v[idx++] = avv[i];
+}
 
-  v.resize(phimBy2);
-  NTL_EXEC_RANGE(phimBy2, first, last)
-  for (long i=first; i < last; ++i) {
-    auto rou = std::polar<double>(1.0, -(2*pi*zmstar[i])/m); // root of unity
-    v[i] = complexEvalPoly(f,rou);
-  }
-  NTL_EXEC_RANGE_END
-  FHE_TIMER_STOP;
+static void embed(std::vector<cx_double>& v, const zzX& f,
+                  const PAlgebra& palg, const CmplxFFT& fft)
+{
+  std::vector<cx_double> x(lsize(f));
+  for (long i=0; i<lsize(f); i++) x[i] = cx_double(double(f[i]), 0.0);
+  std::vector<cx_double> avv;
+  fft.apply(avv, x); // compute the full FFT
+  pickHalfZmStar(v, avv, palg);
 }
 
-// evaluate poly(x) using Horner's rule
-// FIXME: this is actually evaluating the reverse polynomial
-cx_double complexEvalPoly(const Vec<double>& poly, const cx_double& x)
+void canonicalEmbedding(std::vector<cx_double>& v, const zzX& f, const PAlgebra& palg)
 {
-  if (poly.length()<=0) return cx_double(0.0,0.0);
-  cx_double res(poly[0], 0.0);
-  for (long i: range(1, poly.length())) {
-    res *= x;
-    res += cx_double(poly[i]);
-  }
-  return res;
+  FHE_TIMER_START;
+  embed(v, f, palg, *getCmplxFFT(palg.getM()));
 }
 
 void canonicalEmbedding(std::vector<cx_double>& v, const ZZX& f, const PAlgebra& palg)
 {
   FHE_TIMER_START;
+  std::vector<cx_double> x(f.rep.length());
+  for (long i=0; i<f.rep.length(); i++)
+    x[i] = cx_double(conv<double>(f.rep[i]), 0.0);
+  std::vector<cx_double> avv;
+  getCmplxFFT(palg.getM())->apply(avv, x); // compute the full FFT
+  pickHalfZmStar(v, avv, palg);
+}
+
+static void unembed(zzX& f, const std::vector<cx_double>& v,
+                    const PAlgebra& palg, double scaling, bool strictInverse,
+                    const CmplxFFT& fft)
+{
   long m = palg.getM();
   long phimBy2 = divc(palg.getPhiM(),2);
-  vector<long> zmstar(phimBy2); // the first half of Zm*
-
-  Vec<double> ff;
-  conv(ff, f.rep);
+  std::vector<cx_double> avv(m, cx_double(0.0, 0.0));
 
-  if (palg.getNSlots()==phimBy2) // order roots by the palg order
-    for (long i=0; i<phimBy2; i++)
-      zmstar[phimBy2-i-1] = palg.ith_rep(i);
-  else                           // order roots sequentially
-    for (long i=1, idx=0; i<=m/2; i++)
-      if (palg.inZmStar(i)) zmstar[idx++] = i;
+  if (palg.getNSlots()==phimBy2) // roots ordered by the palg order
+    for (long i=0; i<palg.getNSlots(); i++) {
+      long j = palg.ith_rep(i);
+      long ii = palg.getNSlots()-i-1;
+      if (ii < lsize(v)) {
+        avv[j] = scaling*v[ii];
+        avv[m-j] = std::conj(avv[j]);
+      }
+    }
+  else                           // roots ordered sequentially
+    for (long i=1, idx=0; i<=m/2 && idx<lsize(v); i++) {
+      if (palg.inZmStar(i)) {
+        avv[i] = scaling*v[idx++];
+        avv[m-i] = std::conj(avv[i]);
+      }
+    }
+  std::vector<cx_double> av;
+  fft.apply(av, avv, /*inverse=*/true); // that's m*ifft(avv)
 
-  v.resize(phimBy2);
-  NTL_EXEC_RANGE(phimBy2, first, last)
-  for (long i=first; i < last; ++i) {
-    auto rou = std::polar<double>(1.0, -(2*pi*zmstar[i])/m); // root of unity
-    v[i] = complexEvalPoly(ff,rou);
-  }
-  NTL_EXEC_RANGE_END
-  FHE_TIMER_STOP;
+  // If v was obtained by canonicalEmbedding(v,f,palg,1.0) then we have
+  // the guarantee that m*ifft(avv) is an integral polynomial, and moreover
+  // it is in m*Z[X] mod Phi_m(x).
+  double factor = strictInverse? 1.0 : 1.0/m;
+  f.SetLength(m);
+  for (long i=0; i<m; i++) f[i] = std::round(av[i].real()*factor);
+  reduceModPhimX(f, palg);
+  if (strictInverse) f /= m;  // scale down by m
+  normalize(f);
 }
 
+// Roughly the inverse of canonicalEmbedding, see the armadillo version
 void embedInSlots(zzX& f, const std::vector<cx_double>& v,
                   const PAlgebra& palg, double scaling, bool strictInverse)
 {
-  NTL::Error("embedInSlots not implemented\n");
+  FHE_TIMER_START;
+  unembed(f, v, palg, scaling, strictInverse, *getCmplxFFT(palg.getM()));
+}
+
+// The batch versions fetch the tables once, and each thread works on
+// whole transforms
+void canonicalEmbedding(std::vector< std::vector<cx_double> >& v,
+                        const std::vector<zzX>& f, const PAlgebra& palg)
+{
+  FHE_TIMER_START;
+  std::shared_ptr<const CmplxFFT> fft = getCmplxFFT(palg.getM());
+  v.resize(f.size());
+  FHE_EXEC_RANGE(lsize(f), first, last)
+  for (long i=first; i<last; i++) embed(v[i], f[i], palg, *fft);
+  FHE_EXEC_RANGE_END
+}
+
+void embedInSlots(std::vector<zzX>& f,
+                  const std::vector< std::vector<cx_double> >& v,
+                  const PAlgebra& palg, double scaling, bool strictInverse)
+{
+  FHE_TIMER_START;
+  std::shared_ptr<const CmplxFFT> fft = getCmplxFFT(palg.getM());
+  f.resize(v.size());
+  FHE_EXEC_RANGE(lsize(v), first, last)
+  for (long i=first; i<last; i++)
+    unembed(f[i], v[i], palg, scaling, strictInverse, *fft);
+  FHE_EXEC_RANGE_END
 }
 #endif // ifdef FFT_NATIVE
 #endif // ifdef FFT_ARMA
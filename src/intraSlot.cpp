@@ -15,8 +15,11 @@
  * to either ea.getNormalBasisMatrixInverse() or ea.getNormalBasisMatrix().
  */
 #include <memory>
+#include <algorithm>
+#include <NTL/BasicThreadPool.h>
 #include "replicate.h"
 #include "intraSlot.h"
+#include "taskScheduler.h"
 
 NTL_CLIENT
 
@@ -63,64 +66,70 @@ void buildUnpackSlotEncoding(std::vector<zzX>& unpackSlotEncoding,
   ea.dispatch<buildUnpackSlotEncoding_pa_impl>(unpackSlotEncoding);
 }
 
-template<class type>
-class unpack_pa_impl {
-public:
-  PA_INJECT(type)
+//! \endcond
 
-  static void apply(const EncryptedArrayDerived<type>& ea, const CtPtrs& unpacked,
-                    const Ctxt&ctxt,const std::vector<zzX>& unpackSlotEncoding)
-  {
-    long d = ea.getDegree(); // size of each slot
+// The unpacking itself does not depend on the type of the slots: the
+// j'th slot of unpacked[i] gets the i'th coefficient of the j'th slot of
+// ctxt, as sum_j frob_j(ctxt) * coeffs[i+j mod d]. The d Frobenius images
+// come from one digit decomposition, and the outputs are computed in
+// parallel.
+static void unpackWithCoeffs(const CtPtrs& unpacked, const Ctxt& ctxt,
+                             const std::vector<DoubleCRT>& coeffs)
+{
+  long d = coeffs.size(); // size of each slot
 
-    //ctxt.cleanUp();
+  //ctxt.cleanUp();
 
-    // Convert the unpack constants to doubleCRT
-    std::vector< std::shared_ptr<DoubleCRT> > coeff_vector(d);
-    for (long i = 0; i < d; i++) {
-      coeff_vector[i] = std::shared_ptr<DoubleCRT>(new
-        DoubleCRT(unpackSlotEncoding[i],ctxt.getContext(),ctxt.getPrimeSet()));
-    }
-    // Compute the d Frobenius automorphisms of ctxt (use multi-threading)
-    std::vector<Ctxt> frob(d, Ctxt(ZeroCtxtLike, ctxt));
-    NTL_EXEC_RANGE(d, first, last)
-	for (long j = first; j < last; j++) { // process jth Frobenius 
-	  frob[j] = ctxt;
-	  frob[j].frobeniusAutomorph(j);
-	  frob[j].cleanUp();
-          // NOTE: Why do we apply cleanup after the Frobenus?
-	}
-    NTL_EXEC_RANGE_END
-
-    // compute the unpacked ciphertexts: the j'th slot of unpacked[i]
-    // contains the i'th coefficient from the j'th clot of ctxt
+  // Compute the d Frobenius automorphisms of ctxt (use multi-threading),
+  // from a single digit decomposition
+  std::vector< std::shared_ptr<Ctxt> > frob;
+  BasicAutomorphPrecon(ctxt).frobeniusAutomorphs(frob, d);
+  FHE_EXEC_RANGE(d, first, last)
+    for (long j = first; j < last; j++)
+      frob[j]->cleanUp(); // NOTE: Why do we apply cleanup after the Frobenus?
+  FHE_EXEC_RANGE_END
+
+  long n = unpacked.size();
+  FHE_EXEC_RANGE(n, first, last)
     Ctxt tmp1(ZeroCtxtLike, ctxt);
-    for (long i = 0; i < unpacked.size(); i++) {
-      *(unpacked[i]) = frob[0];
-      unpacked[i]->multByConstant(*coeff_vector[i]);
+    for (long i = first; i < last; i++) {
+      *(unpacked[i]) = *frob[0];
+      unpacked[i]->multByConstant(coeffs[i]);
       for (long j = 1; j < d; j++) {
-	tmp1 = frob[j];
-	tmp1.multByConstant(*coeff_vector[mcMod(i+j, d)]);
-	*(unpacked[i]) += tmp1;
+        tmp1 = *frob[j];
+        tmp1.multByConstant(coeffs[mcMod(i+j, d)]);
+        *(unpacked[i]) += tmp1;
       }
-    } // NOTE: why aren't we using multi-threading here?
-  }
-};
-//! \endcond
+    }
+  FHE_EXEC_RANGE_END
+}
 
-// A wrapper function, calls the apply method of the class above
+// Convert the unpack constants to DoubleCRT over the given primes
+static void unpackCoeffs(std::vector<DoubleCRT>& coeffs,
+                         const std::vector<zzX>& unpackSlotEncoding,
+                         const FHEcontext& context, const IndexSet& primes)
+{
+  coeffs.clear();
+  for (const zzX& c: unpackSlotEncoding)
+    coeffs.emplace_back(c, context, primes);
+}
+
+// Low-level unpack of one ciphertext using pre-copmuted constants
 void unpack(const CtPtrs& unpacked, const Ctxt& packed, 
             const EncryptedArray& ea,
             const std::vector<zzX>& unpackSlotEncoding)
-// void unpack(const EncryptedArray& ea, 
-// 	    std::vector<Ctxt*>& unpacked,
-// 	    const Ctxt& ctxt, 
-// 	    const std::vector<zzX>& unpackSlotEncoding)
 {
-  ea.dispatch<unpack_pa_impl>(unpacked, packed, unpackSlotEncoding);
+  assert(lsize(unpackSlotEncoding) == ea.getDegree());
+  std::vector<DoubleCRT> coeffs;
+  unpackCoeffs(coeffs, unpackSlotEncoding, packed.getContext(),
+               packed.getPrimeSet());
+  unpackWithCoeffs(unpacked, packed, coeffs);
 }
 
-// unpack many ciphertexts, returns the number of unpacked ciphertexts
+// unpack many ciphertexts, returns the number of unpacked ciphertexts.
+// The constants are converted once (over all the primes), and with enough
+// packed ciphertexts to keep the threads busy, each thread unpacks whole
+// ciphertexts.
 long unpack(const CtPtrs& unpacked, const CtPtrs& packed,
             const EncryptedArray& ea, 
             const std::vector<zzX>& unpackSlotEncoding)
@@ -128,29 +137,40 @@ long unpack(const CtPtrs& unpacked, const CtPtrs& packed,
   long d = ea.getDegree(); // size of each slot
   long num2unpack = unpacked.size();
   assert(packed.size()*d >= num2unpack); // we must have enough ciphertexts
-  long offset = 0;
-  long idx = 0;
-  while (num2unpack > 0) {
-    if (num2unpack < d) d = num2unpack;
-    const CtPtrs_slice nextSlice(unpacked, offset, d);
-    ea.dispatch<unpack_pa_impl>(nextSlice,
-                                *(packed[idx++]), unpackSlotEncoding);
-    num2unpack -= d;
-    offset += d;
+  long nPacked = divc(num2unpack, d);
+  if (nPacked == 0) return 0;
+
+  const FHEcontext& context = ea.getContext();
+  std::vector<DoubleCRT> coeffs;
+  unpackCoeffs(coeffs, unpackSlotEncoding, context, context.fullPrimes());
+
+  auto unpackOne = [&](long idx) {
+    long offset = idx*d;
+    const CtPtrs_slice nextSlice(unpacked, offset,
+                                 std::min(d, num2unpack - offset));
+    unpackWithCoeffs(nextSlice, *(packed[idx]), coeffs);
+  };
+  if (nPacked < fheAvailableThreads())
+    for (long idx = 0; idx < nPacked; idx++) unpackOne(idx);
+  else {
+    FHE_EXEC_RANGE(nPacked, first, last) // inner loops: serial, or tasks
+      for (long idx = first; idx < last; idx++) unpackOne(idx);
+    FHE_EXEC_RANGE_END
   }
-  return idx;
+  return nPacked;
 }
 
 // An implementation classes for (re)packing.
 
 //! \cond FALSE (make doxygen ignore this code)
 template<class type>
-class repack_pa_impl {
+class repackConsts_pa_impl {
 public:
   PA_INJECT(type)
 
-  static void apply(const EncryptedArrayDerived<type>& ea, Ctxt& ctxt,
-                    const CtPtrs& unpacked)
+  // consts[i] has X^{p^i} in all the slots, for i<n
+  static void apply(const EncryptedArrayDerived<type>& ea,
+                    std::vector<zzX>& consts, long n)
   {
     RBak bak; bak.save(); ea.restoreContext();  // the NTL context for mod p^r
     long nslots = ea.size(); // how many slots
@@ -159,25 +179,52 @@ public:
     // CB contains a description of the normal-basis transformation
 
     RX pow;
-    zzX powInSlots;
     std::vector<RX> powVec(nslots);
-    ctxt.clear();
-    for (long i=0; i<unpacked.size(); i++) {
+    consts.resize(n);
+    for (long i=0; i<n; i++) {
       conv(pow, CB[i]); // convert CB[i] from Vec<R> to RX
       for (long j=0; j < nslots; j++) powVec[j] = pow;
-      ea.encode(powInSlots, powVec); // a constant with X^{p^i} in all slots
-      Ctxt tmp(*(unpacked[i]));
-      tmp.multByConstant(powInSlots);// accumulate unpacked[i] * X^{p^i}
-      ctxt += tmp;
+      ea.encode(consts[i], powVec); // a constant with X^{p^i} in all slots
     }
   }
 };
 //! \endcond
 
-// A wrapper function, calls the apply method of the class above
+// ctxt = sum_i unpacked[i] * consts[i], the products computed in parallel
+static void repackWithConsts(Ctxt& ctxt, const CtPtrs& unpacked,
+                             const std::vector<DoubleCRT>& consts)
+{
+  long n = unpacked.size();
+  ctxt.clear();
+  if (n == 0) return;
+  std::vector<Ctxt> prods(n, Ctxt(ZeroCtxtLike, *(unpacked[0])));
+  FHE_EXEC_RANGE(n, first, last)
+    for (long i = first; i < last; i++) {
+      prods[i] = *(unpacked[i]);
+      prods[i].multByConstant(consts[i]); // unpacked[i] * X^{p^i}
+    }
+  FHE_EXEC_RANGE_END
+  for (long i = 0; i < n; i++)
+    ctxt += prods[i];
+}
+
+// Encode the repacking constants as DoubleCRT over all the primes
+static void repackConsts(std::vector<DoubleCRT>& consts, long n,
+                         const EncryptedArray& ea)
+{
+  std::vector<zzX> polys;
+  ea.dispatch<repackConsts_pa_impl>(polys, n);
+  const FHEcontext& context = ea.getContext();
+  consts.clear();
+  for (const zzX& c: polys)
+    consts.emplace_back(c, context, context.fullPrimes());
+}
+
 void repack(Ctxt& packed, const CtPtrs& unpacked, const EncryptedArray& ea)
 {
-  ea.dispatch<repack_pa_impl>(packed, unpacked);
+  std::vector<DoubleCRT> consts;
+  repackConsts(consts, unpacked.size(), ea);
+  repackWithConsts(packed, unpacked, consts);
 }
 
 // pack many ciphertexts, returns the number of packed ciphertexts
@@ -186,16 +233,26 @@ long repack(const CtPtrs& packed, const CtPtrs& unpacked, const EncryptedArray&
   long d = ea.getDegree(); // size of each slot
   long num2pack = unpacked.size();
   assert(packed.size()*d >= num2pack); // we must have enough ciphertexts
-  long offset = 0;
-  long idx = 0;
-  while (num2pack > 0) {
-    if (num2pack < d) d = num2pack;
-    const CtPtrs_slice nextSlice(unpacked, offset, d);
-    ea.dispatch<repack_pa_impl>(*(packed[idx++]), nextSlice);
-    num2pack -= d;
-    offset += d;
+  long nPacked = divc(num2pack, d);
+  if (nPacked == 0) return 0;
+
+  std::vector<DoubleCRT> consts;
+  repackConsts(consts, std::min(d, num2pack), ea);
+
+  auto repackOne = [&](long idx) {
+    long offset = idx*d;
+    const CtPtrs_slice nextSlice(unpacked, offset,
+                                 std::min(d, num2pack - offset));
+    repackWithConsts(*(packed[idx]), nextSlice, consts);
+  };
+  if (nPacked < fheAvailableThreads())
+    for (long idx = 0; idx < nPacked; idx++) repackOne(idx);
+  else {
+    FHE_EXEC_RANGE(nPacked, first, last) // inner loops: serial, or tasks
+      for (long idx = first; idx < last; idx++) repackOne(idx);
+    FHE_EXEC_RANGE_END
   }
-  return idx;
+  return nPacked;
 }
 
 
@@ -30,7 +30,9 @@ void unpack(const CtPtrs& unpacked, const Ctxt& packed,
             const EncryptedArray& ea,
             const std::vector<zzX>& unpackSlotEncoding);
 
-// unpack many ciphertexts, returns the number of unpacked ciphertexts
+// unpack many ciphertexts, returns the number of unpacked ciphertexts.
+// The ciphertexts are split between the threads if there are enough of
+// them, else the work on each one is.
 long unpack(const CtPtrs& unpacked, const CtPtrs& packed,
             const EncryptedArray& ea, 
             const std::vector<zzX>& unpackSlotEncoding);
@@ -39,6 +41,7 @@ long unpack(const CtPtrs& unpacked, const CtPtrs& packed,
 void repack(Ctxt& packed, const CtPtrs& unpacked, const EncryptedArray& ea);
 
 // pack many ciphertexts, returns the number of packed ciphertexts
+// (threaded in the same way as unpack)
 long repack(const CtPtrs& packed, const CtPtrs& unpacked, const EncryptedArray& ea);
 
 // Returns in 'value' a vector of slot values. The bits of value[i] are
@@ -0,0 +1,198 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* keyStore.cpp - tenant keys over one context, loaded lazily, LRU evicted
+ */
+#include <fstream>
+#include <stdexcept>
+#include "keyStore.h"
+#include "FHE.h"
+#include "binio.h"
+
+NTL_CLIENT
+
+TenantKeyStore::TenantKeyStore(const FHEcontext& _context, long budget)
+  : context(_context), budgetBytes(budget), usedBytes(0)
+{
+  counts.hits = counts.loads = counts.evictions = 0;
+}
+
+void TenantKeyStore::add(const string& id, const Loader& load,
+                         const string& mappedFile)
+{
+  std::lock_guard<std::mutex> lock(mx);
+  if (tenants.count(id))
+    throw std::logic_error("TenantKeyStore: tenant "+id+" already exists");
+  Tenant& t = tenants[id];
+  t.load = load;
+  t.mappedFile = mappedFile;
+  t.charge = 0;
+  t.loading = false;
+}
+
+void TenantKeyStore::addTenant(const string& id, const string& mappedFile)
+{ add(id, nullptr, mappedFile); }
+
+void TenantKeyStore::addTenant(const string& id, const Loader& load)
+{ add(id, load, ""); }
+
+void TenantKeyStore::removeTenant(const string& id)
+{
+  std::lock_guard<std::mutex> lock(mx);
+  auto it = tenants.find(id);
+  if (it == tenants.end()) return;
+  if (it->second.key) drop(it->second);
+  tenants.erase(it); // a load in progress then keeps its key to itself
+}
+
+bool TenantKeyStore::hasTenant(const string& id) const
+{
+  std::lock_guard<std::mutex> lock(mx);
+  return tenants.count(id) > 0;
+}
+
+void TenantKeyStore::drop(Tenant& t)
+{
+  usedBytes -= t.charge;
+  lruList.erase(t.lru);
+  t.key.reset();
+  t.charge = 0;
+}
+
+// Drop the least recently used keys until the budget is met, but never
+// the key of keep (which has just been loaded)
+void TenantKeyStore::enforceBudget(const string& keep)
+{
+  while (usedBytes > budgetBytes && !lruList.empty()) {
+    const string& victim = lruList.back();
+    if (victim == keep) break; // the only one left
+    drop(tenants.at(victim));
+    counts.evictions++;
+  }
+}
+
+shared_ptr<const FHEPubKey> TenantKeyStore::get(const string& id)
+{
+  std::unique_lock<std::mutex> lock(mx);
+  auto it = tenants.find(id);
+  for (;;) {
+    if (it == tenants.end())
+      throw std::logic_error("TenantKeyStore: no tenant "+id);
+    Tenant& t = it->second;
+    if (t.key) {
+      counts.hits++;
+      lruList.splice(lruList.begin(), lruList, t.lru);
+      return t.key;
+    }
+    if (!t.loading) break;
+    loaded.wait(lock); // another thread loads it
+    it = tenants.find(id);
+  }
+
+  // load it without holding the lock
+  Tenant& t = it->second;
+  t.loading = true;
+  Loader load = t.load;
+  string mappedFile = t.mappedFile;
+  lock.unlock();
+
+  shared_ptr<FHEPubKey> key;
+  long charge;
+  try {
+    key = make_shared<FHEPubKey>(context);
+    charge = 0;
+    if (!mappedFile.empty()) {
+      readPubKeyMapped(mappedFile, *key);
+      ifstream f(resolveBinaryPath(mappedFile), ios::binary | ios::ate);
+      if (f) charge = long(f.tellg());
+    }
+    else
+      load(*key);
+    charge += key->memoryUsage();
+  }
+  catch (...) {
+    lock.lock();
+    it = tenants.find(id);
+    if (it != tenants.end()) it->second.loading = false;
+    loaded.notify_all();
+    throw;
+  }
+
+  lock.lock();
+  counts.loads++;
+  it = tenants.find(id);
+  if (it != tenants.end() && it->second.loading) { // not removed meanwhile
+    Tenant& u = it->second;
+    u.loading = false;
+    u.key = key;
+    u.charge = charge;
+    usedBytes += charge;
+    lruList.push_front(id);
+    u.lru = lruList.begin();
+    enforceBudget(id);
+  }
+  loaded.notify_all();
+  return key;
+}
+
+bool TenantKeyStore::isLoaded(const string& id) const
+{
+  std::lock_guard<std::mutex> lock(mx);
+  auto it = tenants.find(id);
+  return it != tenants.end() && it->second.key;
+}
+
+void TenantKeyStore::evict(const string& id)
+{
+  std::lock_guard<std::mutex> lock(mx);
+  auto it = tenants.find(id);
+  if (it != tenants.end() && it->second.key) drop(it->second);
+}
+
+void TenantKeyStore::setBudget(long budget)
+{
+  std::lock_guard<std::mutex> lock(mx);
+  budgetBytes = budget;
+  enforceBudget("");
+}
+
+long TenantKeyStore::getBudget() const
+{
+  std::lock_guard<std::mutex> lock(mx);
+  return budgetBytes;
+}
+
+long TenantKeyStore::usage() const
+{
+  std::lock_guard<std::mutex> lock(mx);
+  return usedBytes;
+}
+
+long TenantKeyStore::numLoaded() const
+{
+  std::lock_guard<std::mutex> lock(mx);
+  return lruList.size();
+}
+
+TenantKeyStore::Stats TenantKeyStore::stats() const
+{
+  std::lock_guard<std::mutex> lock(mx);
+  return counts;
+}
+
+MemoryReport TenantKeyStore::memoryReport() const
+{
+  std::lock_guard<std::mutex> lock(mx);
+  MemoryReport r("TenantKeyStore", sizeof(*this));
+  for (const string& id: lruList) // most recently used first
+    r.add("tenant "+id, tenants.at(id).charge);
+  return r;
+}
@@ -0,0 +1,129 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _KEY_STORE_H_
+#define _KEY_STORE_H_
+/**
+ * @file keyStore.h
+ * @brief The public keys of many tenants over one shared FHEcontext,
+ * loaded on first use and evicted under a memory budget
+ *
+ * A service that evaluates for many tenants with the same parameters
+ * keeps one FHEcontext, and a TenantKeyStore with the public key (mostly
+ * key-switching matrices) of each tenant. A tenant is registered with its
+ * key file and nothing is read until get() first asks for that key. The
+ * keys that are loaded are kept in LRU order, and when their total charge
+ * goes over the budget the least recently used ones are dropped.
+ *
+ * The natural key files are the mapped ones (writePubKeyMapped): loading
+ * one only maps it, each key-switching matrix is paged in the first time
+ * a computation uses it, and the pages of a dropped key go back to the page
+ * cache, so switching to a tenant whose key is still cached costs only the
+ * page-ins. The charge of such a key is its memoryUsage() plus the size of
+ * the file, the most that it can bring into memory. Any other format can
+ * be used through a Loader, the charge is then memoryUsage().
+ *
+ * get() returns a shared_ptr, so a key that is dropped from the store lives
+ * on until the computations that use it are done (they are not counted in
+ * the budget any more). Ciphertexts keep a reference to their key: hold
+ * the shared_ptr for as long as they exist. All the methods are thread
+ * safe, and two threads that ask for the same key load it once. The
+ * errors of a load (std::runtime_error for a bad file) are raised by get(),
+ * and the next get() tries again.
+ **/
+#include <string>
+#include <map>
+#include <list>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include "memoryUsage.h"
+
+class FHEcontext;
+class FHEPubKey;
+
+//! @class TenantKeyStore
+//! @brief Public keys of many tenants over one context, see keyStore.h
+class TenantKeyStore {
+public:
+  //! Fills in a key that is constructed over the context of the store
+  typedef std::function<void(FHEPubKey&)> Loader;
+
+  //! @brief How the store was used since it was made
+  struct Stats {
+    long hits;      // get() found the key loaded
+    long loads;     // get() had to load it
+    long evictions; // keys dropped for the budget
+  };
+
+private:
+  struct Tenant {
+    Loader load;                        // if mappedFile is empty
+    std::string mappedFile;
+    std::shared_ptr<const FHEPubKey> key;
+    long charge;
+    bool loading;
+    std::list<std::string>::iterator lru;
+  };
+
+  const FHEcontext& context;
+  long budgetBytes;
+  long usedBytes;
+  Stats counts;
+  std::map<std::string, Tenant> tenants;
+  std::list<std::string> lruList; // the loaded keys, most recent first
+  mutable std::mutex mx;
+  std::condition_variable loaded;
+
+  void add(const std::string& id, const Loader& load,
+           const std::string& mappedFile);
+  void drop(Tenant& t);                       // with mx held
+  void enforceBudget(const std::string& keep); // with mx held
+
+public:
+  //! @param budget  the most bytes of loaded keys to keep
+  TenantKeyStore(const FHEcontext& _context, long budget);
+
+  TenantKeyStore(const TenantKeyStore&) = delete;
+  TenantKeyStore& operator=(const TenantKeyStore&) = delete;
+
+  //! @brief Register a tenant whose key is in a mapped key file
+  //! (writePubKeyMapped, the name may be "shm:NAME")
+  void addTenant(const std::string& id, const std::string& mappedFile);
+  //! @brief Register a tenant whose key is read by load
+  void addTenant(const std::string& id, const Loader& load);
+  //! @brief Forget a tenant (its key lives on in the hands of its users)
+  void removeTenant(const std::string& id);
+  bool hasTenant(const std::string& id) const;
+
+  //! @brief The key of tenant id, loaded if it is not there. Raises
+  //! std::logic_error for an unknown tenant.
+  std::shared_ptr<const FHEPubKey> get(const std::string& id);
+
+  //! Is the key of the tenant loaded?
+  bool isLoaded(const std::string& id) const;
+  //! @brief Drop the key of the tenant from the store, if it is loaded
+  void evict(const std::string& id);
+
+  //! @brief Change the budget, dropping keys if it is now exceeded
+  void setBudget(long budget);
+  long getBudget() const;
+  //! The charge of the keys that are loaded
+  long usage() const;
+  long numLoaded() const;
+  Stats stats() const;
+
+  //! @brief The loaded keys, by tenant (see memoryUsage.h)
+  MemoryReport memoryReport() const;
+};
+
+#endif // ifndef _KEY_STORE_H_
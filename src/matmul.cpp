@@ -10,10 +10,21 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 #include <cstddef>
+#include <cstdio>
 #include <tuple>
 #include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <set>
 #include <NTL/BasicThreadPool.h>
 #include "matmul.h"
+#include "binio.h"
+#include "memoryUsage.h"
+#include "taskScheduler.h"
 
 NTL_CLIENT
 
@@ -38,116 +49,6 @@ static bool comp_hoist(bool hoist)
 /********************************************************************/
 /****************** Auxiliary stuff: should go elsewhere   **********/
 
-/**
- * @class BasicAutomorphPrecon
- * @brief Pre-computation to speed many automorphism on the same ciphertext.
- * 
- * The expensive part of homomorphic automorphism is braking the ciphertext
- * parts into digits. The usual setting is we first rotate the ciphertext
- * parts, then break them into digits. But when we apply many automorphisms
- * it is faster to break the original ciphertext into digits, then rotate
- * the digits (as opposed to first rotate, then break).
- * An BasicAutomorphPrecon object breaks the original ciphertext and keeps
- * the digits, then when you call automorph is only needs to apply the
- * native automorphism and key switching to the digits, which is fast(er).
- **/
-class BasicAutomorphPrecon {
-  Ctxt ctxt;
-  NTL::xdouble noise;
-  std::vector<DoubleCRT> polyDigits;
-
-public:
-  BasicAutomorphPrecon(const Ctxt& _ctxt) : ctxt(_ctxt), noise(1.0)
-  {
-    FHE_TIMER_START;
-    if (ctxt.parts.size() >= 1) assert(ctxt.parts[0].skHandle.isOne());
-    if (ctxt.parts.size() <= 1) return; // nothing to do
-
-    ctxt.cleanUp();
-    const FHEcontext& context = ctxt.getContext();
-    const FHEPubKey& pubKey = ctxt.getPubKey();
-    long keyID = ctxt.getKeyID();
-
-    // The call to cleanUp() should ensure that this assertions passes.
-    assert(ctxt.inCanonicalForm(keyID));
-
-    // Compute the number of digits that we need and the esitmated
-    // added noise from switching this ciphertext.
-    long nDigits;
-    std::tie(nDigits, noise)
-      = ctxt.computeKSNoise(1, pubKey.keySWlist().at(0));
-
-    double logProd = context.logOfProduct(context.specialPrimes);
-    noise += ctxt.getNoiseBound() * xexp(logProd);
-
-    // Break the ciphertext part into digits, if needed, and scale up these
-    // digits using the special primes.
-
-    ctxt.parts[1].breakIntoDigits(polyDigits, nDigits);
-  }
-
-  
-  shared_ptr<Ctxt>
-  automorph(long k) const
-  {
-    FHE_TIMER_START;
-
-    // A hack: record this automorphism rather than actually performing it
-    if (isSetAutomorphVals()) { // defined in NumbTh.h
-      recordAutomorphVal(k);
-      return make_shared<Ctxt>(ctxt);
-    }
-
-    if (k==1 || ctxt.isEmpty()) return make_shared<Ctxt>(ctxt);// nothing to do
-
-    const FHEcontext& context = ctxt.getContext();
-    const FHEPubKey& pubKey = ctxt.getPubKey();
-    shared_ptr<Ctxt> result = make_shared<Ctxt>(ZeroCtxtLike, ctxt); // empty ctxt
-    result->noiseBound = noise; // noise estimate
-    result->intFactor = ctxt.intFactor;
-
-    if (ctxt.parts.size()==1) { // only constant part, no need to key-switch
-      CtxtPart tmpPart = ctxt.parts[0];
-      tmpPart.automorph(k);
-      tmpPart.addPrimesAndScale(context.specialPrimes);
-      result->addPart(tmpPart, /*matchPrimeSet=*/true);
-      return result;
-    }
-
-    // Ensure that we have a key-switching matrices for this automorphism
-    long keyID = ctxt.getKeyID();
-    if (!pubKey.isReachable(k,keyID)) {
-      throw std::logic_error("no key-switching matrices for k="+std::to_string(k)
-                             + ", keyID="+std::to_string(keyID));
-    }
-
-    // Get the first key-switching matrix for this automorphism
-    const KeySwitch& W = pubKey.getNextKSWmatrix(k,keyID);
-    long amt = W.fromKey.getPowerOfX();
-
-    // Start by rotating the constant part, no need to key-switch it
-    CtxtPart tmpPart = ctxt.parts[0];
-    tmpPart.automorph(amt);
-    tmpPart.addPrimesAndScale(context.specialPrimes);
-    result->addPart(tmpPart, /*matchPrimeSet=*/true);
-
-    // Then rotate the digits and key-switch them
-    vector<DoubleCRT> tmpDigits = polyDigits;
-    for (auto&& tmp: tmpDigits) // rotate each of the digits
-      tmp.automorph(amt);
-
-    result->keySwitchDigits(W, tmpDigits); // key-switch the digits
-
-    long m = context.zMStar.getM();
-    if ((amt-k)%m != 0) { // amt != k (mod m), more automorphisms to do
-      k = MulMod(k, InvMod(amt,m), m); // k *= amt^{-1} mod m
-      result->smartAutomorph(k);       // call usual smartAutomorph
-    }
-    return result;
-  }
-};
-
-
 class GeneralAutomorphPrecon {
 public:
   virtual ~GeneralAutomorphPrecon() {}
@@ -223,12 +124,12 @@ public:
     precon.resize(h);
 
     // parallel for k in [0..h)
-    NTL_EXEC_RANGE(h, first, last)
+    FHE_EXEC_RANGE(h, first, last)
       for (long k = first; k < last; k++) {
 	shared_ptr<Ctxt> p = precon0.automorph(zMStar.genToPow(dim, g*k));
 	precon[k] = make_shared<BasicAutomorphPrecon>(*p);
       }
-    NTL_EXEC_RANGE_END
+    FHE_EXEC_RANGE_END
   }
 
   shared_ptr<Ctxt> automorph(long i) const override
@@ -281,41 +182,216 @@ struct ConstMultiplier {
 
   virtual void mul(Ctxt& ctxt) const = 0;
 
+  // x += ctxt*constant
+  virtual void mulAdd(Ctxt& x, const Ctxt& ctxt) const {
+    Ctxt tmp(ctxt);
+    mul(tmp);
+    x += tmp;
+  }
+
   virtual shared_ptr<ConstMultiplier> upgrade(const FHEcontext& context) const = 0;
   // Upgrade to DCRT. Returns null of no upgrade required
 
+  virtual long memoryUsage() const = 0;
+
 };
 
 struct ConstMultiplier_DoubleCRT : ConstMultiplier {
 
   DoubleCRT data;
   ConstMultiplier_DoubleCRT(const DoubleCRT& _data) : data(_data) { }
+  ConstMultiplier_DoubleCRT(DoubleCRT&& _data) : data(std::move(_data)) { }
 
   void mul(Ctxt& ctxt) const override {
     ctxt.multByConstant(data);
   } 
 
+  void mulAdd(Ctxt& x, const Ctxt& ctxt) const override {
+    x.mulAddConstant(ctxt, data);
+  }
+
   shared_ptr<ConstMultiplier> upgrade(const FHEcontext& context) const override {
     return nullptr;
   }
 
+  long memoryUsage() const override {
+    return sizeof(*this) - sizeof(DoubleCRT) + data.memoryUsage();
+  }
+
+};
+
+
+// A CKKS constant, which was encoded with the given scaling factor
+struct ConstMultiplier_CKKS : ConstMultiplier_DoubleCRT {
+
+  long factor;
+
+  ConstMultiplier_CKKS(DoubleCRT&& _data, long _factor)
+    : ConstMultiplier_DoubleCRT(std::move(_data)), factor(_factor) { }
+
+  void mul(Ctxt& ctxt) const override {
+    ctxt.multByConstantCKKS(data, /*size=*/xdouble(-1.0), to_ZZ(factor));
+  }
+
+  void mulAdd(Ctxt& x, const Ctxt& ctxt) const override { // not fused
+    ConstMultiplier::mulAdd(x, ctxt);
+  }
+
 };
 
 
+// The hot tier: DoubleCRT copies of the most used zzX constants
+namespace {
+struct ConstTier {
+  struct Entry {
+    shared_ptr<const DoubleCRT> dcrt;
+    long uses, bytes;
+  };
+
+  std::mutex mtx;
+  std::map<const void*, Entry> entries;
+  std::set<pair<long, const void*>> byUses; // the least used first
+  std::atomic_long budget{0}; // read without the lock for the common case
+  long size = 0;
+  long hits = 0, misses = 0;
+
+  void drop(std::map<const void*, Entry>::iterator it) { // mtx must be held
+    byUses.erase(make_pair(it->second.uses, it->first));
+    size -= it->second.bytes;
+    entries.erase(it);
+  }
+  void evict() { // drop the least used entries, mtx must be held
+    while (size > budget && !byUses.empty())
+      drop(entries.find(byUses.begin()->second));
+  }
+  // Can a constant used that many times get a copy, mtx must be held
+  bool admits(long uses, long bytes) {
+    if (bytes > budget) return false;
+    long room = budget - size;
+    for (auto it = byUses.begin(); room < bytes && it != byUses.end(); ++it) {
+      if (it->first >= uses) return false;
+      room += entries.at(it->second).bytes;
+    }
+    return true;
+  }
+};
+
+ConstTier& constTier()
+{
+  static ConstTier tier;
+  return tier;
+}
+} // anonymous namespace
+
+void setConstMultiplierBudget(long bytes)
+{
+  ConstTier& tier = constTier();
+  std::lock_guard<std::mutex> lock(tier.mtx);
+  tier.budget = std::max(0L, bytes);
+  tier.evict();
+}
+
+long getConstMultiplierBudget()
+{
+  ConstTier& tier = constTier();
+  std::lock_guard<std::mutex> lock(tier.mtx);
+  return tier.budget;
+}
+
+ConstMultiplierStats getConstMultiplierStats()
+{
+  ConstTier& tier = constTier();
+  std::lock_guard<std::mutex> lock(tier.mtx);
+  ConstMultiplierStats stats;
+  stats.hits = tier.hits;
+  stats.misses = tier.misses;
+  stats.entries = tier.entries.size();
+  stats.bytes = tier.size;
+  return stats;
+}
+
+void clearConstMultiplierTier()
+{
+  ConstTier& tier = constTier();
+  std::lock_guard<std::mutex> lock(tier.mtx);
+  tier.entries.clear();
+  tier.byUses.clear();
+  tier.size = tier.hits = tier.misses = 0;
+}
+
 struct ConstMultiplier_zzX : ConstMultiplier {
 
   zzX data;
+  mutable std::atomic_long uses; // counted only with a nonzero budget
 
-  ConstMultiplier_zzX(const zzX& _data) : data(_data) { }
+  ConstMultiplier_zzX(const zzX& _data) : data(_data), uses(0) { }
+
+  ~ConstMultiplier_zzX() {
+    if (uses == 0) return; // never seen by the tier
+    ConstTier& tier = constTier();
+    std::lock_guard<std::mutex> lock(tier.mtx);
+    auto it = tier.entries.find(this);
+    if (it != tier.entries.end()) tier.drop(it);
+  }
 
   void mul(Ctxt& ctxt) const override {
-    ctxt.multByConstant(data);
-  } 
+    ConstTier& tier = constTier();
+    if (tier.budget == 0) { // no hot tier
+      ctxt.multByConstant(data);
+      return;
+    }
+
+    shared_ptr<const DoubleCRT> hot;
+    bool admit = false;
+    long bytes = 0;
+    const FHEcontext& context = ctxt.getContext();
+    {std::lock_guard<std::mutex> lock(tier.mtx);
+     long n = ++uses;
+     auto it = tier.entries.find(this);
+     if (it != tier.entries.end()) { // a hit, move it up
+       tier.hits++;
+       tier.byUses.erase(make_pair(it->second.uses, it->first));
+       it->second.uses = n;
+       tier.byUses.insert(make_pair(n, it->first));
+       hot = it->second.dcrt;
+     }
+     else {
+       tier.misses++;
+       bytes = context.fullPrimes().card()
+               * RowSlab(context.zMStar.getPhiM()).getStride() * sizeof(long);
+       admit = tier.admits(n, bytes);
+     }
+    }
+    if (hot) {
+      ctxt.multByConstant(*hot);
+      return;
+    }
+    if (!admit) {
+      ctxt.multByConstant(data);
+      return;
+    }
+
+    hot = make_shared<const DoubleCRT>(data, context, context.fullPrimes());
+    ctxt.multByConstant(*hot);
+    std::lock_guard<std::mutex> lock(tier.mtx);
+    long n = uses;
+    if (tier.entries.count(this) || !tier.admits(n, bytes)) return;
+    while (tier.budget - tier.size < bytes) // make room
+      tier.drop(tier.entries.find(tier.byUses.begin()->second));
+    tier.entries[this] = ConstTier::Entry{hot, n, bytes};
+    tier.byUses.insert(make_pair(n, (const void*) this));
+    tier.size += bytes;
+  }
 
   shared_ptr<ConstMultiplier> upgrade(const FHEcontext& context) const override {
     return make_shared<ConstMultiplier_DoubleCRT>(DoubleCRT(data, context, context.fullPrimes()));
   }
 
+  // not counting a copy in the hot tier, see getConstMultiplierStats
+  long memoryUsage() const override {
+    return sizeof(*this) + memBytes(data);
+  }
+
 };
 
 template<class RX>
@@ -346,11 +422,7 @@ build_ConstMultiplier(const RX& poly,
 void MulAdd(Ctxt& x, const shared_ptr<ConstMultiplier>& a, const Ctxt& b)
 // x += a*b
 {
-   if (a) {
-      Ctxt tmp(b);
-      a->mul(tmp);
-      x += tmp;
-   }
+   if (a) a->mulAdd(x, b);
 }
 
 void DestMulAdd(Ctxt& x, const shared_ptr<ConstMultiplier>& a, Ctxt& b)
@@ -362,21 +434,480 @@ void DestMulAdd(Ctxt& x, const shared_ptr<ConstMultiplier>& a, Ctxt& b)
    }
 }
 
+// x += sum_{i in [0..n)} term_i, where term(acc, i) adds term_i to acc.
+// The terms are split across the thread pool, each thread adds its share
+// into a partial sum of its own, and the partial sums are added to x at
+// the end. Calls to term must be safe to run concurrently.
+template<class Fn>
+static void ParallelAccumulate(Ctxt& x, long n, const Fn& term)
+{
+   if (n <= 0) return;
+
+   PartitionInfo pinfo(n, fheAvailableThreads());
+   long cnt = pinfo.NumIntervals();
+   if (cnt == 1) { // no point in the partial sums
+      for (long i: range(n)) term(x, i);
+      return;
+   }
+
+   vector<Ctxt> partial(cnt, Ctxt(ZeroCtxtLike, x));
+
+   FHE_EXEC_INDEX(cnt, index)
+      long first, last;
+      pinfo.interval(first, last, index);
+      for (long i: range(first, last)) term(partial[index], i);
+   FHE_EXEC_INDEX_END
+
+   for (long i: range(cnt)) x += std::move(partial[i]);
+}
+
+
+long ConstMultiplierCache::memoryUsage() const
+{
+  long n = sizeof(*this) + multiplier.capacity()*sizeof(multiplier[0]);
+  for (auto& c: multiplier)
+    if (c) n += c->memoryUsage();
+  return n;
+}
 
 void ConstMultiplierCache::upgrade(const FHEcontext& context) 
 {
   FHE_TIMER_START;
 
   long n = multiplier.size();
-  NTL_EXEC_RANGE(n, first, last)
+  FHE_EXEC_RANGE(n, first, last)
   for (long i: range(first, last)) {
     if (multiplier[i]) 
       if (auto newptr = multiplier[i]->upgrade(context)) 
 	multiplier[i] = shared_ptr<ConstMultiplier>(newptr); 
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
+}
+
+
+
+
+/************** Persistent caches of the encoded constants **************/
+/* A cache file consists of:
+    1. A fixed-size prefix: eye-catcher, version, an endianness marker
+       (written natively), the row stride, the size of the metadata, and
+       the offset of the data area
+    2. Metadata in the usual binary format: the identity of the context,
+       plaintext space and shape of the transformation, then for every
+       constant of cache and cache1 its kind (none, zzX or DoubleCRT) and
+       either the zzX coefficients or the index set of the DoubleCRT and
+       its offset in the data area (for CKKS constants, preceded by their
+       scaling factor)
+    3. Zero padding up to a page boundary
+    4. The data area: the rows of every DoubleCRT constant, stride apart
+   The DoubleCRT constants that are read from such a file are views of the
+   mapped file.
+*/
+
+static const long mmCacheVersion = 2;
+static const long mmCacheMarker = 0x0102030405060708L;
+static const long mmCachePrefixSize = BINIO_EYE_SIZE + 4 + 4*8;
+
+enum { MMCACHE_NONE=0, MMCACHE_ZZX=1, MMCACHE_DCRT=2, MMCACHE_CKKS=3 };
+
+// The context, the plaintext space and the modulus chain for which the
+// constants are encoded
+static string mmCacheIdentity(const EncryptedArray& ea)
+{
+  const FHEcontext& context = ea.getContext();
+  ostringstream str;
+  writeContextBaseBinary(str, context);
+  write_raw_int(str, context.numPrimes());
+  for (long i: range(context.numPrimes()))
+    write_raw_int(str, context.ithPrime(i));
+
+  write_raw_int(str, ea.getAlMod().getPPowR());
+  zzX G; // the coefficients as they are, without any zz_p context
+  if (ea.getTag() == PA_GF2_tag)
+    convert(G, ea.getDerived(PA_GF2()).getG());
+  else if (ea.getTag() == PA_zz_p_tag)
+    convert(G, ea.getDerived(PA_zz_p()).getG(), /*symmetric=*/false);
+  write_ntl_vec_long(str, G);
+  return str.str();
 }
 
+// Write the two caches to fname, for the matrix with the given shape and
+// digest. This is only an optimization for later runs, so errors are
+// reported as warnings.
+static void saveMatMulCache(const string& fname, const EncryptedArray& ea,
+                            const vector<long>& shape, unsigned long digest,
+                            const ConstMultiplierCache& c0,
+                            const ConstMultiplierCache& c1)
+{
+  long phim = ea.getContext().zMStar.getPhiM();
+  long stride = RowSlab(phim).getStride();
+
+  ostringstream meta;
+  string id = mmCacheIdentity(ea);
+  write_raw_int(meta, id.size());
+  meta.write(id.data(), id.size());
+  write_raw_vector(meta, shape);
+  meta.write(reinterpret_cast<const char*>(&digest), sizeof(digest));
+
+  vector<const DoubleCRT*> rows; // the DoubleCRT constants, in order
+  long offset = 0;
+  for (const ConstMultiplierCache* c: {&c0, &c1}) {
+    write_raw_int(meta, c->multiplier.size());
+    for (const shared_ptr<ConstMultiplier>& mp: c->multiplier) {
+      if (!mp) {
+        write_raw_int(meta, MMCACHE_NONE, BINIO_32BIT);
+      }
+      else if (auto z = dynamic_cast<const ConstMultiplier_zzX*>(mp.get())) {
+        write_raw_int(meta, MMCACHE_ZZX, BINIO_32BIT);
+        write_ntl_vec_long(meta, z->data);
+      }
+      else {
+        auto dc = dynamic_cast<const ConstMultiplier_DoubleCRT*>(mp.get());
+        assert(dc != nullptr);
+        if (auto ck = dynamic_cast<const ConstMultiplier_CKKS*>(dc)) {
+          write_raw_int(meta, MMCACHE_CKKS, BINIO_32BIT);
+          write_raw_int(meta, ck->factor);
+        }
+        else
+          write_raw_int(meta, MMCACHE_DCRT, BINIO_32BIT);
+        dc->data.getIndexSet().write(meta);
+        write_raw_int(meta, offset);
+        offset += dc->data.getIndexSet().card() * stride * sizeof(long);
+        rows.push_back(&dc->data);
+      }
+    }
+  }
+  writeEyeCatcher(meta, BINIO_EYE_MMCACHE_END);
+
+  string metaStr = meta.str();
+  long metaSize = metaStr.size();
+  long dataStart =
+    divc(mmCachePrefixSize + metaSize, BINIO_PAGE_SIZE)*BINIO_PAGE_SIZE;
+
+  // Write to a temporary file and rename it, so that other processes never
+  // map a partially written cache
+  string path;
+  try {
+    path = resolveBinaryPath(fname, /*forWriting=*/true);
+  }
+  catch (std::runtime_error& e) {
+    Warning((string("saveMatMulCache: ") + e.what()).c_str());
+    return;
+  }
+  string tmpName = tempBinaryPath(path);
+  {
+    ofstream str(tmpName, ios::binary);
+    if (!str) {
+      Warning("saveMatMulCache: cannot open "+tmpName);
+      return;
+    }
+
+    writeEyeCatcher(str, BINIO_EYE_MMCACHE_BEGIN);
+    write_raw_int(str, mmCacheVersion, BINIO_32BIT);
+    str.write(reinterpret_cast<const char*>(&mmCacheMarker), sizeof(long));
+    write_raw_int(str, stride);
+    write_raw_int(str, metaSize);
+    write_raw_int(str, dataStart);
+    str.write(metaStr.data(), metaSize);
+
+    string pad(dataStart - mmCachePrefixSize - metaSize, '\0');
+    str.write(pad.data(), pad.size());
+
+    vector<long> zeros(stride-phim, 0);
+    for (const DoubleCRT* dcrt: rows)
+      for (long i: dcrt->getIndexSet()) {
+        str.write(reinterpret_cast<const char*>(dcrt->getMap()[i]),
+                  phim*sizeof(long));
+        str.write(reinterpret_cast<const char*>(zeros.data()),
+                  zeros.size()*sizeof(long));
+      }
+    if (!str) {
+      Warning("saveMatMulCache: error writing "+tmpName);
+      std::remove(tmpName.c_str());
+      return;
+    }
+  }
+  if (std::rename(tmpName.c_str(), path.c_str()) != 0) {
+    Warning("saveMatMulCache: cannot rename "+tmpName);
+    std::remove(tmpName.c_str());
+  }
+}
+
+// Load the two caches from fname. Returns false, and leaves c0 and c1
+// unchanged, if the file does not exist, is not a cache of this version,
+// or is a cache for another context, shape or matrix; the caller then
+// rebuilds the constants and overwrites the file.
+static bool loadMatMulCache(const string& fname, const EncryptedArray& ea,
+                            const vector<long>& shape, unsigned long digest,
+                            ConstMultiplierCache& c0,
+                            ConstMultiplierCache& c1)
+{
+  const FHEcontext& context = ea.getContext();
+  long phim = context.zMStar.getPhiM();
+  long stride = RowSlab(phim).getStride();
+
+  long len;
+  shared_ptr<const void> mapping;
+  try {
+    mapping = mapBinaryFile(fname, len);
+  }
+  catch (std::runtime_error&) {
+    return false; // no cache yet
+  }
+  const char *base = static_cast<const char*>(mapping.get());
+
+  if (len < mmCachePrefixSize) return false;
+  istringstream prefix(string(base, mmCachePrefixSize));
+  if (readEyeCatcher(prefix, BINIO_EYE_MMCACHE_BEGIN) != 0
+      || read_raw_int(prefix, BINIO_32BIT) != mmCacheVersion)
+    return false;
+  long marker;
+  prefix.read(reinterpret_cast<char*>(&marker), sizeof(long));
+  if (marker != mmCacheMarker) return false;
+  if (read_raw_int(prefix) != stride) return false; // another context
+  long metaSize = read_raw_int(prefix);
+  long dataStart = read_raw_int(prefix);
+  if (metaSize < 0 || dataStart < mmCachePrefixSize + metaSize
+      || dataStart > len || dataStart % BINIO_PAGE_SIZE != 0)
+    return false;
+
+  istringstream str(string(base + mmCachePrefixSize, metaSize));
+  string id = mmCacheIdentity(ea);
+  long idSize = read_raw_int(str);
+  if (!str || idSize < 0 || idSize > metaSize) return false;
+  string storedId(idSize, '\0');
+  str.read(&storedId[0], idSize);
+  if (!str) return false;
+  if (storedId != id) return false; // another context
+
+  vector<long> storedShape;
+  unsigned long storedDigest;
+  read_raw_vector(str, storedShape);
+  str.read(reinterpret_cast<char*>(&storedDigest), sizeof(storedDigest));
+  if (!str || storedShape != shape || storedDigest != digest)
+    return false; // another matrix
+
+  IndexSet allPrimes(0, context.numPrimes()-1);
+  const long* data = reinterpret_cast<const long*>(base + dataStart);
+  long dataLen = (len - dataStart) / sizeof(long);
+
+  ConstMultiplierCache loaded[2];
+  for (ConstMultiplierCache& c: loaded) {
+    long n = read_raw_int(str);
+    if (!str || n < 0 || n > metaSize) return false;
+    c.multiplier.resize(n);
+    for (shared_ptr<ConstMultiplier>& mp: c.multiplier) {
+      long kind = read_raw_int(str, BINIO_32BIT);
+      if (kind == MMCACHE_ZZX) {
+        zzX z;
+        read_ntl_vec_long(str, z);
+        mp = make_shared<ConstMultiplier_zzX>(z);
+      }
+      else if (kind == MMCACHE_DCRT || kind == MMCACHE_CKKS) {
+        long factor = (kind == MMCACHE_CKKS)? read_raw_int(str) : 0;
+        IndexSet s;
+        s.read(str);
+        long offset = read_raw_int(str) / sizeof(long);
+        if (!str || !(s <= allPrimes) || offset < 0
+            || offset + s.card()*stride > dataLen)
+          return false;
+        DoubleCRT dcrt(context, IndexSet::emptySet());
+        dcrt.attachView(s, data + offset, mapping);
+        if (kind == MMCACHE_CKKS)
+          mp = make_shared<ConstMultiplier_CKKS>(std::move(dcrt), factor);
+        else
+          mp = make_shared<ConstMultiplier_DoubleCRT>(dcrt);
+      }
+      else if (kind != MMCACHE_NONE || !str)
+        return false;
+    }
+  }
+  if (readEyeCatcher(str, BINIO_EYE_MMCACHE_END) != 0) return false;
+
+  c0.multiplier.swap(loaded[0].multiplier);
+  c1.multiplier.swap(loaded[1].multiplier);
+  return true;
+}
+
+
+// The entries of a matrix, for its digest in the header of a cache file.
+// Matrices that only define their diagonals are described by them.
+template<class type>
+struct MatMul1D_digest {
+  PA_INJECT(type)
+
+  static
+  void apply(const EncryptedArrayDerived<type>& ea,
+             const MatMul1D& mat_basetype, ostream& str)
+  {
+    RBak bak; bak.save(); ea.getTab().restoreContext();
+    long D = dimSz(ea, mat_basetype.getDim());
+    zzX v;
+    RX entry;
+    if (auto mat = dynamic_cast<const MatMul1D_derived<type>*>(&mat_basetype)) {
+      long nBlocks = mat->multipleTransforms()? ea.size()/D : 1;
+      for (long k: range(nBlocks))
+        for (long i: range(D))
+          for (long j: range(D)) {
+            if (mat->get(entry, i, j, k)) clear(entry);
+            convert(v, entry);
+            write_ntl_vec_long(str, v);
+          }
+    }
+    else {
+      const MatMul1D_partial<type>& mat =
+        dynamic_cast< const MatMul1D_partial<type>& >(mat_basetype);
+      for (long i: range(D)) {
+        mat.processDiagonal(entry, i, ea);
+        convert(v, entry);
+        write_ntl_vec_long(str, v);
+      }
+    }
+  }
+};
+
+template<class type>
+struct BlockMatMul1D_digest {
+  PA_INJECT(type)
+
+  static
+  void apply(const EncryptedArrayDerived<type>& ea,
+             const BlockMatMul1D& mat_basetype, ostream& str)
+  {
+    RBak bak; bak.save(); ea.getTab().restoreContext();
+    long D = dimSz(ea, mat_basetype.getDim());
+    long d = ea.getDegree();
+    auto mat = dynamic_cast<const BlockMatMul1D_derived<type>*>(&mat_basetype);
+    if (mat) {
+      long nBlocks = mat->multipleTransforms()? ea.size()/D : 1;
+      mat_R entry;
+      for (long k: range(nBlocks))
+        for (long i: range(D))
+          for (long j: range(D)) {
+            bool zero = mat->get(entry, i, j, k);
+            write_raw_int(str, zero, BINIO_32BIT);
+            if (zero) continue;
+            for (long r: range(d))
+              for (long c: range(d))
+                write_raw_int(str, rep(entry[r][c]));
+          }
+    }
+    else {
+      const BlockMatMul1D_partial<type>& partial =
+        dynamic_cast< const BlockMatMul1D_partial<type>& >(mat_basetype);
+      vector<RX> diag;
+      zzX v;
+      for (long i: range(D)) {
+        bool zero = partial.processDiagonal(diag, i, ea);
+        write_raw_int(str, zero, BINIO_32BIT);
+        if (zero) continue;
+        for (const RX& poly: diag) {
+          convert(v, poly);
+          write_ntl_vec_long(str, v);
+        }
+      }
+    }
+  }
+};
+
+static unsigned long matMulDigest(const MatMul1D& mat)
+{
+  const EncryptedArray& ea = mat.getEA();
+  ostringstream str;
+  if (ea.getTag() == PA_cx_tag) {
+    long D = dimSz(ea, mat.getDim());
+    auto cx = dynamic_cast<const MatMul1DCx*>(&mat);
+    if (cx) {
+      long nBlocks = cx->multipleTransforms()? ea.size()/D : 1;
+      cx_double entry;
+      for (long k: range(nBlocks))
+        for (long i: range(D))
+          for (long j: range(D)) {
+            if (cx->get(entry, i, j, k)) entry = cx_double(0.0);
+            write_raw_double(str, entry.real());
+            write_raw_double(str, entry.imag());
+          }
+    }
+    else {
+      const MatMul1DCx_partial& partial =
+        dynamic_cast<const MatMul1DCx_partial&>(mat);
+      vector<cx_double> diag;
+      for (long i: range(D)) {
+        if (partial.processDiagonal(diag, i)) continue;
+        write_raw_int(str, i);
+        for (const cx_double& x: diag) {
+          write_raw_double(str, x.real());
+          write_raw_double(str, x.imag());
+        }
+      }
+    }
+  }
+  else
+    ea.dispatch<MatMul1D_digest>(mat, str);
+  string bytes = str.str();
+  return hashBytes(bytes.data(), bytes.size());
+}
+
+static unsigned long matMulDigest(const BlockMatMul1D& mat)
+{
+  ostringstream str;
+  mat.getEA().dispatch<BlockMatMul1D_digest>(mat, str);
+  string bytes = str.str();
+  return hashBytes(bytes.data(), bytes.size());
+}
+
+// Write the constants of c to str, in the usual binary format
+static void writeMultipliers(ostream& str, const ConstMultiplierCache& c)
+{
+  write_raw_int(str, c.multiplier.size());
+  for (const shared_ptr<ConstMultiplier>& mp: c.multiplier) {
+    if (!mp) {
+      write_raw_int(str, MMCACHE_NONE, BINIO_32BIT);
+    }
+    else if (auto z = dynamic_cast<const ConstMultiplier_zzX*>(mp.get())) {
+      write_raw_int(str, MMCACHE_ZZX, BINIO_32BIT);
+      write_ntl_vec_long(str, z->data);
+    }
+    else {
+      auto dc = dynamic_cast<const ConstMultiplier_DoubleCRT*>(mp.get());
+      assert(dc != nullptr);
+      if (auto ck = dynamic_cast<const ConstMultiplier_CKKS*>(dc)) {
+        write_raw_int(str, MMCACHE_CKKS, BINIO_32BIT);
+        write_raw_int(str, ck->factor);
+      }
+      else
+        write_raw_int(str, MMCACHE_DCRT, BINIO_32BIT);
+      dc->data.writePacked(str);
+    }
+  }
+}
+
+static void readMultipliers(istream& str, const FHEcontext& context,
+                            ConstMultiplierCache& c)
+{
+  long n = read_raw_int(str);
+  c.multiplier.clear();
+  c.multiplier.resize(n);
+  for (shared_ptr<ConstMultiplier>& mp: c.multiplier) {
+    long kind = read_raw_int(str, BINIO_32BIT);
+    if (kind == MMCACHE_ZZX) {
+      zzX z;
+      read_ntl_vec_long(str, z);
+      mp = make_shared<ConstMultiplier_zzX>(z);
+    }
+    else if (kind == MMCACHE_DCRT || kind == MMCACHE_CKKS) {
+      long factor = (kind == MMCACHE_CKKS)? read_raw_int(str) : 0;
+      DoubleCRT dcrt(context, IndexSet::emptySet());
+      dcrt.readPacked(str);
+      if (kind == MMCACHE_CKKS)
+        mp = make_shared<ConstMultiplier_CKKS>(std::move(dcrt), factor);
+      else
+        mp = make_shared<ConstMultiplier_DoubleCRT>(std::move(dcrt));
+    }
+    else if (kind != MMCACHE_NONE)
+      Error("readMultipliers: bad constant type");
+  }
+}
 
 
 static inline long dimSz(const EncryptedArray& ea, long dim)
@@ -547,6 +1078,53 @@ template
 void MatMul1D_derived<PA_zz_p>::processDiagonal(RX& poly, long i,
         const EncryptedArrayDerived<PA_zz_p>& ea) const;
 
+template<class type>
+bool MatMul1DSparse_derived<type>::get(RX& out, long i, long j, long k) const
+{
+  long D = dimSz(this->getEA(), this->getDim());
+  return getDiagonalEntry(out, mcMod(j-i, D), j, k);
+}
+
+// explicit instantiations
+template
+bool MatMul1DSparse_derived<PA_GF2>::get(RX& out, long i, long j,
+                                         long k) const;
+
+template
+bool MatMul1DSparse_derived<PA_zz_p>::get(RX& out, long i, long j,
+                                          long k) const;
+
+// Same as processDiagonal1/processDiagonal2 above, with complex entries
+bool MatMul1DCx::processDiagonal(vector<cx_double>& diag, long i) const
+{
+  const EncryptedArray& ea = getEA();
+  long dim = getDim();
+  long D = dimSz(ea, dim);
+  bool multiple = multipleTransforms();
+
+  diag.assign(ea.size(), cx_double(0.0));
+  bool zDiag = true; // is this a zero diagonal?
+  cx_double entry;
+  for (long j: range(ea.size())) {
+    long blockIdx = 0, innerIdx = 0;
+    if (D==1) {
+      if (multiple) blockIdx = j;
+    }
+    else if (multiple)
+      std::tie(blockIdx, innerIdx) = ea.getPAlgebra().breakIndexByDim(j, dim);
+    else
+      innerIdx = ea.coordinate(dim, j);
+
+    // entry [innerIdx-i mod D, innerIdx] in the block of blockIdx
+    if (get(entry, mcMod(innerIdx-i, D), innerIdx, blockIdx)
+        || entry == cx_double(0.0))
+      continue;
+    diag[j] = entry;
+    zDiag = false;
+  }
+  return zDiag;
+}
+
 
 #define ALT_MATMUL (1)
 
@@ -560,7 +1138,7 @@ struct MatMul1DExec_construct {
              const MatMul1D& mat_basetype,
              vector<shared_ptr<ConstMultiplier>>& vec,
              vector<shared_ptr<ConstMultiplier>>& vec1,
-             long g)
+             long g, const vector<long>& diags)
   {
     const MatMul1D_partial<type>& mat =
       dynamic_cast< const MatMul1D_partial<type>& >(mat_basetype);
@@ -575,7 +1153,7 @@ struct MatMul1DExec_construct {
 
       vec.resize(D);
 
-      for (long i: range(D)) {
+      for (long i: diags) {
 	// i == j + g*k
         long j, k;
       
@@ -597,7 +1175,7 @@ struct MatMul1DExec_construct {
       vec.resize(D);
       vec1.resize(D);
 
-      for (long i: range(D)) {
+      for (long i: diags) {
 	// i == j + g*k
         long j, k;
       
@@ -644,6 +1222,50 @@ struct MatMul1DExec_construct {
 };
 
 
+// The CKKS version of MatMul1DExec_construct: the native case, with the
+// diagonals rotated in the slots (rather than as polynomials) before they
+// are encoded
+static void MatMul1DExec_construct_cx(const EncryptedArray& ea_basetype,
+                                      const MatMul1D& mat_basetype,
+                                      vector<shared_ptr<ConstMultiplier>>& vec,
+                                      long g, const vector<long>& diags)
+{
+  const MatMul1DCx_partial& mat =
+    dynamic_cast< const MatMul1DCx_partial& >(mat_basetype);
+  const EncryptedArrayCx& ea = ea_basetype.getCx();
+  const FHEcontext& context = ea.getContext();
+
+  long dim = mat.getDim();
+  long D = dimSz(ea, dim);
+  if (!dimNative(ea, dim))
+    Error("MatMul1DExec: CKKS transformations need a native dimension");
+
+  long precision = mat.getPrecision();
+  long factor = context.alMod.getCx().encodeScalingFactor(precision);
+
+  vec.resize(D);
+  for (long i: diags) {
+    // i == j + g*k
+    long amt = g? -g*(i/g) : 0;
+
+    vector<cx_double> diag, rotated;
+    if (mat.processDiagonal(diag, i)) {
+      vec[i] = nullptr;
+      continue;
+    }
+    if (amt != 0) {
+      ea.EncryptedArrayBase::rotate1D(rotated, diag, dim, amt);
+      diag.swap(rotated);
+    }
+
+    zzX poly;
+    ea.encode(poly, diag, precision);
+    vec[i] = make_shared<ConstMultiplier_CKKS>(
+               DoubleCRT(poly, context, context.fullPrimes()), factor);
+  }
+}
+
+
 #define FHE_BSGS_MUL_THRESH FHE_KEYSWITCH_THRESH
 // uses a BSGS multiplication strategy if sizeof(dim) > FHE_BSGS_MUL_THRESH;
 // otherwise uses the old strategy (but potentially with hoisting)
@@ -655,12 +1277,49 @@ struct MatMul1DExec_construct {
 
 
 
-MatMul1DExec::MatMul1DExec(const MatMul1D& mat, bool _minimal)
-  : ea(mat.getEA()), minimal(_minimal)
+// The giant step size g in [1..g0] for which the nonzero diagonals need
+// the fewest automorphisms, that is baby steps j>0 and giant steps k>0
+// with some i = j+g*k in diags (the largest such g on a tie). g0 is the
+// step size of the key-switching matrices of addBSGS1DMatrices, so that
+// all the baby steps have a matrix of their own.
+static long sparseGiantStepSize(const vector<long>& diags, long D, long g0)
 {
-    FHE_NTIMER_START(MatMul1DExec);
+  long best = g0, bestCost = D+1;
+  for (long g = g0; g >= 1; g--) {
+    vector<bool> baby(g, false), giant(divc(D, g), false);
+    for (long i: diags) {
+      baby[i % g] = true;
+      giant[i / g] = true;
+    }
+    long cost = 0;
+    for (long j: range(1, g)) cost += baby[j];
+    for (long k: range(1, lsize(giant))) cost += giant[k];
+    if (cost < bestCost) {
+      best = g;
+      bestCost = cost;
+    }
+  }
+  return best;
+}
 
-    dim = mat.getDim();
+// The diagonals of mat that may be nonzero, all D of them unless the
+// matrix lists them. Returns true if it does.
+static bool getDiagonalList(vector<long>& diags, const MatMul1D& mat, long D)
+{
+  if (mat.getNonzeroDiagonals(diags)) {
+    for (long i: range(lsize(diags)))
+      if (diags[i] < 0 || diags[i] >= D || (i > 0 && diags[i] <= diags[i-1]))
+        Error("MatMul1DExec: the diagonals are not increasing in [0,D)");
+    return true;
+  }
+  diags.resize(D);
+  for (long i: range(D)) diags[i] = i;
+  return false;
+}
+
+void MatMul1DExec::initShape(long _dim, const vector<long>* diags)
+{
+    dim = _dim;
     assert(dim >= 0 && dim <= ea.dimension());
     D = dimSz(ea, dim);
     native = dimNative(ea, dim);
@@ -673,8 +1332,90 @@ MatMul1DExec::MatMul1DExec(const MatMul1D& mat, bool _minimal)
     else
        g = KSGiantStepSize(D); // use BSGS
 
-    ea.dispatch<MatMul1DExec_construct>(mat, cache.multiplier, 
-                                        cache1.multiplier, g);
+    // The iterative (minimal) strategy computes all the baby steps in any
+    // case, so only the others gain from a split that fits the diagonals
+    if (g != 0 && diags != nullptr && !minimal)
+       g = sparseGiantStepSize(*diags, D, g);
+}
+
+MatMul1DExec::MatMul1DExec(const MatMul1D& mat, bool _minimal)
+  : ea(mat.getEA()), minimal(_minimal)
+{
+    FHE_NTIMER_START(MatMul1DExec);
+
+    vector<long> diags;
+    bool sparse = getDiagonalList(diags, mat, dimSz(ea, mat.getDim()));
+    initShape(mat.getDim(), sparse? &diags : nullptr);
+    if (ea.getTag() == PA_cx_tag)
+      MatMul1DExec_construct_cx(ea, mat, cache.multiplier, g, diags);
+    else
+      ea.dispatch<MatMul1DExec_construct>(mat, cache.multiplier, 
+                                          cache1.multiplier, g, diags);
+}
+
+MatMul1DExec::MatMul1DExec(const MatMul1D& mat, bool _minimal,
+                           const string& cacheFile, bool build_cache)
+  : ea(mat.getEA()), minimal(_minimal)
+{
+    FHE_NTIMER_START(MatMul1DExec);
+
+    vector<long> diags;
+    bool sparse = getDiagonalList(diags, mat, dimSz(ea, mat.getDim()));
+    initShape(mat.getDim(), sparse? &diags : nullptr);
+    vector<long> shape = {1, dim, D, native, g, build_cache};
+    if (ea.getTag() == PA_cx_tag)
+      shape.push_back(dynamic_cast<const MatMul1DCx_partial&>(mat)
+                      .getPrecision());
+    unsigned long digest = matMulDigest(mat);
+    if (loadMatMulCache(cacheFile, ea, shape, digest, cache, cache1)) return;
+
+    if (ea.getTag() == PA_cx_tag)
+      MatMul1DExec_construct_cx(ea, mat, cache.multiplier, g, diags);
+    else
+      ea.dispatch<MatMul1DExec_construct>(mat, cache.multiplier, 
+                                          cache1.multiplier, g, diags);
+    if (build_cache) upgrade();
+    saveMatMulCache(cacheFile, ea, shape, digest, cache, cache1);
+}
+
+MatMul1DExec::MatMul1DExec(const EncryptedArray& _ea, istream& str)
+  : ea(_ea)
+{
+    // Not asserts: the reads must also be done with NDEBUG
+    if (readEyeCatcher(str, BINIO_EYE_MATMUL_BEGIN) != 0
+        || read_raw_int(str) != 1) // a 1D transformation
+      Error("MatMul1DExec: bad input stream");
+
+    dim = read_raw_int(str);
+    minimal = read_raw_int(str);
+    g = read_raw_int(str);
+    if (dim < 0 || dim > ea.dimension())
+      Error("MatMul1DExec: bad dimension in input stream");
+    D = dimSz(ea, dim);
+    native = dimNative(ea, dim);
+
+    readMultipliers(str, ea.getContext(), cache);
+    readMultipliers(str, ea.getContext(), cache1);
+    if (readEyeCatcher(str, BINIO_EYE_MATMUL_END) != 0)
+      Error("MatMul1DExec: bad input stream");
+}
+
+long MatMul1DExec::memoryUsage() const
+{
+  return sizeof(*this) - 2*sizeof(ConstMultiplierCache)
+         + cache.memoryUsage() + cache1.memoryUsage();
+}
+
+void MatMul1DExec::write(ostream& str) const
+{
+    writeEyeCatcher(str, BINIO_EYE_MATMUL_BEGIN);
+    write_raw_int(str, 1);
+    write_raw_int(str, dim);
+    write_raw_int(str, minimal);
+    write_raw_int(str, g);
+    writeMultipliers(str, cache);
+    writeMultipliers(str, cache1);
+    writeEyeCatcher(str, BINIO_EYE_MATMUL_END);
 }
 
 
@@ -721,8 +1462,10 @@ So putting it all together
 
 ***************************************************************************/
 
+// v[j] = rot^j(ctxt) for j in [0..v.size()). If needed is given, v[j] is
+// only computed where needed[j], and is left null elsewhere.
 void GenBabySteps(vector<shared_ptr<Ctxt>>& v, const Ctxt& ctxt, long dim, 
-                  bool clean)
+                  bool clean, const vector<bool>* needed=nullptr)
 {
   long n = v.size();
   assert(n > 0);
@@ -739,28 +1482,40 @@ void GenBabySteps(vector<shared_ptr<Ctxt>>& v, const Ctxt& ctxt, long dim,
       ctxt.getPubKey().getKSStrategy(dim) != FHE_KSS_UNKNOWN) {
     BasicAutomorphPrecon precon(ctxt);
 
-    NTL_EXEC_RANGE(n, first, last)
+    FHE_EXEC_RANGE(n, first, last)
       for (long j: range(first, last)) {
+	 if (needed && !(*needed)[j]) continue;
 	 v[j] = precon.automorph(zMStar.genToPow(dim, j));
 	 if (clean) v[j]->cleanUp();
       }
-    NTL_EXEC_RANGE_END
+    FHE_EXEC_RANGE_END
   }
   else {
     Ctxt ctxt0(ctxt);
     ctxt0.cleanUp();
  
-    NTL_EXEC_RANGE(n, first, last)
+    FHE_EXEC_RANGE(n, first, last)
       for (long j: range(first, last)) {
+	 if (needed && !(*needed)[j]) continue;
 	 v[j] = make_shared<Ctxt>(ctxt0);
 	 v[j]->smartAutomorph(zMStar.genToPow(dim, j));
 	 if (clean) v[j]->cleanUp();
       }
-    NTL_EXEC_RANGE_END
+    FHE_EXEC_RANGE_END
   }
   
 }
 
+// Which of the g baby steps some nonzero constant in c multiplies
+static vector<bool>
+usedBabySteps(const ConstMultiplierCache& c, long g)
+{
+  vector<bool> used(g, false);
+  for (long i: range(lsize(c.multiplier)))
+    if (c.multiplier[i]) used[i % g] = true;
+  return used;
+}
+
 void
 MatMul1DExec::mul(Ctxt& ctxt) const
 {
@@ -798,11 +1553,9 @@ MatMul1DExec::mul(Ctxt& ctxt) const
                  sum.cleanUp();
                }
 
-               for (long j: range(g)) {
-		  long i = j + g*k;
-		  if (i >= D) break;
-		  MulAdd(sum, cache.multiplier[i], baby_steps[j]);
-               }
+               ParallelAccumulate(sum, min(g, D-g*k), [&](Ctxt& part, long j) {
+		  MulAdd(part, cache.multiplier[j + g*k], baby_steps[j]);
+               });
             }
 
             ctxt = sum;
@@ -812,15 +1565,16 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 
 	    long h = divc(D, g);
 	    vector<shared_ptr<Ctxt>> baby_steps(g);
-	    GenBabySteps(baby_steps, ctxt, dim, true);
+	    vector<bool> used = usedBabySteps(cache, g);
+	    GenBabySteps(baby_steps, ctxt, dim, true, &used);
 
-	    PartitionInfo pinfo(h);
+	    PartitionInfo pinfo(h, fheAvailableThreads());
 	    long cnt = pinfo.NumIntervals();
 
 	    vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	    // parallel for loop: k in [0..h)
-	    NTL_EXEC_INDEX(cnt, index)
+	    FHE_EXEC_INDEX(cnt, index)
 	       long first, last;
 	       pinfo.interval(first, last, index);
 
@@ -830,13 +1584,15 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 		  for (long j: range(g)) {
 		     long i = j + g*k;
 		     if (i >= D) break;
-		     MulAdd(acc_inner, cache.multiplier[i], *baby_steps[j]); 
+		     if (baby_steps[j])
+		       MulAdd(acc_inner, cache.multiplier[i], *baby_steps[j]); 
 		  }
 
+		  if (acc_inner.isEmpty()) continue; // no giant step k
 		  if (k > 0) acc_inner.smartAutomorph(zMStar.genToPow(dim, g*k));
 		  acc[index] += acc_inner;
 	       }
-	    NTL_EXEC_INDEX_END
+	    FHE_EXEC_INDEX_END
 
 	    ctxt = acc[0];
 	    for (long i: range(1, cnt))
@@ -873,12 +1629,11 @@ MatMul1DExec::mul(Ctxt& ctxt) const
                  sum.cleanUp();
                }
 
-               for (long j: range(g)) {
+               ParallelAccumulate(sum, min(g, D-g*k), [&](Ctxt& part, long j) {
 		  long i = j + g*k;
-		  if (i >= D) break;
-		  MulAdd(sum, cache.multiplier[i], baby_steps[j]);
-		  MulAdd(sum, cache1.multiplier[i], baby_steps1[j]);
-               }
+		  MulAdd(part, cache.multiplier[i], baby_steps[j]);
+		  MulAdd(part, cache1.multiplier[i], baby_steps1[j]);
+               });
             }
             ctxt = sum;
          }
@@ -887,19 +1642,21 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 	    vector<shared_ptr<Ctxt>> baby_steps(g);
 	    vector<shared_ptr<Ctxt>> baby_steps1(g);
 
-	    GenBabySteps(baby_steps, ctxt, dim, false);
+	    vector<bool> used = usedBabySteps(cache, g);
+	    GenBabySteps(baby_steps, ctxt, dim, false, &used);
 
+	    vector<bool> used1 = usedBabySteps(cache1, g);
 	    Ctxt ctxt1(ctxt);
 	    ctxt1.smartAutomorph(zMStar.genToPow(dim, -D));
-	    GenBabySteps(baby_steps1, ctxt1, dim, false);
+	    GenBabySteps(baby_steps1, ctxt1, dim, false, &used1);
 
-	    PartitionInfo pinfo(h);
+	    PartitionInfo pinfo(h, fheAvailableThreads());
 	    long cnt = pinfo.NumIntervals();
 
 	    vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	    // parallel for loop: k in [0..h)
-	    NTL_EXEC_INDEX(cnt, index)
+	    FHE_EXEC_INDEX(cnt, index)
 
 	       long first, last;
 	       pinfo.interval(first, last, index);
@@ -910,10 +1667,13 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 		  for (long j: range(g)) {
 		     long i = j + g*k;
 		     if (i >= D) break;
-		     MulAdd(acc_inner, cache.multiplier[i], *baby_steps[j]);
-		     MulAdd(acc_inner, cache1.multiplier[i], *baby_steps1[j]);
+		     if (baby_steps[j])
+		       MulAdd(acc_inner, cache.multiplier[i], *baby_steps[j]);
+		     if (baby_steps1[j])
+		       MulAdd(acc_inner, cache1.multiplier[i], *baby_steps1[j]);
 		  }
 
+		  if (acc_inner.isEmpty()) continue; // no giant step k
 		  if (k > 0) {
 		     acc_inner.smartAutomorph(zMStar.genToPow(dim, g*k));
 		  }
@@ -921,7 +1681,7 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 		  acc[index] += acc_inner;
 	       }
 
-	    NTL_EXEC_INDEX_END
+	    FHE_EXEC_INDEX_END
 
 	    for (long i: range(1, cnt)) acc[0] += acc[i];
 	    ctxt = acc[0];
@@ -948,12 +1708,12 @@ MatMul1DExec::mul(Ctxt& ctxt) const
                  sum1.cleanUp();
                }
 
-               for (long j: range(g)) {
-		  long i = j + g*k;
-		  if (i >= D) break;
-		  MulAdd(sum, cache.multiplier[i], baby_steps[j]);
-		  MulAdd(sum1, cache1.multiplier[i], baby_steps[j]);
-               }
+               ParallelAccumulate(sum, min(g, D-g*k), [&](Ctxt& part, long j) {
+		  MulAdd(part, cache.multiplier[j + g*k], baby_steps[j]);
+               });
+               ParallelAccumulate(sum1, min(g, D-g*k), [&](Ctxt& part, long j) {
+		  MulAdd(part, cache1.multiplier[j + g*k], baby_steps[j]);
+               });
             }
 	    sum1.smartAutomorph(zMStar.genToPow(dim, -D));
             sum += sum1;
@@ -964,14 +1724,14 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 	    vector<shared_ptr<Ctxt>> baby_steps(g);
 	    GenBabySteps(baby_steps, ctxt, dim, true);
 
-	    PartitionInfo pinfo(h);
+	    PartitionInfo pinfo(h, fheAvailableThreads());
 	    long cnt = pinfo.NumIntervals();
 
 	    vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
 	    vector<Ctxt> acc1(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	    // parallel for loop: k in [0..h)
-	    NTL_EXEC_INDEX(cnt, index)
+	    FHE_EXEC_INDEX(cnt, index)
 
 	       long first, last;
 	       pinfo.interval(first, last, index);
@@ -995,7 +1755,7 @@ MatMul1DExec::mul(Ctxt& ctxt) const
 		  acc[index] += acc_inner;
 		  acc1[index] += acc_inner1;
 	       }
-	    NTL_EXEC_INDEX_END
+	    FHE_EXEC_INDEX_END
 
 	    for (long i: range(1, cnt)) acc[0] += acc[i];
 	    for (long i: range(1, cnt)) acc1[0] += acc1[i];
@@ -1012,13 +1772,13 @@ MatMul1DExec::mul(Ctxt& ctxt) const
          shared_ptr<GeneralAutomorphPrecon> precon =
            buildGeneralAutomorphPrecon(ctxt, dim, ea);
 
-	 PartitionInfo pinfo(D);
+	 PartitionInfo pinfo(D, fheAvailableThreads());
 	 long cnt = pinfo.NumIntervals();
 
 	 vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	 // parallel for loop: i in [0..D)
-	 NTL_EXEC_INDEX(cnt, index)
+	 FHE_EXEC_INDEX(cnt, index)
 	    long first, last;
 	    pinfo.interval(first, last, index);
 
@@ -1028,7 +1788,7 @@ MatMul1DExec::mul(Ctxt& ctxt) const
                   DestMulAdd(acc[index], cache.multiplier[i], *tmp);
 	       }
 	    }
-	 NTL_EXEC_INDEX_END
+	 FHE_EXEC_INDEX_END
 
 	 ctxt = acc[0];
 	 for (long i: range(1, cnt))
@@ -1038,14 +1798,14 @@ MatMul1DExec::mul(Ctxt& ctxt) const
          shared_ptr<GeneralAutomorphPrecon> precon =
            buildGeneralAutomorphPrecon(ctxt, dim, ea);
 
-	 PartitionInfo pinfo(D);
+	 PartitionInfo pinfo(D, fheAvailableThreads());
 	 long cnt = pinfo.NumIntervals();
 
 	 vector<Ctxt> acc(cnt, Ctxt(ZeroCtxtLike, ctxt));
 	 vector<Ctxt> acc1(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	 // parallel for loop: i in [0..D)
-	 NTL_EXEC_INDEX(cnt, index)
+	 FHE_EXEC_INDEX(cnt, index)
 	    long first, last;
 	    pinfo.interval(first, last, index);
 
@@ -1056,7 +1816,7 @@ MatMul1DExec::mul(Ctxt& ctxt) const
                   DestMulAdd(acc1[index], cache1.multiplier[i], *tmp);
 	       }
 	    }
-	 NTL_EXEC_INDEX_END
+	 FHE_EXEC_INDEX_END
 
 	 for (long i: range(1, cnt)) acc[0] += acc[i];
 	 for (long i: range(1, cnt)) acc1[0] += acc1[i];
@@ -1431,13 +2191,9 @@ struct BlockMatMul1DExec_construct {
 };
 
 
-BlockMatMul1DExec::BlockMatMul1DExec(
-  const BlockMatMul1D& mat, bool minimal)
-  : ea(mat.getEA())
+void BlockMatMul1DExec::initShape(long _dim)
 {
-    FHE_TIMER_START;
-
-    dim = mat.getDim();
+    dim = _dim;
     assert(dim >= 0 && dim <= ea.dimension());
     D = dimSz(ea, dim);
     d = ea.getDegree();
@@ -1447,9 +2203,76 @@ BlockMatMul1DExec::BlockMatMul1DExec(
       strategy = +1;
     else
       strategy = -1;
+}
+
+BlockMatMul1DExec::BlockMatMul1DExec(
+  const BlockMatMul1D& mat, bool _minimal)
+  : ea(mat.getEA()), minimal(_minimal)
+{
+    FHE_TIMER_START;
+
+    initShape(mat.getDim());
+    ea.dispatch<BlockMatMul1DExec_construct>(mat, cache.multiplier, 
+                                        cache1.multiplier, strategy);
+}
+
+BlockMatMul1DExec::BlockMatMul1DExec(
+  const BlockMatMul1D& mat, bool _minimal,
+  const string& cacheFile, bool build_cache)
+  : ea(mat.getEA()), minimal(_minimal)
+{
+    FHE_TIMER_START;
+
+    initShape(mat.getDim());
+    vector<long> shape = {2, dim, D, d, native, strategy, build_cache};
+    unsigned long digest = matMulDigest(mat);
+    if (loadMatMulCache(cacheFile, ea, shape, digest, cache, cache1)) return;
 
     ea.dispatch<BlockMatMul1DExec_construct>(mat, cache.multiplier, 
                                         cache1.multiplier, strategy);
+    if (build_cache) upgrade();
+    saveMatMulCache(cacheFile, ea, shape, digest, cache, cache1);
+}
+
+BlockMatMul1DExec::BlockMatMul1DExec(const EncryptedArray& _ea, istream& str)
+  : ea(_ea)
+{
+    // Not asserts: the reads must also be done with NDEBUG
+    if (readEyeCatcher(str, BINIO_EYE_MATMUL_BEGIN) != 0
+        || read_raw_int(str) != 2) // a block 1D transformation
+      Error("BlockMatMul1DExec: bad input stream");
+
+    dim = read_raw_int(str);
+    minimal = read_raw_int(str);
+    strategy = read_raw_int(str);
+    if (dim < 0 || dim > ea.dimension())
+      Error("BlockMatMul1DExec: bad dimension in input stream");
+    D = dimSz(ea, dim);
+    d = ea.getDegree();
+    native = dimNative(ea, dim);
+
+    readMultipliers(str, ea.getContext(), cache);
+    readMultipliers(str, ea.getContext(), cache1);
+    if (readEyeCatcher(str, BINIO_EYE_MATMUL_END) != 0)
+      Error("BlockMatMul1DExec: bad input stream");
+}
+
+long BlockMatMul1DExec::memoryUsage() const
+{
+  return sizeof(*this) - 2*sizeof(ConstMultiplierCache)
+         + cache.memoryUsage() + cache1.memoryUsage();
+}
+
+void BlockMatMul1DExec::write(ostream& str) const
+{
+    writeEyeCatcher(str, BINIO_EYE_MATMUL_BEGIN);
+    write_raw_int(str, 2);
+    write_raw_int(str, dim);
+    write_raw_int(str, minimal);
+    write_raw_int(str, strategy);
+    writeMultipliers(str, cache);
+    writeMultipliers(str, cache1);
+    writeEyeCatcher(str, BINIO_EYE_MATMUL_END);
 }
 
 
@@ -1533,7 +2356,7 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
    if (ctxt.getPubKey().getKSStrategy(dim1) == FHE_KSS_MIN)
       iterative1 = true;
    if (ctxt.getPubKey().getKSStrategy(dim1) != FHE_KSS_FULL && 
-       AvailableThreads() == 1)
+       fheAvailableThreads() == 1)
       iterative1 = true;
 
    if (native) {
@@ -1548,9 +2371,10 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
                sh_ctxt.smartAutomorph(zMStar.genToPow(dim0, 1));
                sh_ctxt.cleanUp();
             }
-	    for (long j: range(d1)) {
-	       MulAdd(acc[j], cache.multiplier[i*d1+j], sh_ctxt);
-	    }
+	    FHE_EXEC_RANGE(d1, first, last)
+	       for (long j: range(first, last))
+	          MulAdd(acc[j], cache.multiplier[i*d1+j], sh_ctxt);
+	    FHE_EXEC_RANGE_END
          }
       }
       else {
@@ -1559,7 +2383,7 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 		  buildGeneralAutomorphPrecon(ctxt, dim0, ea);
 
 	 long par_buf_sz = 1;
-	 if (AvailableThreads() > 1) 
+	 if (fheAvailableThreads() > 1) 
 	    par_buf_sz = min(d0, par_buf_max);
 
 	 vector<shared_ptr<Ctxt>> par_buf(par_buf_sz);
@@ -1570,16 +2394,16 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 	    // for i in [first_i..last_i), generate automorphosm i and store
 	    // in par_buf[i-first_i]
 
-	    NTL_EXEC_RANGE(last_i-first_i, first, last) 
+	    FHE_EXEC_RANGE(last_i-first_i, first, last) 
      
 	       for (long idx: range(first, last)) {
 		 long i = idx + first_i;
 		 par_buf[idx] = precon->automorph(i);
 	       }
 
-	    NTL_EXEC_RANGE_END
+	    FHE_EXEC_RANGE_END
 
-	    NTL_EXEC_RANGE(d1, first, last)
+	    FHE_EXEC_RANGE(d1, first, last)
 
 	       for (long j: range(first, last)) {
 		  for (long i: range(first_i, last_i)) {
@@ -1587,7 +2411,7 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 		  }
 	       }
 
-	    NTL_EXEC_RANGE_END
+	    FHE_EXEC_RANGE_END
 	 }
 
       }
@@ -1606,20 +2430,20 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
       }
       else {
 
-	 PartitionInfo pinfo(d1);
+	 PartitionInfo pinfo(d1, fheAvailableThreads());
 	 long cnt = pinfo.NumIntervals();
 
 	 vector<Ctxt> sum(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	 // for j in [0..d1)
-	 NTL_EXEC_INDEX(cnt, index)
+	 FHE_EXEC_INDEX(cnt, index)
 	    long first, last;
 	    pinfo.interval(first, last, index);
 	    for (long j: range(first, last)) {
 	       if (j > 0) acc[j].smartAutomorph(zMStar.genToPow(dim1, j));
 	       sum[index] += acc[j];
 	    }
-	 NTL_EXEC_INDEX_END
+	 FHE_EXEC_INDEX_END
 
 	 ctxt = sum[0];
 	 for (long i: range(1, cnt)) ctxt += sum[i];
@@ -1638,10 +2462,12 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
                sh_ctxt.smartAutomorph(zMStar.genToPow(dim0, 1));
                sh_ctxt.cleanUp();
             }
-	    for (long j: range(d1)) {
-	       MulAdd(acc[j], cache.multiplier[i*d1+j], sh_ctxt);
-	       MulAdd(acc1[j], cache1.multiplier[i*d1+j], sh_ctxt);
-	    }
+	    FHE_EXEC_RANGE(d1, first, last)
+	       for (long j: range(first, last)) {
+	          MulAdd(acc[j], cache.multiplier[i*d1+j], sh_ctxt);
+	          MulAdd(acc1[j], cache1.multiplier[i*d1+j], sh_ctxt);
+	       }
+	    FHE_EXEC_RANGE_END
          }
       }
       else {
@@ -1650,7 +2476,7 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 		  buildGeneralAutomorphPrecon(ctxt, dim0, ea);
 
 	 long par_buf_sz = 1;
-	 if (AvailableThreads() > 1) 
+	 if (fheAvailableThreads() > 1) 
 	    par_buf_sz = min(d0, par_buf_max);
 
 	 vector<shared_ptr<Ctxt>> par_buf(par_buf_sz);
@@ -1661,16 +2487,16 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 	    // for i in [first_i..last_i), generate automorphosm i and store
 	    // in par_buf[i-first_i]
 
-	    NTL_EXEC_RANGE(last_i-first_i, first, last) 
+	    FHE_EXEC_RANGE(last_i-first_i, first, last) 
      
 	       for (long idx: range(first, last)) {
 		 long i = idx + first_i;
 		 par_buf[idx] = precon->automorph(i);
 	       }
 
-	    NTL_EXEC_RANGE_END
+	    FHE_EXEC_RANGE_END
 
-	    NTL_EXEC_RANGE(d1, first, last)
+	    FHE_EXEC_RANGE(d1, first, last)
 
 	       for (long j: range(first, last)) {
 		  for (long i: range(first_i, last_i)) {
@@ -1679,7 +2505,7 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 		  }
 	       }
 
-	    NTL_EXEC_RANGE_END
+	    FHE_EXEC_RANGE_END
 	 }
       }
 
@@ -1703,14 +2529,14 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
       }
       else {
 
-	 PartitionInfo pinfo(d1);
+	 PartitionInfo pinfo(d1, fheAvailableThreads());
 	 long cnt = pinfo.NumIntervals();
 
 	 vector<Ctxt> sum(cnt, Ctxt(ZeroCtxtLike, ctxt));
 	 vector<Ctxt> sum1(cnt, Ctxt(ZeroCtxtLike, ctxt));
 
 	 // for j in [0..d1)
-	 NTL_EXEC_INDEX(cnt, index)
+	 FHE_EXEC_INDEX(cnt, index)
 	    long first, last;
 	    pinfo.interval(first, last, index);
 	    for (long j: range(first, last)) {
@@ -1721,7 +2547,7 @@ BlockMatMul1DExec::mul(Ctxt& ctxt) const
 	       sum[index] += acc[j];
 	       sum1[index] += acc1[j];
 	    }
-	 NTL_EXEC_INDEX_END
+	 FHE_EXEC_INDEX_END
 
 	 for (long i: range(1, cnt)) sum[0] += sum[i];
 	 for (long i: range(1, cnt)) sum1[0] += sum1[i];
@@ -1885,13 +2711,132 @@ struct MatMulFullExec_construct {
 
 
 
+// The CKKS versions of MatMulFullHelper and MatMulFullExec_construct. All
+// the dimensions of EncryptedArrayCx are native, so there are no masks.
+class MatMulFullHelperCx : public MatMul1DCx_partial {
+public:
+  const MatMulFullCx& mat;
+  vector<long> init_idxes;
+  long dim;
+
+  MatMulFullHelperCx(const MatMulFullCx& _mat,
+                     const vector<long>& _init_idxes, long _dim)
+    : mat(_mat), init_idxes(_init_idxes), dim(_dim) { }
+
+  bool
+  processDiagonal(vector<cx_double>& diag, long offset) const override
+  {
+    const EncryptedArray& ea = mat.getEA();
+    vector<long> idxes;
+    ea.rotate1D(idxes, init_idxes, dim, offset);
+
+    diag.assign(ea.size(), cx_double(0.0));
+    bool zDiag = true; // is this a zero diagonal
+    for (long j: range(ea.size())) {
+      cx_double val;
+      if (!mat.get(val, idxes[j], j) && val != cx_double(0.0)) {
+        diag[j] = val;
+        zDiag = false;
+      }
+    }
+    return zDiag;
+  }
+
+  const EncryptedArray& getEA() const override { return mat.getEA(); }
+  long getDim() const override { return dim; }
+  long getPrecision() const override { return mat.getPrecision(); }
+};
+
+static long rec_mul_construct_cx(long dim, long idx, const vector<long>& idxes,
+                                 vector<MatMul1DExec>& transforms,
+                                 bool minimal, const vector<long>& dims,
+                                 const MatMulFullCx& mat)
+{
+  const EncryptedArray& ea = mat.getEA();
+  if (dim >= ea.dimension()-1) {
+    // Last dimension (recursion edge condition)
+    MatMulFullHelperCx helper(mat, idxes, dims[dim]);
+    transforms.emplace_back(helper, minimal);
+    return idx+1;
+  }
+
+  for (long offset: range(ea.sizeOfDimension(dims[dim]))) {
+    vector<long> idxes1;
+    ea.rotate1D(idxes1, idxes, dims[dim], offset);
+    idx = rec_mul_construct_cx(dim+1, idx, idxes1, transforms, minimal,
+                               dims, mat);
+  }
+  return idx;
+}
+
 MatMulFullExec::MatMulFullExec(const MatMulFull& mat, bool _minimal)
   : ea(mat.getEA()), minimal(_minimal)
 {
   FHE_NTIMER_START(MatMulFullExec);
 
-  ea.dispatch<MatMulFullExec_construct>(ea, mat, transforms, minimal,
-                                        dims);
+  if (ea.getTag() == PA_cx_tag) {
+    long ndims = ea.dimension();
+    dims.resize(ndims);
+    for (long i: range(ndims)) {
+      if (!ea.nativeDimension(i))
+        Error("MatMulFullExec: CKKS transformations need native dimensions");
+      dims[i] = i;
+    }
+    // small dimensions first, as in MatMulFullExec_construct
+    sort(dims.begin(), dims.end(), [&](long i, long j) {
+      return ea.sizeOfDimension(i) < ea.sizeOfDimension(j);
+    });
+
+    vector<long> idxes(ea.size());
+    for (long i: range(ea.size())) idxes[i] = i;
+    rec_mul_construct_cx(0, 0, idxes, transforms, minimal, dims,
+                         dynamic_cast<const MatMulFullCx&>(mat));
+  }
+  else
+    ea.dispatch<MatMulFullExec_construct>(ea, mat, transforms, minimal,
+                                          dims);
+}
+
+MatMulFullExec::MatMulFullExec(const EncryptedArray& _ea, istream& str)
+  : ea(_ea)
+{
+  if (readEyeCatcher(str, BINIO_EYE_MATMUL_BEGIN) != 0
+      || read_raw_int(str) != 3) // a full transformation
+    Error("MatMulFullExec: bad input stream");
+
+  minimal = read_raw_int(str);
+  dims.resize(read_raw_int(str));
+  for (long& d: dims) {
+    d = read_raw_int(str);
+    if (d < 0 || d >= ea.dimension())
+      Error("MatMulFullExec: bad dimension in input stream");
+  }
+  long n = read_raw_int(str);
+  transforms.reserve(n);
+  while (lsize(transforms) < n) transforms.emplace_back(ea, str);
+  if (readEyeCatcher(str, BINIO_EYE_MATMUL_END) != 0)
+    Error("MatMulFullExec: bad input stream");
+}
+
+long MatMulFullExec::memoryUsage() const
+{
+  long n = sizeof(*this) + memBytes(dims)
+           + (transforms.capacity() - transforms.size())
+             * sizeof(MatMul1DExec);
+  for (const MatMul1DExec& t: transforms) n += t.memoryUsage();
+  return n;
+}
+
+void MatMulFullExec::write(ostream& str) const
+{
+  writeEyeCatcher(str, BINIO_EYE_MATMUL_BEGIN);
+  write_raw_int(str, 3);
+  write_raw_int(str, minimal);
+  write_raw_int(str, dims.size());
+  for (long d: dims) write_raw_int(str, d);
+  write_raw_int(str, transforms.size());
+  for (const MatMul1DExec& t: transforms) t.write(str);
+  writeEyeCatcher(str, BINIO_EYE_MATMUL_END);
 }
 
 long
@@ -1918,15 +2863,20 @@ MatMulFullExec::rec_mul(Ctxt& acc, const Ctxt& ctxt, long dim_idx, long idx) con
       iterative = true;
 
     if (!iterative)  {
+      // The recursive calls for different i's are independent, so they
+      // run in parallel. Each one uses the next subtreeSize transforms.
+      long subtreeSize = 1;
+      for (long k: range(dim_idx+1, ea.dimension()-1))
+        subtreeSize *= ea.sizeOfDimension(dims[k]);
 
       if (native) {
 	shared_ptr<GeneralAutomorphPrecon> precon =
 	  buildGeneralAutomorphPrecon(ctxt, dim, ea);
 
-	for (long i: range(sdim)) {
+	ParallelAccumulate(acc, sdim, [&](Ctxt& sum, long i) {
 	  shared_ptr<Ctxt> tmp = precon->automorph(i);
-	  idx = rec_mul(acc, *tmp, dim_idx+1, idx);
-	}
+	  rec_mul(sum, *tmp, dim_idx+1, idx + i*subtreeSize);
+	});
       }
       else {
 	Ctxt ctxt1 = ctxt;
@@ -1936,9 +2886,9 @@ MatMulFullExec::rec_mul(Ctxt& acc, const Ctxt& ctxt, long dim_idx, long idx) con
 	shared_ptr<GeneralAutomorphPrecon> precon1 =
 	  buildGeneralAutomorphPrecon(ctxt1, dim, ea);
 
-	for (long i: range(sdim)) {
+	ParallelAccumulate(acc, sdim, [&](Ctxt& sum, long i) {
 	  if (i == 0) 
-	     idx = rec_mul(acc, ctxt, dim_idx+1, idx);
+	     rec_mul(sum, ctxt, dim_idx+1, idx);
 	  else {
 	    shared_ptr<Ctxt> tmp = precon->automorph(i);
 	    shared_ptr<Ctxt> tmp1 = precon1->automorph(i);
@@ -1954,11 +2904,12 @@ MatMulFullExec::rec_mul(Ctxt& acc, const Ctxt& ctxt, long dim_idx, long idx) con
 	    tmp1->multByConstant(m1);
 	    *tmp -= *tmp1;
 
-	    idx = rec_mul(acc, *tmp, dim_idx+1, idx);
+	    rec_mul(sum, *tmp, dim_idx+1, idx + i*subtreeSize);
 	  }
-	}
+	});
 	
       }
+      idx += sdim*subtreeSize;
 
     }
     else {
@@ -2225,6 +3176,49 @@ BlockMatMulFullExec::BlockMatMulFullExec(
                                         dims);
 }
 
+BlockMatMulFullExec::BlockMatMulFullExec(const EncryptedArray& _ea,
+                                         istream& str)
+  : ea(_ea)
+{
+  if (readEyeCatcher(str, BINIO_EYE_MATMUL_BEGIN) != 0
+      || read_raw_int(str) != 4) // a full block transformation
+    Error("BlockMatMulFullExec: bad input stream");
+
+  minimal = read_raw_int(str);
+  dims.resize(read_raw_int(str));
+  for (long& d: dims) {
+    d = read_raw_int(str);
+    if (d < 0 || d >= ea.dimension())
+      Error("BlockMatMulFullExec: bad dimension in input stream");
+  }
+  long n = read_raw_int(str);
+  transforms.reserve(n);
+  while (lsize(transforms) < n) transforms.emplace_back(ea, str);
+  if (readEyeCatcher(str, BINIO_EYE_MATMUL_END) != 0)
+    Error("BlockMatMulFullExec: bad input stream");
+}
+
+long BlockMatMulFullExec::memoryUsage() const
+{
+  long n = sizeof(*this) + memBytes(dims)
+           + (transforms.capacity() - transforms.size())
+             * sizeof(BlockMatMul1DExec);
+  for (const BlockMatMul1DExec& t: transforms) n += t.memoryUsage();
+  return n;
+}
+
+void BlockMatMulFullExec::write(ostream& str) const
+{
+  writeEyeCatcher(str, BINIO_EYE_MATMUL_BEGIN);
+  write_raw_int(str, 4);
+  write_raw_int(str, minimal);
+  write_raw_int(str, dims.size());
+  for (long d: dims) write_raw_int(str, d);
+  write_raw_int(str, transforms.size());
+  for (const BlockMatMul1DExec& t: transforms) t.write(str);
+  writeEyeCatcher(str, BINIO_EYE_MATMUL_END);
+}
+
 long
 BlockMatMulFullExec::rec_mul(Ctxt& acc, const Ctxt& ctxt, long dim_idx, long idx) const
 {
@@ -2248,16 +3242,21 @@ BlockMatMulFullExec::rec_mul(Ctxt& acc, const Ctxt& ctxt, long dim_idx, long idx
     if (ctxt.getPubKey().getKSStrategy(dim) == FHE_KSS_MIN)
       iterative = true;
 
-    if (!iterative) {
+    if (!iterative)  {
+      // The recursive calls for different i's are independent, so they
+      // run in parallel. Each one uses the next subtreeSize transforms.
+      long subtreeSize = 1;
+      for (long k: range(dim_idx+1, ea.dimension()-1))
+        subtreeSize *= ea.sizeOfDimension(dims[k]);
 
       if (native) {
 	shared_ptr<GeneralAutomorphPrecon> precon =
 	  buildGeneralAutomorphPrecon(ctxt, dim, ea);
 
-	for (long i: range(sdim)) {
+	ParallelAccumulate(acc, sdim, [&](Ctxt& sum, long i) {
 	  shared_ptr<Ctxt> tmp = precon->automorph(i);
-	  idx = rec_mul(acc, *tmp, dim_idx+1, idx);
-	}
+	  rec_mul(sum, *tmp, dim_idx+1, idx + i*subtreeSize);
+	});
       }
       else {
 	Ctxt ctxt1 = ctxt;
@@ -2267,9 +3266,9 @@ BlockMatMulFullExec::rec_mul(Ctxt& acc, const Ctxt& ctxt, long dim_idx, long idx
 	shared_ptr<GeneralAutomorphPrecon> precon1 =
 	  buildGeneralAutomorphPrecon(ctxt1, dim, ea);
 
-	for (long i: range(sdim)) {
+	ParallelAccumulate(acc, sdim, [&](Ctxt& sum, long i) {
 	  if (i == 0) 
-	     idx = rec_mul(acc, ctxt, dim_idx+1, idx);
+	     rec_mul(sum, ctxt, dim_idx+1, idx);
 	  else {
 	    shared_ptr<Ctxt> tmp = precon->automorph(i);
 	    shared_ptr<Ctxt> tmp1 = precon1->automorph(i);
@@ -2285,11 +3284,12 @@ BlockMatMulFullExec::rec_mul(Ctxt& acc, const Ctxt& ctxt, long dim_idx, long idx
 	    tmp1->multByConstant(m1);
 	    *tmp -= *tmp1;
 
-	    idx = rec_mul(acc, *tmp, dim_idx+1, idx);
+	    rec_mul(sum, *tmp, dim_idx+1, idx + i*subtreeSize);
 	  }
-	}
+	});
 	
       }
+      idx += sdim*subtreeSize;
 
     }
     else {
@@ -2359,6 +3359,363 @@ BlockMatMulFullExec::mul(Ctxt& ctxt) const
 }
 
 
+// ================= sharded full transformations ===============
+
+// The transforms under one branch of dims[0]
+template<class Exec>
+static long branchSize(const Exec& exec)
+{
+  long size = 1;
+  for (long k: range(1, exec.ea.dimension()-1))
+    size *= exec.ea.sizeOfDimension(exec.dims[k]);
+  return size;
+}
+
+template<class Exec>
+long numMatMulBranches(const Exec& exec)
+{
+  if (exec.ea.dimension() <= 1) return 1;
+  return exec.ea.sizeOfDimension(exec.dims[0]);
+}
+
+template<class Exec>
+MatMulShard<Exec>::MatMulShard(const Exec& full, long _first, long _last)
+  : exec(full.ea, full.minimal, full.dims,
+         decltype(full.transforms)(
+           full.transforms.begin() + _first*branchSize(full),
+           full.transforms.begin() + _last*branchSize(full))),
+    first(_first), last(_last), subtreeSize(branchSize(full))
+{
+  assert(0 <= first && first < last && last <= numMatMulBranches(full));
+}
+
+template<class Exec>
+MatMulShard<Exec>::MatMulShard(const EncryptedArray& ea, istream& str)
+  : exec(ea, [&str]() -> istream& { // the range comes first
+      if (readEyeCatcher(str, BINIO_EYE_MATMUL_BEGIN) != 0
+          || read_raw_int(str) != 5) // a shard
+        Error("MatMulShard: bad input stream");
+      return str;
+    }()),
+    first(read_raw_int(str)), last(read_raw_int(str)),
+    subtreeSize(read_raw_int(str))
+{
+  if (readEyeCatcher(str, BINIO_EYE_MATMUL_END) != 0)
+    Error("MatMulShard: bad input stream");
+  if (first < 0 || first >= last || last > numMatMulBranches(exec)
+      || subtreeSize != branchSize(exec)
+      || lsize(exec.transforms) != (last-first)*subtreeSize)
+    Error("MatMulShard: bad shard in input stream");
+}
+
+template<class Exec>
+void MatMulShard<Exec>::write(ostream& str) const
+{
+  writeEyeCatcher(str, BINIO_EYE_MATMUL_BEGIN);
+  write_raw_int(str, 5);
+  exec.write(str);
+  write_raw_int(str, first);
+  write_raw_int(str, last);
+  write_raw_int(str, subtreeSize);
+  writeEyeCatcher(str, BINIO_EYE_MATMUL_END);
+}
+
+// The precomputations for the inputs of the branches along dim. For a
+// non-native dimension precon1 is that of ctxt rotated by -sdim, which
+// branchInput needs for the wrap-around, otherwise it is left NULL.
+static void
+buildBranchPrecons(shared_ptr<GeneralAutomorphPrecon>& precon,
+                   shared_ptr<GeneralAutomorphPrecon>& precon1,
+                   const Ctxt& ctxt, long dim, const EncryptedArray& ea)
+{
+  precon = buildGeneralAutomorphPrecon(ctxt, dim, ea);
+  precon1.reset();
+  if (!ea.nativeDimension(dim)) {
+    Ctxt ctxt1 = ctxt;
+    ctxt1.smartAutomorph(
+      ea.getPAlgebra().genToPow(dim, -ea.sizeOfDimension(dim)));
+    precon1 = buildGeneralAutomorphPrecon(ctxt1, dim, ea);
+  }
+}
+
+// The input of branch i: ctxt rotated by i along dim, as in rec_mul
+static shared_ptr<Ctxt>
+branchInput(const Ctxt& ctxt, const GeneralAutomorphPrecon& precon,
+            const GeneralAutomorphPrecon* precon1, long dim, long i,
+            const EncryptedArray& ea)
+{
+  if (precon1 == NULL) return precon.automorph(i);
+  if (i == 0) return make_shared<Ctxt>(ctxt);
+
+  shared_ptr<Ctxt> tmp = precon.automorph(i);
+  shared_ptr<Ctxt> tmp1 = precon1->automorph(i);
+  zzX mask = ea.getAlMod().getMask_zzX(dim, i);
+  DoubleCRT m1(mask, ea.getContext(),
+               tmp->getPrimeSet() | tmp1->getPrimeSet());
+
+  // Compute tmp = tmp*m1 + tmp1 - tmp1*m1
+  tmp->multByConstant(m1);
+  *tmp += *tmp1;
+  tmp1->multByConstant(m1);
+  *tmp -= *tmp1;
+  return tmp;
+}
+
+// The same branches as in rec_mul at the top level: branch i is the input
+// rotated by i along dims[0], and its transforms start at (i-first)*subtreeSize
+template<class Exec>
+void MatMulShard<Exec>::mul(Ctxt& partial, const Ctxt& ctxt_arg) const
+{
+  FHE_NTIMER_START(mul_MatMulShard);
+  const EncryptedArray& ea = exec.ea;
+  assert(&ea.getContext() == &ctxt_arg.getContext());
+  Ctxt ctxt = ctxt_arg;
+  ctxt.cleanUp();
+  partial = Ctxt(ZeroCtxtLike, ctxt);
+
+  if (ea.dimension() <= 1) { // a single transform
+    exec.rec_mul(partial, ctxt, 0, 0);
+    return;
+  }
+
+  long dim = exec.dims[0];
+  shared_ptr<GeneralAutomorphPrecon> precon, precon1;
+  buildBranchPrecons(precon, precon1, ctxt, dim, ea);
+
+  ParallelAccumulate(partial, last-first, [&](Ctxt& sum, long k) {
+    shared_ptr<Ctxt> tmp =
+      branchInput(ctxt, *precon, precon1.get(), dim, first+k, ea);
+    exec.rec_mul(sum, *tmp, 1, k*subtreeSize);
+  });
+}
+
+template<class Exec>
+void partitionMatMul(vector< MatMulShard<Exec> >& shards, const Exec& exec,
+                     long nShards)
+{
+  long n = numMatMulBranches(exec);
+  nShards = max(1L, min(nShards, n));
+  shards.clear();
+  shards.reserve(nShards);
+  for (long j: range(nShards))
+    shards.emplace_back(exec, (n*j)/nShards, (n*(j+1))/nShards);
+}
+
+void mergeMatMulShards(Ctxt& out, const vector<Ctxt>& partials)
+{
+  assert(!partials.empty());
+  out = partials[0];
+  for (long j: range(1, partials.size())) out += partials[j];
+}
+
+template class MatMulShard<MatMulFullExec>;
+template class MatMulShard<BlockMatMulFullExec>;
+template long numMatMulBranches(const MatMulFullExec&);
+template long numMatMulBranches(const BlockMatMulFullExec&);
+template void partitionMatMul(vector<MatMulFullShard>&,
+                              const MatMulFullExec&, long);
+template void partitionMatMul(vector<BlockMatMulFullShard>&,
+                              const BlockMatMulFullExec&, long);
+
+
+// ================= Tiled stuff ===============
+
+// Tile (ti,tj) of a tiled matrix, as an n x n full matrix
+template<class type>
+class MatMulTileView : public MatMulFull_derived<type> {
+public:
+  PA_INJECT(type)
+
+  const MatMulTiled_derived<type>& mat;
+  long rowOffset, colOffset;
+
+  MatMulTileView(const MatMulTiled_derived<type>& _mat, long ti, long tj)
+    : mat(_mat), rowOffset(ti*_mat.getEA().size()),
+      colOffset(tj*_mat.getEA().size()) {}
+
+  const EncryptedArray& getEA() const override { return mat.getEA(); }
+
+  bool get(RX& out, long i, long j) const override {
+    i += rowOffset;
+    j += colOffset;
+    if (i >= mat.getRows() || j >= mat.getCols()) return true; // padding
+    return mat.get(out, i, j);
+  }
+};
+
+template<class type>
+struct TiledMatMulExec_construct {
+  PA_INJECT(type)
+
+  static
+  void apply(const EncryptedArrayDerived<type>& ea,
+             const MatMulTiled& mat_basetype,
+             vector<MatMulFullExec>& tiles,
+             long nIn, long nOut, bool minimal)
+  {
+    const MatMulTiled_derived<type>& mat =
+      dynamic_cast< const MatMulTiled_derived<type>& >(mat_basetype);
+    tiles.reserve(nIn*nOut);
+    for (long i: range(nIn))
+      for (long j: range(nOut)) {
+        MatMulTileView<type> view(mat, i, j);
+        tiles.emplace_back(view, minimal);
+      }
+  }
+};
+
+TiledMatMulExec::TiledMatMulExec(const MatMulTiled& mat, bool minimal)
+  : ea(mat.getEA()), rows(mat.getRows()), cols(mat.getCols())
+{
+  FHE_NTIMER_START(TiledMatMulExec);
+  if (ea.getTag() == PA_cx_tag)
+    Error("TiledMatMulExec: not implemented for CKKS");
+  if (rows <= 0 || cols <= 0)
+    Error("TiledMatMulExec: empty matrix");
+  nIn = divc(rows, ea.size());
+  nOut = divc(cols, ea.size());
+  ea.dispatch<TiledMatMulExec_construct>(mat, tiles, nIn, nOut, minimal);
+}
+
+void
+TiledMatMulExec::mul(vector<Ctxt>& out, const vector<Ctxt>& in) const
+{
+  FHE_NTIMER_START(mul_TiledMatMulExec);
+  if (lsize(in) != nIn)
+    Error("TiledMatMulExec::mul: wrong number of input ciphertexts");
+  vector<Ctxt> acc(nOut, Ctxt(ZeroCtxtLike, in[0]));
+
+  for (long i: range(nIn)) {
+    Ctxt ctxt = in[i];
+    ctxt.cleanUp();
+
+    if (ea.dimension() <= 1) { // a single transform per tile
+      FHE_EXEC_RANGE(nOut, first, last)
+        for (long j: range(first, last)) tile(i,j).rec_mul(acc[j], ctxt, 0, 0);
+      FHE_EXEC_RANGE_END
+      continue;
+    }
+
+    // The inputs of the branches, shared by all the tiles of row i
+    const MatMulFullExec& t0 = tile(i,0);
+    long dim = t0.dims[0];
+    long nBranches = numMatMulBranches(t0);
+    long subtreeSize = branchSize(t0);
+    vector< shared_ptr<Ctxt> > inputs(nBranches);
+    {
+      shared_ptr<GeneralAutomorphPrecon> precon, precon1;
+      buildBranchPrecons(precon, precon1, ctxt, dim, ea);
+      FHE_EXEC_RANGE(nBranches, first, last)
+        for (long b: range(first, last))
+          inputs[b] = branchInput(ctxt, *precon, precon1.get(), dim, b, ea);
+      FHE_EXEC_RANGE_END
+    }
+
+    if (nOut == 1) // split the branches between the threads
+      ParallelAccumulate(acc[0], nBranches, [&](Ctxt& sum, long b) {
+        tile(i,0).rec_mul(sum, *inputs[b], 1, b*subtreeSize);
+      });
+    else {         // split the tiles
+      FHE_EXEC_RANGE(nOut, first, last)
+        for (long j: range(first, last))
+          for (long b: range(nBranches))
+            tile(i,j).rec_mul(acc[j], *inputs[b], 1, b*subtreeSize);
+      FHE_EXEC_RANGE_END
+    }
+  }
+  out.swap(acc);
+}
+
+
+// ================= Encrypted products ===============
+
+// sigma (dim=dimC, other=dimR) and tau (the other way around) as 1D
+// transformations: entry j of the output is entry j+c (mod D) of the
+// input, c the coordinate of the slice along the other dimension
+template<class type>
+class EncMatMulShift : public MatMul1D_derived<type> {
+public:
+  PA_INJECT(type)
+
+  const EncryptedArray& ea;
+  long dim, other;
+
+  EncMatMulShift(const EncryptedArray& _ea, long _dim, long _other)
+    : ea(_ea), dim(_dim), other(_other) {}
+
+  const EncryptedArray& getEA() const override { return ea; }
+  long getDim() const override { return dim; }
+  bool multipleTransforms() const override { return true; }
+
+  bool get(RX& out, long i, long j, long k) const override {
+    const PAlgebra& zMStar = ea.getPAlgebra();
+    long idx = zMStar.assembleIndexByDim(make_pair(k, 0L), dim);
+    long c = zMStar.coordinate(other, idx);
+    if (i != (j + c) % ea.sizeOfDimension(dim)) return true;
+    set(out);
+    return false;
+  }
+};
+
+static MatMul1DExec
+buildEncMatMulShift(const EncryptedArray& ea, long dim, long other,
+                    bool minimal)
+{
+  if (ea.getTag() == PA_GF2_tag)
+    return MatMul1DExec(EncMatMulShift<PA_GF2>(ea, dim, other), minimal);
+  else
+    return MatMul1DExec(EncMatMulShift<PA_zz_p>(ea, dim, other), minimal);
+}
+
+// The common size of dimR and dimC
+static long encMatMulSize(const EncryptedArray& ea, long dimR, long dimC)
+{
+  if (ea.getTag() == PA_cx_tag)
+    Error("EncMatMulExec: not implemented for CKKS");
+  if (dimR < 0 || dimR >= ea.dimension() || dimC < 0
+      || dimC >= ea.dimension() || dimR == dimC)
+    Error("EncMatMulExec: bad dimensions");
+  long d = ea.sizeOfDimension(dimR);
+  if (ea.sizeOfDimension(dimC) != d)
+    Error("EncMatMulExec: the dimensions have different sizes");
+  return d;
+}
+
+EncMatMulExec::EncMatMulExec(const EncryptedArray& _ea, long _dimR,
+                             long _dimC, bool minimal)
+  : ea(_ea), dimR(_dimR), dimC(_dimC), d(encMatMulSize(_ea, _dimR, _dimC)),
+    sigma(buildEncMatMulShift(_ea, _dimC, _dimR, minimal)),
+    tau(buildEncMatMulShift(_ea, _dimR, _dimC, minimal))
+{ }
+
+void EncMatMulExec::mul(Ctxt& c, const Ctxt& a, const Ctxt& b) const
+{
+  FHE_NTIMER_START(mul_EncMatMulExec);
+  Ctxt a0 = a, b0 = b;
+  sigma.mul(a0);
+  tau.mul(b0);
+  a0.cleanUp();
+  b0.cleanUp();
+
+  // phi^k and psi^k rotate by -k, that is by d-k, along dimC and dimR
+  shared_ptr<GeneralAutomorphPrecon> preconA, preconA1, preconB, preconB1;
+  buildBranchPrecons(preconA, preconA1, a0, dimC, ea);
+  buildBranchPrecons(preconB, preconB1, b0, dimR, ea);
+
+  Ctxt acc(ZeroCtxtLike, a0);
+  ParallelAccumulate(acc, d, [&](Ctxt& sum, long k) {
+    long i = (d - k) % d;
+    shared_ptr<Ctxt> x =
+      branchInput(a0, *preconA, preconA1.get(), dimC, i, ea);
+    shared_ptr<Ctxt> y =
+      branchInput(b0, *preconB, preconB1.get(), dimR, i, ea);
+    x->setLazyRelin(); // acc is re-linearized once, at the end
+    x->multiplyBy(*y);
+    sum += std::move(*x);
+  });
+  acc.cleanUp();
+  c = acc;
+}
 
 
 // ================= plaintext mul stuff stuff ===============
@@ -2379,39 +3736,45 @@ struct mul_MatMul1D_impl {
 
     RBak bak; bak.save(); ea.getTab().restoreContext();
 
+    const PAlgebra& zMStar = ea.getContext().zMStar;
     long n = ea.size();
     long D = ea.sizeOfDimension(dim);
-
-    vector< vector<RX> > data1(n/D);
-    for (long k: range(n/D))
-      data1[k].resize(D);
-
-    // copy the data into a vector of 1D vectors
-    vector<RX>& data = pa.getData<type>();
-    for (long i: range(n)) {
-      long k, j;
-      std::tie(k, j) = ea.getContext().zMStar.breakIndexByDim(i, dim);
-      data1[k][j] = data[i];       // k= along dim, j = the rest of i
+    long nBlocks = n/D;
+
+    // The nonzero entries (i, M[i][j]) of each column j of the matrix of
+    // every block, or of block 0 if they all have the same matrix. get()
+    // is only called from this thread, and once per entry.
+    long nMats = mat.multipleTransforms()? nBlocks : 1;
+    vector< vector< vector< std::pair<long,RX> > > > cols(nMats);
+    RX val;
+    for (long k: range(nMats)) {
+      cols[k].resize(D);
+      for (long j: range(D))
+        for (long i: range(D))
+          if (!mat.get(val, i, j, k) && !IsZero(val))
+            cols[k][j].push_back(std::make_pair(i, val));
     }
 
-    // multiply each one of the vectors by the same matrix
-    for (long k: range(n/D)) {
-      for (long j: range(D)) { // simple matrix-vector multiplication
-	std::pair<long,long> p(k, j);
-	long idx = ea.getContext().zMStar.assembleIndexByDim(p, dim);
-
-	RX acc, val, tmp; 
-	acc = 0;
-        for (long i: range(D)) {
-          bool zero = mat.get(val, i, j, k);
-          if (!zero) {
-            NTL::mul(tmp, data1[k][i], val);
-            NTL::add(acc, acc, tmp);
-          }
+    // output (k, j) = sum_i input (k, i) * M[i][j], reduced once mod G,
+    // split between the threads by output slot
+    vector<RX>& data = pa.getData<type>();
+    vector<RX> in(data);
+    const RX& G = ea.getG();
+    FHE_EXEC_RANGE(n, first, last)
+      RBak bak1; bak1.save(); ea.getTab().restoreContext();
+      RX acc, tmp;
+      for (long t: range(first, last)) {
+        long k = t / D, j = t % D;
+        const vector< std::pair<long,RX> >& col = cols[nMats>1? k : 0][j];
+        clear(acc);
+        for (const std::pair<long,RX>& e: col) {
+          long src = zMStar.assembleIndexByDim(std::make_pair(k, e.first), dim);
+          NTL::mul(tmp, in[src], e.second);
+          NTL::add(acc, acc, tmp);
         }
-        rem(data[idx], acc, ea.getG()); // store the result in the data array
+        rem(data[zMStar.assembleIndexByDim(std::make_pair(k, j), dim)], acc, G);
       }
-    }
+    FHE_EXEC_RANGE_END
   }
 
 
@@ -2582,6 +3945,90 @@ void mul(PlaintextArray& pa, const BlockMatMulFull& mat)
   ea.dispatch<mul_BlockMatMulFull_impl>(pa, mat);
 }
 
+template<class type>
+struct mul_MatMulTiled_impl {
+  PA_INJECT(type)
+
+  static
+  void apply(const EncryptedArrayDerived<type>& ea,
+             vector<PlaintextArray>& pas,
+             const MatMulTiled& mat_basetype)
+  {
+    const MatMulTiled_derived<type>& mat =
+          dynamic_cast< const MatMulTiled_derived<type>& >(mat_basetype);
+    long n = ea.size();
+    long nOut = divc(mat.getCols(), n);
+    const RX& G = ea.getG();
+
+    RBak bak; bak.save(); ea.getTab().restoreContext();
+
+    vector<PlaintextArray> res(nOut, PlaintextArray(mat.getEA()));
+    for (long j: range(mat.getCols())) {
+      RX acc, val, tmp;
+      acc = 0;
+      for (long i: range(mat.getRows())) {
+        if (!mat.get(val, i, j)) {
+          mul(tmp, pas[i/n].getData<type>()[i%n], val);
+          add(acc, acc, tmp);
+        }
+      }
+      rem(acc, acc, G);
+      res[j/n].getData<type>()[j%n] = acc;
+    }
+
+    pas.swap(res);
+  }
+
+};
+
+void mul(vector<PlaintextArray>& pas, const MatMulTiled& mat)
+{
+  const EncryptedArray& ea = mat.getEA();
+  assert(lsize(pas) == divc(mat.getRows(), ea.size()));
+  ea.dispatch<mul_MatMulTiled_impl>(pas, mat);
+}
+
+
+template<class type>
+struct mulMatrices_impl {
+  PA_INJECT(type)
+
+  static
+  void apply(const EncryptedArrayDerived<type>& ea, PlaintextArray& a,
+             const PlaintextArray& b, long dimR, long dimC)
+  {
+    const PAlgebra& zMStar = ea.getPAlgebra();
+    long n = ea.size();
+    long d = ea.sizeOfDimension(dimR);
+    const vector<RX>& x = a.getData<type>();
+    const vector<RX>& y = b.getData<type>();
+
+    RBak bak; bak.save(); ea.getTab().restoreContext();
+
+    vector<RX> res(n);
+    RX tmp;
+    for (long s: range(n)) { // entry (i,j) of its matrix
+      long i = zMStar.coordinate(dimR, s);
+      long j = zMStar.coordinate(dimC, s);
+      for (long k: range(d)) {
+        long sa = zMStar.addCoord(dimC, s, k-j); // entry (i,k) of a
+        long sb = zMStar.addCoord(dimR, s, k-i); // entry (k,j) of b
+        NTL::mul(tmp, x[sa], y[sb]);
+        NTL::add(res[s], res[s], tmp);
+      }
+      rem(res[s], res[s], ea.getG());
+    }
+    a.getData<type>().swap(res);
+  }
+};
+
+void mulMatrices(PlaintextArray& a, const PlaintextArray& b,
+                 const EncryptedArray& ea, long dimR, long dimC)
+{
+  encMatMulSize(ea, dimR, dimC); // check the dimensions
+  ea.dispatch<mulMatrices_impl>(a, b, dimR, dimC);
+}
+
 
 //================= traceMap ====================
 
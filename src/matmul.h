@@ -73,6 +73,14 @@ public:
   virtual const EncryptedArray& getEA() const = 0;
   virtual long getDim() const = 0;
   typedef MatMul1DExec ExecType;
+
+  // If only some diagonals may be nonzero, set diags to their indexes, in
+  // increasing order, and return true. Diagonal i holds the entries
+  // (j-i mod D, j). MatMul1DExec then processes only those diagonals, and
+  // picks its baby-step/giant-step split for them. The default is false,
+  // i.e., all D diagonals are processed.
+  virtual bool getNonzeroDiagonals(std::vector<long>& diags) const
+  { return false; }
 };
 
 // An intermediate class that is mainly intended for internal use.
@@ -109,6 +117,75 @@ public:
                   const EncryptedArrayDerived<type>& ea) const override;
 };
 
+// A 1D transformation that is described by its nonzero diagonals, such as
+// a banded one. The work and the storage of MatMul1DExec are proportional
+// to the number of these diagonals rather than to D.
+template<class type>
+class MatMul1DSparse_derived : public MatMul1D_derived<type> {
+public:
+  PA_INJECT(type)
+
+  // The diagonals that may be nonzero, in [0,D) and in increasing order.
+  virtual std::vector<long> getDiagonals() const = 0;
+
+  // Get entry j of diagonal i of the kth component, that is coordinate
+  // (j-i mod D, j). Should return true when the entry is a zero, which
+  // includes all the diagonals that are not listed by getDiagonals().
+  virtual bool getDiagonalEntry(RX& out, long i, long j, long k) const = 0;
+
+  bool get(RX& out, long i, long j, long k) const override;
+
+  bool getNonzeroDiagonals(std::vector<long>& diags) const override
+  { diags = getDiagonals(); return true; }
+};
+
+//====================================
+
+// Matrices over the complex numbers, for the slots of EncryptedArrayCx.
+// MatMul1DExec and MatMulFullExec execute them like the other matrices,
+// using the same baby-step/giant-step and hoisting strategies. The
+// diagonals are encoded right away as DoubleCRT constants, at the
+// precision of the matrix (see EncryptedArrayCx::encode), so there is
+// no need to call upgrade() for them.
+
+// An intermediate class that is mainly intended for internal use.
+class MatMul1DCx_partial : public MatMul1D {
+public:
+  // The precision of the encoded diagonals, 0 for the default precision
+  virtual long getPrecision() const { return 0; }
+
+  // Get the i'th diagonal, one entry for every slot.
+  // Should return true when the diagonal is zero.
+  virtual bool
+  processDiagonal(std::vector<cx_double>& diag, long i) const = 0;
+};
+
+// Concrete derived class that defines the matrix entries.
+class MatMul1DCx : public MatMul1DCx_partial {
+public:
+  // Should return true if there are multiple (different) transforms
+  // among the various components.
+  virtual bool multipleTransforms() const = 0;
+
+  // Get coordinate (i, j) of the kth component.
+  // Should return true when the entry is a zero.
+  virtual bool get(cx_double& out, long i, long j, long k) const = 0;
+
+  bool
+  processDiagonal(std::vector<cx_double>& diag, long i) const override;
+};
+
+// A linear transformation on the full vector of complex slots.
+class MatMulFullCx : public MatMulFull {
+public:
+  // The precision of the encoded diagonals, 0 for the default precision
+  virtual long getPrecision() const { return 0; }
+
+  // Get (i, j) entry of matrix.
+  // Should return true when the entry is a zero.
+  virtual bool get(cx_double& out, long i, long j) const = 0;
+};
+
 //====================================
 
 class BlockMatMul1DExec;
@@ -174,8 +251,54 @@ struct ConstMultiplierCache {
 
   // Upgrade zzX constants to DoubleCRT constants.
   void upgrade(const FHEcontext& context);
+
+  // The bytes of the constants, and of the cache itself
+  long memoryUsage() const;
 };
 
+/**
+ * @name The hot tier of zzX constants
+ * @brief Short of upgrading all the constants, a global memory budget lets
+ * the most used zzX constants (of all the transformations) keep a
+ * DoubleCRT copy, the others are converted on every use as before. A
+ * constant is admitted while there is room, or in place of one that was
+ * used fewer times, so a cyclic scan over more constants than fit (as in a
+ * recryption) keeps the same ones hot instead of thrashing. The default
+ * budget is zero, i.e., no hot tier. The tier is thread-safe.
+ **/
+///@{
+struct ConstMultiplierStats {
+  long hits, misses; // uses of zzX constants (with a nonzero budget),
+                     // with and without a copy
+  long entries;      // constants that have a DoubleCRT copy
+  long bytes;        // the size of those copies
+
+  double hitRate() const
+  { return (hits+misses == 0)? 0.0 : double(hits)/(hits+misses); }
+};
+
+//! @brief Set the budget in bytes, evicting copies if needed
+void setConstMultiplierBudget(long bytes);
+long getConstMultiplierBudget();
+ConstMultiplierStats getConstMultiplierStats();
+//! @brief Drop all the copies and reset the statistics. Call it before
+//! destroying a context that was used with a nonzero budget.
+void clearConstMultiplierTier();
+///@}
+
+// Persistent caches: MatMul1DExec and BlockMatMul1DExec can also be
+// constructed with the name of a cache file. The header of the file holds
+// the context parameters (m, p^r, the modulus chain), the shape of the
+// transformation (including the build_cache flag) and a digest of the
+// entries of the matrix. If these match, the constants are loaded from
+// the file (with mmap when available, so DoubleCRT constants stay in the
+// page cache and are shared between processes) instead of being encoded.
+// If there is no cache file yet, the constants are computed as usual,
+// upgraded if build_cache is set, and written to the file for next time.
+// A cache file of another context or matrix is treated the same way: it is
+// rebuilt and replaced, so parameter sets that map to the same file name
+// (which only depends on the dimensions) just take turns.
+
 //====================================
 
 
@@ -189,6 +312,9 @@ public:
   // Upgrade zzX constants to DoubleCRT constants.
   virtual void upgrade() = 0;
 
+  // The bytes of the encoded constants and of this object
+  virtual long memoryUsage() const = 0;
+
   // If ctxt enctrypts a row std::vector v, then this replaces ctxt
   // by an encryption of the row std::vector v*mat, where mat is 
   // a matrix provided to the constructor of one of the
@@ -228,6 +354,16 @@ public:
   explicit
   MatMul1DExec(const MatMul1D& mat, bool minimal=false);
 
+  // Load the constants from cacheFile if possible, see above
+  MatMul1DExec(const MatMul1D& mat, bool minimal,
+               const std::string& cacheFile, bool build_cache);
+
+  // Read the constants that were written by write(str) with the same ea
+  MatMul1DExec(const EncryptedArray& ea, std::istream& str);
+
+  // Write the strategy and the encoded constants in binary format
+  void write(std::ostream& str) const;
+
   // Replaces an encryption of row std::vector v by encryption of v*mat
   void mul(Ctxt& ctxt) const override;
 
@@ -237,7 +373,14 @@ public:
     cache1.upgrade(ea.getContext()); 
   }
 
+  long memoryUsage() const override;
+
   const EncryptedArray& getEA() const override { return ea; }
+
+private:
+  // Set dim, D, native and the strategy, common to both constructors.
+  // diags are the nonzero diagonals, if the matrix lists them.
+  void initShape(long _dim, const std::vector<long>* diags);
 };
 
 //====================================
@@ -252,6 +395,7 @@ public:
   long D;
   long d;
   bool native;
+  bool minimal;
   long strategy;
 
   ConstMultiplierCache cache;
@@ -269,7 +413,17 @@ public:
   // If the minimal flag is false, it is best to use the
   // addSome{1D,Frb}Matrices routines declared in FHE.h.
   explicit
-  BlockMatMul1DExec(const BlockMatMul1D& mat, bool minimal=false);
+  BlockMatMul1DExec(const BlockMatMul1D& mat, bool _minimal=false);
+
+  // Load the constants from cacheFile if possible, see above
+  BlockMatMul1DExec(const BlockMatMul1D& mat, bool _minimal,
+                    const std::string& cacheFile, bool build_cache);
+
+  // Read the constants that were written by write(str) with the same ea
+  BlockMatMul1DExec(const EncryptedArray& ea, std::istream& str);
+
+  // Write the strategy and the encoded constants in binary format
+  void write(std::ostream& str) const;
 
   // Replaces an encryption of row std::vector v by encryption of v*mat
   void mul(Ctxt& ctxt) const override;
@@ -280,7 +434,13 @@ public:
     cache1.upgrade(ea.getContext()); 
   }
 
+  long memoryUsage() const override;
+
   const EncryptedArray& getEA() const override { return ea; }
+
+private:
+  // Set dim, D, native and the strategy, common to both constructors
+  void initShape(long _dim);
 };
 
 //====================================
@@ -307,6 +467,19 @@ public:
   explicit
   MatMulFullExec(const MatMulFull& mat, bool minimal=false);
 
+  // Read the constants that were written by write(str) with the same ea
+  MatMulFullExec(const EncryptedArray& ea, std::istream& str);
+
+  // Put together from its parts (used for the shards, see below)
+  MatMulFullExec(const EncryptedArray& _ea, bool _minimal,
+                 const std::vector<long>& _dims,
+                 std::vector<MatMul1DExec> _transforms)
+    : ea(_ea), minimal(_minimal), dims(_dims),
+      transforms(std::move(_transforms)) {}
+
+  // Write the dimension order and the 1D transforms in binary format
+  void write(std::ostream& str) const;
+
   // Replaces an encryption of row std::vector v by encryption of v*mat
   void mul(Ctxt& ctxt) const override;
 
@@ -315,6 +488,8 @@ public:
     for (auto& t: transforms) t.upgrade();
   }
 
+  long memoryUsage() const override;
+
   const EncryptedArray& getEA() const override { return ea; }
 
   // This really should be private.
@@ -346,6 +521,19 @@ public:
   explicit
   BlockMatMulFullExec(const BlockMatMulFull& mat, bool minimal=false);
 
+  // Read the constants that were written by write(str) with the same ea
+  BlockMatMulFullExec(const EncryptedArray& ea, std::istream& str);
+
+  // Put together from its parts (used for the shards, see below)
+  BlockMatMulFullExec(const EncryptedArray& _ea, bool _minimal,
+                      const std::vector<long>& _dims,
+                      std::vector<BlockMatMul1DExec> _transforms)
+    : ea(_ea), minimal(_minimal), dims(_dims),
+      transforms(std::move(_transforms)) {}
+
+  // Write the dimension order and the 1D transforms in binary format
+  void write(std::ostream& str) const;
+
   // Replaces an encryption of row std::vector v by encryption of v*mat
   void mul(Ctxt& ctxt) const override;
 
@@ -354,6 +542,8 @@ public:
     for (auto& t: transforms) t.upgrade();
   }
 
+  long memoryUsage() const override;
+
   const EncryptedArray& getEA() const override { return ea; }
 
   // This really should be private.
@@ -363,6 +553,179 @@ public:
 
 //===================================
 
+/**
+ * @name Sharded full transformations
+ * @brief Splitting a MatMulFullExec (or BlockMatMulFullExec) over several
+ * workers.
+ *
+ * A full transformation is a sum over the branches of its first dimension
+ * (dims[0]): branch i rotates the input by i along that dimension, then
+ * applies the next subtreeSize 1D transforms, and the branches do not
+ * depend on each other. A shard holds a range of branches and only their
+ * 1D transforms, its mul() gives the sum over these branches, and the sum
+ * of the partial results of all the shards is the product by the whole
+ * matrix. The shards, the input and the partial results are written and
+ * read with the usual binary IO (MatMulShard::write, Ctxt::write), so
+ * shipping them to the workers is up to the caller. A worker needs the
+ * same public key and EncryptedArray as the coordinator.
+ *
+ * With a single dimension there is only one branch, hence one shard.
+ **/
+///@{
+template<class Exec>
+class MatMulShard {
+  Exec exec;        // the dims, and the transforms of these branches
+  long first, last; // the branches [first,last) of dims[0]
+  long subtreeSize; // transforms per branch
+
+public:
+  //! The shard of full with the branches [first,last)
+  MatMulShard(const Exec& full, long _first, long _last);
+
+  //! Read a shard that was written by write(str) with the same ea
+  MatMulShard(const EncryptedArray& ea, std::istream& str);
+
+  void write(std::ostream& str) const;
+
+  //! partial = the sum of the branches of this shard, applied to ctxt
+  void mul(Ctxt& partial, const Ctxt& ctxt) const;
+
+  void upgrade() { exec.upgrade(); }
+
+  long getFirst() const { return first; }
+  long getLast() const { return last; }
+};
+
+typedef MatMulShard<MatMulFullExec> MatMulFullShard;
+typedef MatMulShard<BlockMatMulFullExec> BlockMatMulFullShard;
+
+//! The number of branches that the shards of exec can split
+template<class Exec> long numMatMulBranches(const Exec& exec);
+
+//! Split exec into (at most) nShards shards of about the same size
+template<class Exec>
+void partitionMatMul(std::vector< MatMulShard<Exec> >& shards,
+                     const Exec& exec, long nShards);
+
+//! out = the sum of the partial results of all the shards
+void mergeMatMulShards(Ctxt& out, const std::vector<Ctxt>& partials);
+///@}
+
+//===================================
+
+/**
+ * @name Tiled transformations
+ * @brief Matrices of any size, over several ciphertexts.
+ *
+ * An R x C matrix is a grid of nIn x nOut tiles of n x n entries (n the
+ * number of slots, padded with zeros), and it multiplies a row vector of R
+ * entries encrypted in nIn=ceil(R/n) ciphertexts, entry k*n+s in slot s of
+ * ciphertext k, into nOut=ceil(C/n) ciphertexts in the same layout. Every
+ * tile is a MatMulFullExec. The rotations of an input along the first
+ * dimension (the branches of the sharding above) depend only on the input,
+ * so they are computed once per input ciphertext and used by all the
+ * tiles of its row, which then run in parallel. With a single dimension
+ * there are no such branches, and only the tiles run in parallel.
+ **/
+///@{
+class TiledMatMulExec;
+
+// Abstract base class for a matrix of any size
+class MatMulTiled {
+public:
+  virtual ~MatMulTiled() {}
+  virtual const EncryptedArray& getEA() const = 0;
+  virtual long getRows() const = 0;
+  virtual long getCols() const = 0;
+  typedef TiledMatMulExec ExecType;
+};
+
+// Concrete derived class that defines the matrix entries.
+template<class type>
+class MatMulTiled_derived : public MatMulTiled {
+public:
+  PA_INJECT(type)
+
+  // Get (i, j) entry of matrix, 0<=i<getRows() and 0<=j<getCols().
+  // Should return true when the entry is a zero.
+  virtual bool get(RX& out, long i, long j) const = 0;
+};
+
+class TiledMatMulExec {
+public:
+  const EncryptedArray& ea;
+  long rows, cols;
+  long nIn, nOut;
+  std::vector<MatMulFullExec> tiles; // tile (i,j) at tiles[i*nOut +j]
+
+  // Encodes the constants of all the tiles in zzX format, the flag minimal
+  // is as for MatMulFullExec
+  explicit
+  TiledMatMulExec(const MatMulTiled& mat, bool minimal=false);
+
+  // out = in * mat, in has nIn ciphertexts, out gets nOut
+  void mul(std::vector<Ctxt>& out, const std::vector<Ctxt>& in) const;
+
+  // Upgrades encoded constants from zzX to DoubleCRT.
+  void upgrade() { for (auto& t: tiles) t.upgrade(); }
+
+  const EncryptedArray& getEA() const { return ea; }
+  const MatMulFullExec& tile(long i, long j) const
+  { return tiles[i*nOut +j]; }
+};
+///@}
+
+//===================================
+
+/**
+ * @name Products of encrypted matrices
+ * @brief Multiplying two encrypted d x d matrices.
+ *
+ * A matrix is laid out along two dimensions of the hypercube of the same
+ * size d, entry (i,j) in the slot with coordinate i along dimR and j along
+ * dimC, and the other dimensions hold independent matrices that are all
+ * multiplied at once. The product follows Jiang, Kim, Lauter and Song
+ * (CCS 2018): A*B = sum_k phi^k(sigma(A)) * psi^k(tau(B)), where sigma
+ * rotates row i of A by i along dimC, tau rotates column j of B by j along
+ * dimR, and phi and psi rotate by one along dimC and dimR, respectively.
+ *
+ * sigma and tau are 1D permutations that differ from one row (column) to
+ * the next, and they are executed as MatMul1DExec's whose masks are
+ * encoded once by the constructor. The d rotations of each of sigma(A) and
+ * tau(B) are hoisted, the d products are split between the threads and
+ * re-linearized only once, after they are added up.
+ **/
+///@{
+class EncMatMulExec {
+public:
+  const EncryptedArray& ea;
+  long dimR, dimC; // the dimensions of the rows and the columns
+  long d;          // the size of both
+  MatMul1DExec sigma, tau;
+
+  // Encodes the masks of sigma and tau in zzX format, the flag minimal is
+  // as for MatMul1DExec. dimR and dimC must be different dimensions of the
+  // same size (not the Frobenius one).
+  explicit
+  EncMatMulExec(const EncryptedArray& ea, long dimR=0, long dimC=1,
+                bool minimal=false);
+
+  // c = a * b, c may be the same object as a or b
+  void mul(Ctxt& c, const Ctxt& a, const Ctxt& b) const;
+
+  // Upgrades encoded constants from zzX to DoubleCRT.
+  void upgrade() { sigma.upgrade(); tau.upgrade(); }
+
+  const EncryptedArray& getEA() const { return ea; }
+};
+
+// a = a * b for the plaintext matrices in the layout above, for testing
+void mulMatrices(PlaintextArray& a, const PlaintextArray& b,
+                 const EncryptedArray& ea, long dimR=0, long dimC=1);
+///@}
+
+//===================================
+
 // ctxt = \sum_{i=0}^{d-1} \sigma^i(ctxt),
 //   where d = order of p mod m, and \sigma is the Frobenius map
 
@@ -376,6 +739,8 @@ void mul(PlaintextArray& pa, const MatMul1D& mat);
 void mul(PlaintextArray& pa, const BlockMatMul1D& mat);
 void mul(PlaintextArray& pa, const MatMulFull& mat);
 void mul(PlaintextArray& pa, const BlockMatMulFull& mat);
+// pas has ceil(rows/n) arrays, laid out as for TiledMatMulExec
+void mul(std::vector<PlaintextArray>& pas, const MatMulTiled& mat);
 
 
 // These are used mainly for performance evaluation.
@@ -0,0 +1,97 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* memoryUsage.cpp - memory reports, and the counters of the row buffers
+ */
+#include <atomic>
+#include <iomanip>
+#include "memoryUsage.h"
+
+NTL_CLIENT
+
+//======================== MemoryReport ========================
+
+MemoryReport& MemoryReport::add(const MemoryReport& part)
+{
+  bytes += part.bytes;
+  parts.push_back(part);
+  return *this;
+}
+
+// bytes in a short readable form, e.g. 12.3MB
+static void printBytes(ostream& str, long bytes)
+{
+  static const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+  double x = bytes;
+  long u = 0;
+  while (x >= 1024 && u < 4) { x /= 1024; u++; }
+  str << fixed << setprecision(u? 1 : 0) << x << units[u];
+  str.unsetf(ios::floatfield);
+  str << setprecision(6);
+}
+
+void MemoryReport::print(ostream& str, long minBytes, long indent) const
+{
+  str << string(2*indent, ' ') << name << ": ";
+  printBytes(str, bytes);
+  str << "\n";
+  for (const MemoryReport& part: parts)
+    if (part.bytes >= minBytes) part.print(str, minBytes, indent+1);
+}
+
+ostream& operator<<(ostream& str, const MemoryReport& r)
+{
+  r.print(str);
+  return str;
+}
+
+long memBytes(const fftRep& x)
+{
+  if (x.MaxK < 0) return 0;
+  return (1L << x.MaxK) * x.NumPrimes * long(sizeof(long));
+}
+
+//======================== the slab counters ========================
+
+static std::atomic_bool slabCounting(false);
+static std::atomic_long slabLive(0), slabPooled(0), slabPeak(0),
+  slabBuffers(0);
+
+void setSlabMemoryCounting(bool on) { slabCounting = on; }
+
+bool isSlabMemoryCounting()
+{ return slabCounting.load(std::memory_order_relaxed); }
+
+void countSlabBytes(long nBytes, SlabState from, SlabState to)
+{
+  if (from == to) return;
+  if (from == SLAB_LIVE) { slabLive -= nBytes; slabBuffers--; }
+  if (from == SLAB_POOLED) slabPooled -= nBytes;
+  if (to == SLAB_LIVE) { slabLive += nBytes; slabBuffers++; }
+  if (to == SLAB_POOLED) slabPooled += nBytes;
+
+  if (to == SLAB_UNCOUNTED || from != SLAB_UNCOUNTED) return; // no growth
+  long now = slabLive + slabPooled;
+  long peak = slabPeak.load();
+  while (now > peak && !slabPeak.compare_exchange_weak(peak, now)) {}
+}
+
+SlabMemoryStats getSlabMemoryStats()
+{
+  SlabMemoryStats s;
+  s.liveBytes = slabLive;
+  s.pooledBytes = slabPooled;
+  s.peakBytes = slabPeak;
+  s.buffers = slabBuffers;
+  return s;
+}
+
+void resetSlabMemoryPeak() { slabPeak = slabLive + slabPooled; }
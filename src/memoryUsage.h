@@ -0,0 +1,142 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _MEMORY_USAGE_H_
+#define _MEMORY_USAGE_H_
+/**
+ * @file memoryUsage.h
+ * @brief Accounting for the memory of contexts, keys, caches and
+ * ciphertexts.
+ *
+ * The main objects have a memoryUsage() method that returns the bytes that
+ * they hold, their own size included, and the large ones (FHEcontext,
+ * FHEPubKey, FHESecKey, RecryptData) also have a memoryReport() that breaks
+ * the total down by their members, as a tree of MemoryReport's:
+ * \code
+ *   secretKey.memoryReport().print(cout, 1L<<20); // the parts over 1MB
+ * \endcode
+ * The numbers are estimates: they count the capacity of the containers and
+ * the NTL objects in them, but not the overhead of the allocator. Rows that
+ * are views of a memory-mapped file (see RowSlab::isView) count only their
+ * bookkeeping, since the page cache holds their data.
+ *
+ * setSlabMemoryCounting(true) also turns on global counters of the bytes
+ * in the row buffers of all DoubleCRT's (i.e., of all RowSlab's), live and
+ * at their peak, including the buffers that are kept in the per-thread
+ * pools for reuse. Without it every allocation only checks a flag.
+ **/
+#include <string>
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <NTL/ZZX.h>
+#include <NTL/lzz_pX.h>
+#include <NTL/GF2X.h>
+#include <NTL/vec_GF2.h>
+#include <NTL/mat_GF2.h>
+#include <NTL/lzz_pEX.h>
+#include <NTL/GF2EX.h>
+
+//! @brief The memory of an object, and of its largest parts
+struct MemoryReport {
+  std::string name;
+  long bytes;                     // all of it, the parts included
+  std::vector<MemoryReport> parts;
+
+  explicit MemoryReport(const std::string& _name="", long _bytes=0)
+    : name(_name), bytes(_bytes) {}
+
+  //! Add a part, and its bytes to the total
+  MemoryReport& add(const MemoryReport& part);
+  MemoryReport& add(const std::string& partName, long partBytes)
+  { return add(MemoryReport(partName, partBytes)); }
+
+  //! Print the tree, one line per part, skipping the parts below minBytes
+  void print(std::ostream& str, long minBytes=0, long indent=0) const;
+};
+
+std::ostream& operator<<(std::ostream& str, const MemoryReport& r);
+
+//! @name Counters of the row buffers of DoubleCRT's
+///@{
+struct SlabMemoryStats {
+  long liveBytes;   // in buffers that hold rows now
+  long pooledBytes; // freed, kept by the per-thread pools
+  long peakBytes;   // the most of liveBytes+pooledBytes since the last reset
+  long buffers;     // the live buffers
+};
+
+//! @brief Turn the counters on or off. The buffers allocated while they are
+//! off are never counted.
+void setSlabMemoryCounting(bool on);
+bool isSlabMemoryCounting();
+SlabMemoryStats getSlabMemoryStats();
+//! @brief Set the peak to the current total
+void resetSlabMemoryPeak();
+///@}
+
+//! \cond FALSE (make doxygen ignore these functions)
+// Called by SlabBuffer when a buffer of nBytes moves between the states
+// below, e.g., from SLAB_POOLED to SLAB_LIVE when it is taken from a pool
+enum SlabState { SLAB_UNCOUNTED, SLAB_LIVE, SLAB_POOLED };
+void countSlabBytes(long nBytes, SlabState from, SlabState to);
+//! \endcond
+
+/**
+ * @name Heap bytes of NTL and standard containers
+ * @brief memBytes(x) is the memory that x owns beyond sizeof(x). The
+ * generic version is for types that own nothing, such as long.
+ **/
+///@{
+template<class T> long memBytes(const T&) { return 0; }
+inline long memBytes(const NTL::ZZ& x) { return NTL::NumBytes(x); }
+inline long memBytes(const NTL::zz_pX& x)
+{ return x.rep.MaxLength() * long(sizeof(NTL::zz_p)); }
+inline long memBytes(const NTL::GF2X& x)
+{ return x.xrep.MaxLength() * long(sizeof(unsigned long)); }
+inline long memBytes(const NTL::vec_GF2& x)
+{ return (x.MaxLength() + NTL_BITS_PER_LONG-1)/NTL_BITS_PER_LONG
+         * long(sizeof(unsigned long)); }
+inline long memBytes(const NTL::zz_pE& x) { return memBytes(rep(x)); }
+inline long memBytes(const NTL::GF2E& x) { return memBytes(rep(x)); }
+inline long memBytes(const std::vector<bool>& x)
+{ return x.capacity()/8; }
+long memBytes(const NTL::fftRep& x);
+
+// declared before the containers that call them
+long memBytes(const NTL::ZZX& x);
+long memBytes(const NTL::zz_pEX& x);
+long memBytes(const NTL::GF2EX& x);
+
+template<class T> long memBytes(const NTL::Vec<T>& x)
+{
+  long n = x.MaxLength() * long(sizeof(T));
+  for (long i = 0; i < x.length(); i++) n += memBytes(x[i]);
+  return n;
+}
+template<class T> long memBytes(const NTL::Mat<T>& x)
+{
+  long n = x.NumRows() * long(sizeof(NTL::Vec<T>));
+  for (long i = 0; i < x.NumRows(); i++) n += memBytes(x[i]);
+  return n;
+}
+template<class T> long memBytes(const std::vector<T>& x)
+{
+  long n = x.capacity() * long(sizeof(T));
+  for (const T& t: x) n += memBytes(t);
+  return n;
+}
+inline long memBytes(const NTL::ZZX& x) { return memBytes(x.rep); }
+inline long memBytes(const NTL::zz_pEX& x) { return memBytes(x.rep); }
+inline long memBytes(const NTL::GF2EX& x) { return memBytes(x.rep); }
+///@}
+
+#endif // _MEMORY_USAGE_H_
@@ -0,0 +1,417 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* metrics.cpp - running totals of the library, for monitoring systems
+ */
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <iomanip>
+#include "metrics.h"
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "matmul.h"
+#include "taskScheduler.h"
+
+NTL_CLIENT
+
+std::atomic<bool> fheMetricsOn(false);
+
+void setMetricsOn(bool on) { fheMetricsOn = on; }
+bool areMetricsOn() { return fheMetricsOn; }
+
+const char* metricCounterName(MetricCounter c)
+{
+  switch (c) {
+  case METRIC_KEY_SWITCHES:     return "helib_key_switches_total";
+  case METRIC_RECRYPTS:         return "helib_recrypts_total";
+  case METRIC_RECRYPTED_CTXTS:  return "helib_recrypted_ctxts_total";
+  case METRIC_FFT_ROWS:         return "helib_fft_rows_total";
+  case METRIC_IFFT_ROWS:        return "helib_ifft_rows_total";
+  case METRIC_CTXTS_CREATED:    return "helib_ctxts_created_total";
+  case METRIC_BYTES_SERIALIZED: return "helib_bytes_serialized_total";
+  case METRIC_TASKS_RUN:        return "helib_tasks_run_total";
+  case METRIC_TASK_BUSY_MICROS: return "helib_task_busy_microseconds_total";
+  default: return "helib_unknown_total";
+  }
+}
+
+const char* metricHistogramName(MetricHistogram h)
+{
+  switch (h) {
+  case METRIC_KEY_SWITCH_SECONDS: return "helib_key_switch_seconds";
+  case METRIC_RECRYPT_SECONDS:    return "helib_recrypt_seconds";
+  default: return "helib_unknown_seconds";
+  }
+}
+
+static const char* counterHelp(MetricCounter c)
+{
+  switch (c) {
+  case METRIC_KEY_SWITCHES:     return "Key switchings";
+  case METRIC_RECRYPTS:         return "Calls of reCrypt and thinReCrypt";
+  case METRIC_RECRYPTED_CTXTS:  return "Ciphertexts in the recrypted batches";
+  case METRIC_FFT_ROWS:         return "DoubleCRT rows converted by FFT";
+  case METRIC_IFFT_ROWS:        return "DoubleCRT rows converted by inverse FFT";
+  case METRIC_CTXTS_CREATED:    return "New ciphertexts, not counting copies";
+  case METRIC_BYTES_SERIALIZED: return "Bytes of the ciphertexts written";
+  case METRIC_TASKS_RUN:        return "Tasks run by the task scheduler";
+  case METRIC_TASK_BUSY_MICROS:
+    return "Time the scheduler threads spent running tasks";
+  default: return "";
+  }
+}
+
+//======================== The shards ========================
+
+// The threads are spread over the shards round-robin, so few of them
+// write to the same cache lines
+static const long NSHARDS = 16;
+static const long NB = MetricHistogramSnapshot::NBUCKETS;
+
+struct alignas(64) MetricShard {
+  std::atomic<long> counter[METRIC_COUNTER_COUNT];
+  std::atomic<long> count[METRIC_HISTOGRAM_COUNT];
+  std::atomic<long> sumNanos[METRIC_HISTOGRAM_COUNT];
+  std::atomic<long> bucket[METRIC_HISTOGRAM_COUNT][NB];
+
+  MetricShard() { clear(); }
+  void clear();
+};
+
+void MetricShard::clear()
+{
+  for (long c = 0; c < METRIC_COUNTER_COUNT; c++) counter[c] = 0;
+  for (long h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+    count[h] = 0;
+    sumNanos[h] = 0;
+    for (long b = 0; b < NB; b++) bucket[h][b] = 0;
+  }
+}
+
+static MetricShard shards[NSHARDS];
+static std::atomic<long> nextShard(0);
+
+static MetricShard& ownShard()
+{
+  static thread_local long index = nextShard++ % NSHARDS;
+  return shards[index];
+}
+
+double metricClock()
+{
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static std::atomic<double> startTime(metricClock());
+
+void addMetricSlow(MetricCounter c, long n)
+{
+  ownShard().counter[c].fetch_add(n, std::memory_order_relaxed);
+}
+
+// The bucket of a value: b with 2^(b-1) < micros <= 2^b, from 0 to NB-1
+static long bucketOf(double seconds)
+{
+  double micros = seconds * 1e6;
+  if (!(micros > 1.0)) return 0;
+  int e;
+  double f = std::frexp(micros, &e); // micros = f * 2^e, 1/2 <= f < 1
+  long b = (f == 0.5)? e-1 : e;
+  return (b < NB-1)? b : NB-1;
+}
+
+void observeMetricSlow(MetricHistogram h, double seconds)
+{
+  if (seconds < 0) seconds = 0;
+  MetricShard& s = ownShard();
+  s.count[h].fetch_add(1, std::memory_order_relaxed);
+  s.sumNanos[h].fetch_add(long(seconds * 1e9), std::memory_order_relaxed);
+  s.bucket[h][bucketOf(seconds)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void resetMetrics()
+{
+  for (MetricShard& s: shards) s.clear();
+  startTime = metricClock();
+}
+
+MetricBytesProbe::MetricBytesProbe(std::ostream& _str) : str(_str), p0(-1)
+{
+  if (fheMetricsOn.load(std::memory_order_relaxed)) p0 = long(str.tellp());
+}
+
+MetricBytesProbe::~MetricBytesProbe()
+{
+  if (p0 < 0) return;
+  long p1 = long(str.tellp());
+  if (p1 > p0) addMetricSlow(METRIC_BYTES_SERIALIZED, p1 - p0);
+}
+
+//======================== Histograms ========================
+
+MetricHistogramSnapshot::MetricHistogramSnapshot() : count(0), sum(0)
+{
+  for (long b = 0; b < NBUCKETS; b++) buckets[b] = 0;
+}
+
+double MetricHistogramSnapshot::bound(long b)
+{
+  if (b >= NBUCKETS-1) return std::numeric_limits<double>::infinity();
+  return std::ldexp(1e-6, b);
+}
+
+double MetricHistogramSnapshot::quantile(double q) const
+{
+  if (count == 0) return 0.0;
+  double target = q * count;
+  long seen = 0;
+  for (long b = 0; b < NBUCKETS; b++) {
+    seen += buckets[b];
+    if (seen > 0 && seen >= target) return bound(b);
+  }
+  return bound(NBUCKETS-1);
+}
+
+MetricsSnapshot::MetricsSnapshot() : uptime(0)
+{
+  for (long c = 0; c < METRIC_COUNTER_COUNT; c++) counter[c] = 0;
+}
+
+//======================== Gauges ========================
+
+namespace {
+struct GaugeEntry {
+  long id;
+  std::string name, labels;
+  std::function<double()> read;
+};
+
+struct GaugeRegistry {
+  std::mutex mx; // held while the gauges are read
+  std::vector<GaugeEntry> gauges;
+  long nextId = 1;
+};
+}
+
+static GaugeRegistry& gaugeRegistry()
+{
+  static GaugeRegistry reg;
+  return reg;
+}
+
+static long newGaugeId()
+{
+  GaugeRegistry& reg = gaugeRegistry();
+  std::lock_guard<std::mutex> lock(reg.mx);
+  return reg.nextId++;
+}
+
+static void addGauge(long id, const std::string& name,
+                     const std::string& labels,
+                     const std::function<double()>& read)
+{
+  GaugeRegistry& reg = gaugeRegistry();
+  std::lock_guard<std::mutex> lock(reg.mx);
+  reg.gauges.push_back(GaugeEntry{id, name, labels, read});
+}
+
+long addMetricGauge(const std::string& name, const std::string& labels,
+                    const std::function<double()>& read)
+{
+  long id = newGaugeId();
+  addGauge(id, name, labels, read);
+  return id;
+}
+
+void removeMetricGauges(long id)
+{
+  GaugeRegistry& reg = gaugeRegistry();
+  std::lock_guard<std::mutex> lock(reg.mx);
+  vector<GaugeEntry> kept;
+  for (GaugeEntry& g: reg.gauges)
+    if (g.id != id) kept.push_back(std::move(g));
+  reg.gauges.swap(kept);
+}
+
+long addCacheGauges(const EncryptedArray& ea, const std::string& labels)
+{
+  long id = newGaugeId();
+  if (ea.getTag() == PA_cx_tag) {
+    const CKKSConstCache* c = &ea.getCx().getConstCache();
+    addGauge(id, "helib_ckks_const_cache_entries", labels,
+             [c]{ return double(c->size()); });
+    addGauge(id, "helib_ckks_const_cache_pinned", labels,
+             [c]{ return double(c->numPinned()); });
+    addGauge(id, "helib_ckks_const_cache_hits", labels,
+             [c]{ return double(c->hits()); });
+    addGauge(id, "helib_ckks_const_cache_misses", labels,
+             [c]{ return double(c->misses()); });
+  }
+  else if (const MaskCache* c = ea.getMaskCache()) {
+    addGauge(id, "helib_mask_cache_entries", labels,
+             [c]{ return double(c->size()); });
+    addGauge(id, "helib_mask_cache_hits", labels,
+             [c]{ return double(c->hits()); });
+    addGauge(id, "helib_mask_cache_misses", labels,
+             [c]{ return double(c->misses()); });
+  }
+  return id;
+}
+
+// The gauges that are always there
+static void builtinGauges(vector<MetricsSnapshot::Gauge>& out)
+{
+  ConstMultiplierStats tier = getConstMultiplierStats();
+  out.push_back({"helib_const_multiplier_tier_entries", "",
+                 double(tier.entries)});
+  out.push_back({"helib_const_multiplier_tier_bytes", "", double(tier.bytes)});
+  out.push_back({"helib_const_multiplier_tier_hit_rate", "", tier.hitRate()});
+  out.push_back({"helib_key_switch_cache_bytes", "",
+                 double(getKeySwitchCacheSize())});
+  out.push_back({"helib_available_threads", "",
+                 double(fheAvailableThreads())});
+  TaskScheduler* ts = getTaskScheduler();
+  out.push_back({"helib_task_scheduler_threads", "",
+                 ts? double(ts->numThreads()) : 0.0});
+  out.push_back({"helib_task_scheduler_queued", "",
+                 ts? double(ts->numQueued()) : 0.0});
+}
+
+//======================== Snapshots ========================
+
+MetricsSnapshot readMetrics()
+{
+  MetricsSnapshot snap;
+  snap.uptime = metricClock() - startTime.load();
+  for (const MetricShard& s: shards) {
+    for (long c = 0; c < METRIC_COUNTER_COUNT; c++)
+      snap.counter[c] += s.counter[c].load(std::memory_order_relaxed);
+    for (long h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+      MetricHistogramSnapshot& hs = snap.histogram[h];
+      hs.count += s.count[h].load(std::memory_order_relaxed);
+      hs.sum += s.sumNanos[h].load(std::memory_order_relaxed) * 1e-9;
+      for (long b = 0; b < NB; b++)
+        hs.buckets[b] += s.bucket[h][b].load(std::memory_order_relaxed);
+    }
+  }
+
+  builtinGauges(snap.gauges);
+  GaugeRegistry& reg = gaugeRegistry();
+  std::lock_guard<std::mutex> lock(reg.mx);
+  for (const GaugeEntry& g: reg.gauges)
+    snap.gauges.push_back({g.name, g.labels, g.read()});
+  return snap;
+}
+
+static void writeNumber(ostream& str, double x)
+{
+  if (std::isinf(x)) str << (x > 0? "+Inf" : "-Inf");
+  else str << x;
+}
+
+void writeMetricsPrometheus(ostream& str, const MetricsSnapshot& snap)
+{
+  std::ios::fmtflags flags = str.flags();
+  std::streamsize prec = str.precision(15);
+
+  str << "# HELP helib_metrics_uptime_seconds Time since the metrics started\n"
+      << "# TYPE helib_metrics_uptime_seconds gauge\n"
+      << "helib_metrics_uptime_seconds " << snap.uptime << "\n";
+
+  for (long c = 0; c < METRIC_COUNTER_COUNT; c++) {
+    const char* name = metricCounterName(MetricCounter(c));
+    str << "# HELP " << name << " " << counterHelp(MetricCounter(c)) << "\n"
+        << "# TYPE " << name << " counter\n"
+        << name << " " << snap.counter[c] << "\n";
+  }
+
+  for (long h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+    const char* name = metricHistogramName(MetricHistogram(h));
+    const MetricHistogramSnapshot& hs = snap.histogram[h];
+    str << "# TYPE " << name << " histogram\n";
+    long cumulative = 0;
+    for (long b = 0; b < NB; b++) {
+      cumulative += hs.buckets[b];
+      str << name << "_bucket{le=\"";
+      writeNumber(str, MetricHistogramSnapshot::bound(b));
+      str << "\"} " << cumulative << "\n";
+    }
+    str << name << "_sum " << hs.sum << "\n"
+        << name << "_count " << hs.count << "\n";
+  }
+
+  // The gauges of one name together, under one TYPE line
+  std::map<std::string, vector<const MetricsSnapshot::Gauge*>> byName;
+  for (const MetricsSnapshot::Gauge& g: snap.gauges)
+    byName[g.name].push_back(&g);
+  for (const auto& entry: byName) {
+    str << "# TYPE " << entry.first << " gauge\n";
+    for (const MetricsSnapshot::Gauge* g: entry.second) {
+      str << g->name;
+      if (!g->labels.empty()) str << "{" << g->labels << "}";
+      str << " ";
+      writeNumber(str, g->value);
+      str << "\n";
+    }
+  }
+
+  str.precision(prec);
+  str.flags(flags);
+}
+
+// The labels may hold quotes
+static void writeJSONString(ostream& str, const std::string& s)
+{
+  str << '"';
+  for (char ch: s) {
+    if (ch == '"' || ch == '\\') str << '\\';
+    str << ch;
+  }
+  str << '"';
+}
+
+void writeMetricsJSON(ostream& str, const MetricsSnapshot& snap)
+{
+  std::streamsize prec = str.precision(15);
+  str << "{\"uptime\": " << snap.uptime << ", \"counters\": {";
+  for (long c = 0; c < METRIC_COUNTER_COUNT; c++)
+    str << (c? ", " : "") << "\"" << metricCounterName(MetricCounter(c))
+        << "\": " << snap.counter[c];
+
+  str << "}, \"histograms\": {";
+  for (long h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+    const MetricHistogramSnapshot& hs = snap.histogram[h];
+    str << (h? ", " : "") << "\"" << metricHistogramName(MetricHistogram(h))
+        << "\": {\"count\": " << hs.count << ", \"sum\": " << hs.sum
+        << ", \"buckets\": [";
+    for (long b = 0; b < NB; b++) str << (b? ", " : "") << hs.buckets[b];
+    str << "]}";
+  }
+
+  str << "}, \"gauges\": [";
+  for (long i = 0; i < lsize(snap.gauges); i++) {
+    const MetricsSnapshot::Gauge& g = snap.gauges[i];
+    str << (i? ", " : "") << "{\"name\": ";
+    writeJSONString(str, g.name);
+    str << ", \"labels\": ";
+    writeJSONString(str, g.labels);
+    str << ", \"value\": ";
+    if (std::isfinite(g.value)) str << g.value;
+    else str << "null";
+    str << "}";
+  }
+  str << "]}\n";
+  str.precision(prec);
+}
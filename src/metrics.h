@@ -0,0 +1,191 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _METRICS_H_
+#define _METRICS_H_
+/**
+ * @file metrics.h
+ * @brief Process-wide counters, latency histograms and gauges, for
+ * services that poll the library while it runs
+ *
+ * The timers of timing.h and the hooks of costModel.h and telemetry.h are
+ * meant for one program run, and print (or aggregate) at the end. The
+ * metrics here are instead running totals since the start of the process
+ * (or the last resetMetrics()), which a monitoring system reads every so
+ * often with readMetrics() and turns into rates, e.g., from the Prometheus
+ * text of writeMetricsPrometheus().
+ *
+ * After setMetricsOn(true) the library counts the key switchings,
+ * recryptions, FFT rows, new ciphertexts, the bytes of the ciphertexts it
+ * writes and the tasks of the TaskScheduler (with the time that its threads
+ * were busy running them), and records the latency of every key switching
+ * and recryption in a histogram. The counts are kept in a few cache-line
+ * padded shards that the threads share, so the threads seldom write to the
+ * same line, and they are summed when they are read. While the metrics are
+ * off (the default) each of these points costs one relaxed load.
+ *
+ * The gauges are read when a snapshot is taken: the built-in ones (the
+ * hot tier of ConstMultiplier, the key-switching cache and the task
+ * scheduler) and those that the application adds with addMetricGauge, for
+ * instance addCacheGauges for the mask and encoding caches of an
+ * EncryptedArray.
+ *
+ * Usage:
+ * \code
+ *   setMetricsOn(true);
+ *   long id = addCacheGauges(*context.ea, "context=\"bgv\"");
+ *   ...
+ *   // in the handler of the monitoring endpoint
+ *   writeMetricsPrometheus(out, readMetrics());
+ *   ...
+ *   removeMetricGauges(id); // before the context goes away
+ * \endcode
+ **/
+#include <vector>
+#include <string>
+#include <functional>
+#include <iostream>
+#include <atomic>
+
+class EncryptedArray;
+
+//! The counters, all of them totals since the start (or resetMetrics())
+enum MetricCounter {
+  METRIC_KEY_SWITCHES,      //!< calls of keySwitchDigits
+  METRIC_RECRYPTS,          //!< calls of reCrypt and thinReCrypt
+  METRIC_RECRYPTED_CTXTS,   //!< the ciphertexts in their batches
+  METRIC_FFT_ROWS,          //!< rows (one per prime) converted by FFT
+  METRIC_IFFT_ROWS,         //!< rows converted back by inverse FFT
+  METRIC_CTXTS_CREATED,     //!< new ciphertexts (not the copies)
+  METRIC_BYTES_SERIALIZED,  //!< by Ctxt::write, writeCompact and writeWire
+  METRIC_TASKS_RUN,         //!< tasks of the TaskScheduler
+  METRIC_TASK_BUSY_MICROS,  //!< the time spent running them, all threads
+  METRIC_COUNTER_COUNT
+};
+
+//! The latency histograms, in seconds
+enum MetricHistogram {
+  METRIC_KEY_SWITCH_SECONDS,
+  METRIC_RECRYPT_SECONDS,
+  METRIC_HISTOGRAM_COUNT
+};
+
+//! @brief The name of c, e.g., "helib_key_switches_total"
+const char* metricCounterName(MetricCounter c);
+//! @brief The name of h, e.g., "helib_key_switch_seconds"
+const char* metricHistogramName(MetricHistogram h);
+
+//! @brief One histogram: the bucket b counts the values in
+//! (bound(b-1), bound(b)], the bounds doubling from one microsecond, and
+//! the last bucket counts the rest
+struct MetricHistogramSnapshot {
+  static const long NBUCKETS = 32;
+
+  long count;
+  double sum;
+  long buckets[NBUCKETS];
+
+  MetricHistogramSnapshot();
+
+  //! The upper bound of bucket b, in seconds (infinite for the last one)
+  static double bound(long b);
+  //! An estimate of the q-quantile (0 <= q <= 1): the bound of the bucket
+  //! that holds it
+  double quantile(double q) const;
+};
+
+//! @brief The counters, histograms and gauges, at one time
+struct MetricsSnapshot {
+  struct Gauge {
+    std::string name, labels; // labels as in Prometheus, e.g. a="b"
+    double value;
+  };
+
+  double uptime; // seconds since the start (or resetMetrics())
+  long counter[METRIC_COUNTER_COUNT];
+  MetricHistogramSnapshot histogram[METRIC_HISTOGRAM_COUNT];
+  std::vector<Gauge> gauges;
+
+  MetricsSnapshot();
+};
+
+//! @brief Start (or stop) counting. The counts are kept while it is off.
+void setMetricsOn(bool on);
+bool areMetricsOn();
+
+//! @brief All the metrics, with the gauges read now. Thread-safe, and can
+//! be called while the library runs.
+MetricsSnapshot readMetrics();
+
+//! @brief Zero the counters and histograms (the gauges are not touched)
+void resetMetrics();
+
+//! @brief Add a gauge, read(), under name and labels. Returns its id,
+//! which removeMetricGauges takes. read is called by readMetrics, from the
+//! thread that calls it, and must not add or remove gauges.
+long addMetricGauge(const std::string& name, const std::string& labels,
+                    const std::function<double()>& read);
+
+//! @brief Remove the gauges added under id. When it returns, their read
+//! functions are not running and will not be called again.
+void removeMetricGauges(long id);
+
+//! @brief Gauges of the caches of ea: the entries, hits and misses of the
+//! mask cache (BGV) or of the CKKS constant cache. They are all added under
+//! one id, which is returned.
+long addCacheGauges(const EncryptedArray& ea, const std::string& labels="");
+
+//! @brief The snapshot in the Prometheus text format (version 0.0.4)
+void writeMetricsPrometheus(std::ostream& str, const MetricsSnapshot& snap);
+//! @brief The snapshot as a JSON object
+void writeMetricsJSON(std::ostream& str, const MetricsSnapshot& snap);
+
+//! \cond FALSE (make doxygen ignore these functions)
+extern std::atomic<bool> fheMetricsOn;
+
+void addMetricSlow(MetricCounter c, long n);
+void observeMetricSlow(MetricHistogram h, double seconds);
+double metricClock(); // seconds, monotonic
+
+// Called by the library
+inline void addMetric(MetricCounter c, long n=1)
+{ if (fheMetricsOn.load(std::memory_order_relaxed)) addMetricSlow(c, n); }
+
+// Observes the time from construction to destruction, if the metrics were
+// on at the start
+class MetricTimer {
+  MetricHistogram h;
+  double t0; // negative if off
+public:
+  explicit MetricTimer(MetricHistogram _h) : h(_h),
+    t0(fheMetricsOn.load(std::memory_order_relaxed)? metricClock() : -1.0) {}
+  ~MetricTimer()
+  { if (t0 >= 0) observeMetricSlow(h, metricClock() - t0); }
+
+  MetricTimer(const MetricTimer&) = delete;
+  MetricTimer& operator=(const MetricTimer&) = delete;
+};
+
+// Adds the bytes that str grew by while this lived, if the metrics are on
+// and str can tell its position
+class MetricBytesProbe {
+  std::ostream& str;
+  long p0; // negative if not counted
+public:
+  explicit MetricBytesProbe(std::ostream& _str);
+  ~MetricBytesProbe();
+
+  MetricBytesProbe(const MetricBytesProbe&) = delete;
+  MetricBytesProbe& operator=(const MetricBytesProbe&) = delete;
+};
+//! \endcond
+
+#endif // _METRICS_H_
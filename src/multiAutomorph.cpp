@@ -0,0 +1,261 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* multiAutomorph.cpp - automorphisms along a tree of key-switching steps
+ */
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <queue>
+#include <stdexcept>
+#include "multiAutomorph.h"
+#include "timing.h"
+#include "taskScheduler.h"
+
+NTL_CLIENT
+
+AutGraph::AutGraph(long _m) : m(_m)
+{
+  Node root;
+  root.k = root.step = 1;
+  root.parent = -1;
+  root.wanted = false;
+  nodes.push_back(root);
+}
+
+long AutGraph::addNode(long parent, long step, bool wanted)
+{
+  assert(parent >= 0 && parent < lsize(nodes));
+  Node node;
+  node.step = mcMod(step, m);
+  node.k = MulMod(nodes[parent].k, node.step, m);
+  node.parent = parent;
+  node.wanted = wanted;
+  nodes.push_back(node);
+  long i = lsize(nodes) - 1;
+  nodes[parent].children.push_back(i);
+  return i;
+}
+
+long AutGraph::depth() const
+{
+  vector<long> d(nodes.size(), 0);
+  long most = 0;
+  for (long i: range(1, lsize(nodes))) {
+    d[i] = d[nodes[i].parent] + 1;
+    most = max(most, d[i]);
+  }
+  return most;
+}
+
+long AutGraph::numInternal() const
+{
+  long n = 0;
+  for (const Node& node: nodes)
+    if (!node.children.empty()) n++;
+  return n;
+}
+
+// The steps X -> X^n that take one matrix of pubKey, as in setKeySwitchMap
+static vector<long> keySwitchingSteps(const FHEPubKey& pubKey, long keyID)
+{
+  vector<long> steps;
+  for (const KeySwitch& W: pubKey.keySWlist())
+    if (W.toKeyID == keyID && W.fromKey.getPowerOfS() == 1
+        && W.fromKey.getSecretKeyID() == keyID && pubKey.isFullKSWmatrix(W))
+      steps.push_back(W.fromKey.getPowerOfX());
+  sort(steps.begin(), steps.end());
+  steps.erase(unique(steps.begin(), steps.end()), steps.end());
+  return steps;
+}
+
+AutGraph buildAutGraph(const FHEPubKey& pubKey, const vector<long>& targets,
+                       long keyID)
+{
+  FHE_TIMER_START;
+  const PAlgebra& zMStar = pubKey.getContext().zMStar;
+  long m = zMStar.getM();
+  vector<long> steps = keySwitchingSteps(pubKey, keyID);
+  vector<long> inverse(steps.size());
+  for (long s: range(lsize(steps))) inverse[s] = InvMod(steps[s], m);
+
+  // The fewest steps from the identity to every automorphism
+  vector<long> dist(m, -1);
+  dist[1] = 0;
+  std::queue<long> bfs;
+  bfs.push(1);
+  while (!bfs.empty()) {
+    long x = bfs.front();
+    bfs.pop();
+    for (long n: steps) {
+      long y = MulMod(x, n, m);
+      if (dist[y] < 0) { dist[y] = dist[x] + 1; bfs.push(y); }
+    }
+  }
+
+  vector<bool> wanted(m, false);
+  long most = 0;
+  for (long k: targets) {
+    k = mcMod(k, m);
+    if (!zMStar.inZmStar(k) || dist[k] < 0)
+      throw std::logic_error("buildAutGraph: no key-switching matrices for k="
+                             + std::to_string(k));
+    if (k == 1) continue;
+    wanted[k] = true;
+    most = max(most, dist[k]);
+  }
+
+  // From the deepest level up, the nodes that a level needs (its targets
+  // and the parents of the level below) choose their parents on the level
+  // above: repeatedly the one that would take the most of them, counting a
+  // parent that is needed anyway first.
+  vector< vector<long> > needed(most+1);
+  for (long k: range(m))
+    if (wanted[k]) needed[dist[k]].push_back(k);
+  vector<long> parent(m, -1), step(m, 0);
+  vector<bool> isNeeded(wanted);
+  isNeeded[1] = true; // the root is always there
+  for (long lvl = most; lvl > 0; lvl--) {
+    vector<long> left = needed[lvl];
+    while (!left.empty()) {
+      std::map<long,long> takes; // candidate parent -> how many of left
+      for (long y: left)
+        for (long s: range(lsize(steps))) {
+          long x = MulMod(y, inverse[s], m);
+          if (dist[x] == lvl-1) takes[x]++;
+        }
+      long best = -1, bestCount = 0;
+      for (const auto& c: takes) {
+        long count = 2*c.second + (isNeeded[c.first]? 1 : 0);
+        if (count > bestCount) { best = c.first; bestCount = count; }
+      }
+      assert(best >= 0);
+      vector<long> rest;
+      for (long y: left) {
+        bool taken = false;
+        for (long s: range(lsize(steps)))
+          if (MulMod(best, steps[s], m) == y) {
+            parent[y] = best;
+            step[y] = steps[s];
+            taken = true;
+            break;
+          }
+        if (!taken) rest.push_back(y);
+      }
+      left.swap(rest);
+      if (!isNeeded[best]) {
+        isNeeded[best] = true;
+        needed[lvl-1].push_back(best);
+      }
+    }
+  }
+
+  // Insert the nodes level by level, so the parents come first
+  AutGraph tree(m);
+  vector<long> index(m, -1);
+  index[1] = 0;
+  for (long lvl: range(1, most+1)) {
+    sort(needed[lvl].begin(), needed[lvl].end());
+    for (long y: needed[lvl])
+      index[y] = tree.addNode(index[parent[y]], step[y], wanted[y]);
+  }
+  return tree;
+}
+
+vector<long> dimAutomorphs(const PAlgebra& zMStar, long dim)
+{
+  assert(dim >= -1 && dim < zMStar.numOfGens());
+  long D = (dim == -1)? zMStar.getOrdP() : zMStar.OrderOf(dim);
+  bool native = (dim == -1) || zMStar.SameOrd(dim);
+  vector<long> v;
+  for (long i: range(1, D)) {
+    v.push_back(zMStar.genToPow(dim, i));
+    if (!native) v.push_back(zMStar.genToPow(dim, i-D));
+  }
+  return v;
+}
+
+vector<long> slotAutomorphs(const PAlgebra& zMStar)
+{
+  vector<long> v;
+  for (long i: range(zMStar.getNSlots()))
+    if (zMStar.ith_rep(i) != 1) v.push_back(zMStar.ith_rep(i));
+  return v;
+}
+
+// Expand the tree one level at a time: the internal nodes of a level are
+// decomposed in parallel, then all their children are key-switched in
+// parallel. visit(i, c) is called for the wanted nodes, and a false return
+// leaves the nodes below i out.
+typedef std::function<bool(long, const shared_ptr<Ctxt>&)> AutVisitor;
+static void expandTree(const Ctxt& ctxt, const AutGraph& tree,
+                       const AutVisitor& visit)
+{
+  vector<long> level(1, 0);
+  vector< shared_ptr<Ctxt> > have(1, make_shared<Ctxt>(ctxt));
+
+  while (!level.empty()) {
+    long ni = lsize(level);
+    vector< unique_ptr<BasicAutomorphPrecon> > precon(ni);
+    FHE_EXEC_RANGE(ni, first, last)
+      for (long i: range(first, last))
+        precon[i].reset(new BasicAutomorphPrecon(*have[i]));
+    FHE_EXEC_RANGE_END
+    have.clear();
+
+    vector<long> jobParent, jobChild;
+    for (long i: range(ni))
+      for (long c: tree[level[i]].children) {
+        jobParent.push_back(i);
+        jobChild.push_back(c);
+      }
+    long nj = lsize(jobChild);
+    vector< shared_ptr<Ctxt> > next(nj);
+    vector<char> expand(nj, 0);
+    FHE_EXEC_RANGE(nj, first, last)
+      for (long j: range(first, last)) {
+        const AutGraph::Node& node = tree[jobChild[j]];
+        next[j] = precon[jobParent[j]]->automorph(node.step);
+        expand[j] = !node.wanted || visit(jobChild[j], next[j]);
+      }
+    FHE_EXEC_RANGE_END
+    precon.clear();
+
+    level.clear();
+    for (long j: range(nj))
+      if (expand[j] && !tree[jobChild[j]].children.empty()) {
+        level.push_back(jobChild[j]);
+        have.push_back(next[j]);
+      }
+  }
+}
+
+void multiAutomorph(const Ctxt& ctxt, const AutGraph& tree,
+                    AutomorphHandler& handler)
+{
+  FHE_TIMER_START;
+  assert(tree.getM() == ctxt.getContext().zMStar.getM());
+  expandTree(ctxt, tree, [&tree, &handler](long i, const shared_ptr<Ctxt>& c) {
+    return handler.handle(*c, tree[i].k);
+  });
+}
+
+void multiAutomorph(vector< shared_ptr<Ctxt> >& out, const Ctxt& ctxt,
+                    const AutGraph& tree)
+{
+  FHE_TIMER_START;
+  assert(tree.getM() == ctxt.getContext().zMStar.getM());
+  out.assign(tree.size(), nullptr);
+  expandTree(ctxt, tree, [&out](long i, const shared_ptr<Ctxt>& c) {
+    out[i] = c; // shared with the tree only until the next level
+    return true;
+  });
+}
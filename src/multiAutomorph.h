@@ -0,0 +1,110 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _MULTI_AUTOMORPH_H_
+#define _MULTI_AUTOMORPH_H_
+/**
+ * @file multiAutomorph.h
+ * @brief Many automorphisms of one ciphertext, along a tree of single
+ * key-switching steps.
+ *
+ * An AutGraph is a tree rooted at the identity: each node is an
+ * automorphism X -> X^k of the input, reached from its parent by one step
+ * X -> X^step for which the public key has a key-switching matrix, so k is
+ * the product of the steps on its path (mod m). multiAutomorph computes the
+ * nodes one level at a time. Every internal node is decomposed into digits
+ * once and all its children are key-switched from these digits, which is
+ * the hoisting of BasicAutomorphPrecon. The nodes of a level, and the
+ * children of all of them, are computed in parallel.
+ *
+ * buildAutGraph chooses the tree for a set of automorphisms from the
+ * matrices that the key has: a breadth-first search, so every target is
+ * reached in the fewest key-switchings (which is also the noise it gets),
+ * with the new nodes of a level put under as few parents as possible, so
+ * that the digits of a parent serve many children. With the matrices of
+ * addSome1DMatrices, the rotations of a dimension form a tree of depth
+ * two: baby steps from the root and giant steps with baby steps below.
+ **/
+#include <vector>
+#include "FHE.h"
+
+//! @class AutGraph
+//! @brief A tree of automorphisms, see multiAutomorph.h
+class AutGraph {
+public:
+  struct Node {
+    long k;      // the automorphism X -> X^k of the input
+    long step;   // k = parent's k * step mod m, 1 for the root
+    long parent; // -1 for the root
+    bool wanted; // the caller asked for k (not only a way to others)
+    std::vector<long> children;
+  };
+
+private:
+  long m;
+  std::vector<Node> nodes; // nodes[0] is the root, the parents come first
+
+public:
+  //! @brief Only the root, the identity
+  explicit AutGraph(long m);
+
+  //! @brief A child of node parent, by the step X -> X^step. Returns its
+  //! index in the graph.
+  long addNode(long parent, long step, bool wanted=true);
+
+  long getM() const { return m; }
+  long size() const { return nodes.size(); }
+  const Node& operator[](long i) const { return nodes.at(i); }
+
+  //! @brief The most steps from the root to a node
+  long depth() const;
+  //! @brief The number of nodes with children, i.e., of decompositions
+  long numInternal() const;
+};
+
+//! @brief The tree of buildAutGraph for the automorphisms in targets (k=1
+//! and repeats are ignored), using the matrices of pubKey from keyID to
+//! itself. Raises std::logic_error if some target cannot be reached.
+AutGraph buildAutGraph(const FHEPubKey& pubKey,
+                       const std::vector<long>& targets, long keyID=0);
+
+//! @brief The automorphisms genToPow(dim, i) for 0 < i < D, which rotate
+//! along dimension dim (dim=-1 is Frobenius). A dimension that is not
+//! native also needs genToPow(dim, i-D), which are included.
+std::vector<long> dimAutomorphs(const PAlgebra& zMStar, long dim);
+
+//! @brief All the automorphisms of the hypercube, the representatives of
+//! the slots but 1, which move any slot to any other
+std::vector<long> slotAutomorphs(const PAlgebra& zMStar);
+
+//! @class AutomorphHandler
+//! @brief Receives the results of multiAutomorph
+class AutomorphHandler {
+public:
+  virtual ~AutomorphHandler() {}
+
+  //! @brief ctxt is the input after X -> X^k, for a node that the caller
+  //! wanted. Return false to skip the nodes below it. This is called from
+  //! several threads at once, for different nodes.
+  virtual bool handle(const Ctxt& ctxt, long k) = 0;
+};
+
+//! @brief Compute the automorphisms of ctxt along the tree, handing each
+//! wanted one to handler as soon as its level is done
+void multiAutomorph(const Ctxt& ctxt, const AutGraph& tree,
+                    AutomorphHandler& handler);
+
+//! @brief out[i] = ctxt after the automorphism of node i, for the nodes
+//! that are wanted (the others are null)
+void multiAutomorph(std::vector<std::shared_ptr<Ctxt>>& out,
+                    const Ctxt& ctxt, const AutGraph& tree);
+
+#endif // ifndef _MULTI_AUTOMORPH_H_
@@ -90,6 +90,16 @@ void embedInSlots(zzX& f, const std::vector<cx_double>& v,
 // but embedInSlots(f,v,palg,1.0,strictInverse=false) may fail to recover
 // the same f.
 
+//! Batch versions of canonicalEmbedding and embedInSlots, for many inputs
+//! at once. The inputs are split between the threads of the NTL thread
+//! pool, one whole transform at a time.
+void canonicalEmbedding(std::vector< std::vector<cx_double> >& v,
+                        const std::vector<zzX>& f, const PAlgebra& palg);
+void embedInSlots(std::vector<zzX>& f,
+                  const std::vector< std::vector<cx_double> >& v,
+                  const PAlgebra& palg,
+                  double scaling=1.0, bool strictInverse=false);
+
 #endif // FFT_IMPL
 
 #endif // _NORMS_H_
@@ -0,0 +1,253 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* numa.cpp - NUMA topology, thread pinning and memory placement
+ */
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <cstdint>
+#include <NTL/BasicThreadPool.h>
+#include "FHE.h"
+#include "numa.h"
+
+#if defined(__linux__) && !defined(FHE_NO_NUMA)
+#define FHE_NUMA_SUPPORTED
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+// from <numaif.h>, which is part of libnuma
+#define FHE_MPOL_PREFERRED  1
+#define FHE_MPOL_INTERLEAVE 3
+#define FHE_MPOL_MF_MOVE    (1 << 1)
+#endif
+
+NTL_CLIENT
+
+//======================== the topology ========================
+
+// Parse a list of ranges such as "0-3,8,10-11"
+static void parseRanges(vector<long>& out, const string& s)
+{
+  out.clear();
+  std::stringstream ss(s);
+  string item;
+  while (std::getline(ss, item, ',')) {
+    if (item.empty() || item == "\n") continue;
+    long lo, hi;
+    size_t dash = item.find('-');
+    lo = atol(item.c_str());
+    hi = (dash == string::npos)? lo : atol(item.c_str()+dash+1);
+    for (long i = lo; i <= hi; i++) out.push_back(i);
+  }
+}
+
+static bool readLine(string& line, const string& fileName)
+{
+  ifstream f(fileName);
+  return f && std::getline(f, line);
+}
+
+static NumaTopology readTopology()
+{
+  NumaTopology topo;
+#ifdef FHE_NUMA_SUPPORTED
+  string line;
+  vector<long> ids;
+  if (readLine(line, "/sys/devices/system/node/online"))
+    parseRanges(ids, line);
+  for (long id: ids) {
+    vector<long> cpus;
+    std::stringstream name;
+    name << "/sys/devices/system/node/node" << id << "/cpulist";
+    if (!readLine(line, name.str())) continue;
+    parseRanges(cpus, line);
+    if (cpus.empty()) continue; // a node with memory only
+    topo.nodeIds.push_back(id);
+    topo.cpus.push_back(cpus);
+  }
+#endif
+  if (topo.nodes() == 0) { // one node with all the CPUs
+    topo.nodeIds.assign(1, 0);
+    topo.cpus.resize(1);
+    long n = std::max(1L, long(std::thread::hardware_concurrency()));
+    for (long i: range(n)) topo.cpus[0].push_back(i);
+  }
+  return topo;
+}
+
+static NumaTopology& topologyRef()
+{
+  static NumaTopology topo = readTopology();
+  return topo;
+}
+
+const NumaTopology& getNumaTopology() { return topologyRef(); }
+
+void setNumaTopology(const NumaTopology& topo)
+{
+  assert(topo.nodes() > 0 && long(topo.cpus.size()) == topo.nodes());
+  topologyRef() = topo;
+}
+
+//======================== the policy ========================
+
+static NumaPolicy numaPolicy;
+static std::atomic_bool placingRows(false);
+static std::atomic_long statBytes(0), statCalls(0), statFailures(0);
+
+const NumaPolicy& getNumaPolicy() { return numaPolicy; }
+
+bool isNumaPlacingRows()
+{ return placingRows.load(std::memory_order_relaxed); }
+
+long numaNodeOfThread(long t, long nThreads)
+{
+  long nNodes = getNumaTopology().nodes();
+  if (nNodes <= 1 || nThreads <= 1) return 0;
+  return std::min(nNodes-1, (t*nNodes)/nThreads);
+}
+
+long numaNodeOfRow(long j, long nRows)
+{
+  PartitionInfo pinfo(nRows);
+  for (long i: range(pinfo.NumIntervals())) {
+    long first, last;
+    pinfo.interval(first, last, i);
+    if (j < last) return numaNodeOfThread(i, AvailableThreads());
+  }
+  return 0;
+}
+
+// Restrict the calling thread to the CPUs of node
+static bool pinToNode(long node)
+{
+#ifdef FHE_NUMA_SUPPORTED
+  const vector<long>& cpus = getNumaTopology().cpus[node];
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (long c: cpus) if (c >= 0 && c < CPU_SETSIZE) CPU_SET(c, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+bool setNumaPolicy(const NumaPolicy& policy)
+{
+  numaPolicy = policy;
+  bool multi = getNumaTopology().nodes() > 1;
+  placingRows = policy.placeRows && multi;
+  if (!policy.pinThreads || !multi) return true;
+
+  long nt = AvailableThreads();
+  std::atomic_bool ok(true);
+  NTL_EXEC_INDEX(nt, index) // index t runs on the t'th thread of the pool
+    if (!pinToNode(numaNodeOfThread(index, nt))) ok = false;
+  NTL_EXEC_INDEX_END
+  return ok;
+}
+
+//======================== placing memory ========================
+
+bool numaPlace(const void *p, long bytes, long node, bool move)
+{
+#ifdef FHE_NUMA_SUPPORTED
+  const NumaTopology& topo = getNumaTopology();
+  assert(node >= -1 && node < topo.nodes());
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = reinterpret_cast<uintptr_t>(p);
+  uintptr_t end = start + bytes;
+  start = (start + page-1) / page * page; // whole pages only
+  end = end / page * page;
+  if (end <= start) return true;
+
+  const long maskWords = 16, wordBits = 8*sizeof(unsigned long);
+  unsigned long mask[maskWords] = {0};
+  bool inRange = true;
+  for (long i: range(topo.nodes())) {
+    if (node >= 0 && i != node) continue;
+    long id = topo.nodeIds[i];
+    if (id < 0 || id >= maskWords*wordBits) inRange = false;
+    else mask[id / wordBits] |= 1UL << (id % wordBits);
+  }
+  long mode = (node < 0)? FHE_MPOL_INTERLEAVE : FHE_MPOL_PREFERRED;
+  long r = !inRange? -1 :
+    syscall(SYS_mbind, start, end-start, mode, mask,
+            maskWords*wordBits, move? FHE_MPOL_MF_MOVE : 0);
+  statCalls++;
+  if (r != 0) {
+    statFailures++;
+    return false;
+  }
+  statBytes += end-start;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void numaPlaceRows(const long *slab, long stride, long nRows, bool move)
+{
+  if (getNumaTopology().nodes() <= 1
+      || nRows*stride*long(sizeof(long)) < FHE_NUMA_MIN_BYTES) return;
+
+  // one call per run of consecutive threads on the same node
+  PartitionInfo pinfo(nRows);
+  long nt = AvailableThreads();
+  long runStart = 0, runNode = -1;
+  for (long i: range(pinfo.NumIntervals())) {
+    long first, last;
+    pinfo.interval(first, last, i);
+    long node = numaNodeOfThread(i, nt);
+    if (node != runNode) {
+      if (runNode >= 0)
+        numaPlace(slab + runStart*stride, (first-runStart)*stride*sizeof(long),
+                  runNode, move);
+      runStart = first;
+      runNode = node;
+    }
+  }
+  if (runNode >= 0)
+    numaPlace(slab + runStart*stride, (nRows-runStart)*stride*sizeof(long),
+              runNode, move);
+}
+
+void numaPlaceKeys(const FHEPubKey& key)
+{
+  NumaKeyPolicy keys = numaPolicy.keys;
+  if (keys == NUMA_KEYS_DEFAULT || getNumaTopology().nodes() <= 1) return;
+  for (const KeySwitch& W: key.keySWlist())
+    for (const DoubleCRT& b: W.b) {
+      const RowSlab& rows = b.getMap();
+      const IndexSet& s = rows.getIndexSet();
+      if (rows.isView() || empty(s)) continue; // mapped from a file
+      const long *first = rows[s.first()];
+      long n = card(s);
+      if (keys == NUMA_KEYS_INTERLEAVE)
+        numaPlace(first, n*rows.getStride()*sizeof(long), -1, /*move=*/true);
+      else
+        numaPlaceRows(first, rows.getStride(), n, /*move=*/true);
+    }
+}
+
+NumaStats getNumaStats()
+{
+  NumaStats s;
+  s.placedBytes = statBytes;
+  s.calls = statCalls;
+  s.failures = statFailures;
+  return s;
+}
+
+void resetNumaStats() { statBytes = statCalls = statFailures = 0; }
@@ -0,0 +1,118 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _FHE_NUMA_H_
+#define _FHE_NUMA_H_
+/**
+ * @file numa.h
+ * @brief NUMA-aware placement of the NTL threads and of the DoubleCRT rows
+ *
+ * The loops over the primes of a DoubleCRT (the NTTs, the pointwise
+ * arithmetic, the inner products of key-switching) hand the rows to the
+ * threads in contiguous blocks: with NTL_EXEC_RANGE(n) the t'th thread
+ * gets the t'th interval of PartitionInfo(n). On a machine with several
+ * NUMA nodes, setNumaPolicy() lines the memory up with that split:
+ *  - pinThreads pins thread t of the pool to all the CPUs of node
+ *    t*nNodes/nThreads, so the first threads share the first socket, etc.
+ *  - placeRows sets the memory policy of the rows of every new large
+ *    DoubleCRT so that each row is on the node of the thread that
+ *    processes it (numaNodeOfRow), before its pages are first touched.
+ *  - keys chooses where numaPlaceKeys() moves the key-switching matrices:
+ *    interleaved over all the nodes, or each row on the node of its thread,
+ *    as for ciphertexts.
+ *
+ * The topology is read from /sys/devices/system/node, and the memory is
+ * placed with the mbind system call, so no library is needed. Elsewhere
+ * (or with -DFHE_NO_NUMA) everything is one node and nothing is done.
+ *
+ * Only slabs of at least FHE_NUMA_MIN_BYTES are placed: the allocator maps
+ * such buffers by themselves, so changing the policy of their pages does
+ * not split the mappings of the heap that smaller objects share.
+ **/
+#include <vector>
+
+class FHEPubKey;
+
+//! Smallest buffer (in bytes) whose rows placeRows places
+#ifndef FHE_NUMA_MIN_BYTES
+#define FHE_NUMA_MIN_BYTES (1L << 20)
+#endif
+
+//! @brief The NUMA nodes and their CPUs
+struct NumaTopology {
+  std::vector<long> nodeIds;             // the node numbers of the OS
+  std::vector< std::vector<long> > cpus; // cpus[i] are on node nodeIds[i]
+
+  long nodes() const { return nodeIds.size(); }
+};
+
+//! @brief The topology of this machine (read once), or the one that was set
+const NumaTopology& getNumaTopology();
+
+//! @brief Use another topology, e.g. to test the placement on a machine
+//! with a single node. Not thread-safe: call it before any computation.
+void setNumaTopology(const NumaTopology& topo);
+
+//! Where numaPlaceKeys puts the key-switching matrices
+enum NumaKeyPolicy {
+  NUMA_KEYS_DEFAULT,    //!< leave them where they are
+  NUMA_KEYS_INTERLEAVE, //!< interleave their pages over all the nodes
+  NUMA_KEYS_BY_PRIME    //!< each row on the node of the thread of its prime
+};
+
+struct NumaPolicy {
+  bool pinThreads;
+  bool placeRows;
+  NumaKeyPolicy keys;
+
+  NumaPolicy(): pinThreads(false), placeRows(false), keys(NUMA_KEYS_DEFAULT) {}
+};
+
+//! @brief Apply the policy. The threads are pinned right away, so call it
+//! after SetNumThreads (and again if the pool changes). The calling thread
+//! is thread 0 of the pool and is pinned too. Returns false if some of it
+//! could not be applied (e.g., pinning is not supported).
+bool setNumaPolicy(const NumaPolicy& policy);
+const NumaPolicy& getNumaPolicy();
+
+//! @brief The node (an index into getNumaTopology()) of thread t, out of
+//! nThreads
+long numaNodeOfThread(long t, long nThreads);
+
+//! @brief The node of the thread that NTL_EXEC_RANGE(nRows) with the
+//! current pool gives row j
+long numaNodeOfRow(long j, long nRows);
+
+//! @brief Place the pages of [p, p+bytes) on a node, or interleave them
+//! over all the nodes for node=-1. With move, pages that are already
+//! there are migrated, otherwise the policy applies to new pages only.
+bool numaPlace(const void *p, long bytes, long node, bool move);
+
+//! @brief Place nRows rows, stride longs apart from slab, as placeRows
+//! does. Used by RowSlab.
+void numaPlaceRows(const long *slab, long stride, long nRows, bool move);
+
+//! @brief Move the key-switching matrices of key as policy.keys says
+void numaPlaceKeys(const FHEPubKey& key);
+
+//! @brief Is placeRows on (and is there more than one node)?
+bool isNumaPlacingRows();
+
+//! @brief How much was placed, and how many mbind calls failed
+struct NumaStats {
+  long placedBytes;
+  long calls;
+  long failures;
+};
+NumaStats getNumaStats();
+void resetNumaStats();
+
+#endif // _FHE_NUMA_H_
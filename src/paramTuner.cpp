@@ -0,0 +1,313 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/**
+ * @file paramTuner.cpp
+ * @brief Choosing parameters for a circuit by benchmarking candidates.
+ */
+#include <cassert>
+#include <climits>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include "FHE.h"
+#include "EncryptedArray.h"
+#include "paramTuner.h"
+
+NTL_CLIENT
+
+// Known-good bootstrappable parameters for p=2 (the same sets as in
+// Test_bootstrapping), as {phi(m), m, d, m1, m2, m3, g1, g2, g3,
+// ord1, ord2, ord3, c_m}
+static const long bootParams[][13] = {
+  {    48,   105, 12,  3,  35,  0,    71,    76,    0,  2,  2,   0, 100},
+  {   600,  1023, 10, 11,  93,  0,   838,   584,    0, 10,  6,   0, 100},
+  {  1200,  1705, 20, 11, 155,  0,   156,   936,    0, 10,  6,   0, 100},
+  {  1728,  4095, 12,  7,  5, 117,  2341,  3277, 3641,  6,  4,   6, 100},
+  {  2304,  4641, 24,  7,  3, 221,  3979,  3095, 3760,  6,  2,  -8, 300},
+  {  4096,  4369, 16, 17, 257,  0,   258,  4115,    0, 16,-16,   0, 100},
+  { 12800, 17425, 40, 41, 425,  0,  5951,  8078,    0, 40, -8,   0, 100},
+  { 15004, 15709, 22, 23, 683,  0,  4099, 13663,    0, 22, 31,   0, 100},
+  { 16384, 21845, 16, 17,   5,257,  8996, 17477, 21591, 16, 4, -16, 200},
+  { 18000, 18631, 25, 31, 601,  0, 15627,  1334,    0, 30, 24,   0, 100},
+  { 18816, 24295, 28, 43, 565,  0, 16386, 16427,    0, 42, 16,   0, 100},
+  { 21168, 27305, 28, 43, 635,  0, 10796, 26059,    0, 42, 18,   0, 100},
+  { 23040, 28679, 24, 17,  7, 241, 15184,  4098,28204, 16,  6, -10, 200},
+  { 24000, 31775, 20, 41, 775,  0,  6976, 24806,    0, 40, 30,   0, 100},
+  { 26400, 27311, 55, 31, 881,  0, 21145,  1830,    0, 30, 16,   0, 100},
+  { 27000, 32767, 15, 31,   7,151, 11628, 28087,25824, 30,  6, -10, 200},
+  { 31104, 35113, 36, 37, 949,  0, 16134,  8548,    0, 36, 24,   0, 200},
+  { 34848, 45655, 44, 23,1985,  0, 33746, 27831,    0, 22, 36,   0, 100},
+  { 42336, 42799, 21,127, 337,  0, 25276, 40133,    0,126, 16,   0, 200},
+  { 45360, 46063, 45, 73, 631,  0, 35337, 20222,    0, 72, 14,   0, 100},
+  { 46080, 53261, 24, 17,  13,241, 43863, 28680,15913, 16, 12, -10, 100},
+  { 49500, 49981, 30,151, 331,  0,  6952, 28540,    0,150, 11,   0, 100},
+  { 54000, 55831, 25, 31,1801,  0, 19812, 50593,    0, 30, 72,   0, 100},
+  { 60016, 60787, 22, 89, 683,  0,  2050, 58741,    0, 88, 31,   0, 200}
+};
+
+// How many m's to keep for each value of c
+static const long tunerMsPerC = 3;
+
+// Disregard m where the order of p is larger than this (as in params.cpp)
+static const long tunerMaxOrd = 100;
+
+// An initial guess for the bits that one level uses, the benchmark measures
+// the actual number and grows the chain if needed
+static long initialBitsPerLevel(const CircuitProfile& prof)
+{
+  return 20 + 2*NumBits(power_long(prof.p, prof.r));
+}
+
+// The least phi(m) for which a chain of nBits (plus the special primes, of
+// about nBits/c bits) has the target security, see FindM
+static long minPhim(const CircuitProfile& prof, long nBits, long c)
+{
+  return long(ceil(nBits*(1.0+1.0/c)*(prof.security+110)/7.2));
+}
+
+// A rough cost per slot of one level, used only to choose which candidates
+// to benchmark: a key-switching is about phi(m)*log(phi(m)) times the size
+// of the chain and the special primes, and a rotation needs about one
+// (FULL), one and a half (BSGS) or two (MIN) key-switchings
+static double staticCost(const TunerCandidate& cand,
+                         const CircuitProfile& prof)
+{
+  double ksPerRotation = (cand.ksStrategy==FHE_KSS_FULL)? 1.0
+    : (cand.ksStrategy==FHE_KSS_BSGS)? 1.5 : 2.0;
+  double perKS = cand.phim * log2(double(cand.phim))
+    * cand.nBits * (1.0+1.0/cand.c);
+  double perLevel = perKS*(prof.multsPerLevel
+                           + ksPerRotation*prof.rotationsPerLevel);
+  return perLevel / cand.nSlots;
+}
+
+// Candidates for m (with their factorization, when bootstrapping)
+static void candidateMs(std::vector<TunerCandidate>& ms,
+                        const CircuitProfile& prof, long N)
+{
+  ms.clear();
+  if (prof.bootstrap) { // from the table, the smallest ones that fit
+    if (prof.p != 2) return;
+    for (const auto& vals: bootParams) {
+      if (vals[0] < N || vals[1] > prof.maxM) continue;
+      if (vals[0]/vals[2] < prof.minSlots) continue;
+      TunerCandidate cand;
+      cand.m = vals[1];
+      cand.phim = vals[0];
+      cand.nSlots = vals[0]/vals[2];
+      for (long i=3; i<6; i++) if (vals[i]>1) append(cand.mvec, vals[i]);
+      for (long i=6; i<9; i++) if (vals[i]>1) cand.gens.push_back(vals[i]);
+      for (long i=9; i<12; i++)
+        if (abs(vals[i])>1) cand.ords.push_back(vals[i]);
+      cand.cM = vals[12]/100.0;
+      ms.push_back(cand);
+      if (lsize(ms) >= tunerMsPerC) break;
+    }
+    return;
+  }
+
+  // Otherwise scan m in [N, 3N], keeping the ones with the lowest cost per
+  // slot of the FFTs
+  long hi = std::min(3*N, std::min(prof.maxM, NTL_SP_BOUND-1));
+  for (long m = std::max(N, 3L); m <= hi; m++) {
+    if (GCD(m, prof.p) != 1) continue;
+    long phim = phi_N(m);
+    if (phim < N) continue;
+    long d = multOrd(prof.p, m);
+    if (d > tunerMaxOrd || phim/d < prof.minSlots) continue;
+
+    TunerCandidate cand;
+    cand.m = m;
+    cand.phim = phim;
+    cand.nSlots = phim/d;
+    ms.push_back(cand);
+  }
+  auto perSlot = [](const TunerCandidate& a) {
+    return a.phim*log2(double(a.phim))/a.nSlots;
+  };
+  std::sort(ms.begin(), ms.end(),
+            [&](const TunerCandidate& a, const TunerCandidate& b)
+            { return perSlot(a) < perSlot(b); });
+  if (lsize(ms) > tunerMsPerC) ms.resize(tunerMsPerC);
+}
+
+void enumerateCandidates(std::vector<TunerCandidate>& cands,
+                         const CircuitProfile& prof, long maxCandidates)
+{
+  assert(prof.depth > 0 && prof.r > 0);
+  long bpl = initialBitsPerLevel(prof);
+  long nBits = prof.bootstrap? 600 + prof.depth*bpl : (prof.depth+2)*bpl;
+
+  std::vector<long> strategies;
+  strategies.push_back(FHE_KSS_BSGS);
+  if (prof.rotationsPerLevel > 0) {
+    strategies.push_back(FHE_KSS_FULL);
+    strategies.push_back(FHE_KSS_MIN);
+  }
+
+  cands.clear();
+  for (long c = 2; c <= 4; c++) {
+    std::vector<TunerCandidate> ms;
+    candidateMs(ms, prof, minPhim(prof, nBits, c));
+    for (const TunerCandidate& mc: ms)
+      for (long ks: strategies) {
+        TunerCandidate cand = mc;
+        cand.nBits = nBits;
+        cand.c = c;
+        cand.ksStrategy = ks;
+        cands.push_back(cand);
+      }
+  }
+
+  std::stable_sort(cands.begin(), cands.end(),
+                   [&](const TunerCandidate& a, const TunerCandidate& b)
+                   { return staticCost(a, prof) < staticCost(b, prof); });
+  if (lsize(cands) > maxCandidates) cands.resize(maxCandidates);
+}
+
+// The average time of body(), at least minTime seconds of it after one
+// untimed call. prep() runs before each call and is not timed.
+template<class Body, class Prep>
+static double timeOp(const Body& body, const Prep& prep, double minTime)
+{
+  prep(); body(); // warm-up
+  double total = 0;
+  long n = 0;
+  do {
+    prep();
+    auto start = std::chrono::steady_clock::now();
+    body();
+    std::chrono::duration<double> d = std::chrono::steady_clock::now()-start;
+    total += d.count();
+    n++;
+  } while (total < minTime);
+  return total/n;
+}
+
+static void addKeySwitching(FHESecKey& sKey, long strategy)
+{
+  switch (strategy) {
+  case FHE_KSS_FULL:
+    addSome1DMatrices(sKey, LONG_MAX);
+    addSomeFrbMatrices(sKey, LONG_MAX);
+    break;
+  case FHE_KSS_MIN:
+    addMinimal1DMatrices(sKey);
+    addMinimalFrbMatrices(sKey);
+    break;
+  default:
+    addSome1DMatrices(sKey);
+    addSomeFrbMatrices(sKey);
+  }
+}
+
+// Try a few times to grow the chain, if the circuit does not fit
+static const long tunerMaxAttempts = 4;
+
+void benchmarkCandidate(TunerCandidate& cand, const CircuitProfile& prof,
+                        double minTime, bool verbose)
+{
+  cand.feasible = false;
+  for (long attempt = 0; attempt < tunerMaxAttempts; attempt++) {
+    FHEcontext context(cand.m, prof.p, prof.r, cand.gens, cand.ords);
+    context.zMStar.set_cM(cand.cM);
+    buildModChain(context, cand.nBits, cand.c, prof.bootstrap);
+    if (prof.bootstrap) context.makeBootstrappable(cand.mvec);
+    cand.security = context.securityLevel();
+    if (cand.security < prof.security) {
+      if (verbose) cerr << "  m="<<cand.m<<", nBits="<<cand.nBits
+                        << ": security "<<cand.security<<" is too low\n";
+      return;
+    }
+
+    FHESecKey sKey(context);
+    sKey.GenSecKey(64);
+    addKeySwitching(sKey, cand.ksStrategy);
+    if (prof.bootstrap) sKey.genRecryptData();
+    const EncryptedArray& ea = *context.ea;
+
+    long p2r = context.alMod.getPPowR();
+    std::vector<long> v(ea.size());
+    for (long& x: v) x = RandomBnd(p2r);
+    Ctxt start(sKey);
+    ea.encrypt(start, sKey, v);
+    if (prof.bootstrap) sKey.reCrypt(start);
+
+    // The capacity that a level uses, measured over two squarings
+    Ctxt t(start);
+    double cap0 = t.capacity()/log(2.0);
+    for (long i=0; i<2; i++) t.square();
+    cand.bitsPerLevel = (cap0 - t.capacity()/log(2.0))/2;
+
+    // Keep one level of room for decryption (or for the next recryption)
+    double need = (prof.depth+1)*cand.bitsPerLevel;
+    if (cap0 < need) {
+      if (verbose) cerr << "  m="<<cand.m<<", nBits="<<cand.nBits
+                        << ": capacity "<<cap0<<" < "<<need<<endl;
+      cand.nBits += long(ceil(need - cap0)) + 10;
+      continue;
+    }
+
+    cand.tMul = timeOp([&]() { t.multiplyBy(start); },
+                       [&]() { t = start; }, minTime);
+    cand.tRotate = 0;
+    if (ea.size() > 1) {
+      long k = 0;
+      cand.tRotate = timeOp([&]() { ea.rotate(t, k); },
+                            [&]() { t = start; k = 1+RandomBnd(ea.size()-1); },
+                            minTime);
+    }
+    cand.tRecrypt = 0;
+    if (prof.bootstrap)
+      cand.tRecrypt = timeOp([&]() { sKey.reCrypt(t); },
+                             [&]() { t = start; }, minTime);
+
+    double blockTime = prof.depth*(prof.multsPerLevel*cand.tMul
+                                   + prof.rotationsPerLevel*cand.tRotate)
+                       + cand.tRecrypt;
+    cand.throughput = cand.nSlots*prof.depth / std::max(blockTime, 1e-12);
+    cand.feasible = true;
+    return;
+  }
+}
+
+void tuneParams(std::vector<TunerCandidate>& ranked,
+                const CircuitProfile& prof, long maxCandidates,
+                double minTime, bool verbose)
+{
+  enumerateCandidates(ranked, prof, maxCandidates);
+  for (TunerCandidate& cand: ranked) {
+    benchmarkCandidate(cand, prof, minTime, verbose);
+    if (verbose) cerr << cand << endl;
+  }
+  std::stable_sort(ranked.begin(), ranked.end(),
+                   [](const TunerCandidate& a, const TunerCandidate& b) {
+                     if (a.feasible != b.feasible) return a.feasible;
+                     return a.throughput > b.throughput;
+                   });
+}
+
+ostream& operator<<(ostream& str, const TunerCandidate& cand)
+{
+  const char *ks = (cand.ksStrategy==FHE_KSS_FULL)? "full"
+    : (cand.ksStrategy==FHE_KSS_MIN)? "min" : "bsgs";
+  str << "m=" << cand.m;
+  if (cand.mvec.length() > 0) str << " mvec=" << cand.mvec;
+  str << " nBits=" << cand.nBits << " c=" << cand.c << " ks=" << ks
+      << " phim=" << cand.phim << " slots=" << cand.nSlots;
+  if (!cand.feasible) return str << " (infeasible)";
+  return str << " security=" << cand.security
+             << " bits/level=" << cand.bitsPerLevel
+             << " tMul=" << cand.tMul << " tRotate=" << cand.tRotate
+             << " tRecrypt=" << cand.tRecrypt
+             << " throughput=" << cand.throughput << " slot-levels/sec";
+}
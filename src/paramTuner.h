@@ -0,0 +1,98 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _PARAM_TUNER_H_
+#define _PARAM_TUNER_H_
+/**
+ * @file paramTuner.h
+ * @brief Choosing parameters for a circuit by benchmarking candidates.
+ *
+ * A CircuitProfile describes what the circuit does at each level and what
+ * it needs from the parameters. enumerateCandidates lists parameter sets
+ * (m and its factorization, the size of the modulus chain, the number of
+ * key-switching digits c and the key-switching strategy) that meet the
+ * security target, with an initial guess of the bits per level.
+ * benchmarkCandidate builds each one on this machine. It measures the
+ * capacity used by a multiplication, grows the chain until the circuit
+ * fits (up to the security target), and times a multiplication, a rotation
+ * and (if needed) a recryption. The predicted throughput is the number of
+ * slot-levels per second:
+ * \verbatim
+ *   nSlots*depth / (depth*(mults*tMul + rotations*tRotate) + tRecrypt)
+ * \endverbatim
+ * The timings are taken at the top of the chain, where the operations are
+ * the most expensive. That is pessimistic, but the same for all candidates.
+ **/
+#include <vector>
+#include <iostream>
+#include <NTL/vector.h>
+
+//! @brief What a circuit needs from the parameters
+struct CircuitProfile {
+  long p, r;              //!< the plaintext space is Z_{p^r}
+  long depth;             //!< levels, between recryptions if bootstrap is set
+  long multsPerLevel;     //!< ciphertext multiplications at each level
+  long rotationsPerLevel; //!< rotations (by arbitrary amounts) at each level
+  bool bootstrap;         //!< whether the circuit needs recryption
+  long security;          //!< the target securityLevel()
+  long minSlots;          //!< the least number of slots to accept
+  long maxM;              //!< do not consider m above this
+
+  CircuitProfile(): p(2), r(1), depth(10), multsPerLevel(1),
+    rotationsPerLevel(1), bootstrap(false), security(80), minSlots(1),
+    maxM(1L<<16) {}
+};
+
+//! @brief One parameter set, and what benchmarkCandidate measured for it
+struct TunerCandidate {
+  long m;
+  NTL::Vec<long> mvec;          //!< factorization of m (for bootstrapping)
+  std::vector<long> gens, ords; //!< empty: let PAlgebra choose
+  double cM;                    //!< the ring constant, see PAlgebra::set_cM
+  long nBits;                   //!< bits of ciphertext primes
+  long c;                       //!< digits in key-switching
+  long ksStrategy;              //!< FHE_KSS_FULL, FHE_KSS_BSGS or FHE_KSS_MIN
+  long phim, nSlots;
+
+  // Set by benchmarkCandidate. A candidate that cannot run the circuit
+  // (not enough capacity within the security target) has feasible==false.
+  bool feasible;
+  double security;    //!< the securityLevel() of the final chain
+  double bitsPerLevel;//!< measured capacity used by one level
+  double tMul, tRotate, tRecrypt; //!< seconds per operation
+  double throughput;  //!< predicted slot-levels per second
+
+  TunerCandidate(): m(0), cM(1.0), nBits(0), c(0), ksStrategy(0),
+    phim(0), nSlots(0), feasible(false), security(0), bitsPerLevel(0),
+    tMul(0), tRotate(0), tRecrypt(0), throughput(0) {}
+};
+
+std::ostream& operator<<(std::ostream& str, const TunerCandidate& cand);
+
+//! @brief List the candidate parameter sets for prof, at most
+//! maxCandidates of them, the cheapest (by a static cost estimate) first.
+//! Bootstrappable candidates come from a table of known-good sets for p=2.
+void enumerateCandidates(std::vector<TunerCandidate>& cands,
+                         const CircuitProfile& prof, long maxCandidates=12);
+
+//! @brief Build the candidate and time its kernels, each of them for at
+//! least minTime seconds. Sets the measured fields of cand, and may grow
+//! cand.nBits so that the circuit fits.
+void benchmarkCandidate(TunerCandidate& cand, const CircuitProfile& prof,
+                        double minTime=0.1, bool verbose=false);
+
+//! @brief Enumerate, benchmark and sort the candidates by decreasing
+//! predicted throughput, the infeasible ones last
+void tuneParams(std::vector<TunerCandidate>& ranked,
+                const CircuitProfile& prof, long maxCandidates=12,
+                double minTime=0.1, bool verbose=false);
+
+#endif // ifndef _PARAM_TUNER_H_
@@ -10,7 +10,11 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <mutex>
+#include <memory>
+#include <NTL/BasicThreadPool.h>
 #include "permutations.h"
+#include "taskScheduler.h"
 
 NTL_CLIENT
 
@@ -149,55 +153,78 @@ collapseBenesLevels(Permut& out, const GeneralBenesNetwork &net,
 // the shift amount to move item j in the i'th layer. Also isID[i]=true if
 // the i'th layer is the identity (i.e., contains only 0 shift amounts).
 void ColPerm::getBenesShiftAmounts(Vec<Permut>& out, Vec<bool>& isID,
-				   const Vec<long>& benesLvls) const
+				   const Vec<long>& benesLvls,
+				   BenesNetworks* nets) const
 {
-  // Go over the columns one by one. For each column extract the columns
-  // permutation, prepare a Benes network for it, and then for every layer
-  // compute the shift amounts for this columns.
+  // For each column extract the columns permutation, prepare a Benes
+  // network for it, and then for every layer compute the shift amounts for
+  // this columns. The columns are independent, they are split between the
+  // threads.
 
   long n = getDim(dim);     // the permutations are over [0,n-1]
+  long nLayers = benesLvls.length();
 
   // Allocate space
-  out.SetLength(benesLvls.length());
-  isID.SetLength(benesLvls.length());
-  for (long k=0; k<benesLvls.length(); k++) {
+  out.SetLength(nLayers);
+  isID.SetLength(nLayers);
+  for (long k=0; k<nLayers; k++) {
     out[k].SetLength(getSize());
     isID[k] = true;
   }
 
+  long nSlices = numSlices(dim);
+  long nCols = getProd(dim+1); // the number of columns in a slice
+  long total = nSlices*nCols;
+  bool reuse = (nets != nullptr && lsize(*nets) == total);
+  if (nets != nullptr && !reuse) nets->assign(total, nullptr);
+
+  std::mutex mx;
+  FHE_EXEC_RANGE(total, first, last)
   Vec<long> col;
   col.SetLength(n);
+  Vec<bool> id;
+  id.SetLength(nLayers);
+  for (long k=0; k<nLayers; k++) id[k] = true;
 
-  for (long slice_index = 0; slice_index < numSlices(dim); slice_index++) {
+  for (long c = first; c < last; c++) {
+    long slice_index = c / nCols, col_index = c % nCols;
     ConstCubeSlice<long> slice(*this, slice_index, dim);
-    for (long col_index = 0; col_index < slice.numCols(); col_index++) {
-      getHyperColumn(col, slice, col_index);
+    getHyperColumn(col, slice, col_index);
+
+    // build a Benes network for this column, from the old one if any
+    shared_ptr<GeneralBenesNetwork> net;
+    if (reuse && (*nets)[c])
+      net = make_shared<GeneralBenesNetwork>(col, *(*nets)[c]);
+    else
+      net = make_shared<GeneralBenesNetwork>(col);
+    if (nets != nullptr) (*nets)[c] = net;
+
+    // Sanity checks: width of network == n,
+    //                and sum of benesLvls entries == # of levels
+    assert(net->getSize()==n);
+    {long sum=0;
+     for (long k=0; k<nLayers; k++) sum+=benesLvls[k];
+     assert(net->getNumLevels()==sum);
+    }
 
-      GeneralBenesNetwork net(col); // build a Benes network for this column
+    // Compute the layers of the collapased network for this column
+    for (long lvl=0,k=0; k<nLayers; lvl += benesLvls[k], k++) {
 
-      // Sanity checks: width of network == n,
-      //                and sum of benesLvls entries == # of levels
-      assert(net.getSize()==n);
-      {long sum=0;
-       for (long k=0; k<benesLvls.length(); k++) sum+=benesLvls[k];
-       assert(net.getNumLevels()==sum);
-      }
+      // Returns in col the shift amounts for this layer in the network,
+      // restricted to this column. Also returns true if the returned
+      // permutation is the idendity, false otherwise.
+      bool lid = collapseBenesLevels(col, *net, lvl, benesLvls[k]);
+      id[k] = id[k] && lid;
+
+      CubeSlice<long> oslice(out[k], getSig());
+      CubeSlice<long> osubslice(oslice, slice_index, dim);
+      setHyperColumn(col, osubslice, col_index);
+    }  // next collapsed layer
+  }  // next column
 
-      // Compute the layers of the collapased network for this column
-      for (long lvl=0,k=0; k<benesLvls.length(); lvl += benesLvls[k], k++) {
-
-	// Returns in col the shift amounts for this layer in the network,
-	// restricted to this column. Also returns true if the returned
-	// permutation is the idendity, false otherwise.
-	bool id = collapseBenesLevels(col, net, lvl, benesLvls[k]);
-	isID[k] = isID[k] && id;
-
-        CubeSlice<long> oslice(out[k], getSig());
-        CubeSlice<long> osubslice(oslice, slice_index, dim);
-        setHyperColumn(col, osubslice, col_index);
-      }  // next collapsed layer
-    }  // next column
-  } // next slice
+  std::lock_guard<std::mutex> lock(mx);
+  for (long k=0; k<nLayers; k++) isID[k] = isID[k] && id[k];
+  FHE_EXEC_RANGE_END
 }
 
 
@@ -227,7 +254,9 @@ void breakPermTo3(const HyperCube<long>& pi, long dim,
       rep[ind].second = j;
     }
 
-  for (long slice_index = 0; slice_index < pi.numSlices(dim); slice_index++) {
+  // The slices are independent, they are split between the threads
+  FHE_EXEC_RANGE(pi.numSlices(dim), first, last)
+  for (long slice_index = first; slice_index < last; slice_index++) {
     ConstCubeSlice<long> pi_slice(pi, slice_index, dim);
     CubeSlice<long> rho1_slice(rho1, slice_index, dim);
     CubeSlice<long> rho2_slice(rho2, slice_index, dim);
@@ -293,6 +322,7 @@ void breakPermTo3(const HyperCube<long>& pi, long dim,
     // FIXME: The comments above do not match the code, the roles
     //        of rho1,rho3 are switched. Why is this code working??
   }
+  FHE_EXEC_RANGE_END
   rho1.setPermDim(dim);
   rho3.setPermDim(dim);
 }
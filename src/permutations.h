@@ -16,6 +16,9 @@
 #ifndef _PERMUTATIONS_H_
 #define _PERMUTATIONS_H_
 
+#include <string>
+#include <memory>
+#include <vector>
 #include "PAlgebra.h"
 #include "matching.h"
 #include "hypercube.h"
@@ -41,6 +44,11 @@ void applyPermsToVec(std::vector<T>& out, const std::vector<T>& in,
 //! @brief A random size-n permutation
 void randomPerm(Permut& perm, long n);
 
+class GeneralBenesNetwork;
+
+//! The Benes networks of the columns of a ColPerm, kept to update them
+typedef std::vector< std::shared_ptr<GeneralBenesNetwork> > BenesNetworks;
+
 
 /**
  * @class ColPerm
@@ -106,7 +114,12 @@ public:
   //! Get multiple layers of a Benes permutation network. Returns in out[i][j]
   //! the shift amount to move item j in the i'th layer. Also isID[i]=true if
   //! the i'th layer is the identity (i.e., contains only 0 shift amounts).
-  void getBenesShiftAmounts(NTL::Vec<Permut>& out, NTL::Vec<bool>& idID, const NTL::Vec<long>& benesLvls) const;
+  //! If nets is not NULL, it returns the networks of all the columns, and
+  //! if it already holds the networks of a previous call on a permutation
+  //! of the same shape, they are updated rather than built from scratch.
+  void getBenesShiftAmounts(NTL::Vec<Permut>& out, NTL::Vec<bool>& idID,
+                            const NTL::Vec<long>& benesLvls,
+                            BenesNetworks* nets=nullptr) const;
 
 
  //! A test/debugging method
@@ -142,8 +155,17 @@ private:
     //   which designates an edge from node j at level i 
     //   to node j + level[i][j]*shamt(i) at level i+1
 
+  NTL::Vec< NTL::Vec<long> > subPerms;
+    // subPerms[d] holds the permutations of the sub-networks at recursion
+    // depth d, each one over its own nodes, so that an updated network
+    // can tell which sub-networks did not change
+
+  long numRouted; // # of sub-networks routed by the constructor
+
   GeneralBenesNetwork(); // default constructor disabled
 
+  void build(const Permut& perm, const GeneralBenesNetwork* old);
+
 public:
   //! computes recursion depth k for generalized Benes network of size n.
   //! the actual number of levels in the network is 2*k-1
@@ -180,9 +202,17 @@ public:
   long levelToDepthMap(long i) const { return levelToDepthMap(n, k, i); }
   long shamt(long i) const { return shamt(n, k, i); }
 
-  // constructor
+  // constructor, the sub-networks at each depth are routed in parallel
   GeneralBenesNetwork(const Permut& perm);
 
+  //! @brief The network of perm, reusing the routes of old for every
+  //! sub-network whose permutation is the same as in old (if old has the
+  //! same size). Only the sub-networks that changed are routed again.
+  GeneralBenesNetwork(const Permut& perm, const GeneralBenesNetwork& old);
+
+  //! The number of sub-networks that were routed (rather than reused)
+  long getNumRouted() const { return numRouted; }
+
   // test correctness
 
   bool testNetwork(const Permut& perm) const;
@@ -481,6 +511,17 @@ class GeneratorTrees  {
   friend std::ostream& operator<< (std::ostream &s, const GeneratorTrees &t);
 };
 
+//! @brief Keep the solutions found by GeneratorTrees::buildOptimalTrees (and
+//! the Benes level-collapsing solutions that it uses) in the given file,
+//! so later builds for the same shapes reuse them, also in other processes.
+//! The solutions already in the file are loaded, and new ones are appended
+//! as they are found. An empty filename stops the writing to a file.
+void setPermPlanStore(const std::string& filename);
+
+//! @brief Forget the solutions that are kept in memory (the file of
+//! setPermPlanStore, if any, is not changed)
+void clearPermPlanCache();
+
 
 // Permutation networks
 
@@ -508,11 +549,15 @@ class PermNetLayer {
 //! A full permutation network
 class PermNetwork {
   NTL::Vec<PermNetLayer> layers;
+  std::vector<BenesNetworks> routes; // kept by updateNetwork, per ColPerm
 
   //! Copmute one or more layers corresponding to one network of a leaf
   void setLayers4Leaf(long lyrIdx, const ColPerm& p,
                       const NTL::Vec<long>& benesLvls, long gIdx,
-                      const SubDimension& leafData, const Permut& map2cube);
+                      const SubDimension& leafData, const Permut& map2cube,
+                      BenesNetworks* nets);
+
+  void build(const Permut& pi, const GeneratorTrees& trees, bool keepRoutes);
 
 public:
   PermNetwork() {}; // empty network
@@ -525,6 +570,13 @@ public:
   //! and prepares the permutation network for this pi
   void buildNetwork(const Permut& pi, const GeneratorTrees& trees);
 
+  //! @brief Prepare the network for a new permutation pi with the same
+  //! trees. The Benes networks of all the columns are kept between calls,
+  //! and every call only routes again the sub-networks whose permutations
+  //! changed since the previous one (the first call builds them all).
+  //! The routes take memory of about (#slots * log(#slots)) words.
+  void updateNetwork(const Permut& pi, const GeneratorTrees& trees);
+
   //! Apply network to permute a ciphertext
   void applyToCtxt(Ctxt& c, const EncryptedArray& ea) const;
 
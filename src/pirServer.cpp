@@ -0,0 +1,262 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* pirServer.cpp - private information retrieval, generalized from the
+ * demo in misc/PIR.cpp
+ *
+ * The layout of an encoded database:
+ *   "|PI[", version (4 bytes), the number of slots and their degree (to
+ *   check the EncryptedArray), nEntries, entryBytes, nChunks, nGroups, the
+ *   index set of the primes, the G*R plaintexts (DoubleCRT::write), "]PI|"
+ */
+#include <cassert>
+#include <stdexcept>
+#include <NTL/BasicThreadPool.h>
+#include "pirServer.h"
+#include "replicate.h"
+#include "binio.h"
+#include "taskScheduler.h"
+
+NTL_CLIENT
+
+static const long pirVersion = 1;
+
+// Bits [idx, idx+d) of data, as the coefficients of a polynomial
+static void encodeBits(ZZX& poly, const vector<uint8_t>& data,
+                       long idx, long d)
+{
+  clear(poly);
+  for (long i=0; i<d; i++, idx++) {
+    long byteIdx = idx / 8;
+    if (byteIdx >= lsize(data)) break;
+    if ((data[byteIdx] >> (idx % 8)) & 1) SetCoeff(poly, i);
+  }
+}
+
+static void decodeBits(vector<uint8_t>& data, long idx,
+                       const ZZX& poly, long d)
+{
+  for (long i=0; i<d; i++, idx++) {
+    long byteIdx = idx / 8;
+    if (byteIdx >= lsize(data)) break;
+    if (IsOne(coeff(poly, i)))
+      data[byteIdx] |= uint8_t(1 << (idx % 8));
+  }
+}
+
+PIRServer::PIRServer(const EncryptedArray& _ea,
+                     const vector< vector<uint8_t> >& db,
+                     const IndexSet& _primes, long _recBound)
+  : ea(_ea), primes(_primes), nEntries(lsize(db)), entryBytes(0),
+    recBound(_recBound)
+{
+  FHE_TIMER_START;
+  const FHEcontext& context = ea.getContext();
+  if (empty(primes)) primes = context.ctxtPrimes;
+  if (nEntries == 0)
+    throw logic_error("PIRServer: empty database");
+  entryBytes = lsize(db[0]);
+  for (const vector<uint8_t>& entry: db)
+    if (lsize(entry) != entryBytes)
+      throw logic_error("PIRServer: entries of different sizes");
+
+  long n = ea.size();
+  long d = ea.getDegree();
+  nChunks = max(divc(8*entryBytes, d), 1L);
+  nGroups = divc(nEntries, n);
+  if (nGroups > n)
+    throw logic_error("PIRServer: more than "+to_string(n*n)+" entries");
+
+  encoded.assign(nGroups*nChunks, DoubleCRT(context, IndexSet()));
+  FHE_EXEC_RANGE(nGroups*nChunks, first, last)
+    vector<ZZX> slots(n);
+    zzX poly;
+    for (long i=first; i<last; i++) {
+      long g = i / nChunks, r = i % nChunks;
+      for (long s=0; s<n; s++) {
+        long e = g*n +s;
+        if (e < nEntries) encodeBits(slots[s], db[e], r*d, d);
+        else              clear(slots[s]);
+      }
+      ea.encode(poly, slots);
+      encoded[i] = DoubleCRT(poly, context, primes);
+    }
+  FHE_EXEC_RANGE_END
+}
+
+PIRServer::PIRServer(const EncryptedArray& _ea, istream& str, long _recBound)
+  : ea(_ea), recBound(_recBound)
+{
+  if (readEyeCatcher(str, BINIO_EYE_PIR_BEGIN) != 0
+      || read_raw_int(str, BINIO_32BIT) != pirVersion)
+    throw std::runtime_error("PIRServer: not an encoded database");
+  if (read_raw_int(str) != ea.size() || read_raw_int(str) != ea.getDegree())
+    throw std::runtime_error("PIRServer: database of another EncryptedArray");
+  nEntries = read_raw_int(str);
+  entryBytes = read_raw_int(str);
+  nChunks = read_raw_int(str);
+  nGroups = read_raw_int(str);
+  primes.read(str);
+  if (!str || nEntries <= 0 || nChunks <= 0 || nGroups <= 0
+      || nGroups > ea.size())
+    throw std::runtime_error("PIRServer: corrupt database");
+
+  encoded.assign(nGroups*nChunks, DoubleCRT(ea.getContext(), IndexSet()));
+  for (DoubleCRT& poly: encoded) {
+    poly.read(str);
+    if (!str || poly.getIndexSet() != primes)
+      throw std::runtime_error("PIRServer: corrupt database");
+  }
+  if (readEyeCatcher(str, BINIO_EYE_PIR_END) != 0)
+    throw std::runtime_error("PIRServer: corrupt database");
+}
+
+void PIRServer::write(ostream& str) const
+{
+  writeEyeCatcher(str, BINIO_EYE_PIR_BEGIN);
+  write_raw_int(str, pirVersion, BINIO_32BIT);
+  write_raw_int(str, ea.size());
+  write_raw_int(str, ea.getDegree());
+  write_raw_int(str, nEntries);
+  write_raw_int(str, entryBytes);
+  write_raw_int(str, nChunks);
+  write_raw_int(str, nGroups);
+  primes.write(str);
+  for (const DoubleCRT& poly: encoded) poly.write(str);
+  writeEyeCatcher(str, BINIO_EYE_PIR_END);
+}
+
+namespace {
+// Adds every replica of the group selector, times the plaintexts of its
+// group, to the accumulators of the chunks
+class PIRGroupHandler : public ReplicateHandler {
+  const vector<DoubleCRT>& encoded;
+  long nGroups, nChunks;
+  vector<Ctxt>& acc;
+  const Ctxt* slot; // multiply the replicas by it first, if not NULL
+
+public:
+  PIRGroupHandler(const vector<DoubleCRT>& _encoded, long _nGroups,
+                  long _nChunks, vector<Ctxt>& _acc, const Ctxt* _slot)
+    : encoded(_encoded), nGroups(_nGroups), nChunks(_nChunks),
+      acc(_acc), slot(_slot) {}
+
+  void handle(const Ctxt& replica, long g) override {
+    if (g >= nGroups) return; // past the last group
+    Ctxt sel(replica);
+    if (slot != NULL) sel.multiplyBy(*slot);
+    const DoubleCRT* row = &encoded[g*nChunks];
+    vector<Ctxt>& sums = acc;
+    FHE_EXEC_RANGE(nChunks, first, last)
+      for (long r=first; r<last; r++) {
+        Ctxt tmp(sel);
+        tmp.multByConstant(row[r]);
+        sums[r] += tmp;
+      }
+    FHE_EXEC_RANGE_END
+  }
+};
+}
+
+void PIRServer::answerOne(vector<Ctxt>& answer, const PIRQuery& q,
+                          RepAuxDim& aux) const
+{
+  FHE_TIMER_START;
+  long n = ea.size();
+  vector<Ctxt> acc(nChunks, Ctxt(ZeroCtxtLike, q.slot));
+
+  if (nGroups == 1) { // no need to select the group
+    FHE_EXEC_RANGE(nChunks, first, last)
+      for (long r=first; r<last; r++) {
+        acc[r] = q.slot;
+        acc[r].multByConstant(encoded[r]);
+      }
+    FHE_EXEC_RANGE_END
+  }
+  else {
+    // Multiply by the slot selector either the G replicas or the R sums,
+    // whichever is fewer
+    bool selectFirst = (nGroups <= nChunks);
+    PIRGroupHandler handler(encoded, nGroups, nChunks, acc,
+                            selectFirst? &q.slot : NULL);
+    replicateAll(ea, q.group, &handler, recBound, &aux);
+    if (!selectFirst) {
+      FHE_EXEC_RANGE(nChunks, first, last)
+        for (long r=first; r<last; r++) acc[r].multiplyBy(q.slot);
+      FHE_EXEC_RANGE_END
+    }
+  }
+
+  // Move chunk r from slot s to slot s+r, and add up the chunks
+  FHE_EXEC_RANGE(nChunks, first, last)
+    for (long r=first; r<last; r++)
+      if (r % n != 0) ea.rotate(acc[r], r % n);
+  FHE_EXEC_RANGE_END
+  answer.assign(answerSize(), Ctxt(ZeroCtxtLike, q.slot));
+  for (long r=0; r<nChunks; r++) answer[r/n] += acc[r];
+}
+
+void PIRServer::answer(vector<Ctxt>& answer, const PIRQuery& q) const
+{
+  RepAuxDim aux;
+  answerOne(answer, q, aux);
+}
+
+void PIRServer::answer(vector< vector<Ctxt> >& answers,
+                       const vector<PIRQuery>& qs) const
+{
+  long nq = lsize(qs);
+  answers.resize(nq);
+  if (nq == 1) { // all the threads on this one
+    answer(answers[0], qs[0]);
+    return;
+  }
+  FHE_EXEC_RANGE(nq, first, last)
+    RepAuxDim aux; // the masks, shared by the queries of this thread
+    for (long i=first; i<last; i++) answerOne(answers[i], qs[i], aux);
+  FHE_EXEC_RANGE_END
+}
+
+void encryptPIRQuery(PIRQuery& q, const EncryptedArray& ea, long idx,
+                     long nGroups, const FHEPubKey& pk)
+{
+  long n = ea.size();
+  if (idx < 0 || idx >= n*nGroups)
+    throw logic_error("encryptPIRQuery: index out of range");
+  vector<long> slots(n, 0);
+  slots[idx % n] = 1;
+  ea.encrypt(q.slot, pk, slots);
+  if (nGroups > 1) {
+    slots[idx % n] = 0;
+    slots[idx / n] = 1;
+    ea.encrypt(q.group, pk, slots);
+  }
+}
+
+void decryptPIRAnswer(vector<uint8_t>& entry, const vector<Ctxt>& answer,
+                      long idx, long entryBytes, const EncryptedArray& ea,
+                      const FHESecKey& sk)
+{
+  long n = ea.size();
+  long d = ea.getDegree();
+  long nChunks = max(divc(8*entryBytes, d), 1L);
+  if (lsize(answer) != divc(nChunks, n))
+    throw logic_error("decryptPIRAnswer: wrong size of answer");
+  entry.assign(entryBytes, 0);
+
+  long s = idx % n;
+  vector<ZZX> slots;
+  for (long k=0; k<lsize(answer); k++) {
+    ea.decrypt(answer[k], sk, slots);
+    for (long r=k*n; r<min(nChunks, (k+1)*n); r++)
+      decodeBits(entry, r*d, slots[(s + r - k*n) % n], d);
+  }
+}
@@ -0,0 +1,122 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _PIR_SERVER_H_
+#define _PIR_SERVER_H_
+/**
+ * @file pirServer.h
+ * @brief Private information retrieval from a preprocessed database.
+ *
+ * A database of N entries, of entryBytes bytes each, is split into groups
+ * of n entries (n the number of slots). Entry g*n+s is the s'th slot (in
+ * the linear order of the slots) of group g, and it is cut into R chunks of
+ * d bits (d the degree of the slots), chunk r being the coefficients of the
+ * slot polynomial. The server encodes, once, the plaintext P[g][r] that
+ * holds chunk r of all the entries of group g, as a DoubleCRT at the primes
+ * it expects the queries to be at.
+ *
+ * To retrieve entry g*n+s the client sends a PIRQuery, two ciphertexts
+ * with a 1 in slot s and in slot g, respectively (the second one is only
+ * needed if there are several groups). The server replicates the group
+ * selector with replicateAll, takes for every chunk the inner product of
+ * the replicas with the plaintexts P[.][r], multiplies it by the slot
+ * selector, and rotates chunk r into slot s+r. The answer is ceil(R/n)
+ * ciphertexts, answer k holding chunks k*n to (k+1)*n-1 in the slots
+ * s+r-k*n (mod n).
+ *
+ * The plaintexts of a group are stored together, and every replica is
+ * multiplied by all of them (split between the NTL threads) as soon as it
+ * is produced, so neither the replicas nor the plaintexts are ever
+ * revisited. A batch of queries is split between the threads instead, each
+ * thread keeping the masks of replicateAll for all its queries.
+ **/
+#include <vector>
+#include <iostream>
+#include <cstdint>
+#include "FHE.h"
+#include "EncryptedArray.h"
+
+class RepAuxDim;
+
+//! @brief A query for one entry: the slot and group selectors
+class PIRQuery {
+public:
+  Ctxt slot;  // 1 in the slot of the entry, 0 elsewhere
+  Ctxt group; // 1 in the slot of its group, 0 elsewhere (if groups()>1)
+
+  explicit PIRQuery(const FHEPubKey& pk): slot(pk), group(pk) {}
+};
+
+/**
+ * @class PIRServer
+ * @brief A database encoded for answering PIR queries
+ **/
+class PIRServer {
+  const EncryptedArray& ea;
+  IndexSet primes;   // of the encoded plaintexts
+  long nEntries, entryBytes;
+  long nChunks;      // R, chunks per entry
+  long nGroups;      // G, groups of ea.size() entries
+  long recBound;     // passed to replicateAll
+  std::vector<DoubleCRT> encoded; // P[g][r] at encoded[g*nChunks +r]
+
+  void answerOne(std::vector<Ctxt>& answer, const PIRQuery& q,
+                 RepAuxDim& aux) const;
+
+public:
+  //! @brief Encode the database db (all entries must have the same size).
+  //! @param primes  the primes of the queries when they are multiplied by
+  //!   the plaintexts (after the replication), empty means ctxtPrimes.
+  //!   Encoding at fewer primes saves memory, but a query that still has
+  //!   primes outside this set is first brought up to it, which is slow.
+  PIRServer(const EncryptedArray& _ea,
+            const std::vector< std::vector<uint8_t> >& db,
+            const IndexSet& _primes=IndexSet(), long _recBound=64);
+
+  //! @brief Read a database written by write()
+  PIRServer(const EncryptedArray& _ea, std::istream& str,
+            long _recBound=64);
+
+  //! Write the encoded database, to be read back with the constructor
+  void write(std::ostream& str) const;
+
+  long size() const { return nEntries; }
+  long getEntryBytes() const { return entryBytes; }
+  long chunks() const { return nChunks; }
+  long groups() const { return nGroups; }
+  const IndexSet& getPrimes() const { return primes; }
+  const EncryptedArray& getEA() const { return ea; }
+
+  //! The number of ciphertexts in an answer
+  long answerSize() const { return divc(nChunks, ea.size()); }
+
+  //! @brief Answer a query, the replicas and the chunks are split between
+  //! the NTL threads
+  void answer(std::vector<Ctxt>& answer, const PIRQuery& q) const;
+
+  //! @brief Answer a batch of queries, answers[i] is the answer to qs[i].
+  //! The queries are split between the NTL threads.
+  void answer(std::vector< std::vector<Ctxt> >& answers,
+              const std::vector<PIRQuery>& qs) const;
+};
+
+//! @brief Encrypt a query for entry idx of a database of nGroups groups
+void encryptPIRQuery(PIRQuery& q, const EncryptedArray& ea, long idx,
+                     long nGroups, const FHEPubKey& pk);
+
+//! @brief Decrypt the answer to a query for entry idx into entry, which
+//! is resized to entryBytes
+void decryptPIRAnswer(std::vector<uint8_t>& entry,
+                      const std::vector<Ctxt>& answer, long idx,
+                      long entryBytes, const EncryptedArray& ea,
+                      const FHESecKey& sk);
+
+#endif // ifndef _PIR_SERVER_H_
@@ -9,24 +9,104 @@
  * See the License for the specific language governing permissions and
  * limitations under the License. See accompanying LICENSE file.
  */
+#include <NTL/BasicThreadPool.h>
 #include "FHEContext.h"
 #include "polyEval.h"
+#include "taskScheduler.h"
 
 NTL_CLIENT
 
 // Returns the e'th power of X, computing it as needed
 Ctxt& DynamicCtxtPowers::getPower(long e)
+{
+  std::lock_guard<std::mutex> lock(mtx);
+  return computePower(e);
+}
+
+Ctxt& DynamicCtxtPowers::computePower(long e)
 {
   if (v.at(e-1).isEmpty()) { // Not computed yet, compute it now
     
     long k = 1L<<(NextPowerOfTwo(e)-1); // largest power of two smaller than e
-    v[e-1] = getPower(e-k);             // compute X^e = X^{e-k} * X^k
-    v[e-1].multiplyBy(getPower(k));
+    v[e-1] = computePower(e-k);         // compute X^e = X^{e-k} * X^k
+    v[e-1].multiplyBy(computePower(k));
     // FIXME: could drop down / cleanup further as an optimization?
   }
   return v[e-1];
 }
 
+void DynamicCtxtPowers::computePowers(long e, bool parallel)
+{
+  assert(e >= 1 && e <= size());
+  std::lock_guard<std::mutex> lock(mtx);
+
+  for (long lo = 1; lo < e; lo *= 2) { // compute X^{lo+1},...,X^{min(2lo,e)}
+    long cnt = min(2*lo, e) - lo;
+    // X^j = X^{j-lo} * X^lo, all the factors are computed already
+    auto compute = [&](long j) {
+      if (v[j-1].isEmpty()) {
+        v[j-1] = v[j-lo-1];
+        v[j-1].multiplyBy(v[lo-1]);
+      }
+    };
+    if (parallel && cnt > 1) {
+      FHE_EXEC_RANGE(cnt, first, last)
+      for (long j = lo+1+first; j < lo+1+last; j++) compute(j);
+      FHE_EXEC_RANGE_END
+    }
+    else
+      for (long j = lo+1; j <= lo+cnt; j++) compute(j);
+  }
+}
+
+// How many independent multiplications of ciphertexts like x are worth
+// running at once. The key-switching of a single product is already spread
+// over the primes, so running several of them concurrently (each one on a
+// single thread) only pays when there are more threads than primes.
+static long concurrentMults(const Ctxt& x)
+{
+  long nPrimes = x.getPrimeSet().card()
+                 + x.getContext().specialPrimes.card();
+  return max(1L, fheAvailableThreads() / max(1L, nPrimes));
+}
+
+// Run two independent parts of an evaluation, concurrently if the
+// ciphertexts are small enough (see concurrentMults). When called from
+// inside one of the parts they run in turn on the NTL pool, and as nested
+// tasks with the task scheduler (see taskScheduler.h).
+template<class Fn0, class Fn1>
+static void evalBoth(const Ctxt& x, const Fn0& f0, const Fn1& f1)
+{
+  if (fheAvailableThreads() > 1 && concurrentMults(x) > 1) {
+    FHE_EXEC_INDEX(2, i)
+      if (i == 0) f0();
+      else        f1();
+    FHE_EXEC_INDEX_END
+  }
+  else {
+    f0();
+    f1();
+  }
+}
+
+// Estimated number of rounds of multiplications (each one dominated by its
+// key-switching) to evaluate a degree-d polynomial with k baby steps, when
+// w multiplications can run concurrently: the baby steps take log(k) rounds
+// of up to k/2 independent products, the giant steps X^{2k},X^{4k},... are
+// repeated squarings, and the Paterson-Stockmeyer recursion does about d/k
+// products, split into two independent halves at the top.
+static double evalCost(long d, long k, long w)
+{
+  double cost = 0;
+  for (long lo = 1; lo < k; lo *= 2)
+    cost += divc(lo, w);
+  long n = divc(d, k);
+  long logn = NextPowerOfTwo(n);
+  cost += logn;
+  cost += (w > 1)? divc(n, 2) + logn : n;
+  return cost;
+}
+
 // Local functions for polynomial evaluation in some special cases
 static void simplePolyEval(Ctxt& ret, const ZZX& poly, DynamicCtxtPowers& babyStep);
 static void PatersonStockmeyer(Ctxt& ret, const ZZX& poly, long k, long t, long delta, DynamicCtxtPowers& babyStep, DynamicCtxtPowers& giantStep);
@@ -37,9 +117,30 @@ static void recursivePolyEval(Ctxt& ret, const Ctxt poly[], long nCoeffs,
 			      const Vec<Ctxt>& powers);
 
 
-// Main entry point: Evaluate an encrypted polynomial on an encrypted input
-// return in ret = sum_i poly[i] * x^i
-void polyEval(Ctxt& ret, const Vec<Ctxt>& poly, const Ctxt& x)
+// The squares x, x^2, x^4, ..., x^{2^logD}
+static void squarePowers(Vec<Ctxt>& powers, const Ctxt& x, long logD)
+{
+  powers.SetLength(logD+1, x);
+  if (logD>0) {
+    powers[1].square();
+    for (long i=2; i<=logD; i++) { // powers[i] = x^{2^i}
+      powers[i] = powers[i-1];
+      powers[i].square();
+    }
+  }
+}
+
+// The degree-splitting power of two for a polynomial with nCoeffs > 1
+// coefficients, d=2^logD with d <= nCoeffs-1 < 3d
+static long splitLog(long nCoeffs)
+{
+  return NextPowerOfTwo(divc(nCoeffs,3));
+}
+
+// Evaluate the encrypted poly, powers must contain at least the squares
+// up to x^{2^splitLog(poly.length())}
+static void evalEncrypted(Ctxt& ret, const Vec<Ctxt>& poly,
+                          const Vec<Ctxt>& powers)
 {
   if (poly.length()<=1) { // Some special cases
     if (poly.length()==0) ret.clear();   // empty polynomial
@@ -47,21 +148,12 @@ void polyEval(Ctxt& ret, const Vec<Ctxt>& poly, const Ctxt& x)
     return;
   }
   long deg = poly.length()-1;
-
-  long logD = NextPowerOfTwo(divc(poly.length(),3));
+  long logD = splitLog(poly.length());
   long d = 1L << logD;
 
   // We have d <= deg(poly) < 3d
   assert(d <= deg && deg < 3*d);
-
-  Vec<Ctxt> powers(INIT_SIZE, logD+1, x);
-  if (logD>0) {
-    powers[1].square();
-    for (long i=2; i<=logD; i++) { // powers[i] = x^{2^i}
-      powers[i] = powers[i-1];
-      powers[i].square();
-    }
-  }
+  assert(logD < powers.length());
 
   // Compute in three parts p0(X) + ( p1(X) + p2(X)*X^d )*X^d
   Ctxt tmp(ZeroCtxtLike, ret);
@@ -78,6 +170,42 @@ void polyEval(Ctxt& ret, const Vec<Ctxt>& poly, const Ctxt& x)
   ret += tmp;
 }
 
+// Main entry point: Evaluate an encrypted polynomial on an encrypted input
+// return in ret = sum_i poly[i] * x^i
+void polyEval(Ctxt& ret, const Vec<Ctxt>& poly, const Ctxt& x)
+{
+  if (poly.length()<=1) { // Some special cases
+    evalEncrypted(ret, poly, Vec<Ctxt>());
+    return;
+  }
+  Vec<Ctxt> powers;
+  squarePowers(powers, x, splitLog(poly.length()));
+  evalEncrypted(ret, poly, powers);
+}
+
+// Evaluate several encrypted polynomials on the same encrypted input
+void polyEval(std::vector<Ctxt>& ret, const std::vector< Vec<Ctxt> >& polys,
+              const Ctxt& x)
+{
+  long nPolys = lsize(polys);
+  std::vector<Ctxt> res(nPolys, Ctxt(ZeroCtxtLike, x)); // x may be in ret
+
+  long maxLen = 0;
+  for (const Vec<Ctxt>& poly: polys) maxLen = max(maxLen, poly.length());
+  Vec<Ctxt> powers;
+  if (maxLen > 1) squarePowers(powers, x, splitLog(maxLen));
+
+  // Only additions and products by the (shared, read-only) squares remain
+  if (concurrentMults(x) > 1 && nPolys > 1) {
+    FHE_EXEC_RANGE(nPolys, first, last)
+    for (long i=first; i<last; i++) evalEncrypted(res[i], polys[i], powers);
+    FHE_EXEC_RANGE_END
+  }
+  else
+    for (long i=0; i<nPolys; i++) evalEncrypted(res[i], polys[i], powers);
+  ret.swap(res);
+}
+
 static void recursivePolyEval(Ctxt& ret, const Ctxt poly[], long nCoeffs,
 			      const Vec<Ctxt>& powers)
 {
@@ -96,48 +224,46 @@ static void recursivePolyEval(Ctxt& ret, const Ctxt poly[], long nCoeffs,
 }
 
 
-// Main entry point: Evaluate a cleartext polynomial on an encrypted input
-void polyEval(Ctxt& ret, ZZX poly, const Ctxt& x, long k)
-     // Note: poly is passed by value, so caller keeps the original
+// The default number of baby steps for a degree-d polynomial: k~sqrt(d/2),
+// rounded up/down to a power of two
+static long defaultBabySteps(long d, long w)
 {
-  if (deg(poly)<=2) {  // nothing to optimize here
-    if (deg(poly)<1) { // A constant
-      ret.clear();
-      ret.addConstant(coeff(poly, 0));
-    } else {           // A linear or quadratic polynomial
-      DynamicCtxtPowers babyStep(x, deg(poly));
-      simplePolyEval(ret, poly, babyStep);
-    }
-    return;
-  }
-
-  // How many baby steps: set k~sqrt(n/2), rounded up/down to a power of two
-
   // FIXME: There may be some room for optimization here: it may be possible
   // to choose k as something other than a power of two and still maintain
   // optimal depth, in principle we can try all possible values of k between
   // two consecutive powers of two and choose the one that gives the least
   // number of multiplies, conditioned on minimum depth.
 
-  if (k<=0) {
-    long kk = (long) sqrt(deg(poly)/2.0);
-    k = 1L << NextPowerOfTwo(kk);
+  long kk = (long) sqrt(d/2.0);
+  long k = 1L << NextPowerOfTwo(kk);
 
+  if (w == 1) {
     // heuristic: if k>>kk then use a smaler power of two
-    if ((k==16 && deg(poly)>167) || (k>16 && k>(1.44*kk)))
+    if ((k==16 && d>167) || (k>16 && k>(1.44*kk)))
       k /= 2;
   }
-#ifdef DEBUG_PRINTOUT
-  cerr << "  k="<<k;
-#endif
+  else if (k > 1 && evalCost(d, k/2, w) < evalCost(d, k, w))
+    k /= 2; // with concurrent baby steps a larger k is often cheaper
+  return k;
+}
 
+// Evaluate poly using the baby steps X,...,X^k and the giant steps
+// X^k,X^{2k},X^{4k},... The giant-step table must have at least
+// ceil(deg(poly)/k) entries, and both tables can be shared by polynomials
+// of different degrees (with the same k).
+static void evalWithPowers(Ctxt& ret, ZZX poly, long k,
+                           DynamicCtxtPowers& babyStep,
+                           DynamicCtxtPowers& giantStep)
+{
+  if (deg(poly)<=babyStep.size()) { // no giant steps are needed
+    simplePolyEval(ret, poly, babyStep);
+    return;
+  }
   long n = divc(deg(poly),k);      // n = ceil(deg(p)/k), deg(p) >= k*n
-  DynamicCtxtPowers babyStep(x, k);
-  const Ctxt& x2k = babyStep.getPower(k);
+  assert(n <= giantStep.size());
 
   // Special case when deg(p)>k*(2^e -1)
   if (n==(1L << NextPowerOfTwo(n))) { // n is a power of two
-    DynamicCtxtPowers giantStep(x2k, n/2);
     degPowerOfTwo(ret, poly, k, babyStep, giantStep);
     return;
   }
@@ -145,7 +271,7 @@ void polyEval(Ctxt& ret, ZZX poly, const Ctxt& x, long k)
   // If n is not a power of two, ensure that poly is monic and that
   // its degree is divisible by k, then call the recursive procedure
 
-  const ZZ p = to_ZZ(x.getPtxtSpace());
+  const ZZ p = to_ZZ(babyStep[0].getPtxtSpace());
   ZZ top = LeadCoeff(poly);
   ZZ topInv; // the inverse mod p of the top coefficient of poly (if any)
   bool divisible = (n*k == deg(poly)); // is the degree divisible by k?
@@ -167,9 +293,6 @@ void polyEval(Ctxt& ret, ZZX poly, const Ctxt& x, long k)
     SetCoeff(poly, n*k); // set the top coefficient of X^{n*k} to one
   }
 
-  long t = IsZero(extra)? divc(n,2) : n;
-  DynamicCtxtPowers giantStep(x2k, t);
-
   if (!IsOne(top)) {
     poly *= topInv; // Multiply by topInv to make into a monic polynomial
     for (long i=0; i<=n*k; i++) rem(poly[i], poly[i], p);
@@ -188,6 +311,78 @@ void polyEval(Ctxt& ret, ZZX poly, const Ctxt& x, long k)
   }
 }
 
+// Main entry point: Evaluate a cleartext polynomial on an encrypted input
+void polyEval(Ctxt& ret, ZZX poly, const Ctxt& x, long k)
+     // Note: poly is passed by value, so caller keeps the original
+{
+  if (deg(poly)<=2) {  // nothing to optimize here
+    if (deg(poly)<1) { // A constant
+      ret.clear();
+      ret.addConstant(coeff(poly, 0));
+    } else {           // A linear or quadratic polynomial
+      DynamicCtxtPowers babyStep(x, deg(poly));
+      simplePolyEval(ret, poly, babyStep);
+    }
+    return;
+  }
+
+  long w = concurrentMults(x);
+  if (k<=0) k = defaultBabySteps(deg(poly), w);
+#ifdef DEBUG_PRINTOUT
+  cerr << "  k="<<k;
+#endif
+
+  long n = divc(deg(poly),k);
+  DynamicCtxtPowers babyStep(x, k);
+  if (w > 1) babyStep.computePowers(k); // one round per power of two
+  DynamicCtxtPowers giantStep(babyStep.getPower(k), n);
+  evalWithPowers(ret, poly, k, babyStep, giantStep);
+}
+
+// Evaluate several cleartext polynomials on the same encrypted input
+void polyEval(std::vector<Ctxt>& ret, const std::vector<ZZX>& polys,
+              const Ctxt& x, long k)
+{
+  long nPolys = lsize(polys);
+  std::vector<Ctxt> res(nPolys, Ctxt(ZeroCtxtLike, x)); // x may be in ret
+  if (nPolys == 0) {
+    ret.swap(res);
+    return;
+  }
+
+  long maxDeg = 0;
+  for (const ZZX& poly: polys) maxDeg = max(maxDeg, deg(poly));
+  if (maxDeg < 1) { // all constants
+    for (long i=0; i<nPolys; i++) {
+      res[i].clear();
+      res[i].addConstant(coeff(polys[i], 0));
+    }
+    ret.swap(res);
+    return;
+  }
+
+  long w = concurrentMults(x);
+  if (k<=0) k = (maxDeg<=2)? maxDeg : defaultBabySteps(maxDeg, w);
+  k = min(k, maxDeg); // more baby steps than that are never used
+
+  DynamicCtxtPowers babyStep(x, k);
+  if (w > 1) babyStep.computePowers(k);
+  DynamicCtxtPowers giantStep(babyStep.getPower(k), divc(maxDeg,k));
+
+  // The tables are shared, and getPower computes each power only once, so
+  // with enough threads the polynomials are evaluated concurrently
+  if (w > 1 && nPolys > 1) {
+    FHE_EXEC_RANGE(nPolys, first, last)
+    for (long i=first; i<last; i++)
+      evalWithPowers(res[i], polys[i], k, babyStep, giantStep);
+    FHE_EXEC_RANGE_END
+  }
+  else
+    for (long i=0; i<nPolys; i++)
+      evalWithPowers(res[i], polys[i], k, babyStep, giantStep);
+  ret.swap(res);
+}
+
 
 // Simple evaluation sum f_i * X^i, assuming that babyStep has enough powers
 static void 
@@ -249,15 +444,20 @@ PatersonStockmeyer(Ctxt& ret, const ZZX& poly, long k, long t, long delta,
   for (long i=0; i<=deg(s); i++) rem(s[i],s[i], p);
   s.normalize();
 
-  // Evaluate recursively poly = (c+X^{kt})*q + s'
-  PatersonStockmeyer(ret, q, k, t/2, delta, babyStep, giantStep);
-
+  // Evaluate recursively poly = (c+X^{kt})*q + s', the two terms are
+  // independent of each other
   Ctxt tmp(ret.getPubKey(), ret.getPtxtSpace());
-  simplePolyEval(tmp, c, babyStep);
-  tmp += giantStep.getPower(t);
-  ret.multiplyBy(tmp);
-
-  PatersonStockmeyer(tmp, s, k, t/2, delta, babyStep, giantStep);
+  evalBoth(babyStep.getVector()[0],
+    [&]() {
+      PatersonStockmeyer(ret, q, k, t/2, delta, babyStep, giantStep);
+      Ctxt cTerm(ret.getPubKey(), ret.getPtxtSpace());
+      simplePolyEval(cTerm, c, babyStep);
+      cTerm += giantStep.getPower(t);
+      ret.multiplyBy(cTerm);
+    },
+    [&]() {
+      PatersonStockmeyer(tmp, s, k, t/2, delta, babyStep, giantStep);
+    });
   ret += tmp;
 }
 
@@ -278,15 +478,19 @@ degPowerOfTwo(Ctxt& ret, const ZZX& poly, long k,
   SetCoeff(r, (n-1)*k);              // monic, degree == k(2^e-1)
   q -= 1;
 
-  PatersonStockmeyer(ret, r, k, n/2, 0,	babyStep, giantStep);
-
   Ctxt tmp(ret.getPubKey(), ret.getPtxtSpace());
-  simplePolyEval(tmp, q, babyStep); // evaluate q
-
-  // multiply by X^{k(n-1)} with minimum depth
-  for (long i=1; i<n; i*=2) {  
-    tmp.multiplyBy(giantStep.getPower(i));
-  }
+  evalBoth(babyStep.getVector()[0],
+    [&]() {
+      PatersonStockmeyer(ret, r, k, n/2, 0, babyStep, giantStep);
+    },
+    [&]() {
+      simplePolyEval(tmp, q, babyStep); // evaluate q
+
+      // multiply by X^{k(n-1)} with minimum depth
+      for (long i=1; i<n; i*=2) {  
+        tmp.multiplyBy(giantStep.getPower(i));
+      }
+    });
   ret += tmp;
 }
 
@@ -327,15 +531,20 @@ recursivePolyEval(Ctxt& ret, const ZZX& poly, long k,
   q -= 1;
   SetCoeff(r, u);              // degree == u
 
-  PatersonStockmeyer(ret, q, k, t/2, 0, babyStep, giantStep);
-
-  Ctxt tmp = giantStep.getPower(u/k);
-  if (delta!=0) { // if u is not divisible by k then compute it
-    tmp.multiplyBy(babyStep.getPower(delta));
-  }
-  ret.multiplyBy(tmp);
+  Ctxt tmp(ret.getPubKey(), ret.getPtxtSpace());
+  evalBoth(babyStep.getVector()[0],
+    [&]() {
+      PatersonStockmeyer(ret, q, k, t/2, 0, babyStep, giantStep);
 
-  recursivePolyEval(tmp, r, k, babyStep, giantStep);
+      Ctxt x2u = giantStep.getPower(u/k);
+      if (delta!=0) { // if u is not divisible by k then compute it
+        x2u.multiplyBy(babyStep.getPower(delta));
+      }
+      ret.multiplyBy(x2u);
+    },
+    [&]() {
+      recursivePolyEval(tmp, r, k, babyStep, giantStep);
+    });
   ret += tmp;
 }
 
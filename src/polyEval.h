@@ -14,6 +14,7 @@
  * @brief Homomorphic Polynomial Evaluation
  */
 
+#include <mutex>
 #include "FHEContext.h"
 #include "Ctxt.h"
 
@@ -22,6 +23,12 @@
 //! @param[in]  poly the degree-d polynomial to evaluate
 //! @param[in]  x    the point on which to evaluate
 //! @param[in]  k    optional optimization parameter, defaults to sqrt(d/2) rounded up or down to a power of two
+//!
+//! With more than one thread available, independent multiplications (the
+//! baby steps of one round, the two halves of each Paterson-Stockmeyer
+//! split) run concurrently when a single multiplication is too small to
+//! use all the threads, and the default k is chosen by a cost model that
+//! takes this into account.
 void polyEval(Ctxt& ret, NTL::ZZX poly, const Ctxt& x, long k=0);
      // Note: poly is passed by value, so caller keeps the original
 
@@ -31,6 +38,28 @@ void polyEval(Ctxt& ret, NTL::ZZX poly, const Ctxt& x, long k=0);
 //! @param[in]  x    the point on which to evaluate
 void polyEval(Ctxt& ret, const NTL::Vec<Ctxt>& poly, const Ctxt& x);
 
+//! @brief Evaluate several cleartext polynomials on the same encrypted input
+//! @param[out] ret   ret[i] holds the value of polys[i]
+//! @param[in]  polys the polynomials to evaluate
+//! @param[in]  x     the point on which to evaluate
+//! @param[in]  k     optional baby-step parameter, defaults to the one that
+//!                   polyEval would use for the largest degree
+//!
+//! The baby steps X,...,X^k and giant steps X^k,X^{2k},X^{4k},... are
+//! computed once and shared by all the polynomials, so each polynomial only
+//! costs its own giant-step combinations. With enough threads the
+//! polynomials are evaluated concurrently.
+void polyEval(std::vector<Ctxt>& ret, const std::vector<NTL::ZZX>& polys,
+              const Ctxt& x, long k=0);
+
+//! @brief Evaluate several encrypted polynomials on the same encrypted
+//! input, sharing the squares x^{2^i}
+//! @param[out] ret   ret[i] holds the value of polys[i]
+//! @param[in]  polys the polynomials to evaluate
+//! @param[in]  x     the point on which to evaluate
+void polyEval(std::vector<Ctxt>& ret,
+              const std::vector< NTL::Vec<Ctxt> >& polys, const Ctxt& x);
+
 
 // A useful helper class
 
@@ -41,6 +70,9 @@ void polyEval(Ctxt& ret, const NTL::Vec<Ctxt>& poly, const Ctxt& x);
 class DynamicCtxtPowers {
 private:
   std::vector<Ctxt> v;   // A std::vector storing the powers themselves
+  std::mutex mtx;        // getPower may be called from concurrent threads
+
+  Ctxt& computePower(long e); // same as getPower, mtx must be held
 
 public:
   DynamicCtxtPowers(const Ctxt& c, long nPowers)
@@ -55,6 +87,11 @@ public:
   //! @brief Returns the e'th power, computing it as needed
   Ctxt& getPower(long e); // must use e >= 1, else throws an exception
 
+  //! @brief Compute all the powers X^1,...,X^e (the same way as getPower
+  //! does). The powers in (2^{i-1},2^i] only depend on smaller powers, so
+  //! if parallel is set then each such range is spread over the threads.
+  void computePowers(long e, bool parallel=true);
+
   //! dp.at(i) and dp[i] both return the i+1st power
   Ctxt& at(long i) { return getPower(i+1); }
   Ctxt& operator[](long i) { return getPower(i+1); }
@@ -13,7 +13,10 @@
  * EXPERIMENTAL CODE, not usable yet
  */
 
+#include <NTL/BasicThreadPool.h>
 #include "powerful.h"
+#include "memoryUsage.h"
+#include "taskScheduler.h"
 
 NTL_CLIENT
 
@@ -105,48 +108,49 @@ static void computeShortToLongMap(Vec<long>& shortToLongMap,
 }
 
 
-// This routine recursively reduces each hypercolumn
-// in dimension d (viewed as a coeff vector) by Phi_{m_d}(X)
-// If one starts with a cube of dimension (m_1, ..., m_k),
-// one ends up with a cube that is effectively of dimension
+// This routine reduces each hypercolumn in every dimension d (viewed as a
+// coeff vector) by Phi_{m_d}(X). If one starts with a cube of dimension
+// (m_1, ..., m_k), one ends up with a cube that is effectively of dimension
 // phi(m_1, ..., m_k). Viewed as an element of the ring
 // F_p[X_1,...,X_k]/(Phi_{m_1}(X_1), ..., Phi_{m_k}(X_k)),
 // the cube remains unchanged.
-static void recursiveReduce(const CubeSlice<zz_p>& s, 
-                     const Vec<zz_pXModulus>& cycVec, 
-                     long d,
-                     zz_pX& tmp1,
-                     zz_pX& tmp2)
-{
-   long numDims = s.getNumDims();
-   assert(numDims > 0);
-
-   long deg0 = deg(cycVec[d]);
-
-   long posBnd = s.getProd(1);
-   for (long pos = 0; pos < posBnd; pos++) {
-      getHyperColumn(tmp1.rep, s, pos);
-      tmp1.normalize();
-
-      // tmp2 may not be normalized, so clear it first
-      clear(tmp2); 
-
-      rem(tmp2, tmp1, cycVec[d]);
-
-      // now pad tmp2.rep with zeros to length deg0...
-      // tmp2 may not be normalized
-      long len = tmp2.rep.length();
-      tmp2.rep.SetLength(deg0);
-      for (long i = len; i < deg0; i++) tmp2.rep[i] = 0;
-
-      setHyperColumn(tmp2.rep, s, pos);
-   }
-
-   if (numDims == 1) return;
-
-   for (long i = 0; i < deg0; i++) 
-      recursiveReduce(CubeSlice<zz_p>(s, i), cycVec, d+1, tmp1, tmp2);
-
+//
+// For m_d = p^e with s = p^{e-1}, X^{phi(m_d)} = -sum_{j<p-1} X^{j*s} mod
+// Phi_{m_d}(X), so each coefficient at or above phi(m_d) is subtracted
+// from p-1 lower ones. All the entries with the same coordinate in
+// dimension d and below it form a contiguous run of longSig.getProd(d+1)
+// entries, so the subtractions run over whole runs. Only the blocks whose
+// coordinates in the dimensions before d are already reduced are touched.
+static void reduceCube(long* cube, const PowerfulTranslationIndexes& ind,
+                       long q)
+{
+  const CubeSignature& sig = ind.longSig;
+  Vec<long> bases(INIT_SIZE, 1, 0L); // offsets of the blocks to reduce
+  for (long d = 0; d < sig.getNumDims(); d++) {
+    long md = ind.mvec[d], phid = ind.phivec[d];
+    long s = md - phid; // m_d/p
+    long p = md / s;
+    assert(p*s == md && (p-1)*s == phid); // m_d is a prime power
+    long run = sig.getProd(d+1);
+
+    for (long b = 0; b < bases.length(); b++) {
+      long* block = cube + bases[b];
+      for (long i = md-1; i >= phid; i--) {
+        const long* src = block + i*run;
+        for (long j = 0; j < p-1; j++) {
+          long* dst = block + (i - phid + j*s)*run;
+          for (long x = 0; x < run; x++) dst[x] = SubMod(dst[x], src[x], q);
+        }
+      }
+    }
+    if (d+1 == sig.getNumDims()) break;
+
+    Vec<long> next; // the reduced coordinates in dimension d
+    next.SetLength(bases.length()*phid);
+    for (long b = 0, n = 0; b < bases.length(); b++)
+      for (long i = 0; i < phid; i++) next[n++] = bases[b] + i*run;
+    bases.swap(next);
+  }
 }
 
 
@@ -180,6 +184,9 @@ PowerfulTranslationIndexes::PowerfulTranslationIndexes(const Vec<long>& mv):
   // index i wrt shortSig to an index i' wrt longSig so that both indexes
   // correspond to the same tuple (i_1,...,i_k).
   computeShortToLongMap(shortToLongMap, shortSig, longSig);
+  shortToPolyMap.SetLength(phim);
+  for (long i = 0; i < phim; i++)
+    shortToPolyMap[i] = cubeToPolyMap[shortToLongMap[i]];
 
   cycVec.SetLength(nfactors);
   for (long d = 0; d < nfactors; d++) cycVec[d] = Cyclotomic(mvec[d]);
@@ -198,31 +205,28 @@ PowerfulTranslationIndexes::PowerfulTranslationIndexes(const Vec<long>& mv):
 long PowerfulConversion::polyToPowerful(HyperCube<zz_p>& powerful,
 					const zz_pX& poly) const
 {
-  HyperCube<zz_p> tmpCube(getLongSig());
-
   long n = deg(poly);
   assert(n < indexes->m);
 
+  static thread_local Vec<long> tls_cube; // avoid re-allocation
+  Vec<long>& cube = tls_cube;
+  cube.SetLength(indexes->m);
+  for (long i = 0; i < indexes->m; i++) cube[i] = 0;
   for (long i = 0; i <= n; i++)
-    tmpCube[indexes->polyToCubeMap[i]] = poly[i];
+    cube[indexes->polyToCubeMap[i]] = rep(poly[i]);
 
-  for (long i = n+1; i < indexes->m; i++)
-    tmpCube[indexes->polyToCubeMap[i]] = 0;
+  long q = zz_p::modulus();
+  reduceCube(cube.elts(), *indexes, q);
 
-  zz_pX tmp1, tmp2;
-  recursiveReduce(CubeSlice<zz_p>(tmpCube), cycVec_p, 0, tmp1, tmp2);
+  for (long i = 0; i < indexes->phim; i++) // already reduced mod q
+    powerful[i].LoopHole() = cube[indexes->shortToLongMap[i]];
 
-  for (long i = 0; i < indexes->phim; i++)
-    powerful[i] = tmpCube[indexes->shortToLongMap[i]];
-
-  return zz_p::modulus();
+  return q;
 }
 
 long PowerfulConversion::powerfulToPoly(zz_pX& poly,
 					const HyperCube<zz_p>& powerful) const
 {
-  //  convertPowerfulToPoly(poly, powerful, indexes->m, indexes.shortToLongMap,
-  //			indexes->cubeToPolyMap, phimX_p);
   zz_pX tmp; // a temporary degree-(m-1) polynomial, initialized to all-zero
   tmp.SetLength(indexes->m);
   for (long i = 0; i < indexes->m; i++)
@@ -230,8 +234,7 @@ long PowerfulConversion::powerfulToPoly(zz_pX& poly,
 
   // copy the coefficienct from hypercube in the right order
   for (long i = 0; i < indexes->phim; i++)
-    tmp[indexes->cubeToPolyMap[indexes->shortToLongMap[i]]] = powerful[i];
-      // FIXME: these two maps could be composed into a single map
+    tmp[indexes->shortToPolyMap[i]] = powerful[i];
 
   tmp.normalize();
   rem(poly, tmp, phimX_p); // reduce modulo Phi_m(X)
@@ -253,6 +256,19 @@ PowerfulDCRT::PowerfulDCRT(const FHEcontext& _context, const Vec<long>& mvec):
   }
 } // NTL's modulus restored upon exit
 
+long PowerfulDCRT::memoryUsage() const
+{
+  const PowerfulTranslationIndexes& ind = indexes;
+  long n = sizeof(*this) + memBytes(ind.mvec) + memBytes(ind.phivec)
+    + memBytes(ind.divvec) + memBytes(ind.invvec)
+    + memBytes(ind.polyToCubeMap) + memBytes(ind.cubeToPolyMap)
+    + memBytes(ind.shortToLongMap) + memBytes(ind.shortToPolyMap)
+    + memBytes(ind.cycVec) + memBytes(ind.phimX);
+  n += pConvVec.MaxLength()
+       * (sizeof(PowerfulConversion) + (ind.phim+1)*sizeof(long));
+  return n;
+}
+
 
 void PowerfulDCRT::dcrtToPowerful(Vec<ZZ>& out, const DoubleCRT& dcrt) const
 {
@@ -261,21 +277,36 @@ void PowerfulDCRT::dcrtToPowerful(Vec<ZZ>& out, const DoubleCRT& dcrt) const
     clear(out);
     return;
   }
-  zz_pBak bak; bak.save(); // backup NTL's current modulus
+  Vec<long> ivec; // the indexes of the primes
+  for (long i = set.first(); i <= set.last(); i = set.next(i)) ivec.append(i);
+  long n = ivec.length();
+
+  // Convert the rows in parallel, each thread setting its own modulus
+  Vec< Vec<zz_p> > rows;
+  rows.SetLength(n);
+  Vec<long> primes;
+  primes.SetLength(n);
+  FHE_EXEC_RANGE(n, first, last)
+    zz_pBak bak; bak.save(); // backup this thread's modulus
+    for (long j = first; j < last; j++) {
+      long i = ivec[j];
+      zz_pX oneRowPoly;
+      primes[j] = dcrt.getOneRow(oneRowPoly,i);
+      pConvVec[i].restoreModulus();
+
+      HyperCube<zz_p> oneRowPwrfl(indexes.shortSig);
+      pConvVec[i].polyToPowerful(oneRowPwrfl, oneRowPoly);
+      rows[j] = oneRowPwrfl.getData();
+    }
+  FHE_EXEC_RANGE_END
 
   ZZ product = conv<ZZ>(1L);
-  for (long i = set.first(); i <= set.last(); i = set.next(i)) {
-    pConvVec[i].restoreModulus();
-    zz_pX oneRowPoly;
-    long newPrime = dcrt.getOneRow(oneRowPoly,i);
-
-    HyperCube<zz_p> oneRowPwrfl(indexes.shortSig);
-    pConvVec[i].polyToPowerful(oneRowPwrfl, oneRowPoly);
-    if (i == set.first()) // just copy
-      conv(out, oneRowPwrfl.getData());
-    else                  // CRT
-      intVecCRT(out, product, oneRowPwrfl.getData(), newPrime); // in NumbTh
-    product *= newPrime;
+  for (long j = 0; j < n; j++) {
+    if (j == 0) // just copy
+      conv(out, rows[j]);
+    else        // CRT
+      intVecCRT(out, product, rows[j], primes[j]); // in NumbTh
+    product *= primes[j];
   }
 }
 
@@ -291,49 +322,113 @@ void PowerfulDCRT::ZZXtoPowerful(Vec<ZZ>& out, const ZZX& poly,
   if (empty(set))
     set = IndexSet(0, pConvVec.length()-1);
 
-  zz_pBak bak; bak.save(); // backup NTL's current modulus
+  Vec<long> ivec; // the indexes of the primes
+  for (long i = set.first(); i <= set.last(); i = set.next(i)) ivec.append(i);
+  long n = ivec.length();
+
+  // Convert the rows in parallel, each thread setting its own modulus
+  Vec< Vec<zz_p> > rows;
+  rows.SetLength(n);
+  Vec<long> primes;
+  primes.SetLength(n);
+  FHE_EXEC_RANGE(n, first, last)
+    zz_pBak bak; bak.save(); // backup this thread's modulus
+    for (long j = first; j < last; j++) {
+      const PowerfulConversion& pConv = pConvVec[ivec[j]];
+      pConv.restoreModulus();
+      primes[j] = zz_p::modulus();
+      zz_pX oneRowPoly;
+      conv(oneRowPoly, poly);  // reduce mod p and convert to zz_pX
+
+      HyperCube<zz_p> oneRowPwrfl(indexes.shortSig);
+      pConv.polyToPowerful(oneRowPwrfl, oneRowPoly);
+      rows[j] = oneRowPwrfl.getData();
+    }
+  FHE_EXEC_RANGE_END
 
   ZZ product = conv<ZZ>(1L);
-  for (long i = set.first(); i <= set.last(); i = set.next(i)) {
-    pConvVec[i].restoreModulus();
-    long newPrime = zz_p::modulus();
-    zz_pX oneRowPoly;
-    conv(oneRowPoly, poly);  // reduce mod p and convert to zz_pX
-
-    HyperCube<zz_p> oneRowPwrfl(indexes.shortSig);
-    pConvVec[i].polyToPowerful(oneRowPwrfl, oneRowPoly);
-    if (i == set.first()) // just copy
-      conv(out, oneRowPwrfl.getData());
-    else                  // CRT
-      intVecCRT(out, product, oneRowPwrfl.getData(), newPrime); // in NumbTh
-    product *= newPrime;
+  for (long j = 0; j < n; j++) {
+    if (j == 0) // just copy
+      conv(out, rows[j]);
+    else        // CRT
+      intVecCRT(out, product, rows[j], primes[j]); // in NumbTh
+    product *= primes[j];
   }
 }
 
-//FIXME: both the reduction from powerful to the individual primes and
-//  the CRT back to poly can be made more efficient
+// Reduce the powerful coefficients modulo each prime and convert them to
+// a polynomial, with the primes spread over the threads, then CRT the
+// coefficients (in parallel over blocks of coefficients). V is either
+// Vec<ZZ> or zzX, the latter saves the big-integer reductions when the
+// coefficients are known to be small (as after rawModSwitch).
+template<class V>
+static void powerfulToZZXimpl(ZZX& poly, const V& powerful,
+                              const IndexSet& s,
+                              const Vec<PowerfulConversion>& pConvVec,
+                              const CubeSignature& shortSig)
+{
+  Vec<long> ivec; // the indexes of the primes
+  for (long i = s.first(); i <= s.last(); i = s.next(i)) ivec.append(i);
+  long n = ivec.length();
+  long phim = shortSig.getSize();
+
+  Vec< Vec<long> > rows; // rows[j][h] = coefficient h modulo primes[j]
+  rows.SetLength(n);
+  Vec<long> primes;
+  primes.SetLength(n);
+  FHE_EXEC_RANGE(n, first, last)
+    zz_pBak bak; bak.save(); // backup this thread's modulus
+    for (long j = first; j < last; j++) {
+      const PowerfulConversion& pConv = pConvVec[ivec[j]];
+      pConv.restoreModulus();
+
+      HyperCube<zz_p> oneRowPwrfl(shortSig);
+      conv(oneRowPwrfl.getData(), powerful); // reduce, convert to Vec<zz_p>
+
+      zz_pX oneRowPoly;
+      primes[j] = pConv.powerfulToPoly(oneRowPoly, oneRowPwrfl);
+
+      Vec<long>& row = rows[j];
+      row.SetLength(phim);
+      long d = deg(oneRowPoly); // copy the coefficents, pad by zeros
+      for (long h = 0; h <= d; h++) row[h] = rep(oneRowPoly.rep[h]);
+      for (long h = d+1; h < phim; h++) row[h] = 0;
+    }
+  FHE_EXEC_RANGE_END
+
+  // Room for the product of the primes, allocated here rather than by
+  // all the threads at once
+  long nbits = 1;
+  for (long j = 0; j < n; j++) nbits += NumBits(primes[j]);
+  poly.rep.SetLength(phim);
+  for (long h = 0; h < phim; h++)
+    poly.rep[h].SetSize((nbits + NTL_ZZ_NBITS-1)/NTL_ZZ_NBITS + 1);
+
+  FHE_EXEC_RANGE(phim, first, last)
+    ZZ product;
+    for (long h = first; h < last; h++) {
+      ZZ& coef = poly.rep[h];
+      clear(coef);
+      set(product);
+      for (long j = 0; j < n; j++) // coef in (-product/2, product/2]
+        CRT(coef, product, rows[j][h], primes[j]);
+    }
+  FHE_EXEC_RANGE_END
+  poly.normalize();
+}
+
 void PowerfulDCRT::powerfulToZZX(ZZX& poly, const Vec<ZZ>& powerful,
 				 IndexSet set) const
 {
-  zz_pBak bak; bak.save(); // backup NTL's current modulus
-
   if (empty(set)) set = IndexSet(0, pConvVec.length()-1);
+  powerfulToZZXimpl(poly, powerful, set, pConvVec, indexes.shortSig);
+}
 
-  clear(poly);
-  //  poly.SetLength(powerful.length());
-  ZZ product = conv<ZZ>(1L);
-  for (long i = set.first(); i <= set.last(); i = set.next(i)) {
-    pConvVec[i].restoreModulus();
-    //    long newPrime = zz_p::modulus();
-
-    HyperCube<zz_p> oneRowPwrfl(indexes.shortSig);
-    conv(oneRowPwrfl.getData(), powerful); // reduce and convert to Vec<zz_p>
-
-    zz_pX oneRowPoly;
-    pConvVec[i].powerfulToPoly(oneRowPoly, oneRowPwrfl);
-    CRT(poly, product, oneRowPoly);                   // NTL :-)
-  }
-  poly.normalize();
+void PowerfulDCRT::powerfulToZZX(ZZX& poly, const zzX& powerful,
+				 IndexSet set) const
+{
+  if (empty(set)) set = IndexSet(0, pConvVec.length()-1);
+  powerfulToZZXimpl(poly, powerful, set, pConvVec, indexes.shortSig);
 }
 
 /********************************************************************/
@@ -39,6 +39,7 @@ class PowerfulTranslationIndexes {
   NTL::Vec<long> polyToCubeMap; // index translation tables
   NTL::Vec<long> cubeToPolyMap;
   NTL::Vec<long> shortToLongMap;
+  NTL::Vec<long> shortToPolyMap; // = cubeToPolyMap[shortToLongMap[i]]
 
   NTL::Vec<NTL::ZZX> cycVec; // cycvec[i] = Phi_mi(X)
   NTL::ZZX phimX;
@@ -80,7 +81,6 @@ class PowerfulTranslationIndexes {
 class PowerfulConversion {
   const PowerfulTranslationIndexes* indexes;
   NTL::zz_pContext zzpContext;
-  NTL::Vec<NTL::zz_pXModulus> cycVec_p; // cycvec[i] = Phi_mi(X)
   NTL::zz_pXModulus phimX_p;
 
 public:
@@ -95,11 +95,7 @@ public:
     if (indexes!=NULL) return; // cannot re-initialize a non-NULL object
     indexes = &ind;
 
-    cycVec_p.SetLength(ind.cycVec.length());
     zzpContext.save(); // store the current modulus
-    for (long i=0; i<ind.cycVec.length(); i++) {
-      cycVec_p[i] = NTL::conv<NTL::zz_pX>(ind.cycVec[i]); // convert to zz_pXModulus
-    }
     phimX_p = NTL::conv<NTL::zz_pX>(ind.phimX); // convert to zz_pXModulus
   }
 
@@ -128,6 +124,10 @@ class PowerfulDCRT {
 public:
   PowerfulDCRT(const FHEcontext& _context, const NTL::Vec<long>& mvec);
 
+  //! The bytes of the index tables and of this object, with the modulus
+  //! of each conversion counted as phi(m) numbers (see memoryUsage.h)
+  long memoryUsage() const;
+
   const PowerfulTranslationIndexes& getIndexTranslation() const
   { return indexes; }
   const PowerfulConversion& getPConv(long i) const
@@ -141,6 +141,9 @@ public:
 		     IndexSet s=IndexSet::emptySet()) const;
   void powerfulToZZX(NTL::ZZX& poly, const NTL::Vec<NTL::ZZ>& powerful,
 		     IndexSet s=IndexSet::emptySet()) const;
+  //! Same, for powerful coefficients that fit in a long
+  void powerfulToZZX(NTL::ZZX& poly, const zzX& powerful,
+		     IndexSet s=IndexSet::emptySet()) const;
 };
 
 
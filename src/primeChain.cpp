@@ -16,10 +16,12 @@
 #include <climits>
 #include <cmath>
 #include <algorithm>
+#include <NTL/BasicThreadPool.h>
 #include "primeChain.h"
 #include "FHEContext.h"
 #include "sample.h"
 #include "binio.h"
+#include "taskScheduler.h"
 
 NTL_CLIENT
 
@@ -348,7 +350,7 @@ void FHEcontext::AddSmallPrime(long q)
 {
   assert(!inChain(q));
   long i = moduli.size(); // The index of the new prime in the list
-  moduli.push_back( Cmodulus(zMStar, q, 0) );
+  moduli.push_back( Cmodulus(zMStar, q, 0, lazyModuli) );
   smallPrimes.insert(i);
 }
 
@@ -356,7 +358,7 @@ void FHEcontext::AddCtxtPrime(long q)
 {
   assert(!inChain(q));
   long i = moduli.size(); // The index of the new prime in the list
-  moduli.push_back( Cmodulus(zMStar, q, 0) );
+  moduli.push_back( Cmodulus(zMStar, q, 0, lazyModuli) );
   ctxtPrimes.insert(i);
 }
 
@@ -364,10 +366,38 @@ void FHEcontext::AddSpecialPrime(long q)
 {
   assert(!inChain(q));
   long i = moduli.size(); // The index of the new prime in the list
-  moduli.push_back( Cmodulus(zMStar, q, 0) );
+  moduli.push_back( Cmodulus(zMStar, q, 0, lazyModuli) );
   specialPrimes.insert(i);
 }
 
+IndexSet FHEcontext::addModuli(const vector<long>& qs)
+{
+  long n = lsize(qs);
+  long first = moduli.size(); // The index of the first new prime
+  for (long i=0; i<n; i++) {
+    assert(!inChain(qs[i]));
+    assert(std::find(qs.begin(), qs.begin()+i, qs[i]) == qs.begin()+i);
+  }
+  if (n == 0) return IndexSet::emptySet();
+
+  // Each Cmodulus installs its own NTL modulus, which is thread-local
+  moduli.resize(first+n);
+  FHE_EXEC_RANGE(n, lo, hi)
+  for (long i=lo; i<hi; i++)
+    moduli[first+i] = Cmodulus(zMStar, qs[i], 0, lazyModuli);
+  FHE_EXEC_RANGE_END
+  return IndexSet(first, first+n-1);
+}
+
+void FHEcontext::AddSmallPrimes(const vector<long>& qs)
+{ smallPrimes.insert(addModuli(qs)); }
+
+void FHEcontext::AddCtxtPrimes(const vector<long>& qs)
+{ ctxtPrimes.insert(addModuli(qs)); }
+
+void FHEcontext::AddSpecialPrimes(const vector<long>& qs)
+{ specialPrimes.insert(addModuli(qs)); }
+
 //! @brief Add small primes to get target resolution
 void addSmallPrimes(FHEcontext& context, long resolution, long cpSize)
 {
@@ -421,14 +451,14 @@ void addSmallPrimes(FHEcontext& context, long resolution, long cpSize)
   std::sort(sizes.begin(), sizes.end()); // order by size
 
   long last_sz = 0;
-  long sz_cnt = 0;
   std::unique_ptr<PrimeGenerator> gen;
+  vector<long> qs;
   for (long sz : sizes) {
     if (sz != last_sz) gen.reset(new PrimeGenerator(sz, m));
-    long q = gen->next();
-    context.AddSmallPrime(q);
+    qs.push_back(gen->next());
     last_sz = sz;
   }
+  context.AddSmallPrimes(qs);
 }
 
 // Determine the target size of the ctxtPrimes. The target size is
@@ -473,16 +503,50 @@ void addCtxtPrimes(FHEcontext& context, long nBits, long targetSize)
 
   PrimeGenerator gen(targetSize, m);
   double bitlen = 0;     // how many bits we already have
+  vector<long> qs;
   while (bitlen < nBits-0.5) {
     long q = gen.next();     // generate the next prime
-    context.AddCtxtPrime(q); // add it to the list
+    qs.push_back(q);         // add it to the list
     bitlen += log2(q);
   }
+  context.AddCtxtPrimes(qs);
 }
 
 
+std::vector<IndexSet> splitIntoDigits(const IndexSet& primes, long nDgts)
+{
+  if (nDgts > primes.card()) nDgts = primes.card(); // sanity checks
+  if (nDgts <= 0) nDgts = 1;
+
+  // NOTE: This assumes that all the primes have roughly the same size
+  vector<IndexSet> digits(nDgts);
+  IndexSet remaining = primes;
+  for (long dgt=0; dgt<nDgts-1; dgt++) {
+    long digitCard = divc(remaining.card(), nDgts-dgt);
+         // ceiling(#-of-remaining-primes, #-or-remaining-digits)
+
+    for (long i : remaining) {
+      digits[dgt].insert(i);
+      if (digits[dgt].card() >= digitCard) break;
+    }
+    remaining.remove(digits[dgt]); // update the remaining set
+  }
+  // The last digit has everything else
+  if (empty(remaining) && nDgts>1) // sanity chack, use one less digit
+    digits.pop_back();
+  else
+    digits[nDgts-1] = remaining;
+  return digits;
+}
+
+double ksDigitBudget(const FHEcontext& context, long nDgts, long ptxtSpace)
+{
+  return context.logOfProduct(context.specialPrimes) - log(nDgts)
+    - log(to_double(context.stdev)*2) - log(double(max(ptxtSpace, 1L)));
+}
+
 void addSpecialPrimes(FHEcontext& context, long nDgts, 
-                      bool willBeBootstrappable)
+                      bool willBeBootstrappable, long budgetDgts)
 {
   const PAlgebra& palg = context.zMStar;
   long p = palg.getP();
@@ -496,40 +560,19 @@ void addSpecialPrimes(FHEcontext& context, long nDgts,
     p2e *= NTL::power_long(p, e-ePrime);
   }
 
-  long nCtxtPrimes = context.ctxtPrimes.card();
-  if (nDgts > nCtxtPrimes) nDgts = nCtxtPrimes; // sanity checks
-  if (nDgts <= 0) nDgts = 1;
-
-  context.digits.resize(nDgts); // allocate space
-
-  if (nDgts>1) { // we break ciphertext into a few digits when key-switching
-    // NOTE: The code below assumes that all the ctxtPrimes have roughly the same size
+  // we break ciphertext into a few digits when key-switching
+  context.digits = splitIntoDigits(context.ctxtPrimes, nDgts);
+  nDgts = context.digits.size();
 
-    IndexSet remaining = context.ctxtPrimes;
-    for (long dgt=0; dgt<nDgts-1; dgt++) {
-      long digitCard = divc(remaining.card(), nDgts-dgt);
-           // ceiling(#-of-remaining-primes, #-or-remaining-digits)
-
-      for (long i : remaining) {
-	context.digits[dgt].insert(i);
-        if (context.digits[dgt].card() >= digitCard) break;
-      }
-      remaining.remove(context.digits[dgt]); // update the remaining set
-    }
-    // The last digit has everything else
-    if (empty(remaining)) { // sanity chack, use one less digit
-      nDgts--;
-      context.digits.resize(nDgts);
-    }
-    else
-      context.digits[nDgts-1] = remaining;
-  }
-  else { // only one digit
-    context.digits[0] = context.ctxtPrimes;
-  }
+  // The special primes must absorb digits of the size of those with
+  // budgetDgts digits, which may be fewer (and larger) than the ones of
+  // the context. Matrices with their own digits can then use that few.
+  vector<IndexSet> budgetDigits = context.digits;
+  if (budgetDgts > 0 && budgetDgts < nDgts)
+    budgetDigits = splitIntoDigits(context.ctxtPrimes, budgetDgts);
 
   double maxDigitLog = 0.0;
-  for (auto& digit : context.digits) {
+  for (auto& digit : budgetDigits) {
     double size = context.logOfProduct(digit);
     if (size > maxDigitLog) maxDigitLog = size;
   }
@@ -562,6 +605,7 @@ void addSpecialPrimes(FHEcontext& context, long nDgts,
   PrimeGenerator gen(nbits, m);
 
   double logSoFar = 0.0;
+  vector<long> qs;
   while (logSoFar < logOfSpecialPrimes) {
     long q = gen.next();
 
@@ -571,19 +615,20 @@ void addSpecialPrimes(FHEcontext& context, long nDgts,
     // this is not the most efficient way to do this,
     // but it doesn't make sense to optimize this any further
 
-    context.AddSpecialPrime(q);
+    qs.push_back(q);
     logSoFar += log(q);
   }
+  context.AddSpecialPrimes(qs);
 
   //cerr << "****** special primes: " << logOfSpecialPrimes << " " << context.logOfProduct(context.specialPrimes) << "\n";
 }
 
 void buildModChain(FHEcontext& context, long nBits, long nDgts,
-                      bool willBeBootstrappable, long resolution)
+                   bool willBeBootstrappable, long resolution, long budgetDgts)
 {
   long pSize = ctxtPrimeSize(nBits);
   addSmallPrimes(context, resolution, pSize);
   addCtxtPrimes(context, nBits, pSize);
-  addSpecialPrimes(context, nDgts, willBeBootstrappable);
+  addSpecialPrimes(context, nDgts, willBeBootstrappable, budgetDgts);
   context.setModSizeTable();
 }
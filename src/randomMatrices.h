@@ -78,6 +78,66 @@ buildRandomMatrix(const EncryptedArray& ea, long dim)
   }
 }
 
+// A random matrix whose nonzero entries are within distance w of the main
+// diagonal (cyclically), listed as 2w-1 diagonals
+template<class type> class RandomBandedMatrix : public MatMul1DSparse_derived<type> {
+public:
+  PA_INJECT(type) 
+
+private:
+  std::vector< std::vector< RX > > diagData; // for the listed diagonals
+  std::vector<long> diagIdx, pos;            // pos[i] = -1 if not listed
+  const EncryptedArray& ea;
+  long dim;
+
+public:
+  RandomBandedMatrix(const EncryptedArray& _ea, long _dim, long w): 
+    ea(_ea), dim(_dim)
+  {
+    RBak bak; bak.save(); ea.getAlMod().restoreContext();
+    long d = ea.getDegree();
+    long D = ea.sizeOfDimension(dim);
+
+    pos.assign(D, -1);
+    for (long i = 0; i < D; i++)
+      if (i < w || D-i < w) {
+        pos[i] = diagIdx.size();
+        diagIdx.push_back(i);
+      }
+    diagData.resize(diagIdx.size());
+    for (auto& diag: diagData) {
+      diag.resize(D);
+      for (auto& entry: diag) random(entry, d);
+    }
+  }
+
+  const EncryptedArray& getEA() const override { return ea; }
+  bool multipleTransforms() const override { return false; }
+  long getDim() const override { return dim; }
+  std::vector<long> getDiagonals() const override { return diagIdx; }
+
+  bool getDiagonalEntry(RX& out, long i, long j, long k) const override {
+    assert(i >= 0 && i < lsize(pos));
+    if (pos[i] < 0 || IsZero(diagData[pos[i]][j])) return true;
+    out = diagData[pos[i]][j];
+    return false;
+  }
+};
+
+static MatMul1D*
+buildRandomBandedMatrix(const EncryptedArray& ea, long dim, long w)
+{
+  switch (ea.getTag()) {
+    case PA_GF2_tag: {
+      return new RandomBandedMatrix<PA_GF2>(ea, dim, w);
+    }
+    case PA_zz_p_tag: {
+      return new RandomBandedMatrix<PA_zz_p>(ea, dim, w);
+    }
+    default: return 0;
+  }
+}
+
 
 
 template<class type> class RandomMultiMatrix : public  MatMul1D_derived<type> {
@@ -340,6 +400,47 @@ static MatMulFull* buildRandomFullMatrix(const EncryptedArray& ea)
   }
 }
 
+template<class type> 
+class RandomTiledMatrix : public MatMulTiled_derived<type> {
+  PA_INJECT(type) 
+  const EncryptedArray& ea;
+  std::vector<std::vector<RX>> data;
+
+public:
+  RandomTiledMatrix(const EncryptedArray& _ea, long rows, long cols): ea(_ea) {
+    long d = ea.getDegree();
+
+    RBak bak; bak.save(); ea.getContext().alMod.restoreContext();
+    data.resize(rows);
+    for (long i: range(rows)) {
+      data[i].resize(cols);
+      for (long j: range(cols)) random(data[i][j], d);
+    }
+  }
+
+  bool get(RX& out, long i, long j) const override {
+    assert(i >= 0 && i < getRows());
+    assert(j >= 0 && j < getCols());
+    if (IsZero(data[i][j])) return true;
+    out = data[i][j];
+    return false;
+  }
+
+  const EncryptedArray& getEA() const override { return ea; }
+  long getRows() const override { return data.size(); }
+  long getCols() const override { return data.empty()? 0 : data[0].size(); }
+};
+
+static MatMulTiled*
+buildRandomTiledMatrix(const EncryptedArray& ea, long rows, long cols)
+{
+  switch (ea.getTag()) {
+    case PA_GF2_tag: { return new RandomTiledMatrix<PA_GF2>(ea, rows, cols); }
+    case PA_zz_p_tag:{ return new RandomTiledMatrix<PA_zz_p>(ea, rows, cols); }
+    default: return nullptr;
+  }
+}
+
 
 
 template<class type> 
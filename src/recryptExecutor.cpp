@@ -0,0 +1,214 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <atomic>
+#include <algorithm>
+#include <NTL/BasicThreadPool.h>
+#include "recryptExecutor.h"
+#include "FHE.h"
+#include "CtPtrs.h"
+#include "circuit.h"
+
+NTL_CLIENT
+
+RecryptExecutor::RecryptExecutor(FHEPubKey& _pubKey, long nWorkers,
+                                 long nThreads)
+  : pubKey(_pubKey), threadsPerWorker(max(nThreads, 1L)),
+    nextSeq(0), running(0), stopping(false)
+{
+  for (long i=0; i<max(nWorkers, 1L); i++)
+    workers.emplace_back(&RecryptExecutor::workerLoop, this);
+}
+
+RecryptExecutor::~RecryptExecutor()
+{
+  vector<long> jobs;
+  {
+    lock_guard<mutex> lock(mx);
+    for (auto& c: cancellers) jobs.push_back(c.first);
+  }
+  for (long job: jobs) cancel(job); // those that started run to the end
+  {
+    lock_guard<mutex> lock(mx);
+    stopping = true;
+  }
+  wakeup.notify_all();
+  for (thread& w: workers) w.join();
+}
+
+void RecryptExecutor::workerLoop()
+{
+  SetNumThreads(threadsPerWorker); // the NTL pool of this thread
+  unique_lock<mutex> lock(mx);
+  while (true) {
+    wakeup.wait(lock, [this]() { return stopping || !order.empty(); });
+    if (order.empty()) break; // stopping, and nothing left to run
+
+    long seq = order.begin()->second;
+    order.erase(order.begin());
+    Chunk chunk = std::move(chunks.at(seq));
+    chunks.erase(seq);
+    started[chunk.job]++;
+    running++;
+
+    lock.unlock();
+    {
+      CircuitPause pause; // not part of whatever circuit is recorded
+      chunk.run();        // reports its own errors to its future
+    }
+    lock.lock();
+
+    running--;
+    if (--remaining[chunk.job] == 0) { // the job is done
+      remaining.erase(chunk.job);
+      started.erase(chunk.job);
+      cancellers.erase(chunk.job);
+    }
+    if (order.empty() && running == 0) idle.notify_all();
+  }
+}
+
+// Queue one chunk, the lock must be held
+long RecryptExecutor::enqueue(long job, long priority,
+                              std::function<void()> run)
+{
+  long seq = nextSeq++;
+  Chunk& chunk = chunks[seq];
+  chunk.job = job;
+  chunk.priority = priority;
+  chunk.run = std::move(run);
+  order.insert(make_pair(-priority, seq));
+  remaining[job]++;
+  return seq;
+}
+
+std::future<Ctxt> RecryptExecutor::submit(Ctxt ctxt, long priority,
+                                          bool thin, Callback done,
+                                          long* jobId)
+{
+  auto prom = make_shared< std::promise<Ctxt> >();
+  auto c = make_shared<Ctxt>(std::move(ctxt));
+  std::future<Ctxt> result = prom->get_future();
+
+  FHEPubKey& pk = pubKey;
+  auto run = [prom, c, thin, done, &pk]() {
+    try {
+      if (thin) pk.thinReCrypt(*c);
+      else      pk.reCrypt(*c);
+      if (done) done(*c);
+      prom->set_value(std::move(*c));
+    }
+    catch (...) { prom->set_exception(std::current_exception()); }
+  };
+
+  {
+    lock_guard<mutex> lock(mx);
+    long job = enqueue(nextSeq, priority, run); // named after its chunk
+    cancellers[job] = [prom]() {
+      prom->set_exception(std::make_exception_ptr(RecryptCancelled()));
+    };
+    if (jobId) *jobId = job;
+  }
+  wakeup.notify_one();
+  return result;
+}
+
+namespace {
+// The state shared by the chunks of a batch
+struct BatchState {
+  std::vector<Ctxt> cts;
+  std::promise< std::vector<Ctxt> > prom;
+  std::atomic_long left;
+  std::atomic_bool failed; // the future has an exception
+
+  BatchState(std::vector<Ctxt>&& _cts)
+    : cts(std::move(_cts)), left(0), failed(false) {}
+
+  void fail(std::exception_ptr e)
+  { if (!failed.exchange(true)) prom.set_exception(e); }
+};
+}
+
+std::future< std::vector<Ctxt> >
+RecryptExecutor::submit(std::vector<Ctxt> cts, long priority, bool thin,
+                        long chunk, long* jobId)
+{
+  long n = cts.size();
+  if (chunk <= 0 || chunk > n) chunk = max(n, 1L);
+  auto st = make_shared<BatchState>(std::move(cts));
+  std::future< std::vector<Ctxt> > result = st->prom.get_future();
+  if (n == 0) {
+    st->prom.set_value(std::vector<Ctxt>());
+    if (jobId) *jobId = -1;
+    return result;
+  }
+  st->left = divc(n, chunk);
+
+  FHEPubKey& pk = pubKey;
+  {
+    lock_guard<mutex> lock(mx);
+    long job = nextSeq;
+    for (long lo=0; lo<n; lo+=chunk) {
+      long hi = min(n, lo+chunk);
+      enqueue(job, priority, [st, lo, hi, thin, &pk]() {
+        try {
+          vector<Ctxt*> v;
+          for (long i=lo; i<hi; i++) v.push_back(&st->cts[i]);
+          if (thin) pk.thinReCrypt(CtPtrs_vectorPt(v));
+          else      pk.reCrypt(CtPtrs_vectorPt(v));
+        }
+        catch (...) { st->fail(std::current_exception()); }
+        if (--st->left == 0 && !st->failed)
+          st->prom.set_value(std::move(st->cts));
+      });
+    }
+    cancellers[job] = [st]() {
+      st->fail(std::make_exception_ptr(RecryptCancelled()));
+    };
+    if (jobId) *jobId = job;
+  }
+  wakeup.notify_all();
+  return result;
+}
+
+bool RecryptExecutor::cancel(long jobId)
+{
+  lock_guard<mutex> lock(mx);
+  auto it = cancellers.find(jobId);
+  if (it == cancellers.end() || started.count(jobId) > 0) return false;
+
+  for (auto c = chunks.begin(); c != chunks.end(); ) {
+    if (c->second.job == jobId) {
+      order.erase(make_pair(-c->second.priority, c->first));
+      c = chunks.erase(c);
+    }
+    else ++c;
+  }
+  remaining.erase(jobId);
+  std::function<void()> cancelIt = std::move(it->second);
+  cancellers.erase(it);
+  cancelIt();
+
+  if (order.empty() && running == 0) idle.notify_all();
+  return true;
+}
+
+long RecryptExecutor::pending() const
+{
+  lock_guard<mutex> lock(mx);
+  return order.size();
+}
+
+void RecryptExecutor::wait()
+{
+  unique_lock<mutex> lock(mx);
+  idle.wait(lock, [this]() { return order.empty() && running == 0; });
+}
@@ -0,0 +1,121 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _RECRYPT_EXECUTOR_H_
+#define _RECRYPT_EXECUTOR_H_
+/**
+ * @file recryptExecutor.h
+ * @brief Running recryptions in the background.
+ *
+ * A RecryptExecutor owns a few worker threads, each of them with its own
+ * NTL thread pool, so a recryption does not take over the pool of the
+ * thread that asked for it. Jobs are queued by priority (higher first,
+ * then in submission order), and each job returns a std::future with the
+ * recrypted ciphertexts. The ciphertexts are taken by value, so the caller
+ * is free to go on with other work (including other Ctxt operations with
+ * the same keys) while the job runs.
+ *
+ * A running recryption cannot be interrupted. To let urgent jobs get ahead
+ * of a large batch, a batch can be split into chunks that are queued
+ * separately, and a job of higher priority runs as soon as a worker is
+ * done with its current chunk. A job that has not started can be
+ * cancelled, its future then throws RecryptCancelled.
+ *
+ * The operations of these recryptions are not seen by the telemetry hooks
+ * nor by a circuit hook (see circuit.h). While a job runs the circuit hook
+ * sees nothing at all, so do not record a circuit while jobs are running.
+ **/
+#include <vector>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <stdexcept>
+#include "Ctxt.h"
+
+class FHEPubKey;
+
+//! @brief The exception in the future of a cancelled job
+class RecryptCancelled : public std::runtime_error {
+public:
+  RecryptCancelled(): std::runtime_error("recryption job cancelled") {}
+};
+
+//! @class RecryptExecutor
+//! @brief A priority queue of recryption jobs, run by dedicated workers
+class RecryptExecutor {
+public:
+  //! Called on the worker thread with the result, before the future is set
+  typedef std::function<void(const Ctxt&)> Callback;
+
+private:
+  struct Chunk {
+    long job, priority;         // the job it is part of
+    std::function<void()> run;  // recrypts this chunk
+  };
+
+  FHEPubKey& pubKey;
+  long threadsPerWorker;
+  std::vector<std::thread> workers;
+
+  mutable std::mutex mx;
+  std::condition_variable wakeup, idle;
+  std::set<std::pair<long,long>> order;  // (-priority, sequence) of chunks
+  std::map<long, Chunk> chunks;          // by sequence
+  std::map<long, std::function<void()>> cancellers; // by job
+  std::map<long, long> started;          // chunks started, by job
+  std::map<long, long> remaining;        // chunks not finished, by job
+  long nextSeq, running;
+  bool stopping;
+
+  void workerLoop();
+  long enqueue(long job, long priority, std::function<void()> run);
+
+public:
+  //! @param nWorkers  how many recryptions can run at once
+  //! @param nThreads  the size of the NTL thread pool of each worker
+  RecryptExecutor(FHEPubKey& _pubKey, long nWorkers=1, long nThreads=1);
+
+  //! Cancels the jobs that have not started, and waits for the others
+  ~RecryptExecutor();
+
+  RecryptExecutor(const RecryptExecutor&) = delete;
+  RecryptExecutor& operator=(const RecryptExecutor&) = delete;
+
+  //! @brief Queue the recryption of ctxt.
+  //! @param thin   use thinReCrypt rather than reCrypt
+  //! @param done   if set, called with the result on the worker thread
+  //! @param jobId  if not NULL, set to the id to cancel the job with
+  std::future<Ctxt> submit(Ctxt ctxt, long priority=0, bool thin=false,
+                           Callback done=nullptr, long* jobId=NULL);
+
+  //! @brief Queue the recryption of a batch, in chunks of at most chunk
+  //! ciphertexts (0: all of them at once, as one batch reCrypt). The chunks
+  //! are queued with the same priority, and may run on several workers.
+  std::future< std::vector<Ctxt> >
+  submit(std::vector<Ctxt> cts, long priority=0, bool thin=false,
+         long chunk=0, long* jobId=NULL);
+
+  //! @brief Cancel a job. Returns false if some of it has already started
+  //! (or if it is done), in which case it runs to completion.
+  bool cancel(long jobId);
+
+  //! The number of chunks waiting in the queue
+  long pending() const;
+
+  //! Wait until the queue is empty and no worker is busy
+  void wait();
+};
+
+#endif // ifndef _RECRYPT_EXECUTOR_H_
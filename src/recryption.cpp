@@ -20,6 +20,13 @@
 #include "norms.h"
 #include "sample.h"
 #include "debugging.h"
+#include "binio.h"
+#include "telemetry.h"
+#include "circuit.h"
+#include "memoryUsage.h"
+#include "ctxtTrace.h"
+#include "taskScheduler.h"
+#include "metrics.h"
 
 NTL_CLIENT
 
@@ -66,38 +73,64 @@ static long makeDivisible(vec_ZZ& vec, long p2e, long p2r, long q, long a,
   zzX vVec(INIT_SIZE, vec.length());
 #endif
 
-  long maxU = 0;
-  for (long i=0; i<vec.length(); i++) {
-    ZZ& z = vec[i];
-    long u, v;
-
-    // What to add to z to make it divisible by p2e?
-    long zMod = rem(z, p2e); // zMod is in [0,p2e-1]
-    if (zMod > p2e/2) { // need to add a positive number
-      zMod = p2e - zMod;
-      u = zMod/p2r;
-      if (u > aa) u = aa;
-    }
-    else {              // need to add a negative number
-      u = -(zMod/p2r);
-      if (u < -aa) u = -aa;
-      zMod = -zMod;
-    }
-    v = zMod - u*p2r;
-    z += u*p2r + to_ZZ(q)*v; // make z divisible by p2e
-
-    if (rem(z,p2e) != 0) { // sanity check
-      cerr << "**error: original z["<<i<<"]=" << (z-(u*p2r+to_ZZ(q)*v))
-	   << std::dec << ", p^r="<<p2r << ", p^e="<<p2e << endl;
-      cerr << "z' = z + "<<u<<"*p^r +"<<v<<"*q = "<<z<<endl;
-      exit(1);
-    }
-    if (abs(u) > maxU) maxU = abs(u);
+  // The coefficients are processed in parallel. When z (and the multiples
+  // added to it) fit in a long, z is adjusted with single-precision
+  // arithmetic and written back into its own storage.
+  const ZZ qZZ = to_ZZ(q);
+  const long wordBits = NTL_BITS_PER_LONG-3;
+  const bool smallQ = (NumBits(q) + NumBits(p2e) < wordBits);
+  PartitionInfo pinfo(vec.length(), fheAvailableThreads());
+  Vec<long> maxUs(INIT_SIZE, pinfo.NumIntervals(), 0L);
+
+  FHE_EXEC_INDEX(pinfo.NumIntervals(), index)
+    long first, last;
+    pinfo.interval(first, last, index);
+    for (long i=first; i<last; i++) {
+      ZZ& z = vec[i];
+      long u, v;
+
+      // What to add to z to make it divisible by p2e?
+      long zMod = rem(z, p2e); // zMod is in [0,p2e-1]
+      if (zMod > p2e/2) { // need to add a positive number
+        zMod = p2e - zMod;
+        u = zMod/p2r;
+        if (u > aa) u = aa;
+      }
+      else {              // need to add a negative number
+        u = -(zMod/p2r);
+        if (u < -aa) u = -aa;
+        zMod = -zMod;
+      }
+      v = zMod - u*p2r;
+
+      bool ok;
+      if (smallQ && NumBits(z) < wordBits) {
+        long zl = conv<long>(z) + u*p2r + q*v; // make z divisible by p2e
+        ok = (zl % p2e == 0);
+        conv(z, zl);
+      }
+      else {
+        z += u*p2r;
+        MulAddTo(z, qZZ, v); // make z divisible by p2e
+        ok = (rem(z,p2e) == 0);
+      }
+      if (!ok) { // sanity check
+        cerr << "**error: original z["<<i<<"]=" << (z-(u*p2r+qZZ*v))
+             << std::dec << ", p^r="<<p2r << ", p^e="<<p2e << endl;
+        cerr << "z' = z + "<<u<<"*p^r +"<<v<<"*q = "<<z<<endl;
+        exit(1);
+      }
+      if (abs(u) > maxUs[index]) maxUs[index] = abs(u);
 #ifdef DEBUG_PRINTOUT
-    uVec[i] = u;
-    vVec[i] = v;
+      uVec[i] = u;
+      vVec[i] = v;
 #endif
-  }
+    }
+  FHE_EXEC_INDEX_END
+
+  long maxU = 0;
+  for (long i=0; i<maxUs.length(); i++)
+    if (maxUs[i] > maxU) maxU = maxUs[i];
 
 #ifdef DEBUG_PRINTOUT
   if (dbgEa) {
@@ -219,6 +252,17 @@ RecryptData::~RecryptData()
   if (p2dConv!=NULL)   delete p2dConv;
 }
 
+MemoryReport RecryptData::memoryReport() const
+{
+  MemoryReport r("recryption data", sizeof(*this) + memBytes(mvec));
+  if (alMod != NULL) r.add("alMod", alMod->memoryUsage());
+  if (firstMap != NULL) r.add("firstMap", firstMap->memoryUsage());
+  if (secondMap != NULL) r.add("secondMap", secondMap->memoryUsage());
+  if (p2dConv != NULL) r.add("p2dConv", p2dConv->memoryUsage());
+  r.add("unpackSlotEncoding", memBytes(unpackSlotEncoding));
+  return r;
+}
+
 
 
 /**
@@ -331,7 +375,8 @@ bool RecryptData::operator==(const RecryptData& other) const
 
 // The main method
 void RecryptData::init(const FHEcontext& context, const Vec<long>& mvec_,
-                  bool enableThick, long t, bool build_cache_, bool minimal)
+                  bool enableThick, long t, bool build_cache_, bool minimal,
+                  const string& cacheDir)
 {
   if (alMod != NULL) { // were we called for a second time?
     cerr << "@Warning: multiple calls to RecryptData::init\n";
@@ -378,8 +423,92 @@ void RecryptData::init(const FHEcontext& context, const Vec<long>& mvec_,
     for (long k = 0; k < nslots; k++) v[k] = C[j];
     ea->encode(unpackSlotEncoding[j], v);
   }
-  firstMap = new EvalMap(*ea, minimal, mvec, true, build_cache);
-  secondMap = new EvalMap(*context.ea, minimal, mvec, false, build_cache);
+  // Collapse the regular matrices if the levels saved are worth more than
+  // the extra key-switchings
+  bool collapse = false;
+  if (ksPerLevel > 0) {
+    long levels, ks, cLevels, cKs;
+    EvalMap::estimateCost(levels, ks, *ea, mvec, false);
+    EvalMap::estimateCost(cLevels, cKs, *ea, mvec, true);
+    collapse = (cKs + ksPerLevel*cLevels < ks + ksPerLevel*levels);
+  }
+  firstMap = new EvalMap(*ea, minimal, mvec, true, build_cache,
+                         /*normal_basis=*/true, cacheDir, collapse);
+  secondMap = new EvalMap(*context.ea, minimal, mvec, false, build_cache,
+                          /*normal_basis=*/true, cacheDir, collapse);
+}
+
+void RecryptData::write(ostream& str) const
+{
+  writeEyeCatcher(str, BINIO_EYE_RECRYPT_BEGIN);
+  write_raw_int(str, alMod != NULL); // was it initialized?
+  if (alMod == NULL) {
+    writeEyeCatcher(str, BINIO_EYE_RECRYPT_END);
+    return;
+  }
+  write_ntl_vec_long(str, mvec);
+  write_raw_int(str, skHwt);
+  write_raw_int(str, e);
+  write_raw_int(str, ePrime);
+  write_raw_int(str, a);
+  write_raw_int(str, build_cache);
+
+  write_raw_int(str, firstMap != NULL); // were the thick maps built?
+  if (firstMap != NULL) {
+    write_raw_int(str, unpackSlotEncoding.size());
+    for (const ZZX& poly: unpackSlotEncoding) {
+      zzX coeffs;
+      convert(coeffs, poly);
+      write_ntl_vec_long(str, coeffs);
+    }
+    firstMap->write(str);
+    secondMap->write(str);
+  }
+  writeEyeCatcher(str, BINIO_EYE_RECRYPT_END);
+}
+
+void RecryptData::read(istream& str, const FHEcontext& context)
+{
+  if (alMod != NULL) { // were we already initialized?
+    cerr << "@Warning: RecryptData::read after RecryptData::init\n";
+    return;
+  }
+  // Not asserts: the reads must also be done with NDEBUG
+  long eye = readEyeCatcher(str, BINIO_EYE_RECRYPT_BEGIN);
+  if (eye != 0) Error("RecryptData::read: bad eye-catcher");
+  bool initialized = read_raw_int(str);
+  if (!initialized) {
+    eye = readEyeCatcher(str, BINIO_EYE_RECRYPT_END);
+    if (eye != 0) Error("RecryptData::read: bad eye-catcher");
+    return;
+  }
+  read_ntl_vec_long(str, mvec);
+  if (computeProd(mvec) != (long)context.zMStar.getM()) // sanity check
+    Error("RecryptData::read: mvec does not match the context");
+  skHwt = read_raw_int(str);
+  e = read_raw_int(str);
+  ePrime = read_raw_int(str);
+  a = read_raw_int(str);
+  build_cache = read_raw_int(str);
+
+  // These tables are quick to rebuild, see init
+  long r = context.alMod.getR();
+  alMod = new PAlgebraMod(context.zMStar, e-ePrime+r);
+  ea = new EncryptedArray(context, *alMod);
+  p2dConv = new PowerfulDCRT(context, mvec);
+
+  if (read_raw_int(str)) {
+    unpackSlotEncoding.resize(read_raw_int(str));
+    for (ZZX& poly: unpackSlotEncoding) {
+      zzX coeffs;
+      read_ntl_vec_long(str, coeffs);
+      convert(poly, coeffs);
+    }
+    firstMap = new EvalMap(*ea, str);
+    secondMap = new EvalMap(*context.ea, str);
+  }
+  eye = readEyeCatcher(str, BINIO_EYE_RECRYPT_END);
+  if (eye != 0) Error("RecryptData::read: bad eye-catcher");
 }
 
 /********************************************************************/
@@ -392,57 +521,56 @@ void extractDigitsPacked(Ctxt& ctxt, long botHigh, long r, long ePrime,
 // Extract digits from unpacked slots
 void extractDigitsThin(Ctxt& ctxt, long botHigh, long r, long ePrime);
 
-// bootstrap a ciphertext to reduce noise
-void FHEPubKey::reCrypt(Ctxt &ctxt)
+/************************ Batch recryption **************************/
+
+// The recryption stages are applied to a whole batch, one stage at a time.
+// If the batch has enough ciphertexts to keep all the threads busy, they
+// are spread over the threads (and the inner loops of each one then run
+// serially, as NTL's thread pool does not nest). Otherwise the ciphertexts
+// are processed one after the other, each one using all the threads.
+template<class Fn>
+static void forEachCtxt(const vector<Ctxt*>& v, const Fn& fn)
 {
-  FHE_TIMER_START;
+  long n = v.size();
+  if (n > 1 && n >= fheAvailableThreads()) {
+    FHE_EXEC_RANGE(n, first, last)
+    for (long i = first; i < last; i++) fn(*v[i]);
+    FHE_EXEC_RANGE_END
+  }
+  else
+    for (Ctxt* c: v) fn(*c);
+}
 
-  // Some sanity checks for dummy ciphertext
-  long ptxtSpace = ctxt.getPtxtSpace();
-  if (ctxt.isEmpty()) return;
+// Empty and dummy ciphertexts need no recryption: make sure that a dummy
+// encryption is reduced mod p and return true, else return false
+bool FHEPubKey::recryptTrivial(Ctxt& ctxt)
+{
+  if (ctxt.isEmpty()) return true;
   if (ctxt.parts.size()==1 && ctxt.parts[0].skHandle.isOne()) {
     // Dummy encryption, just ensure that it is reduced mod p
+    long ptxtSpace = ctxt.getPtxtSpace();
     ZZX poly = to_ZZX(ctxt.parts[0]);
     for (long i=0; i<poly.rep.length(); i++)
       poly[i] = to_ZZ( rem(poly[i],ptxtSpace) );
     poly.normalize();
     ctxt.DummyEncrypt(poly);
-    return;
+    return true;
   }
+  return false;
+}
 
-  assert(recryptKeyID>=0); // check that we have bootstrapping data
-
-  long p = getContext().zMStar.getP();
-  long r = getContext().alMod.getR();
-  long p2r = getContext().alMod.getPPowR();
-
-  long intFactor = ctxt.intFactor;
-
-  // the bootstrapping key is encrypted relative to plaintext space p^{e-e'+r}.
-  const RecryptData& rcData = getContext().rcData;
-  long e = rcData.e;
-  long ePrime = rcData.ePrime;
-  long p2ePrime = power_long(p,ePrime);
-  long q = power_long(p,e)+1;
-  assert(e>=r);
-
-#ifdef DEBUG_PRINTOUT
-  cerr << "reCrypt: p="<<p<<", r="<<r<<", e="<<e<<" ePrime="<<ePrime
-       << ", q="<<q<<endl;
-  CheckCtxt(ctxt, "init");
-#endif
-
-  // can only bootstrap ciphertext with plaintext-space dividing p^r
-  assert(p2r % ptxtSpace == 0);
-
-  ctxt.dropSmallAndSpecialPrimes();
-
-#ifdef DEBUG_PRINTOUT
-  CheckCtxt(ctxt, "after mod down");
-#endif
-
-
-  FHE_NTIMER_START(AAA_preProcess);
+// Switch ctxt to the bootstrapping key, raw-mod-switch it to q=p^e+1,
+// and (after making it divisible by p^{e'}) multiply it by the encrypted
+// bootstrapping key, leaving the coefficients to be extracted.
+// Thin recryption passes the sizes of the constants to the key.
+void FHEPubKey::bootKeySwitch(Ctxt& ctxt, bool thin,
+                              RecryptRecord* prof) const
+{
+  const RecryptData& rcData = context.rcData;
+  long p = context.zMStar.getP();
+  long p2r = context.alMod.getPPowR();
+  long p2ePrime = power_long(p,rcData.ePrime);
+  long q = power_long(p,rcData.e)+1;
 
   // Make sure that this ciphertxt is in canonical form
   if (!ctxt.inCanonicalForm()) ctxt.reLinearize();
@@ -463,20 +591,25 @@ void FHEPubKey::reCrypt(Ctxt &ctxt)
 
   // "raw mod-switch" to the bootstrapping mosulus q=p^e+1.
   vector<ZZX> zzParts; // the mod-switched parts, in ZZX format
-  double noise = ctxt.rawModSwitch(zzParts, q);
+  double noise;
+  {RecryptTimeProbe probe(prof, RECRYPT_RAW_MODSWITCH);
+   noise = ctxt.rawModSwitch(zzParts, q);
+  }
+  assert(zzParts.size() == 2);
 
 #ifdef DEBUG_PRINTOUT
   if (dbgKey) {
     cerr << "  before makeDivisible (recryption modulus q="<<q
          << "), noise_bnd=" << noise<<endl;
     printSizesPowerful(zzParts, dbgKey->sKeys[recryptKeyID],
-                       ctxt.getContext().rcData, q, noise);
+                       rcData, q, noise);
   }
 #endif
 
   // Add multiples of p2r and q to make the zzParts divisible by p^{e'}
   long maxU=0;
   double maxU_norm = 0;
+  {RecryptTimeProbe probe(prof, RECRYPT_MAKE_DIVISIBLE);
   for (long i=0; i<(long)zzParts.size(); i++) {
     // make divisible by p^{e'}
     double U_norm;
@@ -486,15 +619,16 @@ void FHEPubKey::reCrypt(Ctxt &ctxt)
     if (maxU < newMax)  maxU = newMax;
     if (maxU_norm < U_norm)  maxU_norm = U_norm;
   }
+  }
 #ifdef DEBUG_PRINTOUT
-  double newNoise = noise + maxU_norm*p2r*(skBounds[recryptKeyID]+1);
+  double newNoise = noise + maxU_norm*(thin? 1 : p2r)*(skBounds[recryptKeyID]+1);
   cerr << "  after makeDivisible, maxU=" << maxU
        << ", maxU_norm="<<maxU_norm<<", p2r="<<p2r
        << ", noise_bnd="<<newNoise<<", sk_bnd="<< skBounds[recryptKeyID]
        << endl;
    if (dbgKey)
      printSizesPowerful(zzParts, dbgKey->sKeys[recryptKeyID],
-                        ctxt.getContext().rcData, q, newNoise);
+                        rcData, q, newNoise);
 #endif
 
   for (long i=0; i<(long)zzParts.size(); i++)
@@ -502,55 +636,141 @@ void FHEPubKey::reCrypt(Ctxt &ctxt)
 
   // Multiply the post-processed cipehrtext by the encrypted sKey
 
-  double p0size = to_double(embeddingLargestCoeff(zzParts[0], context.zMStar));
-  double p1size = to_double(embeddingLargestCoeff(zzParts[1], context.zMStar));
-  // FIXME: This might be slow without Armadillo
-
   // NOTE: here we lose the intFactor associated with ctxt.
-  // We will restore it below.
+  // The caller restores it at the end.
   ctxt = recryptEkey;
 
-  ctxt.multByConstant(zzParts[1]);
-  ctxt.addConstant(zzParts[0]);
+  if (thin) {
+    double p0size = to_double(embeddingLargestCoeff(zzParts[0], context.zMStar));
+    double p1size = to_double(embeddingLargestCoeff(zzParts[1], context.zMStar));
+    // FIXME: This might be slow without Armadillo
+    ctxt.multByConstant(zzParts[1], p1size);
+    ctxt.addConstant(zzParts[0], p0size);
+  }
+  else {
+    ctxt.multByConstant(zzParts[1]);
+    ctxt.addConstant(zzParts[0]);
+  }
+}
 
+// bootstrap a ciphertext to reduce noise
+void FHEPubKey::reCrypt(Ctxt &ctxt)
+{
+  std::vector<Ctxt*> v(1, &ctxt);
+  reCrypt(CtPtrs_vectorPt(v));
+}
+
+// bootstrap a batch of ciphertexts
+void FHEPubKey::reCrypt(const CtPtrs& cts)
+{
+  FHE_TIMER_START;
+  vector<Ctxt*> all;
+  for (long i=0; i<cts.size(); i++)
+    if (cts.isSet(i)) all.push_back(cts[i]);
+  CircuitProbe circuit(CIRCUIT_RECRYPT, all);
+  CtxtTraceProbe trace(TRACE_RECRYPT, all, /*thin=*/0);
+
+  // Set aside the ciphertexts that need no recryption
+  vector<Ctxt*> batch;
+  for (Ctxt* c: all)
+    if (!recryptTrivial(*c)) batch.push_back(c);
+  if (batch.empty()) return;
+  CtxtOpProbe probe(CTXT_OP_RECRYPT, batch, __func__);
+  RecryptProbe profile(batch, /*thin=*/false);
+  addMetric(METRIC_RECRYPTS);
+  addMetric(METRIC_RECRYPTED_CTXTS, lsize(batch));
+  MetricTimer latency(METRIC_RECRYPT_SECONDS);
+  RecryptRecord* prof = profile.get(); // NULL if not profiling
+
+  assert(recryptKeyID>=0); // check that we have bootstrapping data
+
+  long r = context.alMod.getR();
+  long p2r = context.alMod.getPPowR();
+
+  // the bootstrapping key is encrypted relative to plaintext space p^{e-e'+r}.
+  const RecryptData& rcData = context.rcData;
+  long e = rcData.e;
+  long ePrime = rcData.ePrime;
+  assert(e>=r);
+
+  // NOTE: the recryption loses the intFactor of each ciphertext.
+  // We record them here and restore them below.
+  vector<long> intFactors(batch.size()), ptxtSpaces(batch.size());
+  for (long i: range(batch.size())) {
+    ptxtSpaces[i] = batch[i]->getPtxtSpace();
+    // can only bootstrap ciphertext with plaintext-space dividing p^r
+    assert(p2r % ptxtSpaces[i] == 0);
+    intFactors[i] = batch[i]->intFactor;
+  }
+
+#ifdef DEBUG_PRINTOUT
+  cerr << "reCrypt: p="<<context.zMStar.getP()<<", r="<<r<<", e="<<e
+       <<" ePrime="<<ePrime<<", batch="<<batch.size()<<endl;
+#endif
+
+  FHE_NTIMER_START(AAA_preProcess);
+  {RecryptStageProbe stage(prof, RECRYPT_MODDOWN, batch);
+  forEachCtxt(batch, [&](Ctxt& ctxt) {
+#ifdef DEBUG_PRINTOUT
+    CheckCtxt(ctxt, "init");
+#endif
+    ctxt.dropSmallAndSpecialPrimes();
 #ifdef DEBUG_PRINTOUT
-  CheckCtxt(ctxt, "after preProcess");
+    CheckCtxt(ctxt, "after mod down");
 #endif
+  });
+  }
+  {RecryptStageProbe stage(prof, RECRYPT_BOOT_KEYSWITCH, batch);
+  forEachCtxt(batch, [&](Ctxt& ctxt) {
+    bootKeySwitch(ctxt, /*thin=*/false, prof);
+#ifdef DEBUG_PRINTOUT
+    CheckCtxt(ctxt, "after preProcess");
+#endif
+  });
+  }
   FHE_NTIMER_STOP(AAA_preProcess);
 
   // Move the powerful-basis coefficients to the plaintext slots
   FHE_NTIMER_START(AAA_LinearTransform1);
-  ctxt.getContext().rcData.firstMap->apply(ctxt);
-  FHE_NTIMER_STOP(AAA_LinearTransform1);
-
+  {RecryptStageProbe stage(prof, RECRYPT_COEFF_TO_SLOT, batch);
+  forEachCtxt(batch, [&](Ctxt& ctxt) {
+    rcData.firstMap->apply(ctxt);
 #ifdef DEBUG_PRINTOUT
-  CheckCtxt(ctxt, "after LinearTransform1");
+    CheckCtxt(ctxt, "after LinearTransform1");
 #endif
+  });
+  }
+  FHE_NTIMER_STOP(AAA_LinearTransform1);
 
   // Extract the digits e-e'+r-1,...,e-e' (from fully packed slots)
   FHE_NTIMER_START(AAA_extractDigitsPacked);
-  extractDigitsPacked(ctxt, e-ePrime, r, ePrime,
-		      context.rcData.unpackSlotEncoding);
-  FHE_NTIMER_STOP(AAA_extractDigitsPacked);
-
-
+  {RecryptStageProbe stage(prof, RECRYPT_EXTRACT_DIGITS, batch);
+  forEachCtxt(batch, [&](Ctxt& ctxt) {
+    extractDigitsPacked(ctxt, e-ePrime, r, ePrime, rcData.unpackSlotEncoding);
 #ifdef DEBUG_PRINTOUT
-  CheckCtxt(ctxt, "after extractDigitsPacked");
+    CheckCtxt(ctxt, "after extractDigitsPacked");
 #endif
+  });
+  }
+  FHE_NTIMER_STOP(AAA_extractDigitsPacked);
 
   // Move the slots back to powerful-basis coefficients
   FHE_NTIMER_START(AAA_LinearTransform2);
-  ctxt.getContext().rcData.secondMap->apply(ctxt);
-  FHE_NTIMER_STOP(AAA_LinearTransform2);
-
-
+  {RecryptStageProbe stage(prof, RECRYPT_SLOT_TO_COEFF, batch);
+  forEachCtxt(batch, [&](Ctxt& ctxt) {
+    rcData.secondMap->apply(ctxt);
 #ifdef DEBUG_PRINTOUT
-  CheckCtxt(ctxt, "after linearTransform2");
+    CheckCtxt(ctxt, "after linearTransform2");
 #endif
+  });
+  }
+  FHE_NTIMER_STOP(AAA_LinearTransform2);
 
   // restore intFactor
-  if (intFactor != 1)
-    ctxt.intFactor = MulMod(ctxt.intFactor, intFactor, ptxtSpace);
+  for (long i: range(batch.size()))
+    if (intFactors[i] != 1)
+      batch[i]->intFactor =
+        MulMod(batch[i]->intFactor, intFactors[i], ptxtSpaces[i]);
 }
 
 #ifdef FHE_BOOT_THREADS
@@ -580,17 +800,18 @@ void extractDigitsPacked(Ctxt& ctxt, long botHigh, long r, long ePrime,
     FHE_NTIMER_STOP(unpack1);
 
     FHE_NTIMER_START(unpack2);
+    vector< shared_ptr<Ctxt> > frobPtrs; // all from one decomposition
+    BasicAutomorphPrecon(ctxt).frobeniusAutomorphs(frobPtrs, d);
     vector<Ctxt> frob(d, Ctxt(ZeroCtxtLike, ctxt));
 
-    NTL_EXEC_RANGE(d, first, last)
-    // FIXME: implement using hoisting!
+    FHE_EXEC_RANGE(d, first, last)
         for (long j = first; j < last; j++) { // process jth Frobenius 
-          frob[j] = ctxt;
-          frob[j].frobeniusAutomorph(j);
+          frob[j] = *frobPtrs[j];
           frob[j].cleanUp();
           // FIXME: not clear if we should call cleanUp here
         }
-    NTL_EXEC_RANGE_END
+    FHE_EXEC_RANGE_END
+    frobPtrs.clear();
 
     FHE_NTIMER_STOP(unpack2);
 
@@ -611,11 +832,11 @@ void extractDigitsPacked(Ctxt& ctxt, long botHigh, long r, long ePrime,
   //  CheckCtxt(unpacked[0], "after unpack");
   //#endif
 
-  NTL_EXEC_RANGE(d, first, last)
+  FHE_EXEC_RANGE(d, first, last)
   for (long i = first; i < last; i++) {
     extractDigitsThin(unpacked[i], botHigh, r, ePrime);
   }
-  NTL_EXEC_RANGE_END
+  FHE_EXEC_RANGE_END
 
   //#ifdef DEBUG_PRINTOUT
   //CheckCtxt(unpacked[0], "before repack");
@@ -664,10 +885,9 @@ void extractDigitsPacked(Ctxt& ctxt, long botHigh, long r, long ePrime,
     Ctxt tmp1(ZeroCtxtLike, ctxt);
     Ctxt tmp2(ZeroCtxtLike, ctxt);
 
-    // FIXME: implement using hoisting!
+    BasicAutomorphPrecon precon(ctxt); // one decomposition for all the maps
     for (long j = 0; j < d; j++) { // process jth Frobenius 
-      tmp1 = ctxt;
-      tmp1.frobeniusAutomorph(j);
+      tmp1 = *precon.frobeniusAutomorph(j);
       tmp1.cleanUp();
       // FIXME: not clear if we should call cleanUp here
 
@@ -722,10 +942,9 @@ void packedRecrypt(const CtPtrs& cPtrs,
 
   repack(CtPtrs_vectorCt(cts), cPtrs, ea);  // pack ciphertexts
   //  cout << "@"<< lsize(cts)<<std::flush;
-  for (Ctxt& c: cts) {     // then recrypt them
-    c.reducePtxtSpace(2);  // we only have recryption data for binary ctxt
-    pKey.reCrypt(c);
-  }
+  for (Ctxt& c: cts)       // we only have recryption data for binary ctxt
+    c.reducePtxtSpace(2);
+  pKey.reCrypt(CtPtrs_vectorCt(cts)); // then recrypt them together
   unpack(cPtrs, CtPtrs_vectorCt(cts), ea, unpackConsts);
 }
 
@@ -764,16 +983,52 @@ ThinRecryptData::~ThinRecryptData()
   if (slotToCoeff!=NULL) delete slotToCoeff;
 }
 
+MemoryReport ThinRecryptData::memoryReport() const
+{
+  MemoryReport r = RecryptData::memoryReport();
+  r.bytes += sizeof(*this) - sizeof(RecryptData);
+  if (coeffToSlot != NULL) r.add("coeffToSlot", coeffToSlot->memoryUsage());
+  if (slotToCoeff != NULL) r.add("slotToCoeff", slotToCoeff->memoryUsage());
+  return r;
+}
+
 
 // This code was copied from RecryptData::init, and is mostly
 // the same, except for the linear-map-related stuff.
 // FIXME: There is really too much code (and data!) duplication here.
 void ThinRecryptData::init(const FHEcontext& context, const Vec<long>& mvec_,
-                      bool alsoThick, long t, bool build_cache_, bool minimal)
+                      bool alsoThick, long t, bool build_cache_, bool minimal,
+                      const string& cacheDir)
+{
+  RecryptData::init(context, mvec_, alsoThick, t, build_cache_, minimal,
+                    cacheDir);
+  coeffToSlot = new ThinEvalMap(*ea, minimal, mvec, true, build_cache,
+                                cacheDir);
+  slotToCoeff = new ThinEvalMap(*context.ea, minimal, mvec, false, build_cache,
+                                cacheDir);
+}
+
+void ThinRecryptData::write(ostream& str) const
+{
+  RecryptData::write(str);
+  write_raw_int(str, coeffToSlot != NULL); // were the thin maps built?
+  if (coeffToSlot != NULL) coeffToSlot->write(str);
+  write_raw_int(str, slotToCoeff != NULL);
+  if (slotToCoeff != NULL) slotToCoeff->write(str);
+}
+
+void ThinRecryptData::read(istream& str, const FHEcontext& context)
 {
-  RecryptData::init(context, mvec_, alsoThick, t, build_cache_, minimal);
-  coeffToSlot = new ThinEvalMap(*ea, minimal, mvec, true, build_cache);
-  slotToCoeff = new ThinEvalMap(*context.ea, minimal, mvec, false, build_cache);
+  if (alMod != NULL) { // were we already initialized?
+    cerr << "@Warning: ThinRecryptData::read after ThinRecryptData::init\n";
+    return;
+  }
+  RecryptData::read(str, context);
+  if (read_raw_int(str)) {
+    if (ea == NULL) Error("ThinRecryptData::read: maps without the tables");
+    coeffToSlot = new ThinEvalMap(*ea, str);
+  }
+  if (read_raw_int(str)) slotToCoeff = new ThinEvalMap(*context.ea, str);
 }
 
 
@@ -782,6 +1037,43 @@ void ThinRecryptData::init(const FHEcontext& context, const Vec<long>& mvec_,
 
 long fhe_force_chen_han = 0;
 
+// The degree of the Chen/Han technique is p^{bot-1}(p-1)r, and that of
+// the basic technique is p^{bot-1}p^r, or p^{bot-1}p^{r-1} if p==2, r > 1,
+// and bot+r > 2. These return the logs of the parts that differ.
+static double chenHanLogDegree(long p, long r)
+{ return log(double(p-1)) + log(double(r)); }
+
+static double basicLogDegree(long p, long r, long botHigh)
+{ return ((p == 2 && r > 1 && botHigh + r > 2)? r-1 : r)*log(double(p)); }
+
+DigitExtraction RecryptData::digitAlgorithm(DigitExtraction alg,
+                                            long p, long r, long botHigh)
+{
+  if (fhe_force_chen_han > 0) return DIGITS_LOW_DEGREE;
+  if (fhe_force_chen_han < 0) return DIGITS_BASIC;
+  if (alg != DIGITS_AUTO) return alg;
+  if (r <= 1) return DIGITS_BASIC;
+
+  // Increasing thresh makes chen_han less likely to be chosen.
+  // For p == 2, the basic algorithm is just squaring,
+  // and so is a bit cheaper, so we raise thresh a bit.
+  // This is all a bit heuristic.
+  double thresh = (p == 2)? 1.75 : 1.5;
+  if (basicLogDegree(p, r, botHigh) > thresh*chenHanLogDegree(p, r))
+    return DIGITS_LOW_DEGREE;
+  return DIGITS_BASIC;
+}
+
+long RecryptData::digitExtractionDepth(DigitExtraction alg,
+                                       long p, long r, long botHigh)
+{
+  alg = digitAlgorithm(alg, p, r, botHigh);
+  double logDeg = std::max(botHigh-1, 0L)*log(double(p))
+    + ((alg == DIGITS_LOW_DEGREE)? chenHanLogDegree(p, r)
+                                 : basicLogDegree(p, r, botHigh));
+  return std::max(long(ceil(logDeg/log(2.0) - 1e-9)), 1L);
+}
+
 void extractDigitsThin(Ctxt& ctxt, long botHigh, long r, long ePrime)
 {
   FHE_TIMER_START;
@@ -796,39 +1088,9 @@ void extractDigitsThin(Ctxt& ctxt, long botHigh, long r, long ePrime)
   long topHigh = botHigh + r-1;
 
 
-  // degree Chen/Han technique is p^{bot-1}(p-1)r
-  // degree of basic technique is p^{bot-1}p^r, 
-  //     or p^{bot-1}p^{r-1} if p==2, r > 1, and bot+r > 2
-
-  bool use_chen_han = false;
-  if (r > 1) {
-    double chen_han_cost = log(p-1) + log(r);
-    double basic_cost;
-    if (p == 2 && botHigh + r > 2)
-       basic_cost = (r-1)*log(p);
-    else
-       basic_cost = r*log(p);
-
-    //cerr << "*** basic: " << basic_cost << "\n";
-    //cerr << "*** chen/han: " << chen_han_cost << "\n";
-
-
-    double thresh = 1.5;
-    if (p == 2) thresh = 1.75;
-    // increasing thresh makes chen_han less likely to be chosen.
-    // For p == 2, the basic algorithm is just squaring, 
-    // and so is a bit cheaper, so we raise thresh a bit.
-    // This is all a bit heuristic.
-
-    if (basic_cost > thresh*chen_han_cost)
-      use_chen_han = true;
-  }
-
-  if (fhe_force_chen_han > 0)
-    use_chen_han = true;
-  else if (fhe_force_chen_han < 0)
-    use_chen_han = false;
-
+  bool use_chen_han = (RecryptData::digitAlgorithm(
+                          ctxt.getContext().rcData.digitAlg, p, r, botHigh)
+                        == DIGITS_LOW_DEGREE);
 
   if (use_chen_han) {
     // use Chen and Han technique
@@ -936,214 +1198,183 @@ struct FHEPubKeyHack { // The public key
 // bootstrap a ciphertext to reduce noise
 void FHEPubKey::thinReCrypt(Ctxt &ctxt)
 {
-  FHE_TIMER_START;
-
-  // Some sanity checks for dummy ciphertext
-  long ptxtSpace = ctxt.getPtxtSpace();
-  if (ctxt.isEmpty()) return;
+  std::vector<Ctxt*> v(1, &ctxt);
+  thinReCrypt(CtPtrs_vectorPt(v));
+}
 
-  if (ctxt.parts.size()==1 && ctxt.parts[0].skHandle.isOne()) {
-    // Dummy encryption, just ensure that it is reduced mod p
-    ZZX poly = to_ZZX(ctxt.parts[0]);
-    for (long i=0; i<poly.rep.length(); i++)
-      poly[i] = to_ZZ( rem(poly[i],ptxtSpace) );
-    poly.normalize();
-    ctxt.DummyEncrypt(poly);
-    return;
-  }
+// bootstrap a batch of "thin" ciphertexts
+void FHEPubKey::thinReCrypt(const CtPtrs& cts)
+{
+  FHE_TIMER_START;
+  vector<Ctxt*> all;
+  for (long i=0; i<cts.size(); i++)
+    if (cts.isSet(i)) all.push_back(cts[i]);
+  CircuitProbe circuit(CIRCUIT_RECRYPT, all);
+  CtxtTraceProbe trace(TRACE_RECRYPT, all, /*thin=*/1);
+
+  // Set aside the ciphertexts that need no recryption
+  vector<Ctxt*> batch;
+  for (Ctxt* c: all)
+    if (!recryptTrivial(*c)) batch.push_back(c);
+  if (batch.empty()) return;
+  CtxtOpProbe probe(CTXT_OP_RECRYPT, batch, __func__);
+  RecryptProbe profile(batch, /*thin=*/true);
+  addMetric(METRIC_RECRYPTS);
+  addMetric(METRIC_RECRYPTED_CTXTS, lsize(batch));
+  MetricTimer latency(METRIC_RECRYPT_SECONDS);
+  RecryptRecord* prof = profile.get(); // NULL if not profiling
 
   assert(recryptKeyID>=0); // check that we have bootstrapping data
 
-  long p = ctxt.getContext().zMStar.getP();
-  long r = ctxt.getContext().alMod.getR();
-  long p2r = ctxt.getContext().alMod.getPPowR();
-
-  long intFactor = ctxt.intFactor;
+  long r = context.alMod.getR();
+  long p2r = context.alMod.getPPowR();
 
-  const ThinRecryptData& trcData = ctxt.getContext().rcData;
+  const ThinRecryptData& trcData = context.rcData;
 
   // the bootstrapping key is encrypted relative to plaintext space p^{e-e'+r}.
   long e = trcData.e;
   long ePrime = trcData.ePrime;
-  long p2ePrime = power_long(p,ePrime);
-  long q = power_long(p,e)+1;
   assert(e>=r);
 
-  // can only bootstrap ciphertext with plaintext-space dividing p^r
-  assert(p2r % ptxtSpace == 0);
+  // NOTE: the recryption loses the intFactor of each ciphertext.
+  // We record them here and restore them below.
+  vector<long> intFactors(batch.size()), ptxtSpaces(batch.size());
+  for (long i: range(batch.size())) {
+    ptxtSpaces[i] = batch[i]->getPtxtSpace();
+    // can only bootstrap ciphertext with plaintext-space dividing p^r
+    assert(p2r % ptxtSpaces[i] == 0);
+    intFactors[i] = batch[i]->intFactor;
+  }
 
+  {RecryptStageProbe stage(prof, RECRYPT_MODDOWN, batch);
+  forEachCtxt(batch, [&](Ctxt& ctxt) {
 #ifdef DEBUG_PRINTOUT
-  CheckCtxt(ctxt, "init");
+    CheckCtxt(ctxt, "init");
 #endif
-
-  ctxt.dropSmallAndSpecialPrimes();
+    ctxt.dropSmallAndSpecialPrimes();
 
 #ifdef DROP_BEFORE_THIN_RECRYPT
-  // experimental code...we should drop down to a reasonably low level
-  // before doing the first linear map.
-  long first = context.ctxtPrimes.first();
-  long last = min(context.ctxtPrimes.last(),
-                  first + thinRecrypt_initial_level - 1);
-  ctxt.bringToSet(IndexSet(first, last));
+    // experimental code...we should drop down to a reasonably low level
+    // before doing the first linear map.
+    long first = context.ctxtPrimes.first();
+    long last = min(context.ctxtPrimes.last(),
+                    first + thinRecrypt_initial_level - 1);
+    ctxt.bringToSet(IndexSet(first, last));
 #endif
 
 #ifdef DEBUG_PRINTOUT
-  CheckCtxt(ctxt, "after mod down");
+    CheckCtxt(ctxt, "after mod down");
 #endif
+  });
+  }
 
   // Move the slots to powerful-basis coefficients
   FHE_NTIMER_START(AAA_slotToCoeff);
-  trcData.slotToCoeff->apply(ctxt);
-  FHE_NTIMER_STOP(AAA_slotToCoeff);
-
+  {RecryptStageProbe stage(prof, RECRYPT_SLOT_TO_COEFF, batch);
+  forEachCtxt(batch, [&](Ctxt& ctxt) {
+    trcData.slotToCoeff->apply(ctxt);
 #ifdef DEBUG_PRINTOUT
-  CheckCtxt(ctxt, "after slotToCoeff");
+    CheckCtxt(ctxt, "after slotToCoeff");
 #endif
-
-  FHE_NTIMER_START(AAA_bootKeySwitch);
-
-  // Make sure that this ciphertxt is in canonical form
-  if (!ctxt.inCanonicalForm()) ctxt.reLinearize();
-
-  // Mod-switch down if needed
-  IndexSet s = ctxt.getPrimeSet() / context.specialPrimes;
-  assert(s <= context.ctxtPrimes);
-  if (s.card()>2) { // leave only bottom two primes
-    long frst = s.first();
-    long scnd = s.next(frst);
-    IndexSet s2(frst,scnd);
-    s.retain(s2); // retain only first two primes
+  });
   }
-  ctxt.modDownToSet(s);
-
-  // key-switch to the bootstrapping key
-  ctxt.reLinearize(recryptKeyID);
-
-  // "raw mod-switch" to the bootstrapping mosulus q=p^e+1.
-  vector<ZZX> zzParts; // the mod-switched parts, in ZZX format
-  double noise = ctxt.rawModSwitch(zzParts, q);
-  assert(zzParts.size() == 2);
-
-#ifdef DEBUG_PRINTOUT
-  if (dbgKey) {
-    cerr << "  before makeDivisible (recryption modulus q="<<q
-         << "), noise_bnd=" << noise<<endl;
-    printSizesPowerful(zzParts, dbgKey->sKeys[recryptKeyID],
-                       ctxt.getContext().rcData, q, noise);
-  }
-#endif
-
-#if 1
-
-  // Add multiples of p2r and q to make the zzParts divisible by p^{e'}
-  double maxU_norm = 0;
-  long maxU=0;
-  for (long i=0; i<(long)zzParts.size(); i++) {
-    // make divisible by p^{e'}
-    double U_norm; 
-
-    long newMax = makeDivisible(zzParts[i].rep, p2ePrime, p2r, q,
-				trcData.a, U_norm, context.zMStar);
+  FHE_NTIMER_STOP(AAA_slotToCoeff);
 
-    zzParts[i].normalize(); // normalize after working directly on the rep
-    if (maxU < newMax)  maxU = newMax;
-    if (maxU_norm < U_norm)  maxU_norm = U_norm;
-  }
+  FHE_NTIMER_START(AAA_bootKeySwitch);
+  {RecryptStageProbe stage(prof, RECRYPT_BOOT_KEYSWITCH, batch);
+  forEachCtxt(batch, [&](Ctxt& ctxt) {
+    bootKeySwitch(ctxt, /*thin=*/true, prof);
 #ifdef DEBUG_PRINTOUT
-  double newNoise = noise + maxU_norm*(skBounds[recryptKeyID]+1);
-  cerr << "  after makeDivisible, maxU=" << maxU
-       << ", maxU_norm="<<maxU_norm<<", p2r="<<p2r
-       << ", noise_bnd="<<newNoise<<", sk_bnd="<< skBounds[recryptKeyID]
-       << endl;
-   if (dbgKey)
-     printSizesPowerful(zzParts, dbgKey->sKeys[recryptKeyID],
-                        ctxt.getContext().rcData, q, newNoise);
+    CheckCtxt(ctxt, "after bootKeySwitch");
 #endif
-
-  for (long i=0; i<(long)zzParts.size(); i++)
-    zzParts[i] /= p2ePrime;   // divide by p^{e'}
-
-#else
-  // Experimental version
-  // Add multiples of p2r and q to make the zzParts divisible by p^{e'}
-  double maxU_norm = 0;
-  long maxU=0;
-  for (long i=0; i<(long)zzParts.size(); i++) {
-    // make divisible by p^{e'}
-    double U_norm; 
-
-    Vec<ZZ> pwrfl;
-    trcData.p2dConv->ZZXtoPowerful(pwrfl, zzParts[i]);
-
-    long newMax = makeDivisible(pwrfl, p2ePrime, p2r, q,
-				trcData.a, U_norm, context.zMStar);
-
-    trcData.p2dConv->powerfulToZZX(zzParts[i], pwrfl);
-
-    zzParts[i].normalize(); // normalize after working directly on the rep
-    if (maxU < newMax)  maxU = newMax;
-    if (maxU_norm < U_norm)  maxU_norm = U_norm;
+  });
   }
-#ifdef DEBUG_PRINTOUT
-  double newNoise = noise + maxU_norm*(skBounds[recryptKeyID]+1);
-  cerr << "  after makeDivisible, maxU=" << maxU
-       << ", maxU_norm="<<maxU_norm<<", p2r="<<p2r
-       << ", noise_bnd="<<newNoise<<", sk_bnd="<< skBounds[recryptKeyID]
-       << endl;
-   if (dbgKey)
-     printSizesPowerful(zzParts, dbgKey->sKeys[recryptKeyID],
-                        ctxt.getContext().rcData, q, newNoise);
-#endif
-
-  for (long i=0; i<(long)zzParts.size(); i++)
-    zzParts[i] /= p2ePrime;   // divide by p^{e'}
-
-#endif
-
-  // Multiply the post-processed cipehrtext by the encrypted sKey
-
-  double p0size = to_double(embeddingLargestCoeff(zzParts[0], context.zMStar));
-  double p1size = to_double(embeddingLargestCoeff(zzParts[1], context.zMStar));
-  // FIXME: This might be slow without Armadillo
-
-  // NOTE: here we lose the intFactor associated with ctxt.
-  // We will restore it below.
-  ctxt = recryptEkey;
-
-
-  ctxt.multByConstant(zzParts[1], p1size);
-  ctxt.addConstant(zzParts[0], p0size);
-
-#ifdef DEBUG_PRINTOUT
-   CheckCtxt(ctxt, "after bootKeySwitch");
-#endif
-
   FHE_NTIMER_STOP(AAA_bootKeySwitch);
 
   // Move the powerful-basis coefficients to the plaintext slots
   FHE_NTIMER_START(AAA_coeffToSlot);
-  trcData.coeffToSlot->apply(ctxt);
-  FHE_NTIMER_STOP(AAA_coeffToSlot);
-
+  {RecryptStageProbe stage(prof, RECRYPT_COEFF_TO_SLOT, batch);
+  forEachCtxt(batch, [&](Ctxt& ctxt) {
+    trcData.coeffToSlot->apply(ctxt);
 #ifdef DEBUG_PRINTOUT
-   CheckCtxt(ctxt, "after coeffToSlot");
+    CheckCtxt(ctxt, "after coeffToSlot");
 #endif
+  });
+  }
+  FHE_NTIMER_STOP(AAA_coeffToSlot);
 
   // Extract the digits e-e'+r-1,...,e-e' (from fully packed slots)
   FHE_NTIMER_START(AAA_extractDigitsThin);
-  extractDigitsThin(ctxt, e-ePrime, r, ePrime);
-  FHE_NTIMER_STOP(AAA_extractDigitsThin);
-
-
+  {RecryptStageProbe stage(prof, RECRYPT_EXTRACT_DIGITS, batch);
+  forEachCtxt(batch, [&](Ctxt& ctxt) {
+    extractDigitsThin(ctxt, e-ePrime, r, ePrime);
 #ifdef DEBUG_PRINTOUT
-   CheckCtxt(ctxt, "after extractDigitsThin");
+    CheckCtxt(ctxt, "after extractDigitsThin");
 #endif
+  });
+  }
+  FHE_NTIMER_STOP(AAA_extractDigitsThin);
 
   // restore intFactor
-  if (intFactor != 1)
-    ctxt.intFactor = MulMod(ctxt.intFactor, intFactor, ptxtSpace);
+  for (long i: range(batch.size()))
+    if (intFactors[i] != 1)
+      batch[i]->intFactor =
+        MulMod(batch[i]->intFactor, intFactors[i], ptxtSpaces[i]);
 }
 
+// bootstrap sparsely used "thin" ciphertexts, several to a recryption
+void FHEPubKey::thinReCryptPacked(const CtPtrs& cts, long usedSlots)
+{
+  FHE_TIMER_START;
+  const EncryptedArray& ea = *context.ea;
+  long nslots = ea.size();
+  assert(usedSlots > 0 && usedSlots <= nslots);
+
+  vector<Ctxt*> all;
+  for (long i=0; i<cts.size(); i++)
+    if (cts.isSet(i) && !cts[i]->isEmpty()) all.push_back(cts[i]);
+
+  long k = nslots / usedSlots; // how many fit in one ciphertext
+  if (k <= 1 || all.size() < 2) {
+    thinReCrypt(cts);
+    return;
+  }
+  long n = all.size();
+  long nPacks = divc(n, k);
+
+  // The mask of the first usedSlots slots
+  vector<long> maskSlots(nslots, 0);
+  for (long i: range(usedSlots)) maskSlots[i] = 1;
+  ZZX maskPoly;
+  ea.encode(maskPoly, maskSlots);
+  DoubleCRT mask(maskPoly, context, context.ctxtPrimes|context.specialPrimes);
+
+  // Ciphertext t goes to slots j*usedSlots.. of pack i, for t = i*k+j
+  vector<Ctxt> moved(n, Ctxt(*this));
+  FHE_EXEC_RANGE(n, first, last)
+  for (long t = first; t < last; t++) {
+    moved[t] = *all[t];
+    moved[t].multByConstant(mask);
+    ea.rotate(moved[t], (t%k)*usedSlots);
+  }
+  FHE_EXEC_RANGE_END
+
+  vector<Ctxt> packs(nPacks, Ctxt(*this));
+  for (long i: range(nPacks)) {
+    packs[i] = moved[i*k];
+    for (long t = i*k+1; t < min(n, (i+1)*k); t++) packs[i] += moved[t];
+  }
+  moved.clear();
+
+  thinReCrypt(CtPtrs_vectorCt(packs));
+
+  FHE_EXEC_RANGE(n, first, last)
+  for (long t = first; t < last; t++) {
+    *all[t] = packs[t/k];
+    ea.rotate(*all[t], -(t%k)*usedSlots);
+  }
+  FHE_EXEC_RANGE_END
+}
 
 static void
 printSizesPowerful(const vector<ZZX>& zzParts, const DoubleCRT& sKey,
@@ -26,8 +26,16 @@ class  ThinEvalMap;
 class  PowerfulDCRT;
 class  FHEcontext;
 class  FHEPubKey;
+struct MemoryReport; // see memoryUsage.h
 
 
+//! The algorithms for the digit extraction step of recryption
+enum DigitExtraction {
+  DIGITS_AUTO,      //!< choose by the estimated degree (default)
+  DIGITS_BASIC,     //!< Halevi-Shoup, raising the digits to the power p
+  DIGITS_LOW_DEGREE //!< Chen-Han lowest-digit-retain polynomials
+};
+
 //! @class RecryptData
 //! @brief A structure to hold recryption-related data inside the FHEcontext
 class RecryptData {
@@ -55,6 +63,13 @@ public:
 
   bool build_cache;
 
+  //! how to extract the digits, may be set any time before recrypting
+  DigitExtraction digitAlg;
+
+  //! How many key-switchings one level is worth, set before init. When
+  //! positive, init collapses the regular matrices of the linear maps if
+  //! that is cheaper by this measure (see EvalMap::estimateCost)
+  double ksPerLevel;
 
   //! linear maps
   EvalMap *firstMap, *secondMap;
@@ -69,6 +84,8 @@ public:
     skHwt=0; e=ePrime=0; a=0;
     alMod=NULL; ea=NULL; firstMap=NULL; secondMap=NULL; p2dConv=NULL;
     build_cache = false;
+    digitAlg = DIGITS_AUTO;
+    ksPerLevel = 0;
   }
   ~RecryptData();
 
@@ -77,13 +94,24 @@ public:
             bool enableThick,/*init linear transforms for non-thin*/
             long t=0/*min Hwt for sk*/,            
             bool build_cache=false,
-            bool minimal=false);
+            bool minimal=false,
+            const std::string& cacheDir=""/*see EvalMap.h*/);
+
+  //! Write everything that init computed, including the linear maps
+  void write(std::ostream& str) const;
+
+  //! Restore the data written by write(str), instead of calling init.
+  //! The context must be the one for which the data was written.
+  void read(std::istream& str, const FHEcontext& context);
 
   bool operator==(const RecryptData& other) const;
   bool operator!=(const RecryptData& other) const {
     return !(operator==(other));
   }
 
+  //! The bytes of the linear maps and the other tables
+  MemoryReport memoryReport() const;
+
   //! Helper function for computing the recryption parameters
   static long setAE(long& a, long& e, long& ePrime,
                     const FHEcontext& context, long t=0);
@@ -112,7 +140,21 @@ public:
    * (1) still holds.
    * NOTE: setAE returns the Hamming weight, *not* the norm s'. The norm
    * can be computed from the weight using sampleHWtBoundedEffectiveBound.
+   *
+   * The depth of the digit extraction grows with e-e' (for a fixed r)
+   * under both algorithms, see digitExtractionDepth, so minimizing e-e'
+   * minimizes it whichever algorithm is used.
    **/
+
+  //! @brief Which algorithm extracts the digits botHigh..botHigh+r-1 of
+  //! an integer mod p^{botHigh+r}. Resolves DIGITS_AUTO (and the
+  //! fhe_force_chen_han override of the test programs), never returns it.
+  static DigitExtraction digitAlgorithm(DigitExtraction alg,
+                                        long p, long r, long botHigh);
+
+  //! @brief An estimate of the multiplicative depth of that extraction
+  static long digitExtractionDepth(DigitExtraction alg,
+                                   long p, long r, long botHigh);
 };
 
 
@@ -132,7 +174,13 @@ public:
             bool alsoThick,/*init linear transforms also for non-thin*/
             long t=0/*min Hwt for sk*/, 
             bool build_cache=false,
-            bool minimal=false);
+            bool minimal=false,
+            const std::string& cacheDir=""/*see EvalMap.h*/);
+
+  //! Same as for RecryptData, plus the thin linear maps
+  void write(std::ostream& str) const;
+  void read(std::istream& str, const FHEcontext& context);
+  MemoryReport memoryReport() const;
 };
 
 
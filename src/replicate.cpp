@@ -10,9 +10,12 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <functional>
+#include <NTL/BasicThreadPool.h>
 #include "replicate.h"
 #include "timing.h"
 #include "cloned_ptr.h"
+#include "taskScheduler.h"
 
 
 NTL_CLIENT
@@ -29,9 +32,11 @@ void replicate(const EncryptedArray& ea, Ctxt& ctxt, long pos)
   long nSlots = ea.size();
   assert(pos >= 0 && pos < nSlots); 
 
-  zzX mask;
-  ea.encodeUnitSelector(mask, pos);
-  ctxt.multByConstant(mask);
+  MaskCache::Entry mask =
+    cachedMask(ea.getMaskCache(), ea.getContext(), MaskCache::REPLICATE,
+               -1, pos, ctxt.getPrimeSet(),
+               [&](zzX& poly) { ea.encodeUnitSelector(poly, pos); });
+  ctxt.multByConstant(*mask);
   replicate0(ea, ctxt, pos);
 }
 
@@ -94,7 +99,7 @@ long GreatestPowerOfTwo(long n)
 
 // selects range of slots [lo..hi)
 static
-void SelectRange(const EncryptedArray& ea, ZZX& mask, long lo, long hi)
+void SelectRange(const EncryptedArray& ea, zzX& mask, long lo, long hi)
 {
   long nSlots = ea.size();
 
@@ -112,9 +117,11 @@ void SelectRange(const EncryptedArray& ea, ZZX& mask, long lo, long hi)
 static
 void SelectRange(const EncryptedArray& ea, Ctxt& ctxt, long lo, long hi)
 {
-  ZZX mask;
-  SelectRange(ea, mask, lo, hi);
-  ctxt.multByConstant(mask);
+  MaskCache::Entry mask =
+    cachedMask(ea.getMaskCache(), ea.getContext(), MaskCache::SELECT_RANGE,
+               -1, lo*(ea.size()+1) + hi, ctxt.getPrimeSet(),
+               [&](zzX& poly) { SelectRange(ea, poly, lo, hi); });
+  ctxt.multByConstant(*mask);
 }
 
 // recursiveReplicate:
@@ -148,7 +155,7 @@ void recursiveReplicate(const EncryptedArray& ea, const Ctxt& ctxt,
     // need to replicate to fill positions [ (1L << n) .. nSlots )
     if (repAux.tab(0).null()) {
       // need to generate mask
-      ZZX mask;
+      zzX mask;
       SelectRange(ea, mask, 0, nSlots - (1L << n));
       repAux.tab(0).set_ptr(new DoubleCRT(mask, ea.getContext(), ea.getContext().fullPrimes()));
     }
@@ -254,7 +261,7 @@ void replicateAllOrig(const EncryptedArray& ea, const Ctxt& ctxt_orig,
 
 // selects range of slots [lo..hi) in dimension d
 static
-void SelectRangeDim(const EncryptedArray& ea, ZZX& mask, long lo, long hi,
+void SelectRangeDim(const EncryptedArray& ea, zzX& mask, long lo, long hi,
                     long d)
 {
   long nSlots = ea.size();
@@ -280,11 +287,141 @@ static
 void SelectRangeDim(const EncryptedArray& ea, Ctxt& ctxt, long lo, long hi,
                     long d)
 {
-  ZZX mask;
-  SelectRangeDim(ea, mask, lo, hi, d);
-  ctxt.multByConstant(mask);
+  MaskCache::Entry mask =
+    cachedMask(ea.getMaskCache(), ea.getContext(), MaskCache::SELECT_RANGE,
+               d, lo*(ea.sizeOfDimension(d)+1) + hi, ctxt.getPrimeSet(),
+               [&](zzX& poly) { SelectRangeDim(ea, poly, lo, hi, d); });
+  ctxt.multByConstant(*mask);
 }
 
+// The masks of the dimension-based replication are kept in repAux. They
+// are all generated by repAuxDimMasks before a parallel replication, so the
+// tasks only read them.
+
+// tab(d,0): slots [0..dSize-extent) in dimension d
+static const DoubleCRT& leftoverMask(const EncryptedArray& ea,
+                                     RepAuxDim& repAux, long d, long extent)
+{
+  if (repAux.tab(d,0).null()) { // generate mask if not there already
+    zzX mask;
+    SelectRangeDim(ea, mask, 0, ea.sizeOfDimension(d) - extent, d);
+    repAux.tab(d, 0).set_ptr(new DoubleCRT(mask, ea.getContext(), ea.getContext().fullPrimes()));
+  }
+  return *repAux.tab(d, 0);
+}
+
+// tab(d,k+1): slots with coordinate c<extent and bit k of c zero
+static const DoubleCRT& bitMask(const EncryptedArray& ea,
+                                RepAuxDim& repAux, long d, long extent, long k)
+{
+  if (repAux.tab(d, k+1).null()) { // need to generate
+    long nSlots = ea.size();
+    vector< long > maskArray(nSlots,0);
+    for (long i = 0; i < nSlots; i++) {
+      long c = ea.coordinate(d, i);
+      if (c < extent && bit(c, k) == 0)
+        maskArray[i] = 1;
+    }
+    // store this mask in the repAux table
+    ZZX mask;
+    ea.encode(mask, maskArray);
+    repAux.tab(d, k+1).set_ptr(new DoubleCRT(mask, ea.getContext(), ea.getContext().fullPrimes()));
+  }
+  return *repAux.tab(d, k+1);
+}
+
+// tab1(d,0): slots [0..extent) in dimension d, tab1(d,1): [extent..dSize)
+static const DoubleCRT& extentMask(const EncryptedArray& ea,
+                                   RepAuxDim& repAux, long d, long extent,
+                                   long which)
+{
+  if (repAux.tab1(d, which).null()) { // generate mask if not already there
+    zzX mask;
+    if (which == 0) SelectRangeDim(ea, mask, 0, extent, d);
+    else            SelectRangeDim(ea, mask, extent, ea.sizeOfDimension(d), d);
+    repAux.tab1(d, which).set_ptr(new DoubleCRT(mask, ea.getContext(), ea.getContext().fullPrimes()));
+  }
+  return *repAux.tab1(d, which);
+}
+
+// The log of the block size that replicateAllNextDim uses in dimension d,
+// where dimProd is the product of dimensions 0..d
+static long repBlockLog(const EncryptedArray& ea, long d, long dimProd,
+                        long recBound)
+{
+  long dSize = ea.sizeOfDimension(d);
+  long n = GreatestPowerOfTwo(dSize); // 2^n <= dSize
+  long k = n;
+
+  // The logic below cut the recursion depth by starting from smaller
+  // blocks (by default size approx n rather than 2^n).
+  // The inital block size is controlled by the recBound parameter:
+  //   + recBound>0: blocks of size min(~n, 2^recBound). this ensures
+  //     recursion depth <= recBound, and typically much smaller (~log n)
+  //   + recBound=0: blocks of size 1 (no recursion)
+  //   + recBound<0: blocks of size 2^n (full recursion)
+
+  if (recBound >= 0) { // use heuristic recursion bound
+    k = 0;
+    if (dSize > 2 && dimProd*NumBits(dSize) > ea.size() / 8) {
+      k = NumBits(NumBits(dSize))-1;
+      if (k > n) k = n;
+      if (k > recBound) k = recBound;
+    }
+  }
+  else { // SHAI: I don't understand this else case
+    k = -recBound;
+    if (k > n) k = n;
+  }
+  return k;
+}
+
+// Generate all the masks that the replication may use
+static void repAuxDimMasks(const EncryptedArray& ea, RepAuxDim& repAux,
+                           long recBound)
+{
+  long dimProd = 1;
+  for (long d = 0; d < ea.dimension(); d++) {
+    long dSize = ea.sizeOfDimension(d);
+    dimProd *= dSize;
+    long k = repBlockLog(ea, d, dimProd, recBound);
+    long extent = (dSize >> k) << k;
+    if (extent < dSize) {
+      leftoverMask(ea, repAux, d, extent);
+      extentMask(ea, repAux, d, extent, 0);
+      extentMask(ea, repAux, d, extent, 1);
+    }
+    for (long j = 0; j < k; j++)
+      bitMask(ea, repAux, d, extent, j);
+  }
+}
+
+//! \cond FALSE (make doxygen ignore this class)
+// Subtrees of the replication that were set aside to run in parallel. A
+// subtree with at most grain outputs becomes a task, and the pending
+// tasks are run (and their inputs released) once there are maxLive of them.
+class RepScheduler {
+  std::vector< std::function<void()> > pending;
+public:
+  long grain, maxLive;
+
+  RepScheduler(long _grain, long _maxLive): grain(_grain), maxLive(_maxLive) {}
+
+  void add(std::function<void()> task) {
+    pending.push_back(std::move(task));
+    if (lsize(pending) >= maxLive) flush();
+  }
+
+  void flush() {
+    long n = lsize(pending);
+    FHE_EXEC_RANGE(n, first, last)
+      for (long i = first; i < last; i++) pending[i]();
+    FHE_EXEC_RANGE_END
+    pending.clear();
+  }
+};
+//! \endcond
+
 // replicateOneBlock: assumes that all slots are zero, except for one
 // "block" whose coordinates in dimension d lie in the interval
 //            [ pos*blockSize .. pos*(blockSize+1) -1 ]
@@ -334,7 +471,8 @@ static void replicateOneBlock(const EncryptedArray& ea, Ctxt& ctxt,
 static
 void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
                          long d, long dimProd, long recBound,
-                         RepAuxDim& repAux, ReplicateHandler *handler);
+                         RepAuxDim& repAux, ReplicateHandler *handler,
+                         long base, RepScheduler* sched);
 
 
 
@@ -347,6 +485,9 @@ void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
 //   0 <= limit < ea.sizeOfDimension(): max # of positions to process
 //   dimProd: product of dimensions 0..d
 //   recBound: recursion bound (controls noise) 
+//   base: the index of the output for position 0 (so position pos
+//     gives the outputs from base + pos*nSlots/dimProd)
+//   sched: if not NULL, small enough subtrees are run as parallel tasks
 //
 // SHAI: limit and extent are always the same, it seems
 static
@@ -354,44 +495,49 @@ void recursiveReplicateDim(const EncryptedArray& ea, const Ctxt& ctxt,
                            long d, long extent, long k, long pos, long limit,  
                            long dimProd, long recBound,
                            RepAuxDim& repAux,
-                           ReplicateHandler *handler)
+                           ReplicateHandler *handler,
+                           long base, RepScheduler* sched)
 {
   if (pos >= limit) return;
 
+  long stride = ea.size() / dimProd; // outputs per position
+  if (sched != NULL && min(1L << k, limit - pos)*stride <= sched->grain) {
+    sched->add([=, &ea, &repAux]() {
+        recursiveReplicateDim(ea, ctxt, d, extent, k, pos, limit, dimProd,
+                              recBound, repAux, handler, base, NULL);
+      });
+    return;
+  }
+
   if (replicateVerboseFlag) { // DEBUG code
     cerr << "check: " << k; CheckCtxt(ctxt, "");
   }
   
   long dSize = ea.sizeOfDimension(d);
-  long nSlots = ea.size();
 
   if (k == 0) { // last level in this dimension: blocks of size 2^k=1
 
     if ( extent >= dSize) { // nothing to do in this dimension
-      replicateAllNextDim(ea, ctxt, d+1, dimProd, recBound, repAux, handler);
+      replicateAllNextDim(ea, ctxt, d+1, dimProd, recBound, repAux, handler,
+                          base + pos*stride, sched);
       return;
     } // SHAI: Will we ever have extent > dSize??
 
     // need to replicate to fill positions [ (1L << n) .. dSize-1 ]
 
-    if (repAux.tab(d,0).null()) { // generate mask if not there already
-      ZZX mask;
-      SelectRangeDim(ea, mask, 0, dSize - extent, d);
-      repAux.tab(d, 0).set_ptr(new DoubleCRT(mask, ea.getContext(), ea.getContext().fullPrimes()));
-    }
-
     Ctxt ctxt_tmp = ctxt;
-    ctxt_tmp.multByConstant(*repAux.tab(d, 0));
+    ctxt_tmp.multByConstant(leftoverMask(ea, repAux, d, extent));
 
     ea.rotate1D(ctxt_tmp, d, extent, /*don't-care-flag=*/true);
     ctxt_tmp += ctxt;
-    replicateAllNextDim(ea, ctxt_tmp, d+1, dimProd, recBound, repAux, handler);
+    replicateAllNextDim(ea, ctxt_tmp, d+1, dimProd, recBound, repAux, handler,
+                        base + pos*stride, sched);
     return;
   }
 
   // If we need to stop early, call the handler
   if (handler->earlyStop(d, k, dimProd)) {
-    handler->handle(ctxt);
+    handler->handle(ctxt, base + pos*stride);
     return;
   }
 
@@ -399,33 +545,16 @@ void recursiveReplicateDim(const EncryptedArray& ea, const Ctxt& ctxt,
   Ctxt ctxt_masked = ctxt;
 
   {   // artificial scope to miminize storage in the recursion
-    { // another artificial scope (SHAI: this seems redundant)
-
-      // generate mask at index k+1, if not there yet
-
-      if (repAux.tab(d, k+1).null()) { // need to generate
-        vector< long > maskArray(nSlots,0);
-        for (long i = 0; i < nSlots; i++) {
-          long c = ea.coordinate(d, i);
-          if (c < extent && bit(c, k) == 0)
-            maskArray[i] = 1;
-        }
-	// store this mask in the repAux table
-        ZZX mask;
-        ea.encode(mask, maskArray);
-        repAux.tab(d, k+1).set_ptr(new DoubleCRT(mask, ea.getContext(), ea.getContext().fullPrimes()));
-      }
 
-      // Apply mask to zero out slots in ctxt
-      ctxt_masked.multByConstant(*repAux.tab(d, k+1));
-    }
+    // Apply mask at index k+1 to zero out slots in ctxt
+    ctxt_masked.multByConstant(bitMask(ea, repAux, d, extent, k));
 
     Ctxt ctxt_left = ctxt_masked;
     ea.rotate1D(ctxt_left, d, 1L << k, /*don't-care-flag=*/true);
     ctxt_left += ctxt_masked;
 
     recursiveReplicateDim(ea, ctxt_left, d, extent, k, pos, limit, 
-                          dimProd, recBound, repAux, handler);
+                          dimProd, recBound, repAux, handler, base, sched);
   }
 
   pos += (1L << k);
@@ -439,27 +568,26 @@ void recursiveReplicateDim(const EncryptedArray& ea, const Ctxt& ctxt,
   ctxt_right += ctxt_masked;
 
   recursiveReplicateDim(ea, ctxt_right, d, extent, k, pos, limit, 
-                        dimProd, recBound, repAux, handler);
+                        dimProd, recBound, repAux, handler, base, sched);
 }
 
 void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
                          long d, long dimProd, long recBound,
-                         RepAuxDim& repAux, ReplicateHandler *handler)
+                         RepAuxDim& repAux, ReplicateHandler *handler,
+                         long base, RepScheduler* sched)
 
 {
   assert(d >= 0);
 
   // If already fully replicated (or we need to stop early), call the handler
   if (d >= ea.dimension() || handler->earlyStop(d,/*k=*/-1,dimProd)) {
-    handler->handle(ctxt);
+    handler->handle(ctxt, base);
     return;
   }
   
   long dSize = ea.sizeOfDimension(d);
   dimProd *= dSize; // product of all dimensions including this one
-
-  long n = GreatestPowerOfTwo(dSize); // 2^n <= dSize
-  long k = n;
+  long stride = ea.size() / dimProd;
 
   // We replicate 2^k-size blocks along this dimension, then call the
   // recursive procedure to handle the smaller subblocks. Consider for
@@ -488,26 +616,9 @@ void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
   
 
 
-  // The logic below cut the recursion depth by starting from smaller
-  // blocks (by default size approx n rather than 2^n).
-  // The inital block size is controlled by the recBound parameter:
-  //   + recBound>0: blocks of size min(~n, 2^recBound). this ensures
-  //     recursion depth <= recBound, and typically much smaller (~log n)
-  //   + recBound=0: blocks of size 1 (no recursion)
-  //   + recBound<0: blocks of size 2^n (full recursion)
-
-  if (recBound >= 0) { // use heuristic recursion bound
-    k = 0;
-    if (dSize > 2 && dimProd*NumBits(dSize) > ea.size() / 8) {
-      k = NumBits(NumBits(dSize))-1;
-      if (k > n) k = n;
-      if (k > recBound) k = recBound;
-    }
-  }
-  else { // SHAI: I don't understand this else case
-    k = -recBound;
-    if (k > n) k = n;
-  }
+  // The recursion depth is cut by starting from smaller blocks, see
+  // repBlockLog for how the block size depends on recBound
+  long k = repBlockLog(ea, d, dimProd, recBound);
 
   long blockSize = 1L << k;        // blocks of size 2^k
   long numBlocks = dSize/blockSize;
@@ -519,19 +630,12 @@ void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
 
   Ctxt ctxt1 = ctxt;
 
-  if (extent < dSize) { // select only the slots 0..extent-1 in this dimension
-    if (repAux.tab1(d, 0).null()) { // generate mask if not already there
-      ZZX mask;
-      SelectRangeDim(ea, mask, 0, extent, d);
-      repAux.tab1(d, 0).set_ptr(new DoubleCRT(mask, ea.getContext(), ea.getContext().fullPrimes()));
-      // store mask in 2nd table (tab1)
-    }
-    ctxt1.multByConstant(*repAux.tab1(d, 0)); // mult by mask to zero out slots
-  }
+  if (extent < dSize) // select only the slots 0..extent-1 in this dimension
+    ctxt1.multByConstant(extentMask(ea, repAux, d, extent, 0));
 
   if (numBlocks == 1) { // just one block, call the recursive replication
     recursiveReplicateDim(ea, ctxt1, d, extent, k, 0, extent, 
-                          dimProd, recBound, repAux, handler);
+                          dimProd, recBound, repAux, handler, base, sched);
   }
   else { // replicate the slots in each block separately
     for (long pos = 0; pos < numBlocks; pos++) {
@@ -544,8 +648,9 @@ void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
       replicateOneBlock(ea, ctxt2, pos, blockSize, d);
 
       // now call the recursive replication to do the rest of the work
-      recursiveReplicateDim(ea, ctxt2, d, extent, k, 0, extent, 
-                            dimProd, recBound, repAux, handler);
+      recursiveReplicateDim(ea, ctxt2, d, extent, k, 0, extent, dimProd,
+                            recBound, repAux, handler,
+                            base + pos*blockSize*stride, sched);
     }
   }
 
@@ -554,12 +659,7 @@ void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
   if (extent < dSize) {
     // zero-out the slots from before, leaving only the leftover slots
     ctxt1 = ctxt;
-    if (repAux.tab1(d, 1).null()) { // generate mask if not already there
-      ZZX mask;
-      SelectRangeDim(ea, mask, extent, dSize, d);
-      repAux.tab1(d, 1).set_ptr(new DoubleCRT(mask, ea.getContext(), ea.getContext().fullPrimes()));
-    }
-    ctxt1.multByConstant(*repAux.tab1(d,1)); // mult by mask to zero out slots
+    ctxt1.multByConstant(extentMask(ea, repAux, d, extent, 1));
 
     // move relevant slots to the beginning
     ea.rotate1D(ctxt1, d, -extent, /*don't-care-flag=*/true);
@@ -570,7 +670,7 @@ void replicateAllNextDim(const EncryptedArray& ea, const Ctxt& ctxt,
 
     // now call the recursive replication to do the rest of the work
     recursiveReplicateDim(ea, ctxt1, d, extent, k, extent, dSize, 
-                          dimProd, recBound, repAux, handler);
+                          dimProd, recBound, repAux, handler, base, sched);
   }
 }
 
@@ -591,7 +691,33 @@ replicateAll(const EncryptedArray& ea, const Ctxt& ctxt_orig,
 
   RepAuxDim repAux;
   if (repAuxPtr==NULL) repAuxPtr = &repAux;
-  replicateAllNextDim(ea, ctxt, 0, 1, recBound, *repAuxPtr, handler);
+  replicateAllNextDim(ea, ctxt, 0, 1, recBound, *repAuxPtr, handler,
+                      /*base=*/0, /*sched=*/NULL);
+}
+
+void
+replicateAllParallel(const EncryptedArray& ea, const Ctxt& ctxt_orig,
+                     ReplicateHandler *handler, long maxLive, long recBound,
+                     RepAuxDim* repAuxPtr)
+{
+  FHE_TIMER_START;
+
+  Ctxt ctxt = ctxt_orig;
+  ctxt.cleanUp();
+
+  RepAuxDim repAux;
+  if (repAuxPtr==NULL) repAuxPtr = &repAux;
+  repAuxDimMasks(ea, *repAuxPtr, recBound); // the tasks only read the masks
+
+  // Aim for a few tasks per thread, each with at least one output
+  long nThreads = fheAvailableThreads();
+  if (maxLive <= 0) maxLive = 4*nThreads;
+  long grain = max(1L, ea.size() / (4*nThreads));
+
+  RepScheduler sched(grain, maxLive);
+  replicateAllNextDim(ea, ctxt, 0, 1, recBound, *repAuxPtr, handler,
+                      /*base=*/0, &sched);
+  sched.flush(); // run whatever is left
 }
 
 
@@ -607,6 +733,7 @@ public:
   // _v must already be of the right size (=number-of-slots)
   ExplicitReplicator(std::vector<Ctxt>& _v): v(_v),slot(0) {}
   virtual void handle(const Ctxt& ctxt) { v[slot++] = ctxt; }
+  virtual void handle(const Ctxt& ctxt, long idx) { v[idx] = ctxt; }
 };
 
 // Returns the result as a vector of ciphertexts
@@ -56,6 +56,13 @@ public:
   virtual void handle(const Ctxt& ctxt) {}
   virtual ~ReplicateHandler() {}
 
+  //! The idx'th output of the replication (the idx'th call in the serial
+  //! order, which holds the content of slot idx). By default this calls
+  //! handle(ctxt). replicateAllParallel calls this method concurrently from
+  //! several threads and in no particular order, so a handler used there
+  //! must override it in a thread-safe manner.
+  virtual void handle(const Ctxt& ctxt, long idx) { handle(ctxt); }
+
   // The earlyStop call can be used to quit the replication mid-way, leaving
   // a ciphertext with (e.g.) two different entries, each replicated n/2 times
   virtual bool earlyStop(long d, long k, long prodDim) { return false; }
@@ -85,6 +92,16 @@ void replicateAll(const EncryptedArray& ea, const Ctxt& ctxt,
 		  ReplicateHandler *handler, long recBound = 64,
 		  RepAuxDim* repAuxPtr=NULL);
 
+//! @brief Same as replicateAll, but independent subtrees of the recursion
+//! are run as tasks over the NTL threads. The handler gets each output
+//! through handle(ctxt,idx), concurrently (and earlyStop is also called
+//! from several threads). At most maxLive tasks are kept pending, each
+//! holding one ciphertext, which bounds the memory; maxLive<=0 means four
+//! per thread.
+void replicateAllParallel(const EncryptedArray& ea, const Ctxt& ctxt,
+                          ReplicateHandler *handler, long maxLive = 0,
+                          long recBound = 64, RepAuxDim* repAuxPtr=NULL);
+
 //! return the result as a std::vector of ciphertexts, mostly useful for
 //! debugging purposes (for real parameters would take a lot of memory)
 void replicateAll(std::vector<Ctxt>& v, const EncryptedArray& ea,
@@ -0,0 +1,164 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* ringSwitch.cpp - ciphertexts of Phi_m to the subring of Phi_{m/d}
+ */
+#include <stdexcept>
+#include "ringSwitch.h"
+#include "timing.h"
+
+NTL_CLIENT
+
+long ringSwitchDegree(const FHEcontext& from, const FHEcontext& to)
+{
+  long m = from.zMStar.getM(), mPrime = to.zMStar.getM();
+  if (m % mPrime != 0) return 0;
+  long d = m / mPrime;
+
+  // Every prime factor of m divides m': dividing out the common factors
+  // leaves nothing
+  long rest = m;
+  for (long g = GCD(rest, mPrime); g > 1; g = GCD(rest, mPrime)) rest /= g;
+  if (rest != 1 || from.zMStar.getPhiM() != d * to.zMStar.getPhiM())
+    return 0;
+
+  if (from.alMod.getTag() != to.alMod.getTag()
+      || from.zMStar.getP() != to.zMStar.getP()
+      || from.alMod.getPPowR() != to.alMod.getPPowR())
+    return 0;
+
+  if (from.numPrimes() != to.numPrimes()
+      || from.ctxtPrimes != to.ctxtPrimes
+      || from.specialPrimes != to.specialPrimes)
+    return 0;
+  for (long i: range(from.numPrimes()))
+    if (from.ithPrime(i) != to.ithPrime(i)) return 0;
+  return d;
+}
+
+void buildRingSwitchChain(FHEcontext& to, const FHEcontext& from)
+{
+  if (to.numPrimes() != 0)
+    throw std::logic_error("buildRingSwitchChain: the context has primes");
+  if (from.zMStar.getM() % to.zMStar.getM() != 0)
+    throw std::logic_error("buildRingSwitchChain: m' does not divide m");
+
+  // The primes in the same order, a run of the same kind at a time
+  long n = from.numPrimes();
+  for (long i = 0; i < n; ) {
+    vector<long> qs;
+    long j = i;
+    for (; j < n; j++) {
+      if (from.smallPrimes.contains(j) != from.smallPrimes.contains(i)
+          || from.specialPrimes.contains(j) != from.specialPrimes.contains(i))
+        break;
+      qs.push_back(from.ithPrime(j));
+    }
+    if (from.smallPrimes.contains(i))        to.AddSmallPrimes(qs);
+    else if (from.specialPrimes.contains(i)) to.AddSpecialPrimes(qs);
+    else                                     to.AddCtxtPrimes(qs);
+    i = j;
+  }
+  to.digits = from.digits;
+  to.stdev = from.stdev;
+  to.scale = from.scale;
+  to.setModSizeTable();
+}
+
+long addRingSwitchKey(FHESecKey& fromKey, const FHESecKey& toKey,
+                      long toKeyID, long fromKeyID)
+{
+  FHE_TIMER_START;
+  const FHEcontext& from = fromKey.getContext();
+  long d = ringSwitchDegree(from, toKey.getContext());
+  if (d == 0)
+    throw std::logic_error("addRingSwitchKey: the contexts do not match");
+
+  ZZX s, sd;
+  toKey.sKeys.at(toKeyID).toPoly(s);
+  ringEmbed(sd, s, d);
+  DoubleCRT embedded(sd, from, from.ctxtPrimes | from.specialPrimes);
+  long keyID = fromKey.ImportSecKey(embedded, toKey.getSKeyBound(toKeyID),
+                                    /*ptxtSpace=*/0, /*maxDegKswitch=*/1);
+  fromKey.GenKeySWmatrix(1, 1, fromKeyID, keyID);
+  return keyID;
+}
+
+void ringSwitch(Ctxt& out, const Ctxt& in, long keyID, long toKeyID)
+{
+  FHE_TIMER_START;
+  const FHEcontext& to = out.getContext();
+  long d = ringSwitchDegree(in.getContext(), to);
+  if (d == 0)
+    throw std::logic_error("ringSwitch: the contexts do not match");
+  if (!in.getPubKey().haveKeySWmatrix(1, 1, in.getKeyID(), keyID))
+    throw std::logic_error("ringSwitch: no matrix to keyID, "
+                           "see addRingSwitchKey");
+
+  // (1, s) then (1, s'(X^d)), at the ciphertext primes
+  Ctxt c(in);
+  c.reLinearize(c.getKeyID());
+  c.reLinearize(keyID);
+  c.dropSmallAndSpecialPrimes();
+
+  const IndexSet& s = c.getPrimeSet();
+  vector<CtxtPart> parts;
+  for (const CtxtPart& part: c.parts) {
+    SKHandle handle;
+    if (part.skHandle.isOne()) handle.setOne();
+    else {
+      assert(part.skHandle.isBase(keyID));
+      handle.setBase(toKeyID);
+    }
+    parts.push_back(CtxtPart(to, s, handle));
+    parts.back().ringProject(part, d);
+  }
+
+  // The projection is the average of d conjugates, so it has no more noise
+  out.parts.swap(parts);
+  out.primeSet = s;
+  out.ptxtSpace = c.ptxtSpace;
+  out.intFactor = c.intFactor;
+  out.ratFactor = c.ratFactor;
+  out.noiseBound = c.noiseBound;
+  out.lazyRelin = false;
+  clear(out.prgSeed);
+}
+
+void ringEmbed(ZZX& out, const ZZX& in, long d)
+{
+  assert(d >= 1);
+  if (IsZero(in)) {
+    clear(out);
+    return;
+  }
+  ZZX res;
+  long n = deg(in);
+  res.rep.SetLength(n*d + 1); // zeros in between
+  for (long j = 0; j <= n; j++) res.rep[j*d] = coeff(in, j);
+  res.normalize();
+  out = res;
+}
+
+void ringProject(ZZX& out, const ZZX& in, long d)
+{
+  assert(d >= 1);
+  if (IsZero(in)) {
+    clear(out);
+    return;
+  }
+  ZZX res;
+  long n = deg(in) / d;
+  res.rep.SetLength(n + 1);
+  for (long j = 0; j <= n; j++) res.rep[j] = coeff(in, j*d);
+  res.normalize();
+  out = res;
+}
@@ -0,0 +1,86 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _RING_SWITCH_H_
+#define _RING_SWITCH_H_
+/**
+ * @file ringSwitch.h
+ * @brief Switching a ciphertext to the ring of a smaller cyclotomic
+ *
+ * Let m = d*m', where every prime factor of m also divides m'. Then
+ * Phi_m(X) = Phi_m'(X^d), so R' = Z[X]/Phi_m'(X) is the subring of
+ * R = Z[X]/Phi_m(X) of the polynomials in X^d, and every a in R is
+ * uniquely sum_{j<d} X^j a_j(X^d) with a_j in R'. The projection a -> a_0
+ * (the coefficients of a at the multiples of d) is R'-linear, it is the
+ * trace of R/R' divided by d.
+ *
+ * A ciphertext (c0,c1) with c0 + c1*s' = m + noise, for a key s' of R',
+ * therefore projects to (c0_0, c1_0) with c0_0 + c1_0*s' = m_0 + noise_0,
+ * a ciphertext of m_0 over R' whose noise is no larger. ringSwitch first
+ * key-switches the ciphertext from its key s of R to s' (as s'(X^d), an
+ * element of R), which takes one key-switching matrix from s to s' that
+ * addRingSwitchKey generates, and then projects it.
+ *
+ * The plaintext m_0 of the result is the projection of the plaintext m.
+ * When m is in R' (its slots are fixed by the automorphisms X -> X^k with
+ * k = 1 mod m'), e.g. when it is ringEmbed of a plaintext of R' or a
+ * function of such plaintexts, m_0 = m and the result decrypts to the same
+ * polynomial, with the slots of the context for m'. Working in R' then
+ * costs phi(m')/phi(m) = 1/d of the rows, both for the rest of the circuit
+ * and on the wire.
+ *
+ * The context for m' must have the very primes of the context for m (they
+ * suit m', since m' divides m), which buildRingSwitchChain adds.
+ *
+ * Usage:
+ * \code
+ *   FHEcontext big(m, p, r), small(m/d, p, r);
+ *   buildModChain(big, L);
+ *   buildRingSwitchChain(small, big);
+ *   FHESecKey bigKey(big), smallKey(small);
+ *   bigKey.GenSecKey();
+ *   smallKey.GenSecKey();
+ *   long keyID = addRingSwitchKey(bigKey, smallKey);
+ *   ...
+ *   Ctxt result(smallKey);
+ *   ringSwitch(result, ctxt, keyID);
+ * \endcode
+ **/
+#include "FHE.h"
+
+//! @brief d = m/m' if the ciphertexts of from can be switched to to: m'
+//! divides m, every prime factor of m divides m', the plaintext spaces and
+//! the schemes are the same, and the two have the same primes. Otherwise 0.
+long ringSwitchDegree(const FHEcontext& from, const FHEcontext& to);
+
+//! @brief Give to (which must have no primes yet) the primes, digits and
+//! noise parameters of from, for ring switching from from to to
+void buildRingSwitchChain(FHEcontext& to, const FHEcontext& from);
+
+//! @brief Add s'(X^d) to the keys of fromKey, with s' the key toKeyID of
+//! toKey, and the key-switching matrix to it from the key fromKeyID.
+//! Returns the index of s'(X^d) in fromKey, the keyID of ringSwitch.
+long addRingSwitchKey(FHESecKey& fromKey, const FHESecKey& toKey,
+                      long toKeyID=0, long fromKeyID=0);
+
+//! @brief out = in, switched to the ring of out and to its key toKeyID,
+//! with the matrix of addRingSwitchKey (to the key keyID of the public key
+//! of in). Raises std::logic_error if the contexts do not allow it.
+void ringSwitch(Ctxt& out, const Ctxt& in, long keyID, long toKeyID=0);
+
+//! @brief out(X) = in(X^d), from the ring of m' to that of m = d*m'
+void ringEmbed(NTL::ZZX& out, const NTL::ZZX& in, long d);
+
+//! @brief out = the coefficients of in at the multiples of d, from the ring
+//! of m = d*m' (in reduced mod Phi_m) to that of m'
+void ringProject(NTL::ZZX& out, const NTL::ZZX& in, long d);
+
+#endif // ifndef _RING_SWITCH_H_
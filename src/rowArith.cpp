@@ -0,0 +1,391 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* rowArith.cpp - pointwise modular arithmetic on rows of residues
+ *
+ * The additive kernels use the usual branch-free reduction: compute
+ * s = a+b-q (resp. a-b) and add q back in every lane where s is negative.
+ * Since q < 2^62, all the intermediate values fit in a signed 64-bit lane.
+ */
+#include "rowArith.h"
+
+#if (defined(__GNUC__) && defined(__x86_64__) && !defined(FHE_NO_SIMD))
+#define FHE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#if (defined(__SIZEOF_INT128__) && !defined(FHE_NO_INT128))
+#define FHE_INT128
+#endif
+
+NTL_CLIENT
+
+//======================== scalar kernels ========================
+
+static void addModRow_scalar(long *x, const long *y, long n, long q)
+{
+  for (long j = 0; j < n; j++) x[j] = AddMod(x[j], y[j], q);
+}
+
+static void subModRow_scalar(long *x, const long *y, long n, long q)
+{
+  for (long j = 0; j < n; j++) x[j] = SubMod(x[j], y[j], q);
+}
+
+static void addModRowConst_scalar(long *x, long c, long n, long q)
+{
+  for (long j = 0; j < n; j++) x[j] = AddMod(x[j], c, q);
+}
+
+static void subModRowConst_scalar(long *x, long c, long n, long q)
+{
+  for (long j = 0; j < n; j++) x[j] = SubMod(x[j], c, q);
+}
+
+#ifdef FHE_X86_SIMD
+//======================== AVX2 kernels ========================
+
+__attribute__((target("avx2")))
+static inline __m256i reduce_avx2(__m256i s, __m256i vq, __m256i vzero)
+{ // add q to the lanes where s<0
+  __m256i neg = _mm256_cmpgt_epi64(vzero, s);
+  return _mm256_add_epi64(s, _mm256_and_si256(neg, vq));
+}
+
+__attribute__((target("avx2")))
+static void addModRow_avx2(long *x, const long *y, long n, long q)
+{
+  const __m256i vq = _mm256_set1_epi64x(q);
+  const __m256i vzero = _mm256_setzero_si256();
+  long j = 0;
+  for (; j+4 <= n; j += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(x+j));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(y+j));
+    __m256i s = _mm256_sub_epi64(_mm256_add_epi64(a, b), vq);
+    _mm256_storeu_si256((__m256i*)(x+j), reduce_avx2(s, vq, vzero));
+  }
+  addModRow_scalar(x+j, y+j, n-j, q);
+}
+
+__attribute__((target("avx2")))
+static void subModRow_avx2(long *x, const long *y, long n, long q)
+{
+  const __m256i vq = _mm256_set1_epi64x(q);
+  const __m256i vzero = _mm256_setzero_si256();
+  long j = 0;
+  for (; j+4 <= n; j += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(x+j));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(y+j));
+    __m256i s = _mm256_sub_epi64(a, b);
+    _mm256_storeu_si256((__m256i*)(x+j), reduce_avx2(s, vq, vzero));
+  }
+  subModRow_scalar(x+j, y+j, n-j, q);
+}
+
+__attribute__((target("avx2")))
+static void addModRowConst_avx2(long *x, long c, long n, long q)
+{
+  const __m256i vq = _mm256_set1_epi64x(q);
+  const __m256i vzero = _mm256_setzero_si256();
+  const __m256i vc = _mm256_set1_epi64x(c-q);
+  long j = 0;
+  for (; j+4 <= n; j += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(x+j));
+    __m256i s = _mm256_add_epi64(a, vc);
+    _mm256_storeu_si256((__m256i*)(x+j), reduce_avx2(s, vq, vzero));
+  }
+  addModRowConst_scalar(x+j, c, n-j, q);
+}
+
+__attribute__((target("avx2")))
+static void subModRowConst_avx2(long *x, long c, long n, long q)
+{
+  const __m256i vq = _mm256_set1_epi64x(q);
+  const __m256i vzero = _mm256_setzero_si256();
+  const __m256i vc = _mm256_set1_epi64x(c);
+  long j = 0;
+  for (; j+4 <= n; j += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(x+j));
+    __m256i s = _mm256_sub_epi64(a, vc);
+    _mm256_storeu_si256((__m256i*)(x+j), reduce_avx2(s, vq, vzero));
+  }
+  subModRowConst_scalar(x+j, c, n-j, q);
+}
+
+//======================== AVX-512 kernels ========================
+
+__attribute__((target("avx512f")))
+static inline __m512i reduce_avx512(__m512i s, __m512i vq, __m512i vzero)
+{ // add q to the lanes where s<0
+  __mmask8 neg = _mm512_cmplt_epi64_mask(s, vzero);
+  return _mm512_mask_add_epi64(s, neg, s, vq);
+}
+
+__attribute__((target("avx512f")))
+static void addModRow_avx512(long *x, const long *y, long n, long q)
+{
+  const __m512i vq = _mm512_set1_epi64(q);
+  const __m512i vzero = _mm512_setzero_si512();
+  long j = 0;
+  for (; j+8 <= n; j += 8) {
+    __m512i a = _mm512_loadu_si512((const void*)(x+j));
+    __m512i b = _mm512_loadu_si512((const void*)(y+j));
+    __m512i s = _mm512_sub_epi64(_mm512_add_epi64(a, b), vq);
+    _mm512_storeu_si512((void*)(x+j), reduce_avx512(s, vq, vzero));
+  }
+  addModRow_scalar(x+j, y+j, n-j, q);
+}
+
+__attribute__((target("avx512f")))
+static void subModRow_avx512(long *x, const long *y, long n, long q)
+{
+  const __m512i vq = _mm512_set1_epi64(q);
+  const __m512i vzero = _mm512_setzero_si512();
+  long j = 0;
+  for (; j+8 <= n; j += 8) {
+    __m512i a = _mm512_loadu_si512((const void*)(x+j));
+    __m512i b = _mm512_loadu_si512((const void*)(y+j));
+    __m512i s = _mm512_sub_epi64(a, b);
+    _mm512_storeu_si512((void*)(x+j), reduce_avx512(s, vq, vzero));
+  }
+  subModRow_scalar(x+j, y+j, n-j, q);
+}
+
+__attribute__((target("avx512f")))
+static void addModRowConst_avx512(long *x, long c, long n, long q)
+{
+  const __m512i vq = _mm512_set1_epi64(q);
+  const __m512i vzero = _mm512_setzero_si512();
+  const __m512i vc = _mm512_set1_epi64(c-q);
+  long j = 0;
+  for (; j+8 <= n; j += 8) {
+    __m512i a = _mm512_loadu_si512((const void*)(x+j));
+    __m512i s = _mm512_add_epi64(a, vc);
+    _mm512_storeu_si512((void*)(x+j), reduce_avx512(s, vq, vzero));
+  }
+  addModRowConst_scalar(x+j, c, n-j, q);
+}
+
+__attribute__((target("avx512f")))
+static void subModRowConst_avx512(long *x, long c, long n, long q)
+{
+  const __m512i vq = _mm512_set1_epi64(q);
+  const __m512i vzero = _mm512_setzero_si512();
+  const __m512i vc = _mm512_set1_epi64(c);
+  long j = 0;
+  for (; j+8 <= n; j += 8) {
+    __m512i a = _mm512_loadu_si512((const void*)(x+j));
+    __m512i s = _mm512_sub_epi64(a, vc);
+    _mm512_storeu_si512((void*)(x+j), reduce_avx512(s, vq, vzero));
+  }
+  subModRowConst_scalar(x+j, c, n-j, q);
+}
+#endif // FHE_X86_SIMD
+
+//======================== dispatch ========================
+
+namespace {
+struct RowArithImpl {
+  RowArithISA isa;
+  void (*add)(long *, const long *, long, long);
+  void (*sub)(long *, const long *, long, long);
+  void (*addConst)(long *, long, long, long);
+  void (*subConst)(long *, long, long, long);
+};
+
+const RowArithImpl scalarImpl = { ROWARITH_SCALAR,
+  addModRow_scalar, subModRow_scalar,
+  addModRowConst_scalar, subModRowConst_scalar };
+
+#ifdef FHE_X86_SIMD
+const RowArithImpl avx2Impl = { ROWARITH_AVX2,
+  addModRow_avx2, subModRow_avx2,
+  addModRowConst_avx2, subModRowConst_avx2 };
+
+const RowArithImpl avx512Impl = { ROWARITH_AVX512,
+  addModRow_avx512, subModRow_avx512,
+  addModRowConst_avx512, subModRowConst_avx512 };
+#endif
+
+const RowArithImpl* implFor(RowArithISA isa)
+{
+  switch (isa) {
+#ifdef FHE_X86_SIMD
+  case ROWARITH_AVX512: return &avx512Impl;
+  case ROWARITH_AVX2:   return &avx2Impl;
+#endif
+  case ROWARITH_SCALAR: return &scalarImpl;
+  default: return NULL;
+  }
+}
+
+// The current choice, initialized on first use to the best available ISA
+const RowArithImpl*& currentImpl()
+{
+  static const RowArithImpl* impl = implFor(bestRowArithISA());
+  return impl;
+}
+} // anonymous namespace
+
+RowArithISA bestRowArithISA()
+{
+#ifdef FHE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return ROWARITH_AVX512;
+  if (__builtin_cpu_supports("avx2"))    return ROWARITH_AVX2;
+#endif
+  return ROWARITH_SCALAR;
+}
+
+RowArithISA getRowArithISA() { return currentImpl()->isa; }
+
+bool setRowArithISA(RowArithISA isa)
+{
+  if (isa > bestRowArithISA()) return false;
+  const RowArithImpl* impl = implFor(isa);
+  if (impl == NULL) return false;
+  currentImpl() = impl;
+  return true;
+}
+
+const char* rowArithISAname(RowArithISA isa)
+{
+  switch (isa) {
+  case ROWARITH_AVX512: return "avx512";
+  case ROWARITH_AVX2:   return "avx2";
+  case ROWARITH_SCALAR: return "scalar";
+  default: return "unknown";
+  }
+}
+
+void addModRow(long *x, const long *y, long n, long q)
+{ currentImpl()->add(x, y, n, q); }
+
+void subModRow(long *x, const long *y, long n, long q)
+{ currentImpl()->sub(x, y, n, q); }
+
+void addModRowConst(long *x, long c, long n, long q)
+{ currentImpl()->addConst(x, c, n, q); }
+
+void subModRowConst(long *x, long c, long n, long q)
+{ currentImpl()->subConst(x, c, n, q); }
+
+void mulModRow(long *x, const long *y, long n, long q, mulmod_t qinv)
+{
+  for (long j = 0; j < n; j++) x[j] = MulMod(x[j], y[j], q, qinv);
+}
+
+void mulModRowConst(long *x, long c, long n, long q)
+{
+  mulmod_precon_t cqinv = PrepMulModPrecon(c, q);
+  for (long j = 0; j < n; j++) x[j] = MulModPrecon(x[j], c, q, cqinv);
+}
+
+void mulAddModRow(long *x, const long *y, const long *z, long n, long q,
+                  mulmod_t qinv)
+{
+  for (long j = 0; j < n; j++)
+    x[j] = AddMod(x[j], MulMod(y[j], z[j], q, qinv), q);
+}
+
+//===================== multiply-accumulate =====================
+
+#ifdef FHE_INT128
+typedef unsigned __int128 u128;
+
+long mulAccLazyTerms(long q)
+{
+  // After a reduction the accumulator is below q <= (q-1)^2, so it counts
+  // as one more term
+  u128 sq = u128(q-1) * u128(q-1);
+  if (sq == 0) return 1L << 30;
+  u128 k = ~u128(0) / sq;
+  return (k > u128(1L << 30))? (1L << 30) : long(k);
+}
+
+// Reduction of 128-bit sums mod q by a precomputed reciprocal, the 2/1
+// division of Moller and Granlund ("Improved division by invariant
+// integers", 2011), instead of the __umodti3 libcall of u128 % q: the
+// divisor is d = q<<s with its top bit set, and v = floor((2^128-1)/d)
+// - 2^64. It costs two multiplications (four if the high word of the sum
+// is not below q).
+class RecipMod {
+  unsigned long d, v;
+  long s, q;
+
+  // (u1*2^64 + u0) mod q, for u1 < q
+  long reduce2(unsigned long u1, unsigned long u0) const
+  {
+    // q < 2^62, so 2 <= s < 64 and these shifts are defined
+    unsigned long n1 = (u1 << s) | (u0 >> (64-s)), n0 = u0 << s;
+    u128 t = u128(v) * n1 + ((u128(n1) << 64) | n0);
+    unsigned long t1 = (unsigned long)(t >> 64) + 1, t0 = (unsigned long) t;
+    unsigned long r = n0 - t1*d;
+    if (r > t0) r += d;
+    if (r >= d) r -= d;
+    return long(r >> s);
+  }
+
+public:
+  explicit RecipMod(long _q) : q(_q)
+  {
+    s = __builtin_clzl((unsigned long) q);
+    d = ((unsigned long) q) << s;
+    v = (unsigned long) (~u128(0) / d); // the 2^64 term drops out
+  }
+
+  long reduce(u128 x) const
+  {
+    unsigned long hi = (unsigned long)(x >> 64), lo = (unsigned long) x;
+    if (hi >= (unsigned long) q) hi = reduce2(0, hi);
+    return reduce2(hi, lo);
+  }
+};
+
+// The columns that mulAccRows sums at a time: a block of accumulators
+// stays in registers/L1 while the rows of all the terms stream past
+static const long mulAccBlock = 64;
+
+void mulAccRows(long *x, const long* const* y, const long* const* z,
+                long nTerms, long n, long q, mulmod_t qinv)
+{
+  long lazy = mulAccLazyTerms(q);
+  RecipMod red(q);
+  u128 acc[mulAccBlock];
+  for (long lo = 0; lo < n; lo += mulAccBlock) {
+    long sz = std::min(mulAccBlock, n - lo);
+    for (long j = 0; j < sz; j++) acc[j] = 0;
+    long pending = 0; // the terms in acc since the last reduction
+    for (long k = 0; k < nTerms; k++) {
+      if (pending == lazy) {
+        for (long j = 0; j < sz; j++) acc[j] = red.reduce(acc[j]);
+        pending = 1;
+      }
+      const unsigned long *yk = (const unsigned long *) (y[k] + lo);
+      const unsigned long *zk = (const unsigned long *) (z[k] + lo);
+      for (long j = 0; j < sz; j++) acc[j] += u128(yk[j]) * zk[j];
+      pending++;
+    }
+    for (long j = 0; j < sz; j++) x[lo+j] = red.reduce(acc[j]);
+  }
+}
+
+#else // no 128-bit integers: reduce every product
+
+long mulAccLazyTerms(long q) { return 1; }
+
+void mulAccRows(long *x, const long* const* y, const long* const* z,
+                long nTerms, long n, long q, mulmod_t qinv)
+{
+  std::fill(x, x+n, 0);
+  for (long k = 0; k < nTerms; k++) mulAddModRow(x, y[k], z[k], n, q, qinv);
+}
+#endif
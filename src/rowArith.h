@@ -0,0 +1,99 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _rowArith_H_
+#define _rowArith_H_
+/**
+ * @file rowArith.h
+ * @brief Pointwise modular arithmetic on rows of residues
+ *
+ * These are the inner loops of the DoubleCRT arithmetic: each routine
+ * applies one modular operation to n consecutive entries, all modulo
+ * the same single-precision prime q. All inputs must be in [0,q).
+ *
+ * On x86-64 with gcc/clang, AVX2 and AVX-512 versions of the additive
+ * kernels are compiled in (via function target attributes, no special
+ * compiler flags are needed) and one of them is selected at run time
+ * according to the CPU. Define FHE_NO_SIMD to compile only the scalar code.
+ *
+ * The multiplicative kernels stay scalar: a product of two ~60-bit residues
+ * needs the high half of a 64x64-bit multiplication, which AVX2/AVX-512F do
+ * not provide, so they use NTL's MulMod/MulModPrecon in a tight loop.
+ * The sums of products of mulAccRows are accumulated in unsigned 128-bit
+ * integers where the compiler has them, and reduced only once every
+ * mulAccLazyTerms(q) terms, with a precomputed reciprocal of q rather than
+ * a 128-bit division. Define FHE_NO_INT128 to reduce every product.
+ **/
+#include <algorithm>
+#include <NTL/ZZ.h>
+
+//! The instruction sets for which we have kernels
+enum RowArithISA { ROWARITH_SCALAR=0, ROWARITH_AVX2=1, ROWARITH_AVX512=2 };
+
+//! @brief The ISA that is currently used by the kernels
+RowArithISA getRowArithISA();
+
+//! @brief The best ISA supported by both this build and this CPU
+RowArithISA bestRowArithISA();
+
+//! @brief Force a specific ISA (e.g., for testing). Returns false, and
+//! leaves the current choice unchanged, if isa is not supported.
+//! Not thread-safe: call it before starting any computation.
+bool setRowArithISA(RowArithISA isa);
+
+//! @brief A printable name for isa
+const char* rowArithISAname(RowArithISA isa);
+
+//! x[j] = x[j]+y[j] mod q
+void addModRow(long *x, const long *y, long n, long q);
+//! x[j] = x[j]-y[j] mod q
+void subModRow(long *x, const long *y, long n, long q);
+//! x[j] = x[j]*y[j] mod q, qinv = PrepMulMod(q)
+void mulModRow(long *x, const long *y, long n, long q, NTL::mulmod_t qinv);
+
+//! x[j] = x[j]+y[j]*z[j] mod q, qinv = PrepMulMod(q)
+void mulAddModRow(long *x, const long *y, const long *z, long n, long q,
+                  NTL::mulmod_t qinv);
+//! x[j] = sum_k y[k][j]*z[k][j] mod q, for k in [0,nTerms)
+void mulAccRows(long *x, const long* const* y, const long* const* z,
+                long nTerms, long n, long q, NTL::mulmod_t qinv);
+//! The number of products that mulAccRows adds up before it reduces them,
+//! 1 if it has no 128-bit accumulators
+long mulAccLazyTerms(long q);
+
+//! x[j] = x[j]+c mod q
+void addModRowConst(long *x, long c, long n, long q);
+//! x[j] = x[j]-c mod q
+void subModRowConst(long *x, long c, long n, long q);
+//! x[j] = x[j]*c mod q
+void mulModRowConst(long *x, long c, long n, long q);
+
+//! Bytes at the start of a row that prefetchRow asks for
+#ifndef FHE_PREFETCH_BYTES
+#define FHE_PREFETCH_BYTES (1024)
+#endif
+
+//! @brief A hint that the first entries of the row x will be read soon.
+//! The hardware prefetchers follow a row once it is being read, this
+//! covers the start of the next one. A no-op where there is no builtin.
+inline void prefetchRow(const long *x, long n)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  long len = std::min(n*long(sizeof(long)), long(FHE_PREFETCH_BYTES));
+  const char *p = reinterpret_cast<const char*>(x);
+  for (long b = 0; b < len; b += 64)
+    __builtin_prefetch(p + b, /*read*/0, /*keep in all levels*/3);
+#else
+  (void) x; (void) n;
+#endif
+}
+
+#endif // ifndef _rowArith_H_
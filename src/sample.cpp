@@ -12,6 +12,8 @@
 /* sample.cpp - implementing various sampling routines */
 #include <vector>
 #include <cassert>
+#include <cmath>
+#include <algorithm>
 #include <NTL/ZZX.h>
 #include <NTL/ZZ_pX.h>
 #include <NTL/BasicThreadPool.h>
@@ -25,6 +27,48 @@
 
 NTL_CLIENT
 
+// The samplers below take their randomness from the current NTL
+// RandomStream (a ChaCha20 PRG, seeded by SetSeed), a buffer at a time,
+// rather than calling RandomBnd or RandomBits_long for every coefficient.
+// The output depends only on the state of the stream, which is also
+// advanced by whole buffers.
+class RandomBuffer {
+  static constexpr long bufWords = 256; // 2KB, as in DoubleCRT::randomize
+  NTL::RandomStream& stream;
+  unsigned long buf[bufWords];
+  long pos;
+
+public:
+  RandomBuffer(): stream(NTL::GetCurrentRandomStream()), pos(bufWords) {}
+
+  // 64 random bits
+  unsigned long next()
+  {
+    if (pos == bufWords) {
+      stream.get(reinterpret_cast<unsigned char*>(buf), sizeof(buf));
+      pos = 0;
+    }
+    return buf[pos++];
+  }
+
+  // Uniform in [0,n), by rejection on the next power of two
+  long bnd(long n)
+  {
+    assert(n > 0);
+    unsigned long mask = (1UL << NTL::NumBits(n-1)) - 1UL;
+    for (;;) {
+      unsigned long u = next() & mask;
+      if (u < (unsigned long) n) return u;
+    }
+  }
+
+  // Uniform in (0,1], with 53 bits
+  double uniform()
+  {
+    return ((next() >> 11) + 1) * (1.0/9007199254740992.0); // 2^{-53}
+  }
+};
+
 // Sample a degree-(n-1) poly, with only Hwt nonzero coefficients
 void sampleHWt(zzX &poly, long n, long Hwt)
 {
@@ -38,12 +82,12 @@ void sampleHWt(zzX &poly, long n, long Hwt)
   poly.SetLength(n); // allocate space
   for (long i=0; i<n; i++) poly[i] = 0;
 
+  RandomBuffer rb;
   long i=0;
   while (i<Hwt) {  // continue until exactly Hwt nonzero coefficients
-    long u = NTL::RandomBnd(n);  // The next coefficient to choose
+    long u = rb.bnd(n);  // The next coefficient to choose
     if (poly[u]==0) { // if we didn't choose it already
-      long b = NTL::RandomBits_long(2)&2; // b random in {0,2}
-      poly[u] = b-1;                      //   random in {-1,1}
+      poly[u] = 2*long(rb.next() & 1) - 1; // random in {-1,1}
 
       i++; // count another nonzero coefficient
     }
@@ -72,21 +116,21 @@ void sampleSmall(zzX &poly, long n, double prob)
 
   long threshold = round(hiMask*prob); // threshold/2^15 = Pr[nonzero]
 
-  NTL_EXEC_RANGE(n, first, last)
-  for (long i=first; i<last; i++) {
-    long u = NTL::RandomBits_long(bitSize); // a random 16-bit number
-    long uLo = u & loMask; // bottom 15 bits
-    long uHi = u & hiMask; // top bit
-
-    // with probability threshold/2^15, choose between +-1
-    if (uLo<threshold) { // compare low 15 bits to threshold
-      poly[i] = (uHi>>(bitSize-2))-1; // topBit*2 - 1 \in {+-1}
+  // Four coefficients from every 64-bit word. This is done serially so
+  // that the result does not depend on the number of threads.
+  RandomBuffer rb;
+  long *coeffs = poly.elts();
+  for (long i=0; i<n; i+=4) {
+    unsigned long w = rb.next();
+    for (long j=i; j<std::min(i+4, n); j++, w >>= bitSize) {
+      long u = w & 0xffff; // a random 16-bit number
+      long uLo = u & loMask; // bottom 15 bits
+      long uHi = u & hiMask; // top bit
+
+      // with probability threshold/2^15 choose between +-1, otherwise 0
+      coeffs[j] = (uLo<threshold)? (uHi>>(bitSize-2))-1 : 0;
     }
-
-    // with probability 1-prob, set to zero
-    else poly[i] = 0;
   }
-  NTL_EXEC_RANGE_END
 }
 void sampleSmall(ZZX &poly, long n, double prob)
 {  
@@ -100,17 +144,17 @@ void sampleSmall(ZZX &poly, long n, double prob)
 void sampleGaussian(std::vector<double> &dvec, long n, double stdev)
 {
   static double const Pi=4.0*atan(1.0);  // Pi=3.1415..
-  static double const bignum = LONG_MAX; // convert to double
   // THREADS: C++11 guarantees these are initialized only once
 
   if (n<=0) n=lsize(dvec); if (n<=0) return;
   dvec.resize(n, 0.0);        // allocate space for n variables
 
   // Uses the Box-Muller method to get two Normal(0,stdev^2) variables
+  RandomBuffer rb;
   for (long i=0; i<n; i+=2) {
-    // r1, r2 are "uniform in (0,1)"
-    double r1 = (1+NTL::RandomBnd(LONG_MAX))/(bignum+1);
-    double r2 = (1+NTL::RandomBnd(LONG_MAX))/(bignum+1);
+    // r1, r2 are uniform in (0,1]
+    double r1 = rb.uniform();
+    double r2 = rb.uniform();
     double theta=2*Pi*r1;
     double rr= sqrt(-2.0*log(r2))*stdev;
     if (rr > 8*stdev) // sanity-check, trancate at 8 standard deviations
@@ -123,20 +167,58 @@ void sampleGaussian(std::vector<double> &dvec, long n, double stdev)
   }
 }
 
-// Sample a degree-(n-1) ZZX, with rounded Gaussian coefficients
+// Above this, there are too many entries for the table-based sampler
+static const double maxTableStdev = 64.0;
+
+// Sample a degree-(n-1) ZZX, with discrete Gaussian coefficients,
+// Pr[x] proportional to exp(-x^2/(2*stdev^2)) for |x| <= 8*stdev
 void sampleGaussian(zzX &poly, long n, double stdev)
 {
   if (n<=0) n=lsize(poly); if (n<=0) return;
-  std::vector<double> dvec;
-  sampleGaussian(dvec, n, stdev); // sample continuous Gaussians
-
-  // round and copy to coefficients of poly
   clear(poly);
   poly.SetLength(n); // allocate space for degree-(n-1) polynomial
-  for (long i=0; i<n; i++)
-    poly[i] = long(round(dvec[i])); // round to nearest integer
+
+  if (stdev <= 0) {
+    for (long i=0; i<n; i++) poly[i] = 0;
+    return;
+  }
+  if (stdev > maxTableStdev) { // round continuous Gaussians
+    std::vector<double> dvec;
+    sampleGaussian(dvec, n, stdev);
+    for (long i=0; i<n; i++)
+      poly[i] = long(round(dvec[i])); // round to nearest integer
+    return;
+  }
+
+  // The cumulative distribution of |x|, scaled to 2^63:
+  // cdt[k] = 2^63 * Pr[|x| <= k]
+  long K = std::max(long(ceil(8*stdev)), 1L);
+  std::vector<long double> pr(K+1);
+  long double total = 0;
+  for (long k=0; k<=K; k++) {
+    pr[k] = std::exp(-(long double)(k*k)/(2.0L*stdev*stdev)) * ((k==0)? 1 : 2);
+    total += pr[k];
+  }
+  std::vector<unsigned long> cdt(K+1);
+  long double acc = 0;
+  for (long k=0; k<=K; k++) {
+    acc += pr[k];
+    cdt[k] = (unsigned long) std::min(acc/total*9223372036854775808.0L,
+                                      9223372036854775807.0L);
+  }
+  cdt[K] = 1UL << 63; // everything falls in the table
+
+  // For each coefficient, the low 63 bits choose |x| and the top bit
+  // its sign
+  RandomBuffer rb;
+  for (long i=0; i<n; i++) {
+    unsigned long u = rb.next();
+    unsigned long v = u & ((1UL << 63) - 1);
+    long k = std::upper_bound(cdt.begin(), cdt.end(), v) - cdt.begin();
+    poly[i] = (u >> 63)? -k : k;
+  }
 }
-// Sample a degree-(n-1) ZZX, with rounded Gaussian coefficients
+// Sample a degree-(n-1) ZZX, with discrete Gaussian coefficients
 void sampleGaussian(ZZX &poly, long n, double stdev)
 {
   zzX pp;
@@ -183,8 +265,9 @@ void sampleUniform(zzX& poly, long n, long B)
   if (n<=0) n=lsize(poly); if (n<=0) return;
   poly.SetLength(n); // allocate space for degree-(n-1) polynomial
 
+  RandomBuffer rb;
   for (long i = 0; i < n; i++)
-    poly[i] = NTL::RandomBnd(2*B +1) - B;
+    poly[i] = rb.bnd(2*B +1) - B;
 }
 
 // Sample a degree-(n-1) ZZX, with coefficients uniform in [-B,B]
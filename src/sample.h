@@ -30,7 +30,9 @@ void sampleSmall(NTL::ZZX &poly, long n, double prob=0.5);
 void sampleHWt(zzX &poly, long n, long Hwt=100);
 void sampleHWt(NTL::ZZX &poly, long n, long Hwt=100);
 
-//! Sample polynomials with Gaussian coefficients.
+//! Sample polynomials with Gaussian coefficients. For stdev up to 64 these
+//! are discrete Gaussians, drawn from a table of the distribution;
+//! larger ones are rounded continuous Gaussians.
 void sampleGaussian(zzX &poly, long n, double stdev);
 void sampleGaussian(NTL::ZZX &poly, long n, double stdev);
 
@@ -0,0 +1,186 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* shadow.cpp - ciphertexts that carry the plaintext they should decrypt to
+ */
+#include <atomic>
+#include <stdexcept>
+#include "shadow.h"
+
+NTL_CLIENT
+
+static std::atomic<bool> shadowOn(false);
+
+void setShadowMode(bool on) { shadowOn = on; }
+bool shadowMode() { return shadowOn; }
+
+static const EncryptedArray& checkEA(const EncryptedArray& ea)
+{
+  if (ea.getTag() == PA_cx_tag)
+    throw std::logic_error("ShadowCtxt: CKKS slots have no PlaintextArray");
+  return ea;
+}
+
+ShadowCtxt::ShadowCtxt(const EncryptedArray& _ea, const FHEPubKey& pubKey,
+                       const PlaintextArray& pa)
+  : ea(checkEA(_ea)), ctxt(pubKey)
+{
+  ea.encrypt(ctxt, pubKey, pa);
+  if (shadowMode()) shadow.reset(new PlaintextArray(pa));
+}
+
+ShadowCtxt::ShadowCtxt(const EncryptedArray& _ea, const Ctxt& _ctxt,
+                       const PlaintextArray& pa)
+  : ea(checkEA(_ea)), ctxt(_ctxt)
+{
+  assert(&ea.getContext() == &ctxt.getContext());
+  if (shadowMode()) shadow.reset(new PlaintextArray(pa));
+}
+
+ShadowCtxt::ShadowCtxt(const ShadowCtxt& other)
+  : ea(other.ea), ctxt(other.ctxt)
+{
+  if (other.shadow) shadow.reset(new PlaintextArray(*other.shadow));
+}
+
+ShadowCtxt& ShadowCtxt::operator=(const ShadowCtxt& other)
+{
+  if (this == &other) return *this;
+  assert(&ea.getContext() == &other.ea.getContext());
+  ctxt = other.ctxt;
+  if (!other.shadow) shadow.reset();
+  else if (shadow) *shadow = *other.shadow;
+  else shadow.reset(new PlaintextArray(*other.shadow));
+  return *this;
+}
+
+bool ShadowCtxt::bothShadowed(const ShadowCtxt& other)
+{
+  assert(&ea.getContext() == &other.ea.getContext());
+  if (!other.shadow) shadow.reset();
+  return bool(shadow);
+}
+
+bool ShadowCtxt::check(const FHESecKey& sKey) const
+{
+  if (!shadow) return true;
+
+  PlaintextArray res(ea);
+  ea.decrypt(ctxt, sKey, res);
+  vector<ZZX> got, expected;
+  decode(ea, got, res);
+  decode(ea, expected, *shadow);
+
+  // the ciphertext may have dropped to a smaller plaintext space
+  long ptxtSpace = ctxt.getPtxtSpace();
+  if (ptxtSpace < ea.getAlMod().getPPowR()) {
+    ZZ mod(ptxtSpace);
+    for (long s: range(lsize(got))) {
+      for (long i: range(got[s].rep.length())) got[s].rep[i] %= mod;
+      for (long i: range(expected[s].rep.length()))
+        expected[s].rep[i] %= mod;
+      got[s].normalize();
+      expected[s].normalize();
+    }
+  }
+  return got == expected;
+}
+
+void ShadowCtxt::addCtxt(const ShadowCtxt& other, bool negative)
+{
+  ctxt.addCtxt(other.ctxt, negative);
+  if (!bothShadowed(other)) return;
+  if (negative) sub(ea, *shadow, *other.shadow);
+  else          add(ea, *shadow, *other.shadow);
+}
+
+void ShadowCtxt::multiplyBy(const ShadowCtxt& other)
+{
+  ctxt.multiplyBy(other.ctxt);
+  if (bothShadowed(other)) ::mul(ea, *shadow, *other.shadow);
+}
+
+void ShadowCtxt::negate()
+{
+  ctxt.negate();
+  if (shadow) ::negate(ea, *shadow);
+}
+
+void ShadowCtxt::addConstant(const PlaintextArray& pa)
+{
+  ZZX poly;
+  ea.encode(poly, pa);
+  ctxt.addConstant(poly);
+  if (shadow) add(ea, *shadow, pa);
+}
+
+void ShadowCtxt::addConstant(long c)
+{
+  ctxt.addConstant(to_ZZ(c));
+  if (!shadow) return;
+  PlaintextArray cp(ea);
+  encode(ea, cp, c);
+  add(ea, *shadow, cp);
+}
+
+void ShadowCtxt::multByConstant(const PlaintextArray& pa)
+{
+  ZZX poly;
+  ea.encode(poly, pa);
+  ctxt.multByConstant(poly);
+  if (shadow) ::mul(ea, *shadow, pa);
+}
+
+void ShadowCtxt::multByConstant(long c)
+{
+  ctxt.multByConstant(to_ZZ(c));
+  if (!shadow) return;
+  PlaintextArray cp(ea);
+  encode(ea, cp, c);
+  ::mul(ea, *shadow, cp);
+}
+
+void ShadowCtxt::rotate(long k)
+{
+  ea.rotate(ctxt, k);
+  if (shadow) ::rotate(ea, *shadow, k);
+}
+
+void ShadowCtxt::shift(long k)
+{
+  ea.shift(ctxt, k);
+  if (shadow) ::shift(ea, *shadow, k);
+}
+
+void ShadowCtxt::rotate1D(long i, long k)
+{
+  ea.rotate1D(ctxt, i, k);
+  if (shadow) ::rotate1D(ea, *shadow, i, k);
+}
+
+void ShadowCtxt::shift1D(long i, long k)
+{
+  ea.shift1D(ctxt, i, k);
+  if (shadow) ::shift1D(ea, *shadow, i, k);
+}
+
+void ShadowCtxt::frobeniusAutomorph(long j)
+{
+  ctxt.frobeniusAutomorph(j);
+  if (shadow) ::frobeniusAutomorph(ea, *shadow, j);
+}
+
+void ShadowCtxt::mul(const MatMul1D& mat)
+{
+  assert(&mat.getEA().getContext() == &ea.getContext());
+  MatMul1DExec(mat).mul(ctxt);
+  if (shadow) ::mul(*shadow, mat);
+}
@@ -0,0 +1,100 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _SHADOW_H_
+#define _SHADOW_H_
+/**
+ * @file shadow.h
+ * @brief Verifying a homomorphic computation against the same computation
+ * on plaintext arrays.
+ *
+ * A ShadowCtxt is a ciphertext together with the PlaintextArray that it
+ * should decrypt to (its shadow). Every operation on it is carried out on
+ * the ciphertext and, with the PlaintextArray functions of EncryptedArray.h
+ * and matmul.h, on the shadow, so a holder of the secret key can check()
+ * at any point that the two still agree, e.g. on canary traffic.
+ *
+ * Shadowing is opt-in: while setShadowMode(false) (the default), a new
+ * ShadowCtxt has no shadow and its operations only touch the ciphertext.
+ * An operation with an operand that has no shadow drops the shadow of the
+ * result, and check() passes trivially for a ciphertext without a shadow.
+ * Only the BGV slots (p^r) have a PlaintextArray, a ShadowCtxt with CKKS
+ * slots raises std::logic_error.
+ **/
+#include "EncryptedArray.h"
+#include "matmul.h"
+
+//! @brief Turn the shadows of the ShadowCtxt's that are built from now on
+//! on or off
+void setShadowMode(bool on);
+bool shadowMode();
+
+//! @class ShadowCtxt
+//! @brief A ciphertext with the plaintext that it should decrypt to
+class ShadowCtxt {
+  const EncryptedArray& ea;
+  Ctxt ctxt;
+  std::unique_ptr<PlaintextArray> shadow; // null: not shadowed
+
+  // shadow = null unless the other operand is shadowed too
+  bool bothShadowed(const ShadowCtxt& other);
+
+public:
+  //! @brief An encryption of pa under pubKey
+  ShadowCtxt(const EncryptedArray& ea, const FHEPubKey& pubKey,
+             const PlaintextArray& pa);
+  //! @brief A ciphertext that the caller knows to encrypt pa
+  ShadowCtxt(const EncryptedArray& ea, const Ctxt& ctxt,
+             const PlaintextArray& pa);
+
+  ShadowCtxt(const ShadowCtxt& other);
+  ShadowCtxt& operator=(const ShadowCtxt& other);
+
+  const EncryptedArray& getEA() const { return ea; }
+  const Ctxt& getCtxt() const { return ctxt; }
+  bool hasShadow() const { return bool(shadow); }
+  //! @brief The shadow, only if hasShadow()
+  const PlaintextArray& getShadow() const { return *shadow; }
+
+  //! @brief Does the ciphertext decrypt to its shadow? Also true if there
+  //! is no shadow.
+  bool check(const FHESecKey& sKey) const;
+
+  //! @name The operations of Ctxt and EncryptedArray, on both sides
+  ///@{
+  void addCtxt(const ShadowCtxt& other, bool negative=false);
+  ShadowCtxt& operator+=(const ShadowCtxt& other)
+  { addCtxt(other); return *this; }
+  ShadowCtxt& operator-=(const ShadowCtxt& other)
+  { addCtxt(other, true); return *this; }
+  void multiplyBy(const ShadowCtxt& other);
+  ShadowCtxt& operator*=(const ShadowCtxt& other)
+  { multiplyBy(other); return *this; }
+  void square() { multiplyBy(*this); }
+  void negate();
+
+  void addConstant(const PlaintextArray& pa);
+  void addConstant(long c);          //!< c in every slot
+  void multByConstant(const PlaintextArray& pa);
+  void multByConstant(long c);       //!< c in every slot
+
+  void rotate(long k);
+  void shift(long k);
+  void rotate1D(long i, long k);
+  void shift1D(long i, long k);
+  void frobeniusAutomorph(long j);
+
+  //! @brief Apply a 1D transformation, which encodes mat on every call
+  void mul(const MatMul1D& mat);
+  ///@}
+};
+
+#endif // ifndef _SHADOW_H_
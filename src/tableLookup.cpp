@@ -18,9 +18,13 @@
 #include <cassert>
 #include <cstdlib>
 #include <stdexcept>
+#include <mutex>
+#include <memory>
 #include <NTL/BasicThreadPool.h>
 #include "intraSlot.h"
+#include "binaryArith.h"
 #include "tableLookup.h"
+#include "taskScheduler.h"
 
 NTL_CLIENT
 
@@ -73,27 +77,115 @@ void computeAllProducts(/*Output*/CtPtrs& products,
   recursiveProducts(products, CtPtrs_slice(array,0,nBits));
 }
 
-// The input is a plaintext table T[] and an array of encrypted bits
-// I[], holding the binary representation of an index i into T.
-// The output is the encrypted value T[i].
-void tableLookup(Ctxt& out, const vector<zzX>& table, const CtPtrs& idx,
-                 std::vector<zzX>* unpackSlotEncoding)
+//======================== TableIndexSelector ========================
+
+TableIndexSelector::TableIndexSelector(const CtPtrs& idx, long tableSize,
+                                       std::vector<zzX>* unpackSlotEncoding)
 {
   FHE_TIMER_START;
-  out.clear();
-  vector<Ctxt> products(lsize(table), out); // to hold subset products of idx
+  const Ctxt* ct = idx.ptr2nonNull(); // find some non-null Ctxt
+  if (ct==nullptr) return;            // nothing to select from
+
+  long nBits = lsize(idx);
+  assert(nBits <= 16); // Output cannot be bigger than 2^16
+  if (tableSize<=0 || tableSize > (1L << nBits)) tableSize = 1L << nBits;
+  products.resize(tableSize, Ctxt(ZeroCtxtLike, *ct));
   CtPtrs_vectorCt pWrap(products); // A wrapper
 
   // Compute all products of ecnrypted bits =: b_i
   computeAllProducts(pWrap, idx, unpackSlotEncoding);
+}
 
-  // Compute the sum b_i * T[i]
-  NTL_EXEC_RANGE(lsize(table), first, last)
+void TableIndexSelector::lookup(Ctxt& out, const vector<zzX>& table) const
+{
+  FHE_TIMER_START;
+  out.clear();
+  long n = std::min(size(), lsize(table));
+  if (n==0) return;
+
+  // Compute the sum b_i * T[i], each thread summing up its own range
+  std::mutex mx;
+  FHE_EXEC_RANGE(n, first, last)
+  Ctxt sum(ZeroCtxtLike, products[0]), tmp(ZeroCtxtLike, products[0]);
+  for(long i=first; i<last; i++) {
+    tmp = products[i];
+    tmp.multByConstant(table[i]); // p[i]*T[i]
+    sum += tmp;
+  }
+  std::lock_guard<std::mutex> lock(mx);
+  out += sum;
+  FHE_EXEC_RANGE_END
+}
+
+void TableIndexSelector::lookup(CtPtrs& out,
+                                const vector< vector<zzX> >& tables) const
+{
+  FHE_TIMER_START;
+  long nTables = lsize(tables);
+  if (nTables==0) return;
+  if (size()==0) { // nothing to select from, all the outputs are zero
+    for (long t=0; t<std::min(nTables, lsize(out)); t++) out[t]->clear();
+    return;
+  }
+  const Ctxt zero(ZeroCtxtLike, products[0]);
+  if (lsize(out) < nTables) resize(out, nTables, zero);
+  for (long t=0; t<nTables; t++) out[t]->clear();
+
+  long n = 0;
+  for (auto& table: tables) n = std::max(n, lsize(table));
+  n = std::min(n, size());
+
+  // Every selector is multiplied by the entries of all the tables while
+  // it is hot in cache, each thread summing up its own range
+  std::mutex mx;
+  FHE_EXEC_RANGE(n, first, last)
+  std::vector<Ctxt> sums(nTables, zero);
+  Ctxt tmp(zero);
   for(long i=first; i<last; i++)
-    products[i].multByConstant(table[i]); // p[i] = p[i]*T[i]
-  NTL_EXEC_RANGE_END
-  for(long i=0; i<lsize(table); i++)
-    out += products[i];
+    for (long t=0; t<nTables; t++) {
+      if (i >= lsize(tables[t])) continue;
+      tmp = products[i];
+      tmp.multByConstant(tables[t][i]); // p[i]*T_t[i]
+      sums[t] += tmp;
+    }
+  std::lock_guard<std::mutex> lock(mx);
+  for (long t=0; t<nTables; t++) *out[t] += sums[t];
+  FHE_EXEC_RANGE_END
+}
+
+void TableIndexSelector::writeIn(const CtPtrs& table) const
+{
+  FHE_TIMER_START;
+  long n = std::min(size(), lsize(table));
+
+  // incrememnt each entry of T[i] by products[i]
+  FHE_EXEC_RANGE(n, first, last)
+  for(long i=first; i<last; i++)
+    *table[i] += products[i];
+  FHE_EXEC_RANGE_END
+}
+
+// The input is a plaintext table T[] and an array of encrypted bits
+// I[], holding the binary representation of an index i into T.
+// The output is the encrypted value T[i].
+void tableLookup(Ctxt& out, const vector<zzX>& table, const CtPtrs& idx,
+                 std::vector<zzX>* unpackSlotEncoding)
+{
+  FHE_TIMER_START;
+  TableIndexSelector selector(idx, lsize(table), unpackSlotEncoding);
+  selector.lookup(out, table);
+}
+
+// Several tables with the same index
+void tableLookup(CtPtrs& out, const vector< vector<zzX> >& tables,
+                 const CtPtrs& idx, std::vector<zzX>* unpackSlotEncoding)
+{
+  FHE_TIMER_START;
+  long tableSize = 0;
+  for (auto& table: tables) tableSize = std::max(tableSize, lsize(table));
+  if (tableSize==0) return;
+  TableIndexSelector selector(idx, tableSize, unpackSlotEncoding);
+  selector.lookup(out, tables);
 }
 
 // A counterpart of tableLookup. The input is an encrypted table T[]
@@ -103,20 +195,119 @@ void tableWriteIn(const CtPtrs& table, const CtPtrs& idx,
                   std::vector<zzX>* unpackSlotEncoding)
 {
   FHE_TIMER_START;
-  const Ctxt* ct = table.ptr2nonNull(); // find some non-null Ctxt
   long size = lsize(table);
   if (size==0) return;
-  std::vector<Ctxt> products(size, Ctxt(ZeroCtxtLike, *ct));  
-  CtPtrs_vectorCt pWrap(products); // A wrapper
+  TableIndexSelector selector(idx, size, unpackSlotEncoding);
+  selector.writeIn(table);
+}
 
-  // Compute all products of ecnrypted bits =: b_i
-  computeAllProducts(pWrap, idx, unpackSlotEncoding);
+// A histogram of many indexes. The selector of entry j for index k is the
+// product lo_k[j mod 2^nLo] * hi_k[j >> nLo] of the selectors of the low
+// and high halves of its bits. Only the half selectors are computed for
+// every index, and every entry of the table is incremented by the sum over
+// k of these products, which are tensored without re-linearization, so
+// there is one re-linearization per entry rather than one per entry and
+// index.
+void tableWriteIn(const CtPtrs& table, const CtPtrMat& idxs,
+                  std::vector<zzX>* unpackSlotEncoding)
+{
+  FHE_TIMER_START;
+  long size = lsize(table);
+  long nIdx = lsize(idxs);
+  const Ctxt* ct = idxs.ptr2nonNull();
+  if (size==0 || nIdx==0 || ct==nullptr) return;
+  if (nIdx==1) { tableWriteIn(table, idxs[0], unpackSlotEncoding); return; }
+
+  long nBits = lsize(idxs[0]);
+  for (long k=1; k<nIdx; k++)
+    if (lsize(idxs[k]) != nBits)
+      throw std::logic_error("tableWriteIn: indexes of different sizes");
+  if (size>1) // as in computeAllProducts, ignore bits past the table
+    nBits = std::min(nBits, NTL::NumBits(size-1));
+  if (nBits<1) return; // nothing is selected
+  assert(nBits <= 16); // Output cannot be bigger than 2^16
+  long nLo = (nBits+1)/2;
+  long nHi = nBits - nLo;
+  size = std::min(size, 1L << nBits);
+
+  const Ctxt zero(ZeroCtxtLike, *ct);
+  std::vector< std::vector<Ctxt> >
+    lo(nIdx, std::vector<Ctxt>(1L << nLo, zero)),
+    hi(nIdx, std::vector<Ctxt>(nHi>0? (1L << nHi) : 0, zero));
+  FHE_EXEC_RANGE(nIdx, first, last)
+  for (long k=first; k<last; k++) {
+    CtPtrs_vectorCt loWrap(lo[k]);
+    computeAllProducts(loWrap, CtPtrs_slice(idxs[k], 0, nLo),
+                       unpackSlotEncoding);
+    if (nHi>0) {
+      CtPtrs_vectorCt hiWrap(hi[k]);
+      computeAllProducts(hiWrap, CtPtrs_slice(idxs[k], nLo, nHi),
+                         unpackSlotEncoding);
+    }
+  }
+  FHE_EXEC_RANGE_END
+
+  long loMask = (1L << nLo) - 1;
+  FHE_EXEC_RANGE(size, first, last)
+  Ctxt sum(zero), tmp(zero);
+  for (long j=first; j<last; j++) {
+    long jLo = j & loMask, jHi = j >> nLo;
+    sum.clear();
+    for (long k=0; k<nIdx; k++) {
+      tmp = lo[k][jLo];
+      if (nHi>0) tmp *= hi[k][jHi]; // re-linearized once, below
+      sum += std::move(tmp);
+    }
+    sum.reLinearize();
+    *table[j] += sum;
+  }
+  FHE_EXEC_RANGE_END
+}
 
-  // incrememnt each entry of T[i] by products[i]
-  NTL_EXEC_RANGE(lsize(table), first, last)
-  for(long i=first; i<last; i++)
-    *table[i] += products[i];
-  NTL_EXEC_RANGE_END
+// Group-by sum: every entry of the table gets the products of its
+// selectors and the values in one call to addManyNumbers, together with
+// its old content
+void tableAddIn(CtPtrMat& table, const CtPtrMat& idxs, const CtPtrMat& values,
+                long sizeLimit, std::vector<zzX>* unpackSlotEncoding)
+{
+  FHE_TIMER_START;
+  long size = lsize(table);
+  long nIdx = lsize(idxs);
+  if (lsize(values) != nIdx)
+    throw std::logic_error("tableAddIn: "+std::to_string(nIdx)
+                           +" indexes but "+std::to_string(lsize(values))
+                           +" values");
+  if (size==0 || nIdx==0 || idxs.ptr2nonNull()==nullptr) return;
+
+  std::vector< std::unique_ptr<TableIndexSelector> > selectors(nIdx);
+  FHE_EXEC_RANGE(nIdx, first, last)
+  for (long k=first; k<last; k++)
+    selectors[k].reset(new TableIndexSelector(idxs[k], size,
+                                              unpackSlotEncoding));
+  FHE_EXEC_RANGE_END
+
+  FHE_EXEC_RANGE(size, first, last)
+  for (long j=first; j<last; j++) {
+    std::vector< std::vector<Ctxt> > numbers;
+    if (lsize(table[j]) > 0) {
+      numbers.emplace_back();
+      vecCopy(numbers.back(), table[j]);
+    }
+    for (long k=0; k<nIdx; k++) {
+      const TableIndexSelector& sel = *selectors[k];
+      if (j >= sel.size() || lsize(values[k]) == 0) continue;
+      numbers.emplace_back();
+      std::vector<Ctxt>& bits = numbers.back();
+      for (long b=0; b<lsize(values[k]); b++) {
+        bits.push_back(*values[k][b]);
+        bits.back().multiplyBy(sel[j]); // the value if index k is j, else 0
+      }
+    }
+    if (numbers.empty()) continue; // nothing to add to this entry
+    CtPtrMat_vectorCt wrapper(numbers);
+    addManyNumbers(table[j], wrapper, sizeLimit, unpackSlotEncoding);
+  }
+  FHE_EXEC_RANGE_END
 }
 
 // The function buildLookupTable is documented in tableLookup.h.
@@ -185,21 +376,10 @@ void buildLookupTable(std::vector<zzX>& T,// result is encoded and returned in T
 }
 
 
-// A recursive function to compute, for an n-size array, the 2^n products
-//     products[j] = \prod_{i s.t. j_i=1} array[i]
-//                   \times \prod_{i s.t. j_i=0}(a-array[i])
-// It is assume that 'products' size <= 2^n, else only 1st 2^n entries are set
+// The products for n<=2 bits, N<=4 of them
 static void
-recursiveProducts(const CtPtrs& products, const CtPtrs_slice& array)
+leafProducts(const CtPtrs& products, const CtPtrs_slice& array, long N)
 {
-  long nBits = lsize(array);
-  long N = lsize(products);
-  if (nBits==0 || N==0) return; // nothing to do
-
-  if (N > (1L << nBits)) N = (1L << nBits);
-  else if (N < (1L << (nBits-1)))
-    nBits = NTL::NumBits(N-1); // Ensure nBits <= ceil(log2(N))
-
   if (N<=2) { // edge condition
     *products[0] = *array[0];
     products[0]->negate();
@@ -208,7 +388,7 @@ recursiveProducts(const CtPtrs& products, const CtPtrs_slice& array)
       *products[1] = *array[0];    // out[1] = in
   }
   // optimization for n=2: a single multiplication instead of 4
-  else if (N<=4) {
+  else {
     *products[0] = *array[1];          // x1
     products[0]->multiplyBy(*array[0]);// x1 x0
 
@@ -225,33 +405,105 @@ recursiveProducts(const CtPtrs& products, const CtPtrs_slice& array)
     *products[0] -= *array[1];         // 1 +x1 x0 -x1
     *products[0] -= *array[0]   ;      // 1 +x1 x0 -x1 -x0 = (1-x1)(1-x0)
   }
-  else { // split the array into two parts;
+}
+
+// A node in the tree of the recursion: the N products of the bits
+// array[start..start+nBits-1]. An internal node splits its bits in two
+// parts, the first of size n1, and multiplies the k products of the first
+// part by the products of the second.
+struct ProductsNode {
+  long start, nBits, N;
+  long n1, k;
+  long child1, child2; // -1 for leaves
+  long depth;
+  std::vector<Ctxt> buf; // the products (the root uses the output instead)
+
+  ProductsNode(long _start, long _nBits, long _N, long _depth):
+    start(_start), nBits(_nBits), N(_N), n1(0), k(0),
+    child1(-1), child2(-1), depth(_depth) {}
+};
+
+// A function to compute, for an n-size array, the 2^n products
+//     products[j] = \prod_{i s.t. j_i=1} array[i]
+//                   \times \prod_{i s.t. j_i=0}(a-array[i])
+// It is assume that 'products' size <= 2^n, else only 1st 2^n entries are set
+//
+// The recursion (split the array in two parts, compute the products of
+// each part, then multiply them) is unfolded into a tree, which is then
+// computed bottom-up, one depth at a time: all the multiplications at the
+// same depth are independent, and run together on the thread pool. The
+// products of the nodes below are freed as soon as their parent is done,
+// so besides the output only O(2^{n/2}) ciphertexts are ever alive.
+static void
+recursiveProducts(const CtPtrs& products, const CtPtrs_slice& array)
+{
+  long nBits = lsize(array);
+  long N = lsize(products);
+  if (nBits==0 || N==0) return; // nothing to do
+
+  std::vector<ProductsNode> nodes;
+  nodes.push_back(ProductsNode(0, nBits, N, 0));
+  for (long t=0; t<lsize(nodes); t++) { // breadth first
+    ProductsNode& node = nodes[t];
+    if (node.N > (1L << node.nBits)) node.N = (1L << node.nBits);
+    else if (node.N < (1L << (node.nBits-1)))
+      node.nBits = NTL::NumBits(node.N-1); // Ensure nBits <= ceil(log2(N))
+    if (node.N<=4) continue; // a leaf
+
+    // split the array into two parts;
     // first part is highest pow(2) < n, second part is what is left
+    long n1 = 1L << (NTL::NumBits(node.nBits)-1); // largest power of two <= n
+    if (node.nBits<=n1) n1 = n1/2;                // largest power of two < n
+    node.n1 = n1;
+    node.k = 1L << n1;         // size of first part
+    long l = 1L << (node.nBits-n1); // size of second part
+    long start = node.start, rest = node.nBits-n1, depth = node.depth+1;
+    node.child1 = lsize(nodes);
+    node.child2 = lsize(nodes)+1;
+    nodes.push_back(ProductsNode(start, n1, 1L << n1, depth)); // invalidates node
+    nodes.push_back(ProductsNode(start+n1, rest, l, depth));
+  }
 
-    long n1 = 1L << (NTL::NumBits(nBits)-1); // largest power of two <= n
-    if (nBits<=n1) n1 = n1/2;                // largest power of two < n
-    long k = 1L << n1;         // size of first part
-    long l = 1L << (nBits-n1); // size of second part
+  const Ctxt zeroCtxt(ZeroCtxtLike, *array.ptr2nonNull());
+  for (long d=nodes.back().depth; d>=0; d--) {
+    std::vector<long> level;
+    for (long t=0; t<lsize(nodes); t++)
+      if (nodes[t].depth==d) {
+        level.push_back(t);
+        if (t>0) nodes[t].buf.resize(nodes[t].N, zeroCtxt);
+      }
+
+    // One task for every leaf, and for every product of an internal node
+    std::vector<std::pair<long,long>> tasks; // (node, product or -1)
+    for (long t: level) {
+      if (nodes[t].child1<0) tasks.push_back(std::make_pair(t,-1L));
+      else for (long ii=0; ii<nodes[t].N; ii++)
+        tasks.push_back(std::make_pair(t,ii));
+    }
+    FHE_EXEC_RANGE(lsize(tasks), first, last)
+    for (long tt=first; tt<last; tt++) {
+      ProductsNode& node = nodes[tasks[tt].first];
+      long ii = tasks[tt].second;
+      if (ii<0) {
+        CtPtrs_vectorCt bufWrap(node.buf);
+        const CtPtrs& out = (tasks[tt].first==0)?
+          products : static_cast<const CtPtrs&>(bufWrap);
+        leafProducts(out, CtPtrs_slice(array, node.start, node.nBits), node.N);
+      }
+      else { // multiplication to get all subset products
+        Ctxt* out = (tasks[tt].first==0)? products[ii] : &node.buf[ii];
+        long j = ii / node.k;
+        long i = ii - j*node.k;
+        *out = nodes[node.child1].buf[i];
+        out->multiplyBy(nodes[node.child2].buf[j]);
+      }
+    }
+    FHE_EXEC_RANGE_END
 
-    const Ctxt* ct = array.ptr2nonNull(); // find some non-null Ctxt
-    std::vector<Ctxt> products1(k, Ctxt(ZeroCtxtLike, *ct));
-    std::vector<Ctxt> products2(l, Ctxt(ZeroCtxtLike, *ct));
-
-    // compute first part of the array
-    recursiveProducts(CtPtrs_vectorCt(products1), CtPtrs_slice(array,0, n1));
-
-    // recursive call on second part of array
-    recursiveProducts(CtPtrs_vectorCt(products2), CtPtrs_slice(array,n1,nBits-n1));
-
-    // multiplication to get all subset products
-    NTL_EXEC_RANGE(lsize(products), first, last)
-    for(long ii=first; ii<last; ii++) {
-      long j = ii / k;
-      long i = ii - j*k;
-      *products[ii] = products1[i];
-      products[ii]->multiplyBy(products2[j]);
+    for (long t: level) if (nodes[t].child1>=0) { // free the parts
+      std::vector<Ctxt>().swap(nodes[nodes[t].child1].buf);
+      std::vector<Ctxt>().swap(nodes[nodes[t].child2].buf);
     }
-    NTL_EXEC_RANGE_END
   }
 }
 
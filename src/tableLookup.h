@@ -39,6 +39,67 @@ void tableLookup(Ctxt& out, const std::vector<zzX>& table, const CtPtrs& idx,
 void tableWriteIn(const CtPtrs& table, const CtPtrs& idx,
                   std::vector<zzX>* unpackSlotEncoding=nullptr);
 
+//! A histogram: the input is an encrypted table T[] and many encrypted
+//! indexes idxs[k], all with the same number of bits. This function
+//! increments by one the entry T[i_k] for every index i_k. It is cheaper
+//! than one tableWriteIn per index: only the selector products of the two
+//! halves of every index are computed, and the table is updated once.
+void tableWriteIn(const CtPtrs& table, const CtPtrMat& idxs,
+                  std::vector<zzX>* unpackSlotEncoding=nullptr);
+
+//! Group-by sum over encrypted integers: table[j] holds the encrypted bits
+//! of the sum of group j, and the k'th pair is an index idxs[k] and a value
+//! values[k], both as encrypted bits. Every table[i_k] is incremented by
+//! values[k]. All the values of an entry are added to it with a single
+//! addManyNumbers, with sizeLimit bounding the size of the sums as there.
+//! The selectors of all the indexes are kept in memory at once.
+void tableAddIn(CtPtrMat& table, const CtPtrMat& idxs, const CtPtrMat& values,
+                long sizeLimit=0, std::vector<zzX>* unpackSlotEncoding=nullptr);
+
+/**
+ * @class TableIndexSelector
+ * @brief The selector products of an encrypted index, to be shared by
+ * several table operations on the same index.
+ *
+ * Computing the products (index==j) is the expensive part of tableLookup
+ * and tableWriteIn. A TableIndexSelector computes them once, and every
+ * lookup into a plaintext table then costs only constant multiplications
+ * and additions.
+ **/
+class TableIndexSelector {
+  std::vector<Ctxt> products; // products[j] encrypts (index==j)
+
+public:
+  //! @brief Compute the selectors for the entries 0..tableSize-1 of
+  //! tables indexed by idx (by default all the 2^lsize(idx) of them)
+  explicit TableIndexSelector(const CtPtrs& idx, long tableSize=0,
+                              std::vector<zzX>* unpackSlotEncoding=nullptr);
+
+  //! Number of entries that can be selected
+  long size() const { return lsize(products); }
+  //! The selector of entry j
+  const Ctxt& operator[](long j) const { return products[j]; }
+
+  //! @brief out = T[i]. Only the first size() entries of T are used.
+  void lookup(Ctxt& out, const std::vector<zzX>& table) const;
+
+  //! @brief out[t] = T_t[i] for all the tables T_t, all in one pass over
+  //! the selectors. out is resized if it is too short.
+  void lookup(CtPtrs& out,
+              const std::vector< std::vector<zzX> >& tables) const;
+
+  //! @brief Increment by one the entry T[i] of an encrypted table
+  void writeIn(const CtPtrs& table) const;
+};
+
+//! The inputs are several plaintext tables T_1,T_2,... and an array of
+//! encrypted bits I[], holding the binary representation of an index i.
+//! The outputs are the encrypted values out[t]=T_t[i]. The selector
+//! products of the index are only computed once for all the tables.
+void tableLookup(CtPtrs& out, const std::vector< std::vector<zzX> >& tables,
+                 const CtPtrs& idx,
+                 std::vector<zzX>* unpackSlotEncoding=nullptr);
+
 /**
  * @function buildLookupTable
  * @brief Built a table-lookup for a function in fixed-point representation
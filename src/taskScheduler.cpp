@@ -0,0 +1,304 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+/* taskScheduler.cpp - the work-stealing scheduler of taskScheduler.h
+ */
+#include <chrono>
+#include <stdexcept>
+#include "taskScheduler.h"
+#include "metrics.h"
+
+NTL_CLIENT
+
+// The worker index of this thread in the scheduler, -1 for the others
+static thread_local long tls_worker = -1;
+
+static thread_local long tls_state = 0;
+
+long getInheritedTaskState() { return tls_state; }
+
+long setInheritedTaskState(long state)
+{
+  long old = tls_state;
+  tls_state = state;
+  return old;
+}
+
+static std::mutex schedulerMx;
+static std::unique_ptr<TaskScheduler> theScheduler;
+static std::atomic<TaskScheduler*> activeScheduler(nullptr);
+
+void setTaskScheduler(long n)
+{
+  std::lock_guard<std::mutex> lock(schedulerMx);
+  activeScheduler = nullptr;
+  theScheduler.reset();
+  if (n > 1) {
+    theScheduler.reset(new TaskScheduler(n));
+    activeScheduler = theScheduler.get();
+  }
+}
+
+TaskScheduler* getTaskScheduler() { return activeScheduler; }
+
+long fheAvailableThreads()
+{
+  TaskScheduler* ts = getTaskScheduler();
+  return ts? ts->numThreads() : AvailableThreads();
+}
+
+/********************************************************************/
+
+TaskScheduler::TaskScheduler(long n)
+  : nThreads(std::max(n, 1L)), queued(0), steals(0), stopping(false)
+{
+  for (long i = 0; i < nThreads; i++)
+    deques.emplace_back(new Deque);
+  for (long i = 0; i < nThreads-1; i++)
+    workers.emplace_back(&TaskScheduler::workerLoop, this, i);
+}
+
+TaskScheduler::~TaskScheduler()
+{
+  {
+    std::lock_guard<std::mutex> lock(sleepMx);
+    stopping = true;
+  }
+  wakeup.notify_all();
+  for (auto& w: workers) w.join();
+}
+
+// The workers have a deque each, the other threads share the last one
+TaskScheduler::Deque& TaskScheduler::ownDeque()
+{
+  if (tls_worker >= 0 && tls_worker < nThreads-1) return *deques[tls_worker];
+  return *deques.back();
+}
+
+// Take a task from the back (the owner) or the front (a thief) of d, the
+// first one of the group "only" when that is not NULL
+bool TaskScheduler::popEligible(Deque& d, bool back, const TaskGroup* only,
+                                Task& t)
+{
+  std::lock_guard<std::mutex> lock(d.mx);
+  long n = d.tasks.size();
+  for (long k = 0; k < n; k++) {
+    long i = back? n-1-k : k;
+    if (only && d.tasks[i].group != only) continue;
+    t = std::move(d.tasks[i]);
+    d.tasks.erase(d.tasks.begin() + i);
+    queued--;
+    return true;
+  }
+  return false;
+}
+
+bool TaskScheduler::tryRun(const TaskGroup* only)
+{
+  if (queued == 0) return false;
+  Task t;
+  Deque& own = ownDeque();
+  if (popEligible(own, /*back=*/true, only, t)) {
+    execute(t);
+    return true;
+  }
+  // steal, starting from the next deque so the victims are spread
+  long start = (tls_worker >= 0)? tls_worker+1 : 0;
+  for (long k = 0; k < nThreads; k++) {
+    Deque& d = *deques[(start+k) % nThreads];
+    if (&d == &own) continue;
+    if (popEligible(d, /*back=*/false, only, t)) {
+      steals++;
+      execute(t);
+      return true;
+    }
+  }
+  return false;
+}
+
+// The tasks that run inside another one (while it joins) are part of its
+// busy time
+static thread_local long executeDepth = 0;
+
+void TaskScheduler::execute(Task& t)
+{
+  TaskGroup* g = t.group;
+  addMetric(METRIC_TASKS_RUN);
+  double t0 = (executeDepth == 0 && areMetricsOn())? metricClock() : -1.0;
+  executeDepth++;
+  {
+    InheritedTaskState inherited(t.state);
+    try { t.run(); }
+    catch (...) { g->fail(std::current_exception()); }
+  }
+  executeDepth--;
+  if (t0 >= 0)
+    addMetric(METRIC_TASK_BUSY_MICROS, long((metricClock() - t0) * 1e6));
+  t.run = nullptr; // nothing of the waiter is touched after the count
+
+  if (--g->pending == 0) {
+    std::lock_guard<std::mutex> lock(sleepMx);
+    wakeup.notify_all();
+  }
+}
+
+void TaskScheduler::workerLoop(long index)
+{
+  tls_worker = index;
+  for (;;) {
+    if (tryRun(nullptr)) continue;
+    std::unique_lock<std::mutex> lock(sleepMx);
+    wakeup.wait(lock, [this]{ return stopping || queued > 0; });
+    if (stopping) return;
+  }
+}
+
+void TaskScheduler::execRange(long n, const std::function<void(long,long)>& f)
+{
+  PartitionInfo pinfo(n, nThreads);
+  long cnt = pinfo.NumIntervals();
+  execIndex(cnt, [&](long index) {
+    long first, last;
+    pinfo.interval(first, last, index);
+    f(first, last);
+  });
+}
+
+void TaskScheduler::execIndex(long cnt, const std::function<void(long)>& f)
+{
+  if (cnt == 1) { f(0); return; }
+
+  TaskGroup g;
+  for (long i = cnt-1; i >= 1; i--) // the owner pops 1 first
+    g.run([&f, i]{ f(i); });
+
+  // index 0 on this thread, the join waits for the others even if it throws
+  std::exception_ptr e;
+  try { f(0); }
+  catch (...) { e = std::current_exception(); }
+  if (!e) { g.wait(); return; }
+  try { g.wait(); } catch (...) {}
+  std::rethrow_exception(e);
+}
+
+/********************************************************************/
+
+TaskGroup::TaskGroup() : sched(getTaskScheduler()), pending(0) {}
+
+TaskGroup::~TaskGroup()
+{
+  if (pending > 0) { // not waited for, the tasks still refer to the stack
+    try { wait(); } catch (...) {}
+  }
+}
+
+void TaskGroup::fail(std::exception_ptr e)
+{
+  std::lock_guard<std::mutex> lock(errMx);
+  if (!error) error = e;
+}
+
+void TaskGroup::run(const std::function<void()>& f)
+{
+  if (!sched) {
+    try { f(); }
+    catch (...) { fail(std::current_exception()); }
+    return;
+  }
+  pending++;
+  TaskScheduler::Deque& d = sched->ownDeque();
+  {
+    std::lock_guard<std::mutex> lock(d.mx);
+    d.tasks.push_back(TaskScheduler::Task{f, this, tls_state});
+    sched->queued++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(sched->sleepMx);
+  }
+  sched->wakeup.notify_one();
+}
+
+void TaskGroup::wait()
+{
+  if (sched) {
+    while (pending > 0) {
+      if (sched->tryRun(this)) continue;
+      // what is left of the group runs on other threads
+      std::unique_lock<std::mutex> lock(sched->sleepMx);
+      sched->wakeup.wait_for(lock, std::chrono::microseconds(50),
+                             [this]{ return pending == 0; });
+    }
+  }
+  std::exception_ptr e;
+  {
+    std::lock_guard<std::mutex> lock(errMx);
+    std::swap(e, error);
+  }
+  if (e) std::rethrow_exception(e);
+}
+
+/********************************************************************/
+
+long TaskGraph::add(const std::function<void()>& f,
+                    const std::vector<long>& deps)
+{
+  long i = nodes.size();
+  for (long d: deps)
+    if (d < 0 || d >= i)
+      throw std::logic_error("TaskGraph::add: no such dependency");
+  nodes.push_back(Node{f, std::vector<long>(), long(deps.size())});
+  for (long d: deps) nodes[d].succ.push_back(i);
+  return i;
+}
+
+void TaskGraph::run()
+{
+  long n = nodes.size();
+  std::vector<std::atomic<bool>> skipped(n);
+  for (long i = 0; i < n; i++) skipped[i] = false;
+  std::mutex errMx;
+  std::exception_ptr error;
+
+  // run node i unless a dependency failed, and let its successors know
+  auto runNode = [&](long i) -> bool {
+    bool ok = !skipped[i];
+    if (ok) {
+      try { nodes[i].f(); }
+      catch (...) {
+        std::lock_guard<std::mutex> lock(errMx);
+        if (!error) error = std::current_exception();
+        ok = false;
+      }
+    }
+    if (!ok) for (long s: nodes[i].succ) skipped[s] = true;
+    return ok;
+  };
+
+  if (!getTaskScheduler()) { // the indexes are a topological order
+    for (long i = 0; i < n; i++) runNode(i);
+  }
+  else {
+    std::vector<std::atomic<long>> remaining(n);
+    for (long i = 0; i < n; i++) remaining[i] = nodes[i].nDeps;
+    TaskGroup g;
+    std::function<void(long)> launch = [&](long i) {
+      g.run([&, i]{
+        runNode(i);
+        for (long s: nodes[i].succ)
+          if (--remaining[s] == 0) launch(s);
+      });
+    };
+    for (long i = 0; i < n; i++)
+      if (nodes[i].nDeps == 0) launch(i);
+    g.wait();
+  }
+  if (error) std::rethrow_exception(error);
+}
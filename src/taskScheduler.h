@@ -0,0 +1,279 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _TASK_SCHEDULER_H_
+#define _TASK_SCHEDULER_H_
+/**
+ * @file taskScheduler.h
+ * @brief A work-stealing scheduler for the parallel loops of the library
+ *
+ * With NTL's thread pool a parallel loop that runs inside another one runs
+ * serially, so two independent high-level computations (say two calls of
+ * addTwoNumbers on threads of their own) cannot also use the per-prime
+ * parallelism below them. After setTaskScheduler(n), the parallel loops of
+ * the library (FHE_EXEC_RANGE and FHE_EXEC_INDEX, which replace
+ * NTL_EXEC_RANGE and NTL_EXEC_INDEX) are split into tasks of one scheduler
+ * with n threads instead, whether they are nested or not:
+ *  - every thread has a deque of tasks, pushes the tasks it forks at the
+ *    back and runs them from there, and steals from the front of the
+ *    others when its own is empty;
+ *  - a thread that waits for the tasks it forked (the join) runs those
+ *    that are still queued itself, and at most n threads are ever busy.
+ *
+ * A waiting thread only runs tasks of the group it waits for, the
+ * iterations of that very loop, as NTL's calling thread runs some of them.
+ * Code that keeps thread_local scratch across a parallel loop is thus as
+ * safe as it was with NTL: no task of another computation (nor of a loop
+ * nested in one of the iterations) can run on that thread meanwhile. The
+ * threads that wait for nothing run any task.
+ *
+ * TaskGroup (fork-join), TaskGraph (tasks with dependencies), parallelFor,
+ * parallelIndex and parallelInvoke are the interfaces for the application.
+ * Without a scheduler (the default, or after setTaskScheduler(0)) they and
+ * the macros all run on the NTL thread pool as before. The NTL pool does
+ * not exist on the threads of the scheduler, so the parallel loops that
+ * still use NTL_EXEC_RANGE directly run serially within a task.
+ **/
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <memory>
+#include <NTL/BasicThreadPool.h>
+
+class TaskGroup;
+
+/**
+ * @class TaskScheduler
+ * @brief The worker threads and their deques, see taskScheduler.h
+ **/
+class TaskScheduler {
+  struct Task {
+    std::function<void()> run;
+    TaskGroup* group;
+    long state; // the inherited state of the thread that queued it
+  };
+  struct Deque {
+    std::mutex mx;
+    std::deque<Task> tasks;
+  };
+
+  long nThreads;                       // the workers and one caller
+  std::vector<std::thread> workers;    // nThreads-1 of them
+  std::vector<std::unique_ptr<Deque>> deques; // one per worker, and
+                                       // the last for the other threads
+  std::mutex sleepMx;
+  std::condition_variable wakeup;
+  std::atomic<long> queued;            // tasks in all the deques
+  std::atomic<long> steals;
+  bool stopping;
+
+  Deque& ownDeque();
+  bool tryRun(const TaskGroup* only);   // runs one task, if any is eligible
+  bool popEligible(Deque& d, bool back, const TaskGroup* only, Task& t);
+  void execute(Task& t);
+  void workerLoop(long index);
+
+  friend class TaskGroup;
+
+public:
+  //! @brief A scheduler with n threads: n-1 workers, the thread that
+  //! waits for a task being the n'th
+  explicit TaskScheduler(long n);
+  ~TaskScheduler(); // waits for the workers, all groups must be done
+
+  TaskScheduler(const TaskScheduler&) = delete;
+  TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+  long numThreads() const { return nThreads; }
+  //! @brief How many tasks were taken from the deque of another thread
+  long numSteals() const { return steals; }
+  //! @brief How many tasks are waiting in the deques now
+  long numQueued() const { return queued; }
+
+  //! @brief f(first,last) on the intervals of PartitionInfo(n,
+  //! numThreads()), forked and joined
+  void execRange(long n, const std::function<void(long,long)>& f);
+  //! @brief f(i) for i = 0..cnt-1, each one a task
+  void execIndex(long cnt, const std::function<void(long)>& f);
+};
+
+//! @brief Start a scheduler with n threads for all the parallel loops of
+//! the library (n <= 1 stops it). Not to be called while tasks run.
+void setTaskScheduler(long n);
+//! @brief The active scheduler, or NULL
+TaskScheduler* getTaskScheduler();
+
+//! @brief The threads that a parallel loop can use: those of the scheduler
+//! if there is one (at every depth), else NTL's AvailableThreads()
+long fheAvailableThreads();
+
+/**
+ * @class TaskGroup
+ * @brief Fork-join: run() forks a task, wait() joins all of them
+ *
+ * wait() rethrows the first exception thrown by a task of the group, once
+ * all of them are done. Without a scheduler run() calls the task at once.
+ * A group has to be waited for before it is destroyed.
+ **/
+class TaskGroup {
+  TaskScheduler* sched;
+  std::atomic<long> pending;
+  std::mutex errMx;
+  std::exception_ptr error;
+
+  void fail(std::exception_ptr e);
+  friend class TaskScheduler;
+
+public:
+  TaskGroup();
+  ~TaskGroup();
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  void run(const std::function<void()>& f);
+  void wait();
+};
+
+/**
+ * @class TaskGraph
+ * @brief Tasks with dependencies, each one run after all of its
+ * dependencies are done
+ *
+ * When a task throws, the tasks that depend on it (directly or not) are
+ * skipped, the others still run, and run() rethrows the first exception.
+ **/
+class TaskGraph {
+  struct Node {
+    std::function<void()> f;
+    std::vector<long> succ;
+    long nDeps;
+  };
+  std::vector<Node> nodes;
+
+public:
+  //! @brief Add a task that depends on the ones in deps (earlier results
+  //! of add), returns its index
+  long add(const std::function<void()>& f,
+           const std::vector<long>& deps = std::vector<long>());
+  long size() const { return nodes.size(); }
+  //! @brief Run all the tasks, returns when they are done
+  void run();
+};
+
+/**
+ * @name Inherited state
+ * @brief A word of per-thread state that the tasks of the parallel loops
+ * and of a TaskGroup see on the threads that run them, as it was on the
+ * thread that started them. It marks the tasks as part of what that thread
+ * is doing, e.g., telemetry.h keeps the operations inside a reported
+ * operation quiet on all the threads they run on, and only there.
+ **/
+///@{
+enum {
+  TASK_STATE_CTXT_OP = 1 // inside an operation that telemetry.h reports
+};
+long getInheritedTaskState();
+//! @brief Returns the previous state
+long setInheritedTaskState(long state);
+
+//! @brief Sets the state of this thread while it is in scope
+class InheritedTaskState {
+  long saved;
+public:
+  explicit InheritedTaskState(long state)
+    : saved(setInheritedTaskState(state)) {}
+  ~InheritedTaskState() { setInheritedTaskState(saved); }
+  InheritedTaskState(const InheritedTaskState&) = delete;
+  InheritedTaskState& operator=(const InheritedTaskState&) = delete;
+};
+///@}
+
+//! @brief f(first,last) over a partition of [0,n) in parallel
+template<class Fct> void parallelFor(long n, const Fct& f)
+{
+  if (n <= 0) return;
+  TaskScheduler* ts = getTaskScheduler();
+  if (ts) {
+    ts->execRange(n, std::function<void(long,long)>(std::cref(f)));
+    return;
+  }
+  long state = getInheritedTaskState();
+  NTL_EXEC_RANGE(n, first, last)
+    InheritedTaskState inherited(state);
+    f(first, last);
+  NTL_EXEC_RANGE_END
+}
+
+//! @brief f(i) for i = 0..cnt-1, in parallel; f(i) may use scratch of the
+//! index i, as with NTL_EXEC_INDEX (but cnt is not bounded by the threads)
+template<class Fct> void parallelIndex(long cnt, const Fct& f)
+{
+  if (cnt <= 0) return;
+  TaskScheduler* ts = getTaskScheduler();
+  if (ts) {
+    ts->execIndex(cnt, std::function<void(long)>(std::cref(f)));
+    return;
+  }
+  long state = getInheritedTaskState();
+  if (cnt <= NTL::AvailableThreads()) {
+    NTL_EXEC_INDEX(cnt, index)
+      InheritedTaskState inherited(state);
+      f(index);
+    NTL_EXEC_INDEX_END
+  }
+  else {
+    NTL_EXEC_RANGE(cnt, first, last)
+      InheritedTaskState inherited(state);
+      for (long i = first; i < last; i++) f(i);
+    NTL_EXEC_RANGE_END
+  }
+}
+
+//! @brief f0() and f1() in parallel
+template<class Fn0, class Fn1> void parallelInvoke(const Fn0& f0,
+                                                   const Fn1& f1)
+{
+  parallelIndex(2, [&](long i) { if (i == 0) f0(); else f1(); });
+}
+
+/**
+ * @name The parallel loops of the library
+ * @brief Drop-in replacements of NTL_EXEC_RANGE / NTL_EXEC_INDEX, which
+ * use the scheduler when there is one. The body is a lambda, as with NTL.
+ **/
+///@{
+#define FHE_EXEC_RANGE(n, first, last) \
+{ \
+  long _fhe_exec_n = (n); \
+  auto _fhe_exec_body = [&](long first, long last) {
+
+#define FHE_EXEC_RANGE_END \
+  }; \
+  parallelFor(_fhe_exec_n, _fhe_exec_body); \
+}
+
+#define FHE_EXEC_INDEX(n, index) \
+{ \
+  long _fhe_exec_n = (n); \
+  auto _fhe_exec_body = [&](long index) {
+
+#define FHE_EXEC_INDEX_END \
+  }; \
+  parallelIndex(_fhe_exec_n, _fhe_exec_body); \
+}
+///@}
+
+#endif // _TASK_SCHEDULER_H_
@@ -0,0 +1,413 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include "telemetry.h"
+#include "timing.h"
+#include "Ctxt.h"
+#include "costModel.h"
+#include "taskScheduler.h"
+
+NTL_CLIENT
+
+static std::atomic<CtxtTelemetry*> telemetryHook(NULL);
+
+void setCtxtTelemetry(CtxtTelemetry *hook) { telemetryHook = hook; }
+CtxtTelemetry *getCtxtTelemetry() { return telemetryHook; }
+
+const char* ctxtOpName(CtxtOp op)
+{
+  switch (op) {
+  case CTXT_OP_MULTIPLY:    return "multiplyBy";
+  case CTXT_OP_RELINEARIZE: return "reLinearize";
+  case CTXT_OP_MODDOWN:     return "modDownToSet";
+  case CTXT_OP_AUTOMORPH:   return "smartAutomorph";
+  case CTXT_OP_RECRYPT:     return "reCrypt";
+  default: return "unknown";
+  }
+}
+
+//======================== CtxtOpProbe ========================
+
+void CtxtOpProbe::init(const char *fn)
+{
+  // Part of another operation, on this thread or on the one that started
+  // this task: the state is handed to the tasks of the parallel loops
+  long state = getInheritedTaskState();
+  if (state & TASK_STATE_CTXT_OP) {
+    hook = NULL;
+    return;
+  }
+  savedState = setInheritedTaskState(state | TASK_STATE_CTXT_OP);
+  where = currentTimerName(fn);
+
+  capacity.resize(cts.size());
+  logQ.resize(cts.size());
+  for (long i: range(cts.size())) {
+    capacity[i] = cts[i]->capacity()/log(2.0);
+    logQ[i] = cts[i]->logOfPrimeSet()/log(2.0);
+  }
+}
+
+CtxtOpProbe::CtxtOpProbe(CtxtOp _op, const Ctxt& c, const char *fn,
+                         const Ctxt *other)
+  : hook(getCtxtTelemetry()), op(_op), where(NULL)
+{
+  if (hook == NULL || c.isEmpty()) { hook = NULL; return; }
+  cts.push_back(&c);
+  init(fn);
+  if (hook && other && !other->isEmpty()) { // start from the smaller one
+    capacity[0] = min(capacity[0], other->capacity()/log(2.0));
+    logQ[0] = min(logQ[0], other->logOfPrimeSet()/log(2.0));
+  }
+}
+
+CtxtOpProbe::CtxtOpProbe(CtxtOp _op, const vector<Ctxt*>& _cts,
+                         const char *fn)
+  : hook(getCtxtTelemetry()), op(_op), where(NULL)
+{
+  if (hook == NULL) return;
+  for (const Ctxt *c: _cts)
+    if (!c->isEmpty()) cts.push_back(c);
+  init(fn);
+}
+
+CtxtOpProbe::~CtxtOpProbe()
+{
+  if (hook == NULL) return;
+  setInheritedTaskState(savedState);
+
+  for (long i: range(cts.size())) {
+    if (cts[i]->isEmpty()) continue;
+    CtxtOpRecord rec;
+    rec.op = op;
+    rec.where = where;
+    rec.capacityBefore = capacity[i];
+    rec.logQBefore = logQ[i];
+    rec.capacityAfter = cts[i]->capacity()/log(2.0);
+    rec.logQAfter = cts[i]->logOfPrimeSet()/log(2.0);
+    try { hook->record(rec); }
+    catch (...) {} // never let the telemetry break the computation
+  }
+}
+
+//======================== CtxtBudgetReport ========================
+
+void CtxtBudgetReport::record(const CtxtOpRecord& rec)
+{
+  lock_guard<mutex> lock(mx);
+  string where = rec.where? rec.where : "-";
+  Entry& e = entries[make_pair(int(rec.op), where)];
+  e.calls++;
+  e.spent += rec.spent();
+  e.maxSpent = max(e.maxSpent, rec.spent());
+  e.modulus += rec.logQBefore - rec.logQAfter;
+  if (rec.op == CTXT_OP_RECRYPT)
+    recryptCapacity.push_back(rec.capacityBefore);
+}
+
+map<pair<int, string>, CtxtBudgetReport::Entry>
+CtxtBudgetReport::getEntries() const
+{
+  lock_guard<mutex> lock(mx);
+  return entries;
+}
+
+long CtxtBudgetReport::avoidableRecrypts() const
+{
+  lock_guard<mutex> lock(mx);
+  double maxMult = 0;
+  for (auto& e: entries)
+    if (e.first.first == CTXT_OP_MULTIPLY)
+      maxMult = max(maxMult, e.second.maxSpent);
+  if (maxMult <= 0) return 0;
+
+  long n = 0;
+  for (double c: recryptCapacity)
+    if (c >= maxMult) n++;
+  return n;
+}
+
+void CtxtBudgetReport::clear()
+{
+  lock_guard<mutex> lock(mx);
+  entries.clear();
+  recryptCapacity.clear();
+}
+
+void CtxtBudgetReport::print(ostream& str) const
+{
+  map<pair<int, string>, Entry> snapshot = getEntries();
+  vector<double> recrypts;
+  {
+    lock_guard<mutex> lock(mx);
+    recrypts = recryptCapacity;
+  }
+
+  // The operations that used up the most budget come first
+  vector<pair<pair<int, string>, Entry>> rows(snapshot.begin(), snapshot.end());
+  sort(rows.begin(), rows.end(),
+       [](const pair<pair<int, string>, Entry>& a,
+          const pair<pair<int, string>, Entry>& b)
+       { return a.second.spent > b.second.spent; });
+
+  double total = 0;
+  for (auto& row: rows)
+    if (row.first.first != CTXT_OP_RECRYPT) total += row.second.spent;
+
+  ios::fmtflags flags = str.flags();
+  streamsize prec = str.precision();
+  str << fixed << setprecision(1);
+  str << "Ciphertext budget (bits), by operation and caller:\n";
+  for (auto& row: rows) {
+    const Entry& e = row.second;
+    str << "  " << ctxtOpName(CtxtOp(row.first.first))
+        << " [" << row.first.second << "]: " << e.calls << " calls, ";
+    if (row.first.first == CTXT_OP_RECRYPT) // recryption adds capacity
+      str << "gained " << (-e.spent);
+    else
+      str << "spent " << e.spent << " (max " << e.maxSpent << "), modulus "
+          << e.modulus;
+    if (row.first.first != CTXT_OP_RECRYPT && total > 0)
+      str << ", " << (100*e.spent/total) << "%";
+    str << "\n";
+  }
+  str << "  total spent outside recryption: " << total << "\n";
+
+  if (!recrypts.empty()) {
+    double lo = *min_element(recrypts.begin(), recrypts.end());
+    double hi = *max_element(recrypts.begin(), recrypts.end());
+    double sum = 0;
+    for (double c: recrypts) sum += c;
+    str << "  capacity left at recryption: min " << lo << ", avg "
+        << (sum/recrypts.size()) << ", max " << hi << "\n";
+    str << "  recryptions that could have been deferred: "
+        << avoidableRecrypts() << " of " << recrypts.size() << "\n";
+  }
+  str.flags(flags);
+  str.precision(prec);
+}
+
+//======================== Recryption profiles ========================
+
+static std::atomic<RecryptProfiler*> recryptProfiler(NULL);
+static std::atomic<bool> countingKeySwitches(false);
+static std::atomic_long keySwitches(0);
+
+// Protects the sub-stage times, which the ciphertexts of a batch may add to
+// from several threads
+static mutex subStageMutex;
+
+static double wallTime()
+{
+  return chrono::duration<double>(
+           chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void setRecryptProfiler(RecryptProfiler *prof)
+{
+  recryptProfiler = prof;
+  countingKeySwitches = (prof != NULL);
+}
+
+RecryptProfiler *getRecryptProfiler() { return recryptProfiler; }
+
+void countKeySwitch()
+{
+  if (countingKeySwitches.load(memory_order_relaxed))
+    keySwitches.fetch_add(1, memory_order_relaxed);
+}
+
+long keySwitchCount() { return keySwitches.load(memory_order_relaxed); }
+
+const char* recryptStageName(RecryptStage stage)
+{
+  switch (stage) {
+  case RECRYPT_MODDOWN:        return "modDown";
+  case RECRYPT_BOOT_KEYSWITCH: return "bootKeySwitch";
+  case RECRYPT_RAW_MODSWITCH:  return "rawModSwitch";
+  case RECRYPT_MAKE_DIVISIBLE: return "makeDivisible";
+  case RECRYPT_COEFF_TO_SLOT:  return "coeffToSlot";
+  case RECRYPT_EXTRACT_DIGITS: return "extractDigits";
+  case RECRYPT_SLOT_TO_COEFF:  return "slotToCoeff";
+  default: return "unknown";
+  }
+}
+
+// The largest prime sets and noise and the smallest capacity in the batch
+static void measureBatch(long& primes, double& logNoise, double& capacity,
+                         const vector<Ctxt*>& batch)
+{
+  primes = 0;
+  logNoise = -HUGE_VAL;
+  capacity = HUGE_VAL;
+  for (const Ctxt* c: batch) {
+    if (c->isEmpty()) continue;
+    primes = max(primes, c->getPrimeSet().card());
+    double noise = c->getNoiseBound() <= 0? -HUGE_VAL
+                   : log(c->getNoiseBound())/log(2.0);
+    logNoise = max(logNoise, noise);
+    capacity = min(capacity, c->capacity()/log(2.0));
+  }
+  if (primes == 0) logNoise = capacity = 0; // all empty
+}
+
+RecryptProbe::RecryptProbe(const vector<Ctxt*>& batch, bool thin)
+  : prof(getRecryptProfiler()), t0(0), ks0(0)
+{
+  if (CostCounter *cost = getCostCounter())
+    cost->countRecrypt(thin, batch.size());
+  if (prof == NULL) return;
+  rec.thin = thin;
+  rec.batchSize = batch.size();
+  t0 = wallTime();
+  ks0 = keySwitchCount();
+}
+
+RecryptProbe::~RecryptProbe()
+{
+  if (prof == NULL) return;
+  rec.seconds = wallTime() - t0;
+  rec.keySwitches = keySwitchCount() - ks0;
+  try { prof->record(rec); }
+  catch (...) {} // never let the profiler break the computation
+}
+
+RecryptStageProbe::RecryptStageProbe(RecryptRecord *r, RecryptStage stage,
+                                     const vector<Ctxt*>& _batch)
+  : rec(r? &r->stage[stage] : NULL), batch(_batch), t0(0), ks0(0)
+{
+  if (rec == NULL) return;
+  measureBatch(rec->primesBefore, rec->logNoiseBefore, rec->capacityBefore,
+               batch);
+  ks0 = keySwitchCount();
+  t0 = wallTime();
+}
+
+RecryptStageProbe::~RecryptStageProbe()
+{
+  if (rec == NULL) return;
+  rec->seconds += wallTime() - t0;
+  rec->keySwitches += keySwitchCount() - ks0;
+  measureBatch(rec->primesAfter, rec->logNoiseAfter, rec->capacityAfter,
+               batch);
+}
+
+RecryptTimeProbe::RecryptTimeProbe(RecryptRecord *r, RecryptStage _stage)
+  : rec(r), stage(_stage), t0(r? wallTime() : 0) {}
+
+RecryptTimeProbe::~RecryptTimeProbe()
+{
+  if (rec == NULL) return;
+  double t = wallTime() - t0;
+  lock_guard<mutex> lock(subStageMutex);
+  rec->stage[stage].seconds += t;
+}
+
+//======================== RecryptReport ========================
+
+void RecryptReport::record(const RecryptRecord& rec)
+{
+  lock_guard<mutex> lock(mx);
+  records.push_back(rec);
+}
+
+vector<RecryptRecord> RecryptReport::getRecords() const
+{
+  lock_guard<mutex> lock(mx);
+  return records;
+}
+
+long RecryptReport::size() const
+{
+  lock_guard<mutex> lock(mx);
+  return records.size();
+}
+
+void RecryptReport::clear()
+{
+  lock_guard<mutex> lock(mx);
+  records.clear();
+}
+
+RecryptRecord RecryptReport::totals(bool thin) const
+{
+  vector<RecryptRecord> snapshot = getRecords();
+  RecryptRecord tot;
+  tot.thin = thin;
+  long n = 0;
+  for (const RecryptRecord& rec: snapshot) {
+    if (rec.thin != thin) continue;
+    n++;
+    tot.batchSize += rec.batchSize;
+    tot.seconds += rec.seconds;
+    tot.keySwitches += rec.keySwitches;
+    for (long i = 0; i < RECRYPT_STAGE_COUNT; i++) {
+      RecryptStageRecord& t = tot.stage[i];
+      const RecryptStageRecord& s = rec.stage[i];
+      t.seconds += s.seconds;
+      t.keySwitches += s.keySwitches;
+      t.primesBefore += s.primesBefore;
+      t.primesAfter += s.primesAfter;
+      t.logNoiseBefore += s.logNoiseBefore;
+      t.logNoiseAfter += s.logNoiseAfter;
+      t.capacityBefore += s.capacityBefore;
+      t.capacityAfter += s.capacityAfter;
+    }
+  }
+  if (n > 1)
+    for (RecryptStageRecord& t: tot.stage) {
+      t.primesBefore = (t.primesBefore + n/2) / n; // rounded averages
+      t.primesAfter = (t.primesAfter + n/2) / n;
+      t.logNoiseBefore /= n;
+      t.logNoiseAfter /= n;
+      t.capacityBefore /= n;
+      t.capacityAfter /= n;
+    }
+  return tot;
+}
+
+void RecryptReport::print(ostream& str) const
+{
+  ios::fmtflags flags = str.flags();
+  streamsize prec = str.precision();
+  str << fixed;
+  for (bool thin: {false, true}) {
+    RecryptRecord tot = totals(thin);
+    long n = 0;
+    for (const RecryptRecord& rec: getRecords()) if (rec.thin == thin) n++;
+    if (n == 0) continue;
+
+    str << setprecision(3) << (thin? "thinReCrypt: " : "reCrypt: ") << n
+        << " calls, " << tot.batchSize << " ciphertexts, " << tot.seconds
+        << " sec, " << tot.keySwitches << " key switches\n";
+    for (long i = 0; i < RECRYPT_STAGE_COUNT; i++) {
+      const RecryptStageRecord& s = tot.stage[i];
+      if (s.seconds == 0 && s.keySwitches == 0) continue; // not run
+      str << "  " << setw(14) << left << recryptStageName(RecryptStage(i))
+          << right << setprecision(3) << s.seconds << " sec";
+      if (tot.seconds > 0)
+        str << setprecision(1) << " (" << (100*s.seconds/tot.seconds) << "%)";
+      if (i != RECRYPT_RAW_MODSWITCH && i != RECRYPT_MAKE_DIVISIBLE)
+        str << ", " << s.keySwitches << " key switches, primes "
+            << s.primesBefore << "->" << s.primesAfter
+            << ", noise " << s.logNoiseBefore << "->" << s.logNoiseAfter
+            << ", capacity " << s.capacityBefore << "->" << s.capacityAfter;
+      str << "\n";
+    }
+  }
+  str.flags(flags);
+  str.precision(prec);
+}
@@ -0,0 +1,295 @@
+/* Copyright (C) 2012-2017 IBM Corp.
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+/**
+ * @file telemetry.h
+ * @brief Recording the noise budget consumed by ciphertext operations
+ *
+ * When a CtxtTelemetry hook is installed with setCtxtTelemetry(), each
+ * multiplyBy, reLinearize, modDownToSet, smartAutomorph and reCrypt (or
+ * thinReCrypt) reports the capacity and the modulus of the ciphertext
+ * before and after the operation, together with the name of the timer that
+ * was running around it (see timing.h), which identifies the caller.
+ *
+ * Only outermost operations are reported: the reLinearize inside a
+ * multiplyBy, or the operations that make up a recryption, are part of the
+ * operation that called them, also on the threads of the parallel loops
+ * that it starts (see the inherited state of taskScheduler.h). Operations
+ * of other computations on other threads are reported as usual. Without a
+ * hook, the cost of all this is one pointer load per operation.
+ *
+ * CtxtBudgetReport is a hook that aggregates the records into a report of
+ * where the budget of a circuit is spent, and of the recryptions that were
+ * made while the ciphertext still had room for another multiplication.
+ **/
+#include <vector>
+#include <map>
+#include <string>
+#include <iostream>
+#include <mutex>
+
+class Ctxt;
+
+//! The operations that are reported
+enum CtxtOp {
+  CTXT_OP_MULTIPLY, CTXT_OP_RELINEARIZE, CTXT_OP_MODDOWN, CTXT_OP_AUTOMORPH,
+  CTXT_OP_RECRYPT, CTXT_OP_COUNT
+};
+
+//! @brief A printable name for op
+const char* ctxtOpName(CtxtOp op);
+
+//! One operation on one ciphertext, all the logs are in bits
+struct CtxtOpRecord {
+  CtxtOp op;
+  const char *where;      // the innermost running timer, NULL if none
+  double capacityBefore;  // log(q/noise), the smaller one of the inputs
+  double capacityAfter;
+  double logQBefore;      // log of the modulus
+  double logQAfter;
+
+  //! The budget that the operation used up
+  double spent() const { return capacityBefore - capacityAfter; }
+  //! The growth of the noise (can be negative, e.g., for mod-switching)
+  double noiseGrowth() const
+  { return (logQAfter-capacityAfter) - (logQBefore-capacityBefore); }
+};
+
+//! @brief The hook that receives the records. It may be called from
+//! several threads at once.
+class CtxtTelemetry {
+public:
+  virtual ~CtxtTelemetry() {}
+  virtual void record(const CtxtOpRecord& rec) = 0;
+};
+
+//! @brief Install a hook (NULL to stop reporting). The hook is not owned,
+//! it must be alive as long as it is installed.
+void setCtxtTelemetry(CtxtTelemetry *hook);
+CtxtTelemetry *getCtxtTelemetry();
+
+//! \cond FALSE (make doxygen ignore these classes)
+// Reports an operation on cts when it goes out of scope. Used by the
+// operations themselves, with fn=__func__.
+class CtxtOpProbe {
+  CtxtTelemetry *hook; // NULL if this operation is not reported
+  CtxtOp op;
+  const char *where;
+  long savedState; // the inherited task state before this operation
+  std::vector<const Ctxt*> cts;
+  std::vector<double> capacity, logQ;
+
+  void init(const char *fn);
+public:
+  CtxtOpProbe(CtxtOp _op, const Ctxt& c, const char *fn,
+              const Ctxt *other=NULL);
+  CtxtOpProbe(CtxtOp _op, const std::vector<Ctxt*>& _cts, const char *fn);
+  ~CtxtOpProbe();
+
+  CtxtOpProbe(const CtxtOpProbe&) = delete;
+  CtxtOpProbe& operator=(const CtxtOpProbe&) = delete;
+};
+//! \endcond
+
+/**
+ * @class CtxtBudgetReport
+ * @brief Aggregates the records of a circuit by operation and caller.
+ *
+ * Usage:
+ * \code
+ *   CtxtBudgetReport report;
+ *   setCtxtTelemetry(&report);
+ *   ... evaluate the circuit ...
+ *   setCtxtTelemetry(NULL);
+ *   report.print(cout);
+ * \endcode
+ **/
+class CtxtBudgetReport : public CtxtTelemetry {
+public:
+  //! The totals of one (operation, caller) pair, in bits
+  struct Entry {
+    long calls;
+    double spent, maxSpent, modulus;
+    Entry() : calls(0), spent(0), maxSpent(0), modulus(0) {}
+  };
+
+private:
+  mutable std::mutex mx;
+  std::map<std::pair<int, std::string>, Entry> entries;
+  std::vector<double> recryptCapacity; // capacity left at each recryption
+
+public:
+  void record(const CtxtOpRecord& rec) override;
+
+  //! The totals by (operation, caller)
+  std::map<std::pair<int, std::string>, Entry> getEntries() const;
+
+  //! @brief Number of recryptions made with at least one multiplication's
+  //! worth of capacity left (the most that a multiplyBy used up in this
+  //! circuit), which could have been deferred
+  long avoidableRecrypts() const;
+
+  void clear();
+  void print(std::ostream& str) const;
+};
+
+/************************ Recryption profiles ************************/
+
+//! The stages of a recryption, in the order that reCrypt runs them.
+//! thinReCrypt runs RECRYPT_SLOT_TO_COEFF before RECRYPT_BOOT_KEYSWITCH.
+enum RecryptStage {
+  RECRYPT_MODDOWN,        //!< dropping the small and special primes
+  RECRYPT_BOOT_KEYSWITCH, //!< to the bootstrapping key, times the key
+  RECRYPT_RAW_MODSWITCH,  //!< part of the above: to the modulus p^e+1
+  RECRYPT_MAKE_DIVISIBLE, //!< part of the above: divisible by p^{e'}
+  RECRYPT_COEFF_TO_SLOT,  //!< the first linear map (coeffToSlot)
+  RECRYPT_EXTRACT_DIGITS, //!< extractDigitsPacked or extractDigitsThin
+  RECRYPT_SLOT_TO_COEFF,  //!< the second linear map of reCrypt
+  RECRYPT_STAGE_COUNT
+};
+
+//! @brief A printable name for stage
+const char* recryptStageName(RecryptStage stage);
+
+//! @brief One stage of one recryption (of a whole batch). The prime-set
+//! sizes and noise are the largest ones in the batch, the capacities the
+//! smallest ones, all in bits. RECRYPT_RAW_MODSWITCH and
+//! RECRYPT_MAKE_DIVISIBLE work on raw polynomials: they only have a time,
+//! summed over the ciphertexts.
+struct RecryptStageRecord {
+  double seconds;
+  long keySwitches;
+  long primesBefore, primesAfter;
+  double logNoiseBefore, logNoiseAfter;
+  double capacityBefore, capacityAfter;
+
+  RecryptStageRecord() : seconds(0), keySwitches(0), primesBefore(0),
+    primesAfter(0), logNoiseBefore(0), logNoiseAfter(0),
+    capacityBefore(0), capacityAfter(0) {}
+
+  //! The number of primes that the stage used up
+  long levels() const { return primesBefore - primesAfter; }
+};
+
+//! @brief One call to reCrypt or thinReCrypt
+struct RecryptRecord {
+  bool thin;
+  long batchSize;
+  double seconds;
+  long keySwitches;
+  RecryptStageRecord stage[RECRYPT_STAGE_COUNT];
+
+  RecryptRecord() : thin(false), batchSize(0), seconds(0), keySwitches(0) {}
+};
+
+//! @brief The hook that receives a record after every recryption. It may be
+//! called from several threads at once.
+class RecryptProfiler {
+public:
+  virtual ~RecryptProfiler() {}
+  virtual void record(const RecryptRecord& rec) = 0;
+};
+
+//! @brief Install a profiler (NULL to stop profiling). The profiler is not
+//! owned, it must be alive as long as it is installed. Without a profiler
+//! a recryption only checks for one, and the key switchings are not
+//! counted. The key switchings are counted process-wide, so those of other
+//! threads during a recryption are included in its count.
+void setRecryptProfiler(RecryptProfiler *prof);
+RecryptProfiler *getRecryptProfiler();
+
+//! \cond FALSE (make doxygen ignore these classes)
+// Called by each key switching, counts them while a profiler is installed
+void countKeySwitch();
+long keySwitchCount();
+
+// The record of one recryption, which is sent to the profiler when this
+// goes out of scope. get() is NULL if there is no profiler.
+class RecryptProbe {
+  RecryptProfiler *prof;
+  RecryptRecord rec;
+  double t0;
+  long ks0;
+public:
+  RecryptProbe(const std::vector<Ctxt*>& batch, bool thin);
+  ~RecryptProbe();
+  RecryptRecord* get() { return prof? &rec : NULL; }
+
+  RecryptProbe(const RecryptProbe&) = delete;
+  RecryptProbe& operator=(const RecryptProbe&) = delete;
+};
+
+// Measures one stage of a batch into rec (unless it is NULL)
+class RecryptStageProbe {
+  RecryptStageRecord *rec;
+  const std::vector<Ctxt*>& batch;
+  double t0;
+  long ks0;
+public:
+  RecryptStageProbe(RecryptRecord *r, RecryptStage stage,
+                    const std::vector<Ctxt*>& batch);
+  ~RecryptStageProbe();
+
+  RecryptStageProbe(const RecryptStageProbe&) = delete;
+  RecryptStageProbe& operator=(const RecryptStageProbe&) = delete;
+};
+
+// Adds the time from construction to destruction to a sub-stage of rec
+// (unless it is NULL), may be used from several threads at once
+class RecryptTimeProbe {
+  RecryptRecord *rec;
+  RecryptStage stage;
+  double t0;
+public:
+  RecryptTimeProbe(RecryptRecord *r, RecryptStage stage);
+  ~RecryptTimeProbe();
+
+  RecryptTimeProbe(const RecryptTimeProbe&) = delete;
+  RecryptTimeProbe& operator=(const RecryptTimeProbe&) = delete;
+};
+//! \endcond
+
+/**
+ * @class RecryptReport
+ * @brief Aggregates the records of all the recryptions.
+ *
+ * Usage:
+ * \code
+ *   RecryptReport report;
+ *   setRecryptProfiler(&report);
+ *   ... evaluate the circuit ...
+ *   setRecryptProfiler(NULL);
+ *   report.print(cout);
+ * \endcode
+ **/
+class RecryptReport : public RecryptProfiler {
+  mutable std::mutex mx;
+  std::vector<RecryptRecord> records;
+
+public:
+  void record(const RecryptRecord& rec) override;
+
+  //! All the records, in the order that the recryptions ended
+  std::vector<RecryptRecord> getRecords() const;
+
+  //! The sums over all the records (of the thin or the packed ones), the
+  //! batch size is the number of ciphertexts. The prime-set sizes, noise
+  //! and capacities are the averages over the records.
+  RecryptRecord totals(bool thin) const;
+
+  long size() const;
+  void clear();
+  void print(std::ostream& str) const;
+};
+
+#endif // _TELEMETRY_H_
@@ -13,8 +13,18 @@
 #include <utility>
 #include <cstring>
 #include <ctime>
+#include <deque>
+#include <unordered_map>
 #include "timing.h"
 
+#if defined(__linux__) && !defined(FHE_NO_PERF_COUNTERS)
+#define FHE_PERF_EVENTS
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
 using namespace std;
 
 #ifdef CLOCK_MONOTONIC
@@ -55,71 +65,473 @@ bool timer_compare(const FHEtimer *a, const FHEtimer *b)
 }
 
 
+//! \cond FALSE (make doxygen ignore these classes)
+// One node of the call tree of a thread: the calls to timer made while
+// parent was the innermost running timer
+struct FHEtimerNode {
+  const FHEtimer *timer;
+  FHEtimerNode *parent;
+  vector<FHEtimerNode*> children;
+  // Only the owner thread adds to these, so they are never contended
+  FHE_atomic_ulong time;
+  FHE_atomic_long calls;
+  FHE_atomic_ulong counts[FHE_PERF_NCOUNTERS]; // the hardware counters
+
+  FHEtimerNode(const FHEtimer *_timer, FHEtimerNode *_parent) :
+    timer(_timer), parent(_parent), time(0), calls(0)
+  { clearCounts(); }
+
+  void clearCounts()
+  { for (long i = 0; i < FHE_PERF_NCOUNTERS; i++) counts[i] = 0; }
+};
+//! \endcond
+
+namespace {
+struct TimerEvent { // one recorded call, for tracing
+  const FHEtimer *timer;
+  unsigned long start, dur;
+  long tid;
+};
+
+// The timings of one thread. The owner thread reads the tree without
+// locking, and takes mx only to add nodes or events; everyone else takes
+// mx to read them.
+struct TimerShard {
+  FHE_MUTEX_TYPE mx;
+  deque<FHEtimerNode> nodes; // a deque, so the nodes never move
+  FHEtimerNode root;
+  FHEtimerNode *current;     // the innermost running timer of the owner
+  vector<TimerEvent> events;
+  long tid;
+
+  explicit TimerShard(long _tid) : root(0, 0), current(&root), tid(_tid) { }
+
+  // Returns the child of p for timer t, adding it if needed. Only the
+  // owner (or whoever holds the shard exclusively) may call it.
+  FHEtimerNode *child(FHEtimerNode *p, const FHEtimer *t)
+  {
+    for (FHEtimerNode *c: p->children)
+      if (c->timer == t) return c;
+
+    FHE_MUTEX_GUARD(mx);
+    nodes.emplace_back(t, p);
+    p->children.push_back(&nodes.back());
+    return &nodes.back();
+  }
+};
+
+struct TimerRegistry {
+  FHE_MUTEX_TYPE mx;
+  vector<FHEtimer *> timers;
+  vector<TimerShard *> shards; // of the running threads
+  TimerShard retired;          // merged timings of threads that exited
+  long nextTid;
+
+  TimerRegistry() : retired(0), nextTid(1) { }
+};
+
+// Never destroyed, so that threads that end during the static destruction
+// can still hand their timings over
+TimerRegistry& registry()
+{
+  static TimerRegistry *reg = new TimerRegistry;
+  return *reg;
+}
+
+FHE_atomic_long tracing(0);
+FHE_atomic_long countersOn(0);
+
+// The hardware counters of one thread, as one group led by the cycles so
+// that a single read returns all of them
+struct PerfGroup {
+  int fd[FHE_PERF_NCOUNTERS];
+  bool tried, ok;
+
+  PerfGroup() : tried(false), ok(false)
+  { for (long i = 0; i < FHE_PERF_NCOUNTERS; i++) fd[i] = -1; }
+  ~PerfGroup() { closeAll(); }
+
+  void closeAll()
+  {
+#ifdef FHE_PERF_EVENTS
+    for (long i = 0; i < FHE_PERF_NCOUNTERS; i++)
+      if (fd[i] >= 0) { close(fd[i]); fd[i] = -1; }
+#endif
+  }
+
+  // Open the counters of this thread, in user space only (which
+  // perf_event_paranoid allows up to level 2)
+  bool open()
+  {
+#ifdef FHE_PERF_EVENTS
+    static const unsigned long config[FHE_PERF_NCOUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES };
+    for (long i = 0; i < FHE_PERF_NCOUNTERS; i++) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = config[i];
+      attr.disabled = (i == 0);
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP;
+      fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1,
+                      (i == 0)? -1 : fd[0], 0);
+      if (fd[i] < 0) { closeAll(); return false; }
+    }
+    ioctl(fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  bool read(unsigned long *out) const
+  {
+#ifdef FHE_PERF_EVENTS
+    struct { unsigned long nr, values[FHE_PERF_NCOUNTERS]; } buf;
+    if (::read(fd[0], &buf, sizeof(buf)) != long(sizeof(buf))
+        || buf.nr != FHE_PERF_NCOUNTERS) return false;
+    for (long i = 0; i < FHE_PERF_NCOUNTERS; i++) out[i] = buf.values[i];
+    return true;
+#else
+    (void) out;
+    return false;
+#endif
+  }
+};
+
+thread_local PerfGroup perfGroup;
+
+// The counters of this thread, opened on the first call, NULL if they
+// cannot be
+const PerfGroup *myCounters()
+{
+  if (!perfGroup.tried) {
+    perfGroup.tried = true;
+    perfGroup.ok = perfGroup.open();
+  }
+  return perfGroup.ok? &perfGroup : 0;
+}
+
+// Add the subtree of src to dst (whose shard is held exclusively)
+void mergeTree(TimerShard& shard, FHEtimerNode *dst, const FHEtimerNode *src)
+{
+  dst->time += src->time;
+  dst->calls += src->calls;
+  for (long i = 0; i < FHE_PERF_NCOUNTERS; i++)
+    dst->counts[i] += src->counts[i];
+  for (const FHEtimerNode *c: src->children)
+    mergeTree(shard, shard.child(dst, c->timer), c);
+}
+
+thread_local TimerShard *curShard = 0; // set on the first use
+thread_local bool shardGone = false;   // true after the thread's handle died
+
+// Registers the shard of this thread on creation, merges it into the
+// retired timings when the thread exits
+struct ShardHandle {
+  ShardHandle()
+  {
+    TimerRegistry& reg = registry();
+    FHE_MUTEX_GUARD(reg.mx);
+    curShard = new TimerShard(reg.nextTid++);
+    reg.shards.push_back(curShard);
+  }
+
+  ~ShardHandle()
+  {
+    TimerShard *shard = curShard;
+    curShard = 0;
+    shardGone = true; // timers stopped by later destructors are dropped
+
+    TimerRegistry& reg = registry();
+    FHE_MUTEX_GUARD(reg.mx);
+    reg.shards.erase(find(reg.shards.begin(), reg.shards.end(), shard));
+    {
+      FHE_MUTEX_GUARD(reg.retired.mx);
+      reg.retired.events.insert(reg.retired.events.end(),
+                                shard->events.begin(), shard->events.end());
+    }
+    mergeTree(reg.retired, &reg.retired.root, &shard->root);
+    delete shard;
+  }
+};
+
+thread_local ShardHandle shardHandle;
+
+// The shard of the current thread, NULL once the thread is ending
+TimerShard *myShard()
+{
+  if (curShard == 0 && !shardGone) (void) &shardHandle; // construct it
+  return curShard;
+}
+
+// Apply fn to every shard, with the registry and the shard locked
+template<class Fn> void forEachShard(const Fn& fn)
+{
+  TimerRegistry& reg = registry();
+  FHE_MUTEX_GUARD(reg.mx);
+  for (TimerShard *shard: reg.shards) {
+    FHE_MUTEX_GUARD(shard->mx);
+    fn(*shard);
+  }
+  {
+    FHE_MUTEX_GUARD(reg.retired.mx);
+    fn(reg.retired);
+  }
+}
+
+// The flat totals of every timer, over all the threads
+struct TimerTotal {
+  unsigned long time;
+  long calls;
+  FHEtimerCounters counters;
+  TimerTotal() : time(0), calls(0) { }
+
+  void add(const FHEtimerNode *node)
+  {
+    time += node->time;
+    calls += node->calls;
+    for (long i = 0; i < FHE_PERF_NCOUNTERS; i++)
+      counters.value[i] += node->counts[i];
+  }
+};
+
+void addTotals(unordered_map<const FHEtimer*, TimerTotal>& totals,
+               const FHEtimerNode *node)
+{
+  for (const FHEtimerNode *c: node->children) {
+    totals[c->timer].add(c);
+    addTotals(totals, c);
+  }
+}
+
+unordered_map<const FHEtimer*, TimerTotal> allTotals()
+{
+  unordered_map<const FHEtimer*, TimerTotal> totals;
+  forEachShard([&](const TimerShard& shard) { addTotals(totals, &shard.root); });
+  return totals;
+}
+
+TimerTotal totalsFor(const FHEtimer *timer)
+{
+  TimerTotal total;
+  forEachShard([&](const TimerShard& shard) {
+    for (const FHEtimerNode& node: shard.nodes)
+      if (node.timer == timer) total.add(&node);
+  });
+  return total;
+}
+
+void printJSONstring(ostream& str, const char *s)
+{
+  str << '"';
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') str << '\\' << *s;
+    else if ((unsigned char)(*s) < ' ') str << ' ';
+    else str << *s;
+  }
+  str << '"';
+}
+
+void printJSONcounters(ostream& str, const FHEtimerCounters& c)
+{
+  if (c.empty()) return;
+  str << ", \"counters\": {\"cycles\": " << c.value[FHE_PERF_CYCLES]
+      << ", \"instructions\": " << c.value[FHE_PERF_INSTRUCTIONS]
+      << ", \"cacheRefs\": " << c.value[FHE_PERF_CACHE_REFS]
+      << ", \"cacheMisses\": " << c.value[FHE_PERF_CACHE_MISSES] << "}";
+}
+
+void printJSONnode(ostream& str, const FHEtimerNode *node, long indent)
+{
+  vector<const FHEtimerNode*> children(node->children.begin(),
+                                       node->children.end());
+  sort(children.begin(), children.end(),
+       [](const FHEtimerNode *a, const FHEtimerNode *b)
+       { return timer_compare(a->timer, b->timer); });
+
+  string pad(indent, ' ');
+  str << "[";
+  for (long i = 0; i < long(children.size()); i++) {
+    const FHEtimerNode *c = children[i];
+    str << (i? ",\n" : "\n") << pad << "  {\"name\": ";
+    printJSONstring(str, c->timer->name);
+    str << ", \"loc\": ";
+    printJSONstring(str, c->timer->loc);
+    str << ", \"time\": " << double(c->time)/CLOCK_SCALE
+        << ", \"calls\": " << long(c->calls);
+    TimerTotal t;
+    t.add(c);
+    printJSONcounters(str, t.counters);
+    if (!c->children.empty()) {
+      str << ", \"children\": ";
+      printJSONnode(str, c, indent+2);
+    }
+    str << "}";
+  }
+  if (!children.empty()) str << "\n" << pad;
+  str << "]";
+}
+} // anonymous namespace
 
-static vector<FHEtimer *> timerMap;
-static FHE_MUTEX_TYPE timerMapMx;
 
 void registerTimer(FHEtimer *timer)
 {
-  FHE_MUTEX_GUARD(timerMapMx);
-  timerMap.push_back(timer);
+  TimerRegistry& reg = registry();
+  FHE_MUTEX_GUARD(reg.mx);
+  reg.timers.push_back(timer);
+}
+
+void auto_timer::start()
+{
+  node = parent = 0;
+  TimerShard *shard = myShard();
+  if (shard) {
+    parent = shard->current;
+    node = shard->child(parent, timer);
+    shard->current = node;
+  }
+  counting = false;
+  if (countersOn && node) {
+    const PerfGroup *g = myCounters();
+    counting = g && g->read(cnt);
+  }
+  amt = GetTimerClock();
+}
+
+void auto_timer::stop()
+{
+  unsigned long now = GetTimerClock();
+  running = false;
+  TimerShard *shard = myShard();
+  if (shard == 0 || node == 0) return;
+
+  node->time += now - amt;
+  node->calls++;
+  shard->current = parent;
+
+  unsigned long end[FHE_PERF_NCOUNTERS];
+  if (counting && myCounters()->read(end))
+    for (long i = 0; i < FHE_PERF_NCOUNTERS; i++)
+      node->counts[i] += end[i] - cnt[i];
+
+  if (tracing) {
+    FHE_MUTEX_GUARD(shard->mx);
+    if (long(shard->events.size()) < FHE_TIMER_TRACE_MAX) {
+      TimerEvent ev = { timer, amt, now - amt, shard->tid };
+      shard->events.push_back(ev);
+    }
+  }
+}
+
+const char *currentTimerName(const char *skip)
+{
+  TimerShard *shard = myShard();
+  if (shard == 0) return 0;
+  const FHEtimerNode *node = shard->current;
+  if (node->timer && skip && strcmp(node->timer->name, skip) == 0)
+    node = node->parent;
+  return (node && node->timer)? node->timer->name : 0;
 }
 
 // Reset a timer for some label to zero
 void FHEtimer::reset()
 {
-  numCalls = 0;
-  counter = 0;
+  forEachShard([&](TimerShard& shard) {
+    for (FHEtimerNode& node: shard.nodes)
+      if (node.timer == this) {
+        node.time = 0; node.calls = 0; node.clearCounts();
+      }
+  });
 }
 
 
 // Read the value of a timer (in seconds)
 double FHEtimer::getTime() const // returns time in seconds
 {
-  // If the counter is currently counting, add the clock() value
-  return ((double)counter)/CLOCK_SCALE;
+  return ((double)totalsFor(this).time)/CLOCK_SCALE;
 }
 
 // Returns number of calls for that timer
 long FHEtimer::getNumCalls() const
 {
-    return numCalls;
+  return totalsFor(this).calls;
 }
 
 void resetAllTimers()
 {
-  for (long i = 0; i < long(timerMap.size()); i++) 
-    timerMap[i]->reset();
+  forEachShard([](TimerShard& shard) {
+    for (FHEtimerNode& node: shard.nodes) {
+      node.time = 0; node.calls = 0; node.clearCounts();
+    }
+    shard.events.clear();
+  });
 }
 
-// Print the value of all timers to stream
-void printAllTimers(ostream& str)
+// Returns the counters of a timer, summed over all the threads
+FHEtimerCounters FHEtimer::getCounters() const
 {
+  return totalsFor(this).counters;
+}
 
-  sort(timerMap.begin(), timerMap.end(), timer_compare);
+double FHEtimerCounters::ipc() const
+{
+  if (value[FHE_PERF_CYCLES] == 0) return 0;
+  return double(value[FHE_PERF_INSTRUCTIONS]) / value[FHE_PERF_CYCLES];
+}
 
-  for (long i = 0; i < long(timerMap.size()); i++) {
-    const char *name = timerMap[i]->name;
-    const char *loc = timerMap[i]->loc;
-    double t =  timerMap[i]->getTime();
-    long n = timerMap[i]->getNumCalls();
-    double ave;
-    if (n > 0) { 
-      ave = t/n;
-    }
-    else {
-      continue;
-    }
+double FHEtimerCounters::memBytes() const
+{
+  return 64.0 * value[FHE_PERF_CACHE_MISSES]; // 64-byte cache lines
+}
 
-    str << "  " << name << ": " << t << " / " << n << " = " << ave << "   [" << loc << "]\n";
+static void printTimer(ostream& str, const FHEtimer *timer, unsigned long time,
+                       long n, const FHEtimerCounters& c)
+{
+  double t = ((double)time)/CLOCK_SCALE;
+  str << "  " << timer->name << ": " << t << " / " << n << " = " << (t/n)
+      << "   [" << timer->loc << "]\n";
+  if (c.empty()) return;
+  const unsigned long *v = c.value;
+  str << "      cycles=" << v[FHE_PERF_CYCLES] << " IPC=" << c.ipc()
+      << " LLC refs=" << v[FHE_PERF_CACHE_REFS]
+      << " misses=" << v[FHE_PERF_CACHE_MISSES];
+  if (t > 0) str << " (~" << c.memBytes()/t/1e6 << " MB/s)";
+  str << "\n";
+}
+
+// Print the value of all timers to stream
+void printAllTimers(ostream& str)
+{
+  unordered_map<const FHEtimer*, TimerTotal> totals = allTotals();
+  vector<FHEtimer *> timers;
+  {
+    TimerRegistry& reg = registry();
+    FHE_MUTEX_GUARD(reg.mx);
+    timers = reg.timers;
+  }
+  sort(timers.begin(), timers.end(), timer_compare);
+
+  for (const FHEtimer *timer: timers) {
+    auto it = totals.find(timer);
+    if (it == totals.end() || it->second.calls <= 0) continue;
+    printTimer(str, timer, it->second.time, it->second.calls,
+               it->second.counters);
   }
 }
 
 const FHEtimer *getTimerByName(const char *name)
 {
-  for (long i = 0; i < long(timerMap.size()); i++) {
-    if (strcmp(name, timerMap[i]->name) == 0)
-      return timerMap[i];
+  TimerRegistry& reg = registry();
+  FHE_MUTEX_GUARD(reg.mx);
+  for (long i = 0; i < long(reg.timers.size()); i++) {
+    if (strcmp(name, reg.timers[i]->name) == 0)
+      return reg.timers[i];
   }
 
   return 0;
@@ -127,22 +539,78 @@ const FHEtimer *getTimerByName(const char *name)
 
 bool printNamedTimer(ostream& str, const char* name)
 {
-  for (long i = 0; i < long(timerMap.size()); i++) {
-    if (strcmp(name, timerMap[i]->name) == 0) {
-      
-      long n = timerMap[i]->getNumCalls();
-      if (n>0) {
-        double t = timerMap[i]->getTime();
-        double ave = t/n;
-    
-        str << "  " << name << ": " << t << " / " << n << " = " 
-    	<< ave << "   [" << timerMap[i]->loc << "]\n";
-      }
-      else {
-        str << "  " << name << " -- [" << timerMap[i]->loc << "]\n";
-      }
-      return true;
-    }
+  const FHEtimer *timer = getTimerByName(name);
+  if (timer == 0) return false;
+
+  TimerTotal total = totalsFor(timer);
+  if (total.calls > 0)
+    printTimer(str, timer, total.time, total.calls, total.counters);
+  else
+    str << "  " << name << " -- [" << timer->loc << "]\n";
+  return true;
+}
+
+void printAllTimersJSON(ostream& str)
+{
+  // Merge the trees of all the threads into one
+  TimerShard merged(0);
+  forEachShard([&](const TimerShard& shard) {
+    mergeTree(merged, &merged.root, &shard.root);
+  });
+  unordered_map<const FHEtimer*, TimerTotal> totals;
+  addTotals(totals, &merged.root);
+
+  vector<const FHEtimer *> timers;
+  for (auto& t: totals)
+    if (t.second.calls > 0) timers.push_back(t.first);
+  sort(timers.begin(), timers.end(), timer_compare);
+
+  str << "{\"timers\": [";
+  for (long i = 0; i < long(timers.size()); i++) {
+    const TimerTotal& total = totals[timers[i]];
+    str << (i? ",\n" : "\n") << "  {\"name\": ";
+    printJSONstring(str, timers[i]->name);
+    str << ", \"loc\": ";
+    printJSONstring(str, timers[i]->loc);
+    str << ", \"time\": " << double(total.time)/CLOCK_SCALE
+        << ", \"calls\": " << total.calls;
+    printJSONcounters(str, total.counters);
+    str << "}";
   }
-  return false;
+  str << "\n],\n\"tree\": ";
+  printJSONnode(str, &merged.root, 0);
+  str << "}\n";
+}
+
+bool setTimerCounters(bool on)
+{
+  if (on && !myCounters()) return false;
+  countersOn = on;
+  return true;
+}
+
+bool areTimerCountersOn() { return countersOn; }
+
+void setTimerTracing(bool on) { tracing = on; }
+bool isTimerTracing() { return tracing; }
+
+void writeTimerTrace(ostream& str)
+{
+  const double usec = 1000000.0/CLOCK_SCALE; // trace times are in usec
+  bool first = true;
+  str << "[";
+  forEachShard([&](const TimerShard& shard) {
+    for (const TimerEvent& ev: shard.events) {
+      str << (first? "\n" : ",\n") << "{\"name\": ";
+      printJSONstring(str, ev.timer->name);
+      str << ", \"cat\": \"FHE\", \"ph\": \"X\""
+          << ", \"ts\": " << (unsigned long)(ev.start*usec)
+          << ", \"dur\": " << (unsigned long)(ev.dur*usec)
+          << ", \"pid\": 1, \"tid\": " << ev.tid << ", \"args\": {\"loc\": ";
+      printJSONstring(str, ev.timer->loc);
+      str << "}}";
+      first = false;
+    }
+  });
+  str << "\n]\n";
 }
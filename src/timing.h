@@ -27,6 +27,31 @@
  * built-in macro \_\_func\_\_). We can also use the "lower level" methods
  * startFHEtimer(name), stopFHEtimer(name), and resetFHEtimer(name) to add
  * timers with arbitrary names (not necessarily associated with functions).
+ *
+ * Every thread accumulates its own timings, without locks or shared atomic
+ * counters, and the per-thread values are merged only when they are read.
+ * Each thread also records the nesting of the timers it runs: a timer that
+ * is started while another one is running is counted as a child of it, so
+ * printAllTimersJSON() can print the full call tree (e.g., KS_loop_1 under
+ * keySwitchDigits under multiplyBy). Work that is handed to the NTL thread
+ * pool is timed on the worker thread, at the top level of its own tree.
+ *
+ * For a timeline, setTimerTracing(true) additionally records each timed
+ * call, and writeTimerTrace() writes them in the Chrome trace-event format,
+ * which chrome://tracing, Perfetto or speedscope display as a flame chart
+ * with one track per thread.
+ *
+ * On Linux, setTimerCounters(true) also reads hardware performance counters
+ * (through perf_event_open) when each timer starts and stops: the cycles,
+ * instructions, last-level cache references and misses of the thread. They
+ * are summed per timer like the times and printed next to them, with the
+ * IPC and the memory traffic that the cache misses imply (a line each),
+ * which tells a compute-bound scope from a memory-bound one. Each thread
+ * opens its counters the first time it runs a timer with them on; where
+ * they cannot be opened (another OS, perf_event_paranoid, a container
+ * without the PMU) the timers keep only the times. A timer read costs one
+ * system call per start and per stop while the counters are on, and a flag
+ * test when they are off.
  **/
 #ifndef _TIMING_H_
 #define _TIMING_H_
@@ -37,26 +62,40 @@
 
 
 class FHEtimer;
+struct FHEtimerNode;
 void registerTimer(FHEtimer *timer);
 unsigned long GetTimerClock();
 
+//! @brief The hardware counters of a timer, see setTimerCounters()
+enum { FHE_PERF_CYCLES, FHE_PERF_INSTRUCTIONS, FHE_PERF_CACHE_REFS,
+       FHE_PERF_CACHE_MISSES, FHE_PERF_NCOUNTERS };
+
+//! @brief The counters of a timer, summed over its calls and the threads
+struct FHEtimerCounters {
+  unsigned long value[FHE_PERF_NCOUNTERS];
+
+  FHEtimerCounters()
+  { for (long i = 0; i < FHE_PERF_NCOUNTERS; i++) value[i] = 0; }
+  bool empty() const { return value[FHE_PERF_CYCLES] == 0; }
+  double ipc() const;
+  //! Bytes moved from memory, one cache line per last-level miss
+  double memBytes() const;
+};
+
 //! A simple class to accumulate time
 class FHEtimer {
 public:
   const char *name;
   const char *loc;
 
-  // THREADS: these need to be atomic
-  FHE_atomic_ulong counter;
-  FHE_atomic_long numCalls;
-
   FHEtimer(const char *_name, const char *_loc) :
-    name(_name), loc(_loc), counter(0), numCalls(0) 
+    name(_name), loc(_loc)
   { registerTimer(this); }
 
   void reset();
-  double getTime() const;
-  long getNumCalls() const;
+  double getTime() const;   // summed over all the threads
+  long getNumCalls() const; // summed over all the threads
+  FHEtimerCounters getCounters() const; // summed over all the threads
 };
 
 
@@ -76,6 +115,32 @@ void printAllTimers(std::ostream& str=std::cerr);
 // return true if timer was found, false otherwise
 bool printNamedTimer(std::ostream& str, const char* name);
 
+//! The name of the innermost timer that is running on this thread, skipping
+//! it if it is called skip (e.g., the caller's own timer), or NULL if none
+const char *currentTimerName(const char *skip=0);
+
+//! Print all timers to stream as a JSON object, with the flat totals of
+//! every timer ("timers") and the call tree merged over all the threads
+//! ("tree"), each node with its time (in seconds) and number of calls
+void printAllTimersJSON(std::ostream& str=std::cerr);
+
+//! Maximum number of calls that each thread records while tracing
+#ifndef FHE_TIMER_TRACE_MAX
+#define FHE_TIMER_TRACE_MAX (1L << 20)
+#endif
+
+//! Start (or stop) recording every timed call, for writeTimerTrace()
+void setTimerTracing(bool on);
+bool isTimerTracing();
+
+//! Write the recorded calls as a JSON array of Chrome trace events
+void writeTimerTrace(std::ostream& str);
+
+//! @brief Start (or stop) reading the hardware counters in the timers.
+//! Returns false if they cannot be read on this thread.
+bool setTimerCounters(bool on);
+bool areTimerCountersOn();
+
 
 //! \cond FALSE (make doxygen ignore these classes)
 class auto_timer {
@@ -83,16 +148,15 @@ public:
   FHEtimer *timer;
   unsigned long amt;
   bool running;
+  FHEtimerNode *node;   // where this call is accounted for
+  FHEtimerNode *parent; // the node that was current when we started
+  bool counting;        // the counters were read at the start
+  unsigned long cnt[FHE_PERF_NCOUNTERS];
 
-  auto_timer(FHEtimer *_timer) : 
-    timer(_timer), amt(GetTimerClock()), running(true) { }
+  auto_timer(FHEtimer *_timer) : timer(_timer), running(true) { start(); }
 
-  void stop() {
-    amt = GetTimerClock() - amt; 
-    timer->counter += amt;
-    timer->numCalls++;
-    running = false;
-  }
+  void start();
+  void stop();
 
   ~auto_timer() { if (running) stop(); }
 };
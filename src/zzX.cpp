@@ -15,6 +15,8 @@
  **/
 #include <mutex>
 #include <map>
+#include <vector>
+#include <algorithm>
 #include "PAlgebra.h"
 #include "timing.h"
 #include "zzX.h"
@@ -34,30 +36,58 @@ void MulMod(zzX& res, const zzX& a, const zzX& b, const PAlgebra& palg)
   convert(res, aa);
 }
 
+// The loops below are on raw pointers, so that the compiler can vectorize
+// them. The pointers are taken after SetLength, so res may alias a or b.
+
 void add(zzX& res, const zzX& a, const zzX& b)
 {
   FHE_TIMER_START;
   // The shorter one is aa, the longer is bb
   const zzX& aa = (lsize(a)<lsize(b))? a : b;
   const zzX& bb = (lsize(a)<lsize(b))? b : a;
-  res.SetLength(lsize(bb));
-  for (long i=0; i<lsize(aa); i++)
-    res[i] = aa[i]+bb[i];
-  for (long i=lsize(aa); i<lsize(bb); i++)
-    res[i] = bb[i];
+  long na = lsize(aa), nb = lsize(bb);
+  res.SetLength(nb);
+  long *r = res.elts();
+  const long *x = aa.elts(), *y = bb.elts();
+  for (long i=0; i<na; i++)
+    r[i] = x[i]+y[i];
+  for (long i=na; i<nb; i++)
+    r[i] = y[i];
+}
+
+void sub(zzX& res, const zzX& a, const zzX& b)
+{
+  long na = lsize(a), nb = lsize(b);
+  res.SetLength(std::max(na, nb));
+  long *r = res.elts();
+  const long *x = a.elts(), *y = b.elts();
+  long n = std::min(na, nb);
+  for (long i=0; i<n; i++)
+    r[i] = x[i]-y[i];
+  for (long i=n; i<na; i++)
+    r[i] = x[i];
+  for (long i=n; i<nb; i++)
+    r[i] = -y[i];
 }
+
 void mul(zzX& res, const zzX& a, long b)
 {
-  res.SetLength(lsize(a));
-  for (long i=0; i<lsize(a); i++)
-    res[i] *= a[i]*b;
+  long n = lsize(a);
+  res.SetLength(n);
+  long *r = res.elts();
+  const long *x = a.elts();
+  for (long i=0; i<n; i++)
+    r[i] = x[i]*b;
 }
 
 void div(zzX& res, const zzX& a, long b)
 {
-  res.SetLength(lsize(a));
-  for (long i=0; i<lsize(a); i++)
-    res[i] = a[i]/b;
+  long n = lsize(a);
+  res.SetLength(n);
+  long *r = res.elts();
+  const long *x = a.elts();
+  for (long i=0; i<n; i++)
+    r[i] = x[i]/b;
 }
 
 void normalize(zzX& f)
@@ -76,17 +106,16 @@ void normalize(zzX& f)
 const zz_pXModulus& getPhimXMod(const PAlgebra& palg)
 {
   static std::map<long,zz_pXModulus*> moduli; // pointer per value of m
-  static std::mutex pt_mtx;      // control access to modifying the map
+  static std::mutex pt_mtx;      // control access to the map
 
   zz_p::FFTInit(0); // set "the best FFT prime" as NTL's current modulus
 
   long m = palg.getM();
+  std::unique_lock<std::mutex> lck(pt_mtx); // another thread may insert
   auto it = moduli.find(m); // check if we already have zz_pXModulus for m
 
   if (it==moduli.end()) {   // init a new zz_pXModulus for this value of m
-    std::unique_lock<std::mutex> lck(pt_mtx); // try to get a lock
-
-    // Got the lock, insert a new entry for this malue of m into the map
+    // Insert a new entry for this malue of m into the map
     zz_pX phimX = conv<zz_pX>(palg.getPhimX());
     zz_pXModulus* ptr = new zz_pXModulus(phimX); // will "never" be deleted
 
@@ -102,10 +131,47 @@ const zz_pXModulus& getPhimXMod(const PAlgebra& palg)
   return *(it->second);
 }
 
-// DIRT: We use modular arithmetic mod p \approx 2^{60} as a
+// Phi_m(X) is monic with integer coefficients, so the division by it is
+// exact over Z/2^64 (unsigned long arithmetic), and the result is the
+// right one whenever it fits in a long, even if intermediate values wrap.
+// That takes (lsize(poly)-phi(m)) times the number of nonzero terms of
+// Phi_m(X), so it is used when that is not much more than an FFT
+// (e.g., m a power of two, or poly of degree not far above phi(m)).
+static bool reduceDirect(zzX& poly, const PAlgebra& palg)
+{
+  long n = lsize(poly), phim = palg.getPhiM();
+  const ZZX& PhimX = palg.getPhimX();
+
+  std::vector< std::pair<long, unsigned long> > terms; // below X^phim
+  for (long j=0; j<phim; j++) {
+    long c = conv<long>(coeff(PhimX, j));
+    if (c != 0) terms.push_back(std::make_pair(j, (unsigned long) c));
+  }
+  if ((n-phim)*lsize(terms) > 16*n*NumBits(n))
+    return false;
+
+  unsigned long *f = reinterpret_cast<unsigned long*>(poly.elts());
+  for (long i=n-1; i>=phim; i--) {
+    unsigned long c = f[i]; // subtract c*X^{i-phim}*Phi_m(X)
+    if (c == 0) continue;
+    unsigned long *g = f + (i-phim);
+    for (const auto& t: terms) g[t.first] -= c*t.second;
+  }
+  poly.SetLength(phim);
+  normalize(poly);
+  return true;
+}
+
+// DIRT: Otherwise we use modular arithmetic mod p \approx 2^{60} as a
 //       substitute for computing on rational numbers
 void reduceModPhimX(zzX& poly, const PAlgebra& palg)
 {
+  if (lsize(poly) <= palg.getPhiM()) {
+    normalize(poly);
+    return;
+  }
+  if (reduceDirect(poly, palg)) return;
+
   zz_pPush push; // backup the NTL current modulus
   const zz_pXModulus& phimX = getPhimXMod(palg);
 
@@ -43,6 +43,19 @@ inline zzX& operator+=(zzX& a, const zzX& b)
   return a;
 }
 
+void sub(zzX& res, const zzX& a, const zzX& b);
+inline zzX operator-(const zzX& a, const zzX& b)
+{
+  zzX tmp;
+  sub(tmp, a, b);
+  return tmp;
+}
+inline zzX& operator-=(zzX& a, const zzX& b)
+{
+  sub(a, a, b);
+  return a;
+}
+
 void div(zzX& res, const zzX& a, long b);
 inline zzX operator/(const zzX& a, long b)
 {
@@ -72,6 +85,10 @@ inline zzX& operator*=(zzX& a, long b)
 void normalize(zzX& f);
 
 const NTL::zz_pXModulus& getPhimXMod(const PAlgebra& palg);
+
+//! Reduce poly mod Phi_m(X), assuming that the result is single-precision.
+//! When Phi_m(X) is sparse enough (e.g., m a power of two) this is done
+//! directly on the coefficients of poly, without converting it.
 void reduceModPhimX(zzX& poly, const PAlgebra& palg);
 
 void MulMod(zzX& res, const zzX& a, const zzX& b, const PAlgebra& palg);